@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
@@ -52,6 +53,9 @@
 #include "exec/ram_addr.h"
 #include "hw/acpi/acpi.h"
 #include "qemu/host-utils.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "block/block.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -124,6 +128,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
 
 static struct defconfig_file {
     const char *filename;
@@ -235,7 +240,9 @@ typedef struct AccountingInfo {
     uint64_t iterations;
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_hit;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_evictions;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
 } AccountingInfo;
@@ -292,6 +299,16 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_pages_cache_evictions(void)
+{
+    return acct_info.xbzrle_cache_evictions;
+}
+
 double xbzrle_mig_cache_miss_rate(void)
 {
     return acct_info.xbzrle_cache_miss_rate;
@@ -302,11 +319,16 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+/* This is the last block from where we have sent data */
+static RAMBlock *last_sent_block;
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
     size_t size;
 
+    last_sent_block = block;
+
     qemu_put_be64(f, offset | cont | flag);
     size = 8;
 
@@ -322,8 +344,6 @@ static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
-/* This is the last block from where we have sent data */
-static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
@@ -344,7 +364,9 @@ static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE);
+    if (cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE) == 1) {
+        acct_info.xbzrle_cache_evictions++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -359,9 +381,14 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     if (!cache_is_cached(XBZRLE.cache, current_addr)) {
         acct_info.xbzrle_cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data) == -1) {
+            int ret = cache_insert(XBZRLE.cache, current_addr, *current_data);
+
+            if (ret == -1) {
                 return -1;
             } else {
+                if (ret == 1) {
+                    acct_info.xbzrle_cache_evictions++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -559,13 +586,352 @@ static void migration_bitmap_sync(void)
     }
 }
 
+/* With the compress capability, the pages which would be sent whole are
+ * deflated by a pool of threads instead.  The migration thread hands each
+ * page to an idle thread, and writes the result of the previous page that
+ * thread compressed, so compression overlaps with sending.  All the results
+ * are written before the end of each iteration, so a page never overtakes
+ * an older copy of itself.  The destination inflates them with its own
+ * threads, and waits for them at the end of each iteration too.
+ */
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;                 /* protected by mutex */
+    bool quit;                  /* protected by mutex */
+    bool done;                  /* protected by comp_done_lock */
+
+    /* Written by the migration thread while the thread is idle */
+    RAMBlock *block;            /* NULL if there is no result to write */
+    ram_addr_t offset;
+
+    /* Written by the compression thread */
+    uint8_t *buf;
+    unsigned long len;
+    int ret;
+} CompressParam;
+
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;                 /* protected by mutex */
+    bool quit;                  /* protected by mutex */
+    bool done;                  /* protected by decomp_done_lock */
+    void *host;
+    uint8_t *buf;
+    unsigned long len;
+} DecompressParam;
+
+static CompressParam *comp_param;
+static int comp_thread_count;
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+
+static DecompressParam *decomp_param;
+static int decomp_thread_count;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+static bool decomp_failed;
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+    int level = migrate_compress_level();
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            param->start = false;
+            qemu_mutex_unlock(&param->mutex);
+
+            param->len = compressBound(TARGET_PAGE_SIZE);
+            param->ret = compress2(param->buf, &param->len,
+                                   memory_region_get_ram_ptr(param->block->mr)
+                                   + param->offset, TARGET_PAGE_SIZE, level);
+
+            qemu_mutex_lock(&comp_done_lock);
+            param->done = true;
+            qemu_cond_signal(&comp_done_cond);
+            qemu_mutex_unlock(&comp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+    return NULL;
+}
+
+static void compress_threads_save_setup(void)
+{
+    int i;
+
+    if (!migrate_use_compression()) {
+        return;
+    }
+    comp_thread_count = migrate_compress_threads();
+    comp_param = g_new0(CompressParam, comp_thread_count);
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+    for (i = 0; i < comp_thread_count; i++) {
+        comp_param[i].buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        comp_param[i].done = true;
+        qemu_mutex_init(&comp_param[i].mutex);
+        qemu_cond_init(&comp_param[i].cond);
+        qemu_thread_create(&comp_param[i].thread, "compress",
+                           do_data_compress, &comp_param[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void compress_threads_save_cleanup(void)
+{
+    int i;
+
+    if (!comp_param) {
+        return;
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        qemu_mutex_lock(&comp_param[i].mutex);
+        comp_param[i].quit = true;
+        qemu_cond_signal(&comp_param[i].cond);
+        qemu_mutex_unlock(&comp_param[i].mutex);
+        qemu_thread_join(&comp_param[i].thread);
+        qemu_mutex_destroy(&comp_param[i].mutex);
+        qemu_cond_destroy(&comp_param[i].cond);
+        g_free(comp_param[i].buf);
+    }
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(comp_param);
+    comp_param = NULL;
+}
+
+/* Writes the result of a thread which is done; returns the bytes written */
+static int compress_write_result(QEMUFile *f, CompressParam *param)
+{
+    RAMBlock *block = param->block;
+    int cont, bytes_sent;
+
+    if (!block) {
+        return 0;
+    }
+    param->block = NULL;
+
+    cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    acct_info.norm_pages++;
+    if (param->ret != Z_OK) {
+        /* Send the page whole */
+        bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, memory_region_get_ram_ptr(block->mr) +
+                              param->offset, TARGET_PAGE_SIZE);
+        return bytes_sent + TARGET_PAGE_SIZE;
+    }
+
+    bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                RAM_SAVE_FLAG_COMPRESS_PAGE);
+    qemu_put_be32(f, param->len);
+    qemu_put_buffer(f, param->buf, param->len);
+    return bytes_sent + 4 + param->len;
+}
+
+/* Waits for all of the threads and writes their results */
+static int flush_compressed_data(QEMUFile *f)
+{
+    int i, bytes_sent = 0;
+
+    if (!comp_param) {
+        return 0;
+    }
+    qemu_mutex_lock(&comp_done_lock);
+    for (i = 0; i < comp_thread_count; i++) {
+        while (!comp_param[i].done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    for (i = 0; i < comp_thread_count; i++) {
+        bytes_sent += compress_write_result(f, &comp_param[i]);
+    }
+    return bytes_sent;
+}
+
+/* Hands the page to an idle thread, after writing the result that thread
+ * had; returns the bytes written */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset)
+{
+    CompressParam *param = NULL;
+    int i, bytes_sent;
+
+    qemu_mutex_lock(&comp_done_lock);
+    while (!param) {
+        for (i = 0; i < comp_thread_count; i++) {
+            if (comp_param[i].done) {
+                param = &comp_param[i];
+                param->done = false;
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    bytes_sent = compress_write_result(f, param);
+
+    param->block = block;
+    param->offset = offset;
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    unsigned long len;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            param->start = false;
+            qemu_mutex_unlock(&param->mutex);
+
+            len = TARGET_PAGE_SIZE;
+            if (uncompress(param->host, &len, param->buf, param->len) != Z_OK
+                || len != TARGET_PAGE_SIZE) {
+                atomic_set(&decomp_failed, true);
+            }
+
+            qemu_mutex_lock(&decomp_done_lock);
+            param->done = true;
+            qemu_cond_signal(&decomp_done_cond);
+            qemu_mutex_unlock(&decomp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+    return NULL;
+}
+
+static void decompress_threads_load_setup(void)
+{
+    int i;
+
+    decomp_thread_count = migrate_decompress_threads();
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
+    decomp_failed = false;
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    for (i = 0; i < decomp_thread_count; i++) {
+        decomp_param[i].buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].done = true;
+        qemu_mutex_init(&decomp_param[i].mutex);
+        qemu_cond_init(&decomp_param[i].cond);
+        qemu_thread_create(&decomp_param[i].thread, "decompress",
+                           do_data_decompress, &decomp_param[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Waits for the pages being inflated; returns -1 if one of them failed */
+static int wait_for_decompress_done(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return 0;
+    }
+    qemu_mutex_lock(&decomp_done_lock);
+    for (i = 0; i < decomp_thread_count; i++) {
+        while (!decomp_param[i].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+    return atomic_read(&decomp_failed) ? -1 : 0;
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+    wait_for_decompress_done();
+    for (i = 0; i < decomp_thread_count; i++) {
+        qemu_mutex_lock(&decomp_param[i].mutex);
+        decomp_param[i].quit = true;
+        qemu_cond_signal(&decomp_param[i].cond);
+        qemu_mutex_unlock(&decomp_param[i].mutex);
+        qemu_thread_join(&decomp_param[i].thread);
+        qemu_mutex_destroy(&decomp_param[i].mutex);
+        qemu_cond_destroy(&decomp_param[i].cond);
+        g_free(decomp_param[i].buf);
+    }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decomp_param);
+    decomp_param = NULL;
+}
+
+/* Reads a compressed page into an idle thread's buffer and starts it */
+static void decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                               unsigned long len)
+{
+    DecompressParam *param = NULL;
+    int i;
+
+    if (!decomp_param) {
+        decompress_threads_load_setup();
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    while (!param) {
+        for (i = 0; i < decomp_thread_count; i++) {
+            if (decomp_param[i].done) {
+                param = &decomp_param[i];
+                param->done = false;
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    qemu_get_buffer(f, param->buf, len);
+    param->host = host;
+    param->len = len;
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
+
 /*
  * ram_save_page: Send the given page to the stream
  *
- * Returns: Number of bytes written.
+ * Returns: Number of bytes written.  *queued is set if the page was handed
+ *          to a compression thread, and will be written later.
  */
 static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
-                         bool last_stage)
+                         bool last_stage, bool *queued)
 {
     int bytes_sent;
     int cont;
@@ -617,7 +983,10 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
     }
 
     /* XBZRLE overflow or normal page */
-    if (bytes_sent == -1) {
+    if (bytes_sent == -1 && comp_param) {
+        bytes_sent = compress_page_with_multi_thread(f, block, offset);
+        *queued = true;
+    } else if (bytes_sent == -1) {
         bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
         if (send_async) {
             qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
@@ -636,18 +1005,22 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
 /*
  * ram_find_and_save_block: Finds a page to send and sends it to f
  *
- * Returns:  The number of bytes written.
- *           0 means no dirty pages
+ * Returns:  The number of pages sent or queued: 0 means no dirty pages.
+ *           *bytes_sent gets the number of bytes written.
  */
 
-static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
+static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
+                                   int *bytes_sent)
 {
     RAMBlock *block = last_seen_block;
     ram_addr_t offset = last_offset;
     bool complete_round = false;
-    int bytes_sent = 0;
+    bool queued = false;
+    int pages = 0;
     MemoryRegion *mr;
 
+    *bytes_sent = 0;
+
     if (!block)
         block = QTAILQ_FIRST(&ram_list.blocks);
 
@@ -667,11 +1040,12 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
                 ram_bulk_stage = false;
             }
         } else {
-            bytes_sent = ram_save_page(f, block, offset, last_stage);
+            *bytes_sent = ram_save_page(f, block, offset, last_stage,
+                                        &queued);
 
             /* if page is unmodified, continue to the next */
-            if (bytes_sent > 0) {
-                last_sent_block = block;
+            if (*bytes_sent > 0 || queued) {
+                pages = 1;
                 break;
             }
         }
@@ -679,7 +1053,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
     last_seen_block = block;
     last_offset = offset;
 
-    return bytes_sent;
+    return pages;
 }
 
 static uint64_t bytes_transferred;
@@ -746,6 +1120,7 @@ static void migration_end(void)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+    compress_threads_save_cleanup();
 }
 
 static void ram_migration_cancel(void *opaque)
@@ -769,6 +1144,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
+    /* The pages left behind by loadvm are not in the host memory yet */
+    ram_lazy_load_flush();
+
     mig_throttle_on = false;
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
@@ -803,6 +1181,8 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    compress_threads_save_setup();
+
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
@@ -866,9 +1246,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     while ((ret = qemu_file_rate_limit(f)) == 0) {
         int bytes_sent;
 
-        bytes_sent = ram_find_and_save_block(f, false);
         /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (ram_find_and_save_block(f, false, &bytes_sent) == 0) {
             break;
         }
         total_sent += bytes_sent;
@@ -889,6 +1268,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+    total_sent += flush_compressed_data(f);
 
     qemu_mutex_unlock_ramlist();
 
@@ -928,13 +1308,13 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     while (true) {
         int bytes_sent;
 
-        bytes_sent = ram_find_and_save_block(f, true);
         /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (ram_find_and_save_block(f, true, &bytes_sent) == 0) {
             break;
         }
         bytes_transferred += bytes_sent;
     }
+    bytes_transferred += flush_compressed_data(f);
 
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     migration_end();
@@ -1036,6 +1416,226 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+/* Lazy RAM restore for loadvm.  While the RAM section of a snapshot is
+ * loaded, ram_load() only notes where each page is in the vmstate and
+ * skips it.  The guest then runs at once, and a page is read from the
+ * snapshot when the memory API or a TLB fill first touches it, or by a
+ * bottom half which streams the rest in the background.
+ *
+ * With KVM and Xen the guest accesses RAM behind QEMU's back, so the
+ * restore stays eager.  So it does for the blocks of a device, or with a
+ * host pointer kept by the board (see qemu_ram_set_direct()): only the
+ * guest RAM of the machine itself is restored lazily.  */
+
+/* The most a single read of the streaming bottom half reads */
+#define RAM_LAZY_SPAN (1024 * 1024)
+
+static struct {
+    BlockDriverState *bs;
+    bool loading;
+    uint64_t npages;
+    unsigned long *bitmap;      /* the pages not read yet */
+    int64_t *pos;               /* where they are in the vmstate */
+    uint64_t next;              /* where the streaming is */
+    QEMUBH *bh;
+    uint8_t *buf;
+} ram_lazy;
+
+uint64_t ram_lazy_pending;
+
+static void ram_lazy_done(void)
+{
+    if (ram_lazy.bh) {
+        qemu_bh_delete(ram_lazy.bh);
+    }
+    if (ram_lazy.bs) {
+        bdrv_unref(ram_lazy.bs);
+    }
+    g_free(ram_lazy.bitmap);
+    g_free(ram_lazy.pos);
+    g_free(ram_lazy.buf);
+    memset(&ram_lazy, 0, sizeof(ram_lazy));
+    ram_lazy_pending = 0;
+}
+
+/* The block and page of host, or NULL if it is not guest RAM */
+static RAMBlock *ram_lazy_host_page(void *host, uint64_t *page)
+{
+    static RAMBlock *last;
+    RAMBlock *block = last;
+    uint8_t *p = host;
+
+    if (!block || p < block->host || p - block->host >= block->length) {
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (p >= block->host && p - block->host < block->length) {
+                break;
+            }
+        }
+        if (!block) {
+            return NULL;
+        }
+        last = block;
+    }
+    *page = (block->offset + (p - block->host)) >> TARGET_PAGE_BITS;
+    return block;
+}
+
+static void ram_lazy_clear(uint64_t page)
+{
+    clear_bit(page, ram_lazy.bitmap);
+    ram_lazy_pending--;
+}
+
+static void ram_lazy_load_page(uint64_t page)
+{
+    ram_addr_t addr = (ram_addr_t)page << TARGET_PAGE_BITS;
+    int ret;
+
+    ret = bdrv_load_vmstate(ram_lazy.bs, qemu_get_ram_ptr(addr),
+                            ram_lazy.pos[page], TARGET_PAGE_SIZE);
+    if (ret != TARGET_PAGE_SIZE) {
+        error_report("Failed to load RAM page " RAM_ADDR_FMT
+                     " from the snapshot", addr);
+        exit(1);
+    }
+    ram_lazy_clear(page);
+}
+
+void ram_lazy_load_range(ram_addr_t start, ram_addr_t length)
+{
+    uint64_t page = start >> TARGET_PAGE_BITS;
+    uint64_t end = MIN(TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS,
+                       ram_lazy.npages);
+
+    if (!ram_lazy.bitmap) {
+        return;
+    }
+    for (page = find_next_bit(ram_lazy.bitmap, end, page); page < end;
+         page = find_next_bit(ram_lazy.bitmap, end, page + 1)) {
+        ram_lazy_load_page(page);
+    }
+}
+
+/* Reads the next pages which are close together in the vmstate at once */
+static void ram_lazy_stream(void *opaque)
+{
+    uint64_t first, last, page;
+    int64_t start, end;
+    int ret;
+
+    if (!ram_lazy_pending) {
+        ram_lazy_done();
+        return;
+    }
+
+    first = find_next_bit(ram_lazy.bitmap, ram_lazy.npages, ram_lazy.next);
+    assert(first < ram_lazy.npages);
+    start = end = ram_lazy.pos[first];
+    for (last = first; last < ram_lazy.npages;
+         last = find_next_bit(ram_lazy.bitmap, ram_lazy.npages, last + 1)) {
+        if (ram_lazy.pos[last] < start ||
+            ram_lazy.pos[last] + TARGET_PAGE_SIZE - start > RAM_LAZY_SPAN) {
+            break;
+        }
+        end = MAX(end, ram_lazy.pos[last] + TARGET_PAGE_SIZE);
+    }
+
+    ret = bdrv_load_vmstate(ram_lazy.bs, ram_lazy.buf, start, end - start);
+    if (ret != end - start) {
+        error_report("Failed to load RAM from the snapshot");
+        exit(1);
+    }
+
+    ram_lazy.next = last;
+    for (page = first; page < last;
+         page = find_next_bit(ram_lazy.bitmap, ram_lazy.npages, page + 1)) {
+        memcpy(qemu_get_ram_ptr((ram_addr_t)page << TARGET_PAGE_BITS),
+               ram_lazy.buf + (ram_lazy.pos[page] - start), TARGET_PAGE_SIZE);
+        ram_lazy_clear(page);
+    }
+    qemu_bh_schedule(ram_lazy.bh);
+}
+
+/* Before loading the snapshot in bs: from now on, RAM pages are only read
+ * when needed */
+void ram_lazy_load_prepare(BlockDriverState *bs)
+{
+    ram_lazy_done();
+    if (!tcg_enabled()) {
+        return;
+    }
+
+    bdrv_ref(bs);
+    ram_lazy.bs = bs;
+    ram_lazy.loading = true;
+    ram_lazy.npages = last_ram_offset() >> TARGET_PAGE_BITS;
+    ram_lazy.bitmap = bitmap_new(ram_lazy.npages);
+    ram_lazy.pos = g_new(int64_t, ram_lazy.npages);
+}
+
+/* After loading the snapshot, with the result of qemu_loadvm_state() */
+void ram_lazy_load_finish(int ret)
+{
+    ram_lazy.loading = false;
+    if (ret < 0 || !ram_lazy_pending) {
+        ram_lazy_done();
+        return;
+    }
+    ram_lazy.buf = g_malloc(RAM_LAZY_SPAN);
+    ram_lazy.bh = qemu_bh_new(ram_lazy_stream, NULL);
+    qemu_bh_schedule(ram_lazy.bh);
+}
+
+/* Before reading all of RAM or writing a new vmstate */
+void ram_lazy_load_flush(void)
+{
+    while (ram_lazy_pending) {
+        ram_lazy_stream(NULL);
+    }
+    ram_lazy_done();
+}
+
+/* A page of the stream which would go to host: skip it if it can be read
+ * later */
+static bool ram_lazy_record(QEMUFile *f, void *host)
+{
+    RAMBlock *block;
+    uint64_t page;
+
+    if (!ram_lazy.loading) {
+        return false;
+    }
+    block = ram_lazy_host_page(host, &page);
+    if (!block || block->mr->owner ||
+        (block->flags & (RAM_PREALLOC | RAM_SHARED | RAM_DIRECT))) {
+        return false;
+    }
+
+    ram_lazy.pos[page] = qemu_file_skip_unread(f, TARGET_PAGE_SIZE);
+    if (!test_and_set_bit(page, ram_lazy.bitmap)) {
+        ram_lazy_pending++;
+    }
+    return true;
+}
+
+/* A page of the stream which will be written in host: forget where it was
+ * earlier in the stream, or read it from there if the new content depends
+ * on the old one */
+static void ram_lazy_overwrite(void *host, bool load)
+{
+    uint64_t page;
+
+    if (!ram_lazy_pending || !ram_lazy_host_page(host, &page) ||
+        !test_bit(page, ram_lazy.bitmap)) {
+        return;
+    }
+    if (load) {
+        ram_lazy_load_page(page);
+    } else {
+        ram_lazy_clear(page);
+    }
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -1103,6 +1703,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
 
+            ram_lazy_overwrite(host, false);
             ch = qemu_get_byte(f);
             ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
@@ -1115,7 +1716,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (!ram_lazy_record(f, host)) {
+                ram_lazy_overwrite(host, false);
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
@@ -1124,16 +1728,40 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
 
+            ram_lazy_overwrite(host, true);
             if (load_xbzrle(f, addr, host) < 0) {
                 error_report("Failed to decompress XBZRLE page at "
                              RAM_ADDR_FMT, addr);
                 ret = -EINVAL;
                 break;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            unsigned long len;
+
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+
+            ram_lazy_overwrite(host, false);
+            len = qemu_get_be32(f);
+            if (len > compressBound(TARGET_PAGE_SIZE)) {
+                error_report("Invalid compressed page length %lu at "
+                             RAM_ADDR_FMT, len, addr);
+                ret = -EINVAL;
+                break;
+            }
+            decompress_data_with_multi_threads(f, host, len);
         } else if (flags & RAM_SAVE_FLAG_HOOK) {
             ram_control_load_hook(f, flags);
         } else if (flags & RAM_SAVE_FLAG_EOS) {
             /* normal exit */
+            if (wait_for_decompress_done() < 0) {
+                error_report("Failed to decompress a page");
+                ret = -EINVAL;
+            }
             break;
         } else {
             error_report("Unknown migration flags: %#x", flags);
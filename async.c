@@ -31,11 +31,21 @@
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
+/* A scheduled (or deleted) bottom half is pushed on the context's
+ * pending_bh stack, lock-free, unless it is queued already.  aio_bh_poll
+ * takes the whole stack at once, so its cost and that of the GSource
+ * callbacks depend on the bottom halves which were scheduled, not on all
+ * those which exist: a machine with many ptimers no longer walks all of
+ * their bottom halves on each main loop iteration.  Bottom halves which are
+ * cancelled or deleted stay queued until the next aio_bh_poll, which drops
+ * or frees them.
+ */
 struct QEMUBH {
     AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
-    QEMUBH *next;
+    QEMUBH *next;       /* on pending_bh or bh_batch */
+    bool queued;
     bool scheduled;
     bool idle;
     bool deleted;
@@ -48,29 +58,59 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
     bh->ctx = ctx;
     bh->cb = cb;
     bh->opaque = opaque;
-    qemu_mutex_lock(&ctx->bh_lock);
-    bh->next = ctx->first_bh;
-    /* Make sure that the members are ready before putting bh into list */
-    smp_wmb();
-    ctx->first_bh = bh;
-    qemu_mutex_unlock(&ctx->bh_lock);
     return bh;
 }
 
-/* Multiple occurrences of aio_bh_poll cannot be called concurrently */
+/* Called from any thread once scheduled or deleted is set */
+static void aio_bh_enqueue(QEMUBH *bh)
+{
+    AioContext *ctx = bh->ctx;
+    QEMUBH *old;
+
+    if (atomic_xchg(&bh->queued, true)) {
+        return;
+    }
+    do {
+        old = atomic_read(&ctx->pending_bh);
+        bh->next = old;
+    } while (atomic_cmpxchg(&ctx->pending_bh, old, bh) != old);
+}
+
+/* Multiple occurrences of aio_bh_poll cannot be called concurrently.  A
+ * callback may call it again though (through aio_poll), and the nested call
+ * then runs the rest of the batch, so that it sees every bottom half which
+ * is scheduled.
+ */
 int aio_bh_poll(AioContext *ctx)
 {
-    QEMUBH *bh, **bhp, *next;
+    QEMUBH *bh, *list, *last, *next;
     int ret;
 
-    ctx->walking_bh++;
+    /* Put the newly queued bottom halves in front of the batch, oldest
+     * first.  The stack has the newest on top. */
+    list = atomic_xchg(&ctx->pending_bh, NULL);
+    last = list;
+    next = ctx->bh_batch;
+    while (list) {
+        bh = list;
+        list = bh->next;
+        bh->next = next;
+        next = bh;
+    }
+    if (last) {
+        ctx->bh_batch = next;
+    }
 
     ret = 0;
-    for (bh = ctx->first_bh; bh; bh = next) {
-        /* Make sure that fetching bh happens before accessing its members */
-        smp_read_barrier_depends();
-        next = bh->next;
-        if (!bh->deleted && bh->scheduled) {
+    while ((bh = ctx->bh_batch)) {
+        ctx->bh_batch = bh->next;
+        /* While queued is set, qemu_bh_delete cannot push it again */
+        if (atomic_read(&bh->deleted)) {
+            g_free(bh);
+            continue;
+        }
+        atomic_mb_set(&bh->queued, false);
+        if (bh->scheduled) {
             bh->scheduled = 0;
             /* Paired with write barrier in bh schedule to ensure reading for
              * idle & callbacks coming after bh's scheduling.
@@ -83,24 +123,6 @@ int aio_bh_poll(AioContext *ctx)
         }
     }
 
-    ctx->walking_bh--;
-
-    /* remove deleted bhs */
-    if (!ctx->walking_bh) {
-        qemu_mutex_lock(&ctx->bh_lock);
-        bhp = &ctx->first_bh;
-        while (*bhp) {
-            bh = *bhp;
-            if (bh->deleted) {
-                *bhp = bh->next;
-                g_free(bh);
-            } else {
-                bhp = &bh->next;
-            }
-        }
-        qemu_mutex_unlock(&ctx->bh_lock);
-    }
-
     return ret;
 }
 
@@ -114,6 +136,7 @@ void qemu_bh_schedule_idle(QEMUBH *bh)
      */
     smp_wmb();
     bh->scheduled = 1;
+    aio_bh_enqueue(bh);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
@@ -132,6 +155,7 @@ void qemu_bh_schedule(QEMUBH *bh)
      */
     smp_mb();
     bh->scheduled = 1;
+    aio_bh_enqueue(bh);
     aio_notify(ctx);
 }
 
@@ -149,31 +173,58 @@ void qemu_bh_cancel(QEMUBH *bh)
 void qemu_bh_delete(QEMUBH *bh)
 {
     bh->scheduled = 0;
-    bh->deleted = 1;
+    atomic_mb_set(&bh->deleted, true);
+    aio_bh_enqueue(bh);
+}
+
+/* Returns 2 if one of the bottom halves on the list is scheduled and not
+ * idle, 1 if only idle ones are, else 0.  Only the thread which runs
+ * aio_bh_poll may walk the lists.
+ */
+static int aio_bh_list_scheduled(QEMUBH *bh)
+{
+    int ret = 0;
+
+    for (; bh; bh = bh->next) {
+        if (!bh->deleted && bh->scheduled) {
+            if (!bh->idle) {
+                return 2;
+            }
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+static int aio_bh_scheduled(AioContext *ctx)
+{
+    int ret = aio_bh_list_scheduled(ctx->bh_batch);
+
+    if (ret < 2) {
+        ret = MAX(ret, aio_bh_list_scheduled(atomic_read(&ctx->pending_bh)));
+    }
+    return ret;
 }
 
 static gboolean
 aio_ctx_prepare(GSource *source, gint    *timeout)
 {
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
     int deadline;
 
     /* We assume there is no timeout already supplied */
     *timeout = -1;
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            if (bh->idle) {
-                /* idle bottom halves will be polled at least
-                 * every 10ms */
-                *timeout = 10;
-            } else {
-                /* non-idle bottom halves will be executed
-                 * immediately */
-                *timeout = 0;
-                return true;
-            }
-        }
+    switch (aio_bh_scheduled(ctx)) {
+    case 2:
+        /* non-idle bottom halves will be executed
+         * immediately */
+        *timeout = 0;
+        return true;
+    case 1:
+        /* idle bottom halves will be polled at least
+         * every 10ms */
+        *timeout = 10;
+        break;
     }
 
     deadline = qemu_timeout_ns_to_ms(timerlistgroup_deadline_ns(&ctx->tlg));
@@ -191,12 +242,9 @@ static gboolean
 aio_ctx_check(GSource *source)
 {
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            return true;
-	}
+    if (aio_bh_scheduled(ctx)) {
+        return true;
     }
     return aio_pending(ctx) || (timerlistgroup_deadline_ns(&ctx->tlg) == 0);
 }
@@ -222,7 +270,6 @@ aio_ctx_finalize(GSource     *source)
     aio_set_event_notifier(ctx, &ctx->notifier, NULL);
     event_notifier_cleanup(&ctx->notifier);
     rfifolock_destroy(&ctx->lock);
-    qemu_mutex_destroy(&ctx->bh_lock);
     g_array_free(ctx->pollfds, TRUE);
     timerlistgroup_deinit(&ctx->tlg);
 }
@@ -286,7 +333,6 @@ AioContext *aio_context_new(void)
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
     ctx->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
     ctx->thread_pool = NULL;
-    qemu_mutex_init(&ctx->bh_lock);
     rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
     event_notifier_init(&ctx->notifier, false);
     aio_set_event_notifier(ctx, &ctx->notifier, 
@@ -82,33 +82,30 @@ static inline int64_t glue (conv_, ET) (IN_T v)
 #endif
 }
 
+/* Selects rather than branches, so that the loops below vectorise */
 static inline IN_T glue (clip_, ET) (int64_t v)
 {
-    if (v >= 0x7f000000) {
-        return IN_MAX;
-    }
-    else if (v < -2147483648LL) {
-        return IN_MIN;
-    }
-
 #ifdef SIGNED
-    return ENDIAN_CONVERT ((IN_T) (v >> (32 - SHIFT)));
+    IN_T nv = ENDIAN_CONVERT ((IN_T) (v >> (32 - SHIFT)));
 #else
-    return ENDIAN_CONVERT ((IN_T) ((v >> (32 - SHIFT)) + HALF));
+    IN_T nv = ENDIAN_CONVERT ((IN_T) ((v >> (32 - SHIFT)) + HALF));
 #endif
+
+    nv = v < -2147483648LL ? IN_MIN : nv;
+    return v >= 0x7f000000 ? IN_MAX : nv;
 }
 #endif
 
 static void glue (glue (conv_, ET), _to_stereo)
     (struct st_sample *dst, const void *src, int samples)
 {
-    struct st_sample *out = dst;
-    IN_T *in = (IN_T *) src;
+    struct st_sample *restrict out = dst;
+    const IN_T *restrict in = src;
+    int i;
 
-    while (samples--) {
-        out->l = glue (conv_, ET) (*in++);
-        out->r = glue (conv_, ET) (*in++);
-        out += 1;
+    for (i = 0; i < samples; i++) {
+        out[i].l = glue (conv_, ET) (in[2 * i]);
+        out[i].r = glue (conv_, ET) (in[2 * i + 1]);
     }
 }
 
@@ -129,12 +126,13 @@ static void glue (glue (conv_, ET), _to_mono)
 static void glue (glue (clip_, ET), _from_stereo)
     (void *dst, const struct st_sample *src, int samples)
 {
-    const struct st_sample *in = src;
-    IN_T *out = (IN_T *) dst;
-    while (samples--) {
-        *out++ = glue (clip_, ET) (in->l);
-        *out++ = glue (clip_, ET) (in->r);
-        in += 1;
+    const struct st_sample *restrict in = src;
+    IN_T *restrict out = dst;
+    int i;
+
+    for (i = 0; i < samples; i++) {
+        out[2 * i] = glue (clip_, ET) (in[i].l);
+        out[2 * i + 1] = glue (clip_, ET) (in[i].r);
     }
 }
 
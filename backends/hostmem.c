@@ -23,6 +23,10 @@ QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_DEFAULT != MPOL_DEFAULT);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_PREFERRED != MPOL_PREFERRED);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_BIND != MPOL_BIND);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_INTERLEAVE != MPOL_INTERLEAVE);
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4
+#endif
+QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_LOCAL != MPOL_LOCAL);
 #endif
 
 static void
@@ -313,7 +317,11 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
                        " or you should explicitly specify a policy other"
                        " than default");
             return;
-        } else if (maxnode == 0 && backend->policy != MPOL_DEFAULT) {
+        } else if (maxnode && backend->policy == MPOL_LOCAL) {
+            error_setg(errp, "host-nodes must be empty for policy local");
+            return;
+        } else if (maxnode == 0 && backend->policy != MPOL_DEFAULT &&
+                   backend->policy != MPOL_LOCAL) {
             error_setg(errp, "host-nodes must be set for policy %s",
                        HostMemPolicy_lookup[backend->policy]);
             return;
@@ -2077,6 +2077,8 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
 
 static void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(!bs->dev);
     assert(!bs->job);
     assert(bdrv_op_blocker_is_empty(bs));
@@ -2088,6 +2090,9 @@ static void bdrv_delete(BlockDriverState *bs)
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
 
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        bdrv_latency_histogram_clear(bs, i);
+    }
     g_free(bs);
 }
 
@@ -4193,6 +4198,36 @@ int bdrv_writev_vmstate(BlockDriverState *bs, QEMUIOVector *qiov, int64_t pos)
     return -ENOTSUP;
 }
 
+/* Several of these may be in flight at once, for different parts of the
+ * vmstate */
+int coroutine_fn bdrv_co_writev_vmstate(BlockDriverState *bs,
+                                        QEMUIOVector *qiov, int64_t pos)
+{
+    static CoMutex lock;
+    static bool lock_init;
+    BlockDriver *drv = bs->drv;
+    int ret;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    } else if (drv->bdrv_co_save_vmstate) {
+        return drv->bdrv_co_save_vmstate(bs, qiov, pos);
+    } else if (!drv->bdrv_save_vmstate && bs->file) {
+        return bdrv_co_writev_vmstate(bs->file, qiov, pos);
+    }
+
+    /* bdrv_save_vmstate callbacks may change bs around the write, so they
+     * run one at a time */
+    if (!lock_init) {
+        qemu_co_mutex_init(&lock);
+        lock_init = true;
+    }
+    qemu_co_mutex_lock(&lock);
+    ret = bdrv_writev_vmstate(bs, qiov, pos);
+    qemu_co_mutex_unlock(&lock);
+    return ret;
+}
+
 int bdrv_load_vmstate(BlockDriverState *bs, uint8_t *buf,
                       int64_t pos, int size)
 {
@@ -5330,6 +5365,11 @@ void bdrv_dirty_iter_init(BlockDriverState *bs,
     hbitmap_iter_init(hbi, bitmap->bitmap, 0);
 }
 
+void bdrv_set_dirty_iter(HBitmapIter *hbi, int64_t offset)
+{
+    hbitmap_iter_init(hbi, hbi->hb, offset);
+}
+
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
                     int nr_sectors)
 {
@@ -5490,14 +5530,78 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
     cookie->type = type;
 }
 
+static int latency_histogram_bin(BlockLatencyHistogram *hist,
+                                 uint64_t latency_ns)
+{
+    int lo = 0, hi = hist->nbins - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    BlockLatencyHistogram *hist;
+    int64_t latency_ns;
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
+    latency_ns = get_clock() - cookie->start_time_ns;
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+
+    hist = &bs->latency_histogram[cookie->type];
+    if (hist->bins) {
+        hist->bins[latency_histogram_bin(hist, latency_ns)]++;
+    }
+}
+
+/*
+ * Starts collecting a latency histogram for requests of the given type,
+ * with bins split at the given boundaries (strictly increasing and
+ * positive, in nanoseconds).  A previous histogram is discarded.
+ */
+void bdrv_latency_histogram_set(BlockDriverState *bs, enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist = &bs->latency_histogram[type];
+    uint64List *entry;
+    int i;
+
+    bdrv_latency_histogram_clear(bs, type);
+
+    hist->nbins = 1;
+    for (entry = boundaries; entry; entry = entry->next) {
+        hist->nbins++;
+    }
+    hist->boundaries = g_new(uint64_t, hist->nbins - 1);
+    hist->bins = g_new0(uint64_t, hist->nbins);
+    for (entry = boundaries, i = 0; entry; entry = entry->next, i++) {
+        assert(entry->value > (i ? hist->boundaries[i - 1] : 0));
+        hist->boundaries[i] = entry->value;
+    }
+}
+
+void bdrv_latency_histogram_clear(BlockDriverState *bs,
+                                  enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hist = &bs->latency_histogram[type];
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    hist->nbins = 0;
+    hist->boundaries = NULL;
+    hist->bins = NULL;
 }
 
 void bdrv_img_create(const char *filename, const char *fmt,
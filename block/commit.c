@@ -24,6 +24,12 @@ enum {
      * contiguous regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /*
+     * Number of copy requests kept in flight ahead of the allocation scan,
+     * so that the latency of a remote image is overlapped.
+     */
+    COMMIT_MAX_IN_FLIGHT = 4,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -38,8 +44,22 @@ typedef struct CommitBlockJob {
     int base_flags;
     int orig_overlay_flags;
     char *backing_file_str;
+
+    void *buf_free[COMMIT_MAX_IN_FLIGHT];
+    int buf_free_count;
+    int in_flight;
+    bool waiting;               /* commit_run waits for in_flight to drop */
+    int ret;                    /* first failure of a request in flight */
+    int64_t error_sector;       /* ...and where it occurred */
 } CommitBlockJob;
 
+typedef struct CommitOp {
+    CommitBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    void *buf;
+} CommitOp;
+
 static int coroutine_fn commit_populate(BlockDriverState *bs,
                                         BlockDriverState *base,
                                         int64_t sector_num, int nb_sectors,
@@ -60,6 +80,56 @@ static int coroutine_fn commit_populate(BlockDriverState *bs,
     return 0;
 }
 
+static void coroutine_fn commit_co_populate(void *opaque)
+{
+    CommitOp *op = opaque;
+    CommitBlockJob *s = op->s;
+    int ret;
+
+    ret = commit_populate(s->top, s->base, op->sector_num, op->nb_sectors,
+                          op->buf);
+    trace_commit_populate_done(s, op->sector_num, op->nb_sectors, ret);
+    if (ret < 0 && (s->ret == 0 || op->sector_num < s->error_sector)) {
+        s->ret = ret;
+        s->error_sector = op->sector_num;
+    }
+
+    s->buf_free[s->buf_free_count++] = op->buf;
+    s->in_flight--;
+    g_free(op);
+
+    if (s->waiting) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn commit_wait_in_flight(CommitBlockJob *s, int max)
+{
+    while (s->in_flight > max) {
+        s->waiting = true;
+        qemu_coroutine_yield();
+        s->waiting = false;
+    }
+}
+
+/* Starts copying [sector_num, sector_num + nb_sectors) in the background */
+static void coroutine_fn commit_start_populate(CommitBlockJob *s,
+                                               int64_t sector_num,
+                                               int nb_sectors)
+{
+    CommitOp *op;
+
+    commit_wait_in_flight(s, COMMIT_MAX_IN_FLIGHT - 1);
+
+    op = g_new(CommitOp, 1);
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->buf = s->buf_free[--s->buf_free_count];
+    s->in_flight++;
+    qemu_coroutine_enter(qemu_coroutine_create(commit_co_populate), op);
+}
+
 static void coroutine_fn commit_run(void *opaque)
 {
     CommitBlockJob *s = opaque;
@@ -70,7 +140,7 @@ static void coroutine_fn commit_run(void *opaque)
     int64_t sector_num, end;
     int ret = 0;
     int n = 0;
-    void *buf;
+    int i;
     int bytes_written = 0;
     int64_t base_len;
 
@@ -94,26 +164,45 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
+    for (i = 0; i < COMMIT_MAX_IN_FLIGHT; i++) {
+        s->buf_free[s->buf_free_count++] = qemu_blockalign(top,
+                                                           COMMIT_BUFFER_SIZE);
+    }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    /* Up to COMMIT_MAX_IN_FLIGHT copies run in the background while the loop
+     * goes on scanning the allocation status.  When one of them fails, the
+     * loop waits for the others and handles the error as if it had just
+     * occurred; a retry resumes at the first sector that failed.
+     */
+    for (sector_num = 0; sector_num < end || s->in_flight || s->ret < 0;
+         sector_num += n) {
         uint64_t delay_ns = 0;
         bool copy;
 
 wait:
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  Copies in flight do not
+         * hold it up, because they do not wait for this coroutine.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
-        /* Copy if allocated above the base */
-        ret = bdrv_is_allocated_above(top, base, sector_num,
-                                      COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
-                                      &n);
-        copy = (ret == 1);
-        trace_commit_one_iteration(s, sector_num, n, ret);
+
+        copy = false;
+
+        if (s->ret < 0 || sector_num >= end) {
+            commit_wait_in_flight(s, 0);
+            n = 0;
+            ret = s->ret;
+        } else {
+            /* Copy if allocated above the base */
+            ret = bdrv_is_allocated_above(top, base, sector_num,
+                                          COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
+                                          &n);
+            copy = (ret == 1);
+            trace_commit_one_iteration(s, sector_num, n, ret);
+        }
         if (copy) {
             if (s->common.speed) {
                 delay_ns = ratelimit_calculate_delay(&s->limit, n);
@@ -121,7 +210,7 @@ wait:
                     goto wait;
                 }
             }
-            ret = commit_populate(top, base, sector_num, n, buf);
+            commit_start_populate(s, sector_num, n);
             bytes_written += n * BDRV_SECTOR_SIZE;
         }
         if (ret < 0) {
@@ -130,6 +219,11 @@ wait:
                 (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC)) {
                 goto exit_free_buf;
             } else {
+                if (s->ret < 0) {
+                    sector_num = s->error_sector;
+                    s->common.offset = sector_num * BDRV_SECTOR_SIZE;
+                    s->ret = 0;
+                }
                 n = 0;
                 continue;
             }
@@ -138,7 +232,12 @@ wait:
         s->common.offset += n * BDRV_SECTOR_SIZE;
     }
 
-    ret = 0;
+    commit_wait_in_flight(s, 0);
+    ret = s->ret;
+    if (ret < 0) {
+        /* failed after the job was cancelled */
+        goto exit_free_buf;
+    }
 
     if (!block_job_is_cancelled(&s->common) && sector_num == end) {
         /* success */
@@ -146,7 +245,10 @@ wait:
     }
 
 exit_free_buf:
-    qemu_vfree(buf);
+    commit_wait_in_flight(s, 0);
+    while (s->buf_free_count) {
+        qemu_vfree(s->buf_free[--s->buf_free_count]);
+    }
 
 exit_restore_reopen:
     /* restore base open flags here if appropriate (e.g., change the base back
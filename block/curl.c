@@ -63,6 +63,12 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_DEFAULT (256 * 1024)
+/* Sequential reads double the read-ahead up to this, or the readahead
+ * option if larger */
+#define READ_AHEAD_MAX  (4 * 1024 * 1024)
+/* Requests of the next read-ahead sized ranges sent along with the one a
+ * sequential read needs, each on a state (and connection) of its own */
+#define CURL_NUM_PREFETCH 2
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -99,6 +105,7 @@ typedef struct CURLState
     char range[128];
     char errmsg[CURL_ERROR_SIZE];
     char in_use;
+    uint64_t last_use;      /* when the buffer was last filled or read */
 } CURLState;
 
 typedef struct BDRVCURLState {
@@ -108,6 +115,9 @@ typedef struct BDRVCURLState {
     CURLState states[CURL_NUM_STATES];
     char *url;
     size_t readahead_size;
+    size_t readahead;       /* the current, adaptive read-ahead */
+    size_t seq_next;        /* where a sequential read would start */
+    uint64_t use_count;
     bool sslverify;
     bool accept_range;
     AioContext *aio_context;
@@ -241,6 +251,7 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
 
             qemu_iovec_from_buf(acb->qiov, 0, buf, len);
             acb->common.cb(acb->common.opaque, 0);
+            state->last_use = ++s->use_count;
 
             return FIND_RET_OK;
         }
@@ -260,6 +271,7 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
             for (j=0; j<CURL_NUM_ACB; j++) {
                 if (!state->acb[j]) {
                     state->acb[j] = acb;
+                    state->last_use = ++s->use_count;
                     return FIND_RET_WAIT;
                 }
             }
@@ -305,7 +317,6 @@ static void curl_multi_check_completion(BDRVCURLState *s)
             }
 
             curl_clean_state(state);
-            break;
         }
     }
 }
@@ -352,28 +363,32 @@ static void curl_multi_timeout_do(void *arg)
 #endif
 }
 
-static CURLState *curl_init_state(BDRVCURLState *s)
+/* The idle state whose buffer is the least recently used, or NULL */
+static CURLState *curl_find_state(BDRVCURLState *s, int *nb_idle)
 {
     CURLState *state = NULL;
-    int i, j;
-
-    do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
+    int i;
 
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
+    if (nb_idle) {
+        *nb_idle = 0;
+    }
+    for (i = 0; i < CURL_NUM_STATES; i++) {
+        if (s->states[i].in_use) {
+            continue;
         }
-        if (!state) {
-            aio_poll(state->s->aio_context, true);
+        if (nb_idle) {
+            (*nb_idle)++;
         }
-    } while(!state);
+        if (!state || s->states[i].last_use < state->last_use) {
+            state = &s->states[i];
+        }
+    }
+    return state;
+}
 
+static CURLState *curl_setup_state(BDRVCURLState *s, CURLState *state)
+{
+    state->in_use = 1;
     if (!state->curl) {
         state->curl = curl_easy_init();
         if (!state->curl) {
@@ -414,6 +429,75 @@ static CURLState *curl_init_state(BDRVCURLState *s)
     return state;
 }
 
+static CURLState *curl_init_state(BDRVCURLState *s)
+{
+    CURLState *state;
+
+    while (!(state = curl_find_state(s, NULL))) {
+        aio_poll(s->aio_context, true);
+    }
+    return curl_setup_state(s, state);
+}
+
+/* Fills the buffer of state with [start, start + len) of the image */
+static void curl_start_request(BDRVCURLState *s, CURLState *state,
+                               size_t start, size_t len)
+{
+    size_t end = MIN(start + len, s->len) - 1;
+
+    state->buf_off = 0;
+    g_free(state->orig_buf);
+    state->buf_start = start;
+    state->buf_len = len;
+    state->orig_buf = g_malloc(state->buf_len);
+    state->last_use = ++s->use_count;
+
+    snprintf(state->range, 127, "%zd-%zd", start, end);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+    curl_multi_add_handle(s->multi, state->curl);
+}
+
+/* Whether a state has or is reading the byte at pos */
+static bool curl_covered(BDRVCURLState *s, size_t pos)
+{
+    int i;
+
+    for (i = 0; i < CURL_NUM_STATES; i++) {
+        CURLState *state = &s->states[i];
+        size_t buf_end = state->buf_start +
+                         (state->in_use ? state->buf_len : state->buf_off);
+
+        if (state->orig_buf && pos >= state->buf_start && pos < buf_end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* After the request of a sequential read which ends at pos, asks for the
+ * next ranges in parallel, leaving one state for the next miss */
+static void curl_prefetch(BDRVCURLState *s, size_t pos)
+{
+    CURLState *state;
+    int i, nb_idle;
+
+    for (i = 0; i < CURL_NUM_PREFETCH && pos < s->len; i++) {
+        if (!curl_covered(s, pos)) {
+            state = curl_find_state(s, &nb_idle);
+            if (nb_idle < 2) {
+                return;
+            }
+            if (!curl_setup_state(s, state)) {
+                state->in_use = 0;
+                return;
+            }
+            DPRINTF("CURL (AIO): Prefetching %zd at %zd\n", s->readahead, pos);
+            curl_start_request(s, state, pos, s->readahead);
+        }
+        pos += s->readahead;
+    }
+}
+
 static void curl_clean_state(CURLState *s)
 {
     if (s->s->multi)
@@ -524,6 +608,7 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
                    s->readahead_size);
         goto out_noclean;
     }
+    s->readahead = s->readahead_size;
 
     s->sslverify = qemu_opt_get_bool(opts, CURL_BLOCK_OPT_SSLVERIFY, true);
 
@@ -610,11 +695,14 @@ static void curl_readv_bh_cb(void *p)
     acb->bh = NULL;
 
     size_t start = acb->sector_num * SECTOR_SIZE;
-    size_t end;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
+    bool sequential = start == s->seq_next;
+
+    s->seq_next = start + len;
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    switch (curl_find_buf(s, start, len, acb)) {
         case FIND_RET_OK:
             qemu_aio_release(acb);
             // fall through
@@ -632,23 +720,24 @@ static void curl_readv_bh_cb(void *p)
         return;
     }
 
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
+    /* A miss of a sequential read means the read-ahead was too short */
+    if (sequential) {
+        s->readahead = MIN(s->readahead * 2,
+                           MAX(READ_AHEAD_MAX, s->readahead_size));
+    } else {
+        s->readahead = s->readahead_size;
+    }
 
-    state->buf_off = 0;
-    g_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = g_malloc(state->buf_len);
+    acb->start = 0;
+    acb->end = len;
     state->acb[0] = acb;
+    curl_start_request(s, state, start, len + s->readahead);
+    DPRINTF("CURL (AIO): Reading %zd at %zd (%s)\n", len, start,
+            state->range);
 
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
-
-    curl_multi_add_handle(s->multi, state->curl);
+    if (sequential) {
+        curl_prefetch(s, start + len + s->readahead);
+    }
 
     /* Tell curl it needs to kick things off */
     curl_multi_socket_action(s->multi, CURL_SOCKET_TIMEOUT, 0, &running);
@@ -12,6 +12,7 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
 
 #include <libaio.h>
 
@@ -51,6 +52,31 @@ struct qemu_laio_state {
 
     /* io queue for submit at batch */
     LaioQueue io_q;
+
+    /* submits the requests queued while not plugged */
+    QEMUBH *submit_bh;
+
+    /* number of submitted requests that have not completed yet */
+    unsigned int in_flight;
+};
+
+/*
+ * The kernel maps the completion ring of an io_context_t into user space,
+ * so completed requests can be reaped without an io_getevents() call.  This
+ * is the layout of its header, as defined in fs/aio.c.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -86,6 +112,68 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+/*
+ * Returns the number of completions that can be read from the ring without
+ * wrapping, and points *events at the first one.  Returns 0 if the ring is
+ * empty or cannot be read from user space.
+ */
+static unsigned int io_getevents_peek(io_context_t ctx,
+                                      struct io_event **events)
+{
+    struct aio_ring *ring = (struct aio_ring *)ctx;
+    unsigned int head, tail;
+
+    if (ring->magic != AIO_RING_MAGIC || ring->incompat_features) {
+        return 0;
+    }
+
+    head = ring->head;
+    tail = atomic_read(&ring->tail);
+    smp_rmb();
+
+    *events = ring->io_events + head;
+    return tail >= head ? tail - head : ring->nr - head;
+}
+
+static void io_getevents_commit(io_context_t ctx, unsigned int nr)
+{
+    struct aio_ring *ring = (struct aio_ring *)ctx;
+
+    /* Finish reading the events before handing the slots back */
+    smp_mb();
+    atomic_set(&ring->head, (ring->head + nr) % ring->nr);
+}
+
+static void qemu_laio_complete_event(struct qemu_laio_state *s,
+                                     struct io_event *event)
+{
+    struct qemu_laiocb *laiocb =
+            container_of(event->obj, struct qemu_laiocb, iocb);
+
+    s->in_flight--;
+    laiocb->ret = io_event_ret(event);
+    qemu_laio_process_completion(s, laiocb);
+}
+
+/*
+ * Reaps all completions that are in the ring.  Every event is consumed
+ * before its callback runs, so that callbacks may reap completions too.
+ */
+static bool qemu_laio_poll_completions(struct qemu_laio_state *s)
+{
+    struct io_event *events;
+    struct io_event event;
+    bool progress = false;
+
+    while (s->in_flight && io_getevents_peek(s->ctx, &events)) {
+        event = events[0];
+        io_getevents_commit(s->ctx, 1);
+        qemu_laio_complete_event(s, &event);
+        progress = true;
+    }
+    return progress;
+}
+
 static void qemu_laio_completion_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
@@ -95,17 +183,16 @@ static void qemu_laio_completion_cb(EventNotifier *e)
         struct timespec ts = { 0 };
         int nevents, i;
 
+        if (qemu_laio_poll_completions(s)) {
+            continue;
+        }
+
         do {
             nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
         } while (nevents == -EINTR);
 
         for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
-
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
+            qemu_laio_complete_event(s, &events[i]);
         }
     }
 }
@@ -113,12 +200,26 @@ static void qemu_laio_completion_cb(EventNotifier *e)
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
+    unsigned int i;
     int ret;
 
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* A request that is still queued is simply dropped */
+    for (i = 0; i < s->io_q.idx; i++) {
+        if (s->io_q.iocbs[i] == &laiocb->iocb) {
+            memmove(&s->io_q.iocbs[i], &s->io_q.iocbs[i + 1],
+                    (s->io_q.idx - i - 1) * sizeof(s->io_q.iocbs[0]));
+            s->io_q.idx--;
+            laiocb->ret = -ECANCELED;
+            qemu_laio_process_completion(s, laiocb);
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -126,6 +227,7 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
      */
     ret = io_cancel(laiocb->ctx->ctx, &laiocb->iocb, &event);
     if (ret == 0) {
+        laiocb->ctx->in_flight--;
         laiocb->ret = -ECANCELED;
         return;
     }
@@ -170,6 +272,7 @@ static int ioq_submit(struct qemu_laio_state *s)
         i = 0;
     } else {
         i = ret;
+        s->in_flight += ret;
     }
 
     for (; i < len; i++) {
@@ -195,6 +298,22 @@ static void ioq_enqueue(struct qemu_laio_state *s, struct iocb *iocb)
     }
 }
 
+/*
+ * Requests issued while the queue is not plugged are collected until the
+ * current event loop iteration is done with its handlers, and then go to
+ * the kernel with a single io_submit().  Completions that are already in
+ * the ring are reaped at the same time, saving the eventfd round trip.
+ */
+static void qemu_laio_submit_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+
+    if (!s->io_q.plugged && s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+    qemu_laio_poll_completions(s);
+}
+
 void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
 {
     struct qemu_laio_state *s = aio_ctx;
@@ -253,12 +372,16 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     }
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
 
-    if (!s->io_q.plugged) {
+    if (!s->io_q.plugged && !s->submit_bh) {
         if (io_submit(s->ctx, 1, &iocbs) < 0) {
             goto out_free_aiocb;
         }
+        s->in_flight++;
     } else {
         ioq_enqueue(s, iocbs);
+        if (!s->io_q.plugged) {
+            qemu_bh_schedule(s->submit_bh);
+        }
     }
     return &laiocb->common;
 
@@ -271,6 +394,12 @@ void laio_detach_aio_context(void *s_, AioContext *old_context)
 {
     struct qemu_laio_state *s = s_;
 
+    if (s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+    qemu_bh_delete(s->submit_bh);
+    s->submit_bh = NULL;
+
     aio_set_event_notifier(old_context, &s->e, NULL);
 }
 
@@ -278,6 +407,7 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
 {
     struct qemu_laio_state *s = s_;
 
+    s->submit_bh = aio_bh_new(new_context, qemu_laio_submit_bh, s);
     aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
 }
 
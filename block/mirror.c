@@ -18,7 +18,8 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define MAX_IN_FLIGHT 64
+#define DEFAULT_IN_FLIGHT 16
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -54,6 +55,10 @@ typedef struct MirrorBlockJob {
 
     unsigned long *in_flight_bitmap;
     int in_flight;
+    /* Operations allowed in flight, adapted to the target's latency */
+    int max_in_flight;
+    int in_flight_credit;
+    uint64_t min_chunk_latency_ns;
     int ret;
 } MirrorBlockJob;
 
@@ -62,6 +67,7 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    int64_t start_ns;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -114,6 +120,43 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     }
 }
 
+/* Grows the number of operations in flight by one per round trip while the
+ * target's latency per chunk stays close to the best seen so far, and backs
+ * off when it goes up, i.e. when the target stops absorbing more requests.
+ */
+static void mirror_update_in_flight_limit(MirrorBlockJob *s, MirrorOp *op)
+{
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int nb_chunks = DIV_ROUND_UP(op->nb_sectors, sectors_per_chunk);
+    uint64_t latency_ns;
+
+    latency_ns = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->start_ns) /
+                 nb_chunks;
+
+    /* Let the reference drift up slowly, the target's load may change */
+    s->min_chunk_latency_ns += s->min_chunk_latency_ns / 64;
+    if (s->min_chunk_latency_ns == 0 || latency_ns < s->min_chunk_latency_ns) {
+        s->min_chunk_latency_ns = latency_ns;
+    }
+
+    if (latency_ns <= 2 * s->min_chunk_latency_ns) {
+        if (++s->in_flight_credit >= s->max_in_flight &&
+            s->max_in_flight < MAX_IN_FLIGHT) {
+            s->max_in_flight++;
+            s->in_flight_credit = 0;
+        }
+    } else if (latency_ns > 4 * s->min_chunk_latency_ns &&
+               s->in_flight_credit >= 0) {
+        s->max_in_flight = MAX(1, s->max_in_flight * 3 / 4);
+        /* Wait for a round trip before reacting again */
+        s->in_flight_credit = -s->max_in_flight;
+    } else {
+        s->in_flight_credit = MIN(s->in_flight_credit + 1, 0);
+    }
+
+    trace_mirror_in_flight_limit(s, s->max_in_flight, latency_ns);
+}
+
 static void mirror_write_complete(void *opaque, int ret)
 {
     MirrorOp *op = opaque;
@@ -127,6 +170,8 @@ static void mirror_write_complete(void *opaque, int ret)
         if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
         }
+    } else {
+        mirror_update_in_flight_limit(s, op);
     }
     mirror_iteration_done(op, ret);
 }
@@ -155,21 +200,24 @@ static void mirror_read_complete(void *opaque, int ret)
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
-    int nb_sectors, sectors_per_chunk, nb_chunks;
-    int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
-    uint64_t delay_ns;
+    int nb_sectors, sectors_per_chunk, nb_chunks, max_chunks;
+    int64_t end, sector_num, next_chunk, next_sector, dirty_end;
+    uint64_t delay_ns, dirty_count;
     MirrorOp *op;
 
-    s->sector_num = hbitmap_iter_next(&s->hbi);
+    /* Take a whole run of dirty sectors at once, so that the loop below
+     * does not have to look up the bitmap for every chunk.
+     */
+    s->sector_num = hbitmap_iter_next_extent(&s->hbi, &dirty_count);
     if (s->sector_num < 0) {
         bdrv_dirty_iter_init(source, s->dirty_bitmap, &s->hbi);
-        s->sector_num = hbitmap_iter_next(&s->hbi);
+        s->sector_num = hbitmap_iter_next_extent(&s->hbi, &dirty_count);
         trace_mirror_restart_iter(s,
                                   bdrv_get_dirty_count(source, s->dirty_bitmap));
         assert(s->sector_num >= 0);
     }
 
-    hbitmap_next_sector = s->sector_num;
+    dirty_end = s->sector_num + dirty_count;
     sector_num = s->sector_num;
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     end = s->common.len >> BDRV_SECTOR_BITS;
@@ -185,8 +233,12 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
      *
      * We also want to extend the QEMUIOVector to include more adjacent
      * dirty blocks if possible, to limit the number of I/O operations and
-     * run efficiently even with a small granularity.
+     * run efficiently even with a small granularity.  The buffer is shared
+     * out between the operations allowed in flight, so large contiguous
+     * dirty ranges become large copies when the target only takes a few
+     * requests at a time, and many smaller ones when it takes more.
      */
+    max_chunks = MAX(1, s->buf_size / s->granularity / s->max_in_flight);
     nb_chunks = 0;
     nb_sectors = 0;
     next_sector = sector_num;
@@ -201,7 +253,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     do {
         int added_sectors, added_chunks;
 
-        if (!bdrv_get_dirty(source, s->dirty_bitmap, next_sector) ||
+        if (next_sector >= dirty_end ||
             test_bit(next_chunk, s->in_flight_bitmap)) {
             assert(nb_sectors > 0);
             break;
@@ -237,6 +289,9 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
             break;
         }
+        if (nb_chunks > 0 && nb_chunks + added_chunks > max_chunks) {
+            break;
+        }
 
         /* We have enough free space to copy these sectors.  */
         bitmap_set(s->in_flight_bitmap, next_chunk, added_chunks);
@@ -257,12 +312,12 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     op->s = s;
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
      */
     qemu_iovec_init(&op->qiov, nb_chunks);
-    next_sector = sector_num;
     while (nb_chunks-- > 0) {
         MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
         size_t remaining = (nb_sectors * BDRV_SECTOR_SIZE) - op->qiov.size;
@@ -270,20 +325,21 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
         s->buf_free_count--;
         qemu_iovec_add(&op->qiov, buf, MIN(s->granularity, remaining));
-
-        /* Advance the HBitmapIter in parallel, so that we do not examine
-         * the same sector twice.
-         */
-        if (next_sector > hbitmap_next_sector
-            && bdrv_get_dirty(source, s->dirty_bitmap, next_sector)) {
-            hbitmap_next_sector = hbitmap_iter_next(&s->hbi);
-        }
-
-        next_sector += sectors_per_chunk;
     }
 
     bdrv_reset_dirty(source, sector_num, nb_sectors);
 
+    /* Resume the walk right after the copied sectors.  This picks up the
+     * rest of the run if it did not fit, and drops the words the iterator
+     * cached before the reset.
+     */
+    next_sector = sector_num + nb_sectors;
+    if (next_sector < end) {
+        bdrv_set_dirty_iter(&s->hbi, next_sector);
+    } else {
+        bdrv_dirty_iter_init(source, s->dirty_bitmap, &s->hbi);
+    }
+
     /* Copy the dirty cluster.  */
     s->in_flight++;
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
@@ -414,7 +470,7 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
                 qemu_coroutine_yield();
@@ -651,6 +707,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->base = base;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->max_in_flight = DEFAULT_IN_FLIGHT;
 
     s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, errp);
     if (!s->dirty_bitmap) {
@@ -293,8 +293,30 @@ void bdrv_query_info(BlockDriverState *bs,
     qapi_free_BlockInfo(info);
 }
 
-static BlockStats *bdrv_query_stats(const BlockDriverState *bs)
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
 {
+    BlockLatencyHistogramInfo *info = g_new0(BlockLatencyHistogramInfo, 1);
+    uint64List **boundaries = &info->boundaries;
+    uint64List **bins = &info->bins;
+    int i;
+
+    for (i = 0; i < hist->nbins; i++) {
+        if (i < hist->nbins - 1) {
+            *boundaries = g_new0(uint64List, 1);
+            (*boundaries)->value = hist->boundaries[i];
+            boundaries = &(*boundaries)->next;
+        }
+        *bins = g_new0(uint64List, 1);
+        (*bins)->value = hist->bins[i];
+        bins = &(*bins)->next;
+    }
+    return info;
+}
+
+static BlockStats *bdrv_query_stats(BlockDriverState *bs)
+{
+    BlockLatencyHistogram *hist = bs->latency_histogram;
     BlockStats *s;
 
     s = g_malloc0(sizeof(*s));
@@ -315,6 +337,26 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (hist[BDRV_ACCT_READ].bins) {
+        s->stats->has_rd_latency_histogram = true;
+        s->stats->rd_latency_histogram =
+            bdrv_latency_histogram_info(&hist[BDRV_ACCT_READ]);
+    }
+    if (hist[BDRV_ACCT_WRITE].bins) {
+        s->stats->has_wr_latency_histogram = true;
+        s->stats->wr_latency_histogram =
+            bdrv_latency_histogram_info(&hist[BDRV_ACCT_WRITE]);
+    }
+    if (hist[BDRV_ACCT_FLUSH].bins) {
+        s->stats->has_flush_latency_histogram = true;
+        s->stats->flush_latency_histogram =
+            bdrv_latency_histogram_info(&hist[BDRV_ACCT_FLUSH]);
+    }
+
+    if (bs->drv && bs->drv->bdrv_get_stats) {
+        bs->drv->bdrv_get_stats(bs, s->stats);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file);
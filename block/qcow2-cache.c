@@ -27,34 +27,139 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found through a hash table keyed by their offset, and
+ * replaced in least recently used order.  Entries with offset 0 are unused
+ * and not hashed.  All tables live in one array, so that the entry of a
+ * table pointer passed to qcow2_cache_put() is found without a search.
+ */
+
 typedef struct Qcow2CachedTable {
     void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int     hash_next;      /* next entry in the same bucket, or -1 */
+    int     lru_prev;       /* towards the least recently used, or -1 */
+    int     lru_next;       /* towards the most recently used, or -1 */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    void*                   table_array;
+    int*                    buckets;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
+    unsigned                hash_mask;
+    int                     lru_first;
+    int                     lru_last;
     bool                    depends_on_flush;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset / c->table_size) * 0x9e3779b97f4a7c15ULL >> 32) &
+           c->hash_mask;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned h = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static int qcow2_cache_hash_find(Qcow2Cache *c, uint64_t offset)
 {
-    BDRVQcowState *s = bs->opaque;
-    Qcow2Cache *c;
     int i;
 
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Makes entry i the most recently used one */
+static void qcow2_cache_lru_touch(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *e = &c->entries[i];
+
+    if (c->lru_last == i) {
+        return;
+    }
+
+    if (e->lru_prev >= 0) {
+        c->entries[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        c->lru_first = e->lru_next;
+    }
+    c->entries[e->lru_next].lru_prev = e->lru_prev;
+
+    e->lru_prev = c->lru_last;
+    e->lru_next = -1;
+    c->entries[c->lru_last].lru_next = i;
+    c->lru_last = i;
+}
+
+static inline int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t delta = (uint8_t *)table - (uint8_t *)c->table_array;
+    int i = delta / c->table_size;
+
+    assert(delta >= 0 && i < c->size && delta % c->table_size == 0);
+    return i;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+    int table_size)
+{
+    Qcow2Cache *c;
+    int i, buckets;
+
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_size = table_size;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_array = qemu_blockalign(bs, (size_t)num_tables * table_size);
+
+    buckets = pow2floor(num_tables);
+    if (buckets < num_tables) {
+        buckets *= 2;
+    }
+    c->hash_mask = buckets - 1;
+    c->buckets = g_malloc(sizeof(*c->buckets) * buckets);
+    for (i = 0; i < buckets; i++) {
+        c->buckets[i] = -1;
+    }
 
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].table = (uint8_t *)c->table_array +
+                              (size_t)i * table_size;
+        c->entries[i].hash_next = -1;
+        c->entries[i].lru_prev = i - 1;
+        c->entries[i].lru_next = i + 1 < c->size ? i + 1 : -1;
     }
+    c->lru_first = 0;
+    c->lru_last = c->size - 1;
 
     return c;
 }
@@ -65,15 +170,22 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -116,13 +228,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -136,7 +248,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     }
 
     ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+        c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -212,7 +324,10 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
+        c->entries[i].hash_next = -1;
+    }
+    for (i = 0; i <= c->hash_mask; i++) {
+        c->buckets[i] = -1;
     }
 
     return 0;
@@ -221,31 +336,17 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
     int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
 
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+    /* Tables in use are rare, so this normally stops at the first entry */
+    for (i = c->lru_first; i >= 0; i = c->entries[i].lru_next) {
+        if (!c->entries[i].ref) {
+            return i;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -259,11 +360,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_hash_find(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -280,26 +382,27 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, c->entries[i].table, c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    qcow2_cache_lru_touch(c, i);
     c->entries[i].ref++;
     *table = c->entries[i].table;
 
@@ -323,16 +426,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
+    int i = qcow2_cache_table_index(c, *table);
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -342,15 +437,7 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
+    int i = qcow2_cache_table_index(c, table);
 
-found:
     c->entries[i].dirty = true;
 }
@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
@@ -617,6 +618,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
     s->l2_size = 1 << s->l2_bits;
+    s->l2_slice_bits = MIN(s->l2_bits, L2_SLICE_BITS);
+    s->l2_slice_size = 1 << s->l2_slice_bits;
     bs->total_sectors = header.size / 512;
     s->csize_shift = (62 - (s->cluster_bits - 8));
     s->csize_mask = (1 << (s->cluster_bits - 8)) - 1;
@@ -702,8 +705,11 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    s->l2_table_cache = qcow2_cache_create(bs,
+        L2_CACHE_SIZE << (s->l2_bits - s->l2_slice_bits),
+        s->l2_slice_size * sizeof(uint64_t));
+    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
+                                                 s->cluster_size);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -1946,12 +1952,63 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
+/* Deflates one cluster into dest, which has room for size bytes.  Returns
+ * the compressed length, -ENOSPC if the data does not get any smaller, or
+ * -EINVAL on zlib errors. */
+static ssize_t qcow2_compress(void *dest, const void *src, size_t size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END && strm.next_out - (uint8_t *)dest < size) {
+        ret = strm.next_out - (uint8_t *)dest;
+    } else if (ret == Z_STREAM_END || ret == Z_OK) {
+        ret = -ENOSPC;
+    } else {
+        ret = -EINVAL;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    const void *src;
+    size_t size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = qcow2_compress(data->dest, data->src, data->size);
+    return 0;
+}
+
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    bool in_co = qemu_in_coroutine();
+    int ret;
+    ssize_t out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
@@ -1981,47 +2038,48 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    if (in_co) {
+        /* Several coroutines may be writing compressed clusters at the same
+         * time (qemu-img convert -m), so deflate in the thread pool and let
+         * the others run meanwhile. */
+        ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        Qcow2CompressData data = {
+            .dest = out_buf,
+            .src = buf,
+            .size = s->cluster_size,
+        };
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+        thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+        out_len = data.ret;
+    } else {
+        out_len = qcow2_compress(out_buf, buf, s->cluster_size);
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len == -ENOSPC) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (out_len < 0) {
+        ret = -EINVAL;
+        goto fail;
     } else {
+        if (in_co) {
+            qemu_co_mutex_lock(&s->lock);
+        }
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
         if (!cluster_offset) {
             ret = -EIO;
-            goto fail;
+        } else {
+            cluster_offset &= s->cluster_offset_mask;
+            ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset,
+                                                out_len);
+        }
+        if (in_co) {
+            qemu_co_mutex_unlock(&s->lock);
         }
-        cluster_offset &= s->cluster_offset_mask;
-
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
         if (ret < 0) {
             goto fail;
         }
@@ -2100,6 +2158,24 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static void qcow2_get_stats(BlockDriverState *bs, BlockDeviceStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t hits, misses;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &hits, &misses);
+    stats->has_l2_cache_hits = true;
+    stats->l2_cache_hits = hits;
+    stats->has_l2_cache_misses = true;
+    stats->l2_cache_misses = misses;
+
+    qcow2_cache_get_stats(s->refcount_block_cache, &hits, &misses);
+    stats->has_refcount_cache_hits = true;
+    stats->refcount_cache_hits = hits;
+    stats->has_refcount_cache_misses = true;
+    stats->refcount_cache_misses = misses;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2145,6 +2221,24 @@ static int qcow2_save_vmstate(BlockDriverState *bs, QEMUIOVector *qiov,
     return ret;
 }
 
+static coroutine_fn int qcow2_co_save_vmstate(BlockDriverState *bs,
+                                              QEMUIOVector *qiov, int64_t pos)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if ((pos | qiov->size) & (BDRV_SECTOR_SIZE - 1)) {
+        return qcow2_save_vmstate(bs, qiov, pos);
+    }
+
+    /* Straight to qcow2_co_writev(): bdrv_pwritev() would need the changes
+     * to bs of qcow2_save_vmstate() to write past the end of the disk,
+     * which concurrent requests would undo under each other's feet */
+    BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_SAVE);
+    return qcow2_co_writev(bs, (qcow2_vm_state_offset(s) + pos)
+                                >> BDRV_SECTOR_BITS,
+                           qiov->size >> BDRV_SECTOR_BITS, qiov);
+}
+
 static int qcow2_load_vmstate(BlockDriverState *bs, uint8_t *buf,
                               int64_t pos, int size)
 {
@@ -2443,8 +2537,10 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_stats         = qcow2_get_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
+    .bdrv_co_save_vmstate = qcow2_co_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
 
     .supports_backing           = true,
@@ -66,6 +66,9 @@
 
 #define L2_CACHE_SIZE 16
 
+/* The L2 cache holds slices of at most 512 entries (4 KB) of an L2 table */
+#define L2_SLICE_BITS 9
+
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
@@ -211,6 +214,8 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_bits;
+    int l2_slice_size;
     int l1_size;
     int l1_vm_state_index;
     int csize_shift;
@@ -411,6 +416,20 @@ static inline int offset_to_l2_index(BDRVQcowState *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
+/* Returns the image file offset of the L2 slice that maps offset */
+static inline uint64_t l2_slice_offset(BDRVQcowState *s, uint64_t l2_offset,
+                                       int64_t offset)
+{
+    int l2_index = offset_to_l2_index(s, offset);
+
+    return l2_offset + (l2_index & ~(s->l2_slice_size - 1)) * sizeof(uint64_t);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -541,8 +560,10 @@ void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+    int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
@@ -48,6 +48,10 @@
  * start reading the L2 table from the image file.  The first to finish will
  * commit its L2 table into the cache.  When the second tries to commit its
  * table will be deleted in favor of the existing cache entry.
+ *
+ * Entries are looked up through a hash table keyed by L2 table offset.  The
+ * entry list is kept in least recently used order so that eviction drops the
+ * tables that have gone unused the longest.
  */
 
 #include "trace.h"
@@ -56,12 +60,22 @@
 /* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
 #define MAX_L2_CACHE_SIZE 50
 
+static unsigned int qed_l2_cache_hash(uint64_t offset)
+{
+    return (offset * 0x9e3779b97f4a7c15ULL) >> (64 - QED_L2_CACHE_HASH_BITS);
+}
+
 /**
  * Initialize the L2 cache
  */
 void qed_init_l2_cache(L2TableCache *l2_cache)
 {
+    int i;
+
     QTAILQ_INIT(&l2_cache->entries);
+    for (i = 0; i < ARRAY_SIZE(l2_cache->buckets); i++) {
+        QLIST_INIT(&l2_cache->buckets[i]);
+    }
     l2_cache->n_entries = 0;
 }
 
@@ -126,10 +140,15 @@ CachedL2Table *qed_find_l2_cache_entry(L2TableCache *l2_cache, uint64_t offset)
 {
     CachedL2Table *entry;
 
-    QTAILQ_FOREACH(entry, &l2_cache->entries, node) {
+    QLIST_FOREACH(entry, &l2_cache->buckets[qed_l2_cache_hash(offset)],
+                  hash_node) {
         if (entry->offset == offset) {
             trace_qed_find_l2_cache_entry(l2_cache, entry, offset, entry->ref);
             entry->ref++;
+
+            /* Move to the most recently used end */
+            QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+            QTAILQ_INSERT_TAIL(&l2_cache->entries, entry, node);
             return entry;
         }
     }
@@ -172,6 +191,7 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
             }
 
             QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+            QLIST_REMOVE(entry, hash_node);
             l2_cache->n_entries--;
             qed_unref_l2_cache_entry(entry);
 
@@ -184,4 +204,6 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
 
     l2_cache->n_entries++;
     QTAILQ_INSERT_TAIL(&l2_cache->entries, l2_table, node);
+    QLIST_INSERT_HEAD(&l2_cache->buckets[qed_l2_cache_hash(l2_table->offset)],
+                      l2_table, hash_node);
 }
@@ -935,9 +935,16 @@ static void qed_aio_complete_bh(void *opaque)
 static void qed_aio_complete(QEDAIOCB *acb, int ret)
 {
     BDRVQEDState *s = acb_to_s(acb);
+    QEDAIOCB *merged;
 
     trace_qed_aio_complete(s, acb, ret);
 
+    /* Requests coalesced into this one share its outcome */
+    while ((merged = QSIMPLEQ_FIRST(&acb->coalesced_reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&acb->coalesced_reqs, next);
+        qed_aio_complete(merged, ret);
+    }
+
     /* Free resources */
     qemu_iovec_destroy(&acb->cur_qiov);
     qed_unref_l2_cache_entry(acb->request.l2_table);
@@ -1172,6 +1179,74 @@ static void qed_aio_write_zero_cluster(void *opaque, int ret)
     qed_aio_write_l2_update(acb, 0, 1);
 }
 
+/**
+ * Merge queued allocating writes that continue this one
+ *
+ * @acb:        Allocating write request at the head of the queue
+ * @len:        Length in bytes of the current part of @acb
+ *
+ * When an image is populated sequentially, the queue of allocating writes
+ * typically holds requests that pick up exactly where the current one ends.
+ * Their data is appended to acb->cur_qiov so that the whole run gets a single
+ * cluster allocation, one data write and one L2 table update.  A request is
+ * only merged as a whole, when it lies within the same L2 table and its
+ * clusters are still unallocated.  Merged requests complete with @acb.
+ *
+ * Returns the number of bytes added to the current I/O.
+ */
+static size_t qed_coalesce_allocating_writes(QEDAIOCB *acb, size_t len)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+    unsigned int l1_index = qed_l1_index(s, acb->cur_pos);
+    uint64_t end = acb->cur_pos + len;
+    size_t added = 0;
+    QEDAIOCB *req;
+
+    /* Only the final part of a request can be followed by another one */
+    if (end != acb->end_pos || (acb->flags & QED_AIOCB_ZERO)) {
+        return 0;
+    }
+
+    while ((req = QSIMPLEQ_NEXT(acb, next)) != NULL) {
+        uint64_t req_len = req->end_pos - req->cur_pos;
+        unsigned int i, first, last;
+
+        if (req->cur_pos != end || (req->flags & QED_AIOCB_ZERO) ||
+            qed_l1_index(s, req->end_pos - 1) != l1_index ||
+            acb->cur_qiov.niov + req->qiov->niov > IOV_MAX) {
+            break;
+        }
+
+        /* Without a new L2 table, check that nothing was allocated since */
+        if (acb->find_cluster_ret != QED_CLUSTER_L1) {
+            QEDTable *table = acb->request.l2_table->table;
+
+            first = qed_l2_index(s, req->cur_pos);
+            last = qed_l2_index(s, req->end_pos - 1);
+            for (i = first; i <= last; i++) {
+                if (!qed_offset_is_unalloc_cluster(table->offsets[i]) &&
+                    !qed_offset_is_zero_cluster(table->offsets[i])) {
+                    break;
+                }
+            }
+            if (i <= last) {
+                break;
+            }
+        }
+
+        trace_qed_aio_write_coalesce(s, acb, req, req_len);
+
+        QSIMPLEQ_REMOVE(&s->allocating_write_reqs, req, QEDAIOCB, next);
+        QSIMPLEQ_INSERT_TAIL(&acb->coalesced_reqs, req, next);
+        qemu_iovec_concat(&acb->cur_qiov, req->qiov, req->qiov_offset,
+                          req_len);
+        end += req_len;
+        added += req_len;
+    }
+
+    return added;
+}
+
 /**
  * Write new data cluster
  *
@@ -1199,9 +1274,10 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
         return; /* wait for existing request to finish */
     }
 
+    qemu_iovec_concat(&acb->cur_qiov, acb->qiov, acb->qiov_offset, len);
+    len += qed_coalesce_allocating_writes(acb, len);
     acb->cur_nclusters = qed_bytes_to_clusters(s,
             qed_offset_into_cluster(s, acb->cur_pos) + len);
-    qemu_iovec_concat(&acb->cur_qiov, acb->qiov, acb->qiov_offset, len);
 
     if (acb->flags & QED_AIOCB_ZERO) {
         /* Skip ahead if the clusters are already zero */
@@ -1399,6 +1475,7 @@ static BlockDriverAIOCB *qed_aio_setup(BlockDriverState *bs,
     acb->end_pos = acb->cur_pos + nb_sectors * BDRV_SECTOR_SIZE;
     acb->backing_qiov = NULL;
     acb->request.l2_table = NULL;
+    QSIMPLEQ_INIT(&acb->coalesced_reqs);
     qemu_iovec_init(&acb->cur_qiov, qiov->niov);
 
     /* Start request */
@@ -110,11 +110,15 @@ typedef struct CachedL2Table {
     QEDTable *table;
     uint64_t offset;    /* offset=0 indicates an invalidate entry */
     QTAILQ_ENTRY(CachedL2Table) node;
+    QLIST_ENTRY(CachedL2Table) hash_node;
     int ref;
 } CachedL2Table;
 
+#define QED_L2_CACHE_HASH_BITS 6
+
 typedef struct {
-    QTAILQ_HEAD(, CachedL2Table) entries;
+    QTAILQ_HEAD(, CachedL2Table) entries;   /* least recently used first */
+    QLIST_HEAD(, CachedL2Table) buckets[1 << QED_L2_CACHE_HASH_BITS];
     unsigned int n_entries;
 } L2TableCache;
 
@@ -148,6 +152,9 @@ typedef struct QEDAIOCB {
     unsigned int cur_nclusters;     /* number of clusters being accessed */
     int find_cluster_ret;           /* used for L1/L2 update */
 
+    /* Queued allocating writes whose data was merged into this request */
+    QSIMPLEQ_HEAD(, QEDAIOCB) coalesced_reqs;
+
     QEDRequest request;
 } QEDAIOCB;
 
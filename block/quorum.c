@@ -18,12 +18,17 @@
 #include "block/block_int.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
+#include "qemu/timer.h"
 
 #define HASH_LENGTH 32
 
 #define QUORUM_OPT_VOTE_THRESHOLD "vote-threshold"
 #define QUORUM_OPT_BLKVERIFY      "blkverify"
 #define QUORUM_OPT_REWRITE        "rewrite-corrupted"
+#define QUORUM_OPT_READ_PATTERN   "read-pattern"
+
+/* A failed read counts as a read this slow in the latency of a child */
+#define QUORUM_ERROR_LATENCY_NS   1000000000LL
 
 /* This union holds a vote hash value */
 typedef union QuorumVoteValue {
@@ -74,6 +79,15 @@ typedef struct BDRVQuorumState {
     bool rewrite_corrupted;/* true if the driver must rewrite-on-read corrupted
                             * block if Quorum is reached.
                             */
+
+    QuorumReadPattern read_pattern; /* all patterns but quorum read from a
+                                     * single child at a time and only try
+                                     * another one when the read fails
+                                     */
+    int next_child;        /* first child tried by the next round-robin read */
+    int64_t *latency_ns;   /* per child average read latency, 0 until the
+                            * first read
+                            */
 } BDRVQuorumState;
 
 typedef struct QuorumAIOCB QuorumAIOCB;
@@ -117,6 +131,7 @@ struct QuorumAIOCB {
 
     bool is_read;
     int vote_ret;
+    int64_t start_ns;           /* start of the single child read */
 };
 
 static bool quorum_vote(QuorumAIOCB *acb);
@@ -129,7 +144,9 @@ static void quorum_aio_cancel(BlockDriverAIOCB *blockacb)
 
     /* cancel all callbacks */
     for (i = 0; i < s->num_children; i++) {
-        bdrv_aio_cancel(acb->qcrs[i].aiocb);
+        if (acb->qcrs[i].aiocb) {
+            bdrv_aio_cancel(acb->qcrs[i].aiocb);
+        }
     }
 
     g_free(acb->qcrs);
@@ -152,7 +169,7 @@ static void quorum_aio_finalize(QuorumAIOCB *acb)
 
     acb->common.cb(acb->common.opaque, ret);
 
-    if (acb->is_read) {
+    if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
         for (i = 0; i < s->num_children; i++) {
             qemu_vfree(acb->qcrs[i].buf);
             qemu_iovec_destroy(&acb->qcrs[i].qiov);
@@ -615,6 +632,82 @@ free_exit:
     return rewrite;
 }
 
+static void quorum_update_latency(BDRVQuorumState *s, int i, int64_t ns)
+{
+    if (!s->latency_ns[i]) {
+        s->latency_ns[i] = ns;
+    } else {
+        s->latency_ns[i] = (s->latency_ns[i] * 7 + ns) / 8;
+    }
+}
+
+static void quorum_single_read(QuorumAIOCB *acb, int i);
+
+static void quorum_single_aio_cb(void *opaque, int ret)
+{
+    QuorumChildRequest *sacb = opaque;
+    QuorumAIOCB *acb = sacb->parent;
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int i = sacb - acb->qcrs;
+
+    sacb->aiocb = NULL;
+    sacb->ret = ret;
+    acb->count++;
+    quorum_update_latency(s, i, ret ? QUORUM_ERROR_LATENCY_NS :
+                          qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                          acb->start_ns);
+
+    if (ret) {
+        quorum_report_bad(acb, s->bs[i]->node_name, ret);
+
+        /* try the next child until each one has failed */
+        if (acb->count < s->num_children) {
+            quorum_single_read(acb, (i + 1) % s->num_children);
+            return;
+        }
+        acb->vote_ret = quorum_vote_error(acb);
+        quorum_report_failure(acb);
+    }
+
+    quorum_aio_finalize(acb);
+}
+
+/* Reads straight into the caller's vector: the data of a failed read is
+ * overwritten by the next one */
+static void quorum_single_read(QuorumAIOCB *acb, int i)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+
+    acb->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    acb->qcrs[i].aiocb = bdrv_aio_readv(s->bs[i], acb->sector_num, acb->qiov,
+                                        acb->nb_sectors, quorum_single_aio_cb,
+                                        &acb->qcrs[i]);
+}
+
+static int quorum_first_child(BDRVQuorumState *s)
+{
+    int i, best = 0;
+
+    switch (s->read_pattern) {
+    case QUORUM_READ_PATTERN_ROUND_ROBIN:
+        best = s->next_child;
+        s->next_child = (s->next_child + 1) % s->num_children;
+        break;
+    case QUORUM_READ_PATTERN_LATENCY:
+        /* children not read yet come first, so that each gets measured */
+        for (i = 1; i < s->num_children; i++) {
+            if (s->latency_ns[i] < s->latency_ns[best]) {
+                best = i;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    return best;
+}
+
 static BlockDriverAIOCB *quorum_aio_readv(BlockDriverState *bs,
                                          int64_t sector_num,
                                          QEMUIOVector *qiov,
@@ -629,6 +722,11 @@ static BlockDriverAIOCB *quorum_aio_readv(BlockDriverState *bs,
 
     acb->is_read = true;
 
+    if (s->read_pattern != QUORUM_READ_PATTERN_QUORUM) {
+        quorum_single_read(acb, quorum_first_child(s));
+        return &acb->common;
+    }
+
     for (i = 0; i < s->num_children; i++) {
         acb->qcrs[i].buf = qemu_blockalign(s->bs[i], qiov->size);
         qemu_iovec_init(&acb->qcrs[i].qiov, qiov->niov);
@@ -782,10 +880,34 @@ static QemuOptsList quorum_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Rewrite corrupted block on read quorum",
         },
+        {
+            .name = QUORUM_OPT_READ_PATTERN,
+            .type = QEMU_OPT_STRING,
+            .help = "Allowed pattern: quorum, fifo, round-robin, latency. "
+                    "Quorum is default",
+        },
         { /* end of list */ }
     },
 };
 
+static int parse_read_pattern(const char *opt)
+{
+    int i;
+
+    if (!opt) {
+        /* Set quorum as default */
+        return QUORUM_READ_PATTERN_QUORUM;
+    }
+
+    for (i = 0; i < QUORUM_READ_PATTERN_MAX; i++) {
+        if (!strcmp(opt, QuorumReadPattern_lookup[i])) {
+            return i;
+        }
+    }
+
+    return -EINVAL;
+}
+
 static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
                        Error **errp)
 {
@@ -851,8 +973,27 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
         goto exit;
     }
 
+    ret = parse_read_pattern(qemu_opt_get(opts, QUORUM_OPT_READ_PATTERN));
+    if (ret < 0) {
+        error_setg(&local_err, "Please set read-pattern as quorum, fifo, "
+                   "round-robin or latency");
+        goto exit;
+    }
+    s->read_pattern = ret;
+    ret = 0;
+
+    /* reads from a single child give nothing to compare or vote on */
+    if (s->read_pattern != QUORUM_READ_PATTERN_QUORUM &&
+        (s->is_blkverify || s->rewrite_corrupted)) {
+        error_setg(&local_err, "blkverify=on and rewrite-corrupted=on need "
+                   "read-pattern=quorum");
+        ret = -EINVAL;
+        goto exit;
+    }
+
     /* allocate the children BlockDriverState array */
     s->bs = g_new0(BlockDriverState *, s->num_children);
+    s->latency_ns = g_new0(int64_t, s->num_children);
     opened = g_new0(bool, s->num_children);
 
     for (i = 0, lentry = qlist_first(list); lentry;
@@ -901,6 +1042,7 @@ close_exit:
         bdrv_unref(s->bs[i]);
     }
     g_free(s->bs);
+    g_free(s->latency_ns);
     g_free(opened);
 exit:
     /* propagate error */
@@ -922,6 +1064,7 @@ static void quorum_close(BlockDriverState *bs)
     }
 
     g_free(s->bs);
+    g_free(s->latency_ns);
 }
 
 static void quorum_detach_aio_context(BlockDriverState *bs)
@@ -23,6 +23,12 @@ enum {
      * contiguous regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /*
+     * Number of copy-on-read requests kept in flight ahead of the allocation
+     * scan, so that the latency of a remote backing file is overlapped.
+     */
+    STREAM_MAX_IN_FLIGHT = 4,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -33,8 +39,22 @@ typedef struct StreamBlockJob {
     BlockDriverState *base;
     BlockdevOnError on_error;
     char *backing_file_str;
+
+    void *buf_free[STREAM_MAX_IN_FLIGHT];
+    int buf_free_count;
+    int in_flight;
+    bool waiting;               /* stream_run waits for in_flight to drop */
+    int ret;                    /* first failure of a request in flight */
+    int64_t error_sector;       /* ...and where it occurred */
 } StreamBlockJob;
 
+typedef struct StreamOp {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    void *buf;
+} StreamOp;
+
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -51,6 +71,56 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+static void coroutine_fn stream_co_populate(void *opaque)
+{
+    StreamOp *op = opaque;
+    StreamBlockJob *s = op->s;
+    int ret;
+
+    ret = stream_populate(s->common.bs, op->sector_num, op->nb_sectors,
+                          op->buf);
+    trace_stream_populate_done(s, op->sector_num, op->nb_sectors, ret);
+    if (ret < 0 && (s->ret == 0 || op->sector_num < s->error_sector)) {
+        s->ret = ret;
+        s->error_sector = op->sector_num;
+    }
+
+    s->buf_free[s->buf_free_count++] = op->buf;
+    s->in_flight--;
+    g_free(op);
+
+    if (s->waiting) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn stream_wait_in_flight(StreamBlockJob *s, int max)
+{
+    while (s->in_flight > max) {
+        s->waiting = true;
+        qemu_coroutine_yield();
+        s->waiting = false;
+    }
+}
+
+/* Starts copying [sector_num, sector_num + nb_sectors) in the background */
+static void coroutine_fn stream_start_populate(StreamBlockJob *s,
+                                               int64_t sector_num,
+                                               int nb_sectors)
+{
+    StreamOp *op;
+
+    stream_wait_in_flight(s, STREAM_MAX_IN_FLIGHT - 1);
+
+    op = g_new(StreamOp, 1);
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->buf = s->buf_free[--s->buf_free_count];
+    s->in_flight++;
+    qemu_coroutine_enter(qemu_coroutine_create(stream_co_populate), op);
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -88,7 +158,7 @@ static void coroutine_fn stream_run(void *opaque)
     int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
+    int i;
 
     if (!bs->backing_hd) {
         block_job_completed(&s->common, 0);
@@ -102,7 +172,10 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    for (i = 0; i < STREAM_MAX_IN_FLIGHT; i++) {
+        s->buf_free[s->buf_free_count++] = qemu_blockalign(bs,
+                                                           STREAM_BUFFER_SIZE);
+    }
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -113,13 +186,20 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    /* Up to STREAM_MAX_IN_FLIGHT copies run in the background while the loop
+     * goes on scanning the allocation status.  When one of them fails, the
+     * loop waits for the others and handles the error as if it had just
+     * occurred; on stop, it resumes at the first sector that failed.
+     */
+    for (sector_num = 0; sector_num < end || s->in_flight || s->ret < 0;
+         sector_num += n) {
         uint64_t delay_ns = 0;
         bool copy;
 
 wait:
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  Copies in flight do not
+         * hold it up, because they do not wait for this coroutine.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
@@ -128,24 +208,30 @@ wait:
 
         copy = false;
 
-        ret = bdrv_is_allocated(bs, sector_num,
-                                STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-        } else if (ret >= 0) {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_is_allocated_above(bs->backing_hd, base,
-                                          sector_num, n, &n);
-
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = end - sector_num;
-            }
+        if (s->ret < 0 || sector_num >= end) {
+            stream_wait_in_flight(s, 0);
+            n = 0;
+            ret = s->ret;
+        } else {
+            ret = bdrv_is_allocated(bs, sector_num,
+                                    STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
+            if (ret == 1) {
+                /* Allocated in the top, no need to copy.  */
+            } else if (ret >= 0) {
+                /* Copy if allocated in the intermediate images.  Limit to the
+                 * known-unallocated area [sector_num, sector_num+n).  */
+                ret = bdrv_is_allocated_above(bs->backing_hd, base,
+                                              sector_num, n, &n);
+
+                /* Finish early if end of backing file has been reached */
+                if (ret == 0 && n == 0) {
+                    n = end - sector_num;
+                }
 
-            copy = (ret == 1);
+                copy = (ret == 1);
+            }
+            trace_stream_one_iteration(s, sector_num, n, ret);
         }
-        trace_stream_one_iteration(s, sector_num, n, ret);
         if (copy) {
             if (s->common.speed) {
                 delay_ns = ratelimit_calculate_delay(&s->limit, n);
@@ -153,16 +239,24 @@ wait:
                     goto wait;
                 }
             }
-            ret = stream_populate(bs, sector_num, n, buf);
+            stream_start_populate(s, sector_num, n);
         }
         if (ret < 0) {
             BlockErrorAction action =
                 block_job_error_action(&s->common, s->common.bs, s->on_error,
                                        true, -ret);
             if (action == BLOCK_ERROR_ACTION_STOP) {
+                if (s->ret < 0) {
+                    /* Copies after the failed one are found allocated in
+                     * the top when scanning them again. */
+                    sector_num = s->error_sector;
+                    s->common.offset = sector_num * BDRV_SECTOR_SIZE;
+                    s->ret = 0;
+                }
                 n = 0;
                 continue;
             }
+            s->ret = 0;
             if (error == 0) {
                 error = ret;
             }
@@ -176,6 +270,12 @@ wait:
         s->common.offset += n * BDRV_SECTOR_SIZE;
     }
 
+    stream_wait_in_flight(s, 0);
+    if (s->ret < 0 && error == 0) {
+        /* failed after the loop was cancelled or reported an error */
+        error = s->ret;
+    }
+
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
@@ -195,7 +295,9 @@ wait:
         close_unused_images(bs, base, base_id);
     }
 
-    qemu_vfree(buf);
+    while (s->buf_free_count) {
+        qemu_vfree(s->buf_free[--s->buf_free_count]);
+    }
     g_free(s->backing_file_str);
     block_job_completed(&s->common, ret);
 }
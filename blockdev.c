@@ -1793,6 +1793,77 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
     return 0;
 }
 
+static bool check_latency_histogram_boundaries(uint64List *boundaries,
+                                               Error **errp)
+{
+    uint64_t prev = 0;
+
+    for (; boundaries; boundaries = boundaries->next) {
+        if (boundaries->value <= prev) {
+            error_setg(errp, "latency histogram boundaries must be positive "
+                       "and strictly increasing");
+            return false;
+        }
+        prev = boundaries->value;
+    }
+    return true;
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+    bool has[BDRV_MAX_IOTYPE];
+    uint64List *lists[BDRV_MAX_IOTYPE];
+    int i;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    has[BDRV_ACCT_READ] = has_boundaries_read;
+    lists[BDRV_ACCT_READ] = boundaries_read;
+    has[BDRV_ACCT_WRITE] = has_boundaries_write;
+    lists[BDRV_ACCT_WRITE] = boundaries_write;
+    has[BDRV_ACCT_FLUSH] = has_boundaries_flush;
+    lists[BDRV_ACCT_FLUSH] = boundaries_flush;
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        if (!has[i]) {
+            has[i] = has_boundaries;
+            lists[i] = boundaries;
+        }
+        if (!check_latency_histogram_boundaries(lists[i], errp)) {
+            return;
+        }
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        if (has[i]) {
+            bdrv_latency_histogram_set(bs, i, lists[i]);
+        } else if (!has_boundaries_read && !has_boundaries_write &&
+                   !has_boundaries_flush && !has_boundaries) {
+            bdrv_latency_histogram_clear(bs, i);
+        }
+    }
+
+    aio_context_release(aio_context);
+}
+
 void qmp_block_resize(bool has_device, const char *device,
                       bool has_node_name, const char *node_name,
                       int64_t size, Error **errp)
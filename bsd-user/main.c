@@ -35,6 +35,8 @@
 #include "qemu/envlist.h"
 
 int singlestep;
+int tb_hot_count;
+const char *tb_coverage_file;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long mmap_min_addr;
 unsigned long guest_base;
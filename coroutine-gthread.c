@@ -70,8 +70,10 @@ static inline void set_coroutine_key(CoroutineGThread *co,
     g_private_replace(&coroutine_key, co);
 }
 
-static inline GThread *create_thread(GThreadFunc func, gpointer data)
+static inline GThread *create_thread(GThreadFunc func, gpointer data,
+                                     size_t stack_size)
 {
+    /* g_thread_new() always uses the default thread stack size */
     return g_thread_new("coroutine", func, data);
 }
 
@@ -93,9 +95,10 @@ static inline void set_coroutine_key(CoroutineGThread *co,
                          free_on_thread_exit ? (GDestroyNotify)g_free : NULL);
 }
 
-static inline GThread *create_thread(GThreadFunc func, gpointer data)
+static inline GThread *create_thread(GThreadFunc func, gpointer data,
+                                     size_t stack_size)
 {
-    return g_thread_create_full(func, data, 0, TRUE, TRUE,
+    return g_thread_create_full(func, data, stack_size, TRUE, TRUE,
                                 G_THREAD_PRIORITY_NORMAL, NULL);
 }
 
@@ -136,12 +139,12 @@ static gpointer coroutine_thread(gpointer opaque)
     return NULL;
 }
 
-Coroutine *qemu_coroutine_new(void)
+Coroutine *qemu_coroutine_new(size_t stack_size)
 {
     CoroutineGThread *co;
 
     co = g_malloc0(sizeof(*co));
-    co->thread = create_thread(coroutine_thread, co);
+    co->thread = create_thread(coroutine_thread, co, stack_size);
     if (!co->thread) {
         g_free(co);
         return NULL;
@@ -144,9 +144,8 @@ static void coroutine_trampoline(int signal)
     coroutine_bootstrap(self, co);
 }
 
-Coroutine *qemu_coroutine_new(void)
+Coroutine *qemu_coroutine_new(size_t stack_size)
 {
-    const size_t stack_size = 1 << 20;
     CoroutineUContext *co;
     CoroutineThreadState *coTS;
     struct sigaction sa;
@@ -68,9 +68,8 @@ static void CALLBACK coroutine_trampoline(void *co_)
     }
 }
 
-Coroutine *qemu_coroutine_new(void)
+Coroutine *qemu_coroutine_new(size_t stack_size)
 {
-    const size_t stack_size = 1 << 20;
     CoroutineWin32 *co;
 
     co = g_malloc0(sizeof(*co));
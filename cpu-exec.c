@@ -22,6 +22,7 @@
 #include "tcg.h"
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
+#include "exec/gdbstub.h"
 
 void cpu_loop_exit(CPUState *cpu)
 {
@@ -111,64 +112,34 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     tb_free(tb);
 }
 
+/* Called with tb_lock held.  */
 static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong pc,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
     CPUState *cpu = ENV_GET_CPU(env);
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
-
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+    TranslationBlock *tb;
 
     /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
-        }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-        tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
+    tb = tb_find_physical(env, pc, cs_base, flags);
+    if (tb) {
+        cpu->jit_stats.tb_find_slow_hits++;
+    } else {
+        /* if no translated code available, then translate it now */
+        cpu->jit_stats.tb_find_slow_misses++;
+        tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
     }
     /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(cpu, pc)] = tb;
     return tb;
 }
 
-static inline TranslationBlock *tb_find_fast(CPUArchState *env)
+/* Only the owning thread fills tb_jmp_cache, other threads merely clear
+   entries of TBs they invalidate, so a hit needs no lock.  tb_lock is
+   taken for the physical lookup and translation on a miss.  */
+static inline TranslationBlock *tb_find_fast(CPUArchState *env,
+                                             volatile bool *have_tb_lock)
 {
     CPUState *cpu = ENV_GET_CPU(env);
     TranslationBlock *tb;
@@ -179,14 +150,41 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = atomic_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(cpu, pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
+        cpu->tb_jmp_cache_misses++;
+        spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+        *have_tb_lock = true;
         tb = tb_find_slow(env, pc, cs_base, flags);
+        *have_tb_lock = false;
+        spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
     }
     return tb;
 }
 
+/* Changes whenever a TB is invalidated or the whole cache is flushed, after
+   which the TBs looked up before may be gone and must not be chained.  */
+static inline unsigned int tb_generation(void)
+{
+    return atomic_read(&tcg_ctx.tb_ctx.tb_phys_invalidate_count) +
+           atomic_read(&tcg_ctx.tb_ctx.tb_flush_count);
+}
+
+/* Replace a block that became hot by its CF_TIER2 translation.
+   Called with tb_lock held.  */
+static TranslationBlock *tb_tier_up(CPUState *cpu, TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+    target_ulong cs_base = tb->cs_base;
+    int flags = tb->flags;
+
+    tb_phys_invalidate(tb, -1);
+    tb = tb_gen_code(cpu, pc, cs_base, flags, CF_TIER2);
+    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(cpu, pc)] = tb;
+    return tb;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -209,6 +207,48 @@ static void cpu_handle_debug_exception(CPUArchState *env)
     }
 }
 
+/* Called for a debug exception: if it comes from a gdb breakpoint whose
+   conditions are all false, execute the instruction under the breakpoint
+   and return true so that the CPU goes on.  */
+static bool cpu_resume_conditional_breakpoint(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    CPUBreakpoint *bp, *hit = NULL;
+    TranslationBlock *tb;
+    target_ulong pc, cs_base;
+    int flags;
+
+    if (cpu->watchpoint_hit || cpu->singlestep_enabled) {
+        return false;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    QTAILQ_FOREACH(bp, &cpu->breakpoints, entry) {
+        if (bp->pc == pc) {
+            if (hit || !(bp->flags & BP_GDB)) {
+                return false;
+            }
+            hit = bp;
+        }
+    }
+    if (!hit || gdb_breakpoint_condition(cpu, pc)) {
+        return false;
+    }
+
+    /* Translate the instruction without the breakpoint, and keep the
+       result out of the TB caches as in cpu_exec_nocache().  It is removed
+       before it runs, as the instruction may raise an exception.  */
+    QTAILQ_REMOVE(&cpu->breakpoints, hit, entry);
+    tb = tb_gen_code(cpu, pc, cs_base, flags, 1);
+    QTAILQ_INSERT_HEAD(&cpu->breakpoints, hit, entry);
+    tb_phys_invalidate(tb, -1);
+
+    cpu->current_tb = tb;
+    cpu_tb_exec(cpu, tb->tc_ptr);
+    cpu->current_tb = NULL;
+    tb_free(tb);
+    return true;
+}
+
 /* main execution loop */
 
 volatile sig_atomic_t exit_request;
@@ -227,6 +267,7 @@ int cpu_exec(CPUArchState *env)
     TranslationBlock *tb;
     uint8_t *tc_ptr;
     uintptr_t next_tb;
+    unsigned int gen, next_tb_gen = 0;
     /* This must be volatile so it is not trashed by longjmp() */
     volatile bool have_tb_lock = false;
 
@@ -292,6 +333,10 @@ int cpu_exec(CPUArchState *env)
                     /* exit request from the cpu execution loop */
                     ret = cpu->exception_index;
                     if (ret == EXCP_DEBUG) {
+                        if (cpu_resume_conditional_breakpoint(env)) {
+                            cpu->exception_index = -1;
+                            continue;
+                        }
                         cpu_handle_debug_exception(env);
                     }
                     break;
@@ -306,6 +351,7 @@ int cpu_exec(CPUArchState *env)
                     ret = cpu->exception_index;
                     break;
 #else
+                    cpu->jit_stats.exits_exception++;
                     cc->do_interrupt(cpu);
                     cpu->exception_index = -1;
 #endif
@@ -604,31 +650,54 @@ int cpu_exec(CPUArchState *env)
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
-                have_tb_lock = true;
-                tb = tb_find_fast(env);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+                gen = tb_generation();
+                tb = tb_find_fast(env, &have_tb_lock);
+                /* the count is only a heuristic, losing an increment
+                   to another thread does not matter */
+                if (unlikely(tb_is_counted(tb)) &&
+                    ++tb->exec_count >= tb_hot_count) {
+                    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+                    have_tb_lock = true;
+                    /* if another thread got there first, the block is
+                       gone from our jump cache and the tier-2 one is
+                       found next time */
+                    if (tb_generation() == gen) {
+                        /* the previous TB may be the one being replaced */
+                        next_tb = 0;
+                        tb = tb_tier_up(cpu, tb);
+                        gen = tb_generation();
+                    }
+                    have_tb_lock = false;
+                    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
                 }
                 if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
-                    qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
-                             tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
+                    if (qemu_loglevel_mask(LOG_ASYNC)) {
+                        qemu_log_async_exec(tb->tc_ptr, tb->pc);
+                    } else {
+                        qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
+                                 tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
+                    }
                 }
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
                    jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                if (next_tb != 0 && tb->page_addr[1] == -1 &&
+                    !tb_is_counted(tb)) {
+                    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+                    have_tb_lock = true;
+                    /* Either TB may have been invalidated, by this thread
+                       while translating or by another one, since the
+                       calling TB was looked up.  */
+                    if (tb_generation() == next_tb_gen) {
+                        tb_add_jump((TranslationBlock *)
+                                    (next_tb & ~TB_EXIT_MASK),
+                                    next_tb & TB_EXIT_MASK, tb);
+                        cpu->jit_stats.chained_jumps++;
+                    }
+                    have_tb_lock = false;
+                    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
                 }
-                have_tb_lock = false;
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+                next_tb_gen = gen;
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -649,6 +718,7 @@ int cpu_exec(CPUArchState *env)
                          * interrupt_request) which we will handle
                          * next time around the loop.
                          */
+                        cpu->jit_stats.exits_interrupt++;
                         tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
                         next_tb = 0;
                         break;
@@ -656,6 +726,7 @@ int cpu_exec(CPUArchState *env)
                     {
                         /* Instruction counter expired.  */
                         int insns_left;
+                        cpu->jit_stats.exits_icount++;
                         tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
                         insns_left = cpu->icount_decr.u32;
                         if (cpu->icount_extra && insns_left >= 0) {
@@ -680,6 +751,7 @@ int cpu_exec(CPUArchState *env)
                         break;
                     }
                     default:
+                        cpu->jit_stats.exits_unchained++;
                         break;
                     }
                 }
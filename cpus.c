@@ -39,6 +39,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/log.h"
 #include "qapi-event.h"
 
 #ifndef _WIN32
@@ -107,11 +108,18 @@ static int64_t qemu_icount_bias;
 static int64_t vm_clock_warp_start;
 /* Conversion factor from emulated instructions to virtual clock ticks.  */
 static int icount_time_shift;
+/* False if idle CPUs should jump straight to the next QEMU_CLOCK_VIRTUAL
+ * deadline instead of waiting for it in real time.  */
+static bool icount_sleep = true;
 /* Arbitrarily pick 1MIPS as the minimum allowable speed.  */
 #define MAX_ICOUNT_SHIFT 10
 
 /* Only written by TCG thread */
 static int64_t qemu_icount;
+/* Number of execution slices run under -icount and the instructions
+ * executed in them, reported by "info jit".  */
+static int64_t icount_slices;
+static int64_t icount_slice_insns;
 
 static QEMUTimer *icount_rt_timer;
 static QEMUTimer *icount_vm_timer;
@@ -144,7 +152,8 @@ static int64_t cpu_get_icount_locked(void)
         if (!cpu_can_do_io(cpu)) {
             fprintf(stderr, "Bad clock read\n");
         }
-        icount -= (cpu->icount_decr.u16.low + cpu->icount_extra);
+        icount -= (cpu->icount_decr.u16.low + cpu->icount_extra +
+                   cpu->icount_tb_unexecuted);
     }
     return qemu_icount_bias + (icount << icount_time_shift);
 }
@@ -399,7 +408,18 @@ void qemu_clock_warp(QEMUClockType type)
         return;
     }
 
-    if (deadline > 0) {
+    if (deadline > 0 && !icount_sleep) {
+        /*
+         * With sleep=off the VCPUs are never left waiting: skip straight
+         * to the next QEMU_CLOCK_VIRTUAL event.  Virtual time then no
+         * longer depends on host latencies, which makes long idle periods
+         * both fast and deterministic.
+         */
+        seqlock_write_lock(&timers_state.vm_clock_seqlock);
+        qemu_icount_bias += deadline;
+        seqlock_write_unlock(&timers_state.vm_clock_seqlock);
+        qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+    } else if (deadline > 0) {
         /*
          * Ensure QEMU_CLOCK_VIRTUAL proceeds even when the virtual CPU goes to
          * sleep.  Otherwise, the CPU might be waiting for a future timer
@@ -440,17 +460,51 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+static bool icount_opt_is(const char *opt, size_t len, const char *name)
+{
+    return len == strlen(name) && !strncmp(opt, name, len);
+}
+
 void configure_icount(const char *option)
 {
+    const char *opt, *next;
+    bool is_auto;
+
     seqlock_init(&timers_state.vm_clock_seqlock, NULL);
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
     if (!option) {
         return;
     }
 
+    /* -icount [N|auto][,sleep=on|off][,split=on|off] */
+    opt = strchr(option, ',');
+    is_auto = opt ? !strncmp(option, "auto", opt - option)
+                  : !strcmp(option, "auto");
+    while (opt) {
+        size_t len;
+
+        opt++;
+        next = strchr(opt, ',');
+        len = next ? next - opt : strlen(opt);
+        if (icount_opt_is(opt, len, "sleep=off")) {
+            icount_sleep = false;
+        } else if (icount_opt_is(opt, len, "split=off")) {
+            icount_no_split = true;
+        } else if (!icount_opt_is(opt, len, "sleep=on") &&
+                   !icount_opt_is(opt, len, "split=on")) {
+            fprintf(stderr, "Invalid icount option: %.*s\n", (int)len, opt);
+            exit(1);
+        }
+        opt = next;
+    }
+    if (is_auto && !icount_sleep) {
+        fprintf(stderr, "-icount auto and sleep=off are incompatible\n");
+        exit(1);
+    }
+
     icount_warp_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
                                           icount_warp_rt, NULL);
-    if (strcmp(option, "auto") != 0) {
+    if (!is_auto) {
         icount_time_shift = strtol(option, NULL, 0);
         use_icount = 1;
         return;
@@ -478,6 +532,14 @@ void configure_icount(const char *option)
                    get_ticks_per_sec() / 10);
 }
 
+/* Behave as with -icount N,sleep=off from now on.  Used when replaying
+ * inputs, which does not need the original pacing against real time. */
+void icount_disable_sleep(void)
+{
+    assert(use_icount == 1);
+    icount_sleep = false;
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -493,6 +555,10 @@ void hw_error(const char *fmt, ...)
         cpu_dump_state(cpu, stderr, fprintf, CPU_DUMP_FPU);
     }
     va_end(ap);
+    if (qemu_log_enabled()) {
+        /* an asynchronous log would lose what is still in its rings */
+        qemu_log_flush();
+    }
     abort();
 }
 
@@ -722,6 +788,14 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/* With several CPUs on the TCG thread, a CPU that never waits for an
+   event would keep the others from running until the next I/O event.
+   This timer ends its turn every TCG_KICK_PERIOD of virtual time, and
+   tcg_exec_all() carries on with the next CPU.  */
+#define TCG_KICK_PERIOD (get_ticks_per_sec() / 1000)
+
+static QEMUTimer *tcg_kick_timer;
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -831,6 +905,10 @@ static void qemu_tcg_wait_io_event(void)
     CPUState *cpu;
 
     while (all_cpu_threads_idle()) {
+        /* Translate ahead what the guest may run when it wakes up */
+        if (!iothread_requesting_mutex && tb_prefetch_run()) {
+            continue;
+        }
        /* Start accounting real time to the virtual clock if the CPUs
           are idle.  */
         qemu_clock_warp(QEMU_CLOCK_VIRTUAL);
@@ -935,6 +1013,15 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 
 static void tcg_exec_all(void);
 
+static void qemu_cpu_kick_thread(CPUState *cpu);
+
+static void tcg_kick_timer_cb(void *opaque)
+{
+    timer_mod(tcg_kick_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + TCG_KICK_PERIOD);
+    qemu_cpu_kick_thread(first_cpu);
+}
+
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
@@ -1155,6 +1242,43 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
     } else {
         cpu->thread = tcg_cpu_thread;
         cpu->halt_cond = tcg_halt_cond;
+        if (!tcg_kick_timer) {
+            tcg_kick_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                          tcg_kick_timer_cb, NULL);
+            timer_mod(tcg_kick_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + TCG_KICK_PERIOD);
+        }
+    }
+}
+
+/* Give the TCG CPUs a new thread in a child forked by the main thread
+ * while they were paused, as only the thread which called fork() exists
+ * in the child.  The conditions are set up again since the threads that
+ * waited on them are gone. */
+void qemu_tcg_cpus_after_fork(void)
+{
+    char thread_name[VCPU_THREAD_NAME_SIZE];
+    CPUState *cpu;
+
+    assert(tcg_enabled() && qemu_thread_is_self(&io_thread));
+    qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&qemu_cpu_cond);
+    qemu_cond_init(&qemu_pause_cond);
+    qemu_cond_init(&qemu_work_cond);
+    qemu_cond_init(tcg_halt_cond);
+    iothread_requesting_mutex = false;
+
+    CPU_FOREACH(cpu) {
+        assert(cpu->stopped);
+        cpu->created = false;
+    }
+    cpu = first_cpu;
+    snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+             cpu->cpu_index);
+    qemu_thread_create(tcg_cpu_thread, thread_name, qemu_tcg_cpu_thread_fn,
+                       cpu, QEMU_THREAD_JOINABLE);
+    while (!cpu->created) {
+        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
     }
 }
 
@@ -1244,9 +1368,32 @@ int vm_stop_force_state(RunState state)
     }
 }
 
+/* Run the QEMU_CLOCK_VIRTUAL timers that are due from the vCPU thread,
+ * which holds the BQL here.  Otherwise the main loop has to be woken up
+ * and take the BQL before the vCPU gets anything but an empty budget.
+ */
+static void icount_run_due_timers(void)
+{
+    if (qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL) == 0) {
+        qemu_clock_run_timers(QEMU_CLOCK_VIRTUAL);
+    }
+}
+
+void dump_icount_slice_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!use_icount) {
+        return;
+    }
+    cpu_fprintf(f, "\nicount slices:\n");
+    cpu_fprintf(f, "slice count         %" PRId64 "\n", icount_slices);
+    cpu_fprintf(f, "slice avg length    %" PRId64 " insns\n",
+                icount_slices ? icount_slice_insns / icount_slices : 0);
+}
+
 static int tcg_cpu_exec(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
+    int64_t budget = 0;
     int ret;
 #ifdef CONFIG_PROFILER
     int64_t ti;
@@ -1262,6 +1409,7 @@ static int tcg_cpu_exec(CPUArchState *env)
         qemu_icount -= (cpu->icount_decr.u16.low + cpu->icount_extra);
         cpu->icount_decr.u16.low = 0;
         cpu->icount_extra = 0;
+        icount_run_due_timers();
         deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
 
         /* Maintain prior (possibly buggy) behaviour where if no deadline
@@ -1274,6 +1422,7 @@ static int tcg_cpu_exec(CPUArchState *env)
         }
 
         count = qemu_icount_round(deadline);
+        budget = count;
         qemu_icount += count;
         decr = (count > 0xffff) ? 0xffff : count;
         count -= decr;
@@ -1287,9 +1436,16 @@ static int tcg_cpu_exec(CPUArchState *env)
     if (use_icount) {
         /* Fold pending instructions back into the
            instruction counter, and clear the interrupt flag.  */
+        budget -= cpu->icount_decr.u16.low + cpu->icount_extra;
         qemu_icount -= (cpu->icount_decr.u16.low + cpu->icount_extra);
         cpu->icount_decr.u32 = 0;
         cpu->icount_extra = 0;
+        icount_slices++;
+        icount_slice_insns += budget;
+
+        /* The slice normally ends at the deadline; fire what is due while
+         * we still hold the BQL.  */
+        icount_run_due_timers();
     }
     return ret;
 }
@@ -1464,6 +1620,167 @@ exit:
     fclose(f);
 }
 
+/* Copy a range of guest RAM or ROM.  Returns false if part of it is
+   something else, which is not read as a device read may have side
+   effects.  */
+static bool memory_read_ram(hwaddr addr, uint8_t *buf, hwaddr size)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, l;
+
+    while (size != 0) {
+        l = size;
+        mr = address_space_translate(&address_space_memory, addr, &xlat, &l,
+                                     false);
+        if (!memory_region_is_ram(mr) && !memory_region_is_romd(mr)) {
+            return false;
+        }
+        memcpy(buf, memory_region_get_ram_ptr(mr) + xlat, l);
+        addr += l;
+        buf += l;
+        size -= l;
+    }
+    return true;
+}
+
+#define MEMORY_READ_MAX_SIZE 65536
+
+static bool memory_read_check(uint64_t addr, uint32_t size, Error **errp)
+{
+    if (size == 0 || size > MEMORY_READ_MAX_SIZE) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "size",
+                  "a size from 1 to 65536");
+        return false;
+    }
+    if (addr + size - 1 < addr) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "addr",
+                  "an address such that the range does not wrap");
+        return false;
+    }
+    return true;
+}
+
+char *qmp_memory_read(uint64_t addr, uint32_t size, Error **errp)
+{
+    uint8_t *buf;
+    char *data;
+
+    if (!memory_read_check(addr, size, errp)) {
+        return NULL;
+    }
+    buf = g_malloc(size);
+    if (!memory_read_ram(addr, buf, size)) {
+        error_setg(errp, "Range 0x%" PRIx64 "+%" PRIu32 " is not RAM or ROM",
+                   addr, size);
+        g_free(buf);
+        return NULL;
+    }
+    data = g_base64_encode(buf, size);
+    g_free(buf);
+    return data;
+}
+
+/* A range of RAM which is compared with its last contents every interval
+   of virtual time, and sent in a MEMORY_CHANGE event when it differs.  */
+typedef struct MemoryWatch {
+    char *id;
+    hwaddr addr;
+    uint32_t size;
+    int64_t interval_ns;
+    uint8_t *cache;
+    uint8_t *buf;
+    bool cache_valid;
+    QEMUTimer *timer;
+    QTAILQ_ENTRY(MemoryWatch) next;
+} MemoryWatch;
+
+static QTAILQ_HEAD(, MemoryWatch) memory_watches =
+    QTAILQ_HEAD_INITIALIZER(memory_watches);
+
+static void memory_watch_tick(void *opaque)
+{
+    MemoryWatch *w = opaque;
+    char *data;
+
+    /* The range may have been unmapped since the watch was set up */
+    if (memory_read_ram(w->addr, w->buf, w->size) &&
+        (!w->cache_valid || memcmp(w->buf, w->cache, w->size) != 0)) {
+        memcpy(w->cache, w->buf, w->size);
+        w->cache_valid = true;
+        data = g_base64_encode(w->buf, w->size);
+        qapi_event_send_memory_change(w->id, w->addr, data, &error_abort);
+        g_free(data);
+    }
+    timer_mod(w->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                        w->interval_ns);
+}
+
+static MemoryWatch *memory_watch_find(const char *id)
+{
+    MemoryWatch *w;
+
+    QTAILQ_FOREACH(w, &memory_watches, next) {
+        if (!strcmp(w->id, id)) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+static void memory_watch_free(MemoryWatch *w)
+{
+    QTAILQ_REMOVE(&memory_watches, w, next);
+    timer_free(w->timer);
+    g_free(w->id);
+    g_free(w->cache);
+    g_free(w->buf);
+    g_free(w);
+}
+
+void qmp_memory_watch(const char *id, uint64_t addr, uint32_t size,
+                      uint32_t interval, Error **errp)
+{
+    MemoryWatch *w;
+
+    if (!memory_read_check(addr, size, errp)) {
+        return;
+    }
+    if (interval == 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "interval",
+                  "a positive number of milliseconds");
+        return;
+    }
+
+    w = memory_watch_find(id);
+    if (w) {
+        memory_watch_free(w);
+    }
+    w = g_new0(MemoryWatch, 1);
+    w->id = g_strdup(id);
+    w->addr = addr;
+    w->size = size;
+    w->interval_ns = (int64_t)interval * SCALE_MS;
+    w->cache = g_malloc(size);
+    w->buf = g_malloc(size);
+    w->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, memory_watch_tick, w);
+    QTAILQ_INSERT_TAIL(&memory_watches, w, next);
+
+    /* The first check sends the current contents */
+    timer_mod(w->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+}
+
+void qmp_memory_unwatch(const char *id, Error **errp)
+{
+    MemoryWatch *w = memory_watch_find(id);
+
+    if (!w) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "id",
+                  "the id of a memory watch");
+        return;
+    }
+    memory_watch_free(w);
+}
+
 void qmp_inject_nmi(Error **errp)
 {
 #if defined(TARGET_I386)
@@ -28,6 +28,7 @@
 
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
+#include "qemu/timer.h"
 #include "tcg/tcg.h"
 
 //#define DEBUG_TLB
@@ -60,7 +61,7 @@ void tlb_flush(CPUState *cpu, int flush_global)
     cpu->current_tb = NULL;
 
     memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    cpu_tb_jmp_cache_clear(cpu);
 
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
@@ -115,6 +116,11 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
 {
+    /* Guest stores cannot reach this page, so there is no self-modifying
+       code to catch.  */
+    if (qemu_ram_is_rom_exec(ram_addr)) {
+        return;
+    }
     cpu_physical_memory_reset_dirty(ram_addr, TARGET_PAGE_SIZE,
                                     DIRTY_MEMORY_CODE);
 }
@@ -142,6 +148,13 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
         if ((addr - start) < length) {
             tlb_entry->addr_write |= TLB_NOTDIRTY;
         }
+    } else if (tlb_entry->addr_write & TLB_WATCH) {
+        /* A watched page must not be written behind the watchpoint
+           handlers' back once it is clean again */
+        addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
+        if ((addr - start) < length) {
+            tlb_entry->addr_write &= ~TLB_WATCH;
+        }
     }
 }
 
@@ -259,6 +272,8 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
         addend = 0;
     } else {
         /* TLB_MMIO for rom/romd handled below */
+        ram_lazy_fault((memory_region_get_ram_addr(section->mr)
+                        & TARGET_PAGE_MASK) + xlat, TARGET_PAGE_SIZE);
         addend = (uintptr_t)memory_region_get_ram_ptr(section->mr) + xlat;
     }
 
@@ -285,11 +300,12 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
         if ((memory_region_is_ram(section->mr) && section->readonly)
             || memory_region_is_romd(section->mr)) {
             /* Write access calls the I/O callback.  */
-            te->addr_write = address | TLB_MMIO;
+            te->addr_write = (address & ~TLB_WATCH) | TLB_MMIO;
         } else if (memory_region_is_ram(section->mr)
                    && cpu_physical_memory_is_clean(section->mr->ram_addr
                                                    + xlat)) {
-            te->addr_write = address | TLB_NOTDIRTY;
+            /* Clean pages need the write handlers, watched or not */
+            te->addr_write = (address & ~TLB_WATCH) | TLB_NOTDIRTY;
         } else {
             te->addr_write = address;
         }
@@ -332,6 +348,106 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+/* True if ADDR hits the code TLB and is RAM or ROM, so that
+   get_page_addr_code() and code loads from its page cannot fault.  */
+bool tlb_code_mapped(CPUArchState *env1, target_ulong addr)
+{
+    int page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int mmu_idx = cpu_mmu_index(env1);
+
+    /* MMIO pages carry TLB_MMIO in addr_code and never compare equal */
+    return env1->tlb_table[mmu_idx][page_index].addr_code ==
+           (addr & TARGET_PAGE_MASK);
+}
+
+/* MMIO polling loops.
+ *
+ * A loop like "while (!(SR & TXE));" reads the same device register from
+ * the same load instruction, and gets the same value, over and over.  For
+ * devices which can tell when such a register can next change (see
+ * MemoryRegionOps.poll_deadline), a CPU seen doing this MMIO_POLL_THRESHOLD
+ * times in a row is halted, as if it had executed WFI, until that time.
+ * It then re-executes the load.  The host does not spin meanwhile, and with
+ * -icount sleep=off virtual time skips straight to the deadline.
+ */
+#define MMIO_POLL_THRESHOLD 16
+/* Reads further apart than this in virtual time are not a tight loop */
+#define MMIO_POLL_MAX_GAP_NS 5000
+/* Longest halt, in case a device misses a change it should have reported */
+#define MMIO_POLL_MAX_IDLE_NS 1000000
+
+static void cpu_mmio_poll_wake(void *opaque)
+{
+    CPUState *cpu = opaque;
+
+    if (cpu->mmio_poll_idle) {
+        cpu->mmio_poll_idle = false;
+        timer_del(cpu->mmio_poll_timer);
+        cpu_interrupt(cpu, CPU_INTERRUPT_EXITTB);
+    }
+}
+
+void cpu_mmio_poll_wake_all(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        cpu_mmio_poll_wake(cpu);
+    }
+}
+
+static void cpu_mmio_poll_check(CPUState *cpu, MemoryRegion *mr,
+                                hwaddr addr, uint64_t val, unsigned size,
+                                uintptr_t retaddr)
+{
+    int64_t now, deadline;
+
+    /* Only loads from generated code can be restarted */
+    if (!retaddr || cpu->singlestep_enabled) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (cpu->mmio_poll_mr != mr || cpu->mmio_poll_addr != addr ||
+        cpu->mmio_poll_pc != retaddr || cpu->mmio_poll_value != val ||
+        now - cpu->mmio_poll_time > MMIO_POLL_MAX_GAP_NS) {
+        cpu->mmio_poll_mr = mr;
+        cpu->mmio_poll_addr = addr;
+        cpu->mmio_poll_pc = retaddr;
+        cpu->mmio_poll_value = val;
+        cpu->mmio_poll_time = now;
+        cpu->mmio_poll_count = 1;
+        return;
+    }
+
+    cpu->mmio_poll_time = now;
+    if (++cpu->mmio_poll_count < MMIO_POLL_THRESHOLD) {
+        return;
+    }
+    cpu->mmio_poll_count = 0;
+
+    deadline = mr->ops->poll_deadline(mr->opaque, addr, size);
+    if (deadline <= now) {
+        return;
+    }
+    deadline = MIN(deadline, now + MMIO_POLL_MAX_IDLE_NS);
+
+    /* Go back to the load, so that it is done again on wakeup */
+    if (!cpu_restore_state(cpu, retaddr)) {
+        return;
+    }
+
+    if (!cpu->mmio_poll_timer) {
+        cpu->mmio_poll_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                            cpu_mmio_poll_wake, cpu);
+    }
+    timer_mod(cpu->mmio_poll_timer, deadline);
+    cpu->mmio_poll_idle = true;
+    cpu->halted = 1;
+    cpu->exception_index = EXCP_HLT;
+    cpu_loop_exit(cpu);
+}
+
 #define MMUSUFFIX _mmu
 
 #define SHIFT 0
@@ -21,6 +21,7 @@ CONFIG_STELLARIS_ENET=y
 CONFIG_STM32=y
 CONFIG_SSD0303=y
 CONFIG_SSD0323=y
+CONFIG_ILI9341=y
 CONFIG_ADS7846=y
 CONFIG_MAX111X=y
 CONFIG_SSI=y
@@ -49,6 +49,15 @@ void qemu_sglist_init(QEMUSGList *qsg, DeviceState *dev, int alloc_hint,
 
 void qemu_sglist_add(QEMUSGList *qsg, dma_addr_t base, dma_addr_t len)
 {
+    /* Guests often describe a physically contiguous buffer one page per
+     * descriptor.  Merging those saves a map call and an iovec each.
+     */
+    if (qsg->nsg > 0 &&
+        qsg->sg[qsg->nsg - 1].base + qsg->sg[qsg->nsg - 1].len == base) {
+        qsg->sg[qsg->nsg - 1].len += len;
+        qsg->size += len;
+        return;
+    }
     if (qsg->nsg == qsg->nalloc) {
         qsg->nalloc = 2 * qsg->nalloc + 1;
         qsg->sg = g_realloc(qsg->sg, qsg->nalloc * sizeof(ScatterGatherEntry));
@@ -24,6 +24,9 @@
 #include "sysemu/cpus.h"
 #include "qapi/error.h"
 #include "qmp-commands.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 
 #include <zlib.h>
 #ifdef CONFIG_LZO
@@ -36,6 +39,14 @@
 #define ELF_MACHINE_UNAME "Unknown"
 #endif
 
+/* The last dump, or the one in progress */
+static DumpState dump_state_global = { .status = DUMP_STATUS_NONE };
+
+bool dump_in_progress(void)
+{
+    return atomic_read(&dump_state_global.status) == DUMP_STATUS_ACTIVE;
+}
+
 uint16_t cpu_to_dump16(DumpState *s, uint16_t val)
 {
     if (s->dump_info.d_endian == ELFDATA2LSB) {
@@ -79,7 +90,13 @@ static int dump_cleanup(DumpState *s)
         close(s->fd);
     }
     if (s->resume) {
+        if (s->detached) {
+            qemu_mutex_lock_iothread();
+        }
         vm_start();
+        if (s->detached) {
+            qemu_mutex_unlock_iothread();
+        }
     }
 
     return ret;
@@ -368,30 +385,56 @@ static int write_data(DumpState *s, void *buf, int length)
     return 0;
 }
 
-/* write the memroy to vmcore. 1 page per I/O. */
-static int write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
-                        int64_t size)
+/* Largest run of pages written to the vmcore in one I/O */
+#define DUMP_WRITE_CHUNK (1024 * 1024)
+
+static int write_memory_run(DumpState *s, uint8_t *buf, int64_t size)
 {
-    int64_t i;
     int ret;
 
-    for (i = 0; i < size / TARGET_PAGE_SIZE; i++) {
-        ret = write_data(s, block->host_addr + start + i * TARGET_PAGE_SIZE,
-                         TARGET_PAGE_SIZE);
-        if (ret < 0) {
-            return ret;
-        }
+    if (!size) {
+        return 0;
     }
+    ret = write_data(s, buf, size);
+    if (ret < 0) {
+        return ret;
+    }
+    atomic_set(&s->written_size, s->written_size + size);
+    return 0;
+}
 
-    if ((size % TARGET_PAGE_SIZE) != 0) {
-        ret = write_data(s, block->host_addr + start + i * TARGET_PAGE_SIZE,
-                         size % TARGET_PAGE_SIZE);
-        if (ret < 0) {
-            return ret;
+/* write the memory to vmcore.  Runs of pages are written together, and in
+ * a sparse file zero pages are skipped, leaving a hole. */
+static int write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
+                        int64_t size)
+{
+    uint8_t *buf = block->host_addr + start;
+    int64_t i, n, run = 0;
+    int ret;
+
+    for (i = 0; i < size; i += n) {
+        n = MIN(TARGET_PAGE_SIZE, size - i);
+        if (s->sparse && buffer_is_zero(buf + i, n)) {
+            ret = write_memory_run(s, buf + run, i - run);
+            if (ret < 0) {
+                return ret;
+            }
+            if (lseek(s->fd, n, SEEK_CUR) < 0) {
+                dump_error(s, "dump: failed to seek.\n");
+                return -1;
+            }
+            atomic_set(&s->written_size, s->written_size + n);
+            run = i + n;
+        } else if (i + n - run >= DUMP_WRITE_CHUNK) {
+            ret = write_memory_run(s, buf + run, i + n - run);
+            if (ret < 0) {
+                return ret;
+            }
+            run = i + n;
         }
     }
 
-    return 0;
+    return write_memory_run(s, buf + run, size - run);
 }
 
 /* get the memory's offset and size in the vmcore */
@@ -586,8 +629,18 @@ static int dump_begin(DumpState *s)
 /* write PT_LOAD to vmcore */
 static int dump_completed(DumpState *s)
 {
+    off_t end;
+    int ret = 0;
+
+    /* A hole at the end of the file is only made by its size */
+    if (s->sparse) {
+        end = lseek(s->fd, 0, SEEK_CUR);
+        if (end < 0 || ftruncate(s->fd, end) < 0) {
+            ret = -1;
+        }
+    }
     dump_cleanup(s);
-    return 0;
+    return ret;
 }
 
 static int get_next_block(DumpState *s, GuestPhysBlock *block)
@@ -641,8 +694,7 @@ static int dump_iterate(DumpState *s)
 
         ret = get_next_block(s, block);
         if (ret == 1) {
-            dump_completed(s);
-            return 0;
+            return dump_completed(s);
         }
     }
 }
@@ -1201,20 +1253,266 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/*
+ * Pages are compressed in batches by up to DUMP_COMPRESS_MAX_THREADS
+ * threads.  The batches are handed out and written back in turn, so the
+ * page data stays in pfn order while the other batches are compressed.
+ */
+#define DUMP_COMPRESS_MAX_THREADS 8
+#define DUMP_COMPRESS_BATCH 256
+
+typedef struct DumpCompressJob {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    QemuCond done_cond;
+    bool threaded;
+    bool start;                 /* protected by mutex */
+    bool done;                  /* protected by mutex */
+    bool quit;                  /* protected by mutex */
+
+    DumpState *s;
+    size_t len_buf_out;
+#ifdef CONFIG_LZO
+    lzo_bytep wrkmem;
+#endif
+
+    /* Written by the dump thread while the job is idle */
+    int npages;
+    uint8_t *pages[DUMP_COMPRESS_BATCH];
+
+    /* Written by the compression thread; a size of 0 is a zero page, and
+     * flags of 0 a page stored as is */
+    uint8_t *buf_out;
+    size_t size_out[DUMP_COMPRESS_BATCH];
+    uint32_t flags[DUMP_COMPRESS_BATCH];
+} DumpCompressJob;
+
+/*
+ * only one compression format will be used here, for s->flag_compress is
+ * set. But when compression fails to work, we fall back to save in
+ * plaintext.
+ */
+static void dump_compress_job_run(DumpCompressJob *job)
+{
+    DumpState *s = job->s;
+    size_t size_out;
+    uint8_t *buf, *buf_out;
+    int i;
+
+    for (i = 0; i < job->npages; i++) {
+        buf = job->pages[i];
+        buf_out = job->buf_out + i * job->len_buf_out;
+        size_out = job->len_buf_out;
+
+        if (is_zero_page(buf, TARGET_PAGE_SIZE)) {
+            size_out = 0;
+            job->flags[i] = 0;
+        } else if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+                (compress2(buf_out, (uLongf *)&size_out, buf,
+                           TARGET_PAGE_SIZE, Z_BEST_SPEED) == Z_OK) &&
+                (size_out < TARGET_PAGE_SIZE)) {
+            job->flags[i] = DUMP_DH_COMPRESSED_ZLIB;
+#ifdef CONFIG_LZO
+        } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+                (lzo1x_1_compress(buf, TARGET_PAGE_SIZE, buf_out,
+                (lzo_uint *)&size_out, job->wrkmem) == LZO_E_OK) &&
+                (size_out < TARGET_PAGE_SIZE)) {
+            job->flags[i] = DUMP_DH_COMPRESSED_LZO;
+#endif
+#ifdef CONFIG_SNAPPY
+        } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+                (snappy_compress((char *)buf, TARGET_PAGE_SIZE,
+                (char *)buf_out, &size_out) == SNAPPY_OK) &&
+                (size_out < TARGET_PAGE_SIZE)) {
+            job->flags[i] = DUMP_DH_COMPRESSED_SNAPPY;
+#endif
+        } else {
+            size_out = TARGET_PAGE_SIZE;
+            job->flags[i] = 0;
+        }
+        job->size_out[i] = size_out;
+    }
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressJob *job = opaque;
+
+    qemu_mutex_lock(&job->mutex);
+    while (!job->quit) {
+        if (job->start) {
+            job->start = false;
+            qemu_mutex_unlock(&job->mutex);
+
+            dump_compress_job_run(job);
+
+            qemu_mutex_lock(&job->mutex);
+            job->done = true;
+            qemu_cond_signal(&job->done_cond);
+        } else {
+            qemu_cond_wait(&job->cond, &job->mutex);
+        }
+    }
+    qemu_mutex_unlock(&job->mutex);
+    return NULL;
+}
+
+static int dump_compress_thread_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n > 1) {
+        return MIN(n, DUMP_COMPRESS_MAX_THREADS);
+    }
+#endif
+    /* compress in the dump thread */
+    return 0;
+}
+
+static void dump_compress_job_init(DumpCompressJob *job, DumpState *s,
+                                   size_t len_buf_out, bool threaded)
+{
+    job->s = s;
+    job->len_buf_out = len_buf_out;
+    job->buf_out = g_malloc(DUMP_COMPRESS_BATCH * len_buf_out);
+#ifdef CONFIG_LZO
+    job->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+    job->done = true;
+    job->threaded = threaded;
+    if (threaded) {
+        qemu_mutex_init(&job->mutex);
+        qemu_cond_init(&job->cond);
+        qemu_cond_init(&job->done_cond);
+        qemu_thread_create(&job->thread, "dump_compress",
+                           dump_compress_thread, job, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_compress_job_free(DumpCompressJob *job)
+{
+    if (job->threaded) {
+        qemu_mutex_lock(&job->mutex);
+        job->quit = true;
+        qemu_cond_signal(&job->cond);
+        qemu_mutex_unlock(&job->mutex);
+        qemu_thread_join(&job->thread);
+        qemu_mutex_destroy(&job->mutex);
+        qemu_cond_destroy(&job->cond);
+        qemu_cond_destroy(&job->done_cond);
+    }
+#ifdef CONFIG_LZO
+    g_free(job->wrkmem);
+#endif
+    g_free(job->buf_out);
+}
+
+/* Fills the job with the next pages and starts compressing them */
+static void dump_compress_job_start(DumpCompressJob *job, bool *more,
+                                    GuestPhysBlock **block_iter,
+                                    uint64_t *pfn_iter)
+{
+    DumpState *s = job->s;
+
+    job->npages = 0;
+    while (*more && job->npages < DUMP_COMPRESS_BATCH) {
+        *more = get_next_page(block_iter, pfn_iter,
+                              &job->pages[job->npages], s);
+        if (*more) {
+            job->npages++;
+        }
+    }
+    if (!job->npages) {
+        return;
+    }
+
+    if (!job->threaded) {
+        dump_compress_job_run(job);
+        return;
+    }
+    qemu_mutex_lock(&job->mutex);
+    job->done = false;
+    job->start = true;
+    qemu_cond_signal(&job->cond);
+    qemu_mutex_unlock(&job->mutex);
+}
+
+static void dump_compress_job_wait(DumpCompressJob *job)
+{
+    if (!job->threaded) {
+        return;
+    }
+    qemu_mutex_lock(&job->mutex);
+    while (!job->done) {
+        qemu_cond_wait(&job->done_cond, &job->mutex);
+    }
+    qemu_mutex_unlock(&job->mutex);
+}
+
+/*
+ * write the pages of a job: every zero page uses the page data of the zero
+ * page, the others get their (compressed) page data and a page desc
+ * pointing to it
+ */
+static int write_compressed_pages(DumpState *s, DumpCompressJob *job,
+                                  DataCache *page_desc, DataCache *page_data,
+                                  PageDescriptor *pd_zero, off_t *offset_data)
+{
+    PageDescriptor pd;
+    const uint8_t *data;
+    size_t size_out;
+    int i;
+
+    for (i = 0; i < job->npages; i++) {
+        size_out = job->size_out[i];
+        if (!size_out) {
+            if (write_cache(page_desc, pd_zero, sizeof(PageDescriptor),
+                            false) < 0) {
+                return -1;
+            }
+        } else {
+            if (job->flags[i]) {
+                data = job->buf_out + i * job->len_buf_out;
+            } else {
+                data = job->pages[i];
+            }
+            if (write_cache(page_data, data, size_out, false) < 0) {
+                return -1;
+            }
+
+            pd.flags = cpu_to_dump32(s, job->flags[i]);
+            pd.size = cpu_to_dump32(s, size_out);
+            pd.page_flags = cpu_to_dump64(s, 0);
+            pd.offset = cpu_to_dump64(s, *offset_data);
+            *offset_data += size_out;
+
+            if (write_cache(page_desc, &pd, sizeof(PageDescriptor),
+                            false) < 0) {
+                return -1;
+            }
+        }
+    }
+    atomic_set(&s->written_size,
+               s->written_size + job->npages * TARGET_PAGE_SIZE);
+
+    return 0;
+}
+
 static int write_dump_pages(DumpState *s)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    size_t len_buf_out;
     off_t offset_desc, offset_data;
-    PageDescriptor pd, pd_zero;
+    PageDescriptor pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    DumpCompressJob *jobs;
+    int i, njobs, nthreads;
+    bool more = true;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1227,11 +1525,12 @@ static int write_dump_pages(DumpState *s)
     len_buf_out = get_len_buf_out(TARGET_PAGE_SIZE, s->flag_compress);
     assert(len_buf_out != 0);
 
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    nthreads = dump_compress_thread_count();
+    njobs = MAX(nthreads, 1);
+    jobs = g_new0(DumpCompressJob, njobs);
+    for (i = 0; i < njobs; i++) {
+        dump_compress_job_init(&jobs[i], s, len_buf_out, nthreads > 0);
+    }
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1245,8 +1544,7 @@ static int write_dump_pages(DumpState *s)
     ret = write_cache(&page_data, buf, TARGET_PAGE_SIZE, false);
     g_free(buf);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write page data(zero page).\n");
-        goto out;
+        goto fail;
     }
 
     offset_data += TARGET_PAGE_SIZE;
@@ -1255,119 +1553,46 @@ static int write_dump_pages(DumpState *s)
      * dump memory to vmcore page by page. zero page will all be resided in the
      * first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, TARGET_PAGE_SIZE)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                dump_error(s, "dump: failed to write page desc.\n");
-                goto out;
-            }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               TARGET_PAGE_SIZE, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data.\n");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, TARGET_PAGE_SIZE, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data.\n");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, TARGET_PAGE_SIZE,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data.\n");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned TARGET_PAGE_SIZE
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = TARGET_PAGE_SIZE;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf, TARGET_PAGE_SIZE, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data.\n");
-                    goto out;
-                }
-            }
-
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
-
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
-            if (ret < 0) {
-                dump_error(s, "dump: failed to write page desc.\n");
-                goto out;
-            }
+    for (i = 0; i < njobs; i++) {
+        dump_compress_job_start(&jobs[i], &more, &block_iter, &pfn_iter);
+    }
+    for (i = 0; jobs[i].npages; i = (i + 1) % njobs) {
+        dump_compress_job_wait(&jobs[i]);
+        ret = write_compressed_pages(s, &jobs[i], &page_desc, &page_data,
+                                     &pd_zero, &offset_data);
+        if (ret < 0) {
+            goto fail;
         }
+        dump_compress_job_start(&jobs[i], &more, &block_iter, &pfn_iter);
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
     if (ret < 0) {
-        dump_error(s, "dump: failed to sync cache for page_desc.\n");
-        goto out;
+        goto fail;
     }
     ret = write_cache(&page_data, NULL, 0, true);
     if (ret < 0) {
-        dump_error(s, "dump: failed to sync cache for page_data.\n");
-        goto out;
+        goto fail;
     }
 
 out:
+    for (i = 0; i < njobs; i++) {
+        dump_compress_job_free(&jobs[i]);
+    }
+    g_free(jobs);
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
 
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
-
     return ret;
+
+fail:
+    /* the threads must be stopped before the guest may run again */
+    for (i = 0; i < njobs; i++) {
+        dump_compress_job_free(&jobs[i]);
+    }
+    njobs = 0;
+    dump_error(s, "dump: failed to write pages.\n");
+    goto out;
 }
 
 static int create_kdump_vmcore(DumpState *s)
@@ -1456,6 +1681,30 @@ static ram_addr_t get_start_block(DumpState *s)
     return -1;
 }
 
+/* the bytes of guest memory in the dump, for query-dump */
+static int64_t dump_calculate_size(DumpState *s)
+{
+    GuestPhysBlock *block;
+    int64_t size, total = 0;
+
+    QTAILQ_FOREACH(block, &s->guest_phys_blocks.head, next) {
+        if (s->has_filter) {
+            if (block->target_start >= s->begin + s->length ||
+                block->target_end <= s->begin) {
+                /* This block is out of the range */
+                continue;
+            }
+            size = MIN(block->target_end, s->begin + s->length) -
+                   MAX(block->target_start, s->begin);
+        } else {
+            size = block->target_end - block->target_start;
+        }
+        total += size;
+    }
+
+    return total;
+}
+
 static void get_max_mapnr(DumpState *s)
 {
     GuestPhysBlock *last_block;
@@ -1538,6 +1787,7 @@ static int dump_init(DumpState *s, int fd, bool has_format,
     }
 
     s->nr_cpus = nr_cpus;
+    s->total_size = dump_calculate_size(s);
 
     get_max_mapnr(s);
 
@@ -1631,16 +1881,52 @@ cleanup:
     return -1;
 }
 
+static void dump_process(DumpState *s, Error **errp)
+{
+    int ret;
+
+    if (s->flag_compress) {
+        ret = create_kdump_vmcore(s);
+    } else {
+        ret = create_vmcore(s);
+    }
+    if (ret < 0) {
+        error_set(errp, QERR_IO_ERROR);
+    }
+    atomic_set(&s->status,
+               ret < 0 ? DUMP_STATUS_FAILED : DUMP_STATUS_COMPLETED);
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    Error *err = NULL;
+
+    dump_process(s, &err);
+    if (err) {
+        error_report("%s", error_get_pretty(err));
+        error_free(err);
+    }
+    return NULL;
+}
+
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length,
                            int64_t length, bool has_format,
-                           DumpGuestMemoryFormat format, Error **errp)
+                           DumpGuestMemoryFormat format, bool has_detach,
+                           bool detach, Error **errp)
 {
     const char *p;
     int fd = -1;
+    bool sparse = false;
     DumpState *s;
     int ret;
 
+    if (dump_in_progress()) {
+        error_setg(errp, "there is a dump in progress, see query-dump");
+        return;
+    }
+
     /*
      * kdump-compressed format need the whole memory dumped, so paging or
      * filter is not supported here.
@@ -1690,6 +1976,8 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
             error_setg_file_open(errp, errno, p);
             return;
         }
+        /* the file was truncated, so zero pages can be left as holes */
+        sparse = true;
     }
 
     if (fd == -1) {
@@ -1697,26 +1985,41 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc0(sizeof(DumpState));
+    s = &dump_state_global;
+    memset(s, 0, sizeof(*s));
+    s->status = DUMP_STATUS_ACTIVE;
 
     ret = dump_init(s, fd, has_format, format, paging, has_begin,
                     begin, length, errp);
     if (ret < 0) {
-        g_free(s);
+        close(fd);
+        atomic_set(&s->status, DUMP_STATUS_FAILED);
         return;
     }
+    /* ELF only: in the kdump format every page has its place */
+    s->sparse = sparse && !s->flag_compress;
 
-    if (has_format && format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
-        if (create_kdump_vmcore(s) < 0) {
-            error_set(errp, QERR_IO_ERROR);
-        }
-    } else {
-        if (create_vmcore(s) < 0) {
-            error_set(errp, QERR_IO_ERROR);
-        }
+    /* The guest stays stopped until the dump is done, but the monitor
+     * is free in the meantime */
+    if (has_detach && detach) {
+        s->detached = true;
+        qemu_thread_create(&s->thread, "dump_thread", dump_thread, s,
+                           QEMU_THREAD_DETACHED);
+        return;
     }
 
-    g_free(s);
+    dump_process(s, errp);
+}
+
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    DumpQueryResult *result = g_new0(DumpQueryResult, 1);
+    DumpState *s = &dump_state_global;
+
+    result->status = atomic_read(&s->status);
+    result->completed = atomic_read(&s->written_size);
+    result->total = s->total_size;
+    return result;
 }
 
 DumpGuestMemoryCapability *qmp_query_dump_guest_memory_capability(Error **errp)
@@ -69,12 +69,6 @@ AddressSpace address_space_memory;
 MemoryRegion io_mem_rom, io_mem_notdirty;
 static MemoryRegion io_mem_unassigned;
 
-/* RAM is pre-allocated and passed into qemu_ram_alloc_from_ptr */
-#define RAM_PREALLOC   (1 << 0)
-
-/* RAM is mmap-ed with MAP_SHARED */
-#define RAM_SHARED     (1 << 1)
-
 #endif
 
 struct CPUTailQ cpus = QTAILQ_HEAD_INITIALIZER(cpus);
@@ -85,6 +79,9 @@ DEFINE_TLS(CPUState *, current_cpu);
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
 int use_icount;
+/* With use_icount, let MMIO happen in the middle of a TB instead of
+   retranslating it to end on the access, see cpu_io_mid_tb().  */
+bool icount_no_split;
 
 #if !defined(CONFIG_USER_ONLY)
 
@@ -118,6 +115,11 @@ typedef struct PhysPageMap {
     MemoryRegionSection *sections;
 } PhysPageMap;
 
+typedef struct PhysSectionRemap {
+    hwaddr base;    /* offset_within_address_space - offset_within_region */
+    uint16_t index; /* PHYS_SECTION_NONE if the section is gone */
+} PhysSectionRemap;
+
 struct AddressSpaceDispatch {
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
@@ -125,6 +127,10 @@ struct AddressSpaceDispatch {
     PhysPageEntry phys_map;
     PhysPageMap map;
     AddressSpace *as;
+    /* The index in this map of each section of the previous one, so that
+     * tcg_commit() can keep the TLB entries of the unchanged ranges.  */
+    PhysSectionRemap *remap;
+    unsigned remap_nb;
 };
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
@@ -139,10 +145,31 @@ typedef struct subpage_t {
 #define PHYS_SECTION_NOTDIRTY 1
 #define PHYS_SECTION_ROM 2
 #define PHYS_SECTION_WATCH 3
+/* There are fewer than TARGET_PAGE_SIZE sections, see phys_section_add */
+#define PHYS_SECTION_NONE UINT16_MAX
 
 static void io_mem_init(void);
 static void memory_map_init(void);
 static void tcg_commit(MemoryListener *listener);
+static void tcg_region_change(MemoryListener *listener,
+                              MemoryRegionSection *section);
+
+/* Ranges changed by one memory transaction, as seen by a CPU's TLB.  Past
+   TCG_MAX_MEMORY_CHANGES ranges the whole TLB is flushed instead.  */
+#define TCG_MAX_MEMORY_CHANGES 16
+
+typedef struct TCGMemoryChange {
+    bool ram;           /* start is a ram_addr_t, else a physical address */
+    hwaddr start;
+    uint64_t size;
+} TCGMemoryChange;
+
+typedef struct TCGMemoryListener {
+    MemoryListener listener;
+    CPUState *cpu;
+    int nb_changes;
+    TCGMemoryChange changes[TCG_MAX_MEMORY_CHANGES];
+} TCGMemoryListener;
 
 static MemoryRegion io_mem_watch;
 #endif
@@ -501,8 +528,15 @@ void tcg_cpu_address_space_init(CPUState *cpu, AddressSpace *as)
     if (cpu->tcg_as_listener) {
         memory_listener_unregister(cpu->tcg_as_listener);
     } else {
-        cpu->tcg_as_listener = g_new0(MemoryListener, 1);
+        TCGMemoryListener *tl = g_new0(TCGMemoryListener, 1);
+
+        tl->cpu = cpu;
+        cpu->tcg_as_listener = &tl->listener;
     }
+    cpu->tcg_as_listener->region_add = tcg_region_change;
+    cpu->tcg_as_listener->region_del = tcg_region_change;
+    cpu->tcg_as_listener->log_start = tcg_region_change;
+    cpu->tcg_as_listener->log_stop = tcg_region_change;
     cpu->tcg_as_listener->commit = tcg_commit;
     memory_listener_register(cpu->tcg_as_listener, as);
 }
@@ -584,6 +618,7 @@ int cpu_watchpoint_insert(CPUState *cpu, vaddr addr, vaddr len,
 {
     vaddr len_mask = ~(len - 1);
     CPUWatchpoint *wp;
+    bool first = QTAILQ_EMPTY(&cpu->watchpoints);
 
     /* sanity checks: allow power-of-2 lengths, deny unaligned watchpoints */
     if ((len & (len - 1)) || (addr & ~len_mask) ||
@@ -606,6 +641,10 @@ int cpu_watchpoint_insert(CPUState *cpu, vaddr addr, vaddr len,
     }
 
     tlb_flush_page(cpu, addr);
+    /* Code translated without watchpoints may read RAM without the TLB */
+    if (first) {
+        tb_flush(cpu->env_ptr);
+    }
 
     if (watchpoint)
         *watchpoint = wp;
@@ -650,6 +689,26 @@ void cpu_watchpoint_remove_all(CPUState *cpu, int mask)
         }
     }
 }
+
+/* Return true if an access of LEN bytes at ADDR may hit a watchpoint.
+   Used by the softmmu helpers to let the accesses to a watched RAM page
+   that miss the watched ranges go straight to RAM.  */
+bool cpu_watchpoint_address_matches(CPUState *cpu, vaddr addr, vaddr len,
+                                    int flags)
+{
+    CPUWatchpoint *wp;
+
+    if (cpu->watchpoint_hit) {
+        return true;
+    }
+    QTAILQ_FOREACH(wp, &cpu->watchpoints, entry) {
+        if ((wp->flags & flags) && addr <= wp->vaddr + ~wp->len_mask
+            && wp->vaddr <= addr + len - 1) {
+            return true;
+        }
+    }
+    return false;
+}
 #endif
 
 /* Add a breakpoint.  */
@@ -658,6 +717,7 @@ int cpu_breakpoint_insert(CPUState *cpu, vaddr pc, int flags,
 {
 #if defined(TARGET_HAS_ICE)
     CPUBreakpoint *bp;
+    bool first = QTAILQ_EMPTY(&cpu->breakpoints);
 
     bp = g_malloc(sizeof(*bp));
 
@@ -672,6 +732,11 @@ int cpu_breakpoint_insert(CPUState *cpu, vaddr pc, int flags,
     }
 
     breakpoint_invalidate(cpu, pc);
+    /* Code translated without breakpoints may have followed a branch to
+       pc from a block whose address range does not have it */
+    if (first) {
+        tb_flush(cpu->env_ptr);
+    }
 
     if (breakpoint) {
         *breakpoint = bp;
@@ -829,6 +894,59 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
     }
 }
 
+struct DirtyBitmapSnapshot {
+    ram_addr_t start;
+    ram_addr_t end;
+    unsigned long dirty[];
+};
+
+/* Copy the dirty bits for the range a word at a time, then clear them.
+ * The snapshot is widened to whole bitmap words so that no shifting is
+ * needed; only the bits inside the range are meaningful.
+ */
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+    (ram_addr_t start, ram_addr_t length, unsigned client)
+{
+    ram_addr_t align = (ram_addr_t)TARGET_PAGE_SIZE * BITS_PER_LONG;
+    ram_addr_t first = start & ~(align - 1);
+    ram_addr_t last = QEMU_ALIGN_UP(start + length, align);
+    unsigned long *src = ram_list.dirty_memory[client];
+    DirtyBitmapSnapshot *snap;
+    unsigned long i, words, any = 0;
+
+    assert(client < DIRTY_MEMORY_NUM);
+
+    words = (last - first) / align;
+    snap = g_malloc(sizeof(*snap) + words * sizeof(unsigned long));
+    snap->start = first;
+    snap->end = last;
+    src += (first >> TARGET_PAGE_BITS) / BITS_PER_LONG;
+    for (i = 0; i < words; i++) {
+        snap->dirty[i] = src[i];
+        any |= src[i];
+    }
+
+    /* Resetting also flushes the TLBs' notdirty state; skip it when idle */
+    if (any) {
+        cpu_physical_memory_reset_dirty(start, length, client);
+    }
+    return snap;
+}
+
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length)
+{
+    unsigned long page, end;
+
+    assert(start >= snap->start);
+    assert(start + length <= snap->end);
+
+    end = TARGET_PAGE_ALIGN(start + length - snap->start) >> TARGET_PAGE_BITS;
+    page = (start - snap->start) >> TARGET_PAGE_BITS;
+    return find_next_bit(snap->dirty, end, page) < end;
+}
+
 static void cpu_physical_memory_set_dirty_tracking(bool enable)
 {
     in_migration = enable;
@@ -866,6 +984,11 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
             if ((prot & PAGE_WRITE) || (wp->flags & BP_MEM_READ)) {
                 iotlb = PHYS_SECTION_WATCH + paddr;
                 *address |= TLB_MMIO;
+                /* The accesses that miss the watchpoints may still use
+                   the RAM addend.  */
+                if (memory_region_is_ram(section->mr)) {
+                    *address |= TLB_WATCH;
+                }
                 break;
             }
         }
@@ -1499,6 +1622,15 @@ void *qemu_get_ram_block_host_ptr(ram_addr_t addr)
     return block->host;
 }
 
+/* True if the guest cannot write the RAM at addr, see
+   memory_region_set_rom_exec().  */
+bool qemu_ram_is_rom_exec(ram_addr_t addr)
+{
+    RAMBlock *block = qemu_get_ram_block(addr);
+
+    return block->mr && memory_region_is_rom_exec(block->mr);
+}
+
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
    With the exception of the softmmu code in this file, this should
    only be used for local memory (e.g. video ram) that the device owns,
@@ -1585,6 +1717,18 @@ found:
     return block->mr;
 }
 
+/* For boards and CPUs which keep a host pointer into a RAM block and
+   access it without the memory API: loadvm then restores the block
+   before the guest runs, instead of on first access.  */
+void qemu_ram_set_direct(void *host)
+{
+    ram_addr_t addr;
+
+    if (qemu_ram_addr_from_host(host, &addr)) {
+        qemu_get_ram_block(addr)->flags |= RAM_DIRECT;
+    }
+}
+
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
@@ -1704,16 +1848,50 @@ static const MemoryRegionOps watch_mem_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+/* The I/O section an access to the subpage goes to, if the access can be
+   passed straight on to it: an aligned access that address_space_rw would
+   not split.  Otherwise NULL, and the access goes through the address
+   space again.  */
+static MemoryRegionSection *subpage_direct_section(subpage_t *subpage,
+                                                   hwaddr addr, unsigned len,
+                                                   bool is_write,
+                                                   hwaddr *addr_in_region)
+{
+    MemoryRegionSection *section;
+    unsigned max;
+
+    section = &subpage->as->dispatch->map.sections[
+                  subpage->sub_section[SUBPAGE_IDX(addr)]];
+    max = section->mr->ops->valid.max_access_size;
+    if (memory_access_is_direct(section->mr, is_write) ||
+        memory_region_is_iommu(section->mr) ||
+        (addr & (len - 1)) || len > (max ? max : 4)) {
+        return NULL;
+    }
+    *addr_in_region = subpage->base + addr -
+                      section->offset_within_address_space +
+                      section->offset_within_region;
+    return section;
+}
+
 static uint64_t subpage_read(void *opaque, hwaddr addr,
                              unsigned len)
 {
     subpage_t *subpage = opaque;
+    MemoryRegionSection *section;
+    hwaddr addr1;
+    uint64_t val;
     uint8_t buf[4];
 
 #if defined(DEBUG_SUBPAGE)
     printf("%s: subpage %p len %u addr " TARGET_FMT_plx "\n", __func__,
            subpage, len, addr);
 #endif
+    section = subpage_direct_section(subpage, addr, len, false, &addr1);
+    if (section) {
+        io_mem_read(section->mr, addr1, &val, len);
+        return val;
+    }
     address_space_read(subpage->as, addr + subpage->base, buf, len);
     switch (len) {
     case 1:
@@ -1731,6 +1909,8 @@ static void subpage_write(void *opaque, hwaddr addr,
                           uint64_t value, unsigned len)
 {
     subpage_t *subpage = opaque;
+    MemoryRegionSection *section;
+    hwaddr addr1;
     uint8_t buf[4];
 
 #if defined(DEBUG_SUBPAGE)
@@ -1738,6 +1918,11 @@ static void subpage_write(void *opaque, hwaddr addr,
            " value %"PRIx64"\n",
            __func__, subpage, len, addr, value);
 #endif
+    section = subpage_direct_section(subpage, addr, len, true, &addr1);
+    if (section) {
+        io_mem_write(section->mr, addr1, value, len);
+        return;
+    }
     switch (len) {
     case 1:
         stb_p(buf, value);
@@ -1865,6 +2050,60 @@ static void mem_begin(MemoryListener *listener)
     as->next_dispatch = d;
 }
 
+static guint phys_section_hash(gconstpointer p)
+{
+    const MemoryRegionSection *section = p;
+
+    return g_direct_hash(section->mr) ^
+           (guint)(section->offset_within_address_space >> TARGET_PAGE_BITS);
+}
+
+static gboolean phys_section_equal(gconstpointer a, gconstpointer b)
+{
+    const MemoryRegionSection *sa = a, *sb = b;
+
+    return sa->mr == sb->mr &&
+           sa->offset_within_address_space == sb->offset_within_address_space &&
+           sa->offset_within_region == sb->offset_within_region &&
+           int128_eq(sa->size, sb->size) &&
+           sa->readonly == sb->readonly;
+}
+
+/* Find the sections of cur which are in next too.  Subpages are created
+ * anew by each rebuild, so they never match.  */
+static void phys_sections_remap(AddressSpaceDispatch *next,
+                                AddressSpaceDispatch *cur)
+{
+    GHashTable *indexes = g_hash_table_new(phys_section_hash,
+                                           phys_section_equal);
+    MemoryRegionSection *section;
+    gpointer index;
+    unsigned i;
+
+    for (i = PHYS_SECTION_WATCH + 1; i < next->map.sections_nb; i++) {
+        section = &next->map.sections[i];
+        if (!section->mr->subpage) {
+            g_hash_table_insert(indexes, section, GUINT_TO_POINTER(i));
+        }
+    }
+
+    next->remap = g_new(PhysSectionRemap, cur->map.sections_nb);
+    next->remap_nb = cur->map.sections_nb;
+    for (i = 0; i < cur->map.sections_nb; i++) {
+        section = &cur->map.sections[i];
+        next->remap[i].base = section->offset_within_address_space -
+                              section->offset_within_region;
+        if (i <= PHYS_SECTION_WATCH) {
+            next->remap[i].index = i;
+            continue;
+        }
+        index = g_hash_table_lookup(indexes, section);
+        next->remap[i].index = index ? GPOINTER_TO_UINT(index)
+                                     : PHYS_SECTION_NONE;
+    }
+    g_hash_table_destroy(indexes);
+}
+
 static void mem_commit(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
@@ -1876,26 +2115,136 @@ static void mem_commit(MemoryListener *listener)
     as->dispatch = next;
 
     if (cur) {
+        phys_sections_remap(next, cur);
         phys_sections_free(&cur->map);
+        g_free(cur->remap);
         g_free(cur);
     }
 }
 
+static void tcg_memory_change_add(TCGMemoryListener *tl, bool ram,
+                                  hwaddr start, uint64_t size)
+{
+    if (tl->nb_changes < TCG_MAX_MEMORY_CHANGES) {
+        tl->changes[tl->nb_changes] = (TCGMemoryChange) {
+            .ram = ram, .start = start, .size = size,
+        };
+    }
+    tl->nb_changes++;
+}
+
+static bool tcg_memory_changed(TCGMemoryListener *tl, bool ram, hwaddr page)
+{
+    int i;
+
+    for (i = 0; i < tl->nb_changes; i++) {
+        if (tl->changes[i].ram == ram &&
+            ranges_overlap(tl->changes[i].start, tl->changes[i].size,
+                           page, TARGET_PAGE_SIZE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Called for the ranges added, removed or with a logging change.  The
+   RAM behind a range is recorded too, as RAM TLB entries only hold the
+   ram_addr_t.  */
+static void tcg_region_change(MemoryListener *listener,
+                              MemoryRegionSection *section)
+{
+    TCGMemoryListener *tl = container_of(listener, TCGMemoryListener,
+                                         listener);
+    uint64_t size;
+
+    if (!int128_lt(section->size, int128_2_64())) {
+        tl->nb_changes = TCG_MAX_MEMORY_CHANGES + 1;
+        return;
+    }
+    size = int128_get64(section->size);
+    tcg_memory_change_add(tl, false, section->offset_within_address_space,
+                          size);
+    if (memory_region_is_ram(section->mr)) {
+        tcg_memory_change_add(tl, true,
+                              memory_region_get_ram_addr(section->mr) +
+                              section->offset_within_region, size);
+    }
+}
+
+/* Keep the TLB entries of the pages which did not change, with their
+   section index moved to the new dispatch.  The others are flushed.  */
+static void tcg_tlb_remap(TCGMemoryListener *tl, AddressSpaceDispatch *d)
+{
+    CPUState *cpu = tl->cpu;
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBEntry *te;
+    PhysSectionRemap *r;
+    target_ulong vaddr;
+    hwaddr iotlb, xlat;
+    unsigned index;
+    int mmu_idx, i;
+    bool keep;
+
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    cpu->current_tb = NULL;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            te = &env->tlb_table[mmu_idx][i];
+            if (te->addr_read != -1) {
+                vaddr = te->addr_read;
+            } else if (te->addr_write != -1) {
+                vaddr = te->addr_write;
+            } else if (te->addr_code != -1) {
+                vaddr = te->addr_code;
+            } else {
+                continue;
+            }
+            vaddr &= TARGET_PAGE_MASK;
+            iotlb = env->iotlb[mmu_idx][i] + vaddr;
+            index = iotlb & ~TARGET_PAGE_MASK;
+            xlat = iotlb & TARGET_PAGE_MASK;
+
+            switch (index) {
+            case PHYS_SECTION_NOTDIRTY:
+            case PHYS_SECTION_ROM:
+                keep = !tcg_memory_changed(tl, true, xlat);
+                break;
+            case PHYS_SECTION_UNASSIGNED:
+            case PHYS_SECTION_WATCH:
+                keep = !tcg_memory_changed(tl, false, xlat);
+                break;
+            default:
+                r = index < d->remap_nb ? &d->remap[index] : NULL;
+                keep = r && r->index != PHYS_SECTION_NONE &&
+                       !tcg_memory_changed(tl, false, xlat + r->base);
+                if (keep) {
+                    env->iotlb[mmu_idx][i] += (hwaddr)r->index - index;
+                }
+                break;
+            }
+            if (!keep) {
+                tlb_flush_page(cpu, vaddr);
+            }
+        }
+    }
+}
+
 static void tcg_commit(MemoryListener *listener)
 {
-    CPUState *cpu;
+    TCGMemoryListener *tl = container_of(listener, TCGMemoryListener,
+                                         listener);
+    AddressSpaceDispatch *d = tl->cpu->as->dispatch;
 
     /* since each CPU stores ram addresses in its TLB cache, we must
        reset the modified entries */
-    /* XXX: slow ! */
-    CPU_FOREACH(cpu) {
-        /* FIXME: Disentangle the cpu.h circular files deps so we can
-           directly get the right CPU from listener.  */
-        if (cpu->tcg_as_listener != listener) {
-            continue;
-        }
-        tlb_flush(cpu, 1);
+    if (tl->nb_changes > TCG_MAX_MEMORY_CHANGES || !d->remap) {
+        tlb_flush(tl->cpu, 1);
+    } else {
+        tcg_tlb_remap(tl, d);
     }
+    tl->nb_changes = 0;
 }
 
 static void core_log_global_start(MemoryListener *listener)
@@ -1932,6 +2281,9 @@ void address_space_destroy_dispatch(AddressSpace *as)
     AddressSpaceDispatch *d = as->dispatch;
 
     memory_listener_unregister(&as->dispatch_listener);
+    if (d) {
+        g_free(d->remap);
+    }
     g_free(d);
     as->dispatch = NULL;
 }
@@ -2091,6 +2443,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
             } else {
                 addr1 += memory_region_get_ram_addr(mr);
                 /* RAM case */
+                ram_lazy_fault(addr1, l);
                 ptr = qemu_get_ram_ptr(addr1);
                 memcpy(ptr, buf, l);
                 invalidate_and_set_dirty(addr1, l);
@@ -2125,6 +2478,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                 }
             } else {
                 /* RAM case */
+                ram_lazy_fault(mr->ram_addr + addr1, l);
                 ptr = qemu_get_ram_ptr(mr->ram_addr + addr1);
                 memcpy(buf, ptr, l);
             }
@@ -2178,10 +2532,16 @@ static inline void cpu_physical_memory_write_rom_internal(AddressSpace *as,
         } else {
             addr1 += memory_region_get_ram_addr(mr);
             /* ROM/RAM case */
+            ram_lazy_fault(addr1, l);
             ptr = qemu_get_ram_ptr(addr1);
             switch (type) {
             case WRITE_DATA:
                 memcpy(ptr, buf, l);
+                if (memory_region_is_rom_exec(mr)) {
+                    /* Code pages in this region are not tracked by the
+                     * dirty bitmap, so always drop translated code.  */
+                    tb_invalidate_phys_range(addr1, addr1 + l, 0);
+                }
                 invalidate_and_set_dirty(addr1, l);
                 break;
             case FLUSH_CACHE:
@@ -2225,7 +2585,35 @@ typedef struct {
     hwaddr len;
 } BounceBuffer;
 
-static BounceBuffer bounce;
+/* Accesses to MMIO regions are staged through one of these.  Having a few
+ * lets a scatter/gather list that touches several of them be mapped in
+ * one pass, and lets several devices DMA to MMIO at once, instead of
+ * waiting for each other through the map client list.  The pool size is
+ * the dma-bounce-buffers machine option.
+ */
+#define BOUNCE_BUFFERS_DEFAULT 8
+
+static BounceBuffer *bounce;
+static unsigned bounce_count;
+
+static BounceBuffer *bounce_buffer_get(void)
+{
+    unsigned i;
+
+    if (!bounce) {
+        bounce_count = qemu_opt_get_number(qemu_get_machine_opts(),
+                                           "dma-bounce-buffers",
+                                           BOUNCE_BUFFERS_DEFAULT);
+        bounce_count = MAX(bounce_count, 1);
+        bounce = g_new0(BounceBuffer, bounce_count);
+    }
+    for (i = 0; i < bounce_count; i++) {
+        if (!bounce[i].buffer) {
+            return &bounce[i];
+        }
+    }
+    return NULL;
+}
 
 typedef struct MapClient {
     void *opaque;
@@ -2311,23 +2699,25 @@ void *address_space_map(AddressSpace *as,
     l = len;
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
     if (!memory_access_is_direct(mr, is_write)) {
-        if (bounce.buffer) {
+        BounceBuffer *b = bounce_buffer_get();
+
+        if (!b) {
             return NULL;
         }
         /* Avoid unbounded allocations */
         l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        b->buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
+        b->addr = addr;
+        b->len = l;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        b->mr = mr;
         if (!is_write) {
-            address_space_read(as, addr, bounce.buffer, l);
+            address_space_read(as, addr, b->buffer, l);
         }
 
         *plen = l;
-        return bounce.buffer;
+        return b->buffer;
     }
 
     base = xlat;
@@ -2350,6 +2740,7 @@ void *address_space_map(AddressSpace *as,
 
     memory_region_ref(mr);
     *plen = done;
+    ram_lazy_fault(raddr + base, done);
     return qemu_ram_ptr_length(raddr + base, plen);
 }
 
@@ -2360,7 +2751,16 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *b = NULL;
+    unsigned i;
+
+    for (i = 0; i < bounce_count; i++) {
+        if (buffer == bounce[i].buffer) {
+            b = &bounce[i];
+            break;
+        }
+    }
+    if (!b) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -2376,11 +2776,11 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, bounce.buffer, access_len);
+        address_space_write(as, b->addr, b->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
+    qemu_vfree(b->buffer);
+    b->buffer = NULL;
+    memory_region_unref(b->mr);
     cpu_notify_map_clients();
 }
 
@@ -2422,9 +2822,9 @@ static inline uint32_t ldl_phys_internal(AddressSpace *as, hwaddr addr,
 #endif
     } else {
         /* RAM case */
-        ptr = qemu_get_ram_ptr((memory_region_get_ram_addr(mr)
-                                & TARGET_PAGE_MASK)
-                               + addr1);
+        addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_lazy_fault(addr1, 4);
+        ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
             val = ldl_le_p(ptr);
@@ -2481,9 +2881,9 @@ static inline uint64_t ldq_phys_internal(AddressSpace *as, hwaddr addr,
 #endif
     } else {
         /* RAM case */
-        ptr = qemu_get_ram_ptr((memory_region_get_ram_addr(mr)
-                                & TARGET_PAGE_MASK)
-                               + addr1);
+        addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_lazy_fault(addr1, 8);
+        ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
             val = ldq_le_p(ptr);
@@ -2548,9 +2948,9 @@ static inline uint32_t lduw_phys_internal(AddressSpace *as, hwaddr addr,
 #endif
     } else {
         /* RAM case */
-        ptr = qemu_get_ram_ptr((memory_region_get_ram_addr(mr)
-                                & TARGET_PAGE_MASK)
-                               + addr1);
+        addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_lazy_fault(addr1, 2);
+        ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
             val = lduw_le_p(ptr);
@@ -2597,6 +2997,7 @@ void stl_phys_notdirty(AddressSpace *as, hwaddr addr, uint32_t val)
         io_mem_write(mr, addr1, val, 4);
     } else {
         addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_lazy_fault(addr1, 4);
         ptr = qemu_get_ram_ptr(addr1);
         stl_p(ptr, val);
 
@@ -2637,6 +3038,7 @@ static inline void stl_phys_internal(AddressSpace *as,
     } else {
         /* RAM case */
         addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_lazy_fault(addr1, 4);
         ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
@@ -2700,6 +3102,7 @@ static inline void stw_phys_internal(AddressSpace *as,
     } else {
         /* RAM case */
         addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_lazy_fault(addr1, 2);
         ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
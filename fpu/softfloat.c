@@ -44,6 +44,9 @@ these four paragraphs for those parts of this code that are retained.
 
 /* We only need stdlib for abort() */
 #include <stdlib.h>
+/* and math.h and float.h for the host FPU fast path */
+#include <math.h>
+#include <float.h>
 
 /*----------------------------------------------------------------------------
 | Primitive arithmetic functions, including multi-word arithmetic, and
@@ -2016,6 +2019,154 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  Adding, subtracting, multiplying or dividing two
+| normal (or zero) operands under round-to-nearest-even gives the same result
+| on any IEEE host, so it is computed there when the only exception that
+| could be missed is inexact and that flag is already raised.  The result is
+| checked afterwards: an overflow is flagged here, and anything tiny enough
+| to underflow is recomputed in software so that tininess detection and
+| flush-to-zero keep their target-specific behaviour.  Hosts that evaluate
+| float expressions in a wider format (x87) would round twice, so they always
+| take the software path.
+*----------------------------------------------------------------------------*/
+#if defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0
+#define SOFTFLOAT_HOST_FPU 1
+#else
+#define SOFTFLOAT_HOST_FPU 0
+#endif
+
+enum {
+    host_fpu_add,
+    host_fpu_sub,
+    host_fpu_mul,
+    host_fpu_div
+};
+
+static inline flag host_fpu_usable(float_status *status)
+{
+    return SOFTFLOAT_HOST_FPU
+        && (STATUS(float_exception_flags) & float_flag_inexact)
+        && STATUS(float_rounding_mode) == float_round_nearest_even;
+}
+
+static inline flag float32_is_zero_or_normal(float32 a)
+{
+    int_fast16_t aExp = extractFloat32Exp(a);
+
+    return aExp != 0xFF && (aExp != 0 || extractFloat32Frac(a) == 0);
+}
+
+static inline flag float64_is_zero_or_normal(float64 a)
+{
+    int_fast16_t aExp = extractFloat64Exp(a);
+
+    return aExp != 0x7FF && (aExp != 0 || extractFloat64Frac(a) == 0);
+}
+
+/*----------------------------------------------------------------------------
+| Tries to compute `a' `op' `b' on the host FPU.  Returns 1 and stores the
+| result in `*zPtr' on success, or 0 if the software path must be taken.
+*----------------------------------------------------------------------------*/
+
+static inline flag float32_host_op(float32 a, float32 b, int op,
+                                   float32 *zPtr STATUS_PARAM)
+{
+    union {
+        float32 s;
+        float h;
+    } ua, ub, uz;
+
+    if (!host_fpu_usable(status)
+        || !float32_is_zero_or_normal(a)
+        || !float32_is_zero_or_normal(b)) {
+        return 0;
+    }
+    ua.s = a;
+    ub.s = b;
+    switch (op) {
+    case host_fpu_add:
+        uz.h = ua.h + ub.h;
+        break;
+    case host_fpu_sub:
+        uz.h = ua.h - ub.h;
+        break;
+    case host_fpu_mul:
+        uz.h = ua.h * ub.h;
+        break;
+    default:
+        /* x/0 raises divbyzero, 0/0 is invalid */
+        if (float32_is_zero(b)) {
+            return 0;
+        }
+        uz.h = ua.h / ub.h;
+        break;
+    }
+    if (isinf(uz.h)) {
+        float_raise(float_flag_overflow | float_flag_inexact STATUS_VAR);
+    } else if (fabsf(uz.h) <= FLT_MIN) {
+        /* Exact zeros need no rounding: 0 +- 0, 0 * x and 0 / x */
+        if (op == host_fpu_add || op == host_fpu_sub) {
+            if (!float32_is_zero(a) || !float32_is_zero(b)) {
+                return 0;
+            }
+        } else if (!float32_is_zero(a)
+                   && (op == host_fpu_div || !float32_is_zero(b))) {
+            return 0;
+        }
+    }
+    *zPtr = uz.s;
+    return 1;
+}
+
+static inline flag float64_host_op(float64 a, float64 b, int op,
+                                   float64 *zPtr STATUS_PARAM)
+{
+    union {
+        float64 s;
+        double h;
+    } ua, ub, uz;
+
+    if (!host_fpu_usable(status)
+        || !float64_is_zero_or_normal(a)
+        || !float64_is_zero_or_normal(b)) {
+        return 0;
+    }
+    ua.s = a;
+    ub.s = b;
+    switch (op) {
+    case host_fpu_add:
+        uz.h = ua.h + ub.h;
+        break;
+    case host_fpu_sub:
+        uz.h = ua.h - ub.h;
+        break;
+    case host_fpu_mul:
+        uz.h = ua.h * ub.h;
+        break;
+    default:
+        if (float64_is_zero(b)) {
+            return 0;
+        }
+        uz.h = ua.h / ub.h;
+        break;
+    }
+    if (isinf(uz.h)) {
+        float_raise(float_flag_overflow | float_flag_inexact STATUS_VAR);
+    } else if (fabs(uz.h) <= DBL_MIN) {
+        if (op == host_fpu_add || op == host_fpu_sub) {
+            if (!float64_is_zero(a) || !float64_is_zero(b)) {
+                return 0;
+            }
+        } else if (!float64_is_zero(a)
+                   && (op == host_fpu_div || !float64_is_zero(b))) {
+            return 0;
+        }
+    }
+    *zPtr = uz.s;
+    return 1;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -2025,9 +2176,14 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float32 z;
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
+    if (float32_host_op(a, b, host_fpu_add, &z STATUS_VAR)) {
+        return z;
+    }
+
     aSign = extractFloat32Sign( a );
     bSign = extractFloat32Sign( b );
     if ( aSign == bSign ) {
@@ -2048,9 +2204,14 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float32 z;
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
+    if (float32_host_op(a, b, host_fpu_sub, &z STATUS_VAR)) {
+        return z;
+    }
+
     aSign = extractFloat32Sign( a );
     bSign = extractFloat32Sign( b );
     if ( aSign == bSign ) {
@@ -2071,6 +2232,7 @@ float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 float32 float32_mul( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign, zSign;
+    float32 z;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig;
     uint64_t zSig64;
@@ -2079,6 +2241,10 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
+    if (float32_host_op(a, b, host_fpu_mul, &z STATUS_VAR)) {
+        return z;
+    }
+
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -2134,11 +2300,16 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
 float32 float32_div( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign, zSign;
+    float32 z;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
+    if (float32_host_op(a, b, host_fpu_div, &z STATUS_VAR)) {
+        return z;
+    }
+
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -3769,9 +3940,14 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float64 z;
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
+    if (float64_host_op(a, b, host_fpu_add, &z STATUS_VAR)) {
+        return z;
+    }
+
     aSign = extractFloat64Sign( a );
     bSign = extractFloat64Sign( b );
     if ( aSign == bSign ) {
@@ -3792,9 +3968,14 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float64 z;
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
+    if (float64_host_op(a, b, host_fpu_sub, &z STATUS_VAR)) {
+        return z;
+    }
+
     aSign = extractFloat64Sign( a );
     bSign = extractFloat64Sign( b );
     if ( aSign == bSign ) {
@@ -3815,12 +3996,17 @@ float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 float64 float64_mul( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign, zSign;
+    float64 z;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
 
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
+    if (float64_host_op(a, b, host_fpu_mul, &z STATUS_VAR)) {
+        return z;
+    }
+
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
@@ -3876,6 +4062,7 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
 float64 float64_div( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign, zSign;
+    float64 z;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
@@ -3883,6 +4070,10 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
+    if (float64_host_op(a, b, host_fpu_div, &z STATUS_VAR)) {
+        return z;
+    }
+
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
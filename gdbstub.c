@@ -35,10 +35,11 @@
 #include "exec/gdbstub.h"
 #endif
 
-#define MAX_PACKET_LENGTH 4096
+#define MAX_PACKET_LENGTH 16384
 
 #include "cpu.h"
 #include "qemu/sockets.h"
+#include "qemu/bitops.h"
 #include "sysemu/kvm.h"
 
 static inline int target_memory_rw_debug(CPUState *cpu, target_ulong addr,
@@ -317,6 +318,16 @@ static GDBState *gdbserver_state;
 
 bool gdb_has_xml;
 
+/* Memory map XML for qXfer:memory-map:read, set by the board */
+static char *gdb_memory_map;
+
+void gdb_set_memory_map(const char *xml)
+{
+    if (!gdb_memory_map) {
+        gdb_memory_map = g_strdup(xml);
+    }
+}
+
 #ifdef CONFIG_USER_ONLY
 /* XXX: This is not thread safe.  Do we care?  */
 static int gdbserver_fd = -1;
@@ -503,6 +514,52 @@ static int memtox(char *buf, const char *mem, int len)
     return p - buf;
 }
 
+/* Decode the binary data of 'X' and vFlashWrite packets, which ends at
+ * @end.  Returns the number of bytes stored in @mem.  */
+static int xtomem(uint8_t *mem, const char *buf, const char *end)
+{
+    uint8_t *p = mem;
+
+    while (buf < end) {
+        if (*buf == '}' && buf + 1 < end) {
+            *(p++) = buf[1] ^ 0x20;
+            buf += 2;
+        } else {
+            *(p++) = *(buf++);
+        }
+    }
+    return p - mem;
+}
+
+/* Send the part of an XML document that a qXfer read asks for, @p points
+ * to its "offset,length".  */
+static void put_xfer_packet(GDBState *s, const char *xml, const char *p)
+{
+    char buf[MAX_PACKET_LENGTH];
+    target_ulong addr, len, total_len;
+
+    addr = strtoul(p, (char **)&p, 16);
+    if (*p == ',')
+        p++;
+    len = strtoul(p, (char **)&p, 16);
+
+    total_len = strlen(xml);
+    if (addr > total_len) {
+        put_packet(s, "E00");
+        return;
+    }
+    if (len > (MAX_PACKET_LENGTH - 5) / 2)
+        len = (MAX_PACKET_LENGTH - 5) / 2;
+    if (len < total_len - addr) {
+        buf[0] = 'm';
+        len = memtox(buf + 1, xml + addr, len);
+    } else {
+        buf[0] = 'l';
+        len = memtox(buf + 1, xml + addr, total_len - addr);
+    }
+    put_packet_binary(s, buf, len + 1);
+}
+
 static const char *get_feature_xml(const char *p, const char **newp,
                                    CPUClass *cc)
 {
@@ -632,7 +689,379 @@ static const int xlat_gdb_type[] = {
 };
 #endif
 
-static int gdb_breakpoint_insert(target_ulong addr, target_ulong len, int type)
+/* Conditions of the breakpoints, as agent expressions: a breakpoint with
+ * conditions only stops the CPU if one of them is true.  They come with the
+ * Z0 and Z1 packets, which gdb sends again for a breakpoint that is already
+ * in to change them, and are evaluated when the breakpoint is hit so that
+ * the CPU goes on without a round trip to gdb when they are all false. */
+
+#define GDB_AGENT_STACK_SIZE 32
+#define GDB_AGENT_MAX_STEPS 10000
+
+/* Agent expression opcodes, see "Bytecode Descriptions" in the gdb manual.
+ * The floating point, trace and state variable ones are not supported. */
+enum {
+    AX_ADD = 0x02,
+    AX_SUB = 0x03,
+    AX_MUL = 0x04,
+    AX_DIV_SIGNED = 0x05,
+    AX_DIV_UNSIGNED = 0x06,
+    AX_REM_SIGNED = 0x07,
+    AX_REM_UNSIGNED = 0x08,
+    AX_LSH = 0x09,
+    AX_RSH_SIGNED = 0x0a,
+    AX_RSH_UNSIGNED = 0x0b,
+    AX_LOG_NOT = 0x0e,
+    AX_BIT_AND = 0x0f,
+    AX_BIT_OR = 0x10,
+    AX_BIT_XOR = 0x11,
+    AX_BIT_NOT = 0x12,
+    AX_EQUAL = 0x13,
+    AX_LESS_SIGNED = 0x14,
+    AX_LESS_UNSIGNED = 0x15,
+    AX_EXT = 0x16,
+    AX_REF8 = 0x17,
+    AX_REF16 = 0x18,
+    AX_REF32 = 0x19,
+    AX_REF64 = 0x1a,
+    AX_IF_GOTO = 0x20,
+    AX_GOTO = 0x21,
+    AX_CONST8 = 0x22,
+    AX_CONST16 = 0x23,
+    AX_CONST32 = 0x24,
+    AX_CONST64 = 0x25,
+    AX_REG = 0x26,
+    AX_END = 0x27,
+    AX_DUP = 0x28,
+    AX_POP = 0x29,
+    AX_ZERO_EXT = 0x2a,
+    AX_SWAP = 0x2b,
+    AX_PICK = 0x32,
+    AX_ROT = 0x33,
+};
+
+typedef struct GDBBreakpointCond {
+    target_ulong addr;
+    int len;
+    QTAILQ_ENTRY(GDBBreakpointCond) entry;
+    uint8_t code[];
+} GDBBreakpointCond;
+
+static QTAILQ_HEAD(, GDBBreakpointCond) gdb_breakpoint_conds =
+    QTAILQ_HEAD_INITIALIZER(gdb_breakpoint_conds);
+
+/* Return the value of a big endian operand of size bytes */
+static uint64_t gdb_agent_operand(const uint8_t *code, int size)
+{
+    uint64_t val = 0;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        val = (val << 8) | code[i];
+    }
+    return val;
+}
+
+/* Evaluate an agent expression into *res.  Returns -1 if it is invalid
+ * or uses something that is not supported. */
+static int gdb_agent_eval(CPUState *cpu, const uint8_t *code, int len,
+                          uint64_t *res)
+{
+    uint64_t stack[GDB_AGENT_STACK_SIZE];
+    uint8_t buf[64];
+    int sp = 0, pc = 0, steps, size, n;
+    uint64_t a, b;
+    uint8_t op;
+
+    for (steps = 0; steps < GDB_AGENT_MAX_STEPS; steps++) {
+        if (pc >= len) {
+            return -1;
+        }
+        op = code[pc++];
+        switch (op) {
+        case AX_ADD ... AX_RSH_UNSIGNED:
+        case AX_BIT_AND ... AX_BIT_XOR:
+        case AX_EQUAL ... AX_LESS_UNSIGNED:
+            if (sp < 2) {
+                return -1;
+            }
+            b = stack[--sp];
+            a = stack[sp - 1];
+            switch (op) {
+            case AX_ADD:
+                a += b;
+                break;
+            case AX_SUB:
+                a -= b;
+                break;
+            case AX_MUL:
+                a *= b;
+                break;
+            case AX_DIV_SIGNED:
+            case AX_REM_SIGNED:
+                if (b == 0) {
+                    return -1;
+                }
+                if ((int64_t)b == -1) {
+                    /* Avoid the INT64_MIN / -1 overflow */
+                    a = op == AX_DIV_SIGNED ? -a : 0;
+                } else if (op == AX_DIV_SIGNED) {
+                    a = (int64_t)a / (int64_t)b;
+                } else {
+                    a = (int64_t)a % (int64_t)b;
+                }
+                break;
+            case AX_DIV_UNSIGNED:
+            case AX_REM_UNSIGNED:
+                if (b == 0) {
+                    return -1;
+                }
+                a = op == AX_DIV_UNSIGNED ? a / b : a % b;
+                break;
+            case AX_LSH:
+                a = b < 64 ? a << b : 0;
+                break;
+            case AX_RSH_SIGNED:
+                a = (int64_t)a >> (b < 64 ? b : 63);
+                break;
+            case AX_RSH_UNSIGNED:
+                a = b < 64 ? a >> b : 0;
+                break;
+            case AX_BIT_AND:
+                a &= b;
+                break;
+            case AX_BIT_OR:
+                a |= b;
+                break;
+            case AX_BIT_XOR:
+                a ^= b;
+                break;
+            case AX_EQUAL:
+                a = a == b;
+                break;
+            case AX_LESS_SIGNED:
+                a = (int64_t)a < (int64_t)b;
+                break;
+            case AX_LESS_UNSIGNED:
+                a = a < b;
+                break;
+            }
+            stack[sp - 1] = a;
+            break;
+        case AX_LOG_NOT:
+        case AX_BIT_NOT:
+            if (sp < 1) {
+                return -1;
+            }
+            stack[sp - 1] = op == AX_LOG_NOT ? !stack[sp - 1] : ~stack[sp - 1];
+            break;
+        case AX_EXT:
+        case AX_ZERO_EXT:
+            if (sp < 1 || pc + 1 > len) {
+                return -1;
+            }
+            n = code[pc++];
+            if (n == 0 || n >= 64) {
+                break;
+            }
+            if (op == AX_EXT) {
+                stack[sp - 1] = sextract64(stack[sp - 1], 0, n);
+            } else {
+                stack[sp - 1] = extract64(stack[sp - 1], 0, n);
+            }
+            break;
+        case AX_REF8 ... AX_REF64:
+            if (sp < 1) {
+                return -1;
+            }
+            size = 1 << (op - AX_REF8);
+            if (target_memory_rw_debug(cpu, stack[sp - 1], buf, size,
+                                       false) != 0) {
+                return -1;
+            }
+            switch (size) {
+            case 1:
+                stack[sp - 1] = ldub_p(buf);
+                break;
+            case 2:
+                stack[sp - 1] = lduw_p(buf);
+                break;
+            case 4:
+                stack[sp - 1] = ldl_p(buf);
+                break;
+            default:
+                stack[sp - 1] = ldq_p(buf);
+                break;
+            }
+            break;
+        case AX_IF_GOTO:
+        case AX_GOTO:
+            if (pc + 2 > len || (op == AX_IF_GOTO && sp < 1)) {
+                return -1;
+            }
+            n = gdb_agent_operand(code + pc, 2);
+            pc += 2;
+            if (op == AX_GOTO || stack[--sp]) {
+                pc = n;
+            }
+            break;
+        case AX_CONST8 ... AX_CONST64:
+        case AX_REG:
+            size = op == AX_REG ? 2 : 1 << (op - AX_CONST8);
+            if (pc + size > len || sp >= GDB_AGENT_STACK_SIZE) {
+                return -1;
+            }
+            a = gdb_agent_operand(code + pc, size);
+            pc += size;
+            if (op == AX_REG) {
+                switch (gdb_read_register(cpu, buf, a)) {
+                case 1:
+                    a = ldub_p(buf);
+                    break;
+                case 2:
+                    a = lduw_p(buf);
+                    break;
+                case 4:
+                    a = ldl_p(buf);
+                    break;
+                case 8:
+                    a = ldq_p(buf);
+                    break;
+                default:
+                    return -1;
+                }
+            }
+            stack[sp++] = a;
+            break;
+        case AX_END:
+            if (sp < 1) {
+                return -1;
+            }
+            *res = stack[sp - 1];
+            return 0;
+        case AX_DUP:
+        case AX_PICK:
+            n = 0;
+            if (op == AX_PICK) {
+                if (pc + 1 > len) {
+                    return -1;
+                }
+                n = code[pc++];
+            }
+            if (sp < n + 1 || sp >= GDB_AGENT_STACK_SIZE) {
+                return -1;
+            }
+            stack[sp] = stack[sp - 1 - n];
+            sp++;
+            break;
+        case AX_POP:
+            if (sp < 1) {
+                return -1;
+            }
+            sp--;
+            break;
+        case AX_SWAP:
+            if (sp < 2) {
+                return -1;
+            }
+            a = stack[sp - 1];
+            stack[sp - 1] = stack[sp - 2];
+            stack[sp - 2] = a;
+            break;
+        case AX_ROT:
+            /* a b c => c a b */
+            if (sp < 3) {
+                return -1;
+            }
+            a = stack[sp - 1];
+            stack[sp - 1] = stack[sp - 2];
+            stack[sp - 2] = stack[sp - 3];
+            stack[sp - 3] = a;
+            break;
+        default:
+            return -1;
+        }
+    }
+    /* Probably an endless loop */
+    return -1;
+}
+
+static void gdb_breakpoint_clear_conds(target_ulong addr)
+{
+    GDBBreakpointCond *cond, *next;
+
+    QTAILQ_FOREACH_SAFE(cond, &gdb_breakpoint_conds, entry, next) {
+        if (cond->addr == addr) {
+            QTAILQ_REMOVE(&gdb_breakpoint_conds, cond, entry);
+            g_free(cond);
+        }
+    }
+}
+
+/* Replace the conditions of the breakpoint at addr by the cond_list of a
+ * Z packet, ";Xlen,expr" for each one. */
+static int gdb_breakpoint_set_conds(target_ulong addr, const char *p)
+{
+    GDBBreakpointCond *cond;
+    const char *q;
+    unsigned long len;
+
+    for (q = p; *q == ';' && q[1] == 'X'; q += len * 2) {
+        len = strtoul(q + 2, (char **)&q, 16);
+        if (*q++ != ',' || len == 0 || len > strlen(q) / 2) {
+            return -EINVAL;
+        }
+    }
+    if (*q) {
+        return -EINVAL;
+    }
+
+    gdb_breakpoint_clear_conds(addr);
+    while (*p) {
+        len = strtoul(p + 2, (char **)&p, 16);
+        p++;
+        cond = g_malloc(sizeof(*cond) + len);
+        cond->addr = addr;
+        cond->len = len;
+        hextomem(cond->code, p, len);
+        p += len * 2;
+        QTAILQ_INSERT_TAIL(&gdb_breakpoint_conds, cond, entry);
+    }
+    return 0;
+}
+
+bool gdb_breakpoint_condition(CPUState *cpu, target_ulong pc)
+{
+    GDBBreakpointCond *cond;
+    bool has_conds = false;
+    uint64_t res;
+
+    QTAILQ_FOREACH(cond, &gdb_breakpoint_conds, entry) {
+        if (cond->addr == pc) {
+            /* A condition that cannot be evaluated stops the CPU */
+            if (gdb_agent_eval(cpu, cond->code, cond->len, &res) < 0 || res) {
+                return true;
+            }
+            has_conds = true;
+        }
+    }
+    return !has_conds;
+}
+
+static bool gdb_has_breakpoint(CPUState *cpu, target_ulong addr)
+{
+    CPUBreakpoint *bp;
+
+    QTAILQ_FOREACH(bp, &cpu->breakpoints, entry) {
+        if (bp->pc == addr && (bp->flags & BP_GDB)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int gdb_breakpoint_insert(target_ulong addr, target_ulong len, int type,
+                                 const char *conds)
 {
     CPUState *cpu;
     int err = 0;
@@ -644,9 +1073,18 @@ static int gdb_breakpoint_insert(target_ulong addr, target_ulong len, int type)
     switch (type) {
     case GDB_BREAKPOINT_SW:
     case GDB_BREAKPOINT_HW:
+        err = gdb_breakpoint_set_conds(addr, conds);
+        if (err) {
+            return err;
+        }
         CPU_FOREACH(cpu) {
+            if (gdb_has_breakpoint(cpu, addr)) {
+                /* Only its conditions change */
+                continue;
+            }
             err = cpu_breakpoint_insert(cpu, addr, BP_GDB, NULL);
             if (err) {
+                gdb_breakpoint_clear_conds(addr);
                 break;
             }
         }
@@ -680,6 +1118,7 @@ static int gdb_breakpoint_remove(target_ulong addr, target_ulong len, int type)
     switch (type) {
     case GDB_BREAKPOINT_SW:
     case GDB_BREAKPOINT_HW:
+        gdb_breakpoint_clear_conds(addr);
         CPU_FOREACH(cpu) {
             err = cpu_breakpoint_remove(cpu, addr, BP_GDB);
             if (err) {
@@ -718,6 +1157,9 @@ static void gdb_breakpoint_remove_all(void)
         cpu_watchpoint_remove_all(cpu, BP_GDB);
 #endif
     }
+    while (!QTAILQ_EMPTY(&gdb_breakpoint_conds)) {
+        gdb_breakpoint_clear_conds(QTAILQ_FIRST(&gdb_breakpoint_conds)->addr);
+    }
 }
 
 static void gdb_set_cpu_pc(GDBState *s, target_ulong pc)
@@ -842,6 +1284,41 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
                 return RS_IDLE;
             }
             break;
+        } else if (strncmp(p, "FlashErase:", 11) == 0) {
+            /* Flash regions of the memory map (see gdb_set_memory_map())
+             * are written directly, as ROM, like the 'M' packet does. */
+            addr = strtoull(p + 11, (char **)&p, 16);
+            if (*p == ',')
+                p++;
+            len = strtoull(p, NULL, 16);
+            memset(mem_buf, 0xff, sizeof(mem_buf));
+            res = 0;
+            while (len && !res) {
+                target_ulong l = MIN(len, sizeof(mem_buf));
+
+                res = target_memory_rw_debug(s->g_cpu, addr, mem_buf, l, true);
+                addr += l;
+                len -= l;
+            }
+            put_packet(s, res ? "E14" : "OK");
+            break;
+        } else if (strncmp(p, "FlashWrite:", 11) == 0) {
+            addr = strtoull(p + 11, (char **)&p, 16);
+            if (*p++ != ':') {
+                put_packet(s, "E22");
+                break;
+            }
+            len = xtomem(mem_buf, p, line_buf + s->line_buf_index);
+            if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len,
+                                       true) != 0) {
+                put_packet(s, "E14");
+            } else {
+                put_packet(s, "OK");
+            }
+            break;
+        } else if (strcmp(p, "FlashDone") == 0) {
+            put_packet(s, "OK");
+            break;
         } else {
             goto unknown_command;
         }
@@ -919,6 +1396,9 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         if (*p == ',')
             p++;
         len = strtoull(p, NULL, 16);
+        /* The reply may be shorter than asked for */
+        if (len > (MAX_PACKET_LENGTH - 1) / 2)
+            len = (MAX_PACKET_LENGTH - 1) / 2;
         if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, false) != 0) {
             put_packet (s, "E14");
         } else {
@@ -926,6 +1406,22 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             put_packet(s, buf);
         }
         break;
+    case 'x':
+        /* Binary read: each byte takes at most two characters, after 'b' */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, NULL, 16);
+        if (len > (MAX_PACKET_LENGTH - 1) / 2)
+            len = (MAX_PACKET_LENGTH - 1) / 2;
+        if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, false) != 0) {
+            put_packet (s, "E14");
+        } else {
+            buf[0] = 'b';
+            len = memtox(buf + 1, (const char *)mem_buf, len);
+            put_packet_binary(s, buf, len + 1);
+        }
+        break;
     case 'M':
         addr = strtoull(p, (char **)&p, 16);
         if (*p == ',')
@@ -933,6 +1429,10 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         len = strtoull(p, (char **)&p, 16);
         if (*p == ':')
             p++;
+        if (len > strlen(p) / 2) {
+            put_packet(s, "E22");
+            break;
+        }
         hextomem(mem_buf, p, len);
         if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len,
                                    true) != 0) {
@@ -941,6 +1441,25 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             put_packet(s, "OK");
         }
         break;
+    case 'X':
+        /* Binary write.  The data may contain NULs, so its end is taken
+         * from the packet length. */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, (char **)&p, 16);
+        if (*p++ != ':' ||
+            xtomem(mem_buf, p, line_buf + s->line_buf_index) != len) {
+            put_packet(s, "E22");
+            break;
+        }
+        if (len && target_memory_rw_debug(s->g_cpu, addr, mem_buf, len,
+                                          true) != 0) {
+            put_packet(s, "E14");
+        } else {
+            put_packet(s, "OK");
+        }
+        break;
     case 'p':
         /* Older gdb are really dumb, and don't use 'g' if 'p' is avaialable.
            This works, but can be very slow.  Anything new enough to
@@ -977,7 +1496,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             p++;
         len = strtoull(p, (char **)&p, 16);
         if (ch == 'Z')
-            res = gdb_breakpoint_insert(addr, len, type);
+            res = gdb_breakpoint_insert(addr, len, type, p);
         else
             res = gdb_breakpoint_remove(addr, len, type);
         if (res >= 0)
@@ -1113,12 +1632,18 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             if (cc->gdb_core_xml_file != NULL) {
                 pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
             }
+            if (gdb_memory_map) {
+                pstrcat(buf, sizeof(buf), ";qXfer:memory-map:read+");
+            }
+            pstrcat(buf, sizeof(buf), ";binary-upload+");
+            if (!kvm_enabled()) {
+                pstrcat(buf, sizeof(buf), ";ConditionalBreakpoints+");
+            }
             put_packet(s, buf);
             break;
         }
         if (strncmp(p, "Xfer:features:read:", 19) == 0) {
             const char *xml;
-            target_ulong total_len;
 
             cc = CPU_GET_CLASS(first_cpu);
             if (cc->gdb_core_xml_file == NULL) {
@@ -1136,27 +1661,14 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
 
             if (*p == ':')
                 p++;
-            addr = strtoul(p, (char **)&p, 16);
-            if (*p == ',')
-                p++;
-            len = strtoul(p, (char **)&p, 16);
-
-            total_len = strlen(xml);
-            if (addr > total_len) {
-                snprintf(buf, sizeof(buf), "E00");
-                put_packet(s, buf);
-                break;
-            }
-            if (len > (MAX_PACKET_LENGTH - 5) / 2)
-                len = (MAX_PACKET_LENGTH - 5) / 2;
-            if (len < total_len - addr) {
-                buf[0] = 'm';
-                len = memtox(buf + 1, xml + addr, len);
-            } else {
-                buf[0] = 'l';
-                len = memtox(buf + 1, xml + addr, total_len - addr);
+            put_xfer_packet(s, xml, p);
+            break;
+        }
+        if (strncmp(p, "Xfer:memory-map:read::", 22) == 0) {
+            if (!gdb_memory_map) {
+                goto unknown_command;
             }
-            put_packet_binary(s, buf, len + 1);
+            put_xfer_packet(s, gdb_memory_map, p + 22);
             break;
         }
         /* Unrecognised 'q' command.  */
@@ -314,19 +314,26 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l to save RAM while the VM runs",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, RAM is saved while the VM keeps running, in rounds like
+a migration, and the VM only stops to save the devices and the pages
+dirtied during the last round.  The downtime target is the one of
+@code{migrate_set_downtime}.  The monitor waits until the snapshot is
+complete.
 ETEXI
 
     {
@@ -343,6 +350,11 @@ STEXI
 @findex loadvm
 Set the whole virtual machine to the snapshot identified by the tag
 @var{tag} or the unique snapshot ID @var{id}.
+
+With TCG, the RAM of the machine is not read before the guest resumes:
+each page is read from the snapshot when it is first accessed, and the
+rest in the background.  The RAM of devices, and all of it with KVM or
+Xen, is still read at once.
 ETEXI
 
     {
@@ -358,6 +370,37 @@ STEXI
 @item delvm @var{tag}|@var{id}
 @findex delvm
 Delete the snapshot identified by @var{tag} or @var{id}.
+ETEXI
+
+    {
+        .name       = "checkpoint_save",
+        .args_type  = "",
+        .params     = "",
+        .help       = "save the machine state to memory",
+        .mhandler.cmd = hmp_checkpoint_save,
+    },
+
+STEXI
+@item checkpoint_save
+@findex checkpoint_save
+Save the state of the devices and the contents of RAM to memory, replacing
+the previous checkpoint.  Unlike @code{savevm}, this needs no disk image and
+only copies the RAM pages written since the last checkpoint.
+ETEXI
+
+    {
+        .name       = "checkpoint_restore",
+        .args_type  = "",
+        .params     = "",
+        .help       = "restore the machine state saved by checkpoint_save",
+        .mhandler.cmd = hmp_checkpoint_restore,
+    },
+
+STEXI
+@item checkpoint_restore
+@findex checkpoint_restore
+Put the machine back into the state saved by the last @code{checkpoint_save}.
+The checkpoint is kept, so it can be restored any number of times.
 ETEXI
 
     {
@@ -984,6 +1027,22 @@ STEXI
 @item migrate_set_capability @var{capability} @var{state}
 @findex migrate_set_capability
 Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set the compress-level, compress-threads or "
+                      "decompress-threads parameter for migration",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the parameter @var{parameter} of the compress capability to @var{value}:
+compress-level (0 to 9), compress-threads or decompress-threads (1 to 255).
 ETEXI
 
     {
@@ -1006,10 +1065,11 @@ ETEXI
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,zlib:-z,lzo:-l,snappy:-s,filename:F,begin:i?,length:i?",
-        .params     = "[-p] [-z|-l|-s] filename [begin length]",
+        .args_type  = "paging:-p,detach:-d,zlib:-z,lzo:-l,snappy:-s,filename:F,begin:i?,length:i?",
+        .params     = "[-p] [-d] [-z|-l|-s] filename [begin length]",
         .help       = "dump guest memory into file 'filename'.\n\t\t\t"
                       "-p: do paging to get guest's memory mapping.\n\t\t\t"
+                      "-d: return at once and dump in the background.\n\t\t\t"
                       "-z: dump in kdump-compressed format, with zlib compression.\n\t\t\t"
                       "-l: dump in kdump-compressed format, with lzo compression.\n\t\t\t"
                       "-s: dump in kdump-compressed format, with snappy compression.\n\t\t\t"
@@ -1020,12 +1080,14 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{filename} @var{begin} @var{length}
-@item dump-guest-memory [-z|-l|-s] @var{filename}
+@item dump-guest-memory [-p] [-d] @var{filename} @var{begin} @var{length}
+@item dump-guest-memory [-d] [-z|-l|-s] @var{filename}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb. Without -z|-l|-s, the dump format is ELF.
         -p: do paging to get guest's memory mapping.
+        -d: return at once and dump in the background, see "info dump".
+            The guest stays stopped until the dump is done.
         -z: dump in kdump-compressed format, with zlib compression.
         -l: dump in kdump-compressed format, with lzo compression.
         -s: dump in kdump-compressed format, with snappy compression.
@@ -1766,6 +1828,8 @@ show CPU statistics
 show user network stack connection states
 @item info migrate
 show migration status
+@item info dump
+show the progress of the last guest memory dump
 @item info migrate_capabilities
 show current migration capabilities
 @item info migrate_cache_size
@@ -1780,6 +1844,8 @@ show qdev device model list
 show roms
 @item info tpm
 show the TPM device
+@item info mmio-stats
+show MMIO access counts and host time per memory region
 @end table
 ETEXI
 
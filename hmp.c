@@ -168,6 +168,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
                            info->downtime);
         }
+        if (info->has_downtime_live && info->has_downtime_devices) {
+            monitor_printf(mon, "downtime breakdown: %" PRIu64
+                           " milliseconds live sections, %" PRIu64
+                           " milliseconds devices\n",
+                           info->downtime_live, info->downtime_devices);
+        }
         if (info->has_setup_time) {
             monitor_printf(mon, "setup: %" PRIu64 " milliseconds\n",
                            info->setup_time);
@@ -215,8 +221,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->bytes >> 10);
         monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
                        info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
@@ -1077,6 +1087,29 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    if (strcmp(param, "compress-level") == 0) {
+        qmp_migrate_set_parameters(true, value, false, 0, false, 0, &err);
+    } else if (strcmp(param, "compress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, true, value, false, 0, &err);
+    } else if (strcmp(param, "decompress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, true, value, &err);
+    } else {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -1322,6 +1355,7 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
     int paging = qdict_get_try_bool(qdict, "paging", 0);
+    int detach = qdict_get_try_bool(qdict, "detach", 0);
     int zlib = qdict_get_try_bool(qdict, "zlib", 0);
     int lzo = qdict_get_try_bool(qdict, "lzo", 0);
     int snappy = qdict_get_try_bool(qdict, "snappy", 0);
@@ -1361,11 +1395,25 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, has_begin, begin, has_length, length,
-                          true, dump_format, &err);
+                          true, dump_format, true, detach, &err);
     hmp_handle_error(mon, &err);
     g_free(prot);
 }
 
+void hmp_info_dump(Monitor *mon, const QDict *qdict)
+{
+    DumpQueryResult *result = qmp_query_dump(NULL);
+
+    monitor_printf(mon, "Status: %s\n", DumpStatus_lookup[result->status]);
+    if (result->status != DUMP_STATUS_NONE) {
+        monitor_printf(mon, "Dumped: %" PRId64 " of %" PRId64 " bytes"
+                       " (%.1f%%)\n", result->completed, result->total,
+                       result->total ?
+                       100.0 * result->completed / result->total : 100.0);
+    }
+    qapi_free_DumpQueryResult(result);
+}
+
 void hmp_netdev_add(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -1714,3 +1762,38 @@ void hmp_info_memdev(Monitor *mon, const QDict *qdict)
 
     monitor_printf(mon, "\n");
 }
+
+void hmp_info_mmio_stats(Monitor *mon, const QDict *qdict)
+{
+    MmioStatsInfoList *list = qmp_query_mmio_stats(NULL);
+    MmioStatsInfoList *l;
+
+    monitor_printf(mon, "%-24s %12s %12s %14s %14s\n",
+                   "region", "reads", "writes", "read ns", "write ns");
+    for (l = list; l; l = l->next) {
+        monitor_printf(mon, "%-24s %12" PRIu64 " %12" PRIu64
+                       " %14" PRIu64 " %14" PRIu64 "%s%s\n",
+                       l->value->name, l->value->reads, l->value->writes,
+                       l->value->read_ns, l->value->write_ns,
+                       l->value->has_path ? " " : "",
+                       l->value->has_path ? l->value->path : "");
+    }
+
+    qapi_free_MmioStatsInfoList(list);
+}
+
+void hmp_checkpoint_save(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_checkpoint_save(&err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_checkpoint_restore(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_checkpoint_restore(&err);
+    hmp_handle_error(mon, &err);
+}
@@ -39,6 +39,69 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     return err;
 }
 
+/*
+ * Read the entries that fit in max_size bytes of a Rreaddir reply with a
+ * single trip to a worker thread, instead of one per entry.  The
+ * directory is left positioned after the last entry returned.  Returns
+ * the number of entries stored in a newly allocated array in *entries,
+ * or a negative errno.
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                         struct dirent **entries, int32_t max_size)
+{
+    int err;
+    V9fsState *s = pdu->s;
+    struct dirent *dents = NULL;
+    int count = 0;
+
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(
+        {
+            struct dirent dent, *result;
+            int32_t size = 0, len;
+            off_t saved_dir_pos;
+
+            err = 0;
+            saved_dir_pos = s->ops->telldir(&s->ctx, &fidp->fs);
+            if (saved_dir_pos < 0) {
+                err = -errno;
+            }
+            while (!err) {
+                errno = 0;
+                s->ops->readdir_r(&s->ctx, &fidp->fs, &dent, &result);
+                if (!result) {
+                    err = errno ? -errno : 0;
+                    break;
+                }
+                /*
+                 * Size of each dirent on the wire: size of qid (13) + size
+                 * of offset (8) + size of type (1) + size of name.size (2)
+                 * + strlen(name.data)
+                 */
+                len = 24 + strlen(dent.d_name);
+                if (size + len > max_size) {
+                    s->ops->seekdir(&s->ctx, &fidp->fs, saved_dir_pos);
+                    break;
+                }
+                if (!(count & (count - 1))) {
+                    dents = g_renew(struct dirent, dents,
+                                    count ? count * 2 : 1);
+                }
+                dents[count++] = dent;
+                size += len;
+                saved_dir_pos = dent.d_off;
+            }
+        });
+    if (err < 0) {
+        g_free(dents);
+        return err;
+    }
+    *entries = dents;
+    return count;
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -1762,48 +1762,26 @@ out_nofid:
     complete_pdu(s, pdu, err);
 }
 
-static size_t v9fs_readdir_data_size(V9fsString *name)
-{
-    /*
-     * Size of each dirent on the wire: size of qid (13) + size of offset (8)
-     * size of type (1) + size of name.size (2) + strlen(name.data)
-     */
-    return 24 + v9fs_string_size(name);
-}
-
 static int v9fs_do_readdir(V9fsPDU *pdu,
                            V9fsFidState *fidp, int32_t max_count)
 {
     size_t size;
     V9fsQID qid;
     V9fsString name;
-    int len, err = 0;
+    int i, n, len;
     int32_t count = 0;
-    off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    struct dirent *dents, *dent;
 
-    /* save the directory position */
-    saved_dir_pos = v9fs_co_telldir(pdu, fidp);
-    if (saved_dir_pos < 0) {
-        return saved_dir_pos;
+    /* Fetch every entry that fits in the reply in one go */
+    n = v9fs_co_readdir_many(pdu, fidp, &dents, max_count);
+    if (n < 0) {
+        return n;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
-
-    while (1) {
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
-        }
+    for (i = 0; i < n; i++) {
+        dent = &dents[i];
         v9fs_string_init(&name);
         v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return count;
-        }
         /*
          * Fill up just the path field of qid because the client uses
          * only that. To fill the entire qid structure we will have
@@ -1819,20 +1797,14 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
         len = pdu_marshal(pdu, 11 + count, "Qqbs",
                           &qid, dent->d_off,
                           dent->d_type, &name);
+        v9fs_string_free(&name);
         if (len < 0) {
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
+            g_free(dents);
             return len;
         }
         count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
-    }
-    g_free(dent);
-    if (err < 0) {
-        return err;
     }
+    g_free(dents);
     return count;
 }
 
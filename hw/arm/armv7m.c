@@ -13,150 +13,228 @@
 #include "elf.h"
 #include "sysemu/qtest.h"
 #include "qemu/error-report.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "hw/xen/xen.h"
 
 /* Bitbanded IO.  Each word corresponds to a single bit.  */
 
+#define TYPE_BITBAND "ARM,bitband-memory"
+#define BITBAND(obj) OBJECT_CHECK(BitBandState, (obj), TYPE_BITBAND)
+
+/* Size of the region each bitband alias maps onto */
+#define BITBAND_TARGET_SIZE 0x00100000
+
+typedef struct {
+    /*< private >*/
+    SysBusDevice parent_obj;
+    /*< public >*/
+
+    MemoryRegion iomem;
+    uint32_t base;
+    /* Address space the target region is accessed through */
+    void *as_prop;
+    AddressSpace *as;
+
+    /* If the start of the target region is RAM, accesses which fall
+     * within it operate on the host memory directly instead of going
+     * through cpu_physical_memory_rw() twice.  This is looked up on the
+     * first access, since the RAM may be mapped after the bitband. */
+    bool target_resolved;
+    uint8_t *ram_ptr;
+    ram_addr_t ram_addr;
+    uint32_t ram_size;
+} BitBandState;
+
 /* Get the byte address of the real memory for a bitband access.  */
-static inline uint32_t bitband_addr(void * opaque, uint32_t addr)
+static inline uint32_t bitband_addr(BitBandState *s, uint32_t addr)
 {
     uint32_t res;
 
-    res = *(uint32_t *)opaque;
+    res = s->base;
     res |= (addr & 0x1ffffff) >> 5;
     return res;
 
 }
 
-static uint32_t bitband_readb(void *opaque, hwaddr offset)
+static void bitband_resolve_target(BitBandState *s)
 {
-    uint8_t v;
-    cpu_physical_memory_read(bitband_addr(opaque, offset), &v, 1);
-    return (v & (1 << ((offset >> 2) & 7))) != 0;
+    MemoryRegion *mr;
+    hwaddr xlat, len = BITBAND_TARGET_SIZE;
+
+    s->target_resolved = true;
+    mr = address_space_translate(s->as, s->base, &xlat, &len, true);
+    if (memory_region_is_ram(mr) && !memory_region_is_rom(mr)) {
+        s->ram_ptr = (uint8_t *)memory_region_get_ram_ptr(mr) + xlat;
+        s->ram_addr = memory_region_get_ram_addr(mr) + xlat;
+        s->ram_size = len;
+    }
 }
 
-static void bitband_writeb(void *opaque, hwaddr offset,
-                           uint32_t value)
+/* Returns a host pointer to the addressed RAM, or NULL if the slow path
+ * must be used.  For writes, the slow path is also used while the page
+ * is still clean, so that translated code is invalidated and the dirty
+ * tracking is kept up to date. */
+static uint8_t *bitband_ram_ptr(BitBandState *s, uint32_t addr, unsigned size,
+                                bool is_write)
 {
-    uint32_t addr;
-    uint8_t mask;
-    uint8_t v;
-    addr = bitband_addr(opaque, offset);
-    mask = (1 << ((offset >> 2) & 7));
-    cpu_physical_memory_read(addr, &v, 1);
-    if (value & 1)
-        v |= mask;
-    else
-        v &= ~mask;
-    cpu_physical_memory_write(addr, &v, 1);
+    uint32_t offset = addr - s->base;
+
+    if (!s->target_resolved) {
+        bitband_resolve_target(s);
+    }
+    if (!s->ram_ptr || offset + size > s->ram_size) {
+        return NULL;
+    }
+    if (is_write && (xen_enabled() ||
+        cpu_physical_memory_range_includes_clean(s->ram_addr + offset,
+                                                 size))) {
+        return NULL;
+    }
+    return s->ram_ptr + offset;
 }
 
-static uint32_t bitband_readw(void *opaque, hwaddr offset)
+static uint32_t bitband_load(uint8_t *p, unsigned size)
 {
-    uint32_t addr;
-    uint16_t mask;
-    uint16_t v;
-    addr = bitband_addr(opaque, offset) & ~1;
-    mask = (1 << ((offset >> 2) & 15));
-    mask = tswap16(mask);
-    cpu_physical_memory_read(addr, &v, 2);
-    return (v & mask) != 0;
+    switch (size) {
+    case 1:
+        return ldub_p(p);
+    case 2:
+        return lduw_p(p);
+    default:
+        return ldl_p(p);
+    }
 }
 
-static void bitband_writew(void *opaque, hwaddr offset,
-                           uint32_t value)
+static void bitband_store(uint8_t *p, unsigned size, uint32_t v)
 {
-    uint32_t addr;
-    uint16_t mask;
-    uint16_t v;
-    addr = bitband_addr(opaque, offset) & ~1;
-    mask = (1 << ((offset >> 2) & 15));
-    mask = tswap16(mask);
-    cpu_physical_memory_read(addr, &v, 2);
-    if (value & 1)
-        v |= mask;
-    else
-        v &= ~mask;
-    cpu_physical_memory_write(addr, &v, 2);
+    switch (size) {
+    case 1:
+        stb_p(p, v);
+        break;
+    case 2:
+        stw_p(p, v);
+        break;
+    default:
+        stl_p(p, v);
+        break;
+    }
 }
 
-static uint32_t bitband_readl(void *opaque, hwaddr offset)
+static uint64_t bitband_read(void *opaque, hwaddr offset, unsigned size)
 {
+    BitBandState *s = opaque;
     uint32_t addr;
     uint32_t mask;
-    uint32_t v;
-    addr = bitband_addr(opaque, offset) & ~3;
-    mask = (1 << ((offset >> 2) & 31));
-    mask = tswap32(mask);
-    cpu_physical_memory_read(addr, &v, 4);
-    return (v & mask) != 0;
+    uint8_t buf[4];
+    uint8_t *p;
+
+    addr = bitband_addr(s, offset) & ~(size - 1);
+    mask = 1 << ((offset >> 2) & (size * 8 - 1));
+    p = bitband_ram_ptr(s, addr, size, false);
+    if (!p) {
+        address_space_read(s->as, addr, buf, size);
+        p = buf;
+    }
+    return (bitband_load(p, size) & mask) != 0;
 }
 
-static void bitband_writel(void *opaque, hwaddr offset,
-                           uint32_t value)
+static void bitband_write(void *opaque, hwaddr offset, uint64_t value,
+                          unsigned size)
 {
+    BitBandState *s = opaque;
     uint32_t addr;
     uint32_t mask;
     uint32_t v;
-    addr = bitband_addr(opaque, offset) & ~3;
-    mask = (1 << ((offset >> 2) & 31));
-    mask = tswap32(mask);
-    cpu_physical_memory_read(addr, &v, 4);
-    if (value & 1)
-        v |= mask;
-    else
-        v &= ~mask;
-    cpu_physical_memory_write(addr, &v, 4);
+    uint8_t buf[4];
+    uint8_t *p;
+
+    addr = bitband_addr(s, offset) & ~(size - 1);
+    mask = 1 << ((offset >> 2) & (size * 8 - 1));
+    p = bitband_ram_ptr(s, addr, size, true);
+    if (p) {
+        v = bitband_load(p, size);
+        bitband_store(p, size, (value & 1) ? (v | mask) : (v & ~mask));
+        return;
+    }
+
+    address_space_read(s->as, addr, buf, size);
+    v = bitband_load(buf, size);
+    bitband_store(buf, size, (value & 1) ? (v | mask) : (v & ~mask));
+    address_space_write(s->as, addr, buf, size);
 }
 
 static const MemoryRegionOps bitband_ops = {
-    .old_mmio = {
-        .read = { bitband_readb, bitband_readw, bitband_readl, },
-        .write = { bitband_writeb, bitband_writew, bitband_writel, },
-    },
+    .read = bitband_read,
+    .write = bitband_write,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 4,
+    .impl.min_access_size = 1,
+    .impl.max_access_size = 4,
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
-#define TYPE_BITBAND "ARM,bitband-memory"
-#define BITBAND(obj) OBJECT_CHECK(BitBandState, (obj), TYPE_BITBAND)
-
-typedef struct {
-    /*< private >*/
-    SysBusDevice parent_obj;
-    /*< public >*/
-
-    MemoryRegion iomem;
-    uint32_t base;
-} BitBandState;
-
 static int bitband_init(SysBusDevice *dev)
 {
     BitBandState *s = BITBAND(dev);
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &bitband_ops, &s->base,
+    s->as = s->as_prop ? (AddressSpace *)s->as_prop : &address_space_memory;
+    memory_region_init_io(&s->iomem, OBJECT(s), &bitband_ops, s,
                           "bitband", 0x02000000);
     sysbus_init_mmio(dev, &s->iomem);
     return 0;
 }
 
-static void armv7m_bitband_init(Object *parent)
+static void armv7m_bitband_init(Object *parent, MemoryRegion *address_space_mem,
+                                AddressSpace *as)
 {
     DeviceState *dev;
 
     dev = qdev_create(NULL, TYPE_BITBAND);
     qdev_prop_set_uint32(dev, "base", 0x20000000);
+    qdev_prop_set_ptr(dev, "as", as);
     if(parent) {
         object_property_add_child(parent, "bitband-sram", OBJECT(dev), NULL);
     }
     qdev_init_nofail(dev);
-    sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, 0x22000000);
+    memory_region_add_subregion(address_space_mem, 0x22000000,
+                                sysbus_mmio_get_region(SYS_BUS_DEVICE(dev), 0));
 
     dev = qdev_create(NULL, TYPE_BITBAND);
     qdev_prop_set_uint32(dev, "base", 0x40000000);
+    qdev_prop_set_ptr(dev, "as", as);
     if(parent) {
         object_property_add_child(parent, "bitband-periph", OBJECT(dev), NULL);
     }
     qdev_init_nofail(dev);
-    sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, 0x42000000);
+    memory_region_add_subregion(address_space_mem, 0x42000000,
+                                sysbus_mmio_get_region(SYS_BUS_DEVICE(dev), 0));
+}
+
+/* RAM block names have to be unique, so the memory of cores which are not
+   in the system address space is named after their parent object.  */
+char *armv7m_ram_name(Object *parent, AddressSpace *as, const char *name)
+{
+    char *prefix, *ram_name;
+
+    if (as == NULL || as == &address_space_memory || !parent) {
+        prefix = g_strdup("armv7m");
+    } else {
+        prefix = object_get_canonical_path_component(parent);
+    }
+    ram_name = g_strdup_printf("%s.%s", prefix, name);
+    g_free(prefix);
+    return ram_name;
+}
+
+static void armv7m_init_ram(MemoryRegion *mr, Object *parent, AddressSpace *as,
+                            const char *name, uint64_t size)
+{
+    char *ram_name = armv7m_ram_name(parent, as, name);
+
+    memory_region_init_ram(mr, NULL, ram_name, size);
+    vmstate_register_ram_global(mr);
+    g_free(ram_name);
 }
 
 /* Board init.  */
@@ -175,32 +253,75 @@ static void armv7m_reset(void *opaque)
 qemu_irq *armv7m_init(Object *parent, MemoryRegion *address_space_mem,
                       int flash_size, int sram_size,
                       const char *kernel_filename, const char *cpu_model)
+{
+    MemoryRegion *flash = g_new(MemoryRegion, 1);
+
+    /* Flash programming is done via the SCU, so pretend it is ROM.  */
+    memory_region_init_ram(flash, NULL, "armv7m.flash", flash_size * 1024);
+    vmstate_register_ram_global(flash);
+    memory_region_set_readonly(flash, true);
+    /* ...and as the guest never writes it, do not track it for
+       self-modifying code.  */
+    memory_region_set_rom_exec(flash, true);
+
+    return armv7m_init_with_flash(parent, address_space_mem, NULL, flash,
+                                  NULL, sram_size, kernel_filename, cpu_model,
+                                  64);
+}
+
+/* As armv7m_init(), but for boards with their own model of the flash (and
+   its controller).  The flash region is mapped at address zero and the
+   kernel image is loaded into it.
+   sram is the RAM region of sram_size KB to map at 0x20000000, or NULL to
+   allocate it.
+   as is the address space the core, the bitband regions and the image
+   loader use, and must have address_space_mem as its root.  NULL means the
+   system address space; boards with several cores give each of them its
+   own.  num_irq is the number of external interrupts of the NVIC (a
+   multiple of 32).  */
+qemu_irq *armv7m_init_with_flash(Object *parent,
+                                 MemoryRegion *address_space_mem,
+                                 AddressSpace *as,
+                                 MemoryRegion *flash, MemoryRegion *sram,
+                                 int sram_size, const char *kernel_filename,
+                                 const char *cpu_model, int num_irq)
 {
     ARMCPU *cpu;
     CPUARMState *env;
     DeviceState *nvic;
-    /* FIXME: make this local state.  */
-    static qemu_irq pic[64];
+    ObjectClass *cpu_oc;
+    Error *err = NULL;
+    qemu_irq *pic = g_new(qemu_irq, num_irq);
     int image_size;
     uint64_t entry;
     uint64_t lowaddr;
     int i;
     int big_endian;
-    MemoryRegion *sram = g_new(MemoryRegion, 1);
-    MemoryRegion *flash = g_new(MemoryRegion, 1);
     MemoryRegion *hack = g_new(MemoryRegion, 1);
 
-    flash_size *= 1024;
     sram_size *= 1024;
 
+    if (as == NULL) {
+        as = &address_space_memory;
+    }
+
     if (cpu_model == NULL) {
 	cpu_model = "cortex-m3";
     }
-    cpu = cpu_arm_init(cpu_model);
-    if (cpu == NULL) {
+    cpu_oc = cpu_class_by_name(TYPE_ARM_CPU, cpu_model);
+    if (cpu_oc == NULL) {
         fprintf(stderr, "Unable to find CPU definition\n");
         exit(1);
     }
+    cpu = ARM_CPU(object_new(object_class_get_name(cpu_oc)));
+    /* The address space has to be set before the CPU is realized, which is
+       when TCG starts listening to it.  */
+    CPU(cpu)->as = as;
+    object_property_set_bool(OBJECT(cpu), true, "realized", &err);
+    if (err) {
+        error_report("%s", error_get_pretty(err));
+        exit(1);
+    }
     env = &cpu->env;
 
 #if 0
@@ -215,25 +336,38 @@ qemu_irq *armv7m_init(Object *parent, MemoryRegion *address_space_mem,
     code_size = ram_size - sram_size;
 #endif
 
-    /* Flash programming is done via the SCU, so pretend it is ROM.  */
-    memory_region_init_ram(flash, NULL, "armv7m.flash", flash_size);
-    vmstate_register_ram_global(flash);
-    memory_region_set_readonly(flash, true);
     memory_region_add_subregion(address_space_mem, 0, flash);
-    memory_region_init_ram(sram, NULL, "armv7m.sram", sram_size);
-    vmstate_register_ram_global(sram);
+    if (sram == NULL) {
+        sram = g_new(MemoryRegion, 1);
+        armv7m_init_ram(sram, parent, as, "sram", sram_size);
+    }
     memory_region_add_subregion(address_space_mem, 0x20000000, sram);
-    armv7m_bitband_init(parent);
+    armv7m_bitband_init(parent, address_space_mem, as);
+    /* SRAM first, as it takes most of the data accesses */
+    arm_cpu_add_direct_ram(cpu, 0x20000000, sram_size,
+                           memory_region_get_ram_ptr(sram));
+    arm_cpu_add_direct_ram(cpu, 0, memory_region_size(flash),
+                           memory_region_get_ram_ptr(flash));
 
     nvic = qdev_create(NULL, "armv7m_nvic");
+    qdev_prop_set_uint32(nvic, "num-irq", num_irq);
     env->nvic = nvic;
     if(parent) {
         object_property_add_child(parent, "nvic", OBJECT(nvic), NULL);
     }
     qdev_init_nofail(nvic);
+    memory_region_add_subregion(address_space_mem, 0xe000e000,
+                                sysbus_mmio_get_region(SYS_BUS_DEVICE(nvic),
+                                                       0));
+    memory_region_add_subregion(address_space_mem, 0xe0000000,
+                                sysbus_mmio_get_region(SYS_BUS_DEVICE(nvic),
+                                                       1));
+    memory_region_add_subregion(address_space_mem, 0xe0001000,
+                                sysbus_mmio_get_region(SYS_BUS_DEVICE(nvic),
+                                                       2));
     sysbus_connect_irq(SYS_BUS_DEVICE(nvic), 0,
                        qdev_get_gpio_in(DEVICE(cpu), ARM_CPU_IRQ));
-    for (i = 0; i < 64; i++) {
+    for (i = 0; i < num_irq; i++) {
         pic[i] = qdev_get_gpio_in(nvic, i);
     }
 
@@ -249,10 +383,12 @@ qemu_irq *armv7m_init(Object *parent, MemoryRegion *address_space_mem,
     }
 
     if (kernel_filename) {
-        image_size = load_elf(kernel_filename, NULL, NULL, &entry, &lowaddr,
-                              NULL, big_endian, ELF_MACHINE, 1);
+        image_size = load_elf_as(kernel_filename, NULL, NULL, &entry,
+                                 &lowaddr, NULL, big_endian, ELF_MACHINE, 1,
+                                 as);
         if (image_size < 0) {
-            image_size = load_image_targphys(kernel_filename, 0, flash_size);
+            image_size = load_image_targphys_as(kernel_filename, 0,
+                                                memory_region_size(flash), as);
             lowaddr = 0;
         }
         if (image_size < 0) {
@@ -264,8 +400,7 @@ qemu_irq *armv7m_init(Object *parent, MemoryRegion *address_space_mem,
     /* Hack to map an additional page of ram at the top of the address
        space.  This stops qemu complaining about executing code outside RAM
        when returning from an exception.  */
-    memory_region_init_ram(hack, NULL, "armv7m.hack", 0x1000);
-    vmstate_register_ram_global(hack);
+    armv7m_init_ram(hack, parent, as, "hack", 0x1000);
     memory_region_add_subregion(address_space_mem, 0xfffff000, hack);
 
     qemu_register_reset(armv7m_reset, cpu);
@@ -274,6 +409,7 @@ qemu_irq *armv7m_init(Object *parent, MemoryRegion *address_space_mem,
 
 static Property bitband_properties[] = {
     DEFINE_PROP_UINT32("base", BitBandState, base, 0),
+    DEFINE_PROP_PTR("as", BitBandState, as_prop),
     DEFINE_PROP_END_OF_LIST(),
 };
 
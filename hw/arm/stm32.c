@@ -4,6 +4,7 @@
  * Copyright (C) 2010 Andre Beckus
  *
  * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ * and, for the STM32F4, "RM0090 Reference Manual Rev 7"
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License as
@@ -22,6 +23,14 @@
 #include "hw/arm/stm32.h"
 #include "exec/address-spaces.h"
 #include "exec/gdbstub.h"
+#include "hw/loader.h"
+#include "net/net.h"
+#include "net/can.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/blockdev.h"
+#include "sysemu/iothread.h"
+#include "qemu/main-loop.h"
+#include "cpu.h"
 
 /* DEFINITIONS */
 
@@ -39,6 +48,41 @@ void stm32_hw_warn(const char *fmt, ...)
     va_end(ap);
 }
 
+void stm32_init_reg_page(MemoryRegion *mr, Object *owner,
+                         const MemoryRegionOps *ops, void *opaque,
+                         const char *name, bool direct_read)
+{
+    char *path, *idstr;
+
+    if(!direct_read) {
+        memory_region_init_io(mr, owner, ops, opaque, name, STM32_PERIPH_SIZE);
+        return;
+    }
+
+    /* A ROM device in ROMD mode: the TLB maps reads straight to the RAM
+     * page and only writes are dispatched to ops.  The page is a whole
+     * target page so that it does not end up behind a subpage. */
+    memory_region_init_rom_device(mr, owner, ops, opaque, name,
+                                  STM32_REG_PAGE_SIZE);
+
+    /* Name the RAM block after the device, as there is one per device and
+     * maybe several STM32s. */
+    path = object_get_canonical_path(owner);
+    idstr = g_strdup_printf("%s/%s", path, name);
+    qemu_ram_set_idstr(memory_region_get_ram_addr(mr), idstr, NULL);
+    g_free(idstr);
+    g_free(path);
+}
+
+void stm32_reg_page_set(MemoryRegion *mr, hwaddr offset, uint32_t value)
+{
+    if(!memory_region_is_romd(mr)) {
+        return;
+    }
+    stl_le_p((uint8_t *)memory_region_get_ram_ptr(mr) + offset, value);
+    memory_region_set_dirty(mr, offset, 4);
+}
+
 
 
 
@@ -88,7 +132,10 @@ const char *stm32_periph_name_arr[] =
      "EXTI",
      "SDIO",
      "FSMC",
-     "RTC"};
+     "RTC",
+     "DMA1",
+     "DMA2",
+     "ETH"};
 
 const char *stm32_periph_name(stm32_periph_t periph)
 {
@@ -103,23 +150,463 @@ const char *stm32_periph_name(stm32_periph_t periph)
 
 /* INITIALIZATION */
 
+/* The memories which a fast reset restores: Flash, SRAM and the F4 CCM */
+#define STM32_MEM_SNAPSHOT_MAX 3
+
+/* The reset value of rand(), see stm32_fast_reset */
+#define STM32_FAST_RESET_SEED 1
+
+typedef struct Stm32MemSnapshot {
+    hwaddr addr;
+    uint64_t size;
+    uint8_t *host;
+    uint8_t *data;
+} Stm32MemSnapshot;
+
+struct Stm32 {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    uint32_t flash_size;
+    uint32_t ram_size;
+    char *kernel_filename;
+    uint32_t osc_freq;
+    uint32_t osc32_freq;
+    /* If set, the microcontroller gets an address space of its own instead
+     * of being mapped into the system memory.  This is what allows several
+     * of them in one machine. */
+    bool private_memory;
+    /* If set, there is an Ethernet MAC (as on the STM32F107 and F407),
+     * connected to the first -net nic.  Set it with -global <type>.eth=on. */
+    bool eth;
+    /* The id of the can-bus object the CAN controllers are on, if any
+     * (-object can-bus,id=canbus0 -global <type>.canbus=canbus0) */
+    char *canbus;
+    /* The character device the USB host at the other end of the USB
+     * device controller passes the bulk data to and from (STM32F103) */
+    CharDriverState *usb_chr;
+    /* If set, the core waits for the Flash as FLASH_ACR says.  This only
+     * has an effect with -icount, which turns waiting into virtual time. */
+    bool flash_cycles;
+    /* If set, LDREX/STREX only use the core's local monitor, see
+     * arm_cpu_set_local_monitor */
+    bool local_monitor;
+    /* Size in bytes of the external SRAM on each FSMC sub-bank NE1 to NE4,
+     * or 0, see stm32_fsmc.c */
+    uint32_t fsmc_sram[STM32_FSMC_BANK_COUNT];
+
+    /* Private */
+    MemoryRegion *system_memory;
+    AddressSpace *as;
+    MemoryRegion container;
+    AddressSpace private_as;
+    MemoryRegion flash_alias_mem;
+    MemoryRegion ccm_mem; /* STM32F4 only */
+
+    /* GPIO output telemetry, see stm32_gpio_trace.c */
+    CharDriverState *gpio_trace_chr;
+    char *gpio_trace_file;
+
+    /* Input stimulus, see stm32_stim.c */
+    char *stim_file;
+    uint32_t stim_period_ns;
+    Stm32StimSlot *stim;
+    /* Timestamped stimulus, see stm32_stim_queue.c */
+    CharDriverState *stim_events_chr;
+    char *stim_events_file;
+
+    /* Input record and replay, see stm32_replay.c */
+    char *record_file;
+    char *replay_file;
+
+    /* Peripheral timers, see stm32_timer_new_ns */
+    char *iothread;
+    AioContext *timer_ctx;
+
+    /* Quantum synchronization with other nodes, see stm32_quantum.c */
+    char *quantum_sync;
+    uint32_t quantum_node;
+    uint32_t quantum_nodes;
+    uint32_t quantum_ns;
+    uint32_t quantum_uarts; /* bit 0 is USART1 */
+
+    /* Co-simulated device on the FSMC bus, see stm32_cosim.c */
+    char *cosim_shm;
+    uint32_t cosim_base;
+    uint32_t cosim_size;
+    uint32_t cosim_quantum_ns;
+
+    /* SRAM in a shared memory file, see stm32_sram_shm.c */
+    char *sram_shm;
+    uint32_t sram_shm_period_ns;
+
+    /* Fork server for fuzzing, see stm32_fuzz.c */
+    bool fuzz;
+    char *fuzz_input;
+
+    /* Firmware profiler, see stm32_prof.c */
+    char *prof_file;
+    uint32_t prof_period_ns;
+
+    /* Fast reset, see stm32_fast_reset */
+    bool fast_reset;
+    ARMCPU *cpu;
+    Notifier machine_done;
+    bool snapshot_taken;
+    int mem_snapshot_count;
+    Stm32MemSnapshot mem_snapshot[STM32_MEM_SNAPSHOT_MAX];
+    /* The CPU registers, i.e. the part of CPUARMState in front of the TLB */
+    uint8_t *cpu_snapshot;
+};
+
+#define STM32_CPU_SNAPSHOT_SIZE offsetof(CPUARMState, tlb_table)
+
+/* With fast_reset set, every system reset after the first one puts the
+ * microcontroller back into the state it was in right after the first
+ * reset, which is the state of a freshly started QEMU:
+ *  - The Flash, SRAM and CCM pages which differ from the snapshot taken
+ *    after the first reset are copied back.  Translated code is only
+ *    invalidated for those pages, so the code in Flash does not need to be
+ *    translated again as it does after the loader rewrites the whole image
+ *    on an ordinary reset.
+ *  - The CPU registers are copied back.
+ *  - rand() is reseeded before the devices are reset, which makes the ADC
+ *    samples the same after each reset.
+ * The peripherals are reset by their own reset handlers as usual.  The
+ * backup registers are deliberately left alone, as are the chardevs. */
+static void stm32_fast_reset(void *opaque)
+{
+    Stm32 *s = (Stm32 *)opaque;
+    Stm32MemSnapshot *snap;
+    uint64_t offset, len;
+    int i;
+
+    srand(STM32_FAST_RESET_SEED);
+
+    if(!s->snapshot_taken) {
+        return;
+    }
+
+    for(i = 0; i < s->mem_snapshot_count; i++) {
+        snap = &s->mem_snapshot[i];
+        for(offset = 0; offset < snap->size; offset += TARGET_PAGE_SIZE) {
+            len = MIN(TARGET_PAGE_SIZE, snap->size - offset);
+            if(memcmp(snap->host + offset, snap->data + offset, len)) {
+                cpu_physical_memory_write_rom(s->as, snap->addr + offset,
+                                              snap->data + offset, len);
+            }
+        }
+    }
+
+    /* This handler runs after the CPU reset, which could not load the
+     * initial SP and PC since the loader's copy of the image is gone. */
+    memcpy(&s->cpu->env, s->cpu_snapshot, STM32_CPU_SNAPSHOT_SIZE);
+}
+
+static void stm32_fast_reset_add_mem(Stm32 *s, hwaddr addr)
+{
+    MemoryRegionSection section;
+    Stm32MemSnapshot *snap;
+
+    assert(s->mem_snapshot_count < STM32_MEM_SNAPSHOT_MAX);
+    section = memory_region_find(s->system_memory, addr, 1);
+    assert(section.mr);
+
+    snap = &s->mem_snapshot[s->mem_snapshot_count++];
+    snap->addr = addr;
+    snap->size = memory_region_size(section.mr) -
+                 section.offset_within_region;
+    snap->host = (uint8_t *)memory_region_get_ram_ptr(section.mr) +
+                 section.offset_within_region;
+    snap->data = g_memdup(snap->host, snap->size);
+    /* Written behind the memory API at every reset */
+    qemu_ram_set_direct(snap->host);
+    memory_region_unref(section.mr);
+}
+
+/* Registered last, so this runs at the end of every reset.  The first time,
+ * the images have just been loaded and all devices reset, which is the
+ * state the later resets go back to. */
+static void stm32_fast_reset_snapshot(void *opaque)
+{
+    Stm32 *s = (Stm32 *)opaque;
+
+    if(s->snapshot_taken) {
+        return;
+    }
+
+    stm32_fast_reset_add_mem(s, 0x00000000);
+    stm32_fast_reset_add_mem(s, 0x20000000);
+    if(object_dynamic_cast(OBJECT(s), TYPE_STM32F4)) {
+        stm32_fast_reset_add_mem(s, 0x10000000);
+    }
+    s->cpu_snapshot = g_memdup(&s->cpu->env, STM32_CPU_SNAPSHOT_SIZE);
+
+    /* From now on the Flash is restored from the snapshot.  Keeping the
+     * loader from writing the image again is what keeps the translated
+     * code valid. */
+    rom_free_data_as(s->as);
+    s->snapshot_taken = true;
+}
+
+static void stm32_fast_reset_machine_done(Notifier *notifier, void *data)
+{
+    Stm32 *s = container_of(notifier, Stm32, machine_done);
+
+    /* The loader and the device reset handlers are registered by now */
+    qemu_register_reset(stm32_fast_reset_snapshot, s);
+}
+
+static void stm32_fast_reset_init(Stm32 *s)
+{
+    /* Runs after the CPU reset handler registered by armv7m_init_with_flash,
+     * and before the loader and the devices. */
+    qemu_register_reset(stm32_fast_reset, s);
+    s->machine_done.notify = stm32_fast_reset_machine_done;
+    qemu_add_machine_init_done_notifier(&s->machine_done);
+}
+
+/* The CPU created last in the microcontroller's address space is its own.
+ * With the prof_file property set, it is profiled from the start. */
+static void stm32_find_cpu(Stm32 *s)
+{
+    CPUState *cs;
+
+    CPU_FOREACH(cs) {
+        if(cs->as == s->as) {
+            s->cpu = ARM_CPU(cs);
+        }
+    }
+    assert(s->cpu);
+
+    if(s->prof_file) {
+        stm32_prof_init(s->cpu, s->prof_file, s->prof_period_ns);
+    }
+}
+
+/* With the gpio_trace or gpio_trace_file property set, record the output
+ * changes of all of the GPIO ports. */
+static void stm32_gpio_trace_init(Stm32 *s, DeviceState **gpio_dev)
+{
+    Stm32GpioTrace *trace;
+    int i;
+
+    if(!s->gpio_trace_chr && !s->gpio_trace_file) {
+        return;
+    }
+    trace = stm32_gpio_trace_new(s->gpio_trace_chr, s->gpio_trace_file);
+    for(i = 0; i < STM32_GPIO_COUNT; i++) {
+        stm32_gpio_trace_add_port(trace, STM32_GPIO(gpio_dev[i]), i);
+    }
+}
+
+/* With the stim_events or stim_events_file property set, apply the
+ * timestamped input events to the GPIO ports and ADCs. */
+static void stm32_stim_queue_init(Stm32 *s, DeviceState **gpio_dev,
+                                  DeviceState **adc_dev, int adc_count)
+{
+    Stm32StimQueue *q;
+    int i;
+
+    if(!s->stim_events_chr && !s->stim_events_file) {
+        return;
+    }
+    q = stm32_stim_queue_new(s->timer_ctx, s->stim_events_chr,
+                             s->stim_events_file);
+    for(i = 0; i < STM32_GPIO_COUNT; i++) {
+        stm32_stim_queue_add_gpio(q, STM32_GPIO(gpio_dev[i]), i);
+    }
+    for(i = 0; i < adc_count; i++) {
+        stm32_stim_queue_add_adc(q, STM32_ADC(adc_dev[i]), i);
+    }
+}
+
+typedef struct Stm32AioTimer {
+    QEMUTimerCB *cb;
+    void *opaque;
+} Stm32AioTimer;
+
+static void stm32_aio_timer_expire(void *opaque)
+{
+    Stm32AioTimer *t = opaque;
+
+    /* The peripherals are only ever entered with the BQL held */
+    qemu_mutex_lock_iothread();
+    t->cb(t->opaque);
+    qemu_mutex_unlock_iothread();
+}
+
+QEMUTimer *stm32_timer_new_ns(void *aio_context, QEMUTimerCB *cb,
+                              void *opaque)
+{
+    Stm32AioTimer *t;
+
+    if(!aio_context) {
+        return timer_new_ns(QEMU_CLOCK_VIRTUAL, cb, opaque);
+    }
+    t = g_new(Stm32AioTimer, 1);
+    t->cb = cb;
+    t->opaque = opaque;
+    return aio_timer_new(aio_context, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                         stm32_aio_timer_expire, t);
+}
+
+/* With the iothread property set, the timers of the peripherals are on the
+ * AioContext of that iothread object instead of the main loop.  With
+ * -icount the vCPU thread runs the due timers itself, which it only can
+ * for the main loop's timers. */
+static void stm32_iothread_init(Stm32 *s)
+{
+    IOThread *iothread;
+
+    if(!s->iothread) {
+        return;
+    }
+    if(use_icount) {
+        hw_error("STM32: the iothread property cannot be used with -icount");
+    }
+    iothread = iothread_find(s->iothread);
+    if(!iothread) {
+        hw_error("STM32: no iothread object with id %s", s->iothread);
+    }
+    s->timer_ctx = iothread_get_aio_context(iothread);
+}
+
+/* With the record_file or replay_file property set, the inputs from
+ * outside are logged or replayed.  This must be set up before the
+ * peripherals create their replay channels. */
+static void stm32_replay_setup(Stm32 *s)
+{
+    if(!s->record_file && !s->replay_file) {
+        return;
+    }
+    if(s->iothread) {
+        hw_error("Replay: the peripheral timers must be on the main loop");
+    }
+    stm32_replay_init(s->record_file, s->replay_file);
+}
+
+/* With the quantum_sync property set, the microcontroller is a node of a
+ * network of QEMU processes, and its CAN bus and the USARTs in
+ * quantum_uarts are connected to those of the other nodes. */
+static void stm32_quantum_setup(Stm32 *s)
+{
+    Object *bus;
+
+    if(!s->quantum_sync) {
+        return;
+    }
+    if(s->iothread) {
+        hw_error("Quantum: the peripheral timers must be on the main loop");
+    }
+    stm32_quantum_init(s->quantum_sync, s->quantum_node, s->quantum_nodes,
+                       s->quantum_ns);
+    if(s->canbus) {
+        bus = object_resolve_path_type(s->canbus, TYPE_CAN_BUS, NULL);
+        if(!bus) {
+            hw_error("STM32: no can-bus object with id %s", s->canbus);
+        }
+        stm32_quantum_add_can_bus(CAN_BUS(bus));
+    }
+}
+
+/* With the cosim_shm property set, an external model takes the accesses
+ * to a range of the FSMC banks. */
+static void stm32_cosim_setup(Stm32 *s)
+{
+    if(!s->cosim_shm) {
+        return;
+    }
+    if(s->cosim_base < 0x60000000 || s->cosim_base >= 0xa0000000 ||
+       s->cosim_size == 0 || s->cosim_size > 0xa0000000 - s->cosim_base) {
+        hw_error("Co-simulation: the range must be within the FSMC banks");
+    }
+    stm32_cosim_init(s->system_memory, s->cosim_base, s->cosim_size,
+                     s->cosim_shm, s->cosim_quantum_ns);
+}
+
+/* With the sram_shm property set, the SRAM of size bytes is kept in a
+ * file which other processes can map.  Returns NULL otherwise. */
+static MemoryRegion *stm32_sram_setup(Stm32 *s, uint32_t size)
+{
+    MemoryRegion *sram;
+    char *name;
+
+    if(!s->sram_shm) {
+        return NULL;
+    }
+    name = armv7m_ram_name(OBJECT(s), s->as, "sram");
+    sram = stm32_sram_shm_init(name, size, s->sram_shm,
+                               s->sram_shm_period_ns);
+    g_free(name);
+    return sram;
+}
+
+static void stm32_fuzz_setup(Stm32 *s)
+{
+    if(!s->fuzz) {
+        return;
+    }
+    if(s->iothread) {
+        hw_error("Fuzz: the peripheral timers must be on the main loop");
+    }
+    stm32_fuzz_init(s->system_memory, s->fuzz_input);
+}
+
+/* With the stim_file property set, the microcontrollers take their slot in
+ * the file in the order they are created. */
+static void stm32_stim_init(Stm32 *s)
+{
+    static unsigned stim_instance_count;
+
+    if(s->stim_file) {
+        s->stim = stm32_stim_get_slot(s->stim_file, stim_instance_count++);
+    }
+}
+
+/* Pass the stimulus slot on to a GPIO port or ADC before it is realized */
+static void stm32_stim_connect(Stm32 *s, DeviceState *dev, bool gpio)
+{
+    if(!s->stim) {
+        return;
+    }
+    qdev_prop_set_ptr(dev, "stim", s->stim);
+    if(gpio) {
+        qdev_prop_set_uint32(dev, "stim_period_ns", s->stim_period_ns);
+    }
+}
+
+/* Map a peripheral's memory region into the address space of the
+ * microcontroller it belongs to. */
+static void stm32_map_periph(Stm32 *s, DeviceState *dev, int n, hwaddr addr)
+{
+    memory_region_add_subregion(s->system_memory, addr,
+                                sysbus_mmio_get_region(SYS_BUS_DEVICE(dev), n));
+}
+
 /* I copied sysbus_create_varargs and split it into two parts.  This is so that
  * you can set properties before calling the device init function.
  */
 
-static DeviceState *stm32_init_periph(DeviceState *dev, stm32_periph_t periph,
-                                        hwaddr addr, qemu_irq irq)
+static DeviceState *stm32_init_periph(Stm32 *s, DeviceState *dev,
+                                      stm32_periph_t periph,
+                                      hwaddr addr, qemu_irq irq)
 {
+    if(s->timer_ctx &&
+       object_property_find(OBJECT(dev), "aio_context", NULL)) {
+        qdev_prop_set_ptr(dev, "aio_context", s->timer_ctx);
+    }
     qdev_init_nofail(dev);
-    sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, addr);
+    stm32_map_periph(s, dev, 0, addr);
     if (irq) {
         sysbus_connect_irq(SYS_BUS_DEVICE(dev), 0, irq);
     }
     return dev;
 }
 
-static void stm32_create_uart_dev(
-        Object *stm32_container,
+static DeviceState *stm32_create_uart_dev(
+        Stm32 *s,
         stm32_periph_t periph,
         int uart_num,
         DeviceState *rcc_dev,
@@ -135,12 +622,71 @@ static void stm32_create_uart_dev(
     qdev_prop_set_ptr(uart_dev, "stm32_gpio", gpio_dev);
     qdev_prop_set_ptr(uart_dev, "stm32_afio", afio_dev);
     snprintf(child_name, sizeof(child_name), "uart[%i]", uart_num);
-    object_property_add_child(stm32_container, child_name, OBJECT(uart_dev), NULL);
-    stm32_init_periph(uart_dev, periph, addr, irq);
+    object_property_add_child(OBJECT(s), child_name, OBJECT(uart_dev), NULL);
+    stm32_init_periph(s, uart_dev, periph, addr, irq);
+    if(s->quantum_uarts & BIT(uart_num - 1)) {
+        stm32_uart_connect_quantum(STM32_UART(uart_dev));
+    }
+    return uart_dev;
+}
+
+static DeviceState *stm32_create_spi_dev(
+        Stm32 *s,
+        stm32_periph_t periph,
+        int spi_num,
+        DeviceState *rcc_dev,
+        hwaddr addr,
+        qemu_irq irq)
+{
+    char child_name[8];
+    DeviceState *spi_dev = qdev_create(NULL, TYPE_STM32_SPI);
+    QDEV_PROP_SET_PERIPH_T(spi_dev, "periph", periph);
+    qdev_prop_set_ptr(spi_dev, "stm32_rcc", rcc_dev);
+    snprintf(child_name, sizeof(child_name), "spi[%i]", spi_num);
+    object_property_add_child(OBJECT(s), child_name, OBJECT(spi_dev), NULL);
+    return stm32_init_periph(s, spi_dev, periph, addr, irq);
+}
+
+/* The I2S mode of SPI2 and SPI3 */
+static void stm32_create_i2s_dev(
+        Stm32 *s,
+        stm32_periph_t periph,
+        int i2s_num,
+        DeviceState *rcc_dev,
+        DeviceState *spi_dev)
+{
+    char child_name[8];
+    DeviceState *i2s_dev = qdev_create(NULL, TYPE_STM32_I2S);
+    QDEV_PROP_SET_PERIPH_T(i2s_dev, "periph", periph);
+    qdev_prop_set_ptr(i2s_dev, "stm32_rcc", rcc_dev);
+    snprintf(child_name, sizeof(child_name), "i2s[%i]", i2s_num);
+    object_property_add_child(OBJECT(s), child_name, OBJECT(i2s_dev), NULL);
+    qdev_init_nofail(i2s_dev);
+    stm32_spi_connect_i2s(STM32_SPI(spi_dev), STM32_I2S(i2s_dev));
+}
+
+static DeviceState *stm32_create_i2c_dev(
+        Stm32 *s,
+        stm32_periph_t periph,
+        int i2c_num,
+        DeviceState *rcc_dev,
+        hwaddr addr,
+        qemu_irq ev_irq,
+        qemu_irq er_irq)
+{
+    char child_name[8];
+    DeviceState *i2c_dev = qdev_create(NULL, TYPE_STM32_I2C);
+    QDEV_PROP_SET_PERIPH_T(i2c_dev, "periph", periph);
+    qdev_prop_set_ptr(i2c_dev, "stm32_rcc", rcc_dev);
+    snprintf(child_name, sizeof(child_name), "i2c[%i]", i2c_num);
+    object_property_add_child(OBJECT(s), child_name, OBJECT(i2c_dev), NULL);
+    stm32_init_periph(s, i2c_dev, periph, addr, ev_irq);
+    sysbus_connect_irq(SYS_BUS_DEVICE(i2c_dev), STM32_I2C_ER_IRQ, er_irq);
+    return i2c_dev;
 }
 
-static void stm32_create_timer_dev(
-        Object *stm32_container,
+static DeviceState *stm32_create_timer_dev(
+        Stm32 *s,
         stm32_periph_t periph,
         int timer_num,
         DeviceState *rcc_dev,
@@ -158,21 +704,81 @@ static void stm32_create_timer_dev(
     qdev_prop_set_ptr(timer_dev, "stm32_gpio", gpio_dev);
     qdev_prop_set_ptr(timer_dev, "stm32_afio", afio_dev);
     snprintf(child_name, sizeof(child_name), "timer[%i]", timer_num);
-    object_property_add_child(stm32_container, child_name, OBJECT(timer_dev), NULL);
-    stm32_init_periph(timer_dev, periph, addr, NULL);
+    object_property_add_child(OBJECT(s), child_name, OBJECT(timer_dev), NULL);
+    stm32_init_periph(s, timer_dev, periph, addr, NULL);
     for (i = 0; i < num_irqs; i++) {
       if (irq[i]) {
-        sysbus_connect_irq(SYS_BUS_DEVICE(timer_dev), 0, irq[i]);
+        sysbus_connect_irq(SYS_BUS_DEVICE(timer_dev), i, irq[i]);
       }
     }
+    return timer_dev;
 }
 
-static void stm32_create_adc_dev(
-        Object *stm32_container,
+/* Internal trigger inputs ITR0-ITR3 of TIM1 to TIM5 on the STM32F103, as
+ * indexes into the timer array.  -1 is TIM8, which is not modelled. */
+static const int stm32_timer_itr_map[5][STM32_TIMER_ITR_LINES] = {
+    { 4, 1, 2, 3 },  /* TIM1: TIM5, TIM2, TIM3, TIM4 */
+    { 0, -1, 2, 3 }, /* TIM2: TIM1, TIM8, TIM3, TIM4 */
+    { 0, 1, 4, 3 },  /* TIM3: TIM1, TIM2, TIM5, TIM4 */
+    { 0, 1, 2, -1 }, /* TIM4: TIM1, TIM2, TIM3, TIM8 */
+    { 1, 2, 3, -1 }, /* TIM5: TIM2, TIM3, TIM4, TIM8 */
+};
+
+/* DAC_CR.TSELx trigger inputs fed by TIM2 to TIM5.  TSEL 1 is TIM3 as on
+ * the connectivity line; TIM6, TIM7 and TIM8 are not modelled. */
+static const int stm32_dac_tsel_map[][2] = {
+    { 2, 1 }, /* TIM3 */
+    { 4, 3 }, /* TIM5 */
+    { 1, 4 }, /* TIM2 */
+    { 3, 5 }, /* TIM4 */
+};
+
+/* Connect the next free TRGO line of a timer to a trigger input */
+static void stm32_connect_trgo(DeviceState *timer_dev, int *trgo_used,
+                               qemu_irq trigger)
+{
+    assert(*trgo_used < STM32_TIMER_TRGO_LINES);
+    qdev_connect_gpio_out_named(timer_dev, "trgo", (*trgo_used)++, trigger);
+}
+
+/* Wire the timers' TRGO outputs to the internal trigger inputs of the other
+ * timers, to the ADC regular external trigger (EXTSEL 4 is TIM3 TRGO) and
+ * to the DAC triggers.  The compare event triggers of the ADC are not
+ * wired. */
+static void stm32_connect_triggers(DeviceState **timer_dev,
+                                   DeviceState *adc_dev, DeviceState *dac_dev)
+{
+    int trgo_used[5] = { 0 };
+    int t, i, master;
+
+    for (t = 0; t < 5; t++) {
+        for (i = 0; i < STM32_TIMER_ITR_LINES; i++) {
+            master = stm32_timer_itr_map[t][i];
+            if (master >= 0) {
+                stm32_connect_trgo(timer_dev[master], &trgo_used[master],
+                        qdev_get_gpio_in_named(timer_dev[t], "itr", i));
+            }
+        }
+    }
+
+    stm32_connect_trgo(timer_dev[2], &trgo_used[2],
+                       qdev_get_gpio_in_named(adc_dev, "ext-trigger", 4));
+
+    for (i = 0; i < ARRAY_SIZE(stm32_dac_tsel_map); i++) {
+        master = stm32_dac_tsel_map[i][0];
+        stm32_connect_trgo(timer_dev[master], &trgo_used[master],
+                qdev_get_gpio_in_named(dac_dev, "trigger",
+                                       stm32_dac_tsel_map[i][1]));
+    }
+}
+
+static DeviceState *stm32_create_adc_dev(
+        Stm32 *s,
         stm32_periph_t periph,
         int adc_num,
         DeviceState *rcc_dev,
         DeviceState **gpio_dev,
+        DeviceState *slave_dev,
         hwaddr addr,
         qemu_irq irq)
 {
@@ -181,14 +787,15 @@ static void stm32_create_adc_dev(
     QDEV_PROP_SET_PERIPH_T(adc_dev, "periph", periph);
     qdev_prop_set_ptr(adc_dev, "stm32_rcc", rcc_dev);      // jmf : pourquoi ?
     qdev_prop_set_ptr(adc_dev, "stm32_gpio", gpio_dev);
+    qdev_prop_set_ptr(adc_dev, "stm32_adc_slave", slave_dev);
+    stm32_stim_connect(s, adc_dev, false);
     snprintf(child_name, sizeof(child_name), "adc[%i]", adc_num);
-    object_property_add_child(stm32_container, child_name, OBJECT(adc_dev), NULL);
-    stm32_init_periph(adc_dev, periph, addr, irq);
-    
+    object_property_add_child(OBJECT(s), child_name, OBJECT(adc_dev), NULL);
+    return stm32_init_periph(s, adc_dev, periph, addr, irq);
 }
 
 static void stm32_create_rtc_dev(
-        Object *stm32_container,
+        Stm32 *s,
         stm32_periph_t periph,
         int rtc_num,
         DeviceState *rcc_dev,
@@ -200,13 +807,34 @@ static void stm32_create_rtc_dev(
     QDEV_PROP_SET_PERIPH_T(rtc_dev, "periph", periph);
     qdev_prop_set_ptr(rtc_dev, "stm32_rcc", rcc_dev);      // jmf : pourquoi ?
     snprintf(child_name, sizeof(child_name), "rtc[%i]", rtc_num);
-    object_property_add_child(stm32_container, child_name, OBJECT(rtc_dev), NULL);
-    stm32_init_periph(rtc_dev, periph, addr, irq);
+    object_property_add_child(OBJECT(s), child_name, OBJECT(rtc_dev), NULL);
+    stm32_init_periph(s, rtc_dev, periph, addr, irq);
     
 }
 
-static void stm32_create_dac_dev(
-        Object *stm32_container,
+/* The IWDG has no clock enable bit, it runs from the LSI. */
+static void stm32_create_wdg_devs(
+        Stm32 *s,
+        DeviceState *rcc_dev,
+        hwaddr iwdg_addr,
+        hwaddr wwdg_addr,
+        qemu_irq wwdg_irq)
+{
+    DeviceState *iwdg_dev = qdev_create(NULL, TYPE_STM32_IWDG);
+    DeviceState *wwdg_dev = qdev_create(NULL, TYPE_STM32_WWDG);
+
+    qdev_prop_set_ptr(iwdg_dev, "stm32_rcc", rcc_dev);
+    object_property_add_child(OBJECT(s), "iwdg", OBJECT(iwdg_dev), NULL);
+    stm32_init_periph(s, iwdg_dev, STM32_PERIPH_UNDEFINED, iwdg_addr, NULL);
+
+    QDEV_PROP_SET_PERIPH_T(wwdg_dev, "periph", STM32_WWDG);
+    qdev_prop_set_ptr(wwdg_dev, "stm32_rcc", rcc_dev);
+    object_property_add_child(OBJECT(s), "wwdg", OBJECT(wwdg_dev), NULL);
+    stm32_init_periph(s, wwdg_dev, STM32_WWDG, wwdg_addr, wwdg_irq);
+}
+
+static DeviceState *stm32_create_dac_dev(
+        Stm32 *s,
         stm32_periph_t periph,
         DeviceState *rcc_dev,
         DeviceState **gpio_dev,
@@ -219,33 +847,201 @@ static void stm32_create_dac_dev(
     qdev_prop_set_ptr(dac_dev, "stm32_rcc", rcc_dev);     
     qdev_prop_set_ptr(dac_dev, "stm32_gpio", gpio_dev);
     snprintf(child_name, sizeof(child_name), "dac");
-    object_property_add_child(stm32_container, child_name, OBJECT(dac_dev), NULL);
-    stm32_init_periph(dac_dev, periph, addr, irq);
-    
+    object_property_add_child(OBJECT(s), child_name, OBJECT(dac_dev), NULL);
+    return stm32_init_periph(s, dac_dev, periph, addr, irq);
 }
 
+/* The windows of the sub-banks are below the range of a co-simulated
+ * device (cosim_shm), which may overlap them.  A NOR Flash is connected to
+ * NE1 to NE4 with -drive if=pflash,index=0 to 3, except on microcontrollers
+ * with a private address space, of which a machine may have several. */
+static void stm32_create_fsmc_dev(Stm32 *s, hwaddr addr)
+{
+    DeviceState *fsmc_dev = qdev_create(NULL, TYPE_STM32_FSMC);
+    DriveInfo *dinfo;
+    char prop_name[16];
+    int i;
 
-void stm32_init(
-            ram_addr_t flash_size,
-            ram_addr_t ram_size,
-            const char *kernel_filename,
-            uint32_t osc_freq,
-            uint32_t osc32_freq)
+    for(i = 0; i < STM32_FSMC_BANK_COUNT; i++) {
+        snprintf(prop_name, sizeof(prop_name), "ne%d_sram", i + 1);
+        qdev_prop_set_uint32(fsmc_dev, prop_name, s->fsmc_sram[i]);
+    }
+    object_property_add_child(OBJECT(s), "fsmc", OBJECT(fsmc_dev), NULL);
+    stm32_init_periph(s, fsmc_dev, STM32_FSMC, addr, NULL);
+
+    for(i = 0; i < STM32_FSMC_BANK_COUNT; i++) {
+        dinfo = s->private_memory ? NULL : drive_get(IF_PFLASH, 0, i);
+        if(dinfo) {
+            stm32_fsmc_attach_nor(STM32_FSMC(fsmc_dev), i + 1, dinfo->bdrv);
+        }
+        memory_region_add_subregion_overlap(s->system_memory,
+                0x60000000 + i * STM32_FSMC_BANK_SIZE,
+                sysbus_mmio_get_region(SYS_BUS_DEVICE(fsmc_dev), i + 1), -1);
+    }
+}
+
+static DeviceState *stm32_create_dma_dev(
+        Stm32 *s,
+        stm32_periph_t periph,
+        int dma_num,
+        DeviceState *rcc_dev,
+        hwaddr addr,
+        qemu_irq *irq,
+        int num_irqs)
+{
+    int i;
+    char child_name[8];
+    DeviceState *dma_dev = qdev_create(NULL, TYPE_STM32_DMA);
+    QDEV_PROP_SET_PERIPH_T(dma_dev, "periph", periph);
+    qdev_prop_set_ptr(dma_dev, "stm32_rcc", rcc_dev);
+    qdev_prop_set_ptr(dma_dev, "as", s->as);
+    snprintf(child_name, sizeof(child_name), "dma[%i]", dma_num);
+    object_property_add_child(OBJECT(s), child_name, OBJECT(dma_dev), NULL);
+    stm32_init_periph(s, dma_dev, periph, addr, NULL);
+    for (i = 0; i < num_irqs; i++) {
+        sysbus_connect_irq(SYS_BUS_DEVICE(dma_dev), i, irq[i]);
+    }
+    return dma_dev;
+}
+
+static void stm32_create_eth_dev(
+        Stm32 *s,
+        DeviceState *rcc_dev,
+        hwaddr addr,
+        qemu_irq irq)
+{
+    DeviceState *eth_dev = qdev_create(NULL, TYPE_STM32_ETH);
+    QDEV_PROP_SET_PERIPH_T(eth_dev, "periph", STM32_ETH);
+    qdev_prop_set_ptr(eth_dev, "stm32_rcc", rcc_dev);
+    qdev_prop_set_ptr(eth_dev, "as", s->as);
+    qemu_check_nic_model(&nd_table[0], TYPE_STM32_ETH);
+    qdev_set_nic_properties(eth_dev, &nd_table[0]);
+    object_property_add_child(OBJECT(s), "eth", OBJECT(eth_dev), NULL);
+    stm32_init_periph(s, eth_dev, STM32_ETH, addr, irq);
+}
+
+/* The four interrupt lines of a CAN controller are consecutive.  master is
+ * NULL for CAN1, and CAN1 for CAN2. */
+static DeviceState *stm32_create_can_dev(
+        Stm32 *s,
+        stm32_periph_t periph,
+        int can_num,
+        DeviceState *rcc_dev,
+        DeviceState *master,
+        hwaddr addr,
+        qemu_irq *irq)
 {
-    MemoryRegion *address_space_mem = get_system_memory();
-    MemoryRegion *flash_alias_mem = g_malloc(sizeof(MemoryRegion));
-    qemu_irq *pic;
     int i;
+    char child_name[8];
+    Object *bus = NULL;
+    DeviceState *can_dev = qdev_create(NULL, TYPE_STM32_CAN);
+
+    if(s->canbus) {
+        bus = object_resolve_path_type(s->canbus, TYPE_CAN_BUS, NULL);
+        if(!bus) {
+            hw_error("STM32: no can-bus object with id %s", s->canbus);
+        }
+    }
+    QDEV_PROP_SET_PERIPH_T(can_dev, "periph", periph);
+    qdev_prop_set_ptr(can_dev, "stm32_rcc", rcc_dev);
+    qdev_prop_set_ptr(can_dev, "canbus", bus);
+    qdev_prop_set_ptr(can_dev, "master", master);
+    snprintf(child_name, sizeof(child_name), "can[%i]", can_num);
+    object_property_add_child(OBJECT(s), child_name, OBJECT(can_dev), NULL);
+    stm32_init_periph(s, can_dev, periph, addr, NULL);
+    for (i = 0; i < 4; i++) {
+        sysbus_connect_irq(SYS_BUS_DEVICE(can_dev), i, irq[i]);
+    }
+    return can_dev;
+}
+
+static void stm32_create_usb_dev(
+        Stm32 *s,
+        DeviceState *rcc_dev,
+        hwaddr addr,
+        hwaddr pma_addr,
+        qemu_irq irq_lp,
+        qemu_irq irq_hp)
+{
+    DeviceState *usb_dev = qdev_create(NULL, TYPE_STM32_USB);
+    QDEV_PROP_SET_PERIPH_T(usb_dev, "periph", STM32_USB_PERIPH);
+    qdev_prop_set_ptr(usb_dev, "stm32_rcc", rcc_dev);
+    object_property_add_child(OBJECT(s), "usb", OBJECT(usb_dev), NULL);
+    stm32_init_periph(s, usb_dev, STM32_USB_PERIPH, addr, irq_lp);
+    stm32_map_periph(s, usb_dev, 1, pma_addr);
+    sysbus_connect_irq(SYS_BUS_DEVICE(usb_dev), STM32_USB_HP_IRQ, irq_hp);
+    stm32_usb_connect(STM32_USB(usb_dev), s->usb_chr);
+}
+
+/* An interrupt line shared by two peripherals, such as USB and CAN1 on
+ * the F1.  Each of them drives one of the two inputs. */
+typedef struct Stm32IrqOr {
+    qemu_irq out;
+    int levels;
+} Stm32IrqOr;
+
+static void stm32_irq_or_handler(void *opaque, int n, int level)
+{
+    Stm32IrqOr *s = (Stm32IrqOr *)opaque;
 
-    Object *stm32_container = container_get(qdev_get_machine(), "/stm32");
+    if(level) {
+        s->levels |= 1 << n;
+    } else {
+        s->levels &= ~(1 << n);
+    }
+    qemu_set_irq(s->out, s->levels != 0);
+}
+
+static qemu_irq *stm32_irq_or_new(qemu_irq out)
+{
+    Stm32IrqOr *s = g_new0(Stm32IrqOr, 1);
 
-    pic = armv7m_init(
-              stm32_container,
-              address_space_mem,
-              flash_size,
-              ram_size,
-              kernel_filename,
-              "cortex-m3");
+    s->out = out;
+    return qemu_allocate_irqs(stm32_irq_or_handler, s, 2);
+}
+
+/* Connect a peripheral's DMA request output to a DMA channel request input */
+static void stm32_connect_dma_req(DeviceState *dev, int n,
+                                  DeviceState *dma_dev, int channel, int req)
+{
+    sysbus_connect_irq(SYS_BUS_DEVICE(dev), n,
+                       qdev_get_gpio_in(dma_dev, STM32_DMA_REQ(channel, req)));
+}
+
+
+/* Set up the address space of the microcontroller and its Flash interface
+ * device, and map the Flash memory at 0 and 0x08000000.  Returns the Flash
+ * interface device; its Flash memory region is passed on to the core. */
+static DeviceState *stm32_init_memory(Stm32 *s, uint32_t flash_size,
+                                      uint32_t page_size, bool f4)
+{
+    char *name = object_get_canonical_path_component(OBJECT(s));
+    char *flash_name = NULL;
+    MemoryRegion *flash;
+
+    if (s->private_memory) {
+        memory_region_init(&s->container, OBJECT(s), name, UINT64_MAX);
+        address_space_init(&s->private_as, &s->container, name);
+        s->system_memory = &s->container;
+        s->as = &s->private_as;
+        flash_name = g_strdup_printf("%s.flash", name);
+    } else {
+        s->system_memory = get_system_memory();
+        s->as = &address_space_memory;
+    }
+
+    /* The Flash is part of the Flash interface device, which handles
+     * programming and erasing it. */
+    DeviceState *flash_dev = qdev_create(NULL, TYPE_STM32_FLASH);
+    qdev_prop_set_uint32(flash_dev, "size", flash_size);
+    qdev_prop_set_uint32(flash_dev, "page_size", page_size);
+    qdev_prop_set_bit(flash_dev, "f4", f4);
+    if (flash_name) {
+        qdev_prop_set_string(flash_dev, "ram_name", flash_name);
+    }
+    object_property_add_child(OBJECT(s), "flash", OBJECT(flash_dev), NULL);
+    qdev_init_nofail(flash_dev);
+    flash = sysbus_mmio_get_region(SYS_BUS_DEVICE(flash_dev), 1);
 
     /* The STM32 family stores its Flash memory at some base address in memory
      * (0x08000000 for medium density devices), and then aliases it to the
@@ -255,23 +1051,151 @@ void stm32_init(
      * QEMU alias so that reads in the 0x08000000 area are passed through to the
      * 0x00000000 area. Note that this is the opposite of real hardware, where the
      * memory at 0x00000000 passes reads through the "real" flash memory at
-     * 0x08000000, but it works the same either way. */
+     * 0x08000000, but it works the same either way.  The Flash itself is
+     * mapped at 0x00000000 by armv7m_init_with_flash. */
     /* TODO: Parameterize the base address of the aliased memory. */
     memory_region_init_alias(
-            flash_alias_mem,
+            &s->flash_alias_mem,
             NULL,
             "stm32-flash-alias-mem",
-            address_space_mem,
+            flash,
             0,
             flash_size);
-    memory_region_add_subregion(address_space_mem, 0x08000000, flash_alias_mem);
+    memory_region_add_subregion(s->system_memory, 0x08000000,
+                                &s->flash_alias_mem);
+
+    g_free(flash_name);
+    g_free(name);
+    return flash_dev;
+}
+
+/* Give the debugger the memory map, so that "load" programs the Flash with
+ * the vFlash packets and it knows which areas it may read.  Flash is
+ * described in blocks of @page_size, except on the F4 (@page_size 0) where
+ * the sectors grow from 16 KB to 128 KB.  The peripheral and system areas
+ * include their bit-band aliases. */
+static void stm32_gdb_memory_map(uint32_t flash_size, uint32_t page_size,
+                                 uint32_t sram_size)
+{
+    static const uint32_t f4_sectors[][2] = {
+        /* Start, sector size */
+        { 0x00000, 0x4000 },
+        { 0x10000, 0x10000 },
+        { 0x20000, 0x20000 },
+    };
+    GString *xml = g_string_new("<?xml version=\"1.0\"?>"
+                                "<!DOCTYPE memory-map PUBLIC "
+                                "\"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" "
+                                "\"http://sourceware.org/gdb/gdb-memory-map.dtd\">"
+                                "<memory-map>");
+    uint32_t base, start, end;
+    int i;
+
+    for(base = 0; base <= 0x08000000; base += 0x08000000) {
+        if(page_size) {
+            g_string_append_printf(xml,
+                    "<memory type=\"flash\" start=\"0x%x\" length=\"0x%x\">"
+                    "<property name=\"blocksize\">0x%x</property></memory>",
+                    base, flash_size, page_size);
+            continue;
+        }
+        for(i = 0; i < ARRAY_SIZE(f4_sectors); i++) {
+            start = f4_sectors[i][0];
+            end = i + 1 < ARRAY_SIZE(f4_sectors) ? f4_sectors[i + 1][0] :
+                                                   flash_size;
+            if(start >= flash_size) {
+                break;
+            }
+            g_string_append_printf(xml,
+                    "<memory type=\"flash\" start=\"0x%x\" length=\"0x%x\">"
+                    "<property name=\"blocksize\">0x%x</property></memory>",
+                    base + start, MIN(end, flash_size) - start,
+                    f4_sectors[i][1]);
+        }
+    }
+    if(!page_size) {
+        g_string_append(xml, "<memory type=\"ram\" start=\"0x10000000\" "
+                             "length=\"0x10000\"/>");
+    }
+    g_string_append_printf(xml,
+            "<memory type=\"ram\" start=\"0x20000000\" length=\"0x%x\"/>"
+            "<memory type=\"ram\" start=\"0x22000000\" length=\"0x2000000\"/>"
+            "<memory type=\"ram\" start=\"0x40000000\" length=\"0x20000000\"/>"
+            /* The FSMC banks and registers */
+            "<memory type=\"ram\" start=\"0x60000000\" length=\"0x40001000\"/>"
+            "<memory type=\"ram\" start=\"0xe0000000\" length=\"0x20000000\"/>"
+            "</memory-map>",
+            sram_size);
+
+    gdb_set_memory_map(xml->str);
+    g_string_free(xml, true);
+}
+
+static int stm32_soc_init(SysBusDevice *dev)
+{
+    Stm32 *s = STM32F103(dev);
+    uint32_t flash_size;
+    DeviceState *flash_dev;
+    qemu_irq *pic;
+    DeviceState *uart_dev[STM32_UART_COUNT];
+    DeviceState *spi_dev[STM32_SPI_COUNT];
+    DeviceState *i2c_dev[STM32_I2C_COUNT];
+    DeviceState *dma1_dev, *dma2_dev, *adc_dev, *adc2_dev, *adc3_dev, *dac_dev;
+    DeviceState *timer_dev[5];
+    qemu_irq *usb_hp_can_tx, *usb_lp_can_rx0;
+    qemu_irq can_irqs[4];
+    int i;
+
+    /* High and XL density devices (more than 128 KB of Flash) have 2 KB
+     * pages, the others 1 KB. */
+    flash_size = ROUND_UP(s->flash_size, 0x400);
+    flash_dev = stm32_init_memory(s, flash_size,
+                                  flash_size > 0x20000 ? 0x800 : 0x400, false);
+    /* Note that armv7m_init_with_flash takes ram_size in KB */
+    stm32_gdb_memory_map(flash_size, flash_size > 0x20000 ? 0x800 : 0x400,
+                         s->ram_size * 1024);
+
+    pic = armv7m_init_with_flash(
+              OBJECT(s),
+              s->system_memory,
+              s->as,
+              sysbus_mmio_get_region(SYS_BUS_DEVICE(flash_dev), 1),
+              stm32_sram_setup(s, s->ram_size * 1024),
+              s->ram_size,
+              s->kernel_filename,
+              "cortex-m3",
+              64);
+
+    stm32_find_cpu(s);
+    arm_cpu_add_direct_ram(s->cpu, 0x08000000, flash_size,
+                           memory_region_get_ram_ptr(&s->flash_alias_mem));
+    if(s->flash_cycles) {
+        stm32_flash_connect_cpu(STM32_FLASH(flash_dev), s->cpu, 0x08000000);
+    }
+    stm32_flash_connect_traces(STM32_FLASH(flash_dev), s->cpu, 0x08000000);
+    arm_cpu_set_local_monitor(s->cpu, s->local_monitor);
+
+    if(s->fast_reset) {
+        stm32_fast_reset_init(s);
+    }
+
+    stm32_map_periph(s, flash_dev, 0, 0x40022000);
+    sysbus_connect_irq(SYS_BUS_DEVICE(flash_dev), 0, pic[STM32_FLASH_IRQ]);
 
     DeviceState *rcc_dev = qdev_create(NULL, "stm32-rcc");
-    qdev_prop_set_uint32(rcc_dev, "osc_freq", osc_freq);
-    qdev_prop_set_uint32(rcc_dev, "osc32_freq", osc32_freq);
-    object_property_add_child(stm32_container, "rcc", OBJECT(rcc_dev), NULL);
-    stm32_init_periph(rcc_dev, STM32_RCC_PERIPH, 0x40021000, pic[STM32_RCC_IRQ]);
+    qdev_prop_set_uint32(rcc_dev, "osc_freq", s->osc_freq);
+    qdev_prop_set_uint32(rcc_dev, "osc32_freq", s->osc32_freq);
+    qdev_prop_set_ptr(rcc_dev, "nvic",
+                      object_resolve_path_component(OBJECT(s), "nvic"));
+    object_property_add_child(OBJECT(s), "rcc", OBJECT(rcc_dev), NULL);
+    stm32_init_periph(s, rcc_dev, STM32_RCC_PERIPH, 0x40021000, pic[STM32_RCC_IRQ]);
 
+    stm32_replay_setup(s);
+    stm32_quantum_setup(s);
+    stm32_cosim_setup(s);
+    stm32_fuzz_setup(s);
+    stm32_stim_init(s);
+    stm32_iothread_init(s);
     DeviceState **gpio_dev = (DeviceState **)g_malloc0(sizeof(DeviceState *) * STM32_GPIO_COUNT);
     for(i = 0; i < STM32_GPIO_COUNT; i++) {
         char child_name[8];
@@ -280,13 +1204,15 @@ void stm32_init(
         QDEV_PROP_SET_PERIPH_T(gpio_dev[i], "periph", periph);
         qdev_prop_set_ptr(gpio_dev[i], "stm32_rcc", rcc_dev);
         snprintf(child_name, sizeof(child_name), "gpio[%c]", 'a' + i);
-        object_property_add_child(stm32_container, child_name, OBJECT(gpio_dev[i]), NULL);
-        stm32_init_periph(gpio_dev[i], periph, 0x40010800 + (i * 0x400), NULL);
+        object_property_add_child(OBJECT(s), child_name, OBJECT(gpio_dev[i]), NULL);
+        stm32_stim_connect(s, gpio_dev[i], true);
+        stm32_init_periph(s, gpio_dev[i], periph, 0x40010800 + (i * 0x400), NULL);
     }
+    stm32_gpio_trace_init(s, gpio_dev);
 
     DeviceState *exti_dev = qdev_create(NULL, TYPE_STM32_EXTI);
-    object_property_add_child(stm32_container, "exti", OBJECT(exti_dev), NULL);
-    stm32_init_periph(exti_dev, STM32_EXTI_PERIPH, 0x40010400, NULL);
+    object_property_add_child(OBJECT(s), "exti", OBJECT(exti_dev), NULL);
+    stm32_init_periph(s, exti_dev, STM32_EXTI_PERIPH, 0x40010400, NULL);
     SysBusDevice *exti_busdev = SYS_BUS_DEVICE(exti_dev);
     sysbus_connect_irq(exti_busdev, 0, pic[STM32_EXTI0_IRQ]);
     sysbus_connect_irq(exti_busdev, 1, pic[STM32_EXTI1_IRQ]);
@@ -309,24 +1235,467 @@ void stm32_init(
     object_property_set_link(OBJECT(afio_dev), OBJECT(gpio_dev[5]), "gpio[f]", NULL);
     object_property_set_link(OBJECT(afio_dev), OBJECT(gpio_dev[6]), "gpio[g]", NULL);
     object_property_set_link(OBJECT(afio_dev), OBJECT(exti_dev), "exti", NULL);
-    object_property_add_child(stm32_container, "afio", OBJECT(afio_dev), NULL);
-    stm32_init_periph(afio_dev, STM32_AFIO_PERIPH, 0x40010000, NULL);
-
-    stm32_create_uart_dev(stm32_container, STM32_UART1, 1, rcc_dev, gpio_dev, afio_dev, 0x40013800, pic[STM32_UART1_IRQ]);
-    stm32_create_uart_dev(stm32_container, STM32_UART2, 2, rcc_dev, gpio_dev, afio_dev, 0x40004400, pic[STM32_UART2_IRQ]);
-    stm32_create_uart_dev(stm32_container, STM32_UART3, 3, rcc_dev, gpio_dev, afio_dev, 0x40004800, pic[STM32_UART3_IRQ]);
-    stm32_create_uart_dev(stm32_container, STM32_UART4, 4, rcc_dev, gpio_dev, afio_dev, 0x40004c00, pic[STM32_UART4_IRQ]);
-    stm32_create_uart_dev(stm32_container, STM32_UART5, 5, rcc_dev, gpio_dev, afio_dev, 0x40005000, pic[STM32_UART5_IRQ]);
-
-    /* Timer 1 has four interrupts but only the TIM1 Update interrupt is implemented. */
-    /*qemu_irq tim1_irqs[] = { pic[TIM1_BRK_IRQn], pic[TIM1_UP_IRQn], pic[TIM1_TRG_COM_IRQn], pic[TIM1_CC_IRQn]};*/
-    stm32_create_timer_dev(stm32_container, STM32_TIM1, 1, rcc_dev, gpio_dev, afio_dev, 0x40012C00, &pic[TIM1_UP_IRQn], 1);
-
-    stm32_create_timer_dev(stm32_container, STM32_TIM2, 1, rcc_dev, gpio_dev, afio_dev, 0x40000000, &pic[TIM2_IRQn], 1);
-    stm32_create_timer_dev(stm32_container, STM32_TIM3, 1, rcc_dev, gpio_dev, afio_dev, 0x40000400, &pic[TIM3_IRQn], 1);
-    stm32_create_timer_dev(stm32_container, STM32_TIM4, 1, rcc_dev, gpio_dev, afio_dev, 0x40000800, &pic[TIM4_IRQn], 1);
-    stm32_create_timer_dev(stm32_container, STM32_TIM5, 1, rcc_dev, gpio_dev, afio_dev, 0x40000C00, &pic[TIM5_IRQn], 1);
-    stm32_create_adc_dev(stm32_container, STM32_ADC1, 1, rcc_dev, gpio_dev, 0x40012400,0 );
-    stm32_create_rtc_dev(stm32_container,STM32_RTC, 1, rcc_dev, 0x40002800,pic[STM32_RTC_IRQ]);
-    stm32_create_dac_dev(stm32_container,STM32_DAC, rcc_dev,gpio_dev, 0x40007400,0);
+    object_property_add_child(OBJECT(s), "afio", OBJECT(afio_dev), NULL);
+    stm32_init_periph(s, afio_dev, STM32_AFIO_PERIPH, 0x40010000, NULL);
+
+    uart_dev[0] = stm32_create_uart_dev(s, STM32_UART1, 1, rcc_dev, gpio_dev, afio_dev, 0x40013800, pic[STM32_UART1_IRQ]);
+    uart_dev[1] = stm32_create_uart_dev(s, STM32_UART2, 2, rcc_dev, gpio_dev, afio_dev, 0x40004400, pic[STM32_UART2_IRQ]);
+    uart_dev[2] = stm32_create_uart_dev(s, STM32_UART3, 3, rcc_dev, gpio_dev, afio_dev, 0x40004800, pic[STM32_UART3_IRQ]);
+    uart_dev[3] = stm32_create_uart_dev(s, STM32_UART4, 4, rcc_dev, gpio_dev, afio_dev, 0x40004c00, pic[STM32_UART4_IRQ]);
+    uart_dev[4] = stm32_create_uart_dev(s, STM32_UART5, 5, rcc_dev, gpio_dev, afio_dev, 0x40005000, pic[STM32_UART5_IRQ]);
+
+    spi_dev[0] = stm32_create_spi_dev(s, STM32_SPI1, 1, rcc_dev, 0x40013000, pic[STM32_SPI1_IRQ]);
+    spi_dev[1] = stm32_create_spi_dev(s, STM32_SPI2, 2, rcc_dev, 0x40003800, pic[STM32_SPI2_IRQ]);
+    spi_dev[2] = stm32_create_spi_dev(s, STM32_SPI3, 3, rcc_dev, 0x40003c00, pic[STM32_SPI3_IRQ]);
+    stm32_create_i2s_dev(s, STM32_I2S2, 2, rcc_dev, spi_dev[1]);
+    stm32_create_i2s_dev(s, STM32_I2S3, 3, rcc_dev, spi_dev[2]);
+
+    i2c_dev[0] = stm32_create_i2c_dev(s, STM32_I2C1, 1, rcc_dev, 0x40005400, pic[STM32_I2C1_EV_IRQ], pic[STM32_I2C1_ER_IRQ]);
+    i2c_dev[1] = stm32_create_i2c_dev(s, STM32_I2C2, 2, rcc_dev, 0x40005800, pic[STM32_I2C2_EV_IRQ], pic[STM32_I2C2_ER_IRQ]);
+
+    /* Timer 1 has four interrupts but only the TIM1 Update and Capture Compare interrupts are implemented. */
+    qemu_irq tim1_irqs[] = { pic[TIM1_UP_IRQn], pic[TIM1_CC_IRQn] };
+    timer_dev[0] = stm32_create_timer_dev(s, STM32_TIM1, 1, rcc_dev, gpio_dev, afio_dev, 0x40012C00, tim1_irqs, 2);
+
+    timer_dev[1] = stm32_create_timer_dev(s, STM32_TIM2, 1, rcc_dev, gpio_dev, afio_dev, 0x40000000, &pic[TIM2_IRQn], 1);
+    timer_dev[2] = stm32_create_timer_dev(s, STM32_TIM3, 1, rcc_dev, gpio_dev, afio_dev, 0x40000400, &pic[TIM3_IRQn], 1);
+    timer_dev[3] = stm32_create_timer_dev(s, STM32_TIM4, 1, rcc_dev, gpio_dev, afio_dev, 0x40000800, &pic[TIM4_IRQn], 1);
+    timer_dev[4] = stm32_create_timer_dev(s, STM32_TIM5, 1, rcc_dev, gpio_dev, afio_dev, 0x40000C00, &pic[TIM5_IRQn], 1);
+    /* ADC2 is the slave of ADC1 in the dual modes */
+    adc2_dev = stm32_create_adc_dev(s, STM32_ADC2, 2, rcc_dev, gpio_dev, NULL, 0x40012800, 0);
+    adc_dev = stm32_create_adc_dev(s, STM32_ADC1, 1, rcc_dev, gpio_dev, adc2_dev, 0x40012400,0 );
+    adc3_dev = stm32_create_adc_dev(s, STM32_ADC3, 3, rcc_dev, gpio_dev, NULL, 0x40013C00, 0);
+    DeviceState *adc_devs[] = { adc_dev, adc2_dev, adc3_dev };
+    stm32_stim_queue_init(s, gpio_dev, adc_devs, ARRAY_SIZE(adc_devs));
+    stm32_create_rtc_dev(s, STM32_RTC, 1, rcc_dev, 0x40002800,pic[STM32_RTC_IRQ]);
+    stm32_create_wdg_devs(s, rcc_dev, 0x40003000, 0x40002c00,
+                          pic[STM32_WWDG_IRQ]);
+
+    DeviceState *pwr_dev = qdev_create(NULL, TYPE_STM32_PWR);
+    qdev_prop_set_ptr(pwr_dev, "stm32_rcc", rcc_dev);
+    object_property_add_child(OBJECT(s), "pwr", OBJECT(pwr_dev), NULL);
+    stm32_init_periph(s, pwr_dev, STM32_PWR, 0x40007000, NULL);
+    qdev_connect_gpio_out_named(
+            DEVICE(object_resolve_path_component(OBJECT(s), "nvic")),
+            "sleepdeep", 0, qdev_get_gpio_in_named(pwr_dev, "sleepdeep", 0));
+
+    DeviceState *bkp_dev = qdev_create(NULL, TYPE_STM32_BKP);
+    qdev_prop_set_ptr(bkp_dev, "stm32_rcc", rcc_dev);
+    object_property_add_child(OBJECT(s), "bkp", OBJECT(bkp_dev), NULL);
+    stm32_init_periph(s, bkp_dev, STM32_BKP, 0x40006c00, NULL);
+    qdev_connect_gpio_out_named(pwr_dev, "dbp", 0,
+                                qdev_get_gpio_in_named(bkp_dev, "dbp", 0));
+    qdev_connect_gpio_out_named(rcc_dev, "bdrst", 0,
+                                qdev_get_gpio_in_named(bkp_dev, "bdrst", 0));
+    dac_dev = stm32_create_dac_dev(s, STM32_DAC, rcc_dev,gpio_dev, 0x40007400,0);
+    stm32_connect_triggers(timer_dev, adc_dev, dac_dev);
+
+    qemu_irq dma1_irqs[] = {
+        pic[STM32_DMA1_CHANNEL1_IRQ], pic[STM32_DMA1_CHANNEL2_IRQ],
+        pic[STM32_DMA1_CHANNEL3_IRQ], pic[STM32_DMA1_CHANNEL4_IRQ],
+        pic[STM32_DMA1_CHANNEL5_IRQ], pic[STM32_DMA1_CHANNEL6_IRQ],
+        pic[STM32_DMA1_CHANNEL7_IRQ]};
+    qemu_irq dma2_irqs[] = {
+        pic[STM32_DMA2_CHANNEL1_IRQ], pic[STM32_DMA2_CHANNEL2_IRQ],
+        pic[STM32_DMA2_CHANNEL3_IRQ], pic[STM32_DMA2_CHANNEL4_IRQ],
+        pic[STM32_DMA2_CHANNEL5_IRQ]};
+    dma1_dev = stm32_create_dma_dev(s, STM32_DMA1, 1, rcc_dev, 0x40020000, dma1_irqs, STM32_DMA1_CHANNEL_COUNT);
+    dma2_dev = stm32_create_dma_dev(s, STM32_DMA2, 2, rcc_dev, 0x40020400, dma2_irqs, STM32_DMA2_CHANNEL_COUNT);
+
+    /* DMA request mapping (RM0008 tables 78 and 79) */
+    stm32_connect_dma_req(adc_dev, STM32_ADC_DMA_IRQ, dma1_dev, 1, 0);
+    stm32_connect_dma_req(uart_dev[2], STM32_UART_DMA_TX_IRQ, dma1_dev, 2, 0);
+    stm32_connect_dma_req(uart_dev[2], STM32_UART_DMA_RX_IRQ, dma1_dev, 3, 0);
+    stm32_connect_dma_req(uart_dev[0], STM32_UART_DMA_TX_IRQ, dma1_dev, 4, 0);
+    stm32_connect_dma_req(uart_dev[0], STM32_UART_DMA_RX_IRQ, dma1_dev, 5, 0);
+    stm32_connect_dma_req(uart_dev[1], STM32_UART_DMA_RX_IRQ, dma1_dev, 6, 0);
+    stm32_connect_dma_req(uart_dev[1], STM32_UART_DMA_TX_IRQ, dma1_dev, 7, 0);
+    stm32_connect_dma_req(uart_dev[3], STM32_UART_DMA_RX_IRQ, dma2_dev, 3, 0);
+    stm32_connect_dma_req(dac_dev, STM32_DAC_DMA1_IRQ, dma2_dev, 3, 1);
+    stm32_connect_dma_req(dac_dev, STM32_DAC_DMA2_IRQ, dma2_dev, 4, 0);
+    stm32_connect_dma_req(uart_dev[3], STM32_UART_DMA_TX_IRQ, dma2_dev, 5, 0);
+    stm32_connect_dma_req(adc3_dev, STM32_ADC_DMA_IRQ, dma2_dev, 5, 1);
+    stm32_connect_dma_req(spi_dev[0], STM32_SPI_DMA_RX_IRQ, dma1_dev, 2, 1);
+    stm32_connect_dma_req(spi_dev[0], STM32_SPI_DMA_TX_IRQ, dma1_dev, 3, 1);
+    stm32_connect_dma_req(spi_dev[1], STM32_SPI_DMA_RX_IRQ, dma1_dev, 4, 1);
+    stm32_connect_dma_req(spi_dev[1], STM32_SPI_DMA_TX_IRQ, dma1_dev, 5, 1);
+    stm32_connect_dma_req(spi_dev[2], STM32_SPI_DMA_RX_IRQ, dma2_dev, 1, 0);
+    stm32_connect_dma_req(spi_dev[2], STM32_SPI_DMA_TX_IRQ, dma2_dev, 2, 0);
+    stm32_connect_dma_req(i2c_dev[1], STM32_I2C_DMA_TX_IRQ, dma1_dev, 4, 2);
+    stm32_connect_dma_req(i2c_dev[1], STM32_I2C_DMA_RX_IRQ, dma1_dev, 5, 2);
+    stm32_connect_dma_req(i2c_dev[0], STM32_I2C_DMA_TX_IRQ, dma1_dev, 6, 1);
+    stm32_connect_dma_req(i2c_dev[0], STM32_I2C_DMA_RX_IRQ, dma1_dev, 7, 1);
+    stm32_spi_connect_dma(STM32_SPI(spi_dev[0]), dma1_dev, 0x40013000);
+    stm32_spi_connect_dma(STM32_SPI(spi_dev[1]), dma1_dev, 0x40003800);
+    stm32_spi_connect_dma(STM32_SPI(spi_dev[2]), dma2_dev, 0x40003c00);
+    stm32_i2c_connect_dma(STM32_I2C(i2c_dev[0]), dma1_dev, 0x40005400);
+    stm32_i2c_connect_dma(STM32_I2C(i2c_dev[1]), dma1_dev, 0x40005800);
+
+    usb_hp_can_tx = stm32_irq_or_new(pic[STM32_USB_HP_CAN1_TX_IRQ]);
+    usb_lp_can_rx0 = stm32_irq_or_new(pic[STM32_USB_LP_CAN1_RX0_IRQ]);
+    can_irqs[0] = usb_hp_can_tx[0];
+    can_irqs[1] = usb_lp_can_rx0[0];
+    can_irqs[2] = pic[STM32_CAN1_RX1_IRQ];
+    can_irqs[3] = pic[STM32_CAN1_SCE_IRQ];
+    stm32_create_can_dev(s, STM32_CAN1, 1, rcc_dev, NULL, 0x40006400,
+                         can_irqs);
+    stm32_create_usb_dev(s, rcc_dev, 0x40005c00, 0x40006000,
+                         usb_lp_can_rx0[1], usb_hp_can_tx[1]);
+
+    if(s->eth) {
+        stm32_create_eth_dev(s, rcc_dev, 0x40028000, pic[STM32_ETH_IRQ]);
+    }
+    stm32_create_fsmc_dev(s, 0xa0000000);
+
+    return 0;
 }
+
+/* STM32F4 (RM0090).  The interrupt numbers of the peripherals which are
+ * implemented are the same as on the F1 connectivity line devices.  The
+ * SYSCFG EXTI configuration registers are at the same offsets as the AFIO
+ * ones, so the AFIO device stands in for SYSCFG.  The F4 DMA (stream based),
+ * ADC and RTC are not implemented, and the Flash interface has the F1
+ * register layout (enough for the ACR latency setup and unlocking). */
+static int stm32f4_soc_init(SysBusDevice *dev)
+{
+    Stm32 *s = STM32F4(dev);
+    char *name = object_get_canonical_path_component(OBJECT(s));
+    char *ccm_name;
+    uint32_t flash_size;
+    DeviceState *flash_dev;
+    DeviceState *can_dev;
+    DeviceState *spi_dev[STM32_SPI_COUNT];
+    qemu_irq *pic;
+    int i;
+
+    /* The F4 Flash is organized in sectors of 16 KB to 128 KB.  The
+     * smallest size is used as the page size. */
+    flash_size = ROUND_UP(s->flash_size, 0x4000);
+    flash_dev = stm32_init_memory(s, flash_size, 0x4000, true);
+    stm32_gdb_memory_map(flash_size, 0, ROUND_UP(s->ram_size, 1024));
+
+    /* The NVIC has 82 interrupts, rounded up to a multiple of 32.
+     * armv7m_init_with_flash takes the SRAM size in KB. */
+    pic = armv7m_init_with_flash(
+              OBJECT(s),
+              s->system_memory,
+              s->as,
+              sysbus_mmio_get_region(SYS_BUS_DEVICE(flash_dev), 1),
+              stm32_sram_setup(s, ROUND_UP(s->ram_size, 1024)),
+              DIV_ROUND_UP(s->ram_size, 1024),
+              s->kernel_filename,
+              "cortex-m4",
+              96);
+    stm32_find_cpu(s);
+    if(s->flash_cycles) {
+        stm32_flash_connect_cpu(STM32_FLASH(flash_dev), s->cpu, 0x08000000);
+    }
+    stm32_flash_connect_traces(STM32_FLASH(flash_dev), s->cpu, 0x08000000);
+    arm_cpu_set_local_monitor(s->cpu, s->local_monitor);
+
+    if(s->fast_reset) {
+        stm32_fast_reset_init(s);
+    }
+
+    /* 64 KB of core coupled memory, which is only reachable from the
+     * core. */
+    ccm_name = s->private_memory ? g_strdup_printf("%s.ccm", name) :
+                                   g_strdup("stm32f4.ccm");
+    memory_region_init_ram(&s->ccm_mem, NULL, ccm_name, 0x10000);
+    vmstate_register_ram_global(&s->ccm_mem);
+    memory_region_add_subregion(s->system_memory, 0x10000000, &s->ccm_mem);
+    g_free(ccm_name);
+
+    stm32_map_periph(s, flash_dev, 0, 0x40023c00);
+    sysbus_connect_irq(SYS_BUS_DEVICE(flash_dev), 0, pic[STM32_FLASH_IRQ]);
+
+    DeviceState *rcc_dev = qdev_create(NULL, TYPE_STM32F4_RCC);
+    qdev_prop_set_uint32(rcc_dev, "osc_freq", s->osc_freq);
+    qdev_prop_set_uint32(rcc_dev, "osc32_freq", s->osc32_freq);
+    qdev_prop_set_ptr(rcc_dev, "nvic",
+                      object_resolve_path_component(OBJECT(s), "nvic"));
+    object_property_add_child(OBJECT(s), "rcc", OBJECT(rcc_dev), NULL);
+    stm32_init_periph(s, rcc_dev, STM32_RCC_PERIPH, 0x40023800, pic[STM32_RCC_IRQ]);
+
+    stm32_replay_setup(s);
+    stm32_quantum_setup(s);
+    stm32_cosim_setup(s);
+    stm32_fuzz_setup(s);
+    stm32_stim_init(s);
+    stm32_iothread_init(s);
+    DeviceState **gpio_dev = (DeviceState **)g_malloc0(sizeof(DeviceState *) * STM32_GPIO_COUNT);
+    for(i = 0; i < STM32_GPIO_COUNT; i++) {
+        char child_name[8];
+        stm32_periph_t periph = STM32_GPIOA + i;
+        gpio_dev[i] = qdev_create(NULL, TYPE_STM32F4_GPIO);
+        QDEV_PROP_SET_PERIPH_T(gpio_dev[i], "periph", periph);
+        qdev_prop_set_ptr(gpio_dev[i], "stm32_rcc", rcc_dev);
+        snprintf(child_name, sizeof(child_name), "gpio[%c]", 'a' + i);
+        object_property_add_child(OBJECT(s), child_name, OBJECT(gpio_dev[i]), NULL);
+        stm32_stim_connect(s, gpio_dev[i], true);
+        stm32_init_periph(s, gpio_dev[i], periph, 0x40020000 + (i * 0x400), NULL);
+    }
+    stm32_gpio_trace_init(s, gpio_dev);
+    /* The F4 ADCs are not implemented */
+    stm32_stim_queue_init(s, gpio_dev, NULL, 0);
+
+    DeviceState *exti_dev = qdev_create(NULL, TYPE_STM32_EXTI);
+    object_property_add_child(OBJECT(s), "exti", OBJECT(exti_dev), NULL);
+    stm32_init_periph(s, exti_dev, STM32_EXTI_PERIPH, 0x40013c00, NULL);
+    SysBusDevice *exti_busdev = SYS_BUS_DEVICE(exti_dev);
+    sysbus_connect_irq(exti_busdev, 0, pic[STM32_EXTI0_IRQ]);
+    sysbus_connect_irq(exti_busdev, 1, pic[STM32_EXTI1_IRQ]);
+    sysbus_connect_irq(exti_busdev, 2, pic[STM32_EXTI2_IRQ]);
+    sysbus_connect_irq(exti_busdev, 3, pic[STM32_EXTI3_IRQ]);
+    sysbus_connect_irq(exti_busdev, 4, pic[STM32_EXTI4_IRQ]);
+    sysbus_connect_irq(exti_busdev, 5, pic[STM32_EXTI9_5_IRQ]);
+    sysbus_connect_irq(exti_busdev, 6, pic[STM32_EXTI15_10_IRQ]);
+    sysbus_connect_irq(exti_busdev, 7, pic[STM32_PVD_IRQ]);
+    sysbus_connect_irq(exti_busdev, 8, pic[STM32_RTCAlarm_IRQ]);
+    sysbus_connect_irq(exti_busdev, 9, pic[STM32_OTG_FS_WKUP_IRQ]);
+
+    DeviceState *syscfg_dev = qdev_create(NULL, TYPE_STM32_AFIO);
+    qdev_prop_set_ptr(syscfg_dev, "stm32_rcc", rcc_dev);
+    object_property_set_link(OBJECT(syscfg_dev), OBJECT(gpio_dev[0]), "gpio[a]", NULL);
+    object_property_set_link(OBJECT(syscfg_dev), OBJECT(gpio_dev[1]), "gpio[b]", NULL);
+    object_property_set_link(OBJECT(syscfg_dev), OBJECT(gpio_dev[2]), "gpio[c]", NULL);
+    object_property_set_link(OBJECT(syscfg_dev), OBJECT(gpio_dev[3]), "gpio[d]", NULL);
+    object_property_set_link(OBJECT(syscfg_dev), OBJECT(gpio_dev[4]), "gpio[e]", NULL);
+    object_property_set_link(OBJECT(syscfg_dev), OBJECT(gpio_dev[5]), "gpio[f]", NULL);
+    object_property_set_link(OBJECT(syscfg_dev), OBJECT(gpio_dev[6]), "gpio[g]", NULL);
+    object_property_set_link(OBJECT(syscfg_dev), OBJECT(exti_dev), "exti", NULL);
+    object_property_add_child(OBJECT(s), "syscfg", OBJECT(syscfg_dev), NULL);
+    stm32_init_periph(s, syscfg_dev, STM32_AFIO_PERIPH, 0x40013800, NULL);
+
+    /* There is no pin remapping on the F4, so the UARTs and timers are
+     * created without an AFIO. */
+    stm32_create_uart_dev(s, STM32_UART1, 1, rcc_dev, gpio_dev, NULL, 0x40011000, pic[STM32_UART1_IRQ]);
+    stm32_create_uart_dev(s, STM32_UART2, 2, rcc_dev, gpio_dev, NULL, 0x40004400, pic[STM32_UART2_IRQ]);
+    stm32_create_uart_dev(s, STM32_UART3, 3, rcc_dev, gpio_dev, NULL, 0x40004800, pic[STM32_UART3_IRQ]);
+    stm32_create_uart_dev(s, STM32_UART4, 4, rcc_dev, gpio_dev, NULL, 0x40004c00, pic[STM32_UART4_IRQ]);
+    stm32_create_uart_dev(s, STM32_UART5, 5, rcc_dev, gpio_dev, NULL, 0x40005000, pic[STM32_UART5_IRQ]);
+
+    stm32_create_spi_dev(s, STM32_SPI1, 1, rcc_dev, 0x40013000, pic[STM32_SPI1_IRQ]);
+    spi_dev[1] = stm32_create_spi_dev(s, STM32_SPI2, 2, rcc_dev, 0x40003800, pic[STM32_SPI2_IRQ]);
+    spi_dev[2] = stm32_create_spi_dev(s, STM32_SPI3, 3, rcc_dev, 0x40003c00, pic[STM32_SPI3_IRQ]);
+    stm32_create_i2s_dev(s, STM32_I2S2, 2, rcc_dev, spi_dev[1]);
+    stm32_create_i2s_dev(s, STM32_I2S3, 3, rcc_dev, spi_dev[2]);
+
+    stm32_create_i2c_dev(s, STM32_I2C1, 1, rcc_dev, 0x40005400, pic[STM32_I2C1_EV_IRQ], pic[STM32_I2C1_ER_IRQ]);
+    stm32_create_i2c_dev(s, STM32_I2C2, 2, rcc_dev, 0x40005800, pic[STM32_I2C2_EV_IRQ], pic[STM32_I2C2_ER_IRQ]);
+
+    qemu_irq tim1_irqs[] = { pic[TIM1_UP_IRQn], pic[TIM1_CC_IRQn] };
+    stm32_create_timer_dev(s, STM32_TIM1, 1, rcc_dev, gpio_dev, NULL, 0x40010000, tim1_irqs, 2);
+
+    stm32_create_timer_dev(s, STM32_TIM2, 1, rcc_dev, gpio_dev, NULL, 0x40000000, &pic[TIM2_IRQn], 1);
+    stm32_create_timer_dev(s, STM32_TIM3, 1, rcc_dev, gpio_dev, NULL, 0x40000400, &pic[TIM3_IRQn], 1);
+    stm32_create_timer_dev(s, STM32_TIM4, 1, rcc_dev, gpio_dev, NULL, 0x40000800, &pic[TIM4_IRQn], 1);
+    stm32_create_timer_dev(s, STM32_TIM5, 1, rcc_dev, gpio_dev, NULL, 0x40000C00, &pic[TIM5_IRQn], 1);
+    stm32_create_dac_dev(s, STM32_DAC, rcc_dev, gpio_dev, 0x40007400, 0);
+    stm32_create_wdg_devs(s, rcc_dev, 0x40003000, 0x40002c00,
+                          pic[STM32_WWDG_IRQ]);
+
+    can_dev = stm32_create_can_dev(s, STM32_CAN1, 1, rcc_dev, NULL,
+                                   0x40006400, &pic[STM32_CAN1_TX_IRQ]);
+    stm32_create_can_dev(s, STM32_CAN2, 2, rcc_dev, can_dev, 0x40006800,
+                         &pic[STM32_CAN2_TX_IRQ]);
+
+    if(s->eth) {
+        stm32_create_eth_dev(s, rcc_dev, 0x40028000, pic[STM32_ETH_IRQ]);
+    }
+    stm32_create_fsmc_dev(s, 0xa0000000);
+
+    g_free(name);
+    return 0;
+}
+
+static DeviceState *stm32_create_soc(
+            const char *type,
+            const char *name,
+            bool private_memory,
+            ram_addr_t flash_size,
+            ram_addr_t ram_size,
+            const char *kernel_filename,
+            uint32_t osc_freq,
+            uint32_t osc32_freq)
+{
+    DeviceState *dev = qdev_create(NULL, type);
+
+    qdev_prop_set_uint32(dev, "flash_size", flash_size);
+    qdev_prop_set_uint32(dev, "ram_size", ram_size);
+    if (kernel_filename) {
+        qdev_prop_set_string(dev, "kernel_filename", kernel_filename);
+    }
+    qdev_prop_set_uint32(dev, "osc_freq", osc_freq);
+    qdev_prop_set_uint32(dev, "osc32_freq", osc32_freq);
+    qdev_prop_set_bit(dev, "private_memory", private_memory);
+    object_property_add_child(qdev_get_machine(), name, OBJECT(dev), NULL);
+    qdev_init_nofail(dev);
+    return dev;
+}
+
+DeviceState *stm32_create(
+            const char *name,
+            bool private_memory,
+            ram_addr_t flash_size,
+            ram_addr_t ram_size,
+            const char *kernel_filename,
+            uint32_t osc_freq,
+            uint32_t osc32_freq)
+{
+    return stm32_create_soc(TYPE_STM32F103, name, private_memory, flash_size,
+                            ram_size, kernel_filename, osc_freq, osc32_freq);
+}
+
+DeviceState *stm32f4_create(
+            const char *name,
+            bool private_memory,
+            ram_addr_t flash_size,
+            ram_addr_t ram_size,
+            const char *kernel_filename,
+            uint32_t osc_freq,
+            uint32_t osc32_freq)
+{
+    return stm32_create_soc(TYPE_STM32F4, name, private_memory, flash_size,
+                            ram_size, kernel_filename, osc_freq, osc32_freq);
+}
+
+void stm32_init(
+            ram_addr_t flash_size,
+            ram_addr_t ram_size,
+            const char *kernel_filename,
+            uint32_t osc_freq,
+            uint32_t osc32_freq)
+{
+    stm32_create("stm32", false, flash_size, ram_size, kernel_filename,
+                 osc_freq, osc32_freq);
+}
+
+static Property stm32_soc_properties[] = {
+    DEFINE_PROP_UINT32("flash_size", Stm32, flash_size, 0x20000),
+    DEFINE_PROP_UINT32("ram_size", Stm32, ram_size, 0x5000),
+    DEFINE_PROP_STRING("kernel_filename", Stm32, kernel_filename),
+    DEFINE_PROP_UINT32("osc_freq", Stm32, osc_freq, 8000000),
+    DEFINE_PROP_UINT32("osc32_freq", Stm32, osc32_freq, 32768),
+    DEFINE_PROP_BOOL("private_memory", Stm32, private_memory, false),
+    DEFINE_PROP_BOOL("eth", Stm32, eth, false),
+    DEFINE_PROP_STRING("canbus", Stm32, canbus),
+    DEFINE_PROP_CHR("usb", Stm32, usb_chr),
+    DEFINE_PROP_BOOL("flash_cycles", Stm32, flash_cycles, false),
+    DEFINE_PROP_BOOL("fast_reset", Stm32, fast_reset, false),
+    DEFINE_PROP_BOOL("local_monitor", Stm32, local_monitor, false),
+    DEFINE_PROP_UINT32("fsmc_ne1_sram", Stm32, fsmc_sram[0], 0),
+    DEFINE_PROP_UINT32("fsmc_ne2_sram", Stm32, fsmc_sram[1], 0),
+    DEFINE_PROP_UINT32("fsmc_ne3_sram", Stm32, fsmc_sram[2], 0),
+    DEFINE_PROP_UINT32("fsmc_ne4_sram", Stm32, fsmc_sram[3], 0),
+    DEFINE_PROP_CHR("gpio_trace", Stm32, gpio_trace_chr),
+    DEFINE_PROP_STRING("gpio_trace_file", Stm32, gpio_trace_file),
+    DEFINE_PROP_STRING("stim_file", Stm32, stim_file),
+    DEFINE_PROP_UINT32("stim_period_ns", Stm32, stim_period_ns, 0),
+    DEFINE_PROP_CHR("stim_events", Stm32, stim_events_chr),
+    DEFINE_PROP_STRING("stim_events_file", Stm32, stim_events_file),
+    DEFINE_PROP_STRING("record_file", Stm32, record_file),
+    DEFINE_PROP_STRING("replay_file", Stm32, replay_file),
+    DEFINE_PROP_STRING("quantum_sync", Stm32, quantum_sync),
+    DEFINE_PROP_UINT32("quantum_node", Stm32, quantum_node, 0),
+    DEFINE_PROP_UINT32("quantum_nodes", Stm32, quantum_nodes, 2),
+    DEFINE_PROP_UINT32("quantum_ns", Stm32, quantum_ns, 100000),
+    DEFINE_PROP_UINT32("quantum_uarts", Stm32, quantum_uarts, 0),
+    DEFINE_PROP_STRING("cosim_shm", Stm32, cosim_shm),
+    DEFINE_PROP_UINT32("cosim_base", Stm32, cosim_base, 0x60000000),
+    DEFINE_PROP_UINT32("cosim_size", Stm32, cosim_size, 0x04000000),
+    DEFINE_PROP_UINT32("cosim_quantum_ns", Stm32, cosim_quantum_ns, 100000),
+    DEFINE_PROP_STRING("sram_shm", Stm32, sram_shm),
+    DEFINE_PROP_UINT32("sram_shm_period_ns", Stm32, sram_shm_period_ns, 0),
+    DEFINE_PROP_BOOL("fuzz", Stm32, fuzz, false),
+    DEFINE_PROP_STRING("fuzz_input", Stm32, fuzz_input),
+    DEFINE_PROP_STRING("prof_file", Stm32, prof_file),
+    DEFINE_PROP_STRING("iothread", Stm32, iothread),
+    DEFINE_PROP_UINT32("prof_period_ns", Stm32, prof_period_ns, 100000),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_soc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_soc_init;
+    dc->props = stm32_soc_properties;
+}
+
+static TypeInfo stm32_soc_info = {
+    .name  = TYPE_STM32F103,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32),
+    .class_init = stm32_soc_class_init
+};
+
+/* The defaults are those of the STM32F407VG: 1 MB of Flash and 128 KB of
+ * SRAM (plus the 64 KB of CCM). */
+static Property stm32f4_soc_properties[] = {
+    DEFINE_PROP_UINT32("flash_size", Stm32, flash_size, 0x100000),
+    DEFINE_PROP_UINT32("ram_size", Stm32, ram_size, 0x20000),
+    DEFINE_PROP_STRING("kernel_filename", Stm32, kernel_filename),
+    DEFINE_PROP_UINT32("osc_freq", Stm32, osc_freq, 8000000),
+    DEFINE_PROP_UINT32("osc32_freq", Stm32, osc32_freq, 32768),
+    DEFINE_PROP_BOOL("private_memory", Stm32, private_memory, false),
+    DEFINE_PROP_BOOL("eth", Stm32, eth, false),
+    DEFINE_PROP_STRING("canbus", Stm32, canbus),
+    DEFINE_PROP_BOOL("flash_cycles", Stm32, flash_cycles, false),
+    DEFINE_PROP_BOOL("fast_reset", Stm32, fast_reset, false),
+    DEFINE_PROP_BOOL("local_monitor", Stm32, local_monitor, false),
+    DEFINE_PROP_UINT32("fsmc_ne1_sram", Stm32, fsmc_sram[0], 0),
+    DEFINE_PROP_UINT32("fsmc_ne2_sram", Stm32, fsmc_sram[1], 0),
+    DEFINE_PROP_UINT32("fsmc_ne3_sram", Stm32, fsmc_sram[2], 0),
+    DEFINE_PROP_UINT32("fsmc_ne4_sram", Stm32, fsmc_sram[3], 0),
+    DEFINE_PROP_CHR("gpio_trace", Stm32, gpio_trace_chr),
+    DEFINE_PROP_STRING("gpio_trace_file", Stm32, gpio_trace_file),
+    DEFINE_PROP_STRING("stim_file", Stm32, stim_file),
+    DEFINE_PROP_UINT32("stim_period_ns", Stm32, stim_period_ns, 0),
+    DEFINE_PROP_CHR("stim_events", Stm32, stim_events_chr),
+    DEFINE_PROP_STRING("stim_events_file", Stm32, stim_events_file),
+    DEFINE_PROP_STRING("record_file", Stm32, record_file),
+    DEFINE_PROP_STRING("replay_file", Stm32, replay_file),
+    DEFINE_PROP_STRING("quantum_sync", Stm32, quantum_sync),
+    DEFINE_PROP_UINT32("quantum_node", Stm32, quantum_node, 0),
+    DEFINE_PROP_UINT32("quantum_nodes", Stm32, quantum_nodes, 2),
+    DEFINE_PROP_UINT32("quantum_ns", Stm32, quantum_ns, 100000),
+    DEFINE_PROP_UINT32("quantum_uarts", Stm32, quantum_uarts, 0),
+    DEFINE_PROP_STRING("cosim_shm", Stm32, cosim_shm),
+    DEFINE_PROP_UINT32("cosim_base", Stm32, cosim_base, 0x60000000),
+    DEFINE_PROP_UINT32("cosim_size", Stm32, cosim_size, 0x04000000),
+    DEFINE_PROP_UINT32("cosim_quantum_ns", Stm32, cosim_quantum_ns, 100000),
+    DEFINE_PROP_STRING("sram_shm", Stm32, sram_shm),
+    DEFINE_PROP_UINT32("sram_shm_period_ns", Stm32, sram_shm_period_ns, 0),
+    DEFINE_PROP_BOOL("fuzz", Stm32, fuzz, false),
+    DEFINE_PROP_STRING("fuzz_input", Stm32, fuzz_input),
+    DEFINE_PROP_STRING("prof_file", Stm32, prof_file),
+    DEFINE_PROP_STRING("iothread", Stm32, iothread),
+    DEFINE_PROP_UINT32("prof_period_ns", Stm32, prof_period_ns, 100000),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32f4_soc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32f4_soc_init;
+    dc->props = stm32f4_soc_properties;
+}
+
+static TypeInfo stm32f4_soc_info = {
+    .name  = TYPE_STM32F4,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32),
+    .class_init = stm32f4_soc_class_init
+};
+
+static void stm32_soc_register_types(void)
+{
+    type_register_static(&stm32_soc_info);
+    type_register_static(&stm32f4_soc_info);
+}
+
+type_init(stm32_soc_register_types)
@@ -36,6 +36,20 @@
 #define DPRINTF(fmt, ...)
 #endif
 
+/* Number of entries in the precomputed sine table used for the default
+ * sample source. */
+#define STM32_ADC_SINE_TABLE_SIZE 4096
+
+/* Size of the buffer holding samples received from a character device. */
+#define STM32_ADC_CHR_FIFO_SIZE 256
+
+/* Sample sources for channels 0 to 15 */
+typedef enum {
+    STM32_ADC_SOURCE_SINE,    /* 1 Hz sine wave (precomputed table) */
+    STM32_ADC_SOURCE_FILE,    /* Ring of samples loaded from a file */
+    STM32_ADC_SOURCE_CHARDEV  /* 16 bit little-endian samples from a chardev */
+} Stm32AdcSource;
+
 // libopencm3/cm3/common.h
 #define MMIO32(addr)            (*(volatile uint32_t *)(addr))
 
@@ -581,6 +595,15 @@ and ADC2
 
 /* --- Function prototypes ------------------------------------------------- */
 
+/* The analog inputs sit on ports A, B and C, and for ADC3 also on port F */
+#define STM32_ADC_GPIO_PORTS 3
+#define STM32_ADC_GPIO_NOTIFIERS 4
+
+typedef struct Stm32AdcGpioNotifier {
+    Notifier notifier;
+    struct Stm32Adc *adc;
+} Stm32AdcGpioNotifier;
+
 struct Stm32Adc {
     /* Inherited */
     SysBusDevice busdev;
@@ -590,14 +613,32 @@ struct Stm32Adc {
     void *stm32_rcc_prop;
     void *stm32_gpio_prop;
     void *stm32_afio_prop;
+    /* File of whitespace separated samples to play back (in a loop) */
+    char *source_file;
+    void *stim_prop;
+    /* AioContext in which the timers run, NULL for the main loop */
+    void *aio_context;
+    /* ADC2, for the dual modes (ADC1 only) */
+    void *stm32_adc_slave_prop;
 
     /* Private */
     MemoryRegion iomem;
 
     Stm32Rcc *stm32_rcc;
     Stm32Gpio **stm32_gpio;
+    /* ADC2 from ADC1, and ADC1 from ADC2.  In dual regular simultaneous
+     * mode, ADC1 performs the regular conversions of both: ADC2 never runs
+     * a sequence of its own. */
+    Stm32Adc *slave;
+    Stm32Adc *master;
+    /* Channels IN0-IN15 whose pin has been checked to be an analog input.
+     * Cleared whenever the configuration of port A, B or C (or F) changes. */
+    uint16_t gpio_checked;
+    Stm32AdcGpioNotifier gpio_notifier[STM32_ADC_GPIO_NOTIFIERS];
+    uint64_t ns_per_conversion; /* 12.5 cycles added to every sample time */
     uint64_t ns_per_sample[8]; /*8 possibility of numbers cycles for each conversion 
                                 (recover from: time register 1 (SMPR1),time register 2 (SMPR2))*/
+    uint32_t clk_generation; /* peripheral clock generation of ns_per_sample */
 
     /* Register Values */
     uint32_t
@@ -625,16 +666,41 @@ struct Stm32Adc {
 
     bool sr_read_since_ore_set;
 
+    /* Regular sequence state.  Conversions are not simulated one by one as
+     * they happen.  Instead, next_conv_time records when the conversion at
+     * seq_index completes, and the sequence is brought up to date whenever
+     * the software looks at the ADC (or when a timer fires because an
+     * interrupt or DMA transfer is due).
+     */
     bool converting;
+    bool catching_up; /* a DMA read of ADC_DR must not recurse */
+    int seq_index;
+    int64_t next_conv_time;
 
     struct QEMUTimer *conv_timer;
 
+    Stm32AdcSource source;
+    uint16_t *file_samples;
+    uint32_t file_sample_count, file_sample_pos;
+    uint8_t chr_fifo[STM32_ADC_CHR_FIFO_SIZE];
+    int chr_fifo_head, chr_fifo_count;
+    uint16_t chr_last_sample;
+
     CharDriverState *chr;
 
+    /* Channels driven from the stimulus file take precedence */
+    Stm32StimSlot *stim;
+    Stm32ReplayChannel *stim_replay;
+    /* Then the channels set by stm32_adc_set_input */
+    uint32_t input_mask;
+    uint16_t input_value[STM32_ADC_INPUTS];
+
     uint32_t afio_board_map;
 
     qemu_irq irq;
     int curr_irq_level;
+    qemu_irq dma_irq;
+    int curr_dma_level;
     int Vref; //mv
     int Vdda; //mv
 };
@@ -649,25 +715,21 @@ static void stm32_ADC_CR2_write(Stm32Adc *s,uint32_t new_value);
 static uint32_t stm32_ADC_DR_read(Stm32Adc *s);
 
 /* functions modified in adc*/ 
-static void stm32_adc_clk_irq_handler(void *opaque, int n, int level);
 static void stm32_ADC_update_irq(Stm32Adc *s);
 static void stm32_adc_start_conv(Stm32Adc *s);
 static void stm32_adc_reset(DeviceState *dev);
 
 /* HELPER FUNCTIONS */
 
-/* Handle a change in the peripheral clock. */
-static void stm32_adc_clk_irq_handler(void *opaque, int n, int level)
+/* Recompute the sample times if the peripheral clock changed since they were
+ * last computed.  Called when a conversion starts rather than on every clock
+ * change. */
+static void stm32_ADC_ns_per_sample_sync(Stm32Adc *s)
 {
-
-    Stm32Adc *s = (Stm32Adc *)opaque;
-    assert(n == 0);
-
-    /* Only update the ns per sample if the IRQ is being set. */
-    if(level) {
+    if(s->clk_generation !=
+            stm32_rcc_get_periph_generation(s->stm32_rcc, s->periph)) {
         stm32_ADC_update_ns_per_sample(s);
     }
-
 }
 
 
@@ -679,6 +741,8 @@ static void stm32_ADC_update_irq(Stm32Adc *s) {
         ((s->ADC_CR1 >> 5) & (s->ADC_SR >> 1)) | 
         ((s->ADC_CR1 >> 7) & (s->ADC_SR >> 2)) |
         ((s->ADC_CR1 >> 6) & (s->ADC_SR >> 0));
+    int new_dma_level =
+        (s->ADC_CR2 & ADC_CR2_DMA) && (s->ADC_SR & ADC_SR_EOC);
        
     /* Only trigger an interrupt if the IRQ level changes.  We probably could
      * set the level regardless, but we will just check for good measure.
@@ -688,53 +752,398 @@ static void stm32_ADC_update_irq(Stm32Adc *s) {
         qemu_set_irq(s->irq, new_irq_level);
         s->curr_irq_level = new_irq_level;
     }
+
+    /* In DMA mode, a DMA request is made at the end of each conversion.
+     * The DMA reading ADC_DR clears EOC, which removes the request. */
+    if(new_dma_level ^ s->curr_dma_level) {
+        s->curr_dma_level = new_dma_level;
+        qemu_set_irq(s->dma_irq, new_dma_level);
+    }
 }
 
-static void stm32_adc_conv_complete(Stm32Adc *s)
+/* SAMPLE SOURCES */
+
+static uint16_t stm32_adc_sine_table[STM32_ADC_SINE_TABLE_SIZE];
+
+static void stm32_adc_init_sine_table(void)
 {
-  s-> ADC_SR|=ADC_SR_EOC;  // jmf : indicates end of conversion
-  stm32_ADC_update_irq(s); 
+    static bool initialized;
+    int i;
+
+    if(!initialized) {
+        for(i = 0; i < STM32_ADC_SINE_TABLE_SIZE; i++) {
+            stm32_adc_sine_table[i] =
+                ((int)(1024.*(sin(2*M_PI*i/STM32_ADC_SINE_TABLE_SIZE)+1.)))&0xfff;
+        }
+        initialized = true;
+    }
 }
 
+/* Produce the value of a conversion of the given channel which completed at
+ * the specified time. */
+static uint16_t stm32_adc_sample(Stm32Adc *s, int channel, int64_t time)
+{
+    uint16_t value;
+    uint16_t stim[2] = { 0 }; /* driven, value */
+
+    if(s->stim) {
+        stim[0] = stm32_stim_adc(s->stim, s->periph - STM32_ADC1, channel,
+                                 &stim[1]);
+        stm32_replay_value(s->stim_replay, stim, sizeof(stim));
+        if(stim[0]) {
+            return stim[1] & 0xfff;
+        }
+    }
+
+    if(s->input_mask & BIT(channel)) {
+        return s->input_value[channel];
+    }
+
+    if(channel==16){
+      s->Vdda=rand()%(1200+1) + 2400; //Vdda belongs to the interval [2400 3600] mv
+      s->Vref=rand()%(s->Vdda-2400+1) + 2400; //Vref belongs to the interval [2400 Vdda] mv
+      return s->Vdda - s->Vref;
+    }
+    else if(channel==17){
+      return (s->Vref=rand()%(s->Vdda-2400+1) + 2400); //Vref [2400 Vdda] mv
+    }
+
+    switch(s->source) {
+        case STM32_ADC_SOURCE_FILE:
+            value = s->file_samples[s->file_sample_pos];
+            s->file_sample_pos = (s->file_sample_pos + 1) % s->file_sample_count;
+            return value;
+        case STM32_ADC_SOURCE_CHARDEV:
+            /* Hold the last value if the host has not sent a new one. */
+            if(s->chr_fifo_count >= 2) {
+                s->chr_last_sample = (s->chr_fifo[s->chr_fifo_head] |
+                    (s->chr_fifo[(s->chr_fifo_head + 1) %
+                                 STM32_ADC_CHR_FIFO_SIZE] << 8)) & 0xfff;
+                s->chr_fifo_head = (s->chr_fifo_head + 2) %
+                                   STM32_ADC_CHR_FIFO_SIZE;
+                s->chr_fifo_count -= 2;
+                if(s->chr) {
+                    qemu_chr_accept_input(s->chr);
+                }
+            }
+            return s->chr_last_sample;
+        default:
+            /* 1 Hz sine wave */
+            return stm32_adc_sine_table[(time % 1000000000LL) *
+                                        STM32_ADC_SINE_TABLE_SIZE /
+                                        1000000000LL];
+    }
+}
+
+
+
+
+/* CONVERSION SEQUENCE */
+
+/* Returns the number of conversions in the regular sequence. */
+static int stm32_adc_seq_length(Stm32Adc *s)
+{
+    if(!(s->ADC_CR1 & ADC_CR1_SCAN)) {
+        return 1;
+    }
+    return ((s->ADC_SQR1 >> ADC_SQR1_L_LSB) & 0xf) + 1;
+}
+
+/* Returns true if ADC1 also converts the regular sequence of ADC2. */
+static bool stm32_adc_dual_regular(Stm32Adc *s)
+{
+    return s->slave &&
+           (s->ADC_CR1 & ADC_CR1_DUALMOD_MASK) == ADC_CR1_DUALMOD_RSM;
+}
+
+/* Returns the ADC which runs the regular sequence of this one: ADC1 for
+ * ADC2 in dual regular simultaneous mode, else the ADC itself. */
+static Stm32Adc *stm32_adc_seq_owner(Stm32Adc *s)
+{
+    if(s->master && stm32_adc_dual_regular(s->master)) {
+        return s->master;
+    }
+    return s;
+}
+
+/* Returns the time taken by one conversion of the channel at the given
+ * position in the sequence. */
+static int64_t stm32_adc_conv_time(Stm32Adc *s, int index)
+{
+    int64_t t = s->ns_per_conversion +
+        stm32_ADC_get_nbr_cycle_per_sample(s,
+            stm32_ADC_get_channel_number(s, index + 1));
+
+    /* Guard against a stopped clock - time must always move forward. */
+    return t > 0 ? t : 1;
+}
+
+/* Returns true if something is waiting for individual conversions (an
+ * interrupt or a DMA request), rather than just polling. */
+static bool stm32_adc_observed(Stm32Adc *s)
+{
+    if(stm32_adc_dual_regular(s) && ((s->slave->ADC_CR1 & ADC_CR1_EOCIE) ||
+                                     (s->slave->ADC_CR2 & ADC_CR2_DMA))) {
+        return true;
+    }
+    return (s->ADC_CR1 & ADC_CR1_EOCIE) || (s->ADC_CR2 & ADC_CR2_DMA);
+}
+
+/* Returns true if the end of every conversion raises an interrupt. */
+static bool stm32_adc_eoc_irq(Stm32Adc *s)
+{
+    if(stm32_adc_dual_regular(s) && (s->slave->ADC_CR1 & ADC_CR1_EOCIE)) {
+        return true;
+    }
+    return s->ADC_CR1 & ADC_CR1_EOCIE;
+}
+
+/* Arm the timer for the next point where a conversion has to be delivered.
+ * With the EOC interrupt enabled, that is the end of every conversion.  With
+ * only DMA enabled, the samples of a whole sequence are delivered in one go
+ * at the end of the sequence.  Otherwise no timer is needed at all, since
+ * polling software always brings the sequence up to date first.
+ */
+static void stm32_adc_schedule(Stm32Adc *s)
+{
+    int64_t deadline;
+    int i, len;
+
+    s = stm32_adc_seq_owner(s);
+    if(!s->converting || !stm32_adc_observed(s)) {
+        timer_del(s->conv_timer);
+        return;
+    }
+
+    deadline = s->next_conv_time;
+    if(!stm32_adc_eoc_irq(s)) {
+        len = stm32_adc_seq_length(s);
+        for(i = s->seq_index + 1; i < len; i++) {
+            deadline += stm32_adc_conv_time(s, i);
+        }
+    }
+    timer_mod(s->conv_timer, deadline);
+}
+
+/* Skip samples of the source file, as if they had been converted. */
+static void stm32_adc_skip_samples(Stm32Adc *s, uint64_t count)
+{
+    if(s->source == STM32_ADC_SOURCE_FILE) {
+        s->file_sample_pos = (s->file_sample_pos + count) %
+                             s->file_sample_count;
+    }
+}
+
+/* In dual regular simultaneous mode, convert the ADC2 channel paired with
+ * the one ADC1 has just converted, at the same time.  The ADC2 result also
+ * goes to the upper half of ADC1_DR, so that a single 32-bit DMA transfer
+ * from ADC1 fetches both samples. */
+static void stm32_adc_slave_conv(Stm32Adc *s, int index, int64_t time)
+{
+    Stm32Adc *slave = s->slave;
+    uint16_t value;
+
+    value = stm32_adc_sample(slave,
+                stm32_ADC_get_channel_number(slave,
+                    index % stm32_adc_seq_length(slave) + 1),
+                time);
+    slave->ADC_DR = value;
+    slave->ADC_SR |= ADC_SR_EOC;
+    stm32_ADC_update_irq(slave);
+    s->ADC_DR = (s->ADC_DR & 0xffff) | ((uint32_t)value << 16);
+}
+
+/* Complete all conversions which are due by the given time. */
+static void stm32_adc_catch_up(Stm32Adc *s, int64_t now)
+{
+    int len = stm32_adc_seq_length(s);
+    int64_t seq_time;
+    int64_t skip;
+    int i;
+
+    if(!s->converting || s->catching_up || (s->next_conv_time > now)) {
+        return;
+    }
+    s->catching_up = true;
+
+    /* If nothing is watching individual samples, whole sequences which are
+     * already over can be skipped - only the latest value is visible. */
+    if((s->ADC_CR2 & ADC_CR2_CONT) && !stm32_adc_observed(s) &&
+            (s->seq_index == 0)) {
+        seq_time = 0;
+        for(i = 0; i < len; i++) {
+            seq_time += stm32_adc_conv_time(s, i);
+        }
+        skip = (now - s->next_conv_time) / seq_time;
+        if(skip > 1) {
+            s->next_conv_time += (skip - 1) * seq_time;
+            stm32_adc_skip_samples(s, (uint64_t)(skip - 1) * len);
+            if(stm32_adc_dual_regular(s)) {
+                stm32_adc_skip_samples(s->slave, (uint64_t)(skip - 1) * len);
+            }
+        }
+    }
+
+    while(s->converting && (s->next_conv_time <= now)) {
+        s->ADC_DR = stm32_adc_sample(s,
+                        stm32_ADC_get_channel_number(s, s->seq_index + 1),
+                        s->next_conv_time);
+        if(stm32_adc_dual_regular(s)) {
+            stm32_adc_slave_conv(s, s->seq_index, s->next_conv_time);
+        }
+        s->ADC_SR |= ADC_SR_EOC;  // jmf : indicates end of conversion
+        stm32_ADC_update_irq(s);
+
+        if(s->seq_index + 1 < len) {
+            s->seq_index++;
+        } else if(s->ADC_CR2 & ADC_CR2_CONT) {
+            s->seq_index = 0;
+        } else {
+            s->converting = false;
+            break;
+        }
+        s->next_conv_time += stm32_adc_conv_time(s, s->seq_index);
+    }
+
+    s->catching_up = false;
+}
 
 static void stm32_adc_start_conv(Stm32Adc *s)
 {
     uint64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-    int channel_number=stm32_ADC_get_channel_number(s,1);
-    // Write result of conversion
-      if(channel_number==16){
-      s->Vdda=rand()%(1200+1) + 2400; //Vdda belongs to the interval [2400 3600] mv
-      s->Vref=rand()%(s->Vdda-2400+1) + 2400; //Vref belongs to the interval [2400 Vdda] mv
-      s->ADC_DR= s->Vdda - s->Vref; 
-      }
-      else if(channel_number==17){
-      s->ADC_DR= (s->Vref=rand()%(s->Vdda-2400+1) + 2400); //Vref [2400 Vdda] mv
-      }
-      else{
-      s->ADC_DR=((int)(1024.*(sin(2*M_PI*qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)/1e9)+1.))&0xfff);
-      }
-      s->ADC_SR&=~ADC_SR_EOC;  // jmf : indicates ongoing conversion
-      // calls conv_complete when expires      
-      timer_mod(s->conv_timer,  curr_time + stm32_ADC_get_nbr_cycle_per_sample(s,channel_number)); 
+
+    stm32_ADC_ns_per_sample_sync(s);
+
+    s->ADC_SR&=~ADC_SR_EOC;  // jmf : indicates ongoing conversion
+    s->converting = true;
+    s->seq_index = 0;
+    s->next_conv_time = curr_time + stm32_adc_conv_time(s, 0);
+
+    stm32_adc_schedule(s);
 }
 
 
 /* TIMER HANDLERS */
-/* When the convert delay is complete, mark the conversion as complete */
+/* When the convert delay is complete, deliver the conversions which are due */
 static void stm32_adc_conv_timer_expire(void *opaque) {
     Stm32Adc *s = (Stm32Adc *)opaque;
-    stm32_adc_conv_complete(s);
+
+    stm32_adc_catch_up(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    stm32_adc_schedule(s);
+}
+
+/* Bring the conversion sequence up to date before the software looks at it. */
+static void stm32_adc_sync(Stm32Adc *s)
+{
+    s = stm32_adc_seq_owner(s);
+    if(s->converting && !s->catching_up) {
+        stm32_adc_catch_up(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        stm32_adc_schedule(s);
+    }
+}
+
+/* Start the regular sequence, as a software start or an external trigger
+ * does. */
+static void stm32_adc_start_seq(Stm32Adc *s)
+{
+    int i;
+
+    /* In dual mode, ADC2 is started by ADC1 only */
+    if(stm32_adc_seq_owner(s) != s) {
+        return;
+    }
+
+    for(i = 1; i <= stm32_adc_seq_length(s); i++)
+      stm32_ADC_GPIO_check(s,stm32_ADC_get_channel_number(s,i)); // check GPIO (Mode and config)  ANALOG INTPUT?
+    if(stm32_adc_dual_regular(s)) {
+        for(i = 1; i <= stm32_adc_seq_length(s->slave); i++)
+          stm32_ADC_GPIO_check(s->slave,
+                               stm32_ADC_get_channel_number(s->slave, i));
+        s->slave->ADC_SR &= ~ADC_SR_EOC;
+        stm32_ADC_update_irq(s->slave);
+    }
+    stm32_adc_start_conv(s);
+}
+
+void stm32_adc_set_input(Stm32Adc *s, unsigned channel, uint16_t value,
+                         int64_t time)
+{
+    Stm32Adc *owner = stm32_adc_seq_owner(s);
+
+    assert(channel < STM32_ADC_INPUTS);
+
+    /* The timer may run late: only the conversions up to the given time
+     * see the previous value. */
+    stm32_adc_catch_up(owner, time);
+    s->input_mask |= BIT(channel);
+    s->input_value[channel] = value & 0xfff;
+    stm32_adc_schedule(owner);
+}
+
+/* A rising edge on one of the external trigger inputs, such as the TRGO
+ * of TIM3.  The conversions are paced by the trigger source without the
+ * software doing anything per sample. */
+static void stm32_adc_ext_trigger(void *opaque, int n, int level)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+
+    if(!level || !(s->ADC_CR2 & ADC_CR2_EXTTRIG) ||
+       !(s->ADC_CR2 & ADC_CR2_ADON) ||
+       extract32(s->ADC_CR2, ADC_CR2_EXTSEL_SHIFT, 3) != n) {
+        return;
+    }
+
+    /* A trigger during a conversion is ignored */
+    stm32_adc_sync(s);
+    if(!s->converting) {
+        stm32_adc_start_seq(s);
+    }
+}
+
+
+
+
+/* CHAR DEVICE HANDLERS */
+
+static int stm32_adc_can_receive(void *opaque)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+
+    return STM32_ADC_CHR_FIFO_SIZE - s->chr_fifo_count;
+}
+
+static void stm32_adc_receive(void *opaque, const uint8_t *buf, int size)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+    int i;
+
+    assert(size <= STM32_ADC_CHR_FIFO_SIZE - s->chr_fifo_count);
+
+    for(i = 0; i < size; i++) {
+        s->chr_fifo[(s->chr_fifo_head + s->chr_fifo_count) %
+                    STM32_ADC_CHR_FIFO_SIZE] = buf[i];
+        s->chr_fifo_count++;
+    }
+}
+
+static void stm32_adc_event(void *opaque, int event)
+{
+    /* Do nothing */
 }
 
 /* Checks the ADC GPIO PIN Mode and Config */
 static void stm32_ADC_GPIO_check(Stm32Adc *s,int channel)
 {
  int ADC_periph,ADC_pin,config;
- if(channel<16){  
+ if(channel<16 && !(s->gpio_checked & (1 << channel))){  
         if(channel<=15 && channel>=10){
         ADC_periph=STM32_GPIOC;
         ADC_pin=channel-10; //PC(0-5) IN10-IN15
         }
+        else if(s->periph == STM32_ADC3 && channel>=4){
+        ADC_periph=STM32_GPIOF;
+        ADC_pin=channel+2; //PF(6-10) ADC3_IN4-IN8
+        }
         else if(channel==9 || channel==8){
         ADC_periph=STM32_GPIOB;
         ADC_pin=channel-8; //PB(0-1) IN8-IN9
@@ -754,10 +1163,20 @@ static void stm32_ADC_GPIO_check(Stm32Adc *s,int channel)
     if(config != STM32_GPIO_IN_ANALOG)
         hw_error("GPIO%c pin:%d needs to be configured as Analog input",'A'+ADC_periph-1,ADC_pin);
 
+    s->gpio_checked |= 1 << channel;
+
              }
 
 }
 
+static void stm32_adc_gpio_changed(Notifier *notifier, void *data)
+{
+    Stm32AdcGpioNotifier *n = container_of(notifier, Stm32AdcGpioNotifier,
+                                           notifier);
+
+    n->adc->gpio_checked = 0;
+}
+
 static int stm32_ADC_get_channel_number(Stm32Adc* s,int convert_number)
 {
    assert(convert_number>=1 && convert_number<=16);
@@ -811,24 +1230,32 @@ static void stm32_ADC_SR_write(Stm32Adc *s, uint32_t new_value)
 
 static void stm32_ADC_SQR1_write(Stm32Adc *s,uint32_t new_value)
 {  
-    /* check if number of conversion (ADC_SQR1[24 20]) greater than 1 */  
-     if((new_value >> 20 & 0x0000000f) > 1) 
-     hw_error("Mode Single conversion is only implemented\n");
-
      s->ADC_SQR1=new_value & 0x00ffffff;
 }
 
 static void stm32_ADC_CR2_write(Stm32Adc *s,uint32_t new_value)
 {      
+    stm32_adc_sync(s);
+
     s->ADC_CR2=new_value & 0x00fef90f; 
+    stm32_ADC_update_irq(s); // DMA bit may have changed
+
+    if(!(s->ADC_CR2 & ADC_CR2_ADON))
+    {
+      /* Powering down the ADC stops the conversion sequence. */
+      s->converting = false;
+    }
  
     if (s->ADC_CR2&ADC_CR2_SWSTART )  
     {
       if(!(s->ADC_CR2 & ADC_CR2_ADON))   //CR2_ADON should be set (for Enable ADC) before start conversion
          hw_error("Attempted to start conversion while ADC was disabled\n");
 
-      stm32_ADC_GPIO_check(s,stm32_ADC_get_channel_number(s,1)); // check GPIO (Mode and config)  ANALOG INTPUT?  
-      stm32_adc_start_conv(s); // jmf : software conv
+      stm32_adc_start_seq(s); // jmf : software conv
+    }
+    else
+    {
+      stm32_adc_schedule(s);
     }
    
 }
@@ -839,6 +1266,8 @@ static uint32_t stm32_ADC_DR_read(Stm32Adc *s)
    /* check ADC Enable */  
    if(!(s->ADC_CR2 & ADC_CR2_ADON))
      hw_error("Attempted to read from ADC_DR while ADC was disabled\n");
+
+   stm32_adc_sync(s);
   
    /* check conversion complete*/
    if(s->ADC_SR & ADC_SR_EOC)
@@ -847,6 +1276,12 @@ static uint32_t stm32_ADC_DR_read(Stm32Adc *s)
        stm32_ADC_update_irq(s); // (SR_EOC=0) requiere interrupt update
        return s->ADC_DR;
      }
+   else if(s->ADC_CR2 & ADC_CR2_CONT)
+     {
+       /* In continuous mode the data register always holds the
+          latest conversion */
+       return s->ADC_DR;
+     }
    else
      {
        hw_error("Attempted to read ADC_DR while conversion is not complete\n");
@@ -859,6 +1294,7 @@ static uint32_t stm32_ADC_DR_read(Stm32Adc *s)
 static void stm32_adc_reset(DeviceState *dev)
 {
     Stm32Adc *s = STM32_ADC(dev);
+    s->gpio_checked = 0;
     s->ADC_SR=0x00000000;
     s->ADC_CR1=0x00000000;
     s->ADC_CR2=0x00000000;
@@ -880,6 +1316,17 @@ static void stm32_adc_reset(DeviceState *dev)
     s->ADC_JDR4=0x00000000;
     s->ADC_DR=0x00000000;
 
+    s->converting = false;
+    s->seq_index = 0;
+    timer_del(s->conv_timer);
+
+    /* Start over from the first sample of the source file, and pick new
+     * supply voltages, so that a reset gives the same conversion results
+     * as a fresh start (for the same rand() seed). */
+    s->file_sample_pos = 0;
+    s->Vdda=rand()%(1200+1) +2400; //Vdda belongs to the interval [2400 3600] mv
+    s->Vref=rand()%(s->Vdda-2400+1) +2400; //Vref belongs to the interval [2400 Vdda] mv
+
     stm32_ADC_update_irq(s);
 }
 
@@ -891,7 +1338,8 @@ static uint64_t stm32_adc_read(void *opaque, hwaddr offset,
     int length = size * 8;
 
     switch (offset & 0xfffffffc) {
-        case oADC_SR : 	return (extract64(s->ADC_SR,  start, length));
+        case oADC_SR : 	stm32_adc_sync(s);
+                        return (extract64(s->ADC_SR,  start, length));
         case oADC_CR1: 	return extract64(s->ADC_CR1,  start, length);
         case oADC_CR2: 	return (extract64(s->ADC_CR2, start, length)&~ADC_CR2_RSTCAL&~ADC_CR2_CAL); // jmf : calibration complete
         case oADC_SMPR1:return extract64(s->ADC_SMPR1,start, length);
@@ -927,7 +1375,7 @@ static void stm32_adc_write(void *opaque, hwaddr offset,
 
     switch (offset & 0xfffffffc) {
         case oADC_SR : stm32_ADC_SR_write(s,value);break;
-        case oADC_CR1: (s->ADC_CR1=value & 0x00cfffff); stm32_ADC_update_irq(s); break; //write CR1 requiere update interrupts 
+        case oADC_CR1: stm32_adc_sync(s); (s->ADC_CR1=value & 0x00cfffff); stm32_ADC_update_irq(s); stm32_adc_schedule(s); break; //write CR1 requiere update interrupts 
         case oADC_CR2: stm32_ADC_CR2_write(s,value);break;
         case oADC_SMPR1:(s->ADC_SMPR1=value & 0x00ffffff);break;
         case oADC_SMPR2:(s->ADC_SMPR2=value & 0x3fffffff);break;
@@ -951,21 +1399,37 @@ void stm32_ADC_update_ns_per_sample(Stm32Adc *s)
 {
   uint32_t clk_freq = stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph);
   int i;
+  s->clk_generation = stm32_rcc_get_periph_generation(s->stm32_rcc, s->periph);
   //convert cycles to ns
   if(clk_freq){  
+  s->ns_per_conversion=(1000000000LL*12.5)/clk_freq;
   s->ns_per_sample[0]=(1000000000LL*1.5)/clk_freq;s->ns_per_sample[1]=(1000000000LL*7.5)/clk_freq;
   s->ns_per_sample[2]=(1000000000LL*13.5)/clk_freq;s->ns_per_sample[3]=(1000000000LL*28.5)/clk_freq;
   s->ns_per_sample[4]=(1000000000LL*41.5)/clk_freq;s->ns_per_sample[5]=(1000000000LL*55.5)/clk_freq;
   s->ns_per_sample[6]=(1000000000LL*71.5)/clk_freq;s->ns_per_sample[7]=(1000000000LL*239.5)/clk_freq;
   }
   else{
+  s->ns_per_conversion=0;
   for(i=0;i<8;i++)
   s->ns_per_sample[i]=0;
   }
 }
+/* Apart from guest accesses, SR only changes when a conversion ends */
+static int64_t stm32_adc_poll_deadline(void *opaque, hwaddr offset,
+                                       unsigned size)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+
+    if((offset & 0xfffffffc) != oADC_SR) {
+        return -1;
+    }
+    return s->converting ? s->next_conv_time : INT64_MAX;
+}
+
 static const MemoryRegionOps stm32_adc_ops = {
     .read = stm32_adc_read,
     .write = stm32_adc_write,
+    .poll_deadline = stm32_adc_poll_deadline,
     .valid.min_access_size = 2,
     .valid.max_access_size = 4,
     .endianness = DEVICE_NATIVE_ENDIAN
@@ -973,34 +1437,216 @@ static const MemoryRegionOps stm32_adc_ops = {
 
 
 
+/* PUBLIC FUNCTIONS */
+
+/* Use samples from a character device for channels 0 to 15.  Each sample is
+ * sent as a 16 bit little-endian value (only the low 12 bits are used). */
+void stm32_adc_connect(Stm32Adc *s, CharDriverState *chr,
+                        uint32_t afio_board_map)
+{
+    s->chr = chr;
+    if (chr) {
+        stm32_replay_chr_add_handlers(
+                s->chr,
+                stm32_periph_name(s->periph),
+                stm32_adc_can_receive,
+                stm32_adc_receive,
+                stm32_adc_event,
+                (void *)s);
+        s->source = STM32_ADC_SOURCE_CHARDEV;
+    }
+
+    s->afio_board_map = afio_board_map;
+}
+
+
+
+
 /* DEVICE INITIALIZATION */
 
+/* Load the samples to play back from a file. */
+static void stm32_adc_load_file(Stm32Adc *s, const char *filename)
+{
+    gchar *contents, *p, *end;
+    size_t capacity = 256;
+
+    if(!g_file_get_contents(filename, &contents, NULL, NULL)) {
+        hw_error("Could not read ADC samples from %s", filename);
+    }
+
+    s->file_samples = g_new(uint16_t, capacity);
+    s->file_sample_count = 0;
+    for(p = contents; ; p = end) {
+        unsigned long value = strtoul(p, &end, 0);
+        if(end == p) {
+            break;
+        }
+        if(s->file_sample_count == capacity) {
+            capacity *= 2;
+            s->file_samples = g_renew(uint16_t, s->file_samples, capacity);
+        }
+        s->file_samples[s->file_sample_count++] = value & 0xfff;
+    }
+    g_free(contents);
+
+    if(s->file_sample_count == 0) {
+        hw_error("No ADC samples found in %s", filename);
+    }
+    s->file_sample_pos = 0;
+    s->source = STM32_ADC_SOURCE_FILE;
+}
+
+
 static int stm32_adc_init(SysBusDevice *dev)
 {
-    qemu_irq *clk_irq;
     Stm32Adc *s = STM32_ADC(dev);
+    int i;
+
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
     s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
-    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_adc_ops, s, "adc", 0x03ff);  
-        // jmf : 3FF = length, cf RM0008 p.52
+    s->stim = (Stm32StimSlot *)s->stim_prop;
+    if(s->stim) {
+        s->stim_replay = stm32_replay_channel_new(
+                stm32_periph_name(s->periph), NULL, NULL);
+    }
+    s->slave = (Stm32Adc *)s->stm32_adc_slave_prop;
+    if(s->slave) {
+        s->slave->master = s;
+    }
+    for(i = 0; i < STM32_ADC_GPIO_PORTS; i++) {
+        s->gpio_notifier[i].notifier.notify = stm32_adc_gpio_changed;
+        s->gpio_notifier[i].adc = s;
+        stm32_gpio_add_config_notifier(s->stm32_gpio[i],
+                                       &s->gpio_notifier[i].notifier);
+    }
+    if(s->periph == STM32_ADC3) {
+        s->gpio_notifier[i].notifier.notify = stm32_adc_gpio_changed;
+        s->gpio_notifier[i].adc = s;
+        stm32_gpio_add_config_notifier(
+            s->stm32_gpio[STM32_GPIO_INDEX_FROM_PERIPH(STM32_GPIOF)],
+            &s->gpio_notifier[i].notifier);
+    }
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_adc_ops, s, "adc", STM32_PERIPH_SIZE);  
+        // jmf : 0x400 = length, cf RM0008 p.52
     sysbus_init_mmio(dev, &s->iomem);
     sysbus_init_irq(dev, &s->irq);
-    s->conv_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, (QEMUTimerCB *)stm32_adc_conv_timer_expire, s);
+    sysbus_init_irq(dev, &s->dma_irq);
+    qdev_init_gpio_in_named(DEVICE(dev), stm32_adc_ext_trigger, "ext-trigger",
+                            STM32_ADC_EXT_TRIGGER_LINES);
+    s->conv_timer = stm32_timer_new_ns(s->aio_context, (QEMUTimerCB *)stm32_adc_conv_timer_expire, s);
+
+    stm32_adc_init_sine_table();
+    s->source = STM32_ADC_SOURCE_SINE;
+    if(s->source_file) {
+        stm32_adc_load_file(s, s->source_file);
+    }
+    if(s->chr) {
+        stm32_adc_connect(s, s->chr, s->afio_board_map);
+    }
 
-    /* Register handlers to handle updates to the ADC's peripheral clock. */
-    clk_irq = qemu_allocate_irqs(stm32_adc_clk_irq_handler, (void *)s, 1);   // jmf : segfault
-    
-    stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
     stm32_adc_reset((DeviceState *)s);
-    s->Vdda=rand()%(1200+1) +2400; //Vdda belongs to the interval [2400 3600] mv
-    s->Vref=rand()%(s->Vdda-2400+1) +2400; //Vref belongs to the interval [2400 Vdda] mv
     return 0;
 }
 
+static int stm32_adc_post_load(void *opaque, int version_id)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+
+    /* The sample source and the samples loaded from a file are part of the
+     * configuration, only the position in them is saved. */
+    if(s->source == STM32_ADC_SOURCE_FILE &&
+            s->file_sample_pos >= s->file_sample_count) {
+        return -EINVAL;
+    }
+    if(s->chr_fifo_head >= STM32_ADC_CHR_FIFO_SIZE ||
+            s->chr_fifo_count > STM32_ADC_CHR_FIFO_SIZE) {
+        return -EINVAL;
+    }
+    stm32_ADC_update_ns_per_sample(s);
+    s->gpio_checked = 0;
+    memory_region_flush_read_cache(&s->iomem);
+    return 0;
+}
+
+static bool stm32_adc_inputs_needed(void *opaque)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+
+    return s->input_mask != 0;
+}
+
+static const VMStateDescription vmstate_stm32_adc_inputs = {
+    .name = "stm32-adc/inputs",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(input_mask, Stm32Adc),
+        VMSTATE_UINT16_ARRAY(input_value, Stm32Adc, STM32_ADC_INPUTS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_stm32_adc = {
+    .name = "stm32-adc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_adc_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ADC_SR, Stm32Adc),
+        VMSTATE_UINT32(ADC_CR1, Stm32Adc),
+        VMSTATE_UINT32(ADC_CR2, Stm32Adc),
+        VMSTATE_UINT32(ADC_SMPR1, Stm32Adc),
+        VMSTATE_UINT32(ADC_SMPR2, Stm32Adc),
+        VMSTATE_UINT32(ADC_JOFR1, Stm32Adc),
+        VMSTATE_UINT32(ADC_JOFR2, Stm32Adc),
+        VMSTATE_UINT32(ADC_JOFR3, Stm32Adc),
+        VMSTATE_UINT32(ADC_JOFR4, Stm32Adc),
+        VMSTATE_UINT32(ADC_HTR, Stm32Adc),
+        VMSTATE_UINT32(ADC_LTR, Stm32Adc),
+        VMSTATE_UINT32(ADC_SQR1, Stm32Adc),
+        VMSTATE_UINT32(ADC_SQR2, Stm32Adc),
+        VMSTATE_UINT32(ADC_SQR3, Stm32Adc),
+        VMSTATE_UINT32(ADC_JSQR, Stm32Adc),
+        VMSTATE_UINT32(ADC_JDR1, Stm32Adc),
+        VMSTATE_UINT32(ADC_JDR2, Stm32Adc),
+        VMSTATE_UINT32(ADC_JDR3, Stm32Adc),
+        VMSTATE_UINT32(ADC_JDR4, Stm32Adc),
+        VMSTATE_UINT32(ADC_DR, Stm32Adc),
+        VMSTATE_BOOL(sr_read_since_ore_set, Stm32Adc),
+        VMSTATE_BOOL(converting, Stm32Adc),
+        VMSTATE_INT32(seq_index, Stm32Adc),
+        VMSTATE_INT64(next_conv_time, Stm32Adc),
+        VMSTATE_TIMER(conv_timer, Stm32Adc),
+        VMSTATE_UINT32(file_sample_pos, Stm32Adc),
+        VMSTATE_UINT8_ARRAY(chr_fifo, Stm32Adc, STM32_ADC_CHR_FIFO_SIZE),
+        VMSTATE_INT32(chr_fifo_head, Stm32Adc),
+        VMSTATE_INT32(chr_fifo_count, Stm32Adc),
+        VMSTATE_UINT16(chr_last_sample, Stm32Adc),
+        VMSTATE_INT32(curr_irq_level, Stm32Adc),
+        VMSTATE_INT32(curr_dma_level, Stm32Adc),
+        VMSTATE_INT32(Vref, Stm32Adc),
+        VMSTATE_INT32(Vdda, Stm32Adc),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_stm32_adc_inputs,
+            .needed = stm32_adc_inputs_needed,
+        }, {
+            /* empty */
+        }
+    }
+};
+
 static Property stm32_adc_properties[] = {
     DEFINE_PROP_PERIPH_T("periph", Stm32Adc, periph, STM32_PERIPH_UNDEFINED),
     DEFINE_PROP_PTR("stm32_rcc", Stm32Adc, stm32_rcc_prop),
     DEFINE_PROP_PTR("stm32_gpio", Stm32Adc, stm32_gpio_prop),
+    DEFINE_PROP_STRING("file", Stm32Adc, source_file),
+    DEFINE_PROP_CHR("chardev", Stm32Adc, chr),
+    DEFINE_PROP_PTR("stim", Stm32Adc, stim_prop),
+    DEFINE_PROP_PTR("aio_context", Stm32Adc, aio_context),
+    DEFINE_PROP_PTR("stm32_adc_slave", Stm32Adc, stm32_adc_slave_prop),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -1011,6 +1657,7 @@ static void stm32_adc_class_init(ObjectClass *klass, void *data)
 
     k->init = stm32_adc_init;
     dc->reset = stm32_adc_reset;
+    dc->vmsd = &vmstate_stm32_adc;
     dc->props = stm32_adc_properties;
 }
 
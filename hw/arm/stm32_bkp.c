@@ -0,0 +1,377 @@
+/*
+ * STM32 Microcontroller BKP (Backup registers) module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "qemu/bitops.h"
+#include "qemu-common.h"
+#include "qemu/log.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/* The data registers are part of the backup domain, so a system reset
+ * leaves them alone.  They are only cleared by a backup domain reset
+ * (RCC_BDCR.BDRST, connected to the "bdrst" GPIO).  When the "file"
+ * property is set, the data registers are kept in that file (mapped
+ * shared), so they also survive restarting QEMU, as they would on a
+ * board with a backup battery.
+ *
+ * Writes are only allowed while PWR_CR.DBP is set (the "dbp" GPIO).
+ *
+ * The tamper pin is not modelled, so TEF and TIF are never set.
+ */
+
+/* DEFINITIONS */
+
+#define BKP_DR1_OFFSET 0x04
+#define BKP_DR10_OFFSET 0x28
+#define BKP_DR11_OFFSET 0x40
+#define BKP_DR42_OFFSET 0xbc
+#define BKP_DR_LOW_COUNT 10
+#define BKP_DR_COUNT 42
+
+#define BKP_RTCCR_OFFSET 0x2c
+#define BKP_RTCCR_MASK 0x000003ff
+
+#define BKP_CR_OFFSET 0x30
+#define BKP_CR_TPE_BIT 0
+#define BKP_CR_TPAL_BIT 1
+#define BKP_CR_MASK 0x00000003
+
+#define BKP_CSR_OFFSET 0x34
+#define BKP_CSR_CTE_BIT 0
+#define BKP_CSR_CTI_BIT 1
+#define BKP_CSR_TPIE_BIT 2
+#define BKP_CSR_TEF_BIT 8
+#define BKP_CSR_TIF_BIT 9
+
+#define BKP_DR_FILE_SIZE (BKP_DR_COUNT * sizeof(uint16_t))
+
+struct Stm32Bkp {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    void *stm32_rcc_prop;
+    char *file;
+    bool direct_read;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32Rcc *stm32_rcc;
+
+    /* BKP_DR1 .. BKP_DR42, stored little endian.  Either heap memory or a
+     * shared mapping of the backing file. */
+    uint8_t *dr;
+
+    uint32_t
+        BKP_RTCCR,
+        BKP_CR,
+        BKP_CSR;
+
+    /* Inputs from PWR_CR.DBP and RCC_BDCR.BDRST */
+    bool dbp;
+    bool bdrst;
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+/* Returns the index (0 for BKP_DR1) of the data register at offset, or -1
+ * if offset is not a data register. */
+static int stm32_bkp_dr_index(hwaddr offset)
+{
+    if(offset & 3) {
+        return -1;
+    } else if(offset >= BKP_DR1_OFFSET && offset <= BKP_DR10_OFFSET) {
+        return (offset - BKP_DR1_OFFSET) / 4;
+    } else if(offset >= BKP_DR11_OFFSET && offset <= BKP_DR42_OFFSET) {
+        return BKP_DR_LOW_COUNT + (offset - BKP_DR11_OFFSET) / 4;
+    } else {
+        return -1;
+    }
+}
+
+static hwaddr stm32_bkp_dr_offset(int index)
+{
+    if(index < BKP_DR_LOW_COUNT) {
+        return BKP_DR1_OFFSET + index * 4;
+    } else {
+        return BKP_DR11_OFFSET + (index - BKP_DR_LOW_COUNT) * 4;
+    }
+}
+
+static uint16_t stm32_bkp_dr_get(Stm32Bkp *s, int index)
+{
+    return lduw_le_p(s->dr + index * sizeof(uint16_t));
+}
+
+static void stm32_bkp_dr_set(Stm32Bkp *s, int index, uint16_t value)
+{
+    stw_le_p(s->dr + index * sizeof(uint16_t), value);
+    stm32_reg_page_set(&s->iomem, stm32_bkp_dr_offset(index), value);
+}
+
+/* Store the register values in the register page which the guest reads,
+ * see stm32_init_reg_page. */
+static void stm32_bkp_update_reg_page(Stm32Bkp *s)
+{
+    int i;
+
+    for(i = 0; i < BKP_DR_COUNT; i++) {
+        stm32_reg_page_set(&s->iomem, stm32_bkp_dr_offset(i),
+                           stm32_bkp_dr_get(s, i));
+    }
+    stm32_reg_page_set(&s->iomem, BKP_RTCCR_OFFSET, s->BKP_RTCCR);
+    stm32_reg_page_set(&s->iomem, BKP_CR_OFFSET, s->BKP_CR);
+    stm32_reg_page_set(&s->iomem, BKP_CSR_OFFSET, s->BKP_CSR);
+}
+
+/* Backup domain reset */
+static void stm32_bkp_domain_reset(Stm32Bkp *s)
+{
+    memset(s->dr, 0, BKP_DR_FILE_SIZE);
+    s->BKP_RTCCR = 0;
+    s->BKP_CR = 0;
+    s->BKP_CSR = 0;
+    stm32_bkp_update_reg_page(s);
+}
+
+static void stm32_bkp_open_file(Stm32Bkp *s)
+{
+#ifdef _WIN32
+    hw_error("stm32-bkp: the file property is not supported on this host");
+#else
+    int fd;
+
+    fd = qemu_open(s->file, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+        hw_error("Could not open backup register file %s", s->file);
+    }
+    /* A new file is extended with zeros, which is also the state of the
+     * backup domain after power is first applied. */
+    if(ftruncate(fd, BKP_DR_FILE_SIZE) < 0) {
+        hw_error("Could not resize backup register file %s", s->file);
+    }
+    s->dr = mmap(NULL, BKP_DR_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+    if(s->dr == MAP_FAILED) {
+        hw_error("Could not map backup register file %s", s->file);
+    }
+    qemu_close(fd);
+#endif
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint64_t stm32_bkp_read(void *opaque, hwaddr offset,
+                          unsigned size)
+{
+    Stm32Bkp *s = (Stm32Bkp *)opaque;
+    int index;
+
+    stm32_rcc_check_periph_clk(s->stm32_rcc, STM32_BKP);
+
+    index = stm32_bkp_dr_index(offset);
+    if(index >= 0) {
+        return stm32_bkp_dr_get(s, index);
+    }
+
+    switch (offset) {
+        case BKP_RTCCR_OFFSET:
+            return s->BKP_RTCCR;
+        case BKP_CR_OFFSET:
+            return s->BKP_CR;
+        case BKP_CSR_OFFSET:
+            return s->BKP_CSR;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_bkp_write(void *opaque, hwaddr offset,
+                       uint64_t value, unsigned size)
+{
+    Stm32Bkp *s = (Stm32Bkp *)opaque;
+    int index;
+
+    stm32_rcc_check_periph_clk(s->stm32_rcc, STM32_BKP);
+
+    if(!s->dbp || s->bdrst) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "stm32_bkp: write to 0x%x ignored, backup domain is "
+                      "write protected (PWR_CR.DBP) or in reset\n",
+                      (int)offset);
+        return;
+    }
+
+    index = stm32_bkp_dr_index(offset);
+    if(index >= 0) {
+        stm32_bkp_dr_set(s, index, value);
+        return;
+    }
+
+    switch (offset) {
+        case BKP_RTCCR_OFFSET:
+            s->BKP_RTCCR = value & BKP_RTCCR_MASK;
+            break;
+        case BKP_CR_OFFSET:
+            s->BKP_CR = value & BKP_CR_MASK;
+            break;
+        case BKP_CSR_OFFSET:
+            /* CTE and CTI clear TEF and TIF, which are never set */
+            s->BKP_CSR = value & BIT(BKP_CSR_TPIE_BIT);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            return;
+    }
+    stm32_bkp_update_reg_page(s);
+}
+
+static const MemoryRegionOps stm32_bkp_ops = {
+    .read = stm32_bkp_read,
+    .write = stm32_bkp_write,
+    .valid.min_access_size = 2,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_bkp_dbp_irq_handler(void *opaque, int n, int level)
+{
+    Stm32Bkp *s = (Stm32Bkp *)opaque;
+
+    s->dbp = level;
+}
+
+static void stm32_bkp_bdrst_irq_handler(void *opaque, int n, int level)
+{
+    Stm32Bkp *s = (Stm32Bkp *)opaque;
+
+    s->bdrst = level;
+    if(level) {
+        stm32_bkp_domain_reset(s);
+    }
+}
+
+static void stm32_bkp_reset(DeviceState *dev)
+{
+    Stm32Bkp *s = STM32_Bkp(dev);
+
+    /* A system reset does not affect the backup domain.  The register page
+     * still needs filling in after the first reset, since it is created
+     * empty. */
+    memory_region_flush_read_cache(&s->iomem);
+    stm32_bkp_update_reg_page(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_bkp_init(SysBusDevice *dev)
+{
+    Stm32Bkp *s = STM32_Bkp(dev);
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+
+    if(s->file) {
+        stm32_bkp_open_file(s);
+    } else {
+        s->dr = g_malloc0(BKP_DR_FILE_SIZE);
+    }
+
+    stm32_init_reg_page(&s->iomem, OBJECT(s), &stm32_bkp_ops, s,
+                        "bkp", s->direct_read);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    qdev_init_gpio_in_named(DEVICE(dev), stm32_bkp_dbp_irq_handler, "dbp", 1);
+    qdev_init_gpio_in_named(DEVICE(dev), stm32_bkp_bdrst_irq_handler,
+                            "bdrst", 1);
+
+    return 0;
+}
+
+static int stm32_bkp_post_load(void *opaque, int version_id)
+{
+    Stm32Bkp *s = (Stm32Bkp *)opaque;
+
+    memory_region_flush_read_cache(&s->iomem);
+    stm32_bkp_update_reg_page(s);
+    return 0;
+}
+
+/* The data registers are loaded into the backing file too, when there is
+ * one, just as if the guest had written them. */
+static const VMStateDescription vmstate_stm32_bkp = {
+    .name = TYPE_STM32_BKP,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_bkp_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BUFFER_POINTER_UNSAFE(dr, Stm32Bkp, 0, BKP_DR_FILE_SIZE),
+        VMSTATE_UINT32(BKP_RTCCR, Stm32Bkp),
+        VMSTATE_UINT32(BKP_CR, Stm32Bkp),
+        VMSTATE_UINT32(BKP_CSR, Stm32Bkp),
+        VMSTATE_BOOL(dbp, Stm32Bkp),
+        VMSTATE_BOOL(bdrst, Stm32Bkp),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_bkp_properties[] = {
+    DEFINE_PROP_PTR("stm32_rcc", Stm32Bkp, stm32_rcc_prop),
+    DEFINE_PROP_STRING("file", Stm32Bkp, file),
+    DEFINE_PROP_BOOL("direct_read", Stm32Bkp, direct_read, true),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_bkp_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_bkp_init;
+    dc->reset = stm32_bkp_reset;
+    dc->vmsd = &vmstate_stm32_bkp;
+    dc->props = stm32_bkp_properties;
+}
+
+static TypeInfo stm32_bkp_info = {
+    .name  = TYPE_STM32_BKP,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Bkp),
+    .class_init = stm32_bkp_class_init
+};
+
+static void stm32_bkp_register_types(void)
+{
+    type_register_static(&stm32_bkp_info);
+}
+
+type_init(stm32_bkp_register_types)
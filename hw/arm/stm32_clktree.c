@@ -21,6 +21,9 @@
 
 #include "hw/hw.h"
 #include "hw/arm/stm32_clktree.h"
+#include "qom/object.h"
+#include "qapi/visitor.h"
+#include "qmp-commands.h"
 
 
 /* DEFINITIONS*/
@@ -29,15 +32,19 @@
 //#define DEBUG_CLKTREE
 
 
-/* Helper to:
- *  1) Add a value to an array.
- *  2) Increment the array size count.
- *  3) Make sure the array does not overflow.
- */
-#define CLKTREE_ADD_LINK(array, count, value, array_size) \
-            (array)[(count)++] = (value); \
-            assert((count) <= (array_size));
+/* Clocks and their links are never freed, so they are carved out of large
+ * chunks instead of being allocated one by one. */
+#define CLKTREE_ARENA_CHUNK_SIZE 4096
 
+/* Outputs and users are added one at a time while the tree is built, so they
+ * are kept in singly linked lists (in the order they were added). */
+typedef struct ClkLink {
+    union {
+        struct Clk *clk;
+        qemu_irq irq;
+    } to;
+    struct ClkLink *next;
+} ClkLink;
 
 struct Clk {
     const char *name;
@@ -46,26 +53,110 @@ struct Clk {
 
     uint32_t input_freq, output_freq, max_output_freq;
 
+    /* Incremented every time output_freq changes.  Never 0, so that users
+     * can use 0 to mean "not yet read". */
+    uint32_t generation;
+
     uint16_t multiplier, divisor;
 
-    unsigned user_count;
-    qemu_irq user[CLKTREE_MAX_IRQ]; /* Who to notify on change */
+    ClkLink *users, **users_tail; /* Who to notify on change */
 
-    unsigned output_count;
-    struct Clk *output[CLKTREE_MAX_OUTPUT];
+    ClkLink *outputs, **outputs_tail;
 
+    /* The inputs are all known when the clock is created.  input[0] is
+     * always NULL so that input[selected_input + 1] is the selected input
+     * (or NULL for CLKTREE_NO_INPUT). */
     unsigned input_count;
     int selected_input;
-    struct Clk *input[CLKTREE_MAX_INPUT];
+    struct Clk **input;
+
+    /* Position in clktree_order */
+    unsigned index;
+
+    /* Update bookkeeping.  dirty means the output frequency needs to be
+     * recalculated during the next propagation pass, changed means the
+     * output frequency changed and the users still need to be notified.
+     */
+    bool dirty, changed;
+
+    /* Consistent view of the clock, taken whenever an update which touched
+     * the clock has been fully propagated.  In the middle of an update
+     * transaction the live fields above can be half updated, so this is
+     * what is reported through QOM and QMP.
+     */
+    struct {
+        uint32_t output_freq;
+        bool enabled;
+        struct Clk *input;
+    } snapshot;
+
+    /* QOM object exposing the clock (see clktree_add_children), and its
+     * canonical path once it has been looked up. */
+    Object *obj;
+    char *path;
 };
 
-static void clktree_recalc_output_freq(Clk clk);
+/* All of the clocks, in creation order.  A clock can only be created after
+ * all of its inputs, so this is always a topological order.
+ */
+static Clk *clktree_order;
+static unsigned clktree_count, clktree_order_size;
+
+/* Remainder of the current arena chunk. */
+static uint8_t *clktree_arena_ptr;
+static size_t clktree_arena_left;
+
+/* Nesting depth of clktree_begin_update calls. */
+static unsigned clktree_update_depth;
+
+/* Index of the first clock marked dirty since the last propagation, or
+ * UINT_MAX if there is none.  Clocks before it cannot be affected, so
+ * propagation starts there. */
+static unsigned clktree_first_dirty = UINT_MAX;
+
+#define TYPE_STM32_CLK "stm32-clk"
+#define STM32_CLK(obj) OBJECT_CHECK(Stm32ClkState, (obj), TYPE_STM32_CLK)
+
+typedef struct Stm32ClkState {
+    /* Inherited */
+    Object parent_obj;
+
+    Clk clk;
+} Stm32ClkState;
 
 
 
 
 /* HELPER FUNCTIONS */
 
+/* Allocates zeroed memory from the arena. */
+static void *clktree_arena_alloc(size_t size)
+{
+    void *ptr;
+
+    size = QEMU_ALIGN_UP(size, sizeof(uint64_t));
+    if(size > clktree_arena_left) {
+        clktree_arena_left = MAX(size, CLKTREE_ARENA_CHUNK_SIZE);
+        clktree_arena_ptr = g_malloc0(clktree_arena_left);
+    }
+
+    ptr = clktree_arena_ptr;
+    clktree_arena_ptr += size;
+    clktree_arena_left -= size;
+    return ptr;
+}
+
+/* Appends a link to a list, given the list's tail pointer. */
+static ClkLink *clktree_add_link(ClkLink ***tail)
+{
+    ClkLink *link = clktree_arena_alloc(sizeof(ClkLink));
+
+    link->next = NULL;
+    **tail = link;
+    *tail = &link->next;
+    return link;
+}
+
 static Clk clktree_get_input_clk(Clk clk)
 {
     return clk->input[clk->selected_input + 1];
@@ -88,20 +179,21 @@ static void clktree_print_state(Clk clk)
 }
 #endif
 
-static void clktree_set_input_freq(Clk clk, uint32_t input_freq)
-{
-    clk->input_freq = input_freq;
-
-    clktree_recalc_output_freq(clk);
-}
-
-/* Recalculates the output frequency based on the clock's input_freq variable.
+/* Recalculates the input and output frequency of a single clock.  The input
+ * clock (if any) must already be up to date.  Returns true if the output
+ * frequency changed.
  */
-static void clktree_recalc_output_freq(Clk clk) {
-    int i;
-    Clk next_clk, next_clk_input;
+static bool clktree_recalc_output_freq(Clk clk)
+{
+    Clk input_clk;
     uint32_t new_output_freq;
 
+    /* Source clocks have no inputs and keep their fixed input frequency. */
+    if(clk->input_count > 1) {
+        input_clk = clktree_get_input_clk(clk);
+        clk->input_freq = input_clk ? input_clk->output_freq : 0;
+    }
+
     /* Get the output frequency, or 0 if the output is disabled. */
     new_output_freq = clk->enabled ?
                             muldiv64(clk->input_freq,
@@ -109,81 +201,218 @@ static void clktree_recalc_output_freq(Clk clk) {
                                      clk->divisor)
                             : 0;
 
-    /* if the frequency has changed. */
-   if(new_output_freq != clk->output_freq) {
-       clk->output_freq = new_output_freq;
+    if(new_output_freq == clk->output_freq) {
+        return false;
+    }
+
+    clk->output_freq = new_output_freq;
+    clk->generation++;
+    if(clk->generation == 0) {
+        clk->generation = 1;
+    }
 
 #ifdef DEBUG_CLKTREE
-        clktree_print_state(clk);
+    clktree_print_state(clk);
 #endif
 
-        /* Check the new frequency against the max frequency. */
-        if(new_output_freq > clk->max_output_freq) {
-            fprintf(stderr, "%s: Clock %s output frequency (%d Hz) exceeds max frequency (%d Hz).\n",
-                    __FUNCTION__,
-                    clk->name,
-                    new_output_freq,
-                    clk->max_output_freq);
-        }
+    /* Check the new frequency against the max frequency. */
+    if(new_output_freq > clk->max_output_freq) {
+        fprintf(stderr, "%s: Clock %s output frequency (%d Hz) exceeds max frequency (%d Hz).\n",
+                __FUNCTION__,
+                clk->name,
+                new_output_freq,
+                clk->max_output_freq);
+    }
+
+    return true;
+}
+
+/* Records the state reported through QOM and QMP. */
+static void clktree_take_snapshot(Clk clk)
+{
+    clk->snapshot.output_freq = clk->output_freq;
+    clk->snapshot.enabled = clk->enabled;
+    clk->snapshot.input = clktree_get_input_clk(clk);
+}
+
+/* Recalculates every dirty clock and then notifies the users of each clock
+ * whose output frequency changed.  Because the clock list is in topological
+ * order, a single pass settles the whole tree, and each user is notified at
+ * most once no matter how many of the clock's ancestors changed.
+ */
+static void clktree_propagate(void)
+{
+    Clk clk, next_clk;
+    ClkLink *link;
+    unsigned i, first = clktree_first_dirty;
+
+    clktree_first_dirty = UINT_MAX;
 
-        /* Notify users of change. */
-        for(i=0; i < clk->user_count; i++) {
-            qemu_set_irq(clk->user[i], 1);
+    for(i = first; i < clktree_count; i++) {
+        clk = clktree_order[i];
+        if(!clk->dirty) {
+            continue;
         }
+        clk->dirty = false;
 
-        /* Propagate the frequency change to the child clocks */
-        for(i=0; i < clk->output_count; i++) {
-            next_clk = clk->output[i];
-            assert(next_clk != NULL);
+        if(clktree_recalc_output_freq(clk)) {
+            clk->changed = true;
 
-            /* Only propagate the change if the child has selected the current
-             * clock as input.
+            /* Only children which have selected the current clock as input
+             * need to be recalculated.
              */
-            next_clk_input = clktree_get_input_clk(next_clk);
-            if(next_clk_input == clk) {
-                /* Recursively propagate changes.  The clock tree should not be
-                 * too deep, so we shouldn't have to recurse too many times.
-                 */
-                clktree_set_input_freq(next_clk, new_output_freq);
+            for(link = clk->outputs; link != NULL; link = link->next) {
+                next_clk = link->to.clk;
+                if(clktree_get_input_clk(next_clk) == clk) {
+                    next_clk->dirty = true;
+                }
+            }
+        }
+
+        clktree_take_snapshot(clk);
+    }
+
+    /* Notify users only once the whole tree has settled, so that a handler
+     * reading any clock frequency sees the final value.  Users of a clock
+     * which has been gated off are not notified - there is nothing for them
+     * to do until the clock is enabled again, which is itself a change.
+     */
+    for(i = first; i < clktree_count; i++) {
+        clk = clktree_order[i];
+        if(clk->changed) {
+            clk->changed = false;
+            if(!clk->enabled) {
+                continue;
+            }
+            for(link = clk->users; link != NULL; link = link->next) {
+                qemu_set_irq(link->to.irq, 1);
             }
         }
     }
 }
 
+/* Marks a clock as needing recalculation.  Outside of an update transaction
+ * the change is propagated immediately.
+ */
+static void clktree_mark_dirty(Clk clk)
+{
+    clktree_begin_update();
+    clk->dirty = true;
+    clktree_first_dirty = MIN(clktree_first_dirty, clk->index);
+    clktree_commit_update();
+}
 
-/* Generic create routine used by the public create routines. */
+
+/* Generic create routine used by the public create routines.  The input
+ * clocks are filled in by the caller. */
 static Clk clktree_create_generic(
                     const char *name,
                     uint16_t multiplier,
                     uint16_t divisor,
-                    bool enabled)
+                    bool enabled,
+                    unsigned input_count)
 {
-    Clk clk = (Clk)g_malloc(sizeof(struct Clk));
+    Clk clk = clktree_arena_alloc(sizeof(struct Clk));
 
     clk->name = name;
 
     clk->input_freq = 0;
     clk->output_freq = 0;
     clk->max_output_freq = CLKTREE_NO_MAX_FREQ;
+    clk->generation = 1;
 
     clk->multiplier = multiplier;
     clk->divisor = divisor;
 
     clk->enabled = enabled;
 
-    clk->user_count = 0;
+    clk->users = NULL;
+    clk->users_tail = &clk->users;
 
-    clk->output_count = 0;
+    clk->outputs = NULL;
+    clk->outputs_tail = &clk->outputs;
 
-    clk->input_count = 1;
+    clk->input_count = input_count + 1;
+    clk->input = clktree_arena_alloc(clk->input_count * sizeof(Clk));
     clk->input[0] = NULL;
     clk->selected_input = CLKTREE_NO_INPUT;
 
+    clk->dirty = false;
+    clk->changed = false;
+
+    clk->obj = NULL;
+    clk->path = NULL;
+    clktree_take_snapshot(clk);
+
+    /* Append to the clock order */
+    if(clktree_count == clktree_order_size) {
+        clktree_order_size = MAX(2 * clktree_order_size, 64);
+        clktree_order = g_renew(Clk, clktree_order, clktree_order_size);
+    }
+    clk->index = clktree_count;
+    clktree_order[clktree_count++] = clk;
+
     return clk;
 }
 
 
 
+/* QOM child names cannot contain '/', so "HSE/128" becomes "HSE_div128". */
+static char *clktree_child_name(const char *clk_name)
+{
+    char **parts = g_strsplit(clk_name, "/", -1);
+    char *child_name = g_strjoinv("_div", parts);
+
+    g_strfreev(parts);
+    return child_name;
+}
+
+static void clktree_get_output_freq_prop(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    uint32_t output_freq = STM32_CLK(obj)->clk->snapshot.output_freq;
+
+    visit_type_uint32(v, &output_freq, name, errp);
+}
+
+static bool clktree_get_enabled_prop(Object *obj, Error **errp)
+{
+    return STM32_CLK(obj)->clk->snapshot.enabled;
+}
+
+/* The name of the selected input clock, or "" if there is none. */
+static char *clktree_get_selected_input_prop(Object *obj, Error **errp)
+{
+    Clk input_clk = STM32_CLK(obj)->clk->snapshot.input;
+
+    return g_strdup(input_clk ? input_clk->name : "");
+}
+
+static void clktree_clk_instance_init(Object *obj)
+{
+    object_property_add(obj, "output-freq", "uint32",
+                        clktree_get_output_freq_prop, NULL, NULL, NULL,
+                        NULL);
+    object_property_add_bool(obj, "enabled", clktree_get_enabled_prop, NULL,
+                             NULL);
+    object_property_add_str(obj, "selected-input",
+                            clktree_get_selected_input_prop, NULL, NULL);
+}
+
+static const TypeInfo clktree_clk_info = {
+    .name = TYPE_STM32_CLK,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(Stm32ClkState),
+    .instance_init = clktree_clk_instance_init,
+};
+
+static void clktree_register_types(void)
+{
+    type_register_static(&clktree_clk_info);
+}
+
+type_init(clktree_register_types)
 
 
 
@@ -191,6 +420,21 @@ static Clk clktree_create_generic(
 
 
 /* PUBLIC FUNCTIONS */
+void clktree_begin_update(void)
+{
+    clktree_update_depth++;
+}
+
+void clktree_commit_update(void)
+{
+    assert(clktree_update_depth > 0);
+
+    clktree_update_depth--;
+    if((clktree_update_depth == 0) && (clktree_first_dirty != UINT_MAX)) {
+        clktree_propagate();
+    }
+}
+
 bool clktree_is_enabled(Clk clk)
 {
     return clk->enabled;
@@ -201,13 +445,14 @@ uint32_t clktree_get_output_freq(Clk clk)
     return clk->output_freq;
 }
 
+uint32_t clktree_get_generation(Clk clk)
+{
+    return clk->generation;
+}
+
 void clktree_adduser(Clk clk, qemu_irq user)
 {
-    CLKTREE_ADD_LINK(
-            clk->user,
-            clk->user_count,
-            user,
-            CLKTREE_MAX_IRQ);
+    clktree_add_link(&clk->users_tail)->to.irq = user;
 }
 
 
@@ -218,9 +463,10 @@ Clk clktree_create_src_clk(
 {
     Clk clk;
 
-    clk = clktree_create_generic(name, 1, 1, enabled);
+    clk = clktree_create_generic(name, 1, 1, enabled, 0);
 
-    clktree_set_input_freq(clk, src_freq);
+    clk->input_freq = src_freq;
+    clktree_mark_dirty(clk);
 
     return clk;
 }
@@ -237,24 +483,26 @@ Clk clktree_create_clk(
 {
     va_list input_clks;
     Clk clk, input_clk;
+    unsigned input_count = 0, i;
+
+    /* Count the inputs so that they can be stored in one array. */
+    va_start(input_clks, selected_input);
+    while(va_arg(input_clks, Clk) != NULL) {
+        input_count++;
+    }
+    va_end(input_clks);
 
-    clk = clktree_create_generic(name, multiplier, divisor, enabled);
+    clk = clktree_create_generic(name, multiplier, divisor, enabled,
+                                 input_count);
 
     /* Add the input clock connections. */
     va_start(input_clks, selected_input);
-    while((input_clk = va_arg(input_clks, Clk)) != NULL) {
-        CLKTREE_ADD_LINK(
-                clk->input,
-                clk->input_count,
-                input_clk,
-                CLKTREE_MAX_INPUT);
-
-        CLKTREE_ADD_LINK(
-                input_clk->output,
-                input_clk->output_count,
-                clk,
-                CLKTREE_MAX_OUTPUT);
+    for(i = 1; i <= input_count; i++) {
+        input_clk = va_arg(input_clks, Clk);
+        clk->input[i] = input_clk;
+        clktree_add_link(&input_clk->outputs_tail)->to.clk = clk;
     }
+    va_end(input_clks);
 
     clktree_set_selected_input(clk, selected_input);
 
@@ -267,7 +515,7 @@ void clktree_set_scale(Clk clk, uint16_t multiplier, uint16_t divisor)
     clk->multiplier = multiplier;
     clk->divisor = divisor;
 
-    clktree_recalc_output_freq(clk);
+    clktree_mark_dirty(clk);
 }
 
 
@@ -275,25 +523,79 @@ void clktree_set_enabled(Clk clk, bool enabled)
 {
     clk->enabled = enabled;
 
-    clktree_recalc_output_freq(clk);
+    clktree_mark_dirty(clk);
 }
 
 
 void clktree_set_selected_input(Clk clk, int selected_input)
 {
-    uint32_t input_freq;
-
     assert((selected_input + 1) < clk->input_count);
 
     clk->selected_input = selected_input;
 
-    /* Get the input clock frequency.  If there is no input, this should be 0.
-     */
-    if(selected_input > -1) {
-        input_freq = clktree_get_input_clk(clk)->output_freq;
-    } else {
-        input_freq = 0;
+    /* The input frequency is picked up from the newly selected input clock
+     * (or set to 0 if there is no input) when the clock is recalculated. */
+    clktree_mark_dirty(clk);
+}
+
+
+void clktree_add_children(Object *parent, Clk first)
+{
+    Clk clk;
+    Object *obj;
+    char *child_name;
+    unsigned i;
+
+    for(i = first->index; i < clktree_count; i++) {
+        clk = clktree_order[i];
+        if(clk->obj) {
+            continue;
+        }
+
+        obj = object_new(TYPE_STM32_CLK);
+        STM32_CLK(obj)->clk = clk;
+
+        child_name = clktree_child_name(clk->name);
+        object_property_add_child(parent, child_name, obj, &error_abort);
+        g_free(child_name);
+
+        /* The parent now holds the only reference. */
+        object_unref(obj);
+        clk->obj = obj;
+    }
+}
+
+Stm32ClockInfoList *qmp_query_stm32_clocks(Error **errp)
+{
+    Stm32ClockInfoList *head = NULL, **tail = &head, *entry;
+    Stm32ClockInfo *info;
+    Clk clk;
+    unsigned i;
+
+    for(i = 0; i < clktree_count; i++) {
+        clk = clktree_order[i];
+        if(!clk->obj) {
+            continue;
+        }
+        if(!clk->path) {
+            clk->path = object_get_canonical_path(clk->obj);
+        }
+
+        info = g_new0(Stm32ClockInfo, 1);
+        info->path = g_strdup(clk->path);
+        info->name = g_strdup(clk->name);
+        info->output_freq = clk->snapshot.output_freq;
+        info->enabled = clk->snapshot.enabled;
+        if(clk->snapshot.input) {
+            info->has_selected_input = true;
+            info->selected_input = g_strdup(clk->snapshot.input->name);
+        }
+
+        entry = g_new0(Stm32ClockInfoList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
     }
 
-    clktree_set_input_freq(clk, input_freq);
+    return head;
 }
@@ -0,0 +1,276 @@
+/*
+ * STM32 Microcontroller shared memory co-simulation bridge
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+
+#include "hw/arm/stm32.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/timer.h"
+
+/* The accesses to a range of the address space (an FPGA on the FSMC bus,
+ * say) are passed to a model in another process, e.g. a SystemC or
+ * Verilator simulation, through a file that both map.  The file has a
+ * Stm32CosimHeader, a request ring and a response ring, laid out as in
+ * net/can-shm.c: each ring has a single producer, which only writes head,
+ * and a single consumer, which only writes tail, both counting entries
+ * and wrapping freely.  All fields are little endian.
+ *
+ * Every request has the type, the access size, the offset in the range,
+ * the data of a write and the virtual time in ns.  The model handles them
+ * in order, and answers every READ and SYNC request with one response:
+ *  - Writes are posted.  They are only published (head is only advanced)
+ *    when the next read or sync is, or when the ring is half full, so the
+ *    model and the CPU do not fight over the cache line for every write.
+ *  - A read publishes the writes before it, and waits for its data.
+ *  - Every quantum_ns of virtual time, a SYNC request tells the model the
+ *    time QEMU got to, and QEMU waits for the model to catch up and
+ *    answer.  With quantum_ns 0, there is no sync and every write is
+ *    published at once.
+ * QEMU spins, yielding the host CPU, while it waits for room in the
+ * request ring or for a response. */
+
+/* DEFINITIONS */
+
+#define STM32_COSIM_MAGIC 0x4d49534f /* "OSIM" */
+#define STM32_COSIM_VERSION 1
+#define STM32_COSIM_RING_SIZE 1024
+#define STM32_COSIM_SPINS 1000
+
+enum {
+    STM32_COSIM_WRITE,
+    STM32_COSIM_READ,
+    STM32_COSIM_SYNC,
+};
+
+typedef struct Stm32CosimHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    uint32_t region_size;
+    uint8_t reserved[48];
+} Stm32CosimHeader;
+
+typedef struct Stm32CosimRequest {
+    uint8_t type;
+    uint8_t size;
+    uint16_t reserved;
+    uint32_t offset;
+    uint64_t data;
+    int64_t time;
+} Stm32CosimRequest;
+
+typedef struct Stm32CosimRequestRing {
+    uint32_t head;
+    uint8_t pad0[60];
+    uint32_t tail;
+    uint8_t pad1[60];
+    Stm32CosimRequest entries[STM32_COSIM_RING_SIZE];
+} Stm32CosimRequestRing;
+
+typedef struct Stm32CosimResponseRing {
+    uint32_t head;
+    uint8_t pad0[60];
+    uint32_t tail;
+    uint8_t pad1[60];
+    uint64_t data[STM32_COSIM_RING_SIZE];
+} Stm32CosimResponseRing;
+
+typedef struct Stm32Cosim {
+    MemoryRegion iomem;
+    size_t map_size;
+    Stm32CosimHeader *hdr;
+    Stm32CosimRequestRing *req;
+    Stm32CosimResponseRing *resp;
+
+    /* Next request, which the model sees once head is published */
+    uint32_t req_head;
+
+    uint32_t quantum_ns;
+    QEMUTimer *sync_timer;
+} Stm32Cosim;
+
+
+
+
+/* CHANNEL */
+
+static void stm32_cosim_spin(int *spins)
+{
+    if(++*spins >= STM32_COSIM_SPINS) {
+        sched_yield();
+        *spins = 0;
+    }
+}
+
+static void stm32_cosim_publish(Stm32Cosim *s)
+{
+    smp_wmb();
+    atomic_set(&s->req->head, cpu_to_le32(s->req_head));
+}
+
+static void stm32_cosim_push(Stm32Cosim *s, uint8_t type, unsigned size,
+                             hwaddr offset, uint64_t data)
+{
+    Stm32CosimRequest *r;
+    uint32_t tail = le32_to_cpu(atomic_read(&s->req->tail));
+    int spins = 0;
+
+    if(s->req_head - tail >= STM32_COSIM_RING_SIZE) {
+        /* Full: the model must see what is there to make room */
+        stm32_cosim_publish(s);
+        do {
+            stm32_cosim_spin(&spins);
+            tail = le32_to_cpu(atomic_read(&s->req->tail));
+        } while(s->req_head - tail >= STM32_COSIM_RING_SIZE);
+    }
+    smp_mb();
+
+    r = &s->req->entries[s->req_head % STM32_COSIM_RING_SIZE];
+    r->type = type;
+    r->size = size;
+    r->reserved = 0;
+    r->offset = cpu_to_le32(offset);
+    r->data = cpu_to_le64(data);
+    r->time = cpu_to_le64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    s->req_head++;
+
+    if(type != STM32_COSIM_WRITE || !s->quantum_ns ||
+       s->req_head - tail >= STM32_COSIM_RING_SIZE / 2) {
+        stm32_cosim_publish(s);
+    }
+}
+
+/* Wait for the response to the last request */
+static uint64_t stm32_cosim_response(Stm32Cosim *s)
+{
+    uint32_t tail = le32_to_cpu(s->resp->tail);
+    uint64_t data;
+    int spins = 0;
+
+    while(le32_to_cpu(atomic_read(&s->resp->head)) == tail) {
+        stm32_cosim_spin(&spins);
+    }
+    smp_rmb();
+    data = le64_to_cpu(s->resp->data[tail % STM32_COSIM_RING_SIZE]);
+    smp_mb();
+    atomic_set(&s->resp->tail, cpu_to_le32(tail + 1));
+    return data;
+}
+
+static void stm32_cosim_sync(void *opaque)
+{
+    Stm32Cosim *s = opaque;
+
+    stm32_cosim_push(s, STM32_COSIM_SYNC, 0, 0, 0);
+    stm32_cosim_response(s);
+    timer_mod(s->sync_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->quantum_ns);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint64_t stm32_cosim_read(void *opaque, hwaddr offset, unsigned size)
+{
+    Stm32Cosim *s = opaque;
+
+    stm32_cosim_push(s, STM32_COSIM_READ, size, offset, 0);
+    return stm32_cosim_response(s);
+}
+
+static void stm32_cosim_write(void *opaque, hwaddr offset, uint64_t value,
+                              unsigned size)
+{
+    Stm32Cosim *s = opaque;
+
+    stm32_cosim_push(s, STM32_COSIM_WRITE, size, offset, value);
+}
+
+static const MemoryRegionOps stm32_cosim_ops = {
+    .read = stm32_cosim_read,
+    .write = stm32_cosim_write,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+
+
+
+/* INITIALIZATION */
+
+void stm32_cosim_init(MemoryRegion *system_memory, hwaddr base,
+                      uint32_t size, const char *path, uint32_t quantum_ns)
+{
+    Stm32Cosim *s = g_new0(Stm32Cosim, 1);
+    struct stat st;
+    void *mem;
+    int fd;
+
+    QEMU_BUILD_BUG_ON(sizeof(Stm32CosimHeader) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(Stm32CosimRequest) != 24);
+    QEMU_BUILD_BUG_ON(offsetof(Stm32CosimRequestRing, entries) != 128);
+    QEMU_BUILD_BUG_ON(offsetof(Stm32CosimResponseRing, data) != 128);
+
+    s->map_size = sizeof(Stm32CosimHeader) + sizeof(Stm32CosimRequestRing) +
+                  sizeof(Stm32CosimResponseRing);
+
+    /* The file is not truncated, so the model may create it first */
+    fd = qemu_open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+        hw_error("Co-simulation: cannot open %s: %s", path, strerror(errno));
+    }
+    if(fstat(fd, &st) < 0 ||
+       (st.st_size < s->map_size && ftruncate(fd, s->map_size) < 0)) {
+        hw_error("Co-simulation: cannot resize %s: %s", path,
+                 strerror(errno));
+    }
+    mem = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if(mem == MAP_FAILED) {
+        hw_error("Co-simulation: cannot map %s: %s", path, strerror(errno));
+    }
+
+    s->hdr = mem;
+    s->req = (Stm32CosimRequestRing *)(s->hdr + 1);
+    s->resp = (Stm32CosimResponseRing *)(s->req + 1);
+    /* A new run starts with empty rings, which the model must not look at
+     * before the magic is back */
+    s->hdr->magic = 0;
+    smp_wmb();
+    s->req->head = s->req->tail = 0;
+    s->resp->head = s->resp->tail = 0;
+    s->hdr->version = cpu_to_le32(STM32_COSIM_VERSION);
+    s->hdr->ring_size = cpu_to_le32(STM32_COSIM_RING_SIZE);
+    s->hdr->region_size = cpu_to_le32(size);
+    smp_wmb();
+    s->hdr->magic = cpu_to_le32(STM32_COSIM_MAGIC);
+
+    memory_region_init_io(&s->iomem, NULL, &stm32_cosim_ops, s, "stm32-cosim",
+                          size);
+    memory_region_add_subregion(system_memory, base, &s->iomem);
+
+    s->quantum_ns = quantum_ns;
+    if(quantum_ns) {
+        s->sync_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, stm32_cosim_sync, s);
+        timer_mod(s->sync_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + quantum_ns);
+    }
+}
@@ -23,6 +23,7 @@
 #include "hw/arm/stm32.h"
 #include "sysemu/char.h"
 #include "qemu/bitops.h"
+#include "sysemu/sysemu.h"
 #include <math.h>       // for the sine wave generation
 #include <inttypes.h>
 
@@ -46,6 +47,8 @@
 #define DAC_CR_MAMP2_START   24
 #define DAC_CR_TEN1_BIT   2
 #define DAC_CR_TEN2_BIT   18
+#define DAC_CR_DMAEN1_BIT 12
+#define DAC_CR_DMAEN2_BIT 28
 #define DAC_CR_TSEL1_START   3
 #define DAC_CR_TSEL2_START   19
 #define DAC_SWTRIGR1_MASK  0x00000001
@@ -63,6 +66,18 @@
 #define DAC_DOR1_OFFSET 0x2c
 #define DAC_DOR2_OFFSET 0x30
 
+/* Number of converted samples buffered before they are written out */
+#define DAC_SINK_SIZE 1024
+/* Buffered samples are also written out once they are this old */
+#define DAC_SINK_FLUSH_NS 10000000LL
+
+/* A converted output value */
+typedef struct Stm32DacSample {
+    int64_t time;   /* virtual time at which the output settled */
+    int channel;    /* 1 or 2 */
+    int mv;         /* output voltage */
+} Stm32DacSample;
+
 
 struct Stm32Dac {
     /* Inherited */
@@ -73,6 +88,12 @@ struct Stm32Dac {
     void *stm32_rcc_prop;
     void *stm32_gpio_prop;
     void *stm32_afio_prop;
+    /* AioContext in which the timers run, NULL for the main loop */
+    void *aio_context;
+    /* Output sink.  If neither is set, the values are appended to
+       DAC_OUT_PUT1.txt and DAC_OUT_PUT2.txt */
+    CharDriverState *chr;
+    char *sink_file;
 
     /* Private */
     MemoryRegion iomem;
@@ -83,6 +104,9 @@ struct Stm32Dac {
     /* nano sec per cycle 
        of APB1 Clock   */
     int64_t ns_per_cycle;
+    /* peripheral clock generation 
+       of ns_per_cycle */
+    uint32_t clk_generation;
 
     /* Register Values */
     uint32_t
@@ -107,28 +131,59 @@ struct Stm32Dac {
         DACC2_DHR,
         TRI_CNT1,   /* triangle counter */
         TRI_CNT2;
-    struct QEMUTimer *DOR1_timer;
-    struct QEMUTimer *DOR2_timer;
-    struct QEMUTimer *TRI_CNT1_timer;
-    struct QEMUTimer *TRI_CNT2_timer;
-    struct QEMUTimer *CONV1_timer;
-    struct QEMUTimer *CONV2_timer;
-    struct QEMUTimer *LFSR_timer;
+
+    /* DOR values are computed as soon as the
+       trigger (or DHR write) happens, but only
+       become visible one APB1 cycle later, so
+       the previous value is kept until then */
+    uint32_t DAC_DOR1_prev;
+    uint32_t DAC_DOR2_prev;
+    int64_t DOR1_ready_time;
+    int64_t DOR2_ready_time;
+
+    /* Output sink */
+    Stm32DacSample sink[DAC_SINK_SIZE];
+    int sink_count;
+    FILE *sink_fp;
+    FILE *legacy_fp[2];
+    struct QEMUTimer *sink_timer;
+    Notifier exit_notifier;
 
 
     bool inc_cnt1;
     bool inc_cnt2;
     int Vref; //mv
+
+    /* DMA request lines.  A request is made after each
+       trigger when DMAENx is set, and is removed when
+       the DMA writes the next value to DHRx */
+    qemu_irq dma1_irq;
+    qemu_irq dma2_irq;
+    bool dma1_req;
+    bool dma2_req;
 };
 
 
-/* Handle a change in the peripheral clock. */
-static void stm32_dac_clk_irq_handler(void *opaque, int n, int level)
+/* Compute ns_per_cycle from the peripheral clock */
+static void stm32_dac_ns_per_cycle_update(Stm32Dac *s)
 {
-   Stm32Dac *s=(Stm32Dac *)opaque;    
+   uint32_t clk_freq;
+
+   s->clk_generation =
+       stm32_rcc_get_periph_generation(s->stm32_rcc, s->periph);
+   clk_freq = stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph);
+   s->ns_per_cycle = clk_freq ? 1000000000LL/clk_freq : 0;
+}
 
-   uint32_t clk_freq = stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph);
-   s->ns_per_cycle=1000000000LL/clk_freq;
+/* Recompute ns_per_cycle if the peripheral 
+   clock changed since it was last computed.
+   Called before the cycle time is used rather
+   than on every clock change */
+static void stm32_dac_ns_per_cycle_sync(Stm32Dac *s)
+{
+   if(stm32_rcc_get_periph_generation(s->stm32_rcc, s->periph) !=
+         s->clk_generation)
+      stm32_dac_ns_per_cycle_update(s);
 }
 
 static void stm32_dac_LFSR_update(void *opaque)
@@ -193,16 +248,126 @@ static void stm32_dac_triangular_cnt2_update(void *opaque)
      
 }
 
-static void stm32_dac_load_DOR1_registre(void *opaque) 
+/* OUTPUT SINK */
+
+/* Write out all buffered samples */
+static void stm32_dac_sink_flush(Stm32Dac *s)
+{
+   char line[64];
+   int i,len;
+   Stm32DacSample *sample;
+
+   for(i=0;i<s->sink_count;i++)
+   {
+      sample=&s->sink[i];
+      if(s->chr || s->sink_fp)
+      {
+         len=snprintf(line,sizeof(line),"%" PRId64 " %d %d\n",
+                      sample->time,sample->channel,sample->mv);
+         if(s->chr)
+            qemu_chr_fe_write_all(s->chr,(uint8_t *)line,len);
+         else
+            fwrite(line,1,len,s->sink_fp);
+      }
+      else if(s->legacy_fp[sample->channel-1])
+      {
+         fprintf(s->legacy_fp[sample->channel-1],"%d\n",sample->mv);
+      }
+   }
+   s->sink_count=0;
+
+   if(s->sink_fp)
+      fflush(s->sink_fp);
+   for(i=0;i<2;i++)
+      if(s->legacy_fp[i])
+         fflush(s->legacy_fp[i]);
+}
+
+static void stm32_dac_sink_timer_expire(void *opaque)
+{
+   stm32_dac_sink_flush((Stm32Dac *)opaque);
+}
+
+static void stm32_dac_exit_notify(Notifier *notifier, void *data)
+{
+   Stm32Dac *s=container_of(notifier,Stm32Dac,exit_notifier);
+
+   stm32_dac_sink_flush(s);
+}
+
+/* Record a converted output value.  Values are
+   buffered and written out in batches, either
+   when the buffer is full or after
+   DAC_SINK_FLUSH_NS of virtual time */
+static void stm32_dac_sink_record(Stm32Dac *s,int channel,int64_t time,int mv)
+{
+   Stm32DacSample *sample=&s->sink[s->sink_count++];
+
+   DPRINTF("DAC%doutput:%d\n",channel,mv);
+   sample->time=time;
+   sample->channel=channel;
+   sample->mv=mv;
+
+   if(s->sink_count==DAC_SINK_SIZE)
+      stm32_dac_sink_flush(s);
+   else if(s->sink_count==1)
+      timer_mod(s->sink_timer,
+                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)+DAC_SINK_FLUSH_NS);
+}
+
+static void stm32_dac_check_pin(Stm32Dac *s,int pin);
+
+/* When DAC_DORx is loaded with the DAC_DHRx
+   contents, the analog output voltage becomes
+   available after a time of t SETTLING,
+   generaly equal three cycles */
+static void stm32_dac_conv_DACC1(Stm32Dac *s,int64_t load_time)
+{
+   stm32_dac_check_pin(s,4);
+   stm32_dac_sink_record(s,1,load_time+3*s->ns_per_cycle,
+                         (s->Vref*(s->DAC_DOR1 & 0xfff))/4095);
+}
+
+static void stm32_dac_conv_DACC2(Stm32Dac *s,int64_t load_time)
+{
+   stm32_dac_check_pin(s,5);
+   stm32_dac_sink_record(s,2,load_time+3*s->ns_per_cycle,
+                         (s->Vref*(s->DAC_DOR2 & 0xfff))/4095);
+}
+
+/* Returns the value of DOR1 as currently
+   seen by the software */
+static uint32_t stm32_dac_read_DOR1(Stm32Dac *s)
+{
+   if(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) < s->DOR1_ready_time)
+      return s->DAC_DOR1_prev;
+   return s->DAC_DOR1;
+}
+
+static uint32_t stm32_dac_read_DOR2(Stm32Dac *s)
+{
+   if(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) < s->DOR2_ready_time)
+      return s->DAC_DOR2_prev;
+   return s->DAC_DOR2;
+}
+
+/* Load DOR1 from DHR1.  The load happens one
+   APB1 cycle after the trigger (or DHR write),
+   at load_time.  The triangle counter and
+   LFSR are stepped straight away rather than
+   three cycles later, since they are only
+   used again at the next trigger.  triggered
+   is false for a DHR write with TEN1 clear */
+static void stm32_dac_load_DOR1_registre(Stm32Dac *s,int64_t load_time,
+                                         bool triggered)
 {
-   Stm32Dac *s=(Stm32Dac *)opaque;
    uint32_t WAVE1,MAMP1,MASK_LFSR;
-   uint64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
    
+   s->DAC_DOR1_prev=stm32_dac_read_DOR1(s);
+   s->DOR1_ready_time=load_time;
    s->DAC_DOR1=s->DACC1_DHR;
 
-   if(extract32(s->DAC_CR,DAC_CR_TEN1_BIT,1) &&
-      extract32(s->DAC_SWTRIGR,0,1))
+   if(extract32(s->DAC_CR,DAC_CR_TEN1_BIT,1) && triggered)
    {
       WAVE1=extract32(s->DAC_CR,DAC_CR_WAVE1_START,2);
       MAMP1=extract32(s->DAC_CR,DAC_CR_MAMP1_START,4); 
@@ -213,10 +378,7 @@ static void stm32_dac_load_DOR1_registre(void *opaque)
       if(WAVE1>1)
       {
         s->DAC_DOR1+=s->TRI_CNT1;
-        /*internal triangular counter 1 
-       is incremented three APB1 clock 
-       cycles after each trigger event*/
-        timer_mod(s->TRI_CNT1_timer, curr_time + 3*s->ns_per_cycle);
+        stm32_dac_triangular_cnt1_update(s);
       }
       /* noise generation */
       if(WAVE1==1)
@@ -224,33 +386,33 @@ static void stm32_dac_load_DOR1_registre(void *opaque)
         /* MASK for LFSR */
         MASK_LFSR= (1 << (MAMP1+1))-1;
         s->DAC_DOR1+=(s->LFSR_VALUE & MASK_LFSR);  
-        /* LFSR registre is updated three APB1
-          clock cycles after each trigger event */
-        timer_mod(s->LFSR_timer, curr_time + 3*s->ns_per_cycle);       
+        stm32_dac_LFSR_update(s);
       }   
         /* clear SWTRIG1 ==>
          software triger1 disabled */
       s->DAC_SWTRIGR= (s->DAC_SWTRIGR & (~DAC_SWTRIGR1_MASK));        
-   }  
 
-   /* When DAC_DOR1 is loaded with the DAC_DHR1 
-      contents,the analog output voltage 
-      becomes available after a time of 
-      t SETTLING,generaly equal three cycles */
+      /* request the next value by DMA */
+      if(extract32(s->DAC_CR,DAC_CR_DMAEN1_BIT,1) && !s->dma1_req)
+      {
+        s->dma1_req=true;
+        qemu_irq_raise(s->dma1_irq);
+      }
+   }  
 
-   timer_mod(s->CONV1_timer, curr_time + 3*s->ns_per_cycle);
- 
+   stm32_dac_conv_DACC1(s,load_time);
 }
 
-static void stm32_dac_load_DOR2_registre(void *opaque) 
+static void stm32_dac_load_DOR2_registre(Stm32Dac *s,int64_t load_time,
+                                         bool triggered)
 {
-   Stm32Dac *s=(Stm32Dac *)opaque;
    uint32_t WAVE2,MAMP2,MASK_LFSR;
-   uint64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+   s->DAC_DOR2_prev=stm32_dac_read_DOR2(s);
+   s->DOR2_ready_time=load_time;
    s->DAC_DOR2=s->DACC2_DHR;
 
-   if(extract32(s->DAC_CR,DAC_CR_TEN2_BIT,1) &&
-      extract32(s->DAC_SWTRIGR,1,1))
+   if(extract32(s->DAC_CR,DAC_CR_TEN2_BIT,1) && triggered)
    {
       WAVE2=extract32(s->DAC_CR,DAC_CR_WAVE2_START,2);
       MAMP2=extract32(s->DAC_CR,DAC_CR_MAMP2_START,4);
@@ -260,10 +422,7 @@ static void stm32_dac_load_DOR2_registre(void *opaque)
       if(WAVE2>1)
       {
        s->DAC_DOR2+=s->TRI_CNT2;
-       /*internal triangular counter 2 
-       is incremented three APB1 clock 
-       cycles after each trigger event*/
-       timer_mod(s->TRI_CNT2_timer, curr_time + 3*s->ns_per_cycle);
+       stm32_dac_triangular_cnt2_update(s);
       }
       
       /* noise generation */
@@ -272,21 +431,21 @@ static void stm32_dac_load_DOR2_registre(void *opaque)
        /* MASK for LFSR */
         MASK_LFSR= (1 << (MAMP2+1))-1;
         s->DAC_DOR2+=(s->LFSR_VALUE & MASK_LFSR);
-       /*LFSR registre is updated three APB1 
-       clock cycles after each trigger event*/
-        timer_mod(s->LFSR_timer, curr_time + 3*s->ns_per_cycle);
+        stm32_dac_LFSR_update(s);
       }  
        /* clear SWTRIG2 ==>
        software triger2 disabled */
        s->DAC_SWTRIGR= (s->DAC_SWTRIGR & (~DAC_SWTRIGR2_MASK));          
-   }  
 
-       /* When DAC_DORx is loaded with the
-       DAC_DHRx contents,the analog output 
-       voltage becomes available after a time of 
-       t SETTLING,generaly its equal three cycles */
+       /* request the next value by DMA */
+       if(extract32(s->DAC_CR,DAC_CR_DMAEN2_BIT,1) && !s->dma2_req)
+       {
+         s->dma2_req=true;
+         qemu_irq_raise(s->dma2_irq);
+       }
+   }  
 
-   timer_mod(s->CONV2_timer, curr_time + 3*s->ns_per_cycle);
+   stm32_dac_conv_DACC2(s,load_time);
 }
 
 
@@ -294,15 +453,22 @@ static void stm32_dac_write_DACC1_DHR(Stm32Dac *s,uint32_t value)
 {
 
    uint64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+   stm32_dac_ns_per_cycle_sync(s);
    s->DACC1_DHR=value;
 
+   if(s->dma1_req)
+   {
+     s->dma1_req=false;
+     qemu_irq_lower(s->dma1_irq);
+   }
+
     /* if DAC channel1 trigger disabled 
        data written into DACC2_DHR register is 
        transferred one APB1 clock cycle 
        later to the DAC_DOR1 register */
 
    if(!extract32(s->DAC_CR,DAC_CR_TEN1_BIT,1))
-    timer_mod(s->DOR1_timer, curr_time + s->ns_per_cycle);
+    stm32_dac_load_DOR1_registre(s, curr_time + s->ns_per_cycle, false);
     
 }
 
@@ -310,21 +476,29 @@ static void stm32_dac_write_DACC2_DHR(Stm32Dac *s,uint32_t value)
 {
 
    uint64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+   stm32_dac_ns_per_cycle_sync(s);
    s->DACC2_DHR=value;
 
+   if(s->dma2_req)
+   {
+     s->dma2_req=false;
+     qemu_irq_lower(s->dma2_irq);
+   }
+
     /* if DAC channel2 trigger disabled 
        data written into DACC2_DHR register is 
        transferred one APB1 clock cycle 
        later to the DAC_DOR2 register */
 
    if(!extract32(s->DAC_CR,DAC_CR_TEN2_BIT,1))
-    timer_mod(s->DOR2_timer, curr_time + s->ns_per_cycle);
+    stm32_dac_load_DOR2_registre(s, curr_time + s->ns_per_cycle, false);
    
 }
 
 static void stm32_dac_write_DAC_SWTRIGR(Stm32Dac *s,uint32_t value) 
 {
    uint64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+   stm32_dac_ns_per_cycle_sync(s);
    s->DAC_SWTRIGR=(value & 3);
 
    /* if software trigger x occured 
@@ -332,13 +506,35 @@ static void stm32_dac_write_DAC_SWTRIGR(Stm32Dac *s,uint32_t value)
       APB1 clock cycle */
 
    if(value & DAC_SWTRIGR1_MASK)
-     timer_mod(s->DOR1_timer, curr_time + s->ns_per_cycle);
+     stm32_dac_load_DOR1_registre(s, curr_time + s->ns_per_cycle, true);
 
    if(value & DAC_SWTRIGR2_MASK)
-     timer_mod(s->DOR2_timer, curr_time + s->ns_per_cycle);
+     stm32_dac_load_DOR2_registre(s, curr_time + s->ns_per_cycle, true);
    
 }
 
+/* A rising edge on one of the trigger inputs, such as the TRGO of a timer
+   pacing a waveform played back by DMA */
+static void stm32_dac_trigger(void *opaque, int n, int level)
+{
+   Stm32Dac *s = (Stm32Dac *)opaque;
+   uint64_t curr_time;
+
+   if(!level)
+     return;
+
+   curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+   stm32_dac_ns_per_cycle_sync(s);
+
+   if(extract32(s->DAC_CR,DAC_CR_TEN1_BIT,1) &&
+      extract32(s->DAC_CR,DAC_CR_TSEL1_START,3) == n)
+     stm32_dac_load_DOR1_registre(s, curr_time + s->ns_per_cycle, true);
+
+   if(extract32(s->DAC_CR,DAC_CR_TEN2_BIT,1) &&
+      extract32(s->DAC_CR,DAC_CR_TSEL2_START,3) == n)
+     stm32_dac_load_DOR2_registre(s, curr_time + s->ns_per_cycle, true);
+}
+
 static void stm32_dac_check_pin(Stm32Dac *s,int pin)
 {
     Stm32Gpio *gpio_dev = s->stm32_gpio[STM32_GPIO_INDEX_FROM_PERIPH(STM32_GPIOA)];
@@ -351,30 +547,6 @@ static void stm32_dac_check_pin(Stm32Dac *s,int pin)
                  "analog input",pin);
 }
 
-static void stm32_dac_conv_DACC1(void *opaque) 
-{
-   Stm32Dac *s=(Stm32Dac *)opaque;
-   stm32_dac_check_pin(s,4);
-   printf("DAC1output:%d\n",(s->Vref*(s->DAC_DOR1 & 0xfff))/4095);
-   FILE* fichier=fopen("DAC_OUT_PUT1.txt", "a");
-   fprintf(fichier, "%d\n",(s->Vref*(s->DAC_DOR1 & 0xfff))/4095);
-   fclose(fichier);
-   
-}
-
-
-static void stm32_dac_conv_DACC2(void *opaque) 
-{
-
-   Stm32Dac *s=(Stm32Dac *)opaque;
-   stm32_dac_check_pin(s,5);
-   printf("DAC2output:%d\n",(s->Vref*(s->DAC_DOR2 & 0xfff))/4095);
-   FILE* fichier=fopen("DAC_OUT_PUT2.txt", "a");
-   fprintf(fichier, "%d\n",(s->Vref*(s->DAC_DOR2 & 0xfff))/4095);
-   fclose(fichier);
-}
-
-
 static void stm32_dac_reset(DeviceState *dev)
 {
    Stm32Dac *s = STM32_Dac(dev);
@@ -382,12 +554,30 @@ static void stm32_dac_reset(DeviceState *dev)
    s->Vref=2400;
    s->inc_cnt2=true;
    s->inc_cnt1=true;
-   FILE* fichier=fopen("DAC_OUT_PUT1.txt", "w");
-   fprintf(fichier, "****DAC_OUT_PUT1 : Result of conversion DAC channel 1****\n");
-   fclose(fichier);
-   fichier=fopen("DAC_OUT_PUT2.txt", "w");
-   fprintf(fichier, "****DAC_OUT_PUT2 : Result of conversion DAC channel 2****\n");
-   fclose(fichier);
+   s->dma1_req=false;
+   s->dma2_req=false;
+   qemu_irq_lower(s->dma1_irq);
+   qemu_irq_lower(s->dma2_irq);
+   s->DOR1_ready_time=0;
+   s->DOR2_ready_time=0;
+
+   /* Write out anything still buffered from before the reset */
+   stm32_dac_sink_flush(s);
+   timer_del(s->sink_timer);
+
+   if(!s->chr && !s->sink_fp)
+   {
+     if(s->legacy_fp[0])
+        fclose(s->legacy_fp[0]);
+     if(s->legacy_fp[1])
+        fclose(s->legacy_fp[1]);
+     s->legacy_fp[0]=fopen("DAC_OUT_PUT1.txt", "w");
+     if(s->legacy_fp[0])
+        fprintf(s->legacy_fp[0], "****DAC_OUT_PUT1 : Result of conversion DAC channel 1****\n");
+     s->legacy_fp[1]=fopen("DAC_OUT_PUT2.txt", "w");
+     if(s->legacy_fp[1])
+        fprintf(s->legacy_fp[1], "****DAC_OUT_PUT2 : Result of conversion DAC channel 2****\n");
+   }
 
 }
 
@@ -423,9 +613,9 @@ static uint64_t stm32_dac_read(void *opaque, hwaddr offset,
         case DAC_DHR8RD_OFFSET:
             return s->DAC_DHR8RD;
         case DAC_DOR1_OFFSET:
-	    return s->DAC_DOR1;
+	    return stm32_dac_read_DOR1(s);
         case DAC_DOR2_OFFSET:
-	    return s->DAC_DOR2;
+	    return stm32_dac_read_DOR2(s);
 
         default:
             STM32_BAD_REG(offset, size);
@@ -523,45 +713,100 @@ static const MemoryRegionOps stm32_dac_ops = {
 static int stm32_dac_init(SysBusDevice *dev)
 {
 
-    qemu_irq *clk_irq;
     Stm32Dac *s = STM32_Dac(dev);
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
     s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
 
     memory_region_init_io(&s->iomem, OBJECT(s), &stm32_dac_ops, s,
-                          "dac", 0x03ff);
+                          "dac", STM32_PERIPH_SIZE);
     sysbus_init_mmio(dev, &s->iomem);
+    sysbus_init_irq(dev, &s->dma1_irq);
+    sysbus_init_irq(dev, &s->dma2_irq);
+    qdev_init_gpio_in_named(DEVICE(dev), stm32_dac_trigger, "trigger",
+                            STM32_DAC_TRIGGER_LINES);
 
     
-    s->DOR1_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, 
-                    (QEMUTimerCB *)stm32_dac_load_DOR1_registre, s);
-    s->DOR2_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, 
-                    (QEMUTimerCB *)stm32_dac_load_DOR2_registre, s);
-    s->TRI_CNT1_timer =timer_new_ns(QEMU_CLOCK_VIRTUAL, 
-                    (QEMUTimerCB *)stm32_dac_triangular_cnt1_update, s);
-    s->TRI_CNT2_timer =timer_new_ns(QEMU_CLOCK_VIRTUAL, 
-                    (QEMUTimerCB *)stm32_dac_triangular_cnt2_update, s);
-    s->CONV1_timer =timer_new_ns(QEMU_CLOCK_VIRTUAL, 
-                    (QEMUTimerCB *) stm32_dac_conv_DACC1, s);
-    s->CONV2_timer =timer_new_ns(QEMU_CLOCK_VIRTUAL, 
-                    (QEMUTimerCB *) stm32_dac_conv_DACC2, s);
-    s->LFSR_timer =timer_new_ns(QEMU_CLOCK_VIRTUAL, 
-                    (QEMUTimerCB *) stm32_dac_LFSR_update, s);
+    s->sink_timer = stm32_timer_new_ns(s->aio_context, 
+                    (QEMUTimerCB *)stm32_dac_sink_timer_expire, s);
+    if(!s->chr && s->sink_file)
+    {
+      s->sink_fp=fopen(s->sink_file, "w");
+      if(!s->sink_fp)
+        hw_error("Could not open DAC output file %s", s->sink_file);
+    }
+    s->exit_notifier.notify=stm32_dac_exit_notify;
+    qemu_add_exit_notifier(&s->exit_notifier);
    
-    /* Register handlers to handle updates to the RTC's peripheral clock. */
-    clk_irq =
-          qemu_allocate_irqs(stm32_dac_clk_irq_handler, (void *)s, 1);
-    stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
-    
     stm32_dac_reset((DeviceState *)s);
 
     return 0;
 }
 
+/* Samples already in the output sink were produced
+   before the state being loaded, so they are written
+   out first.  The sink itself is not saved */
+static int stm32_dac_pre_load(void *opaque)
+{
+   Stm32Dac *s = (Stm32Dac *)opaque;
+
+   stm32_dac_sink_flush(s);
+   timer_del(s->sink_timer);
+   return 0;
+}
+
+static int stm32_dac_post_load(void *opaque, int version_id)
+{
+   Stm32Dac *s = (Stm32Dac *)opaque;
+
+   stm32_dac_ns_per_cycle_update(s);
+   return 0;
+}
+
+static const VMStateDescription vmstate_stm32_dac = {
+    .name = "stm32-dac",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_load = stm32_dac_pre_load,
+    .post_load = stm32_dac_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(DAC_CR, Stm32Dac),
+        VMSTATE_UINT32(DAC_SWTRIGR, Stm32Dac),
+        VMSTATE_UINT32(DAC_DOR1, Stm32Dac),
+        VMSTATE_UINT32(DAC_DOR2, Stm32Dac),
+        VMSTATE_UINT32(DAC_DHR12R1, Stm32Dac),
+        VMSTATE_UINT32(DAC_DHR12L1, Stm32Dac),
+        VMSTATE_UINT32(DAC_DHR8R1, Stm32Dac),
+        VMSTATE_UINT32(DAC_DHR12R2, Stm32Dac),
+        VMSTATE_UINT32(DAC_DHR12L2, Stm32Dac),
+        VMSTATE_UINT32(DAC_DHR8R2, Stm32Dac),
+        VMSTATE_UINT32(DAC_DHR12RD, Stm32Dac),
+        VMSTATE_UINT32(DAC_DHR12LD, Stm32Dac),
+        VMSTATE_UINT32(DAC_DHR8RD, Stm32Dac),
+        VMSTATE_UINT16(LFSR_VALUE, Stm32Dac),
+        VMSTATE_UINT16(DACC1_DHR, Stm32Dac),
+        VMSTATE_UINT16(DACC2_DHR, Stm32Dac),
+        VMSTATE_UINT16(TRI_CNT1, Stm32Dac),
+        VMSTATE_UINT16(TRI_CNT2, Stm32Dac),
+        VMSTATE_UINT32(DAC_DOR1_prev, Stm32Dac),
+        VMSTATE_UINT32(DAC_DOR2_prev, Stm32Dac),
+        VMSTATE_INT64(DOR1_ready_time, Stm32Dac),
+        VMSTATE_INT64(DOR2_ready_time, Stm32Dac),
+        VMSTATE_BOOL(inc_cnt1, Stm32Dac),
+        VMSTATE_BOOL(inc_cnt2, Stm32Dac),
+        VMSTATE_INT32(Vref, Stm32Dac),
+        VMSTATE_BOOL(dma1_req, Stm32Dac),
+        VMSTATE_BOOL(dma2_req, Stm32Dac),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property stm32_dac_properties[] = {
     DEFINE_PROP_PERIPH_T("periph", Stm32Dac, periph, STM32_PERIPH_UNDEFINED),
     DEFINE_PROP_PTR("stm32_rcc", Stm32Dac, stm32_rcc_prop),
     DEFINE_PROP_PTR("stm32_gpio", Stm32Dac, stm32_gpio_prop),
+    DEFINE_PROP_CHR("chardev", Stm32Dac, chr),
+    DEFINE_PROP_STRING("file", Stm32Dac, sink_file),
+    DEFINE_PROP_PTR("aio_context", Stm32Dac, aio_context),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -572,6 +817,7 @@ static void stm32_dac_class_init(ObjectClass *klass, void *data)
 
     k->init = stm32_dac_init;
     dc->reset = stm32_dac_reset;
+    dc->vmsd = &vmstate_stm32_dac;
     dc->props = stm32_dac_properties;
 }
 
@@ -0,0 +1,587 @@
+/*
+ * STM32 Microcontroller Flash memory and Flash Program and Erase Controller
+ * (FPEC)
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ * and "PM0075 Programming Manual Rev 2"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "exec/exec-all.h"
+#include "exec/ram_addr.h"
+#include "qemu/bitops.h"
+
+
+/* DEFINITIONS */
+
+/* Where the Flash memory itself lives in the memory map */
+#define FLASH_BASE_ADDR 0x08000000
+
+#define FLASH_ACR_OFFSET 0x00
+#define FLASH_ACR_LATENCY_MASK 0x00000007
+#define FLASH_ACR_PRFTBE_BIT 4
+#define FLASH_ACR_PRFTBS_BIT 5
+#define FLASH_ACR_WRITE_MASK 0x0000001f
+/* The STM32F4 has more wait states and the ART accelerator instead */
+#define FLASH_ACR_F4_LATENCY_MASK 0x0000000f
+#define FLASH_ACR_F4_PRFTEN_BIT 8
+#define FLASH_ACR_F4_ICEN_BIT 9
+#define FLASH_ACR_F4_WRITE_MASK 0x00000f0f
+
+/* Bytes read from the Flash by one access */
+#define FLASH_LINE_SIZE 8
+#define FLASH_F4_LINE_SIZE 16
+
+#define FLASH_KEYR_OFFSET 0x04
+#define FLASH_OPTKEYR_OFFSET 0x08
+#define FLASH_KEY1 0x45670123
+#define FLASH_KEY2 0xcdef89ab
+
+#define FLASH_SR_OFFSET 0x0c
+#define FLASH_SR_BSY_BIT 0
+#define FLASH_SR_PGERR_BIT 2
+#define FLASH_SR_WRPRTERR_BIT 4
+#define FLASH_SR_EOP_BIT 5
+#define FLASH_SR_ERR_MASK (BIT(FLASH_SR_PGERR_BIT) | BIT(FLASH_SR_WRPRTERR_BIT))
+
+#define FLASH_CR_OFFSET 0x10
+#define FLASH_CR_PG_BIT 0
+#define FLASH_CR_PER_BIT 1
+#define FLASH_CR_MER_BIT 2
+#define FLASH_CR_OPTPG_BIT 4
+#define FLASH_CR_OPTER_BIT 5
+#define FLASH_CR_STRT_BIT 6
+#define FLASH_CR_LOCK_BIT 7
+#define FLASH_CR_OPTWRE_BIT 9
+#define FLASH_CR_ERRIE_BIT 10
+#define FLASH_CR_EOPIE_BIT 12
+#define FLASH_CR_WRITE_MASK 0x00001677
+
+#define FLASH_AR_OFFSET 0x14
+
+#define FLASH_OBR_OFFSET 0x1c
+#define FLASH_OBR_RESET_VALUE 0x03fffffc
+
+#define FLASH_WRPR_OFFSET 0x20
+
+/* The erased state of a Flash half-word */
+#define FLASH_ERASED_HALFWORD 0xffff
+
+/* Progress through the FLASH_KEYR unlock sequence */
+typedef enum {
+    FLASH_KEY_NONE,
+    FLASH_KEY_KEY1,
+    /* A wrong key was written: the FPEC stays locked until reset */
+    FLASH_KEY_LOCKED_OUT
+} Stm32FlashKeyState;
+
+struct Stm32Flash {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    uint32_t size;
+    uint32_t page_size;
+    /* Name of the Flash RAM block, which must be unique when there is more
+     * than one STM32 */
+    char *ram_name;
+    /* ACR has the STM32F4 layout */
+    bool f4;
+
+    /* Private */
+    MemoryRegion iomem;
+    /* The Flash memory.  This is a ROM device: reads and instruction
+     * fetches go straight to host memory, and only writes (which are
+     * program operations) come through stm32_flash_mem_write. */
+    MemoryRegion flash;
+
+    uint32_t
+        FLASH_ACR,
+        FLASH_SR,
+        FLASH_CR,
+        FLASH_AR;
+
+    Stm32FlashKeyState key_state;
+    Stm32FlashKeyState opt_key_state;
+
+    /* The CPU which pays for the wait states, if they are modelled */
+    ARMCPU *cpu;
+    /* The CPU whose translated code may follow branches into the Flash */
+    ARMCPU *trace_cpu;
+
+    qemu_irq irq;
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_flash_update_irq(Stm32Flash *s)
+{
+    int level =
+        ((s->FLASH_CR & BIT(FLASH_CR_EOPIE_BIT)) &&
+         (s->FLASH_SR & BIT(FLASH_SR_EOP_BIT))) ||
+        ((s->FLASH_CR & BIT(FLASH_CR_ERRIE_BIT)) &&
+         (s->FLASH_SR & FLASH_SR_ERR_MASK));
+
+    qemu_set_irq(s->irq, level);
+}
+
+/* Tells the CPU how long its fetches from the Flash take.  On the F4 the
+ * ART accelerator is assumed to hit every time once it is enabled. */
+static void stm32_flash_update_wait_states(Stm32Flash *s)
+{
+    if(!s->cpu) {
+        return;
+    }
+
+    if(s->f4) {
+        if(s->FLASH_ACR & BIT(FLASH_ACR_F4_ICEN_BIT)) {
+            arm_cpu_set_fetch_wait_states(s->cpu, 0, false);
+        } else {
+            arm_cpu_set_fetch_wait_states(s->cpu,
+                    s->FLASH_ACR & FLASH_ACR_F4_LATENCY_MASK,
+                    s->FLASH_ACR & BIT(FLASH_ACR_F4_PRFTEN_BIT));
+        }
+    } else {
+        arm_cpu_set_fetch_wait_states(s->cpu,
+                s->FLASH_ACR & FLASH_ACR_LATENCY_MASK,
+                s->FLASH_ACR & BIT(FLASH_ACR_PRFTBS_BIT));
+    }
+}
+
+/* The translated code may only follow branches into the Flash while it is
+ * locked, as the blocks which do are not found by address once it changes.
+ * Unlocking it throws them away. */
+static void stm32_flash_update_traces(Stm32Flash *s)
+{
+    if (s->trace_cpu) {
+        arm_cpu_set_trace_enabled(s->trace_cpu,
+                                  s->FLASH_CR & BIT(FLASH_CR_LOCK_BIT));
+    }
+}
+
+/* Called after the Flash contents in [offset, offset + len) have changed.
+ * Only the translated code from that range is thrown away; the rest of the
+ * Flash (and the rest of the translation cache) is left alone. */
+static void stm32_flash_changed(Stm32Flash *s, uint32_t offset, uint32_t len)
+{
+    ram_addr_t addr = memory_region_get_ram_addr(&s->flash) + offset;
+
+    tb_invalidate_phys_range(addr, addr + len, 0);
+    memory_region_set_dirty(&s->flash, offset, len);
+}
+
+/* Converts a Flash address as written to FLASH_AR (either in the Flash
+ * itself or in its boot alias at 0) into an offset in the Flash.  Returns
+ * -1 if the address is outside the Flash. */
+static int64_t stm32_flash_offset(Stm32Flash *s, uint32_t addr)
+{
+    if (addr >= FLASH_BASE_ADDR) {
+        addr -= FLASH_BASE_ADDR;
+    }
+    return addr < s->size ? addr : -1;
+}
+
+static void stm32_flash_erase(Stm32Flash *s, uint32_t offset, uint32_t len)
+{
+    uint8_t *ptr = memory_region_get_ram_ptr(&s->flash);
+
+    memset(ptr + offset, 0xff, len);
+    stm32_flash_changed(s, offset, len);
+}
+
+/* Runs the erase operation selected in FLASH_CR when STRT is set.  The
+ * operation completes instantly, so BSY is never seen set. */
+static void stm32_flash_start(Stm32Flash *s)
+{
+    int64_t offset;
+
+    if (s->FLASH_CR & BIT(FLASH_CR_MER_BIT)) {
+        stm32_flash_erase(s, 0, s->size);
+    } else if (s->FLASH_CR & BIT(FLASH_CR_PER_BIT)) {
+        offset = stm32_flash_offset(s, s->FLASH_AR);
+        if (offset < 0) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "stm32_flash: page erase outside Flash (0x%08x)\n",
+                          s->FLASH_AR);
+            return;
+        }
+        offset &= ~(int64_t)(s->page_size - 1);
+        stm32_flash_erase(s, offset,
+                          MIN(s->page_size, s->size - (uint32_t)offset));
+    } else if (s->FLASH_CR & (BIT(FLASH_CR_OPTER_BIT) |
+                              BIT(FLASH_CR_OPTPG_BIT))) {
+        qemu_log_mask(LOG_UNIMP,
+                      "stm32_flash: option byte programming not supported\n");
+        return;
+    } else {
+        return;
+    }
+    s->FLASH_SR |= BIT(FLASH_SR_EOP_BIT);
+}
+
+
+
+
+/* FLASH MEMORY ACCESS */
+
+static uint64_t stm32_flash_mem_read(void *opaque, hwaddr offset,
+                                     unsigned size)
+{
+    Stm32Flash *s = (Stm32Flash *)opaque;
+    uint8_t *ptr = (uint8_t *)memory_region_get_ram_ptr(&s->flash) + offset;
+
+    /* The region is always in ROMD mode, so this should not be called. */
+    switch (size) {
+    case 1:
+        return ldub_p(ptr);
+    case 2:
+        return lduw_le_p(ptr);
+    default:
+        return ldl_le_p(ptr);
+    }
+}
+
+/* A write to the Flash while PG is set programs one half-word (word writes
+ * are handled as two consecutive half-word programs). */
+static void stm32_flash_mem_write(void *opaque, hwaddr offset,
+                                  uint64_t value, unsigned size)
+{
+    Stm32Flash *s = (Stm32Flash *)opaque;
+    uint8_t *ptr = memory_region_get_ram_ptr(&s->flash);
+    uint16_t old, new;
+    unsigned i;
+
+    if ((s->FLASH_CR & BIT(FLASH_CR_LOCK_BIT)) ||
+        !(s->FLASH_CR & BIT(FLASH_CR_PG_BIT))) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "stm32_flash: write to Flash at 0x%x while not "
+                      "programming\n", (int)offset);
+        return;
+    }
+    if (size == 1 || (offset & 1)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "stm32_flash: Flash must be programmed by half-words "
+                      "(0x%x, size %u)\n", (int)offset, size);
+        return;
+    }
+
+    /* A half-word which has already been programmed can only be
+     * overwritten with zero.  Otherwise the program operation fails with
+     * PGERR, without EOP and without touching the Flash. */
+    for (i = 0; i < size; i += 2) {
+        old = lduw_le_p(ptr + offset + i);
+        new = value >> (i * 8);
+        if (old != FLASH_ERASED_HALFWORD && new != 0) {
+            s->FLASH_SR |= BIT(FLASH_SR_PGERR_BIT);
+            stm32_flash_update_irq(s);
+            return;
+        }
+    }
+
+    for (i = 0; i < size; i += 2) {
+        stw_le_p(ptr + offset + i, value >> (i * 8));
+    }
+    stm32_flash_changed(s, offset, size);
+
+    s->FLASH_SR |= BIT(FLASH_SR_EOP_BIT);
+    stm32_flash_update_irq(s);
+}
+
+static const MemoryRegionOps stm32_flash_mem_ops = {
+    .read = stm32_flash_mem_read,
+    .write = stm32_flash_mem_write,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_flash_write_KEYR(Stm32Flash *s, uint32_t value,
+                                   Stm32FlashKeyState *key_state,
+                                   uint32_t unlock_bit, bool set_bit)
+{
+    switch (*key_state) {
+    case FLASH_KEY_NONE:
+        if (value == FLASH_KEY1) {
+            *key_state = FLASH_KEY_KEY1;
+            return;
+        }
+        break;
+    case FLASH_KEY_KEY1:
+        if (value == FLASH_KEY2) {
+            *key_state = FLASH_KEY_NONE;
+            if (set_bit) {
+                s->FLASH_CR |= BIT(unlock_bit);
+            } else {
+                s->FLASH_CR &= ~BIT(unlock_bit);
+            }
+            stm32_flash_update_traces(s);
+            return;
+        }
+        break;
+    case FLASH_KEY_LOCKED_OUT:
+        break;
+    }
+
+    /* On the real hardware a wrong key causes a bus error, and the FPEC
+     * stays locked until the next reset. */
+    qemu_log_mask(LOG_GUEST_ERROR,
+                  "stm32_flash: bad key sequence, locked until reset\n");
+    *key_state = FLASH_KEY_LOCKED_OUT;
+}
+
+static void stm32_flash_write_CR(Stm32Flash *s, uint32_t value)
+{
+    if (s->FLASH_CR & BIT(FLASH_CR_LOCK_BIT)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "stm32_flash: FLASH_CR written while locked\n");
+        return;
+    }
+
+    /* OPTWRE can only be set through FLASH_OPTKEYR, LOCK can only be set. */
+    s->FLASH_CR = (value & FLASH_CR_WRITE_MASK &
+                   ~(BIT(FLASH_CR_OPTWRE_BIT) | BIT(FLASH_CR_STRT_BIT))) |
+                  (s->FLASH_CR & value & BIT(FLASH_CR_OPTWRE_BIT));
+    if (value & BIT(FLASH_CR_LOCK_BIT)) {
+        s->FLASH_CR |= BIT(FLASH_CR_LOCK_BIT);
+        s->key_state = FLASH_KEY_NONE;
+        stm32_flash_update_traces(s);
+    }
+    if (value & BIT(FLASH_CR_STRT_BIT)) {
+        stm32_flash_start(s);
+    }
+    stm32_flash_update_irq(s);
+}
+
+static uint64_t stm32_flash_read(void *opaque, hwaddr offset,
+                                 unsigned size)
+{
+    Stm32Flash *s = (Stm32Flash *)opaque;
+
+    switch (offset) {
+        case FLASH_ACR_OFFSET:
+            return s->FLASH_ACR;
+        case FLASH_KEYR_OFFSET:
+        case FLASH_OPTKEYR_OFFSET:
+        case FLASH_AR_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+        case FLASH_SR_OFFSET:
+            return s->FLASH_SR;
+        case FLASH_CR_OFFSET:
+            return s->FLASH_CR;
+        case FLASH_OBR_OFFSET:
+            return FLASH_OBR_RESET_VALUE;
+        case FLASH_WRPR_OFFSET:
+            /* No pages are write protected */
+            return 0xffffffff;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_flash_write(void *opaque, hwaddr offset,
+                              uint64_t value, unsigned size)
+{
+    Stm32Flash *s = (Stm32Flash *)opaque;
+
+    switch (offset) {
+        case FLASH_ACR_OFFSET:
+            if(s->f4) {
+                s->FLASH_ACR = value & FLASH_ACR_F4_WRITE_MASK;
+            } else {
+                /* The prefetch buffer status follows the enable bit at
+                 * once */
+                s->FLASH_ACR = (value & FLASH_ACR_WRITE_MASK) |
+                               (((value >> FLASH_ACR_PRFTBE_BIT) & 1) <<
+                                FLASH_ACR_PRFTBS_BIT);
+            }
+            stm32_flash_update_wait_states(s);
+            break;
+        case FLASH_KEYR_OFFSET:
+            stm32_flash_write_KEYR(s, value, &s->key_state,
+                                   FLASH_CR_LOCK_BIT, false);
+            break;
+        case FLASH_OPTKEYR_OFFSET:
+            stm32_flash_write_KEYR(s, value, &s->opt_key_state,
+                                   FLASH_CR_OPTWRE_BIT, true);
+            break;
+        case FLASH_SR_OFFSET:
+            /* EOP, WRPRTERR and PGERR are cleared by writing 1 */
+            s->FLASH_SR &= ~(value & (FLASH_SR_ERR_MASK |
+                                      BIT(FLASH_SR_EOP_BIT)));
+            stm32_flash_update_irq(s);
+            break;
+        case FLASH_CR_OFFSET:
+            stm32_flash_write_CR(s, value);
+            break;
+        case FLASH_AR_OFFSET:
+            s->FLASH_AR = value;
+            break;
+        case FLASH_OBR_OFFSET:
+        case FLASH_WRPR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_flash_ops = {
+    .read = stm32_flash_read,
+    .write = stm32_flash_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_flash_reset(DeviceState *dev)
+{
+    Stm32Flash *s = STM32_FLASH(dev);
+
+    s->FLASH_ACR = s->f4 ? 0x00000000 : 0x00000030;
+    s->FLASH_SR = 0x00000000;
+    s->FLASH_CR = BIT(FLASH_CR_LOCK_BIT);
+    s->FLASH_AR = 0x00000000;
+    s->key_state = FLASH_KEY_NONE;
+    s->opt_key_state = FLASH_KEY_NONE;
+    stm32_flash_update_irq(s);
+    stm32_flash_update_wait_states(s);
+    stm32_flash_update_traces(s);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+void stm32_flash_connect_cpu(Stm32Flash *s, ARMCPU *cpu, uint32_t base)
+{
+    uint32_t line_size = s->f4 ? FLASH_F4_LINE_SIZE : FLASH_LINE_SIZE;
+
+    s->cpu = cpu;
+    arm_cpu_add_fetch_region(cpu, 0, s->size, line_size);
+    arm_cpu_add_fetch_region(cpu, base, s->size, line_size);
+    stm32_flash_update_wait_states(s);
+}
+
+void stm32_flash_connect_traces(Stm32Flash *s, ARMCPU *cpu, uint32_t base)
+{
+    s->trace_cpu = cpu;
+    arm_cpu_add_trace_region(cpu, 0, s->size);
+    arm_cpu_add_trace_region(cpu, base, s->size);
+    stm32_flash_update_traces(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_flash_init(SysBusDevice *dev)
+{
+    Stm32Flash *s = STM32_FLASH(dev);
+
+    if (s->page_size == 0 || (s->page_size & (s->page_size - 1))) {
+        hw_error("stm32_flash: page size must be a power of 2");
+    }
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_flash_ops, s,
+            "flash-if", STM32_PERIPH_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    memory_region_init_rom_device(&s->flash, OBJECT(s), &stm32_flash_mem_ops,
+                                  s, s->ram_name ? s->ram_name : "stm32.flash",
+                                  s->size);
+    /* Start out erased, like a blank device. */
+    memset(memory_region_get_ram_ptr(&s->flash), 0xff, s->size);
+    vmstate_register_ram(&s->flash, DEVICE(s));
+    /* Guest writes come through stm32_flash_mem_write, which invalidates
+     * the translated code itself. */
+    memory_region_set_rom_exec(&s->flash, true);
+    sysbus_init_mmio(dev, &s->flash);
+
+    sysbus_init_irq(dev, &s->irq);
+
+    return 0;
+}
+
+static int stm32_flash_post_load(void *opaque, int version_id)
+{
+    stm32_flash_update_wait_states((Stm32Flash *)opaque);
+    stm32_flash_update_traces((Stm32Flash *)opaque);
+    return 0;
+}
+
+/* The Flash contents are migrated as RAM (see vmstate_register_ram) */
+static const VMStateDescription vmstate_stm32_flash = {
+    .name = TYPE_STM32_FLASH,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_flash_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(FLASH_ACR, Stm32Flash),
+        VMSTATE_UINT32(FLASH_SR, Stm32Flash),
+        VMSTATE_UINT32(FLASH_CR, Stm32Flash),
+        VMSTATE_UINT32(FLASH_AR, Stm32Flash),
+        VMSTATE_UINT32(key_state, Stm32Flash),
+        VMSTATE_UINT32(opt_key_state, Stm32Flash),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_flash_properties[] = {
+    DEFINE_PROP_UINT32("size", Stm32Flash, size, 0x20000),
+    DEFINE_PROP_UINT32("page_size", Stm32Flash, page_size, 0x400),
+    DEFINE_PROP_STRING("ram_name", Stm32Flash, ram_name),
+    DEFINE_PROP_BOOL("f4", Stm32Flash, f4, false),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_flash_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_flash_init;
+    dc->reset = stm32_flash_reset;
+    dc->vmsd = &vmstate_stm32_flash;
+    dc->props = stm32_flash_properties;
+}
+
+static TypeInfo stm32_flash_info = {
+    .name  = TYPE_STM32_FLASH,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Flash),
+    .class_init = stm32_flash_class_init
+};
+
+static void stm32_flash_register_types(void)
+{
+    type_register_static(&stm32_flash_info);
+}
+
+type_init(stm32_flash_register_types)
@@ -0,0 +1,328 @@
+/*
+ * STM32 Microcontroller FSMC (Flexible static memory controller) module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "hw/block/flash.h"
+#include "sysemu/blockdev.h"
+#include "qemu/bitops.h"
+#include "qemu-common.h"
+#include "qemu/log.h"
+
+/* Only bank 1 (NOR/PSRAM), with its four 64 MB sub-banks NE1 to NE4, is
+ * implemented.  What is connected to a sub-bank is a MemoryRegion at the
+ * start of its window, which is only mapped while BCRx.MBKEN is set:
+ *  - External SRAM (the neN_sram properties) is RAM, so the guest reaches
+ *    it through the TLB like the internal SRAM.  Clearing BCRx.WREN makes
+ *    it read only.
+ *  - A NOR Flash (stm32_fsmc_attach_nor, from -drive if=pflash) is an AMD
+ *    command set CFI Flash, which reads like ROM except while it is being
+ *    programmed.
+ *  - Anything else, e.g. the registers of an LCD controller, is attached by
+ *    the board with stm32_fsmc_attach, and is MMIO.
+ * The timing registers are kept but have no effect, and the FSMC clock is
+ * not modelled.  The NAND and PC Card banks (2 to 4) are not implemented.
+ */
+
+/* DEFINITIONS */
+
+#define FSMC_BCR_OFFSET(n) ((n) * 8)
+#define FSMC_BTR_OFFSET(n) ((n) * 8 + 4)
+#define FSMC_BWTR_OFFSET(n) (0x104 + (n) * 8)
+
+#define FSMC_BCR_MBKEN_BIT 0
+#define FSMC_BCR_WREN_BIT 12
+/* Bit 7 is reserved and reads as 1 */
+#define FSMC_BCR_MASK 0x0008ff7f
+#define FSMC_BCR_RESERVED 0x00000080
+#define FSMC_BCR1_RESET 0x000030db
+#define FSMC_BCR_RESET 0x000030d2
+#define FSMC_BTR_MASK 0x3fffffff
+#define FSMC_BTR_RESET 0x0fffffff
+#define FSMC_BWTR_MASK 0x3ff0ffff
+#define FSMC_BWTR_RESET 0x0fffffff
+
+/* The 16 bit NOR Flash has 64 KB sectors */
+#define FSMC_NOR_SECTOR_SIZE 0x10000
+
+struct Stm32Fsmc {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    uint32_t sram_size[STM32_FSMC_BANK_COUNT];
+
+    /* Private */
+    char *path;
+    MemoryRegion iomem;
+    /* The window of each sub-bank, mapped by the microcontroller */
+    MemoryRegion bank[STM32_FSMC_BANK_COUNT];
+    MemoryRegion sram[STM32_FSMC_BANK_COUNT];
+    /* What is connected to each sub-bank, if anything */
+    MemoryRegion *mem[STM32_FSMC_BANK_COUNT];
+
+    uint32_t
+        FSMC_BCR[STM32_FSMC_BANK_COUNT],
+        FSMC_BTR[STM32_FSMC_BANK_COUNT],
+        FSMC_BWTR[STM32_FSMC_BANK_COUNT];
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_fsmc_update_bank(Stm32Fsmc *s, int n)
+{
+    uint32_t bcr = s->FSMC_BCR[n];
+
+    memory_region_set_enabled(&s->bank[n],
+                              bcr & BIT(FSMC_BCR_MBKEN_BIT));
+    if(s->sram_size[n]) {
+        memory_region_set_readonly(&s->sram[n],
+                                   !(bcr & BIT(FSMC_BCR_WREN_BIT)));
+    }
+}
+
+static void stm32_fsmc_attach_mem(Stm32Fsmc *s, int n, MemoryRegion *mr)
+{
+    if(s->mem[n]) {
+        hw_error("stm32-fsmc: NE%d already has a memory", n + 1);
+    }
+    s->mem[n] = mr;
+    memory_region_add_subregion(&s->bank[n], 0, mr);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint64_t stm32_fsmc_read(void *opaque, hwaddr offset,
+                          unsigned size)
+{
+    Stm32Fsmc *s = (Stm32Fsmc *)opaque;
+    int n;
+
+    for(n = 0; n < STM32_FSMC_BANK_COUNT; n++) {
+        if(offset == FSMC_BCR_OFFSET(n)) {
+            return s->FSMC_BCR[n];
+        } else if(offset == FSMC_BTR_OFFSET(n)) {
+            return s->FSMC_BTR[n];
+        } else if(offset == FSMC_BWTR_OFFSET(n)) {
+            return s->FSMC_BWTR[n];
+        }
+    }
+    STM32_BAD_REG(offset, size);
+    return 0;
+}
+
+static void stm32_fsmc_write(void *opaque, hwaddr offset,
+                       uint64_t value, unsigned size)
+{
+    Stm32Fsmc *s = (Stm32Fsmc *)opaque;
+    int n;
+
+    for(n = 0; n < STM32_FSMC_BANK_COUNT; n++) {
+        if(offset == FSMC_BCR_OFFSET(n)) {
+            s->FSMC_BCR[n] = (value & FSMC_BCR_MASK) | FSMC_BCR_RESERVED;
+            stm32_fsmc_update_bank(s, n);
+            return;
+        } else if(offset == FSMC_BTR_OFFSET(n)) {
+            s->FSMC_BTR[n] = value & FSMC_BTR_MASK;
+            return;
+        } else if(offset == FSMC_BWTR_OFFSET(n)) {
+            s->FSMC_BWTR[n] = value & FSMC_BWTR_MASK;
+            return;
+        }
+    }
+    STM32_BAD_REG(offset, size);
+}
+
+static const MemoryRegionOps stm32_fsmc_ops = {
+    .read = stm32_fsmc_read,
+    .write = stm32_fsmc_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_fsmc_reset(DeviceState *dev)
+{
+    Stm32Fsmc *s = STM32_FSMC(dev);
+    int n;
+
+    /* NE1 is enabled out of reset, so that the core can boot from a NOR
+     * Flash there.  The contents of the external SRAM are kept, as they
+     * would be on a board. */
+    for(n = 0; n < STM32_FSMC_BANK_COUNT; n++) {
+        s->FSMC_BCR[n] = n == 0 ? FSMC_BCR1_RESET : FSMC_BCR_RESET;
+        s->FSMC_BTR[n] = FSMC_BTR_RESET;
+        s->FSMC_BWTR[n] = FSMC_BWTR_RESET;
+        stm32_fsmc_update_bank(s, n);
+    }
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+void stm32_fsmc_attach(Stm32Fsmc *s, int bank, MemoryRegion *mr)
+{
+    assert(bank >= 1 && bank <= STM32_FSMC_BANK_COUNT);
+    stm32_fsmc_attach_mem(s, bank - 1, mr);
+}
+
+void stm32_fsmc_attach_nor(Stm32Fsmc *s, int bank, BlockDriverState *bs)
+{
+    DeviceState *dev;
+    int64_t size = bdrv_getlength(bs);
+    char *name;
+
+    assert(bank >= 1 && bank <= STM32_FSMC_BANK_COUNT);
+    if(size <= 0 || size % FSMC_NOR_SECTOR_SIZE ||
+       size > STM32_FSMC_BANK_SIZE) {
+        hw_error("stm32-fsmc: the NOR Flash of NE%d must be a multiple of "
+                 "64 KB, up to 64 MB", bank);
+    }
+    /* A Spansion S29GL, 16 bits wide.  The path keeps the names of several
+     * microcontrollers apart. */
+    name = g_strdup_printf("%s.ne%d", s->path, bank);
+    dev = qdev_create(NULL, "cfi.pflash02");
+    qdev_prop_set_drive_nofail(dev, "drive", bs);
+    qdev_prop_set_uint32(dev, "num-blocks", size / FSMC_NOR_SECTOR_SIZE);
+    qdev_prop_set_uint32(dev, "sector-length", FSMC_NOR_SECTOR_SIZE);
+    qdev_prop_set_uint8(dev, "width", 2);
+    qdev_prop_set_uint8(dev, "mappings", 1);
+    qdev_prop_set_uint8(dev, "big-endian", 0);
+    qdev_prop_set_uint16(dev, "id0", 0x0001);
+    qdev_prop_set_uint16(dev, "id1", 0x227e);
+    qdev_prop_set_uint16(dev, "id2", 0x2221);
+    qdev_prop_set_uint16(dev, "id3", 0x2201);
+    qdev_prop_set_uint16(dev, "unlock-addr0", 0x555);
+    qdev_prop_set_uint16(dev, "unlock-addr1", 0x2aa);
+    qdev_prop_set_string(dev, "name", name);
+    g_free(name);
+    name = g_strdup_printf("nor[%d]", bank);
+    object_property_add_child(OBJECT(s), name, OBJECT(dev), NULL);
+    g_free(name);
+    qdev_init_nofail(dev);
+    stm32_fsmc_attach_mem(s, bank - 1,
+                          sysbus_mmio_get_region(SYS_BUS_DEVICE(dev), 0));
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_fsmc_init(SysBusDevice *dev)
+{
+    Stm32Fsmc *s = STM32_FSMC(dev);
+    char *name;
+    int n;
+
+    s->path = object_get_canonical_path(OBJECT(s));
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_fsmc_ops, s,
+                          "fsmc", 0x1000);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    for(n = 0; n < STM32_FSMC_BANK_COUNT; n++) {
+        name = g_strdup_printf("fsmc.ne%d", n + 1);
+        memory_region_init(&s->bank[n], OBJECT(s), name,
+                           STM32_FSMC_BANK_SIZE);
+        g_free(name);
+        sysbus_init_mmio(dev, &s->bank[n]);
+
+        if(s->sram_size[n]) {
+            if(s->sram_size[n] > STM32_FSMC_BANK_SIZE) {
+                hw_error("stm32-fsmc: the SRAM of NE%d is larger than 64 MB",
+                         n + 1);
+            }
+            /* The path keeps the names of several microcontrollers apart */
+            name = g_strdup_printf("%s.ne%d", s->path, n + 1);
+            memory_region_init_ram(&s->sram[n], OBJECT(s), name,
+                                   s->sram_size[n]);
+            vmstate_register_ram_global(&s->sram[n]);
+            stm32_fsmc_attach_mem(s, n, &s->sram[n]);
+            g_free(name);
+        }
+    }
+
+    return 0;
+}
+
+static int stm32_fsmc_post_load(void *opaque, int version_id)
+{
+    Stm32Fsmc *s = (Stm32Fsmc *)opaque;
+    int n;
+
+    for(n = 0; n < STM32_FSMC_BANK_COUNT; n++) {
+        stm32_fsmc_update_bank(s, n);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_fsmc = {
+    .name = TYPE_STM32_FSMC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_fsmc_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(FSMC_BCR, Stm32Fsmc, STM32_FSMC_BANK_COUNT),
+        VMSTATE_UINT32_ARRAY(FSMC_BTR, Stm32Fsmc, STM32_FSMC_BANK_COUNT),
+        VMSTATE_UINT32_ARRAY(FSMC_BWTR, Stm32Fsmc, STM32_FSMC_BANK_COUNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_fsmc_properties[] = {
+    DEFINE_PROP_UINT32("ne1_sram", Stm32Fsmc, sram_size[0], 0),
+    DEFINE_PROP_UINT32("ne2_sram", Stm32Fsmc, sram_size[1], 0),
+    DEFINE_PROP_UINT32("ne3_sram", Stm32Fsmc, sram_size[2], 0),
+    DEFINE_PROP_UINT32("ne4_sram", Stm32Fsmc, sram_size[3], 0),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_fsmc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_fsmc_init;
+    dc->reset = stm32_fsmc_reset;
+    dc->vmsd = &vmstate_stm32_fsmc;
+    dc->props = stm32_fsmc_properties;
+}
+
+static TypeInfo stm32_fsmc_info = {
+    .name  = TYPE_STM32_FSMC,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Fsmc),
+    .class_init = stm32_fsmc_class_init
+};
+
+static void stm32_fsmc_register_types(void)
+{
+    type_register_static(&stm32_fsmc_info);
+}
+
+type_init(stm32_fsmc_register_types)
@@ -0,0 +1,270 @@
+/*
+ * STM32 Microcontroller fork server for fuzzing
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#include "hw/arm/stm32.h"
+#include "exec/exec-all.h"
+#include "sysemu/cpus.h"
+#include "sysemu/sysemu.h"
+
+/* A block of registers in reserved address space lets the firmware under
+ * test take its input from the fuzzer, the way afl-qemu does for Linux
+ * programs.  The firmware boots, sets itself up, then writes
+ * STM32_FUZZ_CTRL_START to CTRL and polls STATUS until READY is set.  At
+ * that point the machine is paused and, run under afl-fuzz, becomes a fork
+ * server: for every test case it forks a child, which inherits the RAM,
+ * the devices and the translated code as they are, loads the test case and
+ * resumes.  The firmware then reads LEN bytes from the INPUT window, and
+ * ends the run by writing the exit status to EXIT, or reports a crash
+ * (e.g. from its fault handlers) by writing to CRASH, which aborts.  A
+ * semihosting exit ends the run too.  afl-fuzz kills the runs which take
+ * too long itself.
+ *
+ * Without afl-fuzz, the test case is loaded at START and the run is a
+ * normal one, which replays a crash found before.  The test case is the
+ * file given, or is read from the start of stdin, where afl-fuzz puts it
+ * without @@.
+ *
+ * Under afl-fuzz, tb_coverage_map is the fuzzer's shared memory, so every
+ * block counts the edge from the previous one there.  The blocks which are
+ * first translated in a child are translated again by the next child, as
+ * the parent never sees them. */
+
+/* DEFINITIONS */
+
+#define STM32_FUZZ_BASE 0x4ff00000
+#define STM32_FUZZ_SIZE 0x20000
+
+#define STM32_FUZZ_CTRL_OFFSET 0x00
+#define STM32_FUZZ_CTRL_START 1
+#define STM32_FUZZ_STATUS_OFFSET 0x04
+#define STM32_FUZZ_STATUS_READY BIT(0)
+#define STM32_FUZZ_LEN_OFFSET 0x08
+#define STM32_FUZZ_EXIT_OFFSET 0x0c
+#define STM32_FUZZ_CRASH_OFFSET 0x10
+#define STM32_FUZZ_INPUT_OFFSET 0x10000
+#define STM32_FUZZ_INPUT_MAX 0x10000
+
+/* The file descriptors afl-fuzz talks to the fork server on */
+#define STM32_FUZZ_FORKSRV_FD 198
+
+typedef struct Stm32Fuzz {
+    MemoryRegion iomem;
+    QEMUBH *start_bh;
+    char *input_file;
+
+    bool started;
+    bool ready;
+    uint32_t len;
+    uint8_t input[STM32_FUZZ_INPUT_MAX];
+} Stm32Fuzz;
+
+
+
+
+/* TEST CASE */
+
+static void stm32_fuzz_load(Stm32Fuzz *f)
+{
+    int fd = 0;
+    ssize_t n;
+
+    if(f->input_file) {
+        fd = open(f->input_file, O_RDONLY);
+        if(fd < 0) {
+            hw_error("Fuzz: cannot open %s: %s", f->input_file,
+                     strerror(errno));
+        }
+    } else if(lseek(0, 0, SEEK_SET) < 0 && errno != ESPIPE) {
+        hw_error("Fuzz: cannot rewind stdin: %s", strerror(errno));
+    }
+
+    f->len = 0;
+    do {
+        n = read(fd, f->input + f->len, STM32_FUZZ_INPUT_MAX - f->len);
+        if(n > 0) {
+            f->len += n;
+        }
+    } while(f->len < STM32_FUZZ_INPUT_MAX &&
+            (n > 0 || (n < 0 && errno == EINTR)));
+    if(n < 0) {
+        hw_error("Fuzz: cannot read the test case: %s", strerror(errno));
+    }
+    if(fd) {
+        close(fd);
+    }
+
+    memset(f->input + f->len, 0, STM32_FUZZ_INPUT_MAX - f->len);
+    tb_coverage_prev = 0;
+    f->ready = true;
+}
+
+/* Returns in the child, with the CPU stopped.  The parent only leaves
+ * when afl-fuzz goes away. */
+static void stm32_fuzz_fork_server(void)
+{
+    uint32_t word = 0;
+    int status;
+    pid_t pid;
+
+    for(;;) {
+        if(read(STM32_FUZZ_FORKSRV_FD, &word, 4) != 4) {
+            exit(0);
+        }
+        pid = fork();
+        if(pid < 0) {
+            hw_error("Fuzz: cannot fork: %s", strerror(errno));
+        }
+        if(pid == 0) {
+            close(STM32_FUZZ_FORKSRV_FD);
+            close(STM32_FUZZ_FORKSRV_FD + 1);
+            qemu_tcg_cpus_after_fork();
+            return;
+        }
+        if(write(STM32_FUZZ_FORKSRV_FD + 1, &pid, 4) != 4) {
+            exit(1);
+        }
+        while(waitpid(pid, &status, 0) < 0) {
+            if(errno != EINTR) {
+                hw_error("Fuzz: waitpid failed: %s", strerror(errno));
+            }
+        }
+        if(write(STM32_FUZZ_FORKSRV_FD + 1, &status, 4) != 4) {
+            exit(1);
+        }
+    }
+}
+
+/* Runs from the main loop after the firmware wrote START, so that the
+ * CPU thread can be stopped before the fork. */
+static void stm32_fuzz_start(void *opaque)
+{
+    Stm32Fuzz *f = opaque;
+    uint32_t hello = 0;
+
+    /* afl-fuzz waits for 4 bytes before it sends the first test case */
+    if(write(STM32_FUZZ_FORKSRV_FD + 1, &hello, 4) == 4) {
+        vm_stop(RUN_STATE_PAUSED);
+        stm32_fuzz_fork_server();
+        stm32_fuzz_load(f);
+        vm_start();
+    } else {
+        stm32_fuzz_load(f);
+    }
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint64_t stm32_fuzz_read(void *opaque, hwaddr offset, unsigned size)
+{
+    Stm32Fuzz *f = opaque;
+    uint64_t value = 0;
+    unsigned i;
+
+    if(offset >= STM32_FUZZ_INPUT_OFFSET) {
+        offset -= STM32_FUZZ_INPUT_OFFSET;
+        for(i = 0; i < size && offset + i < STM32_FUZZ_INPUT_MAX; i++) {
+            value |= (uint64_t)f->input[offset + i] << (8 * i);
+        }
+        return value;
+    }
+
+    switch(offset) {
+        case STM32_FUZZ_STATUS_OFFSET:
+            return f->ready ? STM32_FUZZ_STATUS_READY : 0;
+        case STM32_FUZZ_LEN_OFFSET:
+            return f->len;
+        default:
+            return 0;
+    }
+}
+
+static void stm32_fuzz_write(void *opaque, hwaddr offset, uint64_t value,
+                             unsigned size)
+{
+    Stm32Fuzz *f = opaque;
+
+    switch(offset) {
+        case STM32_FUZZ_CTRL_OFFSET:
+            /* Only the first START forks */
+            if((value & STM32_FUZZ_CTRL_START) && !f->started) {
+                f->started = true;
+                qemu_bh_schedule(f->start_bh);
+            }
+            break;
+        case STM32_FUZZ_EXIT_OFFSET:
+            exit(value & 0xff);
+            break;
+        case STM32_FUZZ_CRASH_OFFSET:
+            fprintf(stderr, "Fuzz: the firmware reported a crash (0x%08x)\n",
+                    (uint32_t)value);
+            abort();
+            break;
+        default:
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_fuzz_ops = {
+    .read = stm32_fuzz_read,
+    .write = stm32_fuzz_write,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+
+
+
+/* INITIALIZATION */
+
+void stm32_fuzz_init(MemoryRegion *system_memory, const char *input_file)
+{
+    static bool created;
+    Stm32Fuzz *f;
+    char *shm_id;
+    void *map;
+
+    if(created) {
+        hw_error("Fuzz: only one microcontroller can be fuzzed");
+    }
+    created = true;
+
+    f = g_new0(Stm32Fuzz, 1);
+    f->input_file = g_strdup(input_file);
+    f->start_bh = qemu_bh_new(stm32_fuzz_start, f);
+    memory_region_init_io(&f->iomem, NULL, &stm32_fuzz_ops, f, "stm32-fuzz",
+                          STM32_FUZZ_SIZE);
+    memory_region_add_subregion(system_memory, STM32_FUZZ_BASE, &f->iomem);
+
+    /* Set by afl-fuzz, which clears the map before every run */
+    shm_id = getenv("__AFL_SHM_ID");
+    if(shm_id) {
+        map = shmat(atoi(shm_id), NULL, 0);
+        if(map == (void *)-1) {
+            hw_error("Fuzz: cannot attach the coverage map: %s",
+                     strerror(errno));
+        }
+        tb_coverage_map = map;
+    }
+}
@@ -29,6 +29,7 @@
 #include "ui/console.h"
 #include "sysemu/sysemu.h"
 #include "hw/boards.h"
+#include "qapi-event.h"
 
 #define LOG(format, ...)    do { \
         fprintf(stderr, format, ##__VA_ARGS__); \
@@ -60,6 +61,7 @@ static void led_irq_handler(void *opaque, int n, int level)
                         printf("LED On\n");
                         break;
         }
+        qapi_event_send_led_change("led", level, &error_abort);
 }
 
 static void led_err_irq_handler(void *opaque, int n, int level)
@@ -78,6 +80,7 @@ static void led_err_irq_handler(void *opaque, int n, int level)
                         printf("ERR LED On\n");
                         break;
         }
+        qapi_event_send_led_change("err", level, &error_abort);
 }
 
 static void stm32_maple_key_event(void *opaque, int keycode)
@@ -149,7 +152,8 @@ static void stm32_maple_init(MachineState *machine)
 
         /* Connect button to GPIO C pin 9 */
         s->button_irq = qdev_get_gpio_in(gpio_c, 9);
-        qemu_add_kbd_event_handler(stm32_maple_key_event, s);
+        stm32_replay_add_kbd_event_handler("keyboard",
+                                           stm32_maple_key_event, s);
 
         /* Connect RS232 to UART */
         stm32_uart_connect((Stm32Uart *) uart1, 
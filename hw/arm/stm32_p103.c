@@ -27,6 +27,8 @@
 #include "ui/console.h"
 #include "sysemu/sysemu.h"
 #include "hw/boards.h"
+#include "hw/ssi.h"
+#include "qapi-event.h"
 
 
 typedef struct {
@@ -55,6 +57,7 @@ static void led_irq_handler(void *opaque, int n, int level)
             printf("LED On\n");
             break;
     }
+    qapi_event_send_led_change("led", level, &error_abort);
 }
 
 static void stm32_p103_key_event(void *opaque, int keycode)
@@ -111,11 +114,14 @@ static void stm32_p103_init(MachineState *machine)
     DeviceState *uart2 = DEVICE(object_resolve_path("/machine/stm32/uart[2]", NULL));
     DeviceState *uart1 = DEVICE(object_resolve_path("/machine/stm32/uart[1]", NULL));
     DeviceState *uart3 = DEVICE(object_resolve_path("/machine/stm32/uart[3]", NULL));
+    DeviceState *spi1 = DEVICE(object_resolve_path("/machine/stm32/spi[1]", NULL));
+    DeviceState *lcd;
     assert(gpio_a);
     assert(gpio_c);
     assert(uart2);
     assert(uart1);
     assert(uart3);
+    assert(spi1);
 
     /* Connect LED to GPIO C pin 12 */
     led_irq = qemu_allocate_irqs(led_irq_handler, NULL, 1);
@@ -123,7 +129,13 @@ static void stm32_p103_init(MachineState *machine)
 
     /* Connect button to GPIO A pin 0 */
     s->button_irq = qdev_get_gpio_in(gpio_a, 0);
-    qemu_add_kbd_event_handler(stm32_p103_key_event, s);
+    stm32_replay_add_kbd_event_handler("keyboard", stm32_p103_key_event, s);
+
+    /* Connect an ILI9341 LCD module to SPI1 (PA5 SCK, PA7 MOSI), with
+     * chip select on GPIO A pin 4 and D/C on GPIO A pin 3 */
+    lcd = ssi_create_slave(qdev_get_child_bus(spi1, "ssi"), "ili9341");
+    qdev_connect_gpio_out(gpio_a, 4, qdev_get_gpio_in_named(lcd, SSI_GPIO_CS, 0));
+    qdev_connect_gpio_out(gpio_a, 3, qdev_get_gpio_in(lcd, 0));
 
     /* Connect RS232 to UART */
     stm32_uart_connect(
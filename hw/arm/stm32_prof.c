@@ -0,0 +1,147 @@
+/*
+ * STM32 Microcontroller firmware sampling profiler
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/arm/stm32.h"
+#include "disas/disas.h"
+#include "sysemu/sysemu.h"
+
+/* Every period of virtual time, the PC of the microcontroller's CPU is
+ * attributed to the function of the firmware's ELF symbol table which
+ * contains it.  LR gives one more frame: the caller, for a leaf function
+ * or before the function makes its first call.  Once the function has
+ * called something, LR points back into the function itself and the frame
+ * is left out.  In an exception handler, LR holds EXC_RETURN until the
+ * handler makes a call, and the caller frame is "[exception]".  Samples
+ * taken while the CPU sleeps in WFI or WFE get a "[sleep]" frame on top.
+ *
+ * The samples are counted per stack and written out at exit in the folded
+ * format ("caller;callee count" lines) read by flamegraph.pl and
+ * speedscope.  Addresses outside of any symbol are written in hex. */
+
+/* DEFINITIONS */
+
+typedef struct Stm32Prof {
+    ARMCPU *cpu;
+    QEMUTimer *timer;
+    uint32_t period_ns;
+    char *file;
+    GHashTable *stacks; /* folded stack -> sample count */
+    Notifier exit;
+} Stm32Prof;
+
+
+
+
+/* SAMPLING */
+
+static const char *stm32_prof_symbol(uint32_t addr, char *buf, size_t size)
+{
+    const char *sym = lookup_symbol(addr & ~1);
+
+    if(sym[0]) {
+        return sym;
+    }
+    snprintf(buf, size, "0x%08x", addr & ~1);
+    return buf;
+}
+
+static void stm32_prof_sample(void *opaque)
+{
+    Stm32Prof *p = opaque;
+    CPUARMState *env = &p->cpu->env;
+    char pc_buf[16], lr_buf[16], stack[256];
+    const char *pc_sym, *lr_sym;
+    gpointer key, count;
+    uint32_t lr = env->regs[14];
+
+    pc_sym = stm32_prof_symbol(env->regs[15], pc_buf, sizeof(pc_buf));
+    if((lr & 0xfffffff0) == 0xfffffff0) {
+        lr_sym = "[exception]";
+    } else {
+        lr_sym = stm32_prof_symbol(lr, lr_buf, sizeof(lr_buf));
+    }
+
+    if(!strcmp(lr_sym, pc_sym)) {
+        snprintf(stack, sizeof(stack), "%s", pc_sym);
+    } else {
+        snprintf(stack, sizeof(stack), "%s;%s", lr_sym, pc_sym);
+    }
+    if(CPU(p->cpu)->halted) {
+        pstrcat(stack, sizeof(stack), ";[sleep]");
+    }
+
+    /* Only new stacks are copied */
+    if(g_hash_table_lookup_extended(p->stacks, stack, &key, &count)) {
+        g_hash_table_insert(p->stacks, key,
+                            GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+    } else {
+        g_hash_table_insert(p->stacks, g_strdup(stack), GUINT_TO_POINTER(1));
+    }
+
+    timer_mod(p->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + p->period_ns);
+}
+
+
+
+
+/* OUTPUT */
+
+static void stm32_prof_write_stack(gpointer key, gpointer value,
+                                   gpointer opaque)
+{
+    fprintf((FILE *)opaque, "%s %u\n", (const char *)key,
+            GPOINTER_TO_UINT(value));
+}
+
+static void stm32_prof_exit(Notifier *notifier, void *data)
+{
+    Stm32Prof *p = container_of(notifier, Stm32Prof, exit);
+    FILE *f;
+
+    f = fopen(p->file, "w");
+    if(!f) {
+        fprintf(stderr, "Profiler: cannot create %s: %s\n", p->file,
+                strerror(errno));
+        return;
+    }
+    g_hash_table_foreach(p->stacks, stm32_prof_write_stack, f);
+    fclose(f);
+}
+
+
+
+
+/* INITIALIZATION */
+
+void stm32_prof_init(ARMCPU *cpu, const char *file, uint32_t period_ns)
+{
+    Stm32Prof *p = g_new0(Stm32Prof, 1);
+
+    if(!period_ns) {
+        hw_error("Profiler: the sampling period must not be 0");
+    }
+
+    p->cpu = cpu;
+    p->file = g_strdup(file);
+    p->period_ns = period_ns;
+    p->stacks = g_hash_table_new(g_str_hash, g_str_equal);
+    p->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, stm32_prof_sample, p);
+    timer_mod(p->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + period_ns);
+
+    p->exit.notify = stm32_prof_exit;
+    qemu_add_exit_notifier(&p->exit);
+}
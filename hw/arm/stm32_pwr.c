@@ -0,0 +1,269 @@
+/*
+ * STM32 Microcontroller PWR (Power Control) module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "qemu/bitops.h"
+#include "sysemu/sysemu.h"
+
+/* DBP is exported as the "dbp" GPIO and gates writes to the backup domain
+ * (see stm32_bkp.c).
+ *
+ * The "sleepdeep" GPIO input comes from the NVIC, which raises it when the
+ * core executes WFI with SLEEPDEEP set and lowers it when an interrupt
+ * wakes the core up.  PDDS then selects between:
+ *  - Stop: the PLL, HSE and HSI are switched off, which stops every
+ *    peripheral but the RTC and IWDG.  On wakeup the HSI is the system
+ *    clock again.  LPDS makes no difference.
+ *  - Standby: as Stop, but the wakeup resets the whole chip, with SBF and
+ *    WUF set afterwards.  The SRAM is not cleared.
+ * Nothing runs on the host while the chip sleeps, until the RTC alarm or an
+ * EXTI line raises its interrupt.  The wakeup sources of Standby are not
+ * restricted to WKUP and the RTC alarm.
+ *
+ * The voltage detector is not modelled, and PVDO always reads 0. */
+
+/* DEFINITIONS */
+
+#define PWR_CR_OFFSET 0x00
+#define PWR_CR_LPDS_BIT 0
+#define PWR_CR_PDDS_BIT 1
+#define PWR_CR_CWUF_BIT 2
+#define PWR_CR_CSBF_BIT 3
+#define PWR_CR_PVDE_BIT 4
+#define PWR_CR_PLS_START 5
+#define PWR_CR_PLS_MASK 0x000000e0
+#define PWR_CR_DBP_BIT 8
+/* CWUF and CSBF always read as 0, so they are not stored */
+#define PWR_CR_MASK 0x000001f3
+
+#define PWR_CSR_OFFSET 0x04
+#define PWR_CSR_WUF_BIT 0
+#define PWR_CSR_SBF_BIT 1
+#define PWR_CSR_PVDO_BIT 2
+#define PWR_CSR_EWUP_BIT 8
+
+typedef enum {
+    PWR_MODE_RUN,
+    PWR_MODE_STOP,
+    PWR_MODE_STANDBY
+} Stm32PwrMode;
+
+struct Stm32Pwr {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    void *stm32_rcc_prop;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32Rcc *stm32_rcc;
+
+    uint32_t
+        PWR_CR,
+        PWR_CSR;
+
+    /* The low power mode the chip is in.  It stays PWR_MODE_STANDBY from
+     * the wakeup until the reset which follows it. */
+    uint32_t mode;
+
+    /* Follows PWR_CR.DBP */
+    qemu_irq dbp_irq;
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_pwr_sleepdeep_handler(void *opaque, int n, int level)
+{
+    Stm32Pwr *s = (Stm32Pwr *)opaque;
+
+    if(level) {
+        if(s->mode != PWR_MODE_RUN) {
+            return;
+        }
+        s->mode = (s->PWR_CR & BIT(PWR_CR_PDDS_BIT)) ? PWR_MODE_STANDBY :
+                                                        PWR_MODE_STOP;
+        stm32_rcc_enter_stop(s->stm32_rcc);
+        return;
+    }
+
+    switch(s->mode) {
+        case PWR_MODE_STOP:
+            s->mode = PWR_MODE_RUN;
+            stm32_rcc_exit_stop(s->stm32_rcc);
+            break;
+        case PWR_MODE_STANDBY:
+            qemu_system_reset_request();
+            break;
+    }
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_pwr_PWR_CR_write(Stm32Pwr *s, uint32_t new_value)
+{
+    if(new_value & BIT(PWR_CR_CWUF_BIT)) {
+        s->PWR_CSR &= ~BIT(PWR_CSR_WUF_BIT);
+    }
+    if(new_value & BIT(PWR_CR_CSBF_BIT)) {
+        s->PWR_CSR &= ~BIT(PWR_CSR_SBF_BIT);
+    }
+
+    s->PWR_CR = new_value & PWR_CR_MASK;
+    qemu_set_irq(s->dbp_irq, extract32(s->PWR_CR, PWR_CR_DBP_BIT, 1));
+}
+
+static void stm32_pwr_PWR_CSR_write(Stm32Pwr *s, uint32_t new_value)
+{
+    /* EWUP is the only writable bit */
+    s->PWR_CSR = (s->PWR_CSR & ~BIT(PWR_CSR_EWUP_BIT)) |
+                 (new_value & BIT(PWR_CSR_EWUP_BIT));
+}
+
+static uint64_t stm32_pwr_read(void *opaque, hwaddr offset,
+                          unsigned size)
+{
+    Stm32Pwr *s = (Stm32Pwr *)opaque;
+
+    stm32_rcc_check_periph_clk(s->stm32_rcc, STM32_PWR);
+
+    switch (offset) {
+        case PWR_CR_OFFSET:
+            return s->PWR_CR;
+        case PWR_CSR_OFFSET:
+            return s->PWR_CSR;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_pwr_write(void *opaque, hwaddr offset,
+                       uint64_t value, unsigned size)
+{
+    Stm32Pwr *s = (Stm32Pwr *)opaque;
+
+    stm32_rcc_check_periph_clk(s->stm32_rcc, STM32_PWR);
+
+    switch (offset) {
+        case PWR_CR_OFFSET:
+            stm32_pwr_PWR_CR_write(s, value);
+            break;
+        case PWR_CSR_OFFSET:
+            stm32_pwr_PWR_CSR_write(s, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_pwr_ops = {
+    .read = stm32_pwr_read,
+    .write = stm32_pwr_write,
+    .valid.min_access_size = 2,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_pwr_reset(DeviceState *dev)
+{
+    Stm32Pwr *s = STM32_Pwr(dev);
+
+    if(s->mode == PWR_MODE_STANDBY) {
+        s->PWR_CSR = BIT(PWR_CSR_SBF_BIT) | BIT(PWR_CSR_WUF_BIT);
+    } else {
+        s->PWR_CSR = 0;
+    }
+    s->mode = PWR_MODE_RUN;
+    stm32_pwr_PWR_CR_write(s, 0);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_pwr_init(SysBusDevice *dev)
+{
+    Stm32Pwr *s = STM32_Pwr(dev);
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_pwr_ops, s,
+                          "pwr", STM32_PERIPH_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    qdev_init_gpio_out_named(DEVICE(dev), &s->dbp_irq, "dbp", 1);
+    qdev_init_gpio_in_named(DEVICE(dev), stm32_pwr_sleepdeep_handler,
+                            "sleepdeep", 1);
+
+    return 0;
+}
+
+/* The BKP saves its own copy of DBP, so dbp_irq is not driven again */
+static const VMStateDescription vmstate_stm32_pwr = {
+    .name = TYPE_STM32_PWR,
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(PWR_CR, Stm32Pwr),
+        VMSTATE_UINT32(PWR_CSR, Stm32Pwr),
+        VMSTATE_UINT32_V(mode, Stm32Pwr, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_pwr_properties[] = {
+    DEFINE_PROP_PTR("stm32_rcc", Stm32Pwr, stm32_rcc_prop),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_pwr_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_pwr_init;
+    dc->reset = stm32_pwr_reset;
+    dc->vmsd = &vmstate_stm32_pwr;
+    dc->props = stm32_pwr_properties;
+}
+
+static TypeInfo stm32_pwr_info = {
+    .name  = TYPE_STM32_PWR,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Pwr),
+    .class_init = stm32_pwr_class_init
+};
+
+static void stm32_pwr_register_types(void)
+{
+    type_register_static(&stm32_pwr_info);
+}
+
+type_init(stm32_pwr_register_types)
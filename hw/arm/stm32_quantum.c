@@ -0,0 +1,506 @@
+/*
+ * STM32 Microcontroller quantum synchronization of separate nodes
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/arm/stm32.h"
+#include "net/can.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+
+/* The microcontrollers of one machine share the TCG thread.  To use one
+ * host CPU per node, each node of a network runs in a QEMU process of its
+ * own, with -icount N so that its virtual time follows its instructions,
+ * and the processes only wait for each other at the end of every quantum
+ * of virtual time.  Node 0 listens on a Unix socket which the other nodes
+ * connect to.
+ *
+ * What a node sends on a channel during a quantum (the bytes transmitted
+ * by a USART, the frames put on its CAN bus) is stamped with the virtual
+ * time and kept.  At the end of the quantum, every node sends what it kept
+ * to node 0 and waits for the messages of all of the other nodes, which
+ * node 0 hands back once it has them all.  A message is delivered at its
+ * time plus one quantum, that is during the next quantum, so no node can
+ * get a message from its past, and the spacing of the messages of one node
+ * is kept.  Messages due at the same time are delivered in node order.
+ * Since neither the order nor the delivery times depend on how fast the
+ * processes run, the results are the same from one run to the next.
+ *
+ * A batch is a 32-bit length followed by messages, each with the 64-bit
+ * time, the node, the length of the channel name, the 16-bit length of the
+ * data, the name and the data.  All integers are little endian.  Messages
+ * on a channel that a node does not have are dropped.  When a node stops,
+ * the others stop too. */
+
+/* DEFINITIONS */
+
+#define STM32_QUANTUM_CONNECT_TRIES 300
+#define STM32_QUANTUM_CONNECT_WAIT_US 100000
+#define STM32_QUANTUM_HEADER_SIZE 12
+
+struct Stm32QuantumChannel {
+    char *name;
+    Stm32QuantumDeliver *deliver;
+    void *opaque;
+};
+
+typedef struct Stm32QuantumMsg {
+    int64_t time;       /* delivery time */
+    uint8_t node;
+    guint seq;          /* position in the batch of the node */
+    Stm32QuantumChannel *ch;
+    const uint8_t *data;
+    unsigned len;
+} Stm32QuantumMsg;
+
+typedef struct Stm32Quantum {
+    unsigned node;
+    unsigned nodes;
+    int64_t quantum;
+    int *fds;           /* node 0: by node, the others: fds[0] is node 0 */
+    bool stopped;
+
+    GHashTable *channels;   /* name -> Stm32QuantumChannel */
+    GByteArray *out;        /* sent during the current quantum */
+    QEMUTimer *boundary_timer;
+    int64_t boundary;
+
+    /* Messages of the other nodes for the current quantum, in delivery
+     * order */
+    GByteArray *in;
+    GArray *pending;
+    guint next;
+    QEMUTimer *deliver_timer;
+
+    Stm32QuantumChannel *can;
+    CanBusClientState can_client;
+} Stm32Quantum;
+
+static Stm32Quantum *stm32_quantum;
+
+
+
+
+/* EXCHANGE */
+
+static void stm32_quantum_stop(Stm32Quantum *q)
+{
+    unsigned i;
+
+    error_report("Quantum: a node went away, stopping the simulation");
+    for(i = 0; i < q->nodes; i++) {
+        if(q->fds[i] >= 0) {
+            closesocket(q->fds[i]);
+            q->fds[i] = -1;
+        }
+    }
+    q->stopped = true;
+    timer_del(q->boundary_timer);
+    qemu_system_shutdown_request();
+}
+
+static bool stm32_quantum_write(int fd, const void *buf, size_t size)
+{
+    return qemu_send_full(fd, buf, size, 0) == size;
+}
+
+static bool stm32_quantum_read(int fd, void *buf, size_t size)
+{
+    return qemu_recv_full(fd, buf, size, 0) == size;
+}
+
+static bool stm32_quantum_write_batch(int fd, GByteArray **parts,
+                                      unsigned count, unsigned skip)
+{
+    uint8_t len[4];
+    uint32_t total = 0;
+    unsigned i;
+
+    for(i = 0; i < count; i++) {
+        if(i != skip) {
+            total += parts[i]->len;
+        }
+    }
+    stl_le_p(len, total);
+    if(!stm32_quantum_write(fd, len, sizeof(len))) {
+        return false;
+    }
+    for(i = 0; i < count; i++) {
+        if(i != skip && parts[i]->len &&
+           !stm32_quantum_write(fd, parts[i]->data, parts[i]->len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static GByteArray *stm32_quantum_read_batch(int fd)
+{
+    GByteArray *batch;
+    uint8_t len[4];
+
+    if(!stm32_quantum_read(fd, len, sizeof(len))) {
+        return NULL;
+    }
+    batch = g_byte_array_sized_new(ldl_le_p(len));
+    g_byte_array_set_size(batch, ldl_le_p(len));
+    if(batch->len && !stm32_quantum_read(fd, batch->data, batch->len)) {
+        g_byte_array_unref(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+static gint stm32_quantum_msg_cmp(gconstpointer a, gconstpointer b)
+{
+    const Stm32QuantumMsg *ma = a, *mb = b;
+
+    if(ma->time != mb->time) {
+        return ma->time < mb->time ? -1 : 1;
+    }
+    if(ma->node != mb->node) {
+        return ma->node < mb->node ? -1 : 1;
+    }
+    return ma->seq < mb->seq ? -1 : ma->seq > mb->seq;
+}
+
+/* Sort the messages of the other nodes into the pending list.  q->in must
+ * be kept until they are delivered. */
+static void stm32_quantum_parse(Stm32Quantum *q)
+{
+    const uint8_t *p = q->in->data, *end = p + q->in->len;
+    Stm32QuantumMsg msg;
+    char name[256];
+    unsigned name_len;
+    guint seq = 0;
+
+    g_array_set_size(q->pending, 0);
+    q->next = 0;
+    while(p < end) {
+        if(end - p < STM32_QUANTUM_HEADER_SIZE) {
+            hw_error("Quantum: truncated message from node 0");
+        }
+        msg.time = (int64_t)ldq_le_p(p) + q->quantum;
+        msg.node = p[8];
+        name_len = p[9];
+        msg.len = lduw_le_p(p + 10);
+        p += STM32_QUANTUM_HEADER_SIZE;
+        if(end - p < name_len + msg.len) {
+            hw_error("Quantum: truncated message from node 0");
+        }
+        memcpy(name, p, name_len);
+        name[name_len] = '\0';
+        msg.ch = g_hash_table_lookup(q->channels, name);
+        msg.data = p + name_len;
+        msg.seq = seq++;
+        p += name_len + msg.len;
+        if(msg.ch) {
+            g_array_append_val(q->pending, msg);
+        }
+    }
+    g_array_sort(q->pending, stm32_quantum_msg_cmp);
+}
+
+static void stm32_quantum_deliver(void *opaque)
+{
+    Stm32Quantum *q = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    Stm32QuantumMsg *msg;
+
+    while(q->next < q->pending->len) {
+        msg = &g_array_index(q->pending, Stm32QuantumMsg, q->next);
+        if(msg->time > now) {
+            timer_mod(q->deliver_timer, msg->time);
+            return;
+        }
+        q->next++;
+        msg->ch->deliver(msg->ch->opaque, msg->data, msg->len);
+    }
+}
+
+/* End of a quantum: swap the messages with the other nodes.  The vCPU does
+ * not run while this waits, so the virtual time stays at the boundary. */
+static void stm32_quantum_boundary(void *opaque)
+{
+    Stm32Quantum *q = opaque;
+    GByteArray **batches;
+    unsigned i;
+    bool ok = true;
+
+    /* A message sent at the time of the previous boundary, but before it
+     * was handled, is due now */
+    stm32_quantum_deliver(q);
+    assert(q->next == q->pending->len);
+    g_byte_array_unref(q->in);
+
+    if(q->node == 0) {
+        batches = g_new0(GByteArray *, q->nodes);
+        batches[0] = q->out;
+        for(i = 1; i < q->nodes && ok; i++) {
+            batches[i] = stm32_quantum_read_batch(q->fds[i]);
+            ok = batches[i] != NULL;
+        }
+        for(i = 1; i < q->nodes && ok; i++) {
+            ok = stm32_quantum_write_batch(q->fds[i], batches, q->nodes, i);
+        }
+        q->in = g_byte_array_new();
+        for(i = 1; i < q->nodes && ok; i++) {
+            g_byte_array_append(q->in, batches[i]->data, batches[i]->len);
+        }
+        for(i = 1; i < q->nodes; i++) {
+            if(batches[i]) {
+                g_byte_array_unref(batches[i]);
+            }
+        }
+        g_free(batches);
+    } else {
+        ok = stm32_quantum_write_batch(q->fds[0], &q->out, 1, 1);
+        q->in = ok ? stm32_quantum_read_batch(q->fds[0]) : NULL;
+        ok = q->in != NULL;
+        if(!ok) {
+            q->in = g_byte_array_new();
+        }
+    }
+    g_byte_array_set_size(q->out, 0);
+
+    if(!ok) {
+        g_byte_array_set_size(q->in, 0);
+        g_array_set_size(q->pending, 0);
+        q->next = 0;
+        stm32_quantum_stop(q);
+        return;
+    }
+
+    stm32_quantum_parse(q);
+    stm32_quantum_deliver(q);
+    q->boundary += q->quantum;
+    timer_mod(q->boundary_timer, q->boundary);
+}
+
+
+
+
+/* CAN BUS */
+
+static void stm32_quantum_can_receive(CanBusClientState *client,
+                                      const QemuCanFrame *frames,
+                                      size_t count)
+{
+    Stm32Quantum *q = container_of(client, Stm32Quantum, can_client);
+    QemuCanFrame frame;
+    size_t i;
+
+    for(i = 0; i < count; i++) {
+        frame = frames[i];
+        frame.can_id = cpu_to_le32(frames[i].can_id);
+        stm32_quantum_send(q->can, &frame, sizeof(frame));
+    }
+}
+
+static const CanBusClientInfo stm32_quantum_can_info = {
+    .receive = stm32_quantum_can_receive,
+};
+
+static void stm32_quantum_can_deliver(void *opaque, const uint8_t *buf,
+                                      int size)
+{
+    Stm32Quantum *q = opaque;
+    QemuCanFrame frame;
+
+    if(size != sizeof(frame)) {
+        return;
+    }
+    memcpy(&frame, buf, sizeof(frame));
+    frame.can_id = le32_to_cpu(frame.can_id);
+    can_bus_client_send(&q->can_client, &frame, 1);
+}
+
+void stm32_quantum_add_can_bus(CanBusState *bus)
+{
+    Stm32Quantum *q = stm32_quantum;
+
+    if(!q || q->can) {
+        return;
+    }
+    q->can = stm32_quantum_channel_new("can", stm32_quantum_can_deliver, q);
+    q->can_client.info = &stm32_quantum_can_info;
+    can_bus_insert_client(bus, &q->can_client);
+}
+
+
+
+
+/* CHANNELS */
+
+Stm32QuantumChannel *stm32_quantum_channel_new(const char *name,
+                                               Stm32QuantumDeliver *deliver,
+                                               void *opaque)
+{
+    Stm32Quantum *q = stm32_quantum;
+    Stm32QuantumChannel *ch;
+
+    if(!q) {
+        return NULL;
+    }
+    if(strlen(name) > 255 || g_hash_table_lookup(q->channels, name)) {
+        hw_error("Quantum: bad or duplicate channel name %s", name);
+    }
+
+    ch = g_new0(Stm32QuantumChannel, 1);
+    ch->name = g_strdup(name);
+    ch->deliver = deliver;
+    ch->opaque = opaque;
+    g_hash_table_insert(q->channels, ch->name, ch);
+    return ch;
+}
+
+void stm32_quantum_send(Stm32QuantumChannel *ch, const void *buf, int size)
+{
+    Stm32Quantum *q = stm32_quantum;
+    uint8_t header[STM32_QUANTUM_HEADER_SIZE];
+    size_t name_len = strlen(ch->name);
+
+    assert(size <= UINT16_MAX);
+    if(q->stopped) {
+        return;
+    }
+    stq_le_p(header, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    header[8] = q->node;
+    header[9] = name_len;
+    stw_le_p(header + 10, size);
+    g_byte_array_append(q->out, header, sizeof(header));
+    g_byte_array_append(q->out, (const uint8_t *)ch->name, name_len);
+    g_byte_array_append(q->out, buf, size);
+}
+
+
+
+
+/* INITIALIZATION */
+
+/* Node 0 accepts the other nodes, which introduce themselves with their
+ * number and their view of the setup. */
+static void stm32_quantum_accept(Stm32Quantum *q, const char *path)
+{
+    Error *err = NULL;
+    uint8_t hello[12];
+    unsigned i, node;
+    int listen_fd, fd;
+
+    listen_fd = unix_listen(path, NULL, 0, &err);
+    if(listen_fd < 0) {
+        hw_error("Quantum: cannot listen on %s: %s", path,
+                 error_get_pretty(err));
+    }
+    for(i = 1; i < q->nodes; i++) {
+        do {
+            fd = qemu_accept(listen_fd, NULL, NULL);
+        } while(fd < 0 && errno == EINTR);
+        if(fd < 0) {
+            hw_error("Quantum: cannot accept a node on %s", path);
+        }
+        qemu_set_block(fd);
+        if(!stm32_quantum_read(fd, hello, sizeof(hello))) {
+            hw_error("Quantum: cannot accept a node on %s", path);
+        }
+        node = ldl_le_p(hello);
+        if(node == 0 || node >= q->nodes || q->fds[node] >= 0 ||
+           ldl_le_p(hello + 4) != q->nodes ||
+           ldl_le_p(hello + 8) != q->quantum) {
+            hw_error("Quantum: node %u does not match the setup of node 0",
+                     node);
+        }
+        q->fds[node] = fd;
+    }
+    closesocket(listen_fd);
+    unlink(path);
+}
+
+/* Node 0 may not be up yet */
+static void stm32_quantum_connect(Stm32Quantum *q, const char *path)
+{
+    Error *err = NULL;
+    uint8_t hello[12];
+    int tries, fd = -1;
+
+    for(tries = 0; fd < 0 && tries < STM32_QUANTUM_CONNECT_TRIES; tries++) {
+        if(tries) {
+            g_usleep(STM32_QUANTUM_CONNECT_WAIT_US);
+        }
+        error_free(err);
+        err = NULL;
+        fd = unix_connect(path, &err);
+    }
+    if(fd < 0) {
+        hw_error("Quantum: cannot connect to %s: %s", path,
+                 error_get_pretty(err));
+    }
+    qemu_set_block(fd);
+    stl_le_p(hello, q->node);
+    stl_le_p(hello + 4, q->nodes);
+    stl_le_p(hello + 8, q->quantum);
+    if(!stm32_quantum_write(fd, hello, sizeof(hello))) {
+        hw_error("Quantum: cannot introduce node %u to node 0", q->node);
+    }
+    q->fds[0] = fd;
+}
+
+void stm32_quantum_init(const char *path, unsigned node, unsigned nodes,
+                        uint32_t quantum_ns)
+{
+    Stm32Quantum *q;
+    unsigned i;
+
+    if(stm32_quantum) {
+        /* The microcontrollers of a process make up a single node */
+        return;
+    }
+    if(use_icount != 1) {
+        hw_error("Quantum: -icount with a fixed shift is required");
+    }
+    if(nodes < 2 || nodes > 256 || node >= nodes || !quantum_ns) {
+        hw_error("Quantum: bad setup, node %u of %u, quantum %u ns", node,
+                 nodes, quantum_ns);
+    }
+
+    q = g_new0(Stm32Quantum, 1);
+    q->node = node;
+    q->nodes = nodes;
+    q->quantum = quantum_ns;
+    q->fds = g_new(int, nodes);
+    for(i = 0; i < nodes; i++) {
+        q->fds[i] = -1;
+    }
+    q->channels = g_hash_table_new(g_str_hash, g_str_equal);
+    q->out = g_byte_array_new();
+    q->in = g_byte_array_new();
+    q->pending = g_array_new(false, false, sizeof(Stm32QuantumMsg));
+
+    if(node == 0) {
+        stm32_quantum_accept(q, path);
+    } else {
+        stm32_quantum_connect(q, path);
+    }
+
+    q->deliver_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                    stm32_quantum_deliver, q);
+    q->boundary_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                     stm32_quantum_boundary, q);
+    q->boundary = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + q->quantum;
+    timer_mod(q->boundary_timer, q->boundary);
+    stm32_quantum = q;
+}
@@ -5,6 +5,7 @@
  *
  * Source code based on omap_clk.c
  * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ * and, for the STM32F4 variant, "RM0090 Reference Manual Rev 7"
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License as
@@ -23,6 +24,8 @@
 #include "hw/arm/stm32.h"
 #include "hw/arm/stm32_clktree.h"
 #include "qemu/bitops.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
 #include <stdio.h>
 
 
@@ -46,6 +49,8 @@
 #define RCC_CR_PLL3ON_CL_BIT    28
 #define RCC_CR_PLL2RDY_CL_BIT   27
 #define RCC_CR_PLL2ON_CL_BIT    26
+#define RCC_CR_PLLI2SRDY_F4_BIT 27
+#define RCC_CR_PLLI2SON_F4_BIT  26
 #define RCC_CR_PLLRDY_BIT       25
 #define RCC_CR_PLLON_BIT        24
 #define RCC_CR_CSSON_BIT        19
@@ -175,6 +180,9 @@
 #define RCC_APB1RSTR_TIM2RST            (1U << RCC_APB1RSTR_TIM2RST_BIT)
 
 #define RCC_AHBENR_OFFSET 0x14
+#define RCC_AHBENR_DMA2EN_BIT    1
+#define RCC_AHBENR_DMA1EN_BIT    0
+#define RCC_AHBENR_ETHMACEN_BIT  14
 
 #define RCC_APB2ENR_OFFSET 0x18
 #define RCC_APB2ENR_ADC3EN_BIT   15
@@ -217,6 +225,7 @@
 #define RCC_APB1ENR_TIM2EN_BIT   0
 
 #define RCC_BDCR_OFFSET 0x20
+#define RCC_BDCR_BDRST_BIT 16
 #define RCC_BDCR_RTCEN_BIT 15
 #define RCC_BDCR_RTCSEL_START 8
 #define RCC_BDCR_RTCSEL_MASK 0x00000300
@@ -224,6 +233,15 @@
 #define RCC_BDCR_LSEON_BIT 0
 
 #define RCC_CSR_OFFSET 0x24
+#define RCC_CSR_LPWRRSTF_BIT 31
+#define RCC_CSR_WWDGRSTF_BIT 30
+#define RCC_CSR_IWDGRSTF_BIT 29
+#define RCC_CSR_SFTRSTF_BIT 28
+#define RCC_CSR_PORRSTF_BIT 27
+#define RCC_CSR_PINRSTF_BIT 26
+#define RCC_CSR_BORRSTF_BIT 25
+#define RCC_CSR_RMVF_BIT 24
+#define RCC_CSR_RSTF_MASK 0xfe000000
 #define RCC_CSR_LSIRDY_BIT 1
 #define RCC_CSR_LSION_BIT 0
 
@@ -250,6 +268,86 @@
 #define SW_HSE_SELECTED 1
 #define SW_PLL_SELECTED 2
 
+/* STM32F4 register layout.  CR, BDCR and CSR have the same bits as on the
+ * F1 (for the parts which are implemented), only the offsets differ. */
+#define F4_HSI_FREQ 16000000
+#define F4_LSI_FREQ 32000
+
+#define RCC_F4_PLLCFGR_OFFSET 0x04
+#define RCC_F4_PLLCFGR_PLLQ_START   24
+#define RCC_F4_PLLCFGR_PLLQ_LENGTH  4
+#define RCC_F4_PLLCFGR_PLLSRC_BIT   22
+#define RCC_F4_PLLCFGR_PLLP_START   16
+#define RCC_F4_PLLCFGR_PLLP_LENGTH  2
+#define RCC_F4_PLLCFGR_PLLN_START   6
+#define RCC_F4_PLLCFGR_PLLN_LENGTH  9
+#define RCC_F4_PLLCFGR_PLLM_START   0
+#define RCC_F4_PLLCFGR_PLLM_LENGTH  6
+#define RCC_F4_PLLCFGR_MASK         0x0f437fff
+
+#define RCC_F4_CFGR_OFFSET 0x08
+#define RCC_F4_CFGR_PPRE2_START     13
+#define RCC_F4_CFGR_PPRE2_LENGTH    3
+#define RCC_F4_CFGR_PPRE1_START     10
+#define RCC_F4_CFGR_PPRE1_LENGTH    3
+#define RCC_F4_CFGR_MASK            0xffdffcf3
+
+#define RCC_F4_CIR_OFFSET 0x0c
+#define RCC_F4_AHB1RSTR_OFFSET 0x10
+#define RCC_F4_AHB2RSTR_OFFSET 0x14
+#define RCC_F4_AHB3RSTR_OFFSET 0x18
+#define RCC_F4_APB1RSTR_OFFSET 0x20
+#define RCC_F4_APB2RSTR_OFFSET 0x24
+
+#define RCC_F4_AHB1ENR_OFFSET 0x30
+#define RCC_F4_AHB1ENR_DMA2EN_BIT   22
+#define RCC_F4_AHB1ENR_DMA1EN_BIT   21
+#define RCC_F4_AHB1ENR_ETHMACEN_BIT 25
+#define RCC_F4_AHB1ENR_GPIOAEN_BIT  0
+#define RCC_F4_AHB1ENR_MASK         0x7e7411ff
+
+#define RCC_F4_AHB2ENR_OFFSET 0x34
+#define RCC_F4_AHB2ENR_MASK         0x000000f1
+#define RCC_F4_AHB3ENR_OFFSET 0x38
+#define RCC_F4_AHB3ENR_MASK         0x00000001
+
+#define RCC_F4_APB1ENR_OFFSET 0x40
+#define RCC_F4_APB1ENR_MASK         0x36fec9ff
+
+#define RCC_F4_APB2ENR_OFFSET 0x44
+#define RCC_F4_APB2ENR_SYSCFGEN_BIT 14
+#define RCC_F4_APB2ENR_SPI1EN_BIT   12
+#define RCC_F4_APB2ENR_ADC1EN_BIT   8
+#define RCC_F4_APB2ENR_USART1EN_BIT 4
+#define RCC_F4_APB2ENR_TIM8EN_BIT   1
+#define RCC_F4_APB2ENR_TIM1EN_BIT   0
+#define RCC_F4_APB2ENR_MASK         0x00075f33
+
+#define RCC_F4_AHB1LPENR_OFFSET 0x50
+#define RCC_F4_AHB2LPENR_OFFSET 0x54
+#define RCC_F4_AHB3LPENR_OFFSET 0x58
+#define RCC_F4_APB1LPENR_OFFSET 0x60
+#define RCC_F4_APB2LPENR_OFFSET 0x64
+#define RCC_F4_BDCR_OFFSET 0x70
+#define RCC_F4_CSR_OFFSET 0x74
+#define RCC_F4_SSCGR_OFFSET 0x80
+#define RCC_F4_PLLI2SCFGR_OFFSET 0x84
+#define RCC_F4_PLLI2SCFGR_PLLI2SR_START  28
+#define RCC_F4_PLLI2SCFGR_PLLI2SR_LENGTH 3
+#define RCC_F4_PLLI2SCFGR_PLLI2SN_START  6
+#define RCC_F4_PLLI2SCFGR_PLLI2SN_LENGTH 9
+#define RCC_F4_PLLI2SCFGR_MASK           0x70007fc0
+
+/* Oscillators with a ready flag, used to index the startup timing arrays. */
+enum {
+    RCC_OSC_HSI,
+    RCC_OSC_HSE,
+    RCC_OSC_PLL,
+    RCC_OSC_LSE,
+    RCC_OSC_LSI,
+    RCC_OSC_COUNT
+};
+
 struct Stm32Rcc {
     /* Inherited */
     SysBusDevice busdev;
@@ -257,25 +355,64 @@ struct Stm32Rcc {
     /* Properties */
     uint32_t osc_freq;
     uint32_t osc32_freq;
+    /* NVIC whose SysTick is clocked from HCLK.  If this is not set, the
+     * global SysTick clock scales are updated instead. */
+    void *nvic;
+    /* "instant" (the default) sets each ready flag as soon as its oscillator
+     * is switched on.  "accurate" waits for the startup time below. */
+    char *startup_prop;
+    uint32_t startup_us[RCC_OSC_COUNT];
 
     /* Private */
     MemoryRegion iomem;
 
+    /* Set by the stm32f4-rcc type. */
+    bool f4;
+
+    bool accurate_startup;
+    /* QEMU_CLOCK_VIRTUAL time at which each oscillator became (or will
+     * become) ready.  Only meaningful while the oscillator is on. */
+    int64_t ready_time[RCC_OSC_COUNT];
+
     /* Register Values */
     uint32_t
+        RCC_AHBENR,
         RCC_APB1ENR,
         RCC_APB2ENR;
 
+    /* STM32F4 only.  APB1ENR and APB2ENR are shared with the F1. */
+    uint32_t
+        RCC_F4_PLLCFGR,
+        RCC_F4_PLLI2SCFGR,
+        RCC_F4_CFGR,
+        RCC_F4_AHB1ENR,
+        RCC_F4_AHB2ENR,
+        RCC_F4_AHB3ENR;
+
     /* Register Field Values */
     uint32_t
         RCC_CFGR_PLLMUL,
         RCC_CFGR_PLLXTPRE,
         RCC_CFGR_PLLSRC,
+        RCC_CFGR_USBPRE,
         RCC_CFGR_PPRE1,
         RCC_CFGR_PPRE2,
         RCC_CFGR_HPRE,
         RCC_CFGR_SW,
-        RTC_SEL;
+        RTC_SEL,
+        RCC_BDCR_BDRST,
+        /* The reset flags of CSR.  They are only cleared by RMVF, so they
+         * survive the system resets they record. */
+        RCC_CSR_RSTF;
+
+    /* The registers which are built from the clock states when read, as
+     * they were when the state was saved.  post_load writes them back to
+     * rebuild the clock tree. */
+    uint32_t
+        vmstate_cr,
+        vmstate_cfgr,
+        vmstate_bdcr,
+        vmstate_csr;
 
     Clk
         HSICLK,
@@ -285,6 +422,7 @@ struct Stm32Rcc {
         SYSCLK,
         PLLXTPRECLK,
         PLLCLK,
+        PLLI2SCLK, /* STM32F4 only */
         HCLK, /* Output from AHB Prescaler */
         PCLK1, /* Output from APB1 Prescaler */
         PCLK2, /* Output from APB2 Prescaler */
@@ -292,6 +430,8 @@ struct Stm32Rcc {
         PERIPHCLK[STM32_PERIPH_COUNT];
 
     qemu_irq irq;
+    /* Raised while the backup domain is held in reset (BDCR.BDRST) */
+    qemu_irq bdrst_irq;
 };
 
 
@@ -309,6 +449,43 @@ static void stm32_rcc_periph_enable(
     clktree_set_enabled(s->PERIPHCLK[periph], new_value & BIT(bit_pos));
 }
 
+/* Switch an oscillator on or off.  When it is switched on, its ready time is
+ * set according to the startup mode.  Oscillators which are on at reset are
+ * always ready straight away. */
+static void stm32_rcc_osc_enable(
+                    Stm32Rcc *s,
+                    int osc,
+                    Clk clk,
+                    bool enabled,
+                    bool init)
+{
+    if(enabled && !clktree_is_enabled(clk)) {
+        s->ready_time[osc] = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        if(s->accurate_startup && !init) {
+            s->ready_time[osc] += (int64_t)s->startup_us[osc] * 1000;
+        }
+    }
+    clktree_set_enabled(clk, enabled);
+}
+
+/* Returns true if the oscillator is on and has finished starting up. */
+static bool stm32_rcc_osc_ready(Stm32Rcc *s, int osc, Clk clk)
+{
+    return clktree_is_enabled(clk) &&
+           qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) >= s->ready_time[osc];
+}
+
+/* Returns the earlier of deadline and the time the oscillator will become
+ * ready, if it is still starting up. */
+static int64_t stm32_rcc_osc_deadline(Stm32Rcc *s, int osc, Clk clk,
+                                      int64_t deadline)
+{
+    if(clktree_is_enabled(clk) && !stm32_rcc_osc_ready(s, osc, clk)) {
+        return MIN(deadline, s->ready_time[osc]);
+    }
+    return deadline;
+}
+
 
 
 
@@ -322,15 +499,24 @@ static uint32_t stm32_rcc_RCC_CR_read(Stm32Rcc *s)
     int pllon_bit = clktree_is_enabled(s->PLLCLK) ? 1 : 0;
     int hseon_bit = clktree_is_enabled(s->HSECLK) ? 1 : 0;
     int hsion_bit = clktree_is_enabled(s->HSICLK) ? 1 : 0;
+    int pllrdy_bit = stm32_rcc_osc_ready(s, RCC_OSC_PLL, s->PLLCLK) ? 1 : 0;
+    int hserdy_bit = stm32_rcc_osc_ready(s, RCC_OSC_HSE, s->HSECLK) ? 1 : 0;
+    int hsirdy_bit = stm32_rcc_osc_ready(s, RCC_OSC_HSI, s->HSICLK) ? 1 : 0;
+    /* The F4's I2S PLL locks straight away */
+    int plli2son_bit =
+            (s->PLLI2SCLK && clktree_is_enabled(s->PLLI2SCLK)) ? 1 : 0;
 
     /* build the register value based on the clock states.  If a clock is on,
-     * then its ready bit is always set.
+     * then its ready bit is set once its startup time has passed (straight
+     * away in instant startup mode).
      */
-    return pllon_bit << RCC_CR_PLLRDY_BIT |
+    return plli2son_bit << RCC_CR_PLLI2SRDY_F4_BIT |
+           plli2son_bit << RCC_CR_PLLI2SON_F4_BIT |
+           pllrdy_bit << RCC_CR_PLLRDY_BIT |
            pllon_bit << RCC_CR_PLLON_BIT |
-           hseon_bit << RCC_CR_HSERDY_BIT |
+           hserdy_bit << RCC_CR_HSERDY_BIT |
            hseon_bit << RCC_CR_HSEON_BIT |
-           hsion_bit << RCC_CR_HSIRDY_BIT |
+           hsirdy_bit << RCC_CR_HSIRDY_BIT |
            hsion_bit << RCC_CR_HSION_BIT;
 }
 
@@ -343,12 +529,14 @@ static void stm32_rcc_RCC_CR_write(Stm32Rcc *s, uint32_t new_value, bool init)
 {
     bool new_pllon, new_hseon, new_hsion;
 
+    clktree_begin_update();
+
     new_pllon = new_value & BIT(RCC_CR_PLLON_BIT);
     if((clktree_is_enabled(s->PLLCLK) && !new_pllon) &&
        s->RCC_CFGR_SW == SW_PLL_SELECTED) {
         stm32_hw_warn("PLL cannot be disabled while it is selected as the system clock.");
     }
-    clktree_set_enabled(s->PLLCLK, new_pllon);
+    stm32_rcc_osc_enable(s, RCC_OSC_PLL, s->PLLCLK, new_pllon, init);
 
     new_hseon = new_value & BIT(RCC_CR_HSEON_BIT);
     if((clktree_is_enabled(s->HSECLK) && !new_hseon) &&
@@ -358,7 +546,7 @@ static void stm32_rcc_RCC_CR_write(Stm32Rcc *s, uint32_t new_value, bool init)
       ) {
         stm32_hw_warn("HSE oscillator cannot be disabled while it is driving the system clock.");
     }
-    clktree_set_enabled(s->HSECLK, new_hseon);
+    stm32_rcc_osc_enable(s, RCC_OSC_HSE, s->HSECLK, new_hseon, init);
 
     new_hsion = new_value & BIT(RCC_CR_HSION_BIT);
     if((clktree_is_enabled(s->HSICLK) && !new_hsion) &&
@@ -368,7 +556,14 @@ static void stm32_rcc_RCC_CR_write(Stm32Rcc *s, uint32_t new_value, bool init)
       ) {
         stm32_hw_warn("HSI oscillator cannot be disabled while it is driving the system clock.");
     }
-    clktree_set_enabled(s->HSICLK, new_hsion);
+    stm32_rcc_osc_enable(s, RCC_OSC_HSI, s->HSICLK, new_hsion, init);
+
+    if(s->PLLI2SCLK) {
+        clktree_set_enabled(s->PLLI2SCLK,
+                            new_value & BIT(RCC_CR_PLLI2SON_F4_BIT));
+    }
+
+    clktree_commit_update();
 }
 
 
@@ -377,6 +572,7 @@ static uint32_t stm32_rcc_RCC_CFGR_read(Stm32Rcc *s)
     return (s->RCC_CFGR_PLLMUL << RCC_CFGR_PLLMUL_START) |
            (s->RCC_CFGR_PLLXTPRE << RCC_CFGR_PLLXTPRE_BIT) |
            (s->RCC_CFGR_PLLSRC << RCC_CFGR_PLLSRC_BIT) |
+           (s->RCC_CFGR_USBPRE << RCC_CFGR_USBPRE_BIT) |
            (s->RCC_CFGR_PPRE2 << RCC_CFGR_PPRE2_START) |
            (s->RCC_CFGR_PPRE1 << RCC_CFGR_PPRE1_START) |
            (s->RCC_CFGR_HPRE << RCC_CFGR_HPRE_START) |
@@ -389,6 +585,10 @@ static void stm32_rcc_RCC_CFGR_write(Stm32Rcc *s, uint32_t new_value, bool init)
 {
     uint32_t new_PLLMUL, new_PLLXTPRE, new_PLLSRC;
 
+    /* Apply all of the prescaler and mux changes before propagating them
+     * through the clock tree. */
+    clktree_begin_update();
+
     /* PLLMUL */
     new_PLLMUL = extract32(new_value,
                            RCC_CFGR_PLLMUL_START,
@@ -429,6 +629,14 @@ static void stm32_rcc_RCC_CFGR_write(Stm32Rcc *s, uint32_t new_value, bool init)
     clktree_set_selected_input(s->PLLCLK, new_PLLSRC);
     s->RCC_CFGR_PLLSRC = new_PLLSRC;
 
+    /* USBPRE: the USB clock is PLL / 1.5 or PLL */
+    s->RCC_CFGR_USBPRE = extract32(new_value, RCC_CFGR_USBPRE_BIT, 1);
+    if(s->RCC_CFGR_USBPRE) {
+        clktree_set_scale(s->PERIPHCLK[STM32_USB_PERIPH], 1, 1);
+    } else {
+        clktree_set_scale(s->PERIPHCLK[STM32_USB_PERIPH], 2, 3);
+    }
+
     /* PPRE2 */
     s->RCC_CFGR_PPRE2 = (new_value & RCC_CFGR_PPRE2_MASK) >> RCC_CFGR_PPRE2_START;
     if(s->RCC_CFGR_PPRE2 < 0x4) {
@@ -455,6 +663,14 @@ static void stm32_rcc_RCC_CFGR_write(Stm32Rcc *s, uint32_t new_value, bool init)
 
     /* SW */
     s->RCC_CFGR_SW = (new_value & RCC_CFGR_SW_MASK) >> RCC_CFGR_SW_START;
+    if(!init) {
+        if((s->RCC_CFGR_SW == SW_HSE_SELECTED &&
+            !stm32_rcc_osc_ready(s, RCC_OSC_HSE, s->HSECLK)) ||
+           (s->RCC_CFGR_SW == SW_PLL_SELECTED &&
+            !stm32_rcc_osc_ready(s, RCC_OSC_PLL, s->PLLCLK))) {
+            stm32_hw_warn("SYSCLK switched to a clock which is not ready");
+        }
+    }
     switch(s->RCC_CFGR_SW) {
         case 0x0:
         case 0x1:
@@ -465,6 +681,27 @@ static void stm32_rcc_RCC_CFGR_write(Stm32Rcc *s, uint32_t new_value, bool init)
             hw_error("Invalid input selected for SYSCLK");
             break;
     }
+
+    clktree_commit_update();
+}
+
+/* Write the AHB peripheral clock enable register
+ * Enables/Disables the peripheral clocks based on each bit. */
+static void stm32_rcc_RCC_AHBENR_write(Stm32Rcc *s, uint32_t new_value,
+                                       bool init)
+{
+    clktree_begin_update();
+
+    stm32_rcc_periph_enable(s, new_value, init, STM32_DMA1,
+                            RCC_AHBENR_DMA1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_DMA2,
+                            RCC_AHBENR_DMA2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_ETH,
+                            RCC_AHBENR_ETHMACEN_BIT);
+
+    clktree_commit_update();
+
+    s->RCC_AHBENR = new_value & 0x0001d557;
 }
 
 /* Write the APB2 peripheral clock enable register
@@ -472,10 +709,18 @@ static void stm32_rcc_RCC_CFGR_write(Stm32Rcc *s, uint32_t new_value, bool init)
 static void stm32_rcc_RCC_APB2ENR_write(Stm32Rcc *s, uint32_t new_value,
                                         bool init)
 {
+    clktree_begin_update();
+
     stm32_rcc_periph_enable(s, new_value, init, STM32_ADC1,
                             RCC_APB2ENR_ADC1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_ADC2,
+                            RCC_APB2ENR_ADC2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_ADC3,
+                            RCC_APB2ENR_ADC3EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32_UART1,
                             RCC_APB2ENR_USART1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_SPI1,
+                            RCC_APB2ENR_SPI1EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32_GPIOE,
                             RCC_APB2ENR_IOPEEN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32_GPIOD,
@@ -498,6 +743,8 @@ static void stm32_rcc_RCC_APB2ENR_write(Stm32Rcc *s, uint32_t new_value,
     stm32_rcc_periph_enable(s, new_value, init, STM32_TIM8,
                             RCC_APB2ENR_TIM8EN_BIT);
 
+    clktree_commit_update();
+
     s->RCC_APB2ENR = new_value & 0x0000fffd;
 }
 
@@ -506,6 +753,8 @@ static void stm32_rcc_RCC_APB2ENR_write(Stm32Rcc *s, uint32_t new_value,
 static void stm32_rcc_RCC_APB1ENR_write(Stm32Rcc *s, uint32_t new_value,
                     bool init)
 {
+    clktree_begin_update();
+
     stm32_rcc_periph_enable(s, new_value, init, STM32_UART5,
                             RCC_APB1ENR_USART5EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32_UART4,
@@ -514,6 +763,25 @@ static void stm32_rcc_RCC_APB1ENR_write(Stm32Rcc *s, uint32_t new_value,
                             RCC_APB1ENR_USART3EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32_UART2,
                             RCC_APB1ENR_USART2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_SPI3,
+                            RCC_APB1ENR_SPI3EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_I2C1,
+                            RCC_APB1ENR_I2C1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_I2C2,
+                            RCC_APB1ENR_I2C2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_SPI2,
+                            RCC_APB1ENR_SPI2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_WWDG,
+                            RCC_APB1ENR_WWDGEN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_CAN1,
+                            RCC_APB1ENR_CAN1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_CAN2,
+                            RCC_APB1ENR_CAN2EN_BIT);
+    if(!s->f4) {
+        /* I2C3EN on the F4, which has an OTG controller instead */
+        stm32_rcc_periph_enable(s, new_value, init, STM32_USB_PERIPH,
+                                RCC_APB1ENR_USBEN_BIT);
+    }
 
     stm32_rcc_periph_enable(s, new_value, init, STM32_TIM2,
                             RCC_APB1ENR_TIM2EN_BIT);
@@ -527,23 +795,44 @@ static void stm32_rcc_RCC_APB1ENR_write(Stm32Rcc *s, uint32_t new_value,
                             RCC_APB1ENR_TIM6EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32_TIM7,
                             RCC_APB1ENR_TIM7EN_BIT);
-
-    s->RCC_APB1ENR = new_value & 0x00005e7d;
+    stm32_rcc_periph_enable(s, new_value, init, STM32_PWR,
+                            RCC_APB1ENR_PWREN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_BKP,
+                            RCC_APB1ENR_BKPEN_BIT);
+
+    clktree_commit_update();
+
+    s->RCC_APB1ENR = new_value & (0x00005e7d | BIT(RCC_APB1ENR_PWREN_BIT) |
+                                  BIT(RCC_APB1ENR_BKPEN_BIT) |
+                                  BIT(RCC_APB1ENR_CAN1EN_BIT) |
+                                  BIT(RCC_APB1ENR_CAN2EN_BIT) |
+                                  BIT(RCC_APB1ENR_USBEN_BIT));
 }
 
 static uint32_t stm32_rcc_RCC_BDCR_read(Stm32Rcc *s)
 {
     int lseon_bit = clktree_is_enabled(s->LSECLK) ? 1 : 0;
+    int lserdy_bit = stm32_rcc_osc_ready(s, RCC_OSC_LSE, s->LSECLK) ? 1 : 0;
     int RTCEN_bit = clktree_is_enabled(s->PERIPHCLK[STM32_RTC]) ? 1 : 0;
-    return lseon_bit << RCC_BDCR_LSERDY_BIT |
+    return lserdy_bit << RCC_BDCR_LSERDY_BIT |
            lseon_bit << RCC_BDCR_LSEON_BIT  |
            s->RTC_SEL << RCC_BDCR_RTCSEL_START | 
-           RTCEN_bit  << RCC_BDCR_RTCEN_BIT;
+           RTCEN_bit  << RCC_BDCR_RTCEN_BIT |
+           s->RCC_BDCR_BDRST << RCC_BDCR_BDRST_BIT;
 }
 
 static void stm32_rcc_RCC_BDCR_write(Stm32Rcc *s, uint32_t new_value, bool init)
 {
-     clktree_set_enabled(s->LSECLK,new_value & BIT(RCC_BDCR_LSEON_BIT));    
+    /* While BDRST is set, the rest of the backup domain (including the
+     * other fields of this register) is held in reset. */
+    s->RCC_BDCR_BDRST = extract32(new_value, RCC_BDCR_BDRST_BIT, 1);
+    if(s->RCC_BDCR_BDRST) {
+        new_value = BIT(RCC_BDCR_BDRST_BIT);
+    }
+    qemu_set_irq(s->bdrst_irq, s->RCC_BDCR_BDRST);
+
+    stm32_rcc_osc_enable(s, RCC_OSC_LSE, s->LSECLK,
+                         new_value & BIT(RCC_BDCR_LSEON_BIT), init);
     /* select input CLOCK for RTC  */
     /* RTCSEL =(0,1,2,3) => intput CLK=(0,LSE,LSI,HSE/128)
        see datasheet page 151*/ 
@@ -559,16 +848,25 @@ static void stm32_rcc_RCC_BDCR_write(Stm32Rcc *s, uint32_t new_value, bool init)
 /* Works the same way as stm32_rcc_RCC_CR_read */
 static uint32_t stm32_rcc_RCC_CSR_read(Stm32Rcc *s)
 {
-    int lseon_bit = clktree_is_enabled(s->LSICLK) ? 1 : 0;
+    int lsion_bit = clktree_is_enabled(s->LSICLK) ? 1 : 0;
+    int lsirdy_bit = stm32_rcc_osc_ready(s, RCC_OSC_LSI, s->LSICLK) ? 1 : 0;
 
-    return lseon_bit << RCC_CSR_LSIRDY_BIT |
-           lseon_bit << RCC_CSR_LSION_BIT;
+    return s->RCC_CSR_RSTF |
+           lsirdy_bit << RCC_CSR_LSIRDY_BIT |
+           lsion_bit << RCC_CSR_LSION_BIT;
 }
 
-/* Works the same way as stm32_rcc_RCC_CR_write */
+/* Works the same way as stm32_rcc_RCC_CR_write.  The reset flags can only
+ * be cleared by software, but init sets them as given. */
 static void stm32_rcc_RCC_CSR_write(Stm32Rcc *s, uint32_t new_value, bool init)
 {
-    clktree_set_enabled(s->LSICLK, new_value & BIT(RCC_CSR_LSION_BIT));
+    if(init) {
+        s->RCC_CSR_RSTF = new_value & RCC_CSR_RSTF_MASK;
+    } else if(new_value & BIT(RCC_CSR_RMVF_BIT)) {
+        s->RCC_CSR_RSTF = 0;
+    }
+    stm32_rcc_osc_enable(s, RCC_OSC_LSI, s->LSICLK,
+                         new_value & BIT(RCC_CSR_LSION_BIT), init);
 }
 
 
@@ -591,8 +889,7 @@ static uint64_t stm32_rcc_readw(void *opaque, hwaddr offset)
             STM32_NOT_IMPL_REG(offset, 4);
             return 0;
         case RCC_AHBENR_OFFSET:
-            STM32_NOT_IMPL_REG(offset, 4);
-            return 0;
+            return s->RCC_AHBENR;
         case RCC_APB2ENR_OFFSET:
             return s->RCC_APB2ENR;
         case RCC_APB1ENR_OFFSET:
@@ -637,7 +934,7 @@ static void stm32_rcc_writew(void *opaque, hwaddr offset,
             STM32_NOT_IMPL_REG(offset, 4);
             break;
         case RCC_AHBENR_OFFSET:
-            STM32_NOT_IMPL_REG(offset, 4);
+            stm32_rcc_RCC_AHBENR_write(s, value, false);
             break;
         case RCC_APB2ENR_OFFSET:
             stm32_rcc_RCC_APB2ENR_write(s, value, false);
@@ -688,23 +985,443 @@ static void stm32_rcc_write(void *opaque, hwaddr offset,
     }
 }
 
+/* The ready flags are the only bits which change without a guest write. */
+static int64_t stm32_rcc_poll_deadline(void *opaque, hwaddr offset,
+                                       unsigned size)
+{
+    Stm32Rcc *s = (Stm32Rcc *)opaque;
+    int64_t deadline = INT64_MAX;
+
+    switch(offset & 0xfffffffc) {
+        case RCC_CR_OFFSET:
+            deadline = stm32_rcc_osc_deadline(s, RCC_OSC_HSI, s->HSICLK,
+                                              deadline);
+            deadline = stm32_rcc_osc_deadline(s, RCC_OSC_HSE, s->HSECLK,
+                                              deadline);
+            return stm32_rcc_osc_deadline(s, RCC_OSC_PLL, s->PLLCLK,
+                                          deadline);
+        case RCC_CFGR_OFFSET:
+        case RCC_CIR_OFFSET:
+            return deadline;
+        case RCC_BDCR_OFFSET:
+            return stm32_rcc_osc_deadline(s, RCC_OSC_LSE, s->LSECLK,
+                                          deadline);
+        case RCC_CSR_OFFSET:
+            return stm32_rcc_osc_deadline(s, RCC_OSC_LSI, s->LSICLK,
+                                          deadline);
+        default:
+            return -1;
+    }
+}
+
 static const MemoryRegionOps stm32_rcc_ops = {
     .read = stm32_rcc_read,
     .write = stm32_rcc_write,
+    .poll_deadline = stm32_rcc_poll_deadline,
+    .idempotent_reads = MEMORY_REGION_IDEMPOTENT(RCC_CFGR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(RCC_AHBENR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(RCC_APB2ENR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(RCC_APB1ENR_OFFSET),
     .endianness = DEVICE_NATIVE_ENDIAN
 };
 
 
+
+/* STM32F4 */
+
+/* The I2S PLL shares the source and the PLLM divider of the main PLL, so
+ * this is called when either configuration register changes.  Its output
+ * is (PLL input / PLLM) * PLLI2SN / PLLI2SR. */
+static void stm32_rcc_f4_plli2s_update(Stm32Rcc *s)
+{
+    uint32_t pllm, plln, pllr;
+
+    pllm = extract32(s->RCC_F4_PLLCFGR, RCC_F4_PLLCFGR_PLLM_START,
+                     RCC_F4_PLLCFGR_PLLM_LENGTH);
+    plln = extract32(s->RCC_F4_PLLI2SCFGR, RCC_F4_PLLI2SCFGR_PLLI2SN_START,
+                     RCC_F4_PLLI2SCFGR_PLLI2SN_LENGTH);
+    pllr = extract32(s->RCC_F4_PLLI2SCFGR, RCC_F4_PLLI2SCFGR_PLLI2SR_START,
+                     RCC_F4_PLLI2SCFGR_PLLI2SR_LENGTH);
+
+    /* Keep the clock tree arithmetic defined for out of range values. */
+    clktree_set_scale(s->PLLI2SCLK, plln, MAX(pllm, 2) * MAX(pllr, 2));
+    clktree_set_selected_input(s->PLLI2SCLK, s->RCC_CFGR_PLLSRC);
+}
+
+static void stm32_rcc_f4_PLLI2SCFGR_write(Stm32Rcc *s, uint32_t new_value,
+                                          bool init)
+{
+    uint32_t plln, pllr;
+
+    new_value &= RCC_F4_PLLI2SCFGR_MASK;
+    if(!init) {
+        if(clktree_is_enabled(s->PLLI2SCLK) &&
+           (new_value != s->RCC_F4_PLLI2SCFGR)) {
+            stm32_hw_warn("Can only change PLLI2SCFGR while PLLI2S is "
+                          "disabled");
+        }
+    }
+    s->RCC_F4_PLLI2SCFGR = new_value;
+
+    plln = extract32(new_value, RCC_F4_PLLI2SCFGR_PLLI2SN_START,
+                     RCC_F4_PLLI2SCFGR_PLLI2SN_LENGTH);
+    pllr = extract32(new_value, RCC_F4_PLLI2SCFGR_PLLI2SR_START,
+                     RCC_F4_PLLI2SCFGR_PLLI2SR_LENGTH);
+    if(plln < 50 || plln > 432 || pllr < 2) {
+        stm32_hw_warn("Invalid PLLI2S configuration PLLI2SN=%u PLLI2SR=%u",
+                      plln, pllr);
+    }
+
+    clktree_begin_update();
+    stm32_rcc_f4_plli2s_update(s);
+    clktree_commit_update();
+}
+
+/* Write the PLL configuration register.  The main PLL output is
+ * (PLL input / PLLM) * PLLN / PLLP.  The 48 MHz (PLLQ) output is not
+ * used by any of the implemented peripherals, so it is only stored. */
+static void stm32_rcc_f4_PLLCFGR_write(Stm32Rcc *s, uint32_t new_value,
+                                       bool init)
+{
+    uint32_t pllm, plln, pllp;
+
+    new_value &= RCC_F4_PLLCFGR_MASK;
+    if(!init) {
+        if(clktree_is_enabled(s->PLLCLK) &&
+           (new_value != s->RCC_F4_PLLCFGR)) {
+            stm32_hw_warn("Can only change PLLCFGR while PLL is disabled");
+        }
+    }
+    s->RCC_F4_PLLCFGR = new_value;
+
+    pllm = extract32(new_value, RCC_F4_PLLCFGR_PLLM_START,
+                     RCC_F4_PLLCFGR_PLLM_LENGTH);
+    plln = extract32(new_value, RCC_F4_PLLCFGR_PLLN_START,
+                     RCC_F4_PLLCFGR_PLLN_LENGTH);
+    pllp = 2 * (extract32(new_value, RCC_F4_PLLCFGR_PLLP_START,
+                          RCC_F4_PLLCFGR_PLLP_LENGTH) + 1);
+    if(pllm < 2 || plln < 50 || plln > 432) {
+        stm32_hw_warn("Invalid PLL configuration PLLM=%u PLLN=%u",
+                      pllm, plln);
+    }
+    /* Keep the clock tree arithmetic defined for out of range values. */
+    pllm = MAX(pllm, 2);
+
+    clktree_begin_update();
+
+    clktree_set_scale(s->PLLCLK, plln, pllm * pllp);
+    s->RCC_CFGR_PLLSRC = extract32(new_value, RCC_F4_PLLCFGR_PLLSRC_BIT, 1);
+    clktree_set_selected_input(s->PLLCLK, s->RCC_CFGR_PLLSRC);
+    stm32_rcc_f4_plli2s_update(s);
+
+    clktree_commit_update();
+}
+
+static uint32_t stm32_rcc_f4_CFGR_read(Stm32Rcc *s)
+{
+    return (s->RCC_F4_CFGR & ~RCC_CFGR_SWS_MASK) |
+           (s->RCC_CFGR_SW << RCC_CFGR_SWS_START);
+}
+
+/* Write the clock configuration register.  Unlike the F1 code, the APB
+ * prescalers divide by powers of two (2, 4, 8, 16) and the AHB prescaler
+ * skips /32. */
+static void stm32_rcc_f4_CFGR_write(Stm32Rcc *s, uint32_t new_value,
+                                    bool init)
+{
+    static const uint16_t hpre_div[8] = {2, 4, 8, 16, 64, 128, 256, 512};
+    uint32_t ppre;
+
+    s->RCC_F4_CFGR = new_value & RCC_F4_CFGR_MASK;
+
+    clktree_begin_update();
+
+    /* PPRE2 */
+    ppre = extract32(new_value, RCC_F4_CFGR_PPRE2_START,
+                     RCC_F4_CFGR_PPRE2_LENGTH);
+    s->RCC_CFGR_PPRE2 = ppre;
+    clktree_set_scale(s->PCLK2, 1, ppre < 4 ? 1 : 1 << (ppre - 3));
+
+    /* PPRE1 */
+    ppre = extract32(new_value, RCC_F4_CFGR_PPRE1_START,
+                     RCC_F4_CFGR_PPRE1_LENGTH);
+    s->RCC_CFGR_PPRE1 = ppre;
+    clktree_set_scale(s->PCLK1, 1, ppre < 4 ? 1 : 1 << (ppre - 3));
+
+    /* HPRE */
+    s->RCC_CFGR_HPRE = (new_value & RCC_CFGR_HPRE_MASK) >> RCC_CFGR_HPRE_START;
+    clktree_set_scale(s->HCLK, 1,
+                      s->RCC_CFGR_HPRE < 8 ? 1 : hpre_div[s->RCC_CFGR_HPRE - 8]);
+
+    /* SW */
+    s->RCC_CFGR_SW = (new_value & RCC_CFGR_SW_MASK) >> RCC_CFGR_SW_START;
+    if(!init) {
+        if((s->RCC_CFGR_SW == SW_HSE_SELECTED &&
+            !stm32_rcc_osc_ready(s, RCC_OSC_HSE, s->HSECLK)) ||
+           (s->RCC_CFGR_SW == SW_PLL_SELECTED &&
+            !stm32_rcc_osc_ready(s, RCC_OSC_PLL, s->PLLCLK))) {
+            stm32_hw_warn("SYSCLK switched to a clock which is not ready");
+        }
+    }
+    switch(s->RCC_CFGR_SW) {
+        case 0x0:
+        case 0x1:
+        case 0x2:
+            clktree_set_selected_input(s->SYSCLK, s->RCC_CFGR_SW);
+            break;
+        default:
+            hw_error("Invalid input selected for SYSCLK");
+            break;
+    }
+
+    clktree_commit_update();
+}
+
+/* Write the AHB1 peripheral clock enable register.  The GPIOx enable bits
+ * are numbered in port order. */
+static void stm32_rcc_f4_AHB1ENR_write(Stm32Rcc *s, uint32_t new_value,
+                                       bool init)
+{
+    int i;
+
+    clktree_begin_update();
+
+    for(i = 0; i < STM32_GPIO_COUNT; i++) {
+        stm32_rcc_periph_enable(s, new_value, init, STM32_GPIOA + i,
+                                RCC_F4_AHB1ENR_GPIOAEN_BIT + i);
+    }
+    stm32_rcc_periph_enable(s, new_value, init, STM32_DMA1,
+                            RCC_F4_AHB1ENR_DMA1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_DMA2,
+                            RCC_F4_AHB1ENR_DMA2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_ETH,
+                            RCC_F4_AHB1ENR_ETHMACEN_BIT);
+
+    clktree_commit_update();
+
+    s->RCC_F4_AHB1ENR = new_value & RCC_F4_AHB1ENR_MASK;
+}
+
+/* Write the APB2 peripheral clock enable register.  SYSCFG, whose EXTI
+ * configuration registers are modelled by the AFIO device, uses the AFIO
+ * clock. */
+static void stm32_rcc_f4_APB2ENR_write(Stm32Rcc *s, uint32_t new_value,
+                                       bool init)
+{
+    clktree_begin_update();
+
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM1,
+                            RCC_F4_APB2ENR_TIM1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM8,
+                            RCC_F4_APB2ENR_TIM8EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_UART1,
+                            RCC_F4_APB2ENR_USART1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_ADC1,
+                            RCC_F4_APB2ENR_ADC1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_SPI1,
+                            RCC_F4_APB2ENR_SPI1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_AFIO_PERIPH,
+                            RCC_F4_APB2ENR_SYSCFGEN_BIT);
+
+    clktree_commit_update();
+
+    s->RCC_APB2ENR = new_value & RCC_F4_APB2ENR_MASK;
+}
+
+static uint64_t stm32_rcc_f4_read(void *opaque, hwaddr offset,
+                                  unsigned size)
+{
+    Stm32Rcc *s = (Stm32Rcc *)opaque;
+
+    if(size != 4) {
+        STM32_NOT_IMPL_REG(offset, size);
+        return 0;
+    }
+
+    switch (offset) {
+        case RCC_CR_OFFSET:
+            return stm32_rcc_RCC_CR_read(s);
+        case RCC_F4_PLLCFGR_OFFSET:
+            return s->RCC_F4_PLLCFGR;
+        case RCC_F4_CFGR_OFFSET:
+            return stm32_rcc_f4_CFGR_read(s);
+        case RCC_F4_CIR_OFFSET:
+            return 0;
+        case RCC_F4_AHB1ENR_OFFSET:
+            return s->RCC_F4_AHB1ENR;
+        case RCC_F4_AHB2ENR_OFFSET:
+            return s->RCC_F4_AHB2ENR;
+        case RCC_F4_AHB3ENR_OFFSET:
+            return s->RCC_F4_AHB3ENR;
+        case RCC_F4_APB1ENR_OFFSET:
+            return s->RCC_APB1ENR;
+        case RCC_F4_APB2ENR_OFFSET:
+            return s->RCC_APB2ENR;
+        case RCC_F4_BDCR_OFFSET:
+            return stm32_rcc_RCC_BDCR_read(s);
+        case RCC_F4_CSR_OFFSET:
+            return stm32_rcc_RCC_CSR_read(s);
+        case RCC_F4_AHB1RSTR_OFFSET:
+        case RCC_F4_AHB2RSTR_OFFSET:
+        case RCC_F4_AHB3RSTR_OFFSET:
+        case RCC_F4_APB1RSTR_OFFSET:
+        case RCC_F4_APB2RSTR_OFFSET:
+        case RCC_F4_AHB1LPENR_OFFSET:
+        case RCC_F4_AHB2LPENR_OFFSET:
+        case RCC_F4_AHB3LPENR_OFFSET:
+        case RCC_F4_APB1LPENR_OFFSET:
+        case RCC_F4_APB2LPENR_OFFSET:
+        case RCC_F4_PLLI2SCFGR_OFFSET:
+            return s->RCC_F4_PLLI2SCFGR;
+        case RCC_F4_SSCGR_OFFSET:
+            STM32_NOT_IMPL_REG(offset, size);
+            return 0;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_rcc_f4_write(void *opaque, hwaddr offset,
+                               uint64_t value, unsigned size)
+{
+    Stm32Rcc *s = (Stm32Rcc *)opaque;
+
+    if(size != 4) {
+        STM32_NOT_IMPL_REG(offset, size);
+        return;
+    }
+
+    switch (offset) {
+        case RCC_CR_OFFSET:
+            stm32_rcc_RCC_CR_write(s, value, false);
+            break;
+        case RCC_F4_PLLCFGR_OFFSET:
+            stm32_rcc_f4_PLLCFGR_write(s, value, false);
+            break;
+        case RCC_F4_CFGR_OFFSET:
+            stm32_rcc_f4_CFGR_write(s, value, false);
+            break;
+        case RCC_F4_CIR_OFFSET:
+            /* Allow a write but don't take any action */
+            break;
+        case RCC_F4_AHB1ENR_OFFSET:
+            stm32_rcc_f4_AHB1ENR_write(s, value, false);
+            break;
+        case RCC_F4_AHB2ENR_OFFSET:
+            /* None of the AHB2 peripherals (camera, crypto, RNG, USB OTG FS)
+             * are implemented. */
+            s->RCC_F4_AHB2ENR = value & RCC_F4_AHB2ENR_MASK;
+            break;
+        case RCC_F4_AHB3ENR_OFFSET:
+            s->RCC_F4_AHB3ENR = value & RCC_F4_AHB3ENR_MASK;
+            break;
+        case RCC_F4_APB1ENR_OFFSET:
+            /* The implemented APB1 enable bits are at the same positions as
+             * on the F1. */
+            stm32_rcc_RCC_APB1ENR_write(s, value, false);
+            s->RCC_APB1ENR = value & RCC_F4_APB1ENR_MASK;
+            break;
+        case RCC_F4_APB2ENR_OFFSET:
+            stm32_rcc_f4_APB2ENR_write(s, value, false);
+            break;
+        case RCC_F4_BDCR_OFFSET:
+            stm32_rcc_RCC_BDCR_write(s, value, false);
+            break;
+        case RCC_F4_CSR_OFFSET:
+            stm32_rcc_RCC_CSR_write(s, value, false);
+            break;
+        case RCC_F4_AHB1RSTR_OFFSET:
+        case RCC_F4_AHB2RSTR_OFFSET:
+        case RCC_F4_AHB3RSTR_OFFSET:
+        case RCC_F4_APB1RSTR_OFFSET:
+        case RCC_F4_APB2RSTR_OFFSET:
+        case RCC_F4_AHB1LPENR_OFFSET:
+        case RCC_F4_AHB2LPENR_OFFSET:
+        case RCC_F4_AHB3LPENR_OFFSET:
+        case RCC_F4_APB1LPENR_OFFSET:
+        case RCC_F4_APB2LPENR_OFFSET:
+        case RCC_F4_PLLI2SCFGR_OFFSET:
+            stm32_rcc_f4_PLLI2SCFGR_write(s, value, false);
+            break;
+        case RCC_F4_SSCGR_OFFSET:
+            STM32_NOT_IMPL_REG(offset, size);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static int64_t stm32_rcc_f4_poll_deadline(void *opaque, hwaddr offset,
+                                          unsigned size)
+{
+    switch(offset & 0xfffffffc) {
+        case RCC_F4_PLLCFGR_OFFSET:
+        case RCC_F4_CFGR_OFFSET:
+        case RCC_F4_CIR_OFFSET:
+            return INT64_MAX;
+        case RCC_F4_BDCR_OFFSET:
+            return stm32_rcc_poll_deadline(opaque, RCC_BDCR_OFFSET, size);
+        case RCC_F4_CSR_OFFSET:
+            return stm32_rcc_poll_deadline(opaque, RCC_CSR_OFFSET, size);
+        default:
+            /* CR is at the same offset on both families. */
+            return offset < 4 ? stm32_rcc_poll_deadline(opaque, offset, size)
+                              : -1;
+    }
+}
+
+static const MemoryRegionOps stm32_rcc_f4_ops = {
+    .read = stm32_rcc_f4_read,
+    .write = stm32_rcc_f4_write,
+    .poll_deadline = stm32_rcc_f4_poll_deadline,
+    .idempotent_reads = MEMORY_REGION_IDEMPOTENT(RCC_F4_PLLCFGR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(RCC_F4_CFGR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(RCC_F4_AHB1ENR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(RCC_F4_AHB2ENR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(RCC_F4_AHB3ENR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(RCC_F4_APB1ENR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(RCC_F4_APB2ENR_OFFSET),
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_rcc_f4_reset(Stm32Rcc *s)
+{
+    stm32_rcc_RCC_CR_write(s, 0x00000083, true);
+    stm32_rcc_f4_PLLCFGR_write(s, 0x24003010, true);
+    stm32_rcc_f4_PLLI2SCFGR_write(s, 0x20003000, true);
+    stm32_rcc_f4_CFGR_write(s, 0x00000000, true);
+    stm32_rcc_f4_AHB1ENR_write(s, 0x00100000, true);
+    s->RCC_F4_AHB2ENR = 0;
+    s->RCC_F4_AHB3ENR = 0;
+    stm32_rcc_RCC_APB1ENR_write(s, 0x00000000, true);
+    stm32_rcc_f4_APB2ENR_write(s, 0x00000000, true);
+    stm32_rcc_RCC_BDCR_write(s, 0x00000000, true);
+    /* Every reset pulls NRST low, and the earlier flags are kept */
+    stm32_rcc_RCC_CSR_write(s, s->RCC_CSR_RSTF | BIT(RCC_CSR_PINRSTF_BIT),
+                            true);
+}
+
 static void stm32_rcc_reset(DeviceState *dev)
 {
     Stm32Rcc *s = STM32_RCC(dev);
 
+    memory_region_flush_read_cache(&s->iomem);
+    if(s->f4) {
+        stm32_rcc_f4_reset(s);
+        return;
+    }
+
     stm32_rcc_RCC_CR_write(s, 0x00000083, true);
     stm32_rcc_RCC_CFGR_write(s, 0x00000000, true);
+    stm32_rcc_RCC_AHBENR_write(s, 0x00000014, true);
     stm32_rcc_RCC_APB2ENR_write(s, 0x00000000, true);
     stm32_rcc_RCC_APB1ENR_write(s, 0x00000000, true);
     stm32_rcc_RCC_BDCR_write(s, 0x00000000, true);
-    stm32_rcc_RCC_CSR_write(s, 0x0c000000, true);
+    /* Every reset pulls NRST low, and the earlier flags are kept */
+    stm32_rcc_RCC_CSR_write(s, s->RCC_CSR_RSTF | BIT(RCC_CSR_PINRSTF_BIT),
+                            true);
 }
 
 /* IRQ handler to handle updates to the HCLK frequency.
@@ -725,8 +1442,15 @@ static void stm32_rcc_hclk_upd_irq_handler(void *opaque, int n, int level)
          * (which is an unchanging number independent of the CPU frequency) to
          * system/external clock ticks.
          */
-        system_clock_scale = get_ticks_per_sec() / hclk_freq;
-        external_ref_clock_scale = get_ticks_per_sec() / ext_ref_freq;
+        if(s->nvic) {
+            armv7m_nvic_set_clock_scale(DEVICE(s->nvic),
+                                        get_ticks_per_sec() / hclk_freq,
+                                        get_ticks_per_sec() / ext_ref_freq);
+            armv7m_nvic_set_cpu_freq(DEVICE(s->nvic), hclk_freq);
+        } else {
+            system_clock_scale = get_ticks_per_sec() / hclk_freq;
+            external_ref_clock_scale = get_ticks_per_sec() / ext_ref_freq;
+        }
     }
 
 #ifdef DEBUG_STM32_RCC
@@ -785,6 +1509,52 @@ uint32_t stm32_rcc_get_periph_freq(
     return clktree_get_output_freq(clk);
 }
 
+uint32_t stm32_rcc_get_periph_generation(
+        Stm32Rcc *s,
+        stm32_periph_t periph)
+{
+    Clk clk;
+
+    clk = s->PERIPHCLK[periph];
+
+    assert(clk != NULL);
+
+    return clktree_get_generation(clk);
+}
+
+uint32_t stm32_rcc_get_lsi_freq(Stm32Rcc *s)
+{
+    return s->f4 ? F4_LSI_FREQ : LSI_FREQ;
+}
+
+void stm32_rcc_request_reset(Stm32Rcc *s, int rstf_bit)
+{
+    assert(BIT(rstf_bit) & RCC_CSR_RSTF_MASK);
+
+    s->RCC_CSR_RSTF |= BIT(rstf_bit);
+    qemu_system_reset_request();
+}
+
+void stm32_rcc_enter_stop(Stm32Rcc *s)
+{
+    clktree_begin_update();
+    stm32_rcc_osc_enable(s, RCC_OSC_PLL, s->PLLCLK, false, false);
+    stm32_rcc_osc_enable(s, RCC_OSC_HSE, s->HSECLK, false, false);
+    stm32_rcc_osc_enable(s, RCC_OSC_HSI, s->HSICLK, false, false);
+    clktree_commit_update();
+}
+
+void stm32_rcc_exit_stop(Stm32Rcc *s)
+{
+    clktree_begin_update();
+    stm32_rcc_osc_enable(s, RCC_OSC_HSI, s->HSICLK, true, false);
+    s->RCC_CFGR_SW = SW_HSI_SELECTED;
+    clktree_set_selected_input(s->SYSCLK, SW_HSI_SELECTED);
+    clktree_commit_update();
+    /* CFGR.SW has changed */
+    memory_region_flush_read_cache(&s->iomem);
+}
+
 /* DEVICE INITIALIZATION */
 
 /* Set up the clock tree */
@@ -860,6 +1630,21 @@ static void stm32_rcc_init_clk(Stm32Rcc *s)
     s->PERIPHCLK[STM32_UART4] = clktree_create_clk("UART4", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
     s->PERIPHCLK[STM32_UART5] = clktree_create_clk("UART5", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
 
+    s->PERIPHCLK[STM32_SPI1] = clktree_create_clk("SPI1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+    s->PERIPHCLK[STM32_SPI2] = clktree_create_clk("SPI2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_SPI3] = clktree_create_clk("SPI3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    /* The I2S bit clocks are generated from SYSCLK (on the high density
+     * parts - the PLL3 source of the connectivity line is not implemented),
+     * and SPI2EN and SPI3EN gate them together with the registers. */
+    s->PERIPHCLK[STM32_I2S2] = clktree_create_clk("I2S2", 1, 1, true, CLKTREE_NO_MAX_FREQ, 0, s->SYSCLK, NULL);
+    s->PERIPHCLK[STM32_I2S3] = clktree_create_clk("I2S3", 1, 1, true, CLKTREE_NO_MAX_FREQ, 0, s->SYSCLK, NULL);
+
+    s->PERIPHCLK[STM32_I2C1] = clktree_create_clk("I2C1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_I2C2] = clktree_create_clk("I2C2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_WWDG] = clktree_create_clk("WWDG", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_CAN1] = clktree_create_clk("CAN1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_CAN2] = clktree_create_clk("CAN2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+
     s->PERIPHCLK[STM32_TIM1] = clktree_create_clk("TIM1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
     s->PERIPHCLK[STM32_TIM2] = clktree_create_clk("TIM2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
     s->PERIPHCLK[STM32_TIM3] = clktree_create_clk("TIM3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
@@ -869,9 +1654,118 @@ static void stm32_rcc_init_clk(Stm32Rcc *s)
     s->PERIPHCLK[STM32_TIM7] = clktree_create_clk("TIM7", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
     s->PERIPHCLK[STM32_TIM8] = clktree_create_clk("TIM8", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
     s->PERIPHCLK[STM32_ADC1] = clktree_create_clk("ADC1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+    s->PERIPHCLK[STM32_ADC2] = clktree_create_clk("ADC2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+    s->PERIPHCLK[STM32_ADC3] = clktree_create_clk("ADC3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
     s->PERIPHCLK[STM32_RTC]  = clktree_create_clk("RTC", 1, 1, false, CLKTREE_NO_MAX_FREQ,-1,
                               s->LSECLK,s->LSICLK,s->HSE_DIV128, NULL);
     s->PERIPHCLK[STM32_DAC]  = clktree_create_clk("DAC", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_PWR]  = clktree_create_clk("PWR", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_BKP]  = clktree_create_clk("BKP", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+
+    s->PERIPHCLK[STM32_DMA1] = clktree_create_clk("DMA1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_DMA2] = clktree_create_clk("DMA2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_ETH]  = clktree_create_clk("ETH", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_USB_PERIPH] = clktree_create_clk("USB", 2, 3, false, 48000000, 0, s->PLLCLK, NULL);
+
+    /* HSICLK was created first, so this covers the whole tree. */
+    clktree_add_children(OBJECT(s), s->HSICLK);
+}
+
+/* Set up the STM32F4 clock tree.  GPIO and DMA are on the AHB1 bus, and
+ * the APB buses are limited to 42 and 84 MHz.  The RTC prescaler (RTCPRE)
+ * is not implemented, so the HSE RTC input is approximated by HSE/128. */
+static void stm32_rcc_f4_init_clk(Stm32Rcc *s)
+{
+    int i;
+    qemu_irq *hclk_upd_irq =
+            qemu_allocate_irqs(stm32_rcc_hclk_upd_irq_handler, s, 1);
+
+    for(i = 0; i < STM32_PERIPH_COUNT; i++) {
+        s->PERIPHCLK[i] = NULL;
+    }
+
+    s->HSICLK = clktree_create_src_clk("HSI", F4_HSI_FREQ, false);
+    s->LSICLK = clktree_create_src_clk("LSI", F4_LSI_FREQ, false);
+    s->HSECLK = clktree_create_src_clk("HSE", s->osc_freq, false);
+    s->LSECLK = clktree_create_src_clk("LSE", s->osc32_freq, false);
+
+    s->HSE_DIV128 = clktree_create_clk("HSE/128", 1, 128, true, CLKTREE_NO_MAX_FREQ, 0,
+                        s->HSECLK, NULL);
+
+    /* PLLCLK contains the source switch, the PLLM divider, the PLLN
+     * multiplier and the PLLP divider. */
+    s->PLLCLK = clktree_create_clk("PLLCLK", 0, 1, false, 168000000, CLKTREE_NO_INPUT,
+                        s->HSICLK, s->HSECLK, NULL);
+    /* PLLI2SCLK has the same source and PLLM divider, then the PLLI2SN
+     * multiplier and the PLLI2SR divider. */
+    s->PLLI2SCLK = clktree_create_clk("PLLI2S", 0, 1, false, 192000000, CLKTREE_NO_INPUT,
+                        s->HSICLK, s->HSECLK, NULL);
+
+    s->SYSCLK = clktree_create_clk("SYSCLK", 1, 1, true, 168000000, CLKTREE_NO_INPUT,
+                        s->HSICLK, s->HSECLK, s->PLLCLK, NULL);
+
+    s->HCLK = clktree_create_clk("HCLK", 0, 1, true, 168000000, 0,
+                        s->SYSCLK, NULL);
+    clktree_adduser(s->HCLK, hclk_upd_irq[0]);
+
+    s->PCLK1 = clktree_create_clk("PCLK1", 0, 1, true, 42000000, 0,
+                        s->HCLK, NULL);
+    s->PCLK2 = clktree_create_clk("PCLK2", 0, 1, true, 84000000, 0,
+                        s->HCLK, NULL);
+
+    /* Peripheral clocks */
+    s->PERIPHCLK[STM32_GPIOA] = clktree_create_clk("GPIOA", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_GPIOB] = clktree_create_clk("GPIOB", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_GPIOC] = clktree_create_clk("GPIOC", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_GPIOD] = clktree_create_clk("GPIOD", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_GPIOE] = clktree_create_clk("GPIOE", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_GPIOF] = clktree_create_clk("GPIOF", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_GPIOG] = clktree_create_clk("GPIOG", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+
+    s->PERIPHCLK[STM32_AFIO_PERIPH] = clktree_create_clk("SYSCFG", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+
+    s->PERIPHCLK[STM32_UART1] = clktree_create_clk("UART1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+    s->PERIPHCLK[STM32_UART2] = clktree_create_clk("UART2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_UART3] = clktree_create_clk("UART3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_UART4] = clktree_create_clk("UART4", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_UART5] = clktree_create_clk("UART5", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+
+    s->PERIPHCLK[STM32_SPI1] = clktree_create_clk("SPI1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+    s->PERIPHCLK[STM32_SPI2] = clktree_create_clk("SPI2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_SPI3] = clktree_create_clk("SPI3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    /* The I2S bit clocks are generated from PLLI2S, and SPI2EN and SPI3EN
+     * gate them together with the registers. */
+    s->PERIPHCLK[STM32_I2S2] = clktree_create_clk("I2S2", 1, 1, true, CLKTREE_NO_MAX_FREQ, 0, s->PLLI2SCLK, NULL);
+    s->PERIPHCLK[STM32_I2S3] = clktree_create_clk("I2S3", 1, 1, true, CLKTREE_NO_MAX_FREQ, 0, s->PLLI2SCLK, NULL);
+
+    s->PERIPHCLK[STM32_I2C1] = clktree_create_clk("I2C1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_I2C2] = clktree_create_clk("I2C2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_WWDG] = clktree_create_clk("WWDG", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_CAN1] = clktree_create_clk("CAN1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_CAN2] = clktree_create_clk("CAN2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+
+    s->PERIPHCLK[STM32_TIM1] = clktree_create_clk("TIM1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+    s->PERIPHCLK[STM32_TIM2] = clktree_create_clk("TIM2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_TIM3] = clktree_create_clk("TIM3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_TIM4] = clktree_create_clk("TIM4", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_TIM5] = clktree_create_clk("TIM5", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_TIM6] = clktree_create_clk("TIM6", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_TIM7] = clktree_create_clk("TIM7", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_TIM8] = clktree_create_clk("TIM8", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+    s->PERIPHCLK[STM32_ADC1] = clktree_create_clk("ADC1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+    s->PERIPHCLK[STM32_RTC]  = clktree_create_clk("RTC", 1, 1, false, CLKTREE_NO_MAX_FREQ, -1,
+                              s->LSECLK, s->LSICLK, s->HSE_DIV128, NULL);
+    s->PERIPHCLK[STM32_DAC]  = clktree_create_clk("DAC", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    /* The F4 keeps its backup registers in the RTC, but the BKP clock is
+     * created anyway since APB1ENR writes drive it on both families. */
+    s->PERIPHCLK[STM32_PWR]  = clktree_create_clk("PWR", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32_BKP]  = clktree_create_clk("BKP", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+
+    s->PERIPHCLK[STM32_DMA1] = clktree_create_clk("DMA1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_DMA2] = clktree_create_clk("DMA2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32_ETH]  = clktree_create_clk("ETH", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+
+    clktree_add_children(OBJECT(s), s->HSICLK);
 }
 
 
@@ -883,22 +1777,131 @@ static int stm32_rcc_init(SysBusDevice *dev)
 {
     Stm32Rcc *s = STM32_RCC(dev);
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_rcc_ops, s,
-                          "rcc", 0x3FF);
+    s->accurate_startup = false;
+    if(s->startup_prop) {
+        if(!strcmp(s->startup_prop, "accurate")) {
+            s->accurate_startup = true;
+        } else if(strcmp(s->startup_prop, "instant")) {
+            hw_error("Invalid startup mode \"%s\" for stm32-rcc",
+                     s->startup_prop);
+        }
+    }
+
+    memory_region_init_io(&s->iomem, OBJECT(s),
+                          s->f4 ? &stm32_rcc_f4_ops : &stm32_rcc_ops, s,
+                          "rcc", STM32_PERIPH_SIZE);
 
     sysbus_init_mmio(dev, &s->iomem);
 
     sysbus_init_irq(dev, &s->irq);
+    qdev_init_gpio_out_named(DEVICE(dev), &s->bdrst_irq, "bdrst", 1);
 
-    stm32_rcc_init_clk(s);
+    if(s->f4) {
+        stm32_rcc_f4_init_clk(s);
+        s->RCC_CSR_RSTF = BIT(RCC_CSR_PORRSTF_BIT) | BIT(RCC_CSR_BORRSTF_BIT);
+    } else {
+        stm32_rcc_init_clk(s);
+        s->RCC_CSR_RSTF = BIT(RCC_CSR_PORRSTF_BIT);
+    }
 
     return 0;
 }
 
 
+static void stm32_rcc_pre_save(void *opaque)
+{
+    Stm32Rcc *s = (Stm32Rcc *)opaque;
+
+    s->vmstate_cr = stm32_rcc_RCC_CR_read(s);
+    s->vmstate_cfgr = s->f4 ? stm32_rcc_f4_CFGR_read(s) :
+                              stm32_rcc_RCC_CFGR_read(s);
+    s->vmstate_bdcr = stm32_rcc_RCC_BDCR_read(s);
+    s->vmstate_csr = stm32_rcc_RCC_CSR_read(s);
+}
+
+/* The clock tree is not saved as such.  It is rebuilt by writing the saved
+ * register values, the same way as on reset, which also notifies the
+ * peripherals of their new clock frequencies. */
+static int stm32_rcc_post_load(void *opaque, int version_id)
+{
+    Stm32Rcc *s = (Stm32Rcc *)opaque;
+    int64_t ready_time[RCC_OSC_COUNT];
+    uint32_t apb1enr = s->RCC_APB1ENR;
+
+    /* Switching an oscillator on sets its ready time */
+    memcpy(ready_time, s->ready_time, sizeof(ready_time));
+
+    clktree_begin_update();
+
+    if(version_id < 2) {
+        s->RCC_F4_PLLI2SCFGR = 0x20003000;
+    }
+
+    /* The multiplexers go first, so that CR never switches off the clock
+     * which drives SYSCLK. */
+    if(s->f4) {
+        stm32_rcc_f4_PLLCFGR_write(s, s->RCC_F4_PLLCFGR, true);
+        stm32_rcc_f4_PLLI2SCFGR_write(s, s->RCC_F4_PLLI2SCFGR, true);
+        stm32_rcc_f4_CFGR_write(s, s->vmstate_cfgr, true);
+        stm32_rcc_RCC_CR_write(s, s->vmstate_cr, true);
+        stm32_rcc_f4_AHB1ENR_write(s, s->RCC_F4_AHB1ENR, true);
+        stm32_rcc_f4_APB2ENR_write(s, s->RCC_APB2ENR, true);
+    } else {
+        stm32_rcc_RCC_CFGR_write(s, s->vmstate_cfgr, true);
+        stm32_rcc_RCC_CR_write(s, s->vmstate_cr, true);
+        stm32_rcc_RCC_AHBENR_write(s, s->RCC_AHBENR, true);
+        stm32_rcc_RCC_APB2ENR_write(s, s->RCC_APB2ENR, true);
+    }
+    /* The F4 stores more APB1ENR bits than the F1 code knows about */
+    stm32_rcc_RCC_APB1ENR_write(s, apb1enr, true);
+    s->RCC_APB1ENR = apb1enr;
+    stm32_rcc_RCC_BDCR_write(s, s->vmstate_bdcr, true);
+    stm32_rcc_RCC_CSR_write(s, s->vmstate_csr, true);
+
+    clktree_commit_update();
+
+    memcpy(s->ready_time, ready_time, sizeof(ready_time));
+    memory_region_flush_read_cache(&s->iomem);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_rcc = {
+    .name = "stm32-rcc",
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .pre_save = stm32_rcc_pre_save,
+    .post_load = stm32_rcc_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT64_ARRAY(ready_time, Stm32Rcc, RCC_OSC_COUNT),
+        VMSTATE_UINT32(RCC_AHBENR, Stm32Rcc),
+        VMSTATE_UINT32(RCC_APB1ENR, Stm32Rcc),
+        VMSTATE_UINT32(RCC_APB2ENR, Stm32Rcc),
+        VMSTATE_UINT32(RCC_F4_PLLCFGR, Stm32Rcc),
+        VMSTATE_UINT32(RCC_F4_AHB1ENR, Stm32Rcc),
+        VMSTATE_UINT32(RCC_F4_AHB2ENR, Stm32Rcc),
+        VMSTATE_UINT32(RCC_F4_AHB3ENR, Stm32Rcc),
+        VMSTATE_UINT32(vmstate_cr, Stm32Rcc),
+        VMSTATE_UINT32(vmstate_cfgr, Stm32Rcc),
+        VMSTATE_UINT32(vmstate_bdcr, Stm32Rcc),
+        VMSTATE_UINT32(vmstate_csr, Stm32Rcc),
+        VMSTATE_UINT32_V(RCC_F4_PLLI2SCFGR, Stm32Rcc, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property stm32_rcc_properties[] = {
     DEFINE_PROP_UINT32("osc_freq", Stm32Rcc, osc_freq, 0),
     DEFINE_PROP_UINT32("osc32_freq", Stm32Rcc, osc32_freq, 0),
+    DEFINE_PROP_PTR("nvic", Stm32Rcc, nvic),
+    DEFINE_PROP_STRING("startup", Stm32Rcc, startup_prop),
+    /* Typical startup times from the STM32F103 datasheet. */
+    DEFINE_PROP_UINT32("hsi_startup_us", Stm32Rcc, startup_us[RCC_OSC_HSI], 2),
+    DEFINE_PROP_UINT32("hse_startup_us", Stm32Rcc, startup_us[RCC_OSC_HSE],
+                       2000),
+    DEFINE_PROP_UINT32("pll_lock_us", Stm32Rcc, startup_us[RCC_OSC_PLL], 200),
+    DEFINE_PROP_UINT32("lse_startup_us", Stm32Rcc, startup_us[RCC_OSC_LSE],
+                       3000000),
+    DEFINE_PROP_UINT32("lsi_startup_us", Stm32Rcc, startup_us[RCC_OSC_LSI], 85),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -910,6 +1913,7 @@ static void stm32_rcc_class_init(ObjectClass *klass, void *data)
 
     k->init = stm32_rcc_init;
     dc->reset = stm32_rcc_reset;
+    dc->vmsd = &vmstate_stm32_rcc;
     dc->props = stm32_rcc_properties;
 }
 
@@ -920,9 +1924,25 @@ static TypeInfo stm32_rcc_info = {
     .class_init = stm32_rcc_class_init
 };
 
+static void stm32_rcc_f4_instance_init(Object *obj)
+{
+    Stm32Rcc *s = STM32_RCC(obj);
+
+    s->f4 = true;
+}
+
+/* The startup time defaults are those of the F1; the F4 datasheet values
+ * are close enough for the "accurate" startup mode. */
+static TypeInfo stm32_rcc_f4_info = {
+    .name  = TYPE_STM32F4_RCC,
+    .parent = TYPE_STM32_RCC,
+    .instance_init = stm32_rcc_f4_instance_init
+};
+
 static void stm32_rcc_register_types(void)
 {
     type_register_static(&stm32_rcc_info);
+    type_register_static(&stm32_rcc_f4_info);
 }
 
 type_init(stm32_rcc_register_types)
@@ -0,0 +1,528 @@
+/*
+ * STM32 Microcontroller record and replay of external inputs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/arm/stm32.h"
+#include "qemu/timer.h"
+#include "sysemu/char.h"
+#include "sysemu/sysemu.h"
+#include "ui/console.h"
+
+/* With -icount N (a fixed shift), QEMU_CLOCK_VIRTUAL only moves with the
+ * instructions executed and with the jumps to timer deadlines, so it
+ * identifies a point in the execution.  What is left to make a run
+ * reproducible are the inputs from outside, which go through a replay
+ * channel each:
+ *  - Pushed inputs (chardev bytes and events, key presses) are logged with
+ *    the virtual time at which they arrive.  When replaying, the live ones
+ *    are dropped and the logged ones are applied by a timer at their time.
+ *  - Pulled inputs (values that a device reads from the shared memory
+ *    stimulus when it needs them) are logged in order, and handed back in
+ *    the same order when replaying.
+ * The other sample sources of the ADC (sine of the virtual time, rand()
+ * reseeded at reset, file) are deterministic already.  Since the waits
+ * for real time are not part of the log, a replay runs as with
+ * -icount N,sleep=off.
+ *
+ * The log starts with an 8 byte magic and a 32-bit little endian version.
+ * It is followed by records, each starting with a LEB128 tag, the channel
+ * index shifted left by 2 plus the record type:
+ *  - STM32_REPLAY_DEFINE: name length, name.  Written when the channel is
+ *    created, to check that the replaying machine has the same channels.
+ *  - STM32_REPLAY_PUSH: virtual time since the previous push record,
+ *    length, data.
+ *  - STM32_REPLAY_PULL: length, data.
+ * Lengths and times are LEB128 too.  The data are in host byte order, the
+ * log is meant to be replayed on the machine which recorded it. */
+
+/* DEFINITIONS */
+
+#define STM32_REPLAY_MAGIC "STM32RPL"
+#define STM32_REPLAY_VERSION 1
+
+enum {
+    STM32_REPLAY_DEFINE,
+    STM32_REPLAY_PUSH,
+    STM32_REPLAY_PULL,
+};
+
+typedef struct Stm32ReplayRecord {
+    int64_t time;       /* push records only */
+    unsigned channel;
+    const uint8_t *data;
+    unsigned len;
+} Stm32ReplayRecord;
+
+struct Stm32ReplayChannel {
+    unsigned index;
+    char *name;
+    Stm32ReplayHandler *handler;
+    void *opaque;
+};
+
+/* Pulled records of a channel, taken in order */
+typedef struct Stm32ReplayPullQueue {
+    GArray *records;
+    guint next;
+} Stm32ReplayPullQueue;
+
+typedef struct Stm32Replay {
+    FILE *record;
+    int64_t last_push_time;
+
+    /* Replay */
+    bool playing;
+    gchar *log;
+    GPtrArray *names;       /* channel names, by index */
+    GArray *push;           /* all push records, in time order */
+    guint push_next;
+    GPtrArray *pull;        /* Stm32ReplayPullQueue, by channel index */
+    QEMUTimer *timer;
+
+    GPtrArray *channels;
+    Notifier exit;
+} Stm32Replay;
+
+static Stm32Replay *stm32_replay;
+
+typedef struct Stm32ReplayChr {
+    IOCanReadHandler *can_read;
+    IOReadHandler *read;
+    IOEventHandler *event;
+    void *opaque;
+    Stm32ReplayChannel *ch;
+} Stm32ReplayChr;
+
+typedef struct Stm32ReplayKbd {
+    QEMUPutKBDEvent *func;
+    void *opaque;
+    Stm32ReplayChannel *ch;
+} Stm32ReplayKbd;
+
+
+
+
+/* LOG ENCODING */
+
+static void stm32_replay_put_uleb(FILE *f, uint64_t value)
+{
+    do {
+        uint8_t byte = value & 0x7f;
+
+        value >>= 7;
+        fputc(byte | (value ? 0x80 : 0), f);
+    } while(value);
+}
+
+static void stm32_replay_put(Stm32ReplayChannel *ch, int type,
+                             const void *buf, unsigned len)
+{
+    FILE *f = stm32_replay->record;
+    int64_t now;
+
+    stm32_replay_put_uleb(f, ((uint64_t)ch->index << 2) | type);
+    if(type == STM32_REPLAY_PUSH) {
+        now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        stm32_replay_put_uleb(f, now - stm32_replay->last_push_time);
+        stm32_replay->last_push_time = now;
+    }
+    stm32_replay_put_uleb(f, len);
+    fwrite(buf, 1, len, f);
+}
+
+static bool stm32_replay_get_uleb(const uint8_t **p, const uint8_t *end,
+                                  uint64_t *value)
+{
+    int shift = 0;
+
+    *value = 0;
+    while(*p < end && shift < 64) {
+        uint8_t byte = *(*p)++;
+
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
+/* Split the log into the channel names, the push records and the pull
+ * records of each channel. */
+static void stm32_replay_parse(Stm32Replay *r, const char *file, gsize size)
+{
+    const uint8_t *p = (const uint8_t *)r->log + 12;
+    const uint8_t *end = (const uint8_t *)r->log + size;
+    Stm32ReplayPullQueue *q;
+    Stm32ReplayRecord rec;
+    uint64_t tag, value, time = 0;
+    int type;
+
+    if(size < 12 || memcmp(r->log, STM32_REPLAY_MAGIC, 8) ||
+       ldl_le_p(r->log + 8) != STM32_REPLAY_VERSION) {
+        hw_error("Replay: %s is not a replay log", file);
+    }
+
+    while(p < end) {
+        if(!stm32_replay_get_uleb(&p, end, &tag)) {
+            break;
+        }
+        type = tag & 3;
+        rec.channel = tag >> 2;
+        if(type == STM32_REPLAY_PUSH) {
+            if(!stm32_replay_get_uleb(&p, end, &value)) {
+                break;
+            }
+            time += value;
+        }
+        rec.time = time;
+        if(!stm32_replay_get_uleb(&p, end, &value) ||
+           value > (uint64_t)(end - p)) {
+            break;
+        }
+        rec.data = p;
+        rec.len = value;
+        p += value;
+
+        switch(type) {
+            case STM32_REPLAY_DEFINE:
+                if(rec.channel != r->names->len) {
+                    hw_error("Replay: %s is corrupt", file);
+                }
+                g_ptr_array_add(r->names,
+                                g_strndup((const char *)rec.data, rec.len));
+                break;
+            case STM32_REPLAY_PUSH:
+                g_array_append_val(r->push, rec);
+                break;
+            case STM32_REPLAY_PULL:
+                if(rec.channel >= r->pull->len) {
+                    g_ptr_array_set_size(r->pull, rec.channel + 1);
+                }
+                q = g_ptr_array_index(r->pull, rec.channel);
+                if(!q) {
+                    q = g_new0(Stm32ReplayPullQueue, 1);
+                    q->records = g_array_new(false, false,
+                                             sizeof(Stm32ReplayRecord));
+                    g_ptr_array_index(r->pull, rec.channel) = q;
+                }
+                g_array_append_val(q->records, rec);
+                break;
+            default:
+                hw_error("Replay: %s is corrupt", file);
+        }
+    }
+    /* A log cut short by a crash is replayed up to its last full record */
+}
+
+
+
+
+/* REPLAY */
+
+static Stm32ReplayRecord *stm32_replay_push_record(Stm32Replay *r, guint i)
+{
+    return &g_array_index(r->push, Stm32ReplayRecord, i);
+}
+
+static void stm32_replay_schedule(Stm32Replay *r)
+{
+    if(r->push_next < r->push->len) {
+        timer_mod(r->timer, stm32_replay_push_record(r, r->push_next)->time);
+    } else {
+        timer_del(r->timer);
+    }
+}
+
+/* Apply the pushed inputs which are due, in the order they were logged. */
+static void stm32_replay_run(void *opaque)
+{
+    Stm32Replay *r = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    Stm32ReplayRecord *rec;
+    Stm32ReplayChannel *ch;
+
+    while(r->push_next < r->push->len) {
+        rec = stm32_replay_push_record(r, r->push_next);
+        if(rec->time > now) {
+            break;
+        }
+        r->push_next++;
+        ch = rec->channel < r->channels->len ?
+             g_ptr_array_index(r->channels, rec->channel) : NULL;
+        if(!ch || !ch->handler) {
+            hw_error("Replay: input for channel %u, which takes none",
+                     rec->channel);
+        }
+        ch->handler(ch->opaque, rec->data, rec->len);
+    }
+    stm32_replay_schedule(r);
+}
+
+
+
+
+/* CHANNELS */
+
+Stm32ReplayChannel *stm32_replay_channel_new(const char *name,
+                                             Stm32ReplayHandler *handler,
+                                             void *opaque)
+{
+    Stm32Replay *r = stm32_replay;
+    Stm32ReplayChannel *ch;
+
+    if(!r) {
+        return NULL;
+    }
+
+    ch = g_new0(Stm32ReplayChannel, 1);
+    ch->index = r->channels->len;
+    ch->name = g_strdup(name);
+    ch->handler = handler;
+    ch->opaque = opaque;
+    g_ptr_array_add(r->channels, ch);
+
+    if(r->record) {
+        stm32_replay_put(ch, STM32_REPLAY_DEFINE, name, strlen(name));
+    }
+    if(r->playing && (ch->index >= r->names->len ||
+                      strcmp(g_ptr_array_index(r->names, ch->index), name))) {
+        hw_error("Replay: input %s was not recorded, the machine must be "
+                 "configured as for the recording", name);
+    }
+    return ch;
+}
+
+bool stm32_replay_input(Stm32ReplayChannel *ch, const void *buf, int size)
+{
+    if(!ch) {
+        return true;
+    }
+    if(stm32_replay->playing) {
+        return false;
+    }
+    stm32_replay_put(ch, STM32_REPLAY_PUSH, buf, size);
+    return true;
+}
+
+void stm32_replay_value(Stm32ReplayChannel *ch, void *buf, int size)
+{
+    Stm32ReplayPullQueue *q;
+    Stm32ReplayRecord *rec;
+
+    if(!ch) {
+        return;
+    }
+    if(!stm32_replay->playing) {
+        stm32_replay_put(ch, STM32_REPLAY_PULL, buf, size);
+        return;
+    }
+
+    /* Past the end of the log, the live value is used */
+    q = ch->index < stm32_replay->pull->len ?
+        g_ptr_array_index(stm32_replay->pull, ch->index) : NULL;
+    if(!q || q->next >= q->records->len) {
+        return;
+    }
+    rec = &g_array_index(q->records, Stm32ReplayRecord, q->next++);
+    if(rec->len != size) {
+        hw_error("Replay: %s diverged from the recording", ch->name);
+    }
+    memcpy(buf, rec->data, size);
+}
+
+
+
+
+/* CHARDEVS AND KEYBOARD */
+
+/* Payload of the chardev push records: the first byte says what it is */
+enum {
+    STM32_REPLAY_CHR_DATA,
+    STM32_REPLAY_CHR_EVENT,
+};
+
+static int stm32_replay_chr_can_read(void *opaque)
+{
+    Stm32ReplayChr *c = opaque;
+
+    /* Live input is left in the chardev when replaying */
+    if(stm32_replay->playing) {
+        return 0;
+    }
+    return c->can_read(c->opaque);
+}
+
+static void stm32_replay_chr_read(void *opaque, const uint8_t *buf, int size)
+{
+    Stm32ReplayChr *c = opaque;
+    uint8_t *rec = g_alloca(size + 1);
+
+    rec[0] = STM32_REPLAY_CHR_DATA;
+    memcpy(rec + 1, buf, size);
+    stm32_replay_input(c->ch, rec, size + 1);
+    c->read(c->opaque, buf, size);
+}
+
+static void stm32_replay_chr_event(void *opaque, int event)
+{
+    Stm32ReplayChr *c = opaque;
+    uint8_t rec[2] = { STM32_REPLAY_CHR_EVENT, event };
+
+    if(c->event && stm32_replay_input(c->ch, rec, sizeof(rec))) {
+        c->event(c->opaque, event);
+    }
+}
+
+static void stm32_replay_chr_apply(void *opaque, const uint8_t *buf,
+                                   int size)
+{
+    Stm32ReplayChr *c = opaque;
+
+    if(size >= 2 && buf[0] == STM32_REPLAY_CHR_DATA) {
+        if(c->can_read(c->opaque) < size - 1) {
+            hw_error("Replay: %s diverged from the recording", c->ch->name);
+        }
+        c->read(c->opaque, buf + 1, size - 1);
+    } else if(size == 2 && buf[0] == STM32_REPLAY_CHR_EVENT) {
+        c->event(c->opaque, buf[1]);
+    }
+}
+
+void stm32_replay_chr_add_handlers(CharDriverState *chr, const char *name,
+                                   IOCanReadHandler *can_read,
+                                   IOReadHandler *read,
+                                   IOEventHandler *event, void *opaque)
+{
+    Stm32ReplayChr *c;
+
+    if(!stm32_replay) {
+        qemu_chr_add_handlers(chr, can_read, read, event, opaque);
+        return;
+    }
+
+    c = g_new0(Stm32ReplayChr, 1);
+    c->can_read = can_read;
+    c->read = read;
+    c->event = event;
+    c->opaque = opaque;
+    c->ch = stm32_replay_channel_new(name, stm32_replay_chr_apply, c);
+    qemu_chr_add_handlers(chr, stm32_replay_chr_can_read,
+                          stm32_replay_chr_read, stm32_replay_chr_event, c);
+}
+
+static void stm32_replay_kbd_event(void *opaque, int keycode)
+{
+    Stm32ReplayKbd *k = opaque;
+    uint8_t code = keycode;
+
+    if(stm32_replay_input(k->ch, &code, 1)) {
+        k->func(k->opaque, code);
+    }
+}
+
+static void stm32_replay_kbd_apply(void *opaque, const uint8_t *buf, int size)
+{
+    Stm32ReplayKbd *k = opaque;
+
+    if(size == 1) {
+        k->func(k->opaque, buf[0]);
+    }
+}
+
+void stm32_replay_add_kbd_event_handler(const char *name,
+                                        void (*func)(void *opaque,
+                                                     int keycode),
+                                        void *opaque)
+{
+    Stm32ReplayKbd *k;
+
+    if(!stm32_replay) {
+        qemu_add_kbd_event_handler(func, opaque);
+        return;
+    }
+
+    k = g_new0(Stm32ReplayKbd, 1);
+    k->func = func;
+    k->opaque = opaque;
+    k->ch = stm32_replay_channel_new(name, stm32_replay_kbd_apply, k);
+    qemu_add_kbd_event_handler(stm32_replay_kbd_event, k);
+}
+
+
+
+
+/* INITIALIZATION */
+
+static void stm32_replay_exit(Notifier *notifier, void *data)
+{
+    Stm32Replay *r = container_of(notifier, Stm32Replay, exit);
+
+    if(r->record) {
+        fclose(r->record);
+        r->record = NULL;
+    }
+}
+
+void stm32_replay_init(const char *record_file, const char *replay_file)
+{
+    Stm32Replay *r;
+    uint8_t version[4];
+    GError *err = NULL;
+    gsize size;
+
+    if(stm32_replay || (!record_file && !replay_file)) {
+        /* The machines of a multi-microcontroller setup share one log */
+        return;
+    }
+    if(record_file && replay_file) {
+        hw_error("Replay: cannot record and replay at the same time");
+    }
+    if(use_icount != 1) {
+        hw_error("Replay: -icount with a fixed shift is required");
+    }
+
+    r = g_new0(Stm32Replay, 1);
+    r->channels = g_ptr_array_new();
+
+    if(record_file) {
+        r->record = fopen(record_file, "wb");
+        if(!r->record) {
+            hw_error("Replay: cannot create %s: %s", record_file,
+                     strerror(errno));
+        }
+        stl_le_p(version, STM32_REPLAY_VERSION);
+        fwrite(STM32_REPLAY_MAGIC, 1, 8, r->record);
+        fwrite(version, 1, sizeof(version), r->record);
+        r->exit.notify = stm32_replay_exit;
+        qemu_add_exit_notifier(&r->exit);
+    } else {
+        if(!g_file_get_contents(replay_file, &r->log, &size, &err)) {
+            hw_error("Replay: cannot read %s: %s", replay_file,
+                     err->message);
+        }
+        r->playing = true;
+        r->names = g_ptr_array_new();
+        r->push = g_array_new(false, false, sizeof(Stm32ReplayRecord));
+        r->pull = g_ptr_array_new();
+        stm32_replay_parse(r, replay_file, size);
+        r->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, stm32_replay_run, r);
+        stm32_replay_schedule(r);
+        icount_disable_sleep();
+    }
+    stm32_replay = r;
+}
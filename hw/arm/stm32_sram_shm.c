@@ -0,0 +1,158 @@
+/*
+ * STM32 Microcontroller SRAM in a shared memory file
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+
+#include "hw/arm/stm32.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/timer.h"
+
+/* The SRAM is the file itself, so that another process (a telemetry
+ * analyser, say) can map it and read the firmware's data structures with
+ * no copy and no call into QEMU.  The file has a Stm32SramShmHeader in its
+ * first host page, then the SRAM at sram_offset.  All header fields are
+ * little endian.
+ *
+ * The live SRAM changes under the reader's feet while the CPU runs.  For
+ * views which must be consistent, period_ns makes QEMU copy the SRAM to a
+ * snapshot at snapshot_offset every period_ns of virtual time, from a
+ * timer, so always between two instructions.  seq is odd during the copy
+ * and time is the virtual time of the snapshot: a reader reads seq, waits
+ * while it is odd, copies what it needs from the snapshot, and starts
+ * again if seq has changed since. */
+
+/* DEFINITIONS */
+
+#define STM32_SRAM_SHM_MAGIC 0x4d415253 /* "SRAM" */
+#define STM32_SRAM_SHM_VERSION 1
+
+typedef struct Stm32SramShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sram_base;
+    uint32_t sram_size;
+    uint32_t sram_offset;
+    uint32_t snapshot_offset;   /* 0 without period_ns */
+    uint32_t seq;
+    uint32_t reserved0;
+    int64_t time;
+    uint8_t reserved[24];
+} Stm32SramShmHeader;
+
+typedef struct Stm32SramShm {
+    MemoryRegion mr;
+    Stm32SramShmHeader *hdr;
+    uint8_t *sram;
+    uint8_t *snapshot;
+    uint32_t size;
+
+    uint32_t period_ns;
+    QEMUTimer *snapshot_timer;
+} Stm32SramShm;
+
+
+
+
+/* SNAPSHOT */
+
+static void stm32_sram_shm_snapshot(void *opaque)
+{
+    Stm32SramShm *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t seq = le32_to_cpu(s->hdr->seq);
+
+    atomic_set(&s->hdr->seq, cpu_to_le32(seq + 1));
+    smp_wmb();
+    memcpy(s->snapshot, s->sram, s->size);
+    s->hdr->time = cpu_to_le64(now);
+    smp_wmb();
+    atomic_set(&s->hdr->seq, cpu_to_le32(seq + 2));
+
+    timer_mod(s->snapshot_timer, now + s->period_ns);
+}
+
+
+
+
+/* INITIALIZATION */
+
+MemoryRegion *stm32_sram_shm_init(const char *name, uint32_t size,
+                                  const char *path, uint32_t period_ns)
+{
+    Stm32SramShm *s = g_new0(Stm32SramShm, 1);
+    size_t page = getpagesize();
+    size_t sram_space = ROUND_UP(size, page);
+    size_t map_size;
+    struct stat st;
+    uint8_t *mem;
+    int fd;
+
+    QEMU_BUILD_BUG_ON(sizeof(Stm32SramShmHeader) != 64);
+
+    map_size = page + sram_space + (period_ns ? sram_space : 0);
+
+    fd = qemu_open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+        hw_error("SRAM export: cannot open %s: %s", path, strerror(errno));
+    }
+    if(fstat(fd, &st) < 0 ||
+       (st.st_size < map_size && ftruncate(fd, map_size) < 0)) {
+        hw_error("SRAM export: cannot resize %s: %s", path, strerror(errno));
+    }
+    mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if(mem == MAP_FAILED) {
+        hw_error("SRAM export: cannot map %s: %s", path, strerror(errno));
+    }
+
+    s->hdr = (Stm32SramShmHeader *)mem;
+    s->sram = mem + page;
+    s->size = size;
+    /* Whatever a previous run left in the file is not the SRAM's content;
+     * readers must not look at it before the magic is back */
+    s->hdr->magic = 0;
+    smp_wmb();
+    memset(s->sram, 0, sram_space);
+    s->hdr->version = cpu_to_le32(STM32_SRAM_SHM_VERSION);
+    s->hdr->sram_base = cpu_to_le32(0x20000000);
+    s->hdr->sram_size = cpu_to_le32(size);
+    s->hdr->sram_offset = cpu_to_le32(page);
+    s->hdr->seq = 0;
+    s->hdr->time = 0;
+    if(period_ns) {
+        s->snapshot = s->sram + sram_space;
+        memset(s->snapshot, 0, sram_space);
+        s->hdr->snapshot_offset = cpu_to_le32(page + sram_space);
+    } else {
+        s->hdr->snapshot_offset = 0;
+    }
+    smp_wmb();
+    s->hdr->magic = cpu_to_le32(STM32_SRAM_SHM_MAGIC);
+
+    memory_region_init_ram_ptr(&s->mr, NULL, name, size, s->sram);
+    vmstate_register_ram_global(&s->mr);
+
+    s->period_ns = period_ns;
+    if(period_ns) {
+        s->snapshot_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                         stm32_sram_shm_snapshot, s);
+        timer_mod(s->snapshot_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + period_ns);
+    }
+    return &s->mr;
+}
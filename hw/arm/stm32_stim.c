@@ -0,0 +1,160 @@
+/*
+ * STM32 Microcontroller shared memory stimulus mailbox
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/arm/stm32.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include <sys/mman.h>
+
+/* An external process (e.g. a plant simulation) drives GPIO input pins and
+ * ADC channels by writing into a file which QEMU maps.  There is no
+ * message to send and nothing to wait for: the GPIO ports read the levels
+ * when the firmware reads IDR (and, optionally, periodically so that EXTI
+ * sees the edges), and the ADCs read the channel values when a conversion
+ * completes.
+ *
+ * The file has a Stm32StimHeader, then one Stm32StimSlot per
+ * microcontroller, in the order they were created.  All fields are little
+ * endian.  In each slot, the pins set in gpio_mask[port] are driven with
+ * the levels in gpio_value[port] (port 0 is GPIOA), and the regular
+ * channels set in adc_mask[adc] convert adc_value[adc][channel] (adc 0 is
+ * ADC1).  The other pins and channels keep their usual source.  A writer
+ * should store the value before setting the mask bit. */
+
+/* DEFINITIONS */
+
+#define STM32_STIM_MAGIC 0x4d495453 /* "STIM" */
+#define STM32_STIM_VERSION 1
+#define STM32_STIM_MAX_SLOTS 16
+#define STM32_STIM_GPIO_PORTS 16
+#define STM32_STIM_ADCS 4
+#define STM32_STIM_ADC_CHANNELS 32
+
+typedef struct Stm32StimHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint8_t reserved[48];
+} Stm32StimHeader;
+
+struct Stm32StimSlot {
+    uint16_t gpio_mask[STM32_STIM_GPIO_PORTS];
+    uint16_t gpio_value[STM32_STIM_GPIO_PORTS];
+    uint32_t adc_mask[STM32_STIM_ADCS];
+    uint16_t adc_value[STM32_STIM_ADCS][STM32_STIM_ADC_CHANNELS];
+    uint8_t reserved[176];
+};
+
+typedef struct Stm32StimFile {
+    char *path;
+    Stm32StimHeader *hdr;
+    QLIST_ENTRY(Stm32StimFile) next;
+} Stm32StimFile;
+
+static QLIST_HEAD(, Stm32StimFile) stm32_stim_files =
+    QLIST_HEAD_INITIALIZER(stm32_stim_files);
+
+
+
+
+/* INITIALIZATION */
+
+/* Maps the file, once for all of the microcontrollers using it.  Existing
+ * contents are kept, so the stimulus process may create it first. */
+static Stm32StimFile *stm32_stim_open(const char *path)
+{
+    Stm32StimFile *f;
+    size_t size = sizeof(Stm32StimHeader) +
+                  STM32_STIM_MAX_SLOTS * sizeof(Stm32StimSlot);
+    struct stat st;
+    void *mem;
+    int fd;
+
+    QEMU_BUILD_BUG_ON(sizeof(Stm32StimHeader) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(Stm32StimSlot) != 512);
+
+    QLIST_FOREACH(f, &stm32_stim_files, next) {
+        if(!strcmp(f->path, path)) {
+            return f;
+        }
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0 || fstat(fd, &st) < 0 ||
+       (st.st_size < size && ftruncate(fd, size) < 0)) {
+        hw_error("Stimulus file: cannot create %s: %s", path,
+                 strerror(errno));
+    }
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mem == MAP_FAILED) {
+        hw_error("Stimulus file: cannot map %s: %s", path, strerror(errno));
+    }
+    close(fd);
+
+    f = g_new0(Stm32StimFile, 1);
+    f->path = g_strdup(path);
+    f->hdr = mem;
+    f->hdr->version = cpu_to_le32(STM32_STIM_VERSION);
+    f->hdr->slot_count = cpu_to_le32(STM32_STIM_MAX_SLOTS);
+    f->hdr->slot_size = cpu_to_le32(sizeof(Stm32StimSlot));
+    smp_wmb();
+    f->hdr->magic = cpu_to_le32(STM32_STIM_MAGIC);
+    QLIST_INSERT_HEAD(&stm32_stim_files, f, next);
+    return f;
+}
+
+Stm32StimSlot *stm32_stim_get_slot(const char *path, unsigned index)
+{
+    Stm32StimFile *f = stm32_stim_open(path);
+
+    if(index >= STM32_STIM_MAX_SLOTS) {
+        hw_error("Stimulus file: only %d microcontrollers are supported",
+                 STM32_STIM_MAX_SLOTS);
+    }
+    return (Stm32StimSlot *)(f->hdr + 1) + index;
+}
+
+
+
+
+/* ACCESS */
+
+uint16_t stm32_stim_gpio(Stm32StimSlot *slot, unsigned port, uint16_t *value)
+{
+    uint16_t mask;
+
+    assert(port < STM32_STIM_GPIO_PORTS);
+
+    mask = le16_to_cpu(atomic_read(&slot->gpio_mask[port]));
+    smp_rmb();
+    *value = le16_to_cpu(atomic_read(&slot->gpio_value[port]));
+    return mask;
+}
+
+bool stm32_stim_adc(Stm32StimSlot *slot, unsigned adc, unsigned channel,
+                    uint16_t *value)
+{
+    assert(adc < STM32_STIM_ADCS && channel < STM32_STIM_ADC_CHANNELS);
+
+    if(!(le32_to_cpu(atomic_read(&slot->adc_mask[adc])) & BIT(channel))) {
+        return false;
+    }
+    smp_rmb();
+    *value = le16_to_cpu(atomic_read(&slot->adc_value[adc][channel]));
+    return true;
+}
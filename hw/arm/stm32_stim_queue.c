@@ -0,0 +1,309 @@
+/*
+ * STM32 Microcontroller timestamped stimulus
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/arm/stm32.h"
+#include "qemu/timer.h"
+#include "qemu/error-report.h"
+#include "sysemu/char.h"
+
+/* Input events, each applied at a given time of QEMU_CLOCK_VIRTUAL, come
+ * from a text file loaded at startup or from a chardev (e.g. a socket),
+ * one per line:
+ *
+ *   <time_ns> gpio <port> <pin> <level>     port A to G, pin 0 to 15
+ *   <time_ns> adc <adc> <channel> <value>   adc 1 to 3, channel 0 to 17
+ *
+ * Blank lines and lines starting with '#' are ignored.  The events of a
+ * file may be in any order, those with the same time are applied in file
+ * order.  Events received on the chardev are expected in time order; one
+ * that is already due when it arrives is applied at once.
+ *
+ * The pending events are kept sorted in an array, and a single timer is
+ * armed for the first one.  When it fires, all of the events which are due
+ * are applied; the GPIO edges of one port at one time are passed on to the
+ * port as a single change. */
+
+/* DEFINITIONS */
+
+#define STM32_STIM_QUEUE_LINE_MAX 128
+
+typedef enum {
+    STM32_STIM_EVENT_GPIO,
+    STM32_STIM_EVENT_ADC,
+} Stm32StimEventType;
+
+typedef struct Stm32StimEvent {
+    int64_t time;
+    uint8_t type;
+    uint8_t unit;     /* GPIO port, or ADC index (0 is ADC1) */
+    uint8_t line;     /* GPIO pin or ADC channel */
+    uint16_t value;
+} Stm32StimEvent;
+
+struct Stm32StimQueue {
+    GArray *events;
+    guint head; /* index of the first pending event */
+    QEMUTimer *timer;
+
+    Stm32Gpio *gpio[STM32_GPIO_COUNT];
+    Stm32Adc *adc[STM32_ADC_COUNT];
+
+    /* Chardev source */
+    CharDriverState *chr;
+    char line[STM32_STIM_QUEUE_LINE_MAX];
+    int line_len;
+};
+
+
+
+
+/* QUEUE */
+
+static Stm32StimEvent *stm32_stim_queue_event(Stm32StimQueue *q, guint i)
+{
+    return &g_array_index(q->events, Stm32StimEvent, i);
+}
+
+/* Arm the timer for the first pending event. */
+static void stm32_stim_queue_schedule(Stm32StimQueue *q)
+{
+    if(q->head < q->events->len) {
+        timer_mod(q->timer, stm32_stim_queue_event(q, q->head)->time);
+    } else {
+        timer_del(q->timer);
+    }
+}
+
+/* Insert an event after those with the same or an earlier time.  Events
+ * mostly arrive in order, so the search starts from the end. */
+static void stm32_stim_queue_insert(Stm32StimQueue *q, Stm32StimEvent *ev)
+{
+    guint i = q->events->len;
+
+    while(i > q->head && stm32_stim_queue_event(q, i - 1)->time > ev->time) {
+        i--;
+    }
+    g_array_insert_val(q->events, i, *ev);
+}
+
+static void stm32_stim_queue_flush_gpio(Stm32StimQueue *q, uint16_t *mask,
+                                        uint16_t *value)
+{
+    int i;
+
+    for(i = 0; i < STM32_GPIO_COUNT; i++) {
+        if(mask[i] && q->gpio[i]) {
+            stm32_gpio_set_inputs(q->gpio[i], mask[i], value[i]);
+        }
+        mask[i] = 0;
+    }
+}
+
+/* Apply the events which are due. */
+static void stm32_stim_queue_run(void *opaque)
+{
+    Stm32StimQueue *q = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint16_t gpio_mask[STM32_GPIO_COUNT] = { 0 };
+    uint16_t gpio_value[STM32_GPIO_COUNT];
+    int64_t gpio_time = 0;
+    Stm32StimEvent *ev;
+
+    while(q->head < q->events->len) {
+        ev = stm32_stim_queue_event(q, q->head);
+        if(ev->time > now) {
+            break;
+        }
+        q->head++;
+
+        if(ev->time != gpio_time) {
+            stm32_stim_queue_flush_gpio(q, gpio_mask, gpio_value);
+            gpio_time = ev->time;
+        }
+        switch(ev->type) {
+            case STM32_STIM_EVENT_GPIO:
+                /* A later edge of the same pin at the same time wins */
+                gpio_mask[ev->unit] |= BIT(ev->line);
+                gpio_value[ev->unit] = deposit32(gpio_value[ev->unit],
+                                                 ev->line, 1, ev->value);
+                break;
+            case STM32_STIM_EVENT_ADC:
+                if(q->adc[ev->unit]) {
+                    stm32_adc_set_input(q->adc[ev->unit], ev->line,
+                                        ev->value, ev->time);
+                }
+                break;
+        }
+    }
+    stm32_stim_queue_flush_gpio(q, gpio_mask, gpio_value);
+
+    /* Drop the applied events once they are the larger part of the array */
+    if(q->head > q->events->len / 2) {
+        g_array_remove_range(q->events, 0, q->head);
+        q->head = 0;
+    }
+    stm32_stim_queue_schedule(q);
+}
+
+/* Parse one line.  Returns false if it is not a valid event; blank lines
+ * and comments give true with no event. */
+static bool stm32_stim_queue_parse(const char *line, Stm32StimEvent *ev,
+                                   bool *valid)
+{
+    char type[8], unit[8];
+    long long time;
+    unsigned n, value;
+    int end = 0;
+
+    *valid = false;
+    while(qemu_isspace(*line)) {
+        line++;
+    }
+    if(*line == '\0' || *line == '#') {
+        return true;
+    }
+    if(sscanf(line, "%lld %7s %7s %u %u %n", &time, type, unit, &n, &value,
+              &end) != 5 || line[end] != '\0' || time < 0) {
+        return false;
+    }
+
+    ev->time = time;
+    ev->line = n;
+    ev->value = value;
+    if(!strcmp(type, "gpio")) {
+        ev->type = STM32_STIM_EVENT_GPIO;
+        ev->unit = qemu_toupper(unit[0]) - 'A';
+        if(unit[1] != '\0' || ev->unit >= STM32_GPIO_COUNT || n > 15 ||
+           value > 1) {
+            return false;
+        }
+    } else if(!strcmp(type, "adc")) {
+        ev->type = STM32_STIM_EVENT_ADC;
+        ev->unit = unit[0] - '1';
+        if(unit[1] != '\0' || ev->unit >= STM32_ADC_COUNT ||
+           n >= STM32_ADC_INPUTS || value > 0xfff) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    *valid = true;
+    return true;
+}
+
+
+
+
+/* SOURCES */
+
+static void stm32_stim_queue_load(Stm32StimQueue *q, const char *file)
+{
+    char line[STM32_STIM_QUEUE_LINE_MAX];
+    Stm32StimEvent ev;
+    bool valid;
+    int lineno = 0;
+    FILE *f;
+
+    f = fopen(file, "r");
+    if(!f) {
+        hw_error("Stimulus events: cannot open %s: %s", file,
+                 strerror(errno));
+    }
+    while(fgets(line, sizeof(line), f)) {
+        lineno++;
+        if(!stm32_stim_queue_parse(line, &ev, &valid)) {
+            hw_error("Stimulus events: %s:%d: invalid event", file, lineno);
+        }
+        if(valid) {
+            stm32_stim_queue_insert(q, &ev);
+        }
+    }
+    fclose(f);
+}
+
+static int stm32_stim_queue_can_receive(void *opaque)
+{
+    Stm32StimQueue *q = opaque;
+
+    return STM32_STIM_QUEUE_LINE_MAX - 1 - q->line_len;
+}
+
+static void stm32_stim_queue_receive(void *opaque, const uint8_t *buf,
+                                     int size)
+{
+    Stm32StimQueue *q = opaque;
+    Stm32StimEvent ev;
+    bool valid, added = false;
+    int i;
+
+    for(i = 0; i < size; i++) {
+        if(buf[i] != '\n' && q->line_len < STM32_STIM_QUEUE_LINE_MAX - 1) {
+            q->line[q->line_len++] = buf[i];
+            continue;
+        }
+        q->line[q->line_len] = '\0';
+        q->line_len = 0;
+        if(!stm32_stim_queue_parse(q->line, &ev, &valid)) {
+            error_report("Stimulus events: invalid event \"%s\"", q->line);
+        } else if(valid) {
+            stm32_stim_queue_insert(q, &ev);
+            added = true;
+        }
+    }
+    if(added) {
+        stm32_stim_queue_schedule(q);
+    }
+}
+
+
+
+
+/* INITIALIZATION */
+
+Stm32StimQueue *stm32_stim_queue_new(void *aio_context, CharDriverState *chr,
+                                     const char *file)
+{
+    Stm32StimQueue *q = g_new0(Stm32StimQueue, 1);
+
+    q->events = g_array_new(false, false, sizeof(Stm32StimEvent));
+    q->timer = stm32_timer_new_ns(aio_context, stm32_stim_queue_run, q);
+    if(file) {
+        stm32_stim_queue_load(q, file);
+    }
+    if(chr) {
+        q->chr = chr;
+        stm32_replay_chr_add_handlers(chr, "stim-events",
+                                      stm32_stim_queue_can_receive,
+                                      stm32_stim_queue_receive, NULL, q);
+    }
+    stm32_stim_queue_schedule(q);
+    return q;
+}
+
+void stm32_stim_queue_add_gpio(Stm32StimQueue *q, Stm32Gpio *gpio,
+                               unsigned port)
+{
+    assert(port < STM32_GPIO_COUNT);
+    q->gpio[port] = gpio;
+}
+
+void stm32_stim_queue_add_adc(Stm32StimQueue *q, Stm32Adc *adc,
+                              unsigned index)
+{
+    assert(index < STM32_ADC_COUNT);
+    q->adc[index] = adc;
+}
@@ -0,0 +1,112 @@
+/*
+ * ST STM32F4DISCOVERY Board
+ *
+ * Implementation based on
+ * ST "UM1472 Discovery kit with STM32F407VG MCU, Rev 5"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/arm/stm32.h"
+#include "hw/sysbus.h"
+#include "hw/arm/arm.h"
+#include "ui/console.h"
+#include "sysemu/sysemu.h"
+#include "hw/boards.h"
+#include "qapi-event.h"
+
+
+typedef struct {
+    bool last_button_pressed;
+    qemu_irq button_irq;
+} Stm32F4Discovery;
+
+
+
+
+/* The four user LEDs are on GPIO D pins 12 to 15. */
+static void led_irq_handler(void *opaque, int n, int level)
+{
+    static const char *led_name[] = { "Green", "Orange", "Red", "Blue" };
+
+    assert(n < 4);
+
+    printf("%s LED %s\n", led_name[n], level ? "On" : "Off");
+    qapi_event_send_led_change(led_name[n], level, &error_abort);
+}
+
+static void stm32f4_discovery_key_event(void *opaque, int keycode)
+{
+    Stm32F4Discovery *s = (Stm32F4Discovery *)opaque;
+    bool make = (keycode & 0x80) == 0;
+
+    /* Responds when a "B" key press is received.
+     * Inside the monitor, you can type "sendkey b"
+     */
+    if((keycode & 0x7f) == 0x30 && make != s->last_button_pressed) {
+        qemu_set_irq(s->button_irq, make);
+        s->last_button_pressed = make;
+    }
+}
+
+
+static void stm32f4_discovery_init(MachineState *machine)
+{
+    qemu_irq *led_irq;
+    Stm32F4Discovery *s;
+    int i;
+
+    s = (Stm32F4Discovery *)g_malloc0(sizeof(Stm32F4Discovery));
+
+    /* STM32F407VG with an 8 MHz crystal.  There is no 32 kHz crystal on
+     * the board, but the LSE frequency is still needed by the clock tree. */
+    stm32f4_create("stm32", false, 0x100000, 0x20000,
+                   machine->kernel_filename, 8000000, 32768);
+
+    DeviceState *gpio_a = DEVICE(object_resolve_path("/machine/stm32/gpio[a]", NULL));
+    DeviceState *gpio_d = DEVICE(object_resolve_path("/machine/stm32/gpio[d]", NULL));
+    DeviceState *uart2 = DEVICE(object_resolve_path("/machine/stm32/uart[2]", NULL));
+    assert(gpio_a);
+    assert(gpio_d);
+    assert(uart2);
+
+    led_irq = qemu_allocate_irqs(led_irq_handler, NULL, 4);
+    for(i = 0; i < 4; i++) {
+        qdev_connect_gpio_out(gpio_d, 12 + i, led_irq[i]);
+    }
+
+    /* Connect the user button to GPIO A pin 0 */
+    s->button_irq = qdev_get_gpio_in(gpio_a, 0);
+    stm32_replay_add_kbd_event_handler("keyboard",
+                                       stm32f4_discovery_key_event, s);
+
+    /* USART2 (PA2/PA3) is on the extension header.  The F4 has no pin
+     * remapping, so the map argument is not checked. */
+    stm32_uart_connect((Stm32Uart *)uart2, serial_hds[0],
+                       STM32_USART2_NO_REMAP);
+}
+
+static QEMUMachine stm32f4_discovery_machine = {
+    .name = "stm32f4-discovery",
+    .desc = "ST STM32F4DISCOVERY Board (STM32F407VG)",
+    .init = stm32f4_discovery_init,
+};
+
+
+static void stm32f4_discovery_machine_init(void)
+{
+    qemu_register_machine(&stm32f4_discovery_machine);
+}
+
+machine_init(stm32f4_discovery_machine_init);
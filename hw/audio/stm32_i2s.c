@@ -0,0 +1,397 @@
+/*
+ * STM32 Microcontroller I2S (the I2S mode of SPI2 and SPI3)
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "audio/audio.h"
+#include "qemu/bitops.h"
+#include "qemu/log.h"
+
+/* The samples the firmware transmits are played on a QEMU audio voice.  They
+ * are queued in a buffer which the audio backend drains from its callback,
+ * so the backend, not the I2S clock, sets the pace: TXE stays high while the
+ * buffer has room, and a DMA channel hands over as much of its block as
+ * fits in one go.  The buffer holds several DMA half buffers, so that a
+ * double buffered stream is taken a half buffer at a time rather than a
+ * sample at a time. */
+
+/* DEFINITIONS*/
+
+//#define DEBUG_STM32_I2S
+
+#ifdef DEBUG_STM32_I2S
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_I2S: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define I2SCFGR_CHLEN_BIT 0
+#define I2SCFGR_DATLEN_START 1
+#define I2SCFGR_DATLEN_LENGTH 2
+#define I2SCFGR_I2SSTD_START 4
+#define I2SCFGR_I2SSTD_LENGTH 2
+#define I2SCFGR_I2SCFG_START 8
+#define I2SCFGR_I2SCFG_LENGTH 2
+#define I2SCFGR_I2SE_BIT 10
+#define I2SCFGR_I2SMOD_BIT 11
+
+#define I2SPR_I2SDIV_START 0
+#define I2SPR_I2SDIV_LENGTH 8
+#define I2SPR_ODD_BIT 8
+#define I2SPR_MCKOE_BIT 9
+
+#define I2S_DATLEN_16 0
+#define I2S_DATLEN_24 1
+
+#define I2S_STD_LSB 2
+#define I2S_STD_PCM 3
+
+#define I2S_CFG_MASTER_TX 2
+
+/* Samples (of one channel) queued for the audio backend */
+#define STM32_I2S_BUFFER_SIZE 8192
+
+struct Stm32I2s {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    void *stm32_rcc_prop;
+
+    /* Private */
+    Stm32Rcc *stm32_rcc;
+
+    QEMUSoundCard card;
+    SWVoiceOut *voice;
+    /* Rate the voice was opened with, 0 while it is stopped */
+    uint32_t voice_freq;
+
+    qemu_irq txe_irq;
+
+    /* Copies of the SPI's registers */
+    uint32_t
+        I2SCFGR,
+        I2SPR;
+
+    /* Samples of 24 and 32 bit data take two writes, the most significant
+     * half word first.  first_half holds it until the second arrives. */
+    bool second_half;
+    uint16_t first_half;
+
+    /* Channel of the next sample */
+    bool right;
+
+    int16_t buffer[STM32_I2S_BUFFER_SIZE];
+    int32_t buf_head, buf_count;
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static bool stm32_i2s_enabled(Stm32I2s *s)
+{
+    return extract32(s->I2SCFGR, I2SCFGR_I2SMOD_BIT, 1) &&
+           extract32(s->I2SCFGR, I2SCFGR_I2SE_BIT, 1);
+}
+
+static bool stm32_i2s_playing(Stm32I2s *s)
+{
+    return stm32_i2s_enabled(s) &&
+           extract32(s->I2SCFGR, I2SCFGR_I2SCFG_START,
+                     I2SCFGR_I2SCFG_LENGTH) == I2S_CFG_MASTER_TX;
+}
+
+static void stm32_i2s_update(Stm32I2s *s)
+{
+    qemu_set_irq(s->txe_irq, s->buf_count < STM32_I2S_BUFFER_SIZE);
+}
+
+/* The sample rate is I2SxCLK / (256 * (2 * I2SDIV + ODD)) with the master
+ * clock output on, and otherwise I2SxCLK divided by the bits of a stereo
+ * frame times (2 * I2SDIV + ODD). */
+static uint32_t stm32_i2s_freq(Stm32I2s *s)
+{
+    uint32_t clk = stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph);
+    uint32_t i2sdiv = extract32(s->I2SPR, I2SPR_I2SDIV_START,
+                                I2SPR_I2SDIV_LENGTH);
+    uint32_t div, frame_bits;
+
+    if(i2sdiv < 2) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: I2SDIV %u is not allowed\n",
+                      stm32_periph_name(s->periph), i2sdiv);
+        i2sdiv = 2;
+    }
+    div = 2 * i2sdiv + extract32(s->I2SPR, I2SPR_ODD_BIT, 1);
+
+    if(extract32(s->I2SPR, I2SPR_MCKOE_BIT, 1)) {
+        frame_bits = 256;
+    } else {
+        frame_bits = extract32(s->I2SCFGR, I2SCFGR_CHLEN_BIT, 1) ? 64 : 32;
+    }
+    return clk / (frame_bits * div);
+}
+
+/* Audio backend callback: free bytes can be written to the voice */
+static void stm32_i2s_audio_out(void *opaque, int free)
+{
+    Stm32I2s *s = (Stm32I2s *)opaque;
+    int n, written;
+
+    /* Whole stereo frames only, so the head stays on a left sample */
+    while(free >= 4 && s->buf_count >= 2) {
+        n = MIN(s->buf_count & ~1, STM32_I2S_BUFFER_SIZE - s->buf_head);
+        n = MIN(n, (free / 2) & ~1);
+        written = AUD_write(s->voice, s->buffer + s->buf_head, n * 2) / 2;
+        s->buf_head = (s->buf_head + written) % STM32_I2S_BUFFER_SIZE;
+        s->buf_count -= written;
+        free -= written * 2;
+        if(written < n) {
+            break;
+        }
+    }
+
+    stm32_i2s_update(s);
+}
+
+/* Open the voice at the configured rate, or stop it */
+static void stm32_i2s_update_voice(Stm32I2s *s)
+{
+    struct audsettings as;
+    uint32_t freq = stm32_i2s_playing(s) ? stm32_i2s_freq(s) : 0;
+
+    if(!freq) {
+        if(s->voice) {
+            AUD_set_active_out(s->voice, 0);
+        }
+        s->voice_freq = 0;
+        return;
+    }
+
+    if(!s->voice || (freq != s->voice_freq)) {
+        as.freq = freq;
+        as.nchannels = 2;
+        as.fmt = AUD_FMT_S16;
+        as.endianness = AUDIO_HOST_ENDIANNESS;
+
+        DPRINTF("%s playing at %u Hz\n", stm32_periph_name(s->periph), freq);
+        s->voice = AUD_open_out(&s->card, s->voice,
+                                stm32_periph_name(s->periph), s,
+                                stm32_i2s_audio_out, &as);
+        s->voice_freq = s->voice ? freq : 0;
+    }
+    if(s->voice) {
+        AUD_set_active_out(s->voice, 1);
+    }
+}
+
+/* Turns the half words of one channel into a 16 bit sample.  Returns false
+ * if it was the first half of a two half word sample. */
+static bool stm32_i2s_sample(Stm32I2s *s, uint16_t half, int16_t *sample)
+{
+    uint32_t datlen = extract32(s->I2SCFGR, I2SCFGR_DATLEN_START,
+                                I2SCFGR_DATLEN_LENGTH);
+
+    if(datlen == I2S_DATLEN_16) {
+        *sample = half;
+        return true;
+    }
+    if(!s->second_half) {
+        s->second_half = true;
+        s->first_half = half;
+        return false;
+    }
+    s->second_half = false;
+
+    /* Left justified data has the top 16 bits in the first half word.
+     * LSB justified 24 bit data has the top 8 bits in the low byte of the
+     * first half word. */
+    if((datlen == I2S_DATLEN_24) &&
+       (extract32(s->I2SCFGR, I2SCFGR_I2SSTD_START,
+                  I2SCFGR_I2SSTD_LENGTH) == I2S_STD_LSB)) {
+        *sample = (s->first_half << 8) | (half >> 8);
+    } else {
+        *sample = s->first_half;
+    }
+    return true;
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+int stm32_i2s_transmit(Stm32I2s *s, const uint8_t *buf, int len)
+{
+    int16_t sample;
+    int done;
+
+    for(done = 0; done + 2 <= len; done += 2) {
+        /* The second half of a sample always fits, as its first half has
+         * already been taken */
+        if(!s->second_half && (s->buf_count >= STM32_I2S_BUFFER_SIZE)) {
+            break;
+        }
+        if(stm32_i2s_sample(s, lduw_le_p(buf + done), &sample)) {
+            /* Nothing is played without a voice, so samples are dropped
+             * rather than stall the firmware */
+            if(s->voice_freq) {
+                s->buffer[(s->buf_head + s->buf_count) %
+                          STM32_I2S_BUFFER_SIZE] = sample;
+                s->buf_count++;
+            }
+            s->right = !s->right;
+        }
+    }
+
+    stm32_i2s_update(s);
+    return done;
+}
+
+bool stm32_i2s_chside(Stm32I2s *s)
+{
+    return s->right;
+}
+
+void stm32_i2s_configure(Stm32I2s *s, uint32_t i2scfgr, uint32_t i2spr)
+{
+    bool was_enabled = stm32_i2s_enabled(s);
+    uint32_t changed = s->I2SCFGR ^ i2scfgr;
+
+    s->I2SCFGR = i2scfgr;
+    s->I2SPR = i2spr;
+
+    if(was_enabled && !stm32_i2s_enabled(s)) {
+        /* Whatever was not sent yet is lost */
+        s->buf_head = 0;
+        s->buf_count = 0;
+        s->second_half = false;
+        s->right = false;
+    }
+    if(stm32_i2s_enabled(s) && !stm32_i2s_playing(s) &&
+       (changed & (BIT(I2SCFGR_I2SE_BIT) | BIT(I2SCFGR_I2SMOD_BIT)))) {
+        qemu_log_mask(LOG_UNIMP, "%s: only I2S master transmit is "
+                      "implemented\n", stm32_periph_name(s->periph));
+    }
+    if(stm32_i2s_playing(s) &&
+       (extract32(i2scfgr, I2SCFGR_I2SSTD_START,
+                  I2SCFGR_I2SSTD_LENGTH) == I2S_STD_PCM) &&
+       (changed & BIT(I2SCFGR_I2SE_BIT))) {
+        qemu_log_mask(LOG_UNIMP, "%s: the PCM standard is played as two "
+                      "channels\n", stm32_periph_name(s->periph));
+    }
+
+    stm32_i2s_update_voice(s);
+    stm32_i2s_update(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_i2s_init(SysBusDevice *dev)
+{
+    Stm32I2s *s = STM32_I2S(dev);
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+
+    sysbus_init_irq(dev, &s->txe_irq);
+
+    AUD_register_card(stm32_periph_name(s->periph), &s->card);
+
+    return 0;
+}
+
+static void stm32_i2s_reset(DeviceState *dev)
+{
+    Stm32I2s *s = STM32_I2S(dev);
+
+    /* The SPI passes its registers on again when it is reset */
+    s->buf_head = 0;
+    s->buf_count = 0;
+    s->second_half = false;
+    s->right = false;
+
+    stm32_i2s_update(s);
+}
+
+static int stm32_i2s_post_load(void *opaque, int version_id)
+{
+    Stm32I2s *s = (Stm32I2s *)opaque;
+
+    if(s->buf_head < 0 || s->buf_head >= STM32_I2S_BUFFER_SIZE ||
+            s->buf_count < 0 || s->buf_count > STM32_I2S_BUFFER_SIZE) {
+        return -EINVAL;
+    }
+    stm32_i2s_update_voice(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_i2s = {
+    .name = TYPE_STM32_I2S,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_i2s_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(I2SCFGR, Stm32I2s),
+        VMSTATE_UINT32(I2SPR, Stm32I2s),
+        VMSTATE_BOOL(second_half, Stm32I2s),
+        VMSTATE_UINT16(first_half, Stm32I2s),
+        VMSTATE_BOOL(right, Stm32I2s),
+        VMSTATE_INT16_ARRAY(buffer, Stm32I2s, STM32_I2S_BUFFER_SIZE),
+        VMSTATE_INT32(buf_head, Stm32I2s),
+        VMSTATE_INT32(buf_count, Stm32I2s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_i2s_properties[] = {
+    DEFINE_PROP_PERIPH_T("periph", Stm32I2s, periph, STM32_PERIPH_UNDEFINED),
+    DEFINE_PROP_PTR("stm32_rcc", Stm32I2s, stm32_rcc_prop),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_i2s_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_i2s_init;
+    dc->reset = stm32_i2s_reset;
+    dc->vmsd = &vmstate_stm32_i2s;
+    dc->props = stm32_i2s_properties;
+}
+
+static TypeInfo stm32_i2s_info = {
+    .name  = TYPE_STM32_I2S,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32I2s),
+    .class_init = stm32_i2s_class_init
+};
+
+static void stm32_i2s_register_types(void)
+{
+    type_register_static(&stm32_i2s_info);
+}
+
+type_init(stm32_i2s_register_types)
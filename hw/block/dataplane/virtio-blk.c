@@ -24,14 +24,17 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
-struct VirtIOBlockDataPlane {
-    bool started;
-    bool starting;
-    bool stopping;
-
-    VirtIOBlkConf *blk;
+/* Each virtqueue has its own vring and doorbell, serviced by the IOThread
+ * the queue is bound to.  The BlockDriverState lives in the AioContext of
+ * queue 0 ("the block context"); the block layer is not thread-safe, so
+ * queues running elsewhere only pop descriptors and hand the requests over
+ * to the block context for submission.  Completions happen in the block
+ * context and push to the vring the request came from.
+ */
+typedef struct VirtIOBlockDataPlaneQueue {
+    VirtIOBlockDataPlane *s;
+    unsigned int index;
 
-    VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
     EventNotifier *guest_notifier;  /* irq */
     QEMUBH *bh;                     /* bh for guest notification */
@@ -42,9 +45,30 @@ struct VirtIOBlockDataPlane {
      * use it).
      */
     IOThread *iothread;
-    IOThread internal_iothread_obj;
     AioContext *ctx;
     EventNotifier host_notifier;    /* doorbell */
+} VirtIOBlockDataPlaneQueue;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+
+    VirtIOBlkConf *blk;
+
+    VirtIODevice *vdev;
+    unsigned int num_queues;
+    VirtIOBlockDataPlaneQueue *queues;
+
+    IOThread internal_iothread_obj;
+    bool internal_iothread;
+    AioContext *ctx;                /* block context, same as queue 0 */
+
+    /* Requests popped outside the block context, waiting for submit_bh */
+    QemuMutex submit_lock;
+    VirtIOBlockReq *submit_head;
+    VirtIOBlockReq **submit_tail;
+    QEMUBH *submit_bh;
 
     /* Operation blocker on BDS */
     Error *blocker;
@@ -53,29 +77,30 @@ struct VirtIOBlockDataPlane {
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(q->guest_notifier);
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
 
-    notify_guest(s);
+    notify_guest(q);
 }
 
 static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlockDataPlane *s = req->dev->dataplane;
+    VirtIOBlockDataPlaneQueue *q = &s->queues[virtio_get_queue_index(req->vq)];
+
     stb_p(&req->in->status, status);
 
-    vring_push(&req->dev->dataplane->vring, &req->elem,
-               req->qiov.size + sizeof(*req->in));
+    vring_push(&q->vring, &req->elem, req->qiov.size + sizeof(*req->in));
 
     /* Suppress notification to guest by BH and its scheduled
      * flag because requests are completed as a batch after io
@@ -83,56 +108,165 @@ static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
      * executed in dataplane aio context even after it is
      * stopped, so needn't worry about notification loss with BH.
      */
-    qemu_bh_schedule(s->bh);
+    qemu_bh_schedule(q->bh);
 }
 
-static void handle_notify(EventNotifier *e)
+/* Context: block context */
+static void submit_requests(VirtIOBlockDataPlane *s, VirtIOBlockReq *req)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
-    VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    MultiReqBuffer mrb = {
+        .num_writes = 0,
+    };
 
-    event_notifier_test_and_clear(&s->host_notifier);
     bdrv_io_plug(s->blk->conf.bs);
-    for (;;) {
-        MultiReqBuffer mrb = {
-            .num_writes = 0,
-        };
-        int ret;
+    while (req) {
+        VirtIOBlockReq *next = req->next;
+
+        req->next = NULL;
+        virtio_blk_handle_request(req, &mrb);
+        req = next;
+    }
+    virtio_submit_multiwrite(s->blk->conf.bs, &mrb);
+    bdrv_io_unplug(s->blk->conf.bs);
+}
+
+static VirtIOBlockReq *take_pending_requests(VirtIOBlockDataPlane *s)
+{
+    VirtIOBlockReq *req;
+
+    qemu_mutex_lock(&s->submit_lock);
+    req = s->submit_head;
+    s->submit_head = NULL;
+    s->submit_tail = &s->submit_head;
+    qemu_mutex_unlock(&s->submit_lock);
+    return req;
+}
+
+static void submit_bh(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    submit_requests(s, take_pending_requests(s));
+}
+
+/* Pop everything the guest has queued on @q into a list, in vring order */
+static VirtIOBlockReq *pop_requests(VirtIOBlockDataPlaneQueue *q,
+                                    VirtIOBlockReq ***tail)
+{
+    VirtIOBlockDataPlane *s = q->s;
+    VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    VirtIOBlockReq *head = NULL;
+    int ret;
 
+    *tail = &head;
+    for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(s->vdev, &q->vring);
 
         for (;;) {
             VirtIOBlockReq *req = virtio_blk_alloc_request(vblk);
 
-            ret = vring_pop(s->vdev, &s->vring, &req->elem);
+            ret = vring_pop(s->vdev, &q->vring, &req->elem);
             if (ret < 0) {
                 virtio_blk_free_request(req);
                 break; /* no more requests */
             }
+            req->vq = virtio_get_queue(s->vdev, q->index);
 
             trace_virtio_blk_data_plane_process_request(s, req->elem.out_num,
                                                         req->elem.in_num,
                                                         req->elem.index);
 
-            virtio_blk_handle_request(req, &mrb);
+            **tail = req;
+            *tail = &req->next;
         }
 
-        virtio_submit_multiwrite(s->blk->conf.bs, &mrb);
-
         if (likely(ret == -EAGAIN)) { /* vring emptied */
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(s->vdev, &q->vring)) {
                 break;
             }
         } else { /* fatal error */
             break;
         }
     }
-    bdrv_io_unplug(s->blk->conf.bs);
+    return head;
+}
+
+static void handle_notify(EventNotifier *e)
+{
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+    VirtIOBlockDataPlane *s = q->s;
+    VirtIOBlockReq *head, **tail;
+
+    event_notifier_test_and_clear(&q->host_notifier);
+    head = pop_requests(q, &tail);
+    if (!head) {
+        return;
+    }
+
+    if (q->ctx == s->ctx) {
+        submit_requests(s, head);
+        return;
+    }
+
+    qemu_mutex_lock(&s->submit_lock);
+    *s->submit_tail = head;
+    s->submit_tail = tail;
+    qemu_mutex_unlock(&s->submit_lock);
+    qemu_bh_schedule(s->submit_bh);
+}
+
+/* Resolve the IOThread of every queue: the "iothreads" list, else the
+ * "iothread" link, else a per-device IOThread.
+ */
+static bool assign_iothreads(VirtIOBlockDataPlane *s, Error **errp)
+{
+    VirtIOBlkConf *blk = s->blk;
+    unsigned int i;
+
+    if (blk->iothreads) {
+        gchar **ids = g_strsplit(blk->iothreads, ",", 0);
+        unsigned int n = g_strv_length(ids);
+
+        if (n == 0) {
+            error_setg(errp, "iothreads list is empty");
+            g_strfreev(ids);
+            return false;
+        }
+        for (i = 0; i < s->num_queues; i++) {
+            IOThread *iothread = iothread_find(ids[i % n]);
+
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found", ids[i % n]);
+                g_strfreev(ids);
+                return false;
+            }
+            s->queues[i].iothread = iothread;
+        }
+        g_strfreev(ids);
+    } else if (blk->iothread) {
+        for (i = 0; i < s->num_queues; i++) {
+            s->queues[i].iothread = blk->iothread;
+        }
+    } else {
+        /* Create per-device IOThread if none specified.  This is for
+         * x-data-plane option compatibility.  If x-data-plane is removed we
+         * can drop this.
+         */
+        object_initialize(&s->internal_iothread_obj,
+                          sizeof(s->internal_iothread_obj),
+                          TYPE_IOTHREAD);
+        user_creatable_complete(OBJECT(&s->internal_iothread_obj), &error_abort);
+        s->internal_iothread = true;
+        for (i = 0; i < s->num_queues; i++) {
+            s->queues[i].iothread = &s->internal_iothread_obj;
+        }
+    }
+    return true;
 }
 
 /* Context: QEMU global mutex held */
@@ -144,10 +278,11 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
     Error *local_err = NULL;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned int i;
 
     *dataplane = NULL;
 
-    if (!blk->data_plane && !blk->iothread) {
+    if (!blk->data_plane && !blk->iothread && !blk->iothreads) {
         return;
     }
 
@@ -172,23 +307,32 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->blk = blk;
+    s->num_queues = blk->num_queues;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
 
-    if (blk->iothread) {
-        s->iothread = blk->iothread;
-        object_ref(OBJECT(s->iothread));
-    } else {
-        /* Create per-device IOThread if none specified.  This is for
-         * x-data-plane option compatibility.  If x-data-plane is removed we
-         * can drop this.
+    if (!assign_iothreads(s, errp)) {
+        g_free(s->queues);
+        g_free(s);
+        return;
+    }
+
+    s->ctx = iothread_get_aio_context(s->queues[0].iothread);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->index = i;
+        object_ref(OBJECT(q->iothread));
+        q->ctx = iothread_get_aio_context(q->iothread);
+        /* vring_push() runs in the block context, so must the used ring
+         * side of the notification check.
          */
-        object_initialize(&s->internal_iothread_obj,
-                          sizeof(s->internal_iothread_obj),
-                          TYPE_IOTHREAD);
-        user_creatable_complete(OBJECT(&s->internal_iothread_obj), &error_abort);
-        s->iothread = &s->internal_iothread_obj;
+        q->bh = aio_bh_new(s->ctx, notify_guest_bh, q);
     }
-    s->ctx = iothread_get_aio_context(s->iothread);
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
+
+    qemu_mutex_init(&s->submit_lock);
+    s->submit_tail = &s->submit_head;
+    s->submit_bh = aio_bh_new(s->ctx, submit_bh, s);
 
     error_setg(&s->blocker, "block device is in use by data plane");
     bdrv_op_block_all(blk->conf.bs, s->blocker);
@@ -199,6 +343,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    unsigned int i;
+
     if (!s) {
         return;
     }
@@ -206,8 +352,16 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     virtio_blk_data_plane_stop(s);
     bdrv_op_unblock_all(s->blk->conf.bs, s->blocker);
     error_free(s->blocker);
-    object_unref(OBJECT(s->iothread));
-    qemu_bh_delete(s->bh);
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_bh_delete(s->queues[i].bh);
+        object_unref(OBJECT(s->queues[i].iothread));
+    }
+    if (s->internal_iothread) {
+        object_unref(OBJECT(&s->internal_iothread_obj));
+    }
+    qemu_bh_delete(s->submit_bh);
+    qemu_mutex_destroy(&s->submit_lock);
+    g_free(s->queues);
     g_free(s);
 }
 
@@ -217,7 +371,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
-    VirtQueue *vq;
+    unsigned int i;
 
     if (s->started) {
         return;
@@ -229,26 +383,35 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        s->starting = false;
-        return;
+    for (i = 0; i < s->num_queues; i++) {
+        if (!vring_setup(&s->queues[i].vring, s->vdev, i)) {
+            while (i-- > 0) {
+                vring_teardown(&s->queues[i].vring, s->vdev, i);
+            }
+            s->starting = false;
+            return;
+        }
     }
 
-    /* Set up guest notifier (irq) */
-    if (k->set_guest_notifiers(qbus->parent, 1, true) != 0) {
+    /* Set up guest notifiers (irq) */
+    if (k->set_guest_notifiers(qbus->parent, s->num_queues, true) != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier, "
                 "ensure -enable-kvm is set\n");
         exit(1);
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
     /* Set up virtqueue notify */
-    if (k->set_host_notifier(qbus->parent, 0, true) != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier\n");
-        exit(1);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+
+        q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+        if (k->set_host_notifier(qbus->parent, i, true) != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier\n");
+            exit(1);
+        }
+        q->host_notifier = *virtio_queue_get_host_notifier(vq);
     }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
 
     s->saved_complete_request = vblk->complete_request;
     vblk->complete_request = complete_request_vring;
@@ -259,13 +422,17 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     bdrv_set_aio_context(s->blk->conf.bs, s->ctx);
 
-    /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
 
-    /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
-    aio_context_release(s->ctx);
+        /* Kick right away to begin processing requests already in vring */
+        event_notifier_set(&q->host_notifier);
+
+        /* Get this show started by hooking up our callbacks */
+        aio_context_acquire(q->ctx);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, handle_notify);
+        aio_context_release(q->ctx);
+    }
 }
 
 /* Context: QEMU global mutex held */
@@ -274,6 +441,8 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    unsigned int i;
+
     if (!s->started || s->stopping) {
         return;
     }
@@ -281,25 +450,36 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     vblk->complete_request = s->saved_complete_request;
     trace_virtio_blk_data_plane_stop(s);
 
+    /* Stop notifications for new requests from guest */
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        aio_context_acquire(q->ctx);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, NULL);
+        aio_context_release(q->ctx);
+    }
+
     aio_context_acquire(s->ctx);
 
-    /* Stop notifications for new requests from guest */
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
+    /* Submit whatever was handed over but not picked up yet */
+    submit_requests(s, take_pending_requests(s));
 
     /* Drain and switch bs back to the QEMU main loop */
     bdrv_set_aio_context(s->blk->conf.bs, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
 
-    /* Sync vring state back to virtqueue so that non-dataplane request
-     * processing can continue when we disable the host notifier below.
-     */
-    vring_teardown(&s->vring, s->vdev, 0);
+    for (i = 0; i < s->num_queues; i++) {
+        /* Sync vring state back to virtqueue so that non-dataplane request
+         * processing can continue when we disable the host notifier below.
+         */
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
 
-    k->set_host_notifier(qbus->parent, 0, false);
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
-    /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
     s->started = false;
     s->stopping = false;
@@ -610,6 +610,67 @@ static uint32_t m25p80_transfer8(SSISlave *ss, uint32_t tx)
     return r;
 }
 
+/* Reads and page programs are done a page at a time, which is much faster
+ * than going through m25p80_transfer8 for every byte.  Everything else
+ * (commands, addresses and status) still goes one byte at a time. */
+static void m25p80_transfer_block(SSISlave *ss, const uint8_t *tx,
+                                  uint8_t *rx, int len)
+{
+    Flash *s = M25P80(ss);
+    int64_t page;
+    uint32_t n, i;
+
+    while (len > 0) {
+        switch (s->state) {
+
+        case STATE_READ:
+            n = MIN(len, s->size - s->cur_addr);
+            memcpy(rx, s->storage + s->cur_addr, n);
+            DB_PRINT_L(1, "READ 0x%" PRIx64 " len=%" PRIu32 "\n",
+                       s->cur_addr, n);
+            s->cur_addr = (s->cur_addr + n) % s->size;
+            break;
+
+        case STATE_PAGE_PROGRAM:
+            n = MIN(len, s->pi->page_size - s->cur_addr % s->pi->page_size);
+            if (s->cur_addr + n > s->size) {
+                /* Past the end of the device - leave it to transfer8 */
+                rx[0] = m25p80_transfer8(ss, tx[0]);
+                n = 1;
+                break;
+            }
+            DB_PRINT_L(1, "page program cur_addr=%#" PRIx64 " len=%" PRIu32
+                       "\n", s->cur_addr, n);
+            if (!s->write_enable) {
+                qemu_log_mask(LOG_GUEST_ERROR,
+                              "M25P80: write with write protect!\n");
+            }
+            if (s->pi->flags & WR_1) {
+                memcpy(s->storage + s->cur_addr, tx, n);
+            } else {
+                for (i = 0; i < n; i++) {
+                    s->storage[s->cur_addr + i] &= tx[i];
+                }
+            }
+            memset(rx, 0, n);
+            page = s->cur_addr / s->pi->page_size;
+            flash_sync_dirty(s, page);
+            s->dirty_page = page;
+            s->cur_addr += n;
+            break;
+
+        default:
+            rx[0] = m25p80_transfer8(ss, tx[0]);
+            n = 1;
+            break;
+        }
+
+        tx += n;
+        rx += n;
+        len -= n;
+    }
+}
+
 static int m25p80_init(SSISlave *ss)
 {
     DriveInfo *dinfo;
@@ -673,6 +734,7 @@ static void m25p80_class_init(ObjectClass *klass, void *data)
 
     k->init = m25p80_init;
     k->transfer = m25p80_transfer8;
+    k->transfer_block = m25p80_transfer_block;
     k->set_cs = m25p80_cs;
     k->cs_polarity = SSI_CS_LOW;
     dc->vmsd = &vmstate_m25p80;
@@ -24,6 +24,7 @@
 #include "hw/arm/stm32.h"
 #include "sysemu/char.h"
 #include "qemu/bitops.h"
+#include "qom/cpu.h"
 
 
 
@@ -69,9 +70,22 @@
 #define USART_CR3_OFFSET 0x14
 #define USART_CR3_CTSE_BIT 9
 #define USART_CR3_RTSE_BIT 8
+#define USART_CR3_DMAT_BIT 7
+#define USART_CR3_DMAR_BIT 6
 
 #define USART_GTPR_OFFSET 0x18
 
+/* Size of the receive queue of a USART linked to another one, if it does
+ * not already have an RX FIFO. */
+#define STM32_UART_LINK_FIFO_SIZE 256
+
+/* How the character delay derived from the baud rate is simulated. */
+typedef enum {
+    STM32_UART_TIMING_ACCURATE, /* Full delay for every character */
+    STM32_UART_TIMING_SCALED,   /* Delay divided by timing_scale */
+    STM32_UART_TIMING_INSTANT   /* No delay */
+} Stm32UartTiming;
+
 
 struct Stm32Uart {
     /* Inherited */
@@ -82,6 +96,14 @@ struct Stm32Uart {
     void *stm32_rcc_prop;
     void *stm32_gpio_prop;
     void *stm32_afio_prop;
+    /* AioContext in which the timers run, NULL for the main loop */
+    void *aio_context;
+    /* Size of the host-side RX and TX buffers.  Zero (the default) passes each
+     * character to and from the character device individually. */
+    uint32_t fifo_size;
+    /* "accurate", "scaled" or "instant".  NULL selects the build default. */
+    char *timing_prop;
+    uint32_t timing_scale;
 
     /* Private */
     MemoryRegion iomem;
@@ -90,9 +112,24 @@ struct Stm32Uart {
     Stm32Gpio **stm32_gpio;
     Stm32Afio *stm32_afio;
 
+    /* Set once the TX pin routing and configuration have been checked.
+     * Cleared by the AFIO notifier when the remap changes, and by the GPIO
+     * notifier of the port the TX pin was on when its configuration
+     * changes. */
+    bool tx_pin_checked;
+    Notifier afio_notifier;
+    Notifier gpio_notifier;
+    Stm32Gpio *tx_pin_gpio;
+
     uint32_t bits_per_sec;
     int64_t ns_per_char;
 
+    Stm32UartTiming timing;
+
+    /* Peripheral clock generation that bits_per_sec and ns_per_char were
+     * calculated from. */
+    uint32_t clk_generation;
+
     /* Register Values */
     uint32_t
         USART_RDR,
@@ -124,8 +161,27 @@ struct Stm32Uart {
     struct QEMUTimer *rx_timer;
     struct QEMUTimer *tx_timer;
 
+    /* Host-side buffers used when fifo_size is non-zero.  Received characters
+     * are queued in rx_fifo and handed to the USART one at a time with the
+     * normal receive delay.  Transmitted characters are collected in tx_fifo
+     * and written to the character device at the end of a line, when the
+     * buffer fills, or once the transmitter has been idle for a while.
+     */
+    uint8_t *rx_fifo;
+    uint32_t rx_fifo_size, rx_fifo_head, rx_fifo_count;
+    uint8_t *tx_fifo;
+    uint32_t tx_fifo_count;
+    struct QEMUTimer *tx_flush_timer;
+
     CharDriverState *chr;
 
+    /* USART the transmitter is wired to, if any.  Transmitted characters
+     * go straight into its RX FIFO instead of to the character device. */
+    Stm32Uart *tx_peer;
+
+    /* Channel to the USARTs of the other nodes, see stm32_quantum.c */
+    Stm32QuantumChannel *quantum;
+
     /* Stores the USART pin mapping used by the board.  This is used to check
      * the AFIO's USARTx_REMAP register to make sure the software has set
      * the correct mapping.
@@ -134,6 +190,10 @@ struct Stm32Uart {
 
     qemu_irq irq;
     int curr_irq_level;
+
+    /* DMA request lines */
+    qemu_irq dma_rx_irq, dma_tx_irq;
+    int curr_dma_rx_level, curr_dma_tx_level;
 };
 
 
@@ -149,6 +209,9 @@ static void stm32_uart_baud_update(Stm32Uart *s)
     uint32_t clk_freq = stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph);
     uint64_t ns_per_bit;
 
+    s->clk_generation = stm32_rcc_get_periph_generation(s->stm32_rcc,
+                                                        s->periph);
+
     if((s->USART_BRR == 0) || (clk_freq == 0)) {
         s->bits_per_sec = 0;
     } else {
@@ -173,16 +236,52 @@ static void stm32_uart_baud_update(Stm32Uart *s)
 #endif
 }
 
-/* Handle a change in the peripheral clock. */
-static void stm32_uart_clk_irq_handler(void *opaque, int n, int level)
+/* Recalculate the baud rate if the peripheral clock has changed since it was
+ * last calculated.  This is called before the character timing is used,
+ * rather than on every clock change, since most clock changes happen while
+ * the USART is idle.
+ */
+static void stm32_uart_baud_sync(Stm32Uart *s)
 {
-    Stm32Uart *s = (Stm32Uart *)opaque;
+    if(s->clk_generation !=
+            stm32_rcc_get_periph_generation(s->stm32_rcc, s->periph)) {
+        stm32_uart_baud_update(s);
+    }
+}
 
-    assert(n == 0);
+/* Returns the simulated time it takes to transmit or receive one character,
+ * taking the timing mode into account. */
+static int64_t stm32_uart_char_delay(Stm32Uart *s)
+{
+    stm32_uart_baud_sync(s);
 
-    /* Only update the BAUD rate if the IRQ is being set. */
-    if(level) {
-        stm32_uart_baud_update(s);
+    switch(s->timing) {
+        case STM32_UART_TIMING_SCALED:
+            return s->ns_per_char / s->timing_scale;
+        case STM32_UART_TIMING_INSTANT:
+            return 0;
+        default:
+            return s->ns_per_char;
+    }
+}
+
+/* Routine which updates the USART's DMA request lines.  A request is made
+ * while the corresponding buffer needs servicing and DMA is enabled for it.
+ */
+static void stm32_uart_update_dma(Stm32Uart *s)
+{
+    int new_rx_level = s->USART_SR_RXNE &
+                       extract32(s->USART_CR3, USART_CR3_DMAR_BIT, 1);
+    int new_tx_level = s->USART_SR_TXE &
+                       extract32(s->USART_CR3, USART_CR3_DMAT_BIT, 1);
+
+    if(new_rx_level ^ s->curr_dma_rx_level) {
+        s->curr_dma_rx_level = new_rx_level;
+        qemu_set_irq(s->dma_rx_irq, new_rx_level);
+    }
+    if(new_tx_level ^ s->curr_dma_tx_level) {
+        s->curr_dma_tx_level = new_tx_level;
+        qemu_set_irq(s->dma_tx_irq, new_tx_level);
     }
 }
 
@@ -204,10 +303,45 @@ static void stm32_uart_update_irq(Stm32Uart *s) {
         qemu_set_irq(s->irq, new_irq_level);
         s->curr_irq_level = new_irq_level;
     }
+
+    stm32_uart_update_dma(s);
 }
 
 
+/* Write any buffered transmit characters out to the character device. */
+static void stm32_uart_tx_flush(Stm32Uart *s)
+{
+    if(s->tx_fifo_count > 0) {
+        if (s->chr) {
+            qemu_chr_fe_write_all(s->chr, s->tx_fifo, s->tx_fifo_count);
+        }
+        s->tx_fifo_count = 0;
+    }
+}
+
 static void stm32_uart_start_tx(Stm32Uart *s, uint32_t value);
+static void stm32_uart_peer_receive(Stm32Uart *s, uint8_t ch);
+static void stm32_uart_rx_timer_expire(void *opaque);
+static void stm32_uart_tx_timer_expire(void *opaque);
+static void stm32_uart_tx_flush_timer_expire(void *opaque);
+
+/* Most of the USARTs of a board are never used, so their timers are only
+ * created when the first character goes through. */
+static void stm32_uart_init_timers(Stm32Uart *s)
+{
+    if(s->rx_timer) {
+        return;
+    }
+    s->rx_timer =
+        stm32_timer_new_ns(s->aio_context, stm32_uart_rx_timer_expire, s);
+    s->tx_timer =
+        stm32_timer_new_ns(s->aio_context, stm32_uart_tx_timer_expire, s);
+    if(s->fifo_size) {
+        s->tx_flush_timer =
+            stm32_timer_new_ns(s->aio_context,
+                               stm32_uart_tx_flush_timer_expire, s);
+    }
+}
 
 /* Routine to be called when a transmit is complete. */
 static void stm32_uart_tx_complete(Stm32Uart *s)
@@ -239,19 +373,36 @@ static void stm32_uart_start_tx(Stm32Uart *s, uint32_t value)
     s->USART_SR_TC = 0;
 
     /* Write the character out. */
-    if (s->chr) {
+    if(s->tx_peer) {
+        stm32_uart_peer_receive(s->tx_peer, ch);
+    } else if(s->quantum) {
+        stm32_quantum_send(s->quantum, &ch, 1);
+    } else if(s->fifo_size) {
+        /* Buffer the character, and flush at the end of a line or when the
+         * buffer is full.  Otherwise, it will be flushed once the transmitter
+         * has been idle for two character times.
+         */
+        s->tx_fifo[s->tx_fifo_count++] = ch;
+        if((ch == '\n') || (s->tx_fifo_count == s->fifo_size)) {
+            stm32_uart_tx_flush(s);
+        } else {
+            stm32_uart_baud_sync(s);
+            stm32_uart_init_timers(s);
+            timer_mod(s->tx_flush_timer, curr_time + 2 * s->ns_per_char);
+        }
+    } else if (s->chr) {
         qemu_chr_fe_write(s->chr, &ch, 1);
     }
-#ifdef STM32_UART_NO_BAUD_DELAY
-    /* If BAUD delays are not being simulated, then immediately mark the
-     * transmission as complete.
-     */
-    curr_time = curr_time; //Avoid "variable unused" compiler error
-    stm32_uart_tx_complete(s);
-#else
-    /* Otherwise, start the transmit delay timer. */
-    timer_mod(s->tx_timer,  curr_time + s->ns_per_char);
-#endif
+    if(s->timing == STM32_UART_TIMING_INSTANT) {
+        /* If BAUD delays are not being simulated, then immediately mark the
+         * transmission as complete.
+         */
+        stm32_uart_tx_complete(s);
+    } else {
+        /* Otherwise, start the transmit delay timer. */
+        stm32_uart_init_timers(s);
+        timer_mod(s->tx_timer,  curr_time + stm32_uart_char_delay(s));
+    }
 }
 
 /* Checks the USART transmit pin's GPIO settings.  If the GPIO is not configured
@@ -319,6 +470,15 @@ static void stm32_uart_check_tx_pin(Stm32Uart *s)
 
     Stm32Gpio *gpio_dev = s->stm32_gpio[STM32_GPIO_INDEX_FROM_PERIPH(tx_periph)];
 
+    /* Follow the TX pin to its port, in case the remap moved it */
+    if(gpio_dev != s->tx_pin_gpio) {
+        if(s->tx_pin_gpio) {
+            notifier_remove(&s->gpio_notifier);
+        }
+        stm32_gpio_add_config_notifier(gpio_dev, &s->gpio_notifier);
+        s->tx_pin_gpio = gpio_dev;
+    }
+
     if(stm32_gpio_get_mode_bits(gpio_dev, tx_pin) == STM32_GPIO_MODE_IN) {
         hw_error("UART TX pin needs to be configured as output");
     }
@@ -329,6 +489,92 @@ static void stm32_uart_check_tx_pin(Stm32Uart *s)
         hw_error("UART TX pin needs to be configured as "
                  "alternate function output");
     }
+
+    s->tx_pin_checked = true;
+}
+
+static void stm32_uart_afio_changed(Notifier *notifier, void *data)
+{
+    Stm32Uart *s = container_of(notifier, Stm32Uart, afio_notifier);
+
+    s->tx_pin_checked = false;
+}
+
+static void stm32_uart_gpio_changed(Notifier *notifier, void *data)
+{
+    Stm32Uart *s = container_of(notifier, Stm32Uart, gpio_notifier);
+
+    s->tx_pin_checked = false;
+}
+
+
+
+
+
+/* RECEIVE HELPERS */
+
+/* Place a received character in the data register and start the receive
+ * delay.
+ */
+static void stm32_uart_rx_char(Stm32Uart *s, uint8_t ch)
+{
+    uint64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    /* Only handle the received character if the module is enabled, */
+    if(s->USART_CR1_UE && s->USART_CR1_RE) {
+        /* If there is already a character in the receive buffer, then
+         * set the overflow flag.
+         */
+        if(s->USART_SR_RXNE) {
+            s->USART_SR_ORE = 1;
+            s->sr_read_since_ore_set = false;
+            stm32_uart_update_irq(s);
+        }
+
+        /* Receive the character and mark the buffer as not empty. */
+        s->USART_RDR = ch;
+        s->USART_SR_RXNE = 1;
+        stm32_uart_update_irq(s);
+    }
+
+    /* If BAUD delays are not being simulated, do nothing - there is no delay
+     * before the module reports it can receive the next character.
+     * Otherwise, indicate the module is receiving and start the delay.
+     */
+    if(s->timing != STM32_UART_TIMING_INSTANT) {
+        s->receiving = true;
+        stm32_uart_init_timers(s);
+        timer_mod(s->rx_timer,  curr_time + stm32_uart_char_delay(s));
+    }
+}
+
+/* Hand queued characters from the RX FIFO to the USART for as long as it is
+ * able to accept them.
+ */
+static void stm32_uart_rx_fifo_drain(Stm32Uart *s)
+{
+    bool drained = false;
+    uint8_t ch;
+
+    while((s->rx_fifo_count > 0) && !s->receiving) {
+#ifndef STM32_UART_ENABLE_OVERRUN
+        /* Do not overwrite a character software has not read yet. */
+        if(s->USART_CR1_UE && s->USART_CR1_RE && s->USART_SR_RXNE) {
+            break;
+        }
+#endif
+        ch = s->rx_fifo[s->rx_fifo_head];
+        s->rx_fifo_head = (s->rx_fifo_head + 1) % s->rx_fifo_size;
+        s->rx_fifo_count--;
+        drained = true;
+
+        stm32_uart_rx_char(s, ch);
+    }
+
+    /* Let the character device know there is room for more data. */
+    if(drained && s->chr) {
+        qemu_chr_accept_input(s->chr);
+    }
 }
 
 
@@ -344,6 +590,10 @@ static void stm32_uart_rx_timer_expire(void *opaque) {
     Stm32Uart *s = (Stm32Uart *)opaque;
 
     s->receiving = false;
+
+    if(s->rx_fifo_size) {
+        stm32_uart_rx_fifo_drain(s);
+    }
 }
 
 /* When the transmit delay is complete, mark the transmit as complete
@@ -354,6 +604,13 @@ static void stm32_uart_tx_timer_expire(void *opaque) {
     stm32_uart_tx_complete(s);
 }
 
+/* The transmitter has been idle long enough - send any buffered characters. */
+static void stm32_uart_tx_flush_timer_expire(void *opaque) {
+    Stm32Uart *s = (Stm32Uart *)opaque;
+
+    stm32_uart_tx_flush(s);
+}
+
 
 
 
@@ -364,6 +621,13 @@ static int stm32_uart_can_receive(void *opaque)
 {
     Stm32Uart *s = (Stm32Uart *)opaque;
 
+    if(s->rx_fifo_size) {
+        /* In FIFO mode, accept as much as will fit in the buffer.  The
+         * characters are handed to the USART individually as it becomes
+         * ready for them. */
+        return s->rx_fifo_size - s->rx_fifo_count;
+    }
+
     if(s->USART_CR1_UE && s->USART_CR1_RE) {
         /* The USART can only receive if it is enabled. */
         if(s->receiving) {
@@ -404,36 +668,36 @@ static void stm32_uart_event(void *opaque, int event)
 static void stm32_uart_receive(void *opaque, const uint8_t *buf, int size)
 {
     Stm32Uart *s = (Stm32Uart *)opaque;
-    uint64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int i;
 
     assert(size > 0);
 
-    /* Only handle the received character if the module is enabled, */
-    if(s->USART_CR1_UE && s->USART_CR1_RE) {
-        /* If there is already a character in the receive buffer, then
-         * set the overflow flag.
-         */
-        if(s->USART_SR_RXNE) {
-            s->USART_SR_ORE = 1;
-            s->sr_read_since_ore_set = false;
-            stm32_uart_update_irq(s);
+    if(s->rx_fifo_size) {
+        assert(size <= s->rx_fifo_size - s->rx_fifo_count);
+        for(i = 0; i < size; i++) {
+            s->rx_fifo[(s->rx_fifo_head + s->rx_fifo_count) % s->rx_fifo_size] =
+                    buf[i];
+            s->rx_fifo_count++;
         }
-
-        /* Receive the character and mark the buffer as not empty. */
-        s->USART_RDR = *buf;
-        s->USART_SR_RXNE = 1;
-        stm32_uart_update_irq(s);
+        stm32_uart_rx_fifo_drain(s);
+    } else {
+        stm32_uart_rx_char(s, *buf);
     }
 
-#ifdef STM32_UART_NO_BAUD_DELAY
-    /* Do nothing - there is no delay before the module reports it can receive
-     * the next character. */
-    curr_time = curr_time; //Avoid "variable unused" compiler error
-#else
-    /* Indicate the module is receiving and start the delay. */
-    s->receiving = true;
-    timer_mod(s->rx_timer,  curr_time + s->ns_per_char);
-#endif
+    /* Received characters can change SR at any time */
+    cpu_mmio_poll_wake_all();
+}
+
+/* Receive a character transmitted by a linked USART. */
+static void stm32_uart_peer_receive(Stm32Uart *s, uint8_t ch)
+{
+    if(s->rx_fifo_count == s->rx_fifo_size) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "stm32_uart: %s receive queue full, character lost\n",
+                      stm32_periph_name(s->periph));
+        return;
+    }
+    stm32_uart_receive(s, &ch, 1);
 }
 
 
@@ -514,6 +778,12 @@ static void stm32_uart_USART_DR_read(Stm32Uart *s, uint32_t *read_value)
     }
 
     stm32_uart_update_irq(s);
+
+    /* Now that the data register is empty, the next queued character can be
+     * received. */
+    if(s->rx_fifo_size) {
+        stm32_uart_rx_fifo_drain(s);
+    }
 }
 
 
@@ -530,7 +800,12 @@ static void stm32_uart_USART_DR_write(Stm32Uart *s, uint32_t new_value)
                  "was disabled.");
     }
 
-    stm32_uart_check_tx_pin(s);
+    /* Without an AFIO (STM32F4), any pin can be routed to the USART through
+     * its alternate function, so there is no single pin to check.  The
+     * result of the check is kept until the routing or the pin changes. */
+    if(s->stm32_afio && !s->tx_pin_checked) {
+        stm32_uart_check_tx_pin(s);
+    }
 
     if(s->USART_SR_TC) {
         /* If the Transmission Complete bit is set, it means the USART is not
@@ -572,7 +847,8 @@ static void stm32_uart_USART_CR1_write(Stm32Uart *s, uint32_t new_value,
         /* Check to make sure the correct mapping is selected when enabling the
          * USART.
          */
-        if(s->afio_board_map != stm32_afio_get_periph_map(s->stm32_afio, s->periph)) {
+        if(s->stm32_afio &&
+           s->afio_board_map != stm32_afio_get_periph_map(s->stm32_afio, s->periph)) {
             hw_error("Bad AFIO mapping for %s", stm32_periph_name(s->periph));
         }
     }
@@ -599,12 +875,16 @@ static void stm32_uart_USART_CR3_write(Stm32Uart *s, uint32_t new_value,
                                         bool init)
 {
     s->USART_CR3 = new_value & 0x000007ff;
+
+    stm32_uart_update_irq(s);
 }
 
 static void stm32_uart_reset(DeviceState *dev)
 {
     Stm32Uart *s = STM32_UART(dev);
 
+    memory_region_flush_read_cache(&s->iomem);
+
     /* Initialize the status registers.  These are mostly
      * read-only, so we do not call the "write" routine
      * like normal.
@@ -613,6 +893,13 @@ static void stm32_uart_reset(DeviceState *dev)
     s->USART_SR_TC = 1;
     s->USART_SR_RXNE = 0;
     s->USART_SR_ORE = 0;
+    s->tx_pin_checked = false;
+
+    /* Send anything still waiting to go out and drop anything not yet
+     * received. */
+    stm32_uart_tx_flush(s);
+    s->rx_fifo_head = 0;
+    s->rx_fifo_count = 0;
 
     // Do not initialize USART_DR - it is documented as undefined at reset
     // and does not behave like normal registers.
@@ -698,9 +985,40 @@ static void stm32_uart_write(void *opaque, hwaddr offset,
     }
 }
 
+/* Apart from guest accesses, SR only changes when the receive or transmit
+ * timer fires, or when a character comes in (which wakes any poller). */
+static int64_t stm32_uart_poll_deadline(void *opaque, hwaddr offset,
+                                        unsigned size)
+{
+    Stm32Uart *s = (Stm32Uart *)opaque;
+    int64_t deadline = INT64_MAX;
+    int64_t rx_expire, tx_expire;
+
+    if((offset & 0xfffffffc) != USART_SR_OFFSET) {
+        return -1;
+    }
+    if(!s->rx_timer) {
+        return deadline;
+    }
+    rx_expire = timer_expire_time_ns(s->rx_timer);
+    tx_expire = timer_expire_time_ns(s->tx_timer);
+    if(rx_expire >= 0) {
+        deadline = MIN(deadline, rx_expire);
+    }
+    if(tx_expire >= 0) {
+        deadline = MIN(deadline, tx_expire);
+    }
+    return deadline;
+}
+
 static const MemoryRegionOps stm32_uart_ops = {
     .read = stm32_uart_read,
     .write = stm32_uart_write,
+    .poll_deadline = stm32_uart_poll_deadline,
+    .idempotent_reads = MEMORY_REGION_IDEMPOTENT(USART_BRR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(USART_CR1_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(USART_CR2_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(USART_CR3_OFFSET),
     .valid.min_access_size = 2,
     .valid.max_access_size = 4,
     .endianness = DEVICE_NATIVE_ENDIAN
@@ -717,8 +1035,9 @@ void stm32_uart_connect(Stm32Uart *s, CharDriverState *chr,
 {
     s->chr = chr;
     if (chr) {
-        qemu_chr_add_handlers(
+        stm32_replay_chr_add_handlers(
                 s->chr,
+                stm32_periph_name(s->periph),
                 stm32_uart_can_receive,
                 stm32_uart_receive,
                 stm32_uart_event,
@@ -728,6 +1047,39 @@ void stm32_uart_connect(Stm32Uart *s, CharDriverState *chr,
     s->afio_board_map = afio_board_map;
 }
 
+void stm32_uart_connect_uart(Stm32Uart *s, Stm32Uart *peer,
+                             uint32_t afio_board_map)
+{
+    s->tx_peer = peer;
+    if(peer->rx_fifo_size == 0) {
+        peer->rx_fifo_size = STM32_UART_LINK_FIFO_SIZE;
+        peer->rx_fifo = g_malloc0(peer->rx_fifo_size);
+    }
+
+    s->afio_board_map = afio_board_map;
+}
+
+static void stm32_uart_quantum_deliver(void *opaque, const uint8_t *buf,
+                                       int size)
+{
+    Stm32Uart *s = (Stm32Uart *)opaque;
+    int i;
+
+    for(i = 0; i < size; i++) {
+        stm32_uart_peer_receive(s, buf[i]);
+    }
+}
+
+void stm32_uart_connect_quantum(Stm32Uart *s)
+{
+    s->quantum = stm32_quantum_channel_new(stm32_periph_name(s->periph),
+                                           stm32_uart_quantum_deliver, s);
+    if(s->quantum && s->rx_fifo_size == 0) {
+        s->rx_fifo_size = STM32_UART_LINK_FIFO_SIZE;
+        s->rx_fifo = g_malloc0(s->rx_fifo_size);
+    }
+}
+
 
 
 
@@ -735,41 +1087,142 @@ void stm32_uart_connect(Stm32Uart *s, CharDriverState *chr,
 
 static int stm32_uart_init(SysBusDevice *dev)
 {
-    qemu_irq *clk_irq;
     Stm32Uart *s = STM32_UART(dev);
 
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
     s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
     s->stm32_afio = (Stm32Afio *)s->stm32_afio_prop;
+    s->afio_notifier.notify = stm32_uart_afio_changed;
+    s->gpio_notifier.notify = stm32_uart_gpio_changed;
+    if(s->stm32_afio) {
+        stm32_afio_add_map_notifier(s->stm32_afio, &s->afio_notifier);
+    }
+
+#ifdef STM32_UART_NO_BAUD_DELAY
+    s->timing = STM32_UART_TIMING_INSTANT;
+#else
+    s->timing = STM32_UART_TIMING_ACCURATE;
+#endif
+    if(s->timing_prop) {
+        if(!strcmp(s->timing_prop, "accurate")) {
+            s->timing = STM32_UART_TIMING_ACCURATE;
+        } else if(!strcmp(s->timing_prop, "scaled")) {
+            s->timing = STM32_UART_TIMING_SCALED;
+        } else if(!strcmp(s->timing_prop, "instant")) {
+            s->timing = STM32_UART_TIMING_INSTANT;
+        } else {
+            hw_error("Invalid timing mode \"%s\" for %s", s->timing_prop,
+                     stm32_periph_name(s->periph));
+        }
+    }
+    if((s->timing == STM32_UART_TIMING_SCALED) && (s->timing_scale == 0)) {
+        hw_error("timing_scale for %s must be non-zero",
+                 stm32_periph_name(s->periph));
+    }
 
     memory_region_init_io(&s->iomem, OBJECT(s), &stm32_uart_ops, s,
-                          "uart", 0x03ff);
+                          "uart", STM32_PERIPH_SIZE);
     sysbus_init_mmio(dev, &s->iomem);
 
     sysbus_init_irq(dev, &s->irq);
+    sysbus_init_irq(dev, &s->dma_rx_irq);
+    sysbus_init_irq(dev, &s->dma_tx_irq);
 
-    s->rx_timer =
-        timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                  (QEMUTimerCB *)stm32_uart_rx_timer_expire, s);
-    s->tx_timer =
-        timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                  (QEMUTimerCB *)stm32_uart_tx_timer_expire, s);
+    if(s->fifo_size) {
+        s->rx_fifo_size = s->fifo_size;
+        s->rx_fifo = g_malloc0(s->fifo_size);
+        s->tx_fifo = g_malloc0(s->fifo_size);
+    }
+
+    /* The timers are created on first use, and the registers are set up by
+     * the system reset which follows machine creation. */
+
+    return 0;
+}
+
+static bool stm32_uart_has_fifo(void *opaque, int version_id)
+{
+    Stm32Uart *s = (Stm32Uart *)opaque;
+
+    return s->fifo_size != 0;
+}
 
-    /* Register handlers to handle updates to the USART's peripheral clock. */
-    clk_irq =
-          qemu_allocate_irqs(stm32_uart_clk_irq_handler, (void *)s, 1);
-    stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
+/* The timers are part of the migration stream whether or not the USART
+ * has been used. */
+static void stm32_uart_pre_save(void *opaque)
+{
+    stm32_uart_init_timers((Stm32Uart *)opaque);
+}
+
+static int stm32_uart_pre_load(void *opaque)
+{
+    stm32_uart_init_timers((Stm32Uart *)opaque);
+    return 0;
+}
 
-    stm32_uart_reset((DeviceState *)s);
+static int stm32_uart_post_load(void *opaque, int version_id)
+{
+    Stm32Uart *s = (Stm32Uart *)opaque;
 
+    /* The character timing is derived from the clock tree, which the RCC
+     * restores itself. */
+    stm32_uart_baud_update(s);
+    s->tx_pin_checked = false;
+    memory_region_flush_read_cache(&s->iomem);
     return 0;
 }
 
+static const VMStateDescription vmstate_stm32_uart = {
+    .name = TYPE_STM32_UART,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_load = stm32_uart_pre_load,
+    .post_load = stm32_uart_post_load,
+    .pre_save = stm32_uart_pre_save,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(USART_RDR, Stm32Uart),
+        VMSTATE_UINT32(USART_TDR, Stm32Uart),
+        VMSTATE_UINT32(USART_BRR, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1, Stm32Uart),
+        VMSTATE_UINT32(USART_CR2, Stm32Uart),
+        VMSTATE_UINT32(USART_CR3, Stm32Uart),
+        VMSTATE_UINT32(USART_SR_TXE, Stm32Uart),
+        VMSTATE_UINT32(USART_SR_TC, Stm32Uart),
+        VMSTATE_UINT32(USART_SR_RXNE, Stm32Uart),
+        VMSTATE_UINT32(USART_SR_ORE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_UE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_TXEIE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_TCIE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_RXNEIE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_TE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_RE, Stm32Uart),
+        VMSTATE_BOOL(sr_read_since_ore_set, Stm32Uart),
+        VMSTATE_BOOL(receiving, Stm32Uart),
+        VMSTATE_TIMER(rx_timer, Stm32Uart),
+        VMSTATE_TIMER(tx_timer, Stm32Uart),
+        VMSTATE_TIMER_TEST(tx_flush_timer, Stm32Uart, stm32_uart_has_fifo),
+        /* Both FIFOs are fifo_size bytes long, or not allocated */
+        VMSTATE_VBUFFER_UINT32(rx_fifo, Stm32Uart, 0, NULL, 0, rx_fifo_size),
+        VMSTATE_UINT32(rx_fifo_head, Stm32Uart),
+        VMSTATE_UINT32(rx_fifo_count, Stm32Uart),
+        VMSTATE_VBUFFER_UINT32(tx_fifo, Stm32Uart, 0, NULL, 0, rx_fifo_size),
+        VMSTATE_UINT32(tx_fifo_count, Stm32Uart),
+        VMSTATE_INT32(curr_irq_level, Stm32Uart),
+        VMSTATE_INT32(curr_dma_rx_level, Stm32Uart),
+        VMSTATE_INT32(curr_dma_tx_level, Stm32Uart),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property stm32_uart_properties[] = {
     DEFINE_PROP_PERIPH_T("periph", Stm32Uart, periph, STM32_PERIPH_UNDEFINED),
     DEFINE_PROP_PTR("stm32_rcc", Stm32Uart, stm32_rcc_prop),
     DEFINE_PROP_PTR("stm32_gpio", Stm32Uart, stm32_gpio_prop),
     DEFINE_PROP_PTR("stm32_afio", Stm32Uart, stm32_afio_prop),
+    DEFINE_PROP_UINT32("fifo_size", Stm32Uart, fifo_size, 0),
+    DEFINE_PROP_STRING("timing", Stm32Uart, timing_prop),
+    DEFINE_PROP_UINT32("timing_scale", Stm32Uart, timing_scale, 16),
+    DEFINE_PROP_PTR("aio_context", Stm32Uart, aio_context),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -780,6 +1233,7 @@ static void stm32_uart_class_init(ObjectClass *klass, void *data)
 
     k->init = stm32_uart_init;
     dc->reset = stm32_uart_reset;
+    dc->vmsd = &vmstate_stm32_uart;
     dc->props = stm32_uart_properties;
 }
 
@@ -120,6 +120,34 @@ int load_image_targphys(const char *filename,
     return size;
 }
 
+/* As load_image_targphys(), but the image is written into the given
+ * address space rather than the system memory.  NULL means the system
+ * address space. */
+int load_image_targphys_as(const char *filename,
+                           hwaddr addr, uint64_t max_sz, AddressSpace *as)
+{
+    gchar *data;
+    gsize size;
+
+    if (!as || as == &address_space_memory) {
+        return load_image_targphys(filename, addr, max_sz);
+    }
+    if (!g_file_get_contents(filename, &data, &size, NULL)) {
+        return -1;
+    }
+    if (size > max_sz) {
+        g_free(data);
+        return -1;
+    }
+    if (size > 0) {
+        /* rom_add_elf_program() seize the ownership of 'data' */
+        rom_add_elf_program(filename, data, size, size, addr, as);
+    } else {
+        g_free(data);
+    }
+    return size;
+}
+
 void pstrcpy_targphys(const char *name, hwaddr dest, int buf_size,
                       const char *source)
 {
@@ -307,6 +335,19 @@ const char *load_elf_strerror(int error)
 int load_elf(const char *filename, uint64_t (*translate_fn)(void *, uint64_t),
              void *translate_opaque, uint64_t *pentry, uint64_t *lowaddr,
              uint64_t *highaddr, int big_endian, int elf_machine, int clear_lsb)
+{
+    return load_elf_as(filename, translate_fn, translate_opaque, pentry,
+                       lowaddr, highaddr, big_endian, elf_machine, clear_lsb,
+                       NULL);
+}
+
+/* As load_elf(), but the program is loaded into the given address space.
+ * NULL means the system address space. */
+int load_elf_as(const char *filename,
+                uint64_t (*translate_fn)(void *, uint64_t),
+                void *translate_opaque, uint64_t *pentry, uint64_t *lowaddr,
+                uint64_t *highaddr, int big_endian, int elf_machine,
+                int clear_lsb, AddressSpace *as)
 {
     int fd, data_order, target_data_order, must_swab, ret = ELF_LOAD_FAILED;
     uint8_t e_ident[EI_NIDENT];
@@ -345,10 +386,12 @@ int load_elf(const char *filename, uint64_t (*translate_fn)(void *, uint64_t),
     lseek(fd, 0, SEEK_SET);
     if (e_ident[EI_CLASS] == ELFCLASS64) {
         ret = load_elf64(filename, fd, translate_fn, translate_opaque, must_swab,
-                         pentry, lowaddr, highaddr, elf_machine, clear_lsb);
+                         pentry, lowaddr, highaddr, elf_machine, clear_lsb,
+                         as);
     } else {
         ret = load_elf32(filename, fd, translate_fn, translate_opaque, must_swab,
-                         pentry, lowaddr, highaddr, elf_machine, clear_lsb);
+                         pentry, lowaddr, highaddr, elf_machine, clear_lsb,
+                         as);
     }
 
  fail:
@@ -612,6 +655,8 @@ struct Rom {
     char *fw_file;
 
     hwaddr addr;
+    /* Address space the image is loaded into, NULL for the system one */
+    AddressSpace *as;
     QTAILQ_ENTRY(Rom) next;
 };
 
@@ -626,9 +671,15 @@ static void rom_insert(Rom *rom)
         hw_error ("ROM images must be loaded at startup\n");
     }
 
-    /* list is ordered by load address */
+    if (rom->as == &address_space_memory) {
+        rom->as = NULL;
+    }
+
+    /* list is ordered by address space, then by load address */
     QTAILQ_FOREACH(item, &roms, next) {
-        if (rom->addr >= item->addr)
+        if (rom->as > item->as)
+            continue;
+        if (rom->as == item->as && rom->addr >= item->addr)
             continue;
         QTAILQ_INSERT_BEFORE(item, rom, next);
         return;
@@ -768,7 +819,7 @@ void *rom_add_blob(const char *name, const void *blob, size_t len,
  * memory ownership of "data", so we don't have to allocate and copy the buffer.
  */
 int rom_add_elf_program(const char *name, void *data, size_t datasize,
-                        size_t romsize, hwaddr addr)
+                        size_t romsize, hwaddr addr, AddressSpace *as)
 {
     Rom *rom;
 
@@ -778,6 +829,7 @@ int rom_add_elf_program(const char *name, void *data, size_t datasize,
     rom->datasize = datasize;
     rom->romsize  = romsize;
     rom->data     = data;
+    rom->as       = as;
     rom_insert(rom);
     return 0;
 }
@@ -807,7 +859,8 @@ static void rom_reset(void *unused)
             void *host = memory_region_get_ram_ptr(rom->mr);
             memcpy(host, rom->data, rom->datasize);
         } else {
-            cpu_physical_memory_write_rom(&address_space_memory,
+            cpu_physical_memory_write_rom(rom->as ? rom->as
+                                                  : &address_space_memory,
                                           rom->addr, rom->data, rom->datasize);
         }
         if (rom->isrom) {
@@ -825,9 +878,31 @@ static void rom_reset(void *unused)
     }
 }
 
+/* Release the data of the images loaded into the given address space, so
+ * that later resets leave the memory they were written to alone.  For
+ * boards which restore their memory on reset themselves; the images must
+ * already have been written by a reset. */
+void rom_free_data_as(AddressSpace *as)
+{
+    Rom *rom;
+
+    if (as == &address_space_memory) {
+        as = NULL;
+    }
+
+    QTAILQ_FOREACH(rom, &roms, next) {
+        if (rom->fw_file || rom->mr || rom->as != as) {
+            continue;
+        }
+        g_free(rom->data);
+        rom->data = NULL;
+    }
+}
+
 int rom_load_all(void)
 {
     hwaddr addr = 0;
+    AddressSpace *as = NULL;
     MemoryRegionSection section;
     Rom *rom;
 
@@ -835,6 +910,11 @@ int rom_load_all(void)
         if (rom->fw_file) {
             continue;
         }
+        if (rom->as != as) {
+            /* Images in different address spaces never overlap */
+            as = rom->as;
+            addr = 0;
+        }
         if (addr > rom->addr) {
             fprintf(stderr, "rom: requested regions overlap "
                     "(rom %s. free=0x" TARGET_FMT_plx
@@ -844,7 +924,8 @@ int rom_load_all(void)
         }
         addr  = rom->addr;
         addr += rom->romsize;
-        section = memory_region_find(get_system_memory(), rom->addr, 1);
+        section = memory_region_find(as ? as->root : get_system_memory(),
+                                     rom->addr, 1);
         rom->isrom = int128_nz(section.size) && memory_region_is_rom(section.mr);
         memory_region_unref(section.mr);
     }
@@ -862,14 +943,21 @@ void rom_set_fw(FWCfgState *f)
     fw_cfg = f;
 }
 
-static Rom *find_rom(hwaddr addr)
+static Rom *find_rom(AddressSpace *as, hwaddr addr)
 {
     Rom *rom;
 
+    if (as == &address_space_memory) {
+        as = NULL;
+    }
+
     QTAILQ_FOREACH(rom, &roms, next) {
         if (rom->fw_file) {
             continue;
         }
+        if (rom->as != as) {
+            continue;
+        }
         if (rom->mr) {
             continue;
         }
@@ -903,6 +991,9 @@ int rom_copy(uint8_t *dest, hwaddr addr, size_t size)
         if (rom->mr) {
             continue;
         }
+        if (rom->as) {
+            break;
+        }
         if (rom->addr + rom->romsize < addr) {
             continue;
         }
@@ -947,10 +1038,16 @@ int rom_copy(uint8_t *dest, hwaddr addr, size_t size)
 }
 
 void *rom_ptr(hwaddr addr)
+{
+    return rom_ptr_as(NULL, addr);
+}
+
+/* As rom_ptr(), for an image loaded into the given address space */
+void *rom_ptr_as(AddressSpace *as, hwaddr addr)
 {
     Rom *rom;
 
-    rom = find_rom(addr);
+    rom = find_rom(as, addr);
     if (!rom || !rom->data)
         return NULL;
     return rom->data + (addr - rom->addr);
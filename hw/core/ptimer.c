@@ -10,6 +10,11 @@
 #include "hw/ptimer.h"
 #include "qemu/host-utils.h"
 
+/* A periodic timer never fires the host timer more often than this.  When
+   its period is shorter, one expiry stands for several periods and the
+   callback gets their number from ptimer_take_expired.  */
+#define PTIMER_MIN_NS 10000
+
 struct ptimer_state
 {
     uint8_t enabled; /* 0 = disabled, 1 = periodic, 2 = oneshot.  */
@@ -19,42 +24,101 @@ struct ptimer_state
     int64_t period;
     int64_t last_event;
     int64_t next_event;
+    /* The period is exactly period_num / period_den ns; period and
+       period_frac only round it for the migration stream.  */
+    uint64_t period_num;
+    uint64_t period_den;
+    /* next_event is base_ticks periods after base_time, computed from
+       there rather than by adding up rounded periods, so that a long
+       running timer does not drift.  */
+    int64_t base_time;
+    uint64_t base_ticks;
+    /* Number of times the counter reaches zero between last_event and
+       next_event.  */
+    uint64_t batch;
+    /* Expiries not yet collected by ptimer_take_expired.  */
+    uint64_t expired;
     QEMUBH *bh;
     QEMUTimer *timer;
 };
 
 /* Use a bottom-half routine to avoid reentrancy issues.  */
-static void ptimer_trigger(ptimer_state *s)
+static void ptimer_trigger(ptimer_state *s, uint64_t expired)
 {
+    s->expired += expired;
     if (s->bh) {
         qemu_bh_schedule(s->bh);
     }
 }
 
+/* a * b / c with a 128 bit intermediate product, rounded down or up.  */
+static uint64_t ptimer_muldiv(uint64_t a, uint64_t b, uint64_t c,
+                              bool round_up)
+{
+    uint64_t lo, hi;
+
+    mulu64(&lo, &hi, a, b);
+    if (hi >= c) {
+        return INT64_MAX;
+    }
+    divu128(&lo, &hi, c);
+    /* hi is now the remainder */
+    if (round_up && hi) {
+        lo++;
+    }
+    return MIN(lo, INT64_MAX);
+}
+
+/* Time taken by @ticks counter ticks.  */
+static int64_t ptimer_ticks_to_ns(ptimer_state *s, uint64_t ticks)
+{
+    return ptimer_muldiv(ticks, s->period_num, s->period_den, false);
+}
+
+/* Count the following periods from now.  */
+static void ptimer_rebase(ptimer_state *s)
+{
+    s->base_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    s->base_ticks = 0;
+    s->next_event = s->base_time;
+}
+
 static void ptimer_reload(ptimer_state *s)
 {
+    uint64_t ticks;
+    int64_t ns, limit_ns;
+
     if (s->delta == 0) {
-        ptimer_trigger(s);
+        ptimer_trigger(s, 1);
         s->delta = s->limit;
     }
-    if (s->delta == 0 || s->period == 0) {
+    if (s->delta == 0 || s->period_num == 0) {
         fprintf(stderr, "Timer with period zero, disabling\n");
         s->enabled = 0;
         return;
     }
 
-    s->last_event = s->next_event;
-    s->next_event = s->last_event + s->delta * s->period;
-    if (s->period_frac) {
-        s->next_event += ((int64_t)s->period_frac * s->delta) >> 32;
+    ticks = s->delta;
+    ns = ptimer_ticks_to_ns(s, ticks);
+    s->batch = 1;
+    if (s->enabled == 1 && s->limit && ns < PTIMER_MIN_NS) {
+        /* Cover as many whole reloads as it takes to reach the minimum */
+        limit_ns = ptimer_ticks_to_ns(s, s->limit);
+        s->batch += DIV_ROUND_UP(PTIMER_MIN_NS - ns, limit_ns);
+        ticks += (s->batch - 1) * s->limit;
+        ns = ptimer_ticks_to_ns(s, ticks);
     }
+
+    s->last_event = s->next_event;
+    s->base_ticks += ticks;
+    s->next_event = s->base_time + ptimer_ticks_to_ns(s, s->base_ticks);
     timer_mod(s->timer, s->next_event);
 }
 
 static void ptimer_tick(void *opaque)
 {
     ptimer_state *s = (ptimer_state *)opaque;
-    ptimer_trigger(s);
+    ptimer_trigger(s, s->batch ? s->batch : 1);
     s->delta = 0;
     if (s->enabled == 2) {
         s->enabled = 0;
@@ -72,46 +136,37 @@ uint64_t ptimer_get_count(ptimer_state *s)
         now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
         /* Figure out the current counter value.  */
         if (now - s->next_event > 0
-            || s->period == 0) {
+            || s->period_num == 0) {
             /* Prevent timer underflowing if it should already have
                triggered.  */
             counter = 0;
         } else {
-            uint64_t rem;
-            uint64_t div;
-            int clz1, clz2;
-            int shift;
-
-            /* We need to divide time by period, where time is stored in
-               rem (64-bit integer) and period is stored in period/period_frac
-               (64.32 fixed point).
-              
-               Doing full precision division is hard, so scale values and
-               do a 64-bit division.  The result should be rounded down,
-               so that the rounding error never causes the timer to go
-               backwards.
-            */
-
-            rem = s->next_event - now;
-            div = s->period;
-
-            clz1 = clz64(rem);
-            clz2 = clz64(div);
-            shift = clz1 < clz2 ? clz1 : clz2;
-
-            rem <<= shift;
-            div <<= shift;
-            if (shift >= 32) {
-                div |= ((uint64_t)s->period_frac << (shift - 32));
+            uint64_t elapsed;
+
+            /* Round the ticks since base_time up, so that the counter is
+               rounded down and never goes backwards.  now is only before
+               base_time after loading an older migration stream.  */
+            if (now >= s->base_time) {
+                elapsed = ptimer_muldiv(now - s->base_time, s->period_den,
+                                        s->period_num, true);
+                counter = s->base_ticks - MIN(elapsed, s->base_ticks);
             } else {
-                if (shift != 0)
-                    div |= (s->period_frac >> (32 - shift));
-                /* Look at remaining bits of period_frac and round div up if 
-                   necessary.  */
-                if ((uint32_t)(s->period_frac << shift))
-                    div += 1;
+                counter = s->base_ticks +
+                          ptimer_muldiv(s->base_time - now, s->period_den,
+                                        s->period_num, false);
+            }
+
+            /* With a batch, only the first reload is next_event - counter
+               ticks away; the counter is in the period that ends there.  */
+            if (s->batch > 1 && s->limit) {
+                uint64_t rest = (s->batch - 1) * s->limit;
+
+                if (counter > rest) {
+                    counter -= rest;
+                } else {
+                    counter %= s->limit;
+                }
             }
-            counter = rem / div;
         }
     } else {
         counter = s->delta;
@@ -123,7 +178,7 @@ void ptimer_set_count(ptimer_state *s, uint64_t count)
 {
     s->delta = count;
     if (s->enabled) {
-        s->next_event = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        ptimer_rebase(s);
         ptimer_reload(s);
     }
 }
@@ -133,12 +188,12 @@ void ptimer_run(ptimer_state *s, int oneshot)
     if (s->enabled) {
         return;
     }
-    if (s->period == 0) {
+    if (s->period_num == 0) {
         fprintf(stderr, "Timer with period zero, disabling\n");
         return;
     }
     s->enabled = oneshot ? 2 : 1;
-    s->next_event = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    ptimer_rebase(s);
     ptimer_reload(s);
 }
 
@@ -146,10 +201,22 @@ void ptimer_run(ptimer_state *s, int oneshot)
    is immediately restarted.  */
 void ptimer_stop(ptimer_state *s)
 {
+    uint64_t left;
+
     if (!s->enabled)
         return;
 
     s->delta = ptimer_get_count(s);
+    if (s->batch > 1 && s->limit) {
+        /* Report the reloads of the batch which have already happened */
+        left = DIV_ROUND_UP(MAX(s->next_event -
+                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), 0),
+                            ptimer_ticks_to_ns(s, s->limit));
+        if (left < s->batch) {
+            ptimer_trigger(s, s->batch - left);
+        }
+        s->batch = 1;
+    }
     timer_del(s->timer);
     s->enabled = 0;
 }
@@ -159,8 +226,10 @@ void ptimer_set_period(ptimer_state *s, int64_t period)
 {
     s->period = period;
     s->period_frac = 0;
+    s->period_num = period;
+    s->period_den = 1;
     if (s->enabled) {
-        s->next_event = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        ptimer_rebase(s);
         ptimer_reload(s);
     }
 }
@@ -170,42 +239,107 @@ void ptimer_set_freq(ptimer_state *s, uint32_t freq)
 {
     s->period = 1000000000ll / freq;
     s->period_frac = (1000000000ll << 32) / freq;
+    s->period_num = 1000000000ll;
+    s->period_den = freq;
     if (s->enabled) {
-        s->next_event = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        ptimer_rebase(s);
         ptimer_reload(s);
     }
 }
 
 /* Set the initial countdown value.  If reload is nonzero then also set
-   count = limit.  */
+   count = limit.  Short periods are not lengthened; see PTIMER_MIN_NS.  */
 void ptimer_set_limit(ptimer_state *s, uint64_t limit, int reload)
 {
-    /*
-     * Artificially limit timeout rate to something
-     * achievable under QEMU.  Otherwise, QEMU spends all
-     * its time generating timer interrupts, and there
-     * is no forward progress.
-     * About ten microseconds is the fastest that really works
-     * on the current generation of host machines.
-     */
-
-    if (limit * s->period < 10000 && s->period) {
-        limit = 10000 / s->period;
-    }
-
     s->limit = limit;
     if (reload)
         s->delta = limit;
     if (s->enabled && reload) {
-        s->next_event = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        ptimer_rebase(s);
         ptimer_reload(s);
     }
 }
 
+uint64_t ptimer_take_expired(ptimer_state *s)
+{
+    uint64_t expired = s->expired;
+
+    s->expired = 0;
+    return expired;
+}
+
+static bool ptimer_batch_needed(void *opaque)
+{
+    ptimer_state *s = opaque;
+
+    return s->batch > 1;
+}
+
+static const VMStateDescription vmstate_ptimer_batch = {
+    .name = "ptimer/batch",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(batch, ptimer_state),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool ptimer_exact_needed(void *opaque)
+{
+    ptimer_state *s = opaque;
+
+    /* Otherwise post_load gets the same from period and period_frac */
+    return s->enabled || s->period_den != 1;
+}
+
+static const VMStateDescription vmstate_ptimer_exact = {
+    .name = "ptimer/exact",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(period_num, ptimer_state),
+        VMSTATE_UINT64(period_den, ptimer_state),
+        VMSTATE_INT64(base_time, ptimer_state),
+        VMSTATE_UINT64(base_ticks, ptimer_state),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int ptimer_pre_load(void *opaque)
+{
+    ptimer_state *s = opaque;
+
+    s->period_den = 0;
+    return 0;
+}
+
+static int ptimer_post_load(void *opaque, int version_id)
+{
+    ptimer_state *s = opaque;
+
+    if (s->period_den == 0) {
+        /* No ptimer/exact subsection: the period is the 32.32 fixed point
+           one, and the next periods are counted from next_event.  */
+        if (s->period_frac) {
+            s->period_num = ((uint64_t)s->period << 32) | s->period_frac;
+            s->period_den = 1ull << 32;
+        } else {
+            s->period_num = s->period;
+            s->period_den = 1;
+        }
+        s->base_time = s->next_event;
+        s->base_ticks = 0;
+    }
+    return 0;
+}
+
 const VMStateDescription vmstate_ptimer = {
     .name = "ptimer",
     .version_id = 1,
     .minimum_version_id = 1,
+    .pre_load = ptimer_pre_load,
+    .post_load = ptimer_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_UINT8(enabled, ptimer_state),
         VMSTATE_UINT64(limit, ptimer_state),
@@ -216,6 +350,17 @@ const VMStateDescription vmstate_ptimer = {
         VMSTATE_INT64(next_event, ptimer_state),
         VMSTATE_TIMER(timer, ptimer_state),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_ptimer_batch,
+            .needed = ptimer_batch_needed,
+        }, {
+            .vmsd = &vmstate_ptimer_exact,
+            .needed = ptimer_exact_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
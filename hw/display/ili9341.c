@@ -0,0 +1,545 @@
+/*
+ * ILI9341 TFT LCD controller with a 240x320 RGB panel.
+ *
+ * Implementation based on Ilitek "ILI9341 a-Si TFT LCD Single Chip Driver"
+ * datasheet V1.11
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Only the 4-wire serial interface is modelled: bytes arrive over SSI and
+ * a separate D/C input selects between commands and data.  The address
+ * window, memory access control (row/column exchange and mirroring, BGR
+ * order) and the 16 and 18 bit pixel formats are implemented; gamma, power
+ * and timing setup commands are accepted and ignored.
+ *
+ * Frame memory writes only extend a dirty rectangle.  The display update
+ * converts that rectangle and reports just it to the console, so a guest
+ * redrawing a small widget does not cost a full-screen conversion every
+ * refresh. */
+#include "hw/ssi.h"
+#include "ui/console.h"
+
+//#define DEBUG_ILI9341 1
+
+#ifdef DEBUG_ILI9341
+#define DPRINTF(fmt, ...) \
+do { printf("ili9341: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) do {} while(0)
+#endif
+
+#define ILI9341_WIDTH  240
+#define ILI9341_HEIGHT 320
+
+#define ILI9341_NOP     0x00
+#define ILI9341_SWRESET 0x01
+#define ILI9341_RDDPM   0x0a
+#define ILI9341_RDDMADCTL 0x0b
+#define ILI9341_SLPIN   0x10
+#define ILI9341_SLPOUT  0x11
+#define ILI9341_INVOFF  0x20
+#define ILI9341_INVON   0x21
+#define ILI9341_DISPOFF 0x28
+#define ILI9341_DISPON  0x29
+#define ILI9341_CASET   0x2a
+#define ILI9341_PASET   0x2b
+#define ILI9341_RAMWR   0x2c
+#define ILI9341_MADCTL  0x36
+#define ILI9341_PIXSET  0x3a
+#define ILI9341_RAMWRC  0x3c
+#define ILI9341_RDID4   0xd3
+
+#define MADCTL_MY  0x80
+#define MADCTL_MX  0x40
+#define MADCTL_MV  0x20
+#define MADCTL_BGR 0x08
+
+/* DBI field of the pixel format set command */
+#define PIXSET_DBI_MASK 0x07
+#define PIXSET_DBI_16   0x05
+
+enum ili9341_mode
+{
+    ILI9341_CMD,
+    ILI9341_DATA
+};
+
+typedef struct {
+    SSISlave ssidev;
+    QemuConsole *con;
+
+    bool landscape;
+
+    uint32_t mode;
+    uint8_t cmd;
+    uint32_t param_count;
+    uint8_t params[4];
+
+    uint16_t col_start;
+    uint16_t col_end;
+    uint16_t page_start;
+    uint16_t page_end;
+    uint16_t col;
+    uint16_t page;
+    uint8_t madctl;
+    uint8_t pixset;
+    uint8_t pixel[3];
+    uint8_t pixel_len;
+
+    bool sleeping;
+    bool display_on;
+    bool inverted;
+
+    /* Area of the frame memory changed since the last display update, in
+     * panel coordinates; empty when x0 >= x1. */
+    bool redraw;
+    uint16_t dirty_x0;
+    uint16_t dirty_y0;
+    uint16_t dirty_x1;
+    uint16_t dirty_y1;
+
+    /* Frame memory, one 0x00RRGGBB word per panel pixel */
+    uint32_t framebuffer[ILI9341_WIDTH * ILI9341_HEIGHT];
+} ili9341_state;
+
+
+
+/* HELPER FUNCTIONS */
+
+static void ili9341_reset_state(ili9341_state *s)
+{
+    s->cmd = ILI9341_NOP;
+    s->param_count = 0;
+    s->pixel_len = 0;
+    s->col_start = 0;
+    s->col_end = ILI9341_WIDTH - 1;
+    s->page_start = 0;
+    s->page_end = ILI9341_HEIGHT - 1;
+    s->col = 0;
+    s->page = 0;
+    s->madctl = 0;
+    s->pixset = 0x66;
+    s->sleeping = true;
+    s->display_on = false;
+    s->inverted = false;
+    s->redraw = true;
+}
+
+static void ili9341_mark_dirty(ili9341_state *s, unsigned x, unsigned y)
+{
+    if (s->dirty_x0 >= s->dirty_x1) {
+        s->dirty_x0 = x;
+        s->dirty_x1 = x + 1;
+        s->dirty_y0 = y;
+        s->dirty_y1 = y + 1;
+        return;
+    }
+    if (x < s->dirty_x0) {
+        s->dirty_x0 = x;
+    } else if (x >= s->dirty_x1) {
+        s->dirty_x1 = x + 1;
+    }
+    if (y < s->dirty_y0) {
+        s->dirty_y0 = y;
+    } else if (y >= s->dirty_y1) {
+        s->dirty_y1 = y + 1;
+    }
+}
+
+/* Store a pixel at the current address and advance it through the window.
+ * Addresses are logical (column, page) pairs; MADCTL decides where they land
+ * on the panel. */
+static void ili9341_write_pixel(ili9341_state *s, uint32_t rgb)
+{
+    unsigned x = s->col, y = s->page;
+
+    if (s->madctl & MADCTL_MV) {
+        x = s->page;
+        y = s->col;
+    }
+    if (x < ILI9341_WIDTH && y < ILI9341_HEIGHT) {
+        if (s->madctl & MADCTL_MX) {
+            x = ILI9341_WIDTH - 1 - x;
+        }
+        if (s->madctl & MADCTL_MY) {
+            y = ILI9341_HEIGHT - 1 - y;
+        }
+        if (s->framebuffer[y * ILI9341_WIDTH + x] != rgb) {
+            s->framebuffer[y * ILI9341_WIDTH + x] = rgb;
+            ili9341_mark_dirty(s, x, y);
+        }
+    }
+
+    if (s->col < s->col_end) {
+        s->col++;
+    } else {
+        s->col = s->col_start;
+        s->page = s->page < s->page_end ? s->page + 1 : s->page_start;
+    }
+}
+
+static void ili9341_write_data(ili9341_state *s, uint8_t data)
+{
+    unsigned r, g, b;
+    uint32_t rgb;
+
+    s->pixel[s->pixel_len++] = data;
+    if ((s->pixset & PIXSET_DBI_MASK) == PIXSET_DBI_16) {
+        if (s->pixel_len < 2) {
+            return;
+        }
+        r = s->pixel[0] >> 3;
+        g = ((s->pixel[0] & 0x07) << 3) | (s->pixel[1] >> 5);
+        b = s->pixel[1] & 0x1f;
+        r = (r << 3) | (r >> 2);
+        g = (g << 2) | (g >> 4);
+        b = (b << 3) | (b >> 2);
+    } else {
+        if (s->pixel_len < 3) {
+            return;
+        }
+        r = (s->pixel[0] & 0xfc) | (s->pixel[0] >> 6);
+        g = (s->pixel[1] & 0xfc) | (s->pixel[1] >> 6);
+        b = (s->pixel[2] & 0xfc) | (s->pixel[2] >> 6);
+    }
+    s->pixel_len = 0;
+
+    if (s->madctl & MADCTL_BGR) {
+        rgb = (b << 16) | (g << 8) | r;
+    } else {
+        rgb = (r << 16) | (g << 8) | b;
+    }
+    ili9341_write_pixel(s, rgb);
+}
+
+static uint8_t ili9341_read_data(ili9341_state *s)
+{
+    /* The first byte of every read is a dummy cycle. */
+    static const uint8_t id4[] = { 0x00, 0x00, 0x93, 0x41 };
+
+    switch (s->cmd) {
+    case ILI9341_RDDPM:
+        if (s->param_count != 1) {
+            return 0;
+        }
+        return 0x88 | (s->sleeping ? 0 : 0x10) | (s->display_on ? 0x04 : 0);
+    case ILI9341_RDDMADCTL:
+        return s->param_count == 1 ? s->madctl : 0;
+    case ILI9341_RDID4:
+        return s->param_count < sizeof(id4) ? id4[s->param_count] : 0;
+    default:
+        return 0;
+    }
+}
+
+static void ili9341_command(ili9341_state *s, uint8_t cmd)
+{
+    DPRINTF("command 0x%02x\n", cmd);
+
+    s->cmd = cmd;
+    s->param_count = 0;
+    s->pixel_len = 0;
+
+    switch (cmd) {
+    case ILI9341_SWRESET:
+        ili9341_reset_state(s);
+        break;
+    case ILI9341_SLPIN:
+    case ILI9341_SLPOUT:
+        s->sleeping = cmd == ILI9341_SLPIN;
+        s->redraw = true;
+        break;
+    case ILI9341_DISPOFF:
+    case ILI9341_DISPON:
+        s->display_on = cmd == ILI9341_DISPON;
+        s->redraw = true;
+        break;
+    case ILI9341_INVOFF:
+    case ILI9341_INVON:
+        s->inverted = cmd == ILI9341_INVON;
+        s->redraw = true;
+        break;
+    case ILI9341_RAMWR:
+        s->col = s->col_start;
+        s->page = s->page_start;
+        break;
+    default:
+        break;
+    }
+}
+
+static void ili9341_param(ili9341_state *s, uint8_t data)
+{
+    uint16_t start, end;
+
+    if (s->param_count < sizeof(s->params)) {
+        s->params[s->param_count] = data;
+    }
+    s->param_count++;
+
+    switch (s->cmd) {
+    case ILI9341_CASET:
+    case ILI9341_PASET:
+        if (s->param_count != 4) {
+            break;
+        }
+        start = (s->params[0] << 8) | s->params[1];
+        end = (s->params[2] << 8) | s->params[3];
+        if (start > end) {
+            DPRINTF("ignoring window %u > %u\n", start, end);
+            break;
+        }
+        if (s->cmd == ILI9341_CASET) {
+            s->col_start = start;
+            s->col_end = end;
+        } else {
+            s->page_start = start;
+            s->page_end = end;
+        }
+        break;
+    case ILI9341_MADCTL:
+        if (s->param_count == 1) {
+            s->madctl = data;
+        }
+        break;
+    case ILI9341_PIXSET:
+        if (s->param_count == 1) {
+            s->pixset = data;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+
+/* DISPLAY */
+
+static uint32_t ili9341_pixel(ili9341_state *s, unsigned x, unsigned y)
+{
+    uint32_t rgb;
+
+    if (s->sleeping || !s->display_on) {
+        return 0;
+    }
+    rgb = s->framebuffer[y * ILI9341_WIDTH + x];
+    return s->inverted ? ~rgb & 0xffffff : rgb;
+}
+
+static void ili9341_update_display(void *opaque)
+{
+    ili9341_state *s = (ili9341_state *)opaque;
+    DisplaySurface *surface = qemu_console_surface(s->con);
+    unsigned x0, y0, x1, y1, x, y;
+    uint8_t *dest;
+    uint32_t *line;
+    int stride;
+
+    if (s->redraw) {
+        x0 = 0;
+        y0 = 0;
+        x1 = ILI9341_WIDTH;
+        y1 = ILI9341_HEIGHT;
+    } else if (s->dirty_x0 < s->dirty_x1) {
+        x0 = s->dirty_x0;
+        y0 = s->dirty_y0;
+        x1 = s->dirty_x1;
+        y1 = s->dirty_y1;
+    } else {
+        return;
+    }
+    s->redraw = false;
+    s->dirty_x0 = s->dirty_x1 = 0;
+
+    if (surface_bits_per_pixel(surface) != 32) {
+        fprintf(stderr, "ili9341: unsupported surface depth %d\n",
+                surface_bits_per_pixel(surface));
+        return;
+    }
+    dest = surface_data(surface);
+    stride = surface_stride(surface);
+
+    if (!s->landscape) {
+        for (y = y0; y < y1; y++) {
+            line = (uint32_t *)(dest + y * stride);
+            for (x = x0; x < x1; x++) {
+                line[x] = ili9341_pixel(s, x, y);
+            }
+        }
+        dpy_gfx_update(s->con, x0, y0, x1 - x0, y1 - y0);
+    } else {
+        /* The panel is turned a quarter anticlockwise: panel row y becomes
+         * surface column y and panel column x surface row WIDTH-1-x. */
+        for (x = x0; x < x1; x++) {
+            line = (uint32_t *)(dest + (ILI9341_WIDTH - 1 - x) * stride);
+            for (y = y0; y < y1; y++) {
+                line[y] = ili9341_pixel(s, x, y);
+            }
+        }
+        dpy_gfx_update(s->con, y0, ILI9341_WIDTH - x1, y1 - y0, x1 - x0);
+    }
+}
+
+static void ili9341_invalidate_display(void *opaque)
+{
+    ili9341_state *s = (ili9341_state *)opaque;
+    s->redraw = true;
+}
+
+static const GraphicHwOps ili9341_ops = {
+    .invalidate  = ili9341_invalidate_display,
+    .gfx_update  = ili9341_update_display,
+};
+
+
+
+/* SERIAL INTERFACE */
+
+/* Command/data input.  */
+static void ili9341_dc(void *opaque, int n, int level)
+{
+    ili9341_state *s = (ili9341_state *)opaque;
+    s->mode = level ? ILI9341_DATA : ILI9341_CMD;
+}
+
+static uint32_t ili9341_transfer(SSISlave *dev, uint32_t data)
+{
+    ili9341_state *s = FROM_SSI_SLAVE(ili9341_state, dev);
+    uint8_t ret;
+
+    if (s->mode == ILI9341_CMD) {
+        ili9341_command(s, data);
+        return 0;
+    }
+
+    switch (s->cmd) {
+    case ILI9341_RAMWR:
+    case ILI9341_RAMWRC:
+        ili9341_write_data(s, data);
+        return 0;
+    case ILI9341_RDDPM:
+    case ILI9341_RDDMADCTL:
+    case ILI9341_RDID4:
+        ret = ili9341_read_data(s);
+        s->param_count++;
+        return ret;
+    default:
+        ili9341_param(s, data);
+        return 0;
+    }
+}
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int ili9341_post_load(void *opaque, int version_id)
+{
+    ili9341_state *s = (ili9341_state *)opaque;
+
+    if (s->pixel_len >= sizeof(s->pixel)) {
+        return -EINVAL;
+    }
+    s->redraw = true;
+    return 0;
+}
+
+static const VMStateDescription vmstate_ili9341 = {
+    .name = "ili9341",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = ili9341_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_SSI_SLAVE(ssidev, ili9341_state),
+        VMSTATE_UINT32(mode, ili9341_state),
+        VMSTATE_UINT8(cmd, ili9341_state),
+        VMSTATE_UINT32(param_count, ili9341_state),
+        VMSTATE_UINT8_ARRAY(params, ili9341_state, 4),
+        VMSTATE_UINT16(col_start, ili9341_state),
+        VMSTATE_UINT16(col_end, ili9341_state),
+        VMSTATE_UINT16(page_start, ili9341_state),
+        VMSTATE_UINT16(page_end, ili9341_state),
+        VMSTATE_UINT16(col, ili9341_state),
+        VMSTATE_UINT16(page, ili9341_state),
+        VMSTATE_UINT8(madctl, ili9341_state),
+        VMSTATE_UINT8(pixset, ili9341_state),
+        VMSTATE_UINT8_ARRAY(pixel, ili9341_state, 3),
+        VMSTATE_UINT8(pixel_len, ili9341_state),
+        VMSTATE_BOOL(sleeping, ili9341_state),
+        VMSTATE_BOOL(display_on, ili9341_state),
+        VMSTATE_BOOL(inverted, ili9341_state),
+        VMSTATE_UINT32_ARRAY(framebuffer, ili9341_state,
+                             ILI9341_WIDTH * ILI9341_HEIGHT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void ili9341_reset(DeviceState *dev)
+{
+    ili9341_state *s = FROM_SSI_SLAVE(ili9341_state, SSI_SLAVE(dev));
+
+    ili9341_reset_state(s);
+    s->mode = ILI9341_CMD;
+}
+
+static int ili9341_init(SSISlave *d)
+{
+    DeviceState *dev = DEVICE(d);
+    ili9341_state *s = FROM_SSI_SLAVE(ili9341_state, d);
+
+    s->con = graphic_console_init(dev, 0, &ili9341_ops, s);
+    if (s->landscape) {
+        qemu_console_resize(s->con, ILI9341_HEIGHT, ILI9341_WIDTH);
+    } else {
+        qemu_console_resize(s->con, ILI9341_WIDTH, ILI9341_HEIGHT);
+    }
+
+    qdev_init_gpio_in(dev, ili9341_dc, 1);
+
+    return 0;
+}
+
+static Property ili9341_properties[] = {
+    DEFINE_PROP_BOOL("landscape", ili9341_state, landscape, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void ili9341_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SSISlaveClass *k = SSI_SLAVE_CLASS(klass);
+
+    k->init = ili9341_init;
+    k->transfer = ili9341_transfer;
+    k->cs_polarity = SSI_CS_LOW;
+    dc->reset = ili9341_reset;
+    dc->vmsd = &vmstate_ili9341;
+    dc->props = ili9341_properties;
+}
+
+static const TypeInfo ili9341_info = {
+    .name          = "ili9341",
+    .parent        = TYPE_SSI_SLAVE,
+    .instance_size = sizeof(ili9341_state),
+    .class_init    = ili9341_class_init,
+};
+
+static void ili9341_register_types(void)
+{
+    type_register_static(&ili9341_info);
+}
+
+type_init(ili9341_register_types)
@@ -1676,7 +1676,8 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     DisplaySurface *surface = qemu_console_surface(s->con);
     int y1, y, update, linesize, y_start, double_scan, mask, depth;
     int width, height, shift_control, line_offset, bwidth, bits;
-    ram_addr_t page0, page1, page_min, page_max;
+    ram_addr_t page0, page1, region_start, region_end;
+    DirtyBitmapSnapshot *snap;
     int disp_width, multi_scan, multi_run;
     uint8_t *d;
     uint32_t v, addr1, addr;
@@ -1818,9 +1819,24 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 #endif
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
+
+    /* Take the dirty bits of the whole frame at once; looking up the
+     * global bitmap for every scanline is much slower.  The CGA
+     * addressing modes and the split screen jump around in VRAM, so
+     * cover all of it in those cases.
+     */
+    region_start = addr1;
+    region_end = region_start + (ram_addr_t)line_offset * height + bwidth;
+    if ((s->cr[VGA_CRTC_MODE] & 3) != 3 || s->line_compare < height ||
+        line_offset < 0 || region_end > s->vram_size) {
+        region_start = 0;
+        region_end = s->vram_size;
+    }
+    snap = memory_region_snapshot_and_clear_dirty(&s->vram, region_start,
+                                                  region_end - region_start,
+                                                  DIRTY_MEMORY_VGA);
+
     y_start = -1;
-    page_min = -1;
-    page_max = 0;
     d = surface_data(surface);
     linesize = surface_stride(surface);
     y1 = 0;
@@ -1838,17 +1854,15 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         update = full_update;
         page0 = addr;
         page1 = addr + bwidth - 1;
-        update |= memory_region_get_dirty(&s->vram, page0, page1 - page0,
-                                          DIRTY_MEMORY_VGA);
+        if (!update) {
+            update = memory_region_snapshot_get_dirty(&s->vram, snap, page0,
+                                                      page1 - page0);
+        }
         /* explicit invalidation for the hardware cursor */
         update |= (s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1;
         if (update) {
             if (y_start < 0)
                 y_start = y;
-            if (page0 < page_min)
-                page_min = page0;
-            if (page1 > page_max)
-                page_max = page1;
             if (!(is_buffer_shared(surface))) {
                 vga_draw_line(s, d, s->vram_ptr + addr, width);
                 if (s->cursor_draw_line)
@@ -1881,13 +1895,7 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         dpy_gfx_update(s->con, 0, y_start,
                        disp_width, y - y_start);
     }
-    /* reset modified pages */
-    if (page_max >= page_min) {
-        memory_region_reset_dirty(&s->vram,
-                                  page_min,
-                                  page_max - page_min,
-                                  DIRTY_MEMORY_VGA);
-    }
+    g_free(snap);
     memset(s->invalidated_y_table, 0, ((height + 31) >> 5) * 4);
 }
 
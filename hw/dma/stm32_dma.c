@@ -0,0 +1,761 @@
+/*
+ * STM32 Microcontroller DMA module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "exec/address-spaces.h"
+#include "qemu/bitops.h"
+
+
+
+/* DEFINITIONS*/
+
+//#define DEBUG_STM32_DMA
+
+#ifdef DEBUG_STM32_DMA
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_DMA: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define DMA_ISR_OFFSET 0x00
+#define DMA_IFCR_OFFSET 0x04
+
+/* Per channel flags in ISR and IFCR.  Each channel has four bits, starting
+ * at bit (channel index * 4). */
+#define DMA_ISR_GIF  0x1
+#define DMA_ISR_TCIF 0x2
+#define DMA_ISR_HTIF 0x4
+#define DMA_ISR_TEIF 0x8
+
+/* Channel registers.  Channel n (counting from 0) is at offset 0x08 + n * 20 */
+#define DMA_CHANNEL_START 0x08
+#define DMA_CHANNEL_SIZE 20
+
+#define DMA_CCR_OFFSET 0x00
+#define DMA_CCR_EN_BIT 0
+#define DMA_CCR_TCIE_BIT 1
+#define DMA_CCR_HTIE_BIT 2
+#define DMA_CCR_TEIE_BIT 3
+#define DMA_CCR_DIR_BIT 4
+#define DMA_CCR_CIRC_BIT 5
+#define DMA_CCR_PINC_BIT 6
+#define DMA_CCR_MINC_BIT 7
+#define DMA_CCR_PSIZE_START 8
+#define DMA_CCR_MSIZE_START 10
+#define DMA_CCR_PL_START 12
+#define DMA_CCR_MEM2MEM_BIT 14
+
+#define DMA_CNDTR_OFFSET 0x04
+#define DMA_CPAR_OFFSET 0x08
+#define DMA_CMAR_OFFSET 0x0c
+
+#define DMA_MAX_CHANNEL_COUNT 7
+#define DMA_MAX_BLOCK_HANDLERS 8
+
+typedef struct Stm32DmaChannel {
+    /* Register Values */
+    uint32_t
+        DMA_CCR,
+        DMA_CNDTR,
+        DMA_CPAR,
+        DMA_CMAR;
+
+    /* Internal transfer state.  The hardware keeps its own copies of the
+     * addresses and count, which are reloaded in circular mode, and CPAR and
+     * CMAR read back unchanged during a transfer. */
+    uint32_t curr_par, curr_mar, reload_ndtr;
+
+    /* ISR flags for this channel (GIF/TCIF/HTIF/TEIF) */
+    uint32_t flags;
+
+    /* Bitmap of the request inputs currently asserted for this channel. */
+    uint32_t requests;
+
+    qemu_irq irq;
+} Stm32DmaChannel;
+
+typedef struct Stm32DmaBlockHandler {
+    hwaddr addr;
+    Stm32DmaBlockFn fn;
+    void *opaque;
+} Stm32DmaBlockHandler;
+
+struct Stm32Dma {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    void *stm32_rcc_prop;
+    void *as_prop;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32Rcc *stm32_rcc;
+    /* Address space the transfers are done in */
+    AddressSpace *as;
+
+    int channel_count;
+    Stm32DmaChannel channel[DMA_MAX_CHANNEL_COUNT];
+
+    int block_handler_count;
+    Stm32DmaBlockHandler block_handler[DMA_MAX_BLOCK_HANDLERS];
+
+    /* Set while transfers are being serviced.  Accessing a peripheral during
+     * a transfer can change request lines, which must not start a nested
+     * transfer. */
+    bool servicing;
+};
+
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_dma_update_irq(Stm32DmaChannel *ch)
+{
+    int level =
+        ((ch->flags & DMA_ISR_TCIF) &&
+                extract32(ch->DMA_CCR, DMA_CCR_TCIE_BIT, 1)) ||
+        ((ch->flags & DMA_ISR_HTIF) &&
+                extract32(ch->DMA_CCR, DMA_CCR_HTIE_BIT, 1)) ||
+        ((ch->flags & DMA_ISR_TEIF) &&
+                extract32(ch->DMA_CCR, DMA_CCR_TEIE_BIT, 1));
+
+    qemu_set_irq(ch->irq, level);
+}
+
+static void stm32_dma_set_flag(Stm32DmaChannel *ch, uint32_t flag)
+{
+    ch->flags |= flag | DMA_ISR_GIF;
+    stm32_dma_update_irq(ch);
+}
+
+/* Returns the size in bytes of a peripheral or memory beat. */
+static unsigned stm32_dma_beat_size(Stm32DmaChannel *ch, int start)
+{
+    switch(extract32(ch->DMA_CCR, start, 2)) {
+        case 0:
+            return 1;
+        case 1:
+            return 2;
+        default:
+            /* 3 is reserved - treat it like 32 bits */
+            return 4;
+    }
+}
+
+/* Returns a mask of the bits transferred by a beat of the given size. */
+static uint32_t stm32_dma_beat_mask(unsigned size)
+{
+    return (size == 4) ? 0xffffffff : (1U << (size * 8)) - 1;
+}
+
+/* Returns true if the channel has work to do right now. */
+static bool stm32_dma_channel_ready(Stm32DmaChannel *ch)
+{
+    return extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1) &&
+           (ch->DMA_CNDTR > 0) &&
+           (extract32(ch->DMA_CCR, DMA_CCR_MEM2MEM_BIT, 1) ||
+            ch->requests);
+}
+
+/* Read a beat, either from host memory (if the address has been mapped) or
+ * through the memory API.  Returns false on a bus error. */
+static bool stm32_dma_bus_read(Stm32Dma *s, hwaddr addr, uint8_t *host,
+                               unsigned size, uint32_t *value)
+{
+    uint8_t buf[4] = {0, 0, 0, 0};
+
+    if(host) {
+        memcpy(buf, host, size);
+    } else if(address_space_rw(s->as, addr, buf, size, false)) {
+        return false;
+    }
+    *value = ldl_le_p(buf);
+    return true;
+}
+
+/* Write a beat.  If the destination is wider than the source, the value is
+ * zero extended, and if it is narrower, the upper bits are dropped (this
+ * matches table 78 of the reference manual).  Returns false on a bus error.
+ */
+static bool stm32_dma_bus_write(Stm32Dma *s, hwaddr addr, uint8_t *host,
+                                unsigned size, uint32_t value)
+{
+    uint8_t buf[4];
+
+    stl_le_p(buf, value);
+    if(host) {
+        memcpy(host, buf, size);
+        return true;
+    }
+    return !address_space_rw(s->as, addr, buf, size, true);
+}
+
+/* Map span bytes at addr into host memory so that the transfer can access
+ * them directly rather than going through the memory API for every beat.
+ * Only RAM is mapped.  Anything else (or a mapping which comes back short)
+ * returns NULL, and the transfer falls back to the memory API.
+ */
+static uint8_t *stm32_dma_map(Stm32Dma *s, hwaddr addr, hwaddr span,
+                              bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, len = span;
+    void *host;
+
+    mr = address_space_translate(s->as, addr, &xlat, &len, is_write);
+    if(!memory_region_is_ram(mr) || (is_write && memory_region_is_rom(mr)) ||
+            (len < span)) {
+        return NULL;
+    }
+
+    len = span;
+    host = address_space_map(s->as, addr, &len, is_write);
+    if(host && (len < span)) {
+        address_space_unmap(s->as, host, len, is_write, 0);
+        host = NULL;
+    }
+    return host;
+}
+
+static Stm32DmaBlockHandler *stm32_dma_find_block_handler(Stm32Dma *s,
+                                                          hwaddr addr)
+{
+    int i;
+
+    for(i = 0; i < s->block_handler_count; i++) {
+        if(s->block_handler[i].addr == addr) {
+            return &s->block_handler[i];
+        }
+    }
+    return NULL;
+}
+
+/* Run a channel for as long as it is ready, up to the end of the block.
+ *
+ * The memory side of the block is mapped once up front, so that only the
+ * peripheral register is accessed through the memory API on each beat.  For
+ * memory-to-memory transfers both sides are mapped, and when the beat sizes
+ * match the whole block is copied in one go.  Byte and half word transfers
+ * to or from a peripheral register with a block handler hand the handler as
+ * much of the block as it will take first.
+ */
+static void stm32_dma_channel_run(Stm32Dma *s, Stm32DmaChannel *ch)
+{
+    bool mem2mem = extract32(ch->DMA_CCR, DMA_CCR_MEM2MEM_BIT, 1);
+    bool mem_to_periph = extract32(ch->DMA_CCR, DMA_CCR_DIR_BIT, 1);
+    bool pinc = extract32(ch->DMA_CCR, DMA_CCR_PINC_BIT, 1);
+    bool minc = extract32(ch->DMA_CCR, DMA_CCR_MINC_BIT, 1);
+    unsigned psize = stm32_dma_beat_size(ch, DMA_CCR_PSIZE_START);
+    unsigned msize = stm32_dma_beat_size(ch, DMA_CCR_MSIZE_START);
+    hwaddr mem_span = minc ? (hwaddr)ch->DMA_CNDTR * msize : msize;
+    hwaddr periph_span = pinc ? (hwaddr)ch->DMA_CNDTR * psize : psize;
+    hwaddr mem_base = ch->curr_mar, periph_base = ch->curr_par;
+    hwaddr mem_access = 0, periph_access = 0;
+    uint8_t *mem_host, *periph_host = NULL;
+    uint8_t *mem_ptr, *periph_ptr;
+    unsigned periph_bus_size;
+    Stm32DmaBlockHandler *handler;
+    uint32_t value, old_ndtr;
+    int n;
+    bool ok;
+
+    mem_host = stm32_dma_map(s, mem_base, mem_span, !mem_to_periph);
+    if(mem2mem) {
+        /* A real peripheral register has side effects and must see every
+         * access, so the peripheral side is only mapped for
+         * memory-to-memory transfers. */
+        periph_host = stm32_dma_map(s, periph_base, periph_span, mem_to_periph);
+    }
+
+    if(mem_host && periph_host && pinc && minc && (psize == msize)) {
+        if(mem_to_periph) {
+            memmove(periph_host, mem_host, mem_span);
+        } else {
+            memmove(mem_host, periph_host, mem_span);
+        }
+        mem_access = periph_access = mem_span;
+
+        if(ch->DMA_CNDTR > ch->reload_ndtr / 2) {
+            stm32_dma_set_flag(ch, DMA_ISR_HTIF);
+        }
+        ch->curr_mar += mem_span;
+        ch->curr_par += periph_span;
+        ch->DMA_CNDTR = 0;
+    }
+
+    /* A half word beat must reach the register whole */
+    handler = (mem_host && !mem2mem && !pinc && minc &&
+               ((msize == 1) || ((msize == 2) && (psize >= 2)))) ?
+              stm32_dma_find_block_handler(s, periph_base) : NULL;
+    if(handler) {
+        n = handler->fn(handler->opaque, mem_host, ch->DMA_CNDTR * msize,
+                        msize, mem_to_periph);
+        n -= n % msize;
+        if(n > 0) {
+            old_ndtr = ch->DMA_CNDTR;
+            mem_access = n;
+            ch->curr_mar += n;
+            ch->DMA_CNDTR -= n / msize;
+
+            if((old_ndtr > ch->reload_ndtr / 2) &&
+                    (ch->DMA_CNDTR <= ch->reload_ndtr / 2)) {
+                stm32_dma_set_flag(ch, DMA_ISR_HTIF);
+            }
+        }
+    }
+
+    while(stm32_dma_channel_ready(ch)) {
+        mem_ptr = mem_host ? mem_host + (ch->curr_mar - mem_base) : NULL;
+        periph_ptr = periph_host ?
+                periph_host + (ch->curr_par - periph_base) : NULL;
+
+        /* Peripheral registers sit on the 32 bit APB bus, which turns byte
+         * and half word accesses into word accesses.  Do the same here, since
+         * most of the peripheral models only accept 16 or 32 bit accesses. */
+        periph_bus_size = (!mem2mem && !(ch->curr_par & 3)) ? 4 : psize;
+
+        if(mem_to_periph) {
+            ok = stm32_dma_bus_read(s, ch->curr_mar, mem_ptr, msize,
+                                    &value) &&
+                 stm32_dma_bus_write(s, ch->curr_par, periph_ptr,
+                                     periph_bus_size,
+                                     value & stm32_dma_beat_mask(psize));
+        } else {
+            ok = stm32_dma_bus_read(s, ch->curr_par, periph_ptr,
+                                    periph_bus_size, &value) &&
+                 stm32_dma_bus_write(s, ch->curr_mar, mem_ptr, msize,
+                                     value & stm32_dma_beat_mask(psize));
+        }
+
+        if(!ok) {
+            /* A bus error disables the channel. */
+            DPRINTF("%s transfer error\n", stm32_periph_name(s->periph));
+            ch->DMA_CCR &= ~BIT(DMA_CCR_EN_BIT);
+            stm32_dma_set_flag(ch, DMA_ISR_TEIF);
+            break;
+        }
+
+        mem_access = ch->curr_mar - mem_base + msize;
+        periph_access = ch->curr_par - periph_base + psize;
+        if(pinc) {
+            ch->curr_par += psize;
+        }
+        if(minc) {
+            ch->curr_mar += msize;
+        }
+        ch->DMA_CNDTR--;
+
+        if(ch->DMA_CNDTR == ch->reload_ndtr / 2) {
+            stm32_dma_set_flag(ch, DMA_ISR_HTIF);
+        }
+    }
+
+    if(mem_host) {
+        address_space_unmap(s->as, mem_host, mem_span, !mem_to_periph,
+                            mem_access);
+    }
+    if(periph_host) {
+        address_space_unmap(s->as, periph_host, periph_span, mem_to_periph,
+                            periph_access);
+    }
+
+    if(extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1) && (ch->DMA_CNDTR == 0)) {
+        stm32_dma_set_flag(ch, DMA_ISR_TCIF);
+
+        /* In circular mode, the transfer restarts from the beginning.
+         * Otherwise the channel stays idle until software reprograms it. */
+        if(extract32(ch->DMA_CCR, DMA_CCR_CIRC_BIT, 1) && !mem2mem) {
+            ch->DMA_CNDTR = ch->reload_ndtr;
+            ch->curr_par = ch->DMA_CPAR;
+            ch->curr_mar = ch->DMA_CMAR;
+        }
+    }
+}
+
+/* Service all channels which are ready, highest priority first.  When two
+ * channels have the same priority level, the lower numbered channel wins. */
+static void stm32_dma_service(Stm32Dma *s)
+{
+    Stm32DmaChannel *best;
+    int i, best_pl, pl;
+
+    if(s->servicing) {
+        return;
+    }
+    s->servicing = true;
+
+    for(;;) {
+        best = NULL;
+        best_pl = -1;
+        for(i = 0; i < s->channel_count; i++) {
+            Stm32DmaChannel *ch = &s->channel[i];
+
+            if(stm32_dma_channel_ready(ch)) {
+                pl = extract32(ch->DMA_CCR, DMA_CCR_PL_START, 2);
+                if(pl > best_pl) {
+                    best = ch;
+                    best_pl = pl;
+                }
+            }
+        }
+        if(!best) {
+            break;
+        }
+        stm32_dma_channel_run(s, best);
+    }
+
+    s->servicing = false;
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+void stm32_dma_set_block_handler(DeviceState *dma, hwaddr addr,
+                                 Stm32DmaBlockFn fn, void *opaque)
+{
+    Stm32Dma *s = STM32_DMA(dma);
+    Stm32DmaBlockHandler *handler;
+
+    handler = stm32_dma_find_block_handler(s, addr);
+    if(!handler) {
+        assert(s->block_handler_count < DMA_MAX_BLOCK_HANDLERS);
+        handler = &s->block_handler[s->block_handler_count++];
+    }
+    handler->addr = addr;
+    handler->fn = fn;
+    handler->opaque = opaque;
+}
+
+
+
+
+/* GPIO HANDLERS */
+
+/* A peripheral changed the level of one of its DMA request lines. */
+static void stm32_dma_request_irq_handler(void *opaque, int n, int level)
+{
+    Stm32Dma *s = (Stm32Dma *)opaque;
+    Stm32DmaChannel *ch = &s->channel[n / STM32_DMA_CHANNEL_REQ_COUNT];
+    uint32_t mask = BIT(n % STM32_DMA_CHANNEL_REQ_COUNT);
+
+    assert(n < s->channel_count * STM32_DMA_CHANNEL_REQ_COUNT);
+
+    if(level) {
+        ch->requests |= mask;
+        stm32_dma_service(s);
+    } else {
+        ch->requests &= ~mask;
+    }
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint32_t stm32_dma_DMA_ISR_read(Stm32Dma *s)
+{
+    uint32_t value = 0;
+    int i;
+
+    for(i = 0; i < s->channel_count; i++) {
+        value |= s->channel[i].flags << (i * 4);
+    }
+    return value;
+}
+
+static void stm32_dma_DMA_IFCR_write(Stm32Dma *s, uint32_t new_value)
+{
+    Stm32DmaChannel *ch;
+    uint32_t clear;
+    int i;
+
+    for(i = 0; i < s->channel_count; i++) {
+        ch = &s->channel[i];
+        clear = extract32(new_value, i * 4, 4);
+
+        /* Clearing GIF clears all of the channel's flags. */
+        if(clear & DMA_ISR_GIF) {
+            clear = DMA_ISR_GIF | DMA_ISR_TCIF | DMA_ISR_HTIF | DMA_ISR_TEIF;
+        }
+        ch->flags &= ~clear;
+        if(!(ch->flags & (DMA_ISR_TCIF | DMA_ISR_HTIF | DMA_ISR_TEIF))) {
+            ch->flags &= ~DMA_ISR_GIF;
+        }
+        stm32_dma_update_irq(ch);
+    }
+}
+
+static void stm32_dma_DMA_CCR_write(Stm32Dma *s, Stm32DmaChannel *ch,
+                                    uint32_t new_value)
+{
+    bool was_enabled = extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1);
+
+    ch->DMA_CCR = new_value & 0x00007fff;
+
+    if(!was_enabled && extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1)) {
+        /* Latch the transfer parameters. */
+        ch->reload_ndtr = ch->DMA_CNDTR;
+        ch->curr_par = ch->DMA_CPAR;
+        ch->curr_mar = ch->DMA_CMAR;
+    }
+
+    stm32_dma_update_irq(ch);
+    stm32_dma_service(s);
+}
+
+static uint64_t stm32_dma_read(void *opaque, hwaddr offset,
+                          unsigned size)
+{
+    Stm32Dma *s = (Stm32Dma *)opaque;
+    Stm32DmaChannel *ch;
+    int index;
+
+    switch(offset) {
+        case DMA_ISR_OFFSET:
+            return stm32_dma_DMA_ISR_read(s);
+        case DMA_IFCR_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+    }
+
+    index = (offset - DMA_CHANNEL_START) / DMA_CHANNEL_SIZE;
+    if(index >= s->channel_count) {
+        STM32_BAD_REG(offset, size);
+        return 0;
+    }
+    ch = &s->channel[index];
+
+    switch((offset - DMA_CHANNEL_START) % DMA_CHANNEL_SIZE) {
+        case DMA_CCR_OFFSET:
+            return ch->DMA_CCR;
+        case DMA_CNDTR_OFFSET:
+            return ch->DMA_CNDTR;
+        case DMA_CPAR_OFFSET:
+            return ch->DMA_CPAR;
+        case DMA_CMAR_OFFSET:
+            return ch->DMA_CMAR;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_dma_write(void *opaque, hwaddr offset,
+                       uint64_t value, unsigned size)
+{
+    Stm32Dma *s = (Stm32Dma *)opaque;
+    Stm32DmaChannel *ch;
+    int index;
+
+    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, s->periph);
+
+    switch(offset) {
+        case DMA_ISR_OFFSET:
+            STM32_RO_REG(offset);
+            return;
+        case DMA_IFCR_OFFSET:
+            stm32_dma_DMA_IFCR_write(s, value);
+            return;
+    }
+
+    index = (offset - DMA_CHANNEL_START) / DMA_CHANNEL_SIZE;
+    if(index >= s->channel_count) {
+        STM32_BAD_REG(offset, size);
+        return;
+    }
+    ch = &s->channel[index];
+
+    switch((offset - DMA_CHANNEL_START) % DMA_CHANNEL_SIZE) {
+        case DMA_CCR_OFFSET:
+            stm32_dma_DMA_CCR_write(s, ch, value);
+            break;
+        case DMA_CNDTR_OFFSET:
+            /* The transfer parameters can only be changed while the
+             * channel is disabled. */
+            if(extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1)) {
+                qemu_log_mask(LOG_GUEST_ERROR,
+                              "%s: CNDTR%d written while channel enabled\n",
+                              stm32_periph_name(s->periph), index + 1);
+            } else {
+                ch->DMA_CNDTR = value & 0x0000ffff;
+            }
+            break;
+        case DMA_CPAR_OFFSET:
+            if(extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1)) {
+                qemu_log_mask(LOG_GUEST_ERROR,
+                              "%s: CPAR%d written while channel enabled\n",
+                              stm32_periph_name(s->periph), index + 1);
+            } else {
+                ch->DMA_CPAR = value;
+            }
+            break;
+        case DMA_CMAR_OFFSET:
+            if(extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1)) {
+                qemu_log_mask(LOG_GUEST_ERROR,
+                              "%s: CMAR%d written while channel enabled\n",
+                              stm32_periph_name(s->periph), index + 1);
+            } else {
+                ch->DMA_CMAR = value;
+            }
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_dma_ops = {
+    .read = stm32_dma_read,
+    .write = stm32_dma_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_dma_reset(DeviceState *dev)
+{
+    Stm32Dma *s = STM32_DMA(dev);
+    Stm32DmaChannel *ch;
+    int i;
+
+    for(i = 0; i < s->channel_count; i++) {
+        ch = &s->channel[i];
+        ch->DMA_CCR = 0;
+        ch->DMA_CNDTR = 0;
+        ch->DMA_CPAR = 0;
+        ch->DMA_CMAR = 0;
+        ch->curr_par = 0;
+        ch->curr_mar = 0;
+        ch->reload_ndtr = 0;
+        ch->flags = 0;
+        stm32_dma_update_irq(ch);
+    }
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_dma_init(SysBusDevice *dev)
+{
+    Stm32Dma *s = STM32_DMA(dev);
+    int i;
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+    s->as = s->as_prop ? (AddressSpace *)s->as_prop : &address_space_memory;
+
+    switch(s->periph) {
+        case STM32_DMA1:
+            s->channel_count = STM32_DMA1_CHANNEL_COUNT;
+            break;
+        case STM32_DMA2:
+            s->channel_count = STM32_DMA2_CHANNEL_COUNT;
+            break;
+        default:
+            hw_error("Invalid DMA controller");
+            break;
+    }
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_dma_ops, s,
+                          "dma", STM32_PERIPH_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    for(i = 0; i < s->channel_count; i++) {
+        sysbus_init_irq(dev, &s->channel[i].irq);
+    }
+
+    qdev_init_gpio_in(DEVICE(dev), stm32_dma_request_irq_handler,
+                      s->channel_count * STM32_DMA_CHANNEL_REQ_COUNT);
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_dma_channel = {
+    .name = "stm32-dma-channel",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(DMA_CCR, Stm32DmaChannel),
+        VMSTATE_UINT32(DMA_CNDTR, Stm32DmaChannel),
+        VMSTATE_UINT32(DMA_CPAR, Stm32DmaChannel),
+        VMSTATE_UINT32(DMA_CMAR, Stm32DmaChannel),
+        VMSTATE_UINT32(curr_par, Stm32DmaChannel),
+        VMSTATE_UINT32(curr_mar, Stm32DmaChannel),
+        VMSTATE_UINT32(reload_ndtr, Stm32DmaChannel),
+        VMSTATE_UINT32(flags, Stm32DmaChannel),
+        VMSTATE_UINT32(requests, Stm32DmaChannel),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* The request lines are saved with the channels, since the peripherals only
+ * drive them again when their level changes. */
+static const VMStateDescription vmstate_stm32_dma = {
+    .name = "stm32-dma",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(channel, Stm32Dma, DMA_MAX_CHANNEL_COUNT, 1,
+                             vmstate_stm32_dma_channel, Stm32DmaChannel),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_dma_properties[] = {
+    DEFINE_PROP_PERIPH_T("periph", Stm32Dma, periph, STM32_PERIPH_UNDEFINED),
+    DEFINE_PROP_PTR("stm32_rcc", Stm32Dma, stm32_rcc_prop),
+    DEFINE_PROP_PTR("as", Stm32Dma, as_prop),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_dma_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_dma_init;
+    dc->reset = stm32_dma_reset;
+    dc->vmsd = &vmstate_stm32_dma;
+    dc->props = stm32_dma_properties;
+}
+
+static TypeInfo stm32_dma_info = {
+    .name  = "stm32-dma",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Dma),
+    .class_init = stm32_dma_class_init
+};
+
+static void stm32_dma_register_types(void)
+{
+    type_register_static(&stm32_dma_info);
+}
+
+type_init(stm32_dma_register_types)
@@ -33,6 +33,10 @@
 #define AFIO_MAPR_USART3_REMAP_MASK 0x00000030
 #define AFIO_MAPR_USART2_REMAP_BIT 3
 #define AFIO_MAPR_USART1_REMAP_BIT 2
+#define AFIO_MAPR_TIM1_REMAP_START 6
+#define AFIO_MAPR_TIM2_REMAP_START 8
+#define AFIO_MAPR_TIM3_REMAP_START 10
+#define AFIO_MAPR_TIM4_REMAP_BIT 12
 
 #define AFIO_EXTICR_START 0x08
 #define AFIO_EXTICR_COUNT 4
@@ -51,6 +55,7 @@ struct Stm32Afio {
     /* Properties */
     void *stm32_rcc_prop;
     void *stm32_exti_prop;
+    bool direct_read;
 
     /* Private */
     MemoryRegion iomem;
@@ -64,8 +69,14 @@ struct Stm32Afio {
         USART1_REMAP,
         USART2_REMAP,
         USART3_REMAP,
+        TIM1_REMAP,
+        TIM2_REMAP,
+        TIM3_REMAP,
+        TIM4_REMAP,
         AFIO_MAPR,
         AFIO_EXTICR[AFIO_EXTICR_COUNT];
+
+    NotifierList map_notifiers;
 };
 
 
@@ -79,7 +90,11 @@ static uint32_t stm32_afio_AFIO_MAPR_read(Stm32Afio *s)
 {
     return (s->USART1_REMAP << AFIO_MAPR_USART1_REMAP_BIT) |
            (s->USART2_REMAP << AFIO_MAPR_USART2_REMAP_BIT) |
-           (s->USART3_REMAP << AFIO_MAPR_USART3_REMAP_START);
+           (s->USART3_REMAP << AFIO_MAPR_USART3_REMAP_START) |
+           (s->TIM1_REMAP << AFIO_MAPR_TIM1_REMAP_START) |
+           (s->TIM2_REMAP << AFIO_MAPR_TIM2_REMAP_START) |
+           (s->TIM3_REMAP << AFIO_MAPR_TIM3_REMAP_START) |
+           (s->TIM4_REMAP << AFIO_MAPR_TIM4_REMAP_BIT);
 }
 
 static void stm32_afio_AFIO_MAPR_write(Stm32Afio *s, uint32_t new_value,
@@ -88,6 +103,11 @@ static void stm32_afio_AFIO_MAPR_write(Stm32Afio *s, uint32_t new_value,
     s->USART1_REMAP = extract32(s->AFIO_MAPR, AFIO_MAPR_USART1_REMAP_BIT, 1);
     s->USART2_REMAP = extract32(s->AFIO_MAPR, AFIO_MAPR_USART2_REMAP_BIT, 1);
     s->USART3_REMAP = (new_value & AFIO_MAPR_USART3_REMAP_MASK) >> AFIO_MAPR_USART3_REMAP_START;
+    s->TIM1_REMAP = extract32(new_value, AFIO_MAPR_TIM1_REMAP_START, 2);
+    s->TIM2_REMAP = extract32(new_value, AFIO_MAPR_TIM2_REMAP_START, 2);
+    s->TIM3_REMAP = extract32(new_value, AFIO_MAPR_TIM3_REMAP_START, 2);
+    s->TIM4_REMAP = extract32(new_value, AFIO_MAPR_TIM4_REMAP_BIT, 1);
+    notifier_list_notify(&s->map_notifiers, s);
 }
 
 /* Write the External Interrupt Configuration Register.
@@ -157,6 +177,18 @@ static uint64_t stm32_afio_read(void *opaque, hwaddr offset,
     return 0;
 }
 
+/* Store the register values in the register page which the guest reads,
+ * see stm32_init_reg_page. */
+static void stm32_afio_update_reg_page(Stm32Afio *s)
+{
+    stm32_reg_page_set(&s->iomem, AFIO_MAPR_OFFSET,
+                       stm32_afio_AFIO_MAPR_read(s));
+    stm32_reg_page_set(&s->iomem, AFIO_EXTICR1_OFFSET, s->AFIO_EXTICR[0]);
+    stm32_reg_page_set(&s->iomem, AFIO_EXTICR2_OFFSET, s->AFIO_EXTICR[1]);
+    stm32_reg_page_set(&s->iomem, AFIO_EXTICR3_OFFSET, s->AFIO_EXTICR[2]);
+    stm32_reg_page_set(&s->iomem, AFIO_EXTICR4_OFFSET, s->AFIO_EXTICR[3]);
+}
+
 static void stm32_afio_write(void *opaque, hwaddr offset,
                        uint64_t value, unsigned size)
 {
@@ -187,11 +219,17 @@ static void stm32_afio_write(void *opaque, hwaddr offset,
             STM32_BAD_REG(offset, size);
             break;
     }
+    stm32_afio_update_reg_page(s);
 }
 
 static const MemoryRegionOps stm32_afio_ops = {
     .read = stm32_afio_read,
     .write = stm32_afio_write,
+    .idempotent_reads = MEMORY_REGION_IDEMPOTENT(AFIO_MAPR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(AFIO_EXTICR1_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(AFIO_EXTICR2_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(AFIO_EXTICR3_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(AFIO_EXTICR4_OFFSET),
     .valid.min_access_size = 4,
     .valid.max_access_size = 4,
     .endianness = DEVICE_NATIVE_ENDIAN
@@ -206,6 +244,8 @@ static void stm32_afio_reset(DeviceState *dev)
     stm32_afio_AFIO_EXTICR_write(s, 1, 0x00000000, true);
     stm32_afio_AFIO_EXTICR_write(s, 2, 0x00000000, true);
     stm32_afio_AFIO_EXTICR_write(s, 3, 0x00000000, true);
+    memory_region_flush_read_cache(&s->iomem);
+    stm32_afio_update_reg_page(s);
 }
 
 
@@ -215,6 +255,11 @@ static void stm32_afio_reset(DeviceState *dev)
 
 /* PUBLIC FUNCTIONS */
 
+void stm32_afio_add_map_notifier(Stm32Afio *s, Notifier *notifier)
+{
+    notifier_list_add(&s->map_notifiers, notifier);
+}
+
 uint32_t stm32_afio_get_periph_map(Stm32Afio *s, stm32_periph_t periph)
 {
     switch(periph) {
@@ -224,6 +269,14 @@ uint32_t stm32_afio_get_periph_map(Stm32Afio *s, stm32_periph_t periph)
             return s->USART2_REMAP;
         case STM32_UART3:
             return s->USART3_REMAP;
+        case STM32_TIM1:
+            return s->TIM1_REMAP;
+        case STM32_TIM2:
+            return s->TIM2_REMAP;
+        case STM32_TIM3:
+            return s->TIM3_REMAP;
+        case STM32_TIM4:
+            return s->TIM4_REMAP;
         default:
             hw_error("Invalid peripheral");
             break;
@@ -241,8 +294,8 @@ static int stm32_afio_init(SysBusDevice *dev)
 
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_afio_ops, s,
-                          "afio", 0x03ff);
+    stm32_init_reg_page(&s->iomem, OBJECT(s), &stm32_afio_ops, s,
+                        "afio", s->direct_read);
     sysbus_init_mmio(dev, &s->iomem);
 
     return 0;
@@ -250,9 +303,60 @@ static int stm32_afio_init(SysBusDevice *dev)
 
 static Property stm32_afio_properties[] = {
     DEFINE_PROP_PTR("stm32_rcc", Stm32Afio, stm32_rcc_prop),
+    DEFINE_PROP_BOOL("direct_read", Stm32Afio, direct_read, true),
     DEFINE_PROP_END_OF_LIST()
 };
 
+/* The EXTI routing is made by connecting GPIO IRQs, so it has to be undone
+ * before the saved EXTICR values are loaded over the current ones. */
+static int stm32_afio_pre_load(void *opaque)
+{
+    Stm32Afio *s = (Stm32Afio *)opaque;
+    int i;
+
+    for(i = 0; i < AFIO_EXTICR_COUNT; i++) {
+        stm32_afio_AFIO_EXTICR_write(s, i, 0x00000000, false);
+    }
+    return 0;
+}
+
+static int stm32_afio_post_load(void *opaque, int version_id)
+{
+    Stm32Afio *s = (Stm32Afio *)opaque;
+    uint32_t value;
+    int i;
+
+    for(i = 0; i < AFIO_EXTICR_COUNT; i++) {
+        value = s->AFIO_EXTICR[i];
+        s->AFIO_EXTICR[i] = 0x00000000; /* as routed by pre_load */
+        stm32_afio_AFIO_EXTICR_write(s, i, value, false);
+    }
+    notifier_list_notify(&s->map_notifiers, s);
+    memory_region_flush_read_cache(&s->iomem);
+    stm32_afio_update_reg_page(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_afio = {
+    .name = TYPE_STM32_AFIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_load = stm32_afio_pre_load,
+    .post_load = stm32_afio_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(USART1_REMAP, Stm32Afio),
+        VMSTATE_UINT32(USART2_REMAP, Stm32Afio),
+        VMSTATE_UINT32(USART3_REMAP, Stm32Afio),
+        VMSTATE_UINT32(TIM1_REMAP, Stm32Afio),
+        VMSTATE_UINT32(TIM2_REMAP, Stm32Afio),
+        VMSTATE_UINT32(TIM3_REMAP, Stm32Afio),
+        VMSTATE_UINT32(TIM4_REMAP, Stm32Afio),
+        VMSTATE_UINT32(AFIO_MAPR, Stm32Afio),
+        VMSTATE_UINT32_ARRAY(AFIO_EXTICR, Stm32Afio, AFIO_EXTICR_COUNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void add_gpio_link(Stm32Afio *s, int gpio_index, const char *link_name)
 {
     object_property_add_link(OBJECT(s), link_name, TYPE_STM32_GPIO,
@@ -265,6 +369,8 @@ static void stm32_afio_instance_init(Object *obj)
 {
     Stm32Afio *s = STM32_AFIO(obj);
 
+    notifier_list_init(&s->map_notifiers);
+
     add_gpio_link(s, 0, "gpio[a]");
     add_gpio_link(s, 1, "gpio[b]");
     add_gpio_link(s, 2, "gpio[c]");
@@ -287,6 +393,7 @@ static void stm32_afio_class_init(ObjectClass *klass, void *data)
 
     k->init = stm32_afio_init;
     dc->reset = stm32_afio_reset;
+    dc->vmsd = &vmstate_stm32_afio;
     dc->props = stm32_afio_properties;
 }
 
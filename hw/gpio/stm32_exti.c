@@ -42,10 +42,21 @@
 /* There are 20 lines for CL devices.  Non-CL devices have only 19, but it
  * doesn't hurt to handle the maximum possible. */
 #define EXTI_LINE_COUNT 20
+#define EXTI_LINE_MASK ((1 << EXTI_LINE_COUNT) - 1)
 
 /* The number of IRQ connections to the NVIC */
 #define EXTI_IRQ_COUNT 10
 
+/* The EXTI lines which drive each NVIC IRQ.  EXTI0 - EXTI4 each have their
+ * own IRQ, EXTI5 - EXTI9 and EXTI10 - EXTI15 share one each, followed by
+ * PVD, RTCAlarm and OTG_FS_WKUP.  Line 19 (Ethernet wakeup) has no IRQ. */
+static const uint32_t stm32_exti_irq_lines[EXTI_IRQ_COUNT] = {
+    BIT(0), BIT(1), BIT(2), BIT(3), BIT(4),
+    0x000003e0, /* EXTI5 - EXTI9 */
+    0x0000fc00, /* EXTI10 - EXTI15 */
+    BIT(16), BIT(17), BIT(18)
+};
+
 
 struct Stm32Exti {
     /* Inherited */
@@ -62,26 +73,54 @@ struct Stm32Exti {
         EXTI_PR;
 
     qemu_irq irq[EXTI_IRQ_COUNT];
+    /* Current level of each NVIC IRQ, one bit per IRQ */
+    uint32_t irq_level;
 };
 
-static void stm32_exti_change_EXTI_PR_bit(Stm32Exti *s, unsigned pos,
-                                            unsigned new_bit_value);
-
 
 
 /* HELPER FUNCTIONS */
 
-/* Call when the EXTI shouldbe tri */
-static void stm32_exti_trigger(Stm32Exti *s, int line)
+/* Recalculate the NVIC IRQ levels from the pending and mask registers.
+ * Each IRQ is only updated if its level changes, however many of its
+ * lines changed. */
+static void stm32_exti_update_irqs(Stm32Exti *s)
 {
-    /* Make sure the interrupt for this EXTI line has been enabled. */
-    if(s->EXTI_IMR & BIT(line)) {
-        /* Set the Pending flag for this line, which will trigger the interrupt
-         * (if the flag isn't already set). */
-        stm32_exti_change_EXTI_PR_bit(s, line, 1);
+    uint32_t active = s->EXTI_PR & s->EXTI_IMR;
+    uint32_t level = 0, changed;
+    int i;
+
+    for(i = 0; i < EXTI_IRQ_COUNT; i++) {
+        if(active & stm32_exti_irq_lines[i]) {
+            level |= BIT(i);
+        }
+    }
+
+    changed = level ^ s->irq_level;
+    s->irq_level = level;
+    for(; changed; changed &= changed - 1) {
+        i = ctz32(changed);
+        qemu_set_irq(s->irq[i], (level & BIT(i)) ? 1 : 0);
     }
 }
 
+/* Trigger the EXTI lines in the mask.  Lines whose interrupt is enabled
+ * become pending. */
+static void stm32_exti_trigger(Stm32Exti *s, uint32_t lines)
+{
+    s->EXTI_PR |= lines & s->EXTI_IMR;
+    stm32_exti_update_irqs(s);
+}
+
+/* Clear the pending flag of the EXTI lines in the mask.  The corresponding
+ * Software Interrupt Event Register bits are automatically reset. */
+static void stm32_exti_clear_pending(Stm32Exti *s, uint32_t lines)
+{
+    s->EXTI_PR &= ~lines;
+    s->EXTI_SWIER &= ~lines;
+    stm32_exti_update_irqs(s);
+}
+
 /* We will assume that this handler will only be called if the pin actually
  * changed state. */
 static void stm32_exti_gpio_in_handler(void *opaque, int n, int level)
@@ -95,10 +134,7 @@ static void stm32_exti_gpio_in_handler(void *opaque, int n, int level)
      * corresponding Rising Trigger Selection Register flag is set.  Otherwise,
      * trigger if the Falling Trigger Selection Register flag is set.
      */
-    if((level  && (s->EXTI_RTSR & BIT(pin))) ||
-       (!level && (s->EXTI_FTSR & BIT(pin)))) {
-        stm32_exti_trigger(s, pin);
-    }
+    stm32_exti_trigger(s, BIT(pin) & (level ? s->EXTI_RTSR : s->EXTI_FTSR));
 }
 
 
@@ -109,70 +145,15 @@ static void stm32_exti_gpio_in_handler(void *opaque, int n, int level)
 /* Update a Trigger Selection Register (both the Rising and Falling TSR
  * registers are handled by this routine).
  */
-static void update_TSR_bit(Stm32Exti *s, uint32_t *tsr_register, unsigned pos,
-                                    unsigned new_bit_value)
+static void stm32_exti_write_TSR(Stm32Exti *s, uint32_t *tsr_register,
+                                 uint32_t new_value)
 {
-    assert((new_bit_value == 0) || (new_bit_value == 1));
-    assert(pos < EXTI_LINE_COUNT);
+    new_value &= EXTI_LINE_MASK;
 
-    if(new_bit_value != extract32(*tsr_register, pos, 1)) {
-        /* According to the documentation, the Pending register is cleared when
-         * the "sensitivity of the edge detector changes.  Is this right??? */
-        stm32_exti_change_EXTI_PR_bit(s, pos, 0);
-    }
-    *tsr_register = deposit32(*tsr_register, pos, 1, new_bit_value);
-}
-
-/* Update the Pending Register.  This will trigger an interrupt if a bit is
- * set.
- */
-static void stm32_exti_change_EXTI_PR_bit(Stm32Exti *s, unsigned pos,
-                                            unsigned new_bit_value)
-{
-    unsigned old_bit_value;
-
-    assert((new_bit_value == 0) || (new_bit_value == 1));
-    assert(pos < EXTI_LINE_COUNT);
-
-    old_bit_value = extract32(s->EXTI_PR, pos, 1);
-
-    /* Only continue if the PR bit is actually changing value. */
-    if(new_bit_value != old_bit_value) {
-        /* If the bit is being reset, the corresponding Software Interrupt Event
-         * Register bit is automatically reset.
-         */
-        if(!new_bit_value) {
-            s->EXTI_SWIER &= ~BIT(pos);
-        }
-
-        /* Update the IRQ for this EXTI line.  Some lines share the same
-         * NVIC IRQ.
-         */
-        if(pos <= 4) {
-            /* EXTI0 - EXTI4 each have their own NVIC IRQ */
-            qemu_set_irq(s->irq[pos], new_bit_value);
-        } else if(pos <= 9) {
-            /* EXTI5 - EXTI9 share an NVIC IRQ */
-            qemu_set_irq(s->irq[5], new_bit_value);
-        } else if(pos <= 15) {
-            /* EXTI10 - EXTI15 share an NVIC IRQ */
-            qemu_set_irq(s->irq[6], new_bit_value);
-        } else if(pos == 16) {
-            /* PVD IRQ */
-            qemu_set_irq(s->irq[7], new_bit_value);
-        } else if(pos == 17) {
-            /* RTCAlarm IRQ */
-            qemu_set_irq(s->irq[8], new_bit_value);
-        } else if(pos == 18) {
-            /* OTG_FS_WKUP IRQ */
-            qemu_set_irq(s->irq[9], new_bit_value);
-        } else {
-            assert(false);
-        }
-
-        /* Update the register. */
-        s->EXTI_PR = deposit32(s->EXTI_PR, pos, 1, new_bit_value);
-    }
+    /* According to the documentation, the Pending register is cleared when
+     * the "sensitivity of the edge detector changes.  Is this right??? */
+    stm32_exti_clear_pending(s, *tsr_register ^ new_value);
+    *tsr_register = new_value;
 }
 
 static uint64_t stm32_exti_read(void *opaque, hwaddr offset,
@@ -206,14 +187,14 @@ static void stm32_exti_write(void *opaque, hwaddr offset,
                        uint64_t value, unsigned size)
 {
     Stm32Exti *s = (Stm32Exti *)opaque;
-    int pos, bit_value;
 
     assert(size == 4);
 
     if(offset <= EXTI_EMR_OFFSET) {
         switch (offset) {
             case EXTI_IMR_OFFSET:
-                s->EXTI_IMR = value;
+                s->EXTI_IMR = value & EXTI_LINE_MASK;
+                stm32_exti_update_irqs(s);
                 break;
             case EXTI_EMR_OFFSET:
                 /* Do nothing, events are not implemented yet.
@@ -224,42 +205,33 @@ static void stm32_exti_write(void *opaque, hwaddr offset,
                 break;
         }
     } else {
-        /* These registers all contain one bit per EXTI line.  We will loop
-         * through each line and then update each bit in the appropriate
-         * register.
-         */
-        for(pos = 0; pos < EXTI_LINE_COUNT; pos++) {
-            bit_value = extract32(value, pos, 1);
-
-            switch (offset) {
-                case EXTI_RTSR_OFFSET:
-                    update_TSR_bit(s, &(s->EXTI_RTSR), pos, bit_value);
-                    break;
-                case EXTI_FTSR_OFFSET:
-                    update_TSR_bit(s, &(s->EXTI_FTSR), pos, bit_value);
-                    break;
-                case EXTI_SWIER_OFFSET:
-                    /* If the Software Interrupt Event Register is changed
-                     * from 0 to 1, trigger an interrupt.  Changing the
-                     * bit to 0 does nothing. */
-                    if(bit_value == 1) {
-                        if((s->EXTI_SWIER & BIT(pos)) == 0) {
-                            s->EXTI_SWIER |= BIT(pos);
-                            stm32_exti_trigger(s, pos);
-                        }
-                    }
-                    break;
-                case EXTI_PR_OFFSET:
-                    /* When a 1 is written to a PR bit, it actually clears the
-                     * PR bit. */
-                    if(bit_value == 1) {
-                        stm32_exti_change_EXTI_PR_bit(s, pos, 0);
-                    }
-                    break;
-                default:
-                    STM32_BAD_REG(offset, size);
-                    break;
-            }
+        /* These registers all contain one bit per EXTI line, so each write
+         * is handled as a whole mask. */
+        value &= EXTI_LINE_MASK;
+
+        switch (offset) {
+            case EXTI_RTSR_OFFSET:
+                stm32_exti_write_TSR(s, &(s->EXTI_RTSR), value);
+                break;
+            case EXTI_FTSR_OFFSET:
+                stm32_exti_write_TSR(s, &(s->EXTI_FTSR), value);
+                break;
+            case EXTI_SWIER_OFFSET:
+                /* If a Software Interrupt Event Register bit is changed
+                 * from 0 to 1, trigger an interrupt.  Changing the
+                 * bit to 0 does nothing. */
+                value &= ~s->EXTI_SWIER;
+                s->EXTI_SWIER |= value;
+                stm32_exti_trigger(s, value);
+                break;
+            case EXTI_PR_OFFSET:
+                /* When a 1 is written to a PR bit, it actually clears the
+                 * PR bit. */
+                stm32_exti_clear_pending(s, value);
+                break;
+            default:
+                STM32_BAD_REG(offset, size);
+                break;
         }
     }
 }
@@ -281,6 +253,7 @@ static void stm32_exti_reset(DeviceState *dev)
     s->EXTI_FTSR = 0x00000000;
     s->EXTI_SWIER = 0x00000000;
     s->EXTI_PR = 0x00000000;
+    stm32_exti_update_irqs(s);
 }
 
 
@@ -293,7 +266,7 @@ static int stm32_exti_init(SysBusDevice *dev)
     Stm32Exti *s = STM32_EXTI(dev);
 
     memory_region_init_io(&s->iomem, OBJECT(s), &stm32_exti_ops, s,
-            "exti", 0x03ff);
+            "exti", STM32_PERIPH_SIZE);
     sysbus_init_mmio(dev, &s->iomem);
 
     for(i = 0; i < EXTI_IRQ_COUNT; i++) {
@@ -306,6 +279,23 @@ static int stm32_exti_init(SysBusDevice *dev)
     return 0;
 }
 
+/* The NVIC restores its own input levels, so irq_level is loaded as is and
+ * the IRQ lines are not raised again. */
+static const VMStateDescription vmstate_stm32_exti = {
+    .name = TYPE_STM32_EXTI,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(EXTI_IMR, Stm32Exti),
+        VMSTATE_UINT32(EXTI_RTSR, Stm32Exti),
+        VMSTATE_UINT32(EXTI_FTSR, Stm32Exti),
+        VMSTATE_UINT32(EXTI_SWIER, Stm32Exti),
+        VMSTATE_UINT32(EXTI_PR, Stm32Exti),
+        VMSTATE_UINT32(irq_level, Stm32Exti),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void stm32_exti_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -313,6 +303,7 @@ static void stm32_exti_class_init(ObjectClass *klass, void *data)
 
     k->init = stm32_exti_init;
     dc->reset = stm32_exti_reset;
+    dc->vmsd = &vmstate_stm32_exti;
 }
 
 static TypeInfo stm32_exti_info = {
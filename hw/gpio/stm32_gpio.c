@@ -5,6 +5,7 @@
  *
  * Source code based on pl061.c
  * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ * and, for the STM32F4 layout, "RM0090 Reference Manual Rev 7"
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License as
@@ -37,6 +38,29 @@
 #define GPIOx_BRR_OFFSET 0x14
 #define GPIOx_LCKR_OFFSET 0x18
 
+/* STM32F4 register layout */
+#define GPIOx_MODER_OFFSET 0x00
+#define GPIOx_OTYPER_OFFSET 0x04
+#define GPIOx_OSPEEDR_OFFSET 0x08
+#define GPIOx_PUPDR_OFFSET 0x0c
+#define GPIOx_F4_IDR_OFFSET 0x10
+#define GPIOx_F4_ODR_OFFSET 0x14
+#define GPIOx_F4_BSRR_OFFSET 0x18
+#define GPIOx_F4_LCKR_OFFSET 0x1c
+#define GPIOx_AFRL_OFFSET 0x20
+#define GPIOx_AFRH_OFFSET 0x24
+
+#define GPIOx_MODER_IN 0
+#define GPIOx_MODER_OUT 1
+#define GPIOx_MODER_AF 2
+#define GPIOx_MODER_ANALOG 3
+
+typedef struct Stm32GpioObserver {
+    Stm32GpioPortHandler *handler;
+    void *opaque;
+    QLIST_ENTRY(Stm32GpioObserver) next;
+} Stm32GpioObserver;
+
 struct Stm32Gpio {
     /* Inherited */
     SysBusDevice busdev;
@@ -44,6 +68,11 @@ struct Stm32Gpio {
     /* Properties */
     stm32_periph_t periph;
     void *stm32_rcc_prop;
+    bool direct_read;
+    void *stim_prop;
+    uint32_t stim_period_ns;
+    /* AioContext in which the timers run, NULL for the main loop */
+    void *aio_context;
 
     /* Private */
     MemoryRegion iomem;
@@ -54,6 +83,15 @@ struct Stm32Gpio {
     uint32_t GPIOx_CRy[2]; /* CRL = 0, CRH = 1 */
     uint32_t GPIOx_ODR;
 
+    /* STM32F4 layout.  The F4 port has no CRL/CRH; the pin configuration
+     * is spread over MODER, OTYPER, OSPEEDR and PUPDR instead. */
+    bool f4;
+    uint32_t GPIOx_MODER;
+    uint32_t GPIOx_OTYPER;
+    uint32_t GPIOx_OSPEEDR;
+    uint32_t GPIOx_PUPDR;
+    uint32_t GPIOx_AFR[2]; /* AFRL = 0, AFRH = 1 */
+
     uint16_t in;
     uint16_t dir_mask; /* input = 0, output = 1 */
 
@@ -66,6 +104,24 @@ struct Stm32Gpio {
 
     /* IRQs which relay input pin changes to other STM32 peripherals */
     qemu_irq in_irq[STM32_GPIO_PIN_COUNT];
+
+    /* PWM state reported by the timers, and the IRQs used to pass
+     * duty cycle changes on to the machine. */
+    uint64_t pwm_period_ns[STM32_GPIO_PIN_COUNT];
+    uint32_t pwm_duty[STM32_GPIO_PIN_COUNT];
+    qemu_irq pwm_irq[STM32_GPIO_PIN_COUNT];
+
+    /* Port-wide output observers */
+    QLIST_HEAD(, Stm32GpioObserver) observers;
+
+    /* Told about pin configuration changes, see
+     * stm32_gpio_add_config_notifier */
+    NotifierList config_notifiers;
+
+    /* Inputs driven from the stimulus file, see stm32_gpio_stim_poll */
+    Stm32StimSlot *stim;
+    Stm32ReplayChannel *stim_replay;
+    struct QEMUTimer *stim_timer;
 };
 
 
@@ -82,22 +138,87 @@ static void stm32_gpio_in_trigger(void *opaque, int irq, int level)
 
     assert(pin < STM32_GPIO_PIN_COUNT);
 
-    /* Update internal pin state. */
-    s->in &= ~(1 << pin);
-    s->in |= (level ? 1 : 0) << pin;
+    stm32_gpio_set_inputs(s, BIT(pin), level ? BIT(pin) : 0);
+}
+
+/* Take the levels of the pins driven through the stimulus file.  This is
+ * done whenever IDR is read, and every stim_period_ns if it is set so that
+ * the EXTI sees the edges of pins which are not read. */
+static void stm32_gpio_stim_poll(Stm32Gpio *s)
+{
+    uint16_t stim[2]; /* mask, value */
+
+    stim[0] = stm32_stim_gpio(s->stim, s->periph - STM32_GPIOA, &stim[1]);
+    stm32_replay_value(s->stim_replay, stim, sizeof(stim));
+    if(stim[0]) {
+        stm32_gpio_set_inputs(s, stim[0], stim[1]);
+    }
+}
 
-    /* Propagate the trigger to the input IRQs. */
-    qemu_set_irq(s->in_irq[pin], level);
+static void stm32_gpio_stim_timer_expire(void *opaque)
+{
+    Stm32Gpio *s = opaque;
+
+    stm32_gpio_stim_poll(s);
+    timer_mod(s->stim_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->stim_period_ns);
 }
 
 
 
 /* HELPER FUNCTIONS */
 
+/* Builds F1 style configuration bits (CNF in bits 3:2, MODE in bits 1:0)
+ * for a pin of an F4 port, so that the other peripherals can look at the
+ * pin configuration without knowing which layout the port uses.
+ */
+static uint8_t stm32_gpio_f4_get_pin_config(Stm32Gpio *s, unsigned pin)
+{
+    uint8_t mode, config;
+
+    /* OSPEEDR: 0 = 2 MHz, 1 = 25 MHz, 2 = 50 MHz, 3 = 100 MHz */
+    switch (extract32(s->GPIOx_OSPEEDR, pin * 2, 2)) {
+        case 0:
+            mode = STM32_GPIO_MODE_OUT_2MHZ;
+            break;
+        case 1:
+            mode = STM32_GPIO_MODE_OUT_10MHZ;
+            break;
+        default:
+            mode = STM32_GPIO_MODE_OUT_50MHZ;
+            break;
+    }
+
+    switch (extract32(s->GPIOx_MODER, pin * 2, 2)) {
+        case GPIOx_MODER_IN:
+            mode = STM32_GPIO_MODE_IN;
+            config = extract32(s->GPIOx_PUPDR, pin * 2, 2) ?
+                     STM32_GPIO_IN_PULLUPDOWN : STM32_GPIO_IN_FLOAT;
+            break;
+        case GPIOx_MODER_OUT:
+            config = extract32(s->GPIOx_OTYPER, pin, 1) ?
+                     STM32_GPIO_OUT_OPENDRAIN : STM32_GPIO_OUT_PUSHPULL;
+            break;
+        case GPIOx_MODER_AF:
+            config = extract32(s->GPIOx_OTYPER, pin, 1) ?
+                     STM32_GPIO_OUT_ALT_OPEN : STM32_GPIO_OUT_ALT_PUSHPULL;
+            break;
+        default:
+            mode = STM32_GPIO_MODE_IN;
+            config = STM32_GPIO_IN_ANALOG;
+            break;
+    }
+    return (config << 2) | mode;
+}
+
 /* Gets the four configuration bits for the pin from the CRL or CRH
  * register.
  */
 static uint8_t stm32_gpio_get_pin_config(Stm32Gpio *s, unsigned pin) {
+    if(s->f4) {
+        return stm32_gpio_f4_get_pin_config(s, pin);
+    }
+
     /* Simplify extract logic by combining both 32 bit regiters into
      * one 64 bit value.
      */
@@ -131,6 +252,51 @@ static void stm32_gpio_update_dir(Stm32Gpio *s, int cr_index)
     }
 }
 
+/* Tell the peripherals which cache the configuration of their pins that
+ * it may have changed.  Mode and config bits only change on configuration
+ * register writes, which firmware makes rarely, so this is not done per
+ * pin. */
+static void stm32_gpio_config_changed(Stm32Gpio *s)
+{
+    notifier_list_notify(&s->config_notifiers, s);
+}
+
+/* Update the direction mask after a MODER write.  Only pins in general
+ * purpose output mode are driven from the ODR.
+ */
+static void stm32_gpio_f4_update_dir(Stm32Gpio *s)
+{
+    unsigned pin;
+
+    s->dir_mask = 0;
+    for(pin = 0; pin < STM32_GPIO_PIN_COUNT; pin++) {
+        if(extract32(s->GPIOx_MODER, pin * 2, 2) == GPIOx_MODER_OUT) {
+            s->dir_mask |= 1 << pin;
+        }
+    }
+}
+
+/* Store the register values in the register page which the guest reads,
+ * see stm32_init_reg_page. */
+static void stm32_gpio_update_reg_page(Stm32Gpio *s)
+{
+    if(s->f4) {
+        stm32_reg_page_set(&s->iomem, GPIOx_MODER_OFFSET, s->GPIOx_MODER);
+        stm32_reg_page_set(&s->iomem, GPIOx_OTYPER_OFFSET, s->GPIOx_OTYPER);
+        stm32_reg_page_set(&s->iomem, GPIOx_OSPEEDR_OFFSET, s->GPIOx_OSPEEDR);
+        stm32_reg_page_set(&s->iomem, GPIOx_PUPDR_OFFSET, s->GPIOx_PUPDR);
+        stm32_reg_page_set(&s->iomem, GPIOx_F4_IDR_OFFSET, s->in);
+        stm32_reg_page_set(&s->iomem, GPIOx_F4_ODR_OFFSET, s->GPIOx_ODR);
+        stm32_reg_page_set(&s->iomem, GPIOx_AFRL_OFFSET, s->GPIOx_AFR[0]);
+        stm32_reg_page_set(&s->iomem, GPIOx_AFRH_OFFSET, s->GPIOx_AFR[1]);
+    } else {
+        stm32_reg_page_set(&s->iomem, GPIOx_CRL_OFFSET, s->GPIOx_CRy[0]);
+        stm32_reg_page_set(&s->iomem, GPIOx_CRH_OFFSET, s->GPIOx_CRy[1]);
+        stm32_reg_page_set(&s->iomem, GPIOx_IDR_OFFSET, s->in);
+        stm32_reg_page_set(&s->iomem, GPIOx_ODR_OFFSET, s->GPIOx_ODR);
+    }
+}
+
 /* Write the Output Data Register.
  * Propagates the changes to the output IRQs.
  * Perhaps we should also update the input to match the output for
@@ -138,8 +304,9 @@ static void stm32_gpio_update_dir(Stm32Gpio *s, int cr_index)
 static void stm32_gpio_GPIOx_ODR_write(Stm32Gpio *s, uint32_t new_value)
 {
     uint32_t old_value;
-    uint16_t changed, changed_out;
+    uint16_t changed, changed_out, remaining;
     unsigned pin;
+    Stm32GpioObserver *observer;
 
     old_value = s->GPIOx_ODR;
 
@@ -154,27 +321,81 @@ static void stm32_gpio_GPIOx_ODR_write(Stm32Gpio *s, uint32_t new_value)
     changed_out = changed & s->dir_mask;
 
     if (changed_out) {
-        for (pin = 0; pin < STM32_GPIO_PIN_COUNT; pin++) {
-            /* If the value of this pin has changed, then update
-             * the output IRQ.
-             */
-            if (changed_out & BIT(pin)) {
-                qemu_set_irq(
-                        /* The "irq_intercept_out" command in the qtest
-                           framework overwrites the out IRQ array in the
-                           NamedGPIOList structure (via the
-                           qemu_irq_intercept_out procedure).  So we need
-                           to reference this structure directly (rather than
-                           use our local s->out_irq array) in order for
-                           the unit tests to work. This is something of a hack,
-                           but I don't have a solution yet. */
-                        s->busdev.parent_obj.gpios.lh_first->out[pin],
-                        (s->GPIOx_ODR & BIT(pin)) ? 1 : 0);
-            }
+        /* Tell the port observers about the whole write at once. */
+        QLIST_FOREACH(observer, &s->observers, next) {
+            observer->handler(observer->opaque, s, changed_out,
+                              s->GPIOx_ODR);
+        }
+
+        /* Then update the output IRQ of each pin which changed. */
+        for (remaining = changed_out; remaining; remaining &= remaining - 1) {
+            pin = ctz32(remaining);
+            qemu_set_irq(
+                    /* The "irq_intercept_out" command in the qtest
+                       framework overwrites the out IRQ array in the
+                       NamedGPIOList structure (via the
+                       qemu_irq_intercept_out procedure).  So we need
+                       to reference this structure directly (rather than
+                       use our local s->out_irq array) in order for
+                       the unit tests to work. This is something of a hack,
+                       but I don't have a solution yet. */
+                    s->busdev.parent_obj.gpios.lh_first->out[pin],
+                    (s->GPIOx_ODR & BIT(pin)) ? 1 : 0);
         }
     }
 }
 
+/* Setting a bit sets or resets the corresponding bit in the output
+ * register.  The lower 16 bits perform resets, and the upper 16 bits
+ * perform sets.  Register is write-only and so does not need to store a
+ * value.  Sets take priority over resets, so we do resets first.
+ */
+static void stm32_gpio_GPIOx_BSRR_write(Stm32Gpio *s, uint32_t new_value)
+{
+    uint32_t set_mask = new_value & 0x0000ffff;
+    uint32_t reset_mask = ~(new_value >> 16) & 0x0000ffff;
+
+    stm32_gpio_GPIOx_ODR_write(s, (s->GPIOx_ODR & reset_mask) | set_mask);
+}
+
+/* Setting a bit resets the corresponding bit in the output register.
+ * Register is write-only and so does not need to store a value. */
+static void stm32_gpio_GPIOx_BRR_write(Stm32Gpio *s, uint32_t new_value)
+{
+    uint32_t reset_mask = ~new_value & 0x0000ffff;
+
+    stm32_gpio_GPIOx_ODR_write(s, s->GPIOx_ODR & reset_mask);
+}
+
+/* Stores to ODR, BSRR and BRR at a constant address are translated into
+ * direct calls of these, see MemoryRegionOps.fast_write. */
+static void stm32_gpio_ODR_fast_write(void *opaque, uint32_t value)
+{
+    Stm32Gpio *s = (Stm32Gpio *)opaque;
+
+    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, s->periph);
+    stm32_gpio_GPIOx_ODR_write(s, value);
+    stm32_gpio_update_reg_page(s);
+}
+
+static void stm32_gpio_BSRR_fast_write(void *opaque, uint32_t value)
+{
+    Stm32Gpio *s = (Stm32Gpio *)opaque;
+
+    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, s->periph);
+    stm32_gpio_GPIOx_BSRR_write(s, value);
+    stm32_gpio_update_reg_page(s);
+}
+
+static void stm32_gpio_BRR_fast_write(void *opaque, uint32_t value)
+{
+    Stm32Gpio *s = (Stm32Gpio *)opaque;
+
+    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, s->periph);
+    stm32_gpio_GPIOx_BRR_write(s, value);
+    stm32_gpio_update_reg_page(s);
+}
+
 static uint64_t stm32_gpio_read(void *opaque, hwaddr offset,
                           unsigned size)
 {
@@ -188,6 +409,9 @@ static uint64_t stm32_gpio_read(void *opaque, hwaddr offset,
         case GPIOx_CRH_OFFSET:
             return s->GPIOx_CRy[1];
         case GPIOx_IDR_OFFSET:
+            if(s->stim) {
+                stm32_gpio_stim_poll(s);
+            }
             return s->in;
         case GPIOx_ODR_OFFSET:
             return s->GPIOx_ODR;
@@ -209,7 +433,6 @@ static uint64_t stm32_gpio_read(void *opaque, hwaddr offset,
 static void stm32_gpio_write(void *opaque, hwaddr offset,
                        uint64_t value, unsigned size)
 {
-    uint32_t set_mask, reset_mask;
     Stm32Gpio *s = (Stm32Gpio *)opaque;
 
     assert(size == 4);
@@ -220,10 +443,12 @@ static void stm32_gpio_write(void *opaque, hwaddr offset,
         case GPIOx_CRL_OFFSET:
             s->GPIOx_CRy[0] = value;
             stm32_gpio_update_dir(s, 0);
+            stm32_gpio_config_changed(s);
             break;
         case GPIOx_CRH_OFFSET:
             s->GPIOx_CRy[1] = value;
             stm32_gpio_update_dir(s, 1);
+            stm32_gpio_config_changed(s);
             break;
         case GPIOx_IDR_OFFSET:
             STM32_RO_REG(offset);
@@ -232,23 +457,10 @@ static void stm32_gpio_write(void *opaque, hwaddr offset,
             stm32_gpio_GPIOx_ODR_write(s, value);
             break;
         case GPIOx_BSRR_OFFSET:
-            /* Setting a bit sets or resets the corresponding bit in the output
-             * register.  The lower 16 bits perform resets, and the upper 16
-             * bits perform sets.  Register is write-only and so does not need
-             * to store a value.  Sets take priority over resets, so we do
-             * resets first.
-             */
-            set_mask = value & 0x0000ffff;
-            reset_mask = ~(value >> 16) & 0x0000ffff;
-            stm32_gpio_GPIOx_ODR_write(s,
-                    (s->GPIOx_ODR & reset_mask) | set_mask);
+            stm32_gpio_GPIOx_BSRR_write(s, value);
             break;
         case GPIOx_BRR_OFFSET:
-            /* Setting a bit resets the corresponding bit in the output
-             * register.  Register is write-only and so does not need to store
-             * a value. */
-            reset_mask = ~value & 0x0000ffff;
-            stm32_gpio_GPIOx_ODR_write(s, s->GPIOx_ODR & reset_mask);
+            stm32_gpio_GPIOx_BRR_write(s, value);
             break;
         case GPIOx_LCKR_OFFSET:
             /* Locking is not implemented */
@@ -258,16 +470,186 @@ static void stm32_gpio_write(void *opaque, hwaddr offset,
             STM32_BAD_REG(offset, size);
             break;
     }
+    stm32_gpio_update_reg_page(s);
+}
+
+static MemoryRegionFastWrite *stm32_gpio_fast_write(void *opaque,
+                                                    hwaddr offset)
+{
+    switch (offset) {
+        case GPIOx_ODR_OFFSET:
+            return stm32_gpio_ODR_fast_write;
+        case GPIOx_BSRR_OFFSET:
+            return stm32_gpio_BSRR_fast_write;
+        case GPIOx_BRR_OFFSET:
+            return stm32_gpio_BRR_fast_write;
+        default:
+            return NULL;
+    }
 }
 
 static const MemoryRegionOps stm32_gpio_ops = {
     .read = stm32_gpio_read,
     .write = stm32_gpio_write,
+    .fast_write = stm32_gpio_fast_write,
+    .idempotent_reads = MEMORY_REGION_IDEMPOTENT(GPIOx_CRL_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(GPIOx_CRH_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(GPIOx_ODR_OFFSET),
     .valid.min_access_size = 4,
     .valid.max_access_size = 4,
     .endianness = DEVICE_NATIVE_ENDIAN
 };
 
+static uint64_t stm32_gpio_f4_read(void *opaque, hwaddr offset,
+                                   unsigned size)
+{
+    Stm32Gpio *s = (Stm32Gpio *)opaque;
+
+    assert(size == 4);
+
+    switch (offset) {
+        case GPIOx_MODER_OFFSET:
+            return s->GPIOx_MODER;
+        case GPIOx_OTYPER_OFFSET:
+            return s->GPIOx_OTYPER;
+        case GPIOx_OSPEEDR_OFFSET:
+            return s->GPIOx_OSPEEDR;
+        case GPIOx_PUPDR_OFFSET:
+            return s->GPIOx_PUPDR;
+        case GPIOx_F4_IDR_OFFSET:
+            if(s->stim) {
+                stm32_gpio_stim_poll(s);
+            }
+            return s->in;
+        case GPIOx_F4_ODR_OFFSET:
+            return s->GPIOx_ODR;
+        case GPIOx_F4_BSRR_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+        case GPIOx_F4_LCKR_OFFSET:
+            /* Locking is not yet implemented */
+            return 0;
+        case GPIOx_AFRL_OFFSET:
+            return s->GPIOx_AFR[0];
+        case GPIOx_AFRH_OFFSET:
+            return s->GPIOx_AFR[1];
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_gpio_f4_write(void *opaque, hwaddr offset,
+                                uint64_t value, unsigned size)
+{
+    Stm32Gpio *s = (Stm32Gpio *)opaque;
+
+    assert(size == 4);
+
+    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, s->periph);
+
+    switch (offset) {
+        case GPIOx_MODER_OFFSET:
+            s->GPIOx_MODER = value;
+            stm32_gpio_f4_update_dir(s);
+            stm32_gpio_config_changed(s);
+            break;
+        case GPIOx_OTYPER_OFFSET:
+            s->GPIOx_OTYPER = value & 0x0000ffff;
+            stm32_gpio_config_changed(s);
+            break;
+        case GPIOx_OSPEEDR_OFFSET:
+            s->GPIOx_OSPEEDR = value;
+            stm32_gpio_config_changed(s);
+            break;
+        case GPIOx_PUPDR_OFFSET:
+            s->GPIOx_PUPDR = value;
+            stm32_gpio_config_changed(s);
+            break;
+        case GPIOx_F4_IDR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        case GPIOx_F4_ODR_OFFSET:
+            stm32_gpio_GPIOx_ODR_write(s, value);
+            break;
+        case GPIOx_F4_BSRR_OFFSET:
+            /* Same as the F1 BSRR.  The F4 has no BRR; its BSRR is
+             * sometimes accessed as two halfwords (BSRRL/BSRRH) in vendor
+             * headers, but those are still word aligned writes here. */
+            stm32_gpio_GPIOx_BSRR_write(s, value);
+            break;
+        case GPIOx_F4_LCKR_OFFSET:
+            /* Locking is not implemented */
+            STM32_NOT_IMPL_REG(offset, size);
+            break;
+        case GPIOx_AFRL_OFFSET:
+            /* The alternate function number is stored but does not route
+             * anything; the peripherals only look at the pin mode. */
+            s->GPIOx_AFR[0] = value;
+            break;
+        case GPIOx_AFRH_OFFSET:
+            s->GPIOx_AFR[1] = value;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+    stm32_gpio_update_reg_page(s);
+}
+
+static MemoryRegionFastWrite *stm32_gpio_f4_fast_write(void *opaque,
+                                                       hwaddr offset)
+{
+    switch (offset) {
+        case GPIOx_F4_ODR_OFFSET:
+            return stm32_gpio_ODR_fast_write;
+        case GPIOx_F4_BSRR_OFFSET:
+            return stm32_gpio_BSRR_fast_write;
+        default:
+            return NULL;
+    }
+}
+
+static const MemoryRegionOps stm32_gpio_f4_ops = {
+    .read = stm32_gpio_f4_read,
+    .write = stm32_gpio_f4_write,
+    .fast_write = stm32_gpio_f4_fast_write,
+    .idempotent_reads = MEMORY_REGION_IDEMPOTENT(GPIOx_MODER_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(GPIOx_OTYPER_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(GPIOx_OSPEEDR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(GPIOx_PUPDR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(GPIOx_F4_ODR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(GPIOx_AFRL_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(GPIOx_AFRH_OFFSET),
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+/* Reset values of the F4 configuration registers.  Ports A and B come
+ * out of reset with the debug pins (JTAG/SWD) configured. */
+static void stm32_gpio_f4_reset(Stm32Gpio *s)
+{
+    s->GPIOx_MODER = 0;
+    s->GPIOx_OTYPER = 0;
+    s->GPIOx_OSPEEDR = 0;
+    s->GPIOx_PUPDR = 0;
+    s->GPIOx_AFR[0] = 0;
+    s->GPIOx_AFR[1] = 0;
+
+    switch (s->periph) {
+        case STM32_GPIOA:
+            s->GPIOx_MODER = 0xa8000000;
+            s->GPIOx_PUPDR = 0x64000000;
+            break;
+        case STM32_GPIOB:
+            s->GPIOx_MODER = 0x00000280;
+            s->GPIOx_OSPEEDR = 0x000000c0;
+            s->GPIOx_PUPDR = 0x00000100;
+            break;
+    }
+}
+
 static void stm32_gpio_reset(DeviceState *dev)
 {
     int pin;
@@ -277,6 +659,12 @@ static void stm32_gpio_reset(DeviceState *dev)
     s->GPIOx_CRy[1] = 0x44444444;
     s->GPIOx_ODR = 0;
     s->dir_mask = 0; /* input = 0, output = 1 */
+    if(s->f4) {
+        stm32_gpio_f4_reset(s);
+    }
+    stm32_gpio_config_changed(s);
+    memory_region_flush_read_cache(&s->iomem);
+    stm32_gpio_update_reg_page(s);
 
     for(pin = 0; pin < STM32_GPIO_PIN_COUNT; pin++) {
         qemu_irq_lower(s->out_irq[pin]);
@@ -301,6 +689,71 @@ uint8_t stm32_gpio_get_mode_bits(Stm32Gpio *s, unsigned pin) {
     return stm32_gpio_get_pin_config(s, pin) & 0x3;
 }
 
+void stm32_gpio_add_port_observer(Stm32Gpio *s, Stm32GpioPortHandler *handler,
+                                  void *opaque)
+{
+    Stm32GpioObserver *observer = g_new0(Stm32GpioObserver, 1);
+
+    observer->handler = handler;
+    observer->opaque = opaque;
+    QLIST_INSERT_HEAD(&s->observers, observer, next);
+}
+
+void stm32_gpio_add_config_notifier(Stm32Gpio *s, Notifier *notifier)
+{
+    notifier_list_add(&s->config_notifiers, notifier);
+}
+
+void stm32_gpio_set_inputs(Stm32Gpio *s, uint16_t mask, uint16_t value)
+{
+    uint16_t changed;
+    unsigned pin;
+
+    changed = (s->in ^ value) & mask;
+
+    /* Update internal pin state. */
+    s->in = (s->in & ~mask) | (value & mask);
+    if(changed) {
+        stm32_reg_page_set(&s->iomem,
+                           s->f4 ? GPIOx_F4_IDR_OFFSET : GPIOx_IDR_OFFSET,
+                           s->in);
+    }
+
+    /* Propagate the changes to the input IRQs. */
+    for (; changed; changed &= changed - 1) {
+        pin = ctz32(changed);
+        qemu_set_irq(s->in_irq[pin], (s->in & BIT(pin)) ? 1 : 0);
+    }
+}
+
+void stm32_gpio_set_pwm(Stm32Gpio *s, unsigned pin, uint64_t period_ns,
+                        uint32_t duty)
+{
+    assert(pin < STM32_GPIO_PIN_COUNT);
+    assert(duty <= STM32_GPIO_PWM_DUTY_MAX);
+
+    if(period_ns == 0) {
+        duty = 0;
+    }
+    if((s->pwm_period_ns[pin] == period_ns) && (s->pwm_duty[pin] == duty)) {
+        return;
+    }
+
+    s->pwm_period_ns[pin] = period_ns;
+    s->pwm_duty[pin] = duty;
+    qemu_set_irq(s->pwm_irq[pin], duty);
+}
+
+uint32_t stm32_gpio_get_pwm(Stm32Gpio *s, unsigned pin, uint64_t *period_ns)
+{
+    assert(pin < STM32_GPIO_PIN_COUNT);
+
+    if(period_ns) {
+        *period_ns = s->pwm_period_ns[pin];
+    }
+    return s->pwm_duty[pin];
+}
+
 
 
 
@@ -314,11 +767,33 @@ static int stm32_gpio_init(SysBusDevice *dev)
     Stm32Gpio *s = STM32_GPIO(dev);
 
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+    QLIST_INIT(&s->observers);
+    notifier_list_init(&s->config_notifiers);
+
+    s->stim = (Stm32StimSlot *)s->stim_prop;
+    if(s->stim) {
+        /* IDR must be read through stm32_gpio_read to see the new levels */
+        s->direct_read = false;
+        s->stim_replay = stm32_replay_channel_new(
+                stm32_periph_name(s->periph), NULL, NULL);
+        if(s->stim_period_ns) {
+            s->stim_timer = stm32_timer_new_ns(s->aio_context,
+                                               stm32_gpio_stim_timer_expire,
+                                               s);
+            timer_mod(s->stim_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        }
+    }
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_gpio_ops, s,
-                          "gpio", 0x03ff);
+    stm32_init_reg_page(&s->iomem, OBJECT(s),
+                        s->f4 ? &stm32_gpio_f4_ops : &stm32_gpio_ops, s,
+                        "gpio", s->direct_read);
     sysbus_init_mmio(dev, &s->iomem);
 
+    /* This must come before the unnamed GPIOs are created, so that they
+     * stay at the head of the GPIO list (see stm32_gpio_GPIOx_ODR_write). */
+    qdev_init_gpio_out_named(DEVICE(dev), s->pwm_irq, "pwm",
+                             STM32_GPIO_PIN_COUNT);
+
     qdev_init_gpio_in(DEVICE(dev), stm32_gpio_in_trigger, STM32_GPIO_PIN_COUNT);
     qdev_init_gpio_out(DEVICE(dev), s->out_irq, STM32_GPIO_PIN_COUNT);
 
@@ -329,9 +804,46 @@ static int stm32_gpio_init(SysBusDevice *dev)
     return 0;
 }
 
+static int stm32_gpio_post_load(void *opaque, int version_id)
+{
+    Stm32Gpio *s = (Stm32Gpio *)opaque;
+
+    /* The output pins are not driven again here; the devices on the other
+     * end restore their own state. */
+    stm32_gpio_config_changed(s);
+    memory_region_flush_read_cache(&s->iomem);
+    stm32_gpio_update_reg_page(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_gpio = {
+    .name = TYPE_STM32_GPIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_gpio_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(GPIOx_CRy, Stm32Gpio, 2),
+        VMSTATE_UINT32(GPIOx_ODR, Stm32Gpio),
+        VMSTATE_UINT32(GPIOx_MODER, Stm32Gpio),
+        VMSTATE_UINT32(GPIOx_OTYPER, Stm32Gpio),
+        VMSTATE_UINT32(GPIOx_OSPEEDR, Stm32Gpio),
+        VMSTATE_UINT32(GPIOx_PUPDR, Stm32Gpio),
+        VMSTATE_UINT32_ARRAY(GPIOx_AFR, Stm32Gpio, 2),
+        VMSTATE_UINT16(in, Stm32Gpio),
+        VMSTATE_UINT16(dir_mask, Stm32Gpio),
+        VMSTATE_UINT64_ARRAY(pwm_period_ns, Stm32Gpio, STM32_GPIO_PIN_COUNT),
+        VMSTATE_UINT32_ARRAY(pwm_duty, Stm32Gpio, STM32_GPIO_PIN_COUNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property stm32_gpio_properties[] = {
     DEFINE_PROP_PERIPH_T("periph", Stm32Gpio, periph, STM32_PERIPH_UNDEFINED),
     DEFINE_PROP_PTR("stm32_rcc", Stm32Gpio, stm32_rcc_prop),
+    DEFINE_PROP_BOOL("direct_read", Stm32Gpio, direct_read, true),
+    DEFINE_PROP_PTR("stim", Stm32Gpio, stim_prop),
+    DEFINE_PROP_UINT32("stim_period_ns", Stm32Gpio, stim_period_ns, 0),
+    DEFINE_PROP_PTR("aio_context", Stm32Gpio, aio_context),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -342,6 +854,7 @@ static void stm32_gpio_class_init(ObjectClass *klass, void *data)
 
     k->init = stm32_gpio_init;
     dc->reset = stm32_gpio_reset;
+    dc->vmsd = &vmstate_stm32_gpio;
     dc->props = stm32_gpio_properties;
 }
 
@@ -352,9 +865,25 @@ static TypeInfo stm32_gpio_info = {
     .class_init = stm32_gpio_class_init
 };
 
+static void stm32_gpio_f4_instance_init(Object *obj)
+{
+    Stm32Gpio *s = STM32_GPIO(obj);
+
+    s->f4 = true;
+}
+
+/* The F4 port shares everything with the F1 port except the register
+ * layout. */
+static TypeInfo stm32_gpio_f4_info = {
+    .name  = TYPE_STM32F4_GPIO,
+    .parent = TYPE_STM32_GPIO,
+    .instance_init = stm32_gpio_f4_instance_init
+};
+
 static void stm32_gpio_register_types(void)
 {
     type_register_static(&stm32_gpio_info);
+    type_register_static(&stm32_gpio_f4_info);
 }
 
 type_init(stm32_gpio_register_types)
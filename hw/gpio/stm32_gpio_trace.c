@@ -0,0 +1,230 @@
+/*
+ * STM32 Microcontroller GPIO output telemetry
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/arm/stm32.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "sysemu/char.h"
+#include <sys/mman.h>
+
+/* Every output change of the traced GPIO ports (one ODR, BSRR or BRR write
+ * changing at least one output pin) is stored as a Stm32GpioTraceRecord in
+ * a ring with a single producer, the CPU, and a single consumer.  The
+ * consumer is either
+ *  - a chardev, to which a bottom half copies the records as a byte
+ *    stream, or
+ *  - another process, which maps the ring file and advances the tail
+ *    itself.
+ * The CPU never waits for the consumer: when the ring is full, records are
+ * dropped and counted in the header.
+ *
+ * The file starts with the Stm32GpioTraceHeader and the records follow.
+ * All fields are little endian.  "head" and "tail" count records since the
+ * start and wrap at 2^32; record n is at index n % size.  A reader loads
+ * head, reads the records up to it, then stores the new tail. */
+
+/* DEFINITIONS */
+
+#define STM32_GPIO_TRACE_MAGIC 0x52545047 /* "GPTR" */
+#define STM32_GPIO_TRACE_RECORDS 65536
+
+typedef struct Stm32GpioTraceHeader {
+    uint32_t magic;
+    uint32_t size;      /* number of records in the ring, a power of 2 */
+    uint32_t head;      /* records written, updated by QEMU */
+    uint32_t tail;      /* records read, updated by the consumer */
+    uint64_t dropped;   /* records lost on a full ring */
+    uint8_t reserved[40];
+} Stm32GpioTraceHeader;
+
+typedef struct Stm32GpioTraceRecord {
+    uint64_t time_ns;   /* QEMU_CLOCK_VIRTUAL */
+    uint16_t port;      /* 0 for GPIOA, 1 for GPIOB... */
+    uint16_t mask;      /* output pins which changed */
+    uint16_t value;     /* new ODR value */
+    uint16_t reserved;
+} Stm32GpioTraceRecord;
+
+typedef struct Stm32GpioTracePort {
+    Stm32GpioTrace *trace;
+    unsigned port;
+} Stm32GpioTracePort;
+
+struct Stm32GpioTrace {
+    Stm32GpioTraceHeader *hdr;
+    Stm32GpioTraceRecord *ring;
+    uint32_t size;
+    Stm32GpioTracePort ports[STM32_GPIO_COUNT];
+
+    /* Chardev consumer */
+    CharDriverState *chr;
+    QEMUBH *drain_bh;
+    guint watch_tag;
+    unsigned out_offset; /* bytes of the record at tail already sent */
+};
+
+
+
+
+/* CHARDEV CONSUMER */
+
+static void stm32_gpio_trace_drain(void *opaque);
+
+static gboolean stm32_gpio_trace_writable(GIOChannel *chan, GIOCondition cond,
+                                          void *opaque)
+{
+    Stm32GpioTrace *t = opaque;
+
+    t->watch_tag = 0;
+    stm32_gpio_trace_drain(t);
+    return FALSE;
+}
+
+/* Sends the records up to head to the chardev, as far as it takes them
+ * without blocking. */
+static void stm32_gpio_trace_drain(void *opaque)
+{
+    Stm32GpioTrace *t = opaque;
+    uint32_t head, tail, index, count;
+    int len, ret;
+
+    if(t->watch_tag) {
+        return;
+    }
+    tail = le32_to_cpu(t->hdr->tail);
+    head = le32_to_cpu(atomic_mb_read(&t->hdr->head));
+    while(tail != head) {
+        index = tail & (t->size - 1);
+        count = MIN(head - tail, t->size - index);
+        len = count * sizeof(Stm32GpioTraceRecord) - t->out_offset;
+        ret = qemu_chr_fe_write(t->chr,
+                                (uint8_t *)&t->ring[index] + t->out_offset,
+                                len);
+        if(ret <= 0) {
+            /* Try again when the chardev can take more, or at the next
+             * record if it cannot tell. */
+            t->watch_tag = qemu_chr_fe_add_watch(t->chr, G_IO_OUT,
+                                                 stm32_gpio_trace_writable, t);
+            break;
+        }
+        t->out_offset += ret;
+        tail += t->out_offset / sizeof(Stm32GpioTraceRecord);
+        t->out_offset %= sizeof(Stm32GpioTraceRecord);
+        atomic_mb_set(&t->hdr->tail, cpu_to_le32(tail));
+        if(ret < len) {
+            t->watch_tag = qemu_chr_fe_add_watch(t->chr, G_IO_OUT,
+                                                 stm32_gpio_trace_writable, t);
+            break;
+        }
+    }
+}
+
+
+
+
+/* PRODUCER */
+
+static void stm32_gpio_trace_port_write(void *opaque, Stm32Gpio *gpio,
+                                        uint16_t changed, uint16_t value)
+{
+    Stm32GpioTracePort *p = opaque;
+    Stm32GpioTrace *t = p->trace;
+    Stm32GpioTraceRecord *r;
+    uint32_t head, tail;
+
+    head = le32_to_cpu(t->hdr->head);
+    tail = le32_to_cpu(atomic_mb_read(&t->hdr->tail));
+    if(head - tail >= t->size) {
+        t->hdr->dropped = cpu_to_le64(le64_to_cpu(t->hdr->dropped) + 1);
+        return;
+    }
+
+    r = &t->ring[head & (t->size - 1)];
+    r->time_ns = cpu_to_le64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    r->port = cpu_to_le16(p->port);
+    r->mask = cpu_to_le16(changed);
+    r->value = cpu_to_le16(value);
+    r->reserved = 0;
+    /* The record must be visible before the new head */
+    smp_wmb();
+    atomic_mb_set(&t->hdr->head, cpu_to_le32(head + 1));
+
+    if(t->drain_bh) {
+        qemu_bh_schedule(t->drain_bh);
+    }
+}
+
+
+
+
+/* INITIALIZATION */
+
+Stm32GpioTrace *stm32_gpio_trace_new(CharDriverState *chr, const char *file)
+{
+    Stm32GpioTrace *t = g_new0(Stm32GpioTrace, 1);
+    size_t size = sizeof(Stm32GpioTraceHeader) +
+                  STM32_GPIO_TRACE_RECORDS * sizeof(Stm32GpioTraceRecord);
+    void *mem;
+    int fd;
+
+    if(chr && file) {
+        hw_error("GPIO trace: a chardev and a file were both given");
+    }
+    if(file) {
+        fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0 || ftruncate(fd, size) < 0) {
+            hw_error("GPIO trace: cannot create %s: %s", file,
+                     strerror(errno));
+        }
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(mem == MAP_FAILED) {
+            hw_error("GPIO trace: cannot map %s: %s", file, strerror(errno));
+        }
+        close(fd);
+    } else {
+        mem = g_malloc0(size);
+    }
+
+    t->hdr = mem;
+    t->ring = (Stm32GpioTraceRecord *)(t->hdr + 1);
+    t->size = STM32_GPIO_TRACE_RECORDS;
+    t->hdr->size = cpu_to_le32(t->size);
+    t->hdr->head = 0;
+    t->hdr->tail = 0;
+    t->hdr->dropped = 0;
+    /* Set last, so that a reader polling the file sees a valid header */
+    smp_wmb();
+    t->hdr->magic = cpu_to_le32(STM32_GPIO_TRACE_MAGIC);
+
+    if(chr) {
+        t->chr = chr;
+        t->drain_bh = qemu_bh_new(stm32_gpio_trace_drain, t);
+    }
+    return t;
+}
+
+void stm32_gpio_trace_add_port(Stm32GpioTrace *t, Stm32Gpio *gpio,
+                               unsigned port)
+{
+    assert(port < STM32_GPIO_COUNT);
+
+    t->ports[port].trace = t;
+    t->ports[port].port = port;
+    stm32_gpio_add_port_observer(gpio, stm32_gpio_trace_port_write,
+                                 &t->ports[port]);
+}
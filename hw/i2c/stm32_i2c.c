@@ -0,0 +1,657 @@
+/*
+ * STM32 Microcontroller I2C module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Only master mode is implemented.  Bus events complete as soon as the
+ * register write which starts them, so every SB/ADDR/TXE/BTF polling loop
+ * in the firmware exits on its first iteration.  Received bytes are fetched
+ * from the slave when the firmware next looks at SR1 or DR, so that the ACK
+ * bit it has set by then decides whether the byte is ACKed (which is what
+ * the reception procedures in the reference manual rely on).  DMA
+ * transfers are done a whole block at a time.
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "hw/i2c/i2c.h"
+#include "qemu/bitops.h"
+#include "qemu/log.h"
+
+
+
+/* DEFINITIONS*/
+
+//#define DEBUG_STM32_I2C
+
+#ifdef DEBUG_STM32_I2C
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_I2C: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define I2C_CR1_OFFSET 0x00
+#define I2C_CR1_PE_BIT 0
+#define I2C_CR1_SMBUS_BIT 1
+#define I2C_CR1_START_BIT 8
+#define I2C_CR1_STOP_BIT 9
+#define I2C_CR1_ACK_BIT 10
+#define I2C_CR1_POS_BIT 11
+#define I2C_CR1_SWRST_BIT 15
+
+#define I2C_CR2_OFFSET 0x04
+#define I2C_CR2_ITERREN_BIT 8
+#define I2C_CR2_ITEVTEN_BIT 9
+#define I2C_CR2_ITBUFEN_BIT 10
+#define I2C_CR2_DMAEN_BIT 11
+#define I2C_CR2_LAST_BIT 12
+
+#define I2C_OAR1_OFFSET 0x08
+#define I2C_OAR2_OFFSET 0x0c
+#define I2C_DR_OFFSET 0x10
+
+#define I2C_SR1_OFFSET 0x14
+#define I2C_SR1_SB_BIT 0
+#define I2C_SR1_ADDR_BIT 1
+#define I2C_SR1_BTF_BIT 2
+#define I2C_SR1_RXNE_BIT 6
+#define I2C_SR1_TXE_BIT 7
+#define I2C_SR1_AF_BIT 10
+/* Error flags, which are cleared by writing 0 */
+#define I2C_SR1_ERROR_MASK 0xdf00
+
+#define I2C_SR2_OFFSET 0x18
+#define I2C_SR2_MSL_BIT 0
+#define I2C_SR2_BUSY_BIT 1
+#define I2C_SR2_TRA_BIT 2
+
+#define I2C_CCR_OFFSET 0x1c
+#define I2C_TRISE_OFFSET 0x20
+
+typedef enum {
+    STM32_I2C_IDLE,
+    /* START generated, waiting for the address */
+    STM32_I2C_START,
+    /* Address sent (ADDR may still be set) */
+    STM32_I2C_TX,
+    STM32_I2C_RX,
+} Stm32I2cState;
+
+struct Stm32I2c {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    void *stm32_rcc_prop;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32Rcc *stm32_rcc;
+
+    I2CBus *bus;
+
+    qemu_irq ev_irq;
+    qemu_irq er_irq;
+    qemu_irq dma_rx_irq;
+    qemu_irq dma_tx_irq;
+
+    /* Register Values */
+    uint32_t
+        I2C_CR1,
+        I2C_CR2,
+        I2C_OAR1,
+        I2C_OAR2,
+        I2C_CCR,
+        I2C_TRISE;
+
+    /* SR1 flags which are not derived from the transfer state below:
+     * SB, ADDR and the error flags. */
+    uint32_t sr1;
+
+    Stm32I2cState state;
+    /* ADDR is cleared by reading SR1 followed by SR2 */
+    bool sr1_read;
+
+    /* Receive data register and shift register.  When both are full, BTF
+     * is set.  rx_done is set once a byte has been NACKed, after which
+     * nothing more is received. */
+    uint8_t rx_dr, rx_shift;
+    bool rxne, rx_shift_full, rx_done;
+    /* Set when the first byte after the address has not been received yet
+     * (with POS set, it is ACKed whatever the ACK bit says) */
+    bool rx_first;
+
+    /* Set once a byte has been written to DR in the current transfer */
+    bool tx_written;
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static bool stm32_i2c_addr_pending(Stm32I2c *s)
+{
+    return s->sr1 & BIT(I2C_SR1_ADDR_BIT);
+}
+
+static uint32_t stm32_i2c_sr1(Stm32I2c *s)
+{
+    uint32_t value = s->sr1;
+    bool tx = (s->state == STM32_I2C_TX) && !stm32_i2c_addr_pending(s);
+
+    if(tx) {
+        /* Bytes go out as soon as they are written, so the data register
+         * is always empty and the last byte has always finished. */
+        value |= BIT(I2C_SR1_TXE_BIT);
+        if(s->tx_written) {
+            value |= BIT(I2C_SR1_BTF_BIT);
+        }
+    }
+    if(s->rxne) {
+        value |= BIT(I2C_SR1_RXNE_BIT);
+        if(s->rx_shift_full) {
+            value |= BIT(I2C_SR1_BTF_BIT);
+        }
+    }
+    return value;
+}
+
+static void stm32_i2c_update(Stm32I2c *s)
+{
+    uint32_t sr1 = stm32_i2c_sr1(s);
+    uint32_t events = BIT(I2C_SR1_SB_BIT) | BIT(I2C_SR1_ADDR_BIT) |
+                      BIT(I2C_SR1_BTF_BIT);
+    uint32_t buffer_events = BIT(I2C_SR1_TXE_BIT) | BIT(I2C_SR1_RXNE_BIT);
+    bool dma = extract32(s->I2C_CR2, I2C_CR2_DMAEN_BIT, 1);
+
+    qemu_set_irq(s->ev_irq,
+        extract32(s->I2C_CR2, I2C_CR2_ITEVTEN_BIT, 1) &&
+        ((sr1 & events) ||
+         (extract32(s->I2C_CR2, I2C_CR2_ITBUFEN_BIT, 1) &&
+          (sr1 & buffer_events))));
+    qemu_set_irq(s->er_irq,
+        extract32(s->I2C_CR2, I2C_CR2_ITERREN_BIT, 1) &&
+        (sr1 & I2C_SR1_ERROR_MASK));
+
+    qemu_set_irq(s->dma_tx_irq, dma && (sr1 & BIT(I2C_SR1_TXE_BIT)) &&
+                 !(sr1 & BIT(I2C_SR1_AF_BIT)));
+    qemu_set_irq(s->dma_rx_irq, dma && (sr1 & BIT(I2C_SR1_RXNE_BIT)));
+}
+
+static uint8_t stm32_i2c_recv_byte(Stm32I2c *s, bool ack)
+{
+    int value = i2c_recv(s->bus);
+
+    s->rx_first = false;
+    if(!ack) {
+        i2c_nack(s->bus);
+        s->rx_done = true;
+    }
+    /* Nothing answering reads back as the bus idling high */
+    return (value < 0) ? 0xff : value;
+}
+
+/* Receive whatever the slave would have sent by now: a byte for DR, and
+ * one more for the shift register after it.  In DMA mode, bytes are only
+ * received one at a time, since the DMA block handler reads the rest
+ * directly. */
+static void stm32_i2c_rx_fill(Stm32I2c *s)
+{
+    bool ack;
+
+    while((s->state == STM32_I2C_RX) && !stm32_i2c_addr_pending(s) &&
+          !s->rx_done) {
+        ack = extract32(s->I2C_CR1, I2C_CR1_ACK_BIT, 1) ||
+              (s->rx_first && extract32(s->I2C_CR1, I2C_CR1_POS_BIT, 1));
+        if(!s->rxne) {
+            s->rx_dr = stm32_i2c_recv_byte(s, ack);
+            s->rxne = true;
+        } else if(!s->rx_shift_full &&
+                  !extract32(s->I2C_CR2, I2C_CR2_DMAEN_BIT, 1)) {
+            s->rx_shift = stm32_i2c_recv_byte(s, ack);
+            s->rx_shift_full = true;
+        } else {
+            break;
+        }
+    }
+}
+
+static void stm32_i2c_start(Stm32I2c *s)
+{
+    DPRINTF("%s start\n", stm32_periph_name(s->periph));
+    s->state = STM32_I2C_START;
+    s->sr1 |= BIT(I2C_SR1_SB_BIT);
+    s->sr1 &= ~BIT(I2C_SR1_ADDR_BIT);
+    s->rx_shift_full = false;
+    s->rx_done = false;
+    s->tx_written = false;
+}
+
+static void stm32_i2c_stop(Stm32I2c *s)
+{
+    DPRINTF("%s stop\n", stm32_periph_name(s->periph));
+    if(s->state == STM32_I2C_RX && !s->rx_done) {
+        i2c_nack(s->bus);
+    }
+    i2c_end_transfer(s->bus);
+    s->state = STM32_I2C_IDLE;
+    s->sr1 &= ~(BIT(I2C_SR1_SB_BIT) | BIT(I2C_SR1_ADDR_BIT));
+    s->rx_done = true;
+}
+
+static void stm32_i2c_send_address(Stm32I2c *s, uint8_t value)
+{
+    bool recv = value & 1;
+
+    s->sr1 &= ~BIT(I2C_SR1_SB_BIT);
+
+    if((value & 0xf8) == 0xf0) {
+        qemu_log_mask(LOG_UNIMP, "%s: 10 bit addressing is not implemented\n",
+                      stm32_periph_name(s->periph));
+    }
+
+    if(i2c_start_transfer(s->bus, value >> 1, recv)) {
+        /* Nobody there - the address is not acknowledged */
+        DPRINTF("%s no slave at 0x%02x\n", stm32_periph_name(s->periph),
+                value >> 1);
+        s->sr1 |= BIT(I2C_SR1_AF_BIT);
+        s->state = STM32_I2C_IDLE;
+        /* A repeated start ends the previous transfer regardless */
+        i2c_end_transfer(s->bus);
+        return;
+    }
+
+    s->sr1 |= BIT(I2C_SR1_ADDR_BIT);
+    s->sr1_read = false;
+    s->state = recv ? STM32_I2C_RX : STM32_I2C_TX;
+    s->rxne = false;
+    s->rx_first = true;
+}
+
+static void stm32_i2c_send_byte(Stm32I2c *s, uint8_t value)
+{
+    s->tx_written = true;
+    if(i2c_send(s->bus, value)) {
+        s->sr1 |= BIT(I2C_SR1_AF_BIT);
+    }
+}
+
+/* DMA block handler for DR.  Whole blocks are sent to or received from the
+ * slave in one go. */
+static int stm32_i2c_dma_block(void *opaque, uint8_t *buf, int len,
+                               unsigned size, bool to_periph)
+{
+    Stm32I2c *s = (Stm32I2c *)opaque;
+    bool last;
+    int i;
+
+    if((size != 1) || !extract32(s->I2C_CR2, I2C_CR2_DMAEN_BIT, 1) ||
+            stm32_i2c_addr_pending(s)) {
+        return 0;
+    }
+
+    if(to_periph) {
+        if(s->state != STM32_I2C_TX) {
+            return 0;
+        }
+        for(i = 0; (i < len) && !(s->sr1 & BIT(I2C_SR1_AF_BIT)); i++) {
+            stm32_i2c_send_byte(s, buf[i]);
+        }
+    } else {
+        if(!s->rxne) {
+            return 0;
+        }
+        /* With LAST set, the final byte of the block is NACKed. */
+        last = extract32(s->I2C_CR2, I2C_CR2_LAST_BIT, 1);
+        buf[0] = s->rx_dr;
+        s->rxne = false;
+        for(i = 1; (i < len) && !s->rx_done; i++) {
+            buf[i] = stm32_i2c_recv_byte(s, !(last && (i == len - 1)));
+        }
+        if(last && (i == len) && !s->rx_done) {
+            i2c_nack(s->bus);
+            s->rx_done = true;
+        }
+    }
+
+    stm32_i2c_update(s);
+    return i;
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_i2c_reset(DeviceState *dev);
+
+static void stm32_i2c_I2C_CR1_write(Stm32I2c *s, uint32_t new_value)
+{
+    if(new_value & BIT(I2C_CR1_SWRST_BIT)) {
+        stm32_i2c_reset(DEVICE(s));
+        s->I2C_CR1 = BIT(I2C_CR1_SWRST_BIT);
+        return;
+    }
+
+    s->I2C_CR1 = new_value & 0xbfff;
+
+    if(!extract32(new_value, I2C_CR1_PE_BIT, 1)) {
+        stm32_i2c_stop(s);
+        s->I2C_CR1 &= ~(BIT(I2C_CR1_START_BIT) | BIT(I2C_CR1_STOP_BIT) |
+                        BIT(I2C_CR1_ACK_BIT));
+        s->sr1 = 0;
+        s->rxne = false;
+        stm32_i2c_update(s);
+        return;
+    }
+    if(extract32(new_value, I2C_CR1_SMBUS_BIT, 1)) {
+        qemu_log_mask(LOG_UNIMP, "%s: SMBus mode is not implemented\n",
+                      stm32_periph_name(s->periph));
+    }
+
+    /* STOP is checked first, so that STOP and START together (which is
+     * allowed) give a stop followed by a new start. */
+    if(extract32(new_value, I2C_CR1_STOP_BIT, 1)) {
+        /* While receiving, the stop comes after the byte being received
+         * (the one which has been NACKed). */
+        stm32_i2c_rx_fill(s);
+        stm32_i2c_stop(s);
+        s->I2C_CR1 &= ~BIT(I2C_CR1_STOP_BIT);
+    }
+    if(extract32(new_value, I2C_CR1_START_BIT, 1)) {
+        stm32_i2c_start(s);
+        s->I2C_CR1 &= ~BIT(I2C_CR1_START_BIT);
+    }
+
+    stm32_i2c_update(s);
+}
+
+static void stm32_i2c_I2C_CR2_write(Stm32I2c *s, uint32_t new_value)
+{
+    s->I2C_CR2 = new_value & 0x1f3f;
+    stm32_i2c_update(s);
+}
+
+static uint32_t stm32_i2c_I2C_SR1_read(Stm32I2c *s)
+{
+    stm32_i2c_rx_fill(s);
+    s->sr1_read = true;
+    stm32_i2c_update(s);
+    return stm32_i2c_sr1(s);
+}
+
+static void stm32_i2c_I2C_SR1_write(Stm32I2c *s, uint32_t new_value)
+{
+    /* Error flags are cleared by writing 0, the others are read only */
+    s->sr1 &= new_value | ~I2C_SR1_ERROR_MASK;
+    stm32_i2c_update(s);
+}
+
+static uint32_t stm32_i2c_I2C_SR2_read(Stm32I2c *s)
+{
+    uint32_t value = 0;
+
+    if(s->state != STM32_I2C_IDLE) {
+        value |= BIT(I2C_SR2_MSL_BIT) | BIT(I2C_SR2_BUSY_BIT);
+    }
+    if(s->state == STM32_I2C_TX) {
+        value |= BIT(I2C_SR2_TRA_BIT);
+    }
+
+    if(stm32_i2c_addr_pending(s) && s->sr1_read) {
+        s->sr1 &= ~BIT(I2C_SR1_ADDR_BIT);
+        stm32_i2c_rx_fill(s);
+        stm32_i2c_update(s);
+    }
+    s->sr1_read = false;
+    return value;
+}
+
+static uint32_t stm32_i2c_I2C_DR_read(Stm32I2c *s)
+{
+    uint8_t value = s->rx_dr;
+
+    if(s->rxne) {
+        if(s->rx_shift_full) {
+            s->rx_dr = s->rx_shift;
+            s->rx_shift_full = false;
+        } else {
+            s->rxne = false;
+        }
+        stm32_i2c_rx_fill(s);
+        stm32_i2c_update(s);
+    }
+    return value;
+}
+
+static void stm32_i2c_I2C_DR_write(Stm32I2c *s, uint32_t new_value)
+{
+    switch(s->state) {
+        case STM32_I2C_START:
+            stm32_i2c_send_address(s, new_value);
+            break;
+        case STM32_I2C_TX:
+            if(!stm32_i2c_addr_pending(s)) {
+                stm32_i2c_send_byte(s, new_value);
+            }
+            break;
+        default:
+            /* Nothing to send it to */
+            break;
+    }
+    stm32_i2c_update(s);
+}
+
+static uint64_t stm32_i2c_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32I2c *s = (Stm32I2c *)opaque;
+
+    switch (offset) {
+        case I2C_CR1_OFFSET:
+            return s->I2C_CR1;
+        case I2C_CR2_OFFSET:
+            return s->I2C_CR2;
+        case I2C_OAR1_OFFSET:
+            return s->I2C_OAR1;
+        case I2C_OAR2_OFFSET:
+            return s->I2C_OAR2;
+        case I2C_DR_OFFSET:
+            return stm32_i2c_I2C_DR_read(s);
+        case I2C_SR1_OFFSET:
+            return stm32_i2c_I2C_SR1_read(s);
+        case I2C_SR2_OFFSET:
+            return stm32_i2c_I2C_SR2_read(s);
+        case I2C_CCR_OFFSET:
+            return s->I2C_CCR;
+        case I2C_TRISE_OFFSET:
+            return s->I2C_TRISE;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_i2c_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32I2c *s = (Stm32I2c *)opaque;
+
+    stm32_rcc_check_periph_clk(s->stm32_rcc, s->periph);
+
+    switch (offset) {
+        case I2C_CR1_OFFSET:
+            stm32_i2c_I2C_CR1_write(s, value);
+            break;
+        case I2C_CR2_OFFSET:
+            stm32_i2c_I2C_CR2_write(s, value);
+            break;
+        case I2C_OAR1_OFFSET:
+            s->I2C_OAR1 = value & 0xc3ff;
+            break;
+        case I2C_OAR2_OFFSET:
+            s->I2C_OAR2 = value & 0x00ff;
+            break;
+        case I2C_DR_OFFSET:
+            stm32_i2c_I2C_DR_write(s, value);
+            break;
+        case I2C_SR1_OFFSET:
+            stm32_i2c_I2C_SR1_write(s, value);
+            break;
+        case I2C_SR2_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        case I2C_CCR_OFFSET:
+            s->I2C_CCR = value & 0xcfff;
+            break;
+        case I2C_TRISE_OFFSET:
+            s->I2C_TRISE = value & 0x003f;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_i2c_ops = {
+    .read = stm32_i2c_read,
+    .write = stm32_i2c_write,
+    .valid.min_access_size = 2,
+    .valid.max_access_size = 4,
+    .impl.min_access_size = 4,
+    .impl.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_i2c_reset(DeviceState *dev)
+{
+    Stm32I2c *s = STM32_I2C(dev);
+
+    stm32_i2c_stop(s);
+
+    s->I2C_CR1 = 0;
+    s->I2C_CR2 = 0;
+    s->I2C_OAR1 = 0;
+    s->I2C_OAR2 = 0;
+    s->I2C_CCR = 0;
+    s->I2C_TRISE = 0x0002;
+    s->sr1 = 0;
+    s->sr1_read = false;
+    s->rxne = false;
+    s->rx_shift_full = false;
+    s->tx_written = false;
+
+    stm32_i2c_update(s);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+void stm32_i2c_connect_dma(Stm32I2c *s, DeviceState *dma, hwaddr base)
+{
+    stm32_dma_set_block_handler(dma, base + I2C_DR_OFFSET,
+                                stm32_i2c_dma_block, s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_i2c_init(SysBusDevice *dev)
+{
+    Stm32I2c *s = STM32_I2C(dev);
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_i2c_ops, s,
+                          "i2c", STM32_PERIPH_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->ev_irq);
+    sysbus_init_irq(dev, &s->dma_rx_irq);
+    sysbus_init_irq(dev, &s->dma_tx_irq);
+    sysbus_init_irq(dev, &s->er_irq);
+
+    s->bus = i2c_init_bus(DEVICE(dev), "i2c");
+
+    return 0;
+}
+
+/* The transfer state of the devices on the bus is saved by the I2C core
+ * (vmstate_i2c_bus) and the slaves themselves. */
+static const VMStateDescription vmstate_stm32_i2c = {
+    .name = TYPE_STM32_I2C,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(I2C_CR1, Stm32I2c),
+        VMSTATE_UINT32(I2C_CR2, Stm32I2c),
+        VMSTATE_UINT32(I2C_OAR1, Stm32I2c),
+        VMSTATE_UINT32(I2C_OAR2, Stm32I2c),
+        VMSTATE_UINT32(I2C_CCR, Stm32I2c),
+        VMSTATE_UINT32(I2C_TRISE, Stm32I2c),
+        VMSTATE_UINT32(sr1, Stm32I2c),
+        VMSTATE_UINT32(state, Stm32I2c),
+        VMSTATE_BOOL(sr1_read, Stm32I2c),
+        VMSTATE_UINT8(rx_dr, Stm32I2c),
+        VMSTATE_UINT8(rx_shift, Stm32I2c),
+        VMSTATE_BOOL(rxne, Stm32I2c),
+        VMSTATE_BOOL(rx_shift_full, Stm32I2c),
+        VMSTATE_BOOL(rx_done, Stm32I2c),
+        VMSTATE_BOOL(rx_first, Stm32I2c),
+        VMSTATE_BOOL(tx_written, Stm32I2c),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_i2c_properties[] = {
+    DEFINE_PROP_PERIPH_T("periph", Stm32I2c, periph, STM32_PERIPH_UNDEFINED),
+    DEFINE_PROP_PTR("stm32_rcc", Stm32I2c, stm32_rcc_prop),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_i2c_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_i2c_init;
+    dc->reset = stm32_i2c_reset;
+    dc->vmsd = &vmstate_stm32_i2c;
+    dc->props = stm32_i2c_properties;
+}
+
+static TypeInfo stm32_i2c_info = {
+    .name  = TYPE_STM32_I2C,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32I2c),
+    .class_init = stm32_i2c_class_init
+};
+
+static void stm32_i2c_register_types(void)
+{
+    type_register_static(&stm32_i2c_info);
+}
+
+type_init(stm32_i2c_register_types)
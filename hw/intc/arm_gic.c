@@ -45,6 +45,96 @@ static inline int gic_get_current_cpu(GICState *s)
     return 0;
 }
 
+/* File or unfile an NVIC interrupt as a candidate for gic_update().  An
+ * interrupt is a candidate while it is both enabled and pending.  */
+void gic_nvic_irq_changed(GICState *s, int irq)
+{
+    bool pending = gic_test_pending(s, irq, 1);
+    bool candidate = GIC_TEST_ENABLED(irq, 1) && pending;
+    uint8_t prio = GIC_GET_PRIORITY(irq, 0);
+    uint8_t old_prio;
+
+    if (s->nvic_pend_notify) {
+        s->nvic_pend_notify(s, irq, pending);
+    }
+
+    if (test_bit(irq, s->nvic_candidates)) {
+        old_prio = s->nvic_candidate_prio[irq];
+        if (candidate && old_prio == prio) {
+            return;
+        }
+        clear_bit(irq, s->nvic_candidates);
+        if (--s->nvic_prio_count[old_prio] == 0) {
+            clear_bit(old_prio, s->nvic_prio_used);
+        }
+    }
+
+    if (candidate) {
+        set_bit(irq, s->nvic_candidates);
+        s->nvic_candidate_prio[irq] = prio;
+        if (s->nvic_prio_count[prio]++ == 0) {
+            set_bit(prio, s->nvic_prio_used);
+        }
+    }
+}
+
+/* Recalculate the NVIC candidates from scratch, e.g. after migration.  */
+void gic_nvic_rebuild(GICState *s)
+{
+    int irq;
+
+    bitmap_zero(s->nvic_candidates, GIC_MAXIRQ);
+    bitmap_zero(s->nvic_prio_used, GIC_NVIC_NR_PRIO);
+    memset(s->nvic_prio_count, 0, sizeof(s->nvic_prio_count));
+    for (irq = 0; irq < s->num_irq; irq++) {
+        gic_nvic_irq_changed(s, irq);
+    }
+}
+
+/* The NVIC version of gic_update().  The best priority with a candidate
+ * comes straight from the priority bitmap, and only the candidates need
+ * to be looked at to find the lowest numbered interrupt at that priority.
+ */
+static void gic_update_nvic(GICState *s)
+{
+    int best_irq = 1023;
+    int best_prio;
+    int irq;
+    int level = 0;
+
+    s->current_pending[0] = 1023;
+    if (!s->enabled || !s->cpu_enabled[0]) {
+        qemu_irq_lower(s->parent_irq[0]);
+        return;
+    }
+
+    best_prio = find_first_bit(s->nvic_prio_used, GIC_NVIC_NR_PRIO);
+    if (best_prio == GIC_NVIC_NR_PRIO) {
+        best_prio = 0x100;
+    } else {
+        for (irq = find_first_bit(s->nvic_candidates, GIC_MAXIRQ);
+             irq < GIC_MAXIRQ;
+             irq = find_next_bit(s->nvic_candidates, GIC_MAXIRQ, irq + 1)) {
+            if (s->nvic_candidate_prio[irq] == best_prio) {
+                best_irq = irq;
+                break;
+            }
+        }
+    }
+
+    if (best_prio < s->priority_mask[0]) {
+        s->current_pending[0] = best_irq;
+        if (best_prio < s->running_priority[0]) {
+            DPRINTF("Raised pending IRQ %d (cpu %d)\n", best_irq, 0);
+            level = 1;
+        }
+    }
+    qemu_set_irq(s->parent_irq[0], level);
+    if (level && s->nvic_wake_notify) {
+        s->nvic_wake_notify(s);
+    }
+}
+
 /* TODO: Many places that call this routine could be optimized.  */
 /* Update interrupt status after enabled or pending bits have been changed.  */
 void gic_update(GICState *s)
@@ -56,6 +146,11 @@ void gic_update(GICState *s)
     int cpu;
     int cm;
 
+    if (s->revision == REV_NVIC) {
+        gic_update_nvic(s);
+        return;
+    }
+
     for (cpu = 0; cpu < NUM_CPU(s); cpu++) {
         cm = 1 << cpu;
         s->current_pending[cpu] = 1023;
@@ -230,6 +325,7 @@ void gic_set_priority(GICState *s, int cpu, int irq, uint8_t val)
     } else {
         s->priority2[(irq) - GIC_INTERNAL] = val;
     }
+    gic_irq_changed(s, irq);
 }
 
 void gic_complete_irq(GICState *s, int cpu, int irq)
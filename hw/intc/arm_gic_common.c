@@ -35,6 +35,9 @@ static int gic_post_load(void *opaque, int version_id)
     GICState *s = (GICState *)opaque;
     ARMGICCommonClass *c = ARM_GIC_COMMON_GET_CLASS(s);
 
+    if (s->revision == REV_NVIC) {
+        gic_nvic_rebuild(s);
+    }
     if (c->post_load) {
         c->post_load(s);
     }
@@ -117,6 +120,10 @@ static void arm_gic_common_reset(DeviceState *dev)
     GICState *s = ARM_GIC_COMMON(dev);
     int i;
     memset(s->irq_state, 0, GIC_MAXIRQ * sizeof(gic_irq_state));
+    /* Nothing is pending any more, so there are no NVIC candidates.  */
+    bitmap_zero(s->nvic_candidates, GIC_MAXIRQ);
+    bitmap_zero(s->nvic_prio_used, GIC_NVIC_NR_PRIO);
+    memset(s->nvic_prio_count, 0, sizeof(s->nvic_prio_count));
     for (i = 0 ; i < s->num_cpu; i++) {
         if (s->revision == REV_11MPCORE) {
             s->priority_mask[i] = 0xf0;
@@ -14,22 +14,95 @@
 #include "qemu/timer.h"
 #include "hw/arm/arm.h"
 #include "exec/address-spaces.h"
+#include "qemu/bitmap.h"
+#include "qemu/host-utils.h"
+#include "qemu/main-loop.h"
+#include "sysemu/char.h"
+#include "qmp-commands.h"
+#include "trace.h"
 #include "gic_internal.h"
 
-typedef struct {
+/* Bytes of ITM packets collected before they are written to the chardev */
+#define ITM_BUF_SIZE 256
+
+/* Latencies are counted in buckets of powers of 2 nanoseconds: bucket n
+ * holds those from 2^n to 2^(n+1) - 1 ns, the last one everything above. */
+#define NVIC_LATENCY_BUCKETS 32
+
+typedef struct NVICLatencyHist {
+    uint64_t count;
+    int64_t total;
+    int64_t min;
+    int64_t max;
+    uint64_t buckets[NVIC_LATENCY_BUCKETS];
+} NVICLatencyHist;
+
+typedef struct NVICLatency {
+    int64_t pend_time;  /* when the interrupt became pending, or -1 */
+    int64_t entry_time; /* when its handler was entered, or -1 */
+    NVICLatencyHist pend; /* pending to entry */
+    NVICLatencyHist run;  /* entry to exit, including any preemption */
+} NVICLatency;
+
+typedef struct nvic_state {
     GICState gic;
     struct {
         uint32_t control;
         uint32_t reload;
         int64_t tick;
         QEMUTimer *timer;
+        /* Clock scales for this NVIC, used instead of system_clock_scale
+         * and external_ref_clock_scale once they have been set. */
+        int clock_scale;
+        int ext_ref_clock_scale;
     } systick;
+    uint32_t demcr;
+    uint32_t scr;
+    /* Set from a WFI with SLEEPDEEP until the CPU is woken up, while
+     * sleepdeep_irq is raised.  The core clock is stopped, so SysTick does
+     * not count: it is pushed back by the time spent asleep on wakeup. */
+    bool deep_sleep;
+    int64_t deep_sleep_time;
+    qemu_irq sleepdeep_irq;
+    /* The cycle counter is not stepped: it had the value cyccnt at
+     * cyccnt_time, and has counted at cpu_freq since if it is running. */
+    struct {
+        uint32_t ctrl;
+        uint32_t cyccnt;
+        int64_t cyccnt_time;
+        /* HCLK frequency, or 0 to derive it from the SysTick clock scale */
+        uint32_t cpu_freq;
+    } dwt;
+    /* The stimulus port writes are collected in buf, and written to the
+     * chardev in one go from a bottom half. */
+    struct {
+        CharDriverState *chr;
+        bool raw;
+        uint32_t ter;
+        uint32_t tpr;
+        uint32_t tcr;
+        uint8_t buf[ITM_BUF_SIZE];
+        int len;
+        QEMUBH *bh;
+    } itm;
     MemoryRegion sysregmem;
+    MemoryRegion itm_iomem;
+    MemoryRegion dwt_iomem;
     MemoryRegion gic_iomem_alias;
     MemoryRegion container;
     uint32_t num_irq;
+    /* Interrupt latency statistics in virtual time, indexed by GIC
+     * interrupt number, or NULL when they are not being collected.
+     * pend_seen tracks the pending state for the nvic_irq_pend trace
+     * event and the pending time. */
+    bool latency_prop;
+    NVICLatency *latency;
+    DECLARE_BITMAP(pend_seen, GIC_MAXIRQ);
+    QLIST_ENTRY(nvic_state) next;
 } nvic_state;
 
+static QLIST_HEAD(, nvic_state) nvic_list = QLIST_HEAD_INITIALIZER(nvic_list);
+
 #define TYPE_NVIC "armv7m_nvic"
 /**
  * NVICClass:
@@ -64,6 +137,25 @@ static const uint8_t nvic_id[] = {
 #define SYSTICK_CLKSOURCE (1 << 2)
 #define SYSTICK_COUNTFLAG (1 << 16)
 
+#define SCR_SLEEPONEXIT (1 << 1)
+#define SCR_SLEEPDEEP   (1 << 2)
+#define SCR_SEVONPEND   (1 << 4)
+#define SCR_MASK        (SCR_SLEEPONEXIT | SCR_SLEEPDEEP | SCR_SEVONPEND)
+
+#define DEMCR_TRCENA (1 << 24)
+#define DEMCR_MASK   0x010f07f1
+
+#define DWT_CTRL_CYCCNTENA (1 << 0)
+/* The counters other than CYCCNT, and the comparators, are not there */
+#define DWT_CTRL_NOTRCPKT  (1 << 27)
+#define DWT_CTRL_NOEXTTRIG (1 << 26)
+#define DWT_CTRL_NOPRFCNT  (1 << 24)
+#define DWT_CTRL_RO (DWT_CTRL_NOTRCPKT | DWT_CTRL_NOEXTTRIG | DWT_CTRL_NOPRFCNT)
+
+#define ITM_TCR_ITMENA (1 << 0)
+#define ITM_TCR_MASK   0x007f0f1f
+#define ITM_PORTS 32
+
 int system_clock_scale;
 int external_ref_clock_scale = 1000;
 
@@ -71,9 +163,78 @@ int external_ref_clock_scale = 1000;
 static inline int64_t systick_scale(nvic_state *s)
 {
     if (s->systick.control & SYSTICK_CLKSOURCE)
-        return system_clock_scale;
+        return s->systick.clock_scale ? s->systick.clock_scale
+                                      : system_clock_scale;
     else
-        return external_ref_clock_scale;
+        return s->systick.ext_ref_clock_scale ? s->systick.ext_ref_clock_scale
+                                              : external_ref_clock_scale;
+}
+
+/* Set the SysTick clock scales of a single NVIC, for boards with more than
+ * one v7-M core running at different speeds.  */
+void armv7m_nvic_set_clock_scale(DeviceState *dev, int system_scale,
+                                 int ext_ref_scale)
+{
+    nvic_state *s = NVIC(dev);
+
+    s->systick.clock_scale = system_scale;
+    s->systick.ext_ref_clock_scale = ext_ref_scale;
+}
+
+static inline int64_t systick_period(nvic_state *s)
+{
+    return (s->systick.reload + 1) * systick_scale(s);
+}
+
+static inline bool systick_pending(nvic_state *s)
+{
+    return gic_test_pending(&s->gic, ARMV7M_EXCP_SYSTICK, 1);
+}
+
+/* The counter is not stepped by the QEMU timer: systick.tick holds the
+ * deadline of the next wrap to zero and the current value is derived from
+ * it.  The timer is only armed when a wrap has to raise the SysTick
+ * exception, which is when TICKINT is set and the exception is not already
+ * pending.  Wraps at other times just set COUNTFLAG, so they are folded in
+ * here whenever the state is looked at, however many have gone by.
+ */
+static void systick_sync(nvic_state *s)
+{
+    int64_t now;
+    int64_t period;
+
+    if ((s->systick.control & SYSTICK_ENABLE) == 0) {
+        return;
+    }
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (now < s->systick.tick) {
+        return;
+    }
+
+    s->systick.control |= SYSTICK_COUNTFLAG;
+    if (s->systick.control & SYSTICK_TICKINT) {
+        /* Trigger the interrupt.  Further wraps while it is pending are
+         * not seen by the guest, so one is enough for all of them.  */
+        armv7m_nvic_set_pending(s, ARMV7M_EXCP_SYSTICK);
+    }
+    if (s->systick.reload == 0) {
+        s->systick.control &= ~SYSTICK_ENABLE;
+        return;
+    }
+    period = systick_period(s);
+    s->systick.tick += ((now - s->systick.tick) / period + 1) * period;
+}
+
+static void systick_schedule(nvic_state *s)
+{
+    if (!s->deep_sleep
+        && (s->systick.control & SYSTICK_ENABLE)
+        && (s->systick.control & SYSTICK_TICKINT)
+        && !systick_pending(s)) {
+        timer_mod(s->systick.timer, s->systick.tick);
+    } else {
+        timer_del(s->systick.timer);
+    }
 }
 
 static void systick_reload(nvic_state *s, int reset)
@@ -89,23 +250,16 @@ static void systick_reload(nvic_state *s, int reset)
 
     if (reset)
         s->systick.tick = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-    s->systick.tick += (s->systick.reload + 1) * systick_scale(s);
-    timer_mod(s->systick.timer, s->systick.tick);
+    s->systick.tick += systick_period(s);
+    systick_schedule(s);
 }
 
 static void systick_timer_tick(void * opaque)
 {
     nvic_state *s = (nvic_state *)opaque;
-    s->systick.control |= SYSTICK_COUNTFLAG;
-    if (s->systick.control & SYSTICK_TICKINT) {
-        /* Trigger the interrupt.  */
-        armv7m_nvic_set_pending(s, ARMV7M_EXCP_SYSTICK);
-    }
-    if (s->systick.reload == 0) {
-        s->systick.control &= ~SYSTICK_ENABLE;
-    } else {
-        systick_reload(s, 0);
-    }
+
+    systick_sync(s);
+    systick_schedule(s);
 }
 
 static void systick_reset(nvic_state *s)
@@ -116,11 +270,384 @@ static void systick_reset(nvic_state *s)
     timer_del(s->systick.timer);
 }
 
+/* DWT cycle counter.  It counts HCLK cycles in QEMU_CLOCK_VIRTUAL, which
+ * follows the instruction count with -icount.  */
+static inline bool dwt_cyccnt_running(nvic_state *s)
+{
+    return (s->demcr & DEMCR_TRCENA) && (s->dwt.ctrl & DWT_CTRL_CYCCNTENA);
+}
+
+static uint32_t dwt_cpu_freq(nvic_state *s)
+{
+    int scale;
+
+    if (s->dwt.cpu_freq) {
+        return s->dwt.cpu_freq;
+    }
+    scale = s->systick.clock_scale ? s->systick.clock_scale
+                                   : system_clock_scale;
+    return get_ticks_per_sec() / MAX(scale, 1);
+}
+
+static uint32_t dwt_cyccnt(nvic_state *s, int64_t now)
+{
+    if (!dwt_cyccnt_running(s) || now <= s->dwt.cyccnt_time) {
+        return s->dwt.cyccnt;
+    }
+    return s->dwt.cyccnt + muldiv64(now - s->dwt.cyccnt_time,
+                                    dwt_cpu_freq(s), get_ticks_per_sec());
+}
+
+/* Fold the cycles counted so far into cyccnt, before anything the count
+ * depends on changes.  */
+static void dwt_sync(nvic_state *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    s->dwt.cyccnt = dwt_cyccnt(s, now);
+    s->dwt.cyccnt_time = now;
+}
+
+/* Set the frequency the cycle counter runs at, for boards which know it
+ * more precisely than the SysTick clock scale tells.  */
+void armv7m_nvic_set_cpu_freq(DeviceState *dev, uint32_t freq)
+{
+    nvic_state *s = NVIC(dev);
+
+    dwt_sync(s);
+    s->dwt.cpu_freq = freq;
+}
+
+static void dwt_reset(nvic_state *s)
+{
+    s->demcr = 0;
+    s->dwt.ctrl = DWT_CTRL_RO;
+    s->dwt.cyccnt = 0;
+    s->dwt.cyccnt_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+}
+
+static uint64_t dwt_read(void *opaque, hwaddr offset, unsigned size)
+{
+    nvic_state *s = (nvic_state *)opaque;
+
+    switch (offset) {
+    case 0x0: /* Control.  */
+        return s->dwt.ctrl;
+    case 0x4: /* Cycle Count.  */
+        return dwt_cyccnt(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    case 0x1c: /* Program Counter Sample.  */
+        return 0xffffffff;
+    default:
+        qemu_log_mask(LOG_UNIMP, "DWT: register 0x%x unimplemented\n",
+                      (int)offset);
+        return 0;
+    }
+}
+
+static void dwt_write(void *opaque, hwaddr offset, uint64_t value,
+                      unsigned size)
+{
+    nvic_state *s = (nvic_state *)opaque;
+
+    switch (offset) {
+    case 0x0: /* Control.  */
+        dwt_sync(s);
+        s->dwt.ctrl = DWT_CTRL_RO | (value & DWT_CTRL_CYCCNTENA);
+        break;
+    case 0x4: /* Cycle Count.  */
+        dwt_sync(s);
+        s->dwt.cyccnt = value;
+        break;
+    case 0xfb0: /* Lock Access.  Core accesses are never locked out.  */
+        break;
+    default:
+        qemu_log_mask(LOG_UNIMP, "DWT: register 0x%x unimplemented\n",
+                      (int)offset);
+    }
+}
+
+static const MemoryRegionOps dwt_ops = {
+    .read = dwt_read,
+    .write = dwt_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+/* ITM.  The stimulus port writes go to the "itm" chardev as SWO source
+ * packets, or with itm-raw set as the bare payload bytes, which suits a
+ * printf on port 0.  Nothing is written to the chardev until the CPU
+ * stops executing, so a burst of writes costs a single host write.  */
+static void itm_flush(nvic_state *s)
+{
+    if (s->itm.len) {
+        qemu_chr_fe_write_all(s->itm.chr, s->itm.buf, s->itm.len);
+        s->itm.len = 0;
+    }
+}
+
+static void itm_bh(void *opaque)
+{
+    itm_flush((nvic_state *)opaque);
+}
+
+static void itm_stimulus_write(nvic_state *s, int port, uint32_t value,
+                               unsigned size)
+{
+    unsigned i;
+
+    if (!s->itm.chr || !(s->demcr & DEMCR_TRCENA) ||
+        !(s->itm.tcr & ITM_TCR_ITMENA) || !(s->itm.ter & (1u << port))) {
+        return;
+    }
+
+    if (s->itm.len + 1 + size > ITM_BUF_SIZE) {
+        itm_flush(s);
+    }
+    if (!s->itm.raw) {
+        /* The size field codes 1, 2 and 4 bytes as 1, 2 and 3 */
+        s->itm.buf[s->itm.len++] = (port << 3) | (size == 4 ? 3 : size);
+    }
+    for (i = 0; i < size; i++) {
+        s->itm.buf[s->itm.len++] = value >> (i * 8);
+    }
+    qemu_bh_schedule(s->itm.bh);
+}
+
+/* With a chardev attached, tracing is set up at reset as a debug probe
+ * would do it, since the firmware usually leaves that to the probe.  */
+static void itm_reset(nvic_state *s)
+{
+    if (s->itm.chr) {
+        s->demcr |= DEMCR_TRCENA;
+        s->itm.ter = 0xffffffff;
+        s->itm.tcr = ITM_TCR_ITMENA;
+    } else {
+        s->itm.ter = 0;
+        s->itm.tcr = 0;
+    }
+    s->itm.tpr = 0;
+}
+
+static uint64_t itm_read(void *opaque, hwaddr offset, unsigned size)
+{
+    nvic_state *s = (nvic_state *)opaque;
+
+    switch (offset) {
+    case 0x0 ... 0x7f: /* Stimulus Ports.  The FIFO is never full.  */
+        return 1;
+    case 0xe00: /* Trace Enable.  */
+        return s->itm.ter;
+    case 0xe40: /* Trace Privilege.  */
+        return s->itm.tpr;
+    case 0xe80: /* Trace Control.  */
+        return s->itm.tcr;
+    case 0xfb4: /* Lock Status.  No lock for core accesses.  */
+        return 0;
+    default:
+        qemu_log_mask(LOG_UNIMP, "ITM: register 0x%x unimplemented\n",
+                      (int)offset);
+        return 0;
+    }
+}
+
+static void itm_write(void *opaque, hwaddr offset, uint64_t value,
+                      unsigned size)
+{
+    nvic_state *s = (nvic_state *)opaque;
+
+    switch (offset) {
+    case 0x0 ... 0x7f: /* Stimulus Ports.  */
+        itm_stimulus_write(s, offset >> 2, value, size);
+        break;
+    case 0xe00: /* Trace Enable.  */
+        s->itm.ter = value;
+        break;
+    case 0xe40: /* Trace Privilege.  */
+        s->itm.tpr = value & 0xf;
+        break;
+    case 0xe80: /* Trace Control.  */
+        s->itm.tcr = value & ITM_TCR_MASK;
+        break;
+    case 0xfb0: /* Lock Access.  */
+        break;
+    default:
+        qemu_log_mask(LOG_UNIMP, "ITM: register 0x%x unimplemented\n",
+                      (int)offset);
+    }
+}
+
+static const MemoryRegionOps itm_ops = {
+    .read = itm_read,
+    .write = itm_write,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+/* Interrupt latency.  The trace events and the statistics number the
+ * interrupts like CMSIS does (IRQn): the external interrupts from 0, the
+ * system exceptions from -1 (SysTick) down to -15.  */
+static inline int nvic_irqn(int irq)
+{
+    return irq < 32 ? irq - 16 : irq - 32;
+}
+
+static void nvic_latency_add(NVICLatencyHist *h, int64_t ns)
+{
+    int bucket = ns > 0 ? MIN(63 - clz64(ns), NVIC_LATENCY_BUCKETS - 1) : 0;
+
+    if (!h->count || ns < h->min) {
+        h->min = ns;
+    }
+    if (ns > h->max) {
+        h->max = ns;
+    }
+    h->count++;
+    h->total += ns;
+    h->buckets[bucket]++;
+}
+
+static void nvic_latency_start(nvic_state *s)
+{
+    int i;
+
+    g_free(s->latency);
+    s->latency = g_new0(NVICLatency, s->num_irq);
+    for (i = 0; i < s->num_irq; i++) {
+        s->latency[i].pend_time = -1;
+        s->latency[i].entry_time = -1;
+    }
+}
+
+static void nvic_pend_notify(GICState *gic, int irq, bool pending)
+{
+    nvic_state *s = (nvic_state *)gic;
+
+    if (pending == test_bit(irq, s->pend_seen)) {
+        return;
+    }
+    if (!pending) {
+        clear_bit(irq, s->pend_seen);
+        return;
+    }
+    set_bit(irq, s->pend_seen);
+    trace_nvic_irq_pend(nvic_irqn(irq));
+    if (s->latency) {
+        s->latency[irq].pend_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    }
+}
+
+static void nvic_latency_entry(nvic_state *s, int irq)
+{
+    NVICLatency *l;
+    int64_t now;
+
+    trace_nvic_irq_entry(nvic_irqn(irq));
+    if (!s->latency) {
+        return;
+    }
+    l = &s->latency[irq];
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (l->pend_time >= 0) {
+        nvic_latency_add(&l->pend, now - l->pend_time);
+        l->pend_time = -1;
+    }
+    l->entry_time = now;
+}
+
+static void nvic_latency_exit(nvic_state *s, int irq)
+{
+    NVICLatency *l;
+
+    trace_nvic_irq_exit(nvic_irqn(irq));
+    if (!s->latency) {
+        return;
+    }
+    l = &s->latency[irq];
+    if (l->entry_time >= 0) {
+        nvic_latency_add(&l->run, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) -
+                                  l->entry_time);
+        l->entry_time = -1;
+    }
+}
+
+void qmp_irq_latency_enable(bool enable, Error **errp)
+{
+    nvic_state *s;
+
+    QLIST_FOREACH(s, &nvic_list, next) {
+        if (enable) {
+            nvic_latency_start(s);
+        } else {
+            g_free(s->latency);
+            s->latency = NULL;
+        }
+    }
+}
+
+static IrqLatencyStats *nvic_latency_stats(NVICLatencyHist *h)
+{
+    IrqLatencyStats *stats = g_new0(IrqLatencyStats, 1);
+    uint64List **tail = &stats->histogram;
+    int i, last;
+
+    stats->count = h->count;
+    stats->min_ns = h->min;
+    stats->max_ns = h->max;
+    stats->total_ns = h->total;
+    /* Leave out the empty buckets at the end */
+    for (last = NVIC_LATENCY_BUCKETS - 1; last > 0 && !h->buckets[last];
+         last--) {
+    }
+    for (i = 0; i <= last; i++) {
+        *tail = g_new0(uint64List, 1);
+        (*tail)->value = h->buckets[i];
+        tail = &(*tail)->next;
+    }
+    return stats;
+}
+
+IrqLatencyInfoList *qmp_query_irq_latency(Error **errp)
+{
+    IrqLatencyInfoList *head = NULL, **tail = &head;
+    IrqLatencyInfo *info;
+    NVICLatency *l;
+    nvic_state *s;
+    int irq;
+
+    QLIST_FOREACH(s, &nvic_list, next) {
+        if (!s->latency) {
+            continue;
+        }
+        for (irq = 0; irq < s->num_irq; irq++) {
+            l = &s->latency[irq];
+            if (!l->pend.count && !l->run.count) {
+                continue;
+            }
+            info = g_new0(IrqLatencyInfo, 1);
+            info->nvic = object_get_canonical_path(OBJECT(s));
+            info->irq = nvic_irqn(irq);
+            info->pend = nvic_latency_stats(&l->pend);
+            info->run = nvic_latency_stats(&l->run);
+            *tail = g_new0(IrqLatencyInfoList, 1);
+            (*tail)->value = info;
+            tail = &(*tail)->next;
+        }
+    }
+    return head;
+}
+
 /* The external routines use the hardware vector numbering, ie. the first
    IRQ is #16.  The internal GIC routines use #32 as the first IRQ.  */
 void armv7m_nvic_set_pending(void *opaque, int irq)
 {
     nvic_state *s = (nvic_state *)opaque;
+    /* Disabled configurable faults escalate to HardFault */
+    if ((irq == ARMV7M_EXCP_MEM || irq == ARMV7M_EXCP_BUS ||
+         irq == ARMV7M_EXCP_USAGE) && !s->gic.irq_state[irq].enabled) {
+        irq = ARMV7M_EXCP_HARD;
+    }
     if (irq >= 16)
         irq += 16;
     gic_set_pending_private(&s->gic, 0, irq);
@@ -131,10 +658,19 @@ int armv7m_nvic_acknowledge_irq(void *opaque)
 {
     nvic_state *s = (nvic_state *)opaque;
     uint32_t irq;
+    bool systick_was_pending = systick_pending(s);
 
+    if (systick_was_pending) {
+        /* Wraps up to now are covered by the pending exception.  */
+        systick_sync(s);
+    }
     irq = gic_acknowledge_irq(&s->gic, 0);
+    if (systick_was_pending && !systick_pending(s)) {
+        systick_schedule(s);
+    }
     if (irq == 1023)
         hw_error("Interrupt but no vector\n");
+    nvic_latency_entry(s, irq);
     if (irq >= 32)
         irq -= 16;
     return irq;
@@ -145,9 +681,44 @@ void armv7m_nvic_complete_irq(void *opaque, int irq)
     nvic_state *s = (nvic_state *)opaque;
     if (irq >= 16)
         irq += 16;
+    nvic_latency_exit(s, irq);
     gic_complete_irq(&s->gic, 0, irq);
 }
 
+/* Deep sleep.  The board decides what SLEEPDEEP means for the rest of the
+ * chip from the "sleepdeep" output, and the NVIC only stops SysTick.  Any
+ * interrupt which wakes the CPU ends it, whether or not the board's wakeup
+ * logic would have let it through.  */
+static void nvic_wake_notify(GICState *gic)
+{
+    nvic_state *s = (nvic_state *)gic;
+
+    s->deep_sleep = false;
+    s->gic.nvic_wake_notify = NULL;
+    if (s->systick.control & SYSTICK_ENABLE) {
+        s->systick.tick += qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) -
+                           s->deep_sleep_time;
+    }
+    systick_schedule(s);
+    qemu_irq_lower(s->sleepdeep_irq);
+}
+
+/* Called by the CPU when it executes WFI with no interrupt to take. */
+void armv7m_nvic_wfi(void *opaque)
+{
+    nvic_state *s = (nvic_state *)opaque;
+
+    if (!(s->scr & SCR_SLEEPDEEP) || s->deep_sleep) {
+        return;
+    }
+    systick_sync(s);
+    s->deep_sleep = true;
+    s->deep_sleep_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    s->gic.nvic_wake_notify = nvic_wake_notify;
+    systick_schedule(s);
+    qemu_irq_raise(s->sleepdeep_irq);
+}
+
 static uint32_t nvic_readl(nvic_state *s, uint32_t offset)
 {
     ARMCPU *cpu;
@@ -158,6 +729,8 @@ static uint32_t nvic_readl(nvic_state *s, uint32_t offset)
     case 4: /* Interrupt Control Type.  */
         return (s->num_irq / 32) - 1;
     case 0x10: /* SysTick Control and Status.  */
+        systick_sync(s);
+        systick_schedule(s);
         val = s->systick.control;
         s->systick.control &= ~SYSTICK_COUNTFLAG;
         return val;
@@ -166,6 +739,8 @@ static uint32_t nvic_readl(nvic_state *s, uint32_t offset)
     case 0x18: /* SysTick Current Value.  */
         {
             int64_t t;
+            systick_sync(s);
+            systick_schedule(s);
             if ((s->systick.control & SYSTICK_ENABLE) == 0)
                 return 0;
             t = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
@@ -223,8 +798,8 @@ static uint32_t nvic_readl(nvic_state *s, uint32_t offset)
     case 0xd0c: /* Application Interrupt/Reset Control.  */
         return 0xfa050000;
     case 0xd10: /* System Control.  */
-        /* TODO: Implement SLEEPONEXIT.  */
-        return 0;
+        /* TODO: Implement SLEEPONEXIT and SEVONPEND.  */
+        return s->scr;
     case 0xd14: /* Configuration Control.  */
         /* TODO: Implement Configuration Control bits.  */
         return 0;
@@ -246,12 +821,14 @@ static uint32_t nvic_readl(nvic_state *s, uint32_t offset)
         if (s->gic.irq_state[ARMV7M_EXCP_USAGE].enabled) val |= (1 << 18);
         return val;
     case 0xd28: /* Configurable Fault Status.  */
-        /* TODO: Implement Fault Status.  */
-        qemu_log_mask(LOG_UNIMP, "Configurable Fault Status unimplemented\n");
-        return 0;
+        /* Only the MemManage faults raised by the MPU are recorded.  */
+        cpu = ARM_CPU(current_cpu);
+        return cpu->env.v7m.cfsr;
+    case 0xd34: /* Mem Manage Address.  */
+        cpu = ARM_CPU(current_cpu);
+        return cpu->env.v7m.mmfar;
     case 0xd2c: /* Hard Fault Status.  */
     case 0xd30: /* Debug Fault Status.  */
-    case 0xd34: /* Mem Manage Address.  */
     case 0xd38: /* Bus Fault Address.  */
     case 0xd3c: /* Aux Fault Status.  */
         /* TODO: Implement fault status registers.  */
@@ -283,7 +860,39 @@ static uint32_t nvic_readl(nvic_state *s, uint32_t offset)
         return 0x01111110;
     case 0xd70: /* ISAR4.  */
         return 0x01310102;
-    /* TODO: Implement debug registers.  */
+    case 0xd88: /* Coprocessor Access Control.  */
+        cpu = ARM_CPU(current_cpu);
+        return cpu->env.cp15.c1_coproc;
+    case 0xd90: /* MPU Type.  */
+        return V7M_MPU_NREGIONS << 8;
+    case 0xd94: /* MPU Control.  */
+        cpu = ARM_CPU(current_cpu);
+        return cpu->env.v7m.mpu_ctrl;
+    case 0xd98: /* MPU Region Number.  */
+        cpu = ARM_CPU(current_cpu);
+        return cpu->env.v7m.mpu_rnr;
+    case 0xd9c: /* MPU Region Base Address, and its aliases.  */
+    case 0xda4:
+    case 0xdac:
+    case 0xdb4:
+        cpu = ARM_CPU(current_cpu);
+        return cpu->env.v7m.mpu_rbar[cpu->env.v7m.mpu_rnr] |
+               cpu->env.v7m.mpu_rnr;
+    case 0xda0: /* MPU Region Attribute and Size, and its aliases.  */
+    case 0xda8:
+    case 0xdb0:
+    case 0xdb8:
+        cpu = ARM_CPU(current_cpu);
+        return cpu->env.v7m.mpu_rasr[cpu->env.v7m.mpu_rnr];
+    case 0xf34: /* Floating-point Context Control.  */
+        /* ASPEN and LSPEN, as at reset.  The FP context is always saved
+           straight away, which software cannot tell from lazy saving.  */
+        return 0xc0000000;
+    case 0xf38: /* Floating-point Context Address.  */
+        return 0;
+    case 0xdfc: /* Debug Exception and Monitor Control.  */
+        return s->demcr;
+    /* TODO: Implement the other debug registers.  */
     default:
         qemu_log_mask(LOG_GUEST_ERROR, "NVIC: Bad read offset 0x%x\n", offset);
         return 0;
@@ -296,6 +905,7 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
     uint32_t oldval;
     switch (offset) {
     case 0x10: /* SysTick Control and Status.  */
+        systick_sync(s);
         oldval = s->systick.control;
         s->systick.control &= 0xfffffff8;
         s->systick.control |= value & 7;
@@ -304,7 +914,7 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
             if (value & SYSTICK_ENABLE) {
                 if (s->systick.tick) {
                     s->systick.tick += now;
-                    timer_mod(s->systick.timer, s->systick.tick);
+                    systick_schedule(s);
                 } else {
                     systick_reload(s, 1);
                 }
@@ -318,10 +928,16 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
             /* This is a hack. Force the timer to be reloaded
                when the reference clock is changed.  */
             systick_reload(s, 1);
+        } else {
+            /* TICKINT may have changed.  */
+            systick_schedule(s);
         }
         break;
     case 0x14: /* SysTick Reload Value.  */
+        /* Wraps so far happened with the old reload value.  */
+        systick_sync(s);
         s->systick.reload = value;
+        systick_schedule(s);
         break;
     case 0x18: /* SysTick Current Value.  Writes reload the timer.  */
         systick_reload(s, 1);
@@ -335,13 +951,17 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
             armv7m_nvic_set_pending(s, ARMV7M_EXCP_PENDSV);
         } else if (value & (1 << 27)) {
             s->gic.irq_state[ARMV7M_EXCP_PENDSV].pending = 0;
+            gic_irq_changed(&s->gic, ARMV7M_EXCP_PENDSV);
             gic_update(&s->gic);
         }
         if (value & (1 << 26)) {
             armv7m_nvic_set_pending(s, ARMV7M_EXCP_SYSTICK);
         } else if (value & (1 << 25)) {
+            systick_sync(s);
             s->gic.irq_state[ARMV7M_EXCP_SYSTICK].pending = 0;
+            gic_irq_changed(&s->gic, ARMV7M_EXCP_SYSTICK);
             gic_update(&s->gic);
+            systick_schedule(s);
         }
         break;
     case 0xd08: /* Vector Table Offset.  */
@@ -362,9 +982,11 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
         }
         break;
     case 0xd10: /* System Control.  */
+        s->scr = value & SCR_MASK;
+        break;
     case 0xd14: /* Configuration Control.  */
         /* TODO: Implement control registers.  */
-        qemu_log_mask(LOG_UNIMP, "NVIC: SCR and CCR unimplemented\n");
+        qemu_log_mask(LOG_UNIMP, "NVIC: CCR unimplemented\n");
         break;
     case 0xd24: /* System Handler Control.  */
         /* TODO: Real hardware allows you to set/clear the active bits
@@ -372,16 +994,74 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
         s->gic.irq_state[ARMV7M_EXCP_MEM].enabled = (value & (1 << 16)) != 0;
         s->gic.irq_state[ARMV7M_EXCP_BUS].enabled = (value & (1 << 17)) != 0;
         s->gic.irq_state[ARMV7M_EXCP_USAGE].enabled = (value & (1 << 18)) != 0;
+        gic_irq_changed(&s->gic, ARMV7M_EXCP_MEM);
+        gic_irq_changed(&s->gic, ARMV7M_EXCP_BUS);
+        gic_irq_changed(&s->gic, ARMV7M_EXCP_USAGE);
         break;
     case 0xd28: /* Configurable Fault Status.  */
+        cpu = ARM_CPU(current_cpu);
+        cpu->env.v7m.cfsr &= ~value;
+        break;
+    case 0xd34: /* Mem Manage Address.  */
+        cpu = ARM_CPU(current_cpu);
+        cpu->env.v7m.mmfar = value;
+        break;
     case 0xd2c: /* Hard Fault Status.  */
     case 0xd30: /* Debug Fault Status.  */
-    case 0xd34: /* Mem Manage Address.  */
     case 0xd38: /* Bus Fault Address.  */
     case 0xd3c: /* Aux Fault Status.  */
         qemu_log_mask(LOG_UNIMP,
                       "NVIC: fault status registers unimplemented\n");
         break;
+    /* The permissions of the MPU are cached in the TLB, which therefore
+       has to be flushed whenever they change.  */
+    case 0xd94: /* MPU Control.  */
+        cpu = ARM_CPU(current_cpu);
+        cpu->env.v7m.mpu_ctrl = value & 7;
+        tlb_flush(CPU(cpu), 1);
+        break;
+    case 0xd98: /* MPU Region Number.  */
+        cpu = ARM_CPU(current_cpu);
+        cpu->env.v7m.mpu_rnr = value % V7M_MPU_NREGIONS;
+        break;
+    case 0xd9c: /* MPU Region Base Address, and its aliases.  */
+    case 0xda4:
+    case 0xdac:
+    case 0xdb4:
+        cpu = ARM_CPU(current_cpu);
+        if (value & V7M_MPU_RBAR_VALID) {
+            cpu->env.v7m.mpu_rnr = (value & V7M_MPU_RBAR_REGION_MASK) %
+                                   V7M_MPU_NREGIONS;
+        }
+        cpu->env.v7m.mpu_rbar[cpu->env.v7m.mpu_rnr] =
+            value & V7M_MPU_RBAR_ADDR_MASK;
+        tlb_flush(CPU(cpu), 1);
+        break;
+    case 0xda0: /* MPU Region Attribute and Size, and its aliases.  */
+    case 0xda8:
+    case 0xdb0:
+    case 0xdb8:
+        cpu = ARM_CPU(current_cpu);
+        cpu->env.v7m.mpu_rasr[cpu->env.v7m.mpu_rnr] =
+            value & V7M_MPU_RASR_MASK;
+        tlb_flush(CPU(cpu), 1);
+        break;
+    case 0xd88: /* Coprocessor Access Control.  */
+        cpu = ARM_CPU(current_cpu);
+        /* Only CP10 and CP11 (the FPU) exist, and only on cores with one.  */
+        if (arm_feature(&cpu->env, ARM_FEATURE_VFP)) {
+            cpu->env.cp15.c1_coproc = value & (0xf << 20);
+        }
+        break;
+    case 0xf34: /* Floating-point Context Control.  */
+        if (!(value & (1u << 31))) {
+            qemu_log_mask(LOG_UNIMP, "NVIC: FPCCR.ASPEN clear unimplemented\n");
+        }
+        break;
+    case 0xdfc: /* Debug Exception and Monitor Control.  */
+        dwt_sync(s);
+        s->demcr = value & DEMCR_MASK;
+        break;
     case 0xf00: /* Software Triggered Interrupt Register */
         if ((value & 0x1ff) < s->num_irq) {
             gic_set_pending_private(&s->gic, 0, value & 0x1ff);
@@ -432,8 +1112,8 @@ static void nvic_sysreg_write(void *opaque, hwaddr addr,
     switch (offset) {
     case 0xd18 ... 0xd23: /* System Handler Priority.  */
         for (i = 0; i < size; i++) {
-            s->gic.priority1[(offset - 0xd14) + i][0] =
-                (value >> (i * 8)) & 0xff;
+            gic_set_priority(&s->gic, 0, (offset - 0xd14) + i,
+                             (value >> (i * 8)) & 0xff);
         }
         gic_update(&s->gic);
         return;
@@ -452,15 +1132,35 @@ static const MemoryRegionOps nvic_sysreg_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+static int nvic_post_load(void *opaque, int version_id)
+{
+    nvic_state *s = (nvic_state *)opaque;
+
+    s->gic.nvic_wake_notify = s->deep_sleep ? nvic_wake_notify : NULL;
+    return 0;
+}
+
 static const VMStateDescription vmstate_nvic = {
     .name = "armv7m_nvic",
-    .version_id = 1,
+    .version_id = 3,
     .minimum_version_id = 1,
+    .post_load = nvic_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32(systick.control, nvic_state),
         VMSTATE_UINT32(systick.reload, nvic_state),
         VMSTATE_INT64(systick.tick, nvic_state),
         VMSTATE_TIMER(systick.timer, nvic_state),
+        VMSTATE_UINT32_V(demcr, nvic_state, 2),
+        VMSTATE_UINT32_V(dwt.ctrl, nvic_state, 2),
+        VMSTATE_UINT32_V(dwt.cyccnt, nvic_state, 2),
+        VMSTATE_INT64_V(dwt.cyccnt_time, nvic_state, 2),
+        VMSTATE_UINT32_V(dwt.cpu_freq, nvic_state, 2),
+        VMSTATE_UINT32_V(itm.ter, nvic_state, 2),
+        VMSTATE_UINT32_V(itm.tpr, nvic_state, 2),
+        VMSTATE_UINT32_V(itm.tcr, nvic_state, 2),
+        VMSTATE_UINT32_V(scr, nvic_state, 3),
+        VMSTATE_BOOL_V(deep_sleep, nvic_state, 3),
+        VMSTATE_INT64_V(deep_sleep_time, nvic_state, 3),
         VMSTATE_END_OF_LIST()
     }
 };
@@ -479,7 +1179,23 @@ static void armv7m_nvic_reset(DeviceState *dev)
     s->gic.priority_mask[0] = 0x100;
     /* The NVIC as a whole is always enabled. */
     s->gic.enabled = true;
+    /* The board resets its own side of deep sleep */
+    s->scr = 0;
+    s->deep_sleep = false;
+    s->gic.nvic_wake_notify = NULL;
     systick_reset(s);
+    dwt_reset(s);
+    itm_reset(s);
+    /* Nothing is pending or running any more; the statistics are kept */
+    bitmap_zero(s->pend_seen, GIC_MAXIRQ);
+    if (s->latency) {
+        int i;
+
+        for (i = 0; i < s->num_irq; i++) {
+            s->latency[i].pend_time = -1;
+            s->latency[i].entry_time = -1;
+        }
+    }
 }
 
 static void armv7m_nvic_realize(DeviceState *dev, Error **errp)
@@ -521,13 +1237,36 @@ static void armv7m_nvic_realize(DeviceState *dev, Error **errp)
                              0x100, 0xc00);
     memory_region_add_subregion_overlap(&s->container, 0x100,
                                         &s->gic_iomem_alias, 1);
-    /* Map the whole thing into system memory at the location required
-     * by the v7M architecture.
+    /* The board maps the whole thing at the location required by the v7M
+     * architecture, in the address space of the core it belongs to.
      */
-    memory_region_add_subregion(get_system_memory(), 0xe000e000, &s->container);
+    sysbus_init_mmio(SYS_BUS_DEVICE(s), &s->container);
+    /* The ITM and the DWT are mapped separately, at 0xe0000000 and
+     * 0xe0001000.  */
+    memory_region_init_io(&s->itm_iomem, OBJECT(s), &itm_ops, s,
+                          "itm", 0x1000);
+    sysbus_init_mmio(SYS_BUS_DEVICE(s), &s->itm_iomem);
+    memory_region_init_io(&s->dwt_iomem, OBJECT(s), &dwt_ops, s,
+                          "dwt", 0x1000);
+    sysbus_init_mmio(SYS_BUS_DEVICE(s), &s->dwt_iomem);
+    qdev_init_gpio_out_named(dev, &s->sleepdeep_irq, "sleepdeep", 1);
+    s->itm.bh = qemu_bh_new(itm_bh, s);
     s->systick.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, systick_timer_tick, s);
+
+    s->gic.nvic_pend_notify = nvic_pend_notify;
+    if (s->latency_prop) {
+        nvic_latency_start(s);
+    }
+    QLIST_INSERT_HEAD(&nvic_list, s, next);
 }
 
+static Property armv7m_nvic_properties[] = {
+    DEFINE_PROP_BOOL("irq-latency", nvic_state, latency_prop, false),
+    DEFINE_PROP_CHR("itm", nvic_state, itm.chr),
+    DEFINE_PROP_BOOL("itm-raw", nvic_state, itm.raw, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void armv7m_nvic_instance_init(Object *obj)
 {
     /* We have a different default value for the num-irq property
@@ -552,6 +1291,7 @@ static void armv7m_nvic_class_init(ObjectClass *klass, void *data)
     nc->parent_reset = dc->reset;
     nc->parent_realize = dc->realize;
     dc->vmsd  = &vmstate_nvic;
+    dc->props = armv7m_nvic_properties;
     dc->reset = armv7m_nvic_reset;
     dc->realize = armv7m_nvic_realize;
 }
@@ -29,11 +29,26 @@
    through the normal GIC interface.  */
 #define GIC_BASE_IRQ ((s->revision == REV_NVIC) ? 32 : 0)
 
-#define GIC_SET_ENABLED(irq, cm) s->irq_state[irq].enabled |= (cm)
-#define GIC_CLEAR_ENABLED(irq, cm) s->irq_state[irq].enabled &= ~(cm)
+/* Changes to the enabled and pending state must go through these macros
+ * (or be followed by gic_irq_changed()) to keep the NVIC's bookkeeping of
+ * candidate interrupts up to date. */
+#define GIC_SET_ENABLED(irq, cm) do {                                   \
+        s->irq_state[irq].enabled |= (cm);                              \
+        gic_irq_changed(s, irq);                                        \
+    } while (0)
+#define GIC_CLEAR_ENABLED(irq, cm) do {                                 \
+        s->irq_state[irq].enabled &= ~(cm);                             \
+        gic_irq_changed(s, irq);                                        \
+    } while (0)
 #define GIC_TEST_ENABLED(irq, cm) ((s->irq_state[irq].enabled & (cm)) != 0)
-#define GIC_SET_PENDING(irq, cm) s->irq_state[irq].pending |= (cm)
-#define GIC_CLEAR_PENDING(irq, cm) s->irq_state[irq].pending &= ~(cm)
+#define GIC_SET_PENDING(irq, cm) do {                                   \
+        s->irq_state[irq].pending |= (cm);                              \
+        gic_irq_changed(s, irq);                                        \
+    } while (0)
+#define GIC_CLEAR_PENDING(irq, cm) do {                                 \
+        s->irq_state[irq].pending &= ~(cm);                             \
+        gic_irq_changed(s, irq);                                        \
+    } while (0)
 #define GIC_SET_ACTIVE(irq, cm) s->irq_state[irq].active |= (cm)
 #define GIC_CLEAR_ACTIVE(irq, cm) s->irq_state[irq].active &= ~(cm)
 #define GIC_TEST_ACTIVE(irq, cm) ((s->irq_state[irq].active & (cm)) != 0)
@@ -61,6 +76,17 @@ void gic_complete_irq(GICState *s, int cpu, int irq);
 void gic_update(GICState *s);
 void gic_init_irqs_and_distributor(GICState *s, int num_irq);
 void gic_set_priority(GICState *s, int cpu, int irq, uint8_t val);
+void gic_nvic_irq_changed(GICState *s, int irq);
+void gic_nvic_rebuild(GICState *s);
+
+/* Call after changing the enabled or pending state or the priority of an
+ * interrupt other than through the GIC_SET_* / GIC_CLEAR_* macros. */
+static inline void gic_irq_changed(GICState *s, int irq)
+{
+    if (s->revision == REV_NVIC) {
+        gic_nvic_irq_changed(s, irq);
+    }
+}
 
 static inline bool gic_test_pending(GICState *s, int irq, int cm)
 {
@@ -0,0 +1,1099 @@
+/*
+ * STM32 Microcontroller bxCAN controller
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ * (connectivity line devices, with two controllers sharing 28 filter banks)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The controller with its three transmit mailboxes, its two receive FIFOs
+ * of three messages and the acceptance filters, attached to a can-bus
+ * object (see net/can.c).  Transmit requests are collected by a bottom
+ * half, which sends all the mailboxes requested by then as one batch, in
+ * the order they would win arbitration.  A batch received from the bus is
+ * filtered and queued frame by frame, and the interrupt lines are updated
+ * once for the whole batch.
+ *
+ * The filter banks are compiled when the firmware leaves filter
+ * initialization mode or writes FA1R: identifier list entries go into hash
+ * tables and the mask entries into short arrays, so that a frame is matched
+ * without walking all the banks.  32-bit filters have priority over 16-bit
+ * ones, then list entries over mask entries, then the lower bank.
+ *
+ * Bit timing, arbitration against other nodes and bus errors are not
+ * modelled: a frame is delivered as soon as it is sent, every transmission
+ * succeeds, the error counters stay at 0 and there are no time stamps.
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "net/can.h"
+#include "qemu/bitops.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+
+
+
+/* DEFINITIONS*/
+
+//#define DEBUG_STM32_CAN
+
+#ifdef DEBUG_STM32_CAN
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_CAN: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define CAN_REGION_SIZE 0x400
+
+#define CAN_MCR_OFFSET 0x000
+#define CAN_MCR_INRQ_BIT 0
+#define CAN_MCR_SLEEP_BIT 1
+#define CAN_MCR_TXFP_BIT 2
+#define CAN_MCR_RFLM_BIT 3
+#define CAN_MCR_AWUM_BIT 5
+#define CAN_MCR_RESET_BIT 15
+
+#define CAN_MSR_OFFSET 0x004
+#define CAN_MSR_INAK_BIT 0
+#define CAN_MSR_SLAK_BIT 1
+#define CAN_MSR_ERRI_BIT 2
+#define CAN_MSR_WKUI_BIT 3
+#define CAN_MSR_SLAKI_BIT 4
+/* SAMP and RX (the level of the CANRX pin) read as recessive */
+#define CAN_MSR_IDLE 0x00000c00
+
+/* Each transmit mailbox has a byte of status flags */
+#define CAN_TSR_OFFSET 0x008
+#define CAN_TSR_RQCP_BIT(n) ((n) * 8)
+#define CAN_TSR_TXOK_BIT(n) ((n) * 8 + 1)
+#define CAN_TSR_ABRQ_BIT(n) ((n) * 8 + 7)
+#define CAN_TSR_FLAGS_MASK(n) (0x0f << ((n) * 8))
+#define CAN_TSR_CODE_START 24
+#define CAN_TSR_TME_BIT(n) (26 + (n))
+
+#define CAN_RFR_OFFSET(f) (0x00c + (f) * 4)
+#define CAN_RFR_FMP_MASK 0x3
+#define CAN_RFR_FULL_BIT 3
+#define CAN_RFR_FOVR_BIT 4
+#define CAN_RFR_RFOM_BIT 5
+
+#define CAN_IER_OFFSET 0x014
+#define CAN_IER_TMEIE_BIT 0
+#define CAN_IER_FMPIE_BIT(f) (1 + (f) * 3)
+#define CAN_IER_FFIE_BIT(f) (2 + (f) * 3)
+#define CAN_IER_FOVIE_BIT(f) (3 + (f) * 3)
+#define CAN_IER_WKUIE_BIT 16
+#define CAN_IER_SLKIE_BIT 17
+
+#define CAN_ESR_OFFSET 0x018
+#define CAN_ESR_LEC_MASK 0x00000070
+
+#define CAN_BTR_OFFSET 0x01c
+#define CAN_BTR_LBKM_BIT 30
+#define CAN_BTR_SILM_BIT 31
+
+/* The mailboxes have an identifier, a data length (and time stamp) and two
+ * data registers each.  A receive FIFO shows its oldest message. */
+#define CAN_TX_MB_START 0x180
+#define CAN_TX_MB_COUNT 3
+#define CAN_TX_MB_END (CAN_TX_MB_START + CAN_TX_MB_COUNT * 0x10)
+#define CAN_RX_MB_START 0x1b0
+#define CAN_RX_FIFO_COUNT 2
+#define CAN_RX_MB_END (CAN_RX_MB_START + CAN_RX_FIFO_COUNT * 0x10)
+#define CAN_RX_FIFO_DEPTH 3
+
+#define CAN_MB_IR_OFFSET 0x0
+#define CAN_MB_DTR_OFFSET 0x4
+#define CAN_MB_DLR_OFFSET 0x8
+#define CAN_MB_DHR_OFFSET 0xc
+
+#define CAN_TIR_TXRQ_BIT 0
+#define CAN_IR_RTR_BIT 1
+#define CAN_IR_IDE_BIT 2
+#define CAN_IR_EXID_START 3
+#define CAN_IR_STID_START 21
+#define CAN_DTR_DLC_MASK 0xf
+#define CAN_RDTR_FMI_START 8
+
+/* Filter registers (CAN1 only) */
+#define CAN_FMR_OFFSET 0x200
+#define CAN_FMR_FINIT_BIT 0
+#define CAN_FMR_CAN2SB_START 8
+#define CAN_FMR_WRITE_MASK 0x00003f01
+#define CAN_FM1R_OFFSET 0x204
+#define CAN_FS1R_OFFSET 0x20c
+#define CAN_FFA1R_OFFSET 0x214
+#define CAN_FA1R_OFFSET 0x21c
+#define CAN_FR_START 0x240
+#define CAN_FILTER_BANKS 28
+#define CAN_FR_END (CAN_FR_START + CAN_FILTER_BANKS * 8)
+#define CAN_FILTER_START CAN_FMR_OFFSET
+#define CAN_FILTER_END CAN_FR_END
+
+/* A filter match, as stored in the compiled filters: the FIFO and the
+ * filter number, with a flag so that it is never 0 (no match). */
+#define CAN_MATCH(fifo, fmi) (0x200 | ((fifo) << 8) | (fmi))
+#define CAN_MATCH_FIFO(match) (((match) >> 8) & 1)
+#define CAN_MATCH_FMI(match) ((match) & 0xff)
+
+typedef struct Stm32CanMailbox {
+    uint32_t IR;
+    uint32_t DTR;
+    uint32_t DLR;
+    uint32_t DHR;
+} Stm32CanMailbox;
+
+typedef struct Stm32CanFifo {
+    Stm32CanMailbox mb[CAN_RX_FIFO_DEPTH];
+    /* The oldest message.  The number of messages is FMP in RFR. */
+    uint32_t head;
+} Stm32CanFifo;
+
+typedef struct Stm32CanMaskFilter {
+    uint32_t id; /* already masked */
+    uint32_t mask;
+    uint32_t match;
+} Stm32CanMaskFilter;
+
+/* The active filters of one controller.  The list tables map an
+ * identifier, in the 32-bit or 16-bit filter layout, to its match. */
+typedef struct Stm32CanFilters {
+    GHashTable *list32;
+    GHashTable *list16;
+    int mask32_count;
+    int mask16_count;
+    Stm32CanMaskFilter mask32[CAN_FILTER_BANKS];
+    Stm32CanMaskFilter mask16[CAN_FILTER_BANKS * 2];
+} Stm32CanFilters;
+
+struct Stm32Can {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    void *stm32_rcc_prop;
+    /* The can-bus object (optional: loop back mode works without it) */
+    void *bus_prop;
+    /* CAN2 only: CAN1, which has the filter banks */
+    void *master_prop;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32Rcc *stm32_rcc;
+    Stm32Can *master;
+    CanBusClientState client;
+
+    QEMUBH *tx_bh;
+    qemu_irq irq[4];
+
+    uint32_t
+        CAN_MCR,
+        CAN_MSR,
+        CAN_TSR,
+        CAN_RFR[CAN_RX_FIFO_COUNT],
+        CAN_IER,
+        CAN_ESR,
+        CAN_BTR;
+
+    Stm32CanMailbox tx_mb[CAN_TX_MB_COUNT];
+    Stm32CanFifo rx_fifo[CAN_RX_FIFO_COUNT];
+    /* When each pending mailbox was requested, for the TXFP order */
+    uint32_t tx_seq[CAN_TX_MB_COUNT];
+    uint32_t tx_seq_next;
+
+    /* Filter registers and the filters compiled from them for CAN1 ([0])
+     * and CAN2 ([1]).  Only used in CAN1. */
+    uint32_t
+        CAN_FMR,
+        CAN_FM1R,
+        CAN_FS1R,
+        CAN_FFA1R,
+        CAN_FA1R,
+        CAN_FR[CAN_FILTER_BANKS][2];
+    Stm32CanFilters filters[2];
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_can_update_irq(Stm32Can *s)
+{
+    uint32_t ier = s->CAN_IER;
+    uint32_t rfr;
+    int fifo;
+
+    qemu_set_irq(s->irq[STM32_CAN_TX_IRQ],
+                 (ier & BIT(CAN_IER_TMEIE_BIT)) &&
+                 (s->CAN_TSR & (BIT(CAN_TSR_RQCP_BIT(0)) |
+                                BIT(CAN_TSR_RQCP_BIT(1)) |
+                                BIT(CAN_TSR_RQCP_BIT(2)))));
+    for(fifo = 0; fifo < CAN_RX_FIFO_COUNT; fifo++) {
+        rfr = s->CAN_RFR[fifo];
+        qemu_set_irq(s->irq[STM32_CAN_RX0_IRQ + fifo],
+                     ((ier & BIT(CAN_IER_FMPIE_BIT(fifo))) &&
+                      (rfr & CAN_RFR_FMP_MASK)) ||
+                     ((ier & BIT(CAN_IER_FFIE_BIT(fifo))) &&
+                      (rfr & BIT(CAN_RFR_FULL_BIT))) ||
+                     ((ier & BIT(CAN_IER_FOVIE_BIT(fifo))) &&
+                      (rfr & BIT(CAN_RFR_FOVR_BIT))));
+    }
+    qemu_set_irq(s->irq[STM32_CAN_SCE_IRQ],
+                 ((ier & BIT(CAN_IER_WKUIE_BIT)) &&
+                  (s->CAN_MSR & BIT(CAN_MSR_WKUI_BIT))) ||
+                 ((ier & BIT(CAN_IER_SLKIE_BIT)) &&
+                  (s->CAN_MSR & BIT(CAN_MSR_SLAKI_BIT))));
+}
+
+/* Apply the INRQ and SLEEP requests.  With both set, the controller stays
+ * in the mode it is in. */
+static void stm32_can_update_mode(Stm32Can *s)
+{
+    bool inrq = s->CAN_MCR & BIT(CAN_MCR_INRQ_BIT);
+    bool sleep = s->CAN_MCR & BIT(CAN_MCR_SLEEP_BIT);
+
+    if(inrq && !sleep) {
+        s->CAN_MSR &= ~BIT(CAN_MSR_SLAK_BIT);
+        s->CAN_MSR |= BIT(CAN_MSR_INAK_BIT);
+    } else if(sleep && !inrq) {
+        if(!(s->CAN_MSR & BIT(CAN_MSR_SLAK_BIT))) {
+            s->CAN_MSR |= BIT(CAN_MSR_SLAKI_BIT);
+        }
+        s->CAN_MSR &= ~BIT(CAN_MSR_INAK_BIT);
+        s->CAN_MSR |= BIT(CAN_MSR_SLAK_BIT);
+    } else if(!inrq && !sleep) {
+        s->CAN_MSR &= ~(BIT(CAN_MSR_INAK_BIT) | BIT(CAN_MSR_SLAK_BIT));
+        /* Send what was requested while the controller was stopped */
+        qemu_bh_schedule(s->tx_bh);
+    }
+}
+
+static uint32_t stm32_can_frame_to_ir(const QemuCanFrame *frame)
+{
+    uint32_t ir;
+
+    if(frame->can_id & QEMU_CAN_EFF_FLAG) {
+        ir = ((frame->can_id & QEMU_CAN_EFF_MASK) << CAN_IR_EXID_START) |
+             BIT(CAN_IR_IDE_BIT);
+    } else {
+        ir = (frame->can_id & QEMU_CAN_SFF_MASK) << CAN_IR_STID_START;
+    }
+    if(frame->can_id & QEMU_CAN_RTR_FLAG) {
+        ir |= BIT(CAN_IR_RTR_BIT);
+    }
+    return ir;
+}
+
+static void stm32_can_mailbox_to_frame(const Stm32CanMailbox *mb,
+                                       QemuCanFrame *frame)
+{
+    memset(frame, 0, sizeof(*frame));
+    if(mb->IR & BIT(CAN_IR_IDE_BIT)) {
+        frame->can_id = ((mb->IR >> CAN_IR_EXID_START) & QEMU_CAN_EFF_MASK) |
+                        QEMU_CAN_EFF_FLAG;
+    } else {
+        frame->can_id = mb->IR >> CAN_IR_STID_START;
+    }
+    if(mb->IR & BIT(CAN_IR_RTR_BIT)) {
+        frame->can_id |= QEMU_CAN_RTR_FLAG;
+    }
+    frame->can_dlc = MIN(mb->DTR & CAN_DTR_DLC_MASK, 8);
+    stl_le_p(&frame->data[0], mb->DLR);
+    stl_le_p(&frame->data[4], mb->DHR);
+}
+
+/* The arbitration field of a transmit mailbox as it goes on the wire, so
+ * that the lowest value wins: the standard identifier, then RTR (or SRR,
+ * always recessive, for extended frames), IDE, and for extended frames the
+ * rest of the identifier and RTR. */
+static uint32_t stm32_can_arbitration_field(uint32_t ir)
+{
+    uint32_t stid = ir >> CAN_IR_STID_START;
+    uint32_t rtr = (ir >> CAN_IR_RTR_BIT) & 1;
+
+    if(ir & BIT(CAN_IR_IDE_BIT)) {
+        return (stid << 21) | (3 << 19) |
+               (extract32(ir, CAN_IR_EXID_START, 18) << 1) | rtr;
+    }
+    return (stid << 21) | (rtr << 20);
+}
+
+/* Whether pending mailbox a goes out before pending mailbox b */
+static bool stm32_can_tx_before(Stm32Can *s, int a, int b)
+{
+    uint32_t field_a, field_b;
+
+    if(s->CAN_MCR & BIT(CAN_MCR_TXFP_BIT)) {
+        /* In the order they were requested */
+        return (int32_t)(s->tx_seq[a] - s->tx_seq[b]) < 0;
+    }
+    field_a = stm32_can_arbitration_field(s->tx_mb[a].IR);
+    field_b = stm32_can_arbitration_field(s->tx_mb[b].IR);
+    return field_a < field_b || (field_a == field_b && a < b);
+}
+
+
+
+
+/* FILTERS */
+
+static void stm32_can_filter_add_list(GHashTable *table, uint32_t id,
+                                      uint32_t match)
+{
+    gpointer key = GUINT_TO_POINTER(id);
+
+    /* An identifier listed twice matches the lower bank */
+    if(!g_hash_table_lookup(table, key)) {
+        g_hash_table_insert(table, key, GUINT_TO_POINTER(match));
+    }
+}
+
+static void stm32_can_filter_add_mask(Stm32CanMaskFilter *filter,
+                                      uint32_t id, uint32_t mask,
+                                      uint32_t match)
+{
+    filter->id = id & mask;
+    filter->mask = mask;
+    filter->match = match;
+}
+
+/* Compile banks first to last - 1 of the master into f.  The filter
+ * numbers count up per FIFO, over the inactive banks too. */
+static void stm32_can_compile_banks(Stm32Can *s, Stm32CanFilters *f,
+                                    int first, int last)
+{
+    int fmi[CAN_RX_FIFO_COUNT] = { 0, 0 };
+    uint32_t bit, r1, r2;
+    bool list;
+    int b, fifo, n;
+
+    g_hash_table_remove_all(f->list32);
+    g_hash_table_remove_all(f->list16);
+    f->mask32_count = 0;
+    f->mask16_count = 0;
+
+    for(b = first; b < last; b++) {
+        bit = BIT(b);
+        list = s->CAN_FM1R & bit;
+        fifo = (s->CAN_FFA1R & bit) ? 1 : 0;
+        r1 = s->CAN_FR[b][0];
+        r2 = s->CAN_FR[b][1];
+        n = fmi[fifo];
+
+        if(s->CAN_FS1R & bit) {
+            fmi[fifo] += list ? 2 : 1;
+            if(!(s->CAN_FA1R & bit)) {
+                continue;
+            }
+            /* Bit 0 of the 32-bit layout is not part of the identifier */
+            if(list) {
+                stm32_can_filter_add_list(f->list32, r1 & ~1,
+                                          CAN_MATCH(fifo, n));
+                stm32_can_filter_add_list(f->list32, r2 & ~1,
+                                          CAN_MATCH(fifo, n + 1));
+            } else {
+                stm32_can_filter_add_mask(&f->mask32[f->mask32_count++],
+                                          r1, r2 & ~1, CAN_MATCH(fifo, n));
+            }
+        } else {
+            fmi[fifo] += list ? 4 : 2;
+            if(!(s->CAN_FA1R & bit)) {
+                continue;
+            }
+            if(list) {
+                stm32_can_filter_add_list(f->list16, r1 & 0xffff,
+                                          CAN_MATCH(fifo, n));
+                stm32_can_filter_add_list(f->list16, r1 >> 16,
+                                          CAN_MATCH(fifo, n + 1));
+                stm32_can_filter_add_list(f->list16, r2 & 0xffff,
+                                          CAN_MATCH(fifo, n + 2));
+                stm32_can_filter_add_list(f->list16, r2 >> 16,
+                                          CAN_MATCH(fifo, n + 3));
+            } else {
+                stm32_can_filter_add_mask(&f->mask16[f->mask16_count++],
+                                          r1 & 0xffff, r1 >> 16,
+                                          CAN_MATCH(fifo, n));
+                stm32_can_filter_add_mask(&f->mask16[f->mask16_count++],
+                                          r2 & 0xffff, r2 >> 16,
+                                          CAN_MATCH(fifo, n + 1));
+            }
+        }
+    }
+}
+
+/* Split the banks between CAN1 and CAN2 at CAN2SB and compile them */
+static void stm32_can_compile_filters(Stm32Can *s)
+{
+    int split = MIN(extract32(s->CAN_FMR, CAN_FMR_CAN2SB_START, 6),
+                    CAN_FILTER_BANKS);
+
+    stm32_can_compile_banks(s, &s->filters[0], 0, split);
+    stm32_can_compile_banks(s, &s->filters[1], split, CAN_FILTER_BANKS);
+}
+
+/* Returns the match for a received identifier (in the RIR layout), or 0 if
+ * no filter accepts it. */
+static uint32_t stm32_can_filter_match(Stm32Can *s, uint32_t ir)
+{
+    Stm32Can *m = s->master ? s->master : s;
+    Stm32CanFilters *f = &m->filters[s->master ? 1 : 0];
+    uint32_t id16, match;
+    int i;
+
+    /* No reception while the filters are being set up */
+    if(m->CAN_FMR & BIT(CAN_FMR_FINIT_BIT)) {
+        return 0;
+    }
+
+    match = GPOINTER_TO_UINT(g_hash_table_lookup(f->list32,
+                                                 GUINT_TO_POINTER(ir)));
+    if(match) {
+        return match;
+    }
+    for(i = 0; i < f->mask32_count; i++) {
+        if((ir & f->mask32[i].mask) == f->mask32[i].id) {
+            return f->mask32[i].match;
+        }
+    }
+
+    /* The 16-bit layout: STID, RTR, IDE and EXID[17:15] */
+    id16 = ((ir >> CAN_IR_STID_START) << 5) |
+           (((ir >> CAN_IR_RTR_BIT) & 1) << 4) |
+           (((ir >> CAN_IR_IDE_BIT) & 1) << 3) |
+           extract32(ir, CAN_IR_EXID_START + 15, 3);
+    match = GPOINTER_TO_UINT(g_hash_table_lookup(f->list16,
+                                                 GUINT_TO_POINTER(id16)));
+    if(match) {
+        return match;
+    }
+    for(i = 0; i < f->mask16_count; i++) {
+        if((id16 & f->mask16[i].mask) == f->mask16[i].id) {
+            return f->mask16[i].match;
+        }
+    }
+    return 0;
+}
+
+
+
+
+/* RECEPTION AND TRANSMISSION */
+
+static void stm32_can_receive_frame(Stm32Can *s, const QemuCanFrame *frame)
+{
+    Stm32CanMailbox *mb;
+    Stm32CanFifo *q;
+    uint32_t ir, match, *rfr;
+    int fifo, n;
+
+    if(frame->can_id & QEMU_CAN_ERR_FLAG) {
+        return;
+    }
+    ir = stm32_can_frame_to_ir(frame);
+    match = stm32_can_filter_match(s, ir);
+    if(!match) {
+        return;
+    }
+
+    fifo = CAN_MATCH_FIFO(match);
+    q = &s->rx_fifo[fifo];
+    rfr = &s->CAN_RFR[fifo];
+    n = *rfr & CAN_RFR_FMP_MASK;
+    if(n == CAN_RX_FIFO_DEPTH) {
+        *rfr |= BIT(CAN_RFR_FOVR_BIT);
+        if(s->CAN_MCR & BIT(CAN_MCR_RFLM_BIT)) {
+            DPRINTF("FIFO %d overrun, frame 0x%x dropped\n", fifo,
+                    frame->can_id);
+            return;
+        }
+        /* Not locked: the newest message is overwritten */
+        mb = &q->mb[(q->head + CAN_RX_FIFO_DEPTH - 1) % CAN_RX_FIFO_DEPTH];
+    } else {
+        mb = &q->mb[(q->head + n) % CAN_RX_FIFO_DEPTH];
+        *rfr = (*rfr & ~CAN_RFR_FMP_MASK) | (n + 1);
+        if(n + 1 == CAN_RX_FIFO_DEPTH) {
+            *rfr |= BIT(CAN_RFR_FULL_BIT);
+        }
+    }
+
+    mb->IR = ir;
+    mb->DTR = (CAN_MATCH_FMI(match) << CAN_RDTR_FMI_START) |
+              MIN(frame->can_dlc, 8);
+    mb->DLR = ldl_le_p(&frame->data[0]);
+    mb->DHR = ldl_le_p(&frame->data[4]);
+}
+
+static void stm32_can_receive(CanBusClientState *client,
+                              const QemuCanFrame *frames, size_t count)
+{
+    Stm32Can *s = container_of(client, Stm32Can, client);
+    size_t i;
+
+    if(s->CAN_MSR & BIT(CAN_MSR_SLAK_BIT)) {
+        /* Bus activity wakes the controller up.  The frame itself is lost,
+         * as it is on the wire. */
+        s->CAN_MSR |= BIT(CAN_MSR_WKUI_BIT);
+        if(s->CAN_MCR & BIT(CAN_MCR_AWUM_BIT)) {
+            s->CAN_MCR &= ~BIT(CAN_MCR_SLEEP_BIT);
+            stm32_can_update_mode(s);
+        }
+        stm32_can_update_irq(s);
+        return;
+    }
+    /* The CANRX pin is ignored in loop back mode */
+    if((s->CAN_MSR & BIT(CAN_MSR_INAK_BIT)) ||
+       (s->CAN_BTR & BIT(CAN_BTR_LBKM_BIT))) {
+        return;
+    }
+
+    for(i = 0; i < count; i++) {
+        stm32_can_receive_frame(s, &frames[i]);
+    }
+    stm32_can_update_irq(s);
+}
+
+static CanBusClientInfo stm32_can_client_info = {
+    .receive = stm32_can_receive,
+};
+
+/* Send all the pending mailboxes as one batch */
+static void stm32_can_tx_bh(void *opaque)
+{
+    Stm32Can *s = (Stm32Can *)opaque;
+    QemuCanFrame frames[CAN_TX_MB_COUNT];
+    int order[CAN_TX_MB_COUNT];
+    bool loopback = s->CAN_BTR & BIT(CAN_BTR_LBKM_BIT);
+    bool silent = s->CAN_BTR & BIT(CAN_BTR_SILM_BIT);
+    int count = 0;
+    int i, j, n;
+
+    /* In silent mode, the controller can only talk to itself */
+    if((s->CAN_MSR & (BIT(CAN_MSR_INAK_BIT) | BIT(CAN_MSR_SLAK_BIT))) ||
+       (silent && !loopback)) {
+        return;
+    }
+
+    for(n = 0; n < CAN_TX_MB_COUNT; n++) {
+        if(s->CAN_TSR & BIT(CAN_TSR_TME_BIT(n))) {
+            continue;
+        }
+        for(j = count; j > 0 && stm32_can_tx_before(s, n, order[j - 1]);
+            j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = n;
+        count++;
+    }
+    if(!count) {
+        return;
+    }
+
+    for(i = 0; i < count; i++) {
+        n = order[i];
+        stm32_can_mailbox_to_frame(&s->tx_mb[n], &frames[i]);
+        s->tx_mb[n].IR &= ~BIT(CAN_TIR_TXRQ_BIT);
+        s->CAN_TSR &= ~CAN_TSR_FLAGS_MASK(n);
+        s->CAN_TSR |= BIT(CAN_TSR_RQCP_BIT(n)) | BIT(CAN_TSR_TXOK_BIT(n)) |
+                      BIT(CAN_TSR_TME_BIT(n));
+    }
+    DPRINTF("sending %d frames\n", count);
+
+    if(!silent) {
+        can_bus_client_send(&s->client, frames, count);
+    }
+    if(loopback) {
+        for(i = 0; i < count; i++) {
+            stm32_can_receive_frame(s, &frames[i]);
+        }
+    }
+    stm32_can_update_irq(s);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_can_reset_core(Stm32Can *s);
+
+static void stm32_can_CAN_MCR_write(Stm32Can *s, uint32_t new_value)
+{
+    if(new_value & BIT(CAN_MCR_RESET_BIT)) {
+        /* The filters are not reset */
+        stm32_can_reset_core(s);
+        return;
+    }
+    s->CAN_MCR = new_value & 0x000100ff;
+    stm32_can_update_mode(s);
+    stm32_can_update_irq(s);
+}
+
+static uint32_t stm32_can_CAN_TSR_read(Stm32Can *s)
+{
+    uint32_t value = s->CAN_TSR;
+    int n;
+
+    /* CODE is the next empty mailbox */
+    for(n = 0; n < CAN_TX_MB_COUNT; n++) {
+        if(value & BIT(CAN_TSR_TME_BIT(n))) {
+            value |= n << CAN_TSR_CODE_START;
+            break;
+        }
+    }
+    return value;
+}
+
+static void stm32_can_CAN_TSR_write(Stm32Can *s, uint32_t new_value)
+{
+    int n;
+
+    for(n = 0; n < CAN_TX_MB_COUNT; n++) {
+        if(new_value & BIT(CAN_TSR_RQCP_BIT(n))) {
+            s->CAN_TSR &= ~CAN_TSR_FLAGS_MASK(n);
+        }
+        if((new_value & BIT(CAN_TSR_ABRQ_BIT(n))) &&
+           !(s->CAN_TSR & BIT(CAN_TSR_TME_BIT(n)))) {
+            /* Not sent yet, so the abort always succeeds */
+            s->tx_mb[n].IR &= ~BIT(CAN_TIR_TXRQ_BIT);
+            s->CAN_TSR &= ~CAN_TSR_FLAGS_MASK(n);
+            s->CAN_TSR |= BIT(CAN_TSR_RQCP_BIT(n)) | BIT(CAN_TSR_TME_BIT(n));
+        }
+    }
+    stm32_can_update_irq(s);
+}
+
+static void stm32_can_CAN_RFR_write(Stm32Can *s, int fifo, uint32_t new_value)
+{
+    Stm32CanFifo *q = &s->rx_fifo[fifo];
+    uint32_t *rfr = &s->CAN_RFR[fifo];
+
+    *rfr &= ~(new_value & (BIT(CAN_RFR_FULL_BIT) | BIT(CAN_RFR_FOVR_BIT)));
+    if((new_value & BIT(CAN_RFR_RFOM_BIT)) && (*rfr & CAN_RFR_FMP_MASK)) {
+        q->head = (q->head + 1) % CAN_RX_FIFO_DEPTH;
+        *rfr = (*rfr - 1) & ~BIT(CAN_RFR_FULL_BIT);
+    }
+    stm32_can_update_irq(s);
+}
+
+/* The mailbox registers can only be written while the mailbox is empty */
+static void stm32_can_tx_mb_write(Stm32Can *s, int n, hwaddr offset,
+                                  uint32_t new_value)
+{
+    Stm32CanMailbox *mb = &s->tx_mb[n];
+
+    if(!(s->CAN_TSR & BIT(CAN_TSR_TME_BIT(n)))) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "stm32_can: write to pending mailbox %d\n", n);
+        return;
+    }
+
+    switch(offset) {
+        case CAN_MB_IR_OFFSET:
+            mb->IR = new_value;
+            if(new_value & BIT(CAN_TIR_TXRQ_BIT)) {
+                s->CAN_TSR &= ~BIT(CAN_TSR_TME_BIT(n));
+                s->tx_seq[n] = s->tx_seq_next++;
+                qemu_bh_schedule(s->tx_bh);
+            }
+            break;
+        case CAN_MB_DTR_OFFSET:
+            mb->DTR = new_value & 0xffff010f;
+            break;
+        case CAN_MB_DLR_OFFSET:
+            mb->DLR = new_value;
+            break;
+        case CAN_MB_DHR_OFFSET:
+            mb->DHR = new_value;
+            break;
+    }
+}
+
+static uint32_t stm32_can_mb_read(Stm32CanMailbox *mb, hwaddr offset)
+{
+    switch(offset) {
+        case CAN_MB_IR_OFFSET:
+            return mb->IR;
+        case CAN_MB_DTR_OFFSET:
+            return mb->DTR;
+        case CAN_MB_DLR_OFFSET:
+            return mb->DLR;
+        default:
+            return mb->DHR;
+    }
+}
+
+static uint64_t stm32_can_filter_read(Stm32Can *s, hwaddr offset,
+                                      unsigned size)
+{
+    switch(offset) {
+        case CAN_FMR_OFFSET:
+            return s->CAN_FMR;
+        case CAN_FM1R_OFFSET:
+            return s->CAN_FM1R;
+        case CAN_FS1R_OFFSET:
+            return s->CAN_FS1R;
+        case CAN_FFA1R_OFFSET:
+            return s->CAN_FFA1R;
+        case CAN_FA1R_OFFSET:
+            return s->CAN_FA1R;
+        case CAN_FR_START ... CAN_FR_END - 1:
+            return s->CAN_FR[(offset - CAN_FR_START) / 8][(offset >> 2) & 1];
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+/* FM1R, FS1R and FFA1R can only be written in filter initialization mode,
+ * and a filter bank only while it is inactive or in that mode.  The
+ * filters are compiled again when they can next take effect. */
+static void stm32_can_filter_write(Stm32Can *s, hwaddr offset,
+                                   uint32_t new_value, unsigned size)
+{
+    bool finit = s->CAN_FMR & BIT(CAN_FMR_FINIT_BIT);
+    uint32_t banks_mask = BIT(CAN_FILTER_BANKS) - 1;
+    int bank;
+
+    switch(offset) {
+        case CAN_FMR_OFFSET:
+            s->CAN_FMR = (s->CAN_FMR & ~CAN_FMR_WRITE_MASK) |
+                         (new_value & CAN_FMR_WRITE_MASK);
+            if(finit && !(new_value & BIT(CAN_FMR_FINIT_BIT))) {
+                stm32_can_compile_filters(s);
+            }
+            return;
+        case CAN_FA1R_OFFSET:
+            s->CAN_FA1R = new_value & banks_mask;
+            stm32_can_compile_filters(s);
+            return;
+        case CAN_FR_START ... CAN_FR_END - 1:
+            bank = (offset - CAN_FR_START) / 8;
+            if(!finit && (s->CAN_FA1R & BIT(bank))) {
+                break;
+            }
+            s->CAN_FR[bank][(offset >> 2) & 1] = new_value;
+            return;
+    }
+
+    if(!finit) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "stm32_can: filter register 0x%x written outside "
+                      "of filter initialization mode\n", (int)offset);
+        return;
+    }
+    switch(offset) {
+        case CAN_FM1R_OFFSET:
+            s->CAN_FM1R = new_value & banks_mask;
+            break;
+        case CAN_FS1R_OFFSET:
+            s->CAN_FS1R = new_value & banks_mask;
+            break;
+        case CAN_FFA1R_OFFSET:
+            s->CAN_FFA1R = new_value & banks_mask;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static uint64_t stm32_can_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Can *s = (Stm32Can *)opaque;
+    Stm32CanFifo *q;
+
+    switch (offset) {
+        case CAN_MCR_OFFSET:
+            return s->CAN_MCR;
+        case CAN_MSR_OFFSET:
+            return s->CAN_MSR;
+        case CAN_TSR_OFFSET:
+            return stm32_can_CAN_TSR_read(s);
+        case CAN_RFR_OFFSET(0):
+            return s->CAN_RFR[0];
+        case CAN_RFR_OFFSET(1):
+            return s->CAN_RFR[1];
+        case CAN_IER_OFFSET:
+            return s->CAN_IER;
+        case CAN_ESR_OFFSET:
+            return s->CAN_ESR;
+        case CAN_BTR_OFFSET:
+            return s->CAN_BTR;
+        case CAN_TX_MB_START ... CAN_TX_MB_END - 1:
+            return stm32_can_mb_read(
+                        &s->tx_mb[(offset - CAN_TX_MB_START) / 0x10],
+                        offset & 0xc);
+        case CAN_RX_MB_START ... CAN_RX_MB_END - 1:
+            q = &s->rx_fifo[(offset - CAN_RX_MB_START) / 0x10];
+            return stm32_can_mb_read(&q->mb[q->head], offset & 0xc);
+        case CAN_FILTER_START ... CAN_FILTER_END - 1:
+            if(!s->master) {
+                return stm32_can_filter_read(s, offset, size);
+            }
+            /* fall through: CAN2 has no filter registers */
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_can_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Can *s = (Stm32Can *)opaque;
+
+    stm32_rcc_check_periph_clk(s->stm32_rcc, s->periph);
+
+    switch (offset) {
+        case CAN_MCR_OFFSET:
+            stm32_can_CAN_MCR_write(s, value);
+            break;
+        case CAN_MSR_OFFSET:
+            s->CAN_MSR &= ~(value & (BIT(CAN_MSR_ERRI_BIT) |
+                                     BIT(CAN_MSR_WKUI_BIT) |
+                                     BIT(CAN_MSR_SLAKI_BIT)));
+            stm32_can_update_irq(s);
+            break;
+        case CAN_TSR_OFFSET:
+            stm32_can_CAN_TSR_write(s, value);
+            break;
+        case CAN_RFR_OFFSET(0):
+            stm32_can_CAN_RFR_write(s, 0, value);
+            break;
+        case CAN_RFR_OFFSET(1):
+            stm32_can_CAN_RFR_write(s, 1, value);
+            break;
+        case CAN_IER_OFFSET:
+            s->CAN_IER = value & 0x00038f7f;
+            stm32_can_update_irq(s);
+            break;
+        case CAN_ESR_OFFSET:
+            s->CAN_ESR = (s->CAN_ESR & ~CAN_ESR_LEC_MASK) |
+                         (value & CAN_ESR_LEC_MASK);
+            break;
+        case CAN_BTR_OFFSET:
+            if(!(s->CAN_MSR & BIT(CAN_MSR_INAK_BIT))) {
+                qemu_log_mask(LOG_GUEST_ERROR,
+                              "stm32_can: BTR written outside of "
+                              "initialization mode\n");
+                break;
+            }
+            s->CAN_BTR = value & 0xc37f03ff;
+            break;
+        case CAN_TX_MB_START ... CAN_TX_MB_END - 1:
+            stm32_can_tx_mb_write(s, (offset - CAN_TX_MB_START) / 0x10,
+                                  offset & 0xc, value);
+            break;
+        case CAN_RX_MB_START ... CAN_RX_MB_END - 1:
+            STM32_RO_REG(offset);
+            break;
+        case CAN_FILTER_START ... CAN_FILTER_END - 1:
+            if(!s->master) {
+                stm32_can_filter_write(s, offset, value, size);
+                break;
+            }
+            /* fall through: CAN2 has no filter registers */
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_can_ops = {
+    .read = stm32_can_read,
+    .write = stm32_can_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+/* The state MCR RESET puts the controller in: sleep mode, with empty
+ * mailboxes */
+static void stm32_can_reset_core(Stm32Can *s)
+{
+    s->CAN_MCR = 0x00010002;
+    s->CAN_MSR = CAN_MSR_IDLE | BIT(CAN_MSR_SLAK_BIT);
+    s->CAN_TSR = BIT(CAN_TSR_TME_BIT(0)) | BIT(CAN_TSR_TME_BIT(1)) |
+                 BIT(CAN_TSR_TME_BIT(2));
+    s->CAN_RFR[0] = 0;
+    s->CAN_RFR[1] = 0;
+    s->CAN_IER = 0;
+    s->CAN_ESR = 0;
+    s->CAN_BTR = 0x01230000;
+    memset(s->tx_mb, 0, sizeof(s->tx_mb));
+    memset(s->rx_fifo, 0, sizeof(s->rx_fifo));
+    memset(s->tx_seq, 0, sizeof(s->tx_seq));
+    s->tx_seq_next = 0;
+
+    stm32_can_update_irq(s);
+}
+
+static void stm32_can_reset(DeviceState *dev)
+{
+    Stm32Can *s = STM32_CAN(dev);
+
+    stm32_can_reset_core(s);
+
+    if(!s->master) {
+        s->CAN_FMR = 0x2a1c0e01;
+        s->CAN_FM1R = 0;
+        s->CAN_FS1R = 0;
+        s->CAN_FFA1R = 0;
+        s->CAN_FA1R = 0;
+        memset(s->CAN_FR, 0, sizeof(s->CAN_FR));
+        stm32_can_compile_filters(s);
+    }
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_can_init(SysBusDevice *dev)
+{
+    Stm32Can *s = STM32_CAN(dev);
+    int i;
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+    s->master = (Stm32Can *)s->master_prop;
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_can_ops, s,
+                          "can", CAN_REGION_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    for(i = 0; i < ARRAY_SIZE(s->irq); i++) {
+        sysbus_init_irq(dev, &s->irq[i]);
+    }
+    s->tx_bh = qemu_bh_new(stm32_can_tx_bh, s);
+
+    if(!s->master) {
+        for(i = 0; i < ARRAY_SIZE(s->filters); i++) {
+            s->filters[i].list32 = g_hash_table_new(NULL, NULL);
+            s->filters[i].list16 = g_hash_table_new(NULL, NULL);
+        }
+    }
+
+    s->client.info = &stm32_can_client_info;
+    if(s->bus_prop) {
+        can_bus_insert_client((CanBusState *)s->bus_prop, &s->client);
+    }
+
+    return 0;
+}
+
+static int stm32_can_post_load(void *opaque, int version_id)
+{
+    Stm32Can *s = (Stm32Can *)opaque;
+
+    if(!s->master) {
+        stm32_can_compile_filters(s);
+    }
+    stm32_can_update_irq(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_can_mailbox = {
+    .name = TYPE_STM32_CAN "-mailbox",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(IR, Stm32CanMailbox),
+        VMSTATE_UINT32(DTR, Stm32CanMailbox),
+        VMSTATE_UINT32(DLR, Stm32CanMailbox),
+        VMSTATE_UINT32(DHR, Stm32CanMailbox),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_stm32_can_fifo = {
+    .name = TYPE_STM32_CAN "-fifo",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(mb, Stm32CanFifo, CAN_RX_FIFO_DEPTH, 1,
+                             vmstate_stm32_can_mailbox, Stm32CanMailbox),
+        VMSTATE_UINT32(head, Stm32CanFifo),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_stm32_can = {
+    .name = TYPE_STM32_CAN,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_can_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(CAN_MCR, Stm32Can),
+        VMSTATE_UINT32(CAN_MSR, Stm32Can),
+        VMSTATE_UINT32(CAN_TSR, Stm32Can),
+        VMSTATE_UINT32_ARRAY(CAN_RFR, Stm32Can, CAN_RX_FIFO_COUNT),
+        VMSTATE_UINT32(CAN_IER, Stm32Can),
+        VMSTATE_UINT32(CAN_ESR, Stm32Can),
+        VMSTATE_UINT32(CAN_BTR, Stm32Can),
+        VMSTATE_STRUCT_ARRAY(tx_mb, Stm32Can, CAN_TX_MB_COUNT, 1,
+                             vmstate_stm32_can_mailbox, Stm32CanMailbox),
+        VMSTATE_STRUCT_ARRAY(rx_fifo, Stm32Can, CAN_RX_FIFO_COUNT, 1,
+                             vmstate_stm32_can_fifo, Stm32CanFifo),
+        VMSTATE_UINT32_ARRAY(tx_seq, Stm32Can, CAN_TX_MB_COUNT),
+        VMSTATE_UINT32(tx_seq_next, Stm32Can),
+        VMSTATE_UINT32(CAN_FMR, Stm32Can),
+        VMSTATE_UINT32(CAN_FM1R, Stm32Can),
+        VMSTATE_UINT32(CAN_FS1R, Stm32Can),
+        VMSTATE_UINT32(CAN_FFA1R, Stm32Can),
+        VMSTATE_UINT32(CAN_FA1R, Stm32Can),
+        VMSTATE_UINT32_2DARRAY(CAN_FR, Stm32Can, CAN_FILTER_BANKS, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_can_properties[] = {
+    DEFINE_PROP_PERIPH_T("periph", Stm32Can, periph, STM32_PERIPH_UNDEFINED),
+    DEFINE_PROP_PTR("stm32_rcc", Stm32Can, stm32_rcc_prop),
+    DEFINE_PROP_PTR("canbus", Stm32Can, bus_prop),
+    DEFINE_PROP_PTR("master", Stm32Can, master_prop),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_can_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_can_init;
+    dc->reset = stm32_can_reset;
+    dc->vmsd = &vmstate_stm32_can;
+    dc->props = stm32_can_properties;
+}
+
+static TypeInfo stm32_can_info = {
+    .name  = TYPE_STM32_CAN,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Can),
+    .class_init = stm32_can_class_init
+};
+
+static void stm32_can_register_types(void)
+{
+    type_register_static(&stm32_can_info);
+}
+
+type_init(stm32_can_register_types)
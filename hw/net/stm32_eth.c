@@ -0,0 +1,915 @@
+/*
+ * STM32 Microcontroller Ethernet MAC
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ * (connectivity line devices, STM32F105/107)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The MAC and its DMA controller, with the normal (16 byte) descriptor
+ * format in ring or chained mode, and a PHY with the DP83848 status
+ * register.  Frames are sent as soon as the firmware hands the descriptors
+ * over: a transmit poll demand walks the TX ring until it runs out of
+ * descriptors owned by the DMA, and a received frame is written to as many
+ * RX descriptors as it needs in one go.  Descriptors are read whole with a
+ * single DMA access.  The status flags are updated as the frames go, but
+ * the interrupt line is only updated from a bottom half, so that a burst of
+ * frames raises one interrupt instead of one per frame.
+ *
+ * The MMC counters read as 0, and PTP, power management, flow control and
+ * the hash filter are not implemented (multicast frames are all accepted).
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "exec/address-spaces.h"
+#include "net/net.h"
+#include "sysemu/dma.h"
+#include "qemu/bitops.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include <zlib.h>
+
+
+
+/* DEFINITIONS*/
+
+//#define DEBUG_STM32_ETH
+
+#ifdef DEBUG_STM32_ETH
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_ETH: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+/* The MAC, MMC, PTP and DMA register blocks take 8 KB */
+#define ETH_REGION_SIZE 0x2000
+
+#define ETH_MACCR_OFFSET 0x0000
+#define ETH_MACCR_RE_BIT 2
+#define ETH_MACCR_TE_BIT 3
+
+#define ETH_MACFFR_OFFSET 0x0004
+#define ETH_MACFFR_PM_BIT 0
+#define ETH_MACFFR_BFD_BIT 5
+#define ETH_MACFFR_RA_BIT 31
+
+#define ETH_MACHTHR_OFFSET 0x0008
+#define ETH_MACHTLR_OFFSET 0x000c
+
+#define ETH_MACMIIAR_OFFSET 0x0010
+#define ETH_MACMIIAR_MB_BIT 0
+#define ETH_MACMIIAR_MW_BIT 1
+#define ETH_MACMIIAR_MR_START 6
+#define ETH_MACMIIAR_PA_START 11
+
+#define ETH_MACMIIDR_OFFSET 0x0014
+#define ETH_MACFCR_OFFSET 0x0018
+#define ETH_MACVLANTR_OFFSET 0x001c
+#define ETH_MACSR_OFFSET 0x0038
+#define ETH_MACIMR_OFFSET 0x003c
+
+/* MAC address n (0 to 3) high and low registers */
+#define ETH_MACAHR_OFFSET(n) (0x0040 + (n) * 8)
+#define ETH_MACALR_OFFSET(n) (0x0044 + (n) * 8)
+#define ETH_MACAHR_AE_BIT 31
+#define ETH_MAC_ADDR_COUNT 4
+#define ETH_MACA_START ETH_MACAHR_OFFSET(0)
+#define ETH_MACA_END ETH_MACAHR_OFFSET(ETH_MAC_ADDR_COUNT)
+
+#define ETH_MMC_START 0x0100
+#define ETH_MMC_END 0x0200
+
+#define ETH_DMABMR_OFFSET 0x1000
+#define ETH_DMABMR_SR_BIT 0
+#define ETH_DMABMR_DSL_START 2
+
+#define ETH_DMATPDR_OFFSET 0x1004
+#define ETH_DMARPDR_OFFSET 0x1008
+#define ETH_DMARDLAR_OFFSET 0x100c
+#define ETH_DMATDLAR_OFFSET 0x1010
+
+#define ETH_DMASR_OFFSET 0x1014
+#define ETH_DMASR_TS_BIT 0
+#define ETH_DMASR_TBUS_BIT 2
+#define ETH_DMASR_RS_BIT 6
+#define ETH_DMASR_RBUS_BIT 7
+#define ETH_DMASR_AIS_BIT 15
+#define ETH_DMASR_NIS_BIT 16
+#define ETH_DMASR_RPS_START 17
+#define ETH_DMASR_TPS_START 20
+/* The interrupt flags, and the ones of them summarized by NIS (the others
+ * are summarized by AIS) */
+#define ETH_DMASR_FLAGS_MASK 0x000067ff
+#define ETH_DMASR_NORMAL_MASK 0x00004045
+
+#define ETH_DMAOMR_OFFSET 0x1018
+#define ETH_DMAOMR_SR_BIT 1
+#define ETH_DMAOMR_ST_BIT 13
+
+#define ETH_DMAIER_OFFSET 0x101c
+#define ETH_DMAMFBOCR_OFFSET 0x1020
+#define ETH_DMACHTDR_OFFSET 0x1048
+#define ETH_DMACHRDR_OFFSET 0x104c
+#define ETH_DMACHTBAR_OFFSET 0x1050
+#define ETH_DMACHRBAR_OFFSET 0x1054
+
+/* DMA process states (DMASR RPS and TPS) */
+#define ETH_DMA_STOPPED 0
+#define ETH_DMA_RUNNING 3
+#define ETH_DMA_SUSPENDED 6
+
+/* Descriptor word 0 */
+#define ETH_DES0_OWN (1U << 31)
+#define ETH_TDES0_IC (1 << 30)
+#define ETH_TDES0_LS (1 << 29)
+#define ETH_TDES0_FS (1 << 28)
+#define ETH_TDES0_TER (1 << 21)
+#define ETH_TDES0_TCH (1 << 20)
+#define ETH_RDES0_FL_START 16
+#define ETH_RDES0_FS (1 << 9)
+#define ETH_RDES0_LS (1 << 8)
+
+/* Descriptor word 1 */
+#define ETH_RDES1_DIC (1U << 31)
+#define ETH_RDES1_RER (1 << 15)
+#define ETH_RDES1_RCH (1 << 14)
+#define ETH_DES1_BS1(des1) ((des1) & 0x1fff)
+#define ETH_DES1_BS2(des1) (((des1) >> 16) & 0x1fff)
+
+/* The most RX descriptors a frame may be spread over */
+#define ETH_RX_DESC_MAX 64
+
+/* Large enough for a jumbo frame */
+#define ETH_FRAME_MAX 16384
+
+/* PHY registers (IEEE 802.3 and the DP83848 PHY status register) */
+#define ETH_PHY_BMCR 0x00
+#define ETH_PHY_BMCR_RESET 0x8000
+#define ETH_PHY_BMSR 0x01
+#define ETH_PHY_IDR1 0x02
+#define ETH_PHY_IDR2 0x03
+#define ETH_PHY_ANAR 0x04
+#define ETH_PHY_ANLPAR 0x05
+#define ETH_PHY_STS 0x10
+#define ETH_PHY_REG_COUNT 32
+
+typedef struct Stm32EthDesc {
+    uint32_t des0, des1, des2, des3;
+} Stm32EthDesc;
+
+struct Stm32Eth {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    void *stm32_rcc_prop;
+    void *as_prop;
+    NICConf conf;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32Rcc *stm32_rcc;
+    /* Address space the descriptors and buffers are in */
+    AddressSpace *as;
+    NICState *nic;
+
+    /* Register Values */
+    uint32_t
+        ETH_MACCR,
+        ETH_MACFFR,
+        ETH_MACHTHR,
+        ETH_MACHTLR,
+        ETH_MACMIIAR,
+        ETH_MACMIIDR,
+        ETH_MACFCR,
+        ETH_MACVLANTR,
+        ETH_MACIMR,
+        ETH_MACAHR[ETH_MAC_ADDR_COUNT],
+        ETH_MACALR[ETH_MAC_ADDR_COUNT],
+        ETH_DMABMR,
+        ETH_DMARDLAR,
+        ETH_DMATDLAR,
+        ETH_DMASR,
+        ETH_DMAOMR,
+        ETH_DMAIER,
+        ETH_DMAMFBOCR;
+
+    /* Current descriptors and buffers (DMACHxDR/DMACHxBAR) */
+    uint32_t cur_rx_desc, cur_tx_desc;
+    uint32_t cur_rx_buf, cur_tx_buf;
+
+    uint16_t phy_regs[ETH_PHY_REG_COUNT];
+
+    /* Set while a sent frame is queued by the net layer.  The TX ring is
+     * walked again from stm32_eth_tx_done. */
+    bool tx_pending;
+
+    /* Updates the interrupt line once per burst, see stm32_eth_update_irq */
+    QEMUBH *irq_bh;
+    qemu_irq irq;
+
+    uint8_t tx_frame[ETH_FRAME_MAX];
+};
+
+static const uint8_t stm32_eth_broadcast[6] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_eth_irq_bh(void *opaque)
+{
+    Stm32Eth *s = (Stm32Eth *)opaque;
+    uint32_t pending = s->ETH_DMASR & s->ETH_DMAIER;
+
+    qemu_set_irq(s->irq, !!(pending & (BIT(ETH_DMASR_NIS_BIT) |
+                                       BIT(ETH_DMASR_AIS_BIT))));
+}
+
+/* Recompute the NIS and AIS summary bits from the flags, and schedule the
+ * interrupt line update.  Several calls before the bottom half runs result
+ * in a single update. */
+static void stm32_eth_update_irq(Stm32Eth *s)
+{
+    uint32_t pending = s->ETH_DMASR & s->ETH_DMAIER & ETH_DMASR_FLAGS_MASK;
+
+    if(pending & ETH_DMASR_NORMAL_MASK) {
+        s->ETH_DMASR |= BIT(ETH_DMASR_NIS_BIT);
+    }
+    if(pending & ~ETH_DMASR_NORMAL_MASK) {
+        s->ETH_DMASR |= BIT(ETH_DMASR_AIS_BIT);
+    }
+    qemu_bh_schedule(s->irq_bh);
+}
+
+static void stm32_eth_set_rx_state(Stm32Eth *s, uint32_t state)
+{
+    s->ETH_DMASR = deposit32(s->ETH_DMASR, ETH_DMASR_RPS_START, 3, state);
+}
+
+static void stm32_eth_set_tx_state(Stm32Eth *s, uint32_t state)
+{
+    s->ETH_DMASR = deposit32(s->ETH_DMASR, ETH_DMASR_TPS_START, 3, state);
+}
+
+static void stm32_eth_read_desc(Stm32Eth *s, uint32_t addr, Stm32EthDesc *d)
+{
+    dma_memory_read(s->as, addr, d, sizeof(*d));
+    d->des0 = le32_to_cpu(d->des0);
+    d->des1 = le32_to_cpu(d->des1);
+    d->des2 = le32_to_cpu(d->des2);
+    d->des3 = le32_to_cpu(d->des3);
+}
+
+/* Only the status word is written back, which also hands the descriptor
+ * back to the firmware. */
+static void stm32_eth_write_des0(Stm32Eth *s, uint32_t addr, uint32_t des0)
+{
+    des0 = cpu_to_le32(des0);
+    dma_memory_write(s->as, addr, &des0, sizeof(des0));
+}
+
+/* Address of the descriptor following the one at addr.  end_of_ring and
+ * chained are the TER/RER and TCH/RCH bits of the descriptor. */
+static uint32_t stm32_eth_next_desc(Stm32Eth *s, uint32_t addr,
+                                    Stm32EthDesc *d, uint32_t base,
+                                    bool end_of_ring, bool chained)
+{
+    if(end_of_ring) {
+        return base;
+    } else if(chained) {
+        return d->des3;
+    }
+    return addr + sizeof(*d) +
+           extract32(s->ETH_DMABMR, ETH_DMABMR_DSL_START, 5) * 4;
+}
+
+static void stm32_eth_tx_done(NetClientState *nc, ssize_t len);
+
+/* Send the frames of all the descriptors owned by the DMA.  The TS flag is
+ * raised once for the whole walk. */
+static void stm32_eth_tx(Stm32Eth *s)
+{
+    Stm32EthDesc d;
+    uint32_t addr, len1, len2;
+    int frame_len = 0;
+    bool interrupt = false;
+
+    if(!extract32(s->ETH_DMAOMR, ETH_DMAOMR_ST_BIT, 1) || s->tx_pending) {
+        return;
+    }
+
+    stm32_eth_set_tx_state(s, ETH_DMA_RUNNING);
+    while(true) {
+        addr = s->cur_tx_desc;
+        stm32_eth_read_desc(s, addr, &d);
+        if(!(d.des0 & ETH_DES0_OWN)) {
+            s->ETH_DMASR |= BIT(ETH_DMASR_TBUS_BIT);
+            stm32_eth_set_tx_state(s, ETH_DMA_SUSPENDED);
+            break;
+        }
+
+        if(d.des0 & ETH_TDES0_FS) {
+            frame_len = 0;
+        }
+        len1 = MIN(ETH_DES1_BS1(d.des1), ETH_FRAME_MAX - frame_len);
+        dma_memory_read(s->as, d.des2, s->tx_frame + frame_len, len1);
+        frame_len += len1;
+        s->cur_tx_buf = d.des2;
+        if(!(d.des0 & ETH_TDES0_TCH)) {
+            len2 = MIN(ETH_DES1_BS2(d.des1), ETH_FRAME_MAX - frame_len);
+            dma_memory_read(s->as, d.des3, s->tx_frame + frame_len, len2);
+            frame_len += len2;
+        }
+
+        s->cur_tx_desc = stm32_eth_next_desc(s, addr, &d, s->ETH_DMATDLAR,
+                                             d.des0 & ETH_TDES0_TER,
+                                             d.des0 & ETH_TDES0_TCH);
+        stm32_eth_write_des0(s, addr, d.des0 & ~ETH_DES0_OWN);
+
+        if(d.des0 & ETH_TDES0_LS) {
+            if(d.des0 & ETH_TDES0_IC) {
+                interrupt = true;
+            }
+            DPRINTF("TX frame of %d bytes\n", frame_len);
+            if(extract32(s->ETH_MACCR, ETH_MACCR_TE_BIT, 1) &&
+               qemu_send_packet_async(qemu_get_queue(s->nic), s->tx_frame,
+                                      frame_len, stm32_eth_tx_done) == 0) {
+                /* Queued by the net layer; carry on when it is sent */
+                s->tx_pending = true;
+                break;
+            }
+            frame_len = 0;
+        }
+    }
+
+    if(interrupt) {
+        s->ETH_DMASR |= BIT(ETH_DMASR_TS_BIT);
+    }
+    stm32_eth_update_irq(s);
+}
+
+static void stm32_eth_tx_done(NetClientState *nc, ssize_t len)
+{
+    Stm32Eth *s = qemu_get_nic_opaque(nc);
+
+    s->tx_pending = false;
+    stm32_eth_tx(s);
+}
+
+static bool stm32_eth_rx_enabled(Stm32Eth *s)
+{
+    return extract32(s->ETH_MACCR, ETH_MACCR_RE_BIT, 1) &&
+           extract32(s->ETH_DMAOMR, ETH_DMAOMR_SR_BIT, 1);
+}
+
+/* Called when the firmware may have made room for frames the net layer
+ * is holding back. */
+static void stm32_eth_rx_resume(Stm32Eth *s)
+{
+    if(stm32_eth_rx_enabled(s)) {
+        stm32_eth_set_rx_state(s, ETH_DMA_RUNNING);
+        qemu_flush_queued_packets(qemu_get_queue(s->nic));
+    }
+}
+
+static bool stm32_eth_rx_filter(Stm32Eth *s, const uint8_t *buf)
+{
+    uint8_t mac[6];
+    int i;
+
+    if(s->ETH_MACFFR & (BIT(ETH_MACFFR_RA_BIT) | BIT(ETH_MACFFR_PM_BIT))) {
+        return true;
+    }
+    if(!memcmp(buf, stm32_eth_broadcast, sizeof(mac))) {
+        return !extract32(s->ETH_MACFFR, ETH_MACFFR_BFD_BIT, 1);
+    }
+    if(buf[0] & 1) {
+        return true;
+    }
+
+    for(i = 0; i < ETH_MAC_ADDR_COUNT; i++) {
+        if(i > 0 && !extract32(s->ETH_MACAHR[i], ETH_MACAHR_AE_BIT, 1)) {
+            continue;
+        }
+        mac[0] = s->ETH_MACALR[i];
+        mac[1] = s->ETH_MACALR[i] >> 8;
+        mac[2] = s->ETH_MACALR[i] >> 16;
+        mac[3] = s->ETH_MACALR[i] >> 24;
+        mac[4] = s->ETH_MACAHR[i];
+        mac[5] = s->ETH_MACAHR[i] >> 8;
+        if(!memcmp(buf, mac, sizeof(mac))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+
+/* NETWORK CLIENT */
+
+static int stm32_eth_can_receive(NetClientState *nc)
+{
+    Stm32Eth *s = qemu_get_nic_opaque(nc);
+
+    return stm32_eth_rx_enabled(s);
+}
+
+/* The frame, followed by its CRC, is written to the descriptors it needs,
+ * which are all read before anything is written.  If there are not enough
+ * of them, the frame stays queued in the net layer until the firmware
+ * issues a receive poll demand. */
+static ssize_t stm32_eth_receive(NetClientState *nc, const uint8_t *buf,
+                                 size_t size)
+{
+    Stm32Eth *s = qemu_get_nic_opaque(nc);
+    Stm32EthDesc d[ETH_RX_DESC_MAX];
+    uint32_t addr[ETH_RX_DESC_MAX + 1];
+    uint32_t crc, des0, len;
+    size_t frame_len = size + 4, room = 0, done = 0;
+    int count, i;
+
+    if(!stm32_eth_rx_enabled(s)) {
+        return 0;
+    }
+    if(size < 12 || !stm32_eth_rx_filter(s, buf)) {
+        return size;
+    }
+
+    addr[0] = s->cur_rx_desc;
+    for(count = 0; count < ETH_RX_DESC_MAX && room < frame_len; count++) {
+        stm32_eth_read_desc(s, addr[count], &d[count]);
+        if(!(d[count].des0 & ETH_DES0_OWN)) {
+            s->ETH_DMASR |= BIT(ETH_DMASR_RBUS_BIT);
+            stm32_eth_set_rx_state(s, ETH_DMA_SUSPENDED);
+            stm32_eth_update_irq(s);
+            return 0;
+        }
+        room += ETH_DES1_BS1(d[count].des1);
+        if(!(d[count].des1 & ETH_RDES1_RCH)) {
+            room += ETH_DES1_BS2(d[count].des1);
+        }
+        addr[count + 1] = stm32_eth_next_desc(s, addr[count], &d[count],
+                                              s->ETH_DMARDLAR,
+                                              d[count].des1 & ETH_RDES1_RER,
+                                              d[count].des1 & ETH_RDES1_RCH);
+    }
+    if(room < frame_len) {
+        /* Larger than the ring can take */
+        return size;
+    }
+
+    crc = cpu_to_le32(crc32(0, buf, size));
+    for(i = 0; i < count; i++) {
+        len = MIN(ETH_DES1_BS1(d[i].des1), frame_len - done);
+        s->cur_rx_buf = d[i].des2;
+        if(done < size) {
+            dma_memory_write(s->as, d[i].des2, buf + done,
+                             MIN(len, size - done));
+        }
+        if(done + len > size) {
+            dma_memory_write(s->as, d[i].des2 + MAX(size, done) - done,
+                             (uint8_t *)&crc + MAX(size, done) - size,
+                             done + len - MAX(size, done));
+        }
+        done += len;
+
+        if(!(d[i].des1 & ETH_RDES1_RCH) && done < frame_len) {
+            len = MIN(ETH_DES1_BS2(d[i].des1), frame_len - done);
+            if(done < size) {
+                dma_memory_write(s->as, d[i].des3, buf + done,
+                                 MIN(len, size - done));
+            }
+            if(done + len > size) {
+                dma_memory_write(s->as, d[i].des3 + MAX(size, done) - done,
+                                 (uint8_t *)&crc + MAX(size, done) - size,
+                                 done + len - MAX(size, done));
+            }
+            done += len;
+        }
+
+        des0 = 0;
+        if(i == 0) {
+            des0 |= ETH_RDES0_FS;
+        }
+        if(i == count - 1) {
+            des0 |= ETH_RDES0_LS | (frame_len << ETH_RDES0_FL_START);
+        }
+        stm32_eth_write_des0(s, addr[i], des0);
+    }
+    s->cur_rx_desc = addr[count];
+
+    DPRINTF("RX frame of %zu bytes in %d descriptors\n", size, count);
+    if(!(d[count - 1].des1 & ETH_RDES1_DIC)) {
+        s->ETH_DMASR |= BIT(ETH_DMASR_RS_BIT);
+    }
+    stm32_eth_update_irq(s);
+    return size;
+}
+
+static void stm32_eth_cleanup(NetClientState *nc)
+{
+    Stm32Eth *s = qemu_get_nic_opaque(nc);
+
+    s->nic = NULL;
+}
+
+static NetClientInfo net_stm32_eth_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_NIC,
+    .size = sizeof(NICState),
+    .can_receive = stm32_eth_can_receive,
+    .receive = stm32_eth_receive,
+    .cleanup = stm32_eth_cleanup,
+};
+
+
+
+
+/* PHY */
+
+static void stm32_eth_phy_reset(Stm32Eth *s)
+{
+    memset(s->phy_regs, 0, sizeof(s->phy_regs));
+    /* Autonegotiation complete, 100BASE-TX full duplex */
+    s->phy_regs[ETH_PHY_BMCR] = 0x3100;
+    s->phy_regs[ETH_PHY_BMSR] = 0x782d;
+    s->phy_regs[ETH_PHY_IDR1] = 0x2000;
+    s->phy_regs[ETH_PHY_IDR2] = 0x5c90;
+    s->phy_regs[ETH_PHY_ANAR] = 0x01e1;
+    s->phy_regs[ETH_PHY_ANLPAR] = 0x45e1;
+    /* Link up, 100 Mb/s, full duplex, autonegotiation complete */
+    s->phy_regs[ETH_PHY_STS] = 0x0015;
+}
+
+/* SMI accesses complete immediately, so MB is never seen set */
+static void stm32_eth_ETH_MACMIIAR_write(Stm32Eth *s, uint32_t new_value)
+{
+    unsigned reg = extract32(new_value, ETH_MACMIIAR_MR_START, 5);
+
+    if(extract32(new_value, ETH_MACMIIAR_MB_BIT, 1)) {
+        if(extract32(new_value, ETH_MACMIIAR_MW_BIT, 1)) {
+            if(reg == ETH_PHY_BMCR &&
+               (s->ETH_MACMIIDR & ETH_PHY_BMCR_RESET)) {
+                stm32_eth_phy_reset(s);
+            } else if(reg == ETH_PHY_BMCR || reg == ETH_PHY_ANAR) {
+                s->phy_regs[reg] = s->ETH_MACMIIDR;
+            }
+        } else {
+            s->ETH_MACMIIDR = s->phy_regs[reg];
+        }
+    }
+    s->ETH_MACMIIAR = new_value & ~BIT(ETH_MACMIIAR_MB_BIT);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_eth_reset(DeviceState *dev);
+
+static void stm32_eth_ETH_DMABMR_write(Stm32Eth *s, uint32_t new_value)
+{
+    if(extract32(new_value, ETH_DMABMR_SR_BIT, 1)) {
+        /* The software reset completes immediately */
+        stm32_eth_reset(DEVICE(s));
+        return;
+    }
+    s->ETH_DMABMR = new_value & 0x03ffffff;
+}
+
+static void stm32_eth_ETH_DMAOMR_write(Stm32Eth *s, uint32_t new_value)
+{
+    s->ETH_DMAOMR = new_value & 0x0731e0de;
+
+    if(extract32(new_value, ETH_DMAOMR_ST_BIT, 1)) {
+        stm32_eth_tx(s);
+    } else {
+        stm32_eth_set_tx_state(s, ETH_DMA_STOPPED);
+    }
+    if(extract32(new_value, ETH_DMAOMR_SR_BIT, 1)) {
+        stm32_eth_rx_resume(s);
+    } else {
+        stm32_eth_set_rx_state(s, ETH_DMA_STOPPED);
+    }
+    stm32_eth_update_irq(s);
+}
+
+static uint64_t stm32_eth_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Eth *s = (Stm32Eth *)opaque;
+    uint32_t value;
+    int n;
+
+    switch (offset) {
+        case ETH_MACCR_OFFSET:
+            return s->ETH_MACCR;
+        case ETH_MACFFR_OFFSET:
+            return s->ETH_MACFFR;
+        case ETH_MACHTHR_OFFSET:
+            return s->ETH_MACHTHR;
+        case ETH_MACHTLR_OFFSET:
+            return s->ETH_MACHTLR;
+        case ETH_MACMIIAR_OFFSET:
+            return s->ETH_MACMIIAR;
+        case ETH_MACMIIDR_OFFSET:
+            return s->ETH_MACMIIDR;
+        case ETH_MACFCR_OFFSET:
+            return s->ETH_MACFCR;
+        case ETH_MACVLANTR_OFFSET:
+            return s->ETH_MACVLANTR;
+        case ETH_MACSR_OFFSET:
+            return 0;
+        case ETH_MACIMR_OFFSET:
+            return s->ETH_MACIMR;
+        case ETH_MACA_START ... ETH_MACA_END - 1:
+            n = (offset - ETH_MACA_START) / 8;
+            if(offset & 4) {
+                return s->ETH_MACALR[n];
+            }
+            return s->ETH_MACAHR[n];
+        case ETH_MMC_START ... ETH_MMC_END - 1:
+            return 0;
+        case ETH_DMABMR_OFFSET:
+            return s->ETH_DMABMR;
+        case ETH_DMARDLAR_OFFSET:
+            return s->ETH_DMARDLAR;
+        case ETH_DMATDLAR_OFFSET:
+            return s->ETH_DMATDLAR;
+        case ETH_DMASR_OFFSET:
+            return s->ETH_DMASR;
+        case ETH_DMAOMR_OFFSET:
+            return s->ETH_DMAOMR;
+        case ETH_DMAIER_OFFSET:
+            return s->ETH_DMAIER;
+        case ETH_DMAMFBOCR_OFFSET:
+            /* The missed frame counters clear on read */
+            value = s->ETH_DMAMFBOCR;
+            s->ETH_DMAMFBOCR = 0;
+            return value;
+        case ETH_DMACHTDR_OFFSET:
+            return s->cur_tx_desc;
+        case ETH_DMACHRDR_OFFSET:
+            return s->cur_rx_desc;
+        case ETH_DMACHTBAR_OFFSET:
+            return s->cur_tx_buf;
+        case ETH_DMACHRBAR_OFFSET:
+            return s->cur_rx_buf;
+        default:
+            STM32_NOT_IMPL_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_eth_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Eth *s = (Stm32Eth *)opaque;
+    int n;
+
+    stm32_rcc_check_periph_clk(s->stm32_rcc, s->periph);
+
+    switch (offset) {
+        case ETH_MACCR_OFFSET:
+            s->ETH_MACCR = value & 0x02cf7efc;
+            stm32_eth_rx_resume(s);
+            break;
+        case ETH_MACFFR_OFFSET:
+            s->ETH_MACFFR = value & 0x800007ff;
+            break;
+        case ETH_MACHTHR_OFFSET:
+            s->ETH_MACHTHR = value;
+            break;
+        case ETH_MACHTLR_OFFSET:
+            s->ETH_MACHTLR = value;
+            break;
+        case ETH_MACMIIAR_OFFSET:
+            stm32_eth_ETH_MACMIIAR_write(s, value);
+            break;
+        case ETH_MACMIIDR_OFFSET:
+            s->ETH_MACMIIDR = value & 0xffff;
+            break;
+        case ETH_MACFCR_OFFSET:
+            s->ETH_MACFCR = value & 0xffff00be;
+            break;
+        case ETH_MACVLANTR_OFFSET:
+            s->ETH_MACVLANTR = value & 0x0001ffff;
+            break;
+        case ETH_MACSR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        case ETH_MACIMR_OFFSET:
+            s->ETH_MACIMR = value & 0x0208;
+            break;
+        case ETH_MACA_START ... ETH_MACA_END - 1:
+            n = (offset - ETH_MACA_START) / 8;
+            if(offset & 4) {
+                s->ETH_MACALR[n] = value;
+            } else if(n == 0) {
+                s->ETH_MACAHR[n] = (value & 0xffff) | BIT(ETH_MACAHR_AE_BIT);
+            } else {
+                s->ETH_MACAHR[n] = value & 0xff00ffff;
+            }
+            break;
+        case ETH_MMC_START ... ETH_MMC_END - 1:
+            break;
+        case ETH_DMABMR_OFFSET:
+            stm32_eth_ETH_DMABMR_write(s, value);
+            break;
+        case ETH_DMATPDR_OFFSET:
+            stm32_eth_tx(s);
+            break;
+        case ETH_DMARPDR_OFFSET:
+            stm32_eth_rx_resume(s);
+            break;
+        case ETH_DMARDLAR_OFFSET:
+            s->ETH_DMARDLAR = s->cur_rx_desc = value & ~3;
+            break;
+        case ETH_DMATDLAR_OFFSET:
+            s->ETH_DMATDLAR = s->cur_tx_desc = value & ~3;
+            break;
+        case ETH_DMASR_OFFSET:
+            s->ETH_DMASR &= ~(value & (ETH_DMASR_FLAGS_MASK |
+                                       BIT(ETH_DMASR_AIS_BIT) |
+                                       BIT(ETH_DMASR_NIS_BIT)));
+            stm32_eth_update_irq(s);
+            break;
+        case ETH_DMAOMR_OFFSET:
+            stm32_eth_ETH_DMAOMR_write(s, value);
+            break;
+        case ETH_DMAIER_OFFSET:
+            s->ETH_DMAIER = value & 0x0001e7ff;
+            stm32_eth_update_irq(s);
+            break;
+        case ETH_DMAMFBOCR_OFFSET:
+        case ETH_DMACHTDR_OFFSET:
+        case ETH_DMACHRDR_OFFSET:
+        case ETH_DMACHTBAR_OFFSET:
+        case ETH_DMACHRBAR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        default:
+            STM32_NOT_IMPL_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_eth_ops = {
+    .read = stm32_eth_read,
+    .write = stm32_eth_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_eth_reset(DeviceState *dev)
+{
+    Stm32Eth *s = STM32_ETH(dev);
+    int i;
+
+    s->ETH_MACCR = 0x00008000;
+    s->ETH_MACFFR = 0;
+    s->ETH_MACHTHR = 0;
+    s->ETH_MACHTLR = 0;
+    s->ETH_MACMIIAR = 0;
+    s->ETH_MACMIIDR = 0;
+    s->ETH_MACFCR = 0;
+    s->ETH_MACVLANTR = 0;
+    s->ETH_MACIMR = 0;
+    for(i = 0; i < ETH_MAC_ADDR_COUNT; i++) {
+        s->ETH_MACAHR[i] = 0x0000ffff;
+        s->ETH_MACALR[i] = 0xffffffff;
+    }
+    s->ETH_MACAHR[0] |= BIT(ETH_MACAHR_AE_BIT);
+    s->ETH_DMABMR = 0x00002101;
+    s->ETH_DMARDLAR = 0;
+    s->ETH_DMATDLAR = 0;
+    s->ETH_DMASR = 0;
+    s->ETH_DMAOMR = 0;
+    s->ETH_DMAIER = 0;
+    s->ETH_DMAMFBOCR = 0;
+    s->cur_rx_desc = 0;
+    s->cur_tx_desc = 0;
+    s->cur_rx_buf = 0;
+    s->cur_tx_buf = 0;
+    s->tx_pending = false;
+
+    stm32_eth_phy_reset(s);
+    qemu_set_irq(s->irq, 0);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_eth_init(SysBusDevice *dev)
+{
+    Stm32Eth *s = STM32_ETH(dev);
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+    s->as = s->as_prop ? (AddressSpace *)s->as_prop : &address_space_memory;
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_eth_ops, s,
+                          "eth", ETH_REGION_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+    s->irq_bh = qemu_bh_new(stm32_eth_irq_bh, s);
+
+    qemu_macaddr_default_if_unset(&s->conf.macaddr);
+    s->nic = qemu_new_nic(&net_stm32_eth_info, &s->conf,
+                          object_get_typename(OBJECT(dev)),
+                          DEVICE(dev)->id, s);
+    qemu_format_nic_info_str(qemu_get_queue(s->nic), s->conf.macaddr.a);
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_eth = {
+    .name = TYPE_STM32_ETH,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ETH_MACCR, Stm32Eth),
+        VMSTATE_UINT32(ETH_MACFFR, Stm32Eth),
+        VMSTATE_UINT32(ETH_MACHTHR, Stm32Eth),
+        VMSTATE_UINT32(ETH_MACHTLR, Stm32Eth),
+        VMSTATE_UINT32(ETH_MACMIIAR, Stm32Eth),
+        VMSTATE_UINT32(ETH_MACMIIDR, Stm32Eth),
+        VMSTATE_UINT32(ETH_MACFCR, Stm32Eth),
+        VMSTATE_UINT32(ETH_MACVLANTR, Stm32Eth),
+        VMSTATE_UINT32(ETH_MACIMR, Stm32Eth),
+        VMSTATE_UINT32_ARRAY(ETH_MACAHR, Stm32Eth, ETH_MAC_ADDR_COUNT),
+        VMSTATE_UINT32_ARRAY(ETH_MACALR, Stm32Eth, ETH_MAC_ADDR_COUNT),
+        VMSTATE_UINT32(ETH_DMABMR, Stm32Eth),
+        VMSTATE_UINT32(ETH_DMARDLAR, Stm32Eth),
+        VMSTATE_UINT32(ETH_DMATDLAR, Stm32Eth),
+        VMSTATE_UINT32(ETH_DMASR, Stm32Eth),
+        VMSTATE_UINT32(ETH_DMAOMR, Stm32Eth),
+        VMSTATE_UINT32(ETH_DMAIER, Stm32Eth),
+        VMSTATE_UINT32(ETH_DMAMFBOCR, Stm32Eth),
+        VMSTATE_UINT32(cur_rx_desc, Stm32Eth),
+        VMSTATE_UINT32(cur_tx_desc, Stm32Eth),
+        VMSTATE_UINT32(cur_rx_buf, Stm32Eth),
+        VMSTATE_UINT32(cur_tx_buf, Stm32Eth),
+        VMSTATE_UINT16_ARRAY(phy_regs, Stm32Eth, ETH_PHY_REG_COUNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_eth_properties[] = {
+    DEFINE_PROP_PERIPH_T("periph", Stm32Eth, periph, STM32_PERIPH_UNDEFINED),
+    DEFINE_PROP_PTR("stm32_rcc", Stm32Eth, stm32_rcc_prop),
+    DEFINE_PROP_PTR("as", Stm32Eth, as_prop),
+    DEFINE_NIC_PROPERTIES(Stm32Eth, conf),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_eth_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_eth_init;
+    dc->reset = stm32_eth_reset;
+    dc->vmsd = &vmstate_stm32_eth;
+    dc->props = stm32_eth_properties;
+}
+
+static TypeInfo stm32_eth_info = {
+    .name  = TYPE_STM32_ETH,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Eth),
+    .class_init = stm32_eth_class_init
+};
+
+static void stm32_eth_register_types(void)
+{
+    type_register_static(&stm32_eth_info);
+}
+
+type_init(stm32_eth_register_types)
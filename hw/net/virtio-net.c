@@ -24,6 +24,7 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "qapi/visitor.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -322,6 +323,7 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -345,6 +347,16 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_timer) {
+            timer_del(q->rx_timer);
+            q->rx_timeout = n->net_conf.rxtimer;
+        }
+        q->rx_unnotified = 0;
+    }
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -839,6 +851,57 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 
 /* RX */
 
+static void virtio_net_rx_notify(VirtIONetQueue *q)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    q->rx_unnotified = 0;
+    if (q->rx_timer) {
+        timer_del(q->rx_timer);
+    }
+    if (virtio_notify(vdev, q->rx_vq)) {
+        q->rx_notify_sent++;
+    } else {
+        q->rx_notify_suppressed++;
+    }
+}
+
+/* Called for each packet received, see RX_BURST */
+static void virtio_net_rx_done(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+
+    if (!q->rx_timer) {
+        virtio_net_rx_notify(q);
+        return;
+    }
+
+    if (++q->rx_unnotified >= n->net_conf.rxburst) {
+        /* The burst filled up before the timer expired */
+        q->rx_timeout = MIN(q->rx_timeout * 2, n->net_conf.rxtimer);
+        virtio_net_rx_notify(q);
+        return;
+    }
+
+    q->rx_notify_suppressed++;
+    if (!timer_pending(q->rx_timer)) {
+        timer_mod(q->rx_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + q->rx_timeout);
+    }
+}
+
+static void virtio_net_rx_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    if (q->rx_unnotified < q->n->net_conf.rxburst / 4) {
+        /* Few packets came in during the interval: don't hold them back
+         * as long next time */
+        q->rx_timeout = MAX(q->rx_timeout / 2, RX_TIMER_MIN_INTERVAL);
+    }
+    virtio_net_rx_notify(q);
+}
+
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -1013,6 +1076,10 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
+        /* Let the guest see what it has got so that it refills the ring */
+        if (q->rx_unnotified) {
+            virtio_net_rx_notify(q);
+        }
         return 0;
     }
 
@@ -1092,7 +1159,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    virtio_net_rx_done(q);
 
     return size;
 }
@@ -1175,18 +1242,25 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
+            if (num_packets) {
+                virtio_notify(vdev, q->tx_vq);
+            }
             return -EBUSY;
         }
 
         len += ret;
 
         virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+
+    /* One interrupt for the whole burst */
+    if (num_packets) {
+        virtio_notify(vdev, q->tx_vq);
+    }
     return num_packets;
 }
 
@@ -1341,10 +1415,18 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
 {
     VirtIONet *n = opaque;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int i;
 
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
     assert(!n->vhost_started);
+
+    /* The coalescing timers are not migrated */
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].rx_unnotified) {
+            virtio_net_rx_notify(&n->vqs[i]);
+        }
+    }
     virtio_save(vdev, f);
 }
 
@@ -1583,6 +1665,15 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+static void virtio_net_get_rx_notify_stat(Object *obj, Visitor *v,
+                                          void *opaque, const char *name,
+                                          Error **errp)
+{
+    uint64_t value = *(uint64_t *)opaque;
+
+    visit_type_uint64(v, &value, name, errp);
+}
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -1647,6 +1738,29 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->nic_conf.macaddr.a);
 
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        char *name;
+
+        q->n = n;
+        if (n->net_conf.rxtimer) {
+            q->rx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                       virtio_net_rx_timer, q);
+            q->rx_timeout = n->net_conf.rxtimer;
+        }
+
+        name = g_strdup_printf("rx-notify-sent[%d]", i);
+        object_property_add(OBJECT(dev), name, "uint64",
+                            virtio_net_get_rx_notify_stat, NULL, NULL,
+                            &q->rx_notify_sent, NULL);
+        g_free(name);
+        name = g_strdup_printf("rx-notify-suppressed[%d]", i);
+        object_property_add(OBJECT(dev), name, "uint64",
+                            virtio_net_get_rx_notify_stat, NULL, NULL,
+                            &q->rx_notify_suppressed, NULL);
+        g_free(name);
+    }
+
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
     virtio_net_set_mrg_rx_bufs(n, 0);
@@ -1697,6 +1811,10 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         } else if (q->tx_bh) {
             qemu_bh_delete(q->tx_bh);
         }
+        if (q->rx_timer) {
+            timer_del(q->rx_timer);
+            timer_free(q->rx_timer);
+        }
     }
 
     timer_del(n->announce_timer);
@@ -1723,6 +1841,8 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_UINT32("x-rxtimer", VirtIONet, net_conf.rxtimer, 0),
+    DEFINE_PROP_INT32("x-rxburst", VirtIONet, net_conf.rxburst, RX_BURST),
     DEFINE_PROP_END_OF_LIST(),
 };
 
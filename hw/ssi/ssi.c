@@ -41,13 +41,18 @@ static void ssi_cs_default(void *opaque, int n, int level)
     s->cs = cs;
 }
 
+static bool ssi_slave_selected(SSISlave *dev, SSISlaveClass *ssc)
+{
+    return (dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
+           (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
+           ssc->cs_polarity == SSI_CS_NONE;
+}
+
 static uint32_t ssi_transfer_raw_default(SSISlave *dev, uint32_t val)
 {
     SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(dev);
 
-    if ((dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
-            (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
-            ssc->cs_polarity == SSI_CS_NONE) {
+    if (ssi_slave_selected(dev, ssc)) {
         return ssc->transfer(dev, val);
     }
     return 0;
@@ -122,6 +127,57 @@ uint32_t ssi_transfer(SSIBus *bus, uint32_t val)
     return r;
 }
 
+#define SSI_BLOCK_CHUNK 256
+
+void ssi_transfer_block(SSIBus *bus, const uint8_t *tx, uint8_t *rx, int len)
+{
+    BusState *b = BUS(bus);
+    BusChild *kid;
+    SSISlaveClass *ssc;
+    uint8_t zeros[SSI_BLOCK_CHUNK];
+    uint8_t r[SSI_BLOCK_CHUNK], tmp[SSI_BLOCK_CHUNK];
+    const uint8_t *out;
+    int i, n;
+
+    if (!tx) {
+        memset(zeros, 0, sizeof(zeros));
+    }
+
+    while (len > 0) {
+        n = MIN(len, SSI_BLOCK_CHUNK);
+        out = tx ? tx : zeros;
+        memset(r, 0, n);
+
+        QTAILQ_FOREACH(kid, &b->children, sibling) {
+            SSISlave *slave = SSI_SLAVE(kid->child);
+            ssc = SSI_SLAVE_GET_CLASS(slave);
+
+            if (ssc->transfer_block &&
+                    ssc->transfer_raw == ssi_transfer_raw_default) {
+                if (ssi_slave_selected(slave, ssc)) {
+                    ssc->transfer_block(slave, out, tmp, n);
+                    for (i = 0; i < n; i++) {
+                        r[i] |= tmp[i];
+                    }
+                }
+            } else {
+                for (i = 0; i < n; i++) {
+                    r[i] |= ssc->transfer_raw(slave, out[i]);
+                }
+            }
+        }
+
+        if (rx) {
+            memcpy(rx, r, n);
+            rx += n;
+        }
+        if (tx) {
+            tx += n;
+        }
+        len -= n;
+    }
+}
+
 const VMStateDescription vmstate_ssi_slave = {
     .name = "SSISlave",
     .version_id = 1,
@@ -0,0 +1,634 @@
+/*
+ * STM32 Microcontroller SPI module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "hw/ssi.h"
+#include "qemu/bitops.h"
+#include "qemu/log.h"
+
+
+
+/* DEFINITIONS*/
+
+//#define DEBUG_STM32_SPI
+
+#ifdef DEBUG_STM32_SPI
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_SPI: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define SPI_CR1_OFFSET 0x00
+#define SPI_CR1_MSTR_BIT 2
+#define SPI_CR1_SPE_BIT 6
+#define SPI_CR1_LSBFIRST_BIT 7
+#define SPI_CR1_RXONLY_BIT 10
+#define SPI_CR1_DFF_BIT 11
+#define SPI_CR1_CRCEN_BIT 13
+#define SPI_CR1_BIDIMODE_BIT 15
+
+#define SPI_CR2_OFFSET 0x04
+#define SPI_CR2_RXDMAEN_BIT 0
+#define SPI_CR2_TXDMAEN_BIT 1
+#define SPI_CR2_SSOE_BIT 2
+#define SPI_CR2_ERRIE_BIT 5
+#define SPI_CR2_RXNEIE_BIT 6
+#define SPI_CR2_TXEIE_BIT 7
+
+#define SPI_SR_OFFSET 0x08
+#define SPI_SR_RXNE_BIT 0
+#define SPI_SR_TXE_BIT 1
+#define SPI_SR_CHSIDE_BIT 2
+#define SPI_SR_OVR_BIT 6
+
+#define SPI_DR_OFFSET 0x0c
+#define SPI_CRCPR_OFFSET 0x10
+#define SPI_RXCRCR_OFFSET 0x14
+#define SPI_TXCRCR_OFFSET 0x18
+#define SPI_I2SCFGR_OFFSET 0x1c
+#define SPI_I2SCFGR_I2SE_BIT 10
+#define SPI_I2SCFGR_I2SMOD_BIT 11
+#define SPI_I2SCFGR_MASK 0x0fbf
+
+#define SPI_I2SPR_OFFSET 0x20
+#define SPI_I2SPR_MASK 0x03ff
+
+/* Frames received but not yet read.  The hardware has a single receive
+ * buffer, and frames are only queued beyond that while RX DMA is enabled.
+ * A whole DMA block is transferred at once, so this lets the RX channel
+ * catch up afterwards rather than losing everything but the first frame. */
+#define STM32_SPI_RX_QUEUE_SIZE 4096
+
+/* Largest chunk passed to the SSI bus at once by a DMA block transfer */
+#define STM32_SPI_BLOCK_CHUNK 256
+
+struct Stm32Spi {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    void *stm32_rcc_prop;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32Rcc *stm32_rcc;
+
+    SSIBus *ssi;
+
+    /* Set for SPI2 and SPI3, which have an I2S mode */
+    Stm32I2s *i2s;
+
+    qemu_irq irq;
+    qemu_irq dma_rx_irq;
+    qemu_irq dma_tx_irq;
+    qemu_irq nss_irq;
+
+    /* Register Values */
+    uint32_t
+        SPI_CR1,
+        SPI_CR2,
+        SPI_CRCPR,
+        SPI_I2SCFGR,
+        SPI_I2SPR;
+
+    /* Level of the I2S device's TXE output */
+    bool i2s_txe;
+
+    /* Last frame read from DR, returned again if DR is read when the
+     * receive queue is empty. */
+    uint16_t rx_last;
+
+    /* Frame written to DR while the SPI was disabled.  It is sent as soon
+     * as the SPI is enabled. */
+    bool tx_pending;
+    uint16_t tx_data;
+
+    /* OVR is cleared by reading DR followed by SR. */
+    bool ovr;
+    bool ovr_dr_read;
+
+    uint16_t rx_queue[STM32_SPI_RX_QUEUE_SIZE];
+    int rx_head, rx_count;
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static bool stm32_spi_enabled(Stm32Spi *s)
+{
+    return extract32(s->SPI_CR1, SPI_CR1_SPE_BIT, 1);
+}
+
+static bool stm32_spi_i2s_mode(Stm32Spi *s)
+{
+    return s->i2s && extract32(s->SPI_I2SCFGR, SPI_I2SCFGR_I2SMOD_BIT, 1);
+}
+
+/* Transfers only happen in master mode - slave mode is not implemented. */
+static bool stm32_spi_can_transfer(Stm32Spi *s)
+{
+    return stm32_spi_enabled(s) &&
+           extract32(s->SPI_CR1, SPI_CR1_MSTR_BIT, 1);
+}
+
+static unsigned stm32_spi_rx_limit(Stm32Spi *s)
+{
+    return extract32(s->SPI_CR2, SPI_CR2_RXDMAEN_BIT, 1) ?
+           STM32_SPI_RX_QUEUE_SIZE : 1;
+}
+
+/* In I2S mode, nothing is received (receive modes are not implemented) and
+ * the I2S device says when it can take more data. */
+static void stm32_spi_i2s_update(Stm32Spi *s)
+{
+    bool tx_dma = extract32(s->SPI_CR2, SPI_CR2_TXDMAEN_BIT, 1);
+
+    qemu_set_irq(s->irq,
+                 s->i2s_txe && extract32(s->SPI_CR2, SPI_CR2_TXEIE_BIT, 1));
+    qemu_set_irq(s->dma_rx_irq, 0);
+    qemu_set_irq(s->dma_tx_irq, tx_dma && s->i2s_txe &&
+                 extract32(s->SPI_I2SCFGR, SPI_I2SCFGR_I2SE_BIT, 1));
+    qemu_set_irq(s->nss_irq, 1);
+}
+
+static void stm32_spi_update(Stm32Spi *s)
+{
+    bool txe = !s->tx_pending;
+    bool rxne = s->rx_count > 0;
+    bool rx_dma = extract32(s->SPI_CR2, SPI_CR2_RXDMAEN_BIT, 1);
+    bool tx_dma = extract32(s->SPI_CR2, SPI_CR2_TXDMAEN_BIT, 1);
+
+    if(stm32_spi_i2s_mode(s)) {
+        stm32_spi_i2s_update(s);
+        return;
+    }
+
+    qemu_set_irq(s->irq,
+        (txe && extract32(s->SPI_CR2, SPI_CR2_TXEIE_BIT, 1)) ||
+        (rxne && extract32(s->SPI_CR2, SPI_CR2_RXNEIE_BIT, 1)) ||
+        (s->ovr && extract32(s->SPI_CR2, SPI_CR2_ERRIE_BIT, 1)));
+
+    qemu_set_irq(s->dma_rx_irq, rx_dma && rxne);
+    /* Hold off transmitting while received frames cannot be queued, so
+     * that a TX DMA channel does not overrun its RX channel. */
+    qemu_set_irq(s->dma_tx_irq, tx_dma && txe && stm32_spi_enabled(s) &&
+                 (!rx_dma || (s->rx_count < STM32_SPI_RX_QUEUE_SIZE)));
+
+    /* NSS is driven low while the SPI is enabled as a master with SSOE */
+    qemu_set_irq(s->nss_irq,
+                 !(stm32_spi_can_transfer(s) &&
+                   extract32(s->SPI_CR2, SPI_CR2_SSOE_BIT, 1)));
+}
+
+static void stm32_spi_rx_push(Stm32Spi *s, uint16_t value)
+{
+    if(s->rx_count >= stm32_spi_rx_limit(s)) {
+        DPRINTF("%s overrun\n", stm32_periph_name(s->periph));
+        s->ovr = true;
+        return;
+    }
+    s->rx_queue[(s->rx_head + s->rx_count) % STM32_SPI_RX_QUEUE_SIZE] = value;
+    s->rx_count++;
+}
+
+static uint16_t stm32_spi_rx_pop(Stm32Spi *s)
+{
+    if(s->rx_count > 0) {
+        s->rx_last = s->rx_queue[s->rx_head];
+        s->rx_head = (s->rx_head + 1) % STM32_SPI_RX_QUEUE_SIZE;
+        s->rx_count--;
+    }
+    return s->rx_last;
+}
+
+static void stm32_spi_transfer(Stm32Spi *s, uint16_t value)
+{
+    uint32_t mask = extract32(s->SPI_CR1, SPI_CR1_DFF_BIT, 1) ? 0xffff : 0xff;
+
+    stm32_spi_rx_push(s, ssi_transfer(s->ssi, value & mask) & mask);
+}
+
+/* DMA block handler for DR.  Only 8 bit SPI frames are handled here - 16
+ * bit frames go through the register one at a time.  In I2S mode, whole
+ * blocks of half word samples go to the I2S device. */
+static int stm32_spi_dma_block(void *opaque, uint8_t *buf, int len,
+                               unsigned size, bool to_periph)
+{
+    Stm32Spi *s = (Stm32Spi *)opaque;
+    uint8_t rx[STM32_SPI_BLOCK_CHUNK];
+    int i, n, done;
+
+    if(stm32_spi_i2s_mode(s)) {
+        if((size != 2) || !to_periph ||
+                !extract32(s->SPI_CR2, SPI_CR2_TXDMAEN_BIT, 1) ||
+                !extract32(s->SPI_I2SCFGR, SPI_I2SCFGR_I2SE_BIT, 1)) {
+            return 0;
+        }
+        stm32_rcc_check_periph_clk(s->stm32_rcc, s->periph);
+        return stm32_i2s_transmit(s->i2s, buf, len);
+    }
+
+    if((size != 1) || !stm32_spi_can_transfer(s) || s->tx_pending ||
+            extract32(s->SPI_CR1, SPI_CR1_DFF_BIT, 1)) {
+        return 0;
+    }
+
+    if(to_periph) {
+        if(!extract32(s->SPI_CR2, SPI_CR2_TXDMAEN_BIT, 1)) {
+            return 0;
+        }
+        stm32_rcc_check_periph_clk(s->stm32_rcc, s->periph);
+
+        /* With RX DMA enabled, only send what can be queued for it.
+         * Otherwise everything after the first frame overruns, as it
+         * would on the real hardware. */
+        if(extract32(s->SPI_CR2, SPI_CR2_RXDMAEN_BIT, 1)) {
+            len = MIN(len, STM32_SPI_RX_QUEUE_SIZE - s->rx_count);
+        }
+        for(done = 0; done < len; done += n) {
+            n = MIN(len - done, STM32_SPI_BLOCK_CHUNK);
+            ssi_transfer_block(s->ssi, buf + done, rx, n);
+            for(i = 0; i < n; i++) {
+                stm32_spi_rx_push(s, rx[i]);
+            }
+        }
+    } else {
+        if(!extract32(s->SPI_CR2, SPI_CR2_RXDMAEN_BIT, 1)) {
+            return 0;
+        }
+        len = MIN(len, s->rx_count);
+        for(done = 0; done < len; done++) {
+            buf[done] = stm32_spi_rx_pop(s);
+        }
+    }
+
+    stm32_spi_update(s);
+    return len;
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_spi_SPI_CR1_write(Stm32Spi *s, uint32_t new_value)
+{
+    uint32_t changed = s->SPI_CR1 ^ new_value;
+
+    s->SPI_CR1 = new_value & 0xffff;
+
+    if(stm32_spi_enabled(s) && (changed & (BIT(SPI_CR1_SPE_BIT) |
+                                           BIT(SPI_CR1_MSTR_BIT)))) {
+        if(!extract32(new_value, SPI_CR1_MSTR_BIT, 1)) {
+            qemu_log_mask(LOG_UNIMP, "%s: slave mode is not implemented\n",
+                          stm32_periph_name(s->periph));
+        }
+    }
+    if(changed & new_value & BIT(SPI_CR1_LSBFIRST_BIT)) {
+        qemu_log_mask(LOG_UNIMP, "%s: LSB first is not implemented\n",
+                      stm32_periph_name(s->periph));
+    }
+    if(changed & new_value & (BIT(SPI_CR1_RXONLY_BIT) |
+                              BIT(SPI_CR1_BIDIMODE_BIT))) {
+        qemu_log_mask(LOG_UNIMP, "%s: receive only and bidirectional modes "
+                      "are not implemented\n", stm32_periph_name(s->periph));
+    }
+    if(changed & new_value & BIT(SPI_CR1_CRCEN_BIT)) {
+        qemu_log_mask(LOG_UNIMP, "%s: CRC calculation is not implemented\n",
+                      stm32_periph_name(s->periph));
+    }
+
+    if(s->tx_pending && stm32_spi_can_transfer(s)) {
+        s->tx_pending = false;
+        stm32_spi_transfer(s, s->tx_data);
+    }
+
+    stm32_spi_update(s);
+}
+
+static void stm32_spi_SPI_CR2_write(Stm32Spi *s, uint32_t new_value)
+{
+    s->SPI_CR2 = new_value & 0x00e7;
+    stm32_spi_update(s);
+}
+
+static uint32_t stm32_spi_SPI_SR_read(Stm32Spi *s)
+{
+    uint32_t value;
+
+    if(stm32_spi_i2s_mode(s)) {
+        return (s->i2s_txe << SPI_SR_TXE_BIT) |
+               (stm32_i2s_chside(s->i2s) << SPI_SR_CHSIDE_BIT);
+    }
+
+    value =
+        ((s->rx_count > 0) << SPI_SR_RXNE_BIT) |
+        (!s->tx_pending << SPI_SR_TXE_BIT) |
+        (s->ovr << SPI_SR_OVR_BIT);
+
+    if(s->ovr && s->ovr_dr_read) {
+        s->ovr = false;
+        s->ovr_dr_read = false;
+        stm32_spi_update(s);
+    }
+    return value;
+}
+
+static uint32_t stm32_spi_SPI_DR_read(Stm32Spi *s)
+{
+    uint16_t value;
+
+    if(stm32_spi_i2s_mode(s)) {
+        return 0;
+    }
+
+    value = stm32_spi_rx_pop(s);
+
+    s->ovr_dr_read = s->ovr;
+    stm32_spi_update(s);
+    return value;
+}
+
+static void stm32_spi_SPI_DR_write(Stm32Spi *s, uint32_t new_value)
+{
+    uint8_t buf[2];
+
+    if(stm32_spi_i2s_mode(s)) {
+        /* Dropped if there is no room, like a write while TXE is clear */
+        stw_le_p(buf, new_value);
+        stm32_i2s_transmit(s->i2s, buf, 2);
+        return;
+    }
+
+    if(stm32_spi_can_transfer(s)) {
+        stm32_spi_transfer(s, new_value);
+    } else {
+        /* Overwrites anything already waiting */
+        s->tx_pending = true;
+        s->tx_data = new_value;
+    }
+    stm32_spi_update(s);
+}
+
+static void stm32_spi_i2s_write(Stm32Spi *s, hwaddr offset, uint32_t value)
+{
+    if(offset == SPI_I2SCFGR_OFFSET) {
+        s->SPI_I2SCFGR = value & SPI_I2SCFGR_MASK;
+    } else {
+        s->SPI_I2SPR = value & SPI_I2SPR_MASK;
+    }
+    stm32_i2s_configure(s->i2s, s->SPI_I2SCFGR, s->SPI_I2SPR);
+    stm32_spi_update(s);
+}
+
+static uint64_t stm32_spi_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Spi *s = (Stm32Spi *)opaque;
+
+    switch (offset) {
+        case SPI_CR1_OFFSET:
+            return s->SPI_CR1;
+        case SPI_CR2_OFFSET:
+            return s->SPI_CR2;
+        case SPI_SR_OFFSET:
+            return stm32_spi_SPI_SR_read(s);
+        case SPI_DR_OFFSET:
+            return stm32_spi_SPI_DR_read(s);
+        case SPI_CRCPR_OFFSET:
+            return s->SPI_CRCPR;
+        case SPI_RXCRCR_OFFSET:
+        case SPI_TXCRCR_OFFSET:
+            /* CRC calculation is not implemented */
+            return 0;
+        case SPI_I2SCFGR_OFFSET:
+            if(!s->i2s) {
+                STM32_NOT_IMPL_REG(offset, size);
+            }
+            return s->SPI_I2SCFGR;
+        case SPI_I2SPR_OFFSET:
+            if(!s->i2s) {
+                STM32_NOT_IMPL_REG(offset, size);
+            }
+            return s->SPI_I2SPR;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_spi_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Spi *s = (Stm32Spi *)opaque;
+
+    stm32_rcc_check_periph_clk(s->stm32_rcc, s->periph);
+
+    switch (offset) {
+        case SPI_CR1_OFFSET:
+            stm32_spi_SPI_CR1_write(s, value);
+            break;
+        case SPI_CR2_OFFSET:
+            stm32_spi_SPI_CR2_write(s, value);
+            break;
+        case SPI_SR_OFFSET:
+            /* Only CRCERR is writable, and CRC is not implemented */
+            break;
+        case SPI_DR_OFFSET:
+            stm32_spi_SPI_DR_write(s, value);
+            break;
+        case SPI_CRCPR_OFFSET:
+            s->SPI_CRCPR = value & 0xffff;
+            break;
+        case SPI_RXCRCR_OFFSET:
+        case SPI_TXCRCR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        case SPI_I2SCFGR_OFFSET:
+        case SPI_I2SPR_OFFSET:
+            if(!s->i2s) {
+                STM32_NOT_IMPL_REG(offset, size);
+                break;
+            }
+            stm32_spi_i2s_write(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_spi_ops = {
+    .read = stm32_spi_read,
+    .write = stm32_spi_write,
+    .valid.min_access_size = 2,
+    .valid.max_access_size = 4,
+    .impl.min_access_size = 4,
+    .impl.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_spi_reset(DeviceState *dev)
+{
+    Stm32Spi *s = STM32_SPI(dev);
+
+    s->SPI_CR1 = 0;
+    s->SPI_CR2 = 0;
+    s->SPI_CRCPR = 0x0007;
+    s->SPI_I2SCFGR = 0;
+    s->SPI_I2SPR = 0x0002;
+    s->rx_last = 0;
+    s->tx_pending = false;
+    s->ovr = false;
+    s->ovr_dr_read = false;
+    s->rx_head = 0;
+    s->rx_count = 0;
+    if(s->i2s) {
+        stm32_i2s_configure(s->i2s, s->SPI_I2SCFGR, s->SPI_I2SPR);
+    }
+
+    stm32_spi_update(s);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+void stm32_spi_connect_dma(Stm32Spi *s, DeviceState *dma, hwaddr base)
+{
+    stm32_dma_set_block_handler(dma, base + SPI_DR_OFFSET,
+                                stm32_spi_dma_block, s);
+}
+
+void stm32_spi_connect_i2s(Stm32Spi *s, Stm32I2s *i2s)
+{
+    s->i2s = i2s;
+    sysbus_connect_irq(SYS_BUS_DEVICE(i2s), 0,
+                       qdev_get_gpio_in_named(DEVICE(s), "i2s-txe", 0));
+    stm32_i2s_configure(i2s, s->SPI_I2SCFGR, s->SPI_I2SPR);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_spi_i2s_txe(void *opaque, int n, int level)
+{
+    Stm32Spi *s = (Stm32Spi *)opaque;
+
+    s->i2s_txe = level;
+    if(stm32_spi_i2s_mode(s)) {
+        stm32_spi_i2s_update(s);
+    }
+}
+
+static int stm32_spi_init(SysBusDevice *dev)
+{
+    Stm32Spi *s = STM32_SPI(dev);
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_spi_ops, s,
+                          "spi", STM32_PERIPH_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+    sysbus_init_irq(dev, &s->dma_rx_irq);
+    sysbus_init_irq(dev, &s->dma_tx_irq);
+    sysbus_init_irq(dev, &s->nss_irq);
+    qdev_init_gpio_in_named(DEVICE(dev), stm32_spi_i2s_txe, "i2s-txe", 1);
+
+    s->ssi = ssi_create_bus(DEVICE(dev), "ssi");
+
+    return 0;
+}
+
+static int stm32_spi_post_load(void *opaque, int version_id)
+{
+    Stm32Spi *s = (Stm32Spi *)opaque;
+
+    if(s->rx_head < 0 || s->rx_head >= STM32_SPI_RX_QUEUE_SIZE ||
+            s->rx_count < 0 || s->rx_count > STM32_SPI_RX_QUEUE_SIZE) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_spi = {
+    .name = TYPE_STM32_SPI,
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .post_load = stm32_spi_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(SPI_CR1, Stm32Spi),
+        VMSTATE_UINT32(SPI_CR2, Stm32Spi),
+        VMSTATE_UINT32(SPI_CRCPR, Stm32Spi),
+        VMSTATE_UINT16(rx_last, Stm32Spi),
+        VMSTATE_BOOL(tx_pending, Stm32Spi),
+        VMSTATE_UINT16(tx_data, Stm32Spi),
+        VMSTATE_BOOL(ovr, Stm32Spi),
+        VMSTATE_BOOL(ovr_dr_read, Stm32Spi),
+        VMSTATE_UINT16_ARRAY(rx_queue, Stm32Spi, STM32_SPI_RX_QUEUE_SIZE),
+        VMSTATE_INT32(rx_head, Stm32Spi),
+        VMSTATE_INT32(rx_count, Stm32Spi),
+        VMSTATE_UINT32_V(SPI_I2SCFGR, Stm32Spi, 2),
+        VMSTATE_UINT32_V(SPI_I2SPR, Stm32Spi, 2),
+        VMSTATE_BOOL_V(i2s_txe, Stm32Spi, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_spi_properties[] = {
+    DEFINE_PROP_PERIPH_T("periph", Stm32Spi, periph, STM32_PERIPH_UNDEFINED),
+    DEFINE_PROP_PTR("stm32_rcc", Stm32Spi, stm32_rcc_prop),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_spi_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_spi_init;
+    dc->reset = stm32_spi_reset;
+    dc->vmsd = &vmstate_stm32_spi;
+    dc->props = stm32_spi_properties;
+}
+
+static TypeInfo stm32_spi_info = {
+    .name  = TYPE_STM32_SPI,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Spi),
+    .class_init = stm32_spi_class_init
+};
+
+static void stm32_spi_register_types(void)
+{
+    type_register_static(&stm32_spi_info);
+}
+
+type_init(stm32_spi_register_types)
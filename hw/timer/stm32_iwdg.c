@@ -0,0 +1,295 @@
+/*
+ * STM32 Microcontroller Independent Watchdog (IWDG)
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/arm/stm32.h"
+#include "hw/sysbus.h"
+#include "qemu/timer.h"
+
+
+
+/* DEFINITIONS*/
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_IWDG
+
+#ifdef DEBUG_STM32_IWDG
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_IWDG: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define IWDG_KR_OFFSET 0x00
+#define IWDG_KR_REFRESH 0xaaaa
+#define IWDG_KR_UNLOCK 0x5555
+#define IWDG_KR_START 0xcccc
+
+#define IWDG_PR_OFFSET 0x04
+#define IWDG_PR_MASK 0x7
+
+#define IWDG_RLR_OFFSET 0x08
+#define IWDG_RLR_MASK 0xfff
+
+#define IWDG_SR_OFFSET 0x0c
+
+/* The counter is not modelled: it is reloaded on each refresh and runs out
+ * period_ns later.  A refresh only stores the time, so that firmware which
+ * kicks the watchdog on every pass of its main loop does not rearm a timer
+ * each time.  The timer stays armed for the deadline of an older refresh,
+ * and when it fires too early it moves itself on to the current one. */
+struct Stm32Iwdg {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    void *stm32_rcc_prop;
+    /* AioContext in which the timer runs, NULL for the main loop */
+    void *aio_context;
+
+    /* Private */
+    MemoryRegion iomem;
+    Stm32Rcc *stm32_rcc;
+
+    uint32_t
+        IWDG_PR,
+        IWDG_RLR;
+
+    /* PR and RLR can be written */
+    bool unlocked;
+    /* Once started, the watchdog only stops on reset */
+    bool started;
+    int64_t refresh_time;
+    int64_t period_ns;
+
+    QEMUTimer *timer;
+};
+
+
+
+/* HELPER FUNCTIONS */
+
+/* PR and RLR are applied straight away, there is no need for the firmware
+ * to wait for PVU and RVU. */
+static void stm32_iwdg_update_period(Stm32Iwdg *s)
+{
+    uint64_t cycles = (uint64_t)s->IWDG_RLR << (2 + MIN(s->IWDG_PR, 6));
+
+    s->period_ns = muldiv64(cycles, get_ticks_per_sec(),
+                            stm32_rcc_get_lsi_freq(s->stm32_rcc));
+}
+
+static void stm32_iwdg_schedule(Stm32Iwdg *s)
+{
+    if(s->started) {
+        timer_mod(s->timer, s->refresh_time + s->period_ns);
+    } else {
+        timer_del(s->timer);
+    }
+}
+
+static void stm32_iwdg_timer_cb(void *opaque)
+{
+    Stm32Iwdg *s = (Stm32Iwdg *)opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if(now < s->refresh_time + s->period_ns) {
+        /* Refreshed since the timer was armed */
+        stm32_iwdg_schedule(s);
+        return;
+    }
+
+    DPRINTF("expired\n");
+    stm32_rcc_request_reset(s->stm32_rcc, STM32_RCC_RESET_IWDG);
+}
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_iwdg_KR_write(Stm32Iwdg *s, uint32_t new_value)
+{
+    /* Any key but the unlock key protects PR and RLR again */
+    s->unlocked = false;
+
+    switch(new_value & 0xffff) {
+        case IWDG_KR_REFRESH:
+            s->refresh_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            break;
+        case IWDG_KR_UNLOCK:
+            s->unlocked = true;
+            break;
+        case IWDG_KR_START:
+            s->refresh_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            if(!s->started) {
+                s->started = true;
+                stm32_iwdg_schedule(s);
+            }
+            break;
+    }
+}
+
+static uint64_t stm32_iwdg_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    Stm32Iwdg *s = (Stm32Iwdg *)opaque;
+
+    switch (offset) {
+        case IWDG_KR_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+        case IWDG_PR_OFFSET:
+            return s->IWDG_PR;
+        case IWDG_RLR_OFFSET:
+            return s->IWDG_RLR;
+        case IWDG_SR_OFFSET:
+            return 0;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_iwdg_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    Stm32Iwdg *s = (Stm32Iwdg *)opaque;
+
+    switch (offset) {
+        case IWDG_KR_OFFSET:
+            stm32_iwdg_KR_write(s, value);
+            return;
+        case IWDG_PR_OFFSET:
+        case IWDG_RLR_OFFSET:
+            if(!s->unlocked) {
+                qemu_log_mask(LOG_GUEST_ERROR,
+                              "stm32_iwdg: PR and RLR are write protected\n");
+                return;
+            }
+            if(offset == IWDG_PR_OFFSET) {
+                s->IWDG_PR = value & IWDG_PR_MASK;
+            } else {
+                s->IWDG_RLR = value & IWDG_RLR_MASK;
+            }
+            stm32_iwdg_update_period(s);
+            /* The deadline may have moved closer */
+            stm32_iwdg_schedule(s);
+            return;
+        case IWDG_SR_OFFSET:
+            STM32_RO_REG(offset);
+            return;
+        default:
+            STM32_BAD_REG(offset, size);
+            return;
+    }
+}
+
+static const MemoryRegionOps stm32_iwdg_ops = {
+    .read = stm32_iwdg_read,
+    .write = stm32_iwdg_write,
+    .valid.min_access_size = 2,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_iwdg_reset(DeviceState *dev)
+{
+    Stm32Iwdg *s = STM32_Iwdg(dev);
+
+    s->IWDG_PR = 0;
+    s->IWDG_RLR = IWDG_RLR_MASK;
+    s->unlocked = false;
+    s->started = false;
+    s->refresh_time = 0;
+    stm32_iwdg_update_period(s);
+    stm32_iwdg_schedule(s);
+}
+
+static int stm32_iwdg_init(SysBusDevice *dev)
+{
+    Stm32Iwdg *s = STM32_Iwdg(dev);
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_iwdg_ops, s,
+                          "iwdg", STM32_PERIPH_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    s->timer = stm32_timer_new_ns(s->aio_context, stm32_iwdg_timer_cb, s);
+
+    return 0;
+}
+
+static int stm32_iwdg_post_load(void *opaque, int version_id)
+{
+    Stm32Iwdg *s = (Stm32Iwdg *)opaque;
+
+    stm32_iwdg_update_period(s);
+    stm32_iwdg_schedule(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_iwdg = {
+    .name = TYPE_STM32_IWDG,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_iwdg_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(IWDG_PR, Stm32Iwdg),
+        VMSTATE_UINT32(IWDG_RLR, Stm32Iwdg),
+        VMSTATE_BOOL(unlocked, Stm32Iwdg),
+        VMSTATE_BOOL(started, Stm32Iwdg),
+        VMSTATE_INT64(refresh_time, Stm32Iwdg),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_iwdg_properties[] = {
+    DEFINE_PROP_PTR("stm32_rcc", Stm32Iwdg, stm32_rcc_prop),
+    DEFINE_PROP_PTR("aio_context", Stm32Iwdg, aio_context),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_iwdg_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_iwdg_init;
+    dc->reset = stm32_iwdg_reset;
+    dc->vmsd = &vmstate_stm32_iwdg;
+    dc->props = stm32_iwdg_properties;
+}
+
+static TypeInfo stm32_iwdg_info = {
+    .name  = TYPE_STM32_IWDG,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Iwdg),
+    .class_init = stm32_iwdg_class_init
+};
+
+static void stm32_iwdg_register_types(void)
+{
+    type_register_static(&stm32_iwdg_info);
+}
+
+type_init(stm32_iwdg_register_types)
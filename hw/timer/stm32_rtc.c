@@ -27,7 +27,6 @@
 #include "hw/sysbus.h"
 #include "qemu/timer.h"
 #include "sysemu/sysemu.h"
-#include "hw/ptimer.h"
 /* DEFINITIONS*/
 
 /* See README for DEBUG details. */
@@ -64,6 +63,11 @@
 #define RTC_ALRL_OFFSET 0x24
 
 
+/* The counter and prescaler divider are not stepped by a timer: they are
+ * computed from QEMU_CLOCK_VIRTUAL.  base_ticks is the number of RTCCLK
+ * ticks (since the last TR_CLK tick) the prescaler had counted at
+ * base_time, when CNT was base_cnt.  The timer is only armed for the next
+ * TR_CLK tick which would raise an enabled interrupt. */
 struct Stm32Rtc {
     /* Inherited */
     SysBusDevice busdev;
@@ -72,6 +76,8 @@ struct Stm32Rtc {
     /* Properties */
     
     void *stm32_rcc_prop;
+    /* AioContext in which the timers run, NULL for the main loop */
+    void *aio_context;
 
     /* Private */
     MemoryRegion iomem;
@@ -80,12 +86,16 @@ struct Stm32Rtc {
     uint16_t
         RTC_CR[2], /* 0 CRL 1 CRH */
         RTC_PRL[2], /* 0 PRLL 1 PRLH */
-        RTC_CNT[2], /* 0 CNTL 1 CNTH  */
         RTC_ALR[2]; /* 0 ALRL 1 ALRH */
 
-    ptimer_state    *ptimer;        /* tick timer */
+    QEMUTimer *timer;
     uint32_t freq,
              prescaler;
+    int64_t base_time;
+    uint32_t base_ticks;
+    uint32_t base_cnt;
+    /* TR_CLK ticks since base_time which have already set the flags */
+    uint64_t ticks_seen;
     
     qemu_irq irq;
     int curr_irq_level;
@@ -95,21 +105,6 @@ struct Stm32Rtc {
 
 /* HELPER FUNCTIONS */
 
-/*Function Called if output freq of RTC change*/
-
-static void stm32_rtc_clk_irq_handler(void *opaque, int n, int level)
-{
-
-    Stm32Rtc *s=(Stm32Rtc*)opaque;        
-    s->freq=stm32_rcc_get_periph_freq(s->stm32_rcc,s->periph);
-    if(s->freq){
-    ptimer_set_freq(s->ptimer,s->freq);
-    ptimer_set_count(s->ptimer,s->prescaler+1);
-    ptimer_run(s->ptimer, 1);
-    }    
-    
-}
-
 static void stm32_rtc_update_irq(Stm32Rtc *s) {
 
      int new_irq_level =
@@ -121,52 +116,170 @@ static void stm32_rtc_update_irq(Stm32Rtc *s) {
      * set the level regardless, but we will just check for good measure.
      */
     if((new_irq_level & 0x01) ^ s->curr_irq_level) {
-        qemu_set_irq(s->irq, new_irq_level);
-        s->curr_irq_level = new_irq_level;
+        qemu_set_irq(s->irq, new_irq_level & 0x01);
+        s->curr_irq_level = new_irq_level & 0x01;
     }
 }
 
+static uint32_t stm32_rtc_get_alarm(Stm32Rtc *s)
+{
+    return (s->RTC_ALR[1] << 16) | s->RTC_ALR[0];
+}
+
+/* Number of RTCCLK ticks per TR_CLK tick: f_TR_CLK = RTCCLK/(PRL[19-0]+1) */
+static uint64_t stm32_rtc_period(Stm32Rtc *s)
+{
+    return (uint64_t)s->prescaler + 1;
+}
 
-static int stm32_rtc_check_alarm(Stm32Rtc* s)
+/* RTCCLK ticks counted since the last rebase, including base_ticks */
+static uint64_t stm32_rtc_ticks(Stm32Rtc *s, int64_t now)
 {
-   return ((s->RTC_CNT[1] << 16) | (s->RTC_CNT[0])) == 
-          ((s->RTC_ALR[1] << 16) | (s->RTC_ALR[0]));
+    if (s->freq == 0 || now <= s->base_time) {
+        return s->base_ticks;
+    }
+    return s->base_ticks +
+           muldiv64(now - s->base_time, s->freq, get_ticks_per_sec());
 }
 
-/* functon called each cycle of
-   f_TR_CLK=RTCCLK/(PRL[19-0]+1)*/
-static void stm32_rtc_tick(void *opaque)
+/* Virtual time at which the TR_CLK tick number n (counted from the rebase)
+ * happens */
+static int64_t stm32_rtc_tick_time(Stm32Rtc *s, uint64_t n)
 {
-    Stm32Rtc *s=(Stm32Rtc*)opaque; 
-    /* increment count (systeme date) eache cycle of f_TR_CLK   */
-    uint32_t new_CNT=((s->RTC_CNT[1] << 16 ) | (s->RTC_CNT[0])) + 1; 
+    uint64_t ticks = n * stm32_rtc_period(s) - s->base_ticks;
 
-    s->RTC_CNT[0]=new_CNT & 0xffff;
-    s->RTC_CNT[1]=new_CNT >> 16;
+    /* Round up so the tick has really happened when the timer fires */
+    return s->base_time +
+           muldiv64(ticks, get_ticks_per_sec(), s->freq) + 1;
+}
 
-    /* set seconde flag eachche cycle of f_TR_CLK if
-       seconde interupt is enabled */
-    if(s->RTC_CR[1] & (1<<RTC_CRH_SECIE_BIT)){
-    s->RTC_CR[0]|=(1 << RTC_CRL_SECF_BIT); 
-    }
-     
-    /* set ALR flag if ALR interrupt 
-     enabled and ALR event occured  */
-   if(s->RTC_CR[1] & (1<<RTC_CRH_ALRIE_BIT)){
-    s->RTC_CR[0]|= (stm32_rtc_check_alarm(s)<< RTC_CRL_ALRF_BIT);
+/* Set the flags for every TR_CLK tick which has happened since the last
+ * call, however many that is. */
+static void stm32_rtc_sync(Stm32Rtc *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint64_t n = stm32_rtc_ticks(s, now) / stm32_rtc_period(s);
+    uint64_t count;
+    uint32_t first;
+
+    /* The registers are resynchronised with the RTC on every RTCCLK
+     * tick, so RSF is set again straight away. */
+    if (s->freq) {
+        s->RTC_CR[0] |= (1 << RTC_CRL_RSF_BIT);
     }
-   
-     /* set syncro bit if equal 0 */
-   if(!(s->RTC_CR[0]&(1<<RTC_CRL_RSF_BIT))){
-     s->RTC_CR[0]|=(1 << RTC_CRL_RSF_BIT);
-    
-   }
 
+    if (n <= s->ticks_seen) {
+        return;
+    }
+    count = n - s->ticks_seen;
+    /* Counter value reached by the first of the new ticks */
+    first = s->base_cnt + s->ticks_seen + 1;
+    s->ticks_seen = n;
+
+    s->RTC_CR[0] |= (1 << RTC_CRL_SECF_BIT);
+    if ((uint32_t)(stm32_rtc_get_alarm(s) - first) < count) {
+        s->RTC_CR[0] |= (1 << RTC_CRL_ALRF_BIT);
+    }
+    if ((uint32_t)(0 - first) < count) {
+        s->RTC_CR[0] |= (1 << RTC_CRL_OWF_BIT);
+    }
     stm32_rtc_update_irq(s);
-    /*divise frequence clock by (PR[19-0]+ 1)
-      see datasheet page 480 prescaler registre */ 
-    ptimer_set_count(s->ptimer,s->prescaler+1);
-    ptimer_run(s->ptimer, 1);
+}
+
+static uint32_t stm32_rtc_get_count(Stm32Rtc *s)
+{
+    return s->base_cnt + s->ticks_seen;
+}
+
+/* Value of the prescaler divider, counting down from PRL to 0 */
+static uint32_t stm32_rtc_get_div(Stm32Rtc *s)
+{
+    uint64_t ticks = stm32_rtc_ticks(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+
+    return s->prescaler - ticks % stm32_rtc_period(s);
+}
+
+/* Arm the timer for the next TR_CLK tick which sets a flag that raises an
+ * enabled interrupt. */
+static void stm32_rtc_schedule(Stm32Rtc *s)
+{
+    uint64_t next = UINT64_MAX;
+    uint32_t cnt = stm32_rtc_get_count(s);
+
+    if (s->freq) {
+        if ((s->RTC_CR[1] & (1 << RTC_CRH_SECIE_BIT)) &&
+            !(s->RTC_CR[0] & (1 << RTC_CRL_SECF_BIT))) {
+            next = s->ticks_seen + 1;
+        }
+        if ((s->RTC_CR[1] & (1 << RTC_CRH_ALRIE_BIT)) &&
+            !(s->RTC_CR[0] & (1 << RTC_CRL_ALRF_BIT))) {
+            /* Before the counter reaches the alarm value again */
+            next = MIN(next, s->ticks_seen + 1 +
+                             (uint32_t)(stm32_rtc_get_alarm(s) - cnt - 1));
+        }
+        if ((s->RTC_CR[1] & (1 << RTC_CRH_OWIE_BIT)) &&
+            !(s->RTC_CR[0] & (1 << RTC_CRL_OWF_BIT))) {
+            next = MIN(next, s->ticks_seen + 1 + (uint32_t)(0 - cnt - 1));
+        }
+    }
+
+    if (next == UINT64_MAX) {
+        timer_del(s->timer);
+    } else {
+        timer_mod(s->timer, stm32_rtc_tick_time(s, next));
+    }
+}
+
+/* Restart the time base from now, keeping the counter and the prescaler's
+ * progress towards the next tick. */
+static void stm32_rtc_rebase(Stm32Rtc *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    s->base_ticks = stm32_rtc_ticks(s, now) % stm32_rtc_period(s);
+    s->base_cnt = stm32_rtc_get_count(s);
+    s->base_time = now;
+    s->ticks_seen = 0;
+}
+
+static void stm32_rtc_timer_cb(void *opaque)
+{
+    Stm32Rtc *s = (Stm32Rtc *)opaque;
+
+    stm32_rtc_sync(s);
+    stm32_rtc_schedule(s);
+}
+
+/*Function Called if output freq of RTC change*/
+
+static void stm32_rtc_clk_irq_handler(void *opaque, int n, int level)
+{
+
+    Stm32Rtc *s=(Stm32Rtc*)opaque;        
+
+    stm32_rtc_sync(s);
+    stm32_rtc_rebase(s);
+    s->freq=stm32_rcc_get_periph_freq(s->stm32_rcc,s->periph);
+    stm32_rtc_schedule(s);
+}
+
+static void stm32_rtc_set_prescaler(Stm32Rtc *s)
+{
+    uint32_t prescaler = ((s->RTC_PRL[1] & 0x000f) << 16) | s->RTC_PRL[0];
+
+    if (s->prescaler != prescaler) {
+        stm32_rtc_rebase(s);
+        s->prescaler = prescaler;
+        /* A divider that is already past the new reload value wraps at the
+         * next RTCCLK tick */
+        s->base_ticks = MIN(s->base_ticks, prescaler);
+    }
+}
+
+static void stm32_rtc_set_count(Stm32Rtc *s, uint32_t cnt)
+{
+    stm32_rtc_rebase(s);
+    s->base_cnt = cnt;
 }
 
 
@@ -176,14 +289,17 @@ static void stm32_rtc_reset(DeviceState *dev)
    s->RTC_CR[0]=0x0020;
    s->RTC_CR[1]=0x0000;
    s->RTC_PRL[0]=0x8000;
-   s->RTC_CNT[0]=0x0000;
    s->RTC_ALR[0]=0xFFFF;
    s->RTC_PRL[1]=0x0000;
-   s->RTC_CNT[1]=0x0000;
    s->RTC_ALR[1]=0xFFFF;
    s->prescaler=((s->RTC_PRL[1]&0x000f)<<16)|
                            s->RTC_PRL[0];
-
+   s->base_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+   s->base_ticks = 0;
+   s->base_cnt = 0;
+   s->ticks_seen = 0;
+   stm32_rtc_update_irq(s);
+   stm32_rtc_schedule(s);
 }
 
 static uint64_t stm32_rtc_read(void *opaque, hwaddr offset,
@@ -193,6 +309,8 @@ static uint64_t stm32_rtc_read(void *opaque, hwaddr offset,
 
     Stm32Rtc *s = (Stm32Rtc *)opaque;
 
+    stm32_rtc_sync(s);
+
     switch (offset & 0xffffffff) {
 
         case RTC_PRLH_OFFSET:
@@ -208,13 +326,13 @@ static uint64_t stm32_rtc_read(void *opaque, hwaddr offset,
         case RTC_CRL_OFFSET:
             return s->RTC_CR[0];
         case RTC_DIVH_OFFSET:
-            return s->RTC_PRL[1];
+            return stm32_rtc_get_div(s) >> 16;
         case RTC_DIVL_OFFSET:
-            return s->RTC_PRL[0];
+            return stm32_rtc_get_div(s) & 0xffff;
         case RTC_CNTH_OFFSET:
-            return s->RTC_CNT[1];
+            return stm32_rtc_get_count(s) >> 16;
         case RTC_CNTL_OFFSET:
-            return s->RTC_CNT[0];;
+            return stm32_rtc_get_count(s) & 0xffff;
         case RTC_ALRH_OFFSET:
             return s->RTC_ALR[1];
         case RTC_ALRL_OFFSET:
@@ -231,6 +349,7 @@ static void stm32_rtc_write(void *opaque, hwaddr offset,
 
 
       Stm32Rtc *s = (Stm32Rtc *)opaque;
+      uint32_t cnt;
     /* software can only write in (PRL,ALR,CNT)
        registre if CNF bit is set */
 
@@ -241,6 +360,11 @@ static void stm32_rtc_write(void *opaque, hwaddr offset,
           hw_error("you are must enter to configuration \
                     mode for write in any registre");
       }       
+
+    /* Flags must be up to date before they are written or the time base
+     * is changed */
+    stm32_rtc_sync(s);
+
      /*ongoing writing operation */
     s->RTC_CR[0]&= ~(1 << RTC_CRL_RTOFF_BIT);
  
@@ -258,22 +382,11 @@ static void stm32_rtc_write(void *opaque, hwaddr offset,
            break;
         case RTC_PRLH_OFFSET:
             s->RTC_PRL[1]=value & 0x000f;
-             /* update prescaler if it's changed */
-            if(s->prescaler^(((s->RTC_PRL[1]&0x000f)<<16)|
-                           s->RTC_PRL[0])){
-               s->prescaler=((s->RTC_PRL[1]&0x000f)<<16)|
-                           s->RTC_PRL[0];
-            }
-            
+            stm32_rtc_set_prescaler(s);
            break;
         case RTC_PRLL_OFFSET:
             s->RTC_PRL[0]=value & 0xffff;
-             /* update prescaler if it's changed */
-            if(s->prescaler^(((s->RTC_PRL[1]&0x000f)<<16)|
-                           s->RTC_PRL[0])){
-               s->prescaler=((s->RTC_PRL[1]&0x000f)<<16)|
-                           s->RTC_PRL[0];
-            }
+            stm32_rtc_set_prescaler(s);
            break;
         case RTC_DIVH_OFFSET:
             hw_error("attempted to write\
@@ -284,10 +397,12 @@ static void stm32_rtc_write(void *opaque, hwaddr offset,
                       in DIVL registre");
            break;
         case RTC_CNTH_OFFSET:
-            s->RTC_CNT[1]=(value & 0xffff);
+            cnt = stm32_rtc_get_count(s);
+            stm32_rtc_set_count(s, ((value & 0xffff) << 16) | (cnt & 0xffff));
            break;
         case RTC_CNTL_OFFSET:
-            s->RTC_CNT[0]=(value & 0xffff);
+            cnt = stm32_rtc_get_count(s);
+            stm32_rtc_set_count(s, (cnt & 0xffff0000) | (value & 0xffff));
 	   break;
         case RTC_ALRH_OFFSET:
             s->RTC_ALR[1]=value & 0xffff;
@@ -303,6 +418,8 @@ static void stm32_rtc_write(void *opaque, hwaddr offset,
     /* set RTOFF bit for mark end of write operation */
     s->RTC_CR[0]|= (1 << RTC_CRL_RTOFF_BIT); 
 
+    stm32_rtc_update_irq(s);
+    stm32_rtc_schedule(s);
 }
 
 static const MemoryRegionOps stm32_rtc_ops = {
@@ -322,16 +439,14 @@ static int stm32_rtc_init(SysBusDevice *dev)
 
     qemu_irq *clk_irq;
     Stm32Rtc *s = STM32_Rtc(dev);
-    QEMUBH *bh;
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
 
     memory_region_init_io(&s->iomem, OBJECT(s), &stm32_rtc_ops, s,
-                          "rtc", 0x03ff);
+                          "rtc", STM32_PERIPH_SIZE);
     sysbus_init_mmio(dev, &s->iomem);
     sysbus_init_irq(dev, &s->irq);
 
-    bh = qemu_bh_new(stm32_rtc_tick, s);
-    s->ptimer = ptimer_init(bh);
+    s->timer = stm32_timer_new_ns(s->aio_context, stm32_rtc_timer_cb, s);
     
     /* Register handlers to handle updates to the RTC's peripheral clock. */
     clk_irq =
@@ -343,9 +458,39 @@ static int stm32_rtc_init(SysBusDevice *dev)
     return 0;
 }
 
+static int stm32_rtc_post_load(void *opaque, int version_id)
+{
+    Stm32Rtc *s = (Stm32Rtc *)opaque;
+
+    /* The host timer is armed again from the saved time base. */
+    stm32_rtc_schedule(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_rtc = {
+    .name = "stm32-rtc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_rtc_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16_ARRAY(RTC_CR, Stm32Rtc, 2),
+        VMSTATE_UINT16_ARRAY(RTC_PRL, Stm32Rtc, 2),
+        VMSTATE_UINT16_ARRAY(RTC_ALR, Stm32Rtc, 2),
+        VMSTATE_UINT32(freq, Stm32Rtc),
+        VMSTATE_UINT32(prescaler, Stm32Rtc),
+        VMSTATE_INT64(base_time, Stm32Rtc),
+        VMSTATE_UINT32(base_ticks, Stm32Rtc),
+        VMSTATE_UINT32(base_cnt, Stm32Rtc),
+        VMSTATE_UINT64(ticks_seen, Stm32Rtc),
+        VMSTATE_INT32(curr_irq_level, Stm32Rtc),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property stm32_rtc_properties[] = {
     DEFINE_PROP_PERIPH_T("periph", Stm32Rtc, periph, STM32_PERIPH_UNDEFINED),
     DEFINE_PROP_PTR("stm32_rcc", Stm32Rtc, stm32_rcc_prop),
+    DEFINE_PROP_PTR("aio_context", Stm32Rtc, aio_context),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -356,6 +501,7 @@ static void stm32_rtc_class_init(ObjectClass *klass, void *data)
 
     k->init = stm32_rtc_init;
     dc->reset = stm32_rtc_reset;
+    dc->vmsd = &vmstate_stm32_rtc;
     dc->props = stm32_rtc_properties;
 }
 
@@ -21,9 +21,9 @@
 
 #include "hw/sysbus.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
 #include "sysemu/sysemu.h"
 #include "hw/arm/stm32.h"
-#include "hw/ptimer.h"
 
 
 /* DEFINITIONS*/
@@ -60,6 +60,42 @@
 #define TIMER_DMAR_OFFSET  0x4C
 
 #define TIMER_CEN          0x1
+#define TIMER_SR_UIF       0x1
+#define TIMER_DIER_UIE     0x1
+#define TIMER_CC_COUNT     4
+/* Capture/compare flag and interrupt enable bits for channels 0 to 3
+ * (TIMx_CH1 to TIMx_CH4), in both SR and DIER */
+#define TIMER_CCIF(ch)     (0x2 << (ch))
+#define TIMER_CCIF_MASK    0x1e
+#define TIMER_CCER_CCE(ch) (0x1 << (4 * (ch)))
+#define TIMER_CCER_CCP(ch) (0x2 << (4 * (ch)))
+
+/* Master mode selection (CR2.MMS): what is sent on TRGO */
+#define TIMER_CR2_MMS(cr2)        (((cr2) >> 4) & 0x7)
+#define TIMER_MMS_RESET           0
+#define TIMER_MMS_ENABLE          1
+#define TIMER_MMS_UPDATE          2
+#define TIMER_MMS_COMPARE_PULSE   3
+#define TIMER_MMS_OC1REF          4
+
+/* Slave mode selection (SMCR.SMS) and trigger selection (SMCR.TS) */
+#define TIMER_SMCR_SMS(smcr)      ((smcr) & 0x7)
+#define TIMER_SMCR_TS(smcr)       (((smcr) >> 4) & 0x7)
+#define TIMER_SMS_RESET           4
+#define TIMER_SMS_GATED           5
+#define TIMER_SMS_TRIGGER         6
+#define TIMER_SMS_EXT_CLOCK       7
+
+/* Output compare modes (OCxM) */
+#define TIMER_OCM_TOGGLE          3
+#define TIMER_OCM_FORCE_INACTIVE  4
+#define TIMER_OCM_FORCE_ACTIVE    5
+#define TIMER_OCM_PWM1            6
+#define TIMER_OCM_PWM2            7
+
+/* Channel output pins, as GPIO index << 4 | pin */
+#define TIMER_PIN(gpio, pin) ((STM32_GPIO_INDEX_FROM_PERIPH(gpio) << 4) | (pin))
+#define TIMER_NO_PIN       -1
 
 enum
 {
@@ -73,33 +109,60 @@ struct Stm32Timer {
     SysBusDevice busdev;
 
     MemoryRegion  iomem;
-    ptimer_state *timer;
+    QEMUTimer    *timer;
     qemu_irq      irq;
+    /* Capture/compare interrupt.  Only TIM1 and TIM8 have a separate one -
+     * if this is not connected, capture/compare events use irq. */
+    qemu_irq      cc_irq;
+    /* Trigger output, pulsed on every line for each TRGO event */
+    qemu_irq      trgo[STM32_TIMER_TRGO_LINES];
 
     /* Properties */
     stm32_periph_t periph;
     void *stm32_rcc_prop;
     void *stm32_gpio_prop;
     void *stm32_afio_prop;
+    /* AioContext in which the timers run, NULL for the main loop */
+    void *aio_context;
 
     Stm32Rcc *stm32_rcc;
     Stm32Gpio **stm32_gpio;
     Stm32Afio *stm32_afio;
 
-    int running;
     int countMode;
-    int itr;
+    int center;
+
+    /* The counter is not stepped.  Instead, its position within the
+     * counting period is calculated from the virtual time elapsed since it
+     * was last rebased (i.e. since the last register write or clock change
+     * which affected it).  The position runs from 0 to period - 1 and is
+     * mapped to CNT according to the counting mode.  An update event
+     * happens every update_interval ticks of the position.  A host timer is
+     * only armed for the next event (update or compare match) which could
+     * raise an interrupt - otherwise the flags are brought up to date
+     * when the guest reads the registers.  freq is the clock in front of
+     * the prescaler, so a tick takes exactly (psc + 1) / freq seconds and
+     * the events of a long count do not drift from a rounded tick rate. */
+    uint32_t freq;
+    int64_t base_time;
+    uint32_t base_pos;
+    uint64_t events_seen;
+    /* Position (counted from the rebase, not wrapped) at the last sync */
+    uint64_t synced_pos;
+
+    /* Pin each channel's PWM output was last reported on */
+    int pwm_pin[TIMER_CC_COUNT];
 
     uint32_t cr1;
-    /* uint32_t cr2; Extended modes not supported */
-    /* uint32_t smcr; Slave mode not supported */
+    uint32_t cr2;
+    uint32_t smcr;
     uint32_t dier;
     uint32_t sr;
     uint32_t egr;
     uint32_t ccmr1;
     uint32_t ccmr2;
     uint32_t ccer;
-    /* uint32_t cnt; Handled by ptimer */
+    /* uint32_t cnt; Calculated from base_time and base_pos */
     uint32_t psc;
     uint32_t arr;
     /* uint32_t rcr; Repetition count not supported */
@@ -113,60 +176,619 @@ struct Stm32Timer {
 
 };
 
-static void stm32_timer_freq(Stm32Timer *s)
+static uint32_t stm32_timer_period(Stm32Timer *s)
 {
-    // Why do we need to multiply the frequency by 2?  This is how real hardware
-    // behaves.
-    uint32_t clk_freq = 2*stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph) / (s->psc + 1);
-    DPRINTF
-    (
-        "%s Update freq = 2 * %d / %d = %d\n",
-        stm32_periph_name(s->periph),
-        stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph),
-        (s->psc + 1),
-        clk_freq
-    );
-    if(clk_freq != 0) {
-        ptimer_set_freq(s->timer, clk_freq);
+    /* Center-aligned mode counts from 0 up to ARR and back down again. */
+    return s->center ? 2 * s->arr : s->arr + 1;
+}
+
+static uint32_t stm32_timer_update_interval(Stm32Timer *s)
+{
+    /* Center-aligned mode has an update event at both ends of the count. */
+    return s->center ? s->arr : s->arr + 1;
+}
+
+static uint32_t stm32_timer_pos_to_count(Stm32Timer *s, uint32_t pos)
+{
+    if (s->center)
+    {
+        return pos <= s->arr ? pos : 2 * s->arr - pos;
+    }
+    else if (s->countMode == TIMER_UP_COUNT)
+    {
+        return pos;
+    }
+    else
+    {
+        return s->arr - pos;
     }
 }
 
-static uint32_t stm32_timer_get_count(Stm32Timer *s)
+static uint32_t stm32_timer_count_to_pos(Stm32Timer *s, uint32_t cnt)
 {
-    uint64_t cnt = ptimer_get_count(s->timer);
-    if (s->countMode == TIMER_UP_COUNT)
+    if (cnt > s->arr)
     {
-        return s->arr - (cnt & 0xfffff);
+        cnt = s->arr;
+    }
+
+    if (s->center || s->countMode == TIMER_UP_COUNT)
+    {
+        return cnt;
     }
     else
     {
-        return (cnt & 0xffff);
+        return s->arr - cnt;
     }
 }
 
-static void stm32_timer_set_count(Stm32Timer *s, uint32_t cnt)
+/* Returns the number of counter ticks since the last rebase. */
+static uint64_t stm32_timer_ticks(Stm32Timer *s, int64_t now)
+{
+    if (!(s->cr1 & TIMER_CEN) || s->freq == 0 || now <= s->base_time)
+    {
+        return 0;
+    }
+
+    return muldiv64(now - s->base_time, s->freq, get_ticks_per_sec()) /
+           (s->psc + 1);
+}
+
+/* Returns the time from the last rebase to the first nanosecond at which
+ * stm32_timer_ticks() reaches ticks. */
+static int64_t stm32_timer_ticks_to_ns(Stm32Timer *s, uint64_t ticks)
+{
+    uint64_t lo, hi;
+
+    mulu64(&lo, &hi, ticks * (s->psc + 1), get_ticks_per_sec());
+    divu128(&lo, &hi, s->freq);
+    /* hi is now the remainder */
+    return lo + (hi != 0);
+}
+
+static uint32_t stm32_timer_get_ccr(Stm32Timer *s, int ch)
+{
+    switch (ch)
+    {
+    case 0:
+        return s->ccr1;
+    case 1:
+        return s->ccr2;
+    case 2:
+        return s->ccr3;
+    default:
+        return s->ccr4;
+    }
+}
+
+/* Returns the channel's byte of CCMR1 or CCMR2. */
+static uint32_t stm32_timer_get_ccmr(Stm32Timer *s, int ch)
+{
+    return ((ch < 2 ? s->ccmr1 : s->ccmr2) >> (8 * (ch & 1))) & 0xff;
+}
+
+/* Returns true if the channel is configured as an output (CCxS = 00).
+ * Input capture is not supported. */
+static bool stm32_timer_cc_is_output(Stm32Timer *s, int ch)
 {
-    if (s->countMode == TIMER_UP_COUNT)
+    return (stm32_timer_get_ccmr(s, ch) & 0x3) == 0;
+}
+
+/* Gets the positions within the counting period at which CNT matches the
+ * channel's CCR.  Returns the number of positions (0 to 2). */
+static int stm32_timer_cc_positions(Stm32Timer *s, int ch, uint32_t *pos)
+{
+    uint32_t ccr = stm32_timer_get_ccr(s, ch);
+
+    if (!stm32_timer_cc_is_output(s, ch) || ccr > s->arr)
+    {
+        return 0;
+    }
+
+    if (s->center)
     {
-        ptimer_set_count(s->timer, s->arr - (cnt & 0xfffff));
+        /* The count passes CCR on the way up and on the way down, except
+         * at the turning points. */
+        pos[0] = ccr;
+        if (ccr == 0 || ccr == s->arr)
+        {
+            return 1;
+        }
+        pos[1] = 2 * s->arr - ccr;
+        return 2;
+    }
+
+    pos[0] = stm32_timer_count_to_pos(s, ccr);
+    return 1;
+}
+
+/* Returns the number of positions in [0, limit] which fall on pos in a
+ * period of the given length. */
+static uint64_t stm32_timer_count_matches(uint64_t limit, uint32_t pos,
+                                          uint32_t period)
+{
+    return limit < pos ? 0 : (limit - pos) / period + 1;
+}
+
+/* Returns the first position after the given one which falls on pos. */
+static uint64_t stm32_timer_next_match(uint64_t after, uint32_t pos,
+                                       uint32_t period)
+{
+    return pos + stm32_timer_count_matches(after, pos, period) * period;
+}
+
+static bool stm32_timer_trgo_connected(Stm32Timer *s)
+{
+    int i;
+
+    for (i = 0; i < STM32_TIMER_TRGO_LINES; i++)
+    {
+        if (s->trgo[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Returns the channel whose compare matches are sent on TRGO, or -1.  The
+ * OCxREF modes are approximated by a pulse at each match of the channel,
+ * which is where OCxREF rises in the PWM and toggle modes. */
+static int stm32_timer_trgo_channel(Stm32Timer *s)
+{
+    int mms = TIMER_CR2_MMS(s->cr2);
+
+    if (mms == TIMER_MMS_COMPARE_PULSE)
+    {
+        return 0;
+    }
+    return mms >= TIMER_MMS_OC1REF ? mms - TIMER_MMS_OC1REF : -1;
+}
+
+static void stm32_timer_trgo(Stm32Timer *s)
+{
+    int i;
+
+    for (i = 0; i < STM32_TIMER_TRGO_LINES; i++)
+    {
+        if (s->trgo[i])
+        {
+            qemu_irq_pulse(s->trgo[i]);
+        }
+    }
+}
+
+static void stm32_timer_update_irq(Stm32Timer *s)
+{
+    int update = (s->sr & TIMER_SR_UIF) && (s->dier & TIMER_DIER_UIE);
+    int cc = (s->sr & s->dier & TIMER_CCIF_MASK) != 0;
+
+    if (s->cc_irq)
+    {
+        qemu_set_irq(s->irq, update);
+        qemu_set_irq(s->cc_irq, cc);
     }
     else
     {
-        ptimer_set_count(s->timer, cnt & 0xffff);
+        qemu_set_irq(s->irq, update || cc);
+    }
+}
+
+/* Restart the analytic count from the given position at the current time.
+ * Must be called (after syncing) whenever the frequency, period or mode
+ * changes. */
+static void stm32_timer_rebase(Stm32Timer *s, int64_t now, uint32_t pos)
+{
+    uint32_t interval = stm32_timer_update_interval(s);
+
+    s->base_time = now;
+    s->base_pos = pos;
+    s->synced_pos = pos;
+    /* In center-aligned mode the position may already be past the first
+     * update event. */
+    s->events_seen = interval ? pos / interval : 0;
+}
+
+static void stm32_timer_update_pwm(Stm32Timer *s);
+
+/* Bring CNT, the update and compare flags and (in one-pulse mode) CEN up to
+ * date with the current virtual time. */
+static void stm32_timer_sync(Stm32Timer *s, int64_t now)
+{
+    uint64_t pos, stop_pos, events;
+    uint32_t interval = stm32_timer_update_interval(s);
+    uint32_t period = stm32_timer_period(s);
+    uint32_t cc_pos[2];
+    int ch, i, n;
+    int trgo_ch = stm32_timer_trgo_channel(s);
+    bool stopped = false;
+    bool trgo = false;
+
+    if (!(s->cr1 & TIMER_CEN) || interval == 0)
+    {
+        return;
+    }
+
+    pos = s->base_pos + stm32_timer_ticks(s, now);
+    stop_pos = (s->events_seen + 1) * interval;
+    if ((s->cr1 & 0x04) && pos >= stop_pos) /* one shot */
+    {
+        /* The counter stops at the first update event. */
+        pos = stop_pos;
+        stopped = true;
+    }
+
+    if (pos == s->synced_pos)
+    {
+        return;
+    }
+
+    for (ch = 0; ch < TIMER_CC_COUNT; ch++)
+    {
+        n = stm32_timer_cc_positions(s, ch, cc_pos);
+        for (i = 0; i < n; i++)
+        {
+            if (stm32_timer_count_matches(pos, cc_pos[i], period) >
+                stm32_timer_count_matches(s->synced_pos, cc_pos[i], period))
+            {
+                DPRINTF("%s CC%d match\n", stm32_periph_name(s->periph), ch + 1);
+                s->sr |= TIMER_CCIF(ch);
+                trgo |= ch == trgo_ch;
+            }
+        }
+    }
+    s->synced_pos = pos;
+
+    events = pos / interval;
+    if (events > s->events_seen)
+    {
+        DPRINTF("%s Alarm raised\n", stm32_periph_name(s->periph));
+        s->events_seen = events;
+        s->sr |= TIMER_SR_UIF;
+        trgo |= TIMER_CR2_MMS(s->cr2) == TIMER_MMS_UPDATE;
+    }
+
+    if (stopped)
+    {
+        s->cr1 &= ~TIMER_CEN;
+        stm32_timer_rebase(s, now, stop_pos % period);
+        stm32_timer_update_pwm(s);
+    }
+    stm32_timer_update_irq(s);
+
+    /* Several events coalesced by a late host timer make a single pulse,
+     * as a slave which is still busy would have ignored the others. */
+    if (trgo)
+    {
+        stm32_timer_trgo(s);
+    }
+}
+
+/* Returns the current position within the counting period. */
+static uint32_t stm32_timer_get_pos(Stm32Timer *s, int64_t now)
+{
+    uint32_t period = stm32_timer_period(s);
+
+    if(period == 0)
+    {
+        return 0;
+    }
+    return (s->base_pos + stm32_timer_ticks(s, now)) % period;
+}
+
+static uint32_t stm32_timer_get_count(Stm32Timer *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    stm32_timer_sync(s, now);
+    return stm32_timer_pos_to_count(s, stm32_timer_get_pos(s, now));
+}
+
+/* Arm the host timer for the earliest event which could raise an
+ * interrupt: the next update event and the next match of each channel
+ * all share the one host timer.  Events whose flag is already pending
+ * cannot change anything visible until the guest clears the flag, so
+ * they are left out - unless they are sent on TRGO, where a slave acts
+ * on them whatever the flags. */
+static void stm32_timer_schedule(Stm32Timer *s)
+{
+    uint64_t deadline = UINT64_MAX;
+    uint32_t interval = stm32_timer_update_interval(s);
+    uint32_t period = stm32_timer_period(s);
+    uint32_t cc_pos[2];
+    int ch, i, n;
+    int trgo_ch = -1;
+
+    if (!(s->cr1 & TIMER_CEN) || s->freq == 0 || interval == 0)
+    {
+        timer_del(s->timer);
+        return;
+    }
+
+    if (stm32_timer_trgo_connected(s))
+    {
+        if (TIMER_CR2_MMS(s->cr2) == TIMER_MMS_UPDATE)
+        {
+            deadline = (s->events_seen + 1) * interval;
+        }
+        trgo_ch = stm32_timer_trgo_channel(s);
+    }
+
+    if ((s->dier & TIMER_DIER_UIE) && !(s->sr & TIMER_SR_UIF))
+    {
+        deadline = (s->events_seen + 1) * interval;
+    }
+
+    for (ch = 0; ch < TIMER_CC_COUNT; ch++)
+    {
+        if (ch != trgo_ch &&
+            (!(s->dier & TIMER_CCIF(ch)) || (s->sr & TIMER_CCIF(ch))))
+        {
+            continue;
+        }
+        n = stm32_timer_cc_positions(s, ch, cc_pos);
+        for (i = 0; i < n; i++)
+        {
+            deadline = MIN(deadline, stm32_timer_next_match(s->synced_pos,
+                                                            cc_pos[i], period));
+        }
+    }
+
+    if (deadline == UINT64_MAX)
+    {
+        timer_del(s->timer);
+        return;
+    }
+
+    timer_mod(s->timer, s->base_time +
+              stm32_timer_ticks_to_ns(s, deadline - s->base_pos));
+}
+
+/* Gets the GPIO and pin a channel outputs to, according to the current
+ * AFIO remapping.  Returns TIMER_NO_PIN if the channel has no pin, which
+ * is always the case without an AFIO (STM32F4), where the pin depends on
+ * the GPIO alternate function selection. */
+static int stm32_timer_get_channel_pin(Stm32Timer *s, int ch)
+{
+    static const int8_t tim1_pins[2][TIMER_CC_COUNT] = {
+        { TIMER_PIN(STM32_GPIOA, 8), TIMER_PIN(STM32_GPIOA, 9),
+          TIMER_PIN(STM32_GPIOA, 10), TIMER_PIN(STM32_GPIOA, 11) },
+        { TIMER_PIN(STM32_GPIOE, 9), TIMER_PIN(STM32_GPIOE, 11),
+          TIMER_PIN(STM32_GPIOE, 13), TIMER_PIN(STM32_GPIOE, 14) }
+    };
+    static const int8_t tim2_pins[4][TIMER_CC_COUNT] = {
+        { TIMER_PIN(STM32_GPIOA, 0), TIMER_PIN(STM32_GPIOA, 1),
+          TIMER_PIN(STM32_GPIOA, 2), TIMER_PIN(STM32_GPIOA, 3) },
+        { TIMER_PIN(STM32_GPIOA, 15), TIMER_PIN(STM32_GPIOB, 3),
+          TIMER_PIN(STM32_GPIOA, 2), TIMER_PIN(STM32_GPIOA, 3) },
+        { TIMER_PIN(STM32_GPIOA, 0), TIMER_PIN(STM32_GPIOA, 1),
+          TIMER_PIN(STM32_GPIOB, 10), TIMER_PIN(STM32_GPIOB, 11) },
+        { TIMER_PIN(STM32_GPIOA, 15), TIMER_PIN(STM32_GPIOB, 3),
+          TIMER_PIN(STM32_GPIOB, 10), TIMER_PIN(STM32_GPIOB, 11) }
+    };
+    static const int8_t tim3_pins[3][TIMER_CC_COUNT] = {
+        { TIMER_PIN(STM32_GPIOA, 6), TIMER_PIN(STM32_GPIOA, 7),
+          TIMER_PIN(STM32_GPIOB, 0), TIMER_PIN(STM32_GPIOB, 1) },
+        { TIMER_PIN(STM32_GPIOB, 4), TIMER_PIN(STM32_GPIOB, 5),
+          TIMER_PIN(STM32_GPIOB, 0), TIMER_PIN(STM32_GPIOB, 1) },
+        { TIMER_PIN(STM32_GPIOC, 6), TIMER_PIN(STM32_GPIOC, 7),
+          TIMER_PIN(STM32_GPIOC, 8), TIMER_PIN(STM32_GPIOC, 9) }
+    };
+    static const int8_t tim4_pins[2][TIMER_CC_COUNT] = {
+        { TIMER_PIN(STM32_GPIOB, 6), TIMER_PIN(STM32_GPIOB, 7),
+          TIMER_PIN(STM32_GPIOB, 8), TIMER_PIN(STM32_GPIOB, 9) },
+        { TIMER_PIN(STM32_GPIOD, 12), TIMER_PIN(STM32_GPIOD, 13),
+          TIMER_PIN(STM32_GPIOD, 14), TIMER_PIN(STM32_GPIOD, 15) }
+    };
+    static const int8_t tim5_pins[TIMER_CC_COUNT] = {
+        TIMER_PIN(STM32_GPIOA, 0), TIMER_PIN(STM32_GPIOA, 1),
+        TIMER_PIN(STM32_GPIOA, 2), TIMER_PIN(STM32_GPIOA, 3)
+    };
+    static const int8_t tim8_pins[TIMER_CC_COUNT] = {
+        TIMER_PIN(STM32_GPIOC, 6), TIMER_PIN(STM32_GPIOC, 7),
+        TIMER_PIN(STM32_GPIOC, 8), TIMER_PIN(STM32_GPIOC, 9)
+    };
+
+    if (!s->stm32_afio) {
+        return TIMER_NO_PIN;
+    }
+
+    switch (s->periph)
+    {
+    case STM32_TIM1:
+        return tim1_pins[stm32_afio_get_periph_map(s->stm32_afio, s->periph) ==
+                         STM32_TIM1_FULL_REMAP][ch];
+    case STM32_TIM2:
+        return tim2_pins[stm32_afio_get_periph_map(s->stm32_afio, s->periph)][ch];
+    case STM32_TIM3:
+        switch (stm32_afio_get_periph_map(s->stm32_afio, s->periph))
+        {
+        case STM32_TIM3_PARTIAL_REMAP:
+            return tim3_pins[1][ch];
+        case STM32_TIM3_FULL_REMAP:
+            return tim3_pins[2][ch];
+        default:
+            return tim3_pins[0][ch];
+        }
+    case STM32_TIM4:
+        return tim4_pins[stm32_afio_get_periph_map(s->stm32_afio, s->periph)][ch];
+    case STM32_TIM5:
+        return tim5_pins[ch];
+    case STM32_TIM8:
+        return tim8_pins[ch];
+    default:
+        return TIMER_NO_PIN;
+    }
+}
+
+/* Works out the PWM period and duty cycle of a channel's output.  Returns
+ * a period of 0 if the output is disabled, or is not in a mode which
+ * produces a steady waveform. */
+static uint64_t stm32_timer_get_channel_pwm(Stm32Timer *s, int ch,
+                                            uint32_t *duty)
+{
+    uint32_t period = stm32_timer_period(s);
+    uint32_t ccr = stm32_timer_get_ccr(s, ch);
+    uint32_t ocm = (stm32_timer_get_ccmr(s, ch) >> 4) & 0x7;
+    uint64_t period_ns, active;
+
+    *duty = 0;
+    if (!(s->ccer & TIMER_CCER_CCE(ch)) || !stm32_timer_cc_is_output(s, ch) ||
+        s->freq == 0 || period == 0)
+    {
+        return 0;
+    }
+    period_ns = muldiv64((uint64_t)period * (s->psc + 1), get_ticks_per_sec(),
+                         s->freq);
+
+    switch (ocm)
+    {
+    case TIMER_OCM_FORCE_INACTIVE:
+        break;
+    case TIMER_OCM_FORCE_ACTIVE:
+        *duty = STM32_GPIO_PWM_DUTY_MAX;
+        break;
+    case TIMER_OCM_TOGGLE:
+        if (!(s->cr1 & TIMER_CEN))
+        {
+            return 0;
+        }
+        /* The output toggles once per counting period */
+        period_ns *= 2;
+        *duty = STM32_GPIO_PWM_DUTY_MAX / 2;
+        break;
+    case TIMER_OCM_PWM1:
+    case TIMER_OCM_PWM2:
+        if (!(s->cr1 & TIMER_CEN))
+        {
+            return 0;
+        }
+        /* In PWM mode 1 the output is active while CNT < CCR when counting
+         * up, and while CNT <= CCR when counting down. */
+        if (s->center)
+        {
+            active = MIN(ccr, s->arr) * 2;
+        }
+        else if (s->countMode == TIMER_UP_COUNT)
+        {
+            active = MIN(ccr, s->arr + 1);
+        }
+        else
+        {
+            active = MIN(ccr + 1, s->arr + 1);
+        }
+        *duty = active * STM32_GPIO_PWM_DUTY_MAX / period;
+        if (ocm == TIMER_OCM_PWM2)
+        {
+            *duty = STM32_GPIO_PWM_DUTY_MAX - *duty;
+        }
+        break;
+    default:
+        /* Frozen and active/inactive on match modes only change the
+         * output level on a match, which is not modelled. */
+        return 0;
+    }
+
+    if (s->ccer & TIMER_CCER_CCP(ch)) /* active low */
+    {
+        *duty = STM32_GPIO_PWM_DUTY_MAX - *duty;
     }
+    return period_ns;
+}
+
+/* Report changes to the channel outputs to the GPIOs.  The waveform is
+ * described by its period and duty cycle, so the GPIO only hears about it
+ * when the timer configuration changes, not on every edge.  AFIO remapping
+ * changes are picked up at the next timer register write. */
+static void stm32_timer_update_pwm(Stm32Timer *s)
+{
+    uint64_t period_ns;
+    uint32_t duty;
+    int ch, pin;
+    Stm32Gpio *gpio;
+
+    for (ch = 0; ch < TIMER_CC_COUNT; ch++)
+    {
+        period_ns = stm32_timer_get_channel_pwm(s, ch, &duty);
+        pin = period_ns ? stm32_timer_get_channel_pin(s, ch) : TIMER_NO_PIN;
+        if (pin != TIMER_NO_PIN && !s->stm32_gpio[pin >> 4])
+        {
+            pin = TIMER_NO_PIN;
+        }
+
+        if (s->pwm_pin[ch] != TIMER_NO_PIN && s->pwm_pin[ch] != pin)
+        {
+            gpio = s->stm32_gpio[s->pwm_pin[ch] >> 4];
+            stm32_gpio_set_pwm(gpio, s->pwm_pin[ch] & 0xf, 0, 0);
+        }
+        s->pwm_pin[ch] = pin;
+        if (pin != TIMER_NO_PIN)
+        {
+            gpio = s->stm32_gpio[pin >> 4];
+            stm32_gpio_set_pwm(gpio, pin & 0xf, period_ns, duty);
+        }
+    }
+}
+
+static void stm32_timer_freq(Stm32Timer *s)
+{
+    // Why do we need to multiply the frequency by 2?  This is how real hardware
+    // behaves.
+    uint32_t clk_freq = 2*stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph);
+    DPRINTF
+    (
+        "%s Update freq = 2 * %d / %d\n",
+        stm32_periph_name(s->periph),
+        stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph),
+        (s->psc + 1)
+    );
+    /* A stopped clock (e.g. in Stop mode) holds the count.  In external
+     * clock mode, the count only moves on trigger input edges. */
+    if (TIMER_SMCR_SMS(s->smcr) == TIMER_SMS_EXT_CLOCK)
+    {
+        clk_freq = 0;
+    }
+    s->freq = clk_freq;
+}
+
+static void stm32_timer_set_count(Stm32Timer *s, uint32_t cnt)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    stm32_timer_sync(s, now);
+    stm32_timer_rebase(s, now, stm32_timer_count_to_pos(s, cnt & 0xffff));
+    stm32_timer_schedule(s);
 }
 
 static void stm32_timer_clk_irq_handler(void *opaque, int n, int level)
 {
     Stm32Timer *s = (Stm32Timer *)opaque;
+    int64_t now;
 
     assert(n == 0);
 
-    stm32_timer_freq(s);
+    /* The frequency is picked up again when the timer is enabled, so there
+     * is nothing to do while it is stopped. */
+    if (s->cr1 & TIMER_CEN) {
+        now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        stm32_timer_sync(s, now);
+        stm32_timer_rebase(s, now, stm32_timer_get_pos(s, now));
+        stm32_timer_freq(s);
+        stm32_timer_schedule(s);
+        stm32_timer_update_pwm(s);
+    }
 }
 
-static void stm32_timer_update(Stm32Timer *s)
+/* Apply a write to CR1.  The counter keeps its value across mode changes. */
+static void stm32_timer_update(Stm32Timer *s, uint32_t cr1)
 {
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t cnt;
+    bool started = (cr1 & TIMER_CEN) && !(s->cr1 & TIMER_CEN);
+
+    stm32_timer_sync(s, now);
+    cnt = stm32_timer_pos_to_count(s, stm32_timer_get_pos(s, now));
+
+    s->cr1 = cr1;
     stm32_timer_freq(s);
 
     if (s->cr1 & 0x10) /* dir bit */
@@ -178,66 +800,94 @@ static void stm32_timer_update(Stm32Timer *s)
         s->countMode = TIMER_UP_COUNT;
     }
 
+    s->center = 0;
     if (s->cr1 & 0x060) /* CMS */
     {
         s->countMode = TIMER_UP_COUNT;
+        s->center = 1;
     }
 
     if (s->cr1 & 0x01) /* timer enable */
     {
         DPRINTF("%s Enabling timer\n", stm32_periph_name(s->periph));
-        ptimer_run(s->timer, !(s->cr1 & 0x04));
     }
     else
     {
         DPRINTF("%s Disabling timer\n", stm32_periph_name(s->periph));
-        ptimer_stop(s->timer);
     }
-}
 
-static void stm32_timer_update_UIF(Stm32Timer *s, uint8_t value) {
-    s->sr &= ~0x1; /* update interrupt flag in status reg */
-    s->sr |= (value & 0x1);
+    stm32_timer_rebase(s, now, stm32_timer_count_to_pos(s, cnt));
+    stm32_timer_schedule(s);
+    stm32_timer_update_pwm(s);
 
-    qemu_set_irq(s->irq, value);
+    if (started && TIMER_CR2_MMS(s->cr2) == TIMER_MMS_ENABLE)
+    {
+        stm32_timer_trgo(s);
+    }
 }
 
-static void stm32_timer_tick(void *opaque)
+/* A pulse on one of the internal trigger inputs ITR0 to ITR3, i.e. on the
+ * TRGO of another timer.  Only the input selected by SMCR.TS is used.  The
+ * TI1/TI2/ETR trigger sources and gated mode need a level rather than
+ * pulses and are not modelled. */
+static void stm32_timer_itr(void *opaque, int n, int level)
 {
     Stm32Timer *s = (Stm32Timer *)opaque;
-    DPRINTF("%s Alarm raised\n", stm32_periph_name(s->periph));
-    s->itr = 1;
-    stm32_timer_update_UIF(s, 1);
+    int64_t now;
+    uint32_t period;
 
-    if (s->countMode == TIMER_UP_COUNT)
+    if (!level || TIMER_SMCR_TS(s->smcr) != n)
     {
-        stm32_timer_set_count(s, 0);
-    }
-    else
-    {
-        stm32_timer_set_count(s, s->arr);
+        return;
     }
 
-    if (s->cr1 & 0x0060) /* CMS */
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    switch (TIMER_SMCR_SMS(s->smcr))
     {
-        if (s->countMode == TIMER_UP_COUNT)
+    case TIMER_SMS_RESET:
+        /* Reinitialise the counter and generate an update event */
+        stm32_timer_sync(s, now);
+        stm32_timer_rebase(s, now, 0);
+        s->sr |= TIMER_SR_UIF;
+        stm32_timer_update_irq(s);
+        stm32_timer_schedule(s);
+        break;
+    case TIMER_SMS_TRIGGER:
+        if (!(s->cr1 & TIMER_CEN))
         {
-            s->countMode = TIMER_DOWN_COUNT;
+            stm32_timer_update(s, s->cr1 | TIMER_CEN);
         }
-        else
+        break;
+    case TIMER_SMS_EXT_CLOCK:
+        /* Each edge is one counter tick.  This is how timers are chained
+         * into a wider counter, the master's update events clocking the
+         * slave. */
+        if (s->cr1 & TIMER_CEN)
         {
-            s->countMode = TIMER_UP_COUNT;
+            s->base_pos++;
+            stm32_timer_sync(s, now);
+            period = stm32_timer_period(s);
+            if (period && s->base_pos >= period)
+            {
+                stm32_timer_rebase(s, now, s->base_pos % period);
+            }
         }
+        break;
+    case TIMER_SMS_GATED:
+        qemu_log_mask(LOG_UNIMP,
+                      "stm32_timer: gated slave mode not supported\n");
+        break;
+    default:
+        break;
     }
+}
 
-    if (s->cr1 & 0x04) /* one shot */
-    {
-        s->cr1 &= 0xFFFE;
-    }
-    else
-    {
-        stm32_timer_update(s);
-    }
+static void stm32_timer_tick(void *opaque)
+{
+    Stm32Timer *s = (Stm32Timer *)opaque;
+
+    stm32_timer_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    stm32_timer_schedule(s);
 }
 
 static uint64_t stm32_timer_read(void *opaque, hwaddr offset,
@@ -245,16 +895,16 @@ static uint64_t stm32_timer_read(void *opaque, hwaddr offset,
 {
     Stm32Timer *s = (Stm32Timer *)opaque;
 
+    stm32_timer_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+
     switch (offset) {
     case TIMER_CR1_OFFSET:
         DPRINTF("%s cr1 = %x\n", stm32_periph_name(s->periph), s->cr1);
         return s->cr1;
     case TIMER_CR2_OFFSET:
-        qemu_log_mask(LOG_GUEST_ERROR, "stm32_timer: CR2 not supported");
-        return 0;
+        return s->cr2;
     case TIMER_SMCR_OFFSET:
-        qemu_log_mask(LOG_GUEST_ERROR, "stm32_timer: SMCR not supported");
-        return 0;
+        return s->smcr;
     case TIMER_DIER_OFFSET:
         DPRINTF("%s dier = %x\n", stm32_periph_name(s->periph), s->dier);
         return s->dier;
@@ -319,28 +969,46 @@ static void stm32_timer_write(void * opaque, hwaddr offset,
                         uint64_t value, unsigned size)
 {
     Stm32Timer *s = (Stm32Timer *)opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
 
     switch (offset) {
     case TIMER_CR1_OFFSET:
-        s->cr1 = value & 0x3FF;
+        stm32_timer_update(s, value & 0x3FF);
         DPRINTF("%s cr1 = %x\n", stm32_periph_name(s->periph), s->cr1);
-        stm32_timer_update(s);
         break;
     case TIMER_CR2_OFFSET:
-        /* s->cr2 = value & 0xF8; */
-        qemu_log_mask(LOG_GUEST_ERROR, "stm32_timer: CR2 not supported");
+        /* Only MMS has an effect; the output idle states of TIM1 are not
+         * modelled. */
+        stm32_timer_sync(s, now);
+        s->cr2 = value & 0xF8;
+        stm32_timer_schedule(s);
+        DPRINTF("%s cr2 = %x\n", stm32_periph_name(s->periph), s->cr2);
         break;
     case TIMER_SMCR_OFFSET:
-        qemu_log_mask(LOG_GUEST_ERROR, "stm32_timer: SMCR not supported");
+        /* Entering or leaving external clock mode changes the frequency */
+        stm32_timer_sync(s, now);
+        stm32_timer_rebase(s, now, stm32_timer_get_pos(s, now));
+        s->smcr = value & 0xFFF7;
+        stm32_timer_freq(s);
+        stm32_timer_schedule(s);
+        stm32_timer_update_pwm(s);
+        DPRINTF("%s smcr = %x\n", stm32_periph_name(s->periph), s->smcr);
         break;
     case TIMER_DIER_OFFSET:
+        stm32_timer_sync(s, now);
         s->dier = value & 0x5F5F;
+        stm32_timer_update_irq(s);
+        stm32_timer_schedule(s);
         DPRINTF("%s dier = %x\n", stm32_periph_name(s->periph), s->dier);
         break;
     case TIMER_SR_OFFSET:
-        s->sr ^= (value ^ 0xFFFF);
-        s->sr &= 0x1eFF;
-        stm32_timer_update_UIF(s, s->sr & 0x1);
+        /* Flags are cleared by writing 0 and left alone by writing 1.
+         * Bring UIF up to date first so that an update event which has
+         * already happened is cleared. */
+        stm32_timer_sync(s, now);
+        s->sr &= value & 0x1eFF;
+        stm32_timer_update_irq(s);
+        stm32_timer_schedule(s);
         DPRINTF("%s sr = %x\n", stm32_periph_name(s->periph), s->sr);
         break;
     case TIMER_EGR_OFFSET:
@@ -351,20 +1019,32 @@ static void stm32_timer_write(void * opaque, hwaddr offset,
         }
         if (value & 0x1) {
              /* UG bit - reload count */
-            ptimer_set_limit(s->timer, s->arr, 1);
+            stm32_timer_sync(s, now);
+            stm32_timer_rebase(s, now, 0);
+            stm32_timer_schedule(s);
+            if (TIMER_CR2_MMS(s->cr2) == TIMER_MMS_RESET) {
+                stm32_timer_trgo(s);
+            }
         }
         DPRINTF("%s egr = %x\n", stm32_periph_name(s->periph), s->egr);
         break;
     case TIMER_CCMR1_OFFSET:
+        stm32_timer_sync(s, now);
         s->ccmr1 = value & 0xffff;
+        stm32_timer_schedule(s);
+        stm32_timer_update_pwm(s);
         DPRINTF("%s ccmr1 = %x\n", stm32_periph_name(s->periph), s->ccmr1);
         break;
     case TIMER_CCMR2_OFFSET:
+        stm32_timer_sync(s, now);
         s->ccmr2 = value & 0xffff;
+        stm32_timer_schedule(s);
+        stm32_timer_update_pwm(s);
         DPRINTF("%s ccmr2 = %x\n", stm32_periph_name(s->periph), s->ccmr2);
         break;
     case TIMER_CCER_OFFSET:
         s->ccer = value & 0x3333;
+        stm32_timer_update_pwm(s);
         DPRINTF("%s ccer = %x\n", stm32_periph_name(s->periph), s->ccer);
         break;
     case TIMER_CNT_OFFSET:
@@ -372,13 +1052,21 @@ static void stm32_timer_write(void * opaque, hwaddr offset,
         DPRINTF("%s cnt = %x\n", stm32_periph_name(s->periph), stm32_timer_get_count(s));
         break;
     case TIMER_PSC_OFFSET:
+        stm32_timer_sync(s, now);
+        stm32_timer_rebase(s, now, stm32_timer_get_pos(s, now));
         s->psc = value & 0xffff;
         DPRINTF("%s psc = %x\n", stm32_periph_name(s->periph), s->psc);
         stm32_timer_freq(s);
+        stm32_timer_schedule(s);
+        stm32_timer_update_pwm(s);
         break;
     case TIMER_ARR_OFFSET:
+        /* As before, changing ARR restarts the count. */
+        stm32_timer_sync(s, now);
         s->arr = value & 0xffff;
-        ptimer_set_limit(s->timer, s->arr, 1);
+        stm32_timer_rebase(s, now, 0);
+        stm32_timer_schedule(s);
+        stm32_timer_update_pwm(s);
         DPRINTF("%s arr = %x\n", stm32_periph_name(s->periph), s->arr);
         break;
     case TIMER_RCR_OFFSET:
@@ -386,19 +1074,31 @@ static void stm32_timer_write(void * opaque, hwaddr offset,
         /* s->rcr = value & 0xff; */
         break;
     case TIMER_CCR1_OFFSET:
+        stm32_timer_sync(s, now);
         s->ccr1 = value & 0xffff;
+        stm32_timer_schedule(s);
+        stm32_timer_update_pwm(s);
         DPRINTF("%s ccr1 = %x\n", stm32_periph_name(s->periph), s->ccr1);
         break;
     case TIMER_CCR2_OFFSET:
+        stm32_timer_sync(s, now);
         s->ccr2 = value & 0xffff;
+        stm32_timer_schedule(s);
+        stm32_timer_update_pwm(s);
         DPRINTF("%s ccr2 = %x\n", stm32_periph_name(s->periph), s->ccr2);
         break;
     case TIMER_CCR3_OFFSET:
+        stm32_timer_sync(s, now);
         s->ccr3 = value & 0xffff;
+        stm32_timer_schedule(s);
+        stm32_timer_update_pwm(s);
         DPRINTF("%s ccr3 = %x\n", stm32_periph_name(s->periph), s->ccr3);
         break;
     case TIMER_CCR4_OFFSET:
+        stm32_timer_sync(s, now);
         s->ccr4 = value & 0xffff;
+        stm32_timer_schedule(s);
+        stm32_timer_update_pwm(s);
         DPRINTF("%s ccr4 = %x\n", stm32_periph_name(s->periph), s->ccr4);
         break;
     case TIMER_BDTR_OFFSET:
@@ -418,35 +1118,52 @@ static void stm32_timer_write(void * opaque, hwaddr offset,
 
 }
 
+/* CR1 is not here: one-pulse mode clears CEN when the counter stops. */
 static const MemoryRegionOps stm32_timer_ops = {
     .read = stm32_timer_read,
     .write = stm32_timer_write,
+    .idempotent_reads = MEMORY_REGION_IDEMPOTENT(TIMER_DIER_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(TIMER_CCMR1_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(TIMER_CCMR2_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(TIMER_CCER_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(TIMER_PSC_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(TIMER_ARR_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(TIMER_CCR1_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(TIMER_CCR2_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(TIMER_CCR3_OFFSET) |
+                        MEMORY_REGION_IDEMPOTENT(TIMER_CCR4_OFFSET),
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
 static int stm32_timer_init(SysBusDevice *dev)
 {
-    QEMUBH *bh;
     qemu_irq *clk_irq;
+    int ch;
     Stm32Timer *s = STM32_TIMER(dev);
 
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
     s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
     s->stm32_afio = (Stm32Afio *)s->stm32_afio_prop;
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_timer_ops, s, "stm32-timer", 0x3ff);
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_timer_ops, s, "stm32-timer", STM32_PERIPH_SIZE);
     sysbus_init_mmio(dev, &s->iomem);
 
     sysbus_init_irq(dev, &s->irq);
+    sysbus_init_irq(dev, &s->cc_irq);
+    qdev_init_gpio_out_named(DEVICE(dev), s->trgo, "trgo",
+                             STM32_TIMER_TRGO_LINES);
+    qdev_init_gpio_in_named(DEVICE(dev), stm32_timer_itr, "itr",
+                            STM32_TIMER_ITR_LINES);
 
     /* Register handlers to handle updates to the TIM's peripheral clock. */
     clk_irq = qemu_allocate_irqs(stm32_timer_clk_irq_handler, (void *)s, 1);
     stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
 
-    bh = qemu_bh_new(stm32_timer_tick, s);
-    s->timer = ptimer_init(bh);
+    s->timer = stm32_timer_new_ns(s->aio_context, stm32_timer_tick, s);
 
     s->cr1   = 0;
+    s->cr2   = 0;
+    s->smcr  = 0;
     s->dier  = 0;
     s->sr    = 0;
     s->egr   = 0;
@@ -459,27 +1176,32 @@ static int stm32_timer_init(SysBusDevice *dev)
     s->ccr2  = 0;
     s->ccr3  = 0;
     s->ccr4  = 0;
+    s->freq  = 0;
+    s->countMode = TIMER_UP_COUNT;
+    s->center = 0;
+    stm32_timer_rebase(s, 0, 0);
+    for (ch = 0; ch < TIMER_CC_COUNT; ch++)
+    {
+        s->pwm_pin[ch] = TIMER_NO_PIN;
+    }
 
     return 0;
 }
 
-static void stm32_timer_pre_save(void *opaque)
-{
-    //Stm32Timer *s = opaque;
-
-    /* tick_offset is base_time - rtc_clock base time.  Instead, we want to
-     * store the base time relative to the vm_clock for backwards-compatibility.  */
-    //int64_t delta = qemu_get_clock_ns(rtc_clock) - qemu_get_clock_ns(vm_clock);
-    //s->tick_offset_vmstate = s->tick_offset + delta / get_ticks_per_sec();
-}
-
 static int stm32_timer_post_load(void *opaque, int version_id)
 {
-    //Stm32Timer *s = opaque;
+    Stm32Timer *s = (Stm32Timer *)opaque;
+
+    /* Before version 4, freq was already divided by the prescaler */
+    if (version_id < 4)
+    {
+        s->freq *= s->psc + 1;
+    }
 
-    //int64_t delta = qemu_get_clock_ns(rtc_clock) - qemu_get_clock_ns(vm_clock);
-    //s->tick_offset = s->tick_offset_vmstate - delta / get_ticks_per_sec();
-    //stm32_timer_set_alarm(s);
+    /* The host timer is not saved, it is armed again from the counter
+     * state.  The IRQ lines are restored by the NVIC. */
+    stm32_timer_schedule(s);
+    stm32_timer_update_pwm(s);
     return 0;
 }
 
@@ -488,22 +1210,39 @@ static Property stm32_timer_properties[] = {
     DEFINE_PROP_PTR("stm32_rcc",   Stm32Timer, stm32_rcc_prop),
     DEFINE_PROP_PTR("stm32_gpio",  Stm32Timer, stm32_gpio_prop),
     DEFINE_PROP_PTR("stm32_afio",  Stm32Timer, stm32_afio_prop),
+    DEFINE_PROP_PTR("aio_context", Stm32Timer, aio_context),
     DEFINE_PROP_END_OF_LIST()
 };
 
 static const VMStateDescription vmstate_stm32 = {
     .name = "stm32-timer",
-    .version_id = 1,
-    .minimum_version_id = 1,
-    .pre_save = stm32_timer_pre_save,
+    .version_id = 4,
+    .minimum_version_id = 2,
     .post_load = stm32_timer_post_load,
     .fields = (VMStateField[]) {
-        //VMSTATE_UINT32(tick_offset_vmstate, stm32_timer_tm_state),
-        //VMSTATE_UINT32(mr, Stm32Timer),
-        //VMSTATE_UINT32(lr, Stm32Timer),
-        //VMSTATE_UINT32(cr, Stm32Timer),
-        //VMSTATE_UINT32(im, Stm32Timer),
-        //VMSTATE_UINT32(is, Stm32Timer),
+        VMSTATE_INT32(countMode, Stm32Timer),
+        VMSTATE_INT32(center, Stm32Timer),
+        VMSTATE_UINT32(freq, Stm32Timer),
+        VMSTATE_INT64(base_time, Stm32Timer),
+        VMSTATE_UINT32(base_pos, Stm32Timer),
+        VMSTATE_UINT64(events_seen, Stm32Timer),
+        VMSTATE_UINT64(synced_pos, Stm32Timer),
+        VMSTATE_INT32_ARRAY(pwm_pin, Stm32Timer, TIMER_CC_COUNT),
+        VMSTATE_UINT32(cr1, Stm32Timer),
+        VMSTATE_UINT32_V(cr2, Stm32Timer, 3),
+        VMSTATE_UINT32_V(smcr, Stm32Timer, 3),
+        VMSTATE_UINT32(dier, Stm32Timer),
+        VMSTATE_UINT32(sr, Stm32Timer),
+        VMSTATE_UINT32(egr, Stm32Timer),
+        VMSTATE_UINT32(ccmr1, Stm32Timer),
+        VMSTATE_UINT32(ccmr2, Stm32Timer),
+        VMSTATE_UINT32(ccer, Stm32Timer),
+        VMSTATE_UINT32(psc, Stm32Timer),
+        VMSTATE_UINT32(arr, Stm32Timer),
+        VMSTATE_UINT32(ccr1, Stm32Timer),
+        VMSTATE_UINT32(ccr2, Stm32Timer),
+        VMSTATE_UINT32(ccr3, Stm32Timer),
+        VMSTATE_UINT32(ccr4, Stm32Timer),
         VMSTATE_END_OF_LIST()
     }
 };
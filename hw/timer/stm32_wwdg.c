@@ -0,0 +1,403 @@
+/*
+ * STM32 Microcontroller Window Watchdog (WWDG)
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/arm/stm32.h"
+#include "qemu/bitops.h"
+#include "hw/sysbus.h"
+#include "qemu/timer.h"
+
+
+
+/* DEFINITIONS*/
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_WWDG
+
+#ifdef DEBUG_STM32_WWDG
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_WWDG: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define WWDG_CR_OFFSET 0x00
+#define WWDG_CR_WDGA_BIT 7
+#define WWDG_CR_T_MASK 0x7f
+
+#define WWDG_CFR_OFFSET 0x04
+#define WWDG_CFR_EWI_BIT 9
+#define WWDG_CFR_WDGTB_START 7
+#define WWDG_CFR_WDGTB_MASK 0x00000180
+#define WWDG_CFR_W_MASK 0x7f
+
+#define WWDG_SR_OFFSET 0x08
+#define WWDG_SR_EWIF_BIT 0
+
+/* The early wakeup interrupt is raised when the counter reaches 0x40, the
+ * reset happens when it goes on to 0x3f. */
+#define WWDG_EWI_COUNT 0x40
+#define WWDG_RESET_COUNT 0x3f
+
+/* The counter is not stepped by a timer: it is computed from
+ * QEMU_CLOCK_VIRTUAL, counting down from base_count at base_time.  The
+ * timer is only armed for the next early wakeup or reset, and a refresh
+ * which does not bring them closer leaves it alone. */
+struct Stm32Wwdg {
+    /* Inherited */
+    SysBusDevice busdev;
+    stm32_periph_t periph;
+
+    /* Properties */
+    void *stm32_rcc_prop;
+    /* AioContext in which the timer runs, NULL for the main loop */
+    void *aio_context;
+
+    /* Private */
+    MemoryRegion iomem;
+    Stm32Rcc *stm32_rcc;
+
+    uint32_t
+        WWDG_CFR,
+        WWDG_SR;
+
+    /* WDGA, which only reset clears */
+    bool active;
+    uint32_t base_count;
+    int64_t base_time;
+    /* PCLK1 frequency.  The counter runs at PCLK1 / 4096 / 2^WDGTB. */
+    uint32_t freq;
+    /* The counter has gone past 0x40 since the last refresh */
+    bool ewi_seen;
+
+    QEMUTimer *timer;
+    qemu_irq irq;
+};
+
+
+
+/* HELPER FUNCTIONS */
+
+static int stm32_wwdg_shift(Stm32Wwdg *s)
+{
+    return 12 + ((s->WWDG_CFR & WWDG_CFR_WDGTB_MASK) >> WWDG_CFR_WDGTB_START);
+}
+
+/* Counter ticks since base_time */
+static uint64_t stm32_wwdg_ticks(Stm32Wwdg *s, int64_t now)
+{
+    if(s->freq == 0 || now <= s->base_time) {
+        return 0;
+    }
+    return muldiv64(now - s->base_time, s->freq, get_ticks_per_sec()) >>
+           stm32_wwdg_shift(s);
+}
+
+/* Virtual time at which the counter has ticked n times since base_time */
+static int64_t stm32_wwdg_tick_time(Stm32Wwdg *s, uint64_t n)
+{
+    /* Round up so the tick has really happened when the timer fires */
+    return s->base_time +
+           muldiv64(n << stm32_wwdg_shift(s), get_ticks_per_sec(),
+                    s->freq) + 1;
+}
+
+static uint32_t stm32_wwdg_get_count(Stm32Wwdg *s, int64_t now)
+{
+    return (s->base_count - stm32_wwdg_ticks(s, now)) & WWDG_CR_T_MASK;
+}
+
+/* Restart the time base from now, keeping the counter */
+static void stm32_wwdg_rebase(Stm32Wwdg *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    s->base_count = stm32_wwdg_get_count(s, now);
+    s->base_time = now;
+}
+
+static void stm32_wwdg_update_irq(Stm32Wwdg *s)
+{
+    qemu_set_irq(s->irq, (s->WWDG_CFR & BIT(WWDG_CFR_EWI_BIT)) &&
+                         (s->WWDG_SR & BIT(WWDG_SR_EWIF_BIT)));
+}
+
+/* Set EWIF if the counter has reached 0x40 since the last refresh, and
+ * reset the machine if it has gone past it.  Returns true on reset. */
+static bool stm32_wwdg_sync(Stm32Wwdg *s)
+{
+    uint64_t ticks;
+
+    if(!s->active || s->base_count < WWDG_EWI_COUNT) {
+        return false;
+    }
+
+    ticks = stm32_wwdg_ticks(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    if(ticks >= s->base_count - WWDG_RESET_COUNT) {
+        DPRINTF("expired\n");
+        stm32_rcc_request_reset(s->stm32_rcc, STM32_RCC_RESET_WWDG);
+        return true;
+    }
+    if(!s->ewi_seen && ticks >= s->base_count - WWDG_EWI_COUNT) {
+        s->ewi_seen = true;
+        s->WWDG_SR |= BIT(WWDG_SR_EWIF_BIT);
+        stm32_wwdg_update_irq(s);
+    }
+    return false;
+}
+
+static void stm32_wwdg_schedule(Stm32Wwdg *s)
+{
+    uint64_t next;
+
+    if(!s->active || s->freq == 0 || s->base_count < WWDG_EWI_COUNT) {
+        timer_del(s->timer);
+        return;
+    }
+
+    next = s->base_count - WWDG_RESET_COUNT;
+    if(!s->ewi_seen && (s->WWDG_CFR & BIT(WWDG_CFR_EWI_BIT))) {
+        next = s->base_count - WWDG_EWI_COUNT;
+    }
+    timer_mod(s->timer, stm32_wwdg_tick_time(s, next));
+}
+
+static void stm32_wwdg_timer_cb(void *opaque)
+{
+    Stm32Wwdg *s = (Stm32Wwdg *)opaque;
+
+    if(!stm32_wwdg_sync(s)) {
+        stm32_wwdg_schedule(s);
+    }
+}
+
+/* Called when the PCLK1 frequency changes */
+static void stm32_wwdg_clk_irq_handler(void *opaque, int n, int level)
+{
+    Stm32Wwdg *s = (Stm32Wwdg *)opaque;
+
+    if(stm32_wwdg_sync(s)) {
+        return;
+    }
+    stm32_wwdg_rebase(s);
+    s->freq = stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph);
+    stm32_wwdg_schedule(s);
+}
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_wwdg_CR_write(Stm32Wwdg *s, uint32_t new_value)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t old_count = s->base_count;
+    bool was_active = s->active;
+
+    if(s->active &&
+       stm32_wwdg_get_count(s, now) > (s->WWDG_CFR & WWDG_CFR_W_MASK)) {
+        DPRINTF("refreshed outside the window\n");
+        stm32_rcc_request_reset(s->stm32_rcc, STM32_RCC_RESET_WWDG);
+        return;
+    }
+
+    s->active |= !!(new_value & BIT(WWDG_CR_WDGA_BIT));
+    s->base_count = new_value & WWDG_CR_T_MASK;
+    s->base_time = now;
+    s->ewi_seen = false;
+
+    if(s->active && s->base_count < WWDG_EWI_COUNT) {
+        /* Clearing T6 resets straight away */
+        stm32_rcc_request_reset(s->stm32_rcc, STM32_RCC_RESET_WWDG);
+        return;
+    }
+
+    /* The usual refresh writes the same value again, which only pushes
+     * the deadlines back: the timer then catches up when it fires. */
+    if(!was_active || s->base_count < old_count) {
+        stm32_wwdg_schedule(s);
+    }
+}
+
+static void stm32_wwdg_CFR_write(Stm32Wwdg *s, uint32_t new_value)
+{
+    /* EWI can only be cleared by reset */
+    new_value |= s->WWDG_CFR & BIT(WWDG_CFR_EWI_BIT);
+
+    stm32_wwdg_rebase(s);
+    s->WWDG_CFR = new_value & (BIT(WWDG_CFR_EWI_BIT) | WWDG_CFR_WDGTB_MASK |
+                               WWDG_CFR_W_MASK);
+    stm32_wwdg_update_irq(s);
+    stm32_wwdg_schedule(s);
+}
+
+static uint64_t stm32_wwdg_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    Stm32Wwdg *s = (Stm32Wwdg *)opaque;
+
+    stm32_wwdg_sync(s);
+
+    switch (offset) {
+        case WWDG_CR_OFFSET:
+            return (s->active ? BIT(WWDG_CR_WDGA_BIT) : 0) |
+                   stm32_wwdg_get_count(s,
+                                        qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        case WWDG_CFR_OFFSET:
+            return s->WWDG_CFR;
+        case WWDG_SR_OFFSET:
+            return s->WWDG_SR;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_wwdg_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    Stm32Wwdg *s = (Stm32Wwdg *)opaque;
+
+    stm32_rcc_check_periph_clk(s->stm32_rcc, s->periph);
+
+    if(stm32_wwdg_sync(s)) {
+        return;
+    }
+
+    switch (offset) {
+        case WWDG_CR_OFFSET:
+            stm32_wwdg_CR_write(s, value);
+            break;
+        case WWDG_CFR_OFFSET:
+            stm32_wwdg_CFR_write(s, value);
+            break;
+        case WWDG_SR_OFFSET:
+            /* EWIF is cleared by writing 0 */
+            s->WWDG_SR &= value;
+            stm32_wwdg_update_irq(s);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_wwdg_ops = {
+    .read = stm32_wwdg_read,
+    .write = stm32_wwdg_write,
+    .valid.min_access_size = 2,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_wwdg_reset(DeviceState *dev)
+{
+    Stm32Wwdg *s = STM32_Wwdg(dev);
+
+    s->WWDG_CFR = WWDG_CFR_W_MASK;
+    s->WWDG_SR = 0;
+    s->active = false;
+    s->base_count = WWDG_CR_T_MASK;
+    s->base_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    s->ewi_seen = false;
+    stm32_wwdg_update_irq(s);
+    stm32_wwdg_schedule(s);
+}
+
+static int stm32_wwdg_init(SysBusDevice *dev)
+{
+    qemu_irq *clk_irq;
+    Stm32Wwdg *s = STM32_Wwdg(dev);
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_wwdg_ops, s,
+                          "wwdg", STM32_PERIPH_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+    sysbus_init_irq(dev, &s->irq);
+
+    s->timer = stm32_timer_new_ns(s->aio_context, stm32_wwdg_timer_cb, s);
+
+    /* Register handlers to handle updates to the WWDG's peripheral clock. */
+    clk_irq = qemu_allocate_irqs(stm32_wwdg_clk_irq_handler, (void *)s, 1);
+    stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
+
+    return 0;
+}
+
+static int stm32_wwdg_post_load(void *opaque, int version_id)
+{
+    Stm32Wwdg *s = (Stm32Wwdg *)opaque;
+
+    /* The host timer is armed again from the saved time base. */
+    stm32_wwdg_schedule(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_wwdg = {
+    .name = TYPE_STM32_WWDG,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_wwdg_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(WWDG_CFR, Stm32Wwdg),
+        VMSTATE_UINT32(WWDG_SR, Stm32Wwdg),
+        VMSTATE_BOOL(active, Stm32Wwdg),
+        VMSTATE_UINT32(base_count, Stm32Wwdg),
+        VMSTATE_INT64(base_time, Stm32Wwdg),
+        VMSTATE_UINT32(freq, Stm32Wwdg),
+        VMSTATE_BOOL(ewi_seen, Stm32Wwdg),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_wwdg_properties[] = {
+    DEFINE_PROP_PERIPH_T("periph", Stm32Wwdg, periph, STM32_PERIPH_UNDEFINED),
+    DEFINE_PROP_PTR("stm32_rcc", Stm32Wwdg, stm32_rcc_prop),
+    DEFINE_PROP_PTR("aio_context", Stm32Wwdg, aio_context),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_wwdg_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_wwdg_init;
+    dc->reset = stm32_wwdg_reset;
+    dc->vmsd = &vmstate_stm32_wwdg;
+    dc->props = stm32_wwdg_properties;
+}
+
+static TypeInfo stm32_wwdg_info = {
+    .name  = TYPE_STM32_WWDG,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Wwdg),
+    .class_init = stm32_wwdg_class_init
+};
+
+static void stm32_wwdg_register_types(void)
+{
+    type_register_static(&stm32_wwdg_info);
+}
+
+type_init(stm32_wwdg_register_types)
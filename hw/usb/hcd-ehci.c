@@ -1593,6 +1593,7 @@ static EHCIQueue *ehci_state_fetchqh(EHCIState *ehci, int async)
     uint32_t entry;
     EHCIQueue *q;
     EHCIqh qh;
+    bool qh_changed;
 
     entry = ehci_get_fetch_addr(ehci, async);
     q = ehci_find_queue_by_qh(ehci, entry, async);
@@ -1619,7 +1620,8 @@ static EHCIQueue *ehci_state_fetchqh(EHCIState *ehci, int async)
      * The overlay area of the qh should never be changed by the guest,
      * except when idle, in which case the reset is a nop.
      */
-    if (!ehci_verify_qh(q, &qh)) {
+    qh_changed = !ehci_verify_qh(q, &qh);
+    if (qh_changed) {
         if (ehci_reset_queue(q) > 0) {
             ehci_trace_guest_bug(ehci, "guest updated active QH");
         }
@@ -1661,6 +1663,21 @@ static EHCIQueue *ehci_state_fetchqh(EHCIState *ehci, int async)
     }
 #endif
 
+    /*
+     * When the periodic schedule has been idle for a while, catching up
+     * on the frames since the last timer run would visit an interrupt QH
+     * once per frame it is linked in, only to have the device NAK each
+     * time.  Look at it once per run instead; devices with data to send
+     * call ehci_wakeup_endpoint, which ends the idle period.
+     */
+    if (!async && !ehci->periodic_sched_active && !qh_changed) {
+        if (q->idle_tick == ehci->frame_tick) {
+            ehci_set_state(ehci, async, EST_HORIZONTALQH);
+            goto out;
+        }
+        q->idle_tick = ehci->frame_tick;
+    }
+
     if (q->qh.token & QTD_TOKEN_HALT) {
         ehci_set_state(ehci, async, EST_HORIZONTALQH);
 
@@ -2232,6 +2249,7 @@ static void ehci_frame_timer(void *opaque)
     int uframes, skipped_uframes;
     int i;
 
+    ehci->frame_tick++;
     t_now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
     ns_elapsed = t_now - ehci->last_run_ns;
     uframes = ns_elapsed / UFRAME_TIMER_NS;
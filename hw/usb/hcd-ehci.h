@@ -236,6 +236,7 @@ struct EHCIQueue {
     QTAILQ_ENTRY(EHCIQueue) next;
     uint32_t seen;
     uint64_t ts;
+    uint32_t idle_tick;    /* frame_tick of the last idle visit     */
     int async;
     int transact_ctr;
 
@@ -315,6 +316,7 @@ struct EHCIState {
     uint64_t last_run_ns;
     uint32_t async_stepdown;
     uint32_t periodic_sched_active;
+    uint32_t frame_tick;     /* Number of ehci_frame_timer runs */
     bool int_req_by_async;
 };
 
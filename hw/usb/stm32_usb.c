@@ -0,0 +1,1000 @@
+/*
+ * STM32 Microcontroller USB full speed device controller
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ * (low, medium, high density and XL devices)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The device controller with its eight endpoint registers and the 512 byte
+ * packet memory area (PMA), which the CPU sees as 16-bit words at a 32-bit
+ * stride.
+ *
+ * Since QEMU has no USB host side that a guest device could be plugged
+ * into, the other end of the cable is a small built in host, connected to
+ * a character device.  When the firmware takes the controller out of
+ * reset, the host resets the bus and enumerates the device: it reads the
+ * device and configuration descriptors, sets the address and the
+ * configuration and, for a CDC device, sets the control line state.  From
+ * then on, the first bulk IN endpoint of the configuration is drained to
+ * the character device and what comes from the character device is sent
+ * to the first bulk OUT endpoint, which is what a CDC ACM (virtual COM
+ * port) logger needs.
+ *
+ * A transaction moves a whole packet buffer: an IN packet is written to the
+ * character device straight from the PMA, and an OUT packet is copied into
+ * it in one go.  The host retries a NAKed transaction when the firmware
+ * next writes an endpoint register (which is how it makes an endpoint
+ * VALID), so that the throughput is only limited by the firmware.
+ *
+ * Double buffered and isochronous endpoints, suspend and resume, and the
+ * error and expected SOF interrupts are not implemented.  SOF interrupts
+ * come every millisecond of virtual time while SOFM is set.
+ */
+
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "sysemu/char.h"
+#include "qemu/bitops.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+
+
+
+/* DEFINITIONS*/
+
+//#define DEBUG_STM32_USB
+
+#ifdef DEBUG_STM32_USB
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_USB: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define USB_EPR_OFFSET(n) ((n) * 4)
+#define USB_EP_COUNT 8
+#define USB_EPR_END USB_EPR_OFFSET(USB_EP_COUNT)
+#define USB_EPR_EA_MASK 0x000f
+#define USB_EPR_STAT_TX_START 4
+#define USB_EPR_DTOG_TX_BIT 6
+#define USB_EPR_CTR_TX_BIT 7
+#define USB_EPR_EP_TYPE_START 9
+#define USB_EPR_SETUP_BIT 11
+#define USB_EPR_STAT_RX_START 12
+#define USB_EPR_DTOG_RX_BIT 14
+#define USB_EPR_CTR_RX_BIT 15
+/* Read/write (EA, EP_KIND, EP_TYPE), toggle (DTOG and STAT) and clear only
+ * (CTR) bits */
+#define USB_EPR_RW_MASK 0x070f
+#define USB_EPR_TOGGLE_MASK 0x7070
+#define USB_EPR_CTR_MASK 0x8080
+
+#define USB_EP_TYPE_CONTROL 1
+
+#define USB_STAT_DISABLED 0
+#define USB_STAT_STALL 1
+#define USB_STAT_NAK 2
+#define USB_STAT_VALID 3
+
+#define USB_CNTR_OFFSET 0x40
+#define USB_CNTR_FRES_BIT 0
+#define USB_CNTR_PDWN_BIT 1
+#define USB_CNTR_SOFM_BIT 9
+#define USB_CNTR_CTRM_BIT 15
+
+#define USB_ISTR_OFFSET 0x44
+#define USB_ISTR_DIR_BIT 4
+#define USB_ISTR_SOF_BIT 9
+#define USB_ISTR_RESET_BIT 10
+#define USB_ISTR_CTR_BIT 15
+/* The flags cleared by writing 0 */
+#define USB_ISTR_FLAGS_MASK 0x7f00
+
+#define USB_FNR_OFFSET 0x48
+#define USB_FNR_FN_MASK 0x07ff
+#define USB_FNR_LCK_BIT 13
+
+#define USB_DADDR_OFFSET 0x4c
+#define USB_DADDR_ADD_MASK 0x7f
+#define USB_DADDR_EF_BIT 7
+
+#define USB_BTABLE_OFFSET 0x50
+#define USB_BTABLE_MASK 0xfff8
+
+/* The packet memory, and its buffer descriptor table entries */
+#define USB_PMA_SIZE 512
+#define USB_BD_ADDR_TX 0
+#define USB_BD_COUNT_TX 2
+#define USB_BD_ADDR_RX 4
+#define USB_BD_COUNT_RX 6
+#define USB_COUNT_MASK 0x03ff
+#define USB_COUNT_RX_BLSIZE_BIT 15
+#define USB_COUNT_RX_NUM_BLOCK_START 10
+
+/* Results of a transaction, besides a length */
+#define USB_NORESP -1
+#define USB_NAK -2
+#define USB_STALL -3
+
+/* Standard and CDC requests used by the host */
+#define USB_REQ_GET_DESCRIPTOR 6
+#define USB_REQ_SET_ADDRESS 5
+#define USB_REQ_SET_CONFIGURATION 9
+#define USB_REQ_SET_CONTROL_LINE_STATE 0x22
+#define USB_DT_DEVICE 1
+#define USB_DT_CONFIG 2
+#define USB_DT_INTERFACE 4
+#define USB_DT_ENDPOINT 5
+#define USB_CLASS_COMM 2
+
+#define USB_HOST_ADDRESS 1
+/* From attachment to the bus reset, long enough for the firmware to finish
+ * its own initialization (it clears ISTR after leaving reset) */
+#define USB_HOST_RESET_DELAY_NS (10 * SCALE_MS)
+#define USB_HOST_DATA_SIZE 256
+
+/* The built in host goes through the enumeration steps, each of them a
+ * control transfer, then moves the bulk data. */
+typedef enum {
+    USB_HOST_DETACHED,
+    USB_HOST_RESETTING,
+    USB_HOST_SETUP,
+    USB_HOST_DATA_IN,
+    USB_HOST_STATUS_IN,
+    USB_HOST_STATUS_OUT,
+    USB_HOST_CONFIGURED,
+    USB_HOST_FAILED
+} Stm32UsbHostState;
+
+typedef enum {
+    USB_STEP_DEVICE_DESC,
+    USB_STEP_SET_ADDRESS,
+    USB_STEP_CONFIG_HEADER,
+    USB_STEP_CONFIG_DESC,
+    USB_STEP_SET_CONFIGURATION,
+    USB_STEP_SET_LINE_STATE
+} Stm32UsbHostStep;
+
+typedef struct Stm32UsbHost {
+    uint32_t state;
+    uint32_t step;
+    /* The address the host sends to */
+    uint32_t address;
+    uint32_t ep0_size;
+    uint8_t setup[8];
+    uint32_t data_len;
+    uint8_t data[USB_HOST_DATA_SIZE];
+    /* Found in the configuration descriptor.  Endpoint 0 means none. */
+    uint32_t config_value;
+    uint32_t comm_interface;
+    uint32_t bulk_in;
+    uint32_t bulk_out;
+    uint32_t bulk_out_size;
+} Stm32UsbHost;
+
+struct Stm32Usb {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    void *stm32_rcc_prop;
+    void *aio_context;
+
+    /* Private */
+    MemoryRegion iomem;
+    MemoryRegion pma_iomem;
+
+    Stm32Rcc *stm32_rcc;
+    CharDriverState *chr;
+
+    qemu_irq irq_lp;
+    qemu_irq irq_hp;
+    QEMUBH *host_bh;
+    QEMUTimer *sof_timer;
+    QEMUTimer *reset_timer;
+
+    uint32_t
+        USB_EPR[USB_EP_COUNT],
+        USB_CNTR,
+        USB_ISTR,
+        USB_DADDR,
+        USB_BTABLE;
+
+    uint8_t pma[USB_PMA_SIZE];
+
+    Stm32UsbHost host;
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static uint32_t stm32_usb_pma_get16(Stm32Usb *s, uint32_t addr)
+{
+    return lduw_le_p(&s->pma[addr & (USB_PMA_SIZE - 2)]);
+}
+
+static void stm32_usb_pma_set16(Stm32Usb *s, uint32_t addr, uint32_t value)
+{
+    stw_le_p(&s->pma[addr & (USB_PMA_SIZE - 2)], value);
+}
+
+/* An entry of endpoint register n's buffer descriptor */
+static uint32_t stm32_usb_bd_get(Stm32Usb *s, int n, int entry)
+{
+    return stm32_usb_pma_get16(s, (s->USB_BTABLE & USB_BTABLE_MASK) +
+                                  n * 8 + entry);
+}
+
+static void stm32_usb_bd_set(Stm32Usb *s, int n, int entry, uint32_t value)
+{
+    stm32_usb_pma_set16(s, (s->USB_BTABLE & USB_BTABLE_MASK) + n * 8 + entry,
+                        value);
+}
+
+static int stm32_usb_stat_tx(uint32_t epr)
+{
+    return extract32(epr, USB_EPR_STAT_TX_START, 2);
+}
+
+static int stm32_usb_stat_rx(uint32_t epr)
+{
+    return extract32(epr, USB_EPR_STAT_RX_START, 2);
+}
+
+static uint32_t stm32_usb_set_stat(uint32_t epr, int start, int stat)
+{
+    return deposit32(epr, start, 2, stat);
+}
+
+/* ISTR with CTR, DIR and EP_ID showing the lowest endpoint with a
+ * completed transfer */
+static uint32_t stm32_usb_USB_ISTR_read(Stm32Usb *s)
+{
+    uint32_t value = s->USB_ISTR & USB_ISTR_FLAGS_MASK;
+    uint32_t epr;
+    int n;
+
+    for(n = 0; n < USB_EP_COUNT; n++) {
+        epr = s->USB_EPR[n];
+        if(epr & USB_EPR_CTR_MASK) {
+            value |= BIT(USB_ISTR_CTR_BIT) | n;
+            if(epr & BIT(USB_EPR_CTR_RX_BIT)) {
+                value |= BIT(USB_ISTR_DIR_BIT);
+            }
+            break;
+        }
+    }
+    return value;
+}
+
+/* Double buffered and isochronous transfers, which would go to the high
+ * priority line, are not implemented. */
+static void stm32_usb_update_irq(Stm32Usb *s)
+{
+    uint32_t istr = stm32_usb_USB_ISTR_read(s);
+
+    qemu_set_irq(s->irq_lp, (istr & s->USB_CNTR & 0xff00) != 0);
+}
+
+static void stm32_usb_update_sof_timer(Stm32Usb *s)
+{
+    if((s->USB_CNTR & BIT(USB_CNTR_SOFM_BIT)) &&
+       s->host.state != USB_HOST_DETACHED) {
+        if(!timer_pending(s->sof_timer)) {
+            timer_mod(s->sof_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + SCALE_MS);
+        }
+    } else {
+        timer_del(s->sof_timer);
+    }
+}
+
+static void stm32_usb_sof_tick(void *opaque)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    s->USB_ISTR |= BIT(USB_ISTR_SOF_BIT);
+    stm32_usb_update_irq(s);
+    timer_mod(s->sof_timer, timer_expire_time_ns(s->sof_timer) + SCALE_MS);
+}
+
+
+
+
+/* DEVICE SIDE OF THE TRANSACTIONS */
+
+/* The endpoint register for endpoint address ep, or -1 if the device does
+ * not answer to it */
+static int stm32_usb_find_ep(Stm32Usb *s, int ep)
+{
+    int n;
+
+    if((s->USB_CNTR & (BIT(USB_CNTR_FRES_BIT) | BIT(USB_CNTR_PDWN_BIT))) ||
+       !(s->USB_DADDR & BIT(USB_DADDR_EF_BIT)) ||
+       (s->USB_DADDR & USB_DADDR_ADD_MASK) != s->host.address) {
+        return -1;
+    }
+    for(n = 0; n < USB_EP_COUNT; n++) {
+        if((s->USB_EPR[n] & USB_EPR_EA_MASK) == ep) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+/* The size of endpoint register n's reception buffer */
+static int stm32_usb_rx_size(Stm32Usb *s, int n)
+{
+    uint32_t count = stm32_usb_bd_get(s, n, USB_BD_COUNT_RX);
+    int blocks = extract32(count, USB_COUNT_RX_NUM_BLOCK_START, 5);
+
+    if(count & BIT(USB_COUNT_RX_BLSIZE_BIT)) {
+        return (blocks + 1) * 32;
+    }
+    return blocks * 2;
+}
+
+/* Store a received packet in endpoint register n's buffer */
+static int stm32_usb_rx_packet(Stm32Usb *s, int n, const uint8_t *data,
+                               int len)
+{
+    uint32_t addr = stm32_usb_bd_get(s, n, USB_BD_ADDR_RX) & ~1;
+
+    if(len > stm32_usb_rx_size(s, n) || addr + len > USB_PMA_SIZE) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "stm32_usb: %d byte packet overflows the reception "
+                      "buffer of EP%dR\n", len, n);
+        return USB_NORESP;
+    }
+    memcpy(&s->pma[addr], data, len);
+    stm32_usb_bd_set(s, n, USB_BD_COUNT_RX,
+                     (stm32_usb_bd_get(s, n, USB_BD_COUNT_RX) &
+                      ~USB_COUNT_MASK) | len);
+    return len;
+}
+
+/* A SETUP packet to control endpoint ep.  It is accepted whatever the
+ * reception status, unless the previous packet was not handled yet. */
+static int stm32_usb_setup(Stm32Usb *s, int ep, const uint8_t *data)
+{
+    int n = stm32_usb_find_ep(s, ep);
+    uint32_t epr;
+
+    if(n < 0) {
+        return USB_NORESP;
+    }
+    epr = s->USB_EPR[n];
+    if(extract32(epr, USB_EPR_EP_TYPE_START, 2) != USB_EP_TYPE_CONTROL ||
+       stm32_usb_stat_rx(epr) == USB_STAT_DISABLED) {
+        return USB_NORESP;
+    }
+    if(epr & BIT(USB_EPR_CTR_RX_BIT)) {
+        return USB_NAK;
+    }
+    if(stm32_usb_rx_packet(s, n, data, 8) < 0) {
+        return USB_NORESP;
+    }
+
+    epr = stm32_usb_set_stat(epr, USB_EPR_STAT_RX_START, USB_STAT_NAK);
+    epr = stm32_usb_set_stat(epr, USB_EPR_STAT_TX_START, USB_STAT_NAK);
+    s->USB_EPR[n] = epr | BIT(USB_EPR_SETUP_BIT) | BIT(USB_EPR_CTR_RX_BIT) |
+                    BIT(USB_EPR_DTOG_RX_BIT) | BIT(USB_EPR_DTOG_TX_BIT);
+    stm32_usb_update_irq(s);
+    return 8;
+}
+
+static int stm32_usb_out(Stm32Usb *s, int ep, const uint8_t *data, int len)
+{
+    int n = stm32_usb_find_ep(s, ep);
+    uint32_t epr;
+
+    if(n < 0) {
+        return USB_NORESP;
+    }
+    epr = s->USB_EPR[n];
+    switch(stm32_usb_stat_rx(epr)) {
+        case USB_STAT_DISABLED:
+            return USB_NORESP;
+        case USB_STAT_STALL:
+            return USB_STALL;
+        case USB_STAT_NAK:
+            return USB_NAK;
+    }
+    if(stm32_usb_rx_packet(s, n, data, len) < 0) {
+        return USB_NORESP;
+    }
+
+    epr = stm32_usb_set_stat(epr, USB_EPR_STAT_RX_START, USB_STAT_NAK);
+    epr &= ~BIT(USB_EPR_SETUP_BIT);
+    epr ^= BIT(USB_EPR_DTOG_RX_BIT);
+    s->USB_EPR[n] = epr | BIT(USB_EPR_CTR_RX_BIT);
+    stm32_usb_update_irq(s);
+    return len;
+}
+
+/* An IN transaction.  On success, *data points at the packet in the PMA,
+ * which stays valid until the firmware runs again. */
+static int stm32_usb_in(Stm32Usb *s, int ep, const uint8_t **data)
+{
+    int n = stm32_usb_find_ep(s, ep);
+    uint32_t epr, addr;
+    int len;
+
+    if(n < 0) {
+        return USB_NORESP;
+    }
+    epr = s->USB_EPR[n];
+    switch(stm32_usb_stat_tx(epr)) {
+        case USB_STAT_DISABLED:
+            return USB_NORESP;
+        case USB_STAT_STALL:
+            return USB_STALL;
+        case USB_STAT_NAK:
+            return USB_NAK;
+    }
+
+    addr = stm32_usb_bd_get(s, n, USB_BD_ADDR_TX) & ~1;
+    len = stm32_usb_bd_get(s, n, USB_BD_COUNT_TX) & USB_COUNT_MASK;
+    if(addr + len > USB_PMA_SIZE) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "stm32_usb: EP%dR transmission buffer out of the "
+                      "PMA\n", n);
+        return USB_NORESP;
+    }
+    *data = &s->pma[addr];
+
+    epr = stm32_usb_set_stat(epr, USB_EPR_STAT_TX_START, USB_STAT_NAK);
+    epr ^= BIT(USB_EPR_DTOG_TX_BIT);
+    s->USB_EPR[n] = epr | BIT(USB_EPR_CTR_TX_BIT);
+    stm32_usb_update_irq(s);
+    return len;
+}
+
+/* A bus reset: the device is left with no address and all its endpoints
+ * disabled */
+static void stm32_usb_bus_reset(Stm32Usb *s)
+{
+    memset(s->USB_EPR, 0, sizeof(s->USB_EPR));
+    s->USB_DADDR = 0;
+    s->USB_ISTR |= BIT(USB_ISTR_RESET_BIT);
+    stm32_usb_update_irq(s);
+}
+
+
+
+
+/* BUILT IN HOST */
+
+static void stm32_usb_host_request(Stm32Usb *s, uint8_t type, uint8_t request,
+                                   uint16_t value, uint16_t index,
+                                   uint16_t length)
+{
+    Stm32UsbHost *h = &s->host;
+
+    h->setup[0] = type;
+    h->setup[1] = request;
+    stw_le_p(&h->setup[2], value);
+    stw_le_p(&h->setup[4], index);
+    stw_le_p(&h->setup[6], length);
+    h->data_len = 0;
+    h->state = USB_HOST_SETUP;
+}
+
+/* Find the configuration value, the first bulk endpoints and the CDC
+ * communication interface in the configuration descriptor */
+static void stm32_usb_host_parse_config(Stm32Usb *s)
+{
+    Stm32UsbHost *h = &s->host;
+    uint8_t *d = h->data;
+    uint32_t i = 0;
+
+    h->config_value = d[5];
+    h->comm_interface = ~0;
+    h->bulk_in = 0;
+    h->bulk_out = 0;
+    while(i + 2 <= h->data_len && d[i] >= 2) {
+        if(d[i + 1] == USB_DT_INTERFACE && i + 6 <= h->data_len &&
+           d[i + 5] == USB_CLASS_COMM && h->comm_interface == ~0) {
+            h->comm_interface = d[i + 2];
+        }
+        /* Bulk endpoints (bmAttributes 2) */
+        if(d[i + 1] == USB_DT_ENDPOINT && i + 6 <= h->data_len &&
+           (d[i + 3] & 3) == 2) {
+            if((d[i + 2] & 0x80) && !h->bulk_in) {
+                h->bulk_in = d[i + 2] & 0xf;
+            } else if(!(d[i + 2] & 0x80) && !h->bulk_out) {
+                h->bulk_out = d[i + 2] & 0xf;
+                h->bulk_out_size = lduw_le_p(&d[i + 4]) & USB_COUNT_MASK;
+            }
+        }
+        i += d[i];
+    }
+    DPRINTF("configuration %d, bulk IN %d, bulk OUT %d\n", h->config_value,
+            h->bulk_in, h->bulk_out);
+}
+
+/* Move on to the next enumeration step once a control transfer is done.
+ * stalled tells whether the device refused it. */
+static void stm32_usb_host_next(Stm32Usb *s, bool stalled)
+{
+    Stm32UsbHost *h = &s->host;
+
+    if(stalled && h->step != USB_STEP_SET_LINE_STATE) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "stm32_usb: enumeration step %d stalled\n", h->step);
+        h->state = USB_HOST_FAILED;
+        return;
+    }
+
+    switch(h->step) {
+        case USB_STEP_DEVICE_DESC:
+            h->step = USB_STEP_SET_ADDRESS;
+            stm32_usb_host_request(s, 0x00, USB_REQ_SET_ADDRESS,
+                                   USB_HOST_ADDRESS, 0, 0);
+            break;
+        case USB_STEP_SET_ADDRESS:
+            h->address = USB_HOST_ADDRESS;
+            h->step = USB_STEP_CONFIG_HEADER;
+            stm32_usb_host_request(s, 0x80, USB_REQ_GET_DESCRIPTOR,
+                                   USB_DT_CONFIG << 8, 0, 9);
+            break;
+        case USB_STEP_CONFIG_HEADER:
+            h->step = USB_STEP_CONFIG_DESC;
+            stm32_usb_host_request(s, 0x80, USB_REQ_GET_DESCRIPTOR,
+                                   USB_DT_CONFIG << 8, 0,
+                                   MIN(lduw_le_p(&h->data[2]),
+                                       USB_HOST_DATA_SIZE));
+            break;
+        case USB_STEP_CONFIG_DESC:
+            stm32_usb_host_parse_config(s);
+            h->step = USB_STEP_SET_CONFIGURATION;
+            stm32_usb_host_request(s, 0x00, USB_REQ_SET_CONFIGURATION,
+                                   h->config_value, 0, 0);
+            break;
+        case USB_STEP_SET_CONFIGURATION:
+            if(h->comm_interface != ~0) {
+                /* DTR and RTS, which CDC firmware often waits for */
+                h->step = USB_STEP_SET_LINE_STATE;
+                stm32_usb_host_request(s, 0x21,
+                                       USB_REQ_SET_CONTROL_LINE_STATE,
+                                       3, h->comm_interface, 0);
+                break;
+            }
+            /* fall through */
+        default:
+            h->state = USB_HOST_CONFIGURED;
+            if(s->chr) {
+                qemu_chr_accept_input(s->chr);
+            }
+            break;
+    }
+}
+
+/* Try the next transaction.  Returns false when the device did not take
+ * it, and the host has to wait for the firmware. */
+static bool stm32_usb_host_step(Stm32Usb *s)
+{
+    Stm32UsbHost *h = &s->host;
+    uint32_t length = lduw_le_p(&h->setup[6]);
+    const uint8_t *data;
+    int len;
+
+    switch(h->state) {
+        case USB_HOST_SETUP:
+            if(stm32_usb_setup(s, 0, h->setup) < 0) {
+                return false;
+            }
+            h->state = length ? USB_HOST_DATA_IN : USB_HOST_STATUS_IN;
+            return true;
+        case USB_HOST_DATA_IN:
+            len = stm32_usb_in(s, 0, &data);
+            if(len == USB_STALL) {
+                stm32_usb_host_next(s, true);
+                return true;
+            }
+            if(len < 0) {
+                return false;
+            }
+            memcpy(&h->data[h->data_len], data,
+                   MIN(len, length - h->data_len));
+            h->data_len += MIN(len, length - h->data_len);
+            if(h->step == USB_STEP_DEVICE_DESC && h->data_len >= 8) {
+                h->ep0_size = MAX(h->data[7], 8);
+            }
+            if(h->data_len >= length || len < h->ep0_size) {
+                h->state = USB_HOST_STATUS_OUT;
+            }
+            return true;
+        case USB_HOST_STATUS_OUT:
+            len = stm32_usb_out(s, 0, NULL, 0);
+            if(len == USB_NORESP || len == USB_NAK) {
+                return false;
+            }
+            stm32_usb_host_next(s, len == USB_STALL);
+            return true;
+        case USB_HOST_STATUS_IN:
+            len = stm32_usb_in(s, 0, &data);
+            if(len == USB_NORESP || len == USB_NAK) {
+                return false;
+            }
+            stm32_usb_host_next(s, len == USB_STALL);
+            return true;
+        case USB_HOST_CONFIGURED:
+            if(!h->bulk_in) {
+                return false;
+            }
+            len = stm32_usb_in(s, h->bulk_in, &data);
+            if(len < 0) {
+                return false;
+            }
+            if(len) {
+                qemu_chr_fe_write_all(s->chr, data, len);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void stm32_usb_host_bh(void *opaque)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    while(stm32_usb_host_step(s)) {
+    }
+}
+
+/* The host sees the device when the firmware takes the controller out of
+ * power down and reset, and loses it when they are set again. */
+static void stm32_usb_host_attach(Stm32Usb *s)
+{
+    Stm32UsbHost *h = &s->host;
+    bool powered = !(s->USB_CNTR & (BIT(USB_CNTR_FRES_BIT) |
+                                    BIT(USB_CNTR_PDWN_BIT)));
+
+    if(!s->chr) {
+        return;
+    }
+    if(!powered) {
+        h->state = USB_HOST_DETACHED;
+        timer_del(s->reset_timer);
+    } else if(h->state == USB_HOST_DETACHED) {
+        DPRINTF("device attached\n");
+        h->state = USB_HOST_RESETTING;
+        timer_mod(s->reset_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                  USB_HOST_RESET_DELAY_NS);
+    }
+    stm32_usb_update_sof_timer(s);
+}
+
+/* Reset the bus and start the enumeration */
+static void stm32_usb_host_reset_tick(void *opaque)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+    Stm32UsbHost *h = &s->host;
+
+    h->address = 0;
+    h->ep0_size = 8;
+    h->step = USB_STEP_DEVICE_DESC;
+    stm32_usb_bus_reset(s);
+    stm32_usb_host_request(s, 0x80, USB_REQ_GET_DESCRIPTOR,
+                           USB_DT_DEVICE << 8, 0, 18);
+}
+
+static int stm32_usb_chr_can_receive(void *opaque)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+    Stm32UsbHost *h = &s->host;
+    int n;
+
+    if(h->state != USB_HOST_CONFIGURED || !h->bulk_out) {
+        return 0;
+    }
+    n = stm32_usb_find_ep(s, h->bulk_out);
+    if(n < 0 || stm32_usb_stat_rx(s->USB_EPR[n]) != USB_STAT_VALID) {
+        return 0;
+    }
+    return MIN(h->bulk_out_size, stm32_usb_rx_size(s, n));
+}
+
+static void stm32_usb_chr_receive(void *opaque, const uint8_t *buf, int size)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    stm32_usb_out(s, s->host.bulk_out, buf, size);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_usb_USB_EPR_write(Stm32Usb *s, int n, uint32_t new_value)
+{
+    uint32_t old_value = s->USB_EPR[n];
+
+    s->USB_EPR[n] = (new_value & USB_EPR_RW_MASK) |
+                    (old_value & BIT(USB_EPR_SETUP_BIT)) |
+                    (old_value & new_value & USB_EPR_CTR_MASK) |
+                    ((old_value ^ new_value) & USB_EPR_TOGGLE_MASK);
+    stm32_usb_update_irq(s);
+
+    if(s->host.state != USB_HOST_DETACHED) {
+        qemu_bh_schedule(s->host_bh);
+        if(s->host.state == USB_HOST_CONFIGURED &&
+           (s->USB_EPR[n] & USB_EPR_EA_MASK) == s->host.bulk_out) {
+            qemu_chr_accept_input(s->chr);
+        }
+    }
+}
+
+static void stm32_usb_USB_CNTR_write(Stm32Usb *s, uint32_t new_value)
+{
+    s->USB_CNTR = new_value & 0xff1f;
+    if(s->USB_CNTR & BIT(USB_CNTR_FRES_BIT)) {
+        s->USB_ISTR |= BIT(USB_ISTR_RESET_BIT);
+    }
+    stm32_usb_host_attach(s);
+    stm32_usb_update_irq(s);
+    if(s->host.state != USB_HOST_DETACHED) {
+        qemu_bh_schedule(s->host_bh);
+    }
+}
+
+static uint32_t stm32_usb_USB_FNR_read(Stm32Usb *s)
+{
+    if(s->host.state == USB_HOST_DETACHED) {
+        return 0;
+    }
+    return BIT(USB_FNR_LCK_BIT) |
+           ((qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) / SCALE_MS) &
+            USB_FNR_FN_MASK);
+}
+
+static uint64_t stm32_usb_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    switch (offset) {
+        case USB_EPR_OFFSET(0) ... USB_EPR_END - 1:
+            return s->USB_EPR[offset / 4];
+        case USB_CNTR_OFFSET:
+            return s->USB_CNTR;
+        case USB_ISTR_OFFSET:
+            return stm32_usb_USB_ISTR_read(s);
+        case USB_FNR_OFFSET:
+            return stm32_usb_USB_FNR_read(s);
+        case USB_DADDR_OFFSET:
+            return s->USB_DADDR;
+        case USB_BTABLE_OFFSET:
+            return s->USB_BTABLE;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_usb_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    stm32_rcc_check_periph_clk(s->stm32_rcc, s->periph);
+
+    switch (offset) {
+        case USB_EPR_OFFSET(0) ... USB_EPR_END - 1:
+            stm32_usb_USB_EPR_write(s, offset / 4, value);
+            break;
+        case USB_CNTR_OFFSET:
+            stm32_usb_USB_CNTR_write(s, value);
+            break;
+        case USB_ISTR_OFFSET:
+            s->USB_ISTR &= value | ~USB_ISTR_FLAGS_MASK;
+            stm32_usb_update_irq(s);
+            break;
+        case USB_FNR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        case USB_DADDR_OFFSET:
+            s->USB_DADDR = value & 0xff;
+            if(s->host.state != USB_HOST_DETACHED) {
+                qemu_bh_schedule(s->host_bh);
+            }
+            break;
+        case USB_BTABLE_OFFSET:
+            s->USB_BTABLE = value & USB_BTABLE_MASK;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_usb_ops = {
+    .read = stm32_usb_read,
+    .write = stm32_usb_write,
+    .valid.min_access_size = 2,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+/* Each 16-bit word of the PMA takes 32 bits of the address space, of which
+ * the upper half reads as 0. */
+static uint64_t stm32_usb_pma_read(void *opaque, hwaddr offset,
+                                   unsigned size)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    if(offset & 2) {
+        return 0;
+    }
+    return stm32_usb_pma_get16(s, offset >> 1);
+}
+
+static void stm32_usb_pma_write(void *opaque, hwaddr offset,
+                                uint64_t value, unsigned size)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    if(!(offset & 2)) {
+        stm32_usb_pma_set16(s, offset >> 1, value);
+    }
+}
+
+static const MemoryRegionOps stm32_usb_pma_ops = {
+    .read = stm32_usb_pma_read,
+    .write = stm32_usb_pma_write,
+    .valid.min_access_size = 2,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_usb_reset(DeviceState *dev)
+{
+    Stm32Usb *s = STM32_USB(dev);
+
+    memset(s->USB_EPR, 0, sizeof(s->USB_EPR));
+    s->USB_CNTR = BIT(USB_CNTR_FRES_BIT) | BIT(USB_CNTR_PDWN_BIT);
+    s->USB_ISTR = 0;
+    s->USB_DADDR = 0;
+    s->USB_BTABLE = 0;
+    memset(&s->host, 0, sizeof(s->host));
+    s->host.state = USB_HOST_DETACHED;
+    timer_del(s->sof_timer);
+    timer_del(s->reset_timer);
+
+    stm32_usb_update_irq(s);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+void stm32_usb_connect(Stm32Usb *s, CharDriverState *chr)
+{
+    s->chr = chr;
+    if(chr) {
+        stm32_replay_chr_add_handlers(chr, "usb", stm32_usb_chr_can_receive,
+                                      stm32_usb_chr_receive, NULL, s);
+    }
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_usb_init(SysBusDevice *dev)
+{
+    Stm32Usb *s = STM32_USB(dev);
+
+    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_usb_ops, s,
+                          "usb", STM32_PERIPH_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+    memory_region_init_io(&s->pma_iomem, OBJECT(s), &stm32_usb_pma_ops, s,
+                          "usb-pma", USB_PMA_SIZE * 2);
+    sysbus_init_mmio(dev, &s->pma_iomem);
+
+    sysbus_init_irq(dev, &s->irq_lp);
+    sysbus_init_irq(dev, &s->irq_hp);
+    s->host_bh = qemu_bh_new(stm32_usb_host_bh, s);
+    s->sof_timer = stm32_timer_new_ns(s->aio_context, stm32_usb_sof_tick, s);
+    s->reset_timer = stm32_timer_new_ns(s->aio_context,
+                                        stm32_usb_host_reset_tick, s);
+
+    return 0;
+}
+
+static int stm32_usb_post_load(void *opaque, int version_id)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    stm32_usb_update_irq(s);
+    if(s->host.state != USB_HOST_DETACHED) {
+        qemu_bh_schedule(s->host_bh);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_usb = {
+    .name = TYPE_STM32_USB,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_usb_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(USB_EPR, Stm32Usb, USB_EP_COUNT),
+        VMSTATE_UINT32(USB_CNTR, Stm32Usb),
+        VMSTATE_UINT32(USB_ISTR, Stm32Usb),
+        VMSTATE_UINT32(USB_DADDR, Stm32Usb),
+        VMSTATE_UINT32(USB_BTABLE, Stm32Usb),
+        VMSTATE_BUFFER(pma, Stm32Usb),
+        VMSTATE_TIMER(sof_timer, Stm32Usb),
+        VMSTATE_TIMER(reset_timer, Stm32Usb),
+        VMSTATE_UINT32(host.state, Stm32Usb),
+        VMSTATE_UINT32(host.step, Stm32Usb),
+        VMSTATE_UINT32(host.address, Stm32Usb),
+        VMSTATE_UINT32(host.ep0_size, Stm32Usb),
+        VMSTATE_BUFFER(host.setup, Stm32Usb),
+        VMSTATE_UINT32(host.data_len, Stm32Usb),
+        VMSTATE_BUFFER(host.data, Stm32Usb),
+        VMSTATE_UINT32(host.config_value, Stm32Usb),
+        VMSTATE_UINT32(host.comm_interface, Stm32Usb),
+        VMSTATE_UINT32(host.bulk_in, Stm32Usb),
+        VMSTATE_UINT32(host.bulk_out, Stm32Usb),
+        VMSTATE_UINT32(host.bulk_out_size, Stm32Usb),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_usb_properties[] = {
+    DEFINE_PROP_PERIPH_T("periph", Stm32Usb, periph, STM32_PERIPH_UNDEFINED),
+    DEFINE_PROP_PTR("stm32_rcc", Stm32Usb, stm32_rcc_prop),
+    DEFINE_PROP_PTR("aio_context", Stm32Usb, aio_context),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_usb_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_usb_init;
+    dc->reset = stm32_usb_reset;
+    dc->vmsd = &vmstate_stm32_usb;
+    dc->props = stm32_usb_properties;
+}
+
+static TypeInfo stm32_usb_info = {
+    .name  = TYPE_STM32_USB,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Usb),
+    .class_init = stm32_usb_class_init
+};
+
+static void stm32_usb_register_types(void)
+{
+    type_register_static(&stm32_usb_info);
+}
+
+type_init(stm32_usb_register_types)
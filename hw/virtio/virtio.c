@@ -855,15 +855,16 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     return !v || vring_need_event(vring_used_event(vq), new, old);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+bool virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     if (!vring_notify(vdev, vq)) {
-        return;
+        return false;
     }
 
     trace_virtio_notify(vdev, vq);
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
+    return true;
 }
 
 void virtio_notify_config(VirtIODevice *vdev)
@@ -65,16 +65,13 @@ struct AioContext {
      */
     bool dispatching;
 
-    /* lock to protect between bh's adders and deleter */
-    QemuMutex bh_lock;
+    /* Bottom halves scheduled since the last aio_bh_poll, pushed lock-free
+     * by any thread, newest first */
+    struct QEMUBH *pending_bh;
 
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
-
-    /* A simple lock used to protect the first_bh list, and ensure that
-     * no callbacks are removed while we're walking and dispatching callbacks.
-     */
-    int walking_bh;
+    /* Bottom halves taken by aio_bh_poll and not run yet.  Only used by
+     * the thread running aio_bh_poll. */
+    struct QEMUBH *bh_batch;
 
     /* Used for aio_notify.  */
     EventNotifier notifier;
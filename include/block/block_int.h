@@ -56,6 +56,15 @@
 #define BLOCK_OPT_REDUNDANCY        "redundancy"
 #define BLOCK_OPT_NOCOW             "nocow"
 
+/* bins[i] counts the latencies from boundaries[i - 1] (or 0) up to
+ * boundaries[i] (excluded); the last bin is open ended.
+ */
+typedef struct BlockLatencyHistogram {
+    int nbins;
+    uint64_t *boundaries;       /* nbins - 1 of them, in nanoseconds */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 typedef struct BdrvTrackedRequest {
     BlockDriverState *bs;
     int64_t offset;
@@ -197,9 +206,14 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    /* Fills in the driver specific optional fields of @stats */
+    void (*bdrv_get_stats)(BlockDriverState *bs, BlockDeviceStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
+    /* Unlike bdrv_save_vmstate, may run for several requests at once */
+    int coroutine_fn (*bdrv_co_save_vmstate)(BlockDriverState *bs,
+                                             QEMUIOVector *qiov, int64_t pos);
     int (*bdrv_load_vmstate)(BlockDriverState *bs, uint8_t *buf,
                              int64_t pos, int size);
 
@@ -344,6 +358,7 @@ struct BlockDriverState {
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    BlockLatencyHistogram latency_histogram[BDRV_MAX_IOTYPE];
 
     /* I/O Limits */
     BlockLimits bl;
@@ -66,6 +66,16 @@ typedef void coroutine_fn CoroutineEntry(void *opaque);
  */
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry);
 
+/**
+ * Create a new coroutine with a stack of @stack_size bytes
+ *
+ * Freed coroutines are only recycled when they have the default stack size,
+ * so this is meant for the few users that need a much smaller or larger
+ * stack than qemu_coroutine_create() gives.
+ */
+Coroutine *qemu_coroutine_create_with_stack(CoroutineEntry *entry,
+                                            size_t stack_size);
+
 /**
  * Transfer control to a coroutine
  *
@@ -31,6 +31,14 @@ typedef struct ThreadPool ThreadPool;
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
 
+typedef struct ThreadPoolRequest {
+    ThreadPoolFunc *func;
+    void *arg;
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    BlockDriverAIOCB *acb;      /* set by thread_pool_submit_batch */
+} ThreadPoolRequest;
+
 BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -38,4 +46,10 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 
+/* Submits num_reqs requests with one lock round per queue and a single
+ * check of the worker count; the AIOCBs are returned in reqs[].acb.
+ */
+void thread_pool_submit_batch(ThreadPool *pool, ThreadPoolRequest *reqs,
+                              int num_reqs);
+
 #endif
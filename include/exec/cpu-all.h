@@ -237,6 +237,8 @@ int walk_memory_regions(void *, walk_memory_regions_fn);
 int page_get_flags(target_ulong address);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
+target_ulong page_find_range_empty(target_ulong min, target_ulong max,
+                                   target_ulong len, target_ulong align);
 #endif
 
 CPUArchState *cpu_copy(CPUArchState *env);
@@ -311,6 +313,16 @@ typedef struct RAMBlock {
     int fd;
 } RAMBlock;
 
+/* RAM is pre-allocated and passed into qemu_ram_alloc_from_ptr */
+#define RAM_PREALLOC   (1 << 0)
+
+/* RAM is mmap-ed with MAP_SHARED */
+#define RAM_SHARED     (1 << 1)
+
+/* The host memory is also accessed directly, not only through the memory
+ * API, see qemu_ram_set_direct() */
+#define RAM_DIRECT     (1 << 2)
+
 typedef struct RAMList {
     QemuMutex mutex;
     /* Protected by the iothread lock.  */
@@ -331,6 +343,9 @@ extern RAMList ram_list;
 #define TLB_NOTDIRTY    (1 << 4)
 /* Set if TLB entry is an IO callback.  */
 #define TLB_MMIO        (1 << 5)
+/* Set with TLB_MMIO if the page has watchpoints but is otherwise plain
+   RAM: the accesses that miss the watched ranges may use the addend.  */
+#define TLB_WATCH       (1 << 6)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
 ram_addr_t last_ram_offset(void);
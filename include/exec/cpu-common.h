@@ -57,6 +57,20 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length);
 MemoryRegion *qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev);
 void qemu_ram_unset_idstr(ram_addr_t addr);
+void qemu_ram_set_direct(void *host);
+
+/* Pages not read yet by a lazy loadvm, see ram_lazy_load_prepare() */
+extern uint64_t ram_lazy_pending;
+void ram_lazy_load_range(ram_addr_t start, ram_addr_t length);
+
+/* Before an access to [start, start + length) of RAM by the memory API
+ * or a softmmu TLB fill */
+static inline void ram_lazy_fault(ram_addr_t start, ram_addr_t length)
+{
+    if (unlikely(ram_lazy_pending)) {
+        ram_lazy_load_range(start, length);
+    }
+}
 
 void cpu_physical_memory_rw(hwaddr addr, uint8_t *buf,
                             int len, int is_write);
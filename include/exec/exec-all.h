@@ -85,6 +85,8 @@ void page_size_init(void);
 
 void QEMU_NORETURN cpu_resume_from_signal(CPUState *cpu, void *puc);
 void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
+bool cpu_io_mid_tb(CPUState *cpu, uintptr_t retaddr);
+void cpu_io_mid_tb_end(CPUState *cpu);
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
@@ -116,8 +118,8 @@ static inline void tlb_flush(CPUState *cpu, int flush_global)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial and minimum number of slots of tb_phys_hash */
+#define CODE_GEN_PHYS_HASH_MIN_SIZE (1 << 12)
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -128,6 +130,9 @@ static inline void tlb_flush(CPUState *cpu, int flush_global)
 #define CODE_GEN_AVG_BLOCK_SIZE 64
 #endif
 
+/* maximum number of regions the code buffer is split into */
+#define CODE_GEN_MAX_REGIONS 8
+
 #if defined(__arm__) || defined(_ARCH_PPC) \
     || defined(__x86_64__) || defined(__i386__) \
     || defined(__sparc__) || defined(__aarch64__) \
@@ -142,13 +147,15 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_TIER2       0x10000 /* Retranslated hot block.  */
+#define CF_INVALID     0x20000 /* Removed by tb_phys_invalidate().  */
+    /* number of times cpu_exec entered this block, see tb_hot_count */
+    uint16_t exec_count;
 
     void *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -169,6 +176,9 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* with icount_no_split, the offset in tc_ptr of the host code of each
+       of the icount guest instructions, or NULL if not recorded */
+    uint16_t *insn_off;
 };
 
 #include "exec/spinlock.h"
@@ -178,41 +188,73 @@ typedef struct TBContext TBContext;
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* Open addressing table of the TBs by physical address, with linear
+       probing.  Its size is a power of two, and it is rehashed to stay
+       at most half full, counting the slots of removed TBs. */
+    struct TBHashSlot *tb_phys_hash;
+    size_t tb_phys_hash_size;
+    size_t tb_phys_hash_used;
+    size_t tb_phys_hash_deleted;
     int nb_tbs;
-    /* any access to the tbs or the page table must use this lock */
+    /* The code buffer and tbs[] are split into nb_regions equal parts,
+       filled in turn.  Moving on to the next region evicts its blocks. */
+    int nb_regions;
+    int region;
+    int region_max_blocks;
+    int region_nb_tbs[CODE_GEN_MAX_REGIONS];
+    size_t region_code_size[CODE_GEN_MAX_REGIONS];
+    /* any access to the tbs or the page table must use this lock, except
+       for a vCPU reading its own tb_jmp_cache */
     spinlock_t tb_lock;
 
     /* statistics */
+    uint64_t tb_gen_count;
     int tb_flush_count;
+    int tb_flush_full_count;
+    int tb_evict_count;
     int tb_phys_invalidate_count;
-
-    int tb_invalidated_flag;
+    uint64_t tb_phys_hash_lookups;
+    uint64_t tb_phys_hash_probes;
+    unsigned int tb_phys_hash_max_probes;
 };
 
-static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
+/* The direct-mapped cache is indexed by halfword, so the entries of a page
+   are contiguous and conflicts only occur TB_JMP_CACHE_DIRECT_SIZE * 2
+   bytes apart.  */
+#define TB_JMP_DIRECT_MASK (TB_JMP_CACHE_DIRECT_SIZE - 1)
+
+static inline unsigned int tb_jmp_cache_hash_page(CPUState *cpu,
+                                                  target_ulong pc)
 {
     target_ulong tmp;
+
+    if (cpu->tb_jmp_cache_direct) {
+        return ((pc & TARGET_PAGE_MASK) >> 1) & TB_JMP_DIRECT_MASK;
+    }
     tmp = pc ^ (pc >> (TARGET_PAGE_BITS - TB_JMP_PAGE_BITS));
     return (tmp >> (TARGET_PAGE_BITS - TB_JMP_PAGE_BITS)) & TB_JMP_PAGE_MASK;
 }
 
-static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
+static inline unsigned int tb_jmp_cache_hash_func(CPUState *cpu,
+                                                  target_ulong pc)
 {
     target_ulong tmp;
+
+    if (cpu->tb_jmp_cache_direct) {
+        return (pc >> 1) & TB_JMP_DIRECT_MASK;
+    }
     tmp = pc ^ (pc >> (TARGET_PAGE_BITS - TB_JMP_PAGE_BITS));
     return (((tmp >> (TARGET_PAGE_BITS - TB_JMP_PAGE_BITS)) & TB_JMP_PAGE_MASK)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
-{
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
-}
-
+TranslationBlock *tb_find_physical(CPUArchState *env, target_ulong pc,
+                                   target_ulong cs_base, uint64_t flags);
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+void tb_prefetch_add(target_ulong pc, target_ulong cs_base, int flags);
+bool tb_prefetch_run(void);
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -354,6 +396,7 @@ static inline tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong
 #else
 /* cputlb.c */
 tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
+bool tlb_code_mapped(CPUArchState *env1, target_ulong addr);
 #endif
 
 typedef void (CPUDebugExcpHandler)(CPUArchState *env);
@@ -362,6 +405,25 @@ void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler);
 
 /* vl.c */
 extern int singlestep;
+extern int tb_hot_count;
+extern const char *tb_coverage_file;
+
+/* translate-all.c */
+/* When set, every block adds one to the byte of this AFL style edge map
+   that is indexed by the locations of the previous block and itself,
+   instead of recording -tb-coverage.  The map must be set before the
+   first translation.  */
+#define TB_COVERAGE_MAP_SIZE (1 << 16)
+extern uint8_t *tb_coverage_map;
+extern uint32_t tb_coverage_prev;
+
+/* A block entered tb_hot_count times from the main loop is translated
+   again with CF_TIER2.  Until then it is never chained to, so that every
+   entry is counted. */
+static inline bool tb_is_counted(TranslationBlock *tb)
+{
+    return tb_hot_count && tb->cflags == 0;
+}
 
 /* cpu-exec.c */
 extern volatile sig_atomic_t exit_request;
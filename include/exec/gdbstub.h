@@ -10,6 +10,11 @@
 #define GDB_WATCHPOINT_READ      3
 #define GDB_WATCHPOINT_ACCESS    4
 
+/* Describe the target's memory to the debugger (qXfer:memory-map:read), in
+ * GDB's memory map XML format.  "flash" regions are written with the
+ * vFlash packets.  Only the first map set is used. */
+void gdb_set_memory_map(const char *xml);
+
 #ifdef NEED_CPU_H
 typedef void (*gdb_syscall_complete_cb)(CPUState *cpu,
                                         target_ulong ret, target_ulong err);
@@ -17,6 +22,9 @@ typedef void (*gdb_syscall_complete_cb)(CPUState *cpu,
 void gdb_do_syscall(gdb_syscall_complete_cb cb, const char *fmt, ...);
 int use_gdb_syscalls(void);
 void gdb_set_stop_cpu(CPUState *cpu);
+/* Called when the CPU hits a gdb breakpoint at pc: returns false if the
+ * breakpoint has conditions and they are all false. */
+bool gdb_breakpoint_condition(CPUState *cpu, target_ulong pc);
 void gdb_exit(CPUArchState *, int);
 #ifdef CONFIG_USER_ONLY
 int gdb_queuesig (void);
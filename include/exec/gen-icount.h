@@ -21,6 +21,42 @@ static inline void gen_tb_start(void)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb_coverage_map) {
+        TCGv_ptr prev_ptr = tcg_const_ptr(&tb_coverage_prev);
+        TCGv_ptr slot = tcg_temp_new_ptr();
+        TCGv_i32 prev = tcg_temp_new_i32();
+        TCGv_i32 cur;
+
+        /* tb_coverage_map[cur ^ prev]++, then prev = cur >> 1, where cur
+           is the block's location.  cpu_gen_code() patches it in.  */
+        tcg_gen_ld_i32(prev, prev_ptr, 0);
+        tcg_ctx.tb_coverage_arg = tcg_ctx.gen_opparam_ptr + 1;
+        cur = tcg_const_i32(0);
+        tcg_gen_xor_i32(prev, prev, cur);
+        tcg_gen_shri_i32(cur, cur, 1);
+        tcg_gen_st_i32(cur, prev_ptr, 0);
+        tcg_gen_ext_i32_ptr(slot, prev);
+        tcg_gen_addi_ptr(slot, slot, (uintptr_t)tb_coverage_map);
+        tcg_gen_ld8u_i32(prev, slot, 0);
+        tcg_gen_addi_i32(prev, prev, 1);
+        tcg_gen_st8_i32(prev, slot, 0);
+        tcg_temp_free_i32(cur);
+        tcg_temp_free_i32(prev);
+        tcg_temp_free_ptr(slot);
+        tcg_temp_free_ptr(prev_ptr);
+    } else if (tb_coverage_file) {
+        TCGv_i32 one = tcg_const_i32(1);
+        TCGv_ptr hit;
+
+        /* The address of the block's coverage flag is only known once the
+           block is translated: cpu_gen_code() patches it in.  */
+        tcg_ctx.tb_coverage_arg = tcg_ctx.gen_opparam_ptr + 1;
+        hit = tcg_const_ptr(0);
+        tcg_gen_st8_i32(one, hit, 0);
+        tcg_temp_free_ptr(hit);
+        tcg_temp_free_i32(one);
+    }
+
     if (!use_icount)
         return;
 
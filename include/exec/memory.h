@@ -19,7 +19,8 @@
 #define DIRTY_MEMORY_VGA       0
 #define DIRTY_MEMORY_CODE      1
 #define DIRTY_MEMORY_MIGRATION 2
-#define DIRTY_MEMORY_NUM       3        /* num of dirty bits */
+#define DIRTY_MEMORY_CHECKPOINT 3       /* in-memory checkpoints (savevm.c) */
+#define DIRTY_MEMORY_NUM       4        /* num of dirty bits */
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -67,6 +68,12 @@ struct IOMMUTLBEntry {
     IOMMUAccessFlags perm;
 };
 
+#define MEMORY_REGION_IDEMPOTENT(offset) (1ULL << ((offset) >> 2))
+
+/* Performs an aligned 4-byte write of one register, see
+ * MemoryRegionOps.fast_write. */
+typedef void MemoryRegionFastWrite(void *opaque, uint32_t data);
+
 /*
  * Memory region callbacks
  */
@@ -82,6 +89,34 @@ struct MemoryRegionOps {
                   hwaddr addr,
                   uint64_t data,
                   unsigned size);
+    /* Optional.  Returns the QEMU_CLOCK_VIRTUAL time before which the value
+     * read at @addr cannot change (other than by a guest write), or a time
+     * which is not in the future if it may change at any moment.  Reading
+     * the register again must have no side effects until then.  A CPU found
+     * spinning on the register is halted until that time, so if the value
+     * can also change for reasons the device cannot predict (e.g. input
+     * from a character device), the device must call
+     * cpu_mmio_poll_wake_all() when it does. */
+    int64_t (*poll_deadline)(void *opaque,
+                             hwaddr addr,
+                             unsigned size);
+    /* Optional.  Bit n set means that reading the 32-bit register at
+     * offset 4 * n has no side effects and returns the same value until
+     * the next write to the region, so aligned 4-byte reads of it may be
+     * served from a cache without calling @read.  Use
+     * MEMORY_REGION_IDEMPOTENT() to build the mask.  If the value can
+     * change for another reason (e.g. reset or migration), the device must
+     * call memory_region_flush_read_cache().  */
+    uint64_t idempotent_reads;
+    /* Optional.  Returns the function which performs an aligned 4-byte
+     * write of the register at @addr, or NULL.  A CPU whose translator
+     * knows the address of a store when it translates it may call that
+     * function straight from the generated code instead of going through
+     * the TLB and @write.  So the write must not need anything from the
+     * CPU (its registers, an exact virtual clock under -icount), and the
+     * region must stay where it is mapped once the machine is created.
+     * The value is passed as the CPU stored it.  */
+    MemoryRegionFastWrite *(*fast_write)(void *opaque, hwaddr addr);
 
     enum device_endian endianness;
     /* Guest-visible constraints: */
@@ -151,6 +186,7 @@ struct MemoryRegion {
     bool romd_mode;
     bool ram;
     bool readonly; /* For RAM regions */
+    bool rom_exec; /* For RAM regions */
     bool enabled;
     bool rom_device;
     bool warning_printed; /* For reservations */
@@ -167,6 +203,16 @@ struct MemoryRegion {
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
     NotifierList iommu_notify;
+    /* MMIO accesses dispatched to ops, and the host time spent in them.
+     * See query-mmio-stats.  */
+    uint64_t mmio_reads;
+    uint64_t mmio_writes;
+    uint64_t mmio_read_ns;
+    uint64_t mmio_write_ns;
+    /* Values of the ops->idempotent_reads registers, valid when the
+     * corresponding bit of read_cache_valid is set.  */
+    uint32_t *read_cache;
+    uint64_t read_cache_valid;
 };
 
 /**
@@ -208,6 +254,10 @@ struct AddressSpace {
     char *name;
     MemoryRegion *root;
     struct FlatView *current_map;
+    /* During a transaction commit, the new view if it differs from
+     * current_map */
+    struct FlatView *next_map;
+    bool topology_changed;
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
     struct AddressSpaceDispatch *dispatch;
@@ -620,6 +670,41 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
  */
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client);
+/**
+ * memory_region_snapshot_and_clear_dirty: Get a snapshot of the dirty
+ *                                         bitmap and clear it.
+ *
+ * Creates a snapshot of the dirty bitmap for a range of bytes of the
+ * region, then marks the range as clean for @client.  Querying the
+ * snapshot with memory_region_snapshot_get_dirty() is much cheaper than
+ * calling memory_region_get_dirty() many times, and no write is lost
+ * between the queries and the reset.  Free the snapshot with g_free().
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ */
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client);
+
+/**
+ * memory_region_snapshot_get_dirty: Check whether a range of bytes is dirty
+ *                                   in the specified dirty bitmap snapshot.
+ *
+ * @mr: the memory region being queried.
+ * @snap: the dirty bitmap snapshot
+ * @addr: the address (relative to the start of the region) being queried.
+ *        It must lie within the range the snapshot was taken for.
+ * @size: the size of the range being queried.
+ */
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size);
+
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -657,6 +742,33 @@ void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly);
 
+/**
+ * memory_region_set_rom_exec: Declare that the guest never writes a region
+ *
+ * Tells TCG that code translated from this RAM region cannot be modified
+ * by guest stores, so the pages it is on need not be write-protected to
+ * catch self-modifying code.  Only writes through
+ * cpu_physical_memory_write_rom() (the loader and the debugger) still
+ * invalidate translated code.  Typically used for flash which is
+ * read-only to the guest and is not reprogrammed while it runs.
+ *
+ * @mr: the region being updated; must be a read-only RAM region or a ROM
+ *      device whose write callback does its own invalidation.
+ * @rom_exec: whether guest writes are impossible.
+ */
+void memory_region_set_rom_exec(MemoryRegion *mr, bool rom_exec);
+
+/**
+ * memory_region_is_rom_exec: check whether a region has been marked with
+ * memory_region_set_rom_exec()
+ *
+ * @mr: the memory region being queried
+ */
+static inline bool memory_region_is_rom_exec(MemoryRegion *mr)
+{
+    return mr->rom_exec;
+}
+
 /**
  * memory_region_rom_device_set_romd: enable/disable ROMD mode
  *
@@ -733,6 +845,31 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_flush_read_cache: Forget the cached values of the
+ *                                 idempotent registers of a region.
+ *
+ * Must be called by a device whose MemoryRegionOps sets idempotent_reads
+ * when one of those registers changes other than by a guest write to the
+ * region, for example on reset or after loading its state.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_flush_read_cache(MemoryRegion *mr);
+
+/**
+ * memory_region_fast_write: Call a write function returned by the
+ *                           fast_write hook of a region's ops.
+ *
+ * Takes care of the bookkeeping otherwise done by the dispatch.
+ *
+ * @mr: the region
+ * @fn: the function returned for the register written
+ * @data: the value written
+ */
+void memory_region_fast_write(MemoryRegion *mr, MemoryRegionFastWrite *fn,
+                              uint32_t data);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
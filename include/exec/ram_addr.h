@@ -30,6 +30,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
 ram_addr_t qemu_ram_alloc(ram_addr_t size, MemoryRegion *mr);
 int qemu_get_ram_fd(ram_addr_t addr);
 void *qemu_get_ram_block_host_ptr(ram_addr_t addr);
+bool qemu_ram_is_rom_exec(ram_addr_t addr);
 void *qemu_get_ram_ptr(ram_addr_t addr);
 void qemu_ram_free(ram_addr_t addr);
 void qemu_ram_free_from_ptr(ram_addr_t addr);
@@ -76,7 +77,9 @@ static inline bool cpu_physical_memory_is_clean(ram_addr_t addr)
     bool code = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE);
     bool migration =
         cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
-    return !(vga && code && migration);
+    bool checkpoint =
+        cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CHECKPOINT);
+    return !(vga && code && migration && checkpoint);
 }
 
 static inline bool cpu_physical_memory_range_includes_clean(ram_addr_t start,
@@ -86,7 +89,9 @@ static inline bool cpu_physical_memory_range_includes_clean(ram_addr_t start,
     bool code = cpu_physical_memory_get_clean(start, length, DIRTY_MEMORY_CODE);
     bool migration =
         cpu_physical_memory_get_clean(start, length, DIRTY_MEMORY_MIGRATION);
-    return vga || code || migration;
+    bool checkpoint =
+        cpu_physical_memory_get_clean(start, length, DIRTY_MEMORY_CHECKPOINT);
+    return vga || code || migration || checkpoint;
 }
 
 static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
@@ -105,6 +110,7 @@ static inline void cpu_physical_memory_set_dirty_range_nocode(ram_addr_t start,
     page = start >> TARGET_PAGE_BITS;
     bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
     bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
+    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_CHECKPOINT], page, end - page);
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
@@ -116,6 +122,7 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
     page = start >> TARGET_PAGE_BITS;
     bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
     bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
+    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_CHECKPOINT], page, end - page);
     bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_CODE], page, end - page);
     xen_modified_memory(start, length);
 }
@@ -127,8 +134,6 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
 {
     unsigned long i, j;
     unsigned long page_number, c;
-    hwaddr addr;
-    ram_addr_t ram_addr;
     unsigned long len = (pages + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
     unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
     unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
@@ -146,27 +151,47 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                 ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][page + k] |= temp;
                 ram_list.dirty_memory[DIRTY_MEMORY_VGA][page + k] |= temp;
                 ram_list.dirty_memory[DIRTY_MEMORY_CODE][page + k] |= temp;
+                ram_list.dirty_memory[DIRTY_MEMORY_CHECKPOINT][page + k] |= temp;
             }
         }
         xen_modified_memory(start, pages);
     } else {
         /*
          * bitmap-traveling is faster than memory-traveling (for addr...)
-         * especially when most of the memory is not dirty.
+         * especially when most of the memory is not dirty.  Runs of dirty
+         * pages, possibly spanning words, are marked with a single call:
+         * a dirty huge page then costs one bitmap_set per client instead
+         * of one per small page.
          */
+        unsigned long run_start = 0, run_len = 0, n;
+
         for (i = 0; i < len; i++) {
-            if (bitmap[i] != 0) {
-                c = leul_to_cpu(bitmap[i]);
-                do {
-                    j = ctzl(c);
-                    c &= ~(1ul << j);
-                    page_number = (i * HOST_LONG_BITS + j) * hpratio;
-                    addr = page_number * TARGET_PAGE_SIZE;
-                    ram_addr = start + addr;
-                    cpu_physical_memory_set_dirty_range(ram_addr,
-                                       TARGET_PAGE_SIZE * hpratio);
-                } while (c != 0);
+            if (bitmap[i] == 0) {
+                continue;
             }
+            c = leul_to_cpu(bitmap[i]);
+            do {
+                j = ctzl(c);
+                n = MIN(ctol(c >> j), HOST_LONG_BITS - j);
+                page_number = i * HOST_LONG_BITS + j;
+                if (run_len && run_start + run_len == page_number) {
+                    run_len += n;
+                } else {
+                    if (run_len) {
+                        cpu_physical_memory_set_dirty_range(
+                            start + run_start * hpratio * TARGET_PAGE_SIZE,
+                            run_len * hpratio * TARGET_PAGE_SIZE);
+                    }
+                    run_start = page_number;
+                    run_len = n;
+                }
+                c = j + n < HOST_LONG_BITS ? c & (~0ul << (j + n)) : 0;
+            } while (c != 0);
+        }
+        if (run_len) {
+            cpu_physical_memory_set_dirty_range(
+                start + run_start * hpratio * TARGET_PAGE_SIZE,
+                run_len * hpratio * TARGET_PAGE_SIZE);
         }
     }
 }
@@ -187,5 +212,12 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
                                      unsigned client);
 
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+    (ram_addr_t start, ram_addr_t length, unsigned client);
+
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length);
+
 #endif
 #endif
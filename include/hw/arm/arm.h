@@ -18,6 +18,13 @@
 qemu_irq *armv7m_init(Object *parent, MemoryRegion *address_space_mem,
                       int flash_size, int sram_size,
                       const char *kernel_filename, const char *cpu_model);
+qemu_irq *armv7m_init_with_flash(Object *parent,
+                                 MemoryRegion *address_space_mem,
+                                 AddressSpace *as,
+                                 MemoryRegion *flash, MemoryRegion *sram,
+                                 int sram_size, const char *kernel_filename,
+                                 const char *cpu_model, int num_irq);
+char *armv7m_ram_name(Object *parent, AddressSpace *as, const char *name);
 
 /* arm_boot.c */
 struct arm_boot_info {
@@ -77,4 +84,8 @@ extern int system_clock_scale;
  * qemu timer ticks. */
 extern int external_ref_clock_scale;
 
+void armv7m_nvic_set_clock_scale(DeviceState *dev, int system_scale,
+                                 int ext_ref_scale);
+void armv7m_nvic_set_cpu_freq(DeviceState *dev, uint32_t freq);
+
 #endif /* !ARM_MISC_H */
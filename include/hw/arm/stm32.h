@@ -28,13 +28,48 @@
 #include "qemu-common.h"
 #include "hw/sysbus.h"
 #include "qemu/log.h"
+#include "qemu/notify.h"
+#include "sysemu/char.h"
+#include "net/can.h"
 
 void stm32_hw_warn(const char *fmt, ...)
     __attribute__ ((__format__ (__printf__, 1, 2)));
 
+/* Register pages.  A device whose register reads have no side effects can
+ * create its register window with stm32_init_reg_page and direct_read set.
+ * The guest then reads the registers straight from a RAM page, and only
+ * writes go through ops.  The device must store every register value in
+ * the page with stm32_reg_page_set whenever it changes, including changes
+ * which do not come from a guest write.  Reads of unimplemented or
+ * write-only registers return 0 without a warning.
+ *
+ * With direct_read clear, this is an ordinary I/O region and
+ * stm32_reg_page_set does nothing.
+ */
+#define STM32_REG_PAGE_SIZE 0x400
+
+void stm32_init_reg_page(MemoryRegion *mr, Object *owner,
+                         const MemoryRegionOps *ops, void *opaque,
+                         const char *name, bool direct_read);
+void stm32_reg_page_set(MemoryRegion *mr, hwaddr offset, uint32_t value);
+
 
 
 /* PERIPHERALS - COMMON */
+/* The register window of each peripheral.  The peripherals are 1 KB apart,
+ * which is the target page size, so a window covering all of its 1 KB is
+ * a whole page and is dispatched directly.  A window even one byte short
+ * leaves part of the page unassigned and puts the page behind a subpage,
+ * which costs a second lookup on every access. */
+#define STM32_PERIPH_SIZE 0x400
+
+/* A QEMU_CLOCK_VIRTUAL timer for a peripheral.  With aio_context NULL it
+ * is on the main loop, otherwise in the given AioContext (that of the
+ * microcontroller's iothread), whose thread runs the callback with the BQL
+ * held. */
+QEMUTimer *stm32_timer_new_ns(void *aio_context, QEMUTimerCB *cb,
+                              void *opaque);
+
 /* Indexes used for accessing a GPIO array */
 #define STM32_GPIOA_INDEX 0
 #define STM32_GPIOB_INDEX 1
@@ -95,8 +130,8 @@ typedef int32_t stm32_periph_t;
 #define STM32_WWDG 32
 #define STM32_CAN1 33
 #define STM32_CAN2 34
-#define STM32_CAN 35
-#define STM32_USB 36
+#define STM32_CAN_PERIPH 35
+#define STM32_USB_PERIPH 36
 #define STM32_SPI1 37
 #define STM32_SPI2 38
 #define STM32_SPI3 39
@@ -104,7 +139,10 @@ typedef int32_t stm32_periph_t;
 #define STM32_SDIO 41
 #define STM32_FSMC 42
 #define STM32_RTC 43
-#define STM32_PERIPH_COUNT 44
+#define STM32_DMA1 44
+#define STM32_DMA2 45
+#define STM32_ETH 46
+#define STM32_PERIPH_COUNT 47
 
 const char *stm32_periph_name(stm32_periph_t periph);
 
@@ -132,9 +170,24 @@ const char *stm32_periph_name(stm32_periph_t periph);
 
 
 /* IRQs */
+#define STM32_WWDG_IRQ 0        /* Window watchdog early wakeup interrupt */
 #define STM32_RTC_IRQ 3         /* RTC global interrupt */
+#define STM32_FLASH_IRQ 4       /* Flash global interrupt */
 #define STM32_RCC_IRQ 5
 
+#define STM32_DMA1_CHANNEL1_IRQ 11
+#define STM32_DMA1_CHANNEL2_IRQ 12
+#define STM32_DMA1_CHANNEL3_IRQ 13
+#define STM32_DMA1_CHANNEL4_IRQ 14
+#define STM32_DMA1_CHANNEL5_IRQ 15
+#define STM32_DMA1_CHANNEL6_IRQ 16
+#define STM32_DMA1_CHANNEL7_IRQ 17
+#define STM32_DMA2_CHANNEL1_IRQ 56
+#define STM32_DMA2_CHANNEL2_IRQ 57
+#define STM32_DMA2_CHANNEL3_IRQ 58
+#define STM32_DMA2_CHANNEL4_IRQ 59 /* Shared with channel 5 on high density */
+#define STM32_DMA2_CHANNEL5_IRQ 60
+
 
 #define STM32_ADC1_2_IRQ 18
 
@@ -144,6 +197,15 @@ const char *stm32_periph_name(stm32_periph_t periph);
 #define STM32_UART4_IRQ 52
 #define STM32_UART5_IRQ 53
 
+#define STM32_I2C1_EV_IRQ 31
+#define STM32_I2C1_ER_IRQ 32
+#define STM32_I2C2_EV_IRQ 33
+#define STM32_I2C2_ER_IRQ 34
+
+#define STM32_SPI1_IRQ 35
+#define STM32_SPI2_IRQ 36
+#define STM32_SPI3_IRQ 51
+
 #define STM32_EXTI0_IRQ 6
 #define STM32_EXTI1_IRQ 7
 #define STM32_EXTI2_IRQ 8
@@ -171,8 +233,22 @@ const char *stm32_periph_name(stm32_periph_t periph);
 #define TIM5_IRQn               50     /*!< TIM5 global Interrupt                                */
 #define TIM6_DAC_IRQn           54     /*!< TIM6 and DAC underrun Interrupt                      */
 #define TIM7_IRQn               55     /*!< TIM7 Interrupt                                       */       
+#define STM32_ETH_IRQ 61
 #define STM32_ETH_WKUP_IRQ 62
 
+/* On the F1 connectivity line and the F4.  The other F1 devices share the
+ * CAN1 TX and RX0 lines with USB. */
+#define STM32_CAN1_TX_IRQ 19
+#define STM32_CAN1_RX0_IRQ 20
+#define STM32_CAN1_RX1_IRQ 21
+#define STM32_CAN1_SCE_IRQ 22
+#define STM32_CAN2_TX_IRQ 63
+#define STM32_CAN2_RX0_IRQ 64
+#define STM32_CAN2_RX1_IRQ 65
+#define STM32_CAN2_SCE_IRQ 66
+#define STM32_USB_HP_CAN1_TX_IRQ 19
+#define STM32_USB_LP_CAN1_RX0_IRQ 20
+
 
 
 
@@ -194,10 +270,30 @@ typedef struct Stm32Afio Stm32Afio;
 #define STM32_USART3_PARTIAL_REMAP 1
 #define STM32_USART3_FULL_REMAP 3
 
+#define STM32_TIM1_NO_REMAP 0
+#define STM32_TIM1_PARTIAL_REMAP 1
+#define STM32_TIM1_FULL_REMAP 3
+
+#define STM32_TIM2_NO_REMAP 0
+#define STM32_TIM2_PARTIAL_REMAP1 1
+#define STM32_TIM2_PARTIAL_REMAP2 2
+#define STM32_TIM2_FULL_REMAP 3
+
+#define STM32_TIM3_NO_REMAP 0
+#define STM32_TIM3_PARTIAL_REMAP 2
+#define STM32_TIM3_FULL_REMAP 3
+
+#define STM32_TIM4_NO_REMAP 0
+#define STM32_TIM4_REMAP 1
+
 /* Gets the pin mapping for the specified peripheral.  Will return one
  * of the mapping values defined above. */
 uint32_t stm32_afio_get_periph_map(Stm32Afio *s, int32_t periph_num);
 
+/* The notifier is called whenever MAPR is written, so that peripherals
+ * can cache which pins they are routed to. */
+void stm32_afio_add_map_notifier(Stm32Afio *s, Notifier *notifier);
+
 
 
 
@@ -217,6 +313,10 @@ typedef struct Stm32Gpio Stm32Gpio;
 #define TYPE_STM32_GPIO "stm32-gpio"
 #define STM32_GPIO(obj) OBJECT_CHECK(Stm32Gpio, (obj), TYPE_STM32_GPIO)
 
+/* STM32F4 port (MODER/OTYPER/OSPEEDR/PUPDR/AFR layout).  The mode and
+ * config accessors below still return F1 style values for it. */
+#define TYPE_STM32F4_GPIO "stm32f4-gpio"
+
 #define STM32_GPIO_COUNT (STM32_GPIOG - STM32_GPIOA + 1)
 #define STM32_GPIO_PIN_COUNT 16
 
@@ -237,6 +337,123 @@ uint8_t stm32_gpio_get_mode_bits(Stm32Gpio *s, unsigned pin);
 #define STM32_GPIO_OUT_ALT_OPEN 3
 uint8_t stm32_gpio_get_config_bits(Stm32Gpio *s, unsigned pin);
 
+/* The notifier is called, with the port as data, whenever the mode or
+ * config bits of any pin of the port may have changed (CRL/CRH writes,
+ * MODER/OTYPER/OSPEEDR/PUPDR writes on the F4, and reset). */
+void stm32_gpio_add_config_notifier(Stm32Gpio *s, Notifier *notifier);
+
+/* PWM output.  Rather than toggling the pin's output IRQ at the PWM
+ * frequency, a timer driving the pin reports the period and duty cycle
+ * whenever they change.  The duty cycle is the fraction of the period
+ * the pin is high, in units of 1/STM32_GPIO_PWM_DUTY_MAX.  A period of 0
+ * means the pin is no longer driven by a PWM.  Changes are passed on
+ * through the "pwm" GPIO outputs, whose level is the duty cycle. */
+#define STM32_GPIO_PWM_DUTY_MAX 65536
+void stm32_gpio_set_pwm(Stm32Gpio *s, unsigned pin, uint64_t period_ns,
+                        uint32_t duty);
+uint32_t stm32_gpio_get_pwm(Stm32Gpio *s, unsigned pin, uint64_t *period_ns);
+
+/* Port-wide output change notification.  Board code and external probes
+ * which watch several pins of a port can register a handler, which is
+ * called once per ODR, BSRR or BRR write that changes any output pin.
+ * "changed" is the mask of output pins which changed and "value" is the
+ * new ODR value.  This avoids one IRQ dispatch per pin when firmware
+ * drives a parallel bus.  The per-pin output IRQs are still raised for
+ * consumers connected to them. */
+typedef void Stm32GpioPortHandler(void *opaque, Stm32Gpio *gpio,
+                                  uint16_t changed, uint16_t value);
+void stm32_gpio_add_port_observer(Stm32Gpio *s, Stm32GpioPortHandler *handler,
+                                  void *opaque);
+
+/* Shared memory stimulus.  An external process drives GPIO inputs and ADC
+ * channels through a mapped file, with one slot per microcontroller.  See
+ * stm32_stim.c for the layout. */
+typedef struct Stm32StimSlot Stm32StimSlot;
+Stm32StimSlot *stm32_stim_get_slot(const char *path, unsigned index);
+/* Returns the mask of the pins of the port driven from the file, and
+ * their levels in value. */
+uint16_t stm32_stim_gpio(Stm32StimSlot *slot, unsigned port, uint16_t *value);
+/* Returns true, with the sample in value, if the file drives the channel */
+bool stm32_stim_adc(Stm32StimSlot *slot, unsigned adc, unsigned channel,
+                    uint16_t *value);
+
+/* Record and replay of the inputs from outside the machine, with -icount.
+ * Each source of input has a channel, which is NULL unless recording or
+ * replaying.  See stm32_replay.c. */
+typedef struct Stm32ReplayChannel Stm32ReplayChannel;
+typedef void Stm32ReplayHandler(void *opaque, const uint8_t *buf, int size);
+void stm32_replay_init(const char *record_file, const char *replay_file);
+/* A channel for inputs pushed to the machine.  When replaying, handler is
+ * called with the recorded inputs at the time they were recorded. */
+Stm32ReplayChannel *stm32_replay_channel_new(const char *name,
+                                             Stm32ReplayHandler *handler,
+                                             void *opaque);
+/* Returns true if the input is to be applied now, false if it is dropped
+ * because the recorded inputs are being replayed. */
+bool stm32_replay_input(Stm32ReplayChannel *ch, const void *buf, int size);
+/* For values pulled by the machine.  Records the value in buf, or when
+ * replaying replaces it with the recorded one. */
+void stm32_replay_value(Stm32ReplayChannel *ch, void *buf, int size);
+/* qemu_chr_add_handlers and qemu_add_kbd_event_handler with their input
+ * going through a channel of the given name. */
+void stm32_replay_chr_add_handlers(CharDriverState *chr, const char *name,
+                                   IOCanReadHandler *can_read,
+                                   IOReadHandler *read,
+                                   IOEventHandler *event, void *opaque);
+void stm32_replay_add_kbd_event_handler(const char *name,
+                                        void (*func)(void *opaque,
+                                                     int keycode),
+                                        void *opaque);
+
+/* Firmware profiler.  Samples the CPU's PC and LR every period_ns of
+ * virtual time and writes the folded stacks to file at exit.  See
+ * stm32_prof.c. */
+void stm32_prof_init(ARMCPU *cpu, const char *file, uint32_t period_ns);
+
+/* Quantum synchronization of nodes run as separate processes with -icount.
+ * Messages sent on a channel are delivered to the channel of the same name
+ * on the other nodes one quantum later.  stm32_quantum_channel_new returns
+ * NULL when the node is not synchronized.  See stm32_quantum.c. */
+typedef struct Stm32QuantumChannel Stm32QuantumChannel;
+typedef void Stm32QuantumDeliver(void *opaque, const uint8_t *buf, int size);
+void stm32_quantum_init(const char *path, unsigned node, unsigned nodes,
+                        uint32_t quantum_ns);
+Stm32QuantumChannel *stm32_quantum_channel_new(const char *name,
+                                               Stm32QuantumDeliver *deliver,
+                                               void *opaque);
+void stm32_quantum_send(Stm32QuantumChannel *ch, const void *buf, int size);
+/* Pass the frames of the bus on to the other nodes, and theirs to it */
+void stm32_quantum_add_can_bus(CanBusState *bus);
+
+/* Forward the accesses to [base, base + size) to a model in another
+ * process through the shared memory file at path, synchronizing with it
+ * every quantum_ns of virtual time.  See stm32_cosim.c. */
+void stm32_cosim_init(MemoryRegion *system_memory, hwaddr base,
+                      uint32_t size, const char *path, uint32_t quantum_ns);
+
+/* A RAM region named name of size bytes, for the SRAM, which is kept in the
+ * shared memory file at path, with a snapshot copied every period_ns of
+ * virtual time if period_ns is not 0.  See stm32_sram_shm.c. */
+MemoryRegion *stm32_sram_shm_init(const char *name, uint32_t size,
+                                  const char *path, uint32_t period_ns);
+
+/* Fork server for afl-fuzz, with the registers the firmware takes its test
+ * cases from in reserved address space.  See stm32_fuzz.c. */
+void stm32_fuzz_init(MemoryRegion *system_memory, const char *input_file);
+
+/* GPIO output telemetry.  Records every output change of the ports added
+ * to it, with the virtual time, in a ring which is either streamed to chr
+ * or kept in the shared file. See stm32_gpio_trace.c for the format. */
+typedef struct Stm32GpioTrace Stm32GpioTrace;
+Stm32GpioTrace *stm32_gpio_trace_new(CharDriverState *chr, const char *file);
+void stm32_gpio_trace_add_port(Stm32GpioTrace *t, Stm32Gpio *gpio,
+                               unsigned port);
+
+/* Set several input pins at once.  The pins in mask take their level from
+ * the corresponding bits of value.  Only the pins which actually change
+ * are passed on to the EXTI. */
+void stm32_gpio_set_inputs(Stm32Gpio *s, uint16_t mask, uint16_t value);
+
 
 
 
@@ -249,13 +466,17 @@ typedef struct Stm32Rcc Stm32Rcc;
 #define TYPE_STM32_RCC "stm32-rcc"
 #define STM32_RCC(obj) OBJECT_CHECK(Stm32Rcc, (obj), TYPE_STM32_RCC)
 
+/* STM32F4 register layout and clock tree.  The peripheral clock functions
+ * below work the same way for it. */
+#define TYPE_STM32F4_RCC "stm32f4-rcc"
+
 /* Checks if the specified peripheral clock is enabled.
  * Generates a hardware error if not.
  */
 void stm32_rcc_check_periph_clk(Stm32Rcc *s, stm32_periph_t periph);
 
 /* Sets the IRQ to be called when the specified peripheral clock changes
- * frequency. */
+ * frequency.  The IRQ is not called when the clock is gated off. */
 void stm32_rcc_set_periph_clk_irq(
         Stm32Rcc *s,
         stm32_periph_t periph,
@@ -266,22 +487,62 @@ uint32_t stm32_rcc_get_periph_freq(
         Stm32Rcc *s,
         stm32_periph_t periph);
 
+/* Gets the generation number of the specified peripheral clock.  It changes
+ * whenever the clock frequency changes (and is never 0), so peripherals can
+ * recompute frequency-derived values lazily, on next use, instead of
+ * registering a clock IRQ. */
+uint32_t stm32_rcc_get_periph_generation(
+        Stm32Rcc *s,
+        stm32_periph_t periph);
+
 uint32_t stm32_rcc_get_rtc_freq(
         Stm32Rcc *s);
 
+/* Gets the frequency of the LSI oscillator, which clocks the independent
+ * watchdog whether or not it is switched on in CSR. */
+uint32_t stm32_rcc_get_lsi_freq(Stm32Rcc *s);
+
+/* Reset flags of RCC_CSR, for stm32_rcc_request_reset */
+#define STM32_RCC_RESET_IWDG 29
+#define STM32_RCC_RESET_WWDG 30
+
+/* Sets the reset flag and resets the machine, through the fast reset path
+ * if it is enabled.  The flag is still set when the firmware starts again.
+ * Safe to call from a timer callback. */
+void stm32_rcc_request_reset(Stm32Rcc *s, int rstf_bit);
+
+/* Stop mode: stm32_rcc_enter_stop switches off the PLL, HSE and HSI, which
+ * stops every clock but the LSE and LSI.  stm32_rcc_exit_stop starts the
+ * HSI again and selects it as the system clock, leaving the PLL and HSE off
+ * for the firmware to restart. */
+void stm32_rcc_enter_stop(Stm32Rcc *s);
+void stm32_rcc_exit_stop(Stm32Rcc *s);
+
 
 /* ADC */
 
-#define STM32_ADC_COUNT 2
+#define STM32_ADC_COUNT 3
+/* Regular channels IN0-IN17 */
+#define STM32_ADC_INPUTS 18
 
 typedef struct Stm32Adc Stm32Adc;
 
 void stm32_adc_connect(Stm32Adc *s, CharDriverState *chr,
                         uint32_t afio_board_map);
+/* Set the value the channel converts from the given virtual time on,
+ * in place of the sample source.  The conversions completed before that
+ * time keep the previous value. */
+void stm32_adc_set_input(Stm32Adc *s, unsigned channel, uint16_t value,
+                         int64_t time);
 
 #define TYPE_STM32_ADC "stm32-adc"
 #define STM32_ADC(obj) OBJECT_CHECK(Stm32Adc, (obj), TYPE_STM32_ADC)
 
+/* External trigger inputs of the regular group, a GPIO input array named
+ * "ext-trigger" indexed by CR2.EXTSEL.  A rising edge on the selected input
+ * starts the sequence when CR2.EXTTRIG is set. */
+#define STM32_ADC_EXT_TRIGGER_LINES 8
+
 #define STM32_ADC1_NO_REMAP 0
 #define STM32_ADC1_REMAP 1
 
@@ -291,18 +552,132 @@ void stm32_adc_connect(Stm32Adc *s, CharDriverState *chr,
 #define STM32_ADC3_NO_REMAP 0
 #define STM32_ADC3_REMAP 1
 
+/* Timestamped stimulus.  Applies GPIO input edges and ADC input values,
+ * read from a file and/or a chardev, at given virtual times.  See
+ * stm32_stim_queue.c for the format. */
+typedef struct Stm32StimQueue Stm32StimQueue;
+Stm32StimQueue *stm32_stim_queue_new(void *aio_context, CharDriverState *chr,
+                                     const char *file);
+void stm32_stim_queue_add_gpio(Stm32StimQueue *q, Stm32Gpio *gpio,
+                               unsigned port);
+void stm32_stim_queue_add_adc(Stm32StimQueue *q, Stm32Adc *adc,
+                              unsigned index);
+
 /*RTC*/
 
 typedef struct Stm32Rtc Stm32Rtc;
 #define TYPE_STM32_RTC "stm32-rtc"
 #define STM32_Rtc(obj) OBJECT_CHECK(Stm32Rtc, (obj), TYPE_STM32_RTC)
 
+/* Watchdogs */
+
+typedef struct Stm32Iwdg Stm32Iwdg;
+#define TYPE_STM32_IWDG "stm32-iwdg"
+#define STM32_Iwdg(obj) OBJECT_CHECK(Stm32Iwdg, (obj), TYPE_STM32_IWDG)
+
+typedef struct Stm32Wwdg Stm32Wwdg;
+#define TYPE_STM32_WWDG "stm32-wwdg"
+#define STM32_Wwdg(obj) OBJECT_CHECK(Stm32Wwdg, (obj), TYPE_STM32_WWDG)
+
+/* PWR */
+
+typedef struct Stm32Pwr Stm32Pwr;
+#define TYPE_STM32_PWR "stm32-pwr"
+#define STM32_Pwr(obj) OBJECT_CHECK(Stm32Pwr, (obj), TYPE_STM32_PWR)
+
+/* BKP */
+
+typedef struct Stm32Bkp Stm32Bkp;
+#define TYPE_STM32_BKP "stm32-bkp"
+#define STM32_Bkp(obj) OBJECT_CHECK(Stm32Bkp, (obj), TYPE_STM32_BKP)
+
+/* FSMC */
+
+typedef struct Stm32Fsmc Stm32Fsmc;
+#define TYPE_STM32_FSMC "stm32-fsmc"
+#define STM32_FSMC(obj) OBJECT_CHECK(Stm32Fsmc, (obj), TYPE_STM32_FSMC)
+
+/* The sub-banks NE1 to NE4 of bank 1, at 0x60000000, 0x64000000... */
+#define STM32_FSMC_BANK_COUNT 4
+#define STM32_FSMC_BANK_SIZE 0x04000000
+
+/* Connects mr, e.g. the registers of an LCD controller, to the sub-bank NE
+ * @bank (from 1), where the guest reaches it while the bank is enabled. */
+void stm32_fsmc_attach(Stm32Fsmc *s, int bank, MemoryRegion *mr);
+
+/* Connects a NOR Flash with the contents of bs to the sub-bank NE @bank */
+void stm32_fsmc_attach_nor(Stm32Fsmc *s, int bank, BlockDriverState *bs);
+
 /*DAC*/
 
 typedef struct Stm32Dac Stm32Dac;
 #define TYPE_STM32_DAC "stm32-dac"
 #define STM32_Dac(obj) OBJECT_CHECK(Stm32Dac, (obj), TYPE_STM32_DAC)
 
+/* Trigger inputs, a GPIO input array named "trigger" indexed by
+ * DAC_CR.TSELx.  They act on each channel whose TENx is set and whose
+ * TSELx selects them. */
+#define STM32_DAC_TRIGGER_LINES 8
+
+/* FLASH */
+typedef struct Stm32Flash Stm32Flash;
+
+#define TYPE_STM32_FLASH "stm32-flash"
+#define STM32_FLASH(obj) OBJECT_CHECK(Stm32Flash, (obj), TYPE_STM32_FLASH)
+
+/* Makes the CPU wait for the Flash at @base and its boot alias at 0 as
+ * FLASH_ACR sets, when instructions are counted (-icount).  The wait states
+ * are charged per translated block, so they are only approximate. */
+void stm32_flash_connect_cpu(Stm32Flash *s, ARMCPU *cpu, uint32_t base);
+
+/* Lets the blocks the CPU translates follow branches into the Flash at
+ * @base and its boot alias at 0 while the Flash is locked. */
+void stm32_flash_connect_traces(Stm32Flash *s, ARMCPU *cpu, uint32_t base);
+
+/* DMA */
+typedef struct Stm32Dma Stm32Dma;
+
+#define TYPE_STM32_DMA "stm32-dma"
+#define STM32_DMA(obj) OBJECT_CHECK(Stm32Dma, (obj), TYPE_STM32_DMA)
+
+#define STM32_DMA1_CHANNEL_COUNT 7
+#define STM32_DMA2_CHANNEL_COUNT 5
+
+/* Each DMA channel has several GPIO request inputs, which are ORed together
+ * like the request lines of the peripherals sharing a channel on the real
+ * hardware.  A request input stays high for as long as the peripheral wants
+ * data transferred (e.g. while a USART's TXE flag is set), and the peripheral
+ * lowers it as a side effect of the transfer.  Channels are numbered from 1
+ * as in the reference manual.
+ */
+#define STM32_DMA_CHANNEL_REQ_COUNT 4
+#define STM32_DMA_REQ(channel, n) \
+        (((channel) - 1) * STM32_DMA_CHANNEL_REQ_COUNT + (n))
+
+/* Block transfer handler for a peripheral data register.  When a channel
+ * moves bytes or half words between memory and the register at addr, the
+ * handler is given the whole remaining block (len bytes at buf, in frames of
+ * size bytes, little endian) instead of one register access per frame.  It
+ * returns the number of bytes it transferred, a multiple of size - anything
+ * it does not take goes through the register as usual.
+ */
+typedef int (*Stm32DmaBlockFn)(void *opaque, uint8_t *buf, int len,
+                               unsigned size, bool to_periph);
+
+void stm32_dma_set_block_handler(DeviceState *dma, hwaddr addr,
+                                 Stm32DmaBlockFn fn, void *opaque);
+
+/* DMA request outputs on peripheral devices (sysbus IRQ indexes) */
+#define STM32_UART_DMA_RX_IRQ 1
+#define STM32_UART_DMA_TX_IRQ 2
+#define STM32_ADC_DMA_IRQ 1
+#define STM32_DAC_DMA1_IRQ 0
+#define STM32_DAC_DMA2_IRQ 1
+#define STM32_SPI_DMA_RX_IRQ 1
+#define STM32_SPI_DMA_TX_IRQ 2
+#define STM32_I2C_DMA_RX_IRQ 1
+#define STM32_I2C_DMA_TX_IRQ 2
+
 /* UART */
 #define STM32_UART_COUNT 5
 
@@ -318,6 +693,118 @@ typedef struct Stm32Uart Stm32Uart;
 void stm32_uart_connect(Stm32Uart *s, CharDriverState *chr,
                         uint32_t afio_board_map);
 
+/* Connects the transmitter of s directly to the receiver of peer, which
+ * may belong to another STM32 in the same machine.  Characters are queued
+ * in peer's RX FIFO and received with its normal baud rate timing, without
+ * going through a character device.  For a full duplex link, connect both
+ * directions.
+ */
+void stm32_uart_connect_uart(Stm32Uart *s, Stm32Uart *peer,
+                             uint32_t afio_board_map);
+
+/* Connects the USART to the USARTs of the same name on the other nodes of
+ * a quantum synchronized network, see stm32_quantum_init.  What it
+ * transmits reaches all of them, and it receives what they transmit. */
+void stm32_uart_connect_quantum(Stm32Uart *s);
+
+
+/* SPI */
+#define STM32_SPI_COUNT 3
+
+typedef struct Stm32Spi Stm32Spi;
+
+#define TYPE_STM32_SPI "stm32-spi"
+#define STM32_SPI(obj) OBJECT_CHECK(Stm32Spi, (obj), TYPE_STM32_SPI)
+
+/* Hardware NSS output (sysbus IRQ index), low while the SPI is enabled
+ * as a master with SSOE set.  It can drive a slave's chip select.  Slaves
+ * are attached to the SPI's "ssi" bus. */
+#define STM32_SPI_NSS_IRQ 3
+
+/* Registers the SPI (mapped at base) with the DMA controller serving it,
+ * so that DMA transfers to and from DR are done a block at a time. */
+void stm32_spi_connect_dma(Stm32Spi *s, DeviceState *dma, hwaddr base);
+
+
+/* I2S */
+typedef struct Stm32I2s Stm32I2s;
+
+#define TYPE_STM32_I2S "stm32-i2s"
+#define STM32_I2S(obj) OBJECT_CHECK(Stm32I2s, (obj), TYPE_STM32_I2S)
+
+/* The I2S mode of SPI2 and SPI3.  The SPI keeps the I2SCFGR and I2SPR
+ * registers and passes them on with stm32_i2s_configure.  While I2SMOD is
+ * set, what the firmware writes to DR goes to stm32_i2s_transmit, which
+ * takes half words (little endian, len bytes at buf) and returns how many
+ * bytes it took.  In master transmit mode the samples are played on an
+ * audio output at the rate set by I2SPR.  The I2S device's sysbus IRQ 0 is
+ * TXE: high while there is room for more samples. */
+void stm32_i2s_configure(Stm32I2s *s, uint32_t i2scfgr, uint32_t i2spr);
+int stm32_i2s_transmit(Stm32I2s *s, const uint8_t *buf, int len);
+
+/* CHSIDE of SR: true if the next sample is for the right channel */
+bool stm32_i2s_chside(Stm32I2s *s);
+
+/* Hands DR of the SPI over to the I2S device while I2SMOD is set */
+void stm32_spi_connect_i2s(Stm32Spi *s, Stm32I2s *i2s);
+
+
+/* I2C */
+#define STM32_I2C_COUNT 2
+
+typedef struct Stm32I2c Stm32I2c;
+
+#define TYPE_STM32_I2C "stm32-i2c"
+#define STM32_I2C(obj) OBJECT_CHECK(Stm32I2c, (obj), TYPE_STM32_I2C)
+
+/* Error interrupt output (sysbus IRQ index).  Index 0 is the event
+ * interrupt.  Slaves are attached to the controller's "i2c" bus. */
+#define STM32_I2C_ER_IRQ 3
+
+/* Registers the I2C controller (mapped at base) with the DMA controller
+ * serving it, so that DMA transfers to and from DR are done a block at a
+ * time. */
+void stm32_i2c_connect_dma(Stm32I2c *s, DeviceState *dma, hwaddr base);
+
+
+/* Ethernet MAC (connectivity line and STM32F4).  The NIC properties
+ * ("mac", "netdev") connect it to the network. */
+typedef struct Stm32Eth Stm32Eth;
+
+#define TYPE_STM32_ETH "stm32-eth"
+#define STM32_ETH(obj) OBJECT_CHECK(Stm32Eth, (obj), TYPE_STM32_ETH)
+
+
+/* bxCAN controller.  The "canbus" property points it at a can-bus object
+ * (see include/net/can.h); CAN2 has its "master" property pointing at CAN1,
+ * which holds the filter banks of both. */
+typedef struct Stm32Can Stm32Can;
+
+#define TYPE_STM32_CAN "stm32-can"
+#define STM32_CAN(obj) OBJECT_CHECK(Stm32Can, (obj), TYPE_STM32_CAN)
+
+/* Interrupt outputs (sysbus IRQ indexes) */
+#define STM32_CAN_TX_IRQ 0
+#define STM32_CAN_RX0_IRQ 1
+#define STM32_CAN_RX1_IRQ 2
+#define STM32_CAN_SCE_IRQ 3
+
+
+/* USB full speed device controller (F1 except the connectivity line).  The
+ * second MMIO region is the packet memory.  The USB host at the other end
+ * is built in, and passes the data of the first bulk endpoints to and from
+ * chr. */
+typedef struct Stm32Usb Stm32Usb;
+
+#define TYPE_STM32_USB "stm32-usb"
+#define STM32_USB(obj) OBJECT_CHECK(Stm32Usb, (obj), TYPE_STM32_USB)
+
+/* Interrupt outputs (sysbus IRQ indexes) */
+#define STM32_USB_LP_IRQ 0
+#define STM32_USB_HP_IRQ 1
+
+void stm32_usb_connect(Stm32Usb *s, CharDriverState *chr);
+
 
 /* Timer */
 typedef struct Stm32Timer Stm32Timer;
@@ -325,11 +812,50 @@ typedef struct Stm32Timer Stm32Timer;
 #define TYPE_STM32_TIMER "stm32-timer"
 #define STM32_TIMER(obj) OBJECT_CHECK(Stm32Timer, (obj), TYPE_STM32_TIMER)
 
+/* Trigger fabric.  Each TRGO event selected by CR2.MMS is a pulse on every
+ * line of the "trgo" GPIO output array, so that one timer can trigger the
+ * ADC, the DAC and other timers.  The "itr" GPIO inputs are the internal
+ * trigger inputs ITR0-ITR3 of the slave mode controller (SMCR). */
+#define STM32_TIMER_TRGO_LINES 8
+#define STM32_TIMER_ITR_LINES 4
+
 
 
 /* STM32 MICROCONTROLLER - GENERAL */
 typedef struct Stm32 Stm32;
 
+#define TYPE_STM32F103 "stm32f103"
+#define STM32F103(obj) OBJECT_CHECK(Stm32, (obj), TYPE_STM32F103)
+
+/* STM32F4 with a Cortex-M4F.  ram_size is the size of the main SRAM; the
+ * 64 KB of CCM at 0x10000000 come on top of it. */
+#define TYPE_STM32F4 "stm32f4"
+#define STM32F4(obj) OBJECT_CHECK(Stm32, (obj), TYPE_STM32F4)
+
+/* Create an STM32 microcontroller as the child "name" of the machine, so
+ * that its peripherals can be found at /machine/<name>/gpio[a] etc.
+ * With private_memory set, it has its own CPU address space, and any
+ * number of them can be created in one machine.  Otherwise it is mapped
+ * into the system memory, where only one fits. */
+DeviceState *stm32_create(
+            const char *name,
+            bool private_memory,
+            ram_addr_t flash_size,
+            ram_addr_t ram_size,
+            const char *kernel_filename,
+            uint32_t osc_freq,
+            uint32_t osc32_freq);
+
+/* Same as stm32_create, for an STM32F4. */
+DeviceState *stm32f4_create(
+            const char *name,
+            bool private_memory,
+            ram_addr_t flash_size,
+            ram_addr_t ram_size,
+            const char *kernel_filename,
+            uint32_t osc_freq,
+            uint32_t osc32_freq);
+
 /* Initialize the STM32 microcontroller.  Returns arrays
  * of GPIOs and UARTs so that connections can be made. */
 void stm32_init(
@@ -23,10 +23,7 @@
 #define STM32_CLKTREE_H
 
 #include "qemu-common.h"
-
-#define CLKTREE_MAX_IRQ 16
-#define CLKTREE_MAX_OUTPUT 16
-#define CLKTREE_MAX_INPUT 16
+#include "qom/object.h"
 
 /* Use this when calling clktree_create_clk and clktree_set_selected_input */
 #define CLKTREE_NO_INPUT -1
@@ -36,6 +33,21 @@
 
 typedef struct Clk *Clk;
 
+/* Start a clock tree update transaction.  Until the matching
+ * clktree_commit_update call, changes made with clktree_set_scale,
+ * clktree_set_enabled and clktree_set_selected_input are recorded but not
+ * propagated.  Transactions may be nested; only the outermost commit
+ * propagates.
+ */
+void clktree_begin_update(void);
+
+/* End a clock tree update transaction.  The outermost commit recalculates
+ * every affected clock once (parents before children) and then notifies the
+ * users of each clock whose output frequency changed, at most once per
+ * clock.
+ */
+void clktree_commit_update(void);
+
 /* Check if the clock output is enabled. */
 bool clktree_is_enabled(Clk clk);
 
@@ -46,9 +58,26 @@ bool clktree_is_enabled(Clk clk);
  */
 uint32_t clktree_get_output_freq(Clk clk);
 
-/* Add an IRQ to receive notifications when the clock frequency is updated. */
+/* Get the clock's generation number.  This changes every time the output
+ * frequency changes, so a user can cache values derived from the frequency
+ * and only recompute them when the generation differs from the one it saw
+ * last time.  The generation is never 0.
+ */
+uint32_t clktree_get_generation(Clk clk);
+
+/* Add an IRQ to receive notifications when the clock frequency is updated.
+ * The IRQ is raised after the whole tree has been updated, so the handler
+ * may read any clock frequency.  It is not raised when the clock is gated
+ * off (i.e. when the new frequency is 0 because the clock was disabled). */
 void clktree_adduser(Clk clk, qemu_irq user);
 
+/* Expose first and every clock created after it as QOM children of parent,
+ * unless they are already exposed.  Each child has read-only "output-freq",
+ * "enabled" and "selected-input" properties.  These, and the
+ * query-stm32-clocks QMP command, report the state of the tree as of the
+ * last committed update. */
+void clktree_add_children(Object *parent, Clk first);
+
 /* Create a source clock (e.g. oscillator) with the given frequency. */
 Clk clktree_create_src_clk(
                     const char *name,
@@ -32,6 +32,8 @@
 #define GIC_NCPU 8
 
 #define MAX_NR_GROUP_PRIO 128
+/* Number of distinct priority values */
+#define GIC_NVIC_NR_PRIO 256
 #define GIC_NR_APRS (MAX_NR_GROUP_PRIO / 32)
 
 typedef struct gic_irq_state {
@@ -71,6 +73,23 @@ typedef struct GICState {
     uint16_t running_priority[GIC_NCPU];
     uint16_t current_pending[GIC_NCPU];
 
+    /* NVIC only: the interrupts which are both enabled and pending, with
+     * the priority each was filed under, and a count of them per priority
+     * level.  This lets gic_update() find the best pending interrupt
+     * without scanning every IRQ.  Derived from irq_state and the
+     * priorities, so it is not migrated.
+     */
+    DECLARE_BITMAP(nvic_candidates, GIC_MAXIRQ);
+    DECLARE_BITMAP(nvic_prio_used, GIC_NVIC_NR_PRIO);
+    uint8_t nvic_candidate_prio[GIC_MAXIRQ];
+    uint16_t nvic_prio_count[GIC_NVIC_NR_PRIO];
+    /* NVIC only: called with the pending state of an interrupt whenever
+     * gic_nvic_irq_changed() files or unfiles it (optional). */
+    void (*nvic_pend_notify)(struct GICState *s, int irq, bool pending);
+    /* NVIC only: called after the interrupt line to the CPU has been
+     * raised (optional). */
+    void (*nvic_wake_notify)(struct GICState *s);
+
     /* We present the GICv2 without security extensions to a guest and
      * therefore the guest can configure the GICC_CTLR to configure group 1
      * binary point in the abpr.
@@ -24,6 +24,12 @@ uint64_t ptimer_get_count(ptimer_state *s);
 void ptimer_set_count(ptimer_state *s, uint64_t count);
 void ptimer_run(ptimer_state *s, int oneshot);
 void ptimer_stop(ptimer_state *s);
+/* Number of times the counter has reached zero since the previous call.
+   A periodic timer whose period is shorter than the host can keep up
+   with runs its bottom half once for several expiries; devices that
+   count them (overflow counters, missed interrupt flags) should use this
+   rather than assume one expiry per bottom half.  */
+uint64_t ptimer_take_expired(ptimer_state *s);
 
 extern const VMStateDescription vmstate_ptimer;
 
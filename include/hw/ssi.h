@@ -55,6 +55,14 @@ typedef struct SSISlaveClass {
      * always be called for the device for every txrx access to the parent bus
      */
     uint32_t (*transfer_raw)(SSISlave *dev, uint32_t val);
+
+    /* Optional.  Transfer len 8 bit frames in one call, with the same
+     * result as calling transfer for each of them in turn.  Used by
+     * ssi_transfer_block when the device is selected.  Ignored if
+     * transfer_raw is overridden.
+     */
+    void (*transfer_block)(SSISlave *dev, const uint8_t *tx, uint8_t *rx,
+                           int len);
 } SSISlaveClass;
 
 struct SSISlave {
@@ -84,6 +92,10 @@ SSIBus *ssi_create_bus(DeviceState *parent, const char *name);
 
 uint32_t ssi_transfer(SSIBus *bus, uint32_t val);
 
+/* Transfer len 8 bit frames.  tx may be NULL to send zeros, and rx may be
+ * NULL to discard the frames received.  */
+void ssi_transfer_block(SSIBus *bus, const uint8_t *tx, uint8_t *rx, int len);
+
 /* Automatically connect all children nodes a spi controller as slaves */
 void ssi_auto_connect_slaves(DeviceState *parent, qemu_irq *cs_lines,
                              SSIBus *bus);
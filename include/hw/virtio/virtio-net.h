@@ -67,11 +67,21 @@
  * and latency. */
 #define TX_BURST 256
 
+/* RX notification batching.  With a non-zero x-rxtimer, the guest is
+ * notified of used RX buffers once x-rxburst packets have been received,
+ * or when the coalescing timer expires.  The timer interval adapts between
+ * RX_TIMER_MIN_INTERVAL and x-rxtimer: it grows while bursts fill up before
+ * it expires, and shrinks when it expires with few packets pending. */
+#define RX_TIMER_MIN_INTERVAL 5000 /* 5 us */
+#define RX_BURST 32
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint32_t rxtimer;
+    int32_t rxburst;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -153,6 +163,13 @@ typedef struct VirtIONetQueue {
         VirtQueueElement elem;
         ssize_t len;
     } async_tx;
+    QEMUTimer *rx_timer;
+    int64_t rx_timeout;
+    int rx_unnotified;
+    /* Exposed as the rx-notify-sent[N] and rx-notify-suppressed[N]
+     * properties */
+    uint64_t rx_notify_sent;
+    uint64_t rx_notify_suppressed;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -284,7 +301,9 @@ struct virtio_net_ctrl_mq {
 #define DEFINE_VIRTIO_NET_PROPERTIES(_state, _field)                           \
     DEFINE_PROP_UINT32("x-txtimer", _state, _field.txtimer, TX_TIMER_INTERVAL),\
     DEFINE_PROP_INT32("x-txburst", _state, _field.txburst, TX_BURST),          \
-    DEFINE_PROP_STRING("tx", _state, _field.tx)
+    DEFINE_PROP_STRING("tx", _state, _field.tx),                               \
+    DEFINE_PROP_UINT32("x-rxtimer", _state, _field.rxtimer, 0),                \
+    DEFINE_PROP_INT32("x-rxburst", _state, _field.rxburst, RX_BURST)
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -189,7 +189,9 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes);
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq);
+/* Returns false if the guest asked not to be notified (event index or
+ * VRING_AVAIL_F_NO_INTERRUPT) */
+bool virtio_notify(VirtIODevice *vdev, VirtQueue *vq);
 
 void virtio_save(VirtIODevice *vdev, QEMUFile *f);
 
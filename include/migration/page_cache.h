@@ -60,7 +60,7 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 on error
+ * Returns -1 on error, 1 if another page was evicted to make room, else 0
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -131,6 +131,7 @@ int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size);
 int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
+int64_t qemu_file_skip_unread(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
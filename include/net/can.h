@@ -0,0 +1,67 @@
+/*
+ * In-process CAN bus
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_CAN_H
+#define QEMU_NET_CAN_H
+
+#include "qemu-common.h"
+#include "qemu/queue.h"
+#include "qom/object.h"
+
+#define TYPE_CAN_BUS "can-bus"
+#define CAN_BUS(obj) OBJECT_CHECK(CanBusState, (obj), TYPE_CAN_BUS)
+
+/* Identifier flags and masks, as in <linux/can.h> */
+#define QEMU_CAN_EFF_FLAG 0x80000000U
+#define QEMU_CAN_RTR_FLAG 0x40000000U
+#define QEMU_CAN_ERR_FLAG 0x20000000U
+#define QEMU_CAN_SFF_MASK 0x000007ffU
+#define QEMU_CAN_EFF_MASK 0x1fffffffU
+
+/* A classic CAN frame, laid out like struct can_frame so that it can be
+ * passed to and from SocketCAN unchanged. */
+typedef struct QemuCanFrame {
+    uint32_t can_id;
+    uint8_t can_dlc;
+    uint8_t pad[3];
+    uint8_t data[8];
+} QemuCanFrame;
+
+typedef struct CanBusState CanBusState;
+typedef struct CanBusClientState CanBusClientState;
+
+typedef struct CanBusClientInfo {
+    /* Called with the frames another client sent, in bus order.  There is
+     * no flow control on CAN: frames the client has no room for are lost,
+     * as on the wire. */
+    void (*receive)(CanBusClientState *client,
+                    const QemuCanFrame *frames, size_t count);
+} CanBusClientInfo;
+
+struct CanBusClientState {
+    const CanBusClientInfo *info;
+    CanBusState *bus;
+    QTAILQ_ENTRY(CanBusClientState) next;
+};
+
+struct CanBusState {
+    /*< private >*/
+    Object parent_obj;
+
+    /*< public >*/
+    QTAILQ_HEAD(, CanBusClientState) clients;
+};
+
+void can_bus_insert_client(CanBusState *bus, CanBusClientState *client);
+void can_bus_remove_client(CanBusClientState *client);
+
+/* Put @count frames on the bus.  Every other client gets the whole batch
+ * in one receive call. */
+void can_bus_client_send(CanBusClientState *client,
+                         const QemuCanFrame *frames, size_t count);
+
+#endif
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 
 typedef struct NetPacket NetPacket;
+typedef struct NetSharedPacket NetSharedPacket;
 typedef struct NetQueue NetQueue;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
@@ -52,6 +53,23 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+ssize_t qemu_net_queue_send_batch(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const struct iovec *iov,
+                                  int count,
+                                  NetPacketSent *sent_cb);
+
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetSharedPacket **shared,
+                                   NetPacketSent *sent_cb);
+
+void qemu_net_shared_packet_unref(NetSharedPacket *shared);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
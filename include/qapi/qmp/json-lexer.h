@@ -14,8 +14,7 @@
 #ifndef QEMU_JSON_LEXER_H
 #define QEMU_JSON_LEXER_H
 
-#include "qapi/qmp/qstring.h"
-#include "qapi/qmp/qlist.h"
+#include <glib.h>
 
 typedef enum json_token_type {
     JSON_OPERATOR = 100,
@@ -28,15 +27,27 @@ typedef enum json_token_type {
     JSON_ERROR,
 } JSONTokenType;
 
+/* A token of a complete message, as handed to the parser.  Tokens are
+ * chained in input order through @next. */
+typedef struct JSONToken JSONToken;
+
+struct JSONToken {
+    JSONToken *next;
+    JSONTokenType type;
+    int x;
+    int y;
+    char str[];
+};
+
 typedef struct JSONLexer JSONLexer;
 
-typedef void (JSONLexerEmitter)(JSONLexer *, QString *, JSONTokenType, int x, int y);
+typedef void (JSONLexerEmitter)(JSONLexer *, GString *, JSONTokenType, int x, int y);
 
 struct JSONLexer
 {
     JSONLexerEmitter *emit;
     int state;
-    QString *token;
+    GString *token;
     int x, y;
 };
 
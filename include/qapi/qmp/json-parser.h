@@ -15,10 +15,10 @@
 #define QEMU_JSON_PARSER_H
 
 #include "qemu-common.h"
-#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/json-lexer.h"
 #include "qapi/error.h"
 
-QObject *json_parser_parse(QList *tokens, va_list *ap);
-QObject *json_parser_parse_err(QList *tokens, va_list *ap, Error **errp);
+QObject *json_parser_parse(JSONToken *tokens, va_list *ap);
+QObject *json_parser_parse_err(JSONToken *tokens, va_list *ap, Error **errp);
 
 #endif
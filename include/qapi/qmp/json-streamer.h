@@ -14,21 +14,26 @@
 #ifndef QEMU_JSON_STREAMER_H
 #define QEMU_JSON_STREAMER_H
 
-#include "qapi/qmp/qlist.h"
 #include "qapi/qmp/json-lexer.h"
 
+typedef struct JSONTokenChunk JSONTokenChunk;
+
 typedef struct JSONMessageParser
 {
-    void (*emit)(struct JSONMessageParser *parser, QList *tokens);
+    void (*emit)(struct JSONMessageParser *parser, JSONToken *tokens);
     JSONLexer lexer;
     int brace_count;
     int bracket_count;
-    QList *tokens;
+    JSONToken *tokens;
+    JSONToken **tokens_tail;
+    JSONTokenChunk *chunks;
     uint64_t token_size;
 } JSONMessageParser;
 
+/* @func receives the tokens of each complete message, or NULL after a
+ * lexical error.  The tokens are only valid until @func returns. */
 void json_message_parser_init(JSONMessageParser *parser,
-                              void (*func)(JSONMessageParser *, QList *));
+                              void (*func)(JSONMessageParser *, JSONToken *));
 
 int json_message_parser_feed(JSONMessageParser *parser,
                              const char *buffer, size_t size);
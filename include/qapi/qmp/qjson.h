@@ -26,4 +26,17 @@ QObject *qobject_from_jsonv(const char *string, va_list *ap) GCC_FMT_ATTR(1, 0);
 QString *qobject_to_json(const QObject *obj);
 QString *qobject_to_json_pretty(const QObject *obj);
 
+void qjson_append_str(QString *str, const char *ptr);
+void qjson_append_number(QString *str, double value);
+
+/* Text already in JSON, which qobject_to_json() copies as it is */
+typedef struct QJsonText {
+    QObject_HEAD;
+    QString *text;
+} QJsonText;
+
+QJsonText *qjsontext_from_qstring(QString *text);
+QJsonText *qobject_to_qjsontext(const QObject *obj);
+const char *qjsontext_get_str(const QJsonText *qjt);
+
 #endif /* QJSON_H */
@@ -106,7 +106,9 @@ static inline char *realpath(const char *path, char *resolved_path)
 
 /* icount */
 void configure_icount(const char *option);
+void icount_disable_sleep(void);
 extern int use_icount;
+extern bool icount_no_split;
 
 #include "qemu/osdep.h"
 #include "qemu/bswap.h"
@@ -448,6 +450,7 @@ void qemu_hexdump(const char *buf, FILE *fp, const char *prefix, size_t size);
 #endif
 
 #define BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR 8
+/* Checks the alignment needed by buffer_find_different_offset() */
 static inline bool
 can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
 {
@@ -456,6 +459,8 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
             && ((uintptr_t) buf) % sizeof(VECTYPE) == 0);
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+size_t buffer_find_different_offset(const void *buf1, const void *buf2,
+                                    size_t len);
 
 /*
  * helper to parse debug environment variables
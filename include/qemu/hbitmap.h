@@ -117,6 +117,17 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_next_zero:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to examine (0-based).
+ *
+ * Return the first bit at or after @start that is not set, rounded down to
+ * the granularity, or -1 if every bit from @start to the end is set.  Set
+ * words are skipped a whole word at a time.
+ */
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -176,6 +187,17 @@ static inline int64_t hbitmap_iter_next(HBitmapIter *hbi)
     return item << hbi->granularity;
 }
 
+/**
+ * hbitmap_iter_next_extent:
+ * @hbi: HBitmapIter to operate on.
+ * @count: Location where to store the length of the extent.
+ *
+ * Return the first bit of the next run of set bits in @hbi's associated
+ * HBitmap, store the number of bits in the run in *@count, and move the
+ * iterator past the run.  Return -1 if all remaining bits are zero.
+ */
+int64_t hbitmap_iter_next_extent(HBitmapIter *hbi, uint64_t *count);
+
 /**
  * hbitmap_iter_next_word:
  * @hbi: HBitmapIter to operate on.
@@ -0,0 +1,83 @@
+/*
+ * Interval tree of disjoint address ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+/* A set of addresses, kept as a balanced tree of disjoint, non-adjacent
+ * [start, last] intervals.  Adding, removing and looking up a range, and
+ * finding a free gap of a given size, take logarithmic time in the number
+ * of intervals.  A zero-filled IntervalTree is empty and ready to use.
+ */
+typedef struct IntervalTree {
+    IntervalTreeNode *root;
+    uint32_t seq;
+} IntervalTree;
+
+/**
+ * interval_tree_destroy:
+ * @tree: The tree to empty.
+ *
+ * Remove every interval from @tree and free the memory it uses.
+ */
+void interval_tree_destroy(IntervalTree *tree);
+
+/**
+ * interval_tree_add:
+ * @tree: The tree to operate on.
+ * @start: First address of the range.
+ * @last: Last address of the range, inclusive.
+ *
+ * Add [@start, @last] to @tree, merging it with the intervals it overlaps
+ * or touches.
+ */
+void interval_tree_add(IntervalTree *tree, uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_remove:
+ * @tree: The tree to operate on.
+ * @start: First address of the range.
+ * @last: Last address of the range, inclusive.
+ *
+ * Remove [@start, @last] from @tree, splitting the intervals that
+ * straddle its ends.
+ */
+void interval_tree_remove(IntervalTree *tree, uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_intersects:
+ * @tree: The tree to query.
+ * @start: First address of the range.
+ * @last: Last address of the range, inclusive.
+ *
+ * Return whether any address in [@start, @last] is in @tree.
+ */
+bool interval_tree_intersects(const IntervalTree *tree,
+                              uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_find_gap:
+ * @tree: The tree to query.
+ * @min: Lowest address the gap may start at.
+ * @max: Highest address the gap may end at, inclusive.
+ * @size: Size of the gap, non-zero.
+ * @align: Alignment of the gap start, a power of two.
+ * @addr: Where to store the start of the gap.
+ *
+ * Look for the highest @size bytes between @min and @max that are not in
+ * @tree and start at a multiple of @align.  Return false if there are none.
+ */
+bool interval_tree_find_gap(const IntervalTree *tree, uint64_t min,
+                            uint64_t max, uint64_t size, uint64_t align,
+                            uint64_t *addr);
+
+#endif
@@ -40,6 +40,7 @@ static inline bool qemu_log_enabled(void)
 #define CPU_LOG_RESET      (1 << 9)
 #define LOG_UNIMP          (1 << 10)
 #define LOG_GUEST_ERROR    (1 << 11)
+#define LOG_ASYNC          (1 << 12)
 
 /* Returns true if a bit is set in the current loglevel mask
  */
@@ -69,6 +70,15 @@ qemu_log_vprintf(const char *fmt, va_list va)
 void GCC_FMT_ATTR(2, 3) qemu_log_mask(int mask, const char *fmt, ...);
 
 
+/* With LOG_ASYNC, the hot events which are formatted offline: */
+
+/* "Trace %p [pc] symbol", of CPU_LOG_EXEC */
+void qemu_log_async_exec(const void *tc_ptr, uint64_t pc);
+
+/* "Taking exception %d [%s]", of CPU_LOG_INT.  @name must be static. */
+void qemu_log_async_exception(int idx, const char *name);
+
+
 /* Special cases: */
 
 /* cpu_dump_state() logging functions: */
@@ -126,22 +136,11 @@ static inline void log_page_dump(void)
 
 /* Maintenance: */
 
-/* fflush() the log file */
-static inline void qemu_log_flush(void)
-{
-    fflush(qemu_logfile);
-}
+/* fflush() the log file, or with LOG_ASYNC write out the records */
+void qemu_log_flush(void);
 
 /* Close the log file */
-static inline void qemu_log_close(void)
-{
-    if (qemu_logfile) {
-        if (qemu_logfile != stderr) {
-            fclose(qemu_logfile);
-        }
-        qemu_logfile = NULL;
-    }
-}
+void qemu_log_close(void);
 
 /* Set up a new log file */
 static inline void qemu_log_set_file(FILE *f)
@@ -61,4 +61,10 @@ bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
+struct Notifier;
+/* Run @notifier when the calling thread exits.  The notifier must stay
+ * valid until then, so it is usually a thread-local variable. */
+void qemu_thread_atexit_add(struct Notifier *notifier);
+void qemu_thread_atexit_remove(struct Notifier *notifier);
+
 #endif
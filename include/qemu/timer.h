@@ -59,7 +59,8 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    int heap_index;             /* position in the active timer heap, or -1 */
+    uint64_t seq;               /* order in which same-time timers fire */
     int scale;
 };
 
@@ -27,6 +27,7 @@ typedef struct AddressSpace AddressSpace;
 typedef struct MemoryRegion MemoryRegion;
 typedef struct MemoryRegionSection MemoryRegionSection;
 typedef struct MemoryListener MemoryListener;
+typedef struct DirtyBitmapSnapshot DirtyBitmapSnapshot;
 
 typedef struct MemoryMappingList MemoryMappingList;
 
@@ -180,6 +180,39 @@ struct kvm_run;
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+/* Size of the direct-mapped jump cache used by CPUs that run from a small
+   flat address range (see cpu_tb_jmp_cache_set_direct).  */
+#define TB_JMP_CACHE_DIRECT_BITS 16
+#define TB_JMP_CACHE_DIRECT_SIZE (1 << TB_JMP_CACHE_DIRECT_BITS)
+
+/**
+ * CPUJitStats:
+ * @tb_find_slow_hits: Jump cache misses for which the TB was found in the
+ *           physical hash table.
+ * @tb_find_slow_misses: Jump cache misses for which the TB was translated.
+ * @chained_jumps: Direct jumps patched from one TB to the next.
+ * @exits_unchained: TBs which returned to the main loop when they ended.
+ * @exits_interrupt: Chains of TBs left on request of cpu_interrupt() or
+ *           cpu_exit().
+ * @exits_icount: Chains of TBs left because the instruction budget ran out.
+ * @exits_exception: Guest exceptions raised from the generated code or
+ *           its helpers.
+ * @io_recompiles: TBs translated again to end on a device access.
+ *
+ * Counters of the TCG execution loop for query-jit-stats.  Only the CPU's
+ * own thread writes them.
+ */
+typedef struct CPUJitStats {
+    uint64_t tb_find_slow_hits;
+    uint64_t tb_find_slow_misses;
+    uint64_t chained_jumps;
+    uint64_t exits_unchained;
+    uint64_t exits_interrupt;
+    uint64_t exits_icount;
+    uint64_t exits_exception;
+    uint64_t io_recompiles;
+} CPUJitStats;
+
 /**
  * CPUState:
  * @cpu_index: CPU index (informative).
@@ -188,6 +221,8 @@ struct kvm_run;
  * @numa_node: NUMA node this CPU is belonging to.
  * @host_tid: Host thread ID.
  * @running: #true if CPU is currently running (usermode).
+ * @has_waiter: #true if an exclusive operation waits for this CPU to stop
+ *   running (usermode).
  * @created: Indicates whether the CPU thread has been successfully created.
  * @interrupt_request: Indicates a pending interrupt request.
  * @halted: Nonzero if the CPU is in suspended state.
@@ -201,8 +236,12 @@ struct kvm_run;
  * This allows a single read-compare-cbranch-write sequence to test
  * for both decrementer underflow and exceptions.
  * @can_do_io: Nonzero if memory-mapped IO is safe.
+ * @icount_tb_unexecuted: During an IO access in the middle of a TB, the
+ * number of instructions of the TB after the one doing the access.
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
  * @current_tb: Currently executing TB.
+ * @tb_jmp_cache_misses: Lookups which missed the jump cache.
+ * @jit_stats: Counters of the TCG execution loop.
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
@@ -210,6 +249,10 @@ struct kvm_run;
  * @opaque: User data.
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
+ * @mmio_poll_mr: Memory region of the last MMIO read, for polling loop
+ *           detection.
+ * @mmio_poll_idle: Set while the CPU is halted waiting for a polled
+ *           register to change.
  * @kvm_fd: vCPU file descriptor for KVM.
  *
  * State of one CPU core or thread.
@@ -230,6 +273,7 @@ struct CPUState {
     int thread_id;
     uint32_t host_tid;
     bool running;
+    bool has_waiter;
     struct QemuCond *halt_cond;
     struct qemu_work_item *queued_work_first, *queued_work_last;
     bool thread_kicked;
@@ -240,6 +284,7 @@ struct CPUState {
     uint32_t interrupt_request;
     int singlestep_enabled;
     int64_t icount_extra;
+    int icount_tb_unexecuted;
     sigjmp_buf jmp_env;
 
     AddressSpace *as;
@@ -247,7 +292,10 @@ struct CPUState {
 
     void *env_ptr; /* CPUArchState */
     struct TranslationBlock *current_tb;
-    struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    struct TranslationBlock **tb_jmp_cache;
+    bool tb_jmp_cache_direct;
+    uint64_t tb_jmp_cache_misses;
+    CPUJitStats jit_stats;
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
     int gdb_num_g_regs;
@@ -267,6 +315,17 @@ struct CPUState {
     uintptr_t mem_io_pc;
     vaddr mem_io_vaddr;
 
+    /* Detection of loops spinning on an MMIO register, see
+     * MemoryRegionOps.poll_deadline */
+    MemoryRegion *mmio_poll_mr;
+    hwaddr mmio_poll_addr;
+    uintptr_t mmio_poll_pc;
+    uint64_t mmio_poll_value;
+    int64_t mmio_poll_time;
+    unsigned mmio_poll_count;
+    bool mmio_poll_idle;
+    QEMUTimer *mmio_poll_timer;
+
     int kvm_fd;
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
@@ -300,6 +359,14 @@ extern struct CPUTailQ cpus;
 DECLARE_TLS(CPUState *, current_cpu);
 #define current_cpu tls_var(current_cpu)
 
+/**
+ * cpu_mmio_poll_wake_all:
+ *
+ * Wakes up any CPU halted because it was spinning on an MMIO register.
+ * Called by devices when a polled register changes unpredictably.
+ */
+void cpu_mmio_poll_wake_all(void);
+
 /**
  * cpu_paging_enabled:
  * @cpu: The CPU whose state is to be inspected.
@@ -412,6 +479,33 @@ static inline hwaddr cpu_get_phys_page_debug(CPUState *cpu, vaddr addr)
 }
 #endif
 
+/**
+ * cpu_tb_jmp_cache_set_direct:
+ * @cpu: The CPU whose jump cache to replace.
+ *
+ * Switches @cpu to a larger jump cache indexed directly by the low bits
+ * of the PC, for targets without an MMU that run from a few hundred KB
+ * of flash.  Must be called from the realize function, before the CPU
+ * runs.
+ */
+void cpu_tb_jmp_cache_set_direct(CPUState *cpu);
+
+/**
+ * cpu_tb_jmp_cache_clear:
+ * @cpu: The CPU whose jump cache to empty.
+ */
+static inline void cpu_tb_jmp_cache_clear(CPUState *cpu)
+{
+    unsigned int i, n;
+
+    /* read without tb_lock by the vCPU thread, see tb_find_fast() */
+    n = cpu->tb_jmp_cache_direct ? TB_JMP_CACHE_DIRECT_SIZE :
+        TB_JMP_CACHE_SIZE;
+    for (i = 0; i < n; i++) {
+        atomic_set(&cpu->tb_jmp_cache[i], NULL);
+    }
+}
+
 /**
  * cpu_reset:
  * @cpu: The CPU whose state is to be reset.
@@ -638,6 +732,8 @@ int cpu_watchpoint_remove(CPUState *cpu, vaddr addr,
                           vaddr len, int flags);
 void cpu_watchpoint_remove_by_ref(CPUState *cpu, CPUWatchpoint *watchpoint);
 void cpu_watchpoint_remove_all(CPUState *cpu, int mask);
+bool cpu_watchpoint_address_matches(CPUState *cpu, vaddr addr, vaddr len,
+                                    int flags);
 
 void QEMU_NORETURN cpu_abort(CPUState *cpu, const char *fmt, ...)
     GCC_FMT_ATTR(2, 3);
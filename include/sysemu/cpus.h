@@ -6,6 +6,7 @@ void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
+void qemu_tcg_cpus_after_fork(void);
 
 void cpu_synchronize_all_states(void);
 void cpu_synchronize_all_post_reset(void);
@@ -13,6 +14,7 @@ void cpu_synchronize_all_post_init(void);
 void cpu_clean_all_dirty(void);
 
 void qtest_clock_warp(int64_t dest);
+void dump_icount_slice_info(FILE *f, fprintf_function cpu_fprintf);
 
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
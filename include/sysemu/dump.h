@@ -14,6 +14,9 @@
 #ifndef DUMP_H
 #define DUMP_H
 
+#include "qemu/thread.h"
+#include "qapi-types.h"
+
 #define MAKEDUMPFILE_SIGNATURE      "makedumpfile"
 #define MAX_SIZE_MDF_HEADER         (4096) /* max size of makedumpfile_header */
 #define TYPE_FLAT_HEADER            (1)    /* type of flattened format */
@@ -183,9 +186,20 @@ typedef struct DumpState {
     off_t offset_page;          /* offset of page part in vmcore */
     size_t num_dumpable;        /* number of page that can be dumped */
     uint32_t flag_compress;     /* indicate the compression format */
+
+    bool sparse;                /* zero pages may be left as holes */
+    bool detached;              /* runs in its own thread */
+    QemuThread thread;
+
+    /* Read by query-dump while the dump runs, so accessed atomically */
+    DumpStatus status;
+    int64_t total_size;         /* bytes of guest memory to dump */
+    int64_t written_size;       /* bytes of guest memory dumped so far */
 } DumpState;
 
 uint16_t cpu_to_dump16(DumpState *s, uint16_t val);
 uint32_t cpu_to_dump32(DumpState *s, uint32_t val);
 uint64_t cpu_to_dump64(DumpState *s, uint64_t val);
+
+bool dump_in_progress(void);
 #endif
@@ -429,7 +429,7 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
             d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
         }
         allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
+        /* no need to clear it, KVM_GET_DIRTY_LOG writes the whole bitmap */
 
         d.slot = mem->slot;
 
@@ -37,6 +37,8 @@
 char *exec_path;
 
 int singlestep;
+int tb_hot_count;
+const char *tb_coverage_file;
 const char *filename;
 const char *argv0;
 int gdbstub_port;
@@ -151,19 +153,26 @@ static inline void exclusive_idle(void)
 static inline void start_exclusive(void)
 {
     CPUState *other_cpu;
+    int running_cpus;
 
     pthread_mutex_lock(&exclusive_lock);
     exclusive_idle();
 
-    pending_cpus = 1;
     /* Make all other cpus stop executing.  */
+    atomic_set(&pending_cpus, 1);
+
+    /* Write pending_cpus before reading other_cpu->running.  */
+    smp_mb();
+    running_cpus = 0;
     CPU_FOREACH(other_cpu) {
-        if (other_cpu->running) {
-            pending_cpus++;
+        if (atomic_read(&other_cpu->running)) {
+            other_cpu->has_waiter = true;
+            running_cpus++;
             cpu_exit(other_cpu);
         }
     }
-    if (pending_cpus > 1) {
+    atomic_set(&pending_cpus, running_cpus + 1);
+    while (pending_cpus > 1) {
         pthread_cond_wait(&exclusive_cond, &exclusive_lock);
     }
 }
@@ -171,33 +180,53 @@ static inline void start_exclusive(void)
 /* Finish an exclusive operation.  */
 static inline void end_exclusive(void)
 {
-    pending_cpus = 0;
+    atomic_set(&pending_cpus, 0);
     pthread_cond_broadcast(&exclusive_resume);
     pthread_mutex_unlock(&exclusive_lock);
 }
 
-/* Wait for exclusive ops to finish, and begin cpu execution.  */
+/* Wait for exclusive ops to finish, and begin cpu execution.  Threads
+   only take exclusive_lock while an exclusive operation is pending: the
+   barrier pairs with the one in start_exclusive, so that either this cpu
+   sees pending_cpus or start_exclusive sees it running and waits.  */
 static inline void cpu_exec_start(CPUState *cpu)
 {
-    pthread_mutex_lock(&exclusive_lock);
-    exclusive_idle();
-    cpu->running = true;
-    pthread_mutex_unlock(&exclusive_lock);
+    atomic_set(&cpu->running, true);
+
+    /* Write cpu->running before reading pending_cpus.  */
+    smp_mb();
+    if (unlikely(atomic_read(&pending_cpus))) {
+        pthread_mutex_lock(&exclusive_lock);
+        if (!cpu->has_waiter) {
+            /* Not counted in pending_cpus, let the exclusive operation
+               run first.  */
+            atomic_set(&cpu->running, false);
+            exclusive_idle();
+            atomic_set(&cpu->running, true);
+        }
+        /* otherwise counted, cpu_exec_end releases the waiter */
+        pthread_mutex_unlock(&exclusive_lock);
+    }
 }
 
 /* Mark cpu as not executing, and release pending exclusive ops.  */
 static inline void cpu_exec_end(CPUState *cpu)
 {
-    pthread_mutex_lock(&exclusive_lock);
-    cpu->running = false;
-    if (pending_cpus > 1) {
-        pending_cpus--;
-        if (pending_cpus == 1) {
-            pthread_cond_signal(&exclusive_cond);
+    atomic_set(&cpu->running, false);
+
+    /* Write cpu->running before reading pending_cpus.  */
+    smp_mb();
+    if (unlikely(atomic_read(&pending_cpus))) {
+        pthread_mutex_lock(&exclusive_lock);
+        if (cpu->has_waiter) {
+            cpu->has_waiter = false;
+            atomic_set(&pending_cpus, pending_cpus - 1);
+            if (pending_cpus == 1) {
+                pthread_cond_signal(&exclusive_cond);
+            }
         }
+        pthread_mutex_unlock(&exclusive_lock);
     }
-    exclusive_idle();
-    pthread_mutex_unlock(&exclusive_lock);
 }
 
 void cpu_list_lock(void)
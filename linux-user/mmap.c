@@ -212,8 +212,6 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 {
     abi_ulong addr;
     abi_ulong end_addr;
-    int prot;
-    int looped = 0;
 
     if (size > RESERVED_VA) {
         return (abi_ulong)-1;
@@ -224,26 +222,16 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
     if (end_addr > RESERVED_VA) {
         end_addr = RESERVED_VA;
     }
-    addr = end_addr - qemu_host_page_size;
 
-    while (1) {
-        if (addr > end_addr) {
-            if (looped) {
-                return (abi_ulong)-1;
-            }
-            end_addr = RESERVED_VA;
-            addr = end_addr - qemu_host_page_size;
-            looped = 1;
-            continue;
-        }
-        prot = page_get_flags(addr);
-        if (prot) {
-            end_addr = addr;
-        }
-        if (addr + size == end_addr) {
-            break;
+    /* Take the highest free range below the hint, else the highest one
+       anywhere in the reserved area.  */
+    addr = page_find_range_empty(0, end_addr - 1, size, qemu_host_page_size);
+    if (addr == (abi_ulong)-1) {
+        addr = page_find_range_empty(0, RESERVED_VA - 1, size,
+                                     qemu_host_page_size);
+        if (addr == (abi_ulong)-1) {
+            return (abi_ulong)-1;
         }
-        addr -= qemu_host_page_size;
     }
 
     if (start == mmap_next_start) {
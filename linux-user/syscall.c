@@ -5337,6 +5337,98 @@ static int do_open(void *cpu_env, const char *pathname, int flags, mode_t mode)
     return get_errno(open(path(pathname), flags, mode));
 }
 
+/* Syscalls that only take and return integers, whose value means the same
+   to guest and host, are dispatched straight from this table instead of
+   going through the do_syscall() switch.  The table is indexed by target
+   syscall number, so it only has entries for what the target defines.  */
+typedef abi_long (*syscall_fast_fn)(abi_long arg1, abi_long arg2,
+                                    abi_long arg3);
+
+#define SYSCALL_FAST0(name, call)                                       \
+    static abi_long syscall_fast_##name(abi_long arg1, abi_long arg2,   \
+                                        abi_long arg3)                  \
+    {                                                                   \
+        return get_errno(call);                                         \
+    }
+
+SYSCALL_FAST0(close, close(arg1))
+SYSCALL_FAST0(dup, dup(arg1))
+SYSCALL_FAST0(dup2, dup2(arg1, arg2))
+SYSCALL_FAST0(lseek, lseek(arg1, arg2, arg3))
+SYSCALL_FAST0(fsync, fsync(arg1))
+SYSCALL_FAST0(ftruncate, ftruncate(arg1, arg2))
+SYSCALL_FAST0(fchmod, fchmod(arg1, arg2))
+SYSCALL_FAST0(fchdir, fchdir(arg1))
+SYSCALL_FAST0(umask, umask(arg1))
+SYSCALL_FAST0(getpgrp, getpgrp())
+SYSCALL_FAST0(getpgid, getpgid(arg1))
+SYSCALL_FAST0(setpgid, setpgid(arg1, arg2))
+SYSCALL_FAST0(getsid, getsid(arg1))
+SYSCALL_FAST0(setsid, setsid())
+SYSCALL_FAST0(gettid, gettid())
+SYSCALL_FAST0(sched_yield, sched_yield())
+#ifdef TARGET_NR_getpid
+SYSCALL_FAST0(getpid, getpid())
+#endif
+#ifdef TARGET_NR_getppid
+SYSCALL_FAST0(getppid, getppid())
+#endif
+#ifdef TARGET_NR_fdatasync
+SYSCALL_FAST0(fdatasync, fdatasync(arg1))
+#endif
+#ifdef TARGET_NR_getuid32
+SYSCALL_FAST0(getuid32, getuid())
+#endif
+#ifdef TARGET_NR_getgid32
+SYSCALL_FAST0(getgid32, getgid())
+#endif
+#ifdef TARGET_NR_geteuid32
+SYSCALL_FAST0(geteuid32, geteuid())
+#endif
+#ifdef TARGET_NR_getegid32
+SYSCALL_FAST0(getegid32, getegid())
+#endif
+
+static const syscall_fast_fn syscall_fast_table[] = {
+    [TARGET_NR_close] = syscall_fast_close,
+    [TARGET_NR_dup] = syscall_fast_dup,
+    [TARGET_NR_dup2] = syscall_fast_dup2,
+    [TARGET_NR_lseek] = syscall_fast_lseek,
+    [TARGET_NR_fsync] = syscall_fast_fsync,
+    [TARGET_NR_ftruncate] = syscall_fast_ftruncate,
+    [TARGET_NR_fchmod] = syscall_fast_fchmod,
+    [TARGET_NR_fchdir] = syscall_fast_fchdir,
+    [TARGET_NR_umask] = syscall_fast_umask,
+    [TARGET_NR_getpgrp] = syscall_fast_getpgrp,
+    [TARGET_NR_getpgid] = syscall_fast_getpgid,
+    [TARGET_NR_setpgid] = syscall_fast_setpgid,
+    [TARGET_NR_getsid] = syscall_fast_getsid,
+    [TARGET_NR_setsid] = syscall_fast_setsid,
+    [TARGET_NR_gettid] = syscall_fast_gettid,
+    [TARGET_NR_sched_yield] = syscall_fast_sched_yield,
+#ifdef TARGET_NR_getpid
+    [TARGET_NR_getpid] = syscall_fast_getpid,
+#endif
+#ifdef TARGET_NR_getppid
+    [TARGET_NR_getppid] = syscall_fast_getppid,
+#endif
+#ifdef TARGET_NR_fdatasync
+    [TARGET_NR_fdatasync] = syscall_fast_fdatasync,
+#endif
+#ifdef TARGET_NR_getuid32
+    [TARGET_NR_getuid32] = syscall_fast_getuid32,
+#endif
+#ifdef TARGET_NR_getgid32
+    [TARGET_NR_getgid32] = syscall_fast_getgid32,
+#endif
+#ifdef TARGET_NR_geteuid32
+    [TARGET_NR_geteuid32] = syscall_fast_geteuid32,
+#endif
+#ifdef TARGET_NR_getegid32
+    [TARGET_NR_getegid32] = syscall_fast_getegid32,
+#endif
+};
+
 /* do_syscall() should always have a single exit point at the end so
    that actions, such as logging of syscall results, can be performed.
    All errnos that do_syscall() returns must be -TARGET_<errcode>. */
@@ -5351,7 +5443,14 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
     struct statfs stfs;
     void *p;
 
-#ifdef DEBUG
+#ifndef DEBUG
+    /* strace needs the single exit point below */
+    if (likely(!do_strace) &&
+        (unsigned int)num < ARRAY_SIZE(syscall_fast_table) &&
+        syscall_fast_table[num]) {
+        return syscall_fast_table[num](arg1, arg2, arg3);
+    }
+#else
     gemu_log("syscall %d", num);
 #endif
     if(do_strace)
@@ -18,7 +18,9 @@
 #include "exec/ioport.h"
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
+#include "qmp-commands.h"
 #include "trace.h"
 #include <assert.h>
 
@@ -263,6 +265,24 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+/* Also compares the dirty logging, so that equal views need no listener
+ * call at all. */
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_init(FlatView *view)
 {
     view->ref = 1;
@@ -759,10 +779,48 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
+/* Render the new view of each address space, and keep it only if it
+ * differs from the current one. */
+static void address_space_render_topology(AddressSpace *as)
+{
+    FlatView *old_view = address_space_get_flatview(as);
+
+    as->next_map = generate_memory_topology(as->root);
+    as->topology_changed = !flatview_equal(old_view, as->next_map);
+    if (!as->topology_changed) {
+        flatview_unref(as->next_map);
+        as->next_map = NULL;
+    }
+    flatview_unref(old_view);
+}
+
+/* Listeners which follow a single address space (the dispatch tables and
+ * the TCG TLBs) are left out of the transactions which did not change it,
+ * so that e.g. an AFIO remap on one microcontroller does not rebuild the
+ * dispatch of all the others and flush their TLBs. */
+static void memory_listener_begin_commit(bool begin)
+{
+    MemoryListener *listener;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->address_space_filter
+            && !listener->address_space_filter->topology_changed) {
+            continue;
+        }
+        if (begin && listener->begin) {
+            listener->begin(listener);
+        } else if (!begin && listener->commit) {
+            listener->commit(listener);
+        }
+    }
+}
+
 static void address_space_update_topology(AddressSpace *as)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = as->next_map;
+
+    as->next_map = NULL;
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
@@ -803,13 +861,25 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                address_space_render_topology(as);
+            }
+
+            memory_listener_begin_commit(true);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                if (as->topology_changed) {
+                    address_space_update_topology(as);
+                } else if (ioeventfd_update_pending) {
+                    address_space_update_ioeventfds(as);
+                }
             }
 
-            MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            memory_listener_begin_commit(false);
+
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                as->topology_changed = false;
+            }
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1112,13 +1182,35 @@ static bool memory_region_dispatch_read(MemoryRegion *mr,
                                         uint64_t *pval,
                                         unsigned size)
 {
+    int64_t start;
+
     if (!memory_region_access_valid(mr, addr, size, false)) {
         *pval = unassigned_mem_read(mr, addr, size);
         return true;
     }
 
-    *pval = memory_region_dispatch_read1(mr, addr, size);
-    adjust_endianness(mr, pval, size);
+    start = get_clock();
+    if (size == 4 && !(addr & 3) && addr < 64 * 4 &&
+        (mr->ops->idempotent_reads & MEMORY_REGION_IDEMPOTENT(addr))) {
+        uint64_t bit = MEMORY_REGION_IDEMPOTENT(addr);
+
+        if (mr->read_cache_valid & bit) {
+            *pval = mr->read_cache[addr >> 2];
+        } else {
+            *pval = memory_region_dispatch_read1(mr, addr, size);
+            adjust_endianness(mr, pval, size);
+            if (!mr->read_cache) {
+                mr->read_cache = g_new(uint32_t, 64);
+            }
+            mr->read_cache[addr >> 2] = *pval;
+            mr->read_cache_valid |= bit;
+        }
+    } else {
+        *pval = memory_region_dispatch_read1(mr, addr, size);
+        adjust_endianness(mr, pval, size);
+    }
+    mr->mmio_reads++;
+    mr->mmio_read_ns += get_clock() - start;
     return false;
 }
 
@@ -1127,11 +1219,15 @@ static bool memory_region_dispatch_write(MemoryRegion *mr,
                                          uint64_t data,
                                          unsigned size)
 {
+    int64_t start;
+
     if (!memory_region_access_valid(mr, addr, size, true)) {
         unassigned_mem_write(mr, addr, data, size);
         return true;
     }
 
+    start = get_clock();
+    mr->read_cache_valid = 0;
     adjust_endianness(mr, &data, size);
 
     if (mr->ops->write) {
@@ -1143,6 +1239,8 @@ static bool memory_region_dispatch_write(MemoryRegion *mr,
         access_with_adjusted_size(addr, &data, size, 1, 4,
                                   memory_region_oldmmio_write_accessor, mr);
     }
+    mr->mmio_writes++;
+    mr->mmio_write_ns += get_clock() - start;
     return false;
 }
 
@@ -1262,6 +1360,7 @@ static void memory_region_finalize(Object *obj)
     memory_region_clear_coalescing(mr);
     g_free((char *)mr->name);
     g_free(mr->ioeventfds);
+    g_free(mr->read_cache);
 }
 
 void memory_region_destroy(MemoryRegion *mr)
@@ -1392,6 +1491,24 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
     return ret;
 }
 
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_snapshot_and_clear_dirty(mr->ram_addr + addr,
+                                                        size, client);
+}
+
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_snapshot_get_dirty(snap, mr->ram_addr + addr,
+                                                  size);
+}
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
@@ -1409,6 +1526,12 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_set_rom_exec(MemoryRegion *mr, bool rom_exec)
+{
+    assert(!rom_exec || (mr->ram && mr->readonly) || mr->rom_device);
+    mr->rom_exec = rom_exec;
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -1555,6 +1678,21 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_flush_read_cache(MemoryRegion *mr)
+{
+    mr->read_cache_valid = 0;
+}
+
+/* The write is counted for info mmio-stats, but not timed, as timing it
+ * would cost more than the write itself. */
+void memory_region_fast_write(MemoryRegion *mr, MemoryRegionFastWrite *fn,
+                              uint32_t data)
+{
+    mr->read_cache_valid = 0;
+    mr->mmio_writes++;
+    fn(mr->opaque, data);
+}
+
 void memory_region_add_eventfd(MemoryRegion *mr,
                                hwaddr addr,
                                unsigned size,
@@ -1936,6 +2074,8 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->root = root;
     as->current_map = g_new(FlatView, 1);
     flatview_init(as->current_map);
+    as->next_map = NULL;
+    as->topology_changed = false;
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
@@ -2111,6 +2251,76 @@ void mtree_info(fprintf_function mon_printf, void *f)
     }
 }
 
+static void mmio_stats_collect(MemoryRegion *mr, GHashTable *seen,
+                               GPtrArray *regions)
+{
+    MemoryRegion *submr;
+
+    if (g_hash_table_lookup(seen, mr)) {
+        return;
+    }
+    g_hash_table_insert(seen, mr, mr);
+
+    if (mr->mmio_reads || mr->mmio_writes) {
+        g_ptr_array_add(regions, mr);
+    }
+    if (mr->alias) {
+        mmio_stats_collect(mr->alias, seen, regions);
+    }
+    QTAILQ_FOREACH(submr, &mr->subregions, subregions_link) {
+        mmio_stats_collect(submr, seen, regions);
+    }
+}
+
+static gint mmio_stats_compare(gconstpointer a, gconstpointer b)
+{
+    const MemoryRegion *mra = *(MemoryRegion * const *)a;
+    const MemoryRegion *mrb = *(MemoryRegion * const *)b;
+    uint64_t ta = mra->mmio_read_ns + mra->mmio_write_ns;
+    uint64_t tb = mrb->mmio_read_ns + mrb->mmio_write_ns;
+
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+MmioStatsInfoList *qmp_query_mmio_stats(Error **errp)
+{
+    MmioStatsInfoList *head = NULL, *entry;
+    GHashTable *seen = g_hash_table_new(NULL, NULL);
+    GPtrArray *regions = g_ptr_array_new();
+    AddressSpace *as;
+    int i;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        mmio_stats_collect(as->root, seen, regions);
+    }
+    g_ptr_array_sort(regions, mmio_stats_compare);
+
+    /* Build the list backwards so that it ends up in sorted order.  */
+    for (i = regions->len - 1; i >= 0; i--) {
+        MemoryRegion *mr = g_ptr_array_index(regions, i);
+        MmioStatsInfo *info = g_new0(MmioStatsInfo, 1);
+
+        info->name = g_strdup(mr->name ? mr->name : "");
+        if (memory_region_owner(mr)) {
+            info->has_path = true;
+            info->path = object_get_canonical_path(OBJECT(mr));
+        }
+        info->reads = mr->mmio_reads;
+        info->writes = mr->mmio_writes;
+        info->read_ns = mr->mmio_read_ns;
+        info->write_ns = mr->mmio_write_ns;
+
+        entry = g_new0(MmioStatsInfoList, 1);
+        entry->value = info;
+        entry->next = head;
+        head = entry;
+    }
+
+    g_ptr_array_free(regions, true);
+    g_hash_table_destroy(seen);
+    return head;
+}
+
 static const TypeInfo memory_region_info = {
     .parent             = TYPE_OBJECT,
     .name               = TYPE_MEMORY_REGION,
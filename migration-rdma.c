@@ -1919,9 +1919,8 @@ retry:
              * memset() + madvise() the entire chunk without RDMA.
              */
 
-            if (can_use_buffer_find_nonzero_offset((void *)sge.addr, length)
-                   && buffer_find_nonzero_offset((void *)sge.addr,
-                                                    length) == length) {
+            if (buffer_find_nonzero_offset((void *)sge.addr,
+                                           length) == length) {
                 RDMACompress comp = {
                                         .offset = current_addr,
                                         .value = 0,
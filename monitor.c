@@ -44,6 +44,7 @@
 #include "audio/audio.h"
 #include "disas/disas.h"
 #include "sysemu/balloon.h"
+#include "sysemu/cpus.h"
 #include "qemu/timer.h"
 #include "migration/migration.h"
 #include "sysemu/kvm.h"
@@ -189,6 +190,24 @@ typedef struct MonitorQAPIEventState {
     QObject *data;      /* Event pending delayed dispatch */
 } MonitorQAPIEventState;
 
+/*
+ * On top of that, each Monitor can filter the events it receives with
+ * the event-filter command, until its client disconnects.  An event can
+ * be dropped altogether, or limited to one batch every @rate ns.  The
+ * events in between are coalesced: a batch only has the latest event for
+ * each value of the @key member of their data, so that a state change
+ * event (e.g. LED_CHANGE) reports the last state of every object.
+ */
+typedef struct MonitorEventFilter {
+    struct Monitor *mon;
+    bool disabled;
+    int64_t rate;       /* Minimum time (in ns) between two batches */
+    int64_t last;       /* QEMU_CLOCK_REALTIME value at last emission */
+    char *key;          /* Member of "data" told apart when coalescing */
+    QEMUTimer *timer;   /* Timer for emitting the pending batch */
+    QDict *pending;     /* Latest event for each value of @key */
+} MonitorEventFilter;
+
 struct Monitor {
     CharDriverState *chr;
     int reset_seen;
@@ -205,6 +224,7 @@ struct Monitor {
 
     ReadLineState *rs;
     MonitorControl *mc;
+    MonitorEventFilter *evfilter; /* QAPI_EVENT_MAX entries, or NULL */
     CPUState *mon_cpu;
     BlockDriverCompletionFunc *password_completion_cb;
     void *password_opaque;
@@ -466,6 +486,131 @@ static void monitor_protocol_emitter(Monitor *mon, QObject *data)
 
 static MonitorQAPIEventState monitor_qapi_event_state[QAPI_EVENT_MAX];
 
+/*
+ * Returns the value of the coalescing key of an event as a string,
+ * or "" if the filter has no key or the event does not have it.
+ */
+static const char *monitor_event_filter_key(MonitorEventFilter *f,
+                                            QObject *data, char *buf,
+                                            size_t size)
+{
+    QDict *d;
+    QObject *val;
+
+    if (!f->key) {
+        return "";
+    }
+    val = qdict_get(qobject_to_qdict(data), "data");
+    d = val ? qobject_to_qdict(val) : NULL;
+    val = d ? qdict_get(d, f->key) : NULL;
+    if (!val) {
+        return "";
+    }
+    switch (qobject_type(val)) {
+    case QTYPE_QSTRING:
+        return qstring_get_str(qobject_to_qstring(val));
+    case QTYPE_QINT:
+        snprintf(buf, size, "%" PRId64, qint_get_int(qobject_to_qint(val)));
+        return buf;
+    case QTYPE_QBOOL:
+        return qbool_get_int(qobject_to_qbool(val)) ? "true" : "false";
+    default:
+        return "";
+    }
+}
+
+/*
+ * Emits the pending batch of a filter.
+ * Called with monitor_lock held.
+ */
+static void monitor_event_filter_flush(MonitorEventFilter *f)
+{
+    const QDictEntry *ent;
+
+    if (!f->pending || !qdict_size(f->pending)) {
+        return;
+    }
+    for (ent = qdict_first(f->pending); ent;
+         ent = qdict_next(f->pending, ent)) {
+        monitor_json_emitter(f->mon, qdict_entry_value(ent));
+    }
+    QDECREF(f->pending);
+    f->pending = qdict_new();
+}
+
+static void monitor_event_filter_handler(void *opaque)
+{
+    MonitorEventFilter *f = opaque;
+
+    qemu_mutex_lock(&monitor_lock);
+    monitor_event_filter_flush(f);
+    f->last = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock(&monitor_lock);
+}
+
+/*
+ * Emits the event to one monitor, through its filter.
+ * Called with monitor_lock held.
+ */
+static void monitor_event_filter_emit(Monitor *mon, QAPIEvent event,
+                                      QObject *data)
+{
+    MonitorEventFilter *f;
+    int64_t now;
+    char buf[32];
+
+    if (!mon->evfilter) {
+        monitor_json_emitter(mon, data);
+        return;
+    }
+    f = &mon->evfilter[event];
+    if (f->disabled) {
+        return;
+    }
+    if (!f->rate) {
+        monitor_json_emitter(mon, data);
+        return;
+    }
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (qdict_size(f->pending) || now - f->last < f->rate) {
+        if (!qdict_size(f->pending)) {
+            timer_mod_ns(f->timer, f->last + f->rate);
+        }
+        qobject_incref(data);
+        qdict_put_obj(f->pending,
+                      monitor_event_filter_key(f, data, buf, sizeof(buf)),
+                      data);
+    } else {
+        monitor_json_emitter(mon, data);
+        f->last = now;
+    }
+}
+
+/*
+ * Drops the filters of a monitor, when its client goes away.
+ * Called with monitor_lock held.
+ */
+static void monitor_event_filter_reset(Monitor *mon)
+{
+    MonitorEventFilter *f;
+    int i;
+
+    if (!mon->evfilter) {
+        return;
+    }
+    for (i = 0; i < QAPI_EVENT_MAX; i++) {
+        f = &mon->evfilter[i];
+        if (f->timer) {
+            timer_del(f->timer);
+            timer_free(f->timer);
+        }
+        QDECREF(f->pending);
+        g_free(f->key);
+    }
+    g_free(mon->evfilter);
+    mon->evfilter = NULL;
+}
+
 /*
  * Emits the event to every monitor instance, @event is only used for trace
  * Called with monitor_lock held.
@@ -477,7 +622,7 @@ static void monitor_qapi_event_emit(QAPIEvent event, QObject *data)
     trace_monitor_protocol_event_emit(event, data);
     QLIST_FOREACH(mon, &mon_list, entry) {
         if (monitor_ctrl_mode(mon) && qmp_cmd_mode(mon)) {
-            monitor_json_emitter(mon, data);
+            monitor_event_filter_emit(mon, event, data);
         }
     }
 }
@@ -988,6 +1133,66 @@ CommandInfoList *qmp_query_commands(Error **errp)
     return cmd_list;
 }
 
+void qmp_event_filter(const char *event, bool has_enable, bool enable,
+                      bool has_rate, int64_t rate, bool has_key,
+                      const char *key, Error **errp)
+{
+    MonitorEventFilter *f;
+    QAPIEvent e;
+
+    for (e = 0; e < QAPI_EVENT_MAX; e++) {
+        if (!strcmp(QAPIEvent_lookup[e], event)) {
+            break;
+        }
+    }
+    if (e == QAPI_EVENT_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "event",
+                  "the name of an event");
+        return;
+    }
+    if (has_rate && (rate < 0 || rate > INT64_MAX / SCALE_MS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "rate",
+                  "a non-negative number of milliseconds");
+        return;
+    }
+
+    qemu_mutex_lock(&monitor_lock);
+    if (!cur_mon->evfilter) {
+        cur_mon->evfilter = g_new0(MonitorEventFilter, QAPI_EVENT_MAX);
+        for (e = 0; e < QAPI_EVENT_MAX; e++) {
+            cur_mon->evfilter[e].mon = cur_mon;
+        }
+    }
+    f = &cur_mon->evfilter[e];
+    if (has_enable) {
+        f->disabled = !enable;
+    }
+    if (has_key) {
+        /* the pending events were coalesced with the old key */
+        monitor_event_filter_flush(f);
+        g_free(f->key);
+        f->key = *key ? g_strdup(key) : NULL;
+    }
+    if (has_rate) {
+        f->rate = rate * SCALE_MS;
+        if (!f->timer) {
+            f->timer = timer_new(QEMU_CLOCK_REALTIME, SCALE_MS,
+                                 monitor_event_filter_handler, f);
+            f->pending = qdict_new();
+        }
+        if (!f->rate) {
+            timer_del(f->timer);
+            monitor_event_filter_flush(f);
+        }
+    }
+    if (f->disabled && f->pending) {
+        timer_del(f->timer);
+        QDECREF(f->pending);
+        f->pending = qdict_new();
+    }
+    qemu_mutex_unlock(&monitor_lock);
+}
+
 EventInfoList *qmp_query_events(Error **errp)
 {
     EventInfoList *info, *ev_list = NULL;
@@ -1047,6 +1252,7 @@ static void do_info_registers(Monitor *mon, const QDict *qdict)
 static void do_info_jit(Monitor *mon, const QDict *qdict)
 {
     dump_exec_info((FILE *)mon, monitor_fprintf);
+    dump_icount_slice_info((FILE *)mon, monitor_fprintf);
 }
 
 static void do_info_history(Monitor *mon, const QDict *qdict)
@@ -2854,6 +3060,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show migration status",
         .mhandler.cmd = hmp_info_migrate,
     },
+    {
+        .name       = "dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the progress of the last guest memory dump",
+        .mhandler.cmd = hmp_info_dump,
+    },
     {
         .name       = "migrate_capabilities",
         .args_type  = "",
@@ -2917,6 +3130,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show memory backends",
         .mhandler.cmd = hmp_info_memdev,
     },
+    {
+        .name       = "mmio-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show MMIO access statistics per memory region",
+        .mhandler.cmd = hmp_info_mmio_stats,
+    },
     {
         .name       = NULL,
     },
@@ -5041,7 +5261,7 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
     qobject_decref(data);
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+static void handle_qmp_command(JSONMessageParser *parser, JSONToken *tokens)
 {
     int err;
     QObject *obj;
@@ -5200,6 +5420,9 @@ static void monitor_control_event(void *opaque, int event)
     case CHR_EVENT_CLOSED:
         json_message_parser_destroy(&mon->mc->parser);
         json_message_parser_init(&mon->mc->parser, handle_qmp_command);
+        qemu_mutex_lock(&monitor_lock);
+        monitor_event_filter_reset(mon);
+        qemu_mutex_unlock(&monitor_lock);
         mon_refcount--;
         monitor_fdsets_cleanup();
         break;
@@ -5449,3 +5672,22 @@ void qmp_rtc_reset_reinjection(Error **errp)
     error_set(errp, QERR_FEATURE_DISABLED, "rtc-reset-reinjection");
 }
 #endif
+
+#ifndef TARGET_ARM
+Stm32ClockInfoList *qmp_query_stm32_clocks(Error **errp)
+{
+    error_set(errp, QERR_FEATURE_DISABLED, "query-stm32-clocks");
+    return NULL;
+}
+
+void qmp_irq_latency_enable(bool enable, Error **errp)
+{
+    error_set(errp, QERR_FEATURE_DISABLED, "irq-latency-enable");
+}
+
+IrqLatencyInfoList *qmp_query_irq_latency(Error **errp)
+{
+    error_set(errp, QERR_FEATURE_DISABLED, "query-irq-latency");
+    return NULL;
+}
+#endif
@@ -39,6 +39,7 @@
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
 #include "qemu/main-loop.h"
+#include "qemu/main-loop.h"
 
 //#define DEBUG_NBD
 
@@ -64,8 +65,10 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_CHUNK_SIZE          (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
 #define NBD_REP_MAGIC           0x3e889045565a9LL
@@ -85,6 +88,15 @@
 #define NBD_OPT_EXPORT_NAME     (1)
 #define NBD_OPT_ABORT           (2)
 #define NBD_OPT_LIST            (3)
+#define NBD_OPT_STRUCTURED_REPLY (8)
+
+/* Structured reply chunks */
+#define NBD_REPLY_FLAG_DONE         (1 << 0)
+
+#define NBD_REPLY_TYPE_NONE         (0)
+#define NBD_REPLY_TYPE_OFFSET_DATA  (1)
+#define NBD_REPLY_TYPE_OFFSET_HOLE  (2)
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) | 1)
 
 /* Definitions for opaque data types */
 
@@ -116,8 +128,10 @@ struct NBDClient {
     void (*close)(NBDClient *client);
 
     NBDExport *exp;
+    AioContext *ctx;
     int sock;
 
+    bool can_read;
     Coroutine *recv_coroutine;
 
     CoMutex send_lock;
@@ -126,6 +140,7 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+    bool structured_reply;
 };
 
 /* That's all folks */
@@ -398,6 +413,19 @@ static int nbd_receive_options(NBDClient *client)
         case NBD_OPT_ABORT:
             return -EINVAL;
 
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length) {
+                nbd_send_rep(client->sock, NBD_REP_ERR_INVALID,
+                             NBD_OPT_STRUCTURED_REPLY);
+                return -EINVAL;
+            }
+            if (nbd_send_rep(client->sock, NBD_REP_ACK,
+                             NBD_OPT_STRUCTURED_REPLY) < 0) {
+                return -EINVAL;
+            }
+            client->structured_reply = true;
+            break;
+
         case NBD_OPT_EXPORT_NAME:
             return nbd_handle_export_name(client, length);
 
@@ -849,6 +877,30 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
 
 #define MAX_NBD_REQUESTS 16
 
+static void nbd_read(void *opaque);
+static void nbd_restart_write(void *opaque);
+
+/* The handlers of a client run in the AioContext of the device it reads,
+ * so that clients of devices in other threads are served in those threads */
+static void nbd_set_handlers(NBDClient *client)
+{
+    aio_set_fd_handler(client->ctx, client->sock,
+                       client->can_read ? nbd_read : NULL,
+                       client->send_coroutine ? nbd_restart_write : NULL,
+                       client);
+}
+
+static void nbd_update_can_read(NBDClient *client)
+{
+    bool can_read = client->recv_coroutine ||
+                    client->nb_requests < MAX_NBD_REQUESTS;
+
+    if (can_read != client->can_read) {
+        client->can_read = can_read;
+        nbd_set_handlers(client);
+    }
+}
+
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -862,7 +914,7 @@ void nbd_client_put(NBDClient *client)
          */
         assert(client->closing);
 
-        qemu_set_fd_handler2(client->sock, NULL, NULL, NULL, NULL);
+        aio_set_fd_handler(client->ctx, client->sock, NULL, NULL, NULL);
         close(client->sock);
         client->sock = -1;
         if (client->exp) {
@@ -898,6 +950,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 
     assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
     client->nb_requests++;
+    nbd_update_can_read(client);
 
     req = g_slice_new0(NBDRequest);
     nbd_client_get(client);
@@ -914,9 +967,8 @@ static void nbd_request_put(NBDRequest *req)
     }
     g_slice_free(NBDRequest, req);
 
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
-        qemu_notify_event();
-    }
+    client->nb_requests--;
+    nbd_update_can_read(client);
     nbd_client_put(client);
 }
 
@@ -1023,10 +1075,6 @@ void nbd_export_close_all(void)
     }
 }
 
-static int nbd_can_read(void *opaque);
-static void nbd_read(void *opaque);
-static void nbd_restart_write(void *opaque);
-
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
@@ -1035,9 +1083,8 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     ssize_t rc, ret;
 
     qemu_co_mutex_lock(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
-                         nbd_restart_write, client);
     client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
 
     if (!len) {
         rc = nbd_send_reply(csock, reply);
@@ -1054,11 +1101,129 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     }
 
     client->send_coroutine = NULL;
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+/*
+ * Sends one chunk of a structured reply, made of a fixed size payload
+ * header and optional data.
+ */
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *payload, size_t payload_len,
+                                 void *data, size_t data_len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t buf[NBD_CHUNK_SIZE];
+    struct iovec iov[3];
+    size_t len = sizeof(buf) + payload_len + data_len;
+    int niov = 0;
+    ssize_t rc = 0;
+
+    /* Chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    cpu_to_be32w((uint32_t*)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t*)(buf + 4), flags);
+    cpu_to_be16w((uint16_t*)(buf + 6), type);
+    cpu_to_be64w((uint64_t*)(buf + 8), handle);
+    cpu_to_be32w((uint32_t*)(buf + 16), payload_len + data_len);
+
+    iov[niov++] = (struct iovec) { .iov_base = buf, .iov_len = sizeof(buf) };
+    if (payload_len) {
+        iov[niov++] = (struct iovec) {
+            .iov_base = payload, .iov_len = payload_len
+        };
+    }
+    if (data_len) {
+        iov[niov++] = (struct iovec) { .iov_base = data, .iov_len = data_len };
+    }
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    if (qemu_co_sendv(csock, iov, niov, 0, len) != len) {
+        rc = -EIO;
+    }
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
     qemu_co_mutex_unlock(&client->send_lock);
     return rc;
 }
 
+/*
+ * Answers a read with a structured reply.  Ranges that read as zeroes are
+ * described by hole chunks instead of being transferred.  Errors from the
+ * device are reported to the client in an error chunk; the return value is
+ * negative only if the socket failed.
+ */
+static ssize_t nbd_co_read_structured(NBDRequest *req,
+                                      struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    uint64_t offset = request->from;
+    uint8_t payload[8 + 4];
+    int64_t ret;
+    int n;
+
+    if (nb_sectors == 0) {
+        return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+    }
+
+    while (nb_sectors > 0) {
+        uint16_t flags;
+
+        ret = bdrv_get_block_status(exp->bs, sector_num, nb_sectors, &n);
+        if (ret < 0) {
+            goto error;
+        }
+        flags = (n == nb_sectors) ? NBD_REPLY_FLAG_DONE : 0;
+
+        cpu_to_be64w((uint64_t*)payload, offset);
+        if (ret & BDRV_BLOCK_ZERO) {
+            cpu_to_be32w((uint32_t*)(payload + 8), n * 512);
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE,
+                                    payload, 12, NULL, 0);
+        } else {
+            ret = bdrv_read(exp->bs, sector_num, req->data, n);
+            if (ret < 0) {
+                goto error;
+            }
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA,
+                                    payload, 8, req->data, n * 512);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        offset += n * 512;
+    }
+    return 0;
+
+error:
+    LOG("reading from file failed");
+    cpu_to_be32w((uint32_t*)payload, -ret);
+    cpu_to_be16w((uint16_t*)(payload + 4), 0);
+    return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, payload, 6, NULL, 0);
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1067,6 +1232,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     ssize_t rc;
 
     client->recv_coroutine = qemu_coroutine_self();
+    nbd_update_can_read(client);
     rc = nbd_receive_request(csock, request);
     if (rc < 0) {
         if (rc != -EAGAIN) {
@@ -1108,6 +1274,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
 out:
     client->recv_coroutine = NULL;
+    nbd_update_can_read(client);
     return rc;
 }
 
@@ -1165,6 +1332,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_read_structured(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
                         req->data, request.len / 512);
         if (ret < 0) {
@@ -1259,13 +1433,6 @@ out:
     nbd_client_close(client);
 }
 
-static int nbd_can_read(void *opaque)
-{
-    NBDClient *client = opaque;
-
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
-}
-
 static void nbd_read(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1297,8 +1464,11 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
         return NULL;
     }
     client->close = close;
+    client->ctx = client->exp ? bdrv_get_aio_context(client->exp->bs) :
+                                qemu_get_aio_context();
     qemu_co_mutex_init(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    client->can_read = true;
+    nbd_set_handlers(client);
 
     if (exp) {
         QTAILQ_INSERT_TAIL(&exp->clients, client, next);
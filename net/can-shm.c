@@ -0,0 +1,267 @@
+/*
+ * Bridge between an in-process CAN bus and a shared memory ring
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/* -object can-host-shm,id=can0sim,path=/dev/shm/can0,canbus=canbus0
+ *
+ * An external process (e.g. a bus simulator with many virtual nodes)
+ * exchanges frames with the guest bus through a file that both map, so
+ * that no frame goes through a socket or a chardev.  The file has a
+ * CanShmHeader, then two CanShmRings: the first carries the frames put
+ * on the bus by the guest, the second the frames that the external
+ * process puts on the bus.  All fields are little endian, and frames are
+ * laid out as QemuCanFrame (that is, as struct can_frame).
+ *
+ * Each ring has a single producer, which only writes head, and a single
+ * consumer, which only writes tail.  Both count frames and wrap around
+ * freely; the frame at position n is frames[n % CAN_SHM_RING_SIZE].  The
+ * producer stores a frame before it advances head, and drops it if the
+ * ring is full, as there is no flow control on CAN.  QEMU looks at the
+ * second ring every CAN_SHM_POLL_NS, and puts everything it finds on the
+ * bus as a single batch.
+ */
+#include <sys/mman.h>
+
+#include "net/can.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/timer.h"
+#include "qom/object_interfaces.h"
+
+#define TYPE_CAN_HOST_SHM "can-host-shm"
+#define CAN_HOST_SHM(obj) \
+    OBJECT_CHECK(CanHostShm, (obj), TYPE_CAN_HOST_SHM)
+
+#define CAN_SHM_MAGIC 0x534e4143 /* "CANS" */
+#define CAN_SHM_VERSION 1
+#define CAN_SHM_RING_SIZE 256
+#define CAN_SHM_POLL_NS (1000 * SCALE_US)
+
+typedef struct CanShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    uint8_t reserved[52];
+} CanShmHeader;
+
+/* head and tail sit in separate cache lines, as they are written from
+ * different processes. */
+typedef struct CanShmRing {
+    uint32_t head;
+    uint8_t pad0[60];
+    uint32_t tail;
+    uint8_t pad1[60];
+    QemuCanFrame frames[CAN_SHM_RING_SIZE];
+} CanShmRing;
+
+enum {
+    CAN_SHM_RING_TO_HOST,
+    CAN_SHM_RING_FROM_HOST,
+};
+
+typedef struct CanHostShm {
+    /*< private >*/
+    Object parent_obj;
+
+    /*< public >*/
+    char *path;
+    CanBusState *bus;
+    CanBusClientState client;
+    CanShmHeader *hdr;
+    CanShmRing *rings;
+    QEMUTimer *poll_timer;
+    QemuCanFrame buf[CAN_SHM_RING_SIZE];
+} CanHostShm;
+
+static void can_host_shm_poll(void *opaque)
+{
+    CanHostShm *s = opaque;
+    CanShmRing *ring = &s->rings[CAN_SHM_RING_FROM_HOST];
+    uint32_t head, tail;
+    size_t count = 0;
+
+    head = le32_to_cpu(atomic_read(&ring->head));
+    tail = le32_to_cpu(ring->tail);
+    smp_rmb();
+
+    /* A corrupt index from the other side must not make us overrun buf */
+    if (head - tail > CAN_SHM_RING_SIZE) {
+        tail = head - CAN_SHM_RING_SIZE;
+    }
+    while (tail != head) {
+        QemuCanFrame *frame = &ring->frames[tail % CAN_SHM_RING_SIZE];
+
+        s->buf[count] = *frame;
+        s->buf[count].can_id = le32_to_cpu(frame->can_id);
+        if (!(s->buf[count].can_id & QEMU_CAN_ERR_FLAG)) {
+            count++;
+        }
+        tail++;
+    }
+
+    /* The frames must be copied out before the producer may reuse them */
+    smp_mb();
+    atomic_set(&ring->tail, cpu_to_le32(tail));
+
+    can_bus_client_send(&s->client, s->buf, count);
+
+    timer_mod(s->poll_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + CAN_SHM_POLL_NS);
+}
+
+static void can_host_shm_receive(CanBusClientState *client,
+                                 const QemuCanFrame *frames, size_t count)
+{
+    CanHostShm *s = container_of(client, CanHostShm, client);
+    CanShmRing *ring = &s->rings[CAN_SHM_RING_TO_HOST];
+    uint32_t head, tail;
+    size_t i;
+
+    head = le32_to_cpu(ring->head);
+    tail = le32_to_cpu(atomic_read(&ring->tail));
+    smp_mb();
+
+    for (i = 0; i < count; i++) {
+        QemuCanFrame *frame = &ring->frames[head % CAN_SHM_RING_SIZE];
+
+        if (head - tail >= CAN_SHM_RING_SIZE) {
+            /* The simulator is not keeping up; the frames are lost as
+             * they would be on a bus without a receiver. */
+            break;
+        }
+        *frame = frames[i];
+        frame->can_id = cpu_to_le32(frames[i].can_id);
+        head++;
+    }
+
+    smp_wmb();
+    atomic_set(&ring->head, cpu_to_le32(head));
+}
+
+static const CanBusClientInfo can_host_shm_client_info = {
+    .receive = can_host_shm_receive,
+};
+
+static void can_host_shm_complete(UserCreatable *uc, Error **errp)
+{
+    CanHostShm *s = CAN_HOST_SHM(uc);
+    size_t size = sizeof(CanShmHeader) + 2 * sizeof(CanShmRing);
+    struct stat st;
+    void *mem;
+    int fd;
+
+    QEMU_BUILD_BUG_ON(sizeof(CanShmHeader) != 64);
+    QEMU_BUILD_BUG_ON(offsetof(CanShmRing, frames) != 128);
+
+    if (!s->path) {
+        error_setg(errp, "'path' property is required");
+        return;
+    }
+    if (!s->bus) {
+        error_setg(errp, "'canbus' property is required");
+        return;
+    }
+
+    /* Existing contents are kept, so the simulator may create it first */
+    fd = qemu_open(s->path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot open '%s'", s->path);
+        return;
+    }
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size < size && ftruncate(fd, size) < 0)) {
+        error_setg_errno(errp, errno, "cannot resize '%s'", s->path);
+        qemu_close(fd);
+        return;
+    }
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if (mem == MAP_FAILED) {
+        error_setg_errno(errp, errno, "cannot map '%s'", s->path);
+        return;
+    }
+
+    s->hdr = mem;
+    s->rings = (CanShmRing *)(s->hdr + 1);
+    s->hdr->version = cpu_to_le32(CAN_SHM_VERSION);
+    s->hdr->ring_size = cpu_to_le32(CAN_SHM_RING_SIZE);
+    smp_wmb();
+    s->hdr->magic = cpu_to_le32(CAN_SHM_MAGIC);
+
+    s->client.info = &can_host_shm_client_info;
+    can_bus_insert_client(s->bus, &s->client);
+    s->poll_timer = timer_new_ns(QEMU_CLOCK_REALTIME, can_host_shm_poll, s);
+    timer_mod(s->poll_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + CAN_SHM_POLL_NS);
+}
+
+static char *can_host_shm_get_path(Object *obj, Error **errp)
+{
+    CanHostShm *s = CAN_HOST_SHM(obj);
+
+    return g_strdup(s->path);
+}
+
+static void can_host_shm_set_path(Object *obj, const char *value,
+                                  Error **errp)
+{
+    CanHostShm *s = CAN_HOST_SHM(obj);
+
+    g_free(s->path);
+    s->path = g_strdup(value);
+}
+
+static void can_host_shm_instance_init(Object *obj)
+{
+    CanHostShm *s = CAN_HOST_SHM(obj);
+
+    object_property_add_str(obj, "path", can_host_shm_get_path,
+                            can_host_shm_set_path, NULL);
+    object_property_add_link(obj, "canbus", TYPE_CAN_BUS,
+                             (Object **)&s->bus,
+                             object_property_allow_set_link,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
+}
+
+static void can_host_shm_instance_finalize(Object *obj)
+{
+    CanHostShm *s = CAN_HOST_SHM(obj);
+
+    if (s->hdr) {
+        timer_del(s->poll_timer);
+        timer_free(s->poll_timer);
+        can_bus_remove_client(&s->client);
+        munmap(s->hdr, sizeof(CanShmHeader) + 2 * sizeof(CanShmRing));
+    }
+    g_free(s->path);
+}
+
+static void can_host_shm_class_init(ObjectClass *klass, void *data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+
+    ucc->complete = can_host_shm_complete;
+}
+
+static const TypeInfo can_host_shm_info = {
+    .name = TYPE_CAN_HOST_SHM,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(CanHostShm),
+    .instance_init = can_host_shm_instance_init,
+    .instance_finalize = can_host_shm_instance_finalize,
+    .class_init = can_host_shm_class_init,
+    .interfaces = (InterfaceInfo[]) {
+        {TYPE_USER_CREATABLE},
+        {}
+    },
+};
+
+static void can_host_shm_register_types(void)
+{
+    type_register_static(&can_host_shm_info);
+}
+
+type_init(can_host_shm_register_types)
@@ -0,0 +1,207 @@
+/*
+ * Bridge between an in-process CAN bus and a host SocketCAN interface
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/* -object can-host-socketcan,id=can0host,if=vcan0,canbus=canbus0
+ *
+ * Frames from the guest bus are written to the raw CAN socket, and frames
+ * read from it are put on the bus in batches of up to CAN_HOST_BATCH.
+ * With a vcan interface this connects the buses of several QEMU
+ * processes. */
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "net/can.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "qom/object_interfaces.h"
+
+#define TYPE_CAN_HOST_SOCKETCAN "can-host-socketcan"
+#define CAN_HOST_SOCKETCAN(obj) \
+    OBJECT_CHECK(CanHostSocketCAN, (obj), TYPE_CAN_HOST_SOCKETCAN)
+
+#define CAN_HOST_BATCH 32
+
+QEMU_BUILD_BUG_ON(sizeof(QemuCanFrame) != sizeof(struct can_frame));
+QEMU_BUILD_BUG_ON(offsetof(QemuCanFrame, data) !=
+                  offsetof(struct can_frame, data));
+
+typedef struct CanHostSocketCAN {
+    /*< private >*/
+    Object parent_obj;
+
+    /*< public >*/
+    char *ifname;
+    CanBusState *bus;
+    CanBusClientState client;
+    int fd;
+    QemuCanFrame buf[CAN_HOST_BATCH];
+} CanHostSocketCAN;
+
+static void can_host_socketcan_read(void *opaque)
+{
+    CanHostSocketCAN *s = opaque;
+    size_t count = 0;
+    ssize_t ret;
+
+    while (count < CAN_HOST_BATCH) {
+        ret = read(s->fd, &s->buf[count], sizeof(s->buf[count]));
+        if (ret != sizeof(s->buf[count])) {
+            break;
+        }
+        if (!(s->buf[count].can_id & QEMU_CAN_ERR_FLAG)) {
+            count++;
+        }
+    }
+
+    can_bus_client_send(&s->client, s->buf, count);
+}
+
+static void can_host_socketcan_receive(CanBusClientState *client,
+                                       const QemuCanFrame *frames,
+                                       size_t count)
+{
+    CanHostSocketCAN *s = container_of(client, CanHostSocketCAN, client);
+    size_t i;
+    ssize_t ret;
+
+    for (i = 0; i < count; i++) {
+        ret = write(s->fd, &frames[i], sizeof(frames[i]));
+        if (ret != sizeof(frames[i])) {
+            /* The host queue is full or the interface is down; the frame
+             * is lost as it would be on a bus without a receiver. */
+            break;
+        }
+    }
+}
+
+static const CanBusClientInfo can_host_socketcan_client_info = {
+    .receive = can_host_socketcan_receive,
+};
+
+static void can_host_socketcan_complete(UserCreatable *uc, Error **errp)
+{
+    CanHostSocketCAN *s = CAN_HOST_SOCKETCAN(uc);
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+
+    if (!s->ifname) {
+        error_setg(errp, "'if' property is required");
+        return;
+    }
+    if (!s->bus) {
+        error_setg(errp, "'canbus' property is required");
+        return;
+    }
+    if (strlen(s->ifname) >= sizeof(ifr.ifr_name)) {
+        error_setg(errp, "interface name '%s' is too long", s->ifname);
+        return;
+    }
+
+    s->fd = qemu_socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (s->fd < 0) {
+        error_setg_errno(errp, errno, "failed to create CAN socket");
+        return;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), s->ifname);
+    if (ioctl(s->fd, SIOCGIFINDEX, &ifr) < 0) {
+        error_setg_errno(errp, errno, "CAN interface '%s' not found",
+                         s->ifname);
+        goto fail;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(s->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        error_setg_errno(errp, errno, "failed to bind to CAN interface '%s'",
+                         s->ifname);
+        goto fail;
+    }
+
+    qemu_set_nonblock(s->fd);
+    s->client.info = &can_host_socketcan_client_info;
+    can_bus_insert_client(s->bus, &s->client);
+    qemu_set_fd_handler(s->fd, can_host_socketcan_read, NULL, s);
+    return;
+
+fail:
+    closesocket(s->fd);
+    s->fd = -1;
+}
+
+static char *can_host_socketcan_get_if(Object *obj, Error **errp)
+{
+    CanHostSocketCAN *s = CAN_HOST_SOCKETCAN(obj);
+
+    return g_strdup(s->ifname);
+}
+
+static void can_host_socketcan_set_if(Object *obj, const char *value,
+                                      Error **errp)
+{
+    CanHostSocketCAN *s = CAN_HOST_SOCKETCAN(obj);
+
+    g_free(s->ifname);
+    s->ifname = g_strdup(value);
+}
+
+static void can_host_socketcan_instance_init(Object *obj)
+{
+    CanHostSocketCAN *s = CAN_HOST_SOCKETCAN(obj);
+
+    s->fd = -1;
+    object_property_add_str(obj, "if", can_host_socketcan_get_if,
+                            can_host_socketcan_set_if, NULL);
+    object_property_add_link(obj, "canbus", TYPE_CAN_BUS,
+                             (Object **)&s->bus,
+                             object_property_allow_set_link,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
+}
+
+static void can_host_socketcan_instance_finalize(Object *obj)
+{
+    CanHostSocketCAN *s = CAN_HOST_SOCKETCAN(obj);
+
+    if (s->fd >= 0) {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+        can_bus_remove_client(&s->client);
+        closesocket(s->fd);
+    }
+    g_free(s->ifname);
+}
+
+static void can_host_socketcan_class_init(ObjectClass *klass, void *data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+
+    ucc->complete = can_host_socketcan_complete;
+}
+
+static const TypeInfo can_host_socketcan_info = {
+    .name = TYPE_CAN_HOST_SOCKETCAN,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(CanHostSocketCAN),
+    .instance_init = can_host_socketcan_instance_init,
+    .instance_finalize = can_host_socketcan_instance_finalize,
+    .class_init = can_host_socketcan_class_init,
+    .interfaces = (InterfaceInfo[]) {
+        {TYPE_USER_CREATABLE},
+        {}
+    },
+};
+
+static void can_host_socketcan_register_types(void)
+{
+    type_register_static(&can_host_socketcan_info);
+}
+
+type_init(can_host_socketcan_register_types)
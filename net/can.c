@@ -0,0 +1,74 @@
+/*
+ * In-process CAN bus
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/* A can-bus object connects CAN controllers, possibly of several
+ * microcontrollers in one machine, and host bridges such as
+ * can-host-socketcan.  Create it with "-object can-bus,id=canbus0" and
+ * point the clients at it.
+ *
+ * Arbitration is not modelled: frames go out in the order they are sent,
+ * and every frame reaches every client but its sender.  Clients hand over
+ * whole batches, so a controller that queued several frames delivers them
+ * with one call per receiver. */
+#include "net/can.h"
+#include "qom/object_interfaces.h"
+
+void can_bus_insert_client(CanBusState *bus, CanBusClientState *client)
+{
+    client->bus = bus;
+    QTAILQ_INSERT_TAIL(&bus->clients, client, next);
+}
+
+void can_bus_remove_client(CanBusClientState *client)
+{
+    if (client->bus) {
+        QTAILQ_REMOVE(&client->bus->clients, client, next);
+        client->bus = NULL;
+    }
+}
+
+void can_bus_client_send(CanBusClientState *client,
+                         const QemuCanFrame *frames, size_t count)
+{
+    CanBusState *bus = client->bus;
+    CanBusClientState *peer;
+
+    if (!bus || !count) {
+        return;
+    }
+
+    QTAILQ_FOREACH(peer, &bus->clients, next) {
+        if (peer != client) {
+            peer->info->receive(peer, frames, count);
+        }
+    }
+}
+
+static void can_bus_instance_init(Object *obj)
+{
+    CanBusState *bus = CAN_BUS(obj);
+
+    QTAILQ_INIT(&bus->clients);
+}
+
+static const TypeInfo can_bus_info = {
+    .name = TYPE_CAN_BUS,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(CanBusState),
+    .instance_init = can_bus_instance_init,
+    .interfaces = (InterfaceInfo[]) {
+        {TYPE_USER_CREATABLE},
+        {}
+    },
+};
+
+static void can_bus_register_types(void)
+{
+    type_register_static(&can_bus_info);
+}
+
+type_init(can_bus_register_types)
@@ -17,13 +17,21 @@
 #include "clients.h"
 #include "hub.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 
 /*
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
+ *
+ * The hub learns which port each source MAC address lives behind, and
+ * forwards unicast frames for a known destination to that port only.  Ports
+ * connected to a dump client always see every frame.
  */
 
+#define NET_HUB_MAC_TABLE_SIZE 256
+#define NET_HUB_MAC_AGEING_NS  (300 * 1000000000LL)
+
 typedef struct NetHub NetHub;
 
 typedef struct NetHubPort {
@@ -33,42 +41,103 @@ typedef struct NetHubPort {
     int id;
 } NetHubPort;
 
+typedef struct NetHubMacEntry {
+    uint8_t mac[6];
+    NetHubPort *port;           /* NULL if the entry is unused */
+    int64_t last_seen;
+} NetHubMacEntry;
+
 struct NetHub {
     int id;
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    NetHubMacEntry mac_table[NET_HUB_MAC_TABLE_SIZE];
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
-static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
-                               const uint8_t *buf, size_t len)
+static NetHubMacEntry *net_hub_mac_entry(NetHub *hub, const uint8_t *mac)
 {
-    NetHubPort *port;
+    unsigned hash = mac[3] ^ mac[4] ^ mac[5];
 
-    QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
-            continue;
-        }
+    return &hub->mac_table[hash % NET_HUB_MAC_TABLE_SIZE];
+}
 
-        qemu_send_packet(&port->nc, buf, len);
+static void net_hub_mac_learn(NetHub *hub, NetHubPort *port,
+                              const uint8_t *mac, int64_t now)
+{
+    NetHubMacEntry *entry;
+
+    if (mac[0] & 1) {
+        return; /* multicast source address is bogus */
     }
-    return len;
+
+    entry = net_hub_mac_entry(hub, mac);
+    memcpy(entry->mac, mac, sizeof(entry->mac));
+    entry->port = port;
+    entry->last_seen = now;
 }
 
-static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
-                                   const struct iovec *iov, int iovcnt)
+/* Returns the port behind a unicast address, or NULL to flood */
+static NetHubPort *net_hub_mac_lookup(NetHub *hub, const uint8_t *mac,
+                                      int64_t now)
 {
-    NetHubPort *port;
+    NetHubMacEntry *entry;
+
+    if (mac[0] & 1) {
+        return NULL;
+    }
+
+    entry = net_hub_mac_entry(hub, mac);
+    if (!entry->port || memcmp(entry->mac, mac, sizeof(entry->mac)) ||
+        now - entry->last_seen > NET_HUB_MAC_AGEING_NS) {
+        return NULL;
+    }
+    return entry->port;
+}
+
+static bool net_hub_port_is_dump(NetHubPort *port)
+{
+    return port->nc.peer &&
+           port->nc.peer->info->type == NET_CLIENT_OPTIONS_KIND_DUMP;
+}
+
+/*
+ * The data is copied at most once however many ports queue the packet, see
+ * qemu_sendv_packet_shared().
+ */
+static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
+                               const struct iovec *iov, int iovcnt)
+{
+    NetHubPort *port, *dest_port = NULL;
+    NetSharedPacket *shared = NULL;
     ssize_t len = iov_size(iov, iovcnt);
+    uint8_t hdr[12];
+
+    if (iov_to_buf(iov, iovcnt, 0, hdr, sizeof(hdr)) == sizeof(hdr)) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        net_hub_mac_learn(hub, source_port, hdr + 6, now);
+        dest_port = net_hub_mac_lookup(hub, hdr, now);
+        if (dest_port == source_port) {
+            dest_port = NULL;
+        }
+    }
 
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
+        if (dest_port && port != dest_port && !net_hub_port_is_dump(port)) {
+            continue;
+        }
 
-        qemu_sendv_packet(&port->nc, iov, iovcnt);
+        qemu_sendv_packet_shared(&port->nc, iov, iovcnt, &shared);
+    }
+
+    if (shared) {
+        qemu_net_shared_packet_unref(shared);
     }
     return len;
 }
@@ -77,7 +146,7 @@ static NetHub *net_hub_new(int id)
 {
     NetHub *hub;
 
-    hub = g_malloc(sizeof(*hub));
+    hub = g_malloc0(sizeof(*hub));
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
@@ -110,8 +179,12 @@ static ssize_t net_hub_port_receive(NetClientState *nc,
                                     const uint8_t *buf, size_t len)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+    struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = len,
+    };
 
-    return net_hub_receive(port->hub, port, buf, len);
+    return net_hub_receive(port->hub, port, &iov, 1);
 }
 
 static ssize_t net_hub_port_receive_iov(NetClientState *nc,
@@ -119,13 +192,19 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
 
-    return net_hub_receive_iov(port->hub, port, iov, iovcnt);
+    return net_hub_receive(port->hub, port, iov, iovcnt);
 }
 
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+    int i;
 
+    for (i = 0; i < NET_HUB_MAC_TABLE_SIZE; i++) {
+        if (port->hub->mac_table[i].port == port) {
+            port->hub->mac_table[i].port = NULL;
+        }
+    }
     QLIST_REMOVE(port, next);
 }
 
@@ -567,6 +567,25 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Sends count packets, one per element of iov.  Like qemu_send_packet_async,
+ * returns 0 if the caller must wait for sent_cb before sending more.
+ */
+ssize_t qemu_send_packet_batch_async(NetClientState *sender,
+                                     const struct iovec *iov, int count,
+                                     NetPacketSent *sent_cb)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_batch(queue, sender, QEMU_NET_PACKET_FLAG_NONE,
+                                     iov, count, sent_cb);
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
@@ -642,6 +661,24 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/* Sends the same packet from several clients, see qemu_net_queue_send_shared */
+ssize_t qemu_sendv_packet_shared(NetClientState *sender,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetSharedPacket **shared)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return iov_size(iov, iovcnt);
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_shared(queue, sender,
+                                      QEMU_NET_PACKET_FLAG_NONE,
+                                      iov, iovcnt, shared, NULL);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
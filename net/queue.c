@@ -23,6 +23,7 @@
 
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -39,12 +40,27 @@
  * unbounded queueing.
  */
 
+/* Packets up to NET_PACKET_POOL_DATA bytes are allocated with room for that
+ * much data, and up to NET_PACKET_POOL_MAX of them are kept for reuse by the
+ * queue once sent, so that small packets need no allocation.
+ */
+#define NET_PACKET_POOL_DATA 2048
+#define NET_PACKET_POOL_MAX  128
+
+/* Packet data queued on several queues at once, e.g. by a hub */
+struct NetSharedPacket {
+    int refcnt;
+    size_t size;
+    uint8_t data[0];
+};
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    NetSharedPacket *shared;    /* holds the data instead of data[] */
     uint8_t data[0];
 };
 
@@ -54,6 +70,8 @@ struct NetQueue {
     uint32_t nq_count;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    QTAILQ_HEAD(, NetPacket) free_packets;
+    uint32_t nq_free;
 
     unsigned delivering : 1;
 };
@@ -69,6 +87,7 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->nq_count = 0;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->free_packets);
 
     queue->delivering = 0;
 
@@ -81,12 +100,51 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
+        if (packet->shared) {
+            qemu_net_shared_packet_unref(packet->shared);
+        }
+        g_free(packet);
+    }
+    QTAILQ_FOREACH_SAFE(packet, &queue->free_packets, entry, next) {
+        QTAILQ_REMOVE(&queue->free_packets, packet, entry);
         g_free(packet);
     }
 
     g_free(queue);
 }
 
+static NetPacket *qemu_net_queue_packet_new(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size > NET_PACKET_POOL_DATA) {
+        packet = g_malloc(sizeof(NetPacket) + size);
+    } else if (!QTAILQ_EMPTY(&queue->free_packets)) {
+        packet = QTAILQ_FIRST(&queue->free_packets);
+        QTAILQ_REMOVE(&queue->free_packets, packet, entry);
+        queue->nq_free--;
+    } else {
+        packet = g_malloc(sizeof(NetPacket) + NET_PACKET_POOL_DATA);
+    }
+    packet->shared = NULL;
+    return packet;
+}
+
+static void qemu_net_queue_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    bool pooled = packet->shared || packet->size <= NET_PACKET_POOL_DATA;
+
+    if (packet->shared) {
+        qemu_net_shared_packet_unref(packet->shared);
+    }
+    if (pooled && queue->nq_free < NET_PACKET_POOL_MAX) {
+        QTAILQ_INSERT_HEAD(&queue->free_packets, packet, entry);
+        queue->nq_free++;
+    } else {
+        g_free(packet);
+    }
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -99,7 +157,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_packet_new(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -128,7 +186,7 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_packet_new(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -145,6 +203,49 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+void qemu_net_shared_packet_unref(NetSharedPacket *shared)
+{
+    if (--shared->refcnt == 0) {
+        g_free(shared);
+    }
+}
+
+/* Queues a reference to *shared, which is created from iov on first use */
+static void qemu_net_queue_append_shared(NetQueue *queue,
+                                         NetClientState *sender,
+                                         unsigned flags,
+                                         const struct iovec *iov,
+                                         int iovcnt,
+                                         NetSharedPacket **shared,
+                                         NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        return; /* drop if queue full and no callback */
+    }
+
+    if (!*shared) {
+        size_t size = iov_size(iov, iovcnt);
+
+        *shared = g_malloc(sizeof(NetSharedPacket) + size);
+        (*shared)->refcnt = 1;
+        (*shared)->size = size;
+        iov_to_buf(iov, iovcnt, 0, (*shared)->data, size);
+    }
+
+    packet = qemu_net_queue_packet_new(queue, 0);
+    packet->sender = sender;
+    packet->flags = flags;
+    packet->size = (*shared)->size;
+    packet->sent_cb = sent_cb;
+    packet->shared = *shared;
+    (*shared)->refcnt++;
+
+    queue->nq_count++;
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -225,6 +326,96 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/*
+ * Sends count packets at once, iov[i] holding packet i.  The packets that
+ * cannot be delivered right away are queued, and then sent_cb is only called
+ * for the last one.  Returns 0 in that case and count otherwise.
+ */
+ssize_t qemu_net_queue_send_batch(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const struct iovec *iov,
+                                  int count,
+                                  NetPacketSent *sent_cb)
+{
+    int i = 0;
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        queue->delivering = 1;
+        for (; i < count; i++) {
+            if (qemu_deliver_packet(sender, flags, iov[i].iov_base,
+                                    iov[i].iov_len, queue->opaque) == 0) {
+                break;
+            }
+        }
+        queue->delivering = 0;
+    }
+
+    if (i < count) {
+        if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+            return 0; /* drop if queue full and no callback */
+        }
+        for (; i < count; i++) {
+            NetPacket *packet = qemu_net_queue_packet_new(queue,
+                                                          iov[i].iov_len);
+
+            packet->sender = sender;
+            packet->flags = flags;
+            packet->size = iov[i].iov_len;
+            packet->sent_cb = i == count - 1 ? sent_cb : NULL;
+            memcpy(packet->data, iov[i].iov_base, iov[i].iov_len);
+
+            queue->nq_count++;
+            QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        }
+        return 0;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return count;
+}
+
+/*
+ * Like qemu_net_queue_send_iov, but if the packet must be queued, the queue
+ * only takes a reference to *shared.  The caller sends the same packet to
+ * several queues with *shared initially NULL, then drops its reference with
+ * qemu_net_shared_packet_unref() if *shared was set; the data is copied at
+ * most once.
+ */
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetSharedPacket **shared,
+                                   NetPacketSent *sent_cb)
+{
+    ssize_t ret;
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        qemu_net_queue_append_shared(queue, sender, flags, iov, iovcnt,
+                                     shared, sent_cb);
+        return 0;
+    }
+
+    if (iovcnt == 1) {
+        ret = qemu_net_queue_deliver(queue, sender, flags, iov[0].iov_base,
+                                     iov[0].iov_len);
+    } else {
+        ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
+    }
+    if (ret == 0) {
+        qemu_net_queue_append_shared(queue, sender, flags, iov, iovcnt,
+                                     shared, sent_cb);
+        return 0;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -236,7 +427,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_queue_packet_free(queue, packet);
         }
     }
 }
@@ -254,7 +445,8 @@ bool qemu_net_queue_flush(NetQueue *queue)
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
                                      packet->flags,
-                                     packet->data,
+                                     packet->shared ? packet->shared->data
+                                                    : packet->data,
                                      packet->size);
         if (ret == 0) {
             queue->nq_count++;
@@ -266,7 +458,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_packet_free(queue, packet);
     }
     return true;
 }
@@ -46,6 +46,7 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+    uint8_t *batch_buf;           /* datagrams received together (SOCK_DGRAM) */
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
@@ -220,6 +221,49 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_RECVMMSG
+/* Datagrams received by one recvmmsg() call and sent to the peer together */
+#define NET_SOCKET_DGRAM_BATCH 8
+
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    struct mmsghdr msgs[NET_SOCKET_DGRAM_BATCH];
+    struct iovec iov[NET_SOCKET_DGRAM_BATCH];
+    int i, n;
+
+    if (!s->batch_buf) {
+        s->batch_buf = g_malloc(NET_SOCKET_DGRAM_BATCH * NET_BUFSIZE);
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < NET_SOCKET_DGRAM_BATCH; i++) {
+        iov[i].iov_base = s->batch_buf + i * NET_BUFSIZE;
+        iov[i].iov_len = NET_BUFSIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        n = recvmmsg(s->fd, msgs, NET_SOCKET_DGRAM_BATCH, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return;
+    }
+
+    for (i = 0; i < n && msgs[i].msg_len; i++) {
+        iov[i].iov_len = msgs[i].msg_len;
+    }
+    if (i > 0) {
+        qemu_send_packet_batch_async(&s->nc, iov, i, NULL);
+    }
+    if (i < n) {
+        /* end of connection */
+        net_socket_read_poll(s, false);
+        net_socket_write_poll(s, false);
+    }
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -236,6 +280,7 @@ static void net_socket_send_dgram(void *opaque)
     }
     qemu_send_packet(&s->nc, s->buf, size);
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -336,6 +381,8 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+    g_free(s->batch_buf);
+    s->batch_buf = NULL;
 }
 
 static NetClientInfo net_dgram_socket_info = {
@@ -49,7 +49,7 @@ typedef struct TAPState {
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t buf[2 * NET_BUFSIZE];
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -185,30 +185,49 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/* Packets are read into s->buf one after the other, as long as there is room
+ * for one of the largest size, and passed to the peer in a single batch.
+ */
+#define TAP_BATCH_PACKETS 64
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
-
-    while (qemu_can_send_packet(&s->nc)) {
-        uint8_t *buf = s->buf;
+    struct iovec iov[TAP_BATCH_PACKETS];
+    size_t offset;
+    int count, size;
+    bool empty = false;
+
+    while (!empty && qemu_can_send_packet(&s->nc)) {
+        count = 0;
+        offset = 0;
+        while (count < TAP_BATCH_PACKETS &&
+               sizeof(s->buf) - offset >= NET_BUFSIZE) {
+            uint8_t *buf = s->buf + offset;
+
+            size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+            if (size <= 0) {
+                empty = true;
+                break;
+            }
+            offset += size;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+            iov[count].iov_base = buf;
+            iov[count].iov_len = size;
+            count++;
         }
-
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+        if (count == 0) {
+            break;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        if (qemu_send_packet_batch_async(&s->nc, iov, count,
+                                         tap_send_completed) == 0) {
             tap_read_poll(s, false);
             break;
-        } else if (size < 0) {
-            break;
         }
     }
 }
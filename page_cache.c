@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, based on a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -33,18 +33,31 @@
     do { } while (0)
 #endif
 
+/* The cache is set associative: a page can be in any of the
+ * PAGE_CACHE_WAYS ways of the set picked by its address, so that a few
+ * hot pages which map to the same set do not evict each other.  A miss
+ * takes a free way of the set if there is one, else the victim is chosen
+ * with the CLOCK algorithm: the set's hand skips (and clears) the ways
+ * which were used since it last passed.
+ */
+#define PAGE_CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    bool it_ref;
 };
 
 struct PageCache {
     CacheItem *page_cache;
+    uint8_t *hands;             /* CLOCK hand of each set */
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int num_ways;
     uint64_t max_item_age;
     int64_t num_items;
 };
@@ -75,14 +88,20 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
                                      sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->hands = g_try_malloc0(cache->num_sets);
+    if (!cache->page_cache || !cache->hands) {
         DPRINTF("Failed to allocate cache->page_cache\n");
+        g_free(cache->page_cache);
+        g_free(cache->hands);
         g_free(cache);
         return NULL;
     }
@@ -91,6 +110,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_ref = false;
     }
 
     return cache;
@@ -108,59 +128,114 @@ void cache_fini(PageCache *cache)
     }
 
     g_free(cache->page_cache);
+    g_free(cache->hands);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static size_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
-
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+/* Returns the item caching addr, or NULL */
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int way;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    set = &cache->page_cache[cache_get_set(cache, addr) * cache->num_ways];
+    for (way = 0; way < cache->num_ways; way++) {
+        if (set[way].it_addr == addr) {
+            return &set[way];
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Returns a free way of the set of addr, else the CLOCK victim */
+static CacheItem *cache_get_victim(PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    size_t set_index = cache_get_set(cache, addr);
+    CacheItem *set = &cache->page_cache[set_index * cache->num_ways];
+    unsigned int way;
+    CacheItem *it;
+
+    for (way = 0; way < cache->num_ways; way++) {
+        if (!set[way].it_data) {
+            return &set[way];
+        }
+    }
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (;;) {
+        it = &set[cache->hands[set_index]];
+        cache->hands[set_index] = (cache->hands[set_index] + 1) %
+                                  cache->num_ways;
+        if (!it->it_ref) {
+            return it;
+        }
+        it->it_ref = false;
+    }
+}
+
+/* Returns a free way of the set of addr, else its least recently inserted
+ * one */
+static CacheItem *cache_get_oldest(PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = &cache->page_cache[cache_get_set(cache, addr) *
+                                        cache->num_ways];
+    CacheItem *oldest = &set[0];
+    unsigned int way;
+
+    for (way = 0; way < cache->num_ways; way++) {
+        if (!set[way].it_data) {
+            return &set[way];
+        }
+        if (set[way].it_age < oldest->it_age) {
+            oldest = &set[way];
+        }
+    }
+    return oldest;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    return &cache->page_cache[pos];
+    if (it) {
+        it->it_ref = true;
+    }
+    return it != NULL;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
 {
 
     CacheItem *it = NULL;
+    int ret = 0;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+        if (it->it_data) {
+            ret = 1;
+        }
+    }
 
     /* allocate page */
     if (!it->it_data) {
@@ -176,8 +251,9 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
 
     it->it_age = ++cache->max_item_age;
     it->it_addr = addr;
+    it->it_ref = true;
 
-    return 0;
+    return ret;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
@@ -210,7 +286,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            new_it = cache_get_oldest(new_cache, old_it->it_addr);
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
@@ -222,13 +298,18 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
                 new_it->it_data = old_it->it_data;
                 new_it->it_age = old_it->it_age;
                 new_it->it_addr = old_it->it_addr;
+                new_it->it_ref = old_it->it_ref;
             }
         }
     }
 
     g_free(cache->page_cache);
+    g_free(cache->hands);
     cache->page_cache = new_cache->page_cache;
+    cache->hands = new_cache->hands;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->num_ways = new_cache->num_ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
@@ -0,0 +1,212 @@
+/*
+ * JSON printing Visitor
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qapi/json-output-visitor.h"
+#include "qapi/visitor-impl.h"
+#include "qemu/queue.h"
+#include "qemu-common.h"
+#include "qapi/qmp/qjson.h"
+
+/* Writes the JSON text of the values it visits as it goes, in the format of
+ * qobject_to_json(), where the QMP output visitor builds QObjects which are
+ * only turned to JSON afterwards.  The members of an object come in the order
+ * of the schema instead of the order of a QDict.
+ */
+
+typedef struct JsonOutputLevel
+{
+    int count;                  /* members or elements written */
+    bool is_list;
+    bool is_list_head;
+    QSLIST_ENTRY(JsonOutputLevel) node;
+} JsonOutputLevel;
+
+struct JsonOutputVisitor
+{
+    Visitor visitor;
+    QString *str;
+    QSLIST_HEAD(, JsonOutputLevel) stack;
+};
+
+static JsonOutputVisitor *to_jov(Visitor *v)
+{
+    return container_of(v, JsonOutputVisitor, visitor);
+}
+
+/* Separates the value from the previous one and names it in an object */
+static void json_output_prefix(JsonOutputVisitor *jov, const char *name)
+{
+    JsonOutputLevel *l = QSLIST_FIRST(&jov->stack);
+
+    if (!l) {
+        return;
+    }
+    if (l->count++) {
+        qstring_append(jov->str, ", ");
+    }
+    if (!l->is_list) {
+        qjson_append_str(jov->str, name ? name : "");
+        qstring_append(jov->str, ": ");
+    }
+}
+
+static void json_output_push(JsonOutputVisitor *jov, bool is_list)
+{
+    JsonOutputLevel *l = g_malloc0(sizeof(*l));
+
+    l->is_list = is_list;
+    l->is_list_head = is_list;
+    QSLIST_INSERT_HEAD(&jov->stack, l, node);
+}
+
+static void json_output_pop(JsonOutputVisitor *jov)
+{
+    JsonOutputLevel *l = QSLIST_FIRST(&jov->stack);
+
+    QSLIST_REMOVE_HEAD(&jov->stack, node);
+    g_free(l);
+}
+
+static void json_output_start_struct(Visitor *v, void **obj, const char *kind,
+                                     const char *name, size_t unused,
+                                     Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qstring_append(jov->str, "{");
+    json_output_push(jov, false);
+}
+
+static void json_output_end_struct(Visitor *v, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_pop(jov);
+    qstring_append(jov->str, "}");
+}
+
+static void json_output_start_list(Visitor *v, const char *name, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qstring_append(jov->str, "[");
+    json_output_push(jov, true);
+}
+
+static GenericList *json_output_next_list(Visitor *v, GenericList **listp,
+                                          Error **errp)
+{
+    GenericList *list = *listp;
+    JsonOutputVisitor *jov = to_jov(v);
+    JsonOutputLevel *l = QSLIST_FIRST(&jov->stack);
+
+    assert(l);
+    if (l->is_list_head) {
+        l->is_list_head = false;
+        return list;
+    }
+
+    return list ? list->next : NULL;
+}
+
+static void json_output_end_list(Visitor *v, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_pop(jov);
+    qstring_append(jov->str, "]");
+}
+
+static void json_output_type_int(Visitor *v, int64_t *obj, const char *name,
+                                 Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+    char buffer[32];
+
+    json_output_prefix(jov, name);
+    snprintf(buffer, sizeof(buffer), "%" PRId64, *obj);
+    qstring_append(jov->str, buffer);
+}
+
+static void json_output_type_bool(Visitor *v, bool *obj, const char *name,
+                                  Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qstring_append(jov->str, *obj ? "true" : "false");
+}
+
+static void json_output_type_str(Visitor *v, char **obj, const char *name,
+                                 Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qjson_append_str(jov->str, *obj ? *obj : "");
+}
+
+static void json_output_type_number(Visitor *v, double *obj, const char *name,
+                                    Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qjson_append_number(jov->str, *obj);
+}
+
+/* The text, as a QJsonText which qobject_to_json() copies as it is */
+QObject *json_output_get_qobject(JsonOutputVisitor *jov)
+{
+    if (!qstring_get_length(jov->str)) {
+        return NULL;
+    }
+
+    QINCREF(jov->str);
+    return QOBJECT(qjsontext_from_qstring(jov->str));
+}
+
+Visitor *json_output_get_visitor(JsonOutputVisitor *v)
+{
+    return &v->visitor;
+}
+
+void json_output_visitor_cleanup(JsonOutputVisitor *v)
+{
+    while (!QSLIST_EMPTY(&v->stack)) {
+        json_output_pop(v);
+    }
+
+    QDECREF(v->str);
+    g_free(v);
+}
+
+JsonOutputVisitor *json_output_visitor_new(void)
+{
+    JsonOutputVisitor *v;
+
+    v = g_malloc0(sizeof(*v));
+
+    v->visitor.start_struct = json_output_start_struct;
+    v->visitor.end_struct = json_output_end_struct;
+    v->visitor.start_list = json_output_start_list;
+    v->visitor.next_list = json_output_next_list;
+    v->visitor.end_list = json_output_end_list;
+    v->visitor.type_enum = output_type_enum;
+    v->visitor.type_int = json_output_type_int;
+    v->visitor.type_bool = json_output_type_bool;
+    v->visitor.type_str = json_output_type_str;
+    v->visitor.type_number = json_output_type_number;
+
+    v->str = qstring_new();
+    QSLIST_INIT(&v->stack);
+
+    return v;
+}
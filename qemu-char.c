@@ -2457,6 +2457,12 @@ typedef struct {
         uint16_t code;
         uint16_t first_code; /* First code with FIN=0 */
         char controldata[125];
+        bool binary;         /* client asked for the "binary" subprotocol */
+        guint flush_tag;     /* pending tcp_chr_websocket_flush_timer */
+        int olen;
+#define  WS_OBUF_SIZE            4096
+#define  WS_FLUSH_MS             5
+        uint8_t obuf[WS_OBUF_SIZE]; /* outgoing data not yet framed */
 #define  WS_FIN                  0x8000
 #define  WS_OPCODE_MASK          0x0f00
 #define   WS_OPCODE_CONT          0x0000
@@ -2527,8 +2533,9 @@ static int unix_send_msgfds(CharDriverState *chr, const uint8_t *buf, int len)
 }
 #endif
 
-static void tcp_chr_websocket_send(CharDriverState *chr,
-        uint16_t opcode, const void *data, size_t datasz);
+static void tcp_chr_websocket_queue(CharDriverState *chr,
+        const uint8_t *buf, int len);
+static void tcp_chr_websocket_discard(CharDriverState *chr);
 
 /* Called with chr_write_lock held.  */
 static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
@@ -2541,7 +2548,7 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
         } else
 #endif
         if (s->proto == TCP_PROTO_WEBSOCKET) {
-            tcp_chr_websocket_send(chr, WS_OPCODE_TEXT|WS_FIN, buf, len);
+            tcp_chr_websocket_queue(chr, buf, len);
             return len;
         } else if (s->proto == TCP_PROTO_HTTP) {
             /* ignore */
@@ -2757,6 +2764,7 @@ static void tcp_chr_disconnect(CharDriverState *chr)
     TCPCharDriver *s = chr->opaque;
 
     s->connected = 0;
+    tcp_chr_websocket_discard(chr);
     if (s->listen_chan) {
         s->listen_tag = g_io_add_watch(s->listen_chan, G_IO_IN,
                                        tcp_chr_accept, chr);
@@ -2988,11 +2996,79 @@ static void tcp_chr_websocket_send(CharDriverState *chr,
     send_all(s->fd, data, datasz);
 }
 
+/* Sends the queued output as one data frame */
+static void tcp_chr_websocket_flush(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (s->ws.flush_tag) {
+        g_source_remove(s->ws.flush_tag);
+        s->ws.flush_tag = 0;
+    }
+    if (s->ws.olen) {
+        tcp_chr_websocket_send(chr, (s->ws.binary ? WS_OPCODE_BINARY
+                                                  : WS_OPCODE_TEXT) | WS_FIN,
+                               s->ws.obuf, s->ws.olen);
+        s->ws.olen = 0;
+    }
+}
+
+static gboolean tcp_chr_websocket_flush_timer(gpointer opaque)
+{
+    CharDriverState *chr = opaque;
+    TCPCharDriver *s = chr->opaque;
+
+    qemu_mutex_lock(&chr->chr_write_lock);
+    s->ws.flush_tag = 0;
+    tcp_chr_websocket_flush(chr);
+    qemu_mutex_unlock(&chr->chr_write_lock);
+    return FALSE;
+}
+
+/* Queues output for the websocket.  Writes are coalesced into a frame
+   that is sent when WS_OBUF_SIZE bytes are queued, or WS_FLUSH_MS after
+   the first of them, so that a guest printing one character at a time
+   does not send one frame per character. */
+static void tcp_chr_websocket_queue(CharDriverState *chr,
+        const uint8_t *buf, int len)
+{
+    TCPCharDriver *s = chr->opaque;
+    int n;
+
+    while (len > 0) {
+        n = MIN(len, WS_OBUF_SIZE - s->ws.olen);
+        memcpy(s->ws.obuf + s->ws.olen, buf, n);
+        s->ws.olen += n;
+        buf += n;
+        len -= n;
+        if (s->ws.olen == WS_OBUF_SIZE) {
+            tcp_chr_websocket_flush(chr);
+        }
+    }
+    if (s->ws.olen && !s->ws.flush_tag) {
+        s->ws.flush_tag = g_timeout_add(WS_FLUSH_MS,
+                                        tcp_chr_websocket_flush_timer, chr);
+    }
+}
+
+/* Drops the queued output once the connection is gone */
+static void tcp_chr_websocket_discard(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (s->ws.flush_tag) {
+        g_source_remove(s->ws.flush_tag);
+        s->ws.flush_tag = 0;
+    }
+    s->ws.olen = 0;
+}
+
 /* Closes the websocket */
 static void tcp_chr_websocket_close(CharDriverState *chr)
 {
     TCPCharDriver *s = chr->opaque;
 
+    tcp_chr_websocket_flush(chr);
     tcp_chr_websocket_send(chr, WS_OPCODE_CLOSE | WS_FIN,
                 NULL, 0);
     tcp_chr_disconnect(chr);
@@ -3039,6 +3115,28 @@ static void tcp_chr_websocket_process_data(CharDriverState *chr,
     qemu_chr_be_write(chr, buf, len);
 }
 
+/* XORs len bytes of received payload with the mask, 8 bytes at a time.
+   ws.count is the offset of buf in the payload. */
+static void tcp_chr_websocket_unmask(TCPCharDriver *s, uint8_t *buf, int len)
+{
+    uint8_t m[8];
+    uint64_t mask, v;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        m[i] = s->ws.mask[(s->ws.count + i) & 3];
+    }
+    memcpy(&mask, m, sizeof(mask));
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&v, buf + i, sizeof(v));
+        v ^= mask;
+        memcpy(buf + i, &v, sizeof(v));
+    }
+    for (; i < len; i++) {
+        buf[i] ^= m[i & 7];
+    }
+}
+
 /* Received a finished websocket frame */
 static void tcp_chr_websocket_process_fin(CharDriverState *chr,
         uint16_t opcode)
@@ -3049,7 +3147,7 @@ static void tcp_chr_process_websocket(CharDriverState *chr,
                                       TCPCharDriver *s,
                                       uint8_t *buf, int *size)
 {
-    int len, i;
+    int len;
 
     while (*size) {
         switch (s->ws.state) {
@@ -3122,9 +3220,7 @@ end_mask:
             len = MIN(s->ws.payload_len, *size);
             if (s->ws.code & WS_MASK) {
                 /* XOR with the mask bytes (defeats replay) */
-                for (i = 0; i < len; i++) {
-                    buf[i] ^= s->ws.mask[(s->ws.count + i) & 3];
-                }
+                tcp_chr_websocket_unmask(s, buf, len);
             }
             *size -= len;
             s->ws.payload_len -= len;
@@ -3159,12 +3255,31 @@ end_payload:
     }
 }
 
+/* check whether the comma separated list of subprotocols has proto */
+static bool websocket_protocol_offered(const char *list, const char *proto)
+{
+    size_t len = strlen(proto);
+
+    while (list && *list) {
+        while (*list == ' ' || *list == ',') {
+            list++;
+        }
+        if (!strncmp(list, proto, len) &&
+            (list[len] == '\0' || list[len] == ',' || list[len] == ' ')) {
+            return true;
+        }
+        list = strchr(list, ',');
+    }
+    return false;
+}
+
 /* upgrade a HTTP session to a websocket connection */
 static void tcp_chr_http_upgrade_websocket(CharDriverState *chr,
                  TCPCharDriver *s, QString *key, const char *uri)
 {
     char hdrs[1024];
     QString *accept;
+    const char *protocols;
 
     qstring_append(key, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
     accept = sha1_base64(key);
@@ -3173,12 +3288,19 @@ static void tcp_chr_http_upgrade_websocket(CharDriverState *chr,
         return;
     }
 
+    /* Raw byte streams such as a UART console are not valid UTF-8, so
+       clients that can take them ask for binary frames. */
+    protocols = tcp_chr_process_http_hdr(s, "sec-websocket-protocol");
+    s->ws.binary = websocket_protocol_offered(protocols, "binary");
+
     tcp_chr_http_send_status(chr, 101);
     snprintf(hdrs, sizeof hdrs,
         "Upgrade: websocket\r\n"
         "Connection: Upgrade\r\n"
         "Sec-WebSocket-Accept: %s\r\n"
-        "\r\n", qstring_get_str(accept));
+        "%s"
+        "\r\n", qstring_get_str(accept),
+        s->ws.binary ? "Sec-WebSocket-Protocol: binary\r\n" : "");
     send_all(s->fd, hdrs, strlen(hdrs));
     QDECREF(accept);
     s->http.state = HTTP_STATE_WEBSOCKET;
@@ -3584,6 +3706,7 @@ static void tcp_chr_close(CharDriverState *chr)
 {
     TCPCharDriver *s = chr->opaque;
     int i;
+    tcp_chr_websocket_discard(chr);
     if (s->fd >= 0) {
         remove_fd_in_watch(chr);
         if (s->chan) {
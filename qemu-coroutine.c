@@ -15,35 +15,129 @@
 #include "trace.h"
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/notify.h"
 #include "block/coroutine.h"
 #include "block/coroutine_int.h"
 
 enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
+    /* Coroutines moved between a thread's pool and the global pool at once */
+    POOL_BATCH_SIZE = 64,
+    /* Maximum global pool size prevents holding too many freed coroutines */
+    POOL_MAX_SIZE = 4 * POOL_BATCH_SIZE,
 };
 
-/** Free list to speed up creation */
+typedef QSLIST_HEAD(, Coroutine) CoroutineFreeList;
+
+/** Free lists to speed up creation
+ *
+ * Each thread recycles its own coroutines without locking.  Only when its
+ * list runs dry or overflows does it take pool_lock, and then it moves a
+ * whole batch to or from the global pool.  Only coroutines with the default
+ * stack size are pooled.
+ */
 static QemuMutex pool_lock;
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
+static CoroutineFreeList pool = QSLIST_HEAD_INITIALIZER(pool);
 static unsigned int pool_size;
 
-Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
+static __thread CoroutineFreeList thread_pool;
+static __thread unsigned int thread_pool_size;
+static __thread Notifier thread_pool_cleanup_notifier;
+
+static void coroutine_pool_move(CoroutineFreeList *to, CoroutineFreeList *from,
+                                unsigned int n)
 {
-    Coroutine *co = NULL;
+    Coroutine *co;
+
+    while (n-- > 0) {
+        co = QSLIST_FIRST(from);
+        QSLIST_REMOVE_HEAD(from, pool_next);
+        QSLIST_INSERT_HEAD(to, co, pool_next);
+    }
+}
+
+/* Hand the coroutines of an exiting thread to the global pool */
+static void coroutine_thread_pool_cleanup(Notifier *n, void *value)
+{
+    Coroutine *co;
+    unsigned int n_moved;
+
+    qemu_mutex_lock(&pool_lock);
+    n_moved = MIN(thread_pool_size, POOL_MAX_SIZE - pool_size);
+    coroutine_pool_move(&pool, &thread_pool, n_moved);
+    pool_size += n_moved;
+    qemu_mutex_unlock(&pool_lock);
+
+    while ((co = QSLIST_FIRST(&thread_pool)) != NULL) {
+        QSLIST_REMOVE_HEAD(&thread_pool, pool_next);
+        qemu_coroutine_delete(co);
+    }
+    thread_pool_size = 0;
+}
+
+static Coroutine *coroutine_pool_get(void)
+{
+    Coroutine *co;
+    unsigned int n;
+
+    if (!thread_pool_size) {
+        /* Slow path; a good place to register the exit notifier, too */
+        if (!thread_pool_cleanup_notifier.notify) {
+            thread_pool_cleanup_notifier.notify = coroutine_thread_pool_cleanup;
+            qemu_thread_atexit_add(&thread_pool_cleanup_notifier);
+        }
 
-    if (CONFIG_COROUTINE_POOL) {
         qemu_mutex_lock(&pool_lock);
-        co = QSLIST_FIRST(&pool);
-        if (co) {
-            QSLIST_REMOVE_HEAD(&pool, pool_next);
-            pool_size--;
+        n = MIN(pool_size, POOL_BATCH_SIZE);
+        coroutine_pool_move(&thread_pool, &pool, n);
+        pool_size -= n;
+        qemu_mutex_unlock(&pool_lock);
+
+        thread_pool_size = n;
+        if (!n) {
+            return NULL;
         }
+    }
+
+    co = QSLIST_FIRST(&thread_pool);
+    QSLIST_REMOVE_HEAD(&thread_pool, pool_next);
+    thread_pool_size--;
+    return co;
+}
+
+static bool coroutine_pool_put(Coroutine *co)
+{
+    unsigned int n;
+
+    if (thread_pool_size >= 2 * POOL_BATCH_SIZE) {
+        qemu_mutex_lock(&pool_lock);
+        n = MIN(POOL_BATCH_SIZE, POOL_MAX_SIZE - pool_size);
+        coroutine_pool_move(&pool, &thread_pool, n);
+        pool_size += n;
         qemu_mutex_unlock(&pool_lock);
+
+        thread_pool_size -= n;
+        if (!n) {
+            return false;
+        }
+    }
+
+    QSLIST_INSERT_HEAD(&thread_pool, co, pool_next);
+    thread_pool_size++;
+    return true;
+}
+
+Coroutine *qemu_coroutine_create_with_stack(CoroutineEntry *entry,
+                                            size_t stack_size)
+{
+    Coroutine *co = NULL;
+
+    if (CONFIG_COROUTINE_POOL && stack_size == COROUTINE_STACK_SIZE) {
+        co = coroutine_pool_get();
     }
 
     if (!co) {
-        co = qemu_coroutine_new();
+        co = qemu_coroutine_new(stack_size);
+        co->stack_size = stack_size;
     }
 
     co->entry = entry;
@@ -51,18 +145,19 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
     return co;
 }
 
+Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
+{
+    return qemu_coroutine_create_with_stack(entry, COROUTINE_STACK_SIZE);
+}
+
 static void coroutine_delete(Coroutine *co)
 {
-    if (CONFIG_COROUTINE_POOL) {
-        qemu_mutex_lock(&pool_lock);
-        if (pool_size < POOL_MAX_SIZE) {
-            QSLIST_INSERT_HEAD(&pool, co, pool_next);
-            co->caller = NULL;
-            pool_size++;
-            qemu_mutex_unlock(&pool_lock);
+    co->caller = NULL;
+
+    if (CONFIG_COROUTINE_POOL && co->stack_size == COROUTINE_STACK_SIZE) {
+        if (coroutine_pool_put(co)) {
             return;
         }
-        qemu_mutex_unlock(&pool_lock);
     }
 
     qemu_coroutine_delete(co);
@@ -7,7 +7,15 @@
 #include "trace.h"
 
 #define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+#define MAX_IOV_SIZE MIN(IOV_MAX, 512)
+
+/* Data passed with qemu_put_buffer_async is not copied, so the iovec can
+ * hold much more than IO_BUF_SIZE.  It is flushed once it holds about a
+ * sixteenth of the rate limit, so that rate limiting stays smooth, within
+ * these bounds.
+ */
+#define MIN_FLUSH_SIZE (64 * 1024)
+#define MAX_FLUSH_SIZE (1024 * 1024)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -20,10 +28,12 @@ struct QEMUFile {
                     when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
+    int fill_limit; /* when not 0, the most the next fill reads */
     uint8_t buf[IO_BUF_SIZE];
 
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
+    size_t iov_size;     /* bytes in iov */
 
     int last_error;
 };
@@ -466,6 +476,7 @@ void qemu_fflush(QEMUFile *f)
     }
     f->buf_index = 0;
     f->iovcnt = 0;
+    f->iov_size = 0;
     if (ret < 0) {
         qemu_file_set_error(f, ret);
     }
@@ -552,8 +563,12 @@ static ssize_t qemu_fill_buffer(QEMUFile *f)
     f->buf_index = 0;
     f->buf_size = pending;
 
-    len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
-                        IO_BUF_SIZE - pending);
+    len = IO_BUF_SIZE - pending;
+    if (f->fill_limit) {
+        len = MIN(len, f->fill_limit);
+        f->fill_limit = 0;
+    }
+    len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos, len);
     if (len > 0) {
         f->buf_size += len;
         f->pos += len;
@@ -610,6 +625,14 @@ int qemu_fclose(QEMUFile *f)
     return ret;
 }
 
+static size_t qemu_file_flush_size(QEMUFile *f)
+{
+    if (f->xfer_limit <= 0) {
+        return MAX_FLUSH_SIZE;
+    }
+    return MIN(MAX(f->xfer_limit / 16, MIN_FLUSH_SIZE), MAX_FLUSH_SIZE);
+}
+
 static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
 {
     /* check for adjacent buffer and coalesce them */
@@ -620,8 +643,9 @@ static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
         f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
         f->iov[f->iovcnt++].iov_len = size;
     }
+    f->iov_size += size;
 
-    if (f->iovcnt >= MAX_IOV_SIZE) {
+    if (f->iovcnt >= MAX_IOV_SIZE || f->iov_size >= qemu_file_flush_size(f)) {
         qemu_fflush(f);
     }
 }
@@ -695,6 +719,28 @@ void qemu_file_skip(QEMUFile *f, int size)
     }
 }
 
+/*
+ * Skip 'size' bytes without reading the part of them that is not buffered
+ * yet.  Only for files whose get_buffer reads at the position it is given.
+ * Returns the position of the first skipped byte in the file.
+ */
+int64_t qemu_file_skip_unread(QEMUFile *f, int size)
+{
+    int64_t pos = f->pos - (f->buf_size - f->buf_index);
+    int buffered = MIN(size, f->buf_size - f->buf_index);
+
+    assert(!qemu_file_is_writable(f));
+
+    f->buf_index += buffered;
+    if (buffered < size) {
+        f->pos += size - buffered;
+        /* What follows is most likely another small header and another
+         * skip: do not read ahead what would be skipped */
+        f->fill_limit = 512;
+    }
+    return pos;
+}
+
 /*
  * Read 'size' bytes from file (at 'offset') into buf without moving the
  * pointer.
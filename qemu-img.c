@@ -138,6 +138,9 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' number of parallel coroutines for convert, compare and map (default 1,\n"
+           "       maximum 16)\n"
+           "  '-W' allows convert to write to the target out of order\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -857,6 +860,78 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+typedef struct MapEntry {
+    int flags;
+    int depth;
+    int64_t start;
+    int64_t length;
+    int64_t offset;
+    BlockDriverState *bs;
+} MapEntry;
+
+static int get_block_status(BlockDriverState *bs, int64_t sector_num,
+                            int nb_sectors, MapEntry *e)
+{
+    int64_t ret;
+    int depth;
+
+    /* As an optimization, we could cache the current range of unallocated
+     * clusters in each file of the chain, and avoid querying the same
+     * range repeatedly.
+     */
+
+    depth = 0;
+    for (;;) {
+        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, &nb_sectors);
+        if (ret < 0) {
+            return ret;
+        }
+        assert(nb_sectors);
+        if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
+            break;
+        }
+        bs = bs->backing_hd;
+        if (bs == NULL) {
+            ret = 0;
+            break;
+        }
+
+        depth++;
+    }
+
+    e->start = sector_num * BDRV_SECTOR_SIZE;
+    e->length = nb_sectors * BDRV_SECTOR_SIZE;
+    e->flags = ret & ~BDRV_BLOCK_OFFSET_MASK;
+    e->offset = ret & BDRV_BLOCK_OFFSET_MASK;
+    e->depth = depth;
+    e->bs = bs;
+    return 0;
+}
+
+static int parse_num_coroutines(const char *arg, int max, int *num_coroutines)
+{
+    long val;
+    char *end;
+
+    errno = 0;
+    val = strtol(arg, &end, 10);
+    if (errno || *end || val < 1 || val > max) {
+        error_report("Invalid number of coroutines, it must be "
+                     "between 1 and %d", max);
+        return -1;
+    }
+    *num_coroutines = val;
+    return 0;
+}
+
+/*
+ * Compare and map (-m) scan the image in disjoint chunks, one per coroutine,
+ * so that block status lookups and reads for several chunks are in flight at
+ * once.  The results are still reported in image order.
+ */
+
+#define MAX_SCAN_COROUTINES 16
+
 /*
  * Compares two buffers sector by sector. Returns 0 if the first sector of both
  * buffers matches, non-zero otherwise.
@@ -934,6 +1009,189 @@ static int check_empty_sectors(BlockDriverState *bs, int64_t sect_num,
     return 0;
 }
 
+typedef struct ImgCompareState {
+    BlockDriverState *bs1;
+    BlockDriverState *bs2;
+    const char *filename1;
+    const char *filename2;
+    int64_t total_sectors;
+    int64_t progress_base;
+    bool strict;
+    int64_t sector_num;         /* next chunk to hand out */
+    int64_t mismatch_sector;    /* first difference found so far */
+    bool alloc_mismatch;        /* ...and whether only allocation differs */
+    int running_coroutines;
+    int ret;
+} ImgCompareState;
+
+/*
+ * Like bdrv_is_allocated_above, but unless in strict mode, sectors that the
+ * block status reports as reading zeroes count as unallocated: they are
+ * compared without reading them.
+ */
+static int coroutine_fn compare_is_allocated(ImgCompareState *s,
+                                             BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors, int *pnum)
+{
+    MapEntry e;
+    int ret;
+
+    if (s->strict) {
+        return bdrv_is_allocated_above(bs, NULL, sector_num, nb_sectors, pnum);
+    }
+
+    ret = get_block_status(bs, sector_num, nb_sectors, &e);
+    if (ret < 0) {
+        return ret;
+    }
+    *pnum = e.length >> BDRV_SECTOR_BITS;
+    return (e.flags & (BDRV_BLOCK_DATA|BDRV_BLOCK_ZERO)) == BDRV_BLOCK_DATA;
+}
+
+static void compare_set_mismatch(ImgCompareState *s, int64_t sector_num,
+                                 bool alloc_mismatch)
+{
+    if (sector_num < s->mismatch_sector) {
+        s->mismatch_sector = sector_num;
+        s->alloc_mismatch = alloc_mismatch;
+    }
+}
+
+/*
+ * Compares the sectors from sector_num to end.  Returns 0 if they are the
+ * same, 1 if a difference was recorded and the exit code of img_compare on
+ * error.
+ */
+static int coroutine_fn compare_co_chunk(ImgCompareState *s,
+                                         int64_t sector_num, int64_t end,
+                                         uint8_t *buf1, uint8_t *buf2)
+{
+    int pnum1, pnum2, pnum;
+    int allocated1, allocated2;
+    int nb_sectors, ret;
+
+    while (sector_num < end && sector_num < s->mismatch_sector) {
+        nb_sectors = end - sector_num;
+        allocated1 = compare_is_allocated(s, s->bs1, sector_num, nb_sectors,
+                                          &pnum1);
+        if (allocated1 < 0) {
+            error_report("Sector allocation test failed for %s", s->filename1);
+            return 3;
+        }
+
+        allocated2 = compare_is_allocated(s, s->bs2, sector_num, nb_sectors,
+                                          &pnum2);
+        if (allocated2 < 0) {
+            error_report("Sector allocation test failed for %s", s->filename2);
+            return 3;
+        }
+        nb_sectors = MIN(pnum1, pnum2);
+
+        if (allocated1 == allocated2) {
+            if (allocated1) {
+                ret = bdrv_read(s->bs1, sector_num, buf1, nb_sectors);
+                if (ret < 0) {
+                    error_report("Error while reading offset %" PRId64 " of %s:"
+                                 " %s", sectors_to_bytes(sector_num),
+                                 s->filename1, strerror(-ret));
+                    return 4;
+                }
+                ret = bdrv_read(s->bs2, sector_num, buf2, nb_sectors);
+                if (ret < 0) {
+                    error_report("Error while reading offset %" PRId64
+                                 " of %s: %s", sectors_to_bytes(sector_num),
+                                 s->filename2, strerror(-ret));
+                    return 4;
+                }
+                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
+                if (ret || pnum != nb_sectors) {
+                    compare_set_mismatch(s, ret ? sector_num
+                                                : sector_num + pnum, false);
+                    return 1;
+                }
+            }
+        } else {
+            if (s->strict) {
+                compare_set_mismatch(s, sector_num, true);
+                return 1;
+            }
+
+            ret = bdrv_read(allocated1 ? s->bs1 : s->bs2, sector_num, buf1,
+                            nb_sectors);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64 " of %s: %s",
+                             sectors_to_bytes(sector_num),
+                             allocated1 ? s->filename1 : s->filename2,
+                             strerror(-ret));
+                return 4;
+            }
+            ret = is_allocated_sectors(buf1, nb_sectors, &pnum);
+            if (ret || pnum != nb_sectors) {
+                compare_set_mismatch(s, ret ? sector_num : sector_num + pnum,
+                                     false);
+                return 1;
+            }
+        }
+        sector_num += nb_sectors;
+        qemu_progress_print(((float) nb_sectors / s->progress_base)*100, 100);
+    }
+    return 0;
+}
+
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1, *buf2;
+    int64_t sector_num, end;
+    int ret;
+
+    s->running_coroutines++;
+    buf1 = qemu_blockalign(s->bs1, IO_BUF_SIZE);
+    buf2 = qemu_blockalign(s->bs2, IO_BUF_SIZE);
+
+    /* Chunks are handed out in order, so once a difference is found all
+     * chunks before it have been taken already.  They are still compared,
+     * because one of them may contain an earlier difference. */
+    while (s->ret == -EINPROGRESS &&
+           s->sector_num < MIN(s->total_sectors, s->mismatch_sector)) {
+        sector_num = s->sector_num;
+        end = sector_num + sectors_to_process(s->total_sectors, sector_num);
+        s->sector_num = end;
+
+        ret = compare_co_chunk(s, sector_num, end, buf1, buf2);
+        if (ret > 1) {
+            s->ret = ret;
+        }
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        s->ret = s->mismatch_sector != INT64_MAX;
+    }
+}
+
+static int img_compare_sectors(ImgCompareState *s, int num_coroutines)
+{
+    AioContext *ctx = bdrv_get_aio_context(s->bs1);
+    int i;
+
+    s->sector_num = 0;
+    s->mismatch_sector = INT64_MAX;
+    s->ret = -EINPROGRESS;
+
+    for (i = 0; i < num_coroutines; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(compare_co_do_compare), s);
+    }
+
+    while (s->running_coroutines) {
+        aio_poll(ctx, true);
+    }
+    return s->ret;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -946,20 +1204,20 @@ static int img_compare(int argc, char **argv)
     const char *fmt1 = NULL, *fmt2 = NULL, *filename1, *filename2;
     BlockDriverState *bs1, *bs2;
     int64_t total_sectors1, total_sectors2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int pnum1, pnum2;
-    int allocated1, allocated2;
+    uint8_t *buf = NULL;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int64_t total_sectors;
-    int64_t sector_num = 0;
+    int64_t sector_num;
     int64_t nb_sectors;
     int c, pnum;
+    int num_coroutines = 1;
     uint64_t bs_sectors;
     uint64_t progress_base;
+    ImgCompareState state;
 
     for (;;) {
-        c = getopt(argc, argv, "hpf:F:sq");
+        c = getopt(argc, argv, "hpf:F:m:sq");
         if (c == -1) {
             break;
         }
@@ -974,6 +1232,12 @@ static int img_compare(int argc, char **argv)
         case 'F':
             fmt2 = optarg;
             break;
+        case 'm':
+            if (parse_num_coroutines(optarg, MAX_SCAN_COROUTINES,
+                                     &num_coroutines) < 0) {
+                return 2;
+            }
+            break;
         case 'p':
             progress = true;
             break;
@@ -1015,8 +1279,7 @@ static int img_compare(int argc, char **argv)
         goto out2;
     }
 
-    buf1 = qemu_blockalign(bs1, IO_BUF_SIZE);
-    buf2 = qemu_blockalign(bs2, IO_BUF_SIZE);
+    buf = qemu_blockalign(bs1, IO_BUF_SIZE);
     bdrv_get_geometry(bs1, &bs_sectors);
     total_sectors1 = bs_sectors;
     bdrv_get_geometry(bs2, &bs_sectors);
@@ -1032,83 +1295,30 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    for (;;) {
-        nb_sectors = sectors_to_process(total_sectors, sector_num);
-        if (nb_sectors <= 0) {
-            break;
-        }
-        allocated1 = bdrv_is_allocated_above(bs1, NULL, sector_num, nb_sectors,
-                                             &pnum1);
-        if (allocated1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-
-        allocated2 = bdrv_is_allocated_above(bs2, NULL, sector_num, nb_sectors,
-                                             &pnum2);
-        if (allocated2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        nb_sectors = MIN(pnum1, pnum2);
-
-        if (allocated1 == allocated2) {
-            if (allocated1) {
-                ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
-                                 strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
-                if (ret || pnum != nb_sectors) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            sectors_to_bytes(
-                                ret ? sector_num : sector_num + pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
+    state = (ImgCompareState) {
+        .bs1            = bs1,
+        .bs2            = bs2,
+        .filename1      = filename1,
+        .filename2      = filename2,
+        .total_sectors  = total_sectors,
+        .progress_base  = progress_base,
+        .strict         = strict,
+    };
+    ret = img_compare_sectors(&state, num_coroutines);
+    if (ret == 1) {
+        if (state.alloc_mismatch) {
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " allocation mismatch!\n",
+                    sectors_to_bytes(state.mismatch_sector));
         } else {
-            if (strict) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " allocation mismatch!\n",
-                        sectors_to_bytes(sector_num));
-                goto out;
-            }
-
-            if (allocated1) {
-                ret = check_empty_sectors(bs1, sector_num, nb_sectors,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(bs2, sector_num, nb_sectors,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 ": %s",
-                                 sectors_to_bytes(sector_num), strerror(-ret));
-                    ret = 4;
-                }
-                goto out;
-            }
+            qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    sectors_to_bytes(state.mismatch_sector));
         }
-        sector_num += nb_sectors;
-        qemu_progress_print(((float) nb_sectors / progress_base)*100, 100);
     }
+    if (ret) {
+        goto out;
+    }
+    sector_num = total_sectors;
 
     if (total_sectors1 != total_sectors2) {
         BlockDriverState *bs_over;
@@ -1143,7 +1353,7 @@ static int img_compare(int argc, char **argv)
             nb_sectors = pnum;
             if (ret) {
                 ret = check_empty_sectors(bs_over, sector_num, nb_sectors,
-                                          filename_over, buf1, quiet);
+                                          filename_over, buf, quiet);
                 if (ret) {
                     if (ret < 0) {
                         error_report("Error while reading offset %" PRId64
@@ -1164,8 +1374,7 @@ static int img_compare(int argc, char **argv)
 
 out:
     bdrv_unref(bs2);
-    qemu_vfree(buf1);
-    qemu_vfree(buf2);
+    qemu_vfree(buf);
 out2:
     bdrv_unref(bs1);
 out3:
@@ -1173,9 +1382,293 @@ out3:
     return ret;
 }
 
+/*
+ * Parallel conversion (-m): several coroutines each take the next chunk of
+ * the source, read it and write it to the target, so that many requests are
+ * in flight at once.  Unless -W is given, a coroutine waits for the chunks
+ * before its own to be written first, which keeps the target laid out
+ * sequentially.  Compressed qcow2 clusters are deflated in the thread pool,
+ * so every coroutine also acts as a compression worker.
+ */
+
+#define MAX_CONVERT_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool compressed;
+    bool target_has_backing;
+    bool has_zero_init;
+    bool wr_in_order;
+    int min_sparse;
+    int cluster_sectors;
+    int buf_sectors;
+    CoMutex lock;
+    int64_t sector_num;         /* next chunk to hand out */
+    int64_t wr_offs;            /* next chunk to write when in order */
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_CONVERT_COROUTINES];
+    int64_t wait_sector_num[MAX_CONVERT_COROUTINES];
+    int ret;
+} ImgConvertState;
+
+static int convert_find_source(ImgConvertState *s, int64_t sector_num,
+                               int64_t *src_offset)
+{
+    int src_cur = 0;
+
+    *src_offset = 0;
+    while (sector_num - *src_offset >= s->src_sectors[src_cur]) {
+        *src_offset += s->src_sectors[src_cur];
+        src_cur++;
+        assert(src_cur < s->src_num);
+    }
+    return src_cur;
+}
+
+/* Returns the length of the chunk starting at sector_num, and whether it
+ * can be skipped because the target already reads the same there. */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num,
+                                                  bool *skip)
+{
+    int64_t src_offset, ret;
+    int src_cur, n, n1;
+
+    *skip = false;
+    if (s->compressed) {
+        /* whole clusters, which may span several source images */
+        return MIN(s->total_sectors - sector_num, s->cluster_sectors);
+    }
+
+    src_cur = convert_find_source(s, sector_num, &src_offset);
+    n = MIN(MIN(s->total_sectors - sector_num, s->buf_sectors),
+            s->src_sectors[src_cur] - (sector_num - src_offset));
+
+    if (s->target_has_backing || s->has_zero_init) {
+        ret = bdrv_get_block_status(s->src[src_cur], sector_num - src_offset,
+                                    n, &n1);
+        if (ret < 0) {
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", sector_num - src_offset,
+                         strerror(-ret));
+            return ret;
+        }
+        /* Zeroes on a zero initialized target without a backing file, and
+         * unallocated sectors on a target sharing the source's backing
+         * file, need not be copied (see the sequential loop below). */
+        if ((s->has_zero_init && !s->target_has_backing &&
+             (ret & BDRV_BLOCK_ZERO)) ||
+            (s->target_has_backing && !(ret & BDRV_BLOCK_DATA))) {
+            *skip = true;
+            return n1;
+        }
+        n = n1;
+    }
+
+    /* round down to a cluster boundary, as in the sequential loop */
+    if (s->cluster_sectors > 0 && n >= s->cluster_sectors) {
+        int64_t next_aligned_sector = sector_num + n;
+        next_aligned_sector -= next_aligned_sector % s->cluster_sectors;
+        if (sector_num + n > next_aligned_sector) {
+            n = next_aligned_sector - sector_num;
+        }
+    }
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t src_offset;
+    int src_cur, n, ret;
+
+    while (nb_sectors > 0) {
+        src_cur = convert_find_source(s, sector_num, &src_offset);
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_offset, n,
+                            &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    if (s->compressed) {
+        if (buffer_is_zero(buf, nb_sectors * BDRV_SECTOR_SIZE)) {
+            return 0;
+        }
+        return bdrv_write_compressed(s->target, sector_num, buf, nb_sectors);
+    }
+
+    while (nb_sectors > 0) {
+        n = nb_sectors;
+        if (!s->has_zero_init ||
+            is_allocated_sectors_min(buf, nb_sectors, &n, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n << BDRV_SECTOR_BITS;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int64_t sector_num;
+    bool skip;
+    int i, n, ret;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    for (;;) {
+        /* Block status lookups may yield, so the chunk is handed out with
+         * the lock held; then the others can go on with the next ones. */
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num, &skip);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        sector_num = s->sector_num;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (!skip) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (!skip && s->ret == -EINPROGRESS) {
+            ret = convert_co_write(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while %s sector %" PRId64 ": %s",
+                             s->compressed ? "compressing" : "writing",
+                             sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+        qemu_progress_print(100.0 * (sector_num + n) / s->total_sectors, 0);
+
+        if (s->wr_in_order) {
+            /* Wake up the coroutine waiting for this chunk, if any.  It
+             * cannot be this one, whose wait_sector_num is -1. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    AioContext *ctx = bdrv_get_aio_context(s->target);
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->ret = -EINPROGRESS;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->wait_sector_num[i] = -1;
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        aio_poll(ctx, true);
+    }
+
+    if (s->compressed && !s->ret) {
+        /* signal EOF to align */
+        bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
     int c, n, n1, bs_n, bs_i, compress, cluster_sectors, skip_create;
+    int num_coroutines = 1;
+    bool wr_in_order = true;
     int64_t ret = 0;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
@@ -1204,7 +1697,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qnl:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qnl:m:W");
         if (c == -1) {
             break;
         }
@@ -1291,6 +1784,16 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+            if (parse_num_coroutines(optarg, MAX_CONVERT_COROUTINES,
+                                     &num_coroutines) < 0) {
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1514,6 +2017,48 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
+        /* Only qcow2 serializes concurrent compressed writes against its
+         * metadata updates */
+        if (strcmp(out_bs->drv->format_name, "qcow2")) {
+            num_coroutines = 1;
+        }
+    }
+
+    if (num_coroutines > 1) {
+        ImgConvertState state = {
+            .src = bs,
+            .src_num = bs_n,
+            .total_sectors = total_sectors,
+            .target = out_bs,
+            .compressed = compress,
+            .target_has_backing = !!out_baseimg,
+            .wr_in_order = wr_in_order,
+            .min_sparse = min_sparse,
+            .cluster_sectors = cluster_sectors,
+            .buf_sectors = bufsectors,
+            .num_coroutines = num_coroutines,
+        };
+
+        if (!compress) {
+            state.has_zero_init = min_sparse ? bdrv_has_zero_init(out_bs) : 0;
+            if (!state.has_zero_init &&
+                bdrv_can_write_zeroes_with_unmap(out_bs)) {
+                ret = bdrv_make_zero(out_bs, BDRV_REQ_MAY_UNMAP);
+                if (ret < 0) {
+                    goto out;
+                }
+                state.has_zero_init = true;
+            }
+        }
+
+        state.src_sectors = g_new(int64_t, bs_n);
+        for (bs_i = 0; bs_i < bs_n; bs_i++) {
+            bdrv_get_geometry(bs[bs_i], &bs_sectors);
+            state.src_sectors[bs_i] = bs_sectors;
+        }
+        ret = convert_do_copy(&state);
+        g_free(state.src_sectors);
+    } else if (compress) {
         sector_num = 0;
 
         nb_sectors = total_sectors;
@@ -1965,15 +2510,6 @@ static int img_info(int argc, char **argv)
 }
 
 
-typedef struct MapEntry {
-    int flags;
-    int depth;
-    int64_t start;
-    int64_t length;
-    int64_t offset;
-    BlockDriverState *bs;
-} MapEntry;
-
 static void dump_map_entry(OutputFormat output_format, MapEntry *e,
                            MapEntry *next)
 {
@@ -2016,43 +2552,163 @@ static void dump_map_entry(OutputFormat output_format, MapEntry *e,
     }
 }
 
-static int get_block_status(BlockDriverState *bs, int64_t sector_num,
-                            int nb_sectors, MapEntry *e)
+/*
+ * Map hands out regions of MAP_REGION_SECTORS to its coroutines.  Each one
+ * collects the extents of its region, then waits for the regions before it
+ * to be dumped, like the in-order writes of convert.
+ */
+
+#define MAP_REGION_SECTORS (1 << (30 - BDRV_SECTOR_BITS))
+
+typedef struct ImgMapState {
+    BlockDriverState *bs;
+    OutputFormat output_format;
+    int64_t total_sectors;
+    int64_t sector_num;         /* next region to hand out */
+    int64_t dump_sector_num;    /* next region to dump */
+    MapEntry curr;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_SCAN_COROUTINES];
+    int64_t wait_sector_num[MAX_SCAN_COROUTINES];
+    int ret;
+} ImgMapState;
+
+static bool map_entry_mergeable(const MapEntry *curr, const MapEntry *next)
 {
-    int64_t ret;
-    int depth;
+    return curr->length != 0 && curr->flags == next->flags &&
+           curr->depth == next->depth &&
+           ((curr->flags & BDRV_BLOCK_OFFSET_VALID) == 0 ||
+            curr->offset + curr->length == next->offset);
+}
 
-    /* As an optimization, we could cache the current range of unallocated
-     * clusters in each file of the chain, and avoid querying the same
-     * range repeatedly.
-     */
+static void map_add_entry(ImgMapState *s, MapEntry *next)
+{
+    if (map_entry_mergeable(&s->curr, next)) {
+        s->curr.length += next->length;
+        return;
+    }
 
-    depth = 0;
-    for (;;) {
-        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, &nb_sectors);
+    if (s->curr.length > 0) {
+        dump_map_entry(s->output_format, &s->curr, next);
+    }
+    s->curr = *next;
+}
+
+/* Collects the extents from sector_num to end, merging adjacent ones */
+static int coroutine_fn map_co_get_region(ImgMapState *s, int64_t sector_num,
+                                          int64_t end, MapEntry **entries,
+                                          int *max_entries)
+{
+    MapEntry e;
+    int nb_entries = 0;
+    int ret;
+
+    while (sector_num < end) {
+        ret = get_block_status(s->bs, sector_num, end - sector_num, &e);
         if (ret < 0) {
             return ret;
         }
-        assert(nb_sectors);
-        if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
-            break;
+        sector_num += e.length >> BDRV_SECTOR_BITS;
+
+        if (nb_entries > 0 &&
+            map_entry_mergeable(&(*entries)[nb_entries - 1], &e)) {
+            (*entries)[nb_entries - 1].length += e.length;
+            continue;
         }
-        bs = bs->backing_hd;
-        if (bs == NULL) {
-            ret = 0;
+        if (nb_entries == *max_entries) {
+            *max_entries = MAX(16, *max_entries * 2);
+            *entries = g_renew(MapEntry, *entries, *max_entries);
+        }
+        (*entries)[nb_entries++] = e;
+    }
+    return nb_entries;
+}
+
+static void coroutine_fn map_co_do_map(void *opaque)
+{
+    ImgMapState *s = opaque;
+    MapEntry *entries = NULL;
+    int64_t sector_num, end;
+    int i, nb_entries, max_entries = 0;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
             break;
         }
+    }
+    assert(index >= 0);
 
-        depth++;
+    s->running_coroutines++;
+
+    while (s->ret == -EINPROGRESS && s->sector_num < s->total_sectors) {
+        sector_num = s->sector_num;
+        end = MIN(s->total_sectors, sector_num + MAP_REGION_SECTORS);
+        s->sector_num = end;
+
+        nb_entries = map_co_get_region(s, sector_num, end, &entries,
+                                       &max_entries);
+        if (nb_entries < 0) {
+            error_report("Could not read file metadata: %s",
+                         strerror(-nb_entries));
+            s->ret = nb_entries;
+        }
+
+        while (s->dump_sector_num != sector_num && s->ret == -EINPROGRESS) {
+            s->wait_sector_num[index] = sector_num;
+            qemu_coroutine_yield();
+        }
+        s->wait_sector_num[index] = -1;
+
+        if (s->ret == -EINPROGRESS) {
+            for (i = 0; i < nb_entries; i++) {
+                map_add_entry(s, &entries[i]);
+            }
+        }
+
+        /* Wake up the coroutine waiting for the next region, if any */
+        s->dump_sector_num = end;
+        for (i = 0; i < s->num_coroutines; i++) {
+            if (s->co[i] && s->wait_sector_num[i] == end) {
+                qemu_coroutine_enter(s->co[i], NULL);
+                break;
+            }
+        }
     }
 
-    e->start = sector_num * BDRV_SECTOR_SIZE;
-    e->length = nb_sectors * BDRV_SECTOR_SIZE;
-    e->flags = ret & ~BDRV_BLOCK_OFFSET_MASK;
-    e->offset = ret & BDRV_BLOCK_OFFSET_MASK;
-    e->depth = depth;
-    e->bs = bs;
-    return 0;
+    g_free(entries);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+}
+
+static int map_do_map(ImgMapState *s)
+{
+    AioContext *ctx = bdrv_get_aio_context(s->bs);
+    int i;
+
+    s->sector_num = 0;
+    s->dump_sector_num = 0;
+    s->ret = -EINPROGRESS;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->wait_sector_num[i] = -1;
+        s->co[i] = qemu_coroutine_create(map_co_do_map);
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        aio_poll(ctx, true);
+    }
+    return s->ret;
 }
 
 static int img_map(int argc, char **argv)
@@ -2061,8 +2717,8 @@ static int img_map(int argc, char **argv)
     OutputFormat output_format = OFORMAT_HUMAN;
     BlockDriverState *bs;
     const char *filename, *fmt, *output;
-    int64_t length;
-    MapEntry curr = { .length = 0 }, next;
+    int num_coroutines = 1;
+    ImgMapState state;
     int ret = 0;
 
     fmt = NULL;
@@ -2075,7 +2731,7 @@ static int img_map(int argc, char **argv)
             {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "f:h",
+        c = getopt_long(argc, argv, "f:hm:",
                         long_options, &option_index);
         if (c == -1) {
             break;
@@ -2088,6 +2744,12 @@ static int img_map(int argc, char **argv)
         case 'f':
             fmt = optarg;
             break;
+        case 'm':
+            if (parse_num_coroutines(optarg, MAX_SCAN_COROUTINES,
+                                     &num_coroutines) < 0) {
+                return 1;
+            }
+            break;
         case OPTION_OUTPUT:
             output = optarg;
             break;
@@ -2116,41 +2778,18 @@ static int img_map(int argc, char **argv)
         printf("%-16s%-16s%-16s%s\n", "Offset", "Length", "Mapped to", "File");
     }
 
-    length = bdrv_getlength(bs);
-    while (curr.start + curr.length < length) {
-        int64_t nsectors_left;
-        int64_t sector_num;
-        int n;
-
-        sector_num = (curr.start + curr.length) >> BDRV_SECTOR_BITS;
-
-        /* Probe up to 1 GiB at a time.  */
-        nsectors_left = DIV_ROUND_UP(length, BDRV_SECTOR_SIZE) - sector_num;
-        n = MIN(1 << (30 - BDRV_SECTOR_BITS), nsectors_left);
-        ret = get_block_status(bs, sector_num, n, &next);
-
-        if (ret < 0) {
-            error_report("Could not read file metadata: %s", strerror(-ret));
-            goto out;
-        }
-
-        if (curr.length != 0 && curr.flags == next.flags &&
-            curr.depth == next.depth &&
-            ((curr.flags & BDRV_BLOCK_OFFSET_VALID) == 0 ||
-             curr.offset + curr.length == next.offset)) {
-            curr.length += next.length;
-            continue;
-        }
-
-        if (curr.length > 0) {
-            dump_map_entry(output_format, &curr, &next);
-        }
-        curr = next;
+    state = (ImgMapState) {
+        .bs             = bs,
+        .output_format  = output_format,
+        .total_sectors  = DIV_ROUND_UP(bdrv_getlength(bs), BDRV_SECTOR_SIZE),
+        .curr           = { .length = 0 },
+        .num_coroutines = num_coroutines,
+    };
+    ret = map_do_map(&state);
+    if (ret == 0) {
+        dump_map_entry(output_format, &state.curr, NULL);
     }
 
-    dump_map_entry(output_format, &curr, NULL);
-
-out:
     bdrv_unref(bs);
     return ret < 0;
 }
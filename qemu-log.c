@@ -19,12 +19,363 @@
 
 #include "qemu-common.h"
 #include "qemu/log.h"
+#include "qemu/atomic.h"
+#ifndef _WIN32
+#include <signal.h>
+#include <pthread.h>
+#endif
 
 static char *logfilename;
 FILE *qemu_logfile;
 int qemu_loglevel;
 static int log_append = 0;
 
+/*
+ * With -d async the log file is binary, and scripts/qemu-log-render.py
+ * renders it to the text that the log would have had otherwise.  Like the
+ * simple trace backend, every thread writes records into a ring of its own,
+ * which only it moves the head of, and a writeout thread moves the tails
+ * and appends what it took to the file.  The hot events (CPU_LOG_EXEC and
+ * the exceptions of CPU_LOG_INT) are written as a few words, to be
+ * formatted offline; everything else goes through qemu_logfile, which is
+ * an unbuffered stream whose writes become text records of the calling
+ * thread's ring, so that they stay in order with its other records.
+ *
+ * The records of a thread are in order in the file, but those of different
+ * threads are in chunks of the size the writeout thread takes at once.  A
+ * thread whose ring is full waits for the writeout thread rather than
+ * losing records.  Records are in host byte order, which the magic of the
+ * header tells.
+ */
+#define LOG_ASYNC_MAGIC 0x474f4c2d554d4551ULL   /* "QEMU-LOG" on little endian */
+#define LOG_ASYNC_VERSION 1
+
+enum {
+    LOG_REC_HEADER = 1,     /* magic, version */
+    LOG_REC_THREAD,         /* thread number, for the records that follow */
+    LOG_REC_STRING,         /* string number, then the string */
+    LOG_REC_TEXT,           /* text, padded with NULs */
+    LOG_REC_EXEC,           /* tc_ptr, pc */
+    LOG_REC_EXCEPTION,      /* exception number, string number of its name */
+};
+
+enum {
+    LOG_RING_LEN = 4096 * 64,
+    LOG_RING_FLUSH_THRESHOLD = LOG_RING_LEN / 4,
+    LOG_TEXT_MAX = 4096,
+};
+
+typedef struct LogRecord {
+    uint32_t type;
+    uint32_t length;        /* in bytes, header included, multiple of 8 */
+    uint64_t args[];
+} LogRecord;
+
+typedef struct LogRing {
+    uint8_t data[LOG_RING_LEN];
+    unsigned int head;      /* bytes written, moved by the owner thread */
+    unsigned int tail;      /* bytes written out, moved by the writeout */
+    uint32_t tid;           /* thread number, in order of the first record */
+    struct LogRing *next;
+} LogRing;
+
+static CompatGMutex log_lock;
+static CompatGCond log_available_cond;
+static CompatGCond log_empty_cond;
+static bool log_available;
+static bool log_writeout_enabled;
+static GThread *log_thread;
+
+static LogRing *log_rings;
+static uint32_t log_ring_count;
+static __thread LogRing *log_thread_ring;
+static FILE *log_async_fp;          /* the real file, for the writeout */
+static GHashTable *log_strings;     /* string pointer -> number + 1 */
+static LogRing *log_last_ring;      /* thread of the last record written */
+
+/* Allocate the ring of the calling thread, on its first record */
+static LogRing *log_ring_new(void)
+{
+    LogRing *r = g_try_new0(LogRing, 1);
+
+    if (!r) {
+        return NULL;
+    }
+    r->tid = atomic_fetch_add(&log_ring_count, 1);
+    do {
+        r->next = atomic_read(&log_rings);
+    } while (atomic_cmpxchg(&log_rings, r->next, r) != r->next);
+    log_thread_ring = r;
+    return r;
+}
+
+/* The indices run over the whole unsigned int, of which LOG_RING_LEN is a
+ * divisor, and wrap around the ring */
+static unsigned int log_ring_put(LogRing *r, unsigned int idx,
+                                 const void *data, size_t size)
+{
+    unsigned int pos = idx % LOG_RING_LEN;
+    size_t part = MIN(size, LOG_RING_LEN - pos);
+
+    memcpy(r->data + pos, data, part);
+    memcpy(r->data, (const uint8_t *)data + part, size - part);
+    return idx + size;
+}
+
+static void log_ring_get(LogRing *r, unsigned int idx, void *data,
+                         size_t size)
+{
+    unsigned int pos = idx % LOG_RING_LEN;
+    size_t part = MIN(size, LOG_RING_LEN - pos);
+
+    memcpy(data, r->data + pos, part);
+    memcpy((uint8_t *)data + part, r->data, size - part);
+}
+
+/**
+ * Kick the writeout thread
+ *
+ * @wait        Whether to wait until it has emptied the rings
+ */
+static void log_kick(bool wait)
+{
+    g_mutex_lock(&log_lock);
+    log_available = true;
+    g_cond_signal(&log_available_cond);
+
+    if (wait) {
+        g_cond_wait(&log_empty_cond, &log_lock);
+    }
+
+    g_mutex_unlock(&log_lock);
+}
+
+static void wait_for_log_records_available(void)
+{
+    g_mutex_lock(&log_lock);
+    while (!(log_available && log_writeout_enabled)) {
+        g_cond_signal(&log_empty_cond);
+        g_cond_wait(&log_available_cond, &log_lock);
+    }
+    log_available = false;
+    g_mutex_unlock(&log_lock);
+}
+
+/* Write a record of the calling thread to its ring */
+static void log_ring_record(uint32_t type, const uint64_t *args, int nargs,
+                            const void *text, size_t len)
+{
+    static const uint64_t zero;
+    LogRing *r = log_thread_ring;
+    LogRecord rec;
+    unsigned int head, used;
+
+    if (!r) {
+        r = log_ring_new();
+        if (!r) {
+            return;
+        }
+    }
+
+    rec.type = type;
+    rec.length = sizeof(rec) + nargs * sizeof(uint64_t) + ROUND_UP(len, 8);
+    while (r->head - atomic_read(&r->tail) + rec.length > LOG_RING_LEN) {
+        if (!atomic_read(&log_writeout_enabled)) {
+            return;
+        }
+        log_kick(true);
+    }
+
+    head = log_ring_put(r, r->head, &rec, sizeof(rec));
+    head = log_ring_put(r, head, args, nargs * sizeof(uint64_t));
+    head = log_ring_put(r, head, text, len);
+    head = log_ring_put(r, head, &zero, ROUND_UP(len, 8) - len);
+
+    used = r->head - atomic_read(&r->tail);
+    smp_wmb(); /* write barrier before publishing the record */
+    atomic_set(&r->head, head);
+
+    if (used <= LOG_RING_FLUSH_THRESHOLD &&
+        used + rec.length > LOG_RING_FLUSH_THRESHOLD) {
+        log_kick(false);
+    }
+}
+
+void qemu_log_async_exec(const void *tc_ptr, uint64_t pc)
+{
+    uint64_t args[2] = { (uintptr_t)tc_ptr, pc };
+
+    log_ring_record(LOG_REC_EXEC, args, 2, NULL, 0);
+}
+
+void qemu_log_async_exception(int idx, const char *name)
+{
+    uint64_t args[2] = { (int64_t)idx, (uintptr_t)name };
+
+    log_ring_record(LOG_REC_EXCEPTION, args, 2, NULL, 0);
+}
+
+/* Write a record to the file, from the writeout thread */
+static void log_file_record(uint32_t type, const uint64_t *args, int nargs,
+                            const char *text)
+{
+    static const uint64_t zero;
+    size_t len = text ? strlen(text) : 0;
+    LogRecord rec;
+
+    rec.type = type;
+    rec.length = sizeof(rec) + nargs * sizeof(uint64_t) + ROUND_UP(len, 8);
+    fwrite(&rec, sizeof(rec), 1, log_async_fp);
+    fwrite(args, sizeof(uint64_t), nargs, log_async_fp);
+    fwrite(text, 1, len, log_async_fp);
+    fwrite(&zero, 1, ROUND_UP(len, 8) - len, log_async_fp);
+}
+
+/* The strings of the records are static, and written once to the file */
+static uint64_t log_string_number(const char *s)
+{
+    gpointer n = g_hash_table_lookup(log_strings, s);
+    uint64_t args[1];
+
+    if (!n) {
+        args[0] = g_hash_table_size(log_strings);
+        n = GUINT_TO_POINTER(args[0] + 1);
+        g_hash_table_insert(log_strings, (gpointer)s, n);
+        log_file_record(LOG_REC_STRING, args, 1, s);
+    }
+    return GPOINTER_TO_UINT(n) - 1;
+}
+
+static void log_writeout_ring(LogRing *r)
+{
+    static uint64_t buf[LOG_RING_LEN / sizeof(uint64_t)];
+    unsigned int tail = r->tail;
+    unsigned int len = atomic_read(&r->head) - tail;
+    unsigned int off;
+    LogRecord *rec;
+    uint64_t tid;
+
+    if (!len) {
+        return;
+    }
+    smp_rmb(); /* read memory barrier before accessing the records */
+    log_ring_get(r, tail, buf, len);
+    smp_mb(); /* the records are copied before the space is reused */
+    atomic_set(&r->tail, tail + len);
+
+    if (r != log_last_ring) {
+        tid = r->tid;
+        log_file_record(LOG_REC_THREAD, &tid, 1, NULL);
+        log_last_ring = r;
+    }
+    for (off = 0; off < len; off += rec->length) {
+        rec = (LogRecord *)((uint8_t *)buf + off);
+        if (rec->type == LOG_REC_EXCEPTION) {
+            rec->args[1] = log_string_number((const char *)(uintptr_t)
+                                             rec->args[1]);
+        }
+        fwrite(rec, rec->length, 1, log_async_fp);
+    }
+}
+
+static gpointer log_writeout_thread(gpointer opaque)
+{
+    LogRing *r;
+
+    for (;;) {
+        wait_for_log_records_available();
+        for (r = atomic_read(&log_rings); r; r = r->next) {
+            log_writeout_ring(r);
+        }
+        fflush(log_async_fp);
+    }
+    return NULL;
+}
+
+#ifdef __GLIBC__
+/* qemu_logfile is unbuffered, so this gets the whole output of every
+ * fprintf() to it at once */
+static ssize_t log_async_cookie_write(void *opaque, const char *buf,
+                                      size_t size)
+{
+    size_t done, n;
+
+    for (done = 0; done < size; done += n) {
+        n = MIN(size - done, LOG_TEXT_MAX);
+        log_ring_record(LOG_REC_TEXT, NULL, 0, buf + done, n);
+    }
+    return size;
+}
+#endif
+
+/* Like the trace writeout thread, with signals blocked on POSIX hosts */
+static GThread *log_thread_create(GThreadFunc fn)
+{
+    GThread *thread;
+#ifndef _WIN32
+    sigset_t set, oldset;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+#endif
+
+    thread = g_thread_new("log-thread", fn, NULL);
+
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+
+    return thread;
+}
+
+/* Only called on glibc hosts, the others do not have fopencookie() */
+static void log_async_open(const char *mode)
+{
+#ifdef __GLIBC__
+    static const cookie_io_functions_t funcs = {
+        .write = log_async_cookie_write,
+    };
+#endif
+    uint64_t header[2] = { LOG_ASYNC_MAGIC, LOG_ASYNC_VERSION };
+
+    log_async_fp = fopen(logfilename, mode);
+    if (!log_async_fp) {
+        perror(logfilename);
+        _exit(1);
+    }
+    log_file_record(LOG_REC_HEADER, header, 2, NULL);
+    log_strings = g_hash_table_new(NULL, NULL);
+    log_last_ring = NULL;
+
+    if (!log_thread) {
+        log_thread = log_thread_create(log_writeout_thread);
+        atexit(qemu_log_close);
+    }
+#ifdef __GLIBC__
+    qemu_logfile = fopencookie(NULL, "w", funcs);
+#endif
+    setvbuf(qemu_logfile, NULL, _IONBF, 0);
+
+    /* Resume log writeout */
+    atomic_set(&log_writeout_enabled, true);
+    log_kick(false);
+}
+
+static void log_async_close(void)
+{
+    /* Halt log writeout once the rings are empty */
+    log_kick(true);
+    atomic_set(&log_writeout_enabled, false);
+    log_kick(true);
+
+    fclose(qemu_logfile);
+    qemu_logfile = NULL;
+    fclose(log_async_fp);
+    log_async_fp = NULL;
+    g_hash_table_destroy(log_strings);
+    log_strings = NULL;
+}
+
 void qemu_log(const char *fmt, ...)
 {
     va_list ap;
@@ -50,8 +401,29 @@ void qemu_log_mask(int mask, const char *fmt, ...)
 /* enable or disable low levels log */
 void do_qemu_set_log(int log_flags, bool use_own_buffers)
 {
+    if (log_flags & LOG_ASYNC) {
+#ifdef __GLIBC__
+        if (!logfilename) {
+            fprintf(stderr, "-d async needs a log file, given with -D\n");
+            log_flags &= ~LOG_ASYNC;
+        }
+#else
+        fprintf(stderr, "-d async is not supported on this host\n");
+        log_flags &= ~LOG_ASYNC;
+#endif
+    }
+    if (qemu_logfile && !(log_flags & LOG_ASYNC) != !log_async_fp) {
+        /* Switch between the text and the binary file */
+        qemu_log_close();
+    }
+
     qemu_loglevel = log_flags;
     if (qemu_loglevel && !qemu_logfile) {
+        if (qemu_loglevel & LOG_ASYNC) {
+            log_async_open(log_append ? "ab" : "wb");
+            log_append = 1;
+            return;
+        }
         if (logfilename) {
             qemu_logfile = fopen(logfilename, log_append ? "a" : "w");
             if (!qemu_logfile) {
@@ -82,6 +454,27 @@ void do_qemu_set_log(int log_flags, bool use_own_buffers)
     }
 }
 
+void qemu_log_flush(void)
+{
+    if (log_async_fp) {
+        log_kick(true);
+    } else {
+        fflush(qemu_logfile);
+    }
+}
+
+void qemu_log_close(void)
+{
+    if (log_async_fp) {
+        log_async_close();
+    } else if (qemu_logfile) {
+        if (qemu_logfile != stderr) {
+            fclose(qemu_logfile);
+        }
+        qemu_logfile = NULL;
+    }
+}
+
 void qemu_set_log_filename(const char *filename)
 {
     g_free(logfilename);
@@ -117,6 +510,9 @@ const QEMULogItem qemu_log_items[] = {
     { LOG_GUEST_ERROR, "guest_errors",
       "log when the guest OS does something invalid (eg accessing a\n"
       "non-existent register)" },
+    { LOG_ASYNC, "async",
+      "write the log to the -D file as binary records, from a background\n"
+      "thread; scripts/qemu-log-render.py renders it as text" },
     { 0, NULL, NULL },
 };
 
@@ -144,7 +540,10 @@ int qemu_str_to_log_mask(const char *str)
         }
         if (cmp1(p,p1-p,"all")) {
             for (item = qemu_log_items; item->mask != 0; item++) {
-                mask |= item->mask;
+                /* a way of writing the log, not something to log */
+                if (item->mask != LOG_ASYNC) {
+                    mask |= item->mask;
+                }
             }
         } else {
             for (item = qemu_log_items; item->mask != 0; item++) {
@@ -21,6 +21,8 @@
 #include "block/nbd.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "qemu/error-report.h"
 #include "block/snapshot.h"
 
@@ -41,8 +43,24 @@
 #define QEMU_NBD_OPT_CACHE   1
 #define QEMU_NBD_OPT_AIO     2
 #define QEMU_NBD_OPT_DISCARD 3
+#define QEMU_NBD_OPT_THREADS 4
 
-static NBDExport *exp;
+/* Each worker serves its share of the clients from a device of its own in an
+ * AioContext of its own.  The first worker is the main loop; the others have
+ * a thread each, which polls the AioContext while it does not hold its lock.
+ */
+typedef struct NBDWorker {
+    AioContext *ctx;
+    QemuThread thread;
+    bool stopping;
+    BlockDriverState *bs;
+    NBDExport *exp;
+} NBDWorker;
+
+static NBDWorker *workers;
+static int nb_workers = 1;
+static int next_worker;
+static int nb_exports;
 static int verbose;
 static char *srcpath;
 static char *sockpath;
@@ -67,6 +85,9 @@ static void usage(const char *name)
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent     don't exit on the last connection\n"
+"      --threads=NUM    serve the clients from NUM threads, each with its\n"
+"                       own instance of the device (default '1', more\n"
+"                       need --read-only)\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
 "Exposing part of the image:\n"
@@ -331,21 +352,41 @@ out:
     return (void *) EXIT_FAILURE;
 }
 
+static void *nbd_worker_run(void *opaque)
+{
+    NBDWorker *w = opaque;
+    bool blocking;
+
+    while (!w->stopping) {
+        aio_context_acquire(w->ctx);
+        blocking = true;
+        while (!w->stopping && aio_poll(w->ctx, blocking)) {
+            /* Progress was made, keep going */
+            blocking = false;
+        }
+        aio_context_release(w->ctx);
+    }
+    return NULL;
+}
+
 static int nbd_can_accept(void *opaque)
 {
-    return nb_fds < shared;
+    return atomic_read(&nb_fds) < shared;
 }
 
+/* Both callbacks below run in the thread of the client's worker */
 static void nbd_export_closed(NBDExport *exp)
 {
     assert(state == TERMINATING);
-    state = TERMINATED;
+    if (atomic_fetch_dec(&nb_exports) == 1) {
+        state = TERMINATED;
+        qemu_notify_event();
+    }
 }
 
 static void nbd_client_closed(NBDClient *client)
 {
-    nb_fds--;
-    if (nb_fds == 0 && !persistent && state == RUNNING) {
+    if (atomic_fetch_dec(&nb_fds) == 1 && !persistent && state == RUNNING) {
         state = TERMINATE;
     }
     qemu_notify_event();
@@ -357,6 +398,7 @@ static void nbd_accept(void *opaque)
     int server_fd = (uintptr_t) opaque;
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
+    NBDWorker *w;
 
     int fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
     if (fd < 0) {
@@ -369,17 +411,60 @@ static void nbd_accept(void *opaque)
         return;
     }
 
-    if (nbd_client_new(exp, fd, nbd_client_closed)) {
-        nb_fds++;
-    } else {
+    w = &workers[next_worker];
+    next_worker = (next_worker + 1) % nb_workers;
+
+    /* Counted first, as the client may close in its worker's thread as soon
+     * as the lock is released */
+    atomic_inc(&nb_fds);
+    aio_context_acquire(w->ctx);
+    if (!nbd_client_new(w->exp, fd, nbd_client_closed)) {
+        atomic_dec(&nb_fds);
         shutdown(fd, 2);
         close(fd);
     }
+    aio_context_release(w->ctx);
 }
 
-int main(int argc, char **argv)
+static BlockDriverState *nbd_open_image(const char *name, const char *path,
+                                        int flags, BlockDriver *drv,
+                                        QemuOpts *sn_opts,
+                                        const char *sn_id_or_name)
 {
     BlockDriverState *bs;
+    Error *local_err = NULL;
+    int ret = 0;
+
+    bs = bdrv_new(name, &error_abort);
+
+    ret = bdrv_open(&bs, path, NULL, NULL, flags, drv, &local_err);
+    if (ret < 0) {
+        errno = -ret;
+        err(EXIT_FAILURE, "Failed to bdrv_open '%s': %s", path,
+            error_get_pretty(local_err));
+    }
+
+    if (sn_opts) {
+        ret = bdrv_snapshot_load_tmp(bs,
+                                     qemu_opt_get(sn_opts, SNAPSHOT_OPT_ID),
+                                     qemu_opt_get(sn_opts, SNAPSHOT_OPT_NAME),
+                                     &local_err);
+    } else if (sn_id_or_name) {
+        ret = bdrv_snapshot_load_tmp_by_id_or_name(bs, sn_id_or_name,
+                                                   &local_err);
+    }
+    if (ret < 0) {
+        errno = -ret;
+        err(EXIT_FAILURE,
+            "Failed to load snapshot: %s",
+            error_get_pretty(local_err));
+    }
+
+    return bs;
+}
+
+int main(int argc, char **argv)
+{
     BlockDriver *drv;
     off_t dev_offset = 0;
     uint32_t nbdflags = 0;
@@ -414,6 +499,7 @@ int main(int argc, char **argv)
         { "format", 1, NULL, 'f' },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
+        { "threads", 1, NULL, QEMU_NBD_OPT_THREADS },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -424,6 +510,7 @@ int main(int argc, char **argv)
     int partition = -1;
     int ret;
     int fd;
+    int i;
     bool seen_cache = false;
     bool seen_discard = false;
 #ifdef CONFIG_LINUX_AIO
@@ -431,7 +518,6 @@ int main(int argc, char **argv)
 #endif
     pthread_t client_thread;
     const char *fmt = NULL;
-    Error *local_err = NULL;
 
     /* The client thread uses SIGTERM to interrupt the server.  A signal
      * handler ensures that "qemu-nbd -v -c" exits with a nice status code.
@@ -553,6 +639,15 @@ int main(int argc, char **argv)
 	case 't':
 	    persistent = 1;
 	    break;
+        case QEMU_NBD_OPT_THREADS:
+            nb_workers = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid number of threads '%s'", optarg);
+            }
+            if (nb_workers < 1) {
+                errx(EXIT_FAILURE, "Number of threads must be greater than 0");
+            }
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -576,6 +671,12 @@ int main(int argc, char **argv)
              argv[0]);
     }
 
+    /* The threads each write through a device of their own, which would
+     * corrupt the metadata of the image */
+    if (nb_workers > 1 && (flags & BDRV_O_RDWR)) {
+        errx(EXIT_FAILURE, "--threads greater than 1 needs --read-only");
+    }
+
     if (disconnect) {
         fd = open(argv[optind], O_RDWR);
         if (fd < 0) {
@@ -660,43 +761,45 @@ int main(int argc, char **argv)
         drv = NULL;
     }
 
-    bs = bdrv_new("hda", &error_abort);
-
     srcpath = argv[optind];
-    ret = bdrv_open(&bs, srcpath, NULL, NULL, flags, drv, &local_err);
-    if (ret < 0) {
-        errno = -ret;
-        err(EXIT_FAILURE, "Failed to bdrv_open '%s': %s", argv[optind],
-            error_get_pretty(local_err));
-    }
+    workers = g_new0(NBDWorker, nb_workers);
+    for (i = 0; i < nb_workers; i++) {
+        char name[16] = "hda";
 
-    if (sn_opts) {
-        ret = bdrv_snapshot_load_tmp(bs,
-                                     qemu_opt_get(sn_opts, SNAPSHOT_OPT_ID),
-                                     qemu_opt_get(sn_opts, SNAPSHOT_OPT_NAME),
-                                     &local_err);
-    } else if (sn_id_or_name) {
-        ret = bdrv_snapshot_load_tmp_by_id_or_name(bs, sn_id_or_name,
-                                                   &local_err);
-    }
-    if (ret < 0) {
-        errno = -ret;
-        err(EXIT_FAILURE,
-            "Failed to load snapshot: %s",
-            error_get_pretty(local_err));
+        if (i) {
+            snprintf(name, sizeof(name), "hda%d", i);
+        }
+        workers[i].bs = nbd_open_image(name, srcpath, flags, drv, sn_opts,
+                                       sn_id_or_name);
     }
 
-    fd_size = bdrv_getlength(bs);
+    fd_size = bdrv_getlength(workers[0].bs);
 
     if (partition != -1) {
-        ret = find_partition(bs, partition, &dev_offset, &fd_size);
+        ret = find_partition(workers[0].bs, partition, &dev_offset, &fd_size);
         if (ret < 0) {
             errno = -ret;
             err(EXIT_FAILURE, "Could not find partition %d", partition);
         }
     }
 
-    exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
+    for (i = 0; i < nb_workers; i++) {
+        NBDWorker *w = &workers[i];
+
+        if (i == 0) {
+            w->ctx = qemu_get_aio_context();
+        } else {
+            w->ctx = aio_context_new();
+            bdrv_set_aio_context(w->bs, w->ctx);
+        }
+        w->exp = nbd_export_new(w->bs, dev_offset, fd_size, nbdflags,
+                                nbd_export_closed);
+        nb_exports++;
+        if (i) {
+            qemu_thread_create(&w->thread, "nbd-worker", nbd_worker_run, w,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
@@ -735,13 +838,26 @@ int main(int argc, char **argv)
         main_loop_wait(false);
         if (state == TERMINATE) {
             state = TERMINATING;
-            nbd_export_close(exp);
-            nbd_export_put(exp);
-            exp = NULL;
+            for (i = 0; i < nb_workers; i++) {
+                NBDWorker *w = &workers[i];
+
+                aio_context_acquire(w->ctx);
+                nbd_export_close(w->exp);
+                nbd_export_put(w->exp);
+                w->exp = NULL;
+                aio_context_release(w->ctx);
+            }
         }
     } while (state != TERMINATED);
 
-    bdrv_close(bs);
+    for (i = 1; i < nb_workers; i++) {
+        workers[i].stopping = true;
+        aio_notify(workers[i].ctx);
+        qemu_thread_join(&workers[i].thread);
+    }
+    for (i = 0; i < nb_workers; i++) {
+        bdrv_close(workers[i].bs);
+    }
     if (sockpath) {
         unlink(sockpath);
     }
@@ -35,7 +35,8 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                dma-bounce-buffers=n number of DMA transfers to MMIO in flight (default: 8)\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -58,6 +59,10 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item dma-bounce-buffers=@var{n}
+Sets how many page-sized buffers are available to stage DMA to and from
+regions that are not RAM, such as peripheral registers.  Transfers beyond
+this number wait for one of them to complete.  The default is 8.
 @end table
 ETEXI
 
@@ -3011,17 +3016,36 @@ re-inject them.
 ETEXI
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [N|auto]\n" \
+    "-icount [N|auto][,sleep=on|off][,split=on|off]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
-    "                instruction\n", QEMU_ARCH_ALL)
+    "                instruction; with sleep=off idle time is skipped; with\n" \
+    "                split=off blocks are not retranslated around I/O\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [@var{N}|auto]
+@item -icount [@var{N}|auto][,sleep=on|off][,split=on|off]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
 then the virtual cpu speed will be automatically adjusted to keep virtual
 time within a few seconds of real time.
 
+With @option{sleep=off}, when the virtual cpu is idle (for example in a
+WFI or HLT instruction) virtual time jumps straight to the next timer
+deadline instead of advancing in step with real time.  This makes idle
+guests run much faster and keeps their timing independent of the host,
+which is useful for long deterministic soak tests.  It cannot be combined
+with @code{auto}.
+
+By default, a translated block that performs memory-mapped I/O before its
+last instruction is retranslated to end on the I/O access, so that the
+access sees the exact instruction count.  Guests that access devices every
+few instructions spend most of their time in the translator.  With
+@option{split=off}, the block keeps running and the count of the
+instructions after the access is subtracted from the virtual clock during
+the access, which is as precise for the device but much cheaper.  An
+interrupt raised by the access is then taken at the end of the block.
+This is only implemented for 32-bit ARM guests; other blocks are still
+retranslated.
+
 Note that while this option can give deterministic behavior, it does not
 provide cycle accurate emulation.  Modern CPUs contain superscalar out of
 order cores with complex cache hierarchies.  The number of instructions
@@ -3130,6 +3154,33 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-hot-count", HAS_ARG, QEMU_OPTION_tb_hot_count, \
+    "-tb-hot-count n retranslate a TB after n entries with extra optimization\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-hot-count @var{n}
+@findex -tb-hot-count
+Translate a block again once it has been entered @var{n} times from the
+main loop.  The second translation follows forward direct branches within
+the page and removes redundant loads and stores of CPU state fields.  The
+default of 0 disables this.
+ETEXI
+
+DEF("tb-coverage", HAS_ARG, QEMU_OPTION_tb_coverage, \
+    "-tb-coverage file\n"
+    "                write the guest code ranges which were executed to file at exit\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-coverage @var{file}
+@findex -tb-coverage
+Record which translated blocks are executed, with one store at the start
+of each block, and write the guest address ranges they cover to @var{file}
+at exit, sorted and merged, one @code{start end} pair (end excluded, in
+hex) per line.  The addresses can be given to @command{addr2line} to get
+the source lines which were run.  A block which raised an exception
+part way through counts as executed in full.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
@@ -3191,6 +3242,19 @@ STEXI
 @findex -semihosting
 Semihosting mode (ARM, M68K, Xtensa only).
 ETEXI
+DEF("startup-profile", 0, QEMU_OPTION_startup_profile,
+    "-startup-profile\n"
+    "                print the time taken by each phase of start-up\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -startup-profile
+@findex -startup-profile
+Print on stderr how long QEMU took to parse its options and open the
+backends, to initialize the machine, to create the other devices and the
+displays, to load the ROMs and reset, and then to translate the first block
+of guest code.  With @option{-S}, the last phase includes the time until
+the guest is started.
+ETEXI
 DEF("old-param", 0, QEMU_OPTION_old_param,
     "-old-param      old param mode\n", QEMU_ARCH_ARM)
 STEXI
@@ -684,6 +684,34 @@ Example:
 -> { "execute": "migrate-set-cache-size", "arguments": { "value": 536870912 } }
 <- { "return": {} }
 
+EQMP
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+migrate-set-parameters
+----------------------
+
+Set the parameters of the "compress" migration capability, for the next
+migration
+
+Arguments:
+
+- "compress-level": zlib level, 0 to 9 (json-int, optional)
+- "compress-threads": compression threads on the source, 1 to 255
+  (json-int, optional)
+- "decompress-threads": decompression threads on the destination, 1 to 255
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-parameters",
+     "arguments": { "compress-level": 1, "compress-threads": 4 } }
+<- { "return": {} }
+
 EQMP
     {
         .name       = "query-migrate-cache-size",
@@ -791,8 +819,8 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?",
-        .params     = "-p protocol [begin] [length] [format]",
+        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?,detach:b?",
+        .params     = "-p protocol [begin] [length] [format] [detach]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
         .mhandler.cmd_new = qmp_marshal_input_dump_guest_memory,
@@ -816,6 +844,8 @@ Arguments:
 - "format": the format of guest memory dump. It's optional, and can be
             elf|kdump-zlib|kdump-lzo|kdump-snappy, but non-elf formats will
             conflict with paging and filter, ie. begin and length (json-string)
+- "detach": return at once and dump in the background, see query-dump.
+            The guest stays stopped until the dump is done (json-bool)
 
 Example:
 
@@ -826,6 +856,33 @@ Notes:
 
 (1) All boolean arguments default to false
 
+EQMP
+
+    {
+        .name       = "query-dump",
+        .args_type  = "",
+        .params     = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dump,
+    },
+
+SQMP
+query-dump
+----------
+
+Show the progress of the last guest memory dump.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "completed": bytes of guest memory dumped so far (json-int)
+- "total": bytes of guest memory in the dump (json-int)
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "completed": 1073741824,
+                 "total": 4294967296 } }
+
 EQMP
 
     {
@@ -1708,6 +1765,42 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Start collecting latency histograms of the requests to a block drive, which
+are then reported by query-blockstats.  Setting a histogram resets its counts.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": boundaries between the bins in nano-seconds, positive and
+                strictly increasing, for all request types
+                (json-array of json-int, optional)
+- "boundaries-read": boundaries for reads (json-array of json-int, optional)
+- "boundaries-write": boundaries for writes (json-array of json-int, optional)
+- "boundaries-flush": boundaries for cache flushes
+                      (json-array of json-int, optional)
+
+Histograms of a request type with no boundaries given are left alone, unless
+no boundaries are given at all: then all histograms of the drive are removed.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": [ 100000, 1000000, 10000000 ] } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2262,6 +2355,25 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "l2_cache_hits": L2 table lookups served from the qcow2 metadata
+                       cache (json-int, optional)
+    - "l2_cache_misses": L2 table lookups that loaded a table into the
+                         qcow2 metadata cache (json-int, optional)
+    - "refcount_cache_hits": refcount block lookups served from the qcow2
+                             metadata cache (json-int, optional)
+    - "refcount_cache_misses": refcount block lookups that loaded a block
+                               into the qcow2 metadata cache
+                               (json-int, optional)
+    - "rd_latency_histogram": latency histogram of the reads, see
+                              block-latency-histogram-set (json-object,
+                              optional)
+        - "boundaries": boundaries between the bins in nano-seconds
+                        (json-array of json-int)
+        - "bins": number of requests in each bin (json-array of json-int)
+    - "wr_latency_histogram": latency histogram of the writes (json-object,
+                              optional)
+    - "flush_latency_histogram": latency histogram of the cache flushes
+                                 (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -3054,7 +3166,10 @@ The main json-object contains the following:
          - "cache-size": XBZRLE cache size in bytes
          - "bytes": number of bytes transferred for XBZRLE compressed pages
          - "pages": number of XBZRLE compressed pages
+         - "cache-hit": number of XBRZRLE page cache hits
          - "cache-miss": number of XBRZRLE page cache misses
+         - "cache-eviction": number of XBRZRLE cached pages replaced by
+           another page
          - "cache-miss-rate": rate of XBRZRLE page cache misses
          - "overflow": number of times XBZRLE overflows.  This means
            that the XBZRLE encoding was bigger than just sent the
@@ -3163,7 +3278,9 @@ Examples:
             "cache-size":67108864,
             "bytes":20971520,
             "pages":2444343,
+            "cache-hit":2440099,
             "cache-miss":2244,
+            "cache-eviction":1023,
             "cache-miss-rate":0.123,
             "overflow":34434
          }
@@ -3755,3 +3872,358 @@ Example:
 <- { "return": {} }
 
 EQMP
+
+#if defined TARGET_ARM
+    {
+        .name       = "query-stm32-clocks",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_stm32_clocks,
+    },
+#endif
+
+SQMP
+query-stm32-clocks
+------------------
+
+Return the state of every STM32 clock.
+
+Each clock is returned as a json-object with the following information:
+
+- "path": QOM path of the clock (json-string)
+- "name": clock name (json-string)
+- "output-freq": output frequency in Hz (json-int)
+- "enabled": whether the clock output is enabled (json-bool)
+- "selected-input": name of the selected input clock, if any (json-string,
+  optional)
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "query-stm32-clocks" }
+<- { "return": [
+       { "path": "/machine/stm32/rcc/HSI", "name": "HSI",
+         "output-freq": 8000000, "enabled": true },
+       { "path": "/machine/stm32/rcc/HSI_div2", "name": "HSI/2",
+         "output-freq": 4000000, "enabled": true,
+         "selected-input": "HSI" }
+   ]}
+
+EQMP
+
+    {
+        .name       = "query-mmio-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_mmio_stats,
+    },
+
+SQMP
+query-mmio-stats
+----------------
+
+Return the access statistics of every MMIO memory region which has been
+accessed, most expensive first.
+
+Each region is returned as a json-object with the following information:
+
+- "name": memory region name (json-string)
+- "path": QOM path of the memory region, if it has an owner (json-string,
+  optional)
+- "reads": number of reads (json-int)
+- "writes": number of writes (json-int)
+- "read-ns": host nanoseconds spent in reads (json-int)
+- "write-ns": host nanoseconds spent in writes (json-int)
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "query-mmio-stats" }
+<- { "return": [
+       { "name": "stm32-timer", "reads": 120311, "writes": 52,
+         "read-ns": 9102334, "write-ns": 4310 },
+       { "name": "armv7m_nvic", "reads": 2210, "writes": 1904,
+         "read-ns": 190220, "write-ns": 288901 }
+   ]}
+
+EQMP
+
+    {
+        .name       = "checkpoint-save",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_checkpoint_save,
+    },
+
+SQMP
+checkpoint-save
+---------------
+
+Save the state of the devices and the contents of RAM to memory, replacing
+the previous checkpoint.  After the first checkpoint, only the RAM pages
+written since the last checkpoint-save or checkpoint-restore are copied.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "checkpoint-save" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "checkpoint-restore",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_checkpoint_restore,
+    },
+
+SQMP
+checkpoint-restore
+------------------
+
+Put the devices and RAM back into the state saved by the last
+checkpoint-save.  Only the RAM pages written since then are copied back.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "checkpoint-restore" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "event-filter",
+        .args_type  = "event:s,enable:b?,rate:i?,key:s?",
+        .mhandler.cmd_new = qmp_marshal_input_event_filter,
+    },
+
+SQMP
+event-filter
+------------
+
+Set how the events of one type are sent to this monitor, until its client
+disconnects.  The events can be dropped, or limited to one batch every
+"rate" milliseconds, in which only the latest event is sent for each value
+of the "key" member of the event data.  This applies on top of the global
+rate limits of events such as RTC_CHANGE.
+
+Arguments:
+
+- "event": event name (json-string)
+- "enable": false to drop the event (json-bool, optional)
+- "rate": minimum time in milliseconds between two batches, 0 for no
+          limit (json-int, optional)
+- "key": event data member telling apart the events coalesced in a batch,
+         "" for none (json-string, optional)
+
+Example:
+
+-> { "execute": "event-filter",
+     "arguments": { "event": "LED_CHANGE", "rate": 100, "key": "led" } }
+<- { "return": {} }
+
+EQMP
+
+#if defined TARGET_ARM
+    {
+        .name       = "irq-latency-enable",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_irq_latency_enable,
+    },
+#endif
+
+SQMP
+irq-latency-enable
+------------------
+
+Start or stop collecting interrupt latency statistics on every ARMv7-M
+NVIC.  Starting clears the previous statistics.
+
+Arguments:
+
+- "enable": true to start, false to stop (json-bool)
+
+Example:
+
+-> { "execute": "irq-latency-enable", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+#if defined TARGET_ARM
+    {
+        .name       = "query-irq-latency",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_irq_latency,
+    },
+#endif
+
+SQMP
+query-irq-latency
+-----------------
+
+Return the latency statistics of each interrupt which has been pending or
+entered since the statistics were started, in virtual time.
+
+Each interrupt is returned as a json-object with the following information:
+
+- "nvic": QOM path of the NVIC (json-string)
+- "irq": interrupt number, as CMSIS IRQn (json-int)
+- "pend", "run": pending to entry and entry to exit latencies, each a
+  json-object with
+  - "count": number of latencies (json-int)
+  - "min-ns", "max-ns", "total-ns": shortest, longest and sum (json-int)
+  - "histogram": counts per power of 2 of nanoseconds (json-array)
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "query-irq-latency" }
+<- { "return": [
+       { "nvic": "/machine/stm32/nvic", "irq": 38,
+         "pend": { "count": 2, "min-ns": 83, "max-ns": 97, "total-ns": 180,
+                   "histogram": [ 0, 0, 0, 0, 0, 0, 2 ] },
+         "run": { "count": 2, "min-ns": 2125, "max-ns": 2208,
+                  "total-ns": 4333,
+                  "histogram": [ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 ] } }
+   ]}
+
+EQMP
+
+    {
+        .name       = "memory-read",
+        .args_type  = "addr:l,size:i",
+        .mhandler.cmd_new = qmp_marshal_input_memory_read,
+    },
+
+SQMP
+memory-read
+-----------
+
+Read a range of guest physical RAM or ROM, and return it base64 encoded.
+Device registers are not read.
+
+Arguments:
+
+- "addr": the physical address of the first byte (json-int)
+- "size": the number of bytes, from 1 to 65536 (json-int)
+
+Example:
+
+-> { "execute": "memory-read",
+             "arguments": { "addr": 536870912, "size": 8 } }
+<- { "return": "AQAAAOgDAAA=" }
+
+EQMP
+
+    {
+        .name       = "memory-watch",
+        .args_type  = "id:s,addr:l,size:i,interval:i",
+        .mhandler.cmd_new = qmp_marshal_input_memory_watch,
+    },
+
+SQMP
+memory-watch
+------------
+
+Compare a range of guest RAM or ROM with its previous contents every
+interval of virtual time, and send a MEMORY_CHANGE event with the new
+contents when they differ.  The first comparison always sends the event.
+A watch with the same id is replaced.
+
+Arguments:
+
+- "id": the name of the watch, which the events carry (json-string)
+- "addr": the physical address of the first byte (json-int)
+- "size": the number of bytes, from 1 to 65536 (json-int)
+- "interval": milliseconds of virtual time between comparisons (json-int)
+
+Example:
+
+-> { "execute": "memory-watch",
+             "arguments": { "id": "ticks", "addr": 536870912, "size": 4,
+                            "interval": 100 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "memory-unwatch",
+        .args_type  = "id:s",
+        .mhandler.cmd_new = qmp_marshal_input_memory_unwatch,
+    },
+
+SQMP
+memory-unwatch
+--------------
+
+Remove a watch set up by memory-watch.
+
+Arguments:
+
+- "id": the name of the watch (json-string)
+
+Example:
+
+-> { "execute": "memory-unwatch", "arguments": { "id": "ticks" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-jit-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_jit_stats,
+    },
+
+SQMP
+query-jit-stats
+---------------
+
+Return the statistics of the TCG translation cache and the counters of the
+execution loop of each CPU, from the start.  "info jit" shows the same.
+
+Return a json-object with:
+
+- "tbs", "max-tbs": TBs in the cache and its capacity (json-int)
+- "tbs-translated", "tbs-invalidated": TBs translated and invalidated
+  (json-int)
+- "flushes": times the cache was emptied, "flushes-full" of which because
+  it was full (json-int)
+- "evictions": times a part of the cache was emptied because it was full
+  (json-int)
+- "code-size", "code-buffer-size": bytes of generated code and size of the
+  code buffer (json-int)
+- "cpus": a json-array of json-objects, one per CPU, with:
+  - "cpu": the CPU index (json-int)
+  - "jmp-cache-misses": lookups which missed the jump cache (json-int)
+  - "find-slow-hits", "find-slow-misses": of those, the TB was found or
+    translated (json-int)
+  - "chained-jumps": direct jumps patched between TBs (json-int)
+  - "exits-unchained": TBs which returned to the execution loop (json-int)
+  - "exits-interrupt", "exits-icount", "exits-exception": chains of TBs
+    left for an interrupt, the end of the icount budget and a guest
+    exception (json-int)
+  - "io-recompiles": TBs translated again to end on a device access
+    (json-int)
+
+Example:
+
+-> { "execute": "query-jit-stats" }
+<- { "return": { "tbs": 1542, "max-tbs": 65536, "tbs-translated": 1620,
+                 "tbs-invalidated": 78, "flushes": 0, "flushes-full": 0,
+                 "evictions": 0, "code-size": 412016,
+                 "code-buffer-size": 33554432,
+                 "cpus": [ { "cpu": 0, "jmp-cache-misses": 3310,
+                             "find-slow-hits": 1690,
+                             "find-slow-misses": 1620,
+                             "chained-jumps": 2054,
+                             "exits-unchained": 812277,
+                             "exits-interrupt": 10213, "exits-icount": 0,
+                             "exits-exception": 4471,
+                             "io-recompiles": 0 } ] } }
+
+EQMP
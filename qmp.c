@@ -30,6 +30,7 @@
 #include "qom/object_interfaces.h"
 #include "hw/mem/pc-dimm.h"
 #include "hw/acpi/acpi_dev_interface.h"
+#include "sysemu/dump.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -157,6 +158,9 @@ void qmp_cont(Error **errp)
         return;
     } else if (runstate_check(RUN_STATE_SUSPENDED)) {
         return;
+    } else if (dump_in_progress()) {
+        error_setg(errp, "The guest memory is being dumped, see query-dump");
+        return;
     }
 
     for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
@@ -11,9 +11,6 @@
  *
  */
 
-#include "qapi/qmp/qlist.h"
-#include "qapi/qmp/qint.h"
-#include "qapi/qmp/qdict.h"
 #include "qemu-common.h"
 #include "qapi/qmp/json-lexer.h"
 #include "qapi/qmp/json-streamer.h"
@@ -21,13 +18,69 @@
 #define MAX_TOKEN_SIZE (64ULL << 20)
 #define MAX_NESTING (1ULL << 10)
 
-static void json_message_process_token(JSONLexer *lexer, QString *token, JSONTokenType type, int x, int y)
+/* Tokens are carved out of chunks that are kept from one message to the
+ * next, so a typical QMP command is split into tokens without touching
+ * the allocator at all. */
+#define TOKEN_CHUNK_SIZE 4096
+
+struct JSONTokenChunk {
+    JSONTokenChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static JSONToken *json_message_alloc_token(JSONMessageParser *parser,
+                                           size_t len)
+{
+    JSONTokenChunk *chunk = parser->chunks;
+    size_t size = QEMU_ALIGN_UP(sizeof(JSONToken) + len + 1, sizeof(void *));
+    JSONToken *token;
+
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = MAX(size, TOKEN_CHUNK_SIZE);
+
+        chunk = g_malloc(sizeof(*chunk) + chunk_size);
+        chunk->next = parser->chunks;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        parser->chunks = chunk;
+    }
+
+    token = (JSONToken *)(chunk->data + chunk->used);
+    chunk->used += size;
+    return token;
+}
+
+/* Forget the tokens of the last message.  Only the first chunk is kept,
+ * and only if it has the usual size, so that one huge message does not
+ * pin its memory forever. */
+static void json_message_reset_tokens(JSONMessageParser *parser)
+{
+    JSONTokenChunk *chunk = parser->chunks;
+    JSONTokenChunk *next;
+
+    while (chunk && (chunk->next || chunk->size > TOKEN_CHUNK_SIZE)) {
+        next = chunk->next;
+        g_free(chunk);
+        chunk = next;
+    }
+    if (chunk) {
+        chunk->used = 0;
+    }
+    parser->chunks = chunk;
+    parser->tokens = NULL;
+    parser->tokens_tail = &parser->tokens;
+    parser->token_size = 0;
+}
+
+static void json_message_process_token(JSONLexer *lexer, GString *input, JSONTokenType type, int x, int y)
 {
     JSONMessageParser *parser = container_of(lexer, JSONMessageParser, lexer);
-    QDict *dict;
+    JSONToken *token;
 
     if (type == JSON_OPERATOR) {
-        switch (qstring_get_str(token)[0]) {
+        switch (input->str[0]) {
         case '{':
             parser->brace_count++;
             break;
@@ -45,16 +98,17 @@ static void json_message_process_token(JSONLexer *lexer, QString *token, JSONTok
         }
     }
 
-    dict = qdict_new();
-    qdict_put(dict, "type", qint_from_int(type));
-    QINCREF(token);
-    qdict_put(dict, "token", token);
-    qdict_put(dict, "x", qint_from_int(x));
-    qdict_put(dict, "y", qint_from_int(y));
+    token = json_message_alloc_token(parser, input->len);
+    token->next = NULL;
+    token->type = type;
+    token->x = x;
+    token->y = y;
+    memcpy(token->str, input->str, input->len + 1);
 
-    parser->token_size += token->length;
+    parser->token_size += input->len;
 
-    qlist_append(parser->tokens, dict);
+    *parser->tokens_tail = token;
+    parser->tokens_tail = &token->next;
 
     if (type == JSON_ERROR) {
         goto out_emit_bad;
@@ -78,28 +132,23 @@ out_emit_bad:
     /* clear out token list and tell the parser to emit and error
      * indication by passing it a NULL list
      */
-    QDECREF(parser->tokens);
     parser->tokens = NULL;
 out_emit:
     /* send current list of tokens to parser and reset tokenizer */
     parser->brace_count = 0;
     parser->bracket_count = 0;
     parser->emit(parser, parser->tokens);
-    if (parser->tokens) {
-        QDECREF(parser->tokens);
-    }
-    parser->tokens = qlist_new();
-    parser->token_size = 0;
+    json_message_reset_tokens(parser);
 }
 
 void json_message_parser_init(JSONMessageParser *parser,
-                              void (*func)(JSONMessageParser *, QList *))
+                              void (*func)(JSONMessageParser *, JSONToken *))
 {
     parser->emit = func;
     parser->brace_count = 0;
     parser->bracket_count = 0;
-    parser->tokens = qlist_new();
-    parser->token_size = 0;
+    parser->chunks = NULL;
+    json_message_reset_tokens(parser);
 
     json_lexer_init(&parser->lexer, json_message_process_token);
 }
@@ -117,6 +166,12 @@ int json_message_parser_flush(JSONMessageParser *parser)
 
 void json_message_parser_destroy(JSONMessageParser *parser)
 {
+    JSONTokenChunk *chunk, *next;
+
     json_lexer_destroy(&parser->lexer);
-    QDECREF(parser->tokens);
+    for (chunk = parser->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        g_free(chunk);
+    }
+    parser->chunks = NULL;
 }
@@ -28,7 +28,7 @@ typedef struct JSONParsingState
     QObject *result;
 } JSONParsingState;
 
-static void parse_json(JSONMessageParser *parser, QList *tokens)
+static void parse_json(JSONMessageParser *parser, JSONToken *tokens)
 {
     JSONParsingState *s = container_of(parser, JSONParsingState, parser);
     s->result = json_parser_parse(tokens, s->ap);
@@ -70,6 +70,58 @@ QObject *qobject_from_jsonf(const char *string, ...)
     return obj;
 }
 
+static void qjsontext_destroy_obj(QObject *obj);
+
+static const QType qjsontext_type = {
+    .code = QTYPE_QJSONTEXT,
+    .destroy = qjsontext_destroy_obj,
+};
+
+/**
+ * qjsontext_from_qstring(): Create a new QJsonText from JSON text
+ *
+ * The reference to @text is taken over.
+ *
+ * Return strong reference.
+ */
+QJsonText *qjsontext_from_qstring(QString *text)
+{
+    QJsonText *qjt;
+
+    qjt = g_malloc(sizeof(*qjt));
+    qjt->text = text;
+    QOBJECT_INIT(qjt, &qjsontext_type);
+
+    return qjt;
+}
+
+/**
+ * qobject_to_qjsontext(): Convert a QObject into a QJsonText
+ */
+QJsonText *qobject_to_qjsontext(const QObject *obj)
+{
+    if (qobject_type(obj) != QTYPE_QJSONTEXT) {
+        return NULL;
+    }
+
+    return container_of(obj, QJsonText, base);
+}
+
+const char *qjsontext_get_str(const QJsonText *qjt)
+{
+    return qstring_get_str(qjt->text);
+}
+
+static void qjsontext_destroy_obj(QObject *obj)
+{
+    QJsonText *qjt;
+
+    assert(obj != NULL);
+    qjt = qobject_to_qjsontext(obj);
+    QDECREF(qjt->text);
+    g_free(qjt);
+}
+
 typedef struct ToJsonIterState
 {
     int indent;
@@ -80,6 +132,80 @@ typedef struct ToJsonIterState
 
 static void to_json(const QObject *obj, QString *str, int pretty, int indent);
 
+/* Appends ptr as a JSON string */
+void qjson_append_str(QString *str, const char *ptr)
+{
+    int cp;
+    char buf[16];
+    char *end;
+
+    qstring_append(str, "\"");
+
+    for (; *ptr; ptr = end) {
+        cp = mod_utf8_codepoint(ptr, 6, &end);
+        switch (cp) {
+        case '\"':
+            qstring_append(str, "\\\"");
+            break;
+        case '\\':
+            qstring_append(str, "\\\\");
+            break;
+        case '\b':
+            qstring_append(str, "\\b");
+            break;
+        case '\f':
+            qstring_append(str, "\\f");
+            break;
+        case '\n':
+            qstring_append(str, "\\n");
+            break;
+        case '\r':
+            qstring_append(str, "\\r");
+            break;
+        case '\t':
+            qstring_append(str, "\\t");
+            break;
+        default:
+            if (cp < 0) {
+                cp = 0xFFFD; /* replacement character */
+            }
+            if (cp > 0xFFFF) {
+                /* beyond BMP; need a surrogate pair */
+                snprintf(buf, sizeof(buf), "\\u%04X\\u%04X",
+                         0xD800 + ((cp - 0x10000) >> 10),
+                         0xDC00 + ((cp - 0x10000) & 0x3FF));
+            } else if (cp < 0x20 || cp >= 0x7F) {
+                snprintf(buf, sizeof(buf), "\\u%04X", cp);
+            } else {
+                buf[0] = cp;
+                buf[1] = 0;
+            }
+            qstring_append(str, buf);
+        }
+    };
+
+    qstring_append(str, "\"");
+}
+
+void qjson_append_number(QString *str, double value)
+{
+    char buffer[1024];
+    int len;
+
+    len = snprintf(buffer, sizeof(buffer), "%f", value);
+    while (len > 0 && buffer[len - 1] == '0') {
+        len--;
+    }
+
+    if (len && buffer[len - 1] == '.') {
+        buffer[len - 1] = 0;
+    } else {
+        buffer[len] = 0;
+    }
+
+    qstring_append(str, buffer);
+}
+
 static void to_json_dict_iter(const char *key, QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
@@ -135,58 +261,8 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
     }
     case QTYPE_QSTRING: {
         QString *val = qobject_to_qstring(obj);
-        const char *ptr;
-        int cp;
-        char buf[16];
-        char *end;
-
-        ptr = qstring_get_str(val);
-        qstring_append(str, "\"");
-
-        for (; *ptr; ptr = end) {
-            cp = mod_utf8_codepoint(ptr, 6, &end);
-            switch (cp) {
-            case '\"':
-                qstring_append(str, "\\\"");
-                break;
-            case '\\':
-                qstring_append(str, "\\\\");
-                break;
-            case '\b':
-                qstring_append(str, "\\b");
-                break;
-            case '\f':
-                qstring_append(str, "\\f");
-                break;
-            case '\n':
-                qstring_append(str, "\\n");
-                break;
-            case '\r':
-                qstring_append(str, "\\r");
-                break;
-            case '\t':
-                qstring_append(str, "\\t");
-                break;
-            default:
-                if (cp < 0) {
-                    cp = 0xFFFD; /* replacement character */
-                }
-                if (cp > 0xFFFF) {
-                    /* beyond BMP; need a surrogate pair */
-                    snprintf(buf, sizeof(buf), "\\u%04X\\u%04X",
-                             0xD800 + ((cp - 0x10000) >> 10),
-                             0xDC00 + ((cp - 0x10000) & 0x3FF));
-                } else if (cp < 0x20 || cp >= 0x7F) {
-                    snprintf(buf, sizeof(buf), "\\u%04X", cp);
-                } else {
-                    buf[0] = cp;
-                    buf[1] = 0;
-                }
-                qstring_append(str, buf);
-            }
-        };
 
-        qstring_append(str, "\"");
+        qjson_append_str(str, qstring_get_str(val));
         break;
     }
     case QTYPE_QDICT: {
@@ -229,21 +305,8 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
     }
     case QTYPE_QFLOAT: {
         QFloat *val = qobject_to_qfloat(obj);
-        char buffer[1024];
-        int len;
 
-        len = snprintf(buffer, sizeof(buffer), "%f", qfloat_get_double(val));
-        while (len > 0 && buffer[len - 1] == '0') {
-            len--;
-        }
-
-        if (len && buffer[len - 1] == '.') {
-            buffer[len - 1] = 0;
-        } else {
-            buffer[len] = 0;
-        }
-        
-        qstring_append(str, buffer);
+        qjson_append_number(str, qfloat_get_double(val));
         break;
     }
     case QTYPE_QBOOL: {
@@ -256,6 +319,9 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
         }
         break;
     }
+    case QTYPE_QJSONTEXT:
+        qstring_append(str, qjsontext_get_str(qobject_to_qjsontext(obj)));
+        break;
     case QTYPE_QERROR:
         /* XXX: should QError be emitted? */
     case QTYPE_NONE:
@@ -249,7 +249,15 @@ static void cpu_common_reset(CPUState *cpu)
     cpu->icount_extra = 0;
     cpu->icount_decr.u32 = 0;
     cpu->can_do_io = 0;
-    memset(cpu->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
+    cpu_tb_jmp_cache_clear(cpu);
+}
+
+void cpu_tb_jmp_cache_set_direct(CPUState *cpu)
+{
+    g_free(cpu->tb_jmp_cache);
+    cpu->tb_jmp_cache = g_new0(struct TranslationBlock *,
+                               TB_JMP_CACHE_DIRECT_SIZE);
+    cpu->tb_jmp_cache_direct = true;
 }
 
 static bool cpu_common_has_work(CPUState *cs)
@@ -314,6 +322,14 @@ static void cpu_common_initfn(Object *obj)
     CPUClass *cc = CPU_GET_CLASS(obj);
 
     cpu->gdb_num_regs = cpu->gdb_num_g_regs = cc->gdb_num_core_regs;
+    cpu->tb_jmp_cache = g_new0(struct TranslationBlock *, TB_JMP_CACHE_SIZE);
+}
+
+static void cpu_common_finalize(Object *obj)
+{
+    CPUState *cpu = CPU(obj);
+
+    g_free(cpu->tb_jmp_cache);
 }
 
 static int64_t cpu_common_get_arch_id(CPUState *cpu)
@@ -353,6 +369,7 @@ static const TypeInfo cpu_type_info = {
     .parent = TYPE_DEVICE,
     .instance_size = sizeof(CPUState),
     .instance_init = cpu_common_initfn,
+    .instance_finalize = cpu_common_finalize,
     .abstract = true,
     .class_size = sizeof(CPUClass),
     .class_init = cpu_class_init,
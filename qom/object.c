@@ -362,6 +362,7 @@ static void object_property_del_all(Object *obj)
         ObjectProperty *prop = QTAILQ_FIRST(&obj->properties);
 
         QTAILQ_REMOVE(&obj->properties, prop, node);
+        g_hash_table_remove(obj->property_table, prop->name);
 
         if (prop->release) {
             prop->release(obj, prop->name, prop->opaque);
@@ -371,6 +372,11 @@ static void object_property_del_all(Object *obj)
         g_free(prop->type);
         g_free(prop);
     }
+
+    if (obj->property_table) {
+        g_hash_table_destroy(obj->property_table);
+        obj->property_table = NULL;
+    }
 }
 
 static void object_property_del_child(Object *obj, Object *child, Error **errp)
@@ -739,13 +745,11 @@ object_property_add(Object *obj, const char *name, const char *type,
 {
     ObjectProperty *prop;
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
-            error_setg(errp, "attempt to add duplicate property '%s'"
-                       " to object (type '%s')", name,
-                       object_get_typename(obj));
-            return NULL;
-        }
+    if (object_property_find(obj, name, NULL) != NULL) {
+        error_setg(errp, "attempt to add duplicate property '%s'"
+                   " to object (type '%s')", name,
+                   object_get_typename(obj));
+        return NULL;
     }
 
     prop = g_malloc0(sizeof(*prop));
@@ -758,6 +762,14 @@ object_property_add(Object *obj, const char *name, const char *type,
     prop->release = release;
     prop->opaque = opaque;
 
+    /* The list keeps properties in the order they were added, for
+     * qom-list and friends; the table, keyed by the name the property
+     * owns, serves lookups.  It is only created for objects that get
+     * properties at all. */
+    if (!obj->property_table) {
+        obj->property_table = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    g_hash_table_insert(obj->property_table, prop->name, prop);
     QTAILQ_INSERT_TAIL(&obj->properties, prop, node);
     return prop;
 }
@@ -765,16 +777,15 @@ object_property_add(Object *obj, const char *name, const char *type,
 ObjectProperty *object_property_find(Object *obj, const char *name,
                                      Error **errp)
 {
-    ObjectProperty *prop;
+    ObjectProperty *prop = NULL;
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
-            return prop;
-        }
+    if (obj->property_table) {
+        prop = g_hash_table_lookup(obj->property_table, name);
     }
-
-    error_setg(errp, "Property '.%s' not found", name);
-    return NULL;
+    if (prop == NULL) {
+        error_setg(errp, "Property '.%s' not found", name);
+    }
+    return prop;
 }
 
 void object_property_del(Object *obj, const char *name, Error **errp)
@@ -789,6 +800,11 @@ void object_property_del(Object *obj, const char *name, Error **errp)
     }
 
     QTAILQ_REMOVE(&obj->properties, prop, node);
+    g_hash_table_remove(obj->property_table, prop->name);
+    if (QTAILQ_EMPTY(&obj->properties)) {
+        g_hash_table_destroy(obj->property_table);
+        obj->property_table = NULL;
+    }
 
     g_free(prop->name);
     g_free(prop->type);
@@ -114,12 +114,27 @@ static bool qtest_opened;
  *  > write ADDR SIZE DATA
  *  < OK
  *
+ *  > bread ADDR SIZE
+ *  < OK SIZE
+ *  < RAW
+ *
+ *  > bwrite ADDR SIZE
+ *  > RAW
+ *  < OK
+ *
  * ADDR, SIZE, VALUE are all integers parsed with strtoul() with a base of 0.
  *
  * DATA is an arbitrarily long hex number prefixed with '0x'.  If it's smaller
  * than the expected size, the value will be zero filled at the end of the data
  * sequence.
  *
+ * RAW is exactly SIZE bytes of binary data following the newline, with no
+ * newline of its own, so that large buffers are not sent as hex.
+ *
+ * The requests are processed in the order they arrive and each gets exactly
+ * one response, so a client may send many of them in one message and read
+ * the responses afterwards.
+ *
  * IRQ management:
  *
  *  > irq_intercept_in QOM-PATH ID-NUM
@@ -214,14 +229,8 @@ static void qtest_irq_handler(void *opaque, int n, int level)
                level ? "raise" : "lower", intercept_data->id, n);
 }
 
-static void qtest_process_command(CharDriverState *chr, gchar **words)
+static void qtest_log_request(gchar **words)
 {
-    const gchar *command;
-
-    g_assert(words);
-
-    command = words[0];
-
     if (qtest_log_fp) {
         qemu_timeval tv;
         int i;
@@ -234,6 +243,17 @@ static void qtest_process_command(CharDriverState *chr, gchar **words)
         }
         fprintf(qtest_log_fp, "\n");
     }
+}
+
+static void qtest_process_command(CharDriverState *chr, gchar **words)
+{
+    const gchar *command;
+
+    g_assert(words);
+
+    command = words[0];
+
+    qtest_log_request(words);
 
     g_assert(command);
     if (strcmp(words[0], "irq_intercept_out") == 0
@@ -414,6 +434,22 @@ static void qtest_process_command(CharDriverState *chr, gchar **words)
         }
         qtest_send(chr, "\n");
 
+        g_free(data);
+    } else if (strcmp(words[0], "bread") == 0) {
+        uint64_t addr, len;
+        uint8_t *data;
+
+        g_assert(words[1] && words[2]);
+        addr = strtoull(words[1], NULL, 0);
+        len = strtoull(words[2], NULL, 0);
+
+        data = g_malloc(len);
+        cpu_physical_memory_read(addr, data, len);
+
+        qtest_send_prefix(chr);
+        qtest_send(chr, "OK 0x%" PRIx64 "\n", len);
+        qemu_chr_fe_write_all(chr, data, len);
+
         g_free(data);
     } else if (strcmp(words[0], "write") == 0) {
         uint64_t addr, len, i;
@@ -469,11 +505,35 @@ static void qtest_process_command(CharDriverState *chr, gchar **words)
     }
 }
 
+/* bwrite is handled here rather than in qtest_process_command(), because its
+ * data follows the command line in the input buffer.  Returns false if the
+ * data has not all arrived yet. */
+static bool qtest_process_bwrite(CharDriverState *chr, GString *inbuf,
+                                 gchar **words, size_t offset)
+{
+    uint64_t addr, len;
+
+    g_assert(words[1] && words[2]);
+    addr = strtoull(words[1], NULL, 0);
+    len = strtoull(words[2], NULL, 0);
+    if (inbuf->len - offset - 1 < len) {
+        return false;
+    }
+
+    qtest_log_request(words);
+    cpu_physical_memory_write(addr, inbuf->str + offset + 1, len);
+    g_string_erase(inbuf, 0, offset + 1 + len);
+
+    qtest_send_prefix(chr);
+    qtest_send(chr, "OK\n");
+    return true;
+}
+
 static void qtest_process_inbuf(CharDriverState *chr, GString *inbuf)
 {
     char *end;
 
-    while ((end = strchr(inbuf->str, '\n')) != NULL) {
+    while ((end = memchr(inbuf->str, '\n', inbuf->len)) != NULL) {
         size_t offset;
         GString *cmd;
         gchar **words;
@@ -481,13 +541,19 @@ static void qtest_process_inbuf(CharDriverState *chr, GString *inbuf)
         offset = end - inbuf->str;
 
         cmd = g_string_new_len(inbuf->str, offset);
-        g_string_erase(inbuf, 0, offset + 1);
-
         words = g_strsplit(cmd->str, " ", 0);
-        qtest_process_command(chr, words);
-        g_strfreev(words);
-
         g_string_free(cmd, TRUE);
+
+        if (words[0] && strcmp(words[0], "bwrite") == 0) {
+            if (!qtest_process_bwrite(chr, inbuf, words, offset)) {
+                g_strfreev(words);
+                break;
+            }
+        } else {
+            g_string_erase(inbuf, 0, offset + 1);
+            qtest_process_command(chr, words);
+        }
+        g_strfreev(words);
     }
 }
 
@@ -37,11 +37,14 @@
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
 #include "exec/memory.h"
+#include "exec/exec-all.h"
+#include "exec/ram_addr.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
+#include "block/coroutine.h"
 
 
 #ifndef ETH_P_RARP
@@ -115,26 +118,133 @@ void qemu_announce_self(void)
 /***********************************************************/
 /* savevm/loadvm support */
 
-static ssize_t block_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
-                                   int64_t pos)
+/* The vmstate is written in buffers of VMSTATE_WRITE_BUF_SIZE, each by a
+ * coroutine of its own, so that up to VMSTATE_WRITE_IN_FLIGHT of them are
+ * written at once while the next one fills.  The writes are asynchronous
+ * for qcow2; with other formats they still go one at a time, see
+ * bdrv_co_writev_vmstate(). */
+#define VMSTATE_WRITE_BUF_SIZE (1024 * 1024)
+#define VMSTATE_WRITE_IN_FLIGHT 8
+
+typedef struct BlockSaveFile {
+    BlockDriverState *bs;
+    uint8_t *buf;       /* the buffer being filled, or NULL */
+    int64_t buf_pos;    /* its position in the vmstate */
+    int buf_len;
+    int in_flight;
+    int ret;            /* the first error of a write */
+} BlockSaveFile;
+
+typedef struct BlockSaveWrite {
+    BlockSaveFile *s;
+    uint8_t *buf;
+    int64_t pos;
+    int len;
+} BlockSaveWrite;
+
+static void coroutine_fn block_save_write_co(void *opaque)
 {
-    int ret;
+    BlockSaveWrite *w = opaque;
+    BlockSaveFile *s = w->s;
     QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = w->buf,
+        .iov_len = w->len,
+    };
+    int ret;
 
-    qemu_iovec_init_external(&qiov, iov, iovcnt);
-    ret = bdrv_writev_vmstate(opaque, &qiov, pos);
-    if (ret < 0) {
-        return ret;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_writev_vmstate(s->bs, &qiov, w->pos);
+    if (ret < 0 && !s->ret) {
+        s->ret = ret;
     }
+    s->in_flight--;
+    qemu_vfree(w->buf);
+    g_free(w);
+}
 
-    return qiov.size;
+static void block_save_wait(BlockSaveFile *s, int max_in_flight)
+{
+    while (s->in_flight > max_in_flight) {
+        aio_poll(bdrv_get_aio_context(s->bs), true);
+    }
 }
 
-static int block_put_buffer(void *opaque, const uint8_t *buf,
-                           int64_t pos, int size)
+static void block_save_submit(BlockSaveFile *s)
 {
-    bdrv_save_vmstate(opaque, buf, pos, size);
-    return size;
+    BlockSaveWrite *w = g_new(BlockSaveWrite, 1);
+    Coroutine *co;
+
+    /* Whole sectors, which only the last buffer needs padding to; the
+     * padding is past the vmstate size recorded in the snapshot */
+    w->s = s;
+    w->buf = s->buf;
+    w->pos = s->buf_pos;
+    w->len = ROUND_UP(s->buf_len, BDRV_SECTOR_SIZE);
+    memset(w->buf + s->buf_len, 0, w->len - s->buf_len);
+
+    s->buf = NULL;
+    s->buf_pos += s->buf_len;
+    s->buf_len = 0;
+
+    block_save_wait(s, VMSTATE_WRITE_IN_FLIGHT - 1);
+    s->in_flight++;
+    co = qemu_coroutine_create(block_save_write_co);
+    qemu_coroutine_enter(co, w);
+}
+
+static ssize_t block_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                   int64_t pos)
+{
+    BlockSaveFile *s = opaque;
+    ssize_t done = 0;
+    int i;
+
+    assert(pos == s->buf_pos + s->buf_len);
+    for (i = 0; i < iovcnt; i++) {
+        uint8_t *base = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        while (len) {
+            size_t n;
+
+            if (s->ret < 0) {
+                return s->ret;
+            }
+            if (!s->buf) {
+                s->buf = qemu_blockalign(s->bs, VMSTATE_WRITE_BUF_SIZE);
+            }
+            n = MIN(len, VMSTATE_WRITE_BUF_SIZE - s->buf_len);
+            memcpy(s->buf + s->buf_len, base, n);
+            s->buf_len += n;
+            base += n;
+            len -= n;
+            done += n;
+            if (s->buf_len == VMSTATE_WRITE_BUF_SIZE) {
+                block_save_submit(s);
+            }
+        }
+    }
+    return done;
+}
+
+static int block_save_close(void *opaque)
+{
+    BlockSaveFile *s = opaque;
+    int ret;
+
+    if (s->buf_len) {
+        block_save_submit(s);
+    }
+    block_save_wait(s, 0);
+    qemu_vfree(s->buf);
+
+    ret = s->ret;
+    if (!ret) {
+        ret = bdrv_flush(s->bs);
+    }
+    g_free(s);
+    return ret;
 }
 
 static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
@@ -153,15 +263,17 @@ static const QEMUFileOps bdrv_read_ops = {
 };
 
 static const QEMUFileOps bdrv_write_ops = {
-    .put_buffer     = block_put_buffer,
     .writev_buffer  = block_writev_buffer,
-    .close          = bdrv_fclose
+    .close          = block_save_close
 };
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
     if (is_writable) {
-        return qemu_fopen_ops(bs, &bdrv_write_ops);
+        BlockSaveFile *s = g_new0(BlockSaveFile, 1);
+
+        s->bs = bs;
+        return qemu_fopen_ops(s, &bdrv_write_ops);
     }
     return qemu_fopen_ops(bs, &bdrv_read_ops);
 }
@@ -690,13 +802,135 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+/* With many small devices, most of the downtime goes into serialising
+ * each of them, so past SAVEVM_PARALLEL_MIN_SECTIONS sections the device
+ * state is saved by several threads, each section into its own buffer, and
+ * the buffers are written in section order.  The VM is stopped, and a
+ * VMStateDescription (with its pre_save hook) only touches its own device.
+ * The old style save_state handlers make no such promise; they run first,
+ * in this thread, before the others start.
+ */
+#define SAVEVM_PARALLEL_MIN_SECTIONS 32
+#define SAVEVM_PARALLEL_MAX_THREADS 8
+#define SAVEVM_SECTIONS_PER_THREAD 16
+
+typedef struct SaveVMParallel {
+    SaveStateEntry **entries;
+    GByteArray **bufs;
+    int count;
+    int next;       /* next section to save, atomic */
+} SaveVMParallel;
+
+static int savevm_buffer_put(void *opaque, const uint8_t *buf, int64_t pos,
+                             int size)
+{
+    g_byte_array_append(opaque, buf, size);
+    return size;
+}
+
+static const QEMUFileOps savevm_buffer_ops = {
+    .put_buffer = savevm_buffer_put,
+};
+
+static void vmstate_save_to_buffer(SaveStateEntry *se, GByteArray *buf)
+{
+    QEMUFile *f = qemu_fopen_ops(buf, &savevm_buffer_ops);
+
+    vmstate_save(f, se);
+    qemu_fclose(f);
+}
+
+static void *vmstate_save_worker(void *opaque)
+{
+    SaveVMParallel *p = opaque;
+    int i;
+
+    while ((i = atomic_fetch_inc(&p->next)) < p->count) {
+        if (p->entries[i]->vmsd) {
+            vmstate_save_to_buffer(p->entries[i], p->bufs[i]);
+        }
+    }
+    return NULL;
+}
+
+static void vmstate_save_sections(QEMUFile *f, SaveStateEntry **entries,
+                                  int count)
+{
+    SaveVMParallel p = { .entries = entries, .count = count };
+    QemuThread threads[SAVEVM_PARALLEL_MAX_THREADS];
+    int i, nthreads = 0;
+
+    if (count >= SAVEVM_PARALLEL_MIN_SECTIONS) {
+        nthreads = MIN(count / SAVEVM_SECTIONS_PER_THREAD,
+                       SAVEVM_PARALLEL_MAX_THREADS);
+#ifdef _SC_NPROCESSORS_ONLN
+        nthreads = MIN(nthreads, sysconf(_SC_NPROCESSORS_ONLN));
+#else
+        nthreads = 1;
+#endif
+        /* This thread is one of them */
+        nthreads--;
+    }
+
+    if (nthreads > 0) {
+        p.bufs = g_new(GByteArray *, count);
+        for (i = 0; i < count; i++) {
+            p.bufs[i] = g_byte_array_new();
+            if (!entries[i]->vmsd) {
+                vmstate_save_to_buffer(entries[i], p.bufs[i]);
+            }
+        }
+        for (i = 0; i < nthreads; i++) {
+            qemu_thread_create(&threads[i], "savevm", vmstate_save_worker, &p,
+                               QEMU_THREAD_JOINABLE);
+        }
+        vmstate_save_worker(&p);
+        for (i = 0; i < nthreads; i++) {
+            qemu_thread_join(&threads[i]);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        SaveStateEntry *se = entries[i];
+        int len;
+
+        trace_savevm_section_start(se->idstr, se->section_id);
+        /* Section type */
+        qemu_put_byte(f, QEMU_VM_SECTION_FULL);
+        qemu_put_be32(f, se->section_id);
+
+        /* ID string */
+        len = strlen(se->idstr);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)se->idstr, len);
+
+        qemu_put_be32(f, se->instance_id);
+        qemu_put_be32(f, se->version_id);
+
+        if (p.bufs) {
+            qemu_put_buffer(f, p.bufs[i]->data, p.bufs[i]->len);
+            g_byte_array_free(p.bufs[i], TRUE);
+        } else {
+            vmstate_save(f, se);
+        }
+        trace_savevm_section_end(se->idstr, se->section_id);
+    }
+    g_free(p.bufs);
+}
+
+/* The milliseconds spent completing the live sections and saving the
+ * device state are stored in live_ms and devices_ms, if not NULL. */
+void qemu_savevm_state_complete(QEMUFile *f, int64_t *live_ms,
+                                int64_t *devices_ms)
 {
     SaveStateEntry *se;
-    int ret;
+    SaveStateEntry **entries;
+    int64_t start_time, live_time;
+    int ret, count;
 
     trace_savevm_state_complete();
 
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
@@ -720,32 +954,32 @@ void qemu_savevm_state_complete(QEMUFile *f)
             return;
         }
     }
+    live_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
+    count = 0;
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        count++;
+    }
+    entries = g_new(SaveStateEntry *, count);
+    count = 0;
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
-        int len;
-
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
-        trace_savevm_section_start(se->idstr, se->section_id);
-        /* Section type */
-        qemu_put_byte(f, QEMU_VM_SECTION_FULL);
-        qemu_put_be32(f, se->section_id);
-
-        /* ID string */
-        len = strlen(se->idstr);
-        qemu_put_byte(f, len);
-        qemu_put_buffer(f, (uint8_t *)se->idstr, len);
-
-        qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
-
-        vmstate_save(f, se);
-        trace_savevm_section_end(se->idstr, se->section_id);
+        entries[count++] = se;
     }
+    vmstate_save_sections(f, entries, count);
+    g_free(entries);
 
     qemu_put_byte(f, QEMU_VM_EOF);
     qemu_fflush(f);
+
+    if (live_ms) {
+        *live_ms = live_time - start_time;
+    }
+    if (devices_ms) {
+        *devices_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - live_time;
+    }
 }
 
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
@@ -803,7 +1037,7 @@ static int qemu_savevm_state(QEMUFile *f)
 
     ret = qemu_file_get_error(f);
     if (ret == 0) {
-        qemu_savevm_state_complete(f);
+        qemu_savevm_state_complete(f, NULL, NULL);
         ret = qemu_file_get_error(f);
     }
     if (ret != 0) {
@@ -1039,17 +1273,198 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+/* Creates the snapshots of all images once the vmstate is in bs */
+static void savevm_create_snapshots(Monitor *mon, BlockDriverState *bs,
+                                    QEMUSnapshotInfo *sn,
+                                    uint64_t vm_state_size)
+{
+    BlockDriverState *bs1;
+    int ret;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
+                               bdrv_get_device_name(bs1));
+            }
+        }
+    }
+}
+
+static void savevm_set_time(QEMUSnapshotInfo *sn, qemu_timeval *tv)
+{
+    qemu_gettimeofday(tv);
+    sn->date_sec = tv->tv_sec;
+    sn->date_nsec = tv->tv_usec * 1000;
+    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+}
+
+/* Live savevm (savevm -l) saves RAM while the guest runs, a round of
+ * qemu_savevm_state_iterate() at a time from a timer of the main loop,
+ * the way the migration thread does.  The VM only stops for the last
+ * round and the devices, when what is left of RAM would take less than
+ * the migration downtime to write.  The monitor is suspended meanwhile. */
+
+/* Guest time between two rounds */
+#define SAVEVM_LIVE_DELAY_MS 10
+/* The most a round writes */
+#define SAVEVM_LIVE_ROUND_SIZE (64 * 1024 * 1024)
+/* After which the guest stops whatever is left, if it dirties RAM faster
+ * than it can be written */
+#define SAVEVM_LIVE_MAX_ROUNDS 1000
+
+static struct {
+    Monitor *mon;
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    QEMUFile *f;
+    QEMUTimer *timer;
+    Error *blocker;
+    int rounds;
+    uint64_t bytes;         /* written by the rounds */
+    int64_t time_ms;        /* spent in the rounds */
+} savevm_live;
+
+static void savevm_live_end(int ret)
+{
+    Monitor *mon = savevm_live.mon;
+    uint64_t vm_state_size;
+    int saved_vm_running;
+    int close_ret;
+    qemu_timeval tv;
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+    savevm_set_time(&savevm_live.sn, &tv);
+
+    if (ret == 0) {
+        qemu_savevm_state_complete(savevm_live.f, NULL, NULL);
+        ret = qemu_file_get_error(savevm_live.f);
+    }
+    if (ret != 0) {
+        qemu_savevm_state_cancel();
+    }
+    vm_state_size = qemu_ftell(savevm_live.f);
+    /* The last writes of the pipeline only report errors here */
+    close_ret = qemu_fclose(savevm_live.f);
+    if (ret == 0) {
+        ret = close_ret;
+    }
+
+    if (ret < 0) {
+        monitor_printf(mon, "Error %d while writing VM\n", ret);
+    } else {
+        savevm_create_snapshots(mon, savevm_live.bs, &savevm_live.sn,
+                                vm_state_size);
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+    timer_free(savevm_live.timer);
+    migrate_del_blocker(savevm_live.blocker);
+    error_free(savevm_live.blocker);
+    memset(&savevm_live, 0, sizeof(savevm_live));
+    monitor_resume(mon);
+}
+
+static void savevm_live_round(void *opaque)
+{
+    QEMUFile *f = savevm_live.f;
+    int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t pos = qemu_ftell(f);
+    uint64_t bandwidth, max_size, pending;
+    int ret;
+
+    qemu_file_reset_rate_limit(f);
+    qemu_savevm_state_iterate(f);
+    ret = qemu_file_get_error(f);
+    if (ret != 0) {
+        savevm_live_end(ret);
+        return;
+    }
+
+    /* In bytes per ms, the write speed of the pipeline limiting it */
+    savevm_live.bytes += qemu_ftell(f) - pos;
+    savevm_live.time_ms += qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
+    bandwidth = savevm_live.bytes / MAX(savevm_live.time_ms, 1);
+    max_size = bandwidth * migrate_max_downtime() / 1000000;
+
+    /* ram_save_pending() takes the iothread lock to sync the dirty log */
+    qemu_mutex_unlock_iothread();
+    pending = qemu_savevm_state_pending(f, max_size);
+    qemu_mutex_lock_iothread();
+
+    if (pending <= max_size ||
+        ++savevm_live.rounds >= SAVEVM_LIVE_MAX_ROUNDS) {
+        savevm_live_end(0);
+        return;
+    }
+    timer_mod(savevm_live.timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + SAVEVM_LIVE_DELAY_MS);
+}
+
+static void savevm_live_start(Monitor *mon, BlockDriverState *bs,
+                              QEMUSnapshotInfo *sn)
+{
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    Error *err = NULL;
+
+    if (qemu_savevm_state_blocked(&err) ||
+        migration_is_active(migrate_get_current())) {
+        monitor_printf(mon, "%s\n", err ? error_get_pretty(err) :
+                       "Cannot save live while migrating");
+        error_free(err);
+        return;
+    }
+    if (monitor_suspend(mon) < 0) {
+        monitor_printf(mon, "Live savevm needs an interactive monitor\n");
+        return;
+    }
+
+    ram_lazy_load_flush();
+
+    savevm_live.mon = mon;
+    savevm_live.bs = bs;
+    savevm_live.sn = *sn;
+    savevm_live.f = qemu_fopen_bdrv(bs, 1);
+    savevm_live.timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                     savevm_live_round, NULL);
+    error_setg(&savevm_live.blocker, "A live savevm is in progress");
+    migrate_add_blocker(savevm_live.blocker);
+
+    qemu_file_set_rate_limit(savevm_live.f, SAVEVM_LIVE_ROUND_SIZE);
+    qemu_mutex_unlock_iothread();
+    qemu_savevm_state_begin(savevm_live.f, &params);
+    qemu_mutex_lock_iothread();
+
+    savevm_live_round(NULL);
+}
+
 void do_savevm(Monitor *mon, const QDict *qdict)
 {
-    BlockDriverState *bs, *bs1;
+    BlockDriverState *bs;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
-    int ret;
+    int ret, close_ret;
     QEMUFile *f;
     int saved_vm_running;
     uint64_t vm_state_size;
     qemu_timeval tv;
     struct tm tm;
     const char *name = qdict_get_try_str(qdict, "name");
+    bool live = qdict_get_try_bool(qdict, "live", 0);
+
+    if (savevm_live.f) {
+        monitor_printf(mon, "A live savevm is in progress\n");
+        return;
+    }
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -1072,16 +1487,22 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         return;
     }
 
+    /* A stopped VM has nothing to gain from a live save */
+    live = live && runstate_is_running();
+
     saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
+    if (!live) {
+        vm_stop(RUN_STATE_SAVE_VM);
+
+        /* The new vmstate replaces the one a lazy loadvm still reads
+         * from */
+        ram_lazy_load_flush();
+    }
 
     memset(sn, 0, sizeof(*sn));
 
     /* fill auxiliary fields */
-    qemu_gettimeofday(&tv);
-    sn->date_sec = tv.tv_sec;
-    sn->date_nsec = tv.tv_usec * 1000;
-    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    savevm_set_time(sn, &tv);
 
     if (name) {
         ret = bdrv_snapshot_find(bs, old_sn, name);
@@ -1102,6 +1523,11 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         goto the_end;
     }
 
+    if (live) {
+        savevm_live_start(mon, bs, sn);
+        return;
+    }
+
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
     if (!f) {
@@ -1110,26 +1536,17 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
     ret = qemu_savevm_state(f);
     vm_state_size = qemu_ftell(f);
-    qemu_fclose(f);
+    close_ret = qemu_fclose(f);
+    if (ret == 0) {
+        ret = close_ret;
+    }
     if (ret < 0) {
         monitor_printf(mon, "Error %d while writing VM\n", ret);
         goto the_end;
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(mon, bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running) {
@@ -1163,6 +1580,226 @@ void qmp_xen_save_devices_state(const char *filename, Error **errp)
     }
 }
 
+/* In-memory checkpoints.  The device state is written to a buffer which is
+ * kept from one checkpoint to the next, and each RAM block is copied.  The
+ * DIRTY_MEMORY_CHECKPOINT bitmap records which pages were written since the
+ * last checkpoint-save or checkpoint-restore, and only those pages are
+ * copied, so both commands cost in proportion to what the guest changed
+ * rather than to the size of RAM. */
+
+/* Initial size of the device state buffer */
+#define CHECKPOINT_DEVICE_BUF_SIZE (64 * 1024)
+
+typedef struct CheckpointRAM {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t length;
+    uint8_t *data;
+} CheckpointRAM;
+
+static struct {
+    bool valid;
+    uint8_t *buf;
+    size_t size;
+    size_t alloc;
+    CheckpointRAM *ram;
+    int n_ram;
+} checkpoint;
+
+static int checkpoint_put_buffer(void *opaque, const uint8_t *buf,
+                                 int64_t pos, int size)
+{
+    if (pos + size > checkpoint.alloc) {
+        checkpoint.alloc = MAX(checkpoint.alloc * 2, pos + size);
+        checkpoint.buf = g_realloc(checkpoint.buf, checkpoint.alloc);
+    }
+    memcpy(checkpoint.buf + pos, buf, size);
+    checkpoint.size = pos + size;
+    return size;
+}
+
+static int checkpoint_get_buffer(void *opaque, uint8_t *buf,
+                                 int64_t pos, int size)
+{
+    if (pos >= checkpoint.size) {
+        return 0;
+    }
+    size = MIN(size, checkpoint.size - pos);
+    memcpy(buf, checkpoint.buf + pos, size);
+    return size;
+}
+
+static const QEMUFileOps checkpoint_write_ops = {
+    .put_buffer = checkpoint_put_buffer,
+};
+
+static const QEMUFileOps checkpoint_read_ops = {
+    .get_buffer = checkpoint_get_buffer,
+};
+
+/* Whether the RAM blocks are still the ones the checkpoint was taken of */
+static bool checkpoint_ram_matches(void)
+{
+    RAMBlock *block;
+    int i = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (i == checkpoint.n_ram ||
+            checkpoint.ram[i].block != block ||
+            checkpoint.ram[i].offset != block->offset ||
+            checkpoint.ram[i].length != block->length) {
+            return false;
+        }
+        i++;
+    }
+    return i == checkpoint.n_ram;
+}
+
+static void checkpoint_ram_free(void)
+{
+    int i;
+
+    for (i = 0; i < checkpoint.n_ram; i++) {
+        g_free(checkpoint.ram[i].data);
+    }
+    g_free(checkpoint.ram);
+    checkpoint.ram = NULL;
+    checkpoint.n_ram = 0;
+}
+
+/* Copy every RAM block, and start tracking writes from here */
+static void checkpoint_ram_save_all(void)
+{
+    RAMBlock *block;
+    CheckpointRAM *c;
+
+    checkpoint_ram_free();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        checkpoint.n_ram++;
+    }
+    checkpoint.ram = g_new0(CheckpointRAM, checkpoint.n_ram);
+
+    c = checkpoint.ram;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        c->block = block;
+        c->offset = block->offset;
+        c->length = block->length;
+        c->data = g_memdup(block->host, block->length);
+        cpu_physical_memory_reset_dirty(block->offset, block->length,
+                                        DIRTY_MEMORY_CHECKPOINT);
+        c++;
+    }
+}
+
+/* Copy the pages of a RAM block written since the last checkpoint-save or
+ * checkpoint-restore into the checkpoint, or (for restore) back from it. */
+static void checkpoint_ram_copy_dirty(CheckpointRAM *c, bool restore)
+{
+    unsigned long *bitmap = ram_list.dirty_memory[DIRTY_MEMORY_CHECKPOINT];
+    unsigned long first = c->offset >> TARGET_PAGE_BITS;
+    unsigned long end = TARGET_PAGE_ALIGN(c->offset + c->length)
+                        >> TARGET_PAGE_BITS;
+    unsigned long page;
+    ram_addr_t offset, len;
+
+    for (page = find_next_bit(bitmap, end, first); page < end;
+         page = find_next_bit(bitmap, end, page + 1)) {
+        offset = (page - first) << TARGET_PAGE_BITS;
+        len = MIN(TARGET_PAGE_SIZE, c->length - offset);
+        if (restore) {
+            /* Translated code from the page no longer matches it */
+            if (!cpu_physical_memory_get_dirty_flag(c->offset + offset,
+                                                    DIRTY_MEMORY_CODE)) {
+                tb_invalidate_phys_range(c->offset + offset,
+                                         c->offset + offset + len, 0);
+            }
+            memcpy(c->block->host + offset, c->data + offset, len);
+            cpu_physical_memory_set_dirty_range(c->offset + offset, len);
+        } else {
+            memcpy(c->data + offset, c->block->host + offset, len);
+        }
+    }
+    cpu_physical_memory_reset_dirty(c->offset, c->length,
+                                    DIRTY_MEMORY_CHECKPOINT);
+}
+
+void qmp_checkpoint_save(Error **errp)
+{
+    QEMUFile *f;
+    int saved_vm_running;
+    int i, ret;
+
+    if (qemu_savevm_state_blocked(errp)) {
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+    ram_lazy_load_flush();
+
+    if (checkpoint.valid && checkpoint_ram_matches()) {
+        for (i = 0; i < checkpoint.n_ram; i++) {
+            checkpoint_ram_copy_dirty(&checkpoint.ram[i], false);
+        }
+    } else {
+        checkpoint_ram_save_all();
+    }
+
+    if (!checkpoint.buf) {
+        checkpoint.alloc = CHECKPOINT_DEVICE_BUF_SIZE;
+        checkpoint.buf = g_malloc(checkpoint.alloc);
+    }
+    checkpoint.size = 0;
+    f = qemu_fopen_ops(NULL, &checkpoint_write_ops);
+    ret = qemu_save_device_state(f);
+    qemu_fclose(f);
+    checkpoint.valid = ret >= 0;
+    if (ret < 0) {
+        error_set(errp, QERR_IO_ERROR);
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+void qmp_checkpoint_restore(Error **errp)
+{
+    QEMUFile *f;
+    int saved_vm_running;
+    int i, ret;
+
+    if (!checkpoint.valid) {
+        error_setg(errp, "No checkpoint has been saved");
+        return;
+    }
+    if (!checkpoint_ram_matches()) {
+        error_setg(errp, "RAM has been added or removed since the checkpoint "
+                   "was saved");
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_RESTORE_VM);
+    ram_lazy_load_flush();
+
+    for (i = 0; i < checkpoint.n_ram; i++) {
+        checkpoint_ram_copy_dirty(&checkpoint.ram[i], true);
+    }
+
+    f = qemu_fopen_ops(NULL, &checkpoint_read_ops);
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_setg(errp, "Error %d while loading the checkpoint", ret);
+        return;
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
 int load_vmstate(const char *name)
 {
     BlockDriverState *bs, *bs_vm_state;
@@ -1170,6 +1807,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (savevm_live.f) {
+        error_report("A live savevm is in progress");
+        return -EBUSY;
+    }
+
     bs_vm_state = find_vmstate_bs();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -1212,6 +1854,10 @@ int load_vmstate(const char *name)
     /* Flush all IO requests so they don't interfere with the new state.  */
     bdrv_drain_all();
 
+    /* Drops what is left of the RAM of an earlier loadvm, whose vmstate
+     * the snapshot goto replaces */
+    ram_lazy_load_prepare(bs_vm_state);
+
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
         if (bdrv_can_snapshot(bs)) {
@@ -1219,6 +1865,7 @@ int load_vmstate(const char *name)
             if (ret < 0) {
                 error_report("Error %d while activating snapshot '%s' on '%s'",
                              ret, name, bdrv_get_device_name(bs));
+                ram_lazy_load_finish(ret);
                 return ret;
             }
         }
@@ -1228,11 +1875,13 @@ int load_vmstate(const char *name)
     f = qemu_fopen_bdrv(bs_vm_state, 0);
     if (!f) {
         error_report("Could not open VM state file");
+        ram_lazy_load_finish(-EINVAL);
         return -EINVAL;
     }
 
     qemu_system_reset(VMRESET_SILENT);
     ret = qemu_loadvm_state(f);
+    ram_lazy_load_finish(ret);
 
     qemu_fclose(f);
     if (ret < 0) {
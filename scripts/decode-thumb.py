@@ -0,0 +1,187 @@
+#!/usr/bin/env python
+#
+# Generate a decoder for fixed width instructions from a pattern file
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Usage: decode-thumb.py [--width N] [--name NAME] FILE > OUTPUT
+#
+# Every line of FILE is an instruction name and its bits, most significant
+# first, in any number of groups: 0 and 1 must match, '.' matches anything
+# and "field:N" (or "field:sN", sign extended) is an N bit field.  Blank
+# lines and '#' comments are ignored.  When several patterns match an
+# instruction, the first one in the file wins.
+#
+# The output defines a struct arg_NAME with the fields of each pattern,
+# declares "static bool trans_NAME(DisasContext *s, arg_NAME *a)", which
+# the including file must define, and defines
+# "static bool NAME(DisasContext *s, uint32_t insn)" (decode by default).
+# That returns false if no pattern matches, and otherwise what the
+# trans_ function returned.
+#
+# The patterns are sorted into switch statements on the bits that all of
+# them fix, and into if statements in file order where they overlap, so
+# that an instruction only goes through a couple of tests.
+
+import re
+import sys
+
+
+class Pattern(object):
+    def __init__(self, name, mask, value, fields, lineno):
+        self.name = name
+        self.mask = mask
+        self.value = value
+        self.fields = fields    # (name, pos, len, signed), msb first
+        self.lineno = lineno
+
+
+def error(filename, lineno, msg):
+    sys.stderr.write('%s:%d: %s\n' % (filename, lineno, msg))
+    sys.exit(1)
+
+
+def parse(filename, width):
+    patterns = []
+    names = set()
+    field_re = re.compile(r'^([a-z_][a-z0-9_]*):(s?)([0-9]+)$')
+
+    for lineno, line in enumerate(open(filename), 1):
+        line = line.split('#', 1)[0].split()
+        if not line:
+            continue
+        name = line[0]
+        if not re.match(r'^[A-Za-z_][A-Za-z0-9_]*$', name) or name in names:
+            error(filename, lineno, 'bad or duplicate name %s' % name)
+        names.add(name)
+
+        mask = value = 0
+        pos = width
+        fields = []
+        for tok in line[1:]:
+            m = field_re.match(tok)
+            if m:
+                length = int(m.group(3))
+                pos -= length
+                if pos < 0 or length == 0:
+                    error(filename, lineno, 'too many bits')
+                if m.group(1) in [f[0] for f in fields]:
+                    error(filename, lineno, 'duplicate field ' + m.group(1))
+                fields.append((m.group(1), pos, length, m.group(2) == 's'))
+                continue
+            for c in tok:
+                pos -= 1
+                if pos < 0 or c not in '01.':
+                    error(filename, lineno, 'bad bits ' + tok)
+                if c != '.':
+                    mask |= 1 << pos
+                    value |= int(c) << pos
+        if pos != 0:
+            error(filename, lineno, 'expected %d bits' % width)
+        patterns.append(Pattern(name, mask, value, fields, lineno))
+    return patterns
+
+
+def emit_match(out, p, tested, ind):
+    fmt = '0x%%0%dx' % (WIDTH // 4)
+    mask = p.mask & ~tested
+    if mask:
+        out.append('%sif ((insn & %s) == %s) {' %
+                   (ind, fmt % mask, fmt % (p.value & mask)))
+        body = ind + '    '
+    else:
+        body = ind
+    for f in p.fields:
+        out.append('%su.f_%s.%s = %s(insn, %d, %d);' %
+                   (body, p.name, f[0], 'sextract32' if f[3] else 'extract32',
+                    f[1], f[2]))
+    out.append('%sreturn trans_%s(s, &u.f_%s);' % (body, p.name, p.name))
+    if mask:
+        out.append('%s}' % ind)
+
+
+# Returns whether the code emitted always returns
+def emit_tree(out, patterns, tested, ind):
+    fmt = '0x%%0%dx' % (WIDTH // 4)
+    common = ~tested & ((1 << WIDTH) - 1)
+    for p in patterns:
+        common &= p.mask
+
+    if not common or len(patterns) == 1:
+        for p in patterns:
+            emit_match(out, p, tested, ind)
+            if not (p.mask & ~tested):
+                # Anything else is shadowed by this pattern
+                return True
+        return False
+
+    groups = []
+    for p in patterns:
+        key = p.value & common
+        for g in groups:
+            if g[0] == key:
+                g[1].append(p)
+                break
+        else:
+            groups.append((key, [p]))
+
+    out.append('%sswitch (insn & %s) {' % (ind, fmt % common))
+    for key, group in sorted(groups, key=lambda g: g[0]):
+        out.append('%scase %s:' % (ind, fmt % key))
+        if not emit_tree(out, group, tested | common, ind + '    '):
+            out.append('%s    break;' % ind)
+    out.append('%s}' % ind)
+    return False
+
+
+def main():
+    global WIDTH
+    args = sys.argv[1:]
+    WIDTH = 32
+    func = 'decode'
+    while args and args[0].startswith('--'):
+        if args[0] == '--width' and len(args) > 1:
+            WIDTH = int(args[1])
+        elif args[0] == '--name' and len(args) > 1:
+            func = args[1]
+        else:
+            sys.stderr.write('usage: decode-thumb.py [--width N] '
+                             '[--name NAME] FILE\n')
+            sys.exit(1)
+        args = args[2:]
+    if len(args) != 1:
+        sys.stderr.write('usage: decode-thumb.py [--width N] [--name NAME] '
+                         'FILE\n')
+        sys.exit(1)
+
+    patterns = parse(args[0], WIDTH)
+    out = ['/* Generated by scripts/decode-thumb.py from %s, do not edit. */'
+           % args[0].split('/')[-1], '']
+    for p in patterns:
+        out.append('typedef struct {')
+        for f in p.fields:
+            out.append('    int %s;' % f[0])
+        if not p.fields:
+            out.append('    int unused;')
+        out.append('} arg_%s;' % p.name)
+        out.append('')
+    for p in patterns:
+        out.append('static bool trans_%s(DisasContext *s, arg_%s *a);' %
+                   (p.name, p.name))
+    out.append('')
+    out.append('static bool %s(DisasContext *s, uint32_t insn)' % func)
+    out.append('{')
+    out.append('    union {')
+    for p in patterns:
+        out.append('        arg_%s f_%s;' % (p.name, p.name))
+    out.append('    } u;')
+    out.append('')
+    emit_tree(out, patterns, 0, '    ')
+    out.append('    return false;')
+    out.append('}')
+    sys.stdout.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
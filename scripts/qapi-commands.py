@@ -170,28 +170,36 @@ qapi_dealloc_visitor_cleanup(md);
     pop_indent()
     return ret.rstrip()
 
-def gen_marshal_output(name, args, ret_type, middle_mode):
+def gen_marshal_output(name, args, ret_type, middle_mode, json_output=False):
     if not ret_type:
         return ""
 
+    # 'json-output' commands serialize their result straight to JSON text
+    if json_output:
+        output = 'json_output'
+        output_type = 'JsonOutputVisitor'
+    else:
+        output = 'qmp_output'
+        output_type = 'QmpOutputVisitor'
+
     ret = mcgen('''
 static void qmp_marshal_output_%(c_name)s(%(c_ret_type)s ret_in, QObject **ret_out, Error **errp)
 {
     Error *local_err = NULL;
-    QmpOutputVisitor *mo = qmp_output_visitor_new();
+    %(output_type)s *mo = %(output)s_visitor_new();
     QapiDeallocVisitor *md;
     Visitor *v;
 
-    v = qmp_output_get_visitor(mo);
+    v = %(output)s_get_visitor(mo);
     %(visitor)s(v, &ret_in, "unused", &local_err);
     if (local_err) {
         goto out;
     }
-    *ret_out = qmp_output_get_qobject(mo);
+    *ret_out = %(output)s_get_qobject(mo);
 
 out:
     error_propagate(errp, local_err);
-    qmp_output_visitor_cleanup(mo);
+    %(output)s_visitor_cleanup(mo);
     md = qapi_dealloc_visitor_new();
     v = qapi_dealloc_get_visitor(md);
     %(visitor)s(v, &ret_in, "unused", NULL);
@@ -199,7 +207,8 @@ out:
 }
 ''',
                 c_ret_type=c_type(ret_type), c_name=c_fun(name),
-                visitor=type_visitor(ret_type))
+                visitor=type_visitor(ret_type), output=output,
+                output_type=output_type)
 
     return ret
 
@@ -375,6 +384,7 @@ def gen_command_def_prologue(prefix="", proxy=False):
 #include "qapi/qmp/dispatch.h"
 #include "qapi/visitor.h"
 #include "qapi/qmp-output-visitor.h"
+#include "qapi/json-output-visitor.h"
 #include "qapi/qmp-input-visitor.h"
 #include "qapi/dealloc-visitor.h"
 #include "%(prefix)sqapi-types.h"
@@ -464,7 +474,8 @@ if dispatch_type == "sync":
         ret = generate_command_decl(cmd['command'], arglist, ret_type) + "\n"
         fdecl.write(ret)
         if ret_type:
-            ret = gen_marshal_output(cmd['command'], arglist, ret_type, middle_mode) + "\n"
+            ret = gen_marshal_output(cmd['command'], arglist, ret_type, middle_mode,
+                                     option_value_matches('json-output', 'yes', cmd)) + "\n"
             fdef.write(ret)
 
         if middle_mode:
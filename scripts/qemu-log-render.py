@@ -0,0 +1,182 @@
+#!/usr/bin/env python
+#
+# Render a log written with -d async as the text of the ordinary log
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Usage: qemu-log-render.py [--elf FILE] [--nm NM] [--pc-width N]
+#                           [--threads] LOGFILE
+#
+# QEMU resolves the symbols of the "Trace" lines of -d exec when it writes
+# them, and with -d async leaves that to this script: --elf gives the
+# firmware, whose function symbols are read with NM (nm by default,
+# arm-none-eabi-nm for a firmware built with that toolchain).  --pc-width
+# is the number of hex digits of a guest address, 8 for 32 bit targets.
+# --threads starts the lines of every thread with its number, otherwise
+# the lines of the threads are in the chunks the writeout thread took.
+
+import bisect
+import struct
+import subprocess
+import sys
+
+LOG_MAGIC = 0x474f4c2d554d4551
+
+REC_HEADER = 1
+REC_THREAD = 2
+REC_STRING = 3
+REC_TEXT = 4
+REC_EXEC = 5
+REC_EXCEPTION = 6
+
+
+class Symbols(object):
+    '''The function symbols of an ELF file, looked up like lookup_symbol()'''
+
+    def __init__(self, elf, nm):
+        syms = {}
+        out = subprocess.check_output([nm, '-S', '--defined-only', elf])
+        for line in out.decode('ascii', 'replace').splitlines():
+            f = line.split()
+            if len(f) == 4 and f[2] in 'TtWw':
+                addr, size, name = int(f[0], 16), int(f[1], 16), f[3]
+            elif len(f) == 3 and f[1] in 'TtWw':
+                addr, size, name = int(f[0], 16), 0, f[2]
+            else:
+                continue
+            # The bottom address bit marks a Thumb symbol
+            syms[addr & ~1] = (size, name)
+        self.addrs = sorted(syms)
+        self.syms = []
+        for i, addr in enumerate(self.addrs):
+            size, name = syms[addr]
+            if size == 0 and i + 1 < len(self.addrs):
+                size = self.addrs[i + 1] - addr
+            self.syms.append((size, name))
+
+    def lookup(self, addr):
+        i = bisect.bisect_right(self.addrs, addr) - 1
+        if i >= 0 and addr < self.addrs[i] + self.syms[i][0]:
+            return self.syms[i][1]
+        return ''
+
+
+def host_pointer(value):
+    # What glibc's %p prints
+    if value == 0:
+        return '(nil)'
+    return '0x%x' % value
+
+
+def render(f, out, symbols, pc_width, threads):
+    endian = None
+    strings = {}
+    tid = 0
+    bol = True
+    while True:
+        hdr = f.read(8)
+        if len(hdr) < 8:
+            if hdr:
+                sys.stderr.write('truncated record at the end of the log\n')
+            return
+        if endian is None or struct.unpack(endian + 'I', hdr[:4])[0] == \
+           REC_HEADER:
+            # The first record, or the header of a later run appended to the
+            # log, tells the byte order
+            for endian in '<>':
+                rtype, length = struct.unpack(endian + 'II', hdr)
+                if rtype == REC_HEADER and length == 24:
+                    break
+            else:
+                sys.stderr.write('not a log written with -d async\n')
+                sys.exit(1)
+        rtype, length = struct.unpack(endian + 'II', hdr)
+        if length < 8 or length % 8:
+            sys.stderr.write('bad record of length %d\n' % length)
+            sys.exit(1)
+        body = f.read(length - 8)
+        if len(body) < length - 8:
+            sys.stderr.write('truncated record at the end of the log\n')
+            return
+
+        text = None
+        if rtype == REC_HEADER:
+            magic, version = struct.unpack(endian + 'QQ', body)
+            if magic != LOG_MAGIC or version != 1:
+                sys.stderr.write('unknown log version\n')
+                sys.exit(1)
+            strings = {}
+        elif rtype == REC_THREAD:
+            tid = struct.unpack(endian + 'Q', body)[0]
+        elif rtype == REC_STRING:
+            n = struct.unpack(endian + 'Q', body[:8])[0]
+            strings[n] = body[8:].rstrip(b'\0').decode('latin-1')
+        elif rtype == REC_TEXT:
+            text = body.rstrip(b'\0').decode('latin-1')
+        elif rtype == REC_EXEC:
+            tc_ptr, pc = struct.unpack(endian + 'QQ', body)
+            text = 'Trace %s [%0*x] %s\n' % (host_pointer(tc_ptr), pc_width,
+                                             pc, symbols.lookup(pc)
+                                             if symbols else '')
+        elif rtype == REC_EXCEPTION:
+            idx, name = struct.unpack(endian + 'qQ', body)
+            text = 'Taking exception %d [%s]\n' % (idx,
+                                                   strings.get(name, '?'))
+
+        if text is None:
+            continue
+        if threads:
+            # Text records may hold part of a line, or several
+            lines = text.split('\n')
+            for i, line in enumerate(lines):
+                if bol and line:
+                    out.write('%d: ' % tid)
+                out.write(line)
+                if i + 1 < len(lines):
+                    out.write('\n')
+                    bol = True
+                elif line:
+                    bol = False
+        else:
+            out.write(text)
+
+
+def usage():
+    sys.stderr.write('usage: qemu-log-render.py [--elf FILE] [--nm NM] '
+                     '[--pc-width N] [--threads] LOGFILE\n')
+    sys.exit(1)
+
+
+def main():
+    args = sys.argv[1:]
+    elf = None
+    nm = 'nm'
+    pc_width = 8
+    threads = False
+    while args and args[0].startswith('--'):
+        if args[0] == '--threads':
+            threads = True
+            args = args[1:]
+            continue
+        if len(args) < 2:
+            usage()
+        if args[0] == '--elf':
+            elf = args[1]
+        elif args[0] == '--nm':
+            nm = args[1]
+        elif args[0] == '--pc-width':
+            pc_width = int(args[1])
+        else:
+            usage()
+        args = args[2:]
+    if len(args) != 1:
+        usage()
+
+    symbols = Symbols(elf, nm) if elf else None
+    with open(args[0], 'rb') as f:
+        render(f, sys.stdout, symbols, pc_width, threads)
+
+
+if __name__ == '__main__':
+    main()
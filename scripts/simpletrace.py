@@ -21,6 +21,9 @@ dropped_event_id = 0xfffffffffffffffe
 
 log_header_fmt = '=QQQ'
 rec_header_fmt = '=QQII'
+# Version 4 adds the number of the thread which traced the event.  The
+# records are merged from per-thread buffers and are in timestamp order.
+rec_header_fmt_v4 = '=QQIIII'
 
 def read_header(fobj, hfmt):
     '''Read a trace record header'''
@@ -31,7 +34,7 @@ def read_header(fobj, hfmt):
     return struct.unpack(hfmt, hdr)
 
 def get_record(edict, rechdr, fobj):
-    """Deserialize a trace record from a file into a tuple (event_num, timestamp, pid, arg1, ..., arg6)."""
+    """Deserialize a trace record from a file into a tuple (event_num, timestamp, pid, arg1, ..., arg6[, tid])."""
     if rechdr is None:
         return None
     rec = (rechdr[0], rechdr[1], rechdr[3])
@@ -50,12 +53,16 @@ def get_record(edict, rechdr, fobj):
     else:
         (value,) = struct.unpack('=Q', fobj.read(8))
         rec = rec + (value,)
+    if len(rechdr) > 4:
+        # The thread comes after the arguments, so that analyzers index
+        # the arguments the same way in every version
+        rec = rec + (rechdr[4],)
     return rec
 
 
-def read_record(edict, fobj):
-    """Deserialize a trace record from a file into a tuple (event_num, timestamp, pid, arg1, ..., arg6)."""
-    rechdr = read_header(fobj, rec_header_fmt)
+def read_record(edict, fobj, hfmt=rec_header_fmt):
+    """Deserialize a trace record from a file into a tuple (event_num, timestamp, pid, arg1, ..., arg6[, tid])."""
+    rechdr = read_header(fobj, hfmt)
     return get_record(edict, rechdr, fobj) # return tuple of record elements
 
 def read_trace_file(edict, fobj):
@@ -67,14 +74,15 @@ def read_trace_file(edict, fobj):
         raise ValueError('Not a valid trace file!')
 
     log_version = header[2]
-    if log_version not in [0, 2, 3]:
+    if log_version not in [0, 2, 3, 4]:
         raise ValueError('Unknown version of tracelog format!')
-    if log_version != 3:
+    if log_version < 3:
         raise ValueError('Log format %d not supported with this QEMU release!'
                          % log_version)
+    hfmt = rec_header_fmt_v4 if log_version == 4 else rec_header_fmt
 
     while True:
-        rec = read_record(edict, fobj)
+        rec = read_record(edict, fobj, hfmt)
         if rec is None:
             break
 
@@ -173,6 +181,8 @@ if __name__ == '__main__':
 
             fields = [event.name, '%0.3f' % (delta_ns / 1000.0),
                       'pid=%d' % rec[2]]
+            if len(rec) > 3 + len(event.args):
+                fields.append('tid=%d' % rec[3 + len(event.args)])
             i = 3
             for type, name in event.args:
                 if is_string(type):
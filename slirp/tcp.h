@@ -38,8 +38,14 @@ typedef	uint32_t tcp_seq;
 #define      PR_SLOWHZ       2               /* 2 slow timeouts per second (approx) */
 #define      PR_FASTHZ       5               /* 5 fast timeouts per second (not important) */
 
-#define TCP_SNDSPACE 8192
-#define TCP_RCVSPACE 8192
+/*
+ * Socket buffer sizes.  Without window scaling the advertised window is
+ * capped at TCP_MAXWIN, but larger buffers still let soread() pull more
+ * from the host socket per call and keep a full window open while the
+ * host side drains.
+ */
+#define TCP_SNDSPACE (128 * 1024)
+#define TCP_RCVSPACE (128 * 1024)
 
 /*
  * TCP header.
@@ -125,15 +125,25 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
     uint64_t val;
     CPUState *cpu = ENV_GET_CPU(env);
     MemoryRegion *mr = iotlb_to_region(cpu->as, physaddr);
+    bool mid_tb = false;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     cpu->mem_io_pc = retaddr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !cpu_can_do_io(cpu)) {
-        cpu_io_recompile(cpu, retaddr);
+        mid_tb = cpu_io_mid_tb(cpu, retaddr);
+        if (!mid_tb) {
+            cpu_io_recompile(cpu, retaddr);
+        }
     }
 
     cpu->mem_io_vaddr = addr;
     io_mem_read(mr, physaddr, &val, 1 << SHIFT);
+    if (unlikely(mr->ops->poll_deadline)) {
+        cpu_mmio_poll_check(cpu, mr, physaddr, val, 1 << SHIFT, retaddr);
+    }
+    if (mid_tb) {
+        cpu_io_mid_tb_end(cpu);
+    }
     return val;
 }
 #endif
@@ -171,6 +181,11 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr, int mmu_idx,
         if ((addr & (DATA_SIZE - 1)) != 0) {
             goto do_unaligned_access;
         }
+        if ((tlb_addr & ~TARGET_PAGE_MASK) == (TLB_MMIO | TLB_WATCH)
+            && !cpu_watchpoint_address_matches(ENV_GET_CPU(env), addr,
+                                               DATA_SIZE, BP_MEM_READ)) {
+            goto do_ram_access;
+        }
         ioaddr = env->iotlb[mmu_idx][index];
 
         /* ??? Note that the io helpers always read data in the target
@@ -213,6 +228,7 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr, int mmu_idx,
     }
 #endif
 
+    do_ram_access:
     haddr = addr + env->tlb_table[mmu_idx][index].addend;
 #if DATA_SIZE == 1
     res = glue(glue(ld, LSUFFIX), _p)((uint8_t *)haddr);
@@ -256,6 +272,11 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr, int mmu_idx,
         if ((addr & (DATA_SIZE - 1)) != 0) {
             goto do_unaligned_access;
         }
+        if ((tlb_addr & ~TARGET_PAGE_MASK) == (TLB_MMIO | TLB_WATCH)
+            && !cpu_watchpoint_address_matches(ENV_GET_CPU(env), addr,
+                                               DATA_SIZE, BP_MEM_READ)) {
+            goto do_ram_access;
+        }
         ioaddr = env->iotlb[mmu_idx][index];
 
         /* ??? Note that the io helpers always read data in the target
@@ -298,6 +319,7 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr, int mmu_idx,
     }
 #endif
 
+    do_ram_access:
     haddr = addr + env->tlb_table[mmu_idx][index].addend;
     res = glue(glue(ld, LSUFFIX), _be_p)((uint8_t *)haddr);
     return res;
@@ -339,15 +361,22 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
 {
     CPUState *cpu = ENV_GET_CPU(env);
     MemoryRegion *mr = iotlb_to_region(cpu->as, physaddr);
+    bool mid_tb = false;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !cpu_can_do_io(cpu)) {
-        cpu_io_recompile(cpu, retaddr);
+        mid_tb = cpu_io_mid_tb(cpu, retaddr);
+        if (!mid_tb) {
+            cpu_io_recompile(cpu, retaddr);
+        }
     }
 
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
     io_mem_write(mr, physaddr, val, 1 << SHIFT);
+    if (mid_tb) {
+        cpu_io_mid_tb_end(cpu);
+    }
 }
 
 void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
@@ -378,6 +407,11 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         if ((addr & (DATA_SIZE - 1)) != 0) {
             goto do_unaligned_access;
         }
+        if ((tlb_addr & ~TARGET_PAGE_MASK) == (TLB_MMIO | TLB_WATCH)
+            && !cpu_watchpoint_address_matches(ENV_GET_CPU(env), addr,
+                                               DATA_SIZE, BP_MEM_WRITE)) {
+            goto do_ram_access;
+        }
         ioaddr = env->iotlb[mmu_idx][index];
 
         /* ??? Note that the io helpers always read data in the target
@@ -417,6 +451,7 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
     }
 #endif
 
+    do_ram_access:
     haddr = addr + env->tlb_table[mmu_idx][index].addend;
 #if DATA_SIZE == 1
     glue(glue(st, SUFFIX), _p)((uint8_t *)haddr, val);
@@ -454,6 +489,11 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         if ((addr & (DATA_SIZE - 1)) != 0) {
             goto do_unaligned_access;
         }
+        if ((tlb_addr & ~TARGET_PAGE_MASK) == (TLB_MMIO | TLB_WATCH)
+            && !cpu_watchpoint_address_matches(ENV_GET_CPU(env), addr,
+                                               DATA_SIZE, BP_MEM_WRITE)) {
+            goto do_ram_access;
+        }
         ioaddr = env->iotlb[mmu_idx][index];
 
         /* ??? Note that the io helpers always read data in the target
@@ -493,6 +533,7 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
     }
 #endif
 
+    do_ram_access:
     haddr = addr + env->tlb_table[mmu_idx][index].addend;
     glue(glue(st, SUFFIX), _be_p)((uint8_t *)haddr, val);
 }
@@ -34,6 +34,7 @@
 #else
 #include "qemu-common.h"
 #include "exec/gdbstub.h"
+#include "exec/memory.h"
 #include "hw/arm/arm.h"
 #endif
 
@@ -118,6 +119,138 @@ static inline uint32_t set_swi_errno(CPUARMState *env, uint32_t code)
 
 static target_ulong arm_semi_syscall_len;
 
+/* SYS_WRITE data for a file or pipe is collected here and written out in
+ * large chunks, so that firmware which writes its results a few bytes at a
+ * time does not make a host system call for each.  The buffer is flushed
+ * before any other semihosting call, which keeps the order in which the
+ * host sees the calls, and at exit.  Writes to a terminal go straight out.
+ * Errors in buffered writes are not reported to the guest.  */
+#define ARM_SEMI_WBUF_SIZE 65536
+
+static struct {
+    int fd;             /* -1 when the buffer is empty */
+    uint32_t len;
+    uint8_t data[ARM_SEMI_WBUF_SIZE];
+} arm_semi_wbuf = { .fd = -1 };
+
+static ssize_t arm_semi_write_all(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = write(fd, (const uint8_t *)buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return done ? done : -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static void arm_semi_flush(void)
+{
+    if (arm_semi_wbuf.fd >= 0) {
+        arm_semi_write_all(arm_semi_wbuf.fd, arm_semi_wbuf.data,
+                           arm_semi_wbuf.len);
+        arm_semi_wbuf.fd = -1;
+        arm_semi_wbuf.len = 0;
+    }
+}
+
+/* Writes len bytes for SYS_WRITE, returning how many were written or -1
+ * as write() does.  */
+static ssize_t arm_semi_write(int fd, const void *buf, size_t len)
+{
+    static bool flush_at_exit;
+
+    if (fd != arm_semi_wbuf.fd) {
+        arm_semi_flush();
+        if (isatty(fd)) {
+            return arm_semi_write_all(fd, buf, len);
+        }
+    }
+    if (len >= ARM_SEMI_WBUF_SIZE - arm_semi_wbuf.len) {
+        /* Too big to be worth copying */
+        arm_semi_flush();
+        return arm_semi_write_all(fd, buf, len);
+    }
+    if (!flush_at_exit) {
+        atexit(arm_semi_flush);
+        flush_at_exit = true;
+    }
+    memcpy(arm_semi_wbuf.data + arm_semi_wbuf.len, buf, len);
+    arm_semi_wbuf.len += len;
+    arm_semi_wbuf.fd = fd;
+    return len;
+}
+
+#ifndef CONFIG_USER_ONLY
+/* M profile cores have no MMU, so the buffers of SYS_WRITE and SYS_READ
+ * are at the same addresses in the CPU's physical address space.  They are
+ * mapped from there, which for RAM and Flash gives the host pointer with
+ * no copy at all, instead of going through lock_user.  Each returns the
+ * number of bytes transferred, or -1 if nothing could be.  */
+static ssize_t arm_semi_write_mapped(CPUState *cs, int fd, hwaddr addr,
+                                     uint32_t len)
+{
+    uint32_t done = 0;
+    hwaddr plen;
+    ssize_t n;
+    void *p;
+
+    while (done < len) {
+        plen = len - done;
+        p = address_space_map(cs->as, addr + done, &plen, false);
+        if (!p) {
+            break;
+        }
+        n = arm_semi_write(fd, p, plen);
+        address_space_unmap(cs->as, p, plen, false, plen);
+        if (n < 0) {
+            return done ? done : -1;
+        }
+        done += n;
+        if ((hwaddr)n < plen) {
+            break;
+        }
+    }
+    return done;
+}
+
+static ssize_t arm_semi_read_mapped(CPUState *cs, int fd, hwaddr addr,
+                                    uint32_t len)
+{
+    uint32_t done = 0;
+    hwaddr plen;
+    ssize_t n;
+    void *p;
+
+    while (done < len) {
+        plen = len - done;
+        p = address_space_map(cs->as, addr + done, &plen, true);
+        if (!p) {
+            break;
+        }
+        do {
+            n = read(fd, p, plen);
+        } while (n < 0 && errno == EINTR);
+        address_space_unmap(cs->as, p, plen, true, n > 0 ? n : 0);
+        if (n < 0) {
+            return done ? done : -1;
+        }
+        done += n;
+        if ((hwaddr)n < plen) {
+            break;
+        }
+    }
+    return done;
+}
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 static target_ulong syscall_err;
 #endif
@@ -198,6 +331,9 @@ uint32_t do_arm_semihosting(CPUARMState *env)
 
     nr = env->regs[0];
     args = env->regs[1];
+    if (nr != TARGET_SYS_WRITE) {
+        arm_semi_flush();
+    }
     switch (nr) {
     case TARGET_SYS_OPEN:
         GET_ARG(0);
@@ -272,12 +408,21 @@ uint32_t do_arm_semihosting(CPUARMState *env)
             gdb_do_syscall(arm_semi_cb, "write,%x,%x,%x", arg0, arg1, len);
             return env->regs[0];
         } else {
+#ifndef CONFIG_USER_ONLY
+            if (arm_feature(env, ARM_FEATURE_M)) {
+                ret = set_swi_errno(ts, arm_semi_write_mapped(cs, arg0, arg1,
+                                                              len));
+                if (ret == (uint32_t)-1)
+                    return -1;
+                return len - ret;
+            }
+#endif
             s = lock_user(VERIFY_READ, arg1, len, 1);
             if (!s) {
                 /* FIXME - should this error code be -TARGET_EFAULT ? */
                 return (uint32_t)-1;
             }
-            ret = set_swi_errno(ts, write(arg0, s, len));
+            ret = set_swi_errno(ts, arm_semi_write(arg0, s, len));
             unlock_user(s, arg1, 0);
             if (ret == (uint32_t)-1)
                 return -1;
@@ -293,6 +438,15 @@ uint32_t do_arm_semihosting(CPUARMState *env)
             gdb_do_syscall(arm_semi_cb, "read,%x,%x,%x", arg0, arg1, len);
             return env->regs[0];
         } else {
+#ifndef CONFIG_USER_ONLY
+            if (arm_feature(env, ARM_FEATURE_M)) {
+                ret = set_swi_errno(ts, arm_semi_read_mapped(cs, arg0, arg1,
+                                                             len));
+                if (ret == (uint32_t)-1)
+                    return -1;
+                return len - ret;
+            }
+#endif
             s = lock_user(VERIFY_WRITE, arg1, len, 0);
             if (!s) {
                 /* FIXME - should this error code be -TARGET_EFAULT ? */
@@ -53,6 +53,36 @@ typedef struct ARMCPUClass {
  *
  * An ARM CPU core.
  */
+#define ARM_MAX_DIRECT_RAM 4
+
+/* A block of guest RAM that loads may read through its host pointer */
+typedef struct ARMDirectRAM {
+    uint32_t base;
+    uint32_t size;
+    void *host;
+} ARMDirectRAM;
+
+#define ARM_MAX_FETCH_REGION 2
+
+/* Memory which instruction fetches have to wait for, such as Flash behind
+ * wait states.  Only used to charge cycles when counting instructions. */
+typedef struct ARMFetchRegion {
+    uint32_t base;
+    uint32_t size;
+    /* Bytes the memory delivers per access */
+    uint32_t line_size;
+} ARMFetchRegion;
+
+#define ARM_MAX_TRACE_REGION 2
+
+/* Code which only changes through the board, such as Flash, which blocks
+ * may keep translating in after a direct branch.  See
+ * arm_cpu_add_trace_region. */
+typedef struct ARMTraceRegion {
+    uint32_t base;
+    uint32_t size;
+} ARMTraceRegion;
+
 typedef struct ARMCPU {
     /*< private >*/
     CPUState parent_obj;
@@ -159,6 +189,30 @@ typedef struct ARMCPU {
     /* DCZ blocksize, in log_2(words), ie low 4 bits of DCZID_EL0 */
     uint32_t dcz_blocksize;
     uint64_t rvbar;
+
+    /* M profile: RAM registered by the board with arm_cpu_add_direct_ram */
+    ARMDirectRAM direct_ram[ARM_MAX_DIRECT_RAM];
+    int nb_direct_ram;
+
+    /* M profile: slow instruction memory registered by the board with
+     * arm_cpu_add_fetch_region, and its current access time */
+    ARMFetchRegion fetch_region[ARM_MAX_FETCH_REGION];
+    int nb_fetch_region;
+    uint32_t fetch_wait_states;
+    bool fetch_prefetch;
+    QEMUBH *fetch_flush_bh;
+
+    /* M profile: code registered by the board with
+     * arm_cpu_add_trace_region, which blocks may branch into while
+     * trace_enabled, and whether any block has since it was last cleared */
+    ARMTraceRegion trace_region[ARM_MAX_TRACE_REGION];
+    int nb_trace_region;
+    bool trace_enabled;
+    bool trace_translated;
+
+    /* M profile: STREX only checks the address LDREX marked, see
+     * arm_cpu_set_local_monitor */
+    bool local_monitor;
 } ARMCPU;
 
 #define TYPE_AARCH64_CPU "aarch64-cpu"
@@ -188,6 +242,15 @@ extern const struct VMStateDescription vmstate_arm_cpu;
 
 void register_cp_regs_for_features(ARMCPU *cpu);
 void init_cpreg_list(ARMCPU *cpu);
+void arm_cpu_add_direct_ram(ARMCPU *cpu, uint32_t base, uint32_t size,
+                            void *host);
+void arm_cpu_add_fetch_region(ARMCPU *cpu, uint32_t base, uint32_t size,
+                              uint32_t line_size);
+void arm_cpu_set_fetch_wait_states(ARMCPU *cpu, uint32_t wait_states,
+                                   bool prefetch);
+void arm_cpu_add_trace_region(ARMCPU *cpu, uint32_t base, uint32_t size);
+void arm_cpu_set_trace_enabled(ARMCPU *cpu, bool enabled);
+void arm_cpu_set_local_monitor(ARMCPU *cpu, bool enabled);
 
 void arm_cpu_do_interrupt(CPUState *cpu);
 void arm_v7m_cpu_do_interrupt(CPUState *cpu);
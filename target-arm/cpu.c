@@ -134,7 +134,7 @@ static void arm_cpu_reset(CPUState *s)
         uint32_t pc;
         uint8_t *rom;
         env->daif &= ~PSTATE_I;
-        rom = rom_ptr(0);
+        rom = rom_ptr_as(s->as, 0);
         if (rom) {
             /* We should really use ldl_phys here, in case the guest
                modified flash and reset itself.  However images
@@ -152,6 +152,10 @@ static void arm_cpu_reset(CPUState *s)
     }
 
     env->vfp.xregs[ARM_VFP_FPEXC] = 0;
+    /* M profile has no FPEXC: the FPU is enabled by CPACR alone.  */
+    if (IS_M(env) && arm_feature(env, ARM_FEATURE_VFP)) {
+        env->vfp.xregs[ARM_VFP_FPEXC] = 1 << 30;
+    }
 #endif
     set_flush_to_zero(1, &env->vfp.standard_fp_status);
     set_flush_inputs_to_zero(1, &env->vfp.standard_fp_status);
@@ -299,6 +303,121 @@ static void arm_cpu_post_init(Object *obj)
     }
 }
 
+/* Board hook for M profile cores: guest loads in [base, base + size) read
+ * host memory at host directly instead of going through the TLB.  Only
+ * for RAM or ROM whose mapping does not change after machine init, as
+ * blocks already translated keep the old address.  Stores always take
+ * the TLB path, which detects writes to translated code. */
+void arm_cpu_add_direct_ram(ARMCPU *cpu, uint32_t base, uint32_t size,
+                            void *host)
+{
+    ARMDirectRAM *ram;
+
+    assert(cpu->nb_direct_ram < ARM_MAX_DIRECT_RAM);
+    ram = &cpu->direct_ram[cpu->nb_direct_ram++];
+    ram->base = base;
+    ram->size = size;
+    ram->host = host;
+#ifndef CONFIG_USER_ONLY
+    qemu_ram_set_direct(host);
+#endif
+}
+
+void arm_cpu_add_fetch_region(ARMCPU *cpu, uint32_t base, uint32_t size,
+                              uint32_t line_size)
+{
+    ARMFetchRegion *region;
+
+    assert(cpu->nb_fetch_region < ARM_MAX_FETCH_REGION);
+    region = &cpu->fetch_region[cpu->nb_fetch_region++];
+    region->base = base;
+    region->size = size;
+    region->line_size = line_size;
+}
+
+#ifndef CONFIG_USER_ONLY
+static void arm_cpu_fetch_flush_bh(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+
+    tb_flush(&cpu->env);
+}
+#endif
+
+/* The cost of the fetches is built into each translated block, so the
+ * blocks have to be thrown away when it changes.  This is called from
+ * register writes, in the middle of a block, so the flush waits for the
+ * CPU to leave the code it is running. */
+void arm_cpu_set_fetch_wait_states(ARMCPU *cpu, uint32_t wait_states,
+                                   bool prefetch)
+{
+    if (cpu->fetch_wait_states == wait_states &&
+        cpu->fetch_prefetch == prefetch) {
+        return;
+    }
+    cpu->fetch_wait_states = wait_states;
+    cpu->fetch_prefetch = prefetch;
+
+#ifndef CONFIG_USER_ONLY
+    if (use_icount && cpu->nb_fetch_region) {
+        if (!cpu->fetch_flush_bh) {
+            cpu->fetch_flush_bh = qemu_bh_new(arm_cpu_fetch_flush_bh, cpu);
+        }
+        qemu_bh_schedule(cpu->fetch_flush_bh);
+        cpu_exit(CPU(cpu));
+    }
+#endif
+}
+
+/* Board hook for M profile cores: while the trace regions are enabled, a
+ * block may follow a direct branch into [base, base + size), which must be
+ * a whole number of pages, and keep translating there.  That code is not
+ * part of the block's address range, so writes to it do not invalidate
+ * the block: the board disables the regions before the code can change. */
+void arm_cpu_add_trace_region(ARMCPU *cpu, uint32_t base, uint32_t size)
+{
+    ARMTraceRegion *region;
+
+    assert(cpu->nb_trace_region < ARM_MAX_TRACE_REGION);
+    assert(!(base & ~TARGET_PAGE_MASK) && !(size & ~TARGET_PAGE_MASK));
+    region = &cpu->trace_region[cpu->nb_trace_region++];
+    region->base = base;
+    region->size = size;
+}
+
+/* Disabling the regions throws away the blocks which went into them.  This
+ * is called from register writes, in the middle of a block, which goes on
+ * running from the old code buffer until it ends; the CPU then leaves the
+ * translated code.  As the regions are not used when counting
+ * instructions, no I/O will have to find the flushed block again.  */
+void arm_cpu_set_trace_enabled(ARMCPU *cpu, bool enabled)
+{
+    if (!cpu->nb_trace_region || cpu->trace_enabled == enabled) {
+        return;
+    }
+    cpu->trace_enabled = enabled;
+
+    if (!enabled && cpu->trace_translated) {
+        cpu->trace_translated = false;
+        tb_flush(&cpu->env);
+        cpu_exit(CPU(cpu));
+    }
+}
+
+/* Board hook for single core M profile machines: LDREX/STREX only use the
+ * local exclusive monitor, which LDREX sets, and CLREX, STREX, exception
+ * entry and exception return clear.  STREX then succeeds whenever the
+ * monitor is still set for its address, without reading the memory again
+ * to compare it with what LDREX loaded.  Like the local monitor of a real
+ * Cortex-M, it does not see the writes of other bus masters (DMA).  */
+void arm_cpu_set_local_monitor(ARMCPU *cpu, bool enabled)
+{
+    if (cpu->local_monitor != enabled) {
+        cpu->local_monitor = enabled;
+        tb_flush(&cpu->env);
+    }
+}
+
 static void arm_cpu_finalizefn(Object *obj)
 {
     ARMCPU *cpu = ARM_CPU(obj);
@@ -343,6 +462,8 @@ static void arm_cpu_realizefn(DeviceState *dev, Error **errp)
     }
     if (arm_feature(env, ARM_FEATURE_M)) {
         set_feature(env, ARM_FEATURE_THUMB_DIV);
+        /* no MMU, and all the code fits in a small flash region */
+        cpu_tb_jmp_cache_set_direct(cs);
     }
     if (arm_feature(env, ARM_FEATURE_ARM_DIV)) {
         set_feature(env, ARM_FEATURE_THUMB_DIV);
@@ -594,6 +715,19 @@ static void cortex_m3_initfn(Object *obj)
     cpu->midr = 0x410fc231;
 }
 
+static void cortex_m4_initfn(Object *obj)
+{
+    ARMCPU *cpu = ARM_CPU(obj);
+    set_feature(&cpu->env, ARM_FEATURE_V7);
+    set_feature(&cpu->env, ARM_FEATURE_M);
+    /* Cortex-M4F: the FPU is FPv4-SP.  We provide full VFPv4, which is
+     * a superset of it, but report single precision only in MVFR0.  */
+    set_feature(&cpu->env, ARM_FEATURE_VFP4);
+    cpu->midr = 0x410fc241;
+    cpu->mvfr0 = 0x10110021;
+    cpu->mvfr1 = 0x11000011;
+}
+
 static void arm_v7m_class_init(ObjectClass *oc, void *data)
 {
 #ifndef CONFIG_USER_ONLY
@@ -988,6 +1122,8 @@ static const ARMCPUInfo arm_cpus[] = {
     { .name = "arm11mpcore", .initfn = arm11mpcore_initfn },
     { .name = "cortex-m3",   .initfn = cortex_m3_initfn,
                              .class_init = arm_v7m_class_init },
+    { .name = "cortex-m4",   .initfn = cortex_m4_initfn,
+                             .class_init = arm_v7m_class_init },
     { .name = "cortex-a8",   .initfn = cortex_a8_initfn },
     { .name = "cortex-a9",   .initfn = cortex_a9_initfn },
     { .name = "cortex-a15",  .initfn = cortex_a15_initfn },
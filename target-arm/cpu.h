@@ -63,6 +63,26 @@
 #define ARMV7M_EXCP_PENDSV  14
 #define ARMV7M_EXCP_SYSTICK 15
 
+/* v7M MPU registers, in env->v7m */
+#define V7M_MPU_NREGIONS            8
+#define V7M_MPU_CTRL_ENABLE         (1 << 0)
+#define V7M_MPU_CTRL_HFNMIENA       (1 << 1)
+#define V7M_MPU_CTRL_PRIVDEFENA     (1 << 2)
+#define V7M_MPU_RBAR_REGION_MASK    0x0000000f
+#define V7M_MPU_RBAR_VALID          (1 << 4)
+#define V7M_MPU_RBAR_ADDR_MASK      0xffffffe0
+#define V7M_MPU_RASR_ENABLE         (1 << 0)
+#define V7M_MPU_RASR_SIZE_SHIFT     1
+#define V7M_MPU_RASR_SRD_SHIFT      8
+#define V7M_MPU_RASR_AP_SHIFT       24
+#define V7M_MPU_RASR_XN             (1 << 28)
+#define V7M_MPU_RASR_MASK           0x173fff3f
+
+/* MemManage fault status bits of CFSR */
+#define V7M_CFSR_IACCVIOL           (1 << 0)
+#define V7M_CFSR_DACCVIOL           (1 << 1)
+#define V7M_CFSR_MMARVALID          (1 << 7)
+
 /* ARM-specific interrupt pending bits.  */
 #define CPU_INTERRUPT_FIQ   CPU_INTERRUPT_TGT_EXT_1
 
@@ -234,6 +254,14 @@ typedef struct CPUARMState {
         int current_sp;
         int exception;
         int pending_exception;
+        /* MPU */
+        uint32_t mpu_ctrl;
+        uint32_t mpu_rnr;
+        uint32_t mpu_rbar[V7M_MPU_NREGIONS];
+        uint32_t mpu_rasr[V7M_MPU_NREGIONS];
+        /* Fault status: only the MemManage half of CFSR is set */
+        uint32_t cfsr;
+        uint32_t mmfar;
     } v7m;
 
     /* Information associated with an exception about to be taken:
@@ -683,6 +711,7 @@ void arm_cpu_list(FILE *f, fprintf_function cpu_fprintf);
 void armv7m_nvic_set_pending(void *opaque, int irq);
 int armv7m_nvic_acknowledge_irq(void *opaque);
 void armv7m_nvic_complete_irq(void *opaque, int irq);
+void armv7m_nvic_wfi(void *opaque);
 
 /* Interface for defining coprocessor registers.
  * Registers are defined in tables of arm_cp_reginfo structs
@@ -857,6 +886,10 @@ static inline int arm_current_pl(CPUARMState *env)
         return extract32(env->pstate, 2, 2);
     }
 
+    if (arm_feature(env, ARM_FEATURE_M)) {
+        /* Thread mode is unprivileged when CONTROL.nPRIV is set */
+        return !((env->v7m.exception == 0) && (env->v7m.control & 1));
+    }
     if ((env->uncached_cpsr & 0x1f) == ARM_CPU_MODE_USR) {
         return 0;
     }
@@ -1136,6 +1169,12 @@ static inline int cpu_mmu_index (CPUARMState *env)
 #define ARM_TBFLAG_BSWAP_CODE_MASK  (1 << ARM_TBFLAG_BSWAP_CODE_SHIFT)
 #define ARM_TBFLAG_CPACR_FPEN_SHIFT 17
 #define ARM_TBFLAG_CPACR_FPEN_MASK  (1 << ARM_TBFLAG_CPACR_FPEN_SHIFT)
+/* M profile: the MPU is enabled, so loads cannot skip the TLB */
+#define ARM_TBFLAG_MPUEN_SHIFT      18
+#define ARM_TBFLAG_MPUEN_MASK       (1 << ARM_TBFLAG_MPUEN_SHIFT)
+/* M profile: the block may follow branches into the trace regions */
+#define ARM_TBFLAG_TRACE_SHIFT      19
+#define ARM_TBFLAG_TRACE_MASK       (1 << ARM_TBFLAG_TRACE_SHIFT)
 
 /* Bit usage when in AArch64 state */
 #define ARM_TBFLAG_AA64_EL_SHIFT    0
@@ -1162,6 +1201,10 @@ static inline int cpu_mmu_index (CPUARMState *env)
     (((F) & ARM_TBFLAG_BSWAP_CODE_MASK) >> ARM_TBFLAG_BSWAP_CODE_SHIFT)
 #define ARM_TBFLAG_CPACR_FPEN(F) \
     (((F) & ARM_TBFLAG_CPACR_FPEN_MASK) >> ARM_TBFLAG_CPACR_FPEN_SHIFT)
+#define ARM_TBFLAG_MPUEN(F) \
+    (((F) & ARM_TBFLAG_MPUEN_MASK) >> ARM_TBFLAG_MPUEN_SHIFT)
+#define ARM_TBFLAG_TRACE(F) \
+    (((F) & ARM_TBFLAG_TRACE_MASK) >> ARM_TBFLAG_TRACE_SHIFT)
 #define ARM_TBFLAG_AA64_EL(F) \
     (((F) & ARM_TBFLAG_AA64_EL_MASK) >> ARM_TBFLAG_AA64_EL_SHIFT)
 #define ARM_TBFLAG_AA64_FPEN(F) \
@@ -1196,6 +1239,14 @@ static inline void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
             | (env->bswap_code << ARM_TBFLAG_BSWAP_CODE_SHIFT);
         if (arm_feature(env, ARM_FEATURE_M)) {
             privmode = !((env->v7m.exception == 0) && (env->v7m.control & 1));
+            if (env->v7m.mpu_ctrl & V7M_MPU_CTRL_ENABLE) {
+                *flags |= ARM_TBFLAG_MPUEN_MASK;
+            } else if (arm_env_get_cpu(env)->trace_enabled &&
+                       QTAILQ_EMPTY(&ENV_GET_CPU(env)->breakpoints)) {
+                /* A breakpoint only invalidates the blocks whose address
+                   range has it */
+                *flags |= ARM_TBFLAG_TRACE_MASK;
+            }
         } else {
             privmode = (env->uncached_cpsr & CPSR_M) != ARM_CPU_MODE_USR;
         }
@@ -3231,6 +3231,22 @@ static uint32_t v7m_pop(CPUARMState *env)
     return val;
 }
 
+/* Single precision register n, which is half of double register n / 2.  */
+static uint32_t v7m_get_sreg(CPUARMState *env, int n)
+{
+    uint64_t d = float64_val(env->vfp.regs[n >> 1]);
+
+    return (n & 1) ? d >> 32 : (uint32_t)d;
+}
+
+static void v7m_set_sreg(CPUARMState *env, int n, uint32_t val)
+{
+    uint64_t d = float64_val(env->vfp.regs[n >> 1]);
+
+    d = deposit64(d, (n & 1) * 32, 32, val);
+    env->vfp.regs[n >> 1] = make_float64(d);
+}
+
 /* Switch to V7M main or process stack pointer.  */
 static void switch_v7m_sp(CPUARMState *env, int process)
 {
@@ -3243,15 +3259,82 @@ static void switch_v7m_sp(CPUARMState *env, int process)
     }
 }
 
+/* Branch to the handler for the exception the NVIC just acknowledged,
+ * with the given EXC_RETURN value in LR.  */
+static void v7m_exception_taken(CPUARMState *env, uint32_t lr)
+{
+    CPUState *cs = CPU(arm_env_get_cpu(env));
+    uint32_t addr;
+
+    /* Clear IT bits */
+    env->condexec_bits = 0;
+    /* Exception entry and return clear the local exclusive monitor.  */
+    env->exclusive_addr = -1;
+    /* The handler starts without any FP context of its own.  */
+    env->v7m.control &= ~4;
+    env->regs[14] = lr;
+    addr = ldl_phys(cs->as, env->v7m.vecbase + env->v7m.exception * 4);
+    env->regs[15] = addr & 0xfffffffe;
+    env->thumb = addr & 1;
+}
+
+/* The v7M MPU is not used at execution priorities below 0 (HardFault, NMI
+ * and FAULTMASK) unless HFNMIENA is set.  */
+static bool v7m_mpu_bypassed(CPUARMState *env)
+{
+    if (!(env->v7m.mpu_ctrl & V7M_MPU_CTRL_ENABLE)) {
+        return true;
+    }
+    if (env->v7m.mpu_ctrl & V7M_MPU_CTRL_HFNMIENA) {
+        return false;
+    }
+    return env->v7m.exception == ARMV7M_EXCP_NMI ||
+           env->v7m.exception == ARMV7M_EXCP_HARD ||
+           (env->daif & PSTATE_F);
+}
+
+/* The TLB keeps the permissions of the MPU for a whole page, so it has to
+ * be flushed when leaving the priorities that bypass the MPU.  Entries
+ * made with the MPU in use are never more permissive than the default
+ * map, so nothing is needed on the way in.  */
+static void v7m_mpu_leave_bypass(CPUARMState *env)
+{
+    if ((env->v7m.mpu_ctrl & (V7M_MPU_CTRL_ENABLE | V7M_MPU_CTRL_HFNMIENA))
+        == V7M_MPU_CTRL_ENABLE) {
+        tlb_flush(CPU(arm_env_get_cpu(env)), 1);
+    }
+}
+
 static void do_v7m_exception_exit(CPUARMState *env)
 {
+    CPUState *cs = CPU(arm_env_get_cpu(env));
     uint32_t type;
     uint32_t xpsr;
+    int i;
 
     type = env->regs[15];
+    env->exclusive_addr = -1;
+    if (env->v7m.exception == ARMV7M_EXCP_NMI ||
+        env->v7m.exception == ARMV7M_EXCP_HARD) {
+        v7m_mpu_leave_bypass(env);
+    }
     if (env->v7m.exception != 0)
         armv7m_nvic_complete_irq(env->nvic, env->v7m.exception);
 
+    /* Tail-chaining: if completing this exception left another one pending
+     * that can preempt the context we are returning to, the NVIC has raised
+     * the interrupt line again.  Take it straight away, leaving the stack
+     * frame we would have popped in place for the new handler to return
+     * through, as the hardware does.  We are still in Handler mode on the
+     * main stack, so only the exception number and LR change.  */
+    if (cs->interrupt_request & CPU_INTERRUPT_HARD) {
+        env->v7m.exception = armv7m_nvic_acknowledge_irq(env->nvic);
+        qemu_log_mask(CPU_LOG_INT, "...tail-chained to exception %d\n",
+                      env->v7m.exception);
+        v7m_exception_taken(env, type);
+        return;
+    }
+
     /* Switch to the target stack.  */
     switch_v7m_sp(env, (type & 4) != 0);
     /* Pop registers.  */
@@ -3266,6 +3349,20 @@ static void do_v7m_exception_exit(CPUARMState *env)
      * when restoring the program counter. */
     env->regs[15] = v7m_pop(env) & 0xfffffffe;
     xpsr = v7m_pop(env);
+    if (arm_feature(env, ARM_FEATURE_VFP)) {
+        /* EXC_RETURN bit 4 clear means the frame includes the FP context,
+           and that the interrupted code had one.  */
+        if (type & 0x10) {
+            env->v7m.control &= ~4;
+        } else {
+            for (i = 0; i < 16; i++) {
+                v7m_set_sreg(env, i, v7m_pop(env));
+            }
+            vfp_set_fpscr(env, v7m_pop(env));
+            v7m_pop(env); /* Reserved.  */
+            env->v7m.control |= 4;
+        }
+    }
     xpsr_write(env, xpsr, 0xfffffdff);
     /* Undo stack alignment.  */
     if (xpsr & 0x200)
@@ -3283,7 +3380,8 @@ void arm_v7m_cpu_do_interrupt(CPUState *cs)
     CPUARMState *env = &cpu->env;
     uint32_t xpsr = xpsr_read(env);
     uint32_t lr;
-    uint32_t addr;
+    bool fp_frame;
+    int i;
 
     arm_log_exception(cs->exception_index);
 
@@ -3306,10 +3404,12 @@ void arm_v7m_cpu_do_interrupt(CPUState *cs)
         armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_SVC);
         return;
     case EXCP_PREFETCH_ABORT:
+        env->v7m.cfsr |= V7M_CFSR_IACCVIOL;
+        armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_MEM);
+        return;
     case EXCP_DATA_ABORT:
-        /* TODO: if we implemented the MPU registers, this is where we
-         * should set the MMFAR, etc from exception.fsr and exception.vaddress.
-         */
+        env->v7m.cfsr |= V7M_CFSR_DACCVIOL | V7M_CFSR_MMARVALID;
+        env->v7m.mmfar = env->exception.vaddress;
         armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_MEM);
         return;
     case EXCP_BKPT:
@@ -3343,6 +3443,19 @@ void arm_v7m_cpu_do_interrupt(CPUState *cs)
         env->regs[13] -= 4;
         xpsr |= 0x200;
     }
+    /* If the interrupted code has used the FPU since it was entered
+       (CONTROL.FPCA), save S0-S15 and FPSCR too, and tell the return
+       code with bit 4 of EXC_RETURN.  The state is always saved straight
+       away, i.e. lazy stacking is not modelled.  */
+    fp_frame = arm_feature(env, ARM_FEATURE_VFP) && (env->v7m.control & 4);
+    if (fp_frame) {
+        v7m_push(env, 0); /* Reserved.  */
+        v7m_push(env, vfp_get_fpscr(env));
+        for (i = 15; i >= 0; i--) {
+            v7m_push(env, v7m_get_sreg(env, i));
+        }
+        lr &= ~0x10;
+    }
     /* Switch to the handler mode.  */
     v7m_push(env, xpsr);
     v7m_push(env, env->regs[15]);
@@ -3353,12 +3466,7 @@ void arm_v7m_cpu_do_interrupt(CPUState *cs)
     v7m_push(env, env->regs[1]);
     v7m_push(env, env->regs[0]);
     switch_v7m_sp(env, 0);
-    /* Clear IT bits */
-    env->condexec_bits = 0;
-    env->regs[14] = lr;
-    addr = ldl_phys(cs->as, env->v7m.vecbase + env->v7m.exception * 4);
-    env->regs[15] = addr & 0xfffffffe;
-    env->thumb = addr & 1;
+    v7m_exception_taken(env, lr);
 }
 
 /* Handle a CPU exception.  */
@@ -4074,6 +4182,104 @@ static int get_phys_addr_mpu(CPUARMState *env, uint32_t address,
     return 0;
 }
 
+/* ARMv7-M MPU.  The highest numbered enabled region containing the
+ * address gives its permissions.  The TLB works on TARGET_PAGE_SIZE
+ * pages, so regions and subregions smaller than that cannot be enforced
+ * and are ignored.  The XN attribute of the default memory map is not
+ * modelled.  */
+static int get_phys_addr_v7m(CPUARMState *env, uint32_t address,
+                             int access_type, int is_user,
+                             hwaddr *phys_ptr, int *prot)
+{
+    uint32_t rasr = 0;
+    int n, size_bits, srd;
+
+    *phys_ptr = address;
+    /* The PPB always uses the default map, and so does the page the
+       exception return addresses live in (see armv7m_init_with_flash).  */
+    if (v7m_mpu_bypassed(env) ||
+        (address >= 0xe0000000 && address < 0xe0100000) ||
+        address >= 0xfffff000) {
+        *prot = PAGE_READ | PAGE_WRITE | PAGE_EXEC;
+        return 0;
+    }
+
+    for (n = V7M_MPU_NREGIONS - 1; n >= 0; n--) {
+        rasr = env->v7m.mpu_rasr[n];
+        if (!(rasr & V7M_MPU_RASR_ENABLE)) {
+            continue;
+        }
+        size_bits = extract32(rasr, V7M_MPU_RASR_SIZE_SHIFT, 5) + 1;
+        if (size_bits < TARGET_PAGE_BITS) {
+            qemu_log_mask(LOG_UNIMP, "v7M MPU: region %d smaller than %d "
+                          "bytes ignored\n", n, TARGET_PAGE_SIZE);
+            continue;
+        }
+        if (size_bits < 32 &&
+            ((address ^ env->v7m.mpu_rbar[n]) >> size_bits) != 0) {
+            continue;
+        }
+        srd = extract32(rasr, V7M_MPU_RASR_SRD_SHIFT, 8);
+        if (srd) {
+            if (size_bits - 3 < TARGET_PAGE_BITS) {
+                qemu_log_mask(LOG_UNIMP, "v7M MPU: subregions of region %d "
+                              "smaller than %d bytes ignored\n", n,
+                              TARGET_PAGE_SIZE);
+                continue;
+            }
+            if (srd & (1 << extract32(address, size_bits - 3, 3))) {
+                continue;
+            }
+        }
+        break;
+    }
+
+    if (n < 0) {
+        /* Background region */
+        if (is_user || !(env->v7m.mpu_ctrl & V7M_MPU_CTRL_PRIVDEFENA)) {
+            return 1;
+        }
+        *prot = PAGE_READ | PAGE_WRITE | PAGE_EXEC;
+        return 0;
+    }
+
+    switch (extract32(rasr, V7M_MPU_RASR_AP_SHIFT, 3)) {
+    case 1:
+        if (is_user) {
+            return 1;
+        }
+        *prot = PAGE_READ | PAGE_WRITE;
+        break;
+    case 2:
+        *prot = is_user ? PAGE_READ : PAGE_READ | PAGE_WRITE;
+        break;
+    case 3:
+        *prot = PAGE_READ | PAGE_WRITE;
+        break;
+    case 5:
+        if (is_user) {
+            return 1;
+        }
+        *prot = PAGE_READ;
+        break;
+    case 6:
+    case 7:
+        *prot = PAGE_READ;
+        break;
+    default:
+        /* No access, or reserved */
+        return 1;
+    }
+    if (!(rasr & V7M_MPU_RASR_XN)) {
+        *prot |= PAGE_EXEC;
+    }
+    /* PAGE_READ, PAGE_WRITE and PAGE_EXEC follow access_type */
+    if (!(*prot & (1 << access_type))) {
+        return 1;
+    }
+    return 0;
+}
+
 /* get_phys_addr - get the physical address for this virtual address
  *
  * Find the physical address corresponding to the given virtual address,
@@ -4102,6 +4308,12 @@ static inline int get_phys_addr(CPUARMState *env, target_ulong address,
                                 hwaddr *phys_ptr, int *prot,
                                 target_ulong *page_size)
 {
+    if (arm_feature(env, ARM_FEATURE_M)) {
+        *page_size = TARGET_PAGE_SIZE;
+        return get_phys_addr_v7m(env, address, access_type, is_user,
+                                 phys_ptr, prot);
+    }
+
     /* Fast Context Switch Extension.  */
     if (address < 0x02000000)
         address += env->cp15.c13_fcse;
@@ -4182,6 +4394,11 @@ hwaddr arm_cpu_get_phys_page_debug(CPUState *cs, vaddr addr)
     int prot;
     int ret;
 
+    /* Debug accesses are not checked by the v7M MPU */
+    if (arm_feature(&cpu->env, ARM_FEATURE_M)) {
+        return addr & TARGET_PAGE_MASK;
+    }
+
     ret = get_phys_addr(&cpu->env, addr, 0, 0, &phys_addr, &prot, &page_size);
 
     if (ret != 0) {
@@ -4304,12 +4521,14 @@ void HELPER(v7m_msr)(CPUARMState *env, uint32_t reg, uint32_t val)
     case 19: /* FAULTMASK */
         if (val & 1) {
             env->daif |= PSTATE_F;
-        } else {
+        } else if (env->daif & PSTATE_F) {
             env->daif &= ~PSTATE_F;
+            v7m_mpu_leave_bypass(env);
         }
         break;
     case 20: /* CONTROL */
-        env->v7m.control = val & 3;
+        /* FPCA (bit 2) only exists with an FPU.  */
+        env->v7m.control = val & (arm_feature(env, ARM_FEATURE_VFP) ? 7 : 3);
         switch_v7m_sp(env, (val & 2) != 0);
         break;
     default:
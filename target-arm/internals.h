@@ -66,7 +66,11 @@ static inline void arm_log_exception(int idx)
         if (!exc) {
             exc = "unknown";
         }
-        qemu_log_mask(CPU_LOG_INT, "Taking exception %d [%s]\n", idx, exc);
+        if (qemu_loglevel_mask(LOG_ASYNC)) {
+            qemu_log_async_exception(idx, exc);
+        } else {
+            qemu_log_mask(CPU_LOG_INT, "Taking exception %d [%s]\n", idx, exc);
+        }
     }
 }
 
@@ -88,7 +88,7 @@ static bool m_needed(void *opaque)
 
 static const VMStateDescription vmstate_m = {
     .name = "cpu/m",
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32(env.v7m.other_sp, ARMCPU),
@@ -97,6 +97,12 @@ static const VMStateDescription vmstate_m = {
         VMSTATE_UINT32(env.v7m.control, ARMCPU),
         VMSTATE_INT32(env.v7m.current_sp, ARMCPU),
         VMSTATE_INT32(env.v7m.exception, ARMCPU),
+        VMSTATE_UINT32_V(env.v7m.mpu_ctrl, ARMCPU, 2),
+        VMSTATE_UINT32_V(env.v7m.mpu_rnr, ARMCPU, 2),
+        VMSTATE_UINT32_ARRAY_V(env.v7m.mpu_rbar, ARMCPU, V7M_MPU_NREGIONS, 2),
+        VMSTATE_UINT32_ARRAY_V(env.v7m.mpu_rasr, ARMCPU, V7M_MPU_NREGIONS, 2),
+        VMSTATE_UINT32_V(env.v7m.cfsr, ARMCPU, 2),
+        VMSTATE_UINT32_V(env.v7m.mmfar, ARMCPU, 2),
         VMSTATE_END_OF_LIST()
     }
 };
@@ -20,6 +20,7 @@
 #include "exec/helper-proto.h"
 #include "internals.h"
 #include "exec/cpu_ldst.h"
+#include "tcg.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -213,11 +214,49 @@ void HELPER(wfi)(CPUARMState *env)
 {
     CPUState *cs = CPU(arm_env_get_cpu(env));
 
+#ifndef CONFIG_USER_ONLY
+    /* With an interrupt to take the core does not go to sleep at all */
+    if (arm_feature(env, ARM_FEATURE_M) &&
+        !(cs->interrupt_request & CPU_INTERRUPT_HARD)) {
+        armv7m_nvic_wfi(env->nvic);
+    }
+#endif
     cs->exception_index = EXCP_HLT;
     cs->halted = 1;
     cpu_loop_exit(cs);
 }
 
+/* Store to a device register whose address was known at translation time,
+ * see gen_mmio_fast_write(). */
+void HELPER(mmio_fast_write)(void *mr, void *fn, uint32_t val)
+{
+#ifndef CONFIG_USER_ONLY
+    memory_region_fast_write(mr, fn, val);
+#endif
+}
+
+/* Find the TB an indirect branch (BX, POP {pc}, ...) goes to, so that the
+ * generated code can jump to it directly instead of returning to
+ * cpu_exec() for the lookup.  Only the per-CPU jump cache is consulted;
+ * on a miss the code returns through the epilogue as for exit_tb(0), and
+ * cpu_exec() does the full lookup or translation.
+ */
+void *HELPER(lookup_tb_ptr)(CPUARMState *env)
+{
+    CPUState *cs = CPU(arm_env_get_cpu(env));
+    TranslationBlock *tb;
+    target_ulong pc, cs_base;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = cs->tb_jmp_cache[tb_jmp_cache_hash_func(cs, pc)];
+    if (likely(tb && tb->pc == pc && tb->cs_base == cs_base &&
+               tb->flags == flags && !tb_is_counted(tb))) {
+        return tb->tc_ptr;
+    }
+    return tcg_ctx.code_gen_epilogue;
+}
+
 void HELPER(wfe)(CPUARMState *env)
 {
     CPUState *cs = CPU(arm_env_get_cpu(env));
@@ -73,6 +73,12 @@ static TCGv_i32 cpu_exclusive_info;
 static TCGv_i32 cpu_F0s, cpu_F1s;
 static TCGv_i64 cpu_F0d, cpu_F1d;
 
+/* Operands of the last gen_sub_CC(), and where the ops emitted after it
+   start (NULL if there was none in this TB), see gen_test_cc().  */
+static TCGv_i32 cpu_cmp_a, cpu_cmp_b;
+static uint16_t *cmp_opc_ptr;
+static TCGArg *cmp_opparam_ptr;
+
 #include "exec/gen-icount.h"
 
 static const char *regnames[] =
@@ -160,6 +166,7 @@ static void store_reg(DisasContext *s, int reg, TCGv_i32 var)
         tcg_gen_andi_i32(var, var, ~1);
         s->is_jmp = DISAS_JUMP;
     }
+    s->known_regs &= ~(1 << reg);
     tcg_gen_mov_i32(cpu_R[reg], var);
     tcg_temp_free_i32(var);
 }
@@ -436,6 +443,9 @@ static void gen_adc_CC(TCGv_i32 dest, TCGv_i32 t0, TCGv_i32 t1)
 static void gen_sub_CC(TCGv_i32 dest, TCGv_i32 t0, TCGv_i32 t1)
 {
     TCGv_i32 tmp;
+    /* These copies are dead, and removed, unless gen_test_cc() uses them */
+    tcg_gen_mov_i32(cpu_cmp_a, t0);
+    tcg_gen_mov_i32(cpu_cmp_b, t1);
     tcg_gen_sub_i32(cpu_NF, t0, t1);
     tcg_gen_mov_i32(cpu_ZF, cpu_NF);
     tcg_gen_setcond_i32(TCG_COND_GEU, cpu_CF, t0, t1);
@@ -445,6 +455,8 @@ static void gen_sub_CC(TCGv_i32 dest, TCGv_i32 t0, TCGv_i32 t1)
     tcg_gen_and_i32(cpu_VF, cpu_VF, tmp);
     tcg_temp_free_i32(tmp);
     tcg_gen_mov_i32(dest, cpu_NF);
+    cmp_opc_ptr = tcg_ctx.gen_opc_ptr;
+    cmp_opparam_ptr = tcg_ctx.gen_opparam_ptr;
 }
 
 /* dest = T0 + ~T1 + CF.  Compute C, N, V and Z flags */
@@ -587,98 +599,212 @@ static inline void gen_arm_shift_reg(TCGv_i32 var, int shiftop,
     tcg_temp_free_i32(shift);
 }
 
-#define PAS_OP(pfx) \
-    switch (op2) {  \
-    case 0: gen_pas_helper(glue(pfx,add16)); break; \
-    case 1: gen_pas_helper(glue(pfx,addsubx)); break; \
-    case 2: gen_pas_helper(glue(pfx,subaddx)); break; \
-    case 3: gen_pas_helper(glue(pfx,sub16)); break; \
-    case 4: gen_pas_helper(glue(pfx,add8)); break; \
-    case 7: gen_pas_helper(glue(pfx,sub8)); break; \
+/* Parallel add/subtract.  These are expanded inline rather than calling
+ * the op_addsub.h helpers: DSP code uses them in its inner loops, and a
+ * helper call which writes GE through a pointer costs much more than the
+ * few TCG ops per lane.  */
+enum {
+    PAS_S,      /* signed modulo, sets GE */
+    PAS_Q,      /* signed saturating */
+    PAS_SH,     /* signed halving */
+    PAS_U,      /* unsigned modulo, sets GE */
+    PAS_UQ,     /* unsigned saturating */
+    PAS_UH,     /* unsigned halving */
+};
+
+enum {
+    PAS_ADD16,
+    PAS_ADDSUBX,    /* ASX: low = a.lo - b.hi, high = a.hi + b.lo */
+    PAS_SUBADDX,    /* SAX: low = a.lo + b.hi, high = a.hi - b.lo */
+    PAS_SUB16,
+    PAS_ADD8,
+    PAS_SUB8,
+};
+
+/* Extract the width bit lane at pos from var, sign or zero extended.  */
+static void gen_pas_lane(TCGv_i32 dest, TCGv_i32 var, int pos, int width,
+                         bool is_signed)
+{
+    if (is_signed) {
+        if (pos + width == 32) {
+            tcg_gen_sari_i32(dest, var, pos);
+        } else {
+            tcg_gen_shli_i32(dest, var, 32 - pos - width);
+            tcg_gen_sari_i32(dest, dest, 32 - width);
+        }
+    } else if (pos + width == 32) {
+        tcg_gen_shri_i32(dest, var, pos);
+    } else {
+        if (pos) {
+            tcg_gen_shri_i32(dest, var, pos);
+            var = dest;
+        }
+        tcg_gen_andi_i32(dest, var, (1u << width) - 1);
+    }
+}
+
+/* a = a <op> b, lane by lane.  Each lane is computed exactly in 32 bits,
+ * then saturated, halved or checked for GE before being inserted into the
+ * result.  */
+static void gen_parallel_addsub(int kind, int op, TCGv_i32 a, TCGv_i32 b)
+{
+    bool is_signed = kind <= PAS_SH;
+    int width = (op == PAS_ADD8 || op == PAS_SUB8) ? 8 : 16;
+    int32_t max = is_signed ? (1 << (width - 1)) - 1 : (1 << width) - 1;
+    int32_t min = is_signed ? -(1 << (width - 1)) : 0;
+    TCGv_i32 res = tcg_temp_new_i32();
+    TCGv_i32 x = tcg_temp_new_i32();
+    TCGv_i32 y = tcg_temp_new_i32();
+    bool set_ge = (kind == PAS_S || kind == PAS_U);
+    TCGv_i32 ge, lim;
+    int n, bpos;
+    bool sub;
+
+    TCGV_UNUSED_I32(ge);
+    if (set_ge) {
+        ge = tcg_const_i32(0);
+    }
+    for (n = 0; n < 32 / width; n++) {
+        bpos = n * width;
+        switch (op) {
+        case PAS_ADDSUBX:
+            sub = (n == 0);
+            bpos = 16 - bpos;
+            break;
+        case PAS_SUBADDX:
+            sub = (n == 1);
+            bpos = 16 - bpos;
+            break;
+        default:
+            sub = (op == PAS_SUB16 || op == PAS_SUB8);
+            break;
+        }
+        gen_pas_lane(x, a, n * width, width, is_signed);
+        gen_pas_lane(y, b, bpos, width, is_signed);
+        if (sub) {
+            tcg_gen_sub_i32(x, x, y);
+        } else {
+            tcg_gen_add_i32(x, x, y);
+        }
+
+        switch (kind) {
+        case PAS_S:
+        case PAS_U:
+            if (kind == PAS_U && !sub) {
+                /* Unsigned add: GE is the carry out of the lane.  */
+                tcg_gen_setcondi_i32(TCG_COND_GE, y, x, 1 << width);
+            } else {
+                tcg_gen_setcondi_i32(TCG_COND_GE, y, x, 0);
+            }
+            tcg_gen_neg_i32(y, y);
+            tcg_gen_andi_i32(y, y, width == 16 ? 3 << (n * 2) : 1 << n);
+            tcg_gen_or_i32(ge, ge, y);
+            break;
+        case PAS_Q:
+        case PAS_UQ:
+            lim = tcg_const_i32(max);
+            tcg_gen_movcond_i32(TCG_COND_GT, x, x, lim, lim, x);
+            tcg_gen_movi_i32(lim, min);
+            tcg_gen_movcond_i32(TCG_COND_LT, x, x, lim, lim, x);
+            tcg_temp_free_i32(lim);
+            break;
+        case PAS_SH:
+        case PAS_UH:
+            tcg_gen_sari_i32(x, x, 1);
+            break;
+        }
+
+        if (n == 0) {
+            tcg_gen_andi_i32(res, x, (1u << width) - 1);
+        } else {
+            tcg_gen_deposit_i32(res, res, x, n * width, width);
+        }
     }
+    if (set_ge) {
+        tcg_gen_st_i32(ge, cpu_env, offsetof(CPUARMState, GE));
+        tcg_temp_free_i32(ge);
+    }
+    tcg_gen_mov_i32(a, res);
+    tcg_temp_free_i32(y);
+    tcg_temp_free_i32(x);
+    tcg_temp_free_i32(res);
+}
+
 static void gen_arm_parallel_addsub(int op1, int op2, TCGv_i32 a, TCGv_i32 b)
 {
-    TCGv_ptr tmp;
+    static const int8_t kinds[8] = {
+        -1, PAS_S, PAS_Q, PAS_SH, -1, PAS_U, PAS_UQ, PAS_UH
+    };
+    static const int8_t ops[8] = {
+        PAS_ADD16, PAS_ADDSUBX, PAS_SUBADDX, PAS_SUB16,
+        PAS_ADD8, -1, -1, PAS_SUB8
+    };
 
-    switch (op1) {
-#define gen_pas_helper(name) glue(gen_helper_,name)(a, a, b, tmp)
-    case 1:
-        tmp = tcg_temp_new_ptr();
-        tcg_gen_addi_ptr(tmp, cpu_env, offsetof(CPUARMState, GE));
-        PAS_OP(s)
-        tcg_temp_free_ptr(tmp);
-        break;
-    case 5:
-        tmp = tcg_temp_new_ptr();
-        tcg_gen_addi_ptr(tmp, cpu_env, offsetof(CPUARMState, GE));
-        PAS_OP(u)
-        tcg_temp_free_ptr(tmp);
-        break;
-#undef gen_pas_helper
-#define gen_pas_helper(name) glue(gen_helper_,name)(a, a, b)
-    case 2:
-        PAS_OP(q);
-        break;
-    case 3:
-        PAS_OP(sh);
-        break;
-    case 6:
-        PAS_OP(uq);
-        break;
-    case 7:
-        PAS_OP(uh);
-        break;
-#undef gen_pas_helper
+    if (kinds[op1] >= 0 && ops[op2] >= 0) {
+        gen_parallel_addsub(kinds[op1], ops[op2], a, b);
     }
 }
-#undef PAS_OP
 
 /* For unknown reasons Arm and Thumb-2 use arbitrarily different encodings.  */
-#define PAS_OP(pfx) \
-    switch (op1) {  \
-    case 0: gen_pas_helper(glue(pfx,add8)); break; \
-    case 1: gen_pas_helper(glue(pfx,add16)); break; \
-    case 2: gen_pas_helper(glue(pfx,addsubx)); break; \
-    case 4: gen_pas_helper(glue(pfx,sub8)); break; \
-    case 5: gen_pas_helper(glue(pfx,sub16)); break; \
-    case 6: gen_pas_helper(glue(pfx,subaddx)); break; \
-    }
 static void gen_thumb2_parallel_addsub(int op1, int op2, TCGv_i32 a, TCGv_i32 b)
 {
-    TCGv_ptr tmp;
+    static const int8_t kinds[8] = {
+        PAS_S, PAS_Q, PAS_SH, -1, PAS_U, PAS_UQ, PAS_UH, -1
+    };
+    static const int8_t ops[8] = {
+        PAS_ADD8, PAS_ADD16, PAS_ADDSUBX, -1,
+        PAS_SUB8, PAS_SUB16, PAS_SUBADDX, -1
+    };
 
-    switch (op2) {
-#define gen_pas_helper(name) glue(gen_helper_,name)(a, a, b, tmp)
-    case 0:
-        tmp = tcg_temp_new_ptr();
-        tcg_gen_addi_ptr(tmp, cpu_env, offsetof(CPUARMState, GE));
-        PAS_OP(s)
-        tcg_temp_free_ptr(tmp);
-        break;
-    case 4:
-        tmp = tcg_temp_new_ptr();
-        tcg_gen_addi_ptr(tmp, cpu_env, offsetof(CPUARMState, GE));
-        PAS_OP(u)
-        tcg_temp_free_ptr(tmp);
-        break;
-#undef gen_pas_helper
-#define gen_pas_helper(name) glue(gen_helper_,name)(a, a, b)
-    case 1:
-        PAS_OP(q);
-        break;
-    case 2:
-        PAS_OP(sh);
-        break;
-    case 5:
-        PAS_OP(uq);
-        break;
-    case 6:
-        PAS_OP(uh);
-        break;
-#undef gen_pas_helper
+    if (kinds[op2] >= 0 && ops[op1] >= 0) {
+        gen_parallel_addsub(kinds[op2], ops[op1], a, b);
     }
 }
-#undef PAS_OP
+
+/* SEL: dest = a or b, byte by byte, according to the GE flags.  The four
+ * GE bits are spread out to the bottom bit of each byte, then multiplied
+ * into byte masks.  */
+static void gen_sel(TCGv_i32 dest, TCGv_i32 a, TCGv_i32 b)
+{
+    TCGv_i32 mask = tcg_temp_new_i32();
+    TCGv_i32 tmp = tcg_temp_new_i32();
+
+    tcg_gen_ld_i32(mask, cpu_env, offsetof(CPUARMState, GE));
+    tcg_gen_shli_i32(tmp, mask, 14);
+    tcg_gen_or_i32(mask, mask, tmp);
+    tcg_gen_andi_i32(mask, mask, 0x00030003);
+    tcg_gen_shli_i32(tmp, mask, 7);
+    tcg_gen_or_i32(mask, mask, tmp);
+    tcg_gen_andi_i32(mask, mask, 0x01010101);
+    tcg_gen_muli_i32(mask, mask, 0xff);
+    tcg_gen_and_i32(tmp, a, mask);
+    tcg_gen_andc_i32(dest, b, mask);
+    tcg_gen_or_i32(dest, dest, tmp);
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i32(mask);
+}
+
+/* dest = a + b, setting the Q flag on signed overflow (the inline version
+ * of HELPER(add_setq), used by the DSP multiply-accumulates).  */
+static void gen_add_setq(TCGv_i32 dest, TCGv_i32 a, TCGv_i32 b)
+{
+    TCGv_i32 res = tcg_temp_new_i32();
+    TCGv_i32 tmp = tcg_temp_new_i32();
+    TCGv_i32 q = tcg_temp_new_i32();
+
+    tcg_gen_add_i32(res, a, b);
+    tcg_gen_xor_i32(tmp, res, a);
+    tcg_gen_xor_i32(q, a, b);
+    tcg_gen_andc_i32(tmp, tmp, q);
+    tcg_gen_shri_i32(tmp, tmp, 31);
+    tcg_gen_ld_i32(q, cpu_env, offsetof(CPUARMState, QF));
+    tcg_gen_or_i32(q, q, tmp);
+    tcg_gen_st_i32(q, cpu_env, offsetof(CPUARMState, QF));
+    tcg_gen_mov_i32(dest, res);
+    tcg_temp_free_i32(q);
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i32(res);
+}
 
 /*
  * generate a conditional branch based on ARM condition code cc.
@@ -758,6 +884,65 @@ void arm_gen_test_cc(int cc, int label)
     }
 }
 
+/* True if the flags still hold the result of the last gen_sub_CC(), and
+   its operand copies are still live: nothing emitted since then writes a
+   flag, calls a helper or ends the basic block.  */
+static bool gen_cmp_valid(void)
+{
+    uint16_t *opc = cmp_opc_ptr;
+    TCGArg *args = cmp_opparam_ptr;
+    int i;
+
+    if (!opc) {
+        return false;
+    }
+    for (; opc < tcg_ctx.gen_opc_ptr; opc++) {
+        const TCGOpDef *def = &tcg_op_defs[*opc];
+
+        if (*opc == INDEX_op_call || (def->flags & TCG_OPF_BB_END)) {
+            return false;
+        }
+        for (i = 0; i < def->nb_oargs; i++) {
+            if (args[i] == GET_TCGV_I32(cpu_NF) ||
+                args[i] == GET_TCGV_I32(cpu_ZF) ||
+                args[i] == GET_TCGV_I32(cpu_CF) ||
+                args[i] == GET_TCGV_I32(cpu_VF)) {
+                return false;
+            }
+        }
+        args += def->nb_args;
+    }
+    return true;
+}
+
+/* Like arm_gen_test_cc(), but when the flags come from a CMP, SUBS...
+   earlier in the same basic block, test its operands with one brcond
+   instead of combining C, Z, N and V.  Thumb code sets the flags on
+   most instructions, but only the last compare is tested.  */
+static void gen_test_cc(int cc, int label)
+{
+    static const int8_t sub_cond[16] = {
+        TCG_COND_EQ,  /* eq */
+        TCG_COND_NE,  /* ne */
+        TCG_COND_GEU, /* cs */
+        TCG_COND_LTU, /* cc */
+        -1, -1, -1, -1, /* mi, pl, vs, vc: already a single test */
+        TCG_COND_GTU, /* hi */
+        TCG_COND_LEU, /* ls */
+        TCG_COND_GE,  /* ge */
+        TCG_COND_LT,  /* lt */
+        TCG_COND_GT,  /* gt */
+        TCG_COND_LE,  /* le */
+        -1, -1,
+    };
+
+    if (sub_cond[cc & 0xf] >= 0 && gen_cmp_valid()) {
+        tcg_gen_brcond_i32(sub_cond[cc & 0xf], cpu_cmp_a, cpu_cmp_b, label);
+    } else {
+        arm_gen_test_cc(cc, label);
+    }
+}
+
 static const uint8_t table_logic_cc[16] = {
     1, /* and */
     1, /* xor */
@@ -782,7 +967,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 {
     TCGv_i32 tmp;
 
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     if (s->thumb != (addr & 1)) {
         tmp = tcg_temp_new_i32();
         tcg_gen_movi_i32(tmp, addr & 1);
@@ -795,7 +980,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv_i32 var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -906,6 +1091,131 @@ DO_GEN_ST(8, MO_UB)
 DO_GEN_ST(16, MO_TEUW)
 DO_GEN_ST(32, MO_TEUL)
 
+/* M profile blocks keep track of the registers loaded with a constant,
+ * from a literal or MOVW/MOVT, so that a word store to a device register
+ * at a constant address can call the device's fast_write hook instead of
+ * going through the TLB and the memory dispatch.  Values written inside
+ * an IT block are not tracked.  */
+static void set_known_reg(DisasContext *s, int reg, uint32_t val)
+{
+    if (s->fast_mmio && reg < 13 && !s->condexec_mask) {
+        s->known_regs |= 1 << reg;
+        s->known_val[reg] = val;
+    }
+}
+
+static bool get_known_reg(DisasContext *s, int reg, uint32_t *val)
+{
+    if (reg < 13 && (s->known_regs & (1 << reg))) {
+        *val = s->known_val[reg];
+        return true;
+    }
+    return false;
+}
+
+/* Whether the page at @addr is in a trace region which the block may
+ * depend on without covering it, see gen_jmp_can_trace().  */
+static bool in_trace_region(DisasContext *s, uint32_t addr)
+{
+    uint32_t page = addr & TARGET_PAGE_MASK;
+    int i;
+
+    if (!ARM_TBFLAG_TRACE(s->tb->flags)) {
+        return false;
+    }
+    for (i = 0; i < s->nb_trace_region; i++) {
+        if (page - s->trace_region[i].base < s->trace_region[i].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Load the word literal at @addr into @reg.  A literal in direct RAM is
+ * read now, so that the value is a constant for the optimizer, if it is in
+ * the first page of the block, which is then extended to cover it and is
+ * thrown away if the literal is overwritten, or anywhere in a trace region
+ * (locked Flash), which the board flushes before it changes.  */
+static void gen_load_literal(DisasContext *s, int reg, uint32_t addr)
+{
+    TCGv_i32 tmp = tcg_temp_new_i32();
+    TCGv_i32 taddr;
+    uint32_t val;
+    bool in_block, in_trace;
+    int i;
+
+    in_block = s->fast_mmio && addr >= s->tb->pc &&
+               (addr & TARGET_PAGE_MASK) == (s->tb->pc & TARGET_PAGE_MASK);
+    in_trace = !in_block && in_trace_region(s, addr);
+    if ((in_block || in_trace) && !(addr & 3)) {
+        for (i = 0; i < tcg_ctx.nb_direct_ram; i++) {
+            TCGDirectRAM *ram = &tcg_ctx.direct_ram[i];
+
+            if (addr - ram->base < ram->size &&
+                ram->size - (addr - ram->base) >= 4) {
+                val = ldl_le_p((uint8_t *)ram->host + (addr - ram->base));
+                tcg_gen_movi_i32(tmp, val);
+                store_reg(s, reg, tmp);
+                set_known_reg(s, reg, val);
+                if (in_block) {
+                    s->literal_end = MAX(s->literal_end, addr + 4);
+                } else {
+                    s->trace_used = true;
+                }
+                return;
+            }
+        }
+    }
+
+    taddr = tcg_const_i32(addr);
+    gen_aa32_ld32u(tmp, taddr, get_mem_index(s));
+    tcg_temp_free_i32(taddr);
+    store_reg(s, reg, tmp);
+}
+
+/* Store @val to [@base + @offset] by calling the device directly when @base
+ * holds a known address and the device has a fast write hook for it.
+ * Returns false if the normal store has to be generated.  */
+static bool gen_mmio_fast_write(DisasContext *s, int base, uint32_t offset,
+                                TCGv_i32 val)
+{
+#if !defined(CONFIG_USER_ONLY)
+    MemoryRegionSection section;
+    MemoryRegionFastWrite *fn = NULL;
+    TCGv_ptr tmr, tfn;
+    uint32_t addr;
+
+    if (!get_known_reg(s, base, &addr)) {
+        return false;
+    }
+    addr += offset;
+    if (addr & 3) {
+        return false;
+    }
+    section = memory_region_find(s->as->root, addr, 4);
+    if (!section.mr) {
+        return false;
+    }
+    if (section.mr->ops && section.mr->ops->fast_write) {
+        fn = section.mr->ops->fast_write(section.mr->opaque,
+                                         section.offset_within_region);
+    }
+    memory_region_unref(section.mr);
+    if (!fn) {
+        return false;
+    }
+
+    tmr = tcg_const_ptr(section.mr);
+    tfn = tcg_const_ptr(fn);
+    gen_helper_mmio_fast_write(tmr, tfn, val);
+    tcg_temp_free_ptr(tmr);
+    tcg_temp_free_ptr(tfn);
+    return true;
+#else
+    return false;
+#endif
+}
+
 static inline void gen_set_pc_im(DisasContext *s, target_ulong val)
 {
     tcg_gen_movi_i32(cpu_R[15], val);
@@ -938,6 +1248,22 @@ static void gen_exception_insn(DisasContext *s, int offset, int excp, int syn)
     s->is_jmp = DISAS_JUMP;
 }
 
+/* Jump to the TB for the current PC and state, looking it up at run time.
+   The lookup may fail, in which case this acts like exit_tb(0).  */
+static void gen_goto_ptr(void)
+{
+    TCGv_ptr ptr;
+
+    if (!TCG_TARGET_HAS_goto_ptr) {
+        tcg_gen_exit_tb(0);
+        return;
+    }
+    ptr = tcg_temp_new_ptr();
+    gen_helper_lookup_tb_ptr(ptr, cpu_env);
+    tcg_gen_goto_ptr(ptr);
+    tcg_temp_free_ptr(ptr);
+}
+
 /* Force a TB lookup after an instruction that changes the CPU state.  */
 static inline void gen_lookup_tb(DisasContext *s)
 {
@@ -2971,6 +3297,14 @@ static int disas_vfp_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
         }
     }
 
+    if (IS_M(env)) {
+        /* The current context now has FP state (CONTROL.FPCA), which is
+         * saved on exception entry.  */
+        tmp = load_cpu_field(v7m.control);
+        tcg_gen_ori_i32(tmp, tmp, 4);
+        store_cpu_field(tmp, v7m.control);
+    }
+
     if (extract32(insn, 28, 4) == 0xf) {
         /* Encodings with T=1 (Thumb) or unconditional (ARM):
          * only used in v8 and above.
@@ -3845,6 +4179,12 @@ static inline void gen_goto_tb(DisasContext *s, int n, target_ulong dest)
     TranslationBlock *tb;
 
     tb = s->tb;
+    /* The successor starts outside any IT block, unless this is the end of
+       the TB in the middle of one */
+    if ((s->condexec_mask & 0xf) == 0) {
+        tb_prefetch_add(dest, tb->cs_base,
+                        tb->flags & ~ARM_TBFLAG_CONDEXEC_MASK);
+    }
     if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK)) {
         tcg_gen_goto_tb(n);
         gen_set_pc_im(s, dest);
@@ -3855,6 +4195,44 @@ static inline void gen_goto_tb(DisasContext *s, int n, target_ulong dest)
     }
 }
 
+/* Maximum number of direct branches followed by a CF_TIER2 block */
+#define TIER2_MAX_FOLLOWED_JUMPS 8
+
+/* A hot block keeps translating at the target of an unconditional forward
+   branch in the same page, so that code reached through it shares the
+   register allocation of the block.  Only forward branches are followed:
+   the block then still covers [tb->pc, tb->pc + tb->size) and code
+   invalidation works unchanged.  The code skipped over is part of that
+   range too, so -tb-coverage turns this off.  */
+static inline bool gen_jmp_can_follow(DisasContext *s, uint32_t dest)
+{
+    return (s->tb->cflags & CF_TIER2) &&
+           !singlestep && !tb_coverage_file &&
+           !s->condjmp && !s->condexec_mask && !s->block_end &&
+           s->followed_jumps < TIER2_MAX_FOLLOWED_JUMPS &&
+           dest > s->pc &&
+           (dest & TARGET_PAGE_MASK) == (s->tb->pc & TARGET_PAGE_MASK);
+}
+
+/* Maximum number of branches into the trace regions followed by a block */
+#define TRACE_MAX_FOLLOWED_JUMPS 8
+
+/* Any block may also keep translating at the target of an unconditional
+   branch (B or BL) into a trace region, such as Flash which is locked, in
+   any direction and any page, so that chains of short functions become a
+   single block.  The target page is not in the block's address range:
+   the board flushes these blocks before the code there can change, and
+   breakpoints turn this off (ARM_TBFLAG_TRACE).  The fetch wait states
+   are charged from the address range, so it is off when counting
+   instructions too.  */
+static inline bool gen_jmp_can_trace(DisasContext *s, uint32_t dest)
+{
+    return !use_icount && !singlestep && !tb_coverage_file &&
+           !s->condjmp && !s->condexec_mask &&
+           s->followed_jumps < TRACE_MAX_FOLLOWED_JUMPS &&
+           in_trace_region(s, dest);
+}
+
 static inline void gen_jmp (DisasContext *s, uint32_t dest)
 {
     if (unlikely(s->singlestep_enabled)) {
@@ -3862,6 +4240,17 @@ static inline void gen_jmp (DisasContext *s, uint32_t dest)
         if (s->thumb)
             dest |= 1;
         gen_bx_im(s, dest);
+    } else if (gen_jmp_can_follow(s, dest)) {
+        s->followed_jumps++;
+        s->pc = dest;
+    } else if (gen_jmp_can_trace(s, dest)) {
+        s->followed_jumps++;
+        s->trace_used = true;
+        if (!s->block_end) {
+            s->block_end = s->pc;
+        }
+        s->pc = dest;
+        s->next_page_start = (dest & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
     } else {
         gen_goto_tb(s, 0, dest);
         s->is_jmp = DISAS_TB_JUMP;
@@ -6625,7 +7014,7 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
                             switch (size) {
                             case 0: gen_helper_neon_clz_u8(tmp, tmp); break;
                             case 1: gen_helper_neon_clz_u16(tmp, tmp); break;
-                            case 2: gen_helper_clz(tmp, tmp); break;
+                            case 2: tcg_gen_clzi_i32(tmp, tmp, 32); break;
                             default: abort();
                             }
                             break;
@@ -7271,7 +7660,12 @@ static void gen_logicq_cc(TCGv_i32 lo, TCGv_i32 hi)
 
    In system emulation mode only one CPU will be running at once, so
    this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   throw an exception and handle the atomic operation elsewhere.
+
+   A single core M profile machine may use the local monitor only (see
+   arm_cpu_set_local_monitor), which CLREX and exception entry and return
+   clear: the store then only checks the address, and the value loaded
+   is not kept.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i32 addr, int size)
 {
@@ -7301,7 +7695,7 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
         tcg_temp_free_i32(tmp2);
         tcg_gen_concat_i32_i64(cpu_exclusive_val, tmp, tmp3);
         store_reg(s, rt2, tmp3);
-    } else {
+    } else if (!s->local_monitor) {
         tcg_gen_extu_i32_i64(cpu_exclusive_val, tmp);
     }
 
@@ -7345,38 +7739,41 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_gen_brcond_i64(TCG_COND_NE, extaddr, cpu_exclusive_addr, fail_label);
     tcg_temp_free_i64(extaddr);
 
-    tmp = tcg_temp_new_i32();
-    switch (size) {
-    case 0:
-        gen_aa32_ld8u(tmp, addr, get_mem_index(s));
-        break;
-    case 1:
-        gen_aa32_ld16u(tmp, addr, get_mem_index(s));
-        break;
-    case 2:
-    case 3:
-        gen_aa32_ld32u(tmp, addr, get_mem_index(s));
-        break;
-    default:
-        abort();
-    }
+    /* With the local monitor only, the address is all there is to check */
+    if (!s->local_monitor || size == 3) {
+        tmp = tcg_temp_new_i32();
+        switch (size) {
+        case 0:
+            gen_aa32_ld8u(tmp, addr, get_mem_index(s));
+            break;
+        case 1:
+            gen_aa32_ld16u(tmp, addr, get_mem_index(s));
+            break;
+        case 2:
+        case 3:
+            gen_aa32_ld32u(tmp, addr, get_mem_index(s));
+            break;
+        default:
+            abort();
+        }
 
-    val64 = tcg_temp_new_i64();
-    if (size == 3) {
-        TCGv_i32 tmp2 = tcg_temp_new_i32();
-        TCGv_i32 tmp3 = tcg_temp_new_i32();
-        tcg_gen_addi_i32(tmp2, addr, 4);
-        gen_aa32_ld32u(tmp3, tmp2, get_mem_index(s));
-        tcg_temp_free_i32(tmp2);
-        tcg_gen_concat_i32_i64(val64, tmp, tmp3);
-        tcg_temp_free_i32(tmp3);
-    } else {
-        tcg_gen_extu_i32_i64(val64, tmp);
-    }
-    tcg_temp_free_i32(tmp);
+        val64 = tcg_temp_new_i64();
+        if (size == 3) {
+            TCGv_i32 tmp2 = tcg_temp_new_i32();
+            TCGv_i32 tmp3 = tcg_temp_new_i32();
+            tcg_gen_addi_i32(tmp2, addr, 4);
+            gen_aa32_ld32u(tmp3, tmp2, get_mem_index(s));
+            tcg_temp_free_i32(tmp2);
+            tcg_gen_concat_i32_i64(val64, tmp, tmp3);
+            tcg_temp_free_i32(tmp3);
+        } else {
+            tcg_gen_extu_i32_i64(val64, tmp);
+        }
+        tcg_temp_free_i32(tmp);
 
-    tcg_gen_brcond_i64(TCG_COND_NE, val64, cpu_exclusive_val, fail_label);
-    tcg_temp_free_i64(val64);
+        tcg_gen_brcond_i64(TCG_COND_NE, val64, cpu_exclusive_val, fail_label);
+        tcg_temp_free_i64(val64);
+    }
 
     tmp = load_reg(s, rt);
     switch (size) {
@@ -7400,6 +7797,7 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
         gen_aa32_st32(tmp, addr, get_mem_index(s));
         tcg_temp_free_i32(tmp);
     }
+    s->known_regs &= ~(1 << rd);
     tcg_gen_movi_i32(cpu_R[rd], 0);
     tcg_gen_br(done_label);
     gen_set_label(fail_label);
@@ -7566,10 +7964,14 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                 return;
             case 4: /* dsb */
             case 5: /* dmb */
-            case 6: /* isb */
                 ARCH(7);
                 /* We don't emulate caches so these are a no-op.  */
                 return;
+            case 6: /* isb */
+                ARCH(7);
+                /* Context synchronization: end the TB.  */
+                gen_lookup_tb(s);
+                return;
             default:
                 goto illegal_op;
             }
@@ -7683,7 +8085,7 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
         /* if not always execute, we generate a conditional jump to
            next instruction */
         s->condlabel = gen_new_label();
-        arm_gen_test_cc(cond ^ 1, s->condlabel);
+        gen_test_cc(cond ^ 1, s->condlabel);
         s->condjmp = 1;
     }
     if ((insn & 0x0f900000) == 0x03000000) {
@@ -7757,7 +8159,7 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                 ARCH(5);
                 rd = (insn >> 12) & 0xf;
                 tmp = load_reg(s, rm);
-                gen_helper_clz(tmp, tmp);
+                tcg_gen_clzi_i32(tmp, tmp, 32);
                 store_reg(s, rd, tmp);
             } else {
                 goto illegal_op;
@@ -7872,7 +8274,7 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                 tcg_temp_free_i64(tmp64);
                 if ((sh & 2) == 0) {
                     tmp2 = load_reg(s, rn);
-                    gen_helper_add_setq(tmp, cpu_env, tmp, tmp2);
+                    gen_add_setq(tmp, tmp, tmp2);
                     tcg_temp_free_i32(tmp2);
                 }
                 store_reg(s, rd, tmp);
@@ -7892,7 +8294,7 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                 } else {
                     if (op1 == 0) {
                         tmp2 = load_reg(s, rn);
-                        gen_helper_add_setq(tmp, cpu_env, tmp, tmp2);
+                        gen_add_setq(tmp, tmp, tmp2);
                         tcg_temp_free_i32(tmp2);
                     }
                     store_reg(s, rd, tmp);
@@ -8446,10 +8848,7 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                         /* Select bytes.  */
                         tmp = load_reg(s, rn);
                         tmp2 = load_reg(s, rm);
-                        tmp3 = tcg_temp_new_i32();
-                        tcg_gen_ld_i32(tmp3, cpu_env, offsetof(CPUARMState, GE));
-                        gen_helper_sel_flags(tmp, tmp3, tmp, tmp2);
-                        tcg_temp_free_i32(tmp3);
+                        gen_sel(tmp, tmp, tmp2);
                         tcg_temp_free_i32(tmp2);
                         store_reg(s, rd, tmp);
                     } else if ((insn & 0x000003e0) == 0x00000060) {
@@ -8571,13 +8970,13 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                                  * signed operation, in which case we must set
                                  * the Q flag.
                                  */
-                                gen_helper_add_setq(tmp, cpu_env, tmp, tmp2);
+                                gen_add_setq(tmp, tmp, tmp2);
                             }
                             tcg_temp_free_i32(tmp2);
                             if (rd != 15)
                               {
                                 tmp2 = load_reg(s, rd);
-                                gen_helper_add_setq(tmp, cpu_env, tmp, tmp2);
+                                gen_add_setq(tmp, tmp, tmp2);
                                 tcg_temp_free_i32(tmp2);
                               }
                             store_reg(s, rn, tmp);
@@ -9416,14 +9815,11 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                     break;
                 case 0x10: /* sel */
                     tmp2 = load_reg(s, rm);
-                    tmp3 = tcg_temp_new_i32();
-                    tcg_gen_ld_i32(tmp3, cpu_env, offsetof(CPUARMState, GE));
-                    gen_helper_sel_flags(tmp, tmp3, tmp, tmp2);
-                    tcg_temp_free_i32(tmp3);
+                    gen_sel(tmp, tmp, tmp2);
                     tcg_temp_free_i32(tmp2);
                     break;
                 case 0x18: /* clz */
-                    gen_helper_clz(tmp, tmp);
+                    tcg_gen_clzi_i32(tmp, tmp, 32);
                     break;
                 case 0x20:
                 case 0x21:
@@ -9484,7 +9880,7 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                 tcg_temp_free_i32(tmp2);
                 if (rs != 15) {
                     tmp2 = load_reg(s, rs);
-                    gen_helper_add_setq(tmp, cpu_env, tmp, tmp2);
+                    gen_add_setq(tmp, tmp, tmp2);
                     tcg_temp_free_i32(tmp2);
                 }
                 break;
@@ -9501,13 +9897,13 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                      * however it may overflow considered as a signed
                      * operation, in which case we must set the Q flag.
                      */
-                    gen_helper_add_setq(tmp, cpu_env, tmp, tmp2);
+                    gen_add_setq(tmp, tmp, tmp2);
                 }
                 tcg_temp_free_i32(tmp2);
                 if (rs != 15)
                   {
                     tmp2 = load_reg(s, rs);
-                    gen_helper_add_setq(tmp, cpu_env, tmp, tmp2);
+                    gen_add_setq(tmp, tmp, tmp2);
                     tcg_temp_free_i32(tmp2);
                   }
                 break;
@@ -9524,7 +9920,7 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                 if (rs != 15)
                   {
                     tmp2 = load_reg(s, rs);
-                    gen_helper_add_setq(tmp, cpu_env, tmp, tmp2);
+                    gen_add_setq(tmp, tmp, tmp2);
                     tcg_temp_free_i32(tmp2);
                   }
                 break;
@@ -9739,9 +10135,13 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                             break;
                         case 4: /* dsb */
                         case 5: /* dmb */
-                        case 6: /* isb */
                             /* These execute as NOPs.  */
                             break;
+                        case 6: /* isb */
+                            /* End the TB, so that a new MPU configuration
+                               applies from the next instruction on.  */
+                            gen_lookup_tb(s);
+                            break;
                         default:
                             goto illegal_op;
                         }
@@ -9787,7 +10187,7 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                 op = (insn >> 22) & 0xf;
                 /* Generate a conditional jump to next instruction.  */
                 s->condlabel = gen_new_label();
-                arm_gen_test_cc(op ^ 1, s->condlabel);
+                gen_test_cc(op ^ 1, s->condlabel);
                 s->condjmp = 1;
 
                 /* offset[11:1] = insn[10:0] */
@@ -9873,6 +10273,9 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                     }
                     store_reg(s, rd, tmp);
                 } else {
+                    bool known = false;
+                    uint32_t known_val = 0;
+
                     imm = ((insn & 0x04000000) >> 15)
                           | ((insn & 0x7000) >> 4) | (insn & 0xff);
                     if (insn & (1 << 22)) {
@@ -9880,11 +10283,15 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                         imm |= (insn >> 4) & 0xf000;
                         if (insn & (1 << 23)) {
                             /* movt */
+                            known = get_known_reg(s, rd, &known_val);
+                            known_val = (known_val & 0xffff) | (imm << 16);
                             tmp = load_reg(s, rd);
                             tcg_gen_ext16u_i32(tmp, tmp);
                             tcg_gen_ori_i32(tmp, tmp, imm << 16);
                         } else {
                             /* movw */
+                            known = true;
+                            known_val = imm;
                             tmp = tcg_temp_new_i32();
                             tcg_gen_movi_i32(tmp, imm);
                         }
@@ -9907,6 +10314,9 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                         }
                     }
                     store_reg(s, rd, tmp);
+                    if (known) {
+                        set_known_reg(s, rd, known_val);
+                    }
                 }
             } else {
                 int shifter_out = 0;
@@ -10008,7 +10418,6 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
         }
         memidx = get_mem_index(s);
         if (rn == 15) {
-            addr = tcg_temp_new_i32();
             /* PC relative.  */
             /* s->pc has already been incremented by 4.  */
             imm = s->pc & 0xfffffffc;
@@ -10016,6 +10425,11 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                 imm += insn & 0xfff;
             else
                 imm -= insn & 0xfff;
+            if ((insn & (1 << 20)) && op == 2 && rs != 15) {
+                gen_load_literal(s, rs, imm);
+                break;
+            }
+            addr = tcg_temp_new_i32();
             tcg_gen_movi_i32(addr, imm);
         } else {
             addr = load_reg(s, rn);
@@ -10105,7 +10519,11 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                 gen_aa32_st16(tmp, addr, memidx);
                 break;
             case 2:
-                gen_aa32_st32(tmp, addr, memidx);
+                /* Only the positive 12-bit offset form has no writeback */
+                if (rn == 15 || !(insn & (1 << 23)) ||
+                    !gen_mmio_fast_write(s, rn, imm, tmp)) {
+                    gen_aa32_st32(tmp, addr, memidx);
+                }
                 break;
             default:
                 tcg_temp_free_i32(tmp);
@@ -10131,6 +10549,237 @@ illegal_op:
     return 1;
 }
 
+/* The 16-bit Thumb instructions listed in thumb16.decode.  Inside an IT
+ * block the data processing ones do not set the flags.  */
+#include "decode-thumb16.h"
+
+static void gen_thumb_add_sub(DisasContext *s, int rd, TCGv_i32 tmp,
+                              TCGv_i32 tmp2, bool sub)
+{
+    if (sub) {
+        if (s->condexec_mask)
+            tcg_gen_sub_i32(tmp, tmp, tmp2);
+        else
+            gen_sub_CC(tmp, tmp, tmp2);
+    } else {
+        if (s->condexec_mask)
+            tcg_gen_add_i32(tmp, tmp, tmp2);
+        else
+            gen_add_CC(tmp, tmp, tmp2);
+    }
+    tcg_temp_free_i32(tmp2);
+    store_reg(s, rd, tmp);
+}
+
+static bool trans_ADD_SUB_REG(DisasContext *s, arg_ADD_SUB_REG *a)
+{
+    gen_thumb_add_sub(s, a->rd, load_reg(s, a->rn), load_reg(s, a->rm),
+                      a->sub);
+    return true;
+}
+
+static bool trans_ADD_SUB_IMM(DisasContext *s, arg_ADD_SUB_IMM *a)
+{
+    TCGv_i32 tmp2 = tcg_temp_new_i32();
+
+    tcg_gen_movi_i32(tmp2, a->imm);
+    gen_thumb_add_sub(s, a->rd, load_reg(s, a->rn), tmp2, a->sub);
+    return true;
+}
+
+static bool trans_SHIFT_IMM(DisasContext *s, arg_SHIFT_IMM *a)
+{
+    TCGv_i32 tmp = load_reg(s, a->rm);
+
+    gen_arm_shift_im(tmp, a->op, a->imm, s->condexec_mask == 0);
+    if (!s->condexec_mask)
+        gen_logic_CC(tmp);
+    store_reg(s, a->rd, tmp);
+    return true;
+}
+
+static bool trans_MOV_IMM(DisasContext *s, arg_MOV_IMM *a)
+{
+    TCGv_i32 tmp = tcg_temp_new_i32();
+
+    tcg_gen_movi_i32(tmp, a->imm);
+    if (!s->condexec_mask)
+        gen_logic_CC(tmp);
+    store_reg(s, a->rd, tmp);
+    return true;
+}
+
+static bool trans_CMP_IMM(DisasContext *s, arg_CMP_IMM *a)
+{
+    TCGv_i32 tmp = load_reg(s, a->rd);
+    TCGv_i32 tmp2 = tcg_temp_new_i32();
+
+    tcg_gen_movi_i32(tmp2, a->imm);
+    gen_sub_CC(tmp, tmp, tmp2);
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i32(tmp2);
+    return true;
+}
+
+static bool trans_ADD_IMM(DisasContext *s, arg_ADD_IMM *a)
+{
+    TCGv_i32 tmp2 = tcg_temp_new_i32();
+
+    tcg_gen_movi_i32(tmp2, a->imm);
+    gen_thumb_add_sub(s, a->rd, load_reg(s, a->rd), tmp2, false);
+    return true;
+}
+
+static bool trans_SUB_IMM(DisasContext *s, arg_SUB_IMM *a)
+{
+    TCGv_i32 tmp2 = tcg_temp_new_i32();
+
+    tcg_gen_movi_i32(tmp2, a->imm);
+    gen_thumb_add_sub(s, a->rd, load_reg(s, a->rd), tmp2, true);
+    return true;
+}
+
+/* Load or store rd at base + offset, zero extending loads of less than a
+ * word.  Word stores go to a device's fast_write hook when they can.  */
+static void gen_thumb_ldst_imm(DisasContext *s, int base, uint32_t offset,
+                               int rd, int size, bool load)
+{
+    TCGv_i32 addr = load_reg(s, base);
+    TCGv_i32 tmp;
+
+    tcg_gen_addi_i32(addr, addr, offset);
+    if (load) {
+        tmp = tcg_temp_new_i32();
+        switch (size) {
+        case 0:
+            gen_aa32_ld8u(tmp, addr, get_mem_index(s));
+            break;
+        case 1:
+            gen_aa32_ld16u(tmp, addr, get_mem_index(s));
+            break;
+        default:
+            gen_aa32_ld32u(tmp, addr, get_mem_index(s));
+            break;
+        }
+        store_reg(s, rd, tmp);
+    } else {
+        tmp = load_reg(s, rd);
+        switch (size) {
+        case 0:
+            gen_aa32_st8(tmp, addr, get_mem_index(s));
+            break;
+        case 1:
+            gen_aa32_st16(tmp, addr, get_mem_index(s));
+            break;
+        default:
+            if (!gen_mmio_fast_write(s, base, offset, tmp)) {
+                gen_aa32_st32(tmp, addr, get_mem_index(s));
+            }
+            break;
+        }
+        tcg_temp_free_i32(tmp);
+    }
+    tcg_temp_free_i32(addr);
+}
+
+static bool trans_STR_IMM(DisasContext *s, arg_STR_IMM *a)
+{
+    gen_thumb_ldst_imm(s, a->rn, a->imm * 4, a->rd, 2, false);
+    return true;
+}
+
+static bool trans_LDR_IMM(DisasContext *s, arg_LDR_IMM *a)
+{
+    gen_thumb_ldst_imm(s, a->rn, a->imm * 4, a->rd, 2, true);
+    return true;
+}
+
+static bool trans_STRB_IMM(DisasContext *s, arg_STRB_IMM *a)
+{
+    gen_thumb_ldst_imm(s, a->rn, a->imm, a->rd, 0, false);
+    return true;
+}
+
+static bool trans_LDRB_IMM(DisasContext *s, arg_LDRB_IMM *a)
+{
+    gen_thumb_ldst_imm(s, a->rn, a->imm, a->rd, 0, true);
+    return true;
+}
+
+static bool trans_STRH_IMM(DisasContext *s, arg_STRH_IMM *a)
+{
+    gen_thumb_ldst_imm(s, a->rn, a->imm * 2, a->rd, 1, false);
+    return true;
+}
+
+static bool trans_LDRH_IMM(DisasContext *s, arg_LDRH_IMM *a)
+{
+    gen_thumb_ldst_imm(s, a->rn, a->imm * 2, a->rd, 1, true);
+    return true;
+}
+
+static bool trans_STR_SP(DisasContext *s, arg_STR_SP *a)
+{
+    gen_thumb_ldst_imm(s, 13, a->imm * 4, a->rd, 2, false);
+    return true;
+}
+
+static bool trans_LDR_SP(DisasContext *s, arg_LDR_SP *a)
+{
+    gen_thumb_ldst_imm(s, 13, a->imm * 4, a->rd, 2, true);
+    return true;
+}
+
+static bool trans_ADR(DisasContext *s, arg_ADR *a)
+{
+    TCGv_i32 tmp = tcg_temp_new_i32();
+
+    /* bit 1 of PC is ignored.  */
+    tcg_gen_movi_i32(tmp, ((s->pc + 2) & ~(uint32_t)2) + a->imm * 4);
+    store_reg(s, a->rd, tmp);
+    return true;
+}
+
+static bool trans_ADD_SP_REL(DisasContext *s, arg_ADD_SP_REL *a)
+{
+    TCGv_i32 tmp = load_reg(s, 13);
+
+    tcg_gen_addi_i32(tmp, tmp, a->imm * 4);
+    store_reg(s, a->rd, tmp);
+    return true;
+}
+
+static bool trans_UDF(DisasContext *s, arg_UDF *a)
+{
+    gen_exception_insn(s, 2, EXCP_UDEF, syn_uncategorized());
+    return true;
+}
+
+static bool trans_SVC(DisasContext *s, arg_SVC *a)
+{
+    gen_set_pc_im(s, s->pc);
+    s->svc_imm = a->imm;
+    s->is_jmp = DISAS_SWI;
+    return true;
+}
+
+static bool trans_B_COND(DisasContext *s, arg_B_COND *a)
+{
+    /* generate a conditional jump to next instruction */
+    s->condlabel = gen_new_label();
+    gen_test_cc(a->cond ^ 1, s->condlabel);
+    s->condjmp = 1;
+
+    gen_jmp(s, (uint32_t)s->pc + 2 + (a->imm << 1));
+    return true;
+}
+
+static bool trans_B(DisasContext *s, arg_B *a)
+{
+    gen_jmp(s, (uint32_t)s->pc + 2 + (a->imm << 1));
+    return true;
+}
+
 static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
 {
     uint32_t val, insn, op, rm, rn, rd, shift, cond;
@@ -10144,7 +10793,7 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
         cond = s->condexec_cond;
         if (cond != 0x0e) {     /* Skip conditional when condition is AL. */
           s->condlabel = gen_new_label();
-          arm_gen_test_cc(cond ^ 1, s->condlabel);
+          gen_test_cc(cond ^ 1, s->condlabel);
           s->condjmp = 1;
         }
     }
@@ -10152,99 +10801,18 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
     insn = arm_lduw_code(env, s->pc, s->bswap_code);
     s->pc += 2;
 
-    switch (insn >> 12) {
-    case 0: case 1:
+    if (decode_thumb16(s, insn)) {
+        return;
+    }
 
-        rd = insn & 7;
-        op = (insn >> 11) & 3;
-        if (op == 3) {
-            /* add/subtract */
-            rn = (insn >> 3) & 7;
-            tmp = load_reg(s, rn);
-            if (insn & (1 << 10)) {
-                /* immediate */
-                tmp2 = tcg_temp_new_i32();
-                tcg_gen_movi_i32(tmp2, (insn >> 6) & 7);
-            } else {
-                /* reg */
-                rm = (insn >> 6) & 7;
-                tmp2 = load_reg(s, rm);
-            }
-            if (insn & (1 << 9)) {
-                if (s->condexec_mask)
-                    tcg_gen_sub_i32(tmp, tmp, tmp2);
-                else
-                    gen_sub_CC(tmp, tmp, tmp2);
-            } else {
-                if (s->condexec_mask)
-                    tcg_gen_add_i32(tmp, tmp, tmp2);
-                else
-                    gen_add_CC(tmp, tmp, tmp2);
-            }
-            tcg_temp_free_i32(tmp2);
-            store_reg(s, rd, tmp);
-        } else {
-            /* shift immediate */
-            rm = (insn >> 3) & 7;
-            shift = (insn >> 6) & 0x1f;
-            tmp = load_reg(s, rm);
-            gen_arm_shift_im(tmp, op, shift, s->condexec_mask == 0);
-            if (!s->condexec_mask)
-                gen_logic_CC(tmp);
-            store_reg(s, rd, tmp);
-        }
-        break;
-    case 2: case 3:
-        /* arithmetic large immediate */
-        op = (insn >> 11) & 3;
-        rd = (insn >> 8) & 0x7;
-        if (op == 0) { /* mov */
-            tmp = tcg_temp_new_i32();
-            tcg_gen_movi_i32(tmp, insn & 0xff);
-            if (!s->condexec_mask)
-                gen_logic_CC(tmp);
-            store_reg(s, rd, tmp);
-        } else {
-            tmp = load_reg(s, rd);
-            tmp2 = tcg_temp_new_i32();
-            tcg_gen_movi_i32(tmp2, insn & 0xff);
-            switch (op) {
-            case 1: /* cmp */
-                gen_sub_CC(tmp, tmp, tmp2);
-                tcg_temp_free_i32(tmp);
-                tcg_temp_free_i32(tmp2);
-                break;
-            case 2: /* add */
-                if (s->condexec_mask)
-                    tcg_gen_add_i32(tmp, tmp, tmp2);
-                else
-                    gen_add_CC(tmp, tmp, tmp2);
-                tcg_temp_free_i32(tmp2);
-                store_reg(s, rd, tmp);
-                break;
-            case 3: /* sub */
-                if (s->condexec_mask)
-                    tcg_gen_sub_i32(tmp, tmp, tmp2);
-                else
-                    gen_sub_CC(tmp, tmp, tmp2);
-                tcg_temp_free_i32(tmp2);
-                store_reg(s, rd, tmp);
-                break;
-            }
-        }
-        break;
+    switch (insn >> 12) {
     case 4:
         if (insn & (1 << 11)) {
             rd = (insn >> 8) & 7;
             /* load pc-relative.  Bit 1 of PC is ignored.  */
             val = s->pc + 2 + ((insn & 0xff) * 4);
             val &= ~(uint32_t)2;
-            addr = tcg_temp_new_i32();
-            tcg_gen_movi_i32(addr, val);
-            tmp = tcg_temp_new_i32();
-            gen_aa32_ld32u(tmp, addr, get_mem_index(s));
-            tcg_temp_free_i32(addr);
-            store_reg(s, rd, tmp);
+            gen_load_literal(s, rd, val);
             break;
         }
         if (insn & (1 << 10)) {
@@ -10477,109 +11045,6 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
         tcg_temp_free_i32(addr);
         break;
 
-    case 6:
-        /* load/store word immediate offset */
-        rd = insn & 7;
-        rn = (insn >> 3) & 7;
-        addr = load_reg(s, rn);
-        val = (insn >> 4) & 0x7c;
-        tcg_gen_addi_i32(addr, addr, val);
-
-        if (insn & (1 << 11)) {
-            /* load */
-            tmp = tcg_temp_new_i32();
-            gen_aa32_ld32u(tmp, addr, get_mem_index(s));
-            store_reg(s, rd, tmp);
-        } else {
-            /* store */
-            tmp = load_reg(s, rd);
-            gen_aa32_st32(tmp, addr, get_mem_index(s));
-            tcg_temp_free_i32(tmp);
-        }
-        tcg_temp_free_i32(addr);
-        break;
-
-    case 7:
-        /* load/store byte immediate offset */
-        rd = insn & 7;
-        rn = (insn >> 3) & 7;
-        addr = load_reg(s, rn);
-        val = (insn >> 6) & 0x1f;
-        tcg_gen_addi_i32(addr, addr, val);
-
-        if (insn & (1 << 11)) {
-            /* load */
-            tmp = tcg_temp_new_i32();
-            gen_aa32_ld8u(tmp, addr, get_mem_index(s));
-            store_reg(s, rd, tmp);
-        } else {
-            /* store */
-            tmp = load_reg(s, rd);
-            gen_aa32_st8(tmp, addr, get_mem_index(s));
-            tcg_temp_free_i32(tmp);
-        }
-        tcg_temp_free_i32(addr);
-        break;
-
-    case 8:
-        /* load/store halfword immediate offset */
-        rd = insn & 7;
-        rn = (insn >> 3) & 7;
-        addr = load_reg(s, rn);
-        val = (insn >> 5) & 0x3e;
-        tcg_gen_addi_i32(addr, addr, val);
-
-        if (insn & (1 << 11)) {
-            /* load */
-            tmp = tcg_temp_new_i32();
-            gen_aa32_ld16u(tmp, addr, get_mem_index(s));
-            store_reg(s, rd, tmp);
-        } else {
-            /* store */
-            tmp = load_reg(s, rd);
-            gen_aa32_st16(tmp, addr, get_mem_index(s));
-            tcg_temp_free_i32(tmp);
-        }
-        tcg_temp_free_i32(addr);
-        break;
-
-    case 9:
-        /* load/store from stack */
-        rd = (insn >> 8) & 7;
-        addr = load_reg(s, 13);
-        val = (insn & 0xff) * 4;
-        tcg_gen_addi_i32(addr, addr, val);
-
-        if (insn & (1 << 11)) {
-            /* load */
-            tmp = tcg_temp_new_i32();
-            gen_aa32_ld32u(tmp, addr, get_mem_index(s));
-            store_reg(s, rd, tmp);
-        } else {
-            /* store */
-            tmp = load_reg(s, rd);
-            gen_aa32_st32(tmp, addr, get_mem_index(s));
-            tcg_temp_free_i32(tmp);
-        }
-        tcg_temp_free_i32(addr);
-        break;
-
-    case 10:
-        /* add to high reg */
-        rd = (insn >> 8) & 7;
-        if (insn & (1 << 11)) {
-            /* SP */
-            tmp = load_reg(s, 13);
-        } else {
-            /* PC. bit 1 is ignored.  */
-            tmp = tcg_temp_new_i32();
-            tcg_gen_movi_i32(tmp, (s->pc + 2) & ~(uint32_t)2);
-        }
-        val = (insn & 0xff) * 4;
-        tcg_gen_addi_i32(tmp, tmp, val);
-        store_reg(s, rd, tmp);
-        break;
-
     case 11:
         /* misc */
         op = (insn >> 8) & 0xf;
@@ -10806,45 +11271,8 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
         }
         break;
     }
-    case 13:
-        /* conditional branch or swi */
-        cond = (insn >> 8) & 0xf;
-        if (cond == 0xe)
-            goto undef;
-
-        if (cond == 0xf) {
-            /* swi */
-            gen_set_pc_im(s, s->pc);
-            s->svc_imm = extract32(insn, 0, 8);
-            s->is_jmp = DISAS_SWI;
-            break;
-        }
-        /* generate a conditional jump to next instruction */
-        s->condlabel = gen_new_label();
-        arm_gen_test_cc(cond ^ 1, s->condlabel);
-        s->condjmp = 1;
-
-        /* jump to the offset */
-        val = (uint32_t)s->pc + 2;
-        offset = ((int32_t)insn << 24) >> 24;
-        val += offset << 1;
-        gen_jmp(s, val);
-        break;
-
-    case 14:
-        if (insn & (1 << 11)) {
-            if (disas_thumb2_insn(env, s, insn))
-              goto undef32;
-            break;
-        }
-        /* unconditional branch */
-        val = (uint32_t)s->pc;
-        offset = ((int32_t)insn << 21) >> 21;
-        val += (offset << 1) + 2;
-        gen_jmp(s, val);
-        break;
-
-    case 15:
+    case 14: case 15:
+        /* 32-bit instructions */
         if (disas_thumb2_insn(env, s, insn))
             goto undef32;
         break;
@@ -10858,6 +11286,32 @@ undef:
     gen_exception_insn(s, 2, EXCP_UDEF, syn_uncategorized());
 }
 
+/* Cycles the code in [start, end) waits for its instruction fetches, which
+   are charged on top of one per instruction when counting instructions.
+   Without prefetch every line of slow memory the block touches costs the
+   wait states.  With prefetch, sequential fetches are hidden behind
+   execution and only the branch into the block pays them.  */
+static int arm_fetch_wait_cycles(ARMCPU *cpu, uint32_t start, uint32_t end)
+{
+    int i;
+
+    if (cpu->fetch_wait_states == 0) {
+        return 0;
+    }
+    for (i = 0; i < cpu->nb_fetch_region; i++) {
+        ARMFetchRegion *r = &cpu->fetch_region[i];
+
+        if (start - r->base < r->size) {
+            if (cpu->fetch_prefetch) {
+                return cpu->fetch_wait_states;
+            }
+            return ((end - 1) / r->line_size - start / r->line_size + 1) *
+                   cpu->fetch_wait_states;
+        }
+    }
+    return 0;
+}
+
 /* generate intermediate code in gen_opc_buf and gen_opparam_buf for
    basic block 'tb'. If search_pc is TRUE, also generate PC
    information for each intermediate instruction. */
@@ -10872,7 +11326,7 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
     uint16_t *gen_opc_end;
     int j, lj;
     target_ulong pc_start;
-    target_ulong next_page_start;
+    target_ulong pc_end;
     int num_insns;
     int max_insns;
 
@@ -10888,6 +11342,19 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
 
     pc_start = tb->pc;
 
+    /* M profile loads from the board's RAM skip the TLB, unless they
+     * have to be checked against watchpoints or the MPU. */
+    QEMU_BUILD_BUG_ON(ARM_MAX_DIRECT_RAM > TCG_MAX_DIRECT_RAM);
+    if (arm_feature(env, ARM_FEATURE_M) && !ARM_TBFLAG_MPUEN(tb->flags) &&
+        QTAILQ_EMPTY(&cs->watchpoints)) {
+        for (j = 0; j < cpu->nb_direct_ram; j++) {
+            tcg_ctx.direct_ram[j].base = cpu->direct_ram[j].base;
+            tcg_ctx.direct_ram[j].size = cpu->direct_ram[j].size;
+            tcg_ctx.direct_ram[j].host = cpu->direct_ram[j].host;
+        }
+        tcg_ctx.nb_direct_ram = cpu->nb_direct_ram;
+    }
+
     dc->tb = tb;
 
     gen_opc_end = tcg_ctx.gen_opc_buf + OPC_MAX_SIZE;
@@ -10896,6 +11363,20 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
     dc->pc = pc_start;
     dc->singlestep_enabled = cs->singlestep_enabled;
     dc->condjmp = 0;
+    dc->followed_jumps = 0;
+    dc->block_end = 0;
+    dc->trace_used = false;
+    dc->local_monitor = cpu->local_monitor;
+    dc->trace_region = cpu->trace_region;
+    dc->nb_trace_region = cpu->nb_trace_region;
+    /* Under icount a device must see the exact time of the store, without
+     * direct RAM the literals cannot be read here, and -tb-coverage would
+     * count the literals as code.  */
+    dc->fast_mmio = tcg_ctx.nb_direct_ram > 0 && !use_icount &&
+                    !tb_coverage_file;
+    dc->known_regs = 0;
+    dc->literal_end = 0;
+    dc->as = cs->as;
 
     dc->aarch64 = 0;
     dc->thumb = ARM_TBFLAG_THUMB(tb->flags);
@@ -10915,13 +11396,16 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
 
     cpu_F0s = tcg_temp_new_i32();
     cpu_F1s = tcg_temp_new_i32();
+    cpu_cmp_a = tcg_temp_new_i32();
+    cpu_cmp_b = tcg_temp_new_i32();
+    cmp_opc_ptr = NULL;
     cpu_F0d = tcg_temp_new_i64();
     cpu_F1d = tcg_temp_new_i64();
     cpu_V0 = cpu_F0d;
     cpu_V1 = cpu_F1d;
     /* FIXME: cpu_M0 can probably be the same as cpu_V0.  */
     cpu_M0 = tcg_temp_new_i64();
-    next_page_start = (pc_start & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+    dc->next_page_start = (pc_start & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
     lj = -1;
     num_insns = 0;
     max_insns = tb->cflags & CF_COUNT_MASK;
@@ -10982,7 +11466,8 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
             break;
         }
 #else
-        if (dc->pc >= 0xfffffff0 && IS_M(env)) {
+        /* EXC_RETURN values are 0xffffffe1 to 0xfffffffd.  */
+        if (dc->pc >= 0xffffffe0 && IS_M(env)) {
             /* We always get here via a jump, so know we are not in a
                conditional execution block.  */
             gen_exception_internal(EXCP_EXCEPTION_EXIT);
@@ -11018,7 +11503,8 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
         if (num_insns + 1 == max_insns && (tb->cflags & CF_LAST_IO))
             gen_io_start();
 
-        if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT))) {
+        if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT)) ||
+            icount_no_split) {
             tcg_gen_debug_insn_start(dc->pc);
         }
 
@@ -11054,7 +11540,7 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
     } while (!dc->is_jmp && tcg_ctx.gen_opc_ptr < gen_opc_end &&
              !cs->singlestep_enabled &&
              !singlestep &&
-             dc->pc < next_page_start &&
+             dc->pc < dc->next_page_start &&
              num_insns < max_insns);
 
     if (tb->cflags & CF_LAST_IO) {
@@ -11106,8 +11592,13 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* A branch to a computed address, which only changes the PC
+               and Thumb state: look the next TB up without leaving the
+               generated code.  */
+            gen_goto_ptr();
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
@@ -11134,14 +11625,31 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
     }
 
 done_generating:
-    gen_tb_end(tb, num_insns);
+    /* After a branch into a trace region, the rest of the block is
+       somewhere else.  */
+    pc_end = dc->block_end ? dc->block_end : dc->pc;
+    if (dc->trace_used && !search_pc) {
+        cpu->trace_translated = true;
+    }
+
+    /* The fetch cost only goes into the count the block charges on entry:
+       tb->icount stays the number of instructions, which is what unwinding
+       a partly executed block relies on.  Blocks with a limited count are
+       run to make progress at the end of a time slice or to redo an I/O
+       access, so they are left at one cycle per instruction.  */
+    if (use_icount && !(tb->cflags & CF_COUNT_MASK) && dc->pc != pc_start) {
+        gen_tb_end(tb, num_insns + arm_fetch_wait_cycles(cpu, pc_start,
+                                                         dc->pc));
+    } else {
+        gen_tb_end(tb, num_insns);
+    }
     *tcg_ctx.gen_opc_ptr = INDEX_op_end;
 
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)) {
         qemu_log("----------------\n");
         qemu_log("IN: %s\n", lookup_symbol(pc_start));
-        log_target_disas(env, pc_start, dc->pc - pc_start,
+        log_target_disas(env, pc_start, pc_end - pc_start,
                          dc->thumb | (dc->bswap_code << 1));
         qemu_log("\n");
     }
@@ -11152,7 +11660,7 @@ done_generating:
         while (lj <= j)
             tcg_ctx.gen_opc_instr_start[lj++] = 0;
     } else {
-        tb->size = dc->pc - pc_start;
+        tb->size = MAX(pc_end, dc->literal_end) - pc_start;
         tb->icount = num_insns;
     }
 }
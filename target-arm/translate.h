@@ -13,6 +13,29 @@ typedef struct DisasContext {
     /* Thumb-2 conditional execution bits.  */
     int condexec_mask;
     int condexec_cond;
+    /* Direct branches followed so far, see gen_jmp().  */
+    int followed_jumps;
+    /* Once a branch into a trace region has been followed, the end of the
+     * code at tb->pc, which is all the block's address range covers.  */
+    target_ulong block_end;
+    /* Translation stops here, unless a branch is followed.  */
+    target_ulong next_page_start;
+    ARMTraceRegion *trace_region;
+    int nb_trace_region;
+    /* The block has code or literals from a trace region it does not
+     * cover.  */
+    bool trace_used;
+    /* LDREX/STREX use the local monitor only, see gen_store_exclusive().  */
+    bool local_monitor;
+    /* Stores to a constant device address may call the device directly,
+     * see gen_mmio_fast_write().  known_regs has a bit for each of r0-r12
+     * whose value is known, which is in known_val.  */
+    bool fast_mmio;
+    uint32_t known_regs;
+    uint32_t known_val[13];
+    /* End of the literals read at translation time.  */
+    target_ulong literal_end;
+    AddressSpace *as;
     struct TranslationBlock *tb;
     int singlestep_enabled;
     int thumb;
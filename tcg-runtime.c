@@ -57,6 +57,11 @@ uint32_t HELPER(remu_i32)(uint32_t arg1, uint32_t arg2)
     return arg1 % arg2;
 }
 
+uint32_t HELPER(clz_i32)(uint32_t arg1, uint32_t arg2)
+{
+    return arg1 ? clz32(arg1) : arg2;
+}
+
 /* 64-bit helpers */
 
 uint64_t HELPER(shl_i64)(uint64_t arg1, uint64_t arg2)
@@ -139,6 +139,9 @@ static bool have_bmi2;
 # define have_bmi2 0
 #endif
 
+/* Likewise for LZCNT, which gates clz_i32.  */
+bool have_lzcnt;
+
 static tcg_insn_unit *tb_ret_addr;
 
 static void patch_reloc(tcg_insn_unit *code_ptr, int type,
@@ -320,6 +323,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_JMP_long	(0xe9)
 #define OPC_JMP_short	(0xeb)
 #define OPC_LEA         (0x8d)
+#define OPC_LZCNT       (0xbd | P_EXT | P_SIMDF3)
 #define OPC_MOVB_EvGv	(0x88)		/* stores, more or less */
 #define OPC_MOVL_EvGv	(0x89)		/* stores, more or less */
 #define OPC_MOVL_GvEv	(0x8b)		/* loads, more or less */
@@ -431,6 +435,9 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
 
     rex = 0;
     rex |= (opc & P_REXW) ? 0x8 : 0x0;  /* REX.W */
@@ -465,6 +472,9 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
     if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
         if (opc & P_EXT38) {
@@ -1099,6 +1109,34 @@ static void tcg_out_movcond64(TCGContext *s, TCGCond cond, TCGArg dest,
 }
 #endif
 
+/* LZCNT returns 32 and sets CF for a zero source.  Every CPU with LZCNT
+   also has CMOV.  */
+static void tcg_out_clz32(TCGContext *s, TCGReg dest, TCGReg arg1,
+                          TCGArg arg2, int const_arg2)
+{
+    int over;
+
+    if (const_arg2) {
+        tcg_out_modrm(s, OPC_LZCNT, dest, arg1);
+        if (arg2 != 32) {
+            over = gen_new_label();
+            tcg_out_jxx(s, JCC_JAE, over, 1);
+            tcg_out_movi(s, TCG_TYPE_I32, dest, arg2);
+            tcg_out_label(s, over, s->code_ptr);
+        }
+    } else if (dest != arg2) {
+        tcg_out_modrm(s, OPC_LZCNT, dest, arg1);
+        tcg_out_modrm(s, OPC_CMOVCC | JCC_JB, dest, arg2);
+    } else {
+        /* The result for a zero source is already in place.  */
+        over = gen_new_label();
+        tcg_out_cmp(s, arg1, 0, 1, 0);
+        tcg_out_jxx(s, JCC_JE, over, 1);
+        tcg_out_modrm(s, OPC_LZCNT, dest, arg1);
+        tcg_out_label(s, over, s->code_ptr);
+    }
+}
+
 static void tcg_out_branch(TCGContext *s, int call, tcg_insn_unit *dest)
 {
     intptr_t disp = tcg_pcrel_diff(s, dest) - 5;
@@ -1536,6 +1574,10 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, bool is64)
     int mem_index;
     TCGMemOp s_bits;
     tcg_insn_unit *label_ptr[2];
+#if TARGET_LONG_BITS == 32
+    tcg_insn_unit *hit_ptr[TCG_MAX_DIRECT_RAM];
+    int i;
+#endif
 #endif
 
     datalo = *args++;
@@ -1548,9 +1590,37 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, bool is64)
     mem_index = *args++;
     s_bits = opc & MO_SIZE;
 
+#if TARGET_LONG_BITS == 32
+    /* Addresses inside the direct RAM blocks are turned into a host
+       address in L1 without looking at the TLB.  The range check is
+       done on addr - base, so a single unsigned compare suffices.  */
+    for (i = 0; i < s->nb_direct_ram; i++) {
+        const TCGDirectRAM *ram = &s->direct_ram[i];
+        tcg_insn_unit *miss_ptr;
+
+        tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_L1, addrlo);
+        tgen_arithi(s, ARITH_SUB, TCG_REG_L1, ram->base, 0);
+        tgen_arithi(s, ARITH_CMP, TCG_REG_L1, ram->size - (1 << s_bits), 0);
+        tcg_out8(s, OPC_JCC_short + JCC_JA);
+        miss_ptr = s->code_ptr++;
+        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_L0, (uintptr_t)ram->host);
+        tgen_arithr(s, ARITH_ADD + P_REXW, TCG_REG_L1, TCG_REG_L0);
+        tcg_out8(s, OPC_JMP_long);
+        hit_ptr[i] = s->code_ptr;
+        s->code_ptr += 4;
+        tcg_patch8(miss_ptr, s->code_ptr - miss_ptr - 1);
+    }
+#endif
+
     tcg_out_tlb_load(s, addrlo, addrhi, mem_index, s_bits,
                      label_ptr, offsetof(CPUTLBEntry, addr_read));
 
+#if TARGET_LONG_BITS == 32
+    for (i = 0; i < s->nb_direct_ram; i++) {
+        tcg_patch32(hit_ptr[i], s->code_ptr - hit_ptr[i] - 4);
+    }
+#endif
+
     /* TLB Hit.  */
     tcg_out_qemu_ld_direct(s, datalo, datahi, TCG_REG_L1, 0, 0, opc);
 
@@ -1747,6 +1817,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = tcg_current_code_size(s);
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_br:
         tcg_out_jxx(s, JCC_JMP, args[0], 0);
         break;
@@ -1852,6 +1926,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         break;
 
+    case INDEX_op_clz_i32:
+        tcg_out_clz32(s, args[0], args[1], args[2], const_args[2]);
+        break;
+
     OP_32_64(mul):
         if (const_args[2]) {
             int32_t val;
@@ -2070,6 +2148,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_br, { } },
     { INDEX_op_ld8u_i32, { "r", "r" } },
     { INDEX_op_ld8s_i32, { "r", "r" } },
@@ -2089,6 +2168,7 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_or_i32, { "r", "0", "ri" } },
     { INDEX_op_xor_i32, { "r", "0", "ri" } },
     { INDEX_op_andc_i32, { "r", "r", "ri" } },
+    { INDEX_op_clz_i32, { "r", "r", "ri" } },
 
     { INDEX_op_shl_i32, { "r", "0", "Ci" } },
     { INDEX_op_shr_i32, { "r", "0", "Ci" } },
@@ -2262,6 +2342,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /* Return path for goto_ptr when no TB was found: same as exit_tb(0).  */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -2309,6 +2393,15 @@ static void tcg_target_init(TCGContext *s)
 #endif
 #ifndef have_bmi2
         have_bmi2 = (b & bit_BMI2) != 0;
+#endif
+    }
+
+    max = __get_cpuid_max(0x80000000, 0);
+    if (max >= 0x80000001) {
+        __cpuid(0x80000001, a, b, c, d);
+#ifdef bit_LZCNT
+        /* LZCNT decodes as BSR on older CPUs, so it must be probed.  */
+        have_lzcnt = (c & bit_LZCNT) != 0;
 #endif
     }
 #endif
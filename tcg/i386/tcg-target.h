@@ -74,6 +74,7 @@ typedef enum {
 #endif
 
 extern bool have_bmi1;
+extern bool have_lzcnt;
 
 /* optional instructions */
 #define TCG_TARGET_HAS_div2_i32         1
@@ -97,6 +98,8 @@ extern bool have_bmi1;
 #define TCG_TARGET_HAS_sub2_i32         1
 #define TCG_TARGET_HAS_mulu2_i32        1
 #define TCG_TARGET_HAS_muls2_i32        1
+#define TCG_TARGET_HAS_goto_ptr         1
+#define TCG_TARGET_HAS_clz_i32          have_lzcnt
 #define TCG_TARGET_HAS_muluh_i32        0
 #define TCG_TARGET_HAS_mulsh_i32        0
 
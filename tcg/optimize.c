@@ -294,6 +294,9 @@ static TCGArg do_constant_folding_2(TCGOpcode op, TCGArg x, TCGArg y)
     CASE_OP_32_64(nor):
         return ~(x | y);
 
+    case INDEX_op_clz_i32:
+        return (uint32_t)x ? clz32(x) : y;
+
     CASE_OP_32_64(ext8s):
         return (int8_t)x;
 
@@ -1069,6 +1072,7 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
         CASE_OP_32_64(nor):
         CASE_OP_32_64(muluh):
         CASE_OP_32_64(mulsh):
+        case INDEX_op_clz_i32:
         CASE_OP_32_64(div):
         CASE_OP_32_64(divu):
         CASE_OP_32_64(rem):
@@ -1389,10 +1393,223 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     return gen_args;
 }
 
+/* Forwarding of loads and stores of env fields, used for hot blocks.
+
+   Within a basic block, the value last loaded from or stored to a field
+   of env is remembered together with the temp holding it.  A later full
+   width load of the same field becomes a move from that temp, a store of
+   the value the field already holds is dropped, and a store followed by
+   another store to the same field with nothing reading it in between is
+   dropped too.  Anything that may access env behind our back (helper
+   calls, guest memory accesses, stores through other pointers) and the
+   end of the basic block forget everything.  */
+
+#define MAX_ENV_SLOTS 16
+
+struct tcg_env_slot {
+    tcg_target_long offset;
+    int size;
+    /* temp holding the current value of the field */
+    TCGArg val;
+    /* index of a store to the field that nothing has read yet, or -1 */
+    int store_index;
+};
+
+static struct tcg_env_slot env_slots[MAX_ENV_SLOTS];
+static int nb_env_slots;
+
+static void env_slot_remove(int i)
+{
+    env_slots[i] = env_slots[--nb_env_slots];
+}
+
+static bool env_slot_overlaps(int i, tcg_target_long offset, int size)
+{
+    return env_slots[i].offset < offset + size &&
+           offset < env_slots[i].offset + env_slots[i].size;
+}
+
+/* Size of the env access done by OP, 0 if OP is not a load or store */
+static int env_access_size(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+#endif
+        return 4;
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static TCGArg *tcg_env_forwarding(TCGContext *s, uint16_t *tcg_opc_ptr,
+                                  TCGArg *args, TCGOpDef *tcg_op_defs)
+{
+    int nb_ops, op_index;
+    TCGArg *gen_args;
+
+    nb_env_slots = 0;
+    nb_ops = tcg_opc_ptr - s->gen_opc_buf;
+    gen_args = args;
+    for (op_index = 0; op_index < nb_ops; op_index++) {
+        TCGOpcode op = s->gen_opc_buf[op_index];
+        const TCGOpDef *def = &tcg_op_defs[op];
+        int nb_oargs, nb_args, size, i, slot = -1;
+        bool is_store = false, full;
+        tcg_target_long offset;
+
+        if (op == INDEX_op_call) {
+            /* all slots are dropped below, outputs need no tracking */
+            nb_oargs = 0;
+            nb_args = 1 + (args[0] >> 16) + (args[0] & 0xffff)
+                      + def->nb_cargs;
+        } else if (op == INDEX_op_nopn) {
+            nb_oargs = 0;
+            nb_args = args[0];
+        } else {
+            nb_oargs = def->nb_oargs;
+            nb_args = def->nb_args;
+        }
+
+        size = env_access_size(op);
+        if (size == 0) {
+            if (op == INDEX_op_call ||
+                (def->flags & (TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS))) {
+                nb_env_slots = 0;
+            }
+            goto do_copy;
+        }
+
+        is_store = def->nb_oargs == 0;
+        if (!s->temps[args[1]].fixed_reg ||
+            s->temps[args[1]].reg != TCG_AREG0) {
+            /* An access through another pointer may alias env */
+            if (is_store) {
+                nb_env_slots = 0;
+            } else {
+                for (i = 0; i < nb_env_slots; i++) {
+                    env_slots[i].store_index = -1;
+                }
+            }
+            goto do_copy;
+        }
+
+        offset = args[2];
+        full = op == INDEX_op_ld_i32 || op == INDEX_op_st_i32;
+#if TCG_TARGET_REG_BITS == 64
+        full |= op == INDEX_op_ld_i64 || op == INDEX_op_st_i64;
+#endif
+        for (i = nb_env_slots - 1; i >= 0; i--) {
+            if (!env_slot_overlaps(i, offset, size)) {
+                continue;
+            }
+            if (full && env_slots[i].offset == offset &&
+                env_slots[i].size == size) {
+                slot = i;
+            } else if (is_store) {
+                env_slot_remove(i);
+                if (slot == nb_env_slots) {
+                    slot = i;
+                }
+            } else {
+                env_slots[i].store_index = -1;
+            }
+        }
+
+        if (slot < 0) {
+            if (full && nb_env_slots < MAX_ENV_SLOTS) {
+                slot = nb_env_slots++;
+                env_slots[slot].offset = offset;
+                env_slots[slot].size = size;
+                env_slots[slot].val = args[0];
+                env_slots[slot].store_index = is_store ? op_index : -1;
+            }
+            goto do_copy;
+        }
+
+        if (is_store) {
+            if (env_slots[slot].val == args[0]) {
+                /* The field already holds this value */
+                s->gen_opc_buf[op_index] = INDEX_op_nop;
+                args += nb_args;
+                continue;
+            }
+            if (env_slots[slot].store_index >= 0) {
+                /* The previous store is never read, its arguments
+                   stay in place behind a nop3 */
+                s->gen_opc_buf[env_slots[slot].store_index] = INDEX_op_nop3;
+            }
+            env_slots[slot].val = args[0];
+            env_slots[slot].store_index = op_index;
+            goto do_copy;
+        }
+
+        /* Load of a known field.  The temp receiving it now holds the
+           value of this field only.  */
+        for (i = nb_env_slots - 1; i >= 0; i--) {
+            if (i != slot && env_slots[i].val == args[0]) {
+                env_slot_remove(i);
+                if (slot == nb_env_slots) {
+                    slot = i;
+                }
+            }
+        }
+        if (env_slots[slot].val == args[0]) {
+            s->gen_opc_buf[op_index] = INDEX_op_nop;
+        } else {
+            s->gen_opc_buf[op_index] = op_to_mov(op);
+            gen_args[0] = args[0];
+            gen_args[1] = env_slots[slot].val;
+            gen_args += 2;
+        }
+        args += nb_args;
+        continue;
+
+    do_copy:
+        /* A new value in a temp kills the fields it was holding */
+        for (i = 0; i < nb_oargs; i++) {
+            int j;
+            for (j = nb_env_slots - 1; j >= 0; j--) {
+                if (env_slots[j].val == args[i] &&
+                    !(size && !is_store && j == slot)) {
+                    env_slot_remove(j);
+                }
+            }
+        }
+        for (i = 0; i < nb_args; i++) {
+            gen_args[i] = args[i];
+        }
+        args += nb_args;
+        gen_args += nb_args;
+    }
+
+    return gen_args;
+}
+
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
         TCGArg *args, TCGOpDef *tcg_op_defs)
 {
     TCGArg *res;
     res = tcg_constant_folding(s, tcg_opc_ptr, args, tcg_op_defs);
+    if (s->opt_tier2) {
+        res = tcg_env_forwarding(s, tcg_opc_ptr, args, tcg_op_defs);
+    }
     return res;
 }
@@ -1874,6 +1874,23 @@ static inline void tcg_gen_nor_i32(TCGv_i32 ret, TCGv_i32 arg1, TCGv_i32 arg2)
     }
 }
 
+/* ret = arg1 ? clz32(arg1) : arg2 */
+static inline void tcg_gen_clz_i32(TCGv_i32 ret, TCGv_i32 arg1, TCGv_i32 arg2)
+{
+    if (TCG_TARGET_HAS_clz_i32) {
+        tcg_gen_op3_i32(INDEX_op_clz_i32, ret, arg1, arg2);
+    } else {
+        gen_helper_clz_i32(ret, arg1, arg2);
+    }
+}
+
+static inline void tcg_gen_clzi_i32(TCGv_i32 ret, TCGv_i32 arg1, uint32_t arg2)
+{
+    TCGv_i32 t0 = tcg_const_i32(arg2);
+    tcg_gen_clz_i32(ret, arg1, t0);
+    tcg_temp_free_i32(t0);
+}
+
 static inline void tcg_gen_nor_i64(TCGv_i64 ret, TCGv_i64 arg1, TCGv_i64 arg2)
 {
 #if TCG_TARGET_REG_BITS == 64
@@ -2508,6 +2525,15 @@ static inline void tcg_gen_exit_tb(uintptr_t val)
     tcg_gen_op1i(INDEX_op_exit_tb, val);
 }
 
+/* Jump to the host code at ptr, which must be the start of a TB or
+   tcg_ctx.code_gen_epilogue.  Only for backends with
+   TCG_TARGET_HAS_goto_ptr; callers fall back to exit_tb(0).  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+    tcg_debug_assert(TCG_TARGET_HAS_goto_ptr);
+    tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+}
+
 static inline void tcg_gen_goto_tb(unsigned idx)
 {
     /* We only support two chained exits.  */
@@ -417,6 +417,7 @@ void tcg_func_start(TCGContext *s)
 
     s->gen_opc_ptr = s->gen_opc_buf;
     s->gen_opparam_ptr = s->gen_opparam_buf;
+    s->nb_direct_ram = 0;
 
     s->be = tcg_malloc(sizeof(TCGBackendData));
 }
@@ -1419,6 +1420,24 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     }
 }
 
+/* liveness analysis: conditional branch: all temps are dead, globals
+   and local temps should be in memory for the branch target, but keep
+   their liveness from the fall-through path. */
+static inline void tcg_la_cond_branch(TCGContext *s, uint8_t *dead_temps,
+                                      uint8_t *mem_temps)
+{
+    int i;
+
+    memset(mem_temps, 1, s->nb_globals);
+    for(i = s->nb_globals; i < s->nb_temps; i++) {
+        if (s->temps[i].temp_local) {
+            mem_temps[i] = 1;
+        } else {
+            dead_temps[i] = 1;
+        }
+    }
+}
+
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -1656,7 +1675,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                 }
 
                 /* if end of basic block, update */
-                if (def->flags & TCG_OPF_BB_END) {
+                if (def->flags & TCG_OPF_COND_BRANCH) {
+                    tcg_la_cond_branch(s, dead_temps, mem_temps);
+                } else if (def->flags & TCG_OPF_BB_END) {
                     tcg_la_bb_end(s, dead_temps, mem_temps);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
@@ -1963,6 +1984,34 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* at a conditional branch, we assume all temporaries are dead and all
+   globals and local temps are synced to their canonical location, but
+   they stay in registers for the fall-through path. */
+static void tcg_reg_alloc_cond_branch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+    int i;
+
+    for(i = s->nb_globals; i < s->nb_temps; i++) {
+        ts = &s->temps[i];
+        if (ts->temp_local) {
+#ifdef USE_LIVENESS_ANALYSIS
+            assert(ts->val_type != TEMP_VAL_REG || ts->mem_coherent);
+#else
+            temp_sync(s, i, allocated_regs);
+#endif
+        } else {
+#ifdef USE_LIVENESS_ANALYSIS
+            assert(ts->val_type == TEMP_VAL_DEAD);
+#else
+            temp_dead(s, i);
+#endif
+        }
+    }
+
+    sync_globals(s, allocated_regs);
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 #define NEED_SYNC_ARG(n) ((sync_args >> (n)) & 1)
 
@@ -2169,7 +2218,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if (def->flags & TCG_OPF_COND_BRANCH) {
+        tcg_reg_alloc_cond_branch(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
@@ -2468,6 +2519,7 @@ static inline int tcg_gen_code_common(TCGContext *s,
 
     args = s->gen_opparam_buf;
     op_index = 0;
+    s->gen_nb_insns = 0;
 
     for(;;) {
         opc = s->gen_opc_buf[op_index];
@@ -2493,6 +2545,7 @@ static inline int tcg_gen_code_common(TCGContext *s,
             break;
         case INDEX_op_debug_insn_start:
             /* debug instruction */
+            s->gen_insn_off[s->gen_nb_insns++] = tcg_current_code_size(s);
             break;
         case INDEX_op_nop:
         case INDEX_op_nop1:
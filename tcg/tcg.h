@@ -98,6 +98,18 @@ typedef uint64_t TCGRegSet;
 #define TCG_TARGET_HAS_sub2_i32         1
 #endif
 
+/* Backends define this to 1 if they implement goto_ptr, a jump to a host
+   code address computed at run time (usually by a TB lookup helper).  */
+#ifndef TCG_TARGET_HAS_goto_ptr
+#define TCG_TARGET_HAS_goto_ptr         0
+#endif
+
+/* clz_i32 is t1 ? clz32(t1) : t2; backends without a count leading zeros
+   instruction leave it to the runtime helper.  */
+#ifndef TCG_TARGET_HAS_clz_i32
+#define TCG_TARGET_HAS_clz_i32          0
+#endif
+
 #ifndef TCG_TARGET_deposit_i32_valid
 #define TCG_TARGET_deposit_i32_valid(ofs, len) 1
 #endif
@@ -469,6 +481,14 @@ typedef struct TCGTempSet {
     unsigned long l[BITS_TO_LONGS(TCG_MAX_TEMPS)];
 } TCGTempSet;
 
+#define TCG_MAX_DIRECT_RAM 4
+
+typedef struct TCGDirectRAM {
+    target_ulong base;
+    target_ulong size;
+    void *host;
+} TCGDirectRAM;
+
 struct TCGContext {
     uint8_t *pool_cur, *pool_end;
     TCGPool *pool_first, *pool_current, *pool_first_large;
@@ -537,6 +557,20 @@ struct TCGContext {
     target_ulong gen_opc_pc[OPC_BUF_SIZE];
     uint16_t gen_opc_icount[OPC_BUF_SIZE];
     uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
+    /* Host code offset of each debug_insn_start op, in order.  */
+    uint16_t gen_insn_off[OPC_BUF_SIZE];
+    int gen_nb_insns;
+    /* The block being translated is hot (CF_TIER2): also forward loads
+       and stores of env fields in tcg_optimize().  */
+    bool opt_tier2;
+    /* Constant to patch with the address of the block's coverage flag,
+       see gen_tb_start().  NULL without -tb-coverage.  */
+    TCGArg *tb_coverage_arg;
+    /* Guest RAM that qemu_ld may read through a host pointer, without
+       a TLB lookup.  Set by the front end for each block; a backend
+       may ignore it.  */
+    TCGDirectRAM direct_ram[TCG_MAX_DIRECT_RAM];
+    int nb_direct_ram;
 
     /* Code generation.  Note that we specifically do not use tcg_insn_unit
        here, because there's too much arithmetic throughout that relies
@@ -544,10 +578,14 @@ struct TCGContext {
        extension that allows arithmetic on void*.  */
     int code_gen_max_blocks;
     void *code_gen_prologue;
+    /* Jumping here leaves the TB loop as if by exit_tb(0).  Only set
+       by backends with TCG_TARGET_HAS_goto_ptr.  */
+    void *code_gen_epilogue;
     void *code_gen_buffer;
     size_t code_gen_buffer_size;
-    /* threshold to flush the translated code buffer */
+    /* threshold to move on to the next region of the code buffer */
     size_t code_gen_buffer_max_size;
+    size_t code_gen_region_size;
     void *code_gen_ptr;
 
     TBContext tb_ctx;
@@ -661,6 +699,10 @@ enum {
     /* Instruction is optional and not implemented by the host, or insn
        is generic and should not be implemened by the host.  */
     TCG_OPF_NOT_PRESENT  = 0x10,
+    /* Instruction is a conditional branch: together with TCG_OPF_BB_END,
+       globals are only synced to memory and stay live in registers on
+       the fall-through path.  */
+    TCG_OPF_COND_BRANCH  = 0x20,
 };
 
 typedef struct TCGOpDef {
@@ -21,6 +21,7 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <stdio.h>
@@ -37,6 +38,10 @@
 #define MAX_GPIO_INTERCEPTS 20
 #define MAX_IRQ 256
 #define SOCKET_TIMEOUT 5
+/* Writes whose "OK" may be outstanding before the client waits for them.
+ * Kept small enough that the responses fit in the socket buffer, so that
+ * QEMU never blocks sending them while we are still sending commands. */
+#define MAX_PENDING_WRITES 256
 
 QTestState *global_qtest;
 
@@ -52,6 +57,8 @@ struct QTestState
     gpio_id last_intercept_gpio_id;
     bool irq_level[MAX_GPIO_INTERCEPTS][MAX_IRQ];
     GString *rx;
+    GString *tx;          /* commands not sent yet */
+    int pending_writes;   /* writes sent whose response was not read yet */
     pid_t qemu_pid;  /* our child QEMU process */
     struct sigaction sigact_old; /* restored on exit */
     SocketInfo qtest_socket, qmp_socket;
@@ -225,6 +232,8 @@ QTestState *qtest_init(const char *extra_args, int num_serial_ports)
     }
 
     s->rx = g_string_new("");
+    s->tx = g_string_new("");
+    s->pending_writes = 0;
 
     s->last_intercept_gpio_id = -1;
     for(i = 0; i < MAX_GPIO_INTERCEPTS; i++) {
@@ -268,6 +277,7 @@ void qtest_quit(QTestState *s)
     }
     g_free(s->serial_port_sockets);
     g_string_free(s->rx, true);
+    g_string_free(s->tx, true);
     g_free(s);
 }
 
@@ -300,15 +310,26 @@ static void socket_sendf(SocketInfo *socket_info, const char *fmt, va_list ap)
     g_free(str);
 }
 
+/* Commands are queued in s->tx and sent together when a response is needed,
+ * so that a run of writes costs one message rather than one round trip
+ * each. */
 static void GCC_FMT_ATTR(2, 3) qtest_sendf(QTestState *s, const char *fmt, ...)
 {
     va_list ap;
 
     va_start(ap, fmt);
-    socket_sendf(&s->qtest_socket, fmt, ap);
+    g_string_append_vprintf(s->tx, fmt, ap);
     va_end(ap);
 }
 
+static void qtest_send_tx(QTestState *s)
+{
+    if (s->tx->len) {
+        socket_send(&s->qtest_socket, s->tx->str, s->tx->len);
+        g_string_truncate(s->tx, 0);
+    }
+}
+
 static GString *qtest_recv_line(QTestState *s)
 {
     GString *line;
@@ -339,7 +360,7 @@ static GString *qtest_recv_line(QTestState *s)
     return line;
 }
 
-static gchar **qtest_rsp(QTestState *s, int expected_args)
+static gchar **qtest_rsp_one(QTestState *s, int expected_args)
 {
     GString *line;
     gchar **words;
@@ -393,12 +414,37 @@ redo:
     return words;
 }
 
+void qtest_sync(QTestState *s)
+{
+    qtest_send_tx(s);
+    while (s->pending_writes) {
+        s->pending_writes--;
+        qtest_rsp_one(s, 0);
+    }
+}
+
+/* Sends the queued commands and returns the response to the last one */
+static gchar **qtest_rsp(QTestState *s, int expected_args)
+{
+    qtest_sync(s);
+    return qtest_rsp_one(s, expected_args);
+}
+
+/* For commands whose only response is "OK": the response is checked the
+ * next time one is needed, see qtest_sync(). */
+static void qtest_rsp_deferred(QTestState *s)
+{
+    if (++s->pending_writes >= MAX_PENDING_WRITES) {
+        qtest_sync(s);
+    }
+}
+
 typedef struct {
     JSONMessageParser parser;
     QDict *response;
 } QMPResponseParser;
 
-static void qmp_response(JSONMessageParser *parser, QList *tokens)
+static void qmp_response(JSONMessageParser *parser, JSONToken *tokens)
 {
     QMPResponseParser *qmp = container_of(parser, QMPResponseParser, parser);
     QObject *obj;
@@ -454,6 +500,9 @@ QDict *qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
     qobj = qobject_from_jsonv(fmt, &ap_copy);
     va_end(ap_copy);
 
+    /* The queued qtest commands come first */
+    qtest_sync(s);
+
     /* No need to send anything for an empty QObject.  */
     if (qobj) {
         QString *qstr = qobject_to_json(qobj);
@@ -499,6 +548,39 @@ void qtest_qmp_discard_response(QTestState *s, const char *fmt, ...)
     QDECREF(response);
 }
 
+/* Whether the QMP socket holds a message which was not read yet */
+static bool qtest_qmp_pending(QTestState *s)
+{
+    struct pollfd pfd = { .fd = s->qmp_socket.fd, .events = POLLIN };
+
+    return poll(&pfd, 1, 0) > 0;
+}
+
+void qtest_reset(QTestState *s)
+{
+    QDict *msg;
+    bool done;
+
+    /* The writes queued for the test case which ran before go first */
+    qtest_sync(s);
+
+    /* Drop the events which nobody read, so that an old RESET is not taken
+     * for this one */
+    while (qtest_qmp_pending(s)) {
+        QDECREF(qtest_qmp_receive(s));
+    }
+
+    /* The reset runs in the main loop after the command returns, and the
+     * RESET event comes once the devices are reset */
+    qtest_qmp_discard_response(s, "{ 'execute': 'system_reset' }");
+    do {
+        msg = qtest_qmp_receive(s);
+        done = qdict_haskey(msg, "event") &&
+               !strcmp(qdict_get_str(msg, "event"), "RESET");
+        QDECREF(msg);
+    } while (!done);
+}
+
 const char *qtest_get_arch(void)
 {
     const char *qemu = getenv("QTEST_QEMU_BINARY");
@@ -593,6 +675,7 @@ void qtest_write_serial_port(QTestState *s,
     va_list ap;
     SocketInfo *socket_info = get_serial_port_socket(s, serial_port_num);
 
+    qtest_sync(s);
     va_start(ap, fmt);
     socket_sendf(socket_info, fmt, ap);
     va_end(ap);
@@ -604,6 +687,7 @@ uint8_t qtest_read_serial_port_byte(QTestState *s, int serial_port_num)
     uint8_t buffer;
     SocketInfo *socket_info = get_serial_port_socket(s, serial_port_num);
 
+    qtest_sync(s);
     do {
         len = read(socket_info->fd, &buffer, sizeof(buffer));
         if (errno == EINTR) {
@@ -625,7 +709,7 @@ uint8_t qtest_read_serial_port_byte(QTestState *s, int serial_port_num)
 static void qtest_out(QTestState *s, const char *cmd, uint16_t addr, uint32_t value)
 {
     qtest_sendf(s, "%s 0x%x 0x%x\n", cmd, addr, value);
-    qtest_rsp(s, 0);
+    qtest_rsp_deferred(s);
 }
 
 void qtest_outb(QTestState *s, uint16_t addr, uint8_t value)
@@ -675,7 +759,7 @@ static void qtest_write(QTestState *s, const char *cmd, uint64_t addr,
                         uint64_t value)
 {
     qtest_sendf(s, "%s 0x%" PRIx64 " 0x%" PRIx64 "\n", cmd, addr, value);
-    qtest_rsp(s, 0);
+    qtest_rsp_deferred(s);
 }
 
 void qtest_writeb(QTestState *s, uint64_t addr, uint8_t value)
@@ -731,53 +815,103 @@ uint64_t qtest_readq(QTestState *s, uint64_t addr)
     return qtest_read(s, "readq", addr);
 }
 
-static int hex2nib(char ch)
-{
-    if (ch >= '0' && ch <= '9') {
-        return ch - '0';
-    } else if (ch >= 'a' && ch <= 'f') {
-        return 10 + (ch - 'a');
-    } else if (ch >= 'A' && ch <= 'F') {
-        return 10 + (ch - 'a');
-    } else {
-        return -1;
-    }
-}
-
 void qtest_memread(QTestState *s, uint64_t addr, void *data, size_t size)
 {
-    uint8_t *ptr = data;
     gchar **args;
-    size_t i;
 
-    qtest_sendf(s, "read 0x%" PRIx64 " 0x%zx\n", addr, size);
+    qtest_sendf(s, "bread 0x%" PRIx64 " 0x%zx\n", addr, size);
     args = qtest_rsp(s, 2);
+    g_assert_cmpint(strtoull(args[1], NULL, 0), ==, size);
+    g_strfreev(args);
+
+    /* The data follows the response line */
+    while (s->rx->len < size) {
+        ssize_t len;
+        char buffer[1024];
+
+        len = read(s->qtest_socket.fd, buffer, sizeof(buffer));
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
 
-    for (i = 0; i < size; i++) {
-        ptr[i] = hex2nib(args[1][2 + (i * 2)]) << 4;
-        ptr[i] |= hex2nib(args[1][2 + (i * 2) + 1]);
+        if (len == -1 || len == 0) {
+            fprintf(stderr, "Broken pipe\n");
+            exit(1);
+        }
+
+        g_string_append_len(s->rx, buffer, len);
     }
+    memcpy(data, s->rx->str, size);
+    g_string_erase(s->rx, 0, size);
+}
 
-    g_strfreev(args);
+/* With QTEST_SHARD=index/count, only every count-th test case from the
+ * index-th one is added, so that count processes with their own QEMU can
+ * run the cases of a test program in parallel */
+static bool qtest_in_shard(void)
+{
+    static int shard = -1, count, n;
+    const char *env;
+
+    if (shard < 0) {
+        env = getenv("QTEST_SHARD");
+        if (!env || sscanf(env, "%d/%d", &shard, &count) != 2 ||
+            shard < 0 || count <= shard) {
+            shard = 0;
+            count = 1;
+        }
+    }
+    return n++ % count == shard;
 }
 
 void qtest_add_func(const char *str, void (*fn))
 {
-    gchar *path = g_strdup_printf("/%s/%s", qtest_get_arch(), str);
+    gchar *path;
+
+    if (!qtest_in_shard()) {
+        return;
+    }
+    path = g_strdup_printf("/%s/%s", qtest_get_arch(), str);
     g_test_add_func(path, fn);
 }
 
-void qtest_memwrite(QTestState *s, uint64_t addr, const void *data, size_t size)
+typedef struct QTestResetFunc {
+    void (*fn)(void);
+    void (*setup)(void);
+} QTestResetFunc;
+
+static void qtest_run_reset_func(gconstpointer data)
 {
-    const uint8_t *ptr = data;
-    size_t i;
+    const QTestResetFunc *f = data;
 
-    qtest_sendf(s, "write 0x%" PRIx64 " 0x%zx 0x", addr, size);
-    for (i = 0; i < size; i++) {
-        qtest_sendf(s, "%02x", ptr[i]);
+    qtest_reset(global_qtest);
+    if (f->setup) {
+        f->setup();
     }
-    qtest_sendf(s, "\n");
-    qtest_rsp(s, 0);
+    f->fn();
+}
+
+void qtest_add_reset_func(const char *str, void (*fn)(void),
+                          void (*setup)(void))
+{
+    QTestResetFunc *f;
+    gchar *path;
+
+    if (!qtest_in_shard()) {
+        return;
+    }
+    f = g_new(QTestResetFunc, 1);
+    f->fn = fn;
+    f->setup = setup;
+    path = g_strdup_printf("/%s/%s", qtest_get_arch(), str);
+    g_test_add_data_func(path, f, qtest_run_reset_func);
+}
+
+void qtest_memwrite(QTestState *s, uint64_t addr, const void *data, size_t size)
+{
+    qtest_sendf(s, "bwrite 0x%" PRIx64 " 0x%zx\n", addr, size);
+    g_string_append_len(s->tx, data, size);
+    qtest_rsp_deferred(s);
 }
 
 void write_serial_port(int serial_port_num, const char *fmt, ...)
@@ -347,6 +347,19 @@ void qtest_memread(QTestState *s, uint64_t addr, void *data, size_t size);
  */
 void qtest_memwrite(QTestState *s, uint64_t addr, const void *data, size_t size);
 
+/**
+ * qtest_sync:
+ * @s: #QTestState instance to operate on.
+ *
+ * Send the queued commands and wait until QEMU has processed them.  Writes
+ * (qtest_outb(), qtest_writel(), qtest_memwrite()...) are queued and sent
+ * together with the next command that returns a value, so a test which
+ * configures many registers does not wait for each of them.  All the
+ * functions which return a value, talk QMP or use a serial port do this
+ * first; call it directly only to wait for QEMU otherwise.
+ */
+void qtest_sync(QTestState *s);
+
 /**
  * qtest_clock_step_next:
  * @s: #QTestState instance to operate on.
@@ -379,6 +392,18 @@ int64_t qtest_clock_step(QTestState *s, int64_t step);
  */
 int64_t qtest_clock_set(QTestState *s, int64_t val);
 
+/**
+ * qtest_reset:
+ * @s: #QTestState instance to operate on.
+ *
+ * Reset the machine with system_reset, and wait until the reset is done.
+ * QMP events which were not read yet are dropped.  With a machine whose
+ * reset puts back the state of a freshly started QEMU, such as an STM32
+ * with fast_reset=on, test cases can share one QEMU and still each start
+ * from a clean machine.
+ */
+void qtest_reset(QTestState *s);
+
 /**
  * qtest_get_arch:
  *
@@ -397,6 +422,22 @@ const char *qtest_get_arch(void);
  */
 void qtest_add_func(const char *str, void (*fn));
 
+/**
+ * qtest_add_reset_func:
+ * @str: Test case path.
+ * @fn: Test case function
+ * @setup: Function to call after the reset, or %NULL
+ *
+ * Like qtest_add_func(), but the test case first resets the machine of
+ * global_qtest with qtest_reset() and calls @setup.
+ *
+ * With QTEST_SHARD=index/count in the environment, both only add every
+ * count-th test case from the index-th one, so that count instances of the
+ * test program, each with its own QEMU, run all the cases in parallel.
+ */
+void qtest_add_reset_func(const char *str, void (*fn)(void),
+                          void (*setup)(void));
+
 /**
  * qtest_start:
  * @args: other arguments to pass to QEMU
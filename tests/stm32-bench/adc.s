@@ -0,0 +1,102 @@
+/*
+ * ADC capture: continuous conversion of ADC1 IN0 into a circular DMA buffer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * DMA1 channel 1 interrupts once per block of samples.  The events are
+ * samples, each of which is one conversion and one DMA transfer.
+ */
+
+    .syntax unified
+    .cpu cortex-m3
+    .thumb
+
+    .equ RCC_AHBENR, 0x40021014
+    .equ RCC_APB2ENR, 0x40021018
+    .equ GPIOA_CRL, 0x40010800
+    .equ ADC1_BASE, 0x40012400
+    .equ DMA1_BASE, 0x40020000
+    .equ NVIC_ISER0, 0xe000e100
+    .equ BLOCK, 1024
+    .equ BLOCKS, 256
+
+    .bss
+    .align 2
+samples:
+    .space BLOCK * 2
+count:
+    .space 4
+
+    .text
+    .global main
+    .thumb_func
+main:
+    push {r4, lr}
+    ldr r0, =RCC_AHBENR
+    ldr r1, [r0]
+    orr r1, r1, #(1 << 0)               /* DMA1EN */
+    str r1, [r0]
+    ldr r0, =RCC_APB2ENR
+    ldr r1, [r0]
+    orr r1, r1, #((1 << 9) | (1 << 2))  /* ADC1EN | IOPAEN */
+    str r1, [r0]
+
+    /* PA0: analog input */
+    ldr r0, =GPIOA_CRL
+    ldr r1, [r0]
+    bic r1, r1, #0xf
+    str r1, [r0]
+
+    ldr r0, =DMA1_BASE
+    ldr r1, =ADC1_BASE + 0x4c
+    str r1, [r0, #0x10]                 /* CPAR1: ADC1_DR */
+    ldr r1, =samples
+    str r1, [r0, #0x14]                 /* CMAR1 */
+    mov r1, #BLOCK
+    str r1, [r0, #0x0c]                 /* CNDTR1 */
+    movw r1, #0x5a3
+    str r1, [r0, #0x08]                 /* CCR1: 16 bit, MINC, CIRC, TCIE, EN */
+    ldr r2, =NVIC_ISER0
+    mov r3, #(1 << 11)
+    str r3, [r2]
+
+    /* Regular sequence is IN0 alone after reset */
+    ldr r0, =ADC1_BASE
+    movw r1, #0x103
+    str r1, [r0, #0x08]                 /* CR2: DMA, CONT, ADON */
+    ldr r1, =0x5e0103
+    str r1, [r0, #0x08]                 /* CR2: SWSTART, EXTTRIG, EXTSEL */
+
+    ldr r4, =count
+    ldr r2, =BLOCKS
+1:  wfi
+    ldr r3, [r4]
+    cmp r3, r2
+    blo 1b
+    movs r1, #0
+    str r1, [r0, #0x08]                 /* power the ADC down */
+
+    ldr r0, =name
+    ldr r1, =BLOCKS * BLOCK
+    movs r2, #0
+    pop {r4, lr}
+    b report
+
+    .global dma1_ch1_handler
+    .thumb_func
+dma1_ch1_handler:
+    ldr r0, =DMA1_BASE
+    movs r1, #1
+    str r1, [r0, #0x04]                 /* IFCR: CGIF1 */
+    ldr r0, =count
+    ldr r1, [r0]
+    adds r1, #1
+    str r1, [r0]
+    bx lr
+
+    .ltorg
+
+    .section .rodata
+name:
+    .asciz "adc"
@@ -0,0 +1,64 @@
+/*
+ * CoreMark-like integer kernel
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Each pass runs a bitwise CRC-16 and a multiply-accumulate over a 256 byte
+ * buffer, and writes the running CRC back into it so that no two passes
+ * see the same data.  The inner loops have no data dependent branches, so
+ * the instruction count is known exactly.
+ */
+
+    .syntax unified
+    .cpu cortex-m3
+    .thumb
+
+    .equ PASSES, 20000
+    /* Instructions in one pass of the outer loop */
+    .equ PASS_INSNS, 4 + 256 * 63
+
+    .bss
+    .align 2
+buf:
+    .space 256
+
+    .text
+    .global main
+    .thumb_func
+main:
+    push {r4, r5, r6, r7, lr}
+    ldr r5, =0xa001                     /* CRC-16 polynomial, reflected */
+    movw r0, #0xffff
+    movs r7, #0
+    ldr r12, =PASSES
+1:  ldr r1, =buf
+    mov r2, #256
+2:  ldrb r4, [r1]
+    eors r0, r4
+    mla r7, r4, r4, r7
+    movs r6, #8
+3:  and r3, r0, #1
+    lsrs r0, r0, #1
+    negs r3, r3
+    ands r3, r5
+    eors r0, r3
+    subs r6, #1
+    bne 3b
+    strb r0, [r1], #1
+    subs r2, #1
+    bne 2b
+    subs r12, r12, #1
+    bne 1b
+
+    ldr r0, =name
+    ldr r1, =PASSES
+    ldr r2, =PASSES * PASS_INSNS
+    pop {r4, r5, r6, r7, lr}
+    b report
+
+    .ltorg
+
+    .section .rodata
+name:
+    .asciz "coremark"
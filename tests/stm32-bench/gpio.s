@@ -0,0 +1,81 @@
+/*
+ * GPIO toggling through the bit-band aliases
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Each pass toggles PC12, the LED on stm32-p103, four times through the
+ * peripheral bit-band alias of GPIOC_ODR, and sets, reads back and clears
+ * a flag through the SRAM bit-band alias.  The events are pin changes.
+ */
+
+    .syntax unified
+    .cpu cortex-m3
+    .thumb
+
+    .equ RCC_APB2ENR, 0x40021018
+    .equ GPIOC_CRH, 0x40011004
+    /* GPIOC_ODR bit 12 */
+    .equ LED_BB, 0x42000000 + 0x1100c * 32 + 12 * 4
+    .equ PASSES, 500000
+    /* Instructions in one pass of the loop */
+    .equ PASS_INSNS, 14
+
+    .bss
+    .align 2
+flag:
+    .space 4
+
+    .text
+    .global main
+    .thumb_func
+main:
+    push {r4, r5, r6, lr}
+    ldr r0, =RCC_APB2ENR
+    ldr r1, [r0]
+    orr r1, r1, #(1 << 4)               /* IOPCEN */
+    str r1, [r0]
+
+    /* PC12: 50 MHz push-pull output */
+    ldr r0, =GPIOC_CRH
+    ldr r1, [r0]
+    bic r1, r1, #0xf0000
+    orr r1, r1, #0x30000
+    str r1, [r0]
+
+    ldr r4, =LED_BB
+    /* Bit 0 of flag */
+    ldr r5, =flag
+    sub r5, r5, #0x20000000
+    lsls r5, r5, #5
+    add r5, r5, #0x22000000
+    movs r1, #1
+    movs r2, #0
+    movs r6, #0
+    ldr r0, =PASSES
+1:  str r1, [r4]
+    str r2, [r4]
+    str r1, [r4]
+    str r2, [r4]
+    str r1, [r4]
+    str r2, [r4]
+    str r1, [r4]
+    str r2, [r4]
+    str r1, [r5]
+    ldr r3, [r5]
+    add r6, r3
+    str r2, [r5]
+    subs r0, #1
+    bne 1b
+
+    ldr r0, =name
+    ldr r1, =PASSES * 8
+    ldr r2, =PASSES * PASS_INSNS
+    pop {r4, r5, r6, lr}
+    b report
+
+    .ltorg
+
+    .section .rodata
+name:
+    .asciz "gpio"
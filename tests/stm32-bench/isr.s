@@ -0,0 +1,79 @@
+/*
+ * Interrupt storm: TIM2 update interrupts at 1 MHz
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The timer runs faster than QEMU can take the interrupts, so the event
+ * rate measures the cost of the timer and exception paths.
+ */
+
+    .syntax unified
+    .cpu cortex-m3
+    .thumb
+
+    .equ RCC_APB1ENR, 0x4002101c
+    .equ TIM2_BASE, 0x40000000
+    .equ NVIC_ISER0, 0xe000e100
+    .equ EVENTS, 500000
+
+    .bss
+    .align 2
+count:
+    .space 4
+
+    .text
+    .global main
+    .thumb_func
+main:
+    push {r4, lr}
+    ldr r0, =RCC_APB1ENR
+    ldr r1, [r0]
+    orr r1, r1, #(1 << 0)               /* TIM2EN */
+    str r1, [r0]
+
+    /* 8 MHz / 8 */
+    ldr r0, =TIM2_BASE
+    movs r1, #0
+    str r1, [r0, #0x28]                 /* PSC */
+    movs r1, #7
+    str r1, [r0, #0x2c]                 /* ARR */
+    movs r1, #1
+    str r1, [r0, #0x0c]                 /* DIER: UIE */
+    ldr r2, =NVIC_ISER0
+    mov r3, #(1 << 28)
+    str r3, [r2]
+    str r1, [r0]                        /* CR1: CEN */
+
+    ldr r4, =count
+    ldr r2, =EVENTS
+1:  wfi
+    ldr r3, [r4]
+    cmp r3, r2
+    blo 1b
+    movs r1, #0
+    str r1, [r0]
+
+    ldr r0, =name
+    mov r1, r3
+    movs r2, #0
+    pop {r4, lr}
+    b report
+
+    .global tim2_handler
+    .thumb_func
+tim2_handler:
+    ldr r0, =TIM2_BASE
+    movs r1, #0
+    str r1, [r0, #0x10]                 /* SR: clear UIF */
+    ldr r0, =count
+    ldr r1, [r0]
+    adds r1, #1
+    str r1, [r0]
+    bx lr
+
+    .ltorg
+
+    .section .rodata
+name:
+    .asciz "isr"
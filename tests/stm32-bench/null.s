@@ -0,0 +1,26 @@
+/*
+ * Empty kernel, timed by run_bench.sh to take QEMU start-up out of the
+ * other results
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+    .syntax unified
+    .cpu cortex-m3
+    .thumb
+
+    .text
+    .global main
+    .thumb_func
+main:
+    ldr r0, =name
+    movs r1, #0
+    movs r2, #0
+    b report
+
+    .ltorg
+
+    .section .rodata
+name:
+    .asciz "null"
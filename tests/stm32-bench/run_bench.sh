@@ -0,0 +1,112 @@
+#!/bin/bash
+
+# Run the STM32 benchmark kernels on stm32-p103 and report their speed
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Usage: run_bench.sh [kernel...]
+#
+#   QEMU        qemu-system-arm binary to measure
+#   QEMU_OPTS   extra options for every run, e.g. "-icount 2"
+#   BENCH_RUNS  runs of each kernel, of which the fastest is reported
+#
+# The prebuilt .bin files are used as they are; "make" rebuilds them with an
+# arm-none-eabi toolchain.  Rates are computed from the wall time less that
+# of the empty kernel, so that QEMU start-up does not count.
+
+BENCH_DIR=$(dirname "$0")
+QEMU=${QEMU:-"$BENCH_DIR/../../arm-softmmu/qemu-system-arm"}
+RUNS=${BENCH_RUNS:-3}
+KERNELS=${*:-"coremark isr uart adc gpio"}
+UART_BYTES=1048576
+
+now() {
+    date +%s.%N
+}
+
+# Run a kernel once.  Sets result to its RESULT line and wall to its wall
+# time in seconds.
+run_qemu() {
+    local kernel=$1
+    shift
+
+    local start=$(now)
+    result=$($QEMU -M stm32-p103 -kernel $BENCH_DIR/$kernel.bin \
+                   -semihosting -display none -monitor none \
+                   "$@" $QEMU_OPTS | grep '^RESULT')
+    wall=$(echo $start $(now) | awk '{ printf "%.3f", $2 - $1 }')
+}
+
+# The echoed data goes back out of the same serial port, and is compared
+# with what was sent.
+run_uart() {
+    local dir=$(mktemp -d)
+
+    mkfifo $dir/serial.in $dir/serial.out
+    head -c $UART_BYTES /dev/urandom > $dir/data
+    cat $dir/data > $dir/serial.in &
+    local writer=$!
+    (head -c $UART_BYTES $dir/serial.out | cmp -s - $dir/data ||
+        echo "uart: echoed data differs" >&2) &
+
+    run_qemu uart -serial pipe:$dir/serial \
+                  -global stm32-uart.timing=instant
+
+    kill $writer 2>/dev/null
+    wait
+    rm -rf $dir
+}
+
+# Run a kernel BENCH_RUNS times.  Sets result as run_qemu does, and wall to
+# the fastest time.
+bench() {
+    local kernel=$1
+    local best=
+    local i
+
+    for ((i = 0; i < RUNS; i++)); do
+        if [ $kernel = uart ]; then
+            run_uart
+        else
+            run_qemu $kernel -serial null
+        fi
+        if [ -z "$result" ]; then
+            return 1
+        fi
+        if [ -z "$best" ] || awk "BEGIN { exit !($wall < $best) }"; then
+            best=$wall
+        fi
+    done
+    wall=$best
+}
+
+
+
+if ! bench null; then
+    echo "null: no result, is QEMU ($QEMU) built?" >&2
+    exit 1
+fi
+base=$wall
+
+status=0
+printf "%-10s %10s %14s %10s\n" kernel "wall (s)" "events/s" "MIPS"
+for k in $KERNELS; do
+    if ! bench $k; then
+        printf "%-10s %10s\n" $k FAILED
+        status=1
+        continue
+    fi
+    # RESULT <name> <events> <instructions>
+    set -- $result
+    echo $wall $base $3 $4 | awk -v k=$k '{
+        t = $1 - $2
+        if (t <= 0) {
+            t = 0.001
+        }
+        mips = $4 ? sprintf("%.1f", $4 / t / 1e6) : "-"
+        printf "%-10s %10.3f %14.0f %10s\n", k, $1, $3 / t, mips
+    }'
+done
+
+exit $status
@@ -0,0 +1,136 @@
+/*
+ * Start-up code shared by the STM32 benchmark kernels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Each kernel provides main, which returns after calling report.  Output
+ * and exit go through semihosting, so QEMU must be run with -semihosting.
+ */
+
+    .syntax unified
+    .cpu cortex-m3
+    .thumb
+
+    .section .vectors, "a"
+    .word _stack_top
+    .word reset_handler
+    .rept 14
+    .word default_handler
+    .endr
+    /* IRQ 0 to 10 */
+    .rept 11
+    .word default_handler
+    .endr
+    .word dma1_ch1_handler              /* IRQ 11 */
+    /* IRQ 12 to 27 */
+    .rept 16
+    .word default_handler
+    .endr
+    .word tim2_handler                  /* IRQ 28 */
+    /* IRQ 29 to 59 */
+    .rept 31
+    .word default_handler
+    .endr
+
+    .weak dma1_ch1_handler
+    .thumb_set dma1_ch1_handler, default_handler
+    .weak tim2_handler
+    .thumb_set tim2_handler, default_handler
+
+    .text
+
+    .global reset_handler
+    .thumb_func
+reset_handler:
+    ldr r0, =_bss_start
+    ldr r1, =_bss_end
+    movs r2, #0
+1:  cmp r0, r1
+    bhs 2f
+    str r2, [r0], #4
+    b 1b
+2:  bl main
+    b exit
+
+    .thumb_func
+default_handler:
+    ldr r0, =str_fault
+    bl puts
+    b exit
+
+    .global exit
+    .thumb_func
+exit:
+    movs r0, #0x18                      /* SYS_EXIT */
+    ldr r1, =0x20026                    /* ADP_Stopped_ApplicationExit */
+    bkpt 0xab
+    b .
+
+/* Write the string at r0 */
+    .global puts
+    .thumb_func
+puts:
+    mov r1, r0
+    movs r0, #4                         /* SYS_WRITE0 */
+    bkpt 0xab
+    bx lr
+
+/* Write r0 in decimal */
+    .global print_dec
+    .thumb_func
+print_dec:
+    push {r4, lr}
+    sub sp, #16
+    add r4, sp, #15
+    movs r1, #0
+    strb r1, [r4]
+    movs r2, #10
+1:  udiv r1, r0, r2
+    mls r3, r1, r2, r0
+    adds r3, #'0'
+    strb r3, [r4, #-1]!
+    movs r0, r1
+    bne 1b
+    mov r0, r4
+    bl puts
+    add sp, #16
+    pop {r4, pc}
+
+/* Write the "RESULT <name> <events> <instructions>" line that run_bench.sh
+ * looks for.  r0 is the kernel name, r1 the number of events and r2 the
+ * number of instructions executed, or 0 if the kernel does not know it. */
+    .global report
+    .thumb_func
+report:
+    push {r4, r5, r6, lr}
+    mov r4, r0
+    mov r5, r1
+    mov r6, r2
+    ldr r0, =str_result
+    bl puts
+    mov r0, r4
+    bl puts
+    ldr r0, =str_space
+    bl puts
+    mov r0, r5
+    bl print_dec
+    ldr r0, =str_space
+    bl puts
+    mov r0, r6
+    bl print_dec
+    ldr r0, =str_newline
+    bl puts
+    pop {r4, r5, r6, pc}
+
+    .ltorg
+
+    .section .rodata
+str_fault:
+    .asciz "FAILED: unexpected exception\n"
+str_result:
+    .asciz "RESULT "
+str_space:
+    .asciz " "
+str_newline:
+    .asciz "\n"
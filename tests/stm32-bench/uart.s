@@ -0,0 +1,69 @@
+/*
+ * UART echo of 1 MB on USART3
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * USART3 is the UART that receives from the first serial port on
+ * stm32-p103.  run_bench.sh feeds it through a pipe with the UART timing
+ * set to instant, and checks what comes back.
+ */
+
+    .syntax unified
+    .cpu cortex-m3
+    .thumb
+
+    .equ RCC_APB2ENR, 0x40021018
+    .equ RCC_APB1ENR, 0x4002101c
+    .equ GPIOB_CRH, 0x40010c04
+    .equ USART3_BASE, 0x40004800
+    .equ BYTES, 1048576
+
+    .text
+    .global main
+    .thumb_func
+main:
+    ldr r0, =RCC_APB2ENR
+    ldr r1, [r0]
+    orr r1, r1, #(1 << 3)               /* IOPBEN */
+    str r1, [r0]
+    ldr r0, =RCC_APB1ENR
+    ldr r1, [r0]
+    orr r1, r1, #(1 << 18)              /* USART3EN */
+    str r1, [r0]
+
+    /* PB10 (TX): alternate function push-pull */
+    ldr r0, =GPIOB_CRH
+    ldr r1, [r0]
+    bic r1, r1, #0xf00
+    orr r1, r1, #0xb00
+    str r1, [r0]
+
+    ldr r0, =USART3_BASE
+    movs r1, #0x45                      /* 115200 baud from 8 MHz */
+    str r1, [r0, #0x08]                 /* BRR */
+    movw r1, #0x200c
+    str r1, [r0, #0x0c]                 /* CR1: UE | TE | RE */
+
+    ldr r2, =BYTES
+1:  ldr r1, [r0]                        /* SR */
+    tst r1, #(1 << 5)                   /* RXNE */
+    beq 1b
+    ldr r3, [r0, #0x04]                 /* DR */
+2:  ldr r1, [r0]
+    tst r1, #(1 << 7)                   /* TXE */
+    beq 2b
+    str r3, [r0, #0x04]
+    subs r2, #1
+    bne 1b
+
+    ldr r0, =name
+    ldr r1, =BYTES
+    movs r2, #0
+    b report
+
+    .ltorg
+
+    .section .rodata
+name:
+    .asciz "uart"
@@ -13,6 +13,7 @@
 
 #include <glib.h>
 #include "block/coroutine.h"
+#include "qemu/thread.h"
 
 /*
  * Check that qemu_in_coroutine() works
@@ -203,6 +204,79 @@ static void test_order(void)
         g_assert_cmpint(records[i].state, ==, expected_pos[i].state);
     }
 }
+/*
+ * Check that coroutines with a non-default stack size work
+ */
+
+static void coroutine_fn set_and_exit(void *opaque)
+{
+    bool *done = opaque;
+
+    *done = true;
+}
+
+static void test_stack_size(void)
+{
+    Coroutine *coroutine;
+    bool done = false;
+
+    coroutine = qemu_coroutine_create_with_stack(set_and_exit, 64 * 1024);
+    qemu_coroutine_enter(coroutine, &done);
+    g_assert(done);
+}
+
+/*
+ * Check that coroutines can be created and freed from several threads
+ */
+
+typedef struct {
+    QemuThread thread;
+    unsigned int max;
+    unsigned int done;
+} ThreadData;
+
+static void coroutine_fn count_and_exit(void *opaque)
+{
+    unsigned int *done = opaque;
+
+    (*done)++;
+}
+
+static void *lifecycle_thread(void *opaque)
+{
+    ThreadData *data = opaque;
+    Coroutine *coroutine;
+    unsigned int i;
+
+    for (i = 0; i < data->max; i++) {
+        coroutine = qemu_coroutine_create(count_and_exit);
+        qemu_coroutine_enter(coroutine, &data->done);
+    }
+    return NULL;
+}
+
+static void run_lifecycle_threads(unsigned int n_threads, unsigned int max)
+{
+    ThreadData *data = g_new0(ThreadData, n_threads);
+    unsigned int i;
+
+    for (i = 0; i < n_threads; i++) {
+        data[i].max = max;
+        qemu_thread_create(&data[i].thread, "coroutine-test",
+                           lifecycle_thread, &data[i], QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&data[i].thread);
+        g_assert_cmpint(data[i].done, ==, max);
+    }
+    g_free(data);
+}
+
+static void test_threads(void)
+{
+    run_lifecycle_threads(4, 1000);
+}
+
 /*
  * Lifecycle benchmark
  */
@@ -230,6 +304,23 @@ static void perf_lifecycle(void)
     g_test_message("Lifecycle %u iterations: %f s\n", max, duration);
 }
 
+static void perf_lifecycle_threads(void)
+{
+    unsigned int n_threads, max;
+    double duration;
+
+    max = 1000000;
+
+    for (n_threads = 1; n_threads <= 8; n_threads *= 2) {
+        g_test_timer_start();
+        run_lifecycle_threads(n_threads, max);
+        duration = g_test_timer_elapsed();
+
+        g_test_message("Lifecycle %u iterations in %u threads: %f s\n",
+                       max, n_threads, duration);
+    }
+}
+
 static void perf_nesting(void)
 {
     unsigned int i, maxcycles, maxnesting;
@@ -297,8 +388,11 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
     g_test_add_func("/basic/order", test_order);
+    g_test_add_func("/basic/stack_size", test_stack_size);
+    g_test_add_func("/basic/threads", test_threads);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
+        g_test_add_func("/perf/lifecycle-threads", perf_lifecycle_threads);
         g_test_add_func("/perf/nesting", perf_nesting);
         g_test_add_func("/perf/yield", perf_yield);
     }
@@ -226,6 +226,59 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+/* Every alignment and length up to a few chunks, with a single non-zero
+ * byte anywhere in the buffer, or none */
+static void test_buffer_find_nonzero_offset(void)
+{
+    uint8_t *buf = g_malloc0(1024 + 64);
+    size_t align, len, nz, off;
+
+    for (align = 0; align < 64; align++) {
+        uint8_t *p = buf + align;
+
+        for (len = 0; len <= 1024; len += (len < 160 ? 1 : 61)) {
+            g_assert_cmpint(buffer_find_nonzero_offset(p, len), ==, len);
+            g_assert(buffer_is_zero(p, len));
+            for (nz = 0; nz < len; nz++) {
+                p[nz] = 0x80;
+                off = buffer_find_nonzero_offset(p, len);
+                g_assert_cmpint(off, <=, nz);
+                g_assert(!buffer_is_zero(p, len));
+                p[nz] = 0;
+            }
+        }
+    }
+
+    g_free(buf);
+}
+
+/* Run with -m perf; reports the zero page scanning throughput */
+static void test_buffer_find_nonzero_offset_perf(void)
+{
+    size_t size = 64 * 1024 * 1024;
+    uint8_t *buf = g_malloc0(size + 1);
+    int i, iterations = 20;
+    gdouble secs;
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        g_assert_cmpint(buffer_find_nonzero_offset(buf, size), ==, size);
+    }
+    secs = g_test_timer_elapsed();
+    g_test_minimized_result(secs, "aligned: %.1f MB/s",
+                            (gdouble)iterations * size / secs / 1e6);
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        g_assert_cmpint(buffer_find_nonzero_offset(buf + 1, size), ==, size);
+    }
+    secs = g_test_timer_elapsed();
+    g_test_minimized_result(secs, "unaligned: %.1f MB/s",
+                            (gdouble)iterations * size / secs / 1e6);
+
+    g_free(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +299,12 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
+    if (g_test_perf()) {
+        g_test_add_func("/cutils/buffer_find_nonzero_offset_perf",
+                        test_buffer_find_nonzero_offset_perf);
+    }
 
     return g_test_run();
 }
@@ -369,6 +369,69 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+static void test_hbitmap_next_zero(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_init(data, L3, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3 - 1), ==, L3 - 1);
+
+    hbitmap_test_set(data, L1 - 1, L2 + 2);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 - 1), ==, L1 + L2 + 1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 + 5), ==, L1 + L2 + 1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 + L2 + 1), ==,
+                    L1 + L2 + 1);
+
+    hbitmap_test_set(data, L3 - L1 - 3, L1 + 3);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3 - L1 - 3), <, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3 - 1), <, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3), <, 0);
+}
+
+static void test_hbitmap_next_zero_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_init(data, L1 * 2 + 3, 1);
+    hbitmap_test_set(data, 3, 4);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 3), ==, 8);
+
+    /* The last item is only half in the bitmap.  */
+    hbitmap_test_set(data, L1 * 2, 3);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 * 2 + 1), <, 0);
+}
+
+static void test_hbitmap_iter_extent(TestHBitmapData *data,
+                                     const void *unused)
+{
+    HBitmapIter hbi;
+    uint64_t count;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    g_assert_cmpint(hbitmap_iter_next_extent(&hbi, &count), <, 0);
+
+    hbitmap_test_set(data, 10, 5);
+    hbitmap_test_set(data, L1 - 2, L2);
+    hbitmap_test_set(data, L3 - 1, 1);
+
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    g_assert_cmpint(hbitmap_iter_next_extent(&hbi, &count), ==, 10);
+    g_assert_cmpint(count, ==, 5);
+    g_assert_cmpint(hbitmap_iter_next_extent(&hbi, &count), ==, L1 - 2);
+    g_assert_cmpint(count, ==, L2);
+    g_assert_cmpint(hbitmap_iter_next_extent(&hbi, &count), ==, L3 - 1);
+    g_assert_cmpint(count, ==, 1);
+    g_assert_cmpint(hbitmap_iter_next_extent(&hbi, &count), <, 0);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
+
+    /* Starting in the middle of a run returns only its tail.  */
+    hbitmap_iter_init(&hbi, data->hb, L1);
+    g_assert_cmpint(hbitmap_iter_next_extent(&hbi, &count), ==, L1);
+    g_assert_cmpint(count, ==, L2 - 2);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, L3 - 1);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -384,6 +447,10 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/iter/empty", test_hbitmap_iter_empty);
     hbitmap_test_add("/hbitmap/iter/partial", test_hbitmap_iter_partial);
     hbitmap_test_add("/hbitmap/iter/granularity", test_hbitmap_iter_granularity);
+    hbitmap_test_add("/hbitmap/iter/extent", test_hbitmap_iter_extent);
+    hbitmap_test_add("/hbitmap/next_zero/general", test_hbitmap_next_zero);
+    hbitmap_test_add("/hbitmap/next_zero/granularity",
+                     test_hbitmap_next_zero_granularity);
     hbitmap_test_add("/hbitmap/get/all", test_hbitmap_get_all);
     hbitmap_test_add("/hbitmap/get/some", test_hbitmap_get_some);
     hbitmap_test_add("/hbitmap/set/all", test_hbitmap_set_all);
@@ -0,0 +1,113 @@
+/*
+ * Interval tree unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu/interval-tree.h"
+
+#define UNIVERSE 512
+
+/* Check @tree against a shadow array of UNIVERSE addresses */
+static void check_tree(IntervalTree *tree, const bool *shadow)
+{
+    uint64_t i, j, size, addr;
+
+    for (i = 0; i < UNIVERSE; i++) {
+        g_assert_cmpint(interval_tree_intersects(tree, i, i), ==, shadow[i]);
+    }
+
+    for (size = 1; size <= 64; size *= 4) {
+        uint64_t align = size < 16 ? 1 : 16;
+        bool found = false;
+        uint64_t expect = 0;
+
+        /* Highest free aligned run of @size below 400 */
+        for (i = 400 - size + 1; i-- > 0; ) {
+            if (i % align) {
+                continue;
+            }
+            for (j = i; j < i + size && !shadow[j]; j++) {
+            }
+            if (j == i + size) {
+                found = true;
+                expect = i;
+                break;
+            }
+        }
+        g_assert_cmpint(interval_tree_find_gap(tree, 0, 399, size, align,
+                                               &addr), ==, found);
+        if (found) {
+            g_assert_cmpuint(addr, ==, expect);
+        }
+    }
+}
+
+static void test_interval_tree_random(void)
+{
+    IntervalTree tree = { 0 };
+    bool shadow[UNIVERSE];
+    GRand *rand = g_rand_new_with_seed(1);
+    int n;
+
+    memset(shadow, 0, sizeof(shadow));
+    for (n = 0; n < 2000; n++) {
+        uint64_t start = g_rand_int_range(rand, 0, UNIVERSE);
+        uint64_t len = g_rand_int_range(rand, 1, 40);
+        uint64_t last = MIN(start + len - 1, UNIVERSE - 1);
+        bool add = g_rand_boolean(rand);
+
+        if (add) {
+            interval_tree_add(&tree, start, last);
+        } else {
+            interval_tree_remove(&tree, start, last);
+        }
+        memset(&shadow[start], add, last - start + 1);
+        check_tree(&tree, shadow);
+    }
+
+    interval_tree_destroy(&tree);
+    g_assert(!interval_tree_intersects(&tree, 0, UINT64_MAX));
+    g_rand_free(rand);
+}
+
+static void test_interval_tree_limits(void)
+{
+    IntervalTree tree = { 0 };
+    uint64_t addr;
+
+    interval_tree_add(&tree, UINT64_MAX - 9, UINT64_MAX);
+    interval_tree_add(&tree, 0, 9);
+    g_assert(interval_tree_intersects(&tree, UINT64_MAX, UINT64_MAX));
+    g_assert(!interval_tree_intersects(&tree, 10, UINT64_MAX - 10));
+
+    g_assert(interval_tree_find_gap(&tree, 0, UINT64_MAX, 4096, 4096, &addr));
+    g_assert_cmpuint(addr, ==, 0xffffffffffffe000ULL);
+    g_assert(!interval_tree_find_gap(&tree, 0, 9, 1, 1, &addr));
+
+    /* Merging touching ranges leaves a single interval */
+    interval_tree_add(&tree, 10, UINT64_MAX - 10);
+    g_assert(!interval_tree_find_gap(&tree, 0, UINT64_MAX, 1, 1, &addr));
+
+    interval_tree_remove(&tree, 100, 199);
+    g_assert(interval_tree_find_gap(&tree, 0, UINT64_MAX, 100, 1, &addr));
+    g_assert_cmpuint(addr, ==, 100);
+    g_assert(!interval_tree_find_gap(&tree, 0, UINT64_MAX, 101, 1, &addr));
+
+    interval_tree_remove(&tree, 0, UINT64_MAX);
+    g_assert(!interval_tree_intersects(&tree, 0, UINT64_MAX));
+    interval_tree_destroy(&tree);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/random", test_interval_tree_random);
+    g_test_add_func("/interval-tree/limits", test_interval_tree_limits);
+    g_test_run();
+
+    return 0;
+}
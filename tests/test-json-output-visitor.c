@@ -0,0 +1,193 @@
+/*
+ * JSON Output Visitor unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "qapi/json-output-visitor.h"
+#include "test-qapi-types.h"
+#include "test-qapi-visit.h"
+#include "qapi/qmp/types.h"
+#include "qapi/qmp/qjson.h"
+
+typedef struct TestOutputVisitorData {
+    JsonOutputVisitor *jov;
+    Visitor *ov;
+} TestOutputVisitorData;
+
+static void visitor_output_setup(TestOutputVisitorData *data,
+                                 const void *unused)
+{
+    data->jov = json_output_visitor_new();
+    g_assert(data->jov != NULL);
+
+    data->ov = json_output_get_visitor(data->jov);
+    g_assert(data->ov != NULL);
+}
+
+static void visitor_output_teardown(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    json_output_visitor_cleanup(data->jov);
+    data->jov = NULL;
+    data->ov = NULL;
+}
+
+/* The text of the visited value, which must be valid JSON.  Scalars are
+ * also checked to be written like qobject_to_json() does */
+static void check_output(TestOutputVisitorData *data, const char *expected)
+{
+    QObject *obj, *parsed;
+    QString *str;
+
+    obj = json_output_get_qobject(data->jov);
+    g_assert(obj != NULL);
+    g_assert(qobject_type(obj) == QTYPE_QJSONTEXT);
+    g_assert_cmpstr(qjsontext_get_str(qobject_to_qjsontext(obj)), ==,
+                    expected);
+
+    parsed = qobject_from_json(expected);
+    g_assert(parsed != NULL);
+    if (qobject_type(parsed) != QTYPE_QDICT &&
+        qobject_type(parsed) != QTYPE_QLIST) {
+        str = qobject_to_json(parsed);
+        g_assert_cmpstr(qstring_get_str(str), ==, expected);
+        QDECREF(str);
+    }
+    qobject_decref(parsed);
+    qobject_decref(obj);
+}
+
+static void test_visitor_out_int(TestOutputVisitorData *data,
+                                 const void *unused)
+{
+    int64_t value = -42;
+    Error *err = NULL;
+
+    visit_type_int(data->ov, &value, NULL, &err);
+    g_assert(!err);
+    check_output(data, "-42");
+}
+
+static void test_visitor_out_number(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    double value = 3.25;
+    Error *err = NULL;
+
+    visit_type_number(data->ov, &value, NULL, &err);
+    g_assert(!err);
+    check_output(data, "3.25");
+}
+
+static void test_visitor_out_string(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    char *string = (char *) "a \"b\"\\\n\tc\x01";
+    Error *err = NULL;
+
+    visit_type_str(data->ov, &string, NULL, &err);
+    g_assert(!err);
+    check_output(data, "\"a \\\"b\\\"\\\\\\n\\tc\\u0001\"");
+}
+
+static void test_visitor_out_struct(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    UserDefZero ud0 = { .integer = 42 };
+    UserDefOne ud1 = { .base = &ud0, .string = (char *) "foo",
+                       .has_enum1 = true, .enum1 = ENUM_ONE_VALUE2 };
+    UserDefOne *p = &ud1;
+    Error *err = NULL;
+
+    visit_type_UserDefOne(data->ov, &p, NULL, &err);
+    g_assert(!err);
+    check_output(data,
+                 "{\"integer\": 42, \"string\": \"foo\", \"enum1\": \"value2\"}");
+}
+
+static void test_visitor_out_list(TestOutputVisitorData *data,
+                                  const void *unused)
+{
+    UserDefZero ud01 = { .integer = 1 };
+    UserDefZero ud02 = { .integer = 2 };
+    UserDefOne ud1 = { .base = &ud01, .string = (char *) "one" };
+    UserDefOne ud2 = { .base = &ud02, .string = (char *) "two" };
+    UserDefOneList l2 = { .value = &ud2 };
+    UserDefOneList l1 = { .value = &ud1, .next = &l2 };
+    UserDefOneList *head = &l1;
+    Error *err = NULL;
+
+    visit_type_UserDefOneList(data->ov, &head, NULL, &err);
+    g_assert(!err);
+    check_output(data, "[{\"integer\": 1, \"string\": \"one\"}, "
+                       "{\"integer\": 2, \"string\": \"two\"}]");
+}
+
+static void test_visitor_out_empty_list(TestOutputVisitorData *data,
+                                        const void *unused)
+{
+    UserDefOneList *head = NULL;
+    Error *err = NULL;
+
+    visit_type_UserDefOneList(data->ov, &head, NULL, &err);
+    g_assert(!err);
+    check_output(data, "[]");
+}
+
+/* The text goes in a response as it is */
+static void test_visitor_out_in_qdict(TestOutputVisitorData *data,
+                                      const void *unused)
+{
+    int64_t value = 7;
+    Error *err = NULL;
+    QDict *rsp = qdict_new();
+    QString *str;
+
+    visit_type_int(data->ov, &value, NULL, &err);
+    g_assert(!err);
+    qdict_put_obj(rsp, "return", json_output_get_qobject(data->jov));
+
+    str = qobject_to_json(QOBJECT(rsp));
+    g_assert_cmpstr(qstring_get_str(str), ==, "{\"return\": 7}");
+    QDECREF(str);
+    QDECREF(rsp);
+}
+
+static void output_visitor_test_add(const char *testpath,
+                                    TestOutputVisitorData *data,
+                                    void (*test_func)(TestOutputVisitorData *data, const void *user_data))
+{
+    g_test_add(testpath, TestOutputVisitorData, data, visitor_output_setup,
+               test_func, visitor_output_teardown);
+}
+
+int main(int argc, char **argv)
+{
+    TestOutputVisitorData out_visitor_data;
+
+    g_test_init(&argc, &argv, NULL);
+
+    output_visitor_test_add("/json-visitor/output/int",
+                            &out_visitor_data, test_visitor_out_int);
+    output_visitor_test_add("/json-visitor/output/number",
+                            &out_visitor_data, test_visitor_out_number);
+    output_visitor_test_add("/json-visitor/output/string",
+                            &out_visitor_data, test_visitor_out_string);
+    output_visitor_test_add("/json-visitor/output/struct",
+                            &out_visitor_data, test_visitor_out_struct);
+    output_visitor_test_add("/json-visitor/output/list",
+                            &out_visitor_data, test_visitor_out_list);
+    output_visitor_test_add("/json-visitor/output/empty-list",
+                            &out_visitor_data, test_visitor_out_empty_list);
+    output_visitor_test_add("/json-visitor/output/in-qdict",
+                            &out_visitor_data, test_visitor_out_in_qdict);
+
+    g_test_run();
+
+    return 0;
+}
@@ -27,6 +27,16 @@
 #define EXTI_BASE_ADDR 0x40010400
 #define TIM2_BASE_ADDR 0x40000000
 #define UART2_BASE_ADDR 0x40004400
+#define DMA1_BASE_ADDR 0x40020000
+#define I2C1_BASE_ADDR 0x40005400
+#define WWDG_BASE_ADDR 0x40002c00
+#define DWT_BASE_ADDR 0xe0001000
+#define DEMCR_ADDR 0xe000edfc
+#define SCR_ADDR 0xe000ed10
+#define FLASH_IF_BASE_ADDR 0x40022000
+#define SRAM_BASE_ADDR 0x20000000
+#define FSMC_BASE_ADDR 0xa0000000
+#define FSMC_NE1_ADDR 0x60000000
 
 const char *dummy_kernel_path = "tests/test-stm32-dummy-kernel.bin";
 const uint32_t dummy_kernel_data = 0x12345678;
@@ -53,6 +63,7 @@ static void write_dummy_kernel_bin(void)
 
 static void enable_all_periph_clocks(void)
 {
+    writel(RCC_BASE_ADDR + 0x14, 0x00000017);
     writel(RCC_BASE_ADDR + 0x18, 0x0038fffd);
     writel(RCC_BASE_ADDR + 0x1c, 0x3afec9ff);
 }
@@ -74,6 +85,44 @@ static void test_flash_alias(void)
     g_assert_cmpint(readw(0x08000002), ==, dummy_kernel_data >> 16);
 }
 
+static void test_flash_program(void)
+{
+    /* Unlock */
+    g_assert_cmpint(readl(FLASH_IF_BASE_ADDR + 0x10) & 0x80, ==, 0x80);
+    writel(FLASH_IF_BASE_ADDR + 0x04, 0x45670123);
+    writel(FLASH_IF_BASE_ADDR + 0x04, 0xcdef89ab);
+    g_assert_cmpint(readl(FLASH_IF_BASE_ADDR + 0x10) & 0x80, ==, 0);
+
+    /* Erase the second page - the first one (holding the kernel) must not
+     * be touched. */
+    writel(FLASH_IF_BASE_ADDR + 0x10, 0x00000002);
+    writel(FLASH_IF_BASE_ADDR + 0x14, 0x08000400);
+    writel(FLASH_IF_BASE_ADDR + 0x10, 0x00000042);
+    g_assert_cmpint(readl(FLASH_IF_BASE_ADDR + 0x0c), ==, 0x00000020);
+    writel(FLASH_IF_BASE_ADDR + 0x0c, 0x00000020);
+    g_assert_cmpint(readl(0x08000400), ==, 0xffffffff);
+    g_assert_cmpint(readl(0x080007fc), ==, 0xffffffff);
+    g_assert_cmpint(readl(0x08000000), ==, dummy_kernel_data);
+
+    /* Program a half-word; it shows up in the boot alias too. */
+    writel(FLASH_IF_BASE_ADDR + 0x10, 0x00000001);
+    writew(0x08000400, 0xbeef);
+    g_assert_cmpint(readw(0x08000400), ==, 0xbeef);
+    g_assert_cmpint(readw(0x00000400), ==, 0xbeef);
+    g_assert_cmpint(readl(FLASH_IF_BASE_ADDR + 0x0c), ==, 0x00000020);
+
+    /* Programming a half-word which is not erased fails */
+    writew(0x08000400, 0x1234);
+    g_assert_cmpint(readw(0x08000400), ==, 0xbeef);
+    g_assert_cmpint(readl(FLASH_IF_BASE_ADDR + 0x0c) & 0x04, ==, 0x04);
+    writel(FLASH_IF_BASE_ADDR + 0x0c, 0x00000024);
+
+    /* Lock again; further writes are ignored. */
+    writel(FLASH_IF_BASE_ADDR + 0x10, 0x00000080);
+    writew(0x08000402, 0x5555);
+    g_assert_cmpint(readw(0x08000402), ==, 0xffff);
+}
+
 static void test_gpio_read(void)
 {
     const uint32_t addr_idr = GPIOA_BASE_ADDR + 0x08; // Input Data Register
@@ -200,6 +249,15 @@ static void test_gpio_interrupt(void)
     g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 0x6), ==, 0);
     g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 0x7), ==, 0);
     g_assert_cmpint(readl(EXTI_BASE_ADDR + 0x10), ==, 0x00000000);
+
+    // EXTI5 - EXTI9 share one NVIC IRQ, which stays raised until all of
+    // their pending flags are cleared
+    writel(EXTI_BASE_ADDR + 0x10, 0x00000060);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 23), ==, 1);
+    writel(EXTI_BASE_ADDR + 0x14, 0x00000020);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 23), ==, 1);
+    writel(EXTI_BASE_ADDR + 0x14, 0x00000040);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 23), ==, 0);
 }
 
 static void test_uart(void)
@@ -313,6 +371,237 @@ static void test_uart(void)
     writel(TIM2_BASE_ADDR + 0x00, 0x0); // Disable Timer
 }*/
 
+static void test_timer_count(void)
+{
+    /* APB1 runs at 8 MHz out of reset, so the counter ticks at 1 MHz */
+    writel(TIM2_BASE_ADDR + 0x00, 0x0);    // Disable Timer
+    writel(TIM2_BASE_ADDR + 0x0C, 0x0);    // Update interrupt masked
+    writel(TIM2_BASE_ADDR + 0x28, 15);     // PSC
+    writel(TIM2_BASE_ADDR + 0x2C, 999);    // ARR - 1 ms period
+    writel(TIM2_BASE_ADDR + 0x24, 0);      // CNT
+    writel(TIM2_BASE_ADDR + 0x10, 0);      // Clear SR
+    writel(TIM2_BASE_ADDR + 0x00, 0x1);    // Enable Timer
+
+    /* The count and UIF follow the virtual time while nothing is
+     * listening for the update event */
+    clock_step(2500000);
+    g_assert_cmpuint(readl(TIM2_BASE_ADDR + 0x24), ==, 500);
+    g_assert_cmpuint(readl(TIM2_BASE_ADDR + 0x10) & 0x1, ==, 1);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 28), ==, 0);
+
+    /* Unmasking the interrupt raises it at the next update event */
+    writel(TIM2_BASE_ADDR + 0x10, 0);
+    writel(TIM2_BASE_ADDR + 0x0C, 0x1);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 28), ==, 0);
+    clock_step(600000);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 28), ==, 1);
+    g_assert_cmpuint(readl(TIM2_BASE_ADDR + 0x24), ==, 100);
+
+    writel(TIM2_BASE_ADDR + 0x10, 0);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 28), ==, 0);
+    writel(TIM2_BASE_ADDR + 0x0C, 0x0);
+    writel(TIM2_BASE_ADDR + 0x00, 0x0);    // Disable Timer
+}
+
+static void test_timer_compare(void)
+{
+    writel(TIM2_BASE_ADDR + 0x00, 0x0);    // Disable Timer
+    writel(TIM2_BASE_ADDR + 0x28, 15);     // PSC - 1 MHz count
+    writel(TIM2_BASE_ADDR + 0x2C, 999);    // ARR - 1 ms period
+    writel(TIM2_BASE_ADDR + 0x18, 0x0060); // CCMR1 - CH1 PWM mode 1
+    writel(TIM2_BASE_ADDR + 0x34, 250);    // CCR1
+    writel(TIM2_BASE_ADDR + 0x24, 0);      // CNT
+    writel(TIM2_BASE_ADDR + 0x10, 0);      // Clear SR
+    writel(TIM2_BASE_ADDR + 0x0C, 0x2);    // CC1 interrupt enabled
+    writel(TIM2_BASE_ADDR + 0x00, 0x1);    // Enable Timer
+
+    clock_step(200000);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 28), ==, 0);
+    clock_step(100000);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 28), ==, 1);
+    /* CC1IF is set, and UIF has not been set yet */
+    g_assert_cmpuint(readl(TIM2_BASE_ADDR + 0x10) & 0x3, ==, 0x2);
+
+    /* Clearing CC1IF lowers the interrupt until the next period */
+    writel(TIM2_BASE_ADDR + 0x10, ~0x2);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 28), ==, 0);
+    clock_step(1000000);
+    g_assert_cmpint(get_irq_for_gpio(nvic_in_id, 28), ==, 1);
+    g_assert_cmpuint(readl(TIM2_BASE_ADDR + 0x10) & 0x3, ==, 0x3);
+
+    writel(TIM2_BASE_ADDR + 0x10, 0);
+    writel(TIM2_BASE_ADDR + 0x0C, 0x0);
+    writel(TIM2_BASE_ADDR + 0x00, 0x0);    // Disable Timer
+    writel(TIM2_BASE_ADDR + 0x18, 0x0);
+}
+
+static void test_dma_mem2mem(void)
+{
+    const uint32_t src = SRAM_BASE_ADDR + 0x100;
+    const uint32_t dst = SRAM_BASE_ADDR + 0x200;
+    int i;
+
+    for(i = 0; i < 4; i++) {
+        writel(src + i * 4, 0x11111111 * (i + 1));
+        writel(dst + i * 4, 0);
+    }
+
+    /* Channel 1: CPAR, CMAR, CNDTR */
+    writel(DMA1_BASE_ADDR + 0x10, src);
+    writel(DMA1_BASE_ADDR + 0x14, dst);
+    writel(DMA1_BASE_ADDR + 0x0c, 4);
+    /* MEM2MEM, 32 bit sizes, both addresses incrementing, enabled */
+    writel(DMA1_BASE_ADDR + 0x08, 0x00004ac1);
+
+    for(i = 0; i < 4; i++) {
+        g_assert_cmpuint(readl(dst + i * 4), ==, 0x11111111 * (i + 1));
+    }
+    g_assert_cmpuint(readl(DMA1_BASE_ADDR + 0x0c), ==, 0);
+    /* GIF1, TCIF1 and HTIF1 are set */
+    g_assert_cmpuint(readl(DMA1_BASE_ADDR + 0x00) & 0xf, ==, 0x7);
+
+    /* Clear the flags and disable the channel */
+    writel(DMA1_BASE_ADDR + 0x04, 0x1);
+    g_assert_cmpuint(readl(DMA1_BASE_ADDR + 0x00) & 0xf, ==, 0);
+    writel(DMA1_BASE_ADDR + 0x08, 0);
+}
+
+/* Nothing is attached to the I2C bus, so the address is not acknowledged */
+static void test_i2c_nack(void)
+{
+    /* PE, then START */
+    writel(I2C1_BASE_ADDR + 0x00, 0x0001);
+    writel(I2C1_BASE_ADDR + 0x00, 0x0101);
+    /* SB is set straight away, and MSL and BUSY with it */
+    g_assert_cmpuint(readl(I2C1_BASE_ADDR + 0x14), ==, 0x0001);
+    g_assert_cmpuint(readl(I2C1_BASE_ADDR + 0x18), ==, 0x0003);
+
+    /* Send address 0x50 for writing: SB is cleared and AF is set */
+    writel(I2C1_BASE_ADDR + 0x10, 0xa0);
+    g_assert_cmpuint(readl(I2C1_BASE_ADDR + 0x14), ==, 0x0400);
+
+    /* STOP, and clear AF */
+    writel(I2C1_BASE_ADDR + 0x00, 0x0201);
+    writel(I2C1_BASE_ADDR + 0x14, 0);
+    g_assert_cmpuint(readl(I2C1_BASE_ADDR + 0x00), ==, 0x0001);
+    g_assert_cmpuint(readl(I2C1_BASE_ADDR + 0x14), ==, 0);
+    g_assert_cmpuint(readl(I2C1_BASE_ADDR + 0x18), ==, 0);
+    writel(I2C1_BASE_ADDR + 0x00, 0);
+}
+
+/* HSI is on after reset, so it is reported at its full frequency */
+static void test_clock_query(void)
+{
+    QDict *resp, *clk;
+    QList *clks;
+
+    resp = qmp("{ 'execute': 'qom-get', 'arguments': "
+               "{ 'path': '/machine/stm32/rcc/HSI_div2', "
+               "'property': 'selected-input' } }");
+    g_assert_cmpstr(qdict_get_str(resp, "return"), ==, "HSI");
+    QDECREF(resp);
+
+    resp = qmp("{ 'execute': 'query-stm32-clocks' }");
+    clks = qdict_get_qlist(resp, "return");
+    g_assert(clks);
+    /* Clocks are listed in tree order, and HSI is created first */
+    clk = qobject_to_qdict(qlist_peek(clks));
+    g_assert_cmpstr(qdict_get_str(clk, "path"), ==, "/machine/stm32/rcc/HSI");
+    g_assert_cmpint(qdict_get_int(clk, "output-freq"), ==, 8000000);
+    g_assert(qdict_get_bool(clk, "enabled"));
+    g_assert(!qdict_haskey(clk, "selected-input"));
+    QDECREF(resp);
+}
+
+static void test_memory_read(void)
+{
+    QDict *resp;
+
+    writel(SRAM_BASE_ADDR + 0x100, 1);
+    writel(SRAM_BASE_ADDR + 0x104, 1000);
+    resp = qmp("{ 'execute': 'memory-read', "
+               "'arguments': { 'addr': 536871168, 'size': 8 } }");
+    g_assert_cmpstr(qdict_get_str(resp, "return"), ==, "AQAAAOgDAAA=");
+    QDECREF(resp);
+
+    /* Device registers are not read */
+    resp = qmp("{ 'execute': 'memory-read', "
+               "'arguments': { 'addr': 1073876992, 'size': 4 } }");
+    g_assert(qdict_haskey(resp, "error"));
+    QDECREF(resp);
+}
+
+/* The counter runs even while the watchdog is not activated, at
+ * 8 MHz / 4096, so it ticks every 512 us */
+static void test_wwdg_count(void)
+{
+    writel(WWDG_BASE_ADDR + 0x00, 0x7f);    // CR: T = 0x7f, WDGA clear
+    clock_step(10 * 512000 + 1000);
+    g_assert_cmpuint(readl(WWDG_BASE_ADDR + 0x00), ==, 0x75);
+    g_assert_cmpuint(readl(WWDG_BASE_ADDR + 0x08), ==, 0);
+}
+
+/* The power-on reset flags stay set until RMVF clears them */
+static void test_reset_flags(void)
+{
+    g_assert_cmphex(readl(RCC_BASE_ADDR + 0x24) & 0xfe000000, ==, 0x0c000000);
+    writel(RCC_BASE_ADDR + 0x24, 0x01000000);
+    g_assert_cmphex(readl(RCC_BASE_ADDR + 0x24) & 0xfe000000, ==, 0);
+}
+
+/* HCLK runs at 8 MHz out of reset */
+static void test_dwt_cyccnt(void)
+{
+    writel(DEMCR_ADDR, 0x01000000);         // TRCENA
+    writel(DWT_BASE_ADDR + 0x04, 0);        // CYCCNT
+    writel(DWT_BASE_ADDR + 0x00, 0x1);      // CYCCNTENA
+    clock_step(1000000);
+    g_assert_cmpuint(readl(DWT_BASE_ADDR + 0x04), ==, 8000);
+
+    /* The count stops with CYCCNTENA clear */
+    writel(DWT_BASE_ADDR + 0x00, 0x0);
+    clock_step(1000000);
+    g_assert_cmpuint(readl(DWT_BASE_ADDR + 0x04), ==, 8000);
+    writel(DEMCR_ADDR, 0);
+}
+
+static void test_scr(void)
+{
+    /* SLEEPONEXIT, SLEEPDEEP and SEVONPEND are kept */
+    writel(SCR_ADDR, 0xffffffff);
+    g_assert_cmphex(readl(SCR_ADDR), ==, 0x16);
+    writel(SCR_ADDR, 0);
+    g_assert_cmphex(readl(SCR_ADDR), ==, 0);
+}
+
+/* 1 MB of external SRAM on NE1, see main */
+static void test_fsmc_sram(void)
+{
+    g_assert_cmphex(readl(FSMC_BASE_ADDR + 0x00), ==, 0x000030db);
+    writel(FSMC_NE1_ADDR, 0x12345678);
+    writel(FSMC_NE1_ADDR + 0xffffc, 0x9abcdef0);
+    g_assert_cmphex(readl(FSMC_NE1_ADDR), ==, 0x12345678);
+    g_assert_cmphex(readl(FSMC_NE1_ADDR + 0xffffc), ==, 0x9abcdef0);
+
+    /* Without WREN, the SRAM is read only */
+    writel(FSMC_BASE_ADDR + 0x00, 0x000020db);
+    writel(FSMC_NE1_ADDR, 0);
+    g_assert_cmphex(readl(FSMC_NE1_ADDR), ==, 0x12345678);
+
+    /* Without MBKEN, the bank is gone */
+    writel(FSMC_BASE_ADDR + 0x00, 0x000030da);
+    g_assert_cmphex(readl(FSMC_NE1_ADDR), ==, 0);
+    writel(FSMC_BASE_ADDR + 0x00, 0x000030db);
+    g_assert_cmphex(readl(FSMC_NE1_ADDR), ==, 0x12345678);
+}
+
+/* Every test case starts from a system reset, which fast_reset makes as
+ * good as a new QEMU, with the peripheral clocks on */
+static void add_test(const char *path, void (*fn)(void))
+{
+    qtest_add_reset_func(path, fn, enable_all_periph_clocks);
+}
+
 int main(int argc, char **argv)
 {
     QTestState *s = NULL;
@@ -324,21 +613,34 @@ int main(int argc, char **argv)
 
     gchar *qemu_args = g_strdup_printf("-display none "
                                        "-machine stm32-p103 "
+                                       "-global stm32f103.fast_reset=on "
+                                       "-global stm32f103.fsmc_ne1_sram=1048576 "
                                        "-kernel %s",
                                        dummy_kernel_path);
     s = qtest_start_with_serial(qemu_args, 1);
 
-    enable_all_periph_clocks();
-
+    /* The interceptions are wiring, which the resets leave alone */
     gpio_a_out_id = qtest_irq_intercept_out(s, "/machine/stm32/gpio[a]");
     nvic_in_id = qtest_irq_intercept_in(s, "/machine/stm32/nvic");
     //gpio_b_out_id = qtest_irq_intercept_out(s, "/machine/stm32/gpio[b]");
 
-    qtest_add_func("/stm32/flash/alias", test_flash_alias);
-    qtest_add_func("/stm32/gpio/read", test_gpio_read);
-    qtest_add_func("/stm32/gpio/write", test_gpio_write);
-    qtest_add_func("/stm32/gpio/interrupt", test_gpio_interrupt);
-    qtest_add_func("/stm32/uart", test_uart);
+    add_test("/stm32/flash/alias", test_flash_alias);
+    add_test("/stm32/flash/program", test_flash_program);
+    add_test("/stm32/gpio/read", test_gpio_read);
+    add_test("/stm32/gpio/write", test_gpio_write);
+    add_test("/stm32/gpio/interrupt", test_gpio_interrupt);
+    add_test("/stm32/uart", test_uart);
+    add_test("/stm32/timer/count", test_timer_count);
+    add_test("/stm32/timer/compare", test_timer_compare);
+    add_test("/stm32/dma/mem2mem", test_dma_mem2mem);
+    add_test("/stm32/i2c/nack", test_i2c_nack);
+    add_test("/stm32/rcc/clock_query", test_clock_query);
+    add_test("/stm32/memory_read", test_memory_read);
+    add_test("/stm32/rcc/reset_flags", test_reset_flags);
+    add_test("/stm32/wwdg/count", test_wwdg_count);
+    add_test("/stm32/dwt/cyccnt", test_dwt_cyccnt);
+    add_test("/stm32/nvic/scr", test_scr);
+    add_test("/stm32/fsmc/sram", test_fsmc_sram);
 //    qtest_add_func("/stm32/timer", test_timer);
 
     ret = g_test_run();
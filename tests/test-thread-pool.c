@@ -132,6 +132,38 @@ static void test_submit_many(void)
     }
 }
 
+static void test_submit_batch(void)
+{
+    WorkerTestData data[100];
+    ThreadPoolRequest reqs[100];
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        reqs[i] = (ThreadPoolRequest) {
+            .func = worker_cb,
+            .arg = &data[i],
+            .cb = done_cb,
+            .opaque = &data[i],
+        };
+    }
+    thread_pool_submit_batch(pool, reqs, 100);
+    for (i = 0; i < 100; i++) {
+        data[i].aiocb = reqs[i].acb;
+        g_assert(data[i].aiocb != NULL);
+    }
+
+    active = 100;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < 100; i++) {
+        g_assert_cmpint(data[i].n, ==, 1);
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+}
+
 static void test_cancel(void)
 {
     WorkerTestData data[100];
@@ -216,6 +248,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/submit-batch", test_submit_batch);
     g_test_add_func("/thread-pool/cancel", test_cancel);
 
     ret = g_test_run();
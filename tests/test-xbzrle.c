@@ -179,6 +179,88 @@ static void test_encode_decode(void)
     }
 }
 
+/* The vector run scan must find the same run ends as the word loop, also
+ * when the differences start or end at unaligned offsets and at the tail */
+static void encode_compare_range(int start, int len)
+{
+    uint8_t *old_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *vec_out = g_malloc(PAGE_SIZE);
+    uint8_t *long_out = g_malloc(PAGE_SIZE);
+    int i, vec_len, long_len;
+    bool old_accel;
+
+    for (i = start; i < start + len && i < PAGE_SIZE; i++) {
+        new_buf[i] = i % 255 + 1;
+    }
+    /* a lone change a few bytes past the run */
+    if (start + len + 5 < PAGE_SIZE) {
+        new_buf[start + len + 5] = 1;
+    }
+
+    old_accel = xbzrle_use_accel(true);
+    vec_len = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, vec_out,
+                                   PAGE_SIZE);
+    xbzrle_use_accel(false);
+    long_len = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, long_out,
+                                    PAGE_SIZE);
+    xbzrle_use_accel(old_accel);
+
+    g_assert_cmpint(vec_len, ==, long_len);
+    g_assert(vec_len <= 0 || memcmp(vec_out, long_out, vec_len) == 0);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(vec_out);
+    g_free(long_out);
+}
+
+static void test_encode_run_end(void)
+{
+    static const int lens[] = { 1, 3, 15, 16, 17, 31, 32, 33, 63, 64, 65 };
+    int start, j;
+
+    for (start = 0; start < 70; start++) {
+        for (j = 0; j < ARRAY_SIZE(lens); j++) {
+            encode_compare_range(start, lens[j]);
+            encode_compare_range(PAGE_SIZE - 70 + start, lens[j]);
+        }
+    }
+    for (start = PAGE_SIZE - 1; start > PAGE_SIZE - 40; start--) {
+        encode_compare_range(start, PAGE_SIZE - start);
+    }
+}
+
+/* Run with -m perf; reports the encoding throughput for pages with a few
+ * changed runs */
+static void test_encode_perf(void)
+{
+    uint8_t *old_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, iterations = 200000;
+    gdouble secs;
+
+    for (i = 0; i < PAGE_SIZE; i += 512) {
+        new_buf[i] = i / 512 + 1;
+        new_buf[i + 100] = i / 512 + 2;
+        new_buf[i + 101] = i / 512 + 3;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        g_assert(xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, compressed,
+                                      PAGE_SIZE) > 0);
+    }
+    secs = g_test_timer_elapsed();
+    g_test_minimized_result(secs, "encode: %.1f MB/s",
+                            (gdouble)iterations * PAGE_SIZE / secs / 1e6);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +273,10 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_run_end", test_encode_run_end);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/encode_perf", test_encode_perf);
+    }
 
     return g_test_run();
 }
@@ -26,7 +26,17 @@
 
 static void do_spawn_thread(ThreadPool *pool);
 
+/* Requests are spread round-robin over THREAD_POOL_LANES queues, each with
+ * its own lock.  A worker takes the oldest request of its own lane, and when
+ * that is empty steals the newest one of another lane, so that submitters
+ * and workers seldom wait for the same lock.  The semaphore counts the
+ * queued requests of all lanes, and pool->lock only protects the thread
+ * bookkeeping.
+ */
+#define THREAD_POOL_LANES 8
+
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolLane ThreadPoolLane;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -38,23 +48,29 @@ enum ThreadState {
 struct ThreadPoolElement {
     BlockDriverAIOCB common;
     ThreadPool *pool;
+    ThreadPoolLane *lane;
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
+    /* Moving state out of THREAD_QUEUED is protected by lane->lock.  After
      * that, only the worker thread can write to it.  Reads and writes
      * of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by lane->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+struct ThreadPoolLane {
+    QemuMutex lock;
+    QTAILQ_HEAD(ThreadPoolElementHead, ThreadPoolElement) reqs;
+};
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
@@ -65,46 +81,99 @@ struct ThreadPool {
     int max_threads;
     QEMUBH *new_thread_bh;
 
+    ThreadPoolLane lanes[THREAD_POOL_LANES];
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    int submit_lane;
 
-    /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    /* The following variables are protected by lock.  Workers read
+     * idle_threads, pending_cancellations and stopping with atomic accesses,
+     * and update idle_threads without taking the lock.
+     */
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     int pending_cancellations; /* whether we need a cond_broadcast */
+    int worker_lane;     /* lane of the next worker */
     bool stopping;
 };
 
+static bool thread_pool_has_requests(ThreadPool *pool)
+{
+    int i;
+
+    for (i = 0; i < THREAD_POOL_LANES; i++) {
+        if (atomic_read(&QTAILQ_FIRST(&pool->lanes[i].reqs))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Called after taking a token from the semaphore, so there is a queued
+ * request that no other worker will take.
+ */
+static ThreadPoolElement *thread_pool_take(ThreadPool *pool, int lane_index)
+{
+    ThreadPoolElement *req;
+    ThreadPoolLane *lane;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < THREAD_POOL_LANES; i++) {
+            lane = &pool->lanes[(lane_index + i) % THREAD_POOL_LANES];
+            if (!atomic_read(&QTAILQ_FIRST(&lane->reqs))) {
+                continue;
+            }
+            qemu_mutex_lock(&lane->lock);
+            if (i == 0) {
+                req = QTAILQ_FIRST(&lane->reqs);
+            } else {
+                req = QTAILQ_LAST(&lane->reqs, ThreadPoolElementHead);
+            }
+            if (req) {
+                QTAILQ_REMOVE(&lane->reqs, req, reqs);
+                req->state = THREAD_ACTIVE;
+                qemu_mutex_unlock(&lane->lock);
+                return req;
+            }
+            qemu_mutex_unlock(&lane->lock);
+        }
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    int lane;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    lane = pool->worker_lane;
+    pool->worker_lane = (lane + 1) % THREAD_POOL_LANES;
+    qemu_mutex_unlock(&pool->lock);
 
-    while (!pool->stopping) {
+    while (!atomic_read(&pool->stopping)) {
         ThreadPoolElement *req;
         int ret;
 
+        /* The atomic_dec orders it before thread_pool_has_requests; paired
+         * with smp_mb in thread_pool_start, so that a submitter either sees
+         * this thread idle or the thread sees its request.
+         */
         do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
+            atomic_inc(&pool->idle_threads);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
-            qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
+            atomic_dec(&pool->idle_threads);
+        } while (ret == -1 && thread_pool_has_requests(pool));
+        if (ret == -1 || atomic_read(&pool->stopping)) {
             break;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
+        req = thread_pool_take(pool, lane);
 
         ret = req->func(req->arg);
 
@@ -113,14 +182,20 @@ static void *worker_thread(void *opaque)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
-        if (pool->pending_cancellations) {
+        /* Write state before reading pending_cancellations; paired with the
+         * atomic_inc in thread_pool_cancel.
+         */
+        smp_mb();
+        if (atomic_read(&pool->pending_cancellations)) {
+            qemu_mutex_lock(&pool->lock);
             qemu_cond_broadcast(&pool->check_cancel);
+            qemu_mutex_unlock(&pool->lock);
         }
 
         qemu_bh_schedule(pool->completion_bh);
     }
 
+    qemu_mutex_lock(&pool->lock);
     pool->cur_threads--;
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
@@ -209,25 +284,28 @@ static void thread_pool_cancel(BlockDriverAIOCB *acb)
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&pool->lock);
+    qemu_mutex_lock(&elem->lane->lock);
     if (elem->state == THREAD_QUEUED &&
         /* No thread has yet started working on elem. we can try to "steal"
          * the item from the worker if we can get a signal from the
          * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
+         * the lane lock taken and ensure that elem will remain THREAD_QUEUED.
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        QTAILQ_REMOVE(&elem->lane->reqs, elem, reqs);
         elem->state = THREAD_CANCELED;
+        qemu_mutex_unlock(&elem->lane->lock);
         qemu_bh_schedule(pool->completion_bh);
     } else {
-        pool->pending_cancellations++;
+        qemu_mutex_unlock(&elem->lane->lock);
+        qemu_mutex_lock(&pool->lock);
+        atomic_inc(&pool->pending_cancellations);
         while (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
             qemu_cond_wait(&pool->check_cancel, &pool->lock);
         }
-        pool->pending_cancellations--;
+        atomic_dec(&pool->pending_cancellations);
+        qemu_mutex_unlock(&pool->lock);
     }
-    qemu_mutex_unlock(&pool->lock);
     thread_pool_completion_bh(pool);
 }
 
@@ -236,30 +314,80 @@ static const AIOCBInfo thread_pool_aiocb_info = {
     .cancel             = thread_pool_cancel,
 };
 
-BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
-        ThreadPoolFunc *func, void *arg,
-        BlockDriverCompletionFunc *cb, void *opaque)
+/* Makes sure that enough threads are there for the num_reqs requests just
+ * queued, then lets the workers take them.
+ */
+static void thread_pool_start(ThreadPool *pool, int num_reqs)
 {
-    ThreadPoolElement *req;
+    int spawn, i;
 
-    req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
-    req->func = func;
-    req->arg = arg;
-    req->state = THREAD_QUEUED;
-    req->pool = pool;
-
-    QLIST_INSERT_HEAD(&pool->head, req, all);
+    /* Read idle_threads after queuing the requests; paired with the
+     * atomic_dec in worker_thread.
+     */
+    smp_mb();
+    spawn = num_reqs - atomic_read(&pool->idle_threads);
+    if (spawn > 0 && atomic_read(&pool->cur_threads) < pool->max_threads) {
+        qemu_mutex_lock(&pool->lock);
+        while (spawn-- > 0 && pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
+    }
+    for (i = 0; i < num_reqs; i++) {
+        qemu_sem_post(&pool->sem);
+    }
+}
 
-    trace_thread_pool_submit(pool, req, arg);
+void thread_pool_submit_batch(ThreadPool *pool, ThreadPoolRequest *reqs,
+                              int num_reqs)
+{
+    ThreadPoolElement *req;
+    ThreadPoolLane *lane;
+    int i, j;
+
+    for (i = 0; i < num_reqs; i++) {
+        req = qemu_aio_get(&thread_pool_aiocb_info, NULL, reqs[i].cb,
+                           reqs[i].opaque);
+        req->func = reqs[i].func;
+        req->arg = reqs[i].arg;
+        req->state = THREAD_QUEUED;
+        req->pool = pool;
+        req->lane = &pool->lanes[(pool->submit_lane + i) % THREAD_POOL_LANES];
+        reqs[i].acb = &req->common;
+
+        QLIST_INSERT_HEAD(&pool->head, req, all);
+
+        trace_thread_pool_submit(pool, req, reqs[i].arg);
+    }
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    /* Take each lane's lock once for the whole batch */
+    for (i = 0; i < THREAD_POOL_LANES && i < num_reqs; i++) {
+        lane = ((ThreadPoolElement *)reqs[i].acb)->lane;
+        qemu_mutex_lock(&lane->lock);
+        for (j = i; j < num_reqs; j += THREAD_POOL_LANES) {
+            req = (ThreadPoolElement *)reqs[j].acb;
+            QTAILQ_INSERT_TAIL(&lane->reqs, req, reqs);
+        }
+        qemu_mutex_unlock(&lane->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
-    return &req->common;
+    pool->submit_lane = (pool->submit_lane + num_reqs) % THREAD_POOL_LANES;
+
+    thread_pool_start(pool, num_reqs);
+}
+
+BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+        ThreadPoolFunc *func, void *arg,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    ThreadPoolRequest req = {
+        .func = func,
+        .arg = arg,
+        .cb = cb,
+        .opaque = opaque,
+    };
+
+    thread_pool_submit_batch(pool, &req, 1);
+    return req.acb;
 }
 
 typedef struct ThreadPoolCo {
@@ -292,6 +420,8 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
 
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
+    int i;
+
     if (!ctx) {
         ctx = qemu_get_aio_context();
     }
@@ -306,8 +436,11 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
+    for (i = 0; i < THREAD_POOL_LANES; i++) {
+        qemu_mutex_init(&pool->lanes[i].lock);
+        QTAILQ_INIT(&pool->lanes[i].reqs);
+    }
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -319,6 +452,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
@@ -333,7 +468,7 @@ void thread_pool_free(ThreadPool *pool)
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */
-    pool->stopping = true;
+    atomic_set(&pool->stopping, true);
     while (pool->cur_threads > 0) {
         qemu_sem_post(&pool->sem);
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
@@ -345,6 +480,9 @@ void thread_pool_free(ThreadPool *pool)
     qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->check_cancel);
     qemu_cond_destroy(&pool->worker_stopped);
+    for (i = 0; i < THREAD_POOL_LANES; i++) {
+        qemu_mutex_destroy(&pool->lanes[i].lock);
+    }
     qemu_mutex_destroy(&pool->lock);
     g_free(pool);
 }
@@ -17,6 +17,7 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 #include "trace/control.h"
 #include "trace/simple.h"
@@ -28,17 +29,27 @@
 #define HEADER_MAGIC 0xf2b177cb0aa429b4ULL
 
 /** Trace file version number, bump if format changes */
-#define HEADER_VERSION 3
+#define HEADER_VERSION 4
 
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
- * Trace records are written out by a dedicated thread.  The thread waits for
- * records to become available, writes them out, and then waits again.
+ * Every thread writes its trace records into a ring buffer of its own, with
+ * no locking or atomic read-modify-write: only the thread itself moves the
+ * head of its ring, and only the writeout thread moves the tail.  The
+ * writeout thread merges the rings by timestamp, so the trace file is in
+ * time order.
+ *
+ * To merge, the writeout thread needs to know that no record which is not
+ * visible yet can be older than the ones it writes.  A thread publishes the
+ * timestamp of the record it is writing in pending_ts, and TRACE_TS_BUSY
+ * while it reads the clock.  The writeout thread reads the clock, then the
+ * pending_ts of every ring, and only writes out the records older than all
+ * of them; the others are left for the next round.
+ *
+ * Tracing must not be used from signal handlers, which could interrupt a
+ * record being written by the same thread.  The rings are never freed.
  */
 static CompatGMutex trace_lock;
 static CompatGCond trace_available_cond;
@@ -52,10 +63,21 @@ enum {
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+#define TRACE_TS_BUSY UINT64_MAX
+
+typedef struct TraceBuf {
+    uint8_t data[TRACE_BUF_LEN];
+    unsigned int head;      /* bytes written, moved by the owner thread */
+    unsigned int tail;      /* bytes written out, moved by writeout_thread */
+    uint64_t pending_ts;    /* record being written, see above, or 0 */
+    int dropped;            /* records lost because the ring was full */
+    uint32_t tid;           /* thread number, in order of the first event */
+    struct TraceBuf *next;
+} TraceBuf;
+
+static TraceBuf *trace_bufs;
+static uint32_t trace_buf_count;
+static __thread TraceBuf *trace_thread_buf;
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
@@ -66,6 +88,8 @@ typedef struct {
     uint64_t timestamp_ns;
     uint32_t length;   /*    in bytes */
     uint32_t pid;
+    uint32_t tid;
+    uint32_t reserved;
     uint64_t arguments[];
 } TraceRecord;
 
@@ -76,52 +100,44 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceBuf *b, unsigned int idx, void *dataptr,
+                             size_t size);
+static unsigned int write_to_buffer(TraceBuf *b, unsigned int idx,
+                                    void *dataptr, size_t size);
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+/* Allocate the ring of the calling thread, on its first event */
+static TraceBuf *trace_buf_new(void)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
+    TraceBuf *b = calloc(1, sizeof(*b)); /* dont use g_malloc, can deadlock when traced */
+
+    if (!b) {
+        return NULL;
     }
+    b->tid = atomic_fetch_add(&trace_buf_count, 1);
+    do {
+        b->next = atomic_read(&trace_bufs);
+    } while (atomic_cmpxchg(&trace_bufs, b->next, b) != b->next);
+    trace_thread_buf = b;
+    return b;
 }
+
 /**
- * Read a trace record from the trace buffer
+ * Read the header of the oldest record of a ring, if it is complete
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * @b           Trace ring
+ * @record      Trace record header to fill
  *
- * Returns false if the record is not valid.
+ * Returns false if the ring is empty.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static bool peek_trace_record(TraceBuf *b, TraceRecord *record)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    unsigned int tail = b->tail;
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
+    if (atomic_read(&b->head) == tail) {
         return false;
     }
-
     smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
+    read_from_buffer(b, tail % TRACE_BUF_LEN, record, sizeof(TraceRecord));
     return true;
 }
 
@@ -154,40 +170,85 @@ static void wait_for_trace_records_available(void)
     g_mutex_unlock(&trace_lock);
 }
 
+/* The time before which every record is visible in the rings */
+static uint64_t trace_watermark(void)
+{
+    uint64_t watermark = get_clock();
+    uint64_t ts;
+    TraceBuf *b;
+
+    smp_mb();
+    for (b = atomic_read(&trace_bufs); b; b = b->next) {
+        while ((ts = atomic_read(&b->pending_ts)) == TRACE_TS_BUSY) {
+            /* The thread is reading the clock */
+        }
+        if (ts && ts < watermark) {
+            watermark = ts;
+        }
+    }
+    smp_mb();
+    return watermark;
+}
+
 static gpointer writeout_thread(gpointer opaque)
 {
-    TraceRecord *recordptr;
+    TraceRecord *recordptr, record, oldest_record;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
+    TraceBuf *b, *oldest;
+    uint64_t watermark, last_ts = 0;
     int dropped_count;
     size_t unused __attribute__ ((unused));
 
     for (;;) {
         wait_for_trace_records_available();
 
-        if (g_atomic_int_get(&dropped_events)) {
+        watermark = trace_watermark();
+        for (;;) {
+            /* Merge: take the oldest record of all the rings */
+            oldest = NULL;
+            for (b = atomic_read(&trace_bufs); b; b = b->next) {
+                if (peek_trace_record(b, &record) &&
+                    record.timestamp_ns < watermark &&
+                    (!oldest ||
+                     record.timestamp_ns < oldest_record.timestamp_ns)) {
+                    oldest = b;
+                    oldest_record = record;
+                }
+            }
+            if (!oldest) {
+                break;
+            }
+
+            recordptr = malloc(oldest_record.length); /* dont use g_malloc, can deadlock when traced */
+            read_from_buffer(oldest, oldest->tail % TRACE_BUF_LEN, recordptr,
+                             oldest_record.length);
+            smp_mb(); /* the record is copied before the space is reused */
+            atomic_set(&oldest->tail, oldest->tail + oldest_record.length);
+            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
+            last_ts = recordptr->timestamp_ns;
+            free(recordptr); /* dont use g_free, can deadlock when traced */
+        }
+
+        dropped_count = 0;
+        for (b = atomic_read(&trace_bufs); b; b = b->next) {
+            dropped_count += atomic_xchg(&b->dropped, 0);
+        }
+        if (dropped_count) {
+            /* Stamped with the last record written, to keep the file in
+             * time order */
             dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
+            dropped.rec.timestamp_ns = last_ts;
             dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
             dropped.rec.pid = trace_pid;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
+            dropped.rec.tid = 0;
+            dropped.rec.reserved = 0;
             dropped.rec.arguments[0] = dropped_count;
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
-        }
-
         fflush(trace_fp);
     }
     return NULL;
@@ -195,50 +256,62 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(trace_thread_buf, rec->rec_off, &val,
+                                   sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(trace_thread_buf, rec->rec_off, &slen,
+                                   sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(trace_thread_buf, rec->rec_off, (void*)s,
+                                   slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceBuf *b = trace_thread_buf;
+    TraceRecord record;
+    unsigned int head;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
 
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
+    if (!b) {
+        b = trace_buf_new();
+        if (!b) {
+            return -ENOMEM;
         }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
+    }
 
-    idx = old_idx % TRACE_BUF_LEN;
+    /* See trace_watermark() */
+    atomic_set(&b->pending_ts, TRACE_TS_BUSY);
+    smp_mb();
+    record.timestamp_ns = get_clock();
+    atomic_set(&b->pending_ts, record.timestamp_ns);
+
+    head = b->head;
+    if (head - atomic_read(&b->tail) + rec_len > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        atomic_set(&b->pending_ts, 0);
+        atomic_inc(&b->dropped);
+        return -ENOSPC;
+    }
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    record.event = event;
+    record.length = rec_len;
+    record.pid = trace_pid;
+    record.tid = b->tid;
+    record.reserved = 0;
+    write_to_buffer(b, head % TRACE_BUF_LEN, &record, sizeof(TraceRecord));
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->tbuf_idx = head;
+    rec->rec_off  = (head + sizeof(TraceRecord)) % TRACE_BUF_LEN;
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+static void read_from_buffer(TraceBuf *b, unsigned int idx, void *dataptr,
+                             size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
@@ -246,11 +319,12 @@ static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        data_ptr[x++] = trace_buf[idx++];
+        data_ptr[x++] = b->data[idx++];
     }
 }
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
+static unsigned int write_to_buffer(TraceBuf *b, unsigned int idx,
+                                    void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
@@ -258,21 +332,24 @@ static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        trace_buf[idx++] = data_ptr[x++];
+        b->data[idx++] = data_ptr[x++];
     }
     return idx; /* most callers wants to know where to write next */
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
+    TraceBuf *b = trace_thread_buf;
     TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    read_from_buffer(b, rec->tbuf_idx % TRACE_BUF_LEN, &record,
+                     sizeof(TraceRecord));
+    smp_wmb(); /* write barrier before publishing the record */
+    atomic_set(&b->head, rec->tbuf_idx + record.length);
+    smp_wmb();
+    atomic_set(&b->pending_ts, 0);
+
+    if (b->head - atomic_read(&b->tail) > TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
 }
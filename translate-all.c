@@ -37,6 +37,7 @@
 #include "tcg.h"
 #if defined(CONFIG_USER_ONLY)
 #include "qemu.h"
+#include "qemu/interval-tree.h"
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
 #include <sys/param.h>
 #if __FreeBSD_version >= 700104
@@ -54,6 +55,8 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "sysemu/sysemu.h"
+#include "qmp-commands.h"
 #endif
 
 #include "exec/cputlb.h"
@@ -70,7 +73,15 @@
 #undef DEBUG_TB_CHECK
 #endif
 
+/* Writes to a code page walk its TB list until the page has a code bitmap.
+   With 1 KB pages (M profile) code and data share pages all the time, and
+   a firmware running from SRAM keeps writing next to its RAM functions, so
+   build the bitmap on the first write there.  */
+#if TARGET_PAGE_BITS <= 10
+#define SMC_BITMAP_USE_THRESHOLD 1
+#else
 #define SMC_BITMAP_USE_THRESHOLD 10
+#endif
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -129,11 +140,128 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
+/* CPU whose code is being translated by cpu_gen_code(), NULL otherwise */
+static CPUState *tb_prefetch_cpu;
+
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
 }
 
+/* With -tb-coverage, every block stores 1 to the flag of the record for
+   its [pc, pc + size) range when it starts.  There is one record per
+   distinct range, which outlives the translations of that range.  */
+typedef struct TBCoverage {
+    target_ulong pc;
+    uint32_t size;
+    uint8_t hit;
+} TBCoverage;
+
+static GHashTable *tb_coverage;
+
+uint8_t *tb_coverage_map;
+uint32_t tb_coverage_prev;
+
+static guint tb_coverage_hash(gconstpointer p)
+{
+    const TBCoverage *c = p;
+
+    return (guint)c->pc ^ ((guint)c->size << 20);
+}
+
+static gboolean tb_coverage_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCoverage *ca = a, *cb = b;
+
+    return ca->pc == cb->pc && ca->size == cb->size;
+}
+
+static gint tb_coverage_cmp(gconstpointer a, gconstpointer b)
+{
+    const TBCoverage *ca = *(TBCoverage * const *)a;
+    const TBCoverage *cb = *(TBCoverage * const *)b;
+
+    return ca->pc < cb->pc ? -1 : ca->pc > cb->pc;
+}
+
+static void tb_coverage_collect(gpointer key, gpointer value, gpointer opaque)
+{
+    TBCoverage *c = value;
+
+    if (c->hit && c->size) {
+        g_ptr_array_add(opaque, c);
+    }
+}
+
+/* Write the executed ranges, sorted and with overlapping or adjacent
+   ones merged.  */
+static void tb_coverage_dump(void)
+{
+    GPtrArray *hits = g_ptr_array_new();
+    target_ulong start = 0, end = 0;
+    TBCoverage *c;
+    FILE *f;
+    guint i;
+
+    f = fopen(tb_coverage_file, "w");
+    if (!f) {
+        fprintf(stderr, "qemu: cannot create %s: %s\n", tb_coverage_file,
+                strerror(errno));
+        return;
+    }
+
+    g_hash_table_foreach(tb_coverage, tb_coverage_collect, hits);
+    g_ptr_array_sort(hits, tb_coverage_cmp);
+    for (i = 0; i < hits->len; i++) {
+        c = g_ptr_array_index(hits, i);
+        if (i && c->pc <= end) {
+            end = MAX(end, c->pc + c->size);
+            continue;
+        }
+        if (i) {
+            fprintf(f, TARGET_FMT_lx " " TARGET_FMT_lx "\n", start, end);
+        }
+        start = c->pc;
+        end = c->pc + c->size;
+    }
+    if (hits->len) {
+        fprintf(f, TARGET_FMT_lx " " TARGET_FMT_lx "\n", start, end);
+    }
+    fclose(f);
+    g_ptr_array_free(hits, TRUE);
+}
+
+/* Point the store emitted by gen_tb_start() at the block's flag, or give
+   the code it emitted the block's location in tb_coverage_map.  This must
+   also be done when the code is generated again to restore the CPU state,
+   so that the same host code comes out.  */
+static void tb_coverage_patch(TranslationBlock *tb)
+{
+    TBCoverage key = { .pc = tb->pc, .size = tb->size };
+    TBCoverage *c;
+
+    if (!tcg_ctx.tb_coverage_arg) {
+        return;
+    }
+    if (tb_coverage_map) {
+        /* The hash used by afl-qemu, which spreads Thumb's 2 byte aligned
+           addresses over the map.  */
+        *tcg_ctx.tb_coverage_arg = ((tb->pc >> 4) ^ (tb->pc << 8)) &
+                                   (TB_COVERAGE_MAP_SIZE - 1);
+        return;
+    }
+    if (!tb_coverage) {
+        tb_coverage = g_hash_table_new(tb_coverage_hash, tb_coverage_equal);
+        atexit(tb_coverage_dump);
+    }
+    c = g_hash_table_lookup(tb_coverage, &key);
+    if (!c) {
+        c = g_memdup(&key, sizeof(key));
+        g_hash_table_insert(tb_coverage, c, c);
+    }
+    *tcg_ctx.tb_coverage_arg = (uintptr_t)&c->hit;
+}
+
 /* return non zero if the very first instruction is invalid so that
    the virtual CPU can trigger an exception.
 
@@ -155,8 +283,13 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    s->opt_tier2 = (tb->cflags & CF_TIER2) != 0;
+    tb_prefetch_cpu = ENV_GET_CPU(env);
+    s->tb_coverage_arg = NULL;
 
     gen_intermediate_code(env, tb);
+    tb_prefetch_cpu = NULL;
+    tb_coverage_patch(tb);
 
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
@@ -212,14 +345,19 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    s->opt_tier2 = (tb->cflags & CF_TIER2) != 0;
+    tb_prefetch_cpu = NULL;
+    s->tb_coverage_arg = NULL;
 
     gen_intermediate_code_pc(env, tb);
+    tb_coverage_patch(tb);
 
     if (use_icount) {
         /* Reset the cycle counter to the start of the block.  */
         cpu->icount_decr.u16.low += tb->icount;
         /* Clear the IO flag.  */
         cpu->can_do_io = 0;
+        cpu->icount_tb_unexecuted = 0;
     }
 
     /* find opc index corresponding to search_pc */
@@ -670,14 +808,107 @@ static inline void code_gen_alloc(size_t tb_size)
             tcg_ctx.code_gen_buffer_size - 1024;
     tcg_ctx.code_gen_buffer_size -= 1024;
 
-    tcg_ctx.code_gen_buffer_max_size = tcg_ctx.code_gen_buffer_size -
-        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
-    tcg_ctx.code_gen_max_blocks = tcg_ctx.code_gen_buffer_size /
+    /* Split the buffer into regions, each with room for at least eight
+       blocks of the maximum size.  When a region is full, the next one is
+       emptied and reused.  The blocks evicted are the ones translated the
+       longest time ago, a fraction of what a full tb_flush() drops.  */
+    tcg_ctx.tb_ctx.nb_regions = tcg_ctx.code_gen_buffer_size /
+        (8 * TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    if (tcg_ctx.tb_ctx.nb_regions < 1) {
+        tcg_ctx.tb_ctx.nb_regions = 1;
+    } else if (tcg_ctx.tb_ctx.nb_regions > CODE_GEN_MAX_REGIONS) {
+        tcg_ctx.tb_ctx.nb_regions = CODE_GEN_MAX_REGIONS;
+    }
+    tcg_ctx.code_gen_region_size = (tcg_ctx.code_gen_buffer_size /
+        tcg_ctx.tb_ctx.nb_regions) & ~(CODE_GEN_ALIGN - 1);
+    tcg_ctx.code_gen_buffer_max_size = tcg_ctx.code_gen_region_size -
+        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE) - sizeof(tcg_ctx.gen_insn_off);
+    tcg_ctx.tb_ctx.region_max_blocks = tcg_ctx.code_gen_region_size /
             CODE_GEN_AVG_BLOCK_SIZE;
+    tcg_ctx.code_gen_max_blocks = tcg_ctx.tb_ctx.region_max_blocks *
+            tcg_ctx.tb_ctx.nb_regions;
     tcg_ctx.tb_ctx.tbs =
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
 }
 
+static inline void *tb_region_start(int region)
+{
+    return tcg_ctx.code_gen_buffer + region * tcg_ctx.code_gen_region_size;
+}
+
+/* A slot of tb_phys_hash.  The hash is kept next to the pointer so that
+   probing only reads the TBs whose key is likely to match.  */
+typedef struct TBHashSlot {
+    TranslationBlock *tb;
+    uint32_t hash;
+} TBHashSlot;
+
+/* marks the slot of a removed TB, which lookups must probe past */
+#define TB_HASH_DELETED ((TranslationBlock *)1)
+
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc,
+                                    target_ulong cs_base, uint64_t flags)
+{
+    uint64_t h = (uint64_t)phys_pc * 0x9e3779b97f4a7c15ull;
+
+    h ^= ((uint64_t)cs_base << 17) ^ flags;
+    h *= 0xff51afd7ed558ccdull;
+    return h >> 32;
+}
+
+/* Move the live TBs to a new table of SIZE slots */
+static void tb_hash_resize(size_t size)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBHashSlot *old = ctx->tb_phys_hash;
+    size_t old_size = ctx->tb_phys_hash_size;
+    size_t i, j;
+
+    ctx->tb_phys_hash = g_new0(TBHashSlot, size);
+    ctx->tb_phys_hash_size = size;
+    ctx->tb_phys_hash_deleted = 0;
+    for (i = 0; i < old_size; i++) {
+        if (!old[i].tb || old[i].tb == TB_HASH_DELETED) {
+            continue;
+        }
+        j = old[i].hash & (size - 1);
+        while (ctx->tb_phys_hash[j].tb) {
+            j = (j + 1) & (size - 1);
+        }
+        ctx->tb_phys_hash[j] = old[i];
+    }
+    g_free(old);
+}
+
+static void tb_hash_insert(TranslationBlock *tb, tb_page_addr_t phys_pc)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    uint32_t h = tb_hash_func(phys_pc, tb->cs_base, tb->flags);
+    size_t mask, i, size;
+
+    if ((ctx->tb_phys_hash_used + ctx->tb_phys_hash_deleted + 1) * 2 >
+        ctx->tb_phys_hash_size) {
+        /* Rehash to at most a quarter full, which also drops the removed
+           TBs and shrinks the table after an eviction or a flush */
+        size = CODE_GEN_PHYS_HASH_MIN_SIZE;
+        while (size < (ctx->tb_phys_hash_used + 1) * 4) {
+            size *= 2;
+        }
+        tb_hash_resize(size);
+    }
+    mask = ctx->tb_phys_hash_size - 1;
+    for (i = h & mask; ctx->tb_phys_hash[i].tb &&
+                       ctx->tb_phys_hash[i].tb != TB_HASH_DELETED;
+         i = (i + 1) & mask) {
+    }
+    if (ctx->tb_phys_hash[i].tb == TB_HASH_DELETED) {
+        ctx->tb_phys_hash_deleted--;
+    }
+    ctx->tb_phys_hash[i].tb = tb;
+    ctx->tb_phys_hash[i].hash = h;
+    ctx->tb_phys_hash_used++;
+}
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -685,6 +916,7 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
+    tb_hash_resize(CODE_GEN_PHYS_HASH_MIN_SIZE);
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
@@ -700,20 +932,25 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region.  Returns NULL
+   if it has too many translation blocks or too much generated code, and
+   tb_evict_region() must be called. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
     TranslationBlock *tb;
+    int r = ctx->region;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
+    if (ctx->region_nb_tbs[r] >= ctx->region_max_blocks ||
+        (tcg_ctx.code_gen_ptr - tb_region_start(r)) >=
          tcg_ctx.code_gen_buffer_max_size) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &ctx->tbs[r * ctx->region_max_blocks + ctx->region_nb_tbs[r]++];
+    ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
     return tb;
 }
 
@@ -722,13 +959,48 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int r = ctx->region;
+
+    if (ctx->region_nb_tbs[r] > 0 &&
+            tb == &ctx->tbs[r * ctx->region_max_blocks +
+                            ctx->region_nb_tbs[r] - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+        ctx->region_nb_tbs[r]--;
+        ctx->nb_tbs--;
     }
 }
 
+/* Empty the next region and continue there */
+static void tb_evict_region(CPUArchState *env)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TranslationBlock *tb;
+    int r, i;
+
+    if (ctx->nb_regions == 1) {
+        ctx->tb_flush_full_count++;
+        tb_flush(env);
+        return;
+    }
+    ctx->region_code_size[ctx->region] =
+        tcg_ctx.code_gen_ptr - tb_region_start(ctx->region);
+    r = (ctx->region + 1) % ctx->nb_regions;
+    for (i = 0; i < ctx->region_nb_tbs[r]; i++) {
+        tb = &ctx->tbs[r * ctx->region_max_blocks + i];
+        if (!(tb->cflags & CF_INVALID)) {
+            /* also unlinks the blocks of other regions jumping to it */
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    ctx->nb_tbs -= ctx->region_nb_tbs[r];
+    ctx->region_nb_tbs[r] = 0;
+    ctx->region_code_size[r] = 0;
+    ctx->region = r;
+    tcg_ctx.code_gen_ptr = tb_region_start(r);
+    ctx->tb_evict_count++;
+}
+
 static inline void invalidate_page_bitmap(PageDesc *p)
 {
     if (p->code_bitmap) {
@@ -789,12 +1061,20 @@ void tb_flush(CPUArchState *env1)
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
     tcg_ctx.tb_ctx.nb_tbs = 0;
+    tcg_ctx.tb_ctx.region = 0;
+    memset(tcg_ctx.tb_ctx.region_nb_tbs, 0,
+           sizeof(tcg_ctx.tb_ctx.region_nb_tbs));
+    memset(tcg_ctx.tb_ctx.region_code_size, 0,
+           sizeof(tcg_ctx.tb_ctx.region_code_size));
 
     CPU_FOREACH(cpu) {
-        memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+        cpu_tb_jmp_cache_clear(cpu);
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0,
+           tcg_ctx.tb_ctx.tb_phys_hash_size * sizeof(TBHashSlot));
+    tcg_ctx.tb_ctx.tb_phys_hash_used = 0;
+    tcg_ctx.tb_ctx.tb_phys_hash_deleted = 0;
     page_flush_tb();
 
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
@@ -811,14 +1091,14 @@ static void tb_invalidate_check(target_ulong address)
     int i;
 
     address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
+    for (i = 0; i < tcg_ctx.tb_ctx.tb_phys_hash_size; i++) {
+        tb = tcg_ctx.tb_ctx.tb_phys_hash[i].tb;
+        if (tb && tb != TB_HASH_DELETED &&
+            !(address + TARGET_PAGE_SIZE <= tb->pc ||
+              address >= tb->pc + tb->size)) {
+            printf("ERROR invalidate: address=" TARGET_FMT_lx
+                   " PC=%08lx size=%04x\n",
+                   address, (long)tb->pc, tb->size);
         }
     }
 }
@@ -829,33 +1109,80 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
+    for (i = 0; i < tcg_ctx.tb_ctx.tb_phys_hash_size; i++) {
+        tb = tcg_ctx.tb_ctx.tb_phys_hash[i].tb;
+        if (!tb || tb == TB_HASH_DELETED) {
+            continue;
+        }
+        flags1 = page_get_flags(tb->pc);
+        flags2 = page_get_flags(tb->pc + tb->size - 1);
+        if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+            printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+                   (long)tb->pc, tb->size, flags1, flags2);
         }
     }
 }
 
 #endif
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static void tb_hash_remove(TranslationBlock *tb, tb_page_addr_t phys_pc)
 {
-    TranslationBlock *tb1;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t mask = ctx->tb_phys_hash_size - 1;
+    size_t i = tb_hash_func(phys_pc, tb->cs_base, tb->flags) & mask;
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
+    while (ctx->tb_phys_hash[i].tb != tb) {
+        i = (i + 1) & mask;
+    }
+    ctx->tb_phys_hash[i].tb = TB_HASH_DELETED;
+    ctx->tb_phys_hash_used--;
+    ctx->tb_phys_hash_deleted++;
+}
+
+/* Find the TB for the CPU state (pc, cs_base, flags), NULL if there is
+   none yet. */
+TranslationBlock *tb_find_physical(CPUArchState *env, target_ulong pc,
+                                   target_ulong cs_base, uint64_t flags)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t mask = ctx->tb_phys_hash_size - 1;
+    tb_page_addr_t phys_pc, phys_page1, phys_page2 = -1;
+    TranslationBlock *tb;
+    uint32_t h;
+    size_t i;
+    unsigned int probes = 1;
+
+    phys_pc = get_page_addr_code(env, pc);
+    phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, cs_base, flags);
+    for (i = h & mask; (tb = ctx->tb_phys_hash[i].tb) != NULL;
+         i = (i + 1) & mask, probes++) {
+        if (tb == TB_HASH_DELETED || ctx->tb_phys_hash[i].hash != h) {
+            continue;
+        }
+        if (tb->pc == pc &&
+            tb->page_addr[0] == phys_page1 &&
+            tb->cs_base == cs_base &&
+            tb->flags == flags) {
+            /* check next page if needed */
+            if (tb->page_addr[1] == -1) {
+                break;
+            }
+            if (phys_page2 == -1) {
+                phys_page2 = get_page_addr_code(env, (pc & TARGET_PAGE_MASK) +
+                                                TARGET_PAGE_SIZE);
+            }
+            if (tb->page_addr[1] == phys_page2) {
+                break;
+            }
         }
-        ptb = &tb1->phys_hash_next;
     }
+    ctx->tb_phys_hash_lookups++;
+    ctx->tb_phys_hash_probes += probes;
+    if (probes > ctx->tb_phys_hash_max_probes) {
+        ctx->tb_phys_hash_max_probes = probes;
+    }
+    return tb;
 }
 
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
@@ -922,8 +1249,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    tb_hash_remove(tb, phys_pc);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -937,13 +1263,11 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         invalidate_page_bitmap(p);
     }
 
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
-
     /* remove the TB from the hash list */
-    h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        h = tb_jmp_cache_hash_func(cpu, tb->pc);
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -965,6 +1289,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         tb1 = tb2;
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
+    tb->cflags |= CF_INVALID;
 
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
@@ -996,9 +1321,30 @@ static inline void set_bits(uint8_t *tab, int start, int len)
     }
 }
 
+/* mark the bytes of the page that the n-th part of tb covers */
+static void page_bitmap_add_tb(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
     p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
@@ -1007,24 +1353,31 @@ static void build_page_bitmap(PageDesc *p)
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-            }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+        page_bitmap_add_tb(p, tb, n);
         tb = tb->page_next[n];
     }
 }
 
+/* Copy the host code offset of each guest instruction recorded by
+   tcg_gen_code() after the code_size bytes of code of tb, and return the
+   size of both.  The front end must emit a debug_insn_start op for every
+   instruction it counts in tb->icount, otherwise no map is kept.  */
+static int tb_insn_off_save(TranslationBlock *tb, int code_size)
+{
+    uintptr_t off;
+
+    if (tcg_ctx.gen_nb_insns != tb->icount || tb->icount == 0) {
+        tb->insn_off = NULL;
+        return code_size;
+    }
+    off = ((uintptr_t)tb->tc_ptr + code_size + sizeof(uint16_t) - 1) &
+          ~(uintptr_t)(sizeof(uint16_t) - 1);
+    tb->insn_off = (uint16_t *)off;
+    memcpy(tb->insn_off, tcg_ctx.gen_insn_off,
+           tb->icount * sizeof(uint16_t));
+    return off - (uintptr_t)tb->tc_ptr + tb->icount * sizeof(uint16_t);
+}
+
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -1038,18 +1391,21 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        tb_evict_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
-        /* Don't forget to invalidate previous TB info.  */
-        tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
     }
     tb->tc_ptr = tcg_ctx.code_gen_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
     cpu_gen_code(env, tb, &code_gen_size);
+    if (use_icount && icount_no_split) {
+        /* keep the instruction offsets right after the code */
+        code_gen_size = tb_insn_off_save(tb, code_gen_size);
+    } else {
+        tb->insn_off = NULL;
+    }
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -1060,9 +1416,104 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+    tcg_ctx.tb_ctx.tb_gen_count++;
+#ifndef CONFIG_USER_ONLY
+    startup_profile_first_tb();
+#endif
     return tb;
 }
 
+/* Speculative translation.  The translator reports the direct branch
+   targets of each new block with tb_prefetch_add(), and while all CPUs are
+   idle (e.g. in WFI) tb_prefetch_run() translates them ahead of time.  The
+   vCPU then finds them in tb_phys_hash when the guest gets there, instead
+   of stalling in the translator on its way into an interrupt handler.
+   The blocks translated this way report their own successors, so idle time
+   gradually covers the code statically reachable from what already ran.
+   Prefetching stops when the current region of the code buffer is half
+   full, so that it does not make the translator evict blocks that ran
+   for the sake of blocks that may never run.  */
+
+#if !defined(CONFIG_USER_ONLY)
+#define TB_PREFETCH_SIZE 32
+
+typedef struct TBPrefetch {
+    CPUState *cpu;
+    target_ulong pc;
+    target_ulong cs_base;
+    int flags;
+} TBPrefetch;
+
+static TBPrefetch tb_prefetch_queue[TB_PREFETCH_SIZE];
+static unsigned int tb_prefetch_head;
+static unsigned int tb_prefetch_count;
+#endif
+
+void tb_prefetch_add(target_ulong pc, target_ulong cs_base, int flags)
+{
+#if !defined(CONFIG_USER_ONLY)
+    TBPrefetch *p;
+
+    if (!tb_prefetch_cpu) {
+        /* retranslation from cpu_restore_state_from_tb() */
+        return;
+    }
+    if (tb_prefetch_count == TB_PREFETCH_SIZE) {
+        /* drop the oldest hint */
+        tb_prefetch_head = (tb_prefetch_head + 1) % TB_PREFETCH_SIZE;
+        tb_prefetch_count--;
+    }
+    p = &tb_prefetch_queue[(tb_prefetch_head + tb_prefetch_count) %
+                           TB_PREFETCH_SIZE];
+    p->cpu = tb_prefetch_cpu;
+    p->pc = pc;
+    p->cs_base = cs_base;
+    p->flags = flags;
+    tb_prefetch_count++;
+#endif
+}
+
+/* Translate the next queued block, if any.  Returns false once there is
+   nothing left to do.  */
+bool tb_prefetch_run(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    TBPrefetch p;
+    CPUArchState *env;
+    target_ulong next_page;
+
+    if (tb_prefetch_count == 0) {
+        return false;
+    }
+    if (tcg_ctx.tb_ctx.region_nb_tbs[tcg_ctx.tb_ctx.region] >=
+         tcg_ctx.tb_ctx.region_max_blocks / 2 ||
+        (tcg_ctx.code_gen_ptr - tb_region_start(tcg_ctx.tb_ctx.region)) >=
+         tcg_ctx.code_gen_buffer_max_size / 2) {
+        tb_prefetch_count = 0;
+        return false;
+    }
+    p = tb_prefetch_queue[tb_prefetch_head];
+    tb_prefetch_head = (tb_prefetch_head + 1) % TB_PREFETCH_SIZE;
+    tb_prefetch_count--;
+
+    /* Nothing may fault here, outside of cpu_exec().  The block can end
+       with an instruction that crosses into the next page.  */
+    env = p.cpu->env_ptr;
+    next_page = (p.pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+    if (!tlb_code_mapped(env, p.pc) || !tlb_code_mapped(env, next_page)) {
+        return true;
+    }
+    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+    if (!tb_find_physical(env, p.pc, p.cs_base, p.flags)) {
+        tb_gen_code(p.cpu, p.pc, p.cs_base, p.flags, 0);
+    }
+    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    return true;
+#else
+    return false;
+#endif
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1320,7 +1771,11 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+    /* a bitmap only grows when TBs are added: keep it rather than make
+       the next writes to the page slow again */
+    if (p->code_bitmap) {
+        page_bitmap_add_tb(p, tb, n);
+    }
 
 #if defined(TARGET_HAS_SMC) || 1
 
@@ -1368,17 +1823,11 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
     /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    tb_hash_insert(tb, phys_pc);
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1410,23 +1859,29 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int m_min, m_max, m, r;
     uintptr_t v;
-    TranslationBlock *tb;
+    TranslationBlock *tb, *tbs;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    r = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) /
+        tcg_ctx.code_gen_region_size;
+    if (r >= ctx->nb_regions || ctx->region_nb_tbs[r] <= 0) {
         return NULL;
     }
-    /* binary search (cf Knuth) */
+    if (r == ctx->region && tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+        return NULL;
+    }
+    /* binary search (cf Knuth) among the blocks of that region */
+    tbs = &ctx->tbs[r * ctx->region_max_blocks];
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = ctx->region_nb_tbs[r] - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1436,7 +1891,10 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    if (m_max < 0) {
+        return NULL;
+    }
+    return &tbs[m_max];
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1548,11 +2006,13 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
         cpu_abort(cpu, "TB too big during recompile");
     }
 
-    cflags = n | CF_LAST_IO;
+    /* A hot block may have followed branches to reach the IO insn */
+    cflags = n | CF_LAST_IO | (tb->cflags & CF_TIER2);
     pc = tb->pc;
     cs_base = tb->cs_base;
     flags = tb->flags;
     tb_phys_invalidate(tb, -1);
+    cpu->jit_stats.io_recompiles++;
     /* FIXME: In theory this could raise an exception.  In practice
        we have already translated the block once so it's probably ok.  */
     tb_gen_code(cpu, pc, cs_base, flags, cflags);
@@ -1564,66 +2024,158 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     cpu_resume_from_signal(cpu, NULL);
 }
 
+/* With icount_no_split, an IO access does not have to be the last
+   instruction of its TB.  The instructions of the TB were all counted when
+   it was entered; take back the ones after the access from the icount
+   clock, using the instruction offsets saved with the TB, and let the
+   access go ahead.  An interrupt it raises is taken at the end of the TB,
+   a few instructions later than on real hardware but at the same point on
+   every run.  Returns false if the TB has no offsets, in which case the
+   caller must fall back to cpu_io_recompile().  */
+bool cpu_io_mid_tb(CPUState *cpu, uintptr_t retaddr)
+{
+    TranslationBlock *tb;
+    uintptr_t off;
+    int lo, hi, mid;
+
+    if (!icount_no_split) {
+        return false;
+    }
+    tb = tb_find_pc(retaddr);
+    if (!tb || !tb->insn_off) {
+        return false;
+    }
+    /* last instruction starting at or before retaddr */
+    off = retaddr - (uintptr_t)tb->tc_ptr;
+    lo = 0;
+    hi = tb->icount - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (tb->insn_off[mid] <= off) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    cpu->icount_tb_unexecuted = tb->icount - (lo + 1);
+    cpu->can_do_io = 1;
+    return true;
+}
+
+void cpu_io_mid_tb_end(CPUState *cpu)
+{
+    cpu->icount_tb_unexecuted = 0;
+    cpu->can_do_io = 0;
+}
+
+/* The owning thread reads the cache without tb_lock, so the entries are
+   cleared one pointer at a time rather than with memset.  */
+static void tb_jmp_cache_clear_range(CPUState *cpu, unsigned int i,
+                                     unsigned int n)
+{
+    while (n--) {
+        atomic_set(&cpu->tb_jmp_cache[i++], NULL);
+    }
+}
+
 void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
 {
-    unsigned int i;
+    unsigned int i, n;
+
+    n = cpu->tb_jmp_cache_direct ? TARGET_PAGE_SIZE >> 1 : TB_JMP_PAGE_SIZE;
 
     /* Discard jump cache entries for any tb which might potentially
        overlap the flushed page.  */
-    i = tb_jmp_cache_hash_page(addr - TARGET_PAGE_SIZE);
-    memset(&cpu->tb_jmp_cache[i], 0,
-           TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+    i = tb_jmp_cache_hash_page(cpu, addr - TARGET_PAGE_SIZE);
+    tb_jmp_cache_clear_range(cpu, i, n);
+
+    i = tb_jmp_cache_hash_page(cpu, addr);
+    tb_jmp_cache_clear_range(cpu, i, n);
+}
+
+/* Bytes of generated code in the regions of the code buffer */
+static size_t tb_code_size(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t code_size = 0;
+    int r;
 
-    i = tb_jmp_cache_hash_page(addr);
-    memset(&cpu->tb_jmp_cache[i], 0,
-           TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+    for (r = 0; r < ctx->nb_regions; r++) {
+        code_size += r == ctx->region ?
+            tcg_ctx.code_gen_ptr - tb_region_start(r) :
+            ctx->region_code_size[r];
+    }
+    return code_size;
 }
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int i, r, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t code_size;
+    uint64_t jmp_cache_misses;
+    CPUJitStats jit;
     TranslationBlock *tb;
+    CPUState *cpu;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = tb_code_size();
+    for (r = 0; r < ctx->nb_regions; r++) {
+        for (i = 0; i < ctx->region_nb_tbs[r]; i++) {
+            tb = &ctx->tbs[r * ctx->region_max_blocks + i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd (%d regions)\n",
+                code_size, tcg_ctx.code_gen_buffer_size, ctx->nb_regions);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+                target_code_size ? (double) code_size /
                                              target_code_size : 0);
+    cpu_fprintf(f, "TB hash table       %zu/%zu slots used, avg probe %0.2f "
+                "max %u\n", ctx->tb_phys_hash_used, ctx->tb_phys_hash_size,
+                ctx->tb_phys_hash_lookups ?
+                (double)ctx->tb_phys_hash_probes / ctx->tb_phys_hash_lookups :
+                0, ctx->tb_phys_hash_max_probes);
+    jmp_cache_misses = 0;
+    memset(&jit, 0, sizeof(jit));
+    CPU_FOREACH(cpu) {
+        jmp_cache_misses += cpu->tb_jmp_cache_misses;
+        jit.tb_find_slow_hits += cpu->jit_stats.tb_find_slow_hits;
+        jit.tb_find_slow_misses += cpu->jit_stats.tb_find_slow_misses;
+        jit.chained_jumps += cpu->jit_stats.chained_jumps;
+        jit.exits_unchained += cpu->jit_stats.exits_unchained;
+        jit.exits_interrupt += cpu->jit_stats.exits_interrupt;
+        jit.exits_icount += cpu->jit_stats.exits_icount;
+        jit.exits_exception += cpu->jit_stats.exits_exception;
+        jit.io_recompiles += cpu->jit_stats.io_recompiles;
+    }
+    cpu_fprintf(f, "TB jump cache misses %" PRIu64 "\n", jmp_cache_misses);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1635,13 +2187,66 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
-    cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB translate count  %" PRId64 "\n", ctx->tb_gen_count);
+    cpu_fprintf(f, "TB flush count      %d (%d when full)\n",
+                ctx->tb_flush_count, ctx->tb_flush_full_count);
+    cpu_fprintf(f, "TB eviction count   %d\n", tcg_ctx.tb_ctx.tb_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB lookups found %" PRId64 " translated %" PRId64 "\n",
+                jit.tb_find_slow_hits, jit.tb_find_slow_misses);
+    cpu_fprintf(f, "TB chained jumps    %" PRId64 "\n", jit.chained_jumps);
+    cpu_fprintf(f, "TB exits unchained %" PRId64 " interrupt %" PRId64
+                " icount %" PRId64 " exception %" PRId64 "\n",
+                jit.exits_unchained, jit.exits_interrupt, jit.exits_icount,
+                jit.exits_exception);
+    cpu_fprintf(f, "I/O recompile count %" PRId64 "\n", jit.io_recompiles);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+JitStats *qmp_query_jit_stats(Error **errp)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    JitStats *info = g_new0(JitStats, 1);
+    JitCpuStatsList *head = NULL, **tail = &head;
+    JitCpuStatsList *entry;
+    JitCpuStats *stats;
+    CPUState *cpu;
+
+    info->tbs = ctx->nb_tbs;
+    info->max_tbs = tcg_ctx.code_gen_max_blocks;
+    info->tbs_translated = ctx->tb_gen_count;
+    info->tbs_invalidated = ctx->tb_phys_invalidate_count;
+    info->flushes = ctx->tb_flush_count;
+    info->flushes_full = ctx->tb_flush_full_count;
+    info->evictions = ctx->tb_evict_count;
+    info->code_size = tb_code_size();
+    info->code_buffer_size = tcg_ctx.code_gen_buffer_size;
+
+    /* The CPUs may be running: a count may be a few events behind */
+    CPU_FOREACH(cpu) {
+        stats = g_new0(JitCpuStats, 1);
+        stats->cpu = cpu->cpu_index;
+        stats->jmp_cache_misses = cpu->tb_jmp_cache_misses;
+        stats->find_slow_hits = cpu->jit_stats.tb_find_slow_hits;
+        stats->find_slow_misses = cpu->jit_stats.tb_find_slow_misses;
+        stats->chained_jumps = cpu->jit_stats.chained_jumps;
+        stats->exits_unchained = cpu->jit_stats.exits_unchained;
+        stats->exits_interrupt = cpu->jit_stats.exits_interrupt;
+        stats->exits_icount = cpu->jit_stats.exits_icount;
+        stats->exits_exception = cpu->jit_stats.exits_exception;
+        stats->io_recompiles = cpu->jit_stats.io_recompiles;
+
+        entry = g_new0(JitCpuStatsList, 1);
+        entry->value = stats;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    info->cpus = head;
+    return info;
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -1763,6 +2368,10 @@ void page_dump(FILE *f)
     walk_memory_regions(f, dump_region);
 }
 
+/* Guest pages that have any flags set, so that free ranges can be found
+   without walking l1_map.  Protected by mmap_lock like the flags.  */
+static IntervalTree page_intervals;
+
 int page_get_flags(target_ulong address)
 {
     PageDesc *p;
@@ -1810,6 +2419,27 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         }
         p->flags = flags;
     }
+
+    if (flags) {
+        interval_tree_add(&page_intervals, start, (target_ulong)(end - 1));
+    } else {
+        interval_tree_remove(&page_intervals, start, (target_ulong)(end - 1));
+    }
+}
+
+/* Return the highest address, aligned to 'align', of 'len' bytes between
+   'min' and 'max' inclusive that contain no page with flags set, or -1
+   if there is none.  The mmap_lock should already be held.  */
+target_ulong page_find_range_empty(target_ulong min, target_ulong max,
+                                   target_ulong len, target_ulong align)
+{
+    uint64_t addr;
+
+    if (len == 0 ||
+        !interval_tree_find_gap(&page_intervals, min, max, len, align, &addr)) {
+        return -1;
+    }
+    return addr;
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
@@ -2683,6 +2683,30 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Returns how many of the n chunks of cmp_bytes at server and guest are
+ * the same before the first one which differs.  As much as the alignment
+ * allows is compared a whole stripe at a time with vector instructions.
+ */
+static int vnc_count_same_chunks(const uint8_t *server, const uint8_t *guest,
+                                 int n, int cmp_bytes)
+{
+    size_t len = (size_t)n * cmp_bytes;
+    size_t vlen = len - len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR *
+                               sizeof(VECTYPE));
+    int i = 0;
+
+    if (vlen && can_use_buffer_find_nonzero_offset(server, vlen) &&
+        can_use_buffer_find_nonzero_offset(guest, vlen)) {
+        i = buffer_find_different_offset(server, guest, vlen) / cmp_bytes;
+    }
+    while (i < n && memcmp(server + i * cmp_bytes, guest + i * cmp_bytes,
+                           cmp_bytes) == 0) {
+        i++;
+    }
+    return i;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -2690,6 +2714,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     int height = MIN(pixman_image_get_height(vd->guest.fb),
                      pixman_image_get_height(vd->server));
     int cmp_bytes, server_stride, min_stride, guest_stride, y = 0;
+    int end, full_end;
     uint8_t *guest_row0 = NULL, *server_row0;
     VncState *vs;
     int has_dirty = 0;
@@ -2720,9 +2745,12 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     }
     min_stride = MIN(server_stride, guest_stride);
 
+    end = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+    full_end = MIN(end, min_stride / cmp_bytes);
+
     for (;;) {
         int x;
-        uint8_t *guest_ptr, *server_ptr;
+        uint8_t *guest_row, *server_row, *guest_ptr, *server_ptr;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
                                              y * VNC_DIRTY_BPL(&vd->guest));
@@ -2733,27 +2761,48 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         y = offset / VNC_DIRTY_BPL(&vd->guest);
         x = offset % VNC_DIRTY_BPL(&vd->guest);
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+        server_row = server_row0 + y * server_stride;
 
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
             qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
-            guest_ptr = (uint8_t *)pixman_image_get_data(tmpbuf);
+            guest_row = (uint8_t *)pixman_image_get_data(tmpbuf);
         } else {
-            guest_ptr = guest_row0 + y * guest_stride;
+            guest_row = guest_row0 + y * guest_stride;
         }
-        guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
+        for (;; x++) {
             int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
+
+            x = find_next_bit(vd->guest.dirty[y], end, x);
+            if (x >= end) {
+                break;
             }
-            if ((x + 1) * cmp_bytes > min_stride) {
+            server_ptr = server_row + x * cmp_bytes;
+            guest_ptr = guest_row + x * cmp_bytes;
+
+            if (x < full_end) {
+                /* Skip the unchanged chunks at the start of the run of
+                 * dirty chunks */
+                int run = find_next_zero_bit(vd->guest.dirty[y], full_end,
+                                             x) - x;
+                int same = vnc_count_same_chunks(server_ptr, guest_ptr, run,
+                                                 cmp_bytes);
+
+                bitmap_clear(vd->guest.dirty[y], x, same);
+                if (same == run) {
+                    x += same - 1;
+                    continue;
+                }
+                x += same;
+                server_ptr += same * cmp_bytes;
+                guest_ptr += same * cmp_bytes;
+                clear_bit(x, vd->guest.dirty[y]);
+            } else {
+                clear_bit(x, vd->guest.dirty[y]);
                 _cmp_bytes = min_stride - x * cmp_bytes;
-            }
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
-                continue;
+                if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+                    continue;
+                }
             }
             memcpy(server_ptr, guest_ptr, _cmp_bytes);
             if (!vd->non_adaptive) {
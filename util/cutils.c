@@ -166,46 +166,21 @@ int qemu_fdatasync(int fd)
 #endif
 }
 
-/*
- * Searches for an area with non-zero content in a buffer
- *
- * Attention! The len must be a multiple of
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * and addr must be a multiple of sizeof(VECTYPE) due to
- * restriction of optimizations in this function.
- *
- * can_use_buffer_find_nonzero_offset() can be used to check
- * these requirements.
- *
- * The return value is the offset of the non-zero area rounded
- * down to a multiple of sizeof(VECTYPE) for the first
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * afterwards.
- *
- * If the buffer is all zero the return value is equal to len.
+#define BUFFER_FIND_NONZERO_OFFSET_CHUNK \
+    (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE))
+
+/* Scans a buffer whose address is a multiple of sizeof(VECTYPE) and whose
+ * length is a multiple of BUFFER_FIND_NONZERO_OFFSET_CHUNK.  Returns the
+ * offset of the first chunk with a non-zero byte, or len.
  */
+typedef size_t BufferFindNonzeroFunc(const void *buf, size_t len);
 
-size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+static size_t buffer_find_nonzero_offset_vector(const void *buf, size_t len)
 {
     const VECTYPE *p = buf;
-    const VECTYPE zero = (VECTYPE){0};
     size_t i;
 
-    assert(can_use_buffer_find_nonzero_offset(buf, len));
-
-    if (!len) {
-        return 0;
-    }
-
-    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
-        if (!ALL_EQ(p[i], zero)) {
-            return i * sizeof(VECTYPE);
-        }
-    }
-
-    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
-         i < len / sizeof(VECTYPE);
+    for (i = 0; i < len / sizeof(VECTYPE);
          i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
         VECTYPE tmp0 = p[i + 0] | p[i + 1];
         VECTYPE tmp1 = p[i + 2] | p[i + 3];
@@ -213,7 +188,7 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
         VECTYPE tmp3 = p[i + 6] | p[i + 7];
         VECTYPE tmp01 = tmp0 | tmp1;
         VECTYPE tmp23 = tmp2 | tmp3;
-        if (!ALL_EQ(tmp01 | tmp23, zero)) {
+        if (!ALL_EQ(tmp01 | tmp23, (VECTYPE){0})) {
             break;
         }
     }
@@ -221,44 +196,203 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512F_OPT)
+#include <cpuid.h>
+
+/* Checks bit @feature of CPUID.(EAX=7,ECX=0):EBX, and that the OS saves
+ * all the register state in @xcr0_mask. */
+static bool buffer_cpu_has(unsigned feature, uint32_t xcr0_mask)
+{
+    unsigned a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, 0) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    asm("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & xcr0_mask) != xcr0_mask) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & feature) != 0;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    for (i = 0; i < len; i += BUFFER_FIND_NONZERO_OFFSET_CHUNK) {
+        const __m256i *q = p + i / sizeof(__m256i);
+        __m256i tmp0 = _mm256_or_si256(_mm256_loadu_si256(q + 0),
+                                       _mm256_loadu_si256(q + 1));
+        __m256i tmp1 = _mm256_or_si256(_mm256_loadu_si256(q + 2),
+                                       _mm256_loadu_si256(q + 3));
+        __m256i tmp01 = _mm256_or_si256(tmp0, tmp1);
+        if (!_mm256_testz_si256(tmp01, tmp01)) {
+            break;
+        }
+    }
+
+    return i;
+}
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+static size_t buffer_find_nonzero_offset_avx512(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t i;
+
+    for (i = 0; i < len; i += BUFFER_FIND_NONZERO_OFFSET_CHUNK) {
+        __m512i tmp = _mm512_or_si512(_mm512_loadu_si512(p + i),
+                                      _mm512_loadu_si512(p + i + 64));
+        if (_mm512_test_epi64_mask(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i;
+}
+#pragma GCC pop_options
+#endif
+
+static BufferFindNonzeroFunc *buffer_find_nonzero_offset_body =
+    buffer_find_nonzero_offset_vector;
+
+/* The AVX2 and AVX512F bodies check 128 bytes per step and rely on len
+ * being a multiple of that, so only use them when that is the chunk size
+ * the caller rounds len to. */
+static void __attribute__((constructor)) buffer_select_find_nonzero(void)
+{
+    if (BUFFER_FIND_NONZERO_OFFSET_CHUNK != 128) {
+        return;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (buffer_cpu_has(1 << 5, 0x6)) {              /* AVX2, YMM state */
+        buffer_find_nonzero_offset_body = buffer_find_nonzero_offset_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512F_OPT
+    if (buffer_cpu_has(1 << 16, 0xe6)) {            /* AVX512F, ZMM state */
+        buffer_find_nonzero_offset_body = buffer_find_nonzero_offset_avx512;
+    }
+#endif
+}
+
 /*
- * Checks if a buffer is all zeroes
+ * Searches for an area with non-zero content in a buffer
+ *
+ * The buffer may have any address and length.  The part of it which is
+ * aligned to sizeof(VECTYPE) and BUFFER_FIND_NONZERO_OFFSET_CHUNK is
+ * scanned with the widest vector instructions the host CPU has, chosen
+ * at startup; the few bytes around it are checked separately.
+ *
+ * The return value is at most the offset of the first non-zero byte,
+ * rounded down to the start of the chunk or vector which contains it.
  *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
+ * If the buffer is all zero the return value is equal to len.
  */
-bool buffer_is_zero(const void *buf, size_t len)
+
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
 {
-    /*
-     * Use long as the biggest available internal data type that fits into the
-     * CPU register and unroll the loop to smooth out the effect of memory
-     * latency.
-     */
+    const uint8_t *p = buf;
+    size_t head, end, i;
 
-    size_t i;
-    long d0, d1, d2, d3;
-    const long * const data = buf;
+    head = -(uintptr_t)p & (sizeof(VECTYPE) - 1);
+    if (head > len) {
+        head = len;
+    }
+    for (i = 0; i < head; i++) {
+        if (p[i]) {
+            return i;
+        }
+    }
 
-    /* use vector optimized zero check if possible */
-    if (can_use_buffer_find_nonzero_offset(buf, len)) {
-        return buffer_find_nonzero_offset(buf, len) == len;
+    end = head + (len - head) / BUFFER_FIND_NONZERO_OFFSET_CHUNK *
+                 BUFFER_FIND_NONZERO_OFFSET_CHUNK;
+    if (end > head) {
+        i = head + buffer_find_nonzero_offset_body(p + head, end - head);
+        if (i < end) {
+            return i;
+        }
     }
 
-    assert(len % (4 * sizeof(long)) == 0);
-    len /= sizeof(long);
+    for (i = end; i + sizeof(VECTYPE) <= len; i += sizeof(VECTYPE)) {
+        if (!ALL_EQ(*(const VECTYPE *)(p + i), (VECTYPE){0})) {
+            return i;
+        }
+    }
+    for (; i < len; i++) {
+        if (p[i]) {
+            return i;
+        }
+    }
 
-    for (i = 0; i < len; i += 4) {
-        d0 = data[i + 0];
-        d1 = data[i + 1];
-        d2 = data[i + 2];
-        d3 = data[i + 3];
+    return len;
+}
+
+/*
+ * Searches for the first difference between two buffers
+ *
+ * Both buffers must be aligned to sizeof(VECTYPE) and len must be a multiple
+ * of BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE), which can
+ * be checked with can_use_buffer_find_nonzero_offset().
+ *
+ * The return value is the offset of the first difference rounded down to
+ * a multiple of BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE).
+ *
+ * If the buffers are the same the return value is equal to len.
+ */
 
-        if (d0 || d1 || d2 || d3) {
-            return false;
+size_t buffer_find_different_offset(const void *buf1, const void *buf2,
+                                    size_t len)
+{
+    const VECTYPE *p = buf1;
+    const VECTYPE *q = buf2;
+    const VECTYPE zero = (VECTYPE){0};
+    size_t i;
+
+    assert(can_use_buffer_find_nonzero_offset(buf1, len));
+    assert(can_use_buffer_find_nonzero_offset(buf2, len));
+
+    for (i = 0; i < len / sizeof(VECTYPE);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        VECTYPE tmp0 = (p[i + 0] ^ q[i + 0]) | (p[i + 1] ^ q[i + 1]);
+        VECTYPE tmp1 = (p[i + 2] ^ q[i + 2]) | (p[i + 3] ^ q[i + 3]);
+        VECTYPE tmp2 = (p[i + 4] ^ q[i + 4]) | (p[i + 5] ^ q[i + 5]);
+        VECTYPE tmp3 = (p[i + 6] ^ q[i + 6]) | (p[i + 7] ^ q[i + 7]);
+        VECTYPE tmp01 = tmp0 | tmp1;
+        VECTYPE tmp23 = tmp2 | tmp3;
+        if (!ALL_EQ(tmp01 | tmp23, zero)) {
+            break;
         }
     }
 
-    return true;
+    return i * sizeof(VECTYPE);
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_find_nonzero_offset(buf, len) == len;
 }
 
 #ifndef _WIN32
@@ -163,6 +163,32 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     }
 }
 
+int64_t hbitmap_iter_next_extent(HBitmapIter *hbi, uint64_t *count)
+{
+    const HBitmap *hb = hbi->hb;
+    int64_t start, end;
+
+    start = hbitmap_iter_next(hbi);
+    if (start < 0) {
+        return -1;
+    }
+
+    end = hbitmap_next_zero(hb, start);
+    if (end < 0) {
+        /* The run reaches the end of the bitmap: leave only the sentinel
+         * of level 0, which hbitmap_iter_skip_words takes as the end.
+         */
+        memset(hbi->cur, 0, sizeof(hbi->cur));
+        hbi->cur[0] = 1UL << (BITS_PER_LONG - 1);
+        end = hb->size << hb->granularity;
+    } else {
+        hbitmap_iter_init(hbi, hb, end);
+    }
+
+    *count = end - start;
+    return start;
+}
+
 bool hbitmap_empty(const HBitmap *hb)
 {
     return hb->count == 0;
@@ -362,6 +388,35 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
+{
+    const unsigned long *bits = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t item = start >> hb->granularity;
+    size_t pos = item >> BITS_PER_LEVEL;
+    size_t sz = (hb->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    unsigned long cur;
+
+    if (item >= hb->size) {
+        return -1;
+    }
+
+    /* Look for a zero bit at or after item.  */
+    cur = ~bits[pos] & ~((1UL << (item & (BITS_PER_LONG - 1))) - 1);
+    while (cur == 0 && ++pos < sz) {
+        cur = ~bits[pos];
+    }
+    if (cur == 0) {
+        return -1;
+    }
+
+    /* Bits past the size are never set, so this may be beyond it.  */
+    item = ((uint64_t)pos << BITS_PER_LEVEL) + ctzl(cur);
+    if (item >= hb->size) {
+        return -1;
+    }
+    return item << hb->granularity;
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -0,0 +1,273 @@
+/*
+ * Interval tree of disjoint address ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <assert.h>
+#include "qemu/interval-tree.h"
+
+/* The tree is a treap ordered by interval start.  Every node also records
+ * the span of its subtree and the largest hole between two consecutive
+ * intervals inside it.  Both only depend on the subtree itself, so they are
+ * recomputed bottom-up whenever split and merge rebuild a path, and they
+ * let interval_tree_find_gap skip every subtree that has no room.
+ */
+struct IntervalTreeNode {
+    uint64_t start;
+    uint64_t last;
+    /* Span of the subtree */
+    uint64_t min_start;
+    uint64_t max_last;
+    /* Largest number of free addresses between two intervals of the subtree */
+    uint64_t max_gap;
+    uint32_t prio;
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+};
+
+static inline uint64_t max_u64(uint64_t a, uint64_t b)
+{
+    return a > b ? a : b;
+}
+
+static void node_update(IntervalTreeNode *n)
+{
+    uint64_t gap = 0;
+
+    n->min_start = n->left ? n->left->min_start : n->start;
+    n->max_last = n->right ? n->right->max_last : n->last;
+    if (n->left) {
+        gap = max_u64(n->left->max_gap, n->start - n->left->max_last - 1);
+    }
+    if (n->right) {
+        gap = max_u64(gap, n->right->max_gap);
+        gap = max_u64(gap, n->right->min_start - n->last - 1);
+    }
+    n->max_gap = gap;
+}
+
+static IntervalTreeNode *node_new(IntervalTree *tree,
+                                  uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *n = g_new0(IntervalTreeNode, 1);
+    uint32_t h = ++tree->seq;
+
+    /* Scramble the sequence number into a treap priority */
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    n->start = start;
+    n->last = last;
+    n->prio = h;
+    node_update(n);
+    return n;
+}
+
+static void node_free_all(IntervalTreeNode *n)
+{
+    if (n) {
+        node_free_all(n->left);
+        node_free_all(n->right);
+        g_free(n);
+    }
+}
+
+/* Split @n into the intervals that start below @key and the others.  */
+static void split(IntervalTreeNode *n, uint64_t key,
+                  IntervalTreeNode **l, IntervalTreeNode **r)
+{
+    if (!n) {
+        *l = *r = NULL;
+    } else if (n->start < key) {
+        split(n->right, key, &n->right, r);
+        node_update(n);
+        *l = n;
+    } else {
+        split(n->left, key, l, &n->left);
+        node_update(n);
+        *r = n;
+    }
+}
+
+/* Join two treaps, every interval of @l being below those of @r.  */
+static IntervalTreeNode *merge(IntervalTreeNode *l, IntervalTreeNode *r)
+{
+    if (!l) {
+        return r;
+    }
+    if (!r) {
+        return l;
+    }
+    if (l->prio > r->prio) {
+        l->right = merge(l->right, r);
+        node_update(l);
+        return l;
+    } else {
+        r->left = merge(l, r->left);
+        node_update(r);
+        return r;
+    }
+}
+
+/* Detach the highest interval of @*n and return it.  */
+static IntervalTreeNode *take_last(IntervalTreeNode **n)
+{
+    IntervalTreeNode *last = *n;
+
+    while (last->right) {
+        last = last->right;
+    }
+    split(*n, last->start, n, &last);
+    return last;
+}
+
+void interval_tree_destroy(IntervalTree *tree)
+{
+    node_free_all(tree->root);
+    tree->root = NULL;
+}
+
+void interval_tree_add(IntervalTree *tree, uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *lo, *mid, *hi;
+
+    assert(start <= last);
+
+    split(tree->root, start, &lo, &hi);
+
+    /* Absorb the interval below if it overlaps or touches the range */
+    if (lo && lo->max_last >= start - 1) {
+        mid = take_last(&lo);
+        start = mid->start;
+        last = max_u64(last, mid->last);
+        g_free(mid);
+    }
+
+    /* ... and the ones starting inside it or right after it */
+    if (last >= UINT64_MAX - 1) {
+        mid = hi;
+        hi = NULL;
+    } else {
+        split(hi, last + 2, &mid, &hi);
+    }
+    if (mid) {
+        last = max_u64(last, mid->max_last);
+        node_free_all(mid);
+    }
+
+    tree->root = merge(merge(lo, node_new(tree, start, last)), hi);
+}
+
+void interval_tree_remove(IntervalTree *tree, uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *lo, *mid, *hi, *tail = NULL;
+
+    assert(start <= last);
+
+    split(tree->root, start, &lo, &hi);
+
+    /* Trim the interval that starts below the range and runs into it */
+    if (lo && lo->max_last >= start) {
+        mid = take_last(&lo);
+        if (mid->last > last) {
+            tail = node_new(tree, last + 1, mid->last);
+        }
+        mid->last = start - 1;
+        node_update(mid);
+        lo = merge(lo, mid);
+    }
+
+    /* Drop the intervals starting inside the range, keeping what sticks out */
+    if (last == UINT64_MAX) {
+        mid = hi;
+        hi = NULL;
+    } else {
+        split(hi, last + 1, &mid, &hi);
+    }
+    if (mid) {
+        if (mid->max_last > last) {
+            tail = node_new(tree, last + 1, mid->max_last);
+        }
+        node_free_all(mid);
+    }
+
+    tree->root = merge(merge(lo, tail), hi);
+}
+
+bool interval_tree_intersects(const IntervalTree *tree,
+                              uint64_t start, uint64_t last)
+{
+    const IntervalTreeNode *n = tree->root;
+
+    while (n) {
+        if (n->last < start) {
+            n = n->right;
+        } else if (n->start > last) {
+            n = n->left;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Highest aligned start of @size addresses in the free range [@lo, @hi].  */
+static bool gap_fits(uint64_t lo, uint64_t hi, uint64_t size, uint64_t align,
+                     uint64_t *addr)
+{
+    uint64_t start;
+
+    if (hi - lo < size - 1) {
+        return false;
+    }
+    start = (hi - (size - 1)) & ~(align - 1);
+    if (start < lo) {
+        return false;
+    }
+    *addr = start;
+    return true;
+}
+
+/* Search [@lo, @hi], which no interval outside of @n's subtree touches.  */
+static bool find_gap(const IntervalTreeNode *n, uint64_t lo, uint64_t hi,
+                     uint64_t size, uint64_t align, uint64_t *addr)
+{
+    if (!n || n->max_last < lo || n->min_start > hi) {
+        return gap_fits(lo, hi, size, align, addr);
+    }
+
+    /* Nothing to do if the subtree lies inside the range with no room */
+    if (n->min_start >= lo && n->max_last <= hi &&
+        n->max_gap < size &&
+        n->min_start - lo < size && hi - n->max_last < size) {
+        return false;
+    }
+
+    if (n->last < hi &&
+        find_gap(n->right, max_u64(lo, n->last + 1), hi, size, align, addr)) {
+        return true;
+    }
+    if (n->start > lo) {
+        return find_gap(n->left, lo, n->start - 1 < hi ? n->start - 1 : hi,
+                        size, align, addr);
+    }
+    return false;
+}
+
+bool interval_tree_find_gap(const IntervalTree *tree, uint64_t min,
+                            uint64_t max, uint64_t size, uint64_t align,
+                            uint64_t *addr)
+{
+    assert(size != 0 && align != 0 && (align & (align - 1)) == 0);
+
+    if (min > max) {
+        return false;
+    }
+    return find_gap(tree->root, min, max, size, align, addr);
+}
@@ -26,6 +26,7 @@
 #endif
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
+#include "qemu/notify.h"
 
 static bool name_threads;
 
@@ -456,6 +457,32 @@ bool qemu_thread_is_self(QemuThread *thread)
    return pthread_equal(pthread_self(), thread->thread);
 }
 
+/* The key only exists so that its destructor runs the exit notifiers; its
+ * value is the exiting thread's list. */
+static pthread_key_t exit_key;
+static __thread NotifierList thread_exit;
+
+void qemu_thread_atexit_add(Notifier *notifier)
+{
+    notifier_list_add(&thread_exit, notifier);
+    pthread_setspecific(exit_key, &thread_exit);
+}
+
+void qemu_thread_atexit_remove(Notifier *notifier)
+{
+    notifier_remove(notifier);
+}
+
+static void qemu_thread_atexit_run(void *arg)
+{
+    notifier_list_notify(arg, NULL);
+}
+
+static void __attribute__((constructor)) qemu_thread_atexit_init(void)
+{
+    pthread_key_create(&exit_key, qemu_thread_atexit_run);
+}
+
 void qemu_thread_exit(void *retval)
 {
     pthread_exit(retval);
@@ -12,6 +12,7 @@
  */
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/notify.h"
 #include <process.h>
 #include <assert.h>
 #include <limits.h>
@@ -268,6 +269,7 @@ struct QemuThreadData {
     void             *(*start_routine)(void *);
     void             *arg;
     short             mode;
+    NotifierList      exit;
 
     /* Only used for joinable threads. */
     bool              exited;
@@ -277,16 +279,40 @@ struct QemuThreadData {
 
 static __thread QemuThreadData *qemu_thread_data;
 
+/* Threads not started by qemu_thread_create (the main thread) run their
+ * exit notifiers from atexit() */
+static bool atexit_installed;
+static NotifierList main_thread_exit;
+
+static void run_main_thread_exit(void)
+{
+    notifier_list_notify(&main_thread_exit, NULL);
+}
+
+void qemu_thread_atexit_add(Notifier *notifier)
+{
+    if (!qemu_thread_data) {
+        if (!atexit_installed) {
+            atexit_installed = true;
+            atexit(run_main_thread_exit);
+        }
+        notifier_list_add(&main_thread_exit, notifier);
+    } else {
+        notifier_list_add(&qemu_thread_data->exit, notifier);
+    }
+}
+
+void qemu_thread_atexit_remove(Notifier *notifier)
+{
+    notifier_remove(notifier);
+}
+
 static unsigned __stdcall win32_start_routine(void *arg)
 {
     QemuThreadData *data = (QemuThreadData *) arg;
     void *(*start_routine)(void *) = data->start_routine;
     void *thread_arg = data->arg;
 
-    if (data->mode == QEMU_THREAD_DETACHED) {
-        g_free(data);
-        data = NULL;
-    }
     qemu_thread_data = data;
     qemu_thread_exit(start_routine(thread_arg));
     abort();
@@ -297,11 +323,15 @@ void qemu_thread_exit(void *arg)
     QemuThreadData *data = qemu_thread_data;
 
     if (data) {
-        assert(data->mode != QEMU_THREAD_DETACHED);
-        data->ret = arg;
-        EnterCriticalSection(&data->cs);
-        data->exited = true;
-        LeaveCriticalSection(&data->cs);
+        notifier_list_notify(&data->exit, NULL);
+        if (data->mode == QEMU_THREAD_DETACHED) {
+            g_free(data);
+        } else {
+            data->ret = arg;
+            EnterCriticalSection(&data->cs);
+            data->exited = true;
+            LeaveCriticalSection(&data->cs);
+        }
     }
     _endthreadex(0);
 }
@@ -347,6 +377,7 @@ void qemu_thread_create(QemuThread *thread, const char *name,
     data->arg = arg;
     data->mode = mode;
     data->exited = false;
+    notifier_list_init(&data->exit);
 
     if (data->mode != QEMU_THREAD_DETACHED) {
         InitializeCriticalSection(&data->cs);
@@ -373,11 +404,10 @@ HANDLE qemu_thread_get_handle(QemuThread *thread)
     HANDLE handle;
 
     data = thread->data;
-    if (!data) {
+    if (!data || data->mode == QEMU_THREAD_DETACHED) {
         return NULL;
     }
 
-    assert(data->mode != QEMU_THREAD_DETACHED);
     EnterCriticalSection(&data->cs);
     if (!data->exited) {
         handle = OpenThread(SYNCHRONIZE | THREAD_SUSPEND_RESUME, FALSE,
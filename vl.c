@@ -153,6 +153,8 @@ CharDriverState *virtcon_hds[MAX_VIRTIO_CONSOLES];
 CharDriverState *sclp_hds[MAX_SCLP_CONSOLES];
 int win2k_install_hack = 0;
 int singlestep = 0;
+int tb_hot_count = 0;
+const char *tb_coverage_file = NULL;
 int smp_cpus = 1;
 int max_cpus = 0;
 int smp_cores = 1;
@@ -183,6 +185,37 @@ uint8_t *boot_splash_filedata;
 size_t boot_splash_filedata_size;
 uint8_t qemu_extra_params_fw[2];
 
+static bool startup_profile;
+static int64_t startup_profile_start;
+static int64_t startup_profile_last;
+
+/* With -startup-profile, print how long the phase of start-up which has just
+ * ended took.  The last phase is the translation of the first block of guest
+ * code, after which the total is printed. */
+void startup_profile_mark(const char *phase)
+{
+    int64_t now;
+
+    if (!startup_profile) {
+        return;
+    }
+    now = get_clock();
+    fprintf(stderr, "startup: %-24s %8.3f ms\n", phase,
+            (now - startup_profile_last) / 1e6);
+    startup_profile_last = now;
+}
+
+void startup_profile_first_tb(void)
+{
+    if (!startup_profile) {
+        return;
+    }
+    startup_profile_mark("first TB");
+    fprintf(stderr, "startup: %-24s %8.3f ms\n", "total",
+            (startup_profile_last - startup_profile_start) / 1e6);
+    startup_profile = false;
+}
+
 typedef struct FWBootEntry FWBootEntry;
 
 struct FWBootEntry {
@@ -371,6 +404,10 @@ static QemuOptsList qemu_machine_opts = {
             .name = "mem-merge",
             .type = QEMU_OPT_BOOL,
             .help = "enable/disable memory merge support",
+        },{
+            .name = "dma-bounce-buffers",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of buffers for DMA to non-RAM regions",
         },{
             .name = "usb",
             .type = QEMU_OPT_BOOL,
@@ -2944,6 +2981,7 @@ int main(int argc, char **argv, char **envp)
     uint64_t ram_slots = 0;
     FILE *vmstate_dump_file = NULL;
 
+    startup_profile_start = startup_profile_last = get_clock();
     atexit(qemu_run_exit_notifiers);
     error_set_progname(argv[0]);
     qemu_init_exec_dir(argv[0]);
@@ -3779,6 +3817,9 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_semihosting:
                 semihosting_enabled = 1;
                 break;
+            case QEMU_OPTION_startup_profile:
+                startup_profile = true;
+                break;
             case QEMU_OPTION_tdf:
                 fprintf(stderr, "Warning: user space PIT time drift fix "
                                 "is no longer supported.\n");
@@ -3821,6 +3862,17 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_tb_hot_count:
+                tb_hot_count = strtol(optarg, NULL, 0);
+                if (tb_hot_count < 0 || tb_hot_count > UINT16_MAX) {
+                    fprintf(stderr, "qemu: invalid block hot count '%s'\n",
+                            optarg);
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_tb_coverage:
+                tb_coverage_file = optarg;
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
@@ -4406,7 +4458,9 @@ int main(int argc, char **argv, char **envp)
     current_machine->boot_order = boot_order;
     current_machine->cpu_model = cpu_model;
 
+    startup_profile_mark("options and backends");
     machine_class->init(current_machine);
+    startup_profile_mark("machine init");
 
     audio_init();
 
@@ -4488,6 +4542,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     qdev_machine_creation_done();
+    startup_profile_mark("devices and displays");
 
     if (rom_load_all() != 0) {
         fprintf(stderr, "rom loading failed\n");
@@ -4503,6 +4558,7 @@ int main(int argc, char **argv, char **envp)
     rom_load_done();
 
     qemu_system_reset(VMRESET_SILENT);
+    startup_profile_mark("ROM loading and reset");
     if (loadvm) {
         if (load_vmstate(loadvm) < 0) {
             autostart = 0;
@@ -58,6 +58,38 @@ class QMP {
     })
   }
 
+  /*
+   * Returns a promise to read a range of guest RAM with memory-read.
+   * It resolves to a Uint8Array.
+   */
+  readMemory(addr, size) {
+    return this.execute('memory-read', { addr: addr, size: size })
+      .then(QMP.decodeBase64)
+  }
+
+  /*
+   * Calls callback(data, event) with a Uint8Array every time a range of
+   * guest RAM changes, checking it every interval ms of virtual time.
+   * Returns the promise of the memory-watch command.  Stop the watch
+   * with execute('memory-unwatch', { id: id }).
+   */
+  watchMemory(id, addr, size, interval, callback) {
+    this.addEventListener('MEMORY_CHANGE', function (e) {
+      if (e.data.id == id)
+        callback(QMP.decodeBase64(e.data.data), e)
+    })
+    return this.execute('memory-watch',
+                        { id: id, addr: addr, size: size, interval: interval })
+  }
+
+  static decodeBase64(str) {
+    var bin = atob(str)
+    var bytes = new Uint8Array(bin.length)
+    for (var i = 0; i < bin.length; i++)
+      bytes[i] = bin.charCodeAt(i)
+    return bytes
+  }
+
   /* Closes the connection, rejects all pending promises */
   close(code, reason) {
     if (this.open) {
@@ -12,6 +12,7 @@
  */
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "qemu/host-utils.h"
 
 /*
   page = zrun nzrun
@@ -23,12 +24,151 @@
 
   length = uleb128 encoded integer
  */
+
+/* Returns the end of the run of bytes starting at i which are equal in
+ * old_buf and new_buf (zrun) or which differ (nzrun).  The buffers and slen
+ * are aligned to sizeof(long).
+ */
+typedef int XbzrleRunFunc(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen, bool zrun);
+
+static int xbzrle_run_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen, bool zrun)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+
+    /* not aligned to sizeof(long) */
+    while (i % sizeof(long) && (old_buf[i] == new_buf[i]) == zrun) {
+        i++;
+    }
+
+    /* word at a time for speed */
+    if (!(i % sizeof(long))) {
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if (zrun ? xor != 0 : ((xor - mask) & ~xor & (mask << 7)) != 0) {
+                /* found the end of the run within the current long */
+                break;
+            }
+            i += sizeof(long);
+        }
+    }
+
+    /* go over the rest */
+    while (i < slen && (old_buf[i] == new_buf[i]) == zrun) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+static int xbzrle_run_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen, bool zrun)
+{
+    uint32_t flip = zrun ? 0xffff : 0;
+
+    while (i + 16 <= slen) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        /* one bit per byte which ends the run */
+        uint32_t end = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n)) ^ flip;
+
+        if (end) {
+            return i + ctz32(end);
+        }
+        i += 16;
+    }
+    return xbzrle_run_end_long(old_buf, new_buf, i, slen, zrun);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static int xbzrle_run_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen, bool zrun)
+{
+    uint32_t flip = zrun ? 0xffffffff : 0;
+
+    while (i + 32 <= slen) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t end = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n)) ^ flip;
+
+        if (end) {
+            return i + ctz32(end);
+        }
+        i += 32;
+    }
+#ifdef __SSE2__
+    return xbzrle_run_end_sse2(old_buf, new_buf, i, slen, zrun);
+#else
+    return xbzrle_run_end_long(old_buf, new_buf, i, slen, zrun);
+#endif
+}
+#pragma GCC pop_options
+
+/* AVX2 needs both the CPU feature and the OS saving the YMM state */
+static bool xbzrle_have_avx2(void)
+{
+    unsigned a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, 0) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    asm("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & (1 << 5)) != 0;     /* bit_AVX2 */
+}
+#endif
+
+static XbzrleRunFunc *xbzrle_run_end = xbzrle_run_end_long;
+static XbzrleRunFunc *xbzrle_run_end_accel = xbzrle_run_end_long;
+
+static void __attribute__((constructor)) xbzrle_select_run_func(void)
+{
+#ifdef __SSE2__
+    xbzrle_run_end_accel = xbzrle_run_end_sse2;
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (xbzrle_have_avx2()) {
+        xbzrle_run_end_accel = xbzrle_run_end_avx2;
+    }
+#endif
+    xbzrle_run_end = xbzrle_run_end_accel;
+}
+
+/* Switch between the vector run scan and the word-at-a-time loop; used by
+ * the unit tests to check that both produce the same encoding.  Returns the
+ * previous setting.
+ */
+bool xbzrle_use_accel(bool enable)
+{
+    bool old = xbzrle_run_end != xbzrle_run_end_long;
+
+    xbzrle_run_end = enable ? xbzrle_run_end_accel : xbzrle_run_end_long;
+    return old;
+}
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
+    int d = 0, i = 0, end;
     uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
@@ -40,28 +180,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = xbzrle_run_end(old_buf, new_buf, i, slen, true);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,42 +196,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
 
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+        end = xbzrle_run_end(old_buf, new_buf, i, slen, false);
+        nzrun_len = end - i;
+        i = end;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -119,7 +214,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;